@@ -25,6 +25,36 @@
 #define encode_long(n) ((n << 1) ^ (n >> 63))
 #define more_bytes(b) (b & 0x80)
 
+/**
+ * @brief Read raw bytes from the current data block
+ *
+ * The bytes of a compressed file are read from the decompressed block, the
+ * bytes of an uncompressed file straight from the file.
+ *
+ * @param file File to read from
+ * @param dest Destination where the bytes are stored
+ * @param len Number of bytes to read
+ * @return Number of bytes read
+ */
+size_t maxavro_read_bytes(MAXAVRO_FILE *file, void *dest, size_t len)
+{
+    if (MAXAVRO_BLOCK_IN_MEMORY(file))
+    {
+        size_t avail = file->block_len - file->block_pos;
+
+        if (len > avail)
+        {
+            len = avail;
+        }
+
+        memcpy(dest, file->block + file->block_pos, len);
+        file->block_pos += len;
+        return len;
+    }
+
+    return fread(dest, 1, len, file->file);
+}
+
 /**
  * @brief Read an Avro integer
  *
@@ -48,7 +78,7 @@ bool maxavro_read_integer(MAXAVRO_FILE* file, uint64_t *dest)
             file->last_error = MAXAVRO_ERR_VALUE_OVERFLOW;
             return false;
         }
-        size_t rdsz = fread(&byte, sizeof(byte), 1, file->file);
+        size_t rdsz = maxavro_read_bytes(file, &byte, sizeof(byte));
         if (rdsz != sizeof(byte))
         {
             if (rdsz != 0)
@@ -73,6 +103,42 @@ bool maxavro_read_integer(MAXAVRO_FILE* file, uint64_t *dest)
     return true;
 }
 
+/**
+ * @brief Decode an Avro integer from memory
+ *
+ * This is the in-memory version of maxavro_read_integer. At most
+ * MAX_INTEGER_SIZE bytes are looked at so only one bounds check is needed
+ * for each byte of the value.
+ *
+ * @param ptr Start of the encoded value
+ * @param end End of the data
+ * @param dest Destination where the decoded value is written
+ * @return Pointer to the first byte after the value or NULL if the value
+ * does not end before @c end or is too long
+ */
+uint8_t* maxavro_decode_integer(uint8_t *ptr, uint8_t *end, uint64_t *dest)
+{
+    uint8_t *limit = end - ptr > MAX_INTEGER_SIZE ? ptr + MAX_INTEGER_SIZE : end;
+    uint64_t rval = 0;
+    int shift = 0;
+
+    while (ptr < limit)
+    {
+        uint8_t byte = *ptr++;
+        rval |= (uint64_t)(byte & 0x7f) << shift;
+
+        if (!more_bytes(byte))
+        {
+            *dest = avro_decode(rval);
+            return ptr;
+        }
+
+        shift += 7;
+    }
+
+    return NULL;
+}
+
 /**
  * @brief Calculate the length of an Avro integer
  *
@@ -113,7 +179,7 @@ char* maxavro_read_string(MAXAVRO_FILE* file)
         key = malloc(len + 1);
         if (key)
         {
-            size_t nread = fread(key, 1, len, file->file);
+            size_t nread = maxavro_read_bytes(file, key, len);
             if (nread == len)
             {
                 key[len] = '\0';
@@ -149,7 +215,16 @@ bool maxavro_skip_string(MAXAVRO_FILE* file)
 
     if (maxavro_read_integer(file, &len))
     {
-        if (fseek(file->file, len, SEEK_CUR) != 0)
+        if (MAXAVRO_BLOCK_IN_MEMORY(file))
+        {
+            if (len <= file->block_len - file->block_pos)
+            {
+                file->block_pos += len;
+                return true;
+            }
+            file->last_error = MAXAVRO_ERR_VALUE_OVERFLOW;
+        }
+        else if (fseek(file->file, len, SEEK_CUR) != 0)
         {
             file->last_error = MAXAVRO_ERR_IO;
         }
@@ -186,7 +261,7 @@ uint64_t avro_length_string(const char* str)
  */
 bool maxavro_read_float(MAXAVRO_FILE* file, float *dest)
 {
-    size_t nread = fread(dest, 1, sizeof(*dest), file->file);
+    size_t nread = maxavro_read_bytes(file, dest, sizeof(*dest));
     if (nread != sizeof(*dest) && nread != 0)
     {
         file->last_error = MAXAVRO_ERR_IO;
@@ -217,7 +292,7 @@ uint64_t avro_length_float(float val)
  */
 bool maxavro_read_double(MAXAVRO_FILE* file, double *dest)
 {
-    size_t nread = fread(dest, 1, sizeof(*dest), file->file);
+    size_t nread = maxavro_read_bytes(file, dest, sizeof(*dest));
     if (nread != sizeof(*dest) && nread != 0)
     {
         file->last_error = MAXAVRO_ERR_IO;
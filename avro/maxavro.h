@@ -55,6 +55,13 @@ typedef struct
     size_t num_fields;
 } MAXAVRO_SCHEMA;
 
+/** Compression codec of the data blocks */
+enum maxavro_codec
+{
+    MAXAVRO_CODEC_NULL,
+    MAXAVRO_CODEC_DEFLATE
+};
+
 enum maxavro_error
 {
     MAXAVRO_ERR_NONE,
@@ -86,10 +93,22 @@ typedef struct
                          * to know when to read it and when not to.  */
     enum maxavro_error last_error; /*< Last error */
     uint8_t sync[SYNC_MARKER_SIZE];
+    uint8_t *buffer; /*< Data block buffer of maxavro_record_read_json_block */
+    size_t buffer_size; /*< Size of the data block buffer */
+    union maxavro_record_value *values; /*< Integer values of the last record
+                                         * read with maxavro_record_read_json_block */
+    enum maxavro_codec codec; /*< Compression codec of the data blocks */
+    uint8_t *block; /*< Decompressed data of the current block of a compressed file */
+    size_t block_len; /*< Length of the decompressed data */
+    size_t block_alloc; /*< Size of the decompressed data buffer */
+    size_t block_pos; /*< Read position in the decompressed data */
 } MAXAVRO_FILE;
 
+/** True if the records of the current block are read from memory */
+#define MAXAVRO_BLOCK_IN_MEMORY(f) ((f)->codec != MAXAVRO_CODEC_NULL && (f)->metadata_read)
+
 /** A record field value */
-typedef union
+typedef union maxavro_record_value
 {
     uint64_t integer;
     double floating;
@@ -115,6 +134,17 @@ typedef struct
     MAXAVRO_FILE *avrofile; /*< The current open file */
 } MAXAVRO_DATABLOCK;
 
+/** Field projection and row filter for reading records as JSON */
+typedef struct
+{
+    bool *output; /*< Whether each field of the schema is written */
+    long where_field; /*< The field the filter compares, -1 for none */
+    bool match_none; /*< The filtered field is not in the schema */
+    char *where_value; /*< The value the field must have */
+    int64_t where_integer; /*< where_value as an integer */
+    double where_real; /*< where_value as a real number */
+} MAXAVRO_FILTER;
+
 typedef struct avro_map_value
 {
     char* key;
@@ -139,18 +169,28 @@ bool maxavro_datablock_add_double(MAXAVRO_DATABLOCK *file, double val);
 
 /** Reading primitives */
 bool maxavro_read_integer(MAXAVRO_FILE *file, uint64_t *val);
+size_t maxavro_read_bytes(MAXAVRO_FILE *file, void *dest, size_t len);
 char* maxavro_read_string(MAXAVRO_FILE *file);
 bool maxavro_skip_string(MAXAVRO_FILE* file);
 bool maxavro_read_float(MAXAVRO_FILE *file, float *dest);
 bool maxavro_read_double(MAXAVRO_FILE *file, double *dest);
 
+/** Decoding primitives for data in memory */
+uint8_t* maxavro_decode_integer(uint8_t *ptr, uint8_t *end, uint64_t *dest);
+
 /** Reading complex types */
 MAXAVRO_MAP* maxavro_map_read(MAXAVRO_FILE *file);
 void maxavro_map_free(MAXAVRO_MAP *value);
 
 /** Reading and seeking records */
 json_t* maxavro_record_read_json(MAXAVRO_FILE *file);
+GWBUF* maxavro_record_read_json_block(MAXAVRO_FILE *file, MAXAVRO_FILTER *filter);
+MAXAVRO_FILTER* maxavro_filter_alloc(MAXAVRO_FILE *file, const char *columns,
+                                     const char *where_column, const char *where_value);
+void maxavro_filter_free(MAXAVRO_FILTER *filter);
+bool maxavro_record_get_integer(MAXAVRO_FILE *file, const char *name, uint64_t *dest);
 GWBUF* maxavro_record_read_binary(MAXAVRO_FILE *file);
+bool maxavro_record_locate_block(MAXAVRO_FILE *file, long *offset, size_t *len);
 bool maxavro_record_seek(MAXAVRO_FILE *file, uint64_t offset);
 bool maxavro_record_set_pos(MAXAVRO_FILE *file, long pos);
 bool maxavro_next_block(MAXAVRO_FILE *file);
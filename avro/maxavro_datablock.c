@@ -79,8 +79,8 @@ bool maxavro_datablock_finalize(MAXAVRO_DATABLOCK* block)
     else
     {
         /** The current block is successfully written, reset datablock for
-         * a new write. */
-        block->buffersize = 0;
+         * a new write. The buffer is kept for the next block. */
+        block->datasize = 0;
         block->records = 0;
     }
     return rval;
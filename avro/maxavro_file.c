@@ -15,6 +15,7 @@
 #include "skygw_utils.h"
 #include <errno.h>
 #include <string.h>
+#include <zlib.h>
 #include <log_manager.h>
 
 static bool maxavro_read_sync(FILE *file, uint8_t* sync)
@@ -85,6 +86,120 @@ bool maxavro_verify_block(MAXAVRO_FILE *file)
     return true;
 }
 
+/**
+ * @brief Decompress a deflate data block
+ *
+ * The Avro deflate codec stores the data as raw deflate data without the
+ * zlib header and checksum.
+ *
+ * @param file File the block belongs to
+ * @param data Compressed data
+ * @param len Length of the compressed data
+ * @return True if the block was decompressed into the block buffer of the file
+ */
+static bool inflate_block(MAXAVRO_FILE *file, uint8_t *data, size_t len)
+{
+    z_stream stream;
+    int rc;
+
+    memset(&stream, 0, sizeof(stream));
+
+    if (inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+    {
+        file->last_error = MAXAVRO_ERR_MEMORY;
+        return false;
+    }
+
+    stream.next_in = data;
+    stream.avail_in = len;
+    file->block_len = 0;
+
+    do
+    {
+        if (file->block_len == file->block_alloc)
+        {
+            size_t size = file->block_alloc ? file->block_alloc * 2 : len * 4 + 1024;
+            uint8_t *block = realloc(file->block, size);
+
+            if (block == NULL)
+            {
+                inflateEnd(&stream);
+                file->last_error = MAXAVRO_ERR_MEMORY;
+                return false;
+            }
+
+            file->block = block;
+            file->block_alloc = size;
+        }
+
+        stream.next_out = file->block + file->block_len;
+        stream.avail_out = file->block_alloc - file->block_len;
+        rc = inflate(&stream, Z_NO_FLUSH);
+        file->block_len = file->block_alloc - stream.avail_out;
+    }
+    while (rc == Z_OK || (rc == Z_BUF_ERROR && stream.avail_out == 0));
+
+    inflateEnd(&stream);
+
+    if (rc != Z_STREAM_END)
+    {
+        MXS_ERROR("Failed to decompress data block at offset %ld of '%s': %s",
+                  file->block_start_pos, file->filename, stream.msg ? stream.msg : "corrupt data");
+        file->last_error = MAXAVRO_ERR_IO;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Read and decompress the data of a compressed block
+ *
+ * The file is left at the sync marker that follows the block. If the block
+ * is not yet completely written, the file is moved back to the start of the
+ * block so that it is read again later.
+ *
+ * @param file File to read from, positioned at the data of the block
+ * @return True if the data was decompressed
+ */
+static bool read_compressed_block(MAXAVRO_FILE *file)
+{
+    if (file->block_size > file->buffer_size)
+    {
+        uint8_t *buffer = realloc(file->buffer, file->block_size);
+
+        if (buffer == NULL)
+        {
+            file->last_error = MAXAVRO_ERR_MEMORY;
+            return false;
+        }
+
+        file->buffer = buffer;
+        file->buffer_size = file->block_size;
+    }
+
+    if (fread(file->buffer, 1, file->block_size, file->file) != file->block_size)
+    {
+        if (ferror(file->file))
+        {
+            char err[STRERROR_BUFLEN];
+            MXS_ERROR("Failed to read data block of '%s': %d, %s", file->filename, errno,
+                      strerror_r(errno, err, sizeof(err)));
+            file->last_error = MAXAVRO_ERR_IO;
+        }
+        else
+        {
+            clearerr(file->file);
+        }
+
+        fseek(file->file, file->block_start_pos, SEEK_SET);
+        return false;
+    }
+
+    file->block_pos = 0;
+    return inflate_block(file, file->buffer, file->block_size);
+}
+
 bool maxavro_read_datablock_start(MAXAVRO_FILE* file)
 {
     /** The actual start of the binary block */
@@ -111,7 +226,8 @@ bool maxavro_read_datablock_start(MAXAVRO_FILE* file)
             file->records_read_from_block = 0;
             file->data_start_pos = pos;
             ss_dassert(file->data_start_pos > file->block_start_pos);
-            file->metadata_read = true;
+            rval = file->codec == MAXAVRO_CODEC_NULL || read_compressed_block(file);
+            file->metadata_read = rval;
         }
     }
     else if (maxavro_get_error(file) != MAXAVRO_ERR_NONE)
@@ -132,15 +248,27 @@ bool maxavro_read_datablock_start(MAXAVRO_FILE* file)
 static char* read_schema(MAXAVRO_FILE* file)
 {
     char *rval = NULL;
+    bool codec_ok = true;
     MAXAVRO_MAP* head = maxavro_map_read(file);
     MAXAVRO_MAP* map = head;
 
     while (map)
     {
-        if (strcmp(map->key, "avro.schema") == 0)
+        if (strcmp(map->key, "avro.schema") == 0 && rval == NULL)
         {
             rval = strdup(map->value);
-            break;
+        }
+        else if (strcmp(map->key, "avro.codec") == 0)
+        {
+            if (strcmp(map->value, "deflate") == 0)
+            {
+                file->codec = MAXAVRO_CODEC_DEFLATE;
+            }
+            else if (strcmp(map->value, "null") != 0)
+            {
+                MXS_ERROR("Unsupported codec '%s' in '%s'.", map->value, file->filename);
+                codec_ok = false;
+            }
         }
         map = map->next;
     }
@@ -149,6 +277,11 @@ static char* read_schema(MAXAVRO_FILE* file)
     {
         MXS_ERROR("No schema found from Avro header.");
     }
+    else if (!codec_ok)
+    {
+        free(rval);
+        rval = NULL;
+    }
 
     maxavro_map_free(head);
     return rval;
@@ -287,6 +420,9 @@ void maxavro_file_close(MAXAVRO_FILE *file)
         fclose(file->file);
         free(file->filename);
         maxavro_schema_free(file->schema);
+        free(file->buffer);
+        free(file->values);
+        free(file->block);
         free(file);
     }
 }
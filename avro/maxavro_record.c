@@ -17,6 +17,7 @@
 #include <skygw_debug.h>
 #include <log_manager.h>
 #include <errno.h>
+#include <unistd.h>
 
 bool maxavro_read_datablock_start(MAXAVRO_FILE *file);
 bool maxavro_verify_block(MAXAVRO_FILE *file);
@@ -37,8 +38,8 @@ static json_t* read_and_pack_value(MAXAVRO_FILE *file, MAXAVRO_SCHEMA_FIELD *fie
     {
         case MAXAVRO_TYPE_BOOL:
         {
-            int i = 0;
-            if (fread(&i, 1, 1, file->file) == 1)
+            uint8_t i = 0;
+            if (maxavro_read_bytes(file, &i, 1) == 1)
             {
                 value = json_pack("b", i);
             }
@@ -199,6 +200,795 @@ json_t* maxavro_record_read_json(MAXAVRO_FILE *file)
     return object;
 }
 
+/** Minimum size of the buffers that maxavro_record_read_json_block allocates */
+#define JSON_BUFFER_SIZE 4096
+
+/** How much of a data block maxavro_record_locate_block reads to decode the
+ * first record */
+#define BLOCK_PREFIX_SIZE 4096
+
+/** Output of maxavro_record_read_json_block */
+typedef struct
+{
+    GWBUF *head; /*< The chain of buffers */
+    GWBUF *tail; /*< The buffer being written to */
+    uint8_t *ptr; /*< Write position in the tail buffer */
+    uint8_t *end; /*< End of the tail buffer */
+} JSON_WRITER;
+
+/**
+ * @brief Make room for output
+ *
+ * A new buffer is added to the chain if the current one is too small.
+ *
+ * @param writer The output
+ * @param len Number of bytes needed
+ * @return True if there is room for @c len bytes
+ */
+static bool json_reserve(JSON_WRITER *writer, size_t len)
+{
+    if ((size_t)(writer->end - writer->ptr) >= len)
+    {
+        return true;
+    }
+
+    size_t size = MAX(len, JSON_BUFFER_SIZE);
+    GWBUF *buf = gwbuf_alloc(size);
+
+    if (buf == NULL)
+    {
+        return false;
+    }
+
+    if (writer->tail)
+    {
+        GWBUF_RTRIM(writer->tail, writer->end - writer->ptr);
+    }
+
+    writer->head = gwbuf_append(writer->head, buf);
+    writer->tail = buf;
+    writer->ptr = GWBUF_DATA(buf);
+    writer->end = writer->ptr + size;
+    return true;
+}
+
+/**
+ * @brief Write a JSON string
+ *
+ * The string is escaped the same way json_dumps() escapes it.
+ *
+ * @param writer The output
+ * @param str The string
+ * @param len Length of the string
+ * @return True if the string was written
+ */
+static bool json_write_string(JSON_WRITER *writer, const uint8_t *str, size_t len)
+{
+    size_t escapes = 0;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        if (str[i] < 0x20 || str[i] == '"' || str[i] == '\\')
+        {
+            escapes++;
+        }
+    }
+
+    /** An escaped character takes at most six bytes */
+    if (!json_reserve(writer, len + escapes * 5 + 2))
+    {
+        return false;
+    }
+
+    uint8_t *ptr = writer->ptr;
+    *ptr++ = '"';
+
+    if (escapes == 0)
+    {
+        memcpy(ptr, str, len);
+        ptr += len;
+    }
+    else
+    {
+        for (size_t i = 0; i < len; i++)
+        {
+            uint8_t c = str[i];
+
+            if (c >= 0x20 && c != '"' && c != '\\')
+            {
+                *ptr++ = c;
+                continue;
+            }
+
+            *ptr++ = '\\';
+
+            switch (c)
+            {
+                case '"':
+                case '\\':
+                    *ptr++ = c;
+                    break;
+
+                case '\b':
+                    *ptr++ = 'b';
+                    break;
+
+                case '\f':
+                    *ptr++ = 'f';
+                    break;
+
+                case '\n':
+                    *ptr++ = 'n';
+                    break;
+
+                case '\r':
+                    *ptr++ = 'r';
+                    break;
+
+                case '\t':
+                    *ptr++ = 't';
+                    break;
+
+                default:
+                    ptr += sprintf((char*)ptr, "u%04X", c);
+                    break;
+            }
+        }
+    }
+
+    *ptr++ = '"';
+    writer->ptr = ptr;
+    return true;
+}
+
+/**
+ * @brief Write raw bytes
+ *
+ * @param writer The output
+ * @param data Data to write
+ * @param len Length of the data
+ * @return True if the data was written
+ */
+static bool json_write_raw(JSON_WRITER *writer, const char *data, size_t len)
+{
+    if (!json_reserve(writer, len))
+    {
+        return false;
+    }
+
+    memcpy(writer->ptr, data, len);
+    writer->ptr += len;
+    return true;
+}
+
+/**
+ * @brief Write a JSON integer
+ *
+ * @param writer The output
+ * @param val The value, written as a signed integer
+ * @return True if the value was written
+ */
+static bool json_write_integer(JSON_WRITER *writer, int64_t val)
+{
+    char buf[24];
+    char *ptr = buf + sizeof(buf);
+    uint64_t uval = val < 0 ? -(uint64_t)val : (uint64_t)val;
+
+    do
+    {
+        *--ptr = '0' + uval % 10;
+        uval /= 10;
+    }
+    while (uval);
+
+    if (val < 0)
+    {
+        *--ptr = '-';
+    }
+
+    return json_write_raw(writer, ptr, buf + sizeof(buf) - ptr);
+}
+
+/**
+ * @brief Write a JSON real number
+ *
+ * The value is formatted the same way json_dumps() formats it.
+ *
+ * @param writer The output
+ * @param val The value
+ * @return True if the value was written
+ */
+static bool json_write_real(JSON_WRITER *writer, double val)
+{
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf) - 2, "%.17g", val);
+
+    if (strspn(buf, "0123456789-") == (size_t)len)
+    {
+        buf[len++] = '.';
+        buf[len++] = '0';
+    }
+
+    return json_write_raw(writer, buf, len);
+}
+
+/**
+ * @brief Decode a field value from memory and write it as JSON
+ *
+ * @param file File being read
+ * @param field The field of the schema
+ * @param value Where the integer value of the field is stored
+ * @param ptr Start of the encoded value
+ * @param end End of the data block
+ * @param writer The output
+ * @return Pointer to the first byte after the value or NULL if the value
+ * could not be decoded or written
+ */
+static uint8_t* decode_json_value(MAXAVRO_FILE *file, MAXAVRO_SCHEMA_FIELD *field,
+                                  MAXAVRO_RECORD_VALUE *value, uint8_t *ptr,
+                                  uint8_t *end, JSON_WRITER *writer)
+{
+    switch (field->type)
+    {
+        case MAXAVRO_TYPE_BOOL:
+            if (ptr < end && json_write_raw(writer, *ptr ? "true" : "false", *ptr ? 4 : 5))
+            {
+                value->boolean = *ptr++;
+                return ptr;
+            }
+            break;
+
+        case MAXAVRO_TYPE_INT:
+        case MAXAVRO_TYPE_LONG:
+            if ((ptr = maxavro_decode_integer(ptr, end, &value->integer)) &&
+                json_write_integer(writer, (int64_t)value->integer))
+            {
+                return ptr;
+            }
+            break;
+
+        case MAXAVRO_TYPE_ENUM:
+            if ((ptr = maxavro_decode_integer(ptr, end, &value->integer)))
+            {
+                json_t *arr = field->extra;
+                ss_dassert(arr);
+                ss_dassert(json_is_array(arr));
+
+                if (value->integer < json_array_size(arr))
+                {
+                    const char *symbol = json_string_value(json_array_get(arr, value->integer));
+                    ss_dassert(symbol);
+
+                    if (symbol && json_write_string(writer, (const uint8_t*)symbol, strlen(symbol)))
+                    {
+                        return ptr;
+                    }
+                }
+            }
+            break;
+
+        case MAXAVRO_TYPE_FLOAT:
+            if (end - ptr >= (long)sizeof(float))
+            {
+                float f;
+                memcpy(&f, ptr, sizeof(f));
+                value->floating = f;
+
+                if (json_write_real(writer, f))
+                {
+                    return ptr + sizeof(f);
+                }
+            }
+            break;
+
+        case MAXAVRO_TYPE_DOUBLE:
+            if (end - ptr >= (long)sizeof(double))
+            {
+                memcpy(&value->floating, ptr, sizeof(value->floating));
+
+                if (json_write_real(writer, value->floating))
+                {
+                    return ptr + sizeof(value->floating);
+                }
+            }
+            break;
+
+        case MAXAVRO_TYPE_BYTES:
+        case MAXAVRO_TYPE_STRING:
+        {
+            uint64_t len;
+
+            if ((ptr = maxavro_decode_integer(ptr, end, &len)) &&
+                len <= (uint64_t)(end - ptr) &&
+                json_write_string(writer, ptr, len))
+            {
+                value->integer = len;
+                return ptr + len;
+            }
+        }
+        break;
+
+        default:
+            MXS_ERROR("Unimplemented type: %d", field->type);
+            break;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Skip a field value in memory
+ *
+ * Integer values are decoded and stored, the other values are only skipped.
+ *
+ * @param field The field of the schema
+ * @param value Where the integer value of the field is stored
+ * @param ptr Start of the encoded value
+ * @param end End of the data
+ * @return Pointer to the first byte after the value or NULL if the value
+ * does not end before @c end
+ */
+static uint8_t* skip_field_value(MAXAVRO_SCHEMA_FIELD *field, MAXAVRO_RECORD_VALUE *value,
+                                 uint8_t *ptr, uint8_t *end)
+{
+    uint64_t len;
+
+    switch (field->type)
+    {
+        case MAXAVRO_TYPE_INT:
+        case MAXAVRO_TYPE_LONG:
+        case MAXAVRO_TYPE_ENUM:
+            return maxavro_decode_integer(ptr, end, &value->integer);
+
+        case MAXAVRO_TYPE_BOOL:
+            return ptr < end ? ptr + 1 : NULL;
+
+        case MAXAVRO_TYPE_FLOAT:
+            return end - ptr >= (long)sizeof(float) ? ptr + sizeof(float) : NULL;
+
+        case MAXAVRO_TYPE_DOUBLE:
+            return end - ptr >= (long)sizeof(double) ? ptr + sizeof(double) : NULL;
+
+        case MAXAVRO_TYPE_BYTES:
+        case MAXAVRO_TYPE_STRING:
+            if ((ptr = maxavro_decode_integer(ptr, end, &len)))
+            {
+                return len <= (uint64_t)(end - ptr) ? ptr + len : NULL;
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Check if a field value matches the row filter
+ *
+ * @param filter The filter
+ * @param field The field of the schema
+ * @param value The integer value of the field
+ * @param ptr Start of the encoded value
+ * @param end End of the data
+ * @return True if the value is the one the filter requires
+ */
+static bool filter_matches(MAXAVRO_FILTER *filter, MAXAVRO_SCHEMA_FIELD *field,
+                           MAXAVRO_RECORD_VALUE *value, uint8_t *ptr, uint8_t *end)
+{
+    switch (field->type)
+    {
+        case MAXAVRO_TYPE_INT:
+        case MAXAVRO_TYPE_LONG:
+            return (int64_t)value->integer == filter->where_integer;
+
+        case MAXAVRO_TYPE_BOOL:
+            return (*ptr != 0) == (filter->where_integer != 0 ||
+                                   strcmp(filter->where_value, "true") == 0);
+
+        case MAXAVRO_TYPE_ENUM:
+        {
+            json_t *arr = field->extra;
+            const char *symbol = json_string_value(json_array_get(arr, value->integer));
+            return symbol && strcmp(symbol, filter->where_value) == 0;
+        }
+
+        case MAXAVRO_TYPE_FLOAT:
+        {
+            float f;
+            memcpy(&f, ptr, sizeof(f));
+            return f == (float)filter->where_real;
+        }
+
+        case MAXAVRO_TYPE_DOUBLE:
+        {
+            double d;
+            memcpy(&d, ptr, sizeof(d));
+            return d == filter->where_real;
+        }
+
+        case MAXAVRO_TYPE_BYTES:
+        case MAXAVRO_TYPE_STRING:
+        {
+            uint64_t len;
+            ptr = maxavro_decode_integer(ptr, end, &len);
+            return ptr && len == strlen(filter->where_value) &&
+                   memcmp(ptr, filter->where_value, len) == 0;
+        }
+
+        default:
+            return false;
+    }
+}
+
+/**
+ * @brief Write a record that passes the filter as JSON
+ *
+ * The fields are first skipped to find the fields and to check the filter.
+ * Only the fields that are output are then decoded.
+ *
+ * @param file File being read
+ * @param filter The filter
+ * @param ptr Start of the record
+ * @param end End of the data block
+ * @param writer The output
+ * @param field_start Array of schema size for the start of each field
+ * @return Pointer to the first byte after the record or NULL if the record
+ * could not be decoded or written
+ */
+static uint8_t* decode_filtered_record(MAXAVRO_FILE *file, MAXAVRO_FILTER *filter,
+                                       uint8_t *ptr, uint8_t *end, JSON_WRITER *writer,
+                                       uint8_t **field_start)
+{
+    MAXAVRO_SCHEMA *schema = file->schema;
+
+    for (size_t i = 0; i < schema->num_fields && ptr; i++)
+    {
+        field_start[i] = ptr;
+        ptr = skip_field_value(&schema->fields[i], &file->values[i], ptr, end);
+    }
+
+    if (ptr == NULL)
+    {
+        return NULL;
+    }
+
+    if (!filter->match_none &&
+        (filter->where_field == -1 ||
+         filter_matches(filter, &schema->fields[filter->where_field],
+                        &file->values[filter->where_field],
+                        field_start[filter->where_field], end)))
+    {
+        int written = 0;
+
+        for (size_t i = 0; i < schema->num_fields; i++)
+        {
+            MAXAVRO_SCHEMA_FIELD *field = &schema->fields[i];
+
+            if (filter->output[i] &&
+                (!(written++ == 0 ? json_write_raw(writer, "{", 1) : json_write_raw(writer, ", ", 2)) ||
+                 !json_write_string(writer, (uint8_t*)field->name, strlen(field->name)) ||
+                 !json_write_raw(writer, ": ", 2) ||
+                 decode_json_value(file, field, &file->values[i], field_start[i], end, writer) == NULL))
+            {
+                return NULL;
+            }
+        }
+
+        if (!json_write_raw(writer, written == 0 ? "{}\n" : "}\n", written == 0 ? 3 : 2))
+        {
+            return NULL;
+        }
+    }
+
+    return ptr;
+}
+
+/**
+ * @brief Create a filter for reading records as JSON
+ *
+ * Columns that the schema of the file does not have are ignored. If the
+ * filter is on a column the schema does not have, no records pass it.
+ *
+ * @param file The file the filter is used with
+ * @param columns Comma-separated list of the columns to output, NULL for all
+ * @param where_column Column that must have a value, NULL for all records
+ * @param where_value The value of where_column
+ * @return The filter or NULL if memory allocation failed
+ */
+MAXAVRO_FILTER* maxavro_filter_alloc(MAXAVRO_FILE *file, const char *columns,
+                                     const char *where_column, const char *where_value)
+{
+    MAXAVRO_SCHEMA *schema = file->schema;
+    MAXAVRO_FILTER *filter = calloc(1, sizeof(MAXAVRO_FILTER));
+
+    if (filter == NULL ||
+        (filter->output = calloc(schema->num_fields, sizeof(bool))) == NULL ||
+        (where_value && (filter->where_value = strdup(where_value)) == NULL))
+    {
+        maxavro_filter_free(filter);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < schema->num_fields; i++)
+    {
+        const char *name = schema->fields[i].name;
+        size_t len = strlen(name);
+        const char *ptr = columns;
+
+        while (ptr && !filter->output[i])
+        {
+            const char *sep = strchr(ptr, ',');
+            size_t ptrlen = sep ? (size_t)(sep - ptr) : strlen(ptr);
+            filter->output[i] = ptrlen == len && strncmp(ptr, name, len) == 0;
+            ptr = sep ? sep + 1 : NULL;
+        }
+
+        if (columns == NULL)
+        {
+            filter->output[i] = true;
+        }
+    }
+
+    filter->where_field = -1;
+
+    if (where_column)
+    {
+        filter->match_none = true;
+
+        for (size_t i = 0; i < schema->num_fields; i++)
+        {
+            if (strcmp(schema->fields[i].name, where_column) == 0)
+            {
+                filter->where_field = i;
+                filter->match_none = false;
+                break;
+            }
+        }
+
+        filter->where_integer = strtoll(where_value, NULL, 10);
+        filter->where_real = strtod(where_value, NULL);
+    }
+
+    return filter;
+}
+
+/**
+ * @brief Free a filter
+ *
+ * @param filter Filter to free
+ */
+void maxavro_filter_free(MAXAVRO_FILTER *filter)
+{
+    if (filter)
+    {
+        free(filter->output);
+        free(filter->where_value);
+        free(filter);
+    }
+}
+
+/**
+ * @brief Read the unread part of the current data block into memory
+ *
+ * @param file Uncompressed file to read from
+ * @param posp The file offset of the data
+ * @param lenp The length of the data
+ * @return True if the data was read into the buffer of the file
+ */
+static bool read_remaining_data(MAXAVRO_FILE *file, long *posp, long *lenp)
+{
+    long pos = ftell(file->file);
+    long len = file->data_start_pos + file->block_size - pos;
+
+    *posp = pos;
+    *lenp = len;
+
+    if (pos == -1 || len <= 0)
+    {
+        MXS_ERROR("Failed to find the unread records of the data block of '%s'.",
+                  file->filename);
+        file->last_error = MAXAVRO_ERR_IO;
+        return false;
+    }
+
+    if ((size_t)len > file->buffer_size)
+    {
+        uint8_t *buffer = realloc(file->buffer, len);
+
+        if (buffer == NULL)
+        {
+            file->last_error = MAXAVRO_ERR_MEMORY;
+            return false;
+        }
+
+        file->buffer = buffer;
+        file->buffer_size = len;
+    }
+
+    if (fread(file->buffer, 1, len, file->file) != (size_t)len)
+    {
+        if (ferror(file->file))
+        {
+            char err[STRERROR_BUFLEN];
+            MXS_ERROR("Failed to read %ld bytes: %d, %s", len, errno,
+                      strerror_r(errno, err, sizeof(err)));
+            file->last_error = MAXAVRO_ERR_IO;
+        }
+        else
+        {
+            /** The block is still being written, try again later */
+            clearerr(file->file);
+        }
+
+        fseek(file->file, pos, SEEK_SET);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Read the rest of the current data block as JSON
+ *
+ * The unread records of the block are read into memory at once and written
+ * as JSON without building jansson objects. Each record is written on its
+ * own line in the format json_dumps() uses with JSON_PRESERVE_ORDER. The
+ * integer values of the last record can be queried with
+ * maxavro_record_get_integer().
+ *
+ * With a filter, only the records that pass it are written and only with the
+ * fields it selects. The values of the other fields are skipped, not decoded.
+ *
+ * @param file File to read from
+ * @param filter Filter created for this file or NULL to write all records
+ * @return Buffer with the records or NULL if no records were read. The buffer
+ * is empty if no records passed the filter. Consult maxavro_get_error() to see
+ * whether an error occurred.
+ */
+GWBUF* maxavro_record_read_json_block(MAXAVRO_FILE *file, MAXAVRO_FILTER *filter)
+{
+    if (!file->metadata_read && !maxavro_read_datablock_start(file))
+    {
+        return NULL;
+    }
+
+    if (file->records_read_from_block >= file->records_in_block)
+    {
+        return NULL;
+    }
+
+    if (file->values == NULL &&
+        (file->values = calloc(file->schema->num_fields, sizeof(MAXAVRO_RECORD_VALUE))) == NULL)
+    {
+        file->last_error = MAXAVRO_ERR_MEMORY;
+        return NULL;
+    }
+
+    uint8_t *data;
+    long pos;
+    long len;
+
+    if (file->codec != MAXAVRO_CODEC_NULL)
+    {
+        /** Compressed blocks are decompressed as a whole when they are started */
+        pos = file->block_pos;
+        len = file->block_len - file->block_pos;
+        data = file->block + file->block_pos;
+    }
+    else if (read_remaining_data(file, &pos, &len))
+    {
+        data = file->buffer;
+    }
+    else
+    {
+        return NULL;
+    }
+
+    JSON_WRITER writer = {NULL, NULL, NULL, NULL};
+    uint8_t *ptr = data;
+    uint8_t *end = ptr + len;
+
+    /** Most records fit in twice their encoded size */
+    if (!json_reserve(&writer, len * 2))
+    {
+        file->last_error = MAXAVRO_ERR_MEMORY;
+
+        if (file->codec == MAXAVRO_CODEC_NULL)
+        {
+            fseek(file->file, pos, SEEK_SET);
+        }
+        return NULL;
+    }
+
+    uint8_t *field_start[file->schema->num_fields];
+
+    while (file->records_read_from_block < file->records_in_block)
+    {
+        if (filter)
+        {
+            uint8_t *start = ptr;
+
+            if ((ptr = decode_filtered_record(file, filter, ptr, end, &writer, field_start)) == NULL)
+            {
+                MXS_ERROR("Failed to read record at file offset %ld, record numer %lu.",
+                          pos + (long)(start - data), file->records_read);
+                file->last_error = MAXAVRO_ERR_VALUE_OVERFLOW;
+                gwbuf_free(writer.head);
+                return NULL;
+            }
+
+            file->records_read_from_block++;
+            file->records_read++;
+            continue;
+        }
+
+        for (size_t i = 0; i < file->schema->num_fields; i++)
+        {
+            MAXAVRO_SCHEMA_FIELD *field = &file->schema->fields[i];
+            uint8_t *start = ptr;
+
+            if (!json_write_raw(&writer, i == 0 ? "{" : ", ", i == 0 ? 1 : 2) ||
+                !json_write_string(&writer, (uint8_t*)field->name, strlen(field->name)) ||
+                !json_write_raw(&writer, ": ", 2) ||
+                (ptr = decode_json_value(file, field, &file->values[i], ptr, end, &writer)) == NULL)
+            {
+                MXS_ERROR("Failed to read field value '%s', type '%s' at "
+                          "file offset %ld, record numer %lu.",
+                          field->name, type_to_string(field->type),
+                          pos + (long)(start - data), file->records_read);
+                file->last_error = MAXAVRO_ERR_VALUE_OVERFLOW;
+                gwbuf_free(writer.head);
+                return NULL;
+            }
+        }
+
+        if (!json_write_raw(&writer, "}\n", 2))
+        {
+            file->last_error = MAXAVRO_ERR_MEMORY;
+            gwbuf_free(writer.head);
+            return NULL;
+        }
+
+        file->records_read_from_block++;
+        file->records_read++;
+    }
+
+    if (file->codec != MAXAVRO_CODEC_NULL)
+    {
+        file->block_pos = file->block_len;
+    }
+
+    GWBUF_RTRIM(writer.tail, writer.end - writer.ptr);
+    return writer.head;
+}
+
+/**
+ * @brief Get an integer value of the last record read as a block
+ *
+ * @param file File that was read with maxavro_record_read_json_block
+ * @param name Name of the field
+ * @param dest Destination where the value is written
+ * @return True if the field was found
+ */
+bool maxavro_record_get_integer(MAXAVRO_FILE *file, const char *name, uint64_t *dest)
+{
+    if (file->values)
+    {
+        for (size_t i = 0; i < file->schema->num_fields; i++)
+        {
+            if (strcmp(file->schema->fields[i].name, name) == 0)
+            {
+                *dest = file->values[i].integer;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
 static void skip_record(MAXAVRO_FILE *file)
 {
     for (size_t i = 0; i < file->schema->num_fields; i++)
@@ -223,12 +1013,17 @@ bool maxavro_next_block(MAXAVRO_FILE *file)
         if (file->records_read_from_block < file->records_in_block)
         {
             file->records_read += file->records_in_block - file->records_read_from_block;
-            long curr_pos = ftell(file->file);
-            long offset = (long) file->block_size - (curr_pos - file->data_start_pos);
 
-            if (offset > 0)
+            /** A compressed block was already read as a whole */
+            if (file->codec == MAXAVRO_CODEC_NULL)
             {
-                fseek(file->file, offset, SEEK_CUR);
+                long curr_pos = ftell(file->file);
+                long offset = (long) file->block_size - (curr_pos - file->data_start_pos);
+
+                if (offset > 0)
+                {
+                    fseek(file->file, offset, SEEK_CUR);
+                }
             }
         }
 
@@ -266,9 +1061,9 @@ bool maxavro_record_seek(MAXAVRO_FILE *file, uint64_t offset)
 
         while (offset > file->records_in_block)
         {
-            /** Skip full blocks that don't have the position we want */
+            /** Skip full blocks that don't have the position we want, the
+             * unread records of a block are skipped when moving to the next */
             offset -= file->records_in_block;
-            fseek(file->file, file->block_size, SEEK_CUR);
             maxavro_next_block(file);
         }
 
@@ -359,3 +1154,104 @@ GWBUF* maxavro_record_read_binary(MAXAVRO_FILE *file)
     }
     return rval;
 }
+
+/**
+ * @brief Decode the integer values of a record from memory
+ *
+ * The values are stored in the values of the file, other types are skipped.
+ *
+ * @param file File being read
+ * @param ptr Start of the record
+ * @param end End of the data
+ * @return True if the whole record was decoded
+ */
+static bool decode_record_values(MAXAVRO_FILE *file, uint8_t *ptr, uint8_t *end)
+{
+    for (size_t i = 0; i < file->schema->num_fields && ptr; i++)
+    {
+        ptr = skip_field_value(&file->schema->fields[i], &file->values[i], ptr, end);
+    }
+
+    return ptr != NULL;
+}
+
+/**
+ * @brief Locate the current data block so that it can be sent as it is
+ *
+ * The block is only returned once the sync marker that ends it is in the
+ * file and matches the one in the file header. The data of the block is not
+ * read apart from its first record, which is decoded so that its integer
+ * values can be queried with maxavro_record_get_integer(). If the first
+ * record does not fit in the start of the block that is read, no values are
+ * available. After the block has been sent, maxavro_next_block() moves to
+ * the next block.
+ *
+ * @param file File to read from
+ * @param offset Offset of the block in the file
+ * @param len Length of the block, including the sync marker
+ * @return True if a complete block was found
+ */
+bool maxavro_record_locate_block(MAXAVRO_FILE *file, long *offset, size_t *len)
+{
+    if (file->last_error != MAXAVRO_ERR_NONE ||
+        (!file->metadata_read && !maxavro_read_datablock_start(file)))
+    {
+        return false;
+    }
+
+    int fd = fileno(file->file);
+    long sync_pos = file->data_start_pos + file->block_size;
+    uint8_t sync[SYNC_MARKER_SIZE];
+
+    if (pread(fd, sync, sizeof(sync), sync_pos) != sizeof(sync))
+    {
+        /** The block is still being written */
+        return false;
+    }
+
+    if (memcmp(sync, file->sync, sizeof(sync)) != 0)
+    {
+        MXS_ERROR("Sync marker mismatch at offset %ld of '%s'.", sync_pos, file->filename);
+        return false;
+    }
+
+    size_t prefix = MIN(file->block_size, BLOCK_PREFIX_SIZE);
+
+    if (prefix > file->buffer_size)
+    {
+        uint8_t *buffer = realloc(file->buffer, prefix);
+
+        if (buffer)
+        {
+            file->buffer = buffer;
+            file->buffer_size = prefix;
+        }
+    }
+
+    if (file->values == NULL)
+    {
+        file->values = calloc(file->schema->num_fields, sizeof(MAXAVRO_RECORD_VALUE));
+    }
+
+    if (file->codec != MAXAVRO_CODEC_NULL)
+    {
+        /** The decompressed data is already in memory */
+        if (file->values && !decode_record_values(file, file->block, file->block + file->block_len))
+        {
+            free(file->values);
+            file->values = NULL;
+        }
+    }
+    /** Only the values are missing if the first record can't be decoded */
+    else if (file->values && (prefix > file->buffer_size ||
+                         pread(fd, file->buffer, prefix, file->data_start_pos) != (ssize_t)prefix ||
+                         !decode_record_values(file, file->buffer, file->buffer + prefix)))
+    {
+        free(file->values);
+        file->values = NULL;
+    }
+
+    *offset = file->block_start_pos;
+    *len = sync_pos + SYNC_MARKER_SIZE - file->block_start_pos;
+    return true;
+}
@@ -9,7 +9,7 @@
 include(ExternalProject)
 
 ExternalProject_Add(pcre2 SOURCE_DIR ${CMAKE_SOURCE_DIR}/pcre2/
-  CMAKE_ARGS -DCMAKE_C_FLAGS=-fPIC -DBUILD_SHARED_LIBS=N -DPCRE2_BUILD_PCRE2GREP=N  -DPCRE2_BUILD_TESTS=N
+  CMAKE_ARGS -DCMAKE_C_FLAGS=-fPIC -DBUILD_SHARED_LIBS=N -DPCRE2_BUILD_PCRE2GREP=N -DPCRE2_BUILD_TESTS=N -DPCRE2_SUPPORT_JIT=Y
   BINARY_DIR ${CMAKE_BINARY_DIR}/pcre2/
   BUILD_COMMAND make
   INSTALL_COMMAND "")
@@ -53,3 +53,6 @@ set(WITH_TCMALLOC FALSE CACHE BOOL "Use tcmalloc as the memory allocator")
 
 # Use jemalloc as the memory allocator
 set(WITH_JEMALLOC FALSE CACHE BOOL "Use jemalloc as the memory allocator")
+
+# Add the static tracepoints for SystemTap, perf and bpftrace
+set(WITH_USDT FALSE CACHE BOOL "Add USDT static tracepoints (requires sys/sdt.h)")
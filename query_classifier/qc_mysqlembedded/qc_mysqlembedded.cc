@@ -124,7 +124,7 @@ bool ensure_query_is_parsed(GWBUF* query)
     return parsed;
 }
 
-qc_parse_result_t qc_parse(GWBUF* querybuf)
+qc_parse_result_t qc_parse(GWBUF* querybuf, uint32_t collect)
 {
     bool parsed = ensure_query_is_parsed(querybuf);
 
@@ -188,7 +188,7 @@ static bool parse_query(GWBUF* querybuf)
 {
     bool succp;
     THD* thd;
-    uint8_t* data;
+    uint8_t header[MYSQL_HEADER_LEN];
     size_t len;
     char* query_str = NULL;
     parsing_info_t* pi;
@@ -213,9 +213,10 @@ static bool parse_query(GWBUF* querybuf)
         goto retblock;
     }
 
-    /** Extract query and copy it to different buffer */
-    data = (uint8_t*) GWBUF_DATA(querybuf);
-    len = MYSQL_GET_PACKET_LEN(data) - 1; /*< distract 1 for packet type byte */
+    /** Extract query and copy it to different buffer, the buffer may be a chain */
+    memset(header, 0, sizeof(header));
+    gwbuf_copy_data(querybuf, 0, MYSQL_HEADER_LEN, header);
+    len = MYSQL_GET_PACKET_LEN(header) - 1; /*< distract 1 for packet type byte */
 
 
     if (len < 1 || len >= ~((size_t) 0) - 1 || (query_str = (char *) malloc(len + 1)) == NULL)
@@ -228,7 +229,7 @@ static bool parse_query(GWBUF* querybuf)
         goto retblock;
     }
 
-    memcpy(query_str, &data[5], len);
+    len = gwbuf_copy_data(querybuf, MYSQL_HEADER_LEN + 1, len, (uint8_t*) query_str);
     memset(&query_str[len], 0, 1);
     parsing_info_set_plain_str(pi, query_str);
 
@@ -1132,11 +1133,11 @@ return_rc:
 char* qc_get_stmtname(GWBUF* buf)
 {
     MYSQL* mysql;
+    parsing_info_t* pi;
 
     if (buf == NULL ||
-        buf->gwbuf_bufobj == NULL ||
-        buf->gwbuf_bufobj->bo_data == NULL ||
-        (mysql = (MYSQL *) ((parsing_info_t *) buf->gwbuf_bufobj->bo_data)->pi_handle) == NULL ||
+        (pi = (parsing_info_t *) gwbuf_get_buffer_object_data(buf, GWBUF_PARSING_INFO)) == NULL ||
+        (mysql = (MYSQL *) pi->pi_handle) == NULL ||
         mysql->thd == NULL ||
         (THD *) (mysql->thd))->lex == NULL ||
         (THD *) (mysql->thd))->lex->prepared_stmt_name == NULL)
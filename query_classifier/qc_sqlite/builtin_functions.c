@@ -3,15 +3,12 @@
  */
 
 #include "builtin_functions.h"
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <skygw_debug.h>
 
-static struct
-{
-    bool inited;
-} unit = { false };
-
 // The functions have been taken from:
 // https://mariadb.com/kb/en/mariadb/functions-and-operators/
 
@@ -78,7 +75,7 @@ static const char* BUILTIN_FUNCTIONS[] =
     "subtime",
     "sysdate",
     "time",
-    "timediff"
+    "timediff",
     "timestamp",
     "timestampadd",
     "timestampdiff",
@@ -367,16 +364,95 @@ static const char* BUILTIN_FUNCTIONS[] =
 
 const size_t N_BUILTIN_FUNCTIONS = sizeof(BUILTIN_FUNCTIONS) / sizeof(BUILTIN_FUNCTIONS[0]);
 
-// NOTE: sort_compare and search_compare are not identical, so don't
-// NOTE: optimize either of them away.
-static int sort_compare(const void* key, const void* value)
+// The functions are looked up from a perfect hash table. A name is hashed
+// once to find its bucket and the displacement of the bucket decides the
+// slot, so a lookup compares the name with at most one function. The
+// displacements are searched for when the unit is initialized.
+
+#define N_FUNCTIONS (sizeof(BUILTIN_FUNCTIONS) / sizeof(BUILTIN_FUNCTIONS[0]))
+#define N_SLOTS     (2 * N_FUNCTIONS + 1)
+#define N_BUCKETS   (N_FUNCTIONS / 4 + 1)
+
+typedef struct builtin_slot
 {
-    return strcasecmp(*(const char**) key, *(const char**) value);
+    const char* name; // NULL if the slot is free.
+    size_t len;
+} BUILTIN_SLOT;
+
+static struct
+{
+    bool inited;
+    size_t min_len;
+    size_t max_len;
+    uint32_t first_chars[256 / 32];     // The first characters of the names, in lower case.
+    uint32_t displacements[N_BUCKETS];
+    BUILTIN_SLOT slots[N_SLOTS];
+} unit;
+
+static inline char to_lower(char c)
+{
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
 }
 
-static int search_compare(const void* key, const void* value)
+// Case-insensitive FNV-1a, also returns the length of the name.
+static inline uint32_t hash_name(const char* name, size_t* len)
 {
-    return strcasecmp((const char*) key, *(const char**) value);
+    uint32_t h = 2166136261u;
+    const char* p = name;
+
+    while (*p)
+    {
+        h = (h ^ (unsigned char) to_lower(*p++)) * 16777619u;
+    }
+
+    *len = p - name;
+    return h;
+}
+
+static inline size_t slot_of(uint32_t h, uint32_t displacement)
+{
+    h += displacement * 0x9e3779b9u;
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+
+    return h % N_SLOTS;
+}
+
+// Finds a displacement that puts all names of the bucket into free slots.
+static void place_bucket(size_t bucket, const size_t* names, size_t n_names, const uint32_t* hashes)
+{
+    for (uint32_t d = 0; ; d++)
+    {
+        size_t slots[n_names];
+        bool ok = true;
+
+        for (size_t i = 0; ok && i < n_names; i++)
+        {
+            slots[i] = slot_of(hashes[names[i]], d);
+            ok = unit.slots[slots[i]].name == NULL;
+
+            for (size_t j = 0; ok && j < i; j++)
+            {
+                ok = slots[j] != slots[i];
+            }
+        }
+
+        if (ok)
+        {
+            unit.displacements[bucket] = d;
+
+            for (size_t i = 0; i < n_names; i++)
+            {
+                const char* name = BUILTIN_FUNCTIONS[names[i]];
+                unit.slots[slots[i]].name = name;
+                unit.slots[slots[i]].len = strlen(name);
+            }
+            return;
+        }
+    }
 }
 
 //
@@ -387,7 +463,63 @@ void init_builtin_functions()
 {
     ss_dassert(!unit.inited);
 
-    qsort(BUILTIN_FUNCTIONS, N_BUILTIN_FUNCTIONS, sizeof(char*), sort_compare);
+    uint32_t hashes[N_FUNCTIONS];
+    size_t sizes[N_BUCKETS] = {0};
+    size_t max_size = 0;
+
+    memset(unit.slots, 0, sizeof(unit.slots));
+    memset(unit.first_chars, 0, sizeof(unit.first_chars));
+    unit.min_len = SIZE_MAX;
+    unit.max_len = 0;
+
+    for (size_t i = 0; i < N_FUNCTIONS; i++)
+    {
+        size_t len;
+        unsigned char first = to_lower(BUILTIN_FUNCTIONS[i][0]);
+
+        hashes[i] = hash_name(BUILTIN_FUNCTIONS[i], &len);
+        unit.first_chars[first / 32] |= 1u << (first % 32);
+        unit.min_len = len < unit.min_len ? len : unit.min_len;
+        unit.max_len = len > unit.max_len ? len : unit.max_len;
+
+        size_t size = ++sizes[hashes[i] % N_BUCKETS];
+        max_size = size > max_size ? size : max_size;
+    }
+
+    // The largest buckets are placed first, while most of the slots are free.
+    for (size_t size = max_size; size > 0; size--)
+    {
+        for (size_t bucket = 0; bucket < N_BUCKETS; bucket++)
+        {
+            if (sizes[bucket] != size)
+            {
+                continue;
+            }
+
+            size_t names[N_FUNCTIONS];
+            size_t n_names = 0;
+
+            for (size_t i = 0; i < N_FUNCTIONS; i++)
+            {
+                if (hashes[i] % N_BUCKETS == bucket)
+                {
+                    bool duplicate = false;
+
+                    for (size_t j = 0; !duplicate && j < n_names; j++)
+                    {
+                        duplicate = strcasecmp(BUILTIN_FUNCTIONS[names[j]], BUILTIN_FUNCTIONS[i]) == 0;
+                    }
+
+                    if (!duplicate)
+                    {
+                        names[n_names++] = i;
+                    }
+                }
+            }
+
+            place_bucket(bucket, names, n_names, hashes);
+        }
+    }
 
     unit.inited = true;
 }
@@ -402,7 +534,23 @@ bool is_builtin_readonly_function(const char* key)
 {
     ss_dassert(unit.inited);
 
-    char* value = bsearch(key, BUILTIN_FUNCTIONS, N_BUILTIN_FUNCTIONS, sizeof(char*), search_compare);
+    unsigned char first = to_lower(key[0]);
+
+    if ((unit.first_chars[first / 32] & (1u << (first % 32))) == 0)
+    {
+        return false;
+    }
+
+    size_t len;
+    uint32_t h = hash_name(key, &len);
+
+    if (len < unit.min_len || len > unit.max_len)
+    {
+        return false;
+    }
+
+    const BUILTIN_SLOT* slot = &unit.slots[slot_of(h, unit.displacements[h % N_BUCKETS])];
 
-    return value ? true : false;
+    return slot->name && slot->len == len && to_lower(slot->name[0]) == first &&
+           strcasecmp(slot->name, key) == 0;
 }
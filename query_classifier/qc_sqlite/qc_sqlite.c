@@ -13,6 +13,8 @@
 
 #include <sqliteInt.h>
 
+#include <ctype.h>
+#include <inttypes.h>
 #include <signal.h>
 #include <string.h>
 #include <log_manager.h>
@@ -78,8 +80,36 @@ typedef struct qc_sqlite_info
     int keyword_1;                   // The first encountered keyword.
     int keyword_2;                   // The second encountered keyword.
     bool initializing;               // Whether we are initializing sqlite3.
+    uint32_t collect;                // What information should be collected.
+    uint32_t collected;              // What information has been collected.
 } QC_SQLITE_INFO;
 
+/**
+ * An entry in the cache of classification results.
+ */
+typedef struct qc_cache_entry
+{
+    struct qc_cache_entry* next;     // The next entry in the same hash bucket.
+    struct qc_cache_entry* lru_prev; // The entry that was used more recently.
+    struct qc_cache_entry* lru_next; // The entry that was used less recently.
+    uint32_t hash;                   // The hash of the key.
+    char* key;                       // The statement with its literals replaced by '?'.
+    size_t key_len;                  // The length of the key.
+    QC_SQLITE_INFO* info;            // The classification of the statement.
+} QC_CACHE_ENTRY;
+
+// The default number of classification results cached by each thread.
+#define QC_CACHE_DEFAULT_SIZE 1024
+// Longer statements are not cached.
+#define QC_CACHE_MAX_QUERY_LEN 4096
+
+// The size and number of the lookaside slots of each thread. The nodes of the
+// parse trees are allocated from them, so that building and deleting a tree
+// seldom calls malloc and free. The slots are large enough for Select and
+// SrcList nodes, which do not fit into the sqlite default slots of 128 bytes.
+#define QC_LOOKASIDE_SLOT_SIZE 512
+#define QC_LOOKASIDE_SLOTS     512
+
 typedef enum qc_log_level
 {
     QC_LOG_NOTHING = 0,
@@ -96,6 +126,9 @@ static struct
 {
     bool initialized;
     qc_log_level_t log_level;
+    size_t cache_size;     // The maximum number of cached results per thread.
+    uint64_t cache_hits;   // The cache hits of the threads that have ended.
+    uint64_t cache_misses; // The cache misses of the threads that have ended.
 } this_unit;
 
 /**
@@ -105,7 +138,17 @@ static thread_local struct
 {
     bool initialized;
     sqlite3* db;      // Thread specific database handle.
+    void* lookaside;  // The lookaside memory of the database handle.
     QC_SQLITE_INFO* info;
+    QC_CACHE_ENTRY** cache_buckets; // The hash buckets of the cache, allocated when first used.
+    size_t cache_n_buckets;         // The number of buckets, a power of two.
+    size_t cache_n_entries;         // The number of entries in the cache.
+    QC_CACHE_ENTRY* lru_first;      // The most recently used entry.
+    QC_CACHE_ENTRY* lru_last;       // The least recently used entry.
+    uint64_t cache_hits;            // Statements whose classification was found in the cache.
+    uint64_t cache_misses;          // Cacheable statements that had to be parsed.
+    char* sql;                      // Statements that span several buffers are gathered here.
+    size_t sql_size;                // The size of sql.
 } this_thread;
 
 
@@ -179,18 +222,26 @@ typedef enum qc_token_position
 } qc_token_position_t;
 
 static void append_affected_field(QC_SQLITE_INFO* info, const char* s);
+static void cache_add(uint32_t hash, char* key, size_t key_len, QC_SQLITE_INFO* info);
+static QC_CACHE_ENTRY* cache_find(uint32_t hash, const char* key, size_t key_len);
+static void cache_free(void);
+static uint32_t cache_hash(const char* key, size_t key_len);
+static char* cache_key(const char* query, size_t len, size_t* key_len);
 static void buffer_object_free(void* data);
 static char** copy_string_array(char** strings, int* pn);
 static void enlarge_string_array(size_t n, size_t len, char*** ppzStrings, size_t* pCapacity);
-static bool ensure_query_is_parsed(GWBUF* query);
+static bool ensure_query_is_parsed(GWBUF* query, uint32_t collect);
 static void free_string_array(char** sa);
-static QC_SQLITE_INFO* get_query_info(GWBUF* query);
+static QC_SQLITE_INFO* get_query_info(GWBUF* query, uint32_t collect);
 static QC_SQLITE_INFO* info_alloc(void);
+static void info_assign(QC_SQLITE_INFO* dest, const QC_SQLITE_INFO* src);
+static QC_SQLITE_INFO* info_copy(const QC_SQLITE_INFO* info);
+static bool info_is_cacheable(const QC_SQLITE_INFO* info);
 static void info_finish(QC_SQLITE_INFO* info);
 static void info_free(QC_SQLITE_INFO* info);
 static QC_SQLITE_INFO* info_init(QC_SQLITE_INFO* info);
 static void log_invalid_data(GWBUF* query, const char* message);
-static bool parse_query(GWBUF* query);
+static bool parse_query(GWBUF* query, uint32_t collect);
 static void parse_query_string(const char* query, size_t len);
 static bool query_is_parsed(GWBUF* query);
 static bool should_exclude(const char* zName, const ExprList* pExclude);
@@ -276,6 +327,339 @@ static char** copy_string_array(char** strings, int* pn)
     return ss;
 }
 
+/**
+ * Adds a classification result to the cache of the thread. If the cache is
+ * full, the least recently used entry is removed.
+ *
+ * @param hash    The hash of the key.
+ * @param key     The key, the cache takes ownership of it.
+ * @param key_len The length of the key.
+ * @param info    The classification, the cache takes ownership of it.
+ */
+static void cache_add(uint32_t hash, char* key, size_t key_len, QC_SQLITE_INFO* info)
+{
+    if (!this_thread.cache_buckets)
+    {
+        size_t n_buckets = 16;
+
+        while (n_buckets < this_unit.cache_size)
+        {
+            n_buckets *= 2;
+        }
+
+        this_thread.cache_buckets = mxs_calloc(n_buckets, sizeof(QC_CACHE_ENTRY*));
+        this_thread.cache_n_buckets = n_buckets;
+    }
+
+    QC_CACHE_ENTRY* entry;
+
+    if (this_thread.cache_n_entries >= this_unit.cache_size)
+    {
+        // Reuse the least recently used entry.
+        entry = this_thread.lru_last;
+
+        QC_CACHE_ENTRY** pp = &this_thread.cache_buckets[entry->hash & (this_thread.cache_n_buckets - 1)];
+
+        while (*pp != entry)
+        {
+            pp = &(*pp)->next;
+        }
+
+        *pp = entry->next;
+
+        this_thread.lru_last = entry->lru_prev;
+
+        if (this_thread.lru_last)
+        {
+            this_thread.lru_last->lru_next = NULL;
+        }
+        else
+        {
+            this_thread.lru_first = NULL;
+        }
+
+        free(entry->key);
+        info_free(entry->info);
+    }
+    else
+    {
+        entry = mxs_malloc(sizeof(*entry));
+        ++this_thread.cache_n_entries;
+    }
+
+    entry->hash = hash;
+    entry->key = key;
+    entry->key_len = key_len;
+    entry->info = info;
+
+    QC_CACHE_ENTRY** bucket = &this_thread.cache_buckets[hash & (this_thread.cache_n_buckets - 1)];
+    entry->next = *bucket;
+    *bucket = entry;
+
+    entry->lru_prev = NULL;
+    entry->lru_next = this_thread.lru_first;
+
+    if (this_thread.lru_first)
+    {
+        this_thread.lru_first->lru_prev = entry;
+    }
+    else
+    {
+        this_thread.lru_last = entry;
+    }
+
+    this_thread.lru_first = entry;
+}
+
+/**
+ * Finds a classification result from the cache of the thread and makes it
+ * the most recently used one.
+ *
+ * @param hash    The hash of the key.
+ * @param key     The key.
+ * @param key_len The length of the key.
+ *
+ * @return The entry or NULL if the key is not in the cache.
+ */
+static QC_CACHE_ENTRY* cache_find(uint32_t hash, const char* key, size_t key_len)
+{
+    QC_CACHE_ENTRY* entry = NULL;
+
+    if (this_thread.cache_buckets)
+    {
+        entry = this_thread.cache_buckets[hash & (this_thread.cache_n_buckets - 1)];
+
+        while (entry &&
+               (entry->hash != hash || entry->key_len != key_len || memcmp(entry->key, key, key_len) != 0))
+        {
+            entry = entry->next;
+        }
+
+        if (entry && entry != this_thread.lru_first)
+        {
+            // Move the entry to the front of the LRU list.
+            entry->lru_prev->lru_next = entry->lru_next;
+
+            if (entry->lru_next)
+            {
+                entry->lru_next->lru_prev = entry->lru_prev;
+            }
+            else
+            {
+                this_thread.lru_last = entry->lru_prev;
+            }
+
+            entry->lru_prev = NULL;
+            entry->lru_next = this_thread.lru_first;
+            this_thread.lru_first->lru_prev = entry;
+            this_thread.lru_first = entry;
+        }
+    }
+
+    return entry;
+}
+
+/**
+ * Frees the cache of the thread.
+ */
+static void cache_free(void)
+{
+    QC_CACHE_ENTRY* entry = this_thread.lru_first;
+
+    while (entry)
+    {
+        QC_CACHE_ENTRY* next = entry->lru_next;
+
+        free(entry->key);
+        info_free(entry->info);
+        free(entry);
+
+        entry = next;
+    }
+
+    free(this_thread.cache_buckets);
+    this_thread.cache_buckets = NULL;
+    this_thread.cache_n_buckets = 0;
+    this_thread.cache_n_entries = 0;
+    this_thread.lru_first = NULL;
+    this_thread.lru_last = NULL;
+}
+
+/**
+ * Calculates the FNV-1a hash of a key.
+ *
+ * @param key     The key.
+ * @param key_len The length of the key.
+ *
+ * @return The hash.
+ */
+static uint32_t cache_hash(const char* key, size_t key_len)
+{
+    uint32_t hash = 2166136261U;
+
+    for (size_t i = 0; i < key_len; ++i)
+    {
+        hash = (hash ^ (uint8_t) key[i]) * 16777619U;
+    }
+
+    return hash;
+}
+
+static inline bool is_identifier_char(char c)
+{
+    return isalnum((unsigned char) c) || c == '_' || c == '$';
+}
+
+/**
+ * Returns whether a token consists only of a decimal or a hexadecimal number.
+ *
+ * @param s   The start of the token.
+ * @param len The length of the token.
+ *
+ * @return True, if the token is a number.
+ */
+static bool is_number(const char* s, size_t len)
+{
+    size_t i = 0;
+
+    if (len > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X'))
+    {
+        for (i = 2; i < len && isxdigit((unsigned char) s[i]); ++i)
+        {
+        }
+    }
+    else
+    {
+        bool dot = false;
+
+        for (i = 0; i < len && (isdigit((unsigned char) s[i]) || (s[i] == '.' && !dot)); ++i)
+        {
+            dot = dot || s[i] == '.';
+        }
+    }
+
+    return i == len;
+}
+
+/**
+ * Creates the cache key of a statement. The string and number literals are
+ * replaced with '?', so that statements that differ only in their literals
+ * share the key. Comments and quoted identifiers are copied as such, as is
+ * anything that cannot be recognized as a literal.
+ *
+ * @param query   The statement.
+ * @param len     The length of the statement.
+ * @param key_len On return, the length of the key.
+ *
+ * @return The key, which the caller must free.
+ */
+static char* cache_key(const char* query, size_t len, size_t* key_len)
+{
+    char* key = mxs_malloc(len + 1);
+    const char* end = query + len;
+    const char* p = query;
+    char* k = key;
+
+    while (p < end)
+    {
+        char c = *p;
+
+        if (c == '\'' || c == '"')
+        {
+            // A string literal, with backslash escapes and doubled quotes.
+            ++p;
+
+            while (p < end)
+            {
+                if (*p == '\\' && p + 1 < end)
+                {
+                    p += 2;
+                }
+                else if (*p == c)
+                {
+                    if (p + 1 < end && p[1] == c)
+                    {
+                        p += 2;
+                    }
+                    else
+                    {
+                        ++p;
+                        break;
+                    }
+                }
+                else
+                {
+                    ++p;
+                }
+            }
+
+            *k++ = '?';
+        }
+        else if (c == '`' ||
+                 (c == '/' && p + 1 < end && p[1] == '*') ||
+                 c == '#' ||
+                 (c == '-' && p + 2 < end && p[1] == '-' && isspace((unsigned char) p[2])))
+        {
+            // A quoted identifier or a comment, copied as such.
+            const char* start = p;
+
+            if (c == '`')
+            {
+                const char* close = memchr(p + 1, '`', end - p - 1);
+                p = close ? close + 1 : end;
+            }
+            else if (c == '/')
+            {
+                p += 2;
+
+                while (p < end && !(*p == '*' && p + 1 < end && p[1] == '/'))
+                {
+                    ++p;
+                }
+
+                p = p < end ? p + 2 : end;
+            }
+            else
+            {
+                const char* newline = memchr(p, '\n', end - p);
+                p = newline ? newline : end;
+            }
+
+            memcpy(k, start, p - start);
+            k += p - start;
+        }
+        else if (is_identifier_char(c) || c == '.')
+        {
+            // A word, which is replaced only if it is a number.
+            const char* start = p;
+
+            while (p < end && (is_identifier_char(*p) || *p == '.'))
+            {
+                ++p;
+            }
+
+            if (is_number(start, p - start))
+            {
+                *k++ = '?';
+            }
+            else
+            {
+                memcpy(k, start, p - start);
+                k += p - start;
+            }
+        }
+        else
+        {
+            *k++ = *p++;
+        }
+    }
+
+    *k = 0;
+    *key_len = k - key;
+
+    return key;
+}
+
 static void enlarge_string_array(size_t n, size_t len, char*** ppzStrings, size_t* pCapacity)
 {
     if (len + n >= *pCapacity)
@@ -287,13 +671,24 @@ static void enlarge_string_array(size_t n, size_t len, char*** ppzStrings, size_
     }
 }
 
-static bool ensure_query_is_parsed(GWBUF* query)
+static bool ensure_query_is_parsed(GWBUF* query, uint32_t collect)
 {
     bool parsed = query_is_parsed(query);
 
-    if (!parsed)
+    if (parsed)
+    {
+        QC_SQLITE_INFO* info = (QC_SQLITE_INFO*) gwbuf_get_buffer_object_data(query, GWBUF_PARSING_INFO);
+        ss_dassert(info);
+
+        if ((~info->collected & collect) != 0)
+        {
+            // Information that was not collected the first time is now needed.
+            parsed = parse_query(query, collect);
+        }
+    }
+    else
     {
-        parsed = parse_query(query);
+        parsed = parse_query(query, collect);
     }
 
     return parsed;
@@ -315,11 +710,11 @@ static void free_string_array(char** sa)
     }
 }
 
-static QC_SQLITE_INFO* get_query_info(GWBUF* query)
+static QC_SQLITE_INFO* get_query_info(GWBUF* query, uint32_t collect)
 {
     QC_SQLITE_INFO* info = NULL;
 
-    if (ensure_query_is_parsed(query))
+    if (ensure_query_is_parsed(query, collect))
     {
         info = (QC_SQLITE_INFO*) gwbuf_get_buffer_object_data(query, GWBUF_PARSING_INFO);
         ss_dassert(info);
@@ -337,6 +732,80 @@ static QC_SQLITE_INFO* info_alloc(void)
     return info;
 }
 
+/**
+ * Copies a classification result.
+ *
+ * @param copy The structure to copy to, its earlier contents are not freed.
+ * @param info The classification to copy.
+ */
+static void info_assign(QC_SQLITE_INFO* copy, const QC_SQLITE_INFO* info)
+{
+    int n;
+
+    *copy = *info;
+
+    if (info->affected_fields)
+    {
+        copy->affected_fields = mxs_malloc(info->affected_fields_capacity);
+        memcpy(copy->affected_fields, info->affected_fields, info->affected_fields_len + 1);
+    }
+
+    if (info->table_names)
+    {
+        copy->table_names = copy_string_array(info->table_names, &n);
+        copy->table_names_capacity = n + 1;
+    }
+
+    if (info->table_fullnames)
+    {
+        copy->table_fullnames = copy_string_array(info->table_fullnames, &n);
+        copy->table_fullnames_capacity = n + 1;
+    }
+
+    if (info->created_table_name)
+    {
+        copy->created_table_name = mxs_strdup(info->created_table_name);
+    }
+
+    if (info->database_names)
+    {
+        copy->database_names = copy_string_array(info->database_names, &n);
+        copy->database_names_capacity = n + 1;
+    }
+}
+
+/**
+ * Creates a copy of a classification result.
+ *
+ * @param info The classification to copy.
+ *
+ * @return The copy.
+ */
+static QC_SQLITE_INFO* info_copy(const QC_SQLITE_INFO* info)
+{
+    QC_SQLITE_INFO* copy = mxs_malloc(sizeof(*copy));
+
+    info_assign(copy, info);
+
+    return copy;
+}
+
+/**
+ * Returns whether a classification result can be reused for all statements
+ * that differ only in their literals. That is not the case for SET, where the
+ * value decides e.g. whether autocommit is enabled or disabled.
+ *
+ * @param info The classification.
+ *
+ * @return True, if the classification can be cached.
+ */
+static bool info_is_cacheable(const QC_SQLITE_INFO* info)
+{
+    return info->status == QC_QUERY_PARSED &&
+        info->keyword_1 != TK_SET &&
+        (info->types & (QUERY_TYPE_ENABLE_AUTOCOMMIT | QUERY_TYPE_DISABLE_AUTOCOMMIT)) == 0;
+}
+
 static void info_finish(QC_SQLITE_INFO* info)
 {
     free(info->affected_fields);
@@ -382,6 +851,8 @@ static QC_SQLITE_INFO* info_init(QC_SQLITE_INFO* info)
     info->keyword_1 = 0; // Sqlite3 starts numbering tokens from 1, so 0 means
     info->keyword_2 = 0; // that we have not seen a keyword.
     info->initializing = false;
+    info->collect = QC_COLLECT_ALL;
+    info->collected = 0;
 
     return info;
 }
@@ -484,34 +955,167 @@ static void parse_query_string(const char* query, size_t len)
     }
 }
 
-static bool parse_query(GWBUF* query)
+/**
+ * Returns the text of the statement in a buffer. The buffer does not need
+ * to be contiguous: if the text is in one buffer it is used as it is,
+ * otherwise the segments of the chain are gathered into a buffer of the
+ * thread. The buffer chain itself is not modified.
+ *
+ * @param query The buffer containing the statement.
+ * @param len   On return, the length of the text.
+ *
+ * @return The text, which is valid until the next call.
+ */
+static const char* get_query_text(GWBUF* query, size_t* len)
+{
+    uint8_t header[MYSQL_HEADER_LEN] = {0};
+    uint8_t* data;
+    size_t n;
+    GWBUF_ITER iter;
+
+    gwbuf_copy_data(query, 0, MYSQL_HEADER_LEN, header);
+    size_t packet_len = MYSQL_GET_PACKET_LEN(header);
+    *len = packet_len > 0 ? packet_len - 1 : 0; // Subtract 1 for packet type byte.
+
+    gwbuf_iter_init(&iter, query, MYSQL_HEADER_LEN + 1, *len);
+
+    if (!gwbuf_iter_next(&iter, &data, &n))
+    {
+        *len = 0;
+        return "";
+    }
+
+    if (n == *len)
+    {
+        return (const char*) data;
+    }
+
+    if (this_thread.sql_size < *len)
+    {
+        this_thread.sql = mxs_realloc(this_thread.sql, *len);
+        this_thread.sql_size = *len;
+    }
+
+    size_t copied = 0;
+
+    do
+    {
+        memcpy(this_thread.sql + copied, data, n);
+        copied += n;
+    }
+    while (gwbuf_iter_next(&iter, &data, &n));
+
+    *len = copied;
+    return this_thread.sql;
+}
+
+/**
+ * Parses a statement and attaches the result to the buffer. If the buffer
+ * already has a result, the statement is parsed again into it, collecting
+ * what was collected earlier and what is asked for now.
+ *
+ * @param query   The buffer containing the statement.
+ * @param collect What information to collect.
+ *
+ * @return True, if the result could be attached to the buffer.
+ */
+static bool parse_query(GWBUF* query, uint32_t collect)
 {
     bool parsed = false;
-    ss_dassert(!query_is_parsed(query));
+    QC_SQLITE_INFO* info = NULL;
+
+    if (query_is_parsed(query))
+    {
+        info = (QC_SQLITE_INFO*) gwbuf_get_buffer_object_data(query, GWBUF_PARSING_INFO);
+        ss_dassert(info);
 
-    QC_SQLITE_INFO* info = info_alloc();
+        collect |= info->collected;
+        info_finish(info);
+        info_init(info);
+    }
 
-    if (info)
+    // TODO: Where is it checked that the GWBUF really contains a query?
+    size_t len;
+    const char* s = get_query_text(query, &len);
+
+    char* key = NULL;
+    size_t key_len = 0;
+    uint32_t hash = 0;
+    QC_CACHE_ENTRY* entry = NULL;
+
+    if (this_unit.cache_size != 0 && len <= QC_CACHE_MAX_QUERY_LEN)
     {
-        this_thread.info = info;
+        key = cache_key(s, len, &key_len);
+        hash = cache_hash(key, key_len);
 
-        // TODO: Somewhere it needs to be ensured that this buffer is contiguous.
-        // TODO: Where is it checked that the GWBUF really contains a query?
-        uint8_t* data = (uint8_t*) GWBUF_DATA(query);
-        size_t len = MYSQL_GET_PACKET_LEN(data) - 1; // Subtract 1 for packet type byte.
+        entry = cache_find(hash, key, key_len);
 
-        const char* s = (const char*) &data[5]; // TODO: Are there symbolic constants somewhere?
+        if (entry && (~entry->info->collected & collect) == 0)
+        {
+            ++this_thread.cache_hits;
+            free(key);
+
+            if (info)
+            {
+                info_assign(info, entry->info);
+            }
+            else
+            {
+                gwbuf_add_buffer_object(query, GWBUF_PARSING_INFO, info_copy(entry->info), buffer_object_free);
+            }
+
+            return true;
+        }
+    }
+
+    bool attach = false;
+
+    if (!info)
+    {
+        info = info_alloc();
+        attach = true;
+    }
+
+    if (info)
+    {
+        this_thread.info = info;
 
         this_thread.info->query = s;
         this_thread.info->query_len = len;
-        parse_query_string(s, len);
+        this_thread.info->collect = collect;
+
+        // The rows of a bulk INSERT that hold only literals add nothing to
+        // the result, so only the statement up to its first row is parsed.
+        size_t prefix_len = qc_get_insert_values_prefix(s, len, NULL);
+        parse_query_string(s, prefix_len > 0 ? prefix_len : len);
         this_thread.info->query = NULL;
         this_thread.info->query_len = 0;
+        this_thread.info->collected = collect;
 
-        // TODO: Add return value to gwbuf_add_buffer_object.
-        // Always added; also when it was not recognized. If it was not recognized now,
-        // it won't be if we try a second time.
-        gwbuf_add_buffer_object(query, GWBUF_PARSING_INFO, info, buffer_object_free);
+        if (key && info_is_cacheable(info))
+        {
+            ++this_thread.cache_misses;
+
+            if (entry)
+            {
+                // The cached result did not contain everything that is now needed.
+                info_free(entry->info);
+                entry->info = info_copy(info);
+            }
+            else
+            {
+                cache_add(hash, key, key_len, info_copy(info));
+                key = NULL;
+            }
+        }
+
+        if (attach)
+        {
+            // TODO: Add return value to gwbuf_add_buffer_object.
+            // Always added; also when it was not recognized. If it was not recognized now,
+            // it won't be if we try a second time.
+            gwbuf_add_buffer_object(query, GWBUF_PARSING_INFO, info, buffer_object_free);
+        }
         parsed = true;
 
         this_thread.info = NULL;
@@ -521,6 +1125,8 @@ static bool parse_query(GWBUF* query)
         MXS_ERROR("qc_sqlite: Could not allocate structure for containing parse data.");
     }
 
+    free(key);
+
     return parsed;
 }
 
@@ -558,6 +1164,11 @@ static void log_invalid_data(GWBUF* query, const char* message)
 
 static void append_affected_field(QC_SQLITE_INFO* info, const char* s)
 {
+    if ((info->collect & QC_COLLECT_FIELDS) == 0)
+    {
+        return;
+    }
+
     size_t len = strlen(s);
     size_t required_len = info->affected_fields_len + len + 1; // 1 for NULL
 
@@ -845,6 +1456,11 @@ static void update_affected_fields_from_select(QC_SQLITE_INFO* info,
 
 static void update_database_names(QC_SQLITE_INFO* info, const char* zDatabase)
 {
+    if ((info->collect & QC_COLLECT_DATABASES) == 0)
+    {
+        return;
+    }
+
     char* zCopy = mxs_strdup(zDatabase);
     exposed_sqlite3Dequote(zCopy);
 
@@ -856,6 +1472,16 @@ static void update_database_names(QC_SQLITE_INFO* info, const char* zDatabase)
 
 static void update_names(QC_SQLITE_INFO* info, const char* zDatabase, const char* zTable)
 {
+    if ((info->collect & QC_COLLECT_TABLES) == 0)
+    {
+        if (zDatabase)
+        {
+            update_database_names(info, zDatabase);
+        }
+
+        return;
+    }
+
     char* zCopy = mxs_strdup(zTable);
     // TODO: Is this call really needed. Check also sqlite3Dequote.
     exposed_sqlite3Dequote(zCopy);
@@ -1362,7 +1988,8 @@ void mxs_sqlite3StartTable(Parse *pParse,   /* Parser context */
             update_names(info, NULL, name);
         }
 
-        info->created_table_name = mxs_strdup(info->table_names[0]);
+        info->created_table_name = mxs_strdup(name);
+        exposed_sqlite3Dequote(info->created_table_name);
     }
     else
     {
@@ -2351,7 +2978,7 @@ static bool qc_sqlite_init(const char* args);
 static void qc_sqlite_end(void);
 static bool qc_sqlite_thread_init(void);
 static void qc_sqlite_thread_end(void);
-static qc_parse_result_t qc_sqlite_parse(GWBUF* query);
+static qc_parse_result_t qc_sqlite_parse(GWBUF* query, uint32_t collect);
 static uint32_t qc_sqlite_get_type(GWBUF* query);
 static qc_query_op_t qc_sqlite_get_operation(GWBUF* query);
 static char* qc_sqlite_get_created_table_name(GWBUF* query);
@@ -2379,6 +3006,7 @@ static bool get_key_and_value(char* arg, const char** pkey, const char** pvalue)
 }
 
 static char ARG_LOG_UNRECOGNIZED_STATEMENTS[] = "log_unrecognized_statements";
+static char ARG_CACHE_SIZE[] = "cache_size";
 
 static bool qc_sqlite_init(const char* args)
 {
@@ -2386,41 +3014,65 @@ static bool qc_sqlite_init(const char* args)
     assert(!this_unit.initialized);
 
     qc_log_level_t log_level = QC_LOG_NOTHING;
+    size_t cache_size = QC_CACHE_DEFAULT_SIZE;
 
     if (args)
     {
-        char arg[strlen(args) + 1];
-        strcpy(arg, args);
+        char copy[strlen(args) + 1];
+        strcpy(copy, args);
 
-        const char* key;
-        const char* value;
+        char* saveptr;
+        char* arg = strtok_r(copy, ",", &saveptr);
 
-        if (get_key_and_value(arg, &key, &value))
+        while (arg)
         {
-            if (strcmp(key, ARG_LOG_UNRECOGNIZED_STATEMENTS) == 0)
+            const char* key;
+            const char* value;
+
+            if (get_key_and_value(arg, &key, &value))
             {
-                char *end;
+                if (strcmp(key, ARG_LOG_UNRECOGNIZED_STATEMENTS) == 0)
+                {
+                    char *end;
 
-                long l = strtol(value, &end, 0);
+                    long l = strtol(value, &end, 0);
 
-                if ((*end == 0) && (l >= QC_LOG_NOTHING) && (l <= QC_LOG_NON_TOKENIZED))
+                    if ((*end == 0) && (l >= QC_LOG_NOTHING) && (l <= QC_LOG_NON_TOKENIZED))
+                    {
+                        log_level = l;
+                    }
+                    else
+                    {
+                        MXS_WARNING("qc_sqlite: '%s' is not a number between %d and %d.",
+                                    value, QC_LOG_NOTHING, QC_LOG_NON_TOKENIZED);
+                    }
+                }
+                else if (strcmp(key, ARG_CACHE_SIZE) == 0)
                 {
-                    log_level = l;
+                    char *end;
+
+                    long l = strtol(value, &end, 0);
+
+                    if ((*end == 0) && (l >= 0))
+                    {
+                        cache_size = l;
+                    }
+                    else
+                    {
+                        MXS_WARNING("qc_sqlite: '%s' is not a non-negative number.", value);
+                    }
                 }
                 else
                 {
-                    MXS_WARNING("qc_sqlite: '%s' is not a number between %d and %d.",
-                                value, QC_LOG_NOTHING, QC_LOG_NON_TOKENIZED);
+                    MXS_WARNING("qc_sqlite: '%s' is not a recognized argument.", key);
                 }
             }
             else
             {
-                MXS_WARNING("qc_sqlite: '%s' is not a recognized argument.", key);
+                MXS_WARNING("qc_sqlite: '%s' is not a recognized argument string.", arg);
             }
-        }
-        else
-        {
-            MXS_WARNING("qc_sqlite: '%s' is not a recognized argument string.", args);
+
+            arg = strtok_r(NULL, ",", &saveptr);
         }
     }
 
@@ -2430,6 +3082,7 @@ static bool qc_sqlite_init(const char* args)
 
         this_unit.initialized = true;
         this_unit.log_level = log_level;
+        this_unit.cache_size = cache_size;
 
         if (qc_sqlite_thread_init())
         {
@@ -2482,6 +3135,15 @@ static void qc_sqlite_end(void)
 
     qc_sqlite_thread_end();
 
+    uint64_t total = this_unit.cache_hits + this_unit.cache_misses;
+
+    if (total != 0)
+    {
+        MXS_NOTICE("qc_sqlite: %" PRIu64 " of %" PRIu64 " cacheable statements (%.1f%%) "
+                   "were classified from the cache.",
+                   this_unit.cache_hits, total, this_unit.cache_hits * 100.0 / total);
+    }
+
     sqlite3_shutdown();
     this_unit.initialized = false;
 }
@@ -2499,6 +3161,20 @@ static bool qc_sqlite_thread_init(void)
         MXS_INFO("qc_sqlite: In-memory sqlite database successfully opened for thread %lu.",
                  (unsigned long) pthread_self());
 
+        this_thread.lookaside = mxs_malloc(QC_LOOKASIDE_SLOT_SIZE * QC_LOOKASIDE_SLOTS);
+
+        rc = sqlite3_db_config(this_thread.db, SQLITE_DBCONFIG_LOOKASIDE, this_thread.lookaside,
+                               QC_LOOKASIDE_SLOT_SIZE, QC_LOOKASIDE_SLOTS);
+
+        if (rc != SQLITE_OK)
+        {
+            MXS_WARNING("qc_sqlite: Could not configure the lookaside memory of the thread "
+                        "specific sqlite database, using the default: %d, %s",
+                        rc, sqlite3_errstr(rc));
+            mxs_free(this_thread.lookaside);
+            this_thread.lookaside = NULL;
+        }
+
         QC_SQLITE_INFO* info = info_alloc();
 
         if (info)
@@ -2527,6 +3203,8 @@ static bool qc_sqlite_thread_init(void)
         {
             sqlite3_close(this_thread.db);
             this_thread.db = NULL;
+            mxs_free(this_thread.lookaside);
+            this_thread.lookaside = NULL;
         }
     }
     else
@@ -2545,6 +3223,20 @@ static void qc_sqlite_thread_end(void)
     ss_dassert(this_thread.initialized);
 
     ss_dassert(this_thread.db);
+
+    if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_INFO))
+    {
+        int hits, miss_size, miss_full, current;
+
+        sqlite3_db_status(this_thread.db, SQLITE_DBSTATUS_LOOKASIDE_HIT, &current, &hits, 0);
+        sqlite3_db_status(this_thread.db, SQLITE_DBSTATUS_LOOKASIDE_MISS_SIZE, &current, &miss_size, 0);
+        sqlite3_db_status(this_thread.db, SQLITE_DBSTATUS_LOOKASIDE_MISS_FULL, &current, &miss_full, 0);
+
+        MXS_INFO("qc_sqlite: Thread %lu took %d allocations from lookaside memory, "
+                 "%d were too large and %d did not fit.",
+                 (unsigned long) pthread_self(), hits, miss_size, miss_full);
+    }
+
     int rc = sqlite3_close(this_thread.db);
 
     if (rc != SQLITE_OK)
@@ -2554,16 +3246,35 @@ static void qc_sqlite_thread_end(void)
     }
 
     this_thread.db = NULL;
+    mxs_free(this_thread.lookaside);
+    this_thread.lookaside = NULL;
+    mxs_free(this_thread.sql);
+    this_thread.sql = NULL;
+    this_thread.sql_size = 0;
+
+    if (this_thread.cache_hits + this_thread.cache_misses != 0)
+    {
+        MXS_INFO("qc_sqlite: Thread %lu classified %" PRIu64 " statements from the cache "
+                 "and parsed %" PRIu64 " cacheable ones.",
+                 (unsigned long) pthread_self(), this_thread.cache_hits, this_thread.cache_misses);
+    }
+
+    __sync_fetch_and_add(&this_unit.cache_hits, this_thread.cache_hits);
+    __sync_fetch_and_add(&this_unit.cache_misses, this_thread.cache_misses);
+    this_thread.cache_hits = 0;
+    this_thread.cache_misses = 0;
+    cache_free();
+
     this_thread.initialized = false;
 }
 
-static qc_parse_result_t qc_sqlite_parse(GWBUF* query)
+static qc_parse_result_t qc_sqlite_parse(GWBUF* query, uint32_t collect)
 {
     QC_TRACE();
     ss_dassert(this_unit.initialized);
     ss_dassert(this_thread.initialized);
 
-    QC_SQLITE_INFO* info = get_query_info(query);
+    QC_SQLITE_INFO* info = get_query_info(query, collect);
 
     return info ? info->status : QC_QUERY_INVALID;
 }
@@ -2575,7 +3286,7 @@ static uint32_t qc_sqlite_get_type(GWBUF* query)
     ss_dassert(this_thread.initialized);
 
     uint32_t types = QUERY_TYPE_UNKNOWN;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_ESSENTIALS);
 
     if (info)
     {
@@ -2603,7 +3314,7 @@ static qc_query_op_t qc_sqlite_get_operation(GWBUF* query)
     ss_dassert(this_thread.initialized);
 
     qc_query_op_t op = QUERY_OP_UNDEFINED;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_ESSENTIALS);
 
     if (info)
     {
@@ -2631,7 +3342,7 @@ static char* qc_sqlite_get_created_table_name(GWBUF* query)
     ss_dassert(this_thread.initialized);
 
     char* created_table_name = NULL;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_ESSENTIALS);
 
     if (info)
     {
@@ -2662,7 +3373,7 @@ static bool qc_sqlite_is_drop_table_query(GWBUF* query)
     ss_dassert(this_thread.initialized);
 
     bool is_drop_table = false;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_ESSENTIALS);
 
     if (info)
     {
@@ -2690,7 +3401,7 @@ static bool qc_sqlite_is_real_query(GWBUF* query)
     ss_dassert(this_thread.initialized);
 
     bool is_real_query = false;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_ESSENTIALS);
 
     if (info)
     {
@@ -2718,7 +3429,7 @@ static char** qc_sqlite_get_table_names(GWBUF* query, int* tblsize, bool fullnam
     ss_dassert(this_thread.initialized);
 
     char** table_names = NULL;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_TABLES);
 
     if (info)
     {
@@ -2773,7 +3484,7 @@ static bool qc_sqlite_query_has_clause(GWBUF* query)
     ss_dassert(this_thread.initialized);
 
     bool has_clause = false;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_ESSENTIALS);
 
     if (info)
     {
@@ -2801,7 +3512,7 @@ static char* qc_sqlite_get_affected_fields(GWBUF* query)
     ss_dassert(this_thread.initialized);
 
     char* affected_fields = NULL;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_FIELDS);
 
     if (info)
     {
@@ -2834,7 +3545,7 @@ static char** qc_sqlite_get_database_names(GWBUF* query, int* sizep)
     ss_dassert(this_thread.initialized);
 
     char** database_names = NULL;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_DATABASES);
 
     if (info)
     {
@@ -0,0 +1,507 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * Measures how fast query classifiers classify a corpus of statements.
+ *
+ * Usage: benchmark [-r rounds] [-t threads] [-a] [-l] [-L p99-limit]
+ *                  -c classifier[=args] [-c classifier[=args] ...] file...
+ *
+ * -r  How many times each thread classifies the corpus, default 100.
+ * -t  The number of threads, default 1.
+ * -a  Collect all information with qc_parse, not only the type and operation.
+ * -l  The files are qlafilter logs and not files in the format of classify,
+ *     where statements are separated by semicolons.
+ * -L  Fail if the 99th percentile latency, in microseconds, of any of the
+ *     classifiers is higher than this.
+ * -c  A classifier and its arguments, e.g. "-c qc_sqlite=cache_size=0".
+ *
+ * For each classifier, the statements per second, the median and the 99th
+ * percentile latency and the number of allocations per statement are
+ * reported. The allocations are counted by interposing malloc, calloc and
+ * realloc; allocations made with other functions are not counted.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <query_classifier.h>
+#include <buffer.h>
+#include <gwdirs.h>
+#include <log_manager.h>
+#include <platform.h>
+
+/** The maximum number of classifiers that can be compared */
+#define MAX_CLASSIFIERS 4
+
+/** The maximum number of latencies recorded by one thread */
+#define MAX_SAMPLES (16 * 1024 * 1024)
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* p, size_t size);
+
+static thread_local unsigned long n_allocations;
+
+void* malloc(size_t size)
+{
+    ++n_allocations;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size)
+{
+    ++n_allocations;
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* p, size_t size)
+{
+    ++n_allocations;
+    return __libc_realloc(p, size);
+}
+
+typedef struct
+{
+    char** stmts;
+    size_t n_stmts;
+    size_t capacity;
+} CORPUS;
+
+typedef struct
+{
+    QUERY_CLASSIFIER* classifier;
+    const CORPUS* corpus;
+    int rounds;
+    bool collect_all;
+    uint32_t* samples;        /*< Latencies in nanoseconds */
+    size_t n_samples;
+    unsigned long n_stmts;
+    unsigned long n_allocations;
+    bool ok;
+} WORKER;
+
+static void corpus_add(CORPUS* corpus, const char* s, size_t len)
+{
+    while (len && (*s == ' ' || *s == '\t' || *s == '\r'))
+    {
+        ++s;
+        --len;
+    }
+
+    if (len == 0)
+    {
+        return;
+    }
+
+    if (corpus->n_stmts == corpus->capacity)
+    {
+        corpus->capacity = corpus->capacity ? corpus->capacity * 2 : 1024;
+        corpus->stmts = realloc(corpus->stmts, corpus->capacity * sizeof(char*));
+    }
+
+    corpus->stmts[corpus->n_stmts++] = strndup(s, len);
+}
+
+static char* read_file(const char* name)
+{
+    char* data = NULL;
+    FILE* file = fopen(name, "rb");
+
+    if (file)
+    {
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+
+        data = malloc(size + 1);
+
+        if (data && fread(data, 1, size, file) == (size_t) size)
+        {
+            data[size] = 0;
+        }
+        else
+        {
+            free(data);
+            data = NULL;
+        }
+
+        fclose(file);
+    }
+
+    return data;
+}
+
+/**
+ * Read the statements of a file to the corpus
+ *
+ * @param corpus The corpus
+ * @param name   The name of the file
+ * @param qla    If true, the file is a qlafilter log with one statement per
+ *               line after the timestamp and the user@host fields
+ * @return True if the file could be read
+ */
+static bool corpus_read(CORPUS* corpus, const char* name, bool qla)
+{
+    char* data = read_file(name);
+
+    if (!data)
+    {
+        fprintf(stderr, "error: Failed to read file %s.\n", name);
+        return false;
+    }
+
+    char* p = data;
+
+    if (qla)
+    {
+        char* line;
+        char* saveptr;
+
+        for (line = strtok_r(data, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr))
+        {
+            char* stmt = strchr(line, ',');
+
+            if (stmt && (stmt = strchr(stmt + 1, ',')))
+            {
+                corpus_add(corpus, stmt + 1, strlen(stmt + 1));
+            }
+        }
+    }
+    else
+    {
+        for (char* q = data; *q; q++)
+        {
+            if (*q == '\n')
+            {
+                *q = ' ';
+            }
+        }
+
+        char* semicolon;
+
+        while ((semicolon = strchr(p, ';')))
+        {
+            corpus_add(corpus, p, semicolon - p);
+            p = semicolon + 1;
+        }
+    }
+
+    free(data);
+    return true;
+}
+
+static GWBUF* create_gwbuf(const char* s)
+{
+    size_t len = strlen(s);
+    size_t payload_len = len + 1;
+    GWBUF* buf = gwbuf_alloc(4 + payload_len);
+
+    if (buf)
+    {
+        uint8_t* data = GWBUF_DATA(buf);
+
+        data[0] = payload_len;
+        data[1] = payload_len >> 8;
+        data[2] = payload_len >> 16;
+        data[3] = 0x00;
+        data[4] = 0x03; // COM_QUERY
+        memcpy(data + 5, s, len);
+    }
+
+    return buf;
+}
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void* worker_main(void* data)
+{
+    WORKER* worker = (WORKER*) data;
+    QUERY_CLASSIFIER* classifier = worker->classifier;
+
+    if (!classifier->qc_thread_init())
+    {
+        fprintf(stderr, "error: Could not initialize the classifier for a thread.\n");
+        return NULL;
+    }
+
+    for (int i = 0; i < worker->rounds; i++)
+    {
+        for (size_t j = 0; j < worker->corpus->n_stmts; j++)
+        {
+            GWBUF* buf = create_gwbuf(worker->corpus->stmts[j]);
+            unsigned long allocations = n_allocations;
+            uint64_t start = now_ns();
+
+            if (worker->collect_all)
+            {
+                classifier->qc_parse(buf, QC_COLLECT_ALL);
+            }
+
+            classifier->qc_get_type(buf);
+            classifier->qc_get_operation(buf);
+
+            uint64_t latency = now_ns() - start;
+            worker->n_allocations += n_allocations - allocations;
+
+            if (worker->n_samples < MAX_SAMPLES)
+            {
+                worker->samples[worker->n_samples++] = latency > UINT32_MAX ? UINT32_MAX : latency;
+            }
+
+            gwbuf_free(buf);
+            worker->n_stmts++;
+        }
+    }
+
+    classifier->qc_thread_end();
+    worker->ok = true;
+
+    return NULL;
+}
+
+static int compare_samples(const void* l, const void* r)
+{
+    uint32_t a = *(const uint32_t*) l;
+    uint32_t b = *(const uint32_t*) r;
+
+    return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+/**
+ * Run the benchmark for one classifier
+ *
+ * @param spec        The classifier name, optionally followed by '=' and its arguments
+ * @param corpus      The statements
+ * @param n_threads   The number of threads
+ * @param rounds      How many times each thread classifies the corpus
+ * @param collect_all Whether all information is collected
+ * @param p99_limit   The highest allowed 99th percentile latency in microseconds, 0 for none
+ * @return True if the benchmark could be run and the latency was acceptable
+ */
+static bool run(const char* spec, const CORPUS* corpus, int n_threads, int rounds,
+                bool collect_all, double p99_limit)
+{
+    char name[strlen(spec) + 1];
+    strcpy(name, spec);
+
+    char* args = strchr(name, '=');
+
+    if (args)
+    {
+        *args++ = 0;
+    }
+
+    char libdir[strlen(name) + 3 + 1]; // "../" and terminating NULL.
+    sprintf(libdir, "../%s", name);
+    set_libdir(strdup(libdir));
+
+    QUERY_CLASSIFIER* classifier = qc_load(name);
+
+    if (!classifier || !classifier->qc_init(args))
+    {
+        fprintf(stderr, "error: Could not load and initialize classifier %s.\n", name);
+        return false;
+    }
+
+    WORKER workers[n_threads];
+    pthread_t threads[n_threads];
+    size_t max_samples = (size_t) rounds * corpus->n_stmts;
+
+    if (max_samples > MAX_SAMPLES)
+    {
+        max_samples = MAX_SAMPLES;
+    }
+
+    for (int i = 0; i < n_threads; i++)
+    {
+        workers[i].classifier = classifier;
+        workers[i].corpus = corpus;
+        workers[i].rounds = rounds;
+        workers[i].collect_all = collect_all;
+        workers[i].samples = malloc(max_samples * sizeof(uint32_t));
+        workers[i].n_samples = 0;
+        workers[i].n_stmts = 0;
+        workers[i].n_allocations = 0;
+        workers[i].ok = false;
+    }
+
+    uint64_t start = now_ns();
+
+    for (int i = 0; i < n_threads; i++)
+    {
+        pthread_create(&threads[i], NULL, worker_main, &workers[i]);
+    }
+
+    for (int i = 0; i < n_threads; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    double seconds = (now_ns() - start) / 1e9;
+    bool ok = true;
+    unsigned long n_stmts = 0;
+    unsigned long allocations = 0;
+    size_t n_samples = 0;
+
+    for (int i = 0; i < n_threads; i++)
+    {
+        ok = ok && workers[i].ok;
+        n_stmts += workers[i].n_stmts;
+        allocations += workers[i].n_allocations;
+        n_samples += workers[i].n_samples;
+    }
+
+    uint32_t* samples = malloc((n_samples ? n_samples : 1) * sizeof(uint32_t));
+    size_t pos = 0;
+
+    for (int i = 0; i < n_threads; i++)
+    {
+        memcpy(samples + pos, workers[i].samples, workers[i].n_samples * sizeof(uint32_t));
+        pos += workers[i].n_samples;
+        free(workers[i].samples);
+    }
+
+    qsort(samples, n_samples, sizeof(uint32_t), compare_samples);
+
+    double p50 = n_samples ? samples[n_samples / 2] / 1000.0 : 0;
+    double p99 = n_samples ? samples[(n_samples * 99) / 100] / 1000.0 : 0;
+
+    printf("%s: %d threads, %lu statements in %.3f s, %.0f statements/s, "
+           "p50 %.2f us, p99 %.2f us, %.2f allocations per statement\n",
+           name, n_threads, n_stmts, seconds, seconds > 0 ? n_stmts / seconds : 0,
+           p50, p99, n_stmts ? (double) allocations / n_stmts : 0);
+
+    if (p99_limit > 0 && p99 > p99_limit)
+    {
+        fprintf(stderr, "error: The p99 latency of %s, %.2f us, exceeds the limit of %.2f us.\n",
+                name, p99, p99_limit);
+        ok = false;
+    }
+
+    free(samples);
+    classifier->qc_end();
+    qc_unload(classifier);
+
+    return ok;
+}
+
+int main(int argc, char** argv)
+{
+    int rc = EXIT_FAILURE;
+    int rounds = 100;
+    int n_threads = 1;
+    bool collect_all = false;
+    bool qla = false;
+    double p99_limit = 0;
+    const char* classifiers[MAX_CLASSIFIERS];
+    int n_classifiers = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "r:t:alL:c:")) != -1)
+    {
+        switch (c)
+        {
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+
+        case 't':
+            n_threads = atoi(optarg);
+            break;
+
+        case 'a':
+            collect_all = true;
+            break;
+
+        case 'l':
+            qla = true;
+            break;
+
+        case 'L':
+            p99_limit = atof(optarg);
+            break;
+
+        case 'c':
+            if (n_classifiers < MAX_CLASSIFIERS)
+            {
+                classifiers[n_classifiers++] = optarg;
+            }
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    if (optind < argc && n_classifiers > 0 && rounds > 0 && n_threads > 0)
+    {
+        CORPUS corpus = {NULL, 0, 0};
+        bool ok = true;
+
+        for (int i = optind; ok && i < argc; i++)
+        {
+            ok = corpus_read(&corpus, argv[i], qla);
+        }
+
+        if (ok && corpus.n_stmts > 0)
+        {
+            set_datadir(strdup("/tmp"));
+            set_langdir(strdup("."));
+            set_process_datadir(strdup("/tmp"));
+
+            if (mxs_log_init(NULL, ".", MXS_LOG_TARGET_DEFAULT))
+            {
+                printf("%lu statements, %d rounds per thread.\n", (unsigned long) corpus.n_stmts, rounds);
+
+                for (int i = 0; ok && i < n_classifiers; i++)
+                {
+                    ok = run(classifiers[i], &corpus, n_threads, rounds, collect_all, p99_limit);
+                }
+
+                rc = ok ? EXIT_SUCCESS : EXIT_FAILURE;
+                mxs_log_finish();
+            }
+            else
+            {
+                fprintf(stderr, "error: %s: Could not initialize log.\n", argv[0]);
+            }
+        }
+        else if (ok)
+        {
+            fprintf(stderr, "error: %s: No statements were found.\n", argv[0]);
+        }
+
+        for (size_t i = 0; i < corpus.n_stmts; i++)
+        {
+            free(corpus.stmts[i]);
+        }
+
+        free(corpus.stmts);
+    }
+    else
+    {
+        fprintf(stderr, "Usage: %s [-r rounds] [-t threads] [-a] [-l] [-L p99-limit] "
+                "-c classifier[=args] [-c classifier[=args] ...] file...\n", argv[0]);
+    }
+
+    return rc;
+}
@@ -298,8 +298,8 @@ bool compare_parse(QUERY_CLASSIFIER* pClassifier1, GWBUF* pCopy1,
     bool success = false;
     const char HEADING[] = "qc_parse                 : ";
 
-    qc_parse_result_t rv1 = pClassifier1->qc_parse(pCopy1);
-    qc_parse_result_t rv2 = pClassifier2->qc_parse(pCopy2);
+    qc_parse_result_t rv1 = pClassifier1->qc_parse(pCopy1, QC_COLLECT_ALL);
+    qc_parse_result_t rv2 = pClassifier2->qc_parse(pCopy2, QC_COLLECT_ALL);
 
     stringstream ss;
     ss << HEADING;
@@ -15,3 +15,10 @@ QUERY_TYPE_SESSION_WRITE
 QUERY_TYPE_READ|QUERY_TYPE_MASTER_READ
 QUERY_TYPE_READ|QUERY_TYPE_MASTER_READ
 QUERY_TYPE_READ|QUERY_TYPE_MASTER_READ
+QUERY_TYPE_READ
+QUERY_TYPE_BEGIN_TRX
+QUERY_TYPE_COMMIT
+QUERY_TYPE_SESSION_WRITE
+QUERY_TYPE_GSYSVAR_WRITE|QUERY_TYPE_BEGIN_TRX|QUERY_TYPE_DISABLE_AUTOCOMMIT
+QUERY_TYPE_WRITE
+QUERY_TYPE_WRITE
@@ -15,3 +15,10 @@ use X;
 select last_insert_id();
 select @@last_insert_id;
 select @@identity;
+select fname, lname from tst where id = 10 order by lname;
+START TRANSACTION;
+COMMIT WORK;
+use `X`;
+SET autocommit=OFF;
+insert into tst (fname, lname) values ('Jane','Doe'),('Daisy','Duck'),('Marie','Curie');
+INSERT IGNORE INTO tst VALUE (1, -2.5e-3, NULL), (0x1f, DEFAULT, 'it''s');
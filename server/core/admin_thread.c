@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file admin_thread.c The thread that runs the administrative commands
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <mysql.h>
+#include <admin_thread.h>
+#include <thread.h>
+#include <atomic.h>
+#include <log_manager.h>
+
+/** The nice value of the admin thread */
+#define ADMIN_THREAD_NICE 10
+
+typedef struct admin_task
+{
+    ADMIN_TASK_FN      task;    /*< The task to call */
+    SESSION           *session; /*< The session that added the task */
+    void              *data;    /*< Data to pass the task */
+    struct admin_task *next;
+} ADMIN_TASK;
+
+static pthread_mutex_t admin_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  admin_cond = PTHREAD_COND_INITIALIZER;
+static ADMIN_TASK     *admin_head = NULL;
+static ADMIN_TASK     *admin_tail = NULL;
+static bool            admin_running = false;
+static bool            admin_stop = false;
+static THREAD          admin_thr;
+
+static void admin_thread_main(void *data)
+{
+    /** A thread's nice value only affects the thread itself on Linux */
+    if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), ADMIN_THREAD_NICE) != 0)
+    {
+        MXS_WARNING("Failed to lower the priority of the admin thread.");
+    }
+
+    mysql_thread_init();
+    pthread_mutex_lock(&admin_lock);
+
+    while (!admin_stop)
+    {
+        if (admin_head == NULL)
+        {
+            pthread_cond_wait(&admin_cond, &admin_lock);
+            continue;
+        }
+
+        ADMIN_TASK *task = admin_head;
+        admin_head = task->next;
+
+        if (admin_head == NULL)
+        {
+            admin_tail = NULL;
+        }
+
+        pthread_mutex_unlock(&admin_lock);
+
+        mxs_log_tls.li_sesid = task->session->ses_id;
+        task->task(task->session, task->data);
+        mxs_log_tls.li_sesid = 0;
+
+        /** Release the reference taken in admin_task_add */
+        session_free(task->session);
+        free(task);
+
+        pthread_mutex_lock(&admin_lock);
+    }
+
+    pthread_mutex_unlock(&admin_lock);
+    mysql_thread_end();
+}
+
+/**
+ * Start the admin thread
+ */
+void
+admin_thread_init()
+{
+    if (thread_start(&admin_thr, admin_thread_main, NULL) == NULL)
+    {
+        MXS_ERROR("Failed to start the admin thread, administrative "
+                  "commands are run in the worker threads.");
+    }
+    else
+    {
+        admin_running = true;
+    }
+}
+
+/**
+ * Stop the admin thread. Tasks that have not yet started are not run.
+ */
+void
+admin_thread_shutdown()
+{
+    pthread_mutex_lock(&admin_lock);
+    admin_stop = true;
+    admin_running = false;
+    pthread_cond_signal(&admin_cond);
+    pthread_mutex_unlock(&admin_lock);
+}
+
+/**
+ * Add a task for the admin thread
+ *
+ * @param session The session the task is run for
+ * @param task    The task to call
+ * @param data    Data to pass the task
+ * @return True if the task was added, false if the admin thread is not running
+ *         or memory allocation failed. The caller should then run the task itself.
+ */
+bool
+admin_task_add(SESSION *session, ADMIN_TASK_FN task, void *data)
+{
+    ADMIN_TASK *t;
+
+    if (!admin_running || (t = malloc(sizeof(ADMIN_TASK))) == NULL)
+    {
+        return false;
+    }
+
+    t->task = task;
+    t->session = session;
+    t->data = data;
+    t->next = NULL;
+
+    /** The session stays allocated until the task has been run */
+    atomic_add(&session->refcount, 1);
+
+    pthread_mutex_lock(&admin_lock);
+
+    if (admin_stop)
+    {
+        pthread_mutex_unlock(&admin_lock);
+        session_free(session);
+        free(t);
+        return false;
+    }
+
+    if (admin_tail)
+    {
+        admin_tail->next = t;
+    }
+    else
+    {
+        admin_head = t;
+    }
+
+    admin_tail = t;
+    pthread_cond_signal(&admin_cond);
+    pthread_mutex_unlock(&admin_lock);
+
+    return true;
+}
@@ -0,0 +1,749 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file corebench.c Microbenchmarks of the core primitives
+ *
+ * Each benchmark is run with 1, 2, 4, ... threads up to the maximum number of
+ * threads. The threads start at the same time and each does the same number
+ * of operations, either on shared data to measure the contention or on data
+ * of its own to measure the scaling. The results are written as JSON so that
+ * the runs before and after a change can be compared:
+ *
+ * @verbatim
+ * {
+ *   "processors": 8,
+ *   "results": [
+ *     {"benchmark": "gwbuf_alloc_free", "threads": 1, "operations": 2000000,
+ *      "seconds": 0.081, "ops_per_sec": 24691358, "ns_per_op": 40.5},
+ *     ...
+ *   ]
+ * }
+ * @endverbatim
+ *
+ * The ns_per_op value is the time each thread used for an operation, so it
+ * is the same for all thread counts if a primitive scales perfectly.
+ *
+ * Usage: corebench [-t max_threads] [-s scale] [-b benchmark] [-o file] [-l logdir]
+ */
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <buffer.h>
+#include <gw.h>
+#include <hashtable.h>
+#include <ilist.h>
+#include <log_manager.h>
+#include <maxconfig.h>
+#include <mlist.h>
+#include <modutil.h>
+#include <mpsc_queue.h>
+#include <mysql_client_server_protocol.h>
+#include <queuemanager.h>
+#include <slist.h>
+#include <spinlock.h>
+#include <statistics.h>
+#include <utils.h>
+
+/** Number of keys in the hashtable benchmarks */
+#define BENCH_HASH_KEYS     10000
+
+/** Number of packets in the buffer of the packet extraction benchmark */
+#define BENCH_PACKETS       100
+
+/** Number of nodes each thread has in the lock-free queue benchmark */
+#define BENCH_MPSC_NODES    64
+
+/** A benchmark */
+typedef struct
+{
+    const char *name;
+    long        operations; /*< Operations done by each thread with scale 1 */
+    void      *(*setup)(int n_threads);
+    void       (*run)(void *data, int thread_id, long operations);
+    void       (*teardown)(void *data);
+} BENCHMARK;
+
+/** The arguments of a benchmark thread */
+typedef struct
+{
+    const BENCHMARK   *bench;
+    void              *data;
+    int                thread_id;
+    long               operations;
+    pthread_barrier_t *barrier;
+} BENCH_THREAD;
+
+/*
+ * Buffers
+ */
+
+static void
+run_gwbuf_alloc_free(void *data, int thread_id, long operations)
+{
+    for (long i = 0; i < operations; i++)
+    {
+        gwbuf_free(gwbuf_alloc(64 + (i & 1023)));
+    }
+}
+
+static void
+run_gwbuf_clone(void *data, int thread_id, long operations)
+{
+    GWBUF *buf = gwbuf_alloc(1024);
+
+    for (long i = 0; i < operations; i++)
+    {
+        gwbuf_free(gwbuf_clone(buf));
+    }
+
+    gwbuf_free(buf);
+}
+
+static void
+run_gwbuf_split(void *data, int thread_id, long operations)
+{
+    for (long i = 0; i < operations; i++)
+    {
+        GWBUF *buf = gwbuf_alloc(1024);
+        GWBUF *head = gwbuf_split(&buf, 100 + (i & 511));
+        gwbuf_free(head);
+        gwbuf_free(buf);
+    }
+}
+
+/*
+ * Hashtables
+ */
+
+static int bench_keys[BENCH_HASH_KEYS];
+
+static int
+bench_hash(void *key)
+{
+    return *(int *)key * 2654435761U;
+}
+
+static int
+bench_cmp(void *v1, void *v2)
+{
+    int i1 = *(int *)v1;
+    int i2 = *(int *)v2;
+
+    return i1 < i2 ? -1 : (i1 > i2 ? 1 : 0);
+}
+
+static void *
+setup_hashtable(int n_threads, bool concurrent)
+{
+    HASHTABLE *table = concurrent ? hashtable_alloc_concurrent(BENCH_HASH_KEYS, bench_hash, bench_cmp) :
+                       hashtable_alloc(BENCH_HASH_KEYS, bench_hash, bench_cmp);
+
+    for (int i = 0; table && i < BENCH_HASH_KEYS; i++)
+    {
+        bench_keys[i] = i;
+        hashtable_add(table, &bench_keys[i], &bench_keys[i]);
+    }
+
+    return table;
+}
+
+static void *
+setup_hashtable_plain(int n_threads)
+{
+    return setup_hashtable(n_threads, false);
+}
+
+static void *
+setup_hashtable_concurrent(int n_threads)
+{
+    return setup_hashtable(n_threads, true);
+}
+
+static void
+teardown_hashtable(void *data)
+{
+    hashtable_free(data);
+}
+
+static void
+run_hashtable_fetch(void *data, int thread_id, long operations)
+{
+    unsigned int seed = thread_id;
+
+    for (long i = 0; i < operations; i++)
+    {
+        int key = rand_r(&seed) % BENCH_HASH_KEYS;
+
+        if (hashtable_fetch(data, &key) == NULL)
+        {
+            fprintf(stderr, "Key %d was not found\n", key);
+            exit(1);
+        }
+    }
+}
+
+/** Each thread adds and deletes keys of its own in the shared table */
+static void
+run_hashtable_add_delete(void *data, int thread_id, long operations)
+{
+    int *keys = malloc(sizeof(int) * 64);
+
+    for (int i = 0; i < 64; i++)
+    {
+        keys[i] = BENCH_HASH_KEYS + thread_id * 64 + i;
+    }
+
+    for (long i = 0; i < operations; i++)
+    {
+        int *key = &keys[i & 63];
+
+        if (i & 64)
+        {
+            hashtable_delete(data, key);
+        }
+        else
+        {
+            hashtable_add(data, key, key);
+        }
+    }
+
+    for (int i = 0; i < 64; i++)
+    {
+        hashtable_delete(data, &keys[i]);
+    }
+
+    free(keys);
+}
+
+/*
+ * Locks and statistics
+ */
+
+typedef struct
+{
+    SPINLOCK lock;
+    long     counter;
+} BENCH_LOCK;
+
+static void *
+setup_spinlock(int n_threads)
+{
+    BENCH_LOCK *bl = calloc(1, sizeof(BENCH_LOCK));
+
+    if (bl)
+    {
+        spinlock_init(&bl->lock);
+    }
+
+    return bl;
+}
+
+static void
+run_spinlock(void *data, int thread_id, long operations)
+{
+    BENCH_LOCK *bl = data;
+
+    for (long i = 0; i < operations; i++)
+    {
+        spinlock_acquire(&bl->lock);
+        bl->counter++;
+        spinlock_release(&bl->lock);
+    }
+}
+
+static void *
+setup_ts_stats(int n_threads)
+{
+    return ts_stats_alloc();
+}
+
+static void
+teardown_ts_stats(void *data)
+{
+    ts_stats_free(data);
+}
+
+static void
+run_ts_stats_add(void *data, int thread_id, long operations)
+{
+    ts_stats_set_thread_id(thread_id);
+
+    for (long i = 0; i < operations; i++)
+    {
+        ts_stats_add(data, 1);
+    }
+}
+
+/*
+ * Lists and queues
+ */
+
+/**
+ * The lists are not thread-safe, each thread uses a list of its own. The lists
+ * free the data of their nodes so it is allocated here.
+ */
+static void
+run_mlist(void *data, int thread_id, long operations)
+{
+    mlist_t *list = mlist_init(NULL, NULL, NULL, NULL, 1024);
+
+    for (long i = 0; i < operations; i++)
+    {
+        mlist_add_data_nomutex(list, malloc(sizeof(long)));
+
+        if (i & 1)
+        {
+            mlist_node_done(mlist_detach_first(list));
+            mlist_node_done(mlist_detach_first(list));
+        }
+    }
+
+    mlist_done(list);
+}
+
+static void
+run_slist(void *data, int thread_id, long operations)
+{
+    slist_cursor_t *cursor = slist_init();
+
+    for (long i = 0; i < operations; i++)
+    {
+        slcursor_add_data(cursor, malloc(sizeof(long)));
+
+        if ((i & 15) == 15)
+        {
+            /** Walk the list like the users of the list do */
+            slcursor_move_to_begin(cursor);
+            while (slcursor_step_ahead(cursor))
+            {
+                ;
+            }
+        }
+
+        if ((i & 1023) == 1023)
+        {
+            slist_done(cursor);
+            cursor = slist_init();
+        }
+    }
+
+    slist_done(cursor);
+}
+
+/** The intrusive list does the same as the mlist benchmark without allocating */
+static void
+run_ilist(void *data, int thread_id, long operations)
+{
+    static __thread struct
+    {
+        long       value;
+        ILIST_NODE node;
+    } items[1024];
+    ILIST list;
+
+    ilist_init(&list);
+
+    for (long i = 0; i < operations; i++)
+    {
+        ilist_push_back(&list, &items[i & 1023].node);
+
+        if (i & 1)
+        {
+            ilist_pop_front(&list);
+            ilist_pop_front(&list);
+        }
+    }
+}
+
+/** A node of the lock-free queue benchmark */
+typedef struct
+{
+    MPSC_NODE node;
+    int       queued; /*< Set by the producer, cleared by the consumer */
+} BENCH_MPSC_NODE;
+
+typedef struct
+{
+    MPSC_QUEUE      queue;
+    BENCH_MPSC_NODE nodes[];
+} BENCH_MPSC;
+
+static void *
+setup_mpsc_queue(int n_threads)
+{
+    BENCH_MPSC *bench = calloc(1, sizeof(BENCH_MPSC) +
+                               n_threads * BENCH_MPSC_NODES * sizeof(BENCH_MPSC_NODE));
+
+    if (bench)
+    {
+        mpsc_queue_init(&bench->queue);
+    }
+
+    return bench;
+}
+
+/**
+ * All threads push their own nodes to the same queue and the first thread
+ * also pops them. A node that is still in the queue is not pushed again.
+ */
+static void
+run_mpsc_queue(void *data, int thread_id, long operations)
+{
+    BENCH_MPSC *bench = data;
+    BENCH_MPSC_NODE *nodes = &bench->nodes[thread_id * BENCH_MPSC_NODES];
+
+    for (long i = 0; i < operations; i++)
+    {
+        BENCH_MPSC_NODE *node = &nodes[i % BENCH_MPSC_NODES];
+
+        if (!__atomic_load_n(&node->queued, __ATOMIC_ACQUIRE))
+        {
+            node->queued = 1;
+            mpsc_queue_push(&bench->queue, &node->node);
+        }
+
+        if (thread_id == 0)
+        {
+            MPSC_NODE *popped = mpsc_queue_pop(&bench->queue);
+
+            if (popped)
+            {
+                BENCH_MPSC_NODE *done = ILIST_ENTRY(popped, BENCH_MPSC_NODE, node);
+                __atomic_store_n(&done->queued, 0, __ATOMIC_RELEASE);
+            }
+        }
+    }
+}
+
+static void *
+setup_queue(int n_threads)
+{
+    return mxs_queue_alloc(CONNECTION_QUEUE_LIMIT, 0);
+}
+
+static void
+teardown_queue(void *data)
+{
+    mxs_queue_free(data);
+}
+
+static void
+run_queue(void *data, int thread_id, long operations)
+{
+    QUEUE_ENTRY entry;
+    uint64_t now = mxs_queue_now();
+
+    for (long i = 0; i < operations; i++)
+    {
+        mxs_enqueue(data, &bench_keys[i & 1023], i % QUEUE_PRIORITIES);
+        mxs_dequeue(data, now, &entry);
+    }
+}
+
+/*
+ * Protocol and logging
+ */
+
+static void *
+setup_packets(int n_threads)
+{
+    const char *sql = "SELECT id, name, value FROM t1 WHERE id = 1234";
+    int len = strlen(sql) + 1;
+    GWBUF *buf = gwbuf_alloc(BENCH_PACKETS * (MYSQL_HEADER_LEN + len));
+
+    if (buf)
+    {
+        uint8_t *ptr = GWBUF_DATA(buf);
+
+        for (int i = 0; i < BENCH_PACKETS; i++)
+        {
+            ptr[0] = len;
+            ptr[1] = 0;
+            ptr[2] = 0;
+            ptr[3] = 0;
+            ptr[4] = 0x03;
+            memcpy(ptr + 5, sql, len - 1);
+            ptr += MYSQL_HEADER_LEN + len;
+        }
+    }
+
+    return buf;
+}
+
+static void
+teardown_packets(void *data)
+{
+    gwbuf_free(data);
+}
+
+/** One operation is the extraction of one packet */
+static void
+run_packets(void *data, int thread_id, long operations)
+{
+    for (long i = 0; i < operations; i += BENCH_PACKETS)
+    {
+        GWBUF *readbuf = gwbuf_clone(data);
+        GWBUF *packet;
+
+        while ((packet = modutil_get_next_MySQL_packet(&readbuf)))
+        {
+            gwbuf_free(packet);
+        }
+    }
+}
+
+static void
+run_log_message(void *data, int thread_id, long operations)
+{
+    for (long i = 0; i < operations; i++)
+    {
+        MXS_NOTICE("corebench thread %d message %ld", thread_id, i);
+    }
+}
+
+static const BENCHMARK benchmarks[] =
+{
+    {"gwbuf_alloc_free", 2000000, NULL, run_gwbuf_alloc_free, NULL},
+    {"gwbuf_clone", 2000000, NULL, run_gwbuf_clone, NULL},
+    {"gwbuf_split", 1000000, NULL, run_gwbuf_split, NULL},
+    {"hashtable_fetch", 2000000, setup_hashtable_plain, run_hashtable_fetch, teardown_hashtable},
+    {"hashtable_fetch_concurrent", 2000000, setup_hashtable_concurrent, run_hashtable_fetch,
+     teardown_hashtable},
+    {"hashtable_add_delete", 1000000, setup_hashtable_plain, run_hashtable_add_delete,
+     teardown_hashtable},
+    {"hashtable_add_delete_concurrent", 1000000, setup_hashtable_concurrent,
+     run_hashtable_add_delete, teardown_hashtable},
+    {"spinlock", 2000000, setup_spinlock, run_spinlock, free},
+    {"ts_stats_add", 10000000, setup_ts_stats, run_ts_stats_add, teardown_ts_stats},
+    {"mlist", 1000000, NULL, run_mlist, NULL},
+    {"slist", 1000000, NULL, run_slist, NULL},
+    {"ilist", 1000000, NULL, run_ilist, NULL},
+    {"mpsc_queue", 2000000, setup_mpsc_queue, run_mpsc_queue, free},
+    {"queue", 2000000, setup_queue, run_queue, teardown_queue},
+    {"modutil_get_next_MySQL_packet", 2000000, setup_packets, run_packets, teardown_packets},
+    {"mxs_log_message", 200000, NULL, run_log_message, NULL},
+    {NULL}
+};
+
+static double
+bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void *
+bench_thread(void *arg)
+{
+    BENCH_THREAD *bt = arg;
+
+    pthread_barrier_wait(bt->barrier);
+    bt->bench->run(bt->data, bt->thread_id, bt->operations);
+    gwbuf_thread_end();
+
+    return NULL;
+}
+
+/**
+ * Run a benchmark with a number of threads
+ *
+ * @param bench         The benchmark
+ * @param n_threads     Number of threads
+ * @param operations    Operations done by each thread
+ * @return Wall clock time in seconds, a negative value on error
+ */
+static double
+bench_run(const BENCHMARK *bench, int n_threads, long operations)
+{
+    pthread_t threads[n_threads];
+    BENCH_THREAD args[n_threads];
+    pthread_barrier_t barrier;
+    void *data = bench->setup ? bench->setup(n_threads) : NULL;
+
+    if (bench->setup && data == NULL)
+    {
+        return -1;
+    }
+
+    pthread_barrier_init(&barrier, NULL, n_threads + 1);
+
+    for (int i = 0; i < n_threads; i++)
+    {
+        args[i].bench = bench;
+        args[i].data = data;
+        args[i].thread_id = i;
+        args[i].operations = operations;
+        args[i].barrier = &barrier;
+
+        if (pthread_create(&threads[i], NULL, bench_thread, &args[i]) != 0)
+        {
+            fprintf(stderr, "Failed to start a thread\n");
+            exit(1);
+        }
+    }
+
+    pthread_barrier_wait(&barrier);
+    double start = bench_now();
+
+    for (int i = 0; i < n_threads; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    double seconds = bench_now() - start;
+    pthread_barrier_destroy(&barrier);
+
+    if (bench->teardown)
+    {
+        bench->teardown(data);
+    }
+
+    return seconds;
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-t max_threads] [-s scale] [-b benchmark] [-o file] [-l logdir]\n"
+            "\n"
+            "  -t  Largest number of threads, the default is twice the number of processors\n"
+            "  -s  Multiplier of the number of operations, default 1\n"
+            "  -b  Run only the benchmarks whose name starts with this\n"
+            "  -o  Write the results to this file instead of the standard output\n"
+            "  -l  Directory of the log file written by mxs_log_message, default /tmp\n"
+            "\n"
+            "Benchmarks:\n", name);
+
+    for (const BENCHMARK *b = benchmarks; b->name; b++)
+    {
+        fprintf(stderr, "  %s\n", b->name);
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    int max_threads = get_processor_count() * 2;
+    double scale = 1.0;
+    const char *filter = NULL;
+    const char *logdir = "/tmp";
+    FILE *out = stdout;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:s:b:o:l:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 's':
+            scale = atof(optarg);
+            break;
+        case 'b':
+            filter = optarg;
+            break;
+        case 'o':
+            if ((out = fopen(optarg, "w")) == NULL)
+            {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        case 'l':
+            logdir = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (max_threads < 1 || scale <= 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /** The thread ids of the statistics go up to the number of threads */
+    config_get_global_options()->n_threads = max_threads;
+    ts_stats_init();
+
+    if (!mxs_log_init(NULL, logdir, MXS_LOG_TARGET_FS))
+    {
+        fprintf(stderr, "Failed to initialize the log in %s\n", logdir);
+        return 1;
+    }
+
+    MXS_LOG_THROTTLING throttling = {0, 0, 0};
+    mxs_log_set_throttling(&throttling);
+    mxs_log_set_syslog_enabled(false);
+
+    fprintf(out, "{\n  \"processors\": %d,\n  \"results\": [", (int)get_processor_count());
+    bool first = true;
+    int rval = 0;
+
+    for (const BENCHMARK *b = benchmarks; b->name; b++)
+    {
+        if (filter && strncmp(b->name, filter, strlen(filter)) != 0)
+        {
+            continue;
+        }
+
+        long operations = b->operations * scale;
+
+        for (int n = 1;; n = n * 2 < max_threads ? n * 2 : max_threads)
+        {
+            double seconds = bench_run(b, n, operations);
+
+            if (seconds < 0)
+            {
+                fprintf(stderr, "Failed to set up benchmark %s\n", b->name);
+                rval = 1;
+                break;
+            }
+
+            long total = operations * n;
+            fprintf(out, "%s\n    {\"benchmark\": \"%s\", \"threads\": %d, \"operations\": %ld, "
+                    "\"seconds\": %.6f, \"ops_per_sec\": %.0f, \"ns_per_op\": %.2f}",
+                    first ? "" : ",", b->name, n, total, seconds, total / seconds,
+                    seconds * 1000000000.0 * n / total);
+            fflush(out);
+            first = false;
+
+            if (n == max_threads)
+            {
+                break;
+            }
+        }
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+
+    mxs_log_finish();
+    return rval;
+}
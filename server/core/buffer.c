@@ -34,10 +34,15 @@
  *                                      accessed by "show buffers" maxadmin command
  * 20/12/2015   Martin Brampton         Change gwbuf_free to free the whole list; add the
  *                                      gwbuf_count and gwbuf_alloc_and_load functions.
+ * 14/10/2016                           Share the hints and properties between clones
+ *                                      instead of locking each buffer.
+ * 14/10/2016                           Add gwbuf_iter, gwbuf_iovec and gwbuf_compare
  *
  * @endverbatim
  */
 #include <stdlib.h>
+#include <stddef.h>
+#include <inttypes.h>
 #include <buffer.h>
 #include <atomic.h>
 #include <skygw_debug.h>
@@ -45,6 +50,9 @@
 #include <spinlock.h>
 #include <hint.h>
 #include <log_manager.h>
+#include <platform.h>
+#include <dcb.h>
+#include <hugepage.h>
 #include <errno.h>
 
 #if defined(BUFFER_TRACE)
@@ -54,9 +62,83 @@
 static HASHTABLE *buffer_hashtable = NULL;
 #endif
 
+/**
+ * A buffer allocated in one block. The buffer header, the shared buffer and
+ * the data all live in the same allocation.
+ */
+typedef struct gwbuf_block
+{
+    GWBUF           buf;    /*< The header of the buffer that owns the block */
+    SHARED_BUF      sbuf;   /*< The shared buffer */
+    unsigned char   data[]; /*< The data of the buffer */
+} GWBUF_BLOCK;
+
+/** An entry on a free list of the buffer pools */
+typedef struct gwbuf_free_entry
+{
+    struct gwbuf_free_entry *next;
+} GWBUF_FREE_ENTRY;
+
+/**
+ * The data sizes of the block size classes. The smallest class is for the
+ * OK and EOF packets, pings and other tiny buffers so that they don't take
+ * up more memory than the header of the buffer itself.
+ */
+static const unsigned int gwbuf_class_sizes[] = {GWBUF_SMALL_SIZE, 128, 512, 2048, 8192, GWBUF_MAX_POOLED_SIZE};
+
+#define GWBUF_N_CLASSES (sizeof(gwbuf_class_sizes) / sizeof(gwbuf_class_sizes[0]))
+
+/** The maximum number of bytes a thread keeps in the pool of one size class */
+#define GWBUF_POOL_MAX_BYTES (256 * 1024)
+
+/** The maximum number of free clone headers a thread keeps */
+#define GWBUF_POOL_MAX_HEADERS 1024
+
+/**
+ * The buffer pool statistics of one thread. These are allocated on first use
+ * and linked together so that the totals of all threads can be shown.
+ */
+typedef struct gwbuf_pool_stats
+{
+    int64_t hits[GWBUF_N_CLASSES];      /*< Blocks taken from the pool */
+    int64_t misses[GWBUF_N_CLASSES];    /*< Blocks allocated from the arenas */
+    int64_t header_hits;                /*< Clone headers taken from the pool */
+    int64_t header_misses;              /*< Clone headers allocated from the arena */
+    int64_t oversized;                  /*< Blocks too large for any size class */
+    struct gwbuf_pool_stats *next;
+    struct gwbuf_pool_stats *next_spare; /*< Next statistics of a stopped thread */
+} GWBUF_POOL_STATS;
+
+static GWBUF_POOL_STATS *all_pool_stats = NULL;
+static GWBUF_POOL_STATS *spare_pool_stats = NULL; /*< Reused by the threads that start */
+static SPINLOCK pool_stats_lock = SPINLOCK_INIT;
+
+/**
+ * The memory of the blocks and clone headers that are not found in the pools
+ * of the threads. The sizes are those of gwbuf_class_sizes.
+ */
+static HUGEPAGE_ARENA gwbuf_arenas[GWBUF_N_CLASSES] =
+{
+    HUGEPAGE_ARENA_INIT("buffer 64", sizeof(GWBUF_BLOCK) + GWBUF_SMALL_SIZE),
+    HUGEPAGE_ARENA_INIT("buffer 128", sizeof(GWBUF_BLOCK) + 128),
+    HUGEPAGE_ARENA_INIT("buffer 512", sizeof(GWBUF_BLOCK) + 512),
+    HUGEPAGE_ARENA_INIT("buffer 2048", sizeof(GWBUF_BLOCK) + 2048),
+    HUGEPAGE_ARENA_INIT("buffer 8192", sizeof(GWBUF_BLOCK) + 8192),
+    HUGEPAGE_ARENA_INIT("buffer 16384", sizeof(GWBUF_BLOCK) + GWBUF_MAX_POOLED_SIZE)
+};
+static HUGEPAGE_ARENA gwbuf_header_arena = HUGEPAGE_ARENA_INIT("buffer header", sizeof(GWBUF));
+
+static thread_local GWBUF_FREE_ENTRY *thread_blocks[GWBUF_N_CLASSES];
+static thread_local int thread_nblocks[GWBUF_N_CLASSES];
+static thread_local GWBUF_FREE_ENTRY *thread_headers = NULL;
+static thread_local int thread_nheaders = 0;
+static thread_local GWBUF_POOL_STATS *thread_pool_stats = NULL;
+static GWBUF_POOL_STATS dummy_pool_stats;
+
 static void gwbuf_free_one(GWBUF *buf);
-static buffer_object_t* gwbuf_remove_buffer_object(GWBUF*           buf,
-                                                   buffer_object_t* bufobj);
+static buffer_object_t* gwbuf_remove_buffer_object(buffer_object_t* bufobj);
+static BUF_PROPERTY *gwbuf_share_properties(BUF_PROPERTY *prop);
+static void gwbuf_release_properties(BUF_PROPERTY *prop);
 
 #if defined(BUFFER_TRACE)
 static void gwbuf_add_to_hashtable(GWBUF *buf);
@@ -65,12 +147,403 @@ static int bcmpfn (void *key1, void *key2);
 static void gwbuf_remove_from_hashtable(GWBUF *buf);
 #endif
 
+/**
+ * Return the buffer pool statistics of the calling thread
+ *
+ * @return The statistics of this thread
+ */
+static GWBUF_POOL_STATS *
+gwbuf_pool_stats(void)
+{
+    if (thread_pool_stats == NULL && spare_pool_stats)
+    {
+        spinlock_acquire(&pool_stats_lock);
+        if ((thread_pool_stats = spare_pool_stats) != NULL)
+        {
+            spare_pool_stats = thread_pool_stats->next_spare;
+        }
+        spinlock_release(&pool_stats_lock);
+    }
+
+    if (thread_pool_stats == NULL)
+    {
+        GWBUF_POOL_STATS *stats = (GWBUF_POOL_STATS *)calloc(1, sizeof(GWBUF_POOL_STATS));
+
+        if (stats == NULL)
+        {
+            /** The statistics of this thread are lost but the pools still work */
+            return &dummy_pool_stats;
+        }
+        spinlock_acquire(&pool_stats_lock);
+        stats->next = all_pool_stats;
+        all_pool_stats = stats;
+        spinlock_release(&pool_stats_lock);
+        thread_pool_stats = stats;
+    }
+    return thread_pool_stats;
+}
+
+/**
+ * Release the buffer pools of a thread that stops. The blocks are returned to
+ * their arenas and the statistics are kept in the totals and reused by the
+ * next thread that starts.
+ */
+void
+gwbuf_thread_end(void)
+{
+    for (int i = 0; i < GWBUF_N_CLASSES; i++)
+    {
+        while (thread_blocks[i])
+        {
+            GWBUF_FREE_ENTRY *entry = thread_blocks[i];
+            thread_blocks[i] = entry->next;
+            hugepage_free(&gwbuf_arenas[i], entry);
+        }
+        thread_nblocks[i] = 0;
+    }
+
+    while (thread_headers)
+    {
+        GWBUF_FREE_ENTRY *entry = thread_headers;
+        thread_headers = entry->next;
+        hugepage_free(&gwbuf_header_arena, entry);
+    }
+    thread_nheaders = 0;
+
+    if (thread_pool_stats)
+    {
+        spinlock_acquire(&pool_stats_lock);
+        thread_pool_stats->next_spare = spare_pool_stats;
+        spare_pool_stats = thread_pool_stats;
+        spinlock_release(&pool_stats_lock);
+        thread_pool_stats = NULL;
+    }
+}
+
+/**
+ * Find the size class of a data size
+ *
+ * @param size The size of the data
+ * @return The index of the smallest class that fits the data or -1 if the
+ * data does not fit into any class
+ */
+static inline int
+gwbuf_size_class(unsigned int size)
+{
+    for (int i = 0; i < GWBUF_N_CLASSES; i++)
+    {
+        if (size <= gwbuf_class_sizes[i])
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Get a block for a buffer of a given size
+ *
+ * Blocks of a size class are taken from the pool of the calling thread when
+ * possible. Blocks too large for any size class are allocated exactly.
+ *
+ * @param size The size of the data
+ * @return A block with sbuf.pool set or NULL if memory could not be allocated
+ */
+static GWBUF_BLOCK *
+gwbuf_get_block(unsigned int size)
+{
+    GWBUF_POOL_STATS *stats = gwbuf_pool_stats();
+    int pool = gwbuf_size_class(size);
+    GWBUF_BLOCK *block;
+
+    if (pool == -1)
+    {
+        stats->oversized++;
+        block = (GWBUF_BLOCK *)malloc(sizeof(GWBUF_BLOCK) + size);
+    }
+    else if (thread_blocks[pool])
+    {
+        stats->hits[pool]++;
+        block = (GWBUF_BLOCK *)thread_blocks[pool];
+        thread_blocks[pool] = thread_blocks[pool]->next;
+        thread_nblocks[pool]--;
+    }
+    else
+    {
+        stats->misses[pool]++;
+        block = (GWBUF_BLOCK *)hugepage_alloc(&gwbuf_arenas[pool]);
+    }
+
+    if (block)
+    {
+        block->sbuf.pool = pool;
+    }
+    return block;
+}
+
+/**
+ * Release a block to the pool of the calling thread, its arena or back to the system
+ *
+ * @param block The block to release
+ */
+static void
+gwbuf_release_block(GWBUF_BLOCK *block)
+{
+    int pool = block->sbuf.pool;
+
+    if (pool != -1 &&
+        thread_nblocks[pool] < GWBUF_POOL_MAX_BYTES / gwbuf_class_sizes[pool])
+    {
+        GWBUF_FREE_ENTRY *entry = (GWBUF_FREE_ENTRY *)block;
+        entry->next = thread_blocks[pool];
+        thread_blocks[pool] = entry;
+        thread_nblocks[pool]++;
+    }
+    else if (pool != -1)
+    {
+        hugepage_free(&gwbuf_arenas[pool], block);
+    }
+    else
+    {
+        free(block);
+    }
+}
+
+/**
+ * Get a header for a buffer that shares the data of another buffer
+ *
+ * @return A new uninitialised buffer header or NULL if memory could not be allocated
+ */
+static GWBUF *
+gwbuf_get_header(void)
+{
+    GWBUF_POOL_STATS *stats = gwbuf_pool_stats();
+    GWBUF *rval;
+
+    if (thread_headers)
+    {
+        stats->header_hits++;
+        rval = (GWBUF *)thread_headers;
+        thread_headers = thread_headers->next;
+        thread_nheaders--;
+    }
+    else
+    {
+        stats->header_misses++;
+        rval = (GWBUF *)hugepage_alloc(&gwbuf_header_arena);
+    }
+    return rval;
+}
+
+/**
+ * Release a buffer header allocated with gwbuf_get_header
+ *
+ * @param buf The header to release
+ */
+static void
+gwbuf_release_header(GWBUF *buf)
+{
+    if (thread_nheaders < GWBUF_POOL_MAX_HEADERS)
+    {
+        GWBUF_FREE_ENTRY *entry = (GWBUF_FREE_ENTRY *)buf;
+        entry->next = thread_headers;
+        thread_headers = entry;
+        thread_nheaders++;
+    }
+    else
+    {
+        hugepage_free(&gwbuf_header_arena, buf);
+    }
+}
+
+/**
+ * Check whether a buffer is the header embedded in the block of its data
+ *
+ * @param buf The buffer to check
+ * @return True if the header is part of the data block
+ */
+static inline bool
+gwbuf_is_block_header(GWBUF *buf)
+{
+    return (void *)&((GWBUF_BLOCK *)buf)->sbuf == (void *)buf->sbuf;
+}
+
+/**
+ * Start iterating over the segments of a range of a buffer chain
+ *
+ * @param iter   The iterator to initialise
+ * @param head   The head of the chain
+ * @param offset Offset of the first byte of the range
+ * @param length Length of the range, SIZE_MAX for the rest of the chain
+ */
+void
+gwbuf_iter_init(GWBUF_ITER *iter, GWBUF *head, size_t offset, size_t length)
+{
+    while (head && offset >= GWBUF_LENGTH(head))
+    {
+        offset -= GWBUF_LENGTH(head);
+        head = head->next;
+    }
+
+    iter->buffer = head;
+    iter->offset = offset;
+    iter->left = length;
+}
+
+/**
+ * Get the next segment of the range
+ *
+ * @param iter   The iterator
+ * @param data   Set to the start of the segment
+ * @param length Set to the length of the segment
+ * @return True if there was a segment, false at the end of the range
+ */
+bool
+gwbuf_iter_next(GWBUF_ITER *iter, uint8_t **data, size_t *length)
+{
+    while (iter->buffer && iter->left > 0)
+    {
+        GWBUF *buffer = iter->buffer;
+        size_t len = MIN(GWBUF_LENGTH(buffer) - iter->offset, iter->left);
+        uint8_t *ptr = (uint8_t*)GWBUF_DATA(buffer) + iter->offset;
+
+        iter->buffer = buffer->next;
+        iter->offset = 0;
+
+        if (len > 0)
+        {
+            iter->left -= len;
+            *data = ptr;
+            *length = len;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Describe a range of a buffer chain with an I/O vector
+ *
+ * The vectors point to the data of the buffers, nothing is copied.
+ *
+ * @param head   The head of the chain
+ * @param offset Offset of the first byte of the range
+ * @param length Length of the range, SIZE_MAX for the rest of the chain
+ * @param iov    The vectors to fill
+ * @param n_iov  The number of vectors in iov
+ * @return The number of vectors used or -1 if the range has more than n_iov segments
+ */
+int
+gwbuf_iovec(GWBUF *head, size_t offset, size_t length, struct iovec *iov, int n_iov)
+{
+    GWBUF_ITER iter;
+    uint8_t *data;
+    size_t len;
+    int n = 0;
+
+    gwbuf_iter_init(&iter, head, offset, length);
+
+    while (gwbuf_iter_next(&iter, &data, &len))
+    {
+        if (n == n_iov)
+        {
+            return -1;
+        }
+        iov[n].iov_base = data;
+        iov[n].iov_len = len;
+        n++;
+    }
+
+    return n;
+}
+
+/**
+ * Compare the contents of two buffer chains
+ *
+ * The chains are compared byte by byte regardless of how the data is split
+ * into buffers. A chain that is a prefix of the other one is smaller.
+ *
+ * @param lhs A buffer chain, may be NULL
+ * @param rhs A buffer chain, may be NULL
+ * @return Less than, equal to or greater than zero if lhs is smaller than,
+ *         equal to or greater than rhs
+ */
+int
+gwbuf_compare(GWBUF *lhs, GWBUF *rhs)
+{
+    GWBUF_ITER liter, riter;
+    uint8_t *ldata = NULL, *rdata = NULL;
+    size_t llen = 0, rlen = 0;
+
+    gwbuf_iter_init(&liter, lhs, 0, SIZE_MAX);
+    gwbuf_iter_init(&riter, rhs, 0, SIZE_MAX);
+
+    while (true)
+    {
+        if (llen == 0 && !gwbuf_iter_next(&liter, &ldata, &llen))
+        {
+            llen = 0;
+        }
+        if (rlen == 0 && !gwbuf_iter_next(&riter, &rdata, &rlen))
+        {
+            rlen = 0;
+        }
+
+        if (llen == 0 || rlen == 0)
+        {
+            return llen == rlen ? 0 : (llen == 0 ? -1 : 1);
+        }
+
+        size_t n = MIN(llen, rlen);
+        int rc = memcmp(ldata, rdata, n);
+
+        if (rc != 0)
+        {
+            return rc;
+        }
+
+        ldata += n;
+        rdata += n;
+        llen -= n;
+        rlen -= n;
+    }
+}
+
+/**
+ * Return the number of memory allocations the buffers have made
+ *
+ * This counts the blocks and the clone headers that were not found in the
+ * buffer pools of the threads. As a buffer is allocated as a single block,
+ * the count grows by at most one for each new buffer.
+ *
+ * @return Number of blocks and headers allocated outside the pools
+ */
+int64_t
+gwbuf_pool_allocations(void)
+{
+    int64_t total = 0;
+
+    spinlock_acquire(&pool_stats_lock);
+    for (GWBUF_POOL_STATS *stats = all_pool_stats; stats; stats = stats->next)
+    {
+        for (int i = 0; i < GWBUF_N_CLASSES; i++)
+        {
+            total += stats->misses[i];
+        }
+        total += stats->header_misses + stats->oversized;
+    }
+    spinlock_release(&pool_stats_lock);
+
+    return total;
+}
+
 /**
  * Allocate a new gateway buffer structure of size bytes.
  *
- * For now we allocate memory directly from malloc for buffer the management
- * structure and the actual data buffer itself. We may swap at a future date
- * to a more efficient mechanism.
+ * The buffer header, the shared buffer and the data are allocated as one
+ * block. Blocks up to the largest size class are recycled through thread
+ * specific pools.
  *
  * @param       size The size in bytes of the data area required
  * @return      Pointer to the buffer structure or NULL if memory could not
@@ -79,36 +552,23 @@ static void gwbuf_remove_from_hashtable(GWBUF *buf);
 GWBUF *
 gwbuf_alloc(unsigned int size)
 {
-    GWBUF      *rval;
+    GWBUF      *rval = NULL;
     SHARED_BUF *sbuf;
+    GWBUF_BLOCK *block;
 
-    /* Allocate the buffer header */
-    if ((rval = (GWBUF *)malloc(sizeof(GWBUF))) == NULL)
-    {
-        goto retblock;
-    }
-
-    /* Allocate the shared data buffer */
-    if ((sbuf = (SHARED_BUF *)malloc(sizeof(SHARED_BUF))) == NULL)
+    if ((block = gwbuf_get_block(size)) == NULL)
     {
-        free(rval);
-        rval = NULL;
         goto retblock;
     }
 
-    /* Allocate the space for the actual data */
-    if ((sbuf->data = (unsigned char *)malloc(size)) == NULL)
-    {
-        ss_dassert(sbuf->data != NULL);
-        free(rval);
-        free(sbuf);
-        rval = NULL;
-        goto retblock;
-    }
-    spinlock_init(&rval->gwbuf_lock);
+    rval = &block->buf;
+    sbuf = &block->sbuf;
+    sbuf->data = block->data;
     rval->start = sbuf->data;
     rval->end = (void *)((char *)rval->start + size);
     sbuf->refcount = 1;
+    spinlock_init(&sbuf->bufobj_lock);
+    sbuf->bufobj = NULL;
     rval->sbuf = sbuf;
     rval->next = NULL;
     rval->tail = rval;
@@ -116,7 +576,6 @@ gwbuf_alloc(unsigned int size)
     rval->properties = NULL;
     rval->gwbuf_type = GWBUF_TYPE_UNDEFINED;
     rval->gwbuf_info = GWBUF_INFO_NONE;
-    rval->gwbuf_bufobj = NULL;
     CHK_GWBUF(rval);
 retblock:
     if (rval == NULL)
@@ -278,40 +737,39 @@ gwbuf_free(GWBUF *buf)
 static void
 gwbuf_free_one(GWBUF *buf)
 {
-    BUF_PROPERTY    *prop;
     buffer_object_t *bo;
 
-    if (atomic_add(&buf->sbuf->refcount, -1) == 1)
+    gwbuf_release_properties(buf->properties);
+    hint_release(buf->hint);
+#if defined(BUFFER_TRACE)
+    gwbuf_remove_from_hashtable(buf);
+#endif
+    /**
+     * The header embedded in the data block is released with the block
+     * when the last buffer referring to the data is freed.
+     */
+    bool block_header = gwbuf_is_block_header(buf);
+    SHARED_BUF *sbuf = buf->sbuf;
+
+    if (atomic_add(&sbuf->refcount, -1) == 1)
     {
-        free(buf->sbuf->data);
-        free(buf->sbuf);
-        bo = buf->gwbuf_bufobj;
+        bo = sbuf->bufobj;
 
         while (bo != NULL)
         {
-            bo = gwbuf_remove_buffer_object(buf, bo);
+            bo = gwbuf_remove_buffer_object(bo);
         }
 
+        if (!block_header)
+        {
+            gwbuf_release_header(buf);
+        }
+        gwbuf_release_block((GWBUF_BLOCK *)((char *)sbuf - offsetof(GWBUF_BLOCK, sbuf)));
     }
-    while (buf->properties)
-    {
-        prop = buf->properties;
-        buf->properties = prop->next;
-        free(prop->name);
-        free(prop->value);
-        free(prop);
-    }
-    /** Release the hint */
-    while (buf->hint)
+    else if (!block_header)
     {
-        HINT* h = buf->hint;
-        buf->hint = buf->hint->next;
-        hint_free(h);
+        gwbuf_release_header(buf);
     }
-#if defined(BUFFER_TRACE)
-    gwbuf_remove_from_hashtable(buf);
-#endif
-    free(buf);
 }
 
 /**
@@ -329,7 +787,7 @@ gwbuf_clone(GWBUF *buf)
 {
     GWBUF *rval;
 
-    if ((rval = (GWBUF *)calloc(1, sizeof(GWBUF))) == NULL)
+    if ((rval = gwbuf_get_header()) == NULL)
     {
         ss_dassert(rval != NULL);
         char errbuf[STRERROR_BUFLEN];
@@ -344,7 +802,8 @@ gwbuf_clone(GWBUF *buf)
     rval->end = buf->end;
     rval->gwbuf_type = buf->gwbuf_type;
     rval->gwbuf_info = buf->gwbuf_info;
-    rval->gwbuf_bufobj = buf->gwbuf_bufobj;
+    rval->hint = hint_share(buf->hint);
+    rval->properties = gwbuf_share_properties(buf->properties);
     rval->tail = rval;
     rval->next = NULL;
     CHK_GWBUF(rval);
@@ -393,7 +852,7 @@ static GWBUF *gwbuf_clone_portion(GWBUF *buf,
     CHK_GWBUF(buf);
     ss_dassert(start_offset + length <= GWBUF_LENGTH(buf));
 
-    if ((clonebuf = (GWBUF *)malloc(sizeof(GWBUF))) == NULL)
+    if ((clonebuf = gwbuf_get_header()) == NULL)
     {
         ss_dassert(clonebuf != NULL);
         char errbuf[STRERROR_BUFLEN];
@@ -407,10 +866,9 @@ static GWBUF *gwbuf_clone_portion(GWBUF *buf,
     clonebuf->start = (void *)((char*)buf->start + start_offset);
     clonebuf->end = (void *)((char *)clonebuf->start + length);
     clonebuf->gwbuf_type = buf->gwbuf_type; /*< clone the type for now */
-    clonebuf->properties = NULL;
-    clonebuf->hint = NULL;
+    clonebuf->properties = gwbuf_share_properties(buf->properties);
+    clonebuf->hint = hint_share(buf->hint);
     clonebuf->gwbuf_info = buf->gwbuf_info;
-    clonebuf->gwbuf_bufobj = buf->gwbuf_bufobj;
     clonebuf->next = NULL;
     clonebuf->tail = clonebuf;
     CHK_GWBUF(clonebuf);
@@ -713,7 +1171,9 @@ void gwbuf_set_type(
 }
 
 /**
- * Add a buffer object to GWBUF buffer.
+ * Add a buffer object to GWBUF buffer. The object is stored with the shared
+ * data of the buffer and is seen by the clones of the buffer as long as they
+ * refer to the same data as the buffer.
  *
  * @param buf           GWBUF where object is added
  * @param id            Type identifier for object
@@ -742,24 +1202,27 @@ void gwbuf_add_buffer_object(GWBUF* buf,
     newb->bo_id = id;
     newb->bo_data = data;
     newb->bo_donefun_fp = donefun_fp;
+    newb->bo_start = buf->start;
+    newb->bo_length = gwbuf_length(buf);
     newb->bo_next = NULL;
     /** Lock */
-    spinlock_acquire(&buf->gwbuf_lock);
-    p_b = &buf->gwbuf_bufobj;
+    spinlock_acquire(&buf->sbuf->bufobj_lock);
+    p_b = &buf->sbuf->bufobj;
     /** Search the end of the list and add there */
     while (*p_b != NULL)
     {
         p_b = &(*p_b)->bo_next;
     }
     *p_b = newb;
+    /** Unlock */
+    spinlock_release(&buf->sbuf->bufobj_lock);
     /** Set flag */
     buf->gwbuf_info |= GWBUF_INFO_PARSED;
-    /** Unlock */
-    spinlock_release(&buf->gwbuf_lock);
 }
 
 /**
- * Search buffer object which matches with the id.
+ * Search buffer object which matches with the id. Only an object that was
+ * added for the same data as the buffer now has is returned.
  *
  * @param buf   GWBUF to be searched
  * @param id    Identifier for the object
@@ -769,18 +1232,21 @@ void gwbuf_add_buffer_object(GWBUF* buf,
 void* gwbuf_get_buffer_object_data(GWBUF* buf, bufobj_id_t id)
 {
     buffer_object_t* bo;
+    size_t length;
 
     CHK_GWBUF(buf);
+    length = gwbuf_length(buf);
     /** Lock */
-    spinlock_acquire(&buf->gwbuf_lock);
-    bo = buf->gwbuf_bufobj;
+    spinlock_acquire(&buf->sbuf->bufobj_lock);
+    bo = buf->sbuf->bufobj;
 
-    while (bo != NULL && bo->bo_id != id)
+    while (bo != NULL && (bo->bo_id != id || bo->bo_start != buf->start ||
+                          bo->bo_length != length))
     {
         bo = bo->bo_next;
     }
     /** Unlock */
-    spinlock_release(&buf->gwbuf_lock);
+    spinlock_release(&buf->sbuf->bufobj_lock);
     if (bo)
     {
         return bo->bo_data;
@@ -788,10 +1254,96 @@ void* gwbuf_get_buffer_object_data(GWBUF* buf, bufobj_id_t id)
     return NULL;
 }
 
+/**
+ * Remove the buffer objects with an id from the data of a buffer. This must
+ * be called when the data is modified in place, for example when the SQL of
+ * a query is rewritten, as the clones of the buffer would otherwise still
+ * see the objects of the old data. The caller must own the buffer.
+ *
+ * @param buf   GWBUF whose objects are removed
+ * @param id    Identifier for the objects
+ */
+void gwbuf_clear_buffer_object(GWBUF* buf, bufobj_id_t id)
+{
+    buffer_object_t** p_b;
+    buffer_object_t*  removed = NULL;
+
+    CHK_GWBUF(buf);
+    spinlock_acquire(&buf->sbuf->bufobj_lock);
+    p_b = &buf->sbuf->bufobj;
+
+    while (*p_b != NULL)
+    {
+        buffer_object_t* bo = *p_b;
+
+        if (bo->bo_id == id)
+        {
+            *p_b = bo->bo_next;
+            bo->bo_next = removed;
+            removed = bo;
+        }
+        else
+        {
+            p_b = &bo->bo_next;
+        }
+    }
+    spinlock_release(&buf->sbuf->bufobj_lock);
+
+    /** The clean-up functions are called without holding the lock */
+    while (removed != NULL)
+    {
+        removed = gwbuf_remove_buffer_object(removed);
+    }
+}
+
+/**
+ * Move the buffer objects of a buffer chain to a buffer that holds the same
+ * data in one piece.
+ *
+ * @param from  The buffer chain
+ * @param to    The contiguous copy of the chain
+ */
+static void gwbuf_move_buffer_objects(GWBUF* from, GWBUF* to)
+{
+    buffer_object_t** p_b;
+    buffer_object_t*  moved = NULL;
+    size_t length = gwbuf_length(from);
+
+    spinlock_acquire(&from->sbuf->bufobj_lock);
+    p_b = &from->sbuf->bufobj;
+
+    while (*p_b != NULL)
+    {
+        buffer_object_t* bo = *p_b;
+
+        if (bo->bo_start == from->start && bo->bo_length == length)
+        {
+            *p_b = bo->bo_next;
+            bo->bo_start = to->start;
+            bo->bo_next = moved;
+            moved = bo;
+        }
+        else
+        {
+            p_b = &bo->bo_next;
+        }
+    }
+    spinlock_release(&from->sbuf->bufobj_lock);
+
+    /** The new buffer is not yet shared */
+    while (moved != NULL)
+    {
+        buffer_object_t* next = moved->bo_next;
+        moved->bo_next = to->sbuf->bufobj;
+        to->sbuf->bufobj = moved;
+        moved = next;
+    }
+}
+
 /**
  * @return pointer to next buffer object or NULL
  */
-static buffer_object_t* gwbuf_remove_buffer_object(GWBUF* buf, buffer_object_t* bufobj)
+static buffer_object_t* gwbuf_remove_buffer_object(buffer_object_t* bufobj)
 {
     buffer_object_t* next;
 
@@ -802,6 +1354,41 @@ static buffer_object_t* gwbuf_remove_buffer_object(GWBUF* buf, buffer_object_t*
     return next;
 }
 
+/**
+ * Share a list of properties
+ *
+ * @param prop  The properties, may be NULL
+ * @return      The same list with its reference count incremented
+ */
+static BUF_PROPERTY *
+gwbuf_share_properties(BUF_PROPERTY *prop)
+{
+    if (prop)
+    {
+        atomic_add(&prop->refcount, 1);
+    }
+    return prop;
+}
+
+/**
+ * Release a reference to a list of properties, the properties that are
+ * no longer referenced are freed.
+ *
+ * @param prop  The properties, may be NULL
+ */
+static void
+gwbuf_release_properties(BUF_PROPERTY *prop)
+{
+    while (prop && atomic_add(&prop->refcount, -1) == 1)
+    {
+        BUF_PROPERTY *next = prop->next;
+        free(prop->name);
+        free(prop->value);
+        free(prop);
+        prop = next;
+    }
+}
+
 /**
  * Add a property to a buffer.
  *
@@ -825,10 +1412,10 @@ gwbuf_add_property(GWBUF *buf, char *name, char *value)
     }
     prop->name = strdup(name);
     prop->value = strdup(value);
-    spinlock_acquire(&buf->gwbuf_lock);
+    prop->refcount = 1;
+    /** The properties that may be shared are not modified */
     prop->next = buf->properties;
     buf->properties = prop;
-    spinlock_release(&buf->gwbuf_lock);
     return 1;
 }
 
@@ -841,15 +1428,12 @@ gwbuf_add_property(GWBUF *buf, char *name, char *value)
 char *
 gwbuf_get_property(GWBUF *buf, char *name)
 {
-    BUF_PROPERTY *prop;
+    BUF_PROPERTY *prop = buf->properties;
 
-    spinlock_acquire(&buf->gwbuf_lock);
-    prop = buf->properties;
     while (prop && strcmp(prop->name, name) != 0)
     {
         prop = prop->next;
     }
-    spinlock_release(&buf->gwbuf_lock);
     if (prop)
     {
         return prop->value;
@@ -883,7 +1467,10 @@ gwbuf_make_contiguous(GWBUF *orig)
     if ((newbuf = gwbuf_alloc(gwbuf_length(orig))) != NULL)
     {
         newbuf->gwbuf_type = orig->gwbuf_type;
-        newbuf->hint = hint_dup(orig->hint);
+        newbuf->hint = hint_share(orig->hint);
+        newbuf->properties = gwbuf_share_properties(orig->properties);
+        newbuf->gwbuf_info = orig->gwbuf_info;
+        gwbuf_move_buffer_objects(orig, newbuf);
         ptr = GWBUF_DATA(newbuf);
 
         while (orig)
@@ -900,6 +1487,9 @@ gwbuf_make_contiguous(GWBUF *orig)
 /**
  * Add hint to a buffer.
  *
+ * The hint is added to the end of the hints of the buffer. If the end of the
+ * list is shared with other buffers, the shared part is copied first.
+ *
  * @param buf   The buffer to add the hint to
  * @param hint  The hint itself
  * @return      Non-zero on success
@@ -907,23 +1497,32 @@ gwbuf_make_contiguous(GWBUF *orig)
 int
 gwbuf_add_hint(GWBUF *buf, HINT *hint)
 {
-    HINT *ptr;
+    HINT **ptr = &buf->hint;
 
-    spinlock_acquire(&buf->gwbuf_lock);
-    if (buf->hint)
+    /** The hints up to the first shared one are only referred to by this buffer */
+    while (*ptr && (*ptr)->refcount == 1)
     {
-        ptr = buf->hint;
-        while (ptr->next)
-        {
-            ptr = ptr->next;
-        }
-        ptr->next = hint;
+        ptr = &(*ptr)->next;
     }
-    else
+
+    if (*ptr)
     {
-        buf->hint = hint;
+        HINT *shared = *ptr;
+
+        if ((*ptr = hint_dup(shared)) == NULL)
+        {
+            *ptr = shared;
+            return 0;
+        }
+        hint_release(shared);
+
+        while (*ptr)
+        {
+            ptr = &(*ptr)->next;
+        }
     }
-    spinlock_release(&buf->gwbuf_lock);
+
+    *ptr = hint;
     return 1;
 }
 
@@ -986,3 +1585,51 @@ size_t gwbuf_copy_data(GWBUF *buffer, size_t offset, size_t bytes, uint8_t* dest
 
     return bytes_read;
 }
+
+/**
+ * Print the statistics of the buffer pools via a given print DCB
+ *
+ * The hit rate of a size class tells how often a buffer of that class was
+ * recycled instead of being allocated with malloc.
+ *
+ * @param pdcb  Print DCB for output
+ */
+void
+dprintBufferPools(void *pdcb)
+{
+    DCB *dcb = (DCB *)pdcb;
+    int64_t hits[GWBUF_N_CLASSES] = {0};
+    int64_t misses[GWBUF_N_CLASSES] = {0};
+    int64_t header_hits = 0, header_misses = 0, oversized = 0;
+
+    spinlock_acquire(&pool_stats_lock);
+    for (GWBUF_POOL_STATS *stats = all_pool_stats; stats; stats = stats->next)
+    {
+        for (int i = 0; i < GWBUF_N_CLASSES; i++)
+        {
+            hits[i] += stats->hits[i];
+            misses[i] += stats->misses[i];
+        }
+        header_hits += stats->header_hits;
+        header_misses += stats->header_misses;
+        oversized += stats->oversized;
+    }
+    spinlock_release(&pool_stats_lock);
+
+    dcb_printf(dcb, "Buffer pools.\n");
+    dcb_printf(dcb, "Size class | Hits         | Misses       | Hit rate\n");
+    dcb_printf(dcb, "-----------+--------------+--------------+---------\n");
+    for (int i = 0; i < GWBUF_N_CLASSES; i++)
+    {
+        int64_t total = hits[i] + misses[i];
+        dcb_printf(dcb, " %-9u | %-12" PRId64 " | %-12" PRId64 " | %3d%%\n",
+                   gwbuf_class_sizes[i], hits[i], misses[i],
+                   total ? (int)(hits[i] * 100 / total) : 0);
+    }
+    int64_t total = header_hits + header_misses;
+    dcb_printf(dcb, " %-9s | %-12" PRId64 " | %-12" PRId64 " | %3d%%\n",
+               "Headers", header_hits, header_misses,
+               total ? (int)(header_hits * 100 / total) : 0);
+    dcb_printf(dcb, "Buffers larger than %u bytes: %" PRId64 "\n",
+               gwbuf_class_sizes[GWBUF_N_CLASSES - 1], oversized);
+}
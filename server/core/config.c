@@ -71,6 +71,7 @@
 #include <sys/utsname.h>
 #include <dbusers.h>
 #include <gw.h>
+#include <statistics.h>
 #define PCRE2_CODE_UNIT_WIDTH 8
 #include <pcre2.h>
 
@@ -85,6 +86,7 @@ static int handle_global_item(const char *, const char *);
 static int handle_feedback_item(const char *, const char *);
 static void global_defaults();
 static void feedback_defaults();
+static void check_thread_limits();
 static bool check_config_objects(CONFIG_CONTEXT *context);
 static int maxscale_getline(char** dest, int* size, FILE* file);
 static SSL_LISTENER *make_ssl_structure(CONFIG_CONTEXT *obj, bool require_cert, int *error_count);
@@ -119,8 +121,8 @@ static char *service_params[] =
     "password",
     "enable_root_user",
     "max_connections",
-    /* "max_queued_connections", */
-    /* "queued_connection_timeout", */
+    "max_queued_connections",
+    "queued_connection_timeout",
     "connection_timeout",
     "auth_all_servers",
     "strip_db_esc",
@@ -155,6 +157,11 @@ static char *listener_params[] =
     "ssl_key",
     "ssl_version",
     "ssl_cert_verify_depth",
+    "ssl_session_cache_size",
+    "ssl_session_timeout",
+    "ssl_session_tickets",
+    "ssl_ktls",
+    "priority",
     NULL
 };
 
@@ -168,8 +175,11 @@ static char *monitor_params[] =
     "password",
     "script",
     "events",
+    "script_timeout",
+    "script_max_running",
     "mysql51_replication",
     "monitor_interval",
+    "monitor_fast_interval",
     "detect_replication_lag",
     "detect_stale_master",
     "disable_master_failback",
@@ -192,12 +202,16 @@ static char *server_params[] =
     "monitorpw",
     "persistpoolmax",
     "persistmaxtime",
+    "persistpoolmin",
+    "connect_timeout",
+    "compression",
     "ssl_cert",
     "ssl_ca_cert",
     "ssl",
     "ssl_key",
     "ssl_version",
     "ssl_cert_verify_depth",
+    "ssl_ktls",
     NULL
 };
 
@@ -410,6 +424,10 @@ config_load(char *file)
     }
 
     config_file = file;
+    check_thread_limits();
+
+    /** The number of threads is now known, the objects can allocate their statistics */
+    ts_stats_init();
 
     if (check_config_objects(config.next) && process_config_context(config.next))
     {
@@ -446,6 +464,12 @@ config_reload()
         free(gateway.version_string);
     }
 
+    /** The threads are already running, their number can't be changed */
+    int n_threads = gateway.n_threads;
+    int initial_threads = gateway.initial_threads;
+    int min_threads = gateway.min_threads;
+    int max_threads = gateway.max_threads;
+
     global_defaults();
 
     config.object = "";
@@ -456,6 +480,11 @@ config_reload()
         return 0;
     }
 
+    gateway.n_threads = n_threads;
+    gateway.initial_threads = initial_threads;
+    gateway.min_threads = min_threads;
+    gateway.max_threads = max_threads;
+
     rval = process_config_update(config.next);
     free_config_context(config.next);
 
@@ -829,9 +858,12 @@ free_config_context(CONFIG_CONTEXT *context)
 }
 
 /**
- * Return the number of configured threads
+ * Return the largest number of polling threads that can run at a time. This
+ * is the configured number of threads unless the thread count is scaled at
+ * runtime, in which case it is the value of max_threads. The ids of the
+ * polling threads are always below this.
  *
- * @return The number of threads configured in the config file
+ * @return The most polling threads that can run
  */
 int
 config_threadcount()
@@ -839,6 +871,30 @@ config_threadcount()
     return gateway.n_threads;
 }
 
+/**
+ * Return the number of polling threads to start with
+ *
+ * @return The number of threads configured in the config file
+ */
+int
+config_initial_threads()
+{
+    return gateway.initial_threads;
+}
+
+/**
+ * Return the smallest number of polling threads the thread count is scaled
+ * down to
+ *
+ * @return The fewest polling threads that run, the same as
+ * config_threadcount() if the thread count is not scaled
+ */
+int
+config_min_threads()
+{
+    return gateway.min_threads;
+}
+
 /**
  * Return the number of non-blocking polls to be done before a blocking poll
  * is issued.
@@ -863,6 +919,384 @@ config_pollsleep()
     return gateway.pollsleep;
 }
 
+/**
+ * Return the configured poll mode
+ *
+ * @return Whether the threads share one epoll instance or own one each
+ */
+poll_mode_t
+config_poll_mode()
+{
+    return gateway.poll_mode;
+}
+
+/**
+ * Return the number of DCBs a thread takes from the event queue at a time
+ *
+ * @return The event queue batch size
+ */
+unsigned int
+config_poll_batch_size()
+{
+    return gateway.poll_batch_size;
+}
+
+/**
+ * Return whether the threads busy poll only when events are expected soon
+ *
+ * @return True if adaptive polling is enabled
+ */
+bool
+config_adaptive_poll()
+{
+    return gateway.adaptive_poll;
+}
+
+/**
+ * Return the longest time a thread busy polls with adaptive polling
+ *
+ * @return The busy poll time in microseconds
+ */
+unsigned int
+config_busy_poll_time()
+{
+    return gateway.busy_poll_time;
+}
+
+/**
+ * Return the SO_BUSY_POLL value given to the sockets
+ *
+ * @return The busy poll time of the sockets in microseconds, 0 if not set
+ */
+unsigned int
+config_socket_busy_poll()
+{
+    return gateway.socket_busy_poll;
+}
+
+/**
+ * Return whether event queue and execution times are measured in microseconds
+ *
+ * @return True if high precision event times are enabled
+ */
+bool
+config_high_precision_event_times()
+{
+    return gateway.hp_event_times;
+}
+
+/**
+ * Return the configured socket read mode
+ *
+ * @return Whether reads are preceded by a FIONREAD probe
+ */
+read_mode_t
+config_read_mode()
+{
+    return gateway.read_mode;
+}
+
+/**
+ * Return whether each thread should have its own listening socket for a port
+ *
+ * @return True if SO_REUSEPORT listeners are enabled
+ */
+bool
+config_reuseport()
+{
+    return gateway.reuseport;
+}
+
+/**
+ * Return whether the socket reads and writes are batched with io_uring
+ *
+ * @return True if io_uring is enabled
+ */
+bool
+config_io_uring()
+{
+    return gateway.io_uring;
+}
+
+/**
+ * Return how the polling threads are bound to CPUs
+ *
+ * @return The thread affinity mode
+ */
+thread_affinity_t
+config_thread_affinity()
+{
+    return gateway.thread_affinity;
+}
+
+/**
+ * Return the CPUs the polling threads are bound to with THREAD_AFFINITY_CPUS
+ *
+ * @return The set of CPUs
+ */
+const cpu_set_t*
+config_thread_cpus()
+{
+    return &gateway.thread_cpus;
+}
+
+/**
+ * Parse a list of CPUs in the format of the Linux cpulist files, e.g. 0-3,8,10-11
+ *
+ * @param list The list
+ * @param set  The set the CPUs are added to, it is cleared first
+ * @return True if the list was valid and had at least one CPU
+ */
+bool
+config_parse_cpu_list(const char *list, cpu_set_t *set)
+{
+    const char *ptr = list;
+
+    CPU_ZERO(set);
+
+    while (*ptr)
+    {
+        char *end;
+        long first = strtol(ptr, &end, 10);
+        long last = first;
+
+        if (end == ptr || first < 0)
+        {
+            return false;
+        }
+
+        if (*end == '-')
+        {
+            ptr = end + 1;
+            last = strtol(ptr, &end, 10);
+
+            if (end == ptr || last < first)
+            {
+                return false;
+            }
+        }
+
+        if (last >= CPU_SETSIZE)
+        {
+            return false;
+        }
+
+        for (long cpu = first; cpu <= last; cpu++)
+        {
+            CPU_SET(cpu, set);
+        }
+
+        ptr = end;
+
+        while (isspace(*ptr))
+        {
+            ptr++;
+        }
+
+        if (*ptr == ',')
+        {
+            ptr++;
+        }
+        else if (*ptr)
+        {
+            return false;
+        }
+    }
+
+    return CPU_COUNT(set) > 0;
+}
+
+/**
+ * Return the number of threads that run the monitoring rounds
+ *
+ * @return The number of monitor threads
+ */
+unsigned int
+config_monitor_threads()
+{
+    return gateway.monitor_threads;
+}
+
+/**
+ * Return the number of threads that start the services
+ *
+ * @return The number of service start threads
+ */
+unsigned int
+config_service_start_threads()
+{
+    return gateway.service_start_threads;
+}
+
+/**
+ * Return the size above which statements are classified by the classifier threads
+ *
+ * @return The size in bytes, 0 if large statements are classified by the polling threads
+ */
+unsigned int
+config_qc_offload_size()
+{
+    return gateway.qc_offload_size;
+}
+
+/**
+ * Return the number of threads that classify large statements
+ *
+ * @return The number of classifier threads
+ */
+unsigned int
+config_qc_offload_threads()
+{
+    return gateway.qc_offload_threads;
+}
+
+/**
+ * Return the buffered memory of a session above which its client is not read
+ *
+ * @return The limit in bytes, 0 if disabled
+ */
+unsigned int
+config_session_memory_soft_limit()
+{
+    return gateway.session_memory_soft_limit;
+}
+
+/**
+ * Return the buffered memory of a session above which its client is closed
+ *
+ * @return The limit in bytes, 0 if disabled
+ */
+unsigned int
+config_session_memory_hard_limit()
+{
+    return gateway.session_memory_hard_limit;
+}
+
+/**
+ * Return the number of connections a listener accepts per accept event
+ *
+ * @return The accept budget, 0 if there is no limit
+ */
+unsigned int
+config_accept_budget()
+{
+    return gateway.accept_budget;
+}
+
+/**
+ * Return the size of a client write queue above which the reads from the
+ * backend servers of the session are paused
+ *
+ * @return The high water mark in bytes, 0 if reads are never paused
+ */
+unsigned int
+config_writeq_high_water()
+{
+    return gateway.writeq_high_water;
+}
+
+/**
+ * Return the size of a client write queue below which paused reads from the
+ * backend servers of the session are resumed
+ *
+ * @return The low water mark in bytes
+ */
+unsigned int
+config_writeq_low_water()
+{
+    return gateway.writeq_low_water;
+}
+
+/**
+ * Return whether the clients are offered the compressed MySQL protocol
+ *
+ * @return True if clients may use compression
+ */
+bool
+config_client_compression()
+{
+    return gateway.client_compression;
+}
+
+/**
+ * Return whether the clients are offered the tracking of the session state
+ *
+ * @return True if clients may use CLIENT_SESSION_TRACK
+ */
+bool
+config_session_track()
+{
+    return gateway.session_track;
+}
+
+/**
+ * Return the size of the smallest payload that is compressed when the
+ * compressed protocol is in use
+ *
+ * @return The threshold in bytes
+ */
+unsigned int
+config_compression_threshold()
+{
+    return gateway.compression_threshold;
+}
+
+/**
+ * Return whether the queries that a client pipelines are written to each
+ * backend with one write
+ *
+ * @return True if pipelined queries are batched
+ */
+bool
+config_pipeline_batching()
+{
+    return gateway.pipeline_batching;
+}
+
+/**
+ * Return the number of records in the event trace file of each thread
+ *
+ * @return The number of records, 0 if tracing is disabled
+ */
+unsigned int
+config_trace_records()
+{
+    return gateway.trace_records;
+}
+
+/**
+ * Return how often the routing of the queries is traced
+ *
+ * @return One in this many queries is traced, 0 if none
+ */
+unsigned int
+config_trace_sample_rate()
+{
+    return gateway.trace_sample_rate;
+}
+
+/**
+ * Return the user whose queries are all traced
+ *
+ * @return The user name, empty if none
+ */
+const char*
+config_trace_sample_user()
+{
+    return gateway.trace_sample_user;
+}
+
+/**
+ * Return where the buffers, DCBs and sessions are allocated from
+ *
+ * @return The huge page mode of the arenas
+ */
+huge_pages_t
+config_huge_pages()
+{
+    return gateway.huge_pages;
+}
+
 /**
  * Return the feedback config data pointer
  *
@@ -903,47 +1337,322 @@ handle_global_item(const char *name, const char *value)
     int i;
     if (strcmp(name, "threads") == 0)
     {
-        if (strcmp(value, "auto") == 0)
+        if (strcmp(value, "auto") == 0)
+        {
+            if ((gateway.n_threads = get_processor_count()) > 1)
+            {
+                gateway.n_threads--;
+            }
+        }
+        else
+        {
+            int thrcount = atoi(value);
+            if (thrcount > 0)
+            {
+                gateway.n_threads = thrcount;
+
+                int processor_count = get_processor_count();
+                if (thrcount > processor_count)
+                {
+                    MXS_WARNING("Number of threads set to %d which is greater than"
+                                " the number of processors available: %d",
+                                thrcount, processor_count);
+                }
+            }
+            else
+            {
+                MXS_WARNING("Invalid value for 'threads': %s.", value);
+                return 0;
+            }
+        }
+    }
+    else if (strcmp(name, "min_threads") == 0 || strcmp(name, "max_threads") == 0)
+    {
+        char* endptr;
+        int intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval > 0)
+        {
+            *(strcmp(name, "min_threads") == 0 ? &gateway.min_threads : &gateway.max_threads) = intval;
+        }
+        else
+        {
+            MXS_ERROR("Invalid value for '%s': %s, expected a positive number.", name, value);
+            return 0;
+        }
+    }
+    else if (strcmp(name, "non_blocking_polls") == 0)
+    {
+        gateway.n_nbpoll = atoi(value);
+    }
+    else if (strcmp(name, "poll_sleep") == 0)
+    {
+        gateway.pollsleep = atoi(value);
+    }
+    else if (strcmp(name, "poll_mode") == 0)
+    {
+        if (strcmp(value, "shared") == 0)
+        {
+            gateway.poll_mode = POLL_MODE_SHARED;
+        }
+        else if (strcmp(value, "per_thread") == 0)
+        {
+            gateway.poll_mode = POLL_MODE_PER_THREAD;
+        }
+        else
+        {
+            MXS_ERROR("Invalid value for 'poll_mode': %s. Expected 'shared' or 'per_thread'.", value);
+            return 0;
+        }
+    }
+    else if (strcmp(name, "poll_batch_size") == 0)
+    {
+        char* endptr;
+        int intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval > 0 && intval <= MAX_POLL_BATCH_SIZE)
+        {
+            gateway.poll_batch_size = intval;
+        }
+        else
+        {
+            MXS_WARNING("Invalid value for 'poll_batch_size': %s, expected a value "
+                        "between 1 and %d. Using default value of %d.",
+                        value, MAX_POLL_BATCH_SIZE, DEFAULT_POLL_BATCH_SIZE);
+        }
+    }
+    else if (strcmp(name, "adaptive_poll") == 0)
+    {
+        gateway.adaptive_poll = config_truth_value((char*)value);
+    }
+    else if (strcmp(name, "busy_poll_time") == 0 || strcmp(name, "socket_busy_poll") == 0)
+    {
+        char* endptr;
+        int intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval >= 0)
+        {
+            *(strcmp(name, "busy_poll_time") == 0 ?
+              &gateway.busy_poll_time : &gateway.socket_busy_poll) = intval;
+        }
+        else
+        {
+            MXS_ERROR("Invalid value for '%s': %s, expected a number of microseconds.", name, value);
+            return 0;
+        }
+    }
+    else if (strcmp(name, "high_precision_event_times") == 0)
+    {
+        gateway.hp_event_times = config_truth_value((char*)value);
+    }
+    else if (strcmp(name, "read_mode") == 0)
+    {
+        if (strcmp(value, "probe") == 0)
+        {
+            gateway.read_mode = READ_MODE_PROBE;
+        }
+        else if (strcmp(value, "direct") == 0)
+        {
+            gateway.read_mode = READ_MODE_DIRECT;
+        }
+        else
+        {
+            MXS_ERROR("Invalid value for 'read_mode': %s. Expected 'probe' or 'direct'.", value);
+            return 0;
+        }
+    }
+    else if (strcmp(name, "reuseport") == 0)
+    {
+        gateway.reuseport = config_truth_value((char*)value);
+    }
+    else if (strcmp(name, "io_uring") == 0)
+    {
+        gateway.io_uring = config_truth_value((char*)value);
+    }
+    else if (strcmp(name, "thread_affinity") == 0)
+    {
+        if (strcmp(value, "none") == 0)
         {
-            if ((gateway.n_threads = get_processor_count()) > 1)
-            {
-                gateway.n_threads--;
-            }
+            gateway.thread_affinity = THREAD_AFFINITY_NONE;
+        }
+        else if (strcmp(value, "numa") == 0)
+        {
+            gateway.thread_affinity = THREAD_AFFINITY_NUMA;
+        }
+        else if (config_parse_cpu_list(value, &gateway.thread_cpus))
+        {
+            gateway.thread_affinity = THREAD_AFFINITY_CPUS;
         }
         else
         {
-            int thrcount = atoi(value);
-            if (thrcount > 0)
+            MXS_ERROR("Invalid value for 'thread_affinity': %s. Expected 'none', 'numa' "
+                      "or a list of CPUs, e.g. 0-3,8-11.", value);
+            return 0;
+        }
+    }
+    else if (strcmp(name, "monitor_threads") == 0)
+    {
+        char* endptr;
+        int intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval > 0)
+        {
+            gateway.monitor_threads = intval;
+        }
+        else
+        {
+            MXS_WARNING("Invalid value for 'monitor_threads': %s, expected a positive "
+                        "number. Using default value of %d.", value, DEFAULT_MONITOR_THREADS);
+        }
+    }
+    else if (strcmp(name, "service_start_threads") == 0)
+    {
+        char* endptr;
+        int intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval > 0)
+        {
+            gateway.service_start_threads = intval;
+        }
+        else
+        {
+            MXS_WARNING("Invalid value for 'service_start_threads': %s, expected a positive "
+                        "number. Using default value of %d.", value, DEFAULT_SERVICE_START_THREADS);
+        }
+    }
+    else if (strcmp(name, "accept_budget") == 0)
+    {
+        char* endptr;
+        int intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval >= 0)
+        {
+            gateway.accept_budget = intval;
+        }
+        else
+        {
+            MXS_WARNING("Invalid value for 'accept_budget': %s, expected a non-negative "
+                        "number. Using default value of %d.", value, DEFAULT_ACCEPT_BUDGET);
+        }
+    }
+    else if (strcmp(name, "writeq_high_water") == 0 || strcmp(name, "writeq_low_water") == 0)
+    {
+        char* endptr;
+        long intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval >= 0 && intval <= INT_MAX)
+        {
+            if (strcmp(name, "writeq_high_water") == 0)
             {
-                gateway.n_threads = thrcount;
-
-                int processor_count = get_processor_count();
-                if (thrcount > processor_count)
-                {
-                    MXS_WARNING("Number of threads set to %d which is greater than"
-                                " the number of processors available: %d",
-                                thrcount, processor_count);
-                }
+                gateway.writeq_high_water = intval;
             }
             else
             {
-                MXS_WARNING("Invalid value for 'threads': %s.", value);
-                return 0;
+                gateway.writeq_low_water = intval;
             }
         }
+        else
+        {
+            MXS_WARNING("Invalid value for '%s': %s, expected a non-negative number of bytes.",
+                        name, value);
+        }
     }
-    else if (strcmp(name, "non_blocking_polls") == 0)
+    else if (strcmp(name, "client_compression") == 0)
     {
-        gateway.n_nbpoll = atoi(value);
+        gateway.client_compression = config_truth_value((char*)value);
     }
-    else if (strcmp(name, "poll_sleep") == 0)
+    else if (strcmp(name, "session_track") == 0)
     {
-        gateway.pollsleep = atoi(value);
+        gateway.session_track = config_truth_value((char*)value);
+    }
+    else if (strcmp(name, "pipeline_batching") == 0)
+    {
+        gateway.pipeline_batching = config_truth_value((char*)value);
+    }
+    else if (strcmp(name, "trace_records") == 0)
+    {
+        char* endptr;
+        long intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval >= 0 && intval <= (1 << 30))
+        {
+            gateway.trace_records = intval;
+        }
+        else
+        {
+            MXS_WARNING("Invalid value for 'trace_records': %s, expected a non-negative "
+                        "number of records.", value);
+        }
+    }
+    else if (strcmp(name, "trace_sample_rate") == 0)
+    {
+        char* endptr;
+        long intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval >= 0 && intval <= UINT_MAX)
+        {
+            gateway.trace_sample_rate = intval;
+        }
+        else
+        {
+            MXS_WARNING("Invalid value for 'trace_sample_rate': %s, expected a non-negative "
+                        "number of queries.", value);
+        }
+    }
+    else if (strcmp(name, "trace_sample_user") == 0)
+    {
+        snprintf(gateway.trace_sample_user, sizeof(gateway.trace_sample_user), "%s", value);
+    }
+    else if (strcmp(name, "huge_pages") == 0)
+    {
+        if (strcmp(value, "off") == 0)
+        {
+            gateway.huge_pages = HUGE_PAGES_OFF;
+        }
+        else if (strcmp(value, "transparent") == 0)
+        {
+            gateway.huge_pages = HUGE_PAGES_TRANSPARENT;
+        }
+        else if (strcmp(value, "explicit") == 0)
+        {
+            gateway.huge_pages = HUGE_PAGES_EXPLICIT;
+        }
+        else
+        {
+            MXS_ERROR("Invalid value for 'huge_pages': %s. Expected 'off', 'transparent' "
+                      "or 'explicit'.", value);
+            return 0;
+        }
+    }
+    else if (strcmp(name, "compression_threshold") == 0)
+    {
+        char* endptr;
+        long intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval >= 0 && intval <= INT_MAX)
+        {
+            gateway.compression_threshold = intval;
+        }
+        else
+        {
+            MXS_WARNING("Invalid value for 'compression_threshold': %s, expected a non-negative "
+                        "number of bytes. Using default value of %d.",
+                        value, DEFAULT_COMPRESSION_THRESHOLD);
+        }
     }
     else if (strcmp(name, "ms_timestamp") == 0)
     {
         mxs_log_set_highprecision_enabled(config_truth_value((char*)value));
     }
+    else if (strcmp(name, "log_throttling") == 0)
+    {
+        long count;
+        long window_ms;
+        long suppress_ms;
+        char extra;
+
+        if (sscanf(value, " %ld , %ld , %ld %c", &count, &window_ms, &suppress_ms, &extra) == 3 &&
+            count >= 0 && window_ms >= 0 && suppress_ms >= 0)
+        {
+            MXS_LOG_THROTTLING throttling = { count, window_ms, suppress_ms };
+            mxs_log_set_throttling(&throttling);
+        }
+        else
+        {
+            MXS_WARNING("Invalid value for 'log_throttling': %s, expected three "
+                        "non-negative integers, X, Y, Z.", value);
+        }
+    }
     else if (strcmp(name, "auth_connect_timeout") == 0)
     {
         char* endptr;
@@ -1003,6 +1712,58 @@ handle_global_item(const char *name, const char *value)
     {
         gateway.qc_args = strdup(value);
     }
+    else if (strcmp(name, "query_classifier_offload_size") == 0)
+    {
+        char* endptr;
+        long intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval >= 0 && intval <= INT_MAX)
+        {
+            gateway.qc_offload_size = intval;
+        }
+        else
+        {
+            MXS_WARNING("Invalid value for 'query_classifier_offload_size': %s, expected a "
+                        "non-negative number. Large statements are classified by the "
+                        "polling threads.", value);
+        }
+    }
+    else if (strcmp(name, "query_classifier_offload_threads") == 0)
+    {
+        char* endptr;
+        int intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval > 0)
+        {
+            gateway.qc_offload_threads = intval;
+        }
+        else
+        {
+            MXS_WARNING("Invalid value for 'query_classifier_offload_threads': %s, expected a "
+                        "positive number. Using default value of %d.", value,
+                        DEFAULT_QC_OFFLOAD_THREADS);
+        }
+    }
+    else if (strcmp(name, "session_memory_soft_limit") == 0 ||
+             strcmp(name, "session_memory_hard_limit") == 0)
+    {
+        char* endptr;
+        long intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval >= 0 && intval <= INT_MAX)
+        {
+            if (strcmp(name, "session_memory_soft_limit") == 0)
+            {
+                gateway.session_memory_soft_limit = intval;
+            }
+            else
+            {
+                gateway.session_memory_hard_limit = intval;
+            }
+        }
+        else
+        {
+            MXS_WARNING("Invalid value for '%s': %s, expected a non-negative number. "
+                        "The limit is disabled.", name, value);
+        }
+    }
     else
     {
         for (i = 0; lognames[i].name; i++)
@@ -1053,6 +1814,7 @@ static SSL_LISTENER *
 make_ssl_structure (CONFIG_CONTEXT *obj, bool require_cert, int *error_count)
 {
     char *ssl, *ssl_version, *ssl_cert, *ssl_key, *ssl_ca_cert, *ssl_cert_verify_depth;
+    char *cache_size, *session_timeout, *session_tickets, *ktls;
     int local_errors = 0;
     SSL_LISTENER *new_ssl;
 
@@ -1072,7 +1834,14 @@ make_ssl_structure (CONFIG_CONTEXT *obj, bool require_cert, int *error_count)
             ssl_ca_cert = config_get_value(obj->parameters, "ssl_ca_cert");
             ssl_version = config_get_value(obj->parameters, "ssl_version");
             ssl_cert_verify_depth = config_get_value(obj->parameters, "ssl_cert_verify_depth");
+            cache_size = config_get_value(obj->parameters, "ssl_session_cache_size");
+            session_timeout = config_get_value(obj->parameters, "ssl_session_timeout");
+            session_tickets = config_get_value(obj->parameters, "ssl_session_tickets");
+            ktls = config_get_value(obj->parameters, "ssl_ktls");
             new_ssl->ssl_init_done = false;
+            new_ssl->ssl_session_cache_size = SSL_DEFAULT_SESSION_CACHE_SIZE;
+            new_ssl->ssl_session_timeout = SSL_DEFAULT_SESSION_TIMEOUT;
+            new_ssl->ssl_session_tickets = true;
 
             if (ssl_version)
             {
@@ -1103,6 +1872,55 @@ make_ssl_structure (CONFIG_CONTEXT *obj, bool require_cert, int *error_count)
                 new_ssl->ssl_cert_verify_depth = 9;
             }
 
+            if (cache_size)
+            {
+                char *endptr;
+                long val = strtol(cache_size, &endptr, 0);
+
+                if (*endptr != '\0' || val < 0 || val > INT_MAX)
+                {
+                    MXS_ERROR("Invalid parameter value for 'ssl_session_cache_size'"
+                              " for service '%s': %s", obj->object, cache_size);
+                    local_errors++;
+                }
+                else
+                {
+                    new_ssl->ssl_session_cache_size = val;
+                }
+            }
+
+            if (session_timeout)
+            {
+                char *endptr;
+                long val = strtol(session_timeout, &endptr, 0);
+
+                if (*endptr != '\0' || val <= 0 || val > INT_MAX)
+                {
+                    MXS_ERROR("Invalid parameter value for 'ssl_session_timeout'"
+                              " for service '%s': %s", obj->object, session_timeout);
+                    local_errors++;
+                }
+                else
+                {
+                    new_ssl->ssl_session_timeout = val;
+                }
+            }
+
+            if (session_tickets)
+            {
+                new_ssl->ssl_session_tickets = config_truth_value(session_tickets);
+            }
+
+            if (ktls && config_truth_value(ktls))
+            {
+#ifdef SSL_OP_ENABLE_KTLS
+                new_ssl->ssl_ktls = true;
+#else
+                MXS_WARNING("The OpenSSL library MaxScale was built with does not support "
+                            "kernel TLS, ignoring 'ssl_ktls' for '%s'.", obj->object);
+#endif
+            }
+
             listener_set_certificates(new_ssl, ssl_cert, ssl_key, ssl_ca_cert);
 
             if (require_cert && new_ssl->ssl_cert == NULL)
@@ -1208,6 +2026,56 @@ handle_feedback_item(const char *name, const char *value)
     return 1;
 }
 
+/**
+ * Check the limits of the number of polling threads once the configuration
+ * has been read. The thread count is scaled at runtime if min_threads is less
+ * than max_threads, an unset limit defaults to the value of threads. The
+ * number of threads to start with is kept within the limits and the number of
+ * thread ids is set to the maximum.
+ */
+static void
+check_thread_limits()
+{
+    int threads = gateway.n_threads;
+    int min = gateway.min_threads;
+    int max = gateway.max_threads;
+
+    if (min == 0)
+    {
+        min = max && max < threads ? max : threads;
+    }
+    if (max == 0)
+    {
+        max = min > threads ? min : threads;
+    }
+
+    if (min > max)
+    {
+        MXS_WARNING("The value of 'min_threads', %d, is greater than the value of "
+                    "'max_threads', %d. Using %d for both.", min, max, max);
+        min = max;
+    }
+
+    if (min < max && gateway.poll_mode == POLL_MODE_PER_THREAD)
+    {
+        MXS_WARNING("The number of threads is not scaled with 'poll_mode=per_thread', "
+                    "using %d threads.", threads);
+        min = max = threads;
+    }
+
+    if (threads < min || threads > max)
+    {
+        threads = threads < min ? min : max;
+        MXS_NOTICE("Starting with %d threads, within the limits set by 'min_threads' "
+                   "and 'max_threads'.", threads);
+    }
+
+    gateway.initial_threads = threads;
+    gateway.min_threads = min;
+    gateway.max_threads = max;
+    gateway.n_threads = max;
+}
+
 /**
  * Set the defaults for the global configuration options
  */
@@ -1217,8 +2085,39 @@ global_defaults()
     uint8_t mac_addr[6] = "";
     struct utsname uname_data;
     gateway.n_threads = DEFAULT_NTHREADS;
+    gateway.initial_threads = DEFAULT_NTHREADS;
+    gateway.min_threads = 0;
+    gateway.max_threads = 0;
     gateway.n_nbpoll = DEFAULT_NBPOLLS;
     gateway.pollsleep = DEFAULT_POLLSLEEP;
+    gateway.poll_mode = POLL_MODE_SHARED;
+    gateway.poll_batch_size = DEFAULT_POLL_BATCH_SIZE;
+    gateway.adaptive_poll = false;
+    gateway.busy_poll_time = DEFAULT_BUSY_POLL_TIME;
+    gateway.socket_busy_poll = 0;
+    gateway.hp_event_times = false;
+    gateway.read_mode = READ_MODE_PROBE;
+    gateway.reuseport = false;
+    gateway.io_uring = false;
+    gateway.thread_affinity = THREAD_AFFINITY_NONE;
+    CPU_ZERO(&gateway.thread_cpus);
+    gateway.accept_budget = DEFAULT_ACCEPT_BUDGET;
+    gateway.monitor_threads = DEFAULT_MONITOR_THREADS;
+    gateway.service_start_threads = DEFAULT_SERVICE_START_THREADS;
+    gateway.qc_offload_size = 0;
+    gateway.qc_offload_threads = DEFAULT_QC_OFFLOAD_THREADS;
+    gateway.session_memory_soft_limit = 0;
+    gateway.session_memory_hard_limit = 0;
+    gateway.writeq_high_water = 0;
+    gateway.writeq_low_water = 0;
+    gateway.client_compression = false;
+    gateway.compression_threshold = DEFAULT_COMPRESSION_THRESHOLD;
+    gateway.session_track = false;
+    gateway.pipeline_batching = false;
+    gateway.trace_records = 0;
+    gateway.trace_sample_rate = 0;
+    gateway.trace_sample_user[0] = '\0';
+    gateway.huge_pages = HUGE_PAGES_OFF;
     gateway.auth_conn_timeout = DEFAULT_AUTH_CONNECT_TIMEOUT;
     gateway.auth_read_timeout = DEFAULT_AUTH_READ_TIMEOUT;
     gateway.auth_write_timeout = DEFAULT_AUTH_WRITE_TIMEOUT;
@@ -2487,6 +3386,51 @@ int create_new_server(CONFIG_CONTEXT *obj)
             }
         }
 
+        const char *poolmin = config_get_value_string(obj->parameters, "persistpoolmin");
+        if (poolmin)
+        {
+            long int persistpoolmin = strtol(poolmin, &endptr, 0);
+            if (*endptr != '\0' || persistpoolmin < 0)
+            {
+                MXS_ERROR("Invalid value for 'persistpoolmin' for server %s: %s",
+                          server->unique_name, poolmin);
+                error_count++;
+            }
+            else if (persistpoolmin > server->persistpoolmax)
+            {
+                MXS_WARNING("The 'persistpoolmin' of server %s is larger than its "
+                            "'persistpoolmax', the pool is filled to %ld connections.",
+                            server->unique_name, server->persistpoolmax);
+                server->persistpoolmin = server->persistpoolmax;
+            }
+            else
+            {
+                server->persistpoolmin = persistpoolmin;
+            }
+        }
+
+        const char *timeout = config_get_value_string(obj->parameters, "connect_timeout");
+        if (timeout)
+        {
+            long int connect_timeout = strtol(timeout, &endptr, 0);
+            if (*endptr != '\0' || connect_timeout < 0)
+            {
+                MXS_ERROR("Invalid value for 'connect_timeout' for server %s: %s",
+                          server->unique_name, timeout);
+                error_count++;
+            }
+            else
+            {
+                server->connect_timeout = connect_timeout;
+            }
+        }
+
+        const char *compression = config_get_value_string(obj->parameters, "compression");
+        if (compression)
+        {
+            server->compression = config_truth_value((char *)compression);
+        }
+
         CONFIG_PARAMETER *params = obj->parameters;
 
         server->server_ssl = make_ssl_structure(obj, false, &error_count);
@@ -2647,6 +3591,60 @@ int create_new_monitor(CONFIG_CONTEXT *context, CONFIG_CONTEXT *obj, HASHTABLE*
                        obj->object, MONITOR_INTERVAL);
         }
 
+        char *fast_interval_str = config_get_value(obj->parameters, "monitor_fast_interval");
+        if (fast_interval_str)
+        {
+            char *endptr;
+            long fast_interval = strtol(fast_interval_str, &endptr, 0);
+
+            if (*endptr == '\0' && fast_interval >= 0)
+            {
+                monitorSetFastInterval(obj->element, (unsigned long)fast_interval);
+            }
+            else
+            {
+                MXS_ERROR("Invalid 'monitor_fast_interval' parameter for monitor '%s': %s",
+                          obj->object, fast_interval_str);
+                error_count++;
+            }
+        }
+
+        char *script_timeout = config_get_value(obj->parameters, "script_timeout");
+        if (script_timeout)
+        {
+            char *endptr;
+            long timeout = strtol(script_timeout, &endptr, 0);
+
+            if (*endptr == '\0' && timeout >= 0 && timeout <= INT_MAX)
+            {
+                monitorSetScriptTimeout(obj->element, (int)timeout);
+            }
+            else
+            {
+                MXS_ERROR("Invalid 'script_timeout' parameter for monitor '%s': %s",
+                          obj->object, script_timeout);
+                error_count++;
+            }
+        }
+
+        char *script_max_running = config_get_value(obj->parameters, "script_max_running");
+        if (script_max_running)
+        {
+            char *endptr;
+            long max_running = strtol(script_max_running, &endptr, 0);
+
+            if (*endptr == '\0' && max_running > 0 && max_running <= INT_MAX)
+            {
+                monitorSetScriptMaxRunning(obj->element, (int)max_running);
+            }
+            else
+            {
+                MXS_ERROR("Invalid 'script_max_running' parameter for monitor '%s': %s",
+                          obj->object, script_max_running);
+                error_count++;
+            }
+        }
+
         char *connect_timeout = config_get_value(obj->parameters, "backend_connect_timeout");
         if (connect_timeout)
         {
@@ -2741,6 +3739,15 @@ int create_new_listener(CONFIG_CONTEXT *obj, bool startnow)
     char *protocol = config_get_value(obj->parameters, "protocol");
     char *socket = config_get_value(obj->parameters, "socket");
     char *authenticator = config_get_value(obj->parameters, "authenticator");
+    char *priority_name = config_get_value(obj->parameters, "priority");
+    int priority = QUEUE_PRIORITY_NORMAL;
+
+    if (priority_name && (priority = mxs_queue_priority(priority_name)) < 0)
+    {
+        MXS_ERROR("Listener '%s' has an invalid priority '%s'. The priority must be "
+                  "one of high, normal or low.", obj->object, priority_name);
+        return 1;
+    }
 
     if (service_name && protocol && (socket || port))
     {
@@ -2758,7 +3765,11 @@ int create_new_listener(CONFIG_CONTEXT *obj, bool startnow)
                 }
                 else
                 {
-                    serviceAddProtocol(service, protocol, socket, 0, authenticator, ssl_info);
+                    if (serviceAddProtocol(service, protocol, socket, 0, authenticator, ssl_info))
+                    {
+                        /** The new listener is the first one of the service */
+                        service->ports->priority = priority;
+                    }
                     if (startnow)
                     {
                         serviceStartProtocol(service, protocol, 0);
@@ -2778,7 +3789,10 @@ int create_new_listener(CONFIG_CONTEXT *obj, bool startnow)
                 }
                 else
                 {
-                    serviceAddProtocol(service, protocol, address, atoi(port), authenticator, ssl_info);
+                    if (serviceAddProtocol(service, protocol, address, atoi(port), authenticator, ssl_info))
+                    {
+                        service->ports->priority = priority;
+                    }
                     if (startnow)
                     {
                         serviceStartProtocol(service, protocol, atoi(port));
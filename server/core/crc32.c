@@ -0,0 +1,288 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file crc32.c The CRC-32 of zlib computed with the instructions of the CPU
+ *
+ * On x86-64 the data is folded 64 bytes at a time with carry-less
+ * multiplication and the result is reduced to 32 bits with a Barrett
+ * reduction, as described in "Fast CRC Computation for Generic Polynomials
+ * Using PCLMULQDQ Instruction" by Gopal et al. The constants are those of the
+ * paper for the bit-reflected CRC-32 polynomial 0x04C11DB7. On ARMv8 the
+ * CRC32X and CRC32B instructions compute the same polynomial directly.
+ *
+ * The implementation is chosen by the first call. Until then the function
+ * pointer refers to the function that makes the choice, more than one thread
+ * may make it at the same time but they all choose the same one.
+ */
+
+#include <crc32.h>
+#include <stdbool.h>
+#include <zlib.h>
+
+#if defined(__x86_64__) && defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#define HAVE_CRC32_PCLMUL 1
+#elif defined(__aarch64__) && defined(__GNUC__) && __GNUC__ >= 6
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#define HAVE_CRC32_ARMV8 1
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+
+/** The shortest data that is not passed to zlib as a whole */
+#define CRC32_MIN_SIMD_LEN 64
+
+typedef uint32_t (*crc32_func_t)(uint32_t crc, const uint8_t *buf, size_t len);
+
+static uint32_t crc32_choose(uint32_t crc, const uint8_t *buf, size_t len);
+
+static crc32_func_t crc32_func = crc32_choose;
+static const char *crc32_name = "zlib";
+
+/**
+ * The CRC-32 of zlib, computed in parts that fit into the length of zlib
+ */
+static uint32_t crc32_zlib(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    while (len > 0)
+    {
+        uInt n = len > 0x40000000 ? 0x40000000 : len;
+        crc = crc32(crc, buf, n);
+        buf += n;
+        len -= n;
+    }
+
+    return crc;
+}
+
+#if defined(HAVE_CRC32_PCLMUL)
+
+/**
+ * Fold data whose length is a multiple of 16 and at least 64 bytes
+ *
+ * @param crc The inverted checksum of the previous data
+ * @param buf The data
+ * @param len Length of the data
+ * @return The inverted checksum
+ */
+__attribute__((target("pclmul,sse2")))
+static uint32_t crc32_pclmul_fold(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    static const uint64_t __attribute__((aligned(16))) k1k2[] = {0x0154442bd4, 0x01c6e41596};
+    static const uint64_t __attribute__((aligned(16))) k3k4[] = {0x01751997d0, 0x00ccaa009e};
+    static const uint64_t __attribute__((aligned(16))) k5k0[] = {0x0163cd6124, 0x0000000000};
+    static const uint64_t __attribute__((aligned(16))) poly[] = {0x01db710641, 0x01f7011641};
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+
+    buf += 64;
+    len -= 64;
+
+    /** Fold four 16 byte lanes in parallel */
+    while (len >= 64)
+    {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+        y5 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+        buf += 64;
+        len -= 64;
+    }
+
+    /** Fold the lanes into one */
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    /** Fold the remaining 16 byte blocks */
+    while (len >= 16)
+    {
+        x2 = _mm_loadu_si128((const __m128i *)buf);
+
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+        buf += 16;
+        len -= 16;
+    }
+
+    /** Fold 128 bits to 64 bits */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /** Barrett reduction to 32 bits */
+    x0 = _mm_load_si128((const __m128i *)poly);
+
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return _mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    if (len >= CRC32_MIN_SIMD_LEN)
+    {
+        size_t n = len & ~(size_t)15;
+        crc = ~crc32_pclmul_fold(~crc, buf, n);
+        buf += n;
+        len -= n;
+    }
+
+    return crc32_zlib(crc, buf, len);
+}
+
+static bool crc32_pclmul_supported()
+{
+    unsigned int eax, ebx, ecx, edx;
+    return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_PCLMUL);
+}
+
+#elif defined(HAVE_CRC32_ARMV8)
+
+__attribute__((target("+crc")))
+static uint32_t crc32_armv8(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    crc = ~crc;
+
+    while (len > 0 && ((uintptr_t)buf & 7))
+    {
+        crc = __crc32b(crc, *buf++);
+        len--;
+    }
+
+    while (len >= 8)
+    {
+        crc = __crc32d(crc, *(const uint64_t *)buf);
+        buf += 8;
+        len -= 8;
+    }
+
+    while (len > 0)
+    {
+        crc = __crc32b(crc, *buf++);
+        len--;
+    }
+
+    return ~crc;
+}
+
+static bool crc32_armv8_supported()
+{
+    return getauxval(AT_HWCAP) & HWCAP_CRC32;
+}
+
+#endif
+
+/**
+ * Choose the implementation for this CPU and compute the checksum with it
+ */
+static uint32_t crc32_choose(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    crc32_func_t func = crc32_zlib;
+    const char *name = "zlib";
+
+#if defined(HAVE_CRC32_PCLMUL)
+    if (crc32_pclmul_supported())
+    {
+        func = crc32_pclmul;
+        name = "pclmul";
+    }
+#elif defined(HAVE_CRC32_ARMV8)
+    if (crc32_armv8_supported())
+    {
+        func = crc32_armv8;
+        name = "armv8";
+    }
+#endif
+
+    __atomic_store_n(&crc32_name, name, __ATOMIC_RELAXED);
+    __atomic_store_n(&crc32_func, func, __ATOMIC_RELEASE);
+
+    return func(crc, buf, len);
+}
+
+/**
+ * Compute the CRC-32 of data, the same checksum as zlib's crc32
+ *
+ * @param crc The checksum of the previous data, 0 for the first part
+ * @param buf The data
+ * @param len Length of the data
+ * @return The checksum
+ */
+uint32_t mxs_crc32(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    return __atomic_load_n(&crc32_func, __ATOMIC_ACQUIRE)(crc, buf, len);
+}
+
+/**
+ * Get the name of the implementation that computes the checksums
+ *
+ * @return "pclmul", "armv8" or "zlib"
+ */
+const char *mxs_crc32_impl()
+{
+    mxs_crc32(0, NULL, 0);
+    return __atomic_load_n(&crc32_name, __ATOMIC_RELAXED);
+}
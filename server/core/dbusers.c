@@ -37,6 +37,7 @@
 
 #include <stdio.h>
 #include <ctype.h>
+#include <limits.h>
 #include <mysql.h>
 
 #include <dcb.h>
@@ -50,6 +51,14 @@
 #include <mysqld_error.h>
 #include <regex.h>
 #include <mysql_utils.h>
+#include <mysql_pool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 /** Don't include the root user */
 #define USERS_QUERY_NO_ROOT " AND user.user NOT IN ('root')"
@@ -121,18 +130,49 @@
 MaxScale authentication will proceed without including database permissions. \
 See earlier error messages for user '%s' for more information."
 
+/** The magic bytes at the start of a users snapshot file */
+#define DBUSERS_SNAPSHOT_MAGIC   "MXSUSERS"
+
+/** The version of the users snapshot format */
+#define DBUSERS_SNAPSHOT_VERSION 1
+
+/**
+ * The header of a users snapshot file. The records follow the header and are
+ * covered by the checksum. All values are in the byte order of the host that
+ * wrote the file.
+ */
+typedef struct
+{
+    char     magic[8];      /*< DBUSERS_SNAPSHOT_MAGIC without the null byte */
+    uint32_t version;       /*< DBUSERS_SNAPSHOT_VERSION */
+    uint32_t count;         /*< Number of records */
+    uint32_t length;        /*< Length of the records in bytes */
+    uint32_t checksum;      /*< FNV-1a hash of the records */
+} DBUSERS_SNAPSHOT_HEADER;
+
+/**
+ * A user record of a snapshot. The user, the hostname, the resource and the
+ * password follow the record in that order, each with its terminating null
+ * byte so that they can be used straight from a mapping of the file.
+ */
+typedef struct
+{
+    uint32_t addr;          /*< The IPv4 address in network byte order */
+    int32_t  netmask;       /*< The netmask of the address */
+    int16_t  user_len;      /*< Length of the user name */
+    int16_t  host_len;      /*< Length of the hostname */
+    int16_t  resource_len;  /*< Length of the resource, -1 for no resource */
+    int16_t  passwd_len;    /*< Length of the password */
+} DBUSERS_SNAPSHOT_RECORD;
+
 static int add_databases(SERVICE *service, MYSQL *con);
 static int add_wildcard_users(USERS *users, char* name, char* host,
                               char* password, char* anydb, char* db, HASHTABLE* hash);
 static void *dbusers_keyread(int fd);
-static int dbusers_keywrite(int fd, void *key);
 static void *dbusers_valueread(int fd);
-static int dbusers_valuewrite(int fd, void *value);
 static int get_all_users(SERVICE *service, USERS *users);
 static int get_databases(SERVICE *, MYSQL *);
 static int get_users(SERVICE *service, USERS *users);
-static MYSQL *gw_mysql_init(void);
-static int gw_mysql_set_timeouts(MYSQL* handle);
 static bool host_has_singlechar_wildcard(const char *host);
 static bool host_matches_singlechar_wildcard(const char* user, const char* wild);
 static bool is_ipaddress(const char* host);
@@ -147,6 +187,7 @@ static int uh_cmpfun(void* v1, void* v2);
 static int uh_hfun(void* key);
 static void *uh_keydup(void* key);
 static void uh_keyfree(void* key);
+static void mysql_users_reserve(USERS *users, int count);
 static int wildcard_db_grant(char* str);
 
 /**
@@ -340,6 +381,8 @@ replace_mysql_users(SERVICE *service)
         MXS_DEBUG("%lu [replace_mysql_users] users' tables replaced, checksum differs",
                   pthread_self());
         service->users = newusers;
+        /** Invalidates the cached authentication results of the old users */
+        atomic_add(&service->users_generation, 1);
     }
 
     /* free old resources */
@@ -803,26 +846,16 @@ get_all_users(SERVICE *service, USERS *users)
     {
         while (!service->svc_do_shutdown && server != NULL)
         {
-            con = gw_mysql_init();
-            if (con)
+            if ((con = mxs_mysql_pool_get(server->server, service_user, dpwd)) == NULL)
             {
-                if (mxs_mysql_real_connect(con, server->server, service_user, dpwd) == NULL)
-                {
-                    MXS_ERROR("Failure loading users data from backend "
-                              "[%s:%i] for service [%s]. MySQL error %i, %s",
-                              server->server->name, server->server->port,
-                              service->name, mysql_errno(con), mysql_error(con));
-                    mysql_close(con);
-                }
-                else
-                {
-                    /** Successfully connected to a server */
-                    break;
-                }
+                MXS_ERROR("Failure loading users data from backend "
+                          "[%s:%i] for service [%s]. MySQL error %i, %s",
+                          server->server->name, server->server->port,
+                          service->name, mxs_mysql_pool_errno(), mxs_mysql_pool_error());
             }
             else
             {
-                server = NULL;
+                /** Successfully connected to a server */
                 break;
             }
 
@@ -838,7 +871,7 @@ get_all_users(SERVICE *service, USERS *users)
         }
 
         add_databases(service, con);
-        mysql_close(con);
+        mxs_mysql_pool_put(server->server, con);
         server = server->next;
     }
 
@@ -848,26 +881,16 @@ get_all_users(SERVICE *service, USERS *users)
     {
         while (!service->svc_do_shutdown && server != NULL)
         {
-            con = gw_mysql_init();
-            if (con)
+            if ((con = mxs_mysql_pool_get(server->server, service_user, dpwd)) == NULL)
             {
-                if (mxs_mysql_real_connect(con, server->server, service_user, dpwd) == NULL)
-                {
-                    MXS_ERROR("Failure loading users data from backend "
-                              "[%s:%i] for service [%s]. MySQL error %i, %s",
-                              server->server->name, server->server->port,
-                              service->name, mysql_errno(con), mysql_error(con));
-                    mysql_close(con);
-                }
-                else
-                {
-                    /** Successfully connected to a server */
-                    break;
-                }
+                MXS_ERROR("Failure loading users data from backend "
+                          "[%s:%i] for service [%s]. MySQL error %i, %s",
+                          server->server->name, server->server->port,
+                          service->name, mxs_mysql_pool_errno(), mxs_mysql_pool_error());
             }
             else
             {
-                server = NULL;
+                /** Successfully connected to a server */
                 break;
             }
 
@@ -887,7 +910,7 @@ get_all_users(SERVICE *service, USERS *users)
             const char *server_string = mysql_get_server_info(con);
             if (!server_set_version_string(server->server, server_string))
             {
-                mysql_close(con);
+                mxs_mysql_pool_put(server->server, con);
                 goto cleanup;
             }
         }
@@ -904,7 +927,7 @@ get_all_users(SERVICE *service, USERS *users)
                 MXS_ERROR("Loading users for service [%s] encountered error: [%s].",
                           service->name,
                           mysql_error(con));
-                mysql_close(con);
+                mxs_mysql_pool_put(server->server, con);
                 goto cleanup;
             }
             else
@@ -918,7 +941,7 @@ get_all_users(SERVICE *service, USERS *users)
                     MXS_ERROR("Loading users for service [%s] encountered error: [%s].",
                               service->name,
                               mysql_error(con));
-                    mysql_close(con);
+                    mxs_mysql_pool_put(server->server, con);
                     goto cleanup;
                 }
             }
@@ -931,7 +954,7 @@ get_all_users(SERVICE *service, USERS *users)
             MXS_ERROR("Loading users for service [%s] encountered error: [%s].",
                       service->name,
                       mysql_error(con));
-            mysql_close(con);
+            mxs_mysql_pool_put(server->server, con);
             goto cleanup;
         }
 
@@ -944,10 +967,12 @@ get_all_users(SERVICE *service, USERS *users)
         if (!nusers)
         {
             MXS_ERROR("Counting users for service %s returned 0.", service->name);
-            mysql_close(con);
+            mxs_mysql_pool_put(server->server, con);
             goto cleanup;
         }
 
+        mysql_users_reserve(users, nusers);
+
         userquery = get_users_db_query(server->server->server_string,
                                        service->enable_root, querybuffer);
 
@@ -970,7 +995,7 @@ get_all_users(SERVICE *service, USERS *users)
                           mysql_error(con),
                           mysql_errno(con));
 
-                mysql_close(con);
+                mxs_mysql_pool_put(server->server, con);
 
                 goto cleanup;
             }
@@ -995,7 +1020,7 @@ get_all_users(SERVICE *service, USERS *users)
                               mysql_error(con),
                               mysql_errno(con));
 
-                    mysql_close(con);
+                    mxs_mysql_pool_put(server->server, con);
 
                     goto cleanup;
                 }
@@ -1026,7 +1051,7 @@ get_all_users(SERVICE *service, USERS *users)
                       mysql_error(con));
 
             mysql_free_result(result);
-            mysql_close(con);
+            mxs_mysql_pool_put(server->server, con);
 
             goto cleanup;
         }
@@ -1040,7 +1065,7 @@ get_all_users(SERVICE *service, USERS *users)
                       errno,
                       strerror_r(errno, errbuf, sizeof(errbuf)));
             mysql_free_result(result);
-            mysql_close(con);
+            mxs_mysql_pool_put(server->server, con);
 
             goto cleanup;
         }
@@ -1181,7 +1206,7 @@ get_all_users(SERVICE *service, USERS *users)
         }
 
         mysql_free_result(result);
-        mysql_close(con);
+        mxs_mysql_pool_put(server->server, con);
 
         if ((tmp = realloc(final_data, (strlen(final_data) + strlen(users_data)
                                         + 1) * sizeof(char))) == NULL)
@@ -1267,13 +1292,6 @@ get_users(SERVICE *service, USERS *users)
         return get_all_users(service, users);
     }
 
-    con = gw_mysql_init();
-
-    if (!con)
-    {
-        return -1;
-    }
-
     /**
      * Attempt to connect to one of the databases database or until we run
      * out of databases
@@ -1291,13 +1309,12 @@ get_users(SERVICE *service, USERS *users)
     if (service->svc_do_shutdown)
     {
         free(dpwd);
-        mysql_close(con);
         return -1;
     }
 
     /* Try loading data from master server */
     if (server != NULL &&
-        (mxs_mysql_real_connect(con, server->server, service_user, dpwd) != NULL))
+        (con = mxs_mysql_pool_get(server->server, service_user, dpwd)) != NULL)
     {
         MXS_DEBUG("Dbusers : Loading data from backend database with "
                   "Master role [%s:%i] for service [%s]",
@@ -1307,32 +1324,21 @@ get_users(SERVICE *service, USERS *users)
     }
     else
     {
-        mysql_close(con);
         /* load data from other servers via loop */
         server = service->dbref;
 
         while (!service->svc_do_shutdown && server != NULL)
         {
-            con = gw_mysql_init();
-            if (con)
+            if ((con = mxs_mysql_pool_get(server->server, service_user, dpwd)) == NULL)
             {
-                if (mxs_mysql_real_connect(con, server->server, service_user, dpwd) == NULL)
-                {
-                    MXS_ERROR("Failure loading users data from backend "
-                              "[%s:%i] for service [%s]. MySQL error %i, %s",
-                              server->server->name, server->server->port,
-                              service->name, mysql_errno(con), mysql_error(con));
-                    mysql_close(con);
-                }
-                else
-                {
-                    /** Successfully connected to a server */
-                    break;
-                }
+                MXS_ERROR("Failure loading users data from backend "
+                          "[%s:%i] for service [%s]. MySQL error %i, %s",
+                          server->server->name, server->server->port,
+                          service->name, mxs_mysql_pool_errno(), mxs_mysql_pool_error());
             }
             else
             {
-                server = NULL;
+                /** Successfully connected to a server */
                 break;
             }
 
@@ -1342,7 +1348,10 @@ get_users(SERVICE *service, USERS *users)
         if (service->svc_do_shutdown)
         {
             free(dpwd);
-            mysql_close(con);
+            if (con)
+            {
+                mxs_mysql_pool_put(server->server, con);
+            }
             return -1;
         }
 
@@ -1367,7 +1376,7 @@ get_users(SERVICE *service, USERS *users)
         const char *server_string = mysql_get_server_info(con);
         if (!server_set_version_string(server->server, server_string))
         {
-            mysql_close(con);
+            mxs_mysql_pool_put(server->server, con);
             return -1;
         }
     }
@@ -1383,7 +1392,7 @@ get_users(SERVICE *service, USERS *users)
             /* This is an error we cannot handle, return */
             MXS_ERROR("Loading users for service [%s] encountered error: [%s].",
                       service->name, mysql_error(con));
-            mysql_close(con);
+            mxs_mysql_pool_put(server->server, con);
             return -1;
         }
         else
@@ -1396,7 +1405,7 @@ get_users(SERVICE *service, USERS *users)
             {
                 MXS_ERROR("Loading users for service [%s] encountered error: [%s].",
                           service->name, mysql_error(con));
-                mysql_close(con);
+                mxs_mysql_pool_put(server->server, con);
                 return -1;
             }
         }
@@ -1408,7 +1417,7 @@ get_users(SERVICE *service, USERS *users)
     {
         MXS_ERROR("Loading users for service [%s] encountered error: [%s].",
                   service->name, mysql_error(con));
-        mysql_close(con);
+        mxs_mysql_pool_put(server->server, con);
         return -1;
     }
 
@@ -1421,10 +1430,12 @@ get_users(SERVICE *service, USERS *users)
     if (!nusers)
     {
         MXS_ERROR("Counting users for service %s returned 0.", service->name);
-        mysql_close(con);
+        mxs_mysql_pool_put(server->server, con);
         return -1;
     }
 
+    mysql_users_reserve(users, nusers);
+
     userquery = get_users_db_query(server->server->server_string,
                                    service->enable_root, querybuffer);
     /* send first the query that fetches users and db grants */
@@ -1444,7 +1455,7 @@ get_users(SERVICE *service, USERS *users)
                       "error: [%s], MySQL errno %i", service->name,
                       mysql_error(con), mysql_errno(con));
 
-            mysql_close(con);
+            mxs_mysql_pool_put(server->server, con);
             return -1;
         }
         else
@@ -1465,7 +1476,7 @@ get_users(SERVICE *service, USERS *users)
                           "[%s], code %i", service->name, mysql_error(con),
                           mysql_errno(con));
 
-                mysql_close(con);
+                mxs_mysql_pool_put(server->server, con);
                 return -1;
             }
 
@@ -1490,7 +1501,7 @@ get_users(SERVICE *service, USERS *users)
                   service->name, mysql_error(con));
 
         mysql_free_result(result);
-        mysql_close(con);
+        mxs_mysql_pool_put(server->server, con);
         return -1;
     }
 
@@ -1502,7 +1513,7 @@ get_users(SERVICE *service, USERS *users)
         MXS_ERROR("Memory allocation for user data failed due to %d, %s.",
                   errno, strerror_r(errno, errbuf, sizeof(errbuf)));
         mysql_free_result(result);
-        mysql_close(con);
+        mxs_mysql_pool_put(server->server, con);
         return -1;
     }
 
@@ -1671,7 +1682,7 @@ get_users(SERVICE *service, USERS *users)
 
     free(users_data);
     mysql_free_result(result);
-    mysql_close(con);
+    mxs_mysql_pool_put(server->server, con);
 
     return total_users;
 }
@@ -1691,8 +1702,8 @@ mysql_users_alloc()
         return NULL;
     }
 
-    if ((rval->data = hashtable_alloc(USERS_HASHTABLE_DEFAULT_SIZE, uh_hfun,
-                                      uh_cmpfun)) == NULL)
+    if ((rval->data = hashtable_alloc_concurrent(USERS_HASHTABLE_DEFAULT_SIZE, uh_hfun,
+                                                 uh_cmpfun)) == NULL)
     {
         free(rval);
         return NULL;
@@ -1711,6 +1722,33 @@ mysql_users_alloc()
     return rval;
 }
 
+/**
+ * Resize an empty MySQL users table for the number of users that are about
+ * to be added to it. The default size of the table is meant for a handful of
+ * users and a large user base would otherwise end up in long bucket chains.
+ * A table that already has entries is left as it is.
+ *
+ * @param users The users table
+ * @param count The expected number of user entries
+ */
+static void
+mysql_users_reserve(USERS *users, int count)
+{
+    if (users->stats.n_entries == 0 && count > users->data->hashsize)
+    {
+        HASHTABLE *data = hashtable_alloc_concurrent(count, uh_hfun, uh_cmpfun);
+
+        if (data)
+        {
+            hashtable_memory_fns(data, (HASHMEMORYFN) uh_keydup,
+                                 (HASHMEMORYFN) strdup, (HASHMEMORYFN) uh_keyfree,
+                                 (HASHMEMORYFN) free);
+            hashtable_free(users->data);
+            users->data = data;
+        }
+    }
+}
+
 /**
  * Add a new MySQL user to the user table. The user name must be unique
  *
@@ -1771,8 +1809,29 @@ static int uh_hfun(void* key)
     }
     else
     {
-        return (*hu->user + * (hu->user + 1) +
-                (unsigned int) (hu->ipv4.sin_addr.s_addr & 0xFF000000 / (256 * 256 * 256)));
+        /**
+         * Every octet of the address is part of the hash: the grants of one
+         * user to different networks land in different buckets and each of
+         * the prefix lookups of an authentication is a single probe. The
+         * entries with a wildcard hostname are stored with the address 0.0.0.0
+         * which is also what the last, user@%, lookup uses.
+         */
+        unsigned int hash = 2166136261u;
+
+        for (const unsigned char *c = (const unsigned char*)hu->user; *c; c++)
+        {
+            hash = (hash ^ *c) * 16777619u;
+        }
+
+        uint32_t addr = hu->ipv4.sin_addr.s_addr;
+
+        for (int i = 0; i < 4; i++)
+        {
+            hash = (hash ^ (addr & 0xFF)) * 16777619u;
+            addr >>= 8;
+        }
+
+        return (int)(hash & INT_MAX);
     }
 }
 
@@ -2182,165 +2241,6 @@ static int normalize_hostname(const char *input_host, char *output_host)
     return netmask;
 }
 
-/**
- * Returns a MYSQL object suitably configured.
- *
- * @return An object or NULL if something fails.
- */
-MYSQL *gw_mysql_init()
-{
-    MYSQL* con = mysql_init(NULL);
-
-    if (con)
-    {
-        if (gw_mysql_set_timeouts(con) == 0)
-        {
-            // MYSQL_OPT_USE_REMOTE_CONNECTION must be set if the embedded
-            // libary is used. With Connector-C (at least 2.2.1) the call
-            // fails.
-#if !defined(LIBMARIADB)
-            if (mysql_options(con, MYSQL_OPT_USE_REMOTE_CONNECTION, NULL) != 0)
-            {
-                MXS_ERROR("Failed to set external connection. "
-                          "It is needed for backend server connections.");
-                mysql_close(con);
-                con = NULL;
-            }
-#endif
-        }
-        else
-        {
-            MXS_ERROR("Failed to set timeout values for backend connection.");
-            mysql_close(con);
-            con = NULL;
-        }
-    }
-    else
-    {
-        MXS_ERROR("mysql_init: %s", mysql_error(NULL));
-    }
-
-    return con;
-}
-
-/**
- * Set read, write and connect timeout values for MySQL database connection.
- *
- * @param handle            MySQL handle
- * @param read_timeout      Read timeout value in seconds
- * @param write_timeout     Write timeout value in seconds
- * @param connect_timeout   Connect timeout value in seconds
- *
- * @return 0 if succeed, 1 if failed
- */
-static int gw_mysql_set_timeouts(MYSQL* handle)
-{
-    int rc;
-
-    GATEWAY_CONF* cnf = config_get_global_options();
-
-    if ((rc = mysql_options(handle, MYSQL_OPT_READ_TIMEOUT,
-                            (void *) &cnf->auth_read_timeout)))
-    {
-        MXS_ERROR("Failed to set read timeout for backend connection.");
-        goto retblock;
-    }
-
-    if ((rc = mysql_options(handle, MYSQL_OPT_CONNECT_TIMEOUT,
-                            (void *) &cnf->auth_conn_timeout)))
-    {
-        MXS_ERROR("Failed to set connect timeout for backend connection.");
-        goto retblock;
-    }
-
-    if ((rc = mysql_options(handle, MYSQL_OPT_WRITE_TIMEOUT,
-                            (void *) &cnf->auth_write_timeout)))
-    {
-        MXS_ERROR("Failed to set write timeout for backend connection.");
-        goto retblock;
-    }
-
-retblock:
-    return rc;
-}
-
-/*
- * Serialise a key for the dbusers hashtable to a file
- *
- * @param fd    File descriptor to write to
- * @param key   The key to write
- * @return      0 on error, 1 if the key was written
- */
-static int
-dbusers_keywrite(int fd, void *key)
-{
-    MYSQL_USER_HOST *dbkey = (MYSQL_USER_HOST *) key;
-    int tmp;
-
-    tmp = strlen(dbkey->user);
-    if (write(fd, &tmp, sizeof(tmp)) != sizeof(tmp))
-    {
-        return 0;
-    }
-    if (write(fd, dbkey->user, tmp) != tmp)
-    {
-        return 0;
-    }
-    if (write(fd, &dbkey->ipv4, sizeof(dbkey->ipv4)) != sizeof(dbkey->ipv4))
-    {
-        return 0;
-    }
-    if (write(fd, &dbkey->netmask, sizeof(dbkey->netmask)) != sizeof(dbkey->netmask))
-    {
-        return 0;
-    }
-    if (dbkey->resource)
-    {
-        tmp = strlen(dbkey->resource);
-        if (write(fd, &tmp, sizeof(tmp)) != sizeof(tmp))
-        {
-            return 0;
-        }
-        if (write(fd, dbkey->resource, tmp) != tmp)
-        {
-            return 0;
-        }
-    }
-    else // NULL is valid, so represent with a length of -1
-    {
-        tmp = -1;
-        if (write(fd, &tmp, sizeof(tmp)) != sizeof(tmp))
-        {
-            return 0;
-        }
-    }
-    return 1;
-}
-
-/**
- * Serialise a value for the dbusers hashtable to a file
- *
- * @param fd    File descriptor to write to
- * @param value The value to write
- * @return      0 on error, 1 if the value was written
- */
-static int
-dbusers_valuewrite(int fd, void *value)
-{
-    int tmp;
-
-    tmp = strlen(value);
-    if (write(fd, &tmp, sizeof(tmp)) != sizeof(tmp))
-    {
-        return 0;
-    }
-    if (write(fd, value, tmp) != tmp)
-    {
-        return 0;
-    }
-    return 1;
-}
-
 /**
  * Unserialise a key for the dbusers hashtable from a file
  *
@@ -2451,29 +2351,310 @@ dbusers_valueread(int fd)
 }
 
 /**
- * Save the dbusers data to a hashtable file
+ * Append a string, including its terminating null byte, to a users snapshot
+ *
+ * @param buf   The snapshot buffer
+ * @param len   The length of the data in the buffer, updated
+ * @param str   The string or NULL
+ * @return      The length value to store in the record, -1 for NULL
+ */
+static int16_t
+dbusers_snapshot_string(uint8_t *buf, size_t *len, const char *str)
+{
+    if (str == NULL)
+    {
+        return -1;
+    }
+
+    size_t n = strlen(str) + 1;
+    memcpy(buf + *len, str, n);
+    *len += n;
+    return (int16_t)n;
+}
+
+/**
+ * Calculate the checksum of the records of a users snapshot
+ *
+ * @param data  The records
+ * @param len   Length of the records
+ * @return      The FNV-1a hash of the records
+ */
+static uint32_t
+dbusers_snapshot_checksum(const uint8_t *data, size_t len)
+{
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+/**
+ * Write a buffer to a file descriptor, retrying partial writes
+ *
+ * @param fd    File descriptor to write to
+ * @param buf   The data
+ * @param len   Length of the data
+ * @return      True if all of the data was written
+ */
+static bool
+dbusers_write_all(int fd, const uint8_t *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+/**
+ * Save the dbusers data to a snapshot file
+ *
+ * The whole snapshot is built in memory and written to a temporary file which
+ * is then renamed over the old one. A crash or a full disk thus never leaves
+ * a partially written snapshot behind.
  *
  * @param users     The hashtable that stores the user data
  * @param filename  The filename to save the data in
- * @return      The number of entries saved
+ * @return      The number of entries saved or -1 on error
  */
 int
 dbusers_save(USERS *users, const char *filename)
 {
-    return hashtable_save(users->data, filename, dbusers_keywrite, dbusers_valuewrite);
+    HASHITERATOR *iter;
+    MYSQL_USER_HOST *key;
+    size_t size = sizeof(DBUSERS_SNAPSHOT_HEADER);
+    size_t len = sizeof(DBUSERS_SNAPSHOT_HEADER);
+    uint8_t *buf;
+    int count = 0;
+
+    /** The upper bound of the size of a record */
+    const size_t max_record = sizeof(DBUSERS_SNAPSHOT_RECORD) + MYSQL_USER_MAXLEN +
+                              MYSQL_HOST_MAXLEN + MYSQL_DATABASE_MAXLEN + MYSQL_PASSWORD_LEN + 4;
+
+    if ((buf = malloc(size)) == NULL || (iter = hashtable_iterator(users->data)) == NULL)
+    {
+        free(buf);
+        return -1;
+    }
+
+    while ((key = hashtable_next(iter)) != NULL)
+    {
+        char *passwd = hashtable_fetch(users->data, key);
+
+        if (passwd == NULL ||
+            strlen(key->user) >= MYSQL_USER_MAXLEN + 1 ||
+            (key->resource && strlen(key->resource) >= MYSQL_DATABASE_MAXLEN + 1) ||
+            strlen(passwd) >= MYSQL_PASSWORD_LEN + 1)
+        {
+            continue;
+        }
+
+        if (len + max_record > size)
+        {
+            size_t newsize = (size + max_record) * 2;
+            uint8_t *newbuf = realloc(buf, newsize);
+
+            if (newbuf == NULL)
+            {
+                hashtable_iterator_free(iter);
+                free(buf);
+                return -1;
+            }
+            buf = newbuf;
+            size = newsize;
+        }
+
+        DBUSERS_SNAPSHOT_RECORD rec;
+        size_t rec_offset = len;
+        len += sizeof(rec);
+
+        rec.addr = key->ipv4.sin_addr.s_addr;
+        rec.netmask = key->netmask;
+        rec.user_len = dbusers_snapshot_string(buf, &len, key->user);
+        rec.host_len = dbusers_snapshot_string(buf, &len, key->hostname);
+        rec.resource_len = dbusers_snapshot_string(buf, &len, key->resource);
+        rec.passwd_len = dbusers_snapshot_string(buf, &len, passwd);
+        memcpy(buf + rec_offset, &rec, sizeof(rec));
+        count++;
+    }
+
+    hashtable_iterator_free(iter);
+
+    DBUSERS_SNAPSHOT_HEADER hdr;
+    memcpy(hdr.magic, DBUSERS_SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    hdr.version = DBUSERS_SNAPSHOT_VERSION;
+    hdr.count = count;
+    hdr.length = len - sizeof(hdr);
+    hdr.checksum = dbusers_snapshot_checksum(buf + sizeof(hdr), hdr.length);
+    memcpy(buf, &hdr, sizeof(hdr));
+
+    char tmpname[PATH_MAX + 1];
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+
+    int fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+    if (fd == -1)
+    {
+        free(buf);
+        return -1;
+    }
+
+    bool ok = dbusers_write_all(fd, buf, len) && fsync(fd) == 0;
+    free(buf);
+
+    if (close(fd) != 0 || !ok || rename(tmpname, filename) != 0)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("Failed to write the users snapshot '%s': %d, %s", filename,
+                  errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        unlink(tmpname);
+        return -1;
+    }
+
+    return count;
+}
+
+/**
+ * Add the records of a users snapshot to a users table
+ *
+ * @param users     The users table
+ * @param data      The records, already checked against the checksum
+ * @param len       Length of the records
+ * @param count     The number of records
+ * @return          The number of entries loaded or -1 if the records are malformed
+ */
+static int
+dbusers_load_snapshot(USERS *users, const uint8_t *data, size_t len, uint32_t count)
+{
+    const uint8_t *ptr = data;
+    const uint8_t *end = data + len;
+    int loaded = 0;
+
+    mysql_users_reserve(users, count);
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        DBUSERS_SNAPSHOT_RECORD rec;
+
+        if (end - ptr < (ptrdiff_t)sizeof(rec))
+        {
+            return -1;
+        }
+        memcpy(&rec, ptr, sizeof(rec));
+        ptr += sizeof(rec);
+
+        /** The strings are used in place, check that each of them is terminated */
+        const char *user = (const char*)ptr;
+        const char *host = user + rec.user_len;
+        const char *resource = host + rec.host_len;
+        const char *passwd = resource + (rec.resource_len > 0 ? rec.resource_len : 0);
+        const uint8_t *next = (const uint8_t*)passwd + rec.passwd_len;
+
+        if (rec.user_len <= 0 || rec.host_len <= 0 || rec.passwd_len <= 0 || rec.resource_len < -1 ||
+            rec.host_len > MYSQL_HOST_MAXLEN + 1 || next > end ||
+            host[-1] != '\0' || resource[-1] != '\0' || next[-1] != '\0' ||
+            (rec.resource_len > 0 && passwd[-1] != '\0'))
+        {
+            return -1;
+        }
+
+        MYSQL_USER_HOST key;
+        memset(&key, 0, sizeof(key));
+        key.user = (char*)user;
+        key.ipv4.sin_family = AF_INET;
+        key.ipv4.sin_addr.s_addr = rec.addr;
+        key.netmask = rec.netmask;
+        key.resource = rec.resource_len < 0 ? NULL : (char*)resource;
+        strcpy(key.hostname, host);
+
+        loaded += mysql_users_add(users, &key, (char*)passwd);
+        ptr = next;
+    }
+
+    return loaded;
 }
 
 /**
- * Load the dbusers data from a saved hashtable file
+ * Load the dbusers data from a saved snapshot file
+ *
+ * The file is mapped into memory and, after the header and the checksum have
+ * been verified, the users are added straight from the mapping. Files in the
+ * older hashtable format are still loaded.
  *
  * @param users     The hashtable that stores the user data
  * @param filename  The filename to laod the data from
- * @return      The number of entries loaded
+ * @return      The number of entries loaded or -1 on error
  */
 int
 dbusers_load(USERS *users, const char *filename)
 {
-    return hashtable_load(users->data, filename, dbusers_keyread, dbusers_valueread);
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(DBUSERS_SNAPSHOT_HEADER))
+    {
+        close(fd);
+        return hashtable_load(users->data, filename, dbusers_keyread, dbusers_valueread);
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    DBUSERS_SNAPSHOT_HEADER hdr;
+    memcpy(&hdr, map, sizeof(hdr));
+
+    if (memcmp(hdr.magic, DBUSERS_SNAPSHOT_MAGIC, sizeof(hdr.magic)) != 0)
+    {
+        munmap(map, st.st_size);
+        return hashtable_load(users->data, filename, dbusers_keyread, dbusers_valueread);
+    }
+
+    const uint8_t *data = (const uint8_t*)map + sizeof(hdr);
+    int rval = -1;
+
+    if (hdr.version != DBUSERS_SNAPSHOT_VERSION)
+    {
+        MXS_ERROR("Users snapshot '%s' has version %u, expected %u.", filename,
+                  hdr.version, DBUSERS_SNAPSHOT_VERSION);
+    }
+    else if (hdr.length != st.st_size - sizeof(hdr) ||
+             hdr.checksum != dbusers_snapshot_checksum(data, hdr.length))
+    {
+        MXS_ERROR("Users snapshot '%s' is truncated or corrupted.", filename);
+    }
+    else if ((rval = dbusers_load_snapshot(users, data, hdr.length, hdr.count)) == -1)
+    {
+        MXS_ERROR("Users snapshot '%s' contains malformed records.", filename);
+    }
+
+    munmap(map, st.st_size);
+    return rval;
 }
 
 /**
@@ -2587,28 +2768,17 @@ static int add_wildcard_users(USERS *users, char* name, char* host, char* passwo
 static bool check_server_permissions(SERVICE *service, SERVER* server,
                                     const char* user, const char* password)
 {
-    MYSQL *mysql = gw_mysql_init();
+    MYSQL *mysql = mxs_mysql_pool_get(server, user, password);
 
     if (mysql == NULL)
     {
-        return false;
-    }
-
-    GATEWAY_CONF* cnf = config_get_global_options();
-    mysql_options(mysql, MYSQL_OPT_READ_TIMEOUT, &cnf->auth_read_timeout);
-    mysql_options(mysql, MYSQL_OPT_CONNECT_TIMEOUT, &cnf->auth_conn_timeout);
-    mysql_options(mysql, MYSQL_OPT_WRITE_TIMEOUT, &cnf->auth_write_timeout);
-
-    if (mxs_mysql_real_connect(mysql, server, user, password) == NULL)
-    {
-        int my_errno = mysql_errno(mysql);
+        int my_errno = mxs_mysql_pool_errno();
 
         MXS_ERROR("[%s] Failed to connect to server '%s' (%s:%d) when"
                   " checking authentication user credentials and permissions: %d %s",
                   service->name, server->unique_name, server->name, server->port,
-                  my_errno, mysql_error(mysql));
+                  my_errno, mxs_mysql_pool_error());
 
-        mysql_close(mysql);
         return my_errno != ER_ACCESS_DENIED_ERROR;
     }
 
@@ -2715,7 +2885,7 @@ static bool check_server_permissions(SERVICE *service, SERVER* server,
         }
     }
 
-    mysql_close(mysql);
+    mxs_mysql_pool_put(server, mysql);
 
     return rval;
 }
@@ -59,12 +59,14 @@
  * 07/02/2016   Martin Brampton         Make dcb_read_SSL & dcb_create_SSL internal,
  *                                      further small SSL logic changes
  * 31/05/2016   Martin Brampton         Implement connection throttling
+ * 14/10/2016                           Admit queued connections when clients close
  *
  * @endverbatim
  */
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <time.h>
 #include <signal.h>
@@ -79,58 +81,200 @@
 #include <gw.h>
 #include <maxscale/poll.h>
 #include <atomic.h>
+#include <platform.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <hashtable.h>
 #include <listener.h>
 #include <hk_heartbeat.h>
+#include <uring.h>
 #include <netinet/tcp.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <limits.h>
+#include <probes.h>
+#include <hugepage.h>
 
 static  DCB             *allDCBs = NULL;        /* Diagnostics need a list of DCBs */
 static  DCB             *lastDCB = NULL;
-static  DCB             *wasfreeDCB = NULL;
-static  int             freeDCBcount = 0;
+static  DCB             *freeDCBs = NULL;       /* Free DCBs not held by any thread */
+static  HUGEPAGE_ARENA  dcb_arena = HUGEPAGE_ARENA_INIT("dcb", sizeof(DCB)); /* Memory of new DCBs */
 static  int             nDCBs = 0;
 static  int             maxDCBs = 0;
-static  DCB             *zombies = NULL;
+static  DCB             *zombies = NULL;        /* Closed DCBs not yet taken by a thread */
 static  int             nzombies = 0;
 static  int             maxzombies = 0;
+static  int             nclients = 0;           /* DCBs in the client handler role */
+static  int             nbackends = 0;          /* DCBs in the backend handler role */
+static  int             nlistening = 0;         /* DCBs in the listening state */
 static  SPINLOCK        dcbspin = SPINLOCK_INIT;
-static  SPINLOCK        zombiespin = SPINLOCK_INIT;
+
+/**
+ * Serializes pausing and resuming the reads from the backend DCBs of sessions
+ * whose clients read slowly, and from the clients whose servers read slowly.
+ * The most backend DCBs of one session that are paused is DCB_MAX_THROTTLED.
+ */
+static  SPINLOCK        throttle_lock = SPINLOCK_INIT;
+#define DCB_MAX_THROTTLED 64
+
+/** The largest number of connections one new session opens to fill a persistent pool */
+#define DCB_POOL_FILL_BATCH 4
+
+/**
+ * The timers of the new backend connections whose server has not responded
+ * yet. The timers are in milliseconds, as measured by the housekeeper heartbeat.
+ */
+static  SPINLOCK        connect_timer_lock = SPINLOCK_INIT;
+static  TIMER_WHEEL     *connect_timers = NULL;
+static  uint64_t        connect_timers_next = UINT64_MAX; /* When the wheel next needs to be advanced */
+
+/**
+ * The epoch of a thread, padded to a cache line to avoid false sharing. In the
+ * per thread poll mode the zombies of the DCBs that a thread owns are pushed
+ * to the thread so that the DCBs, and the router sessions they close, are
+ * only ever processed by their own thread.
+ */
+typedef struct
+{
+    uint64_t epoch;
+    DCB      *zombies; /* Zombies of the DCBs owned by the thread */
+    char     padding[MXS_CACHE_LINE_SIZE - sizeof(uint64_t) - sizeof(DCB *)];
+} ZOMBIE_EPOCH;
+
+static  uint64_t        zombie_epoch = 0;       /* Incremented for each retired DCB */
+static  ZOMBIE_EPOCH    *thread_epochs = NULL;  /* Last epoch announced by each thread */
+static  int             n_epoch_threads = 0;
+static  bool            owner_zombies = false; /* Zombies are processed by their owners */
+
+static thread_local DCB *thread_zombies = NULL;   /* Zombies waiting for this thread */
+
+/** An object that is freed once no polling thread can refer to it */
+typedef struct retired_object
+{
+    void                  *data;
+    void                  (*free_fn)(void *);
+    uint64_t              epoch;
+    struct retired_object *next;
+} RETIRED_OBJECT;
+
+static  SPINLOCK        retired_lock = SPINLOCK_INIT;
+static  RETIRED_OBJECT  *retired_objects = NULL;
+
+/** The maximum number of buffers filled by one readv call */
+#define DCB_READV_MAX_IOV 8
+
+/** The socket I/O statistics of all DCBs */
+typedef enum
+{
+    DCB_IO_READ_CALLS,      /*< Calls to read and readv */
+    DCB_IO_READ_BYTES,      /*< Bytes read with read and readv */
+    DCB_IO_WRITE_CALLS,     /*< Calls to write and writev */
+    DCB_IO_WRITE_BYTES,     /*< Bytes written with write and writev */
+    DCB_IO_WRITE_BUFFERS,   /*< Buffers passed to write and writev */
+    DCB_IO_URING_CALLS,     /*< Calls to io_uring_enter */
+    DCB_IO_URING_READS,     /*< Reads done through io_uring */
+    DCB_IO_URING_WRITES,    /*< Writes done through io_uring */
+    DCB_IO_N_STATS
+} dcb_io_stat_t;
+
+static  ts_stats_t      io_stats[DCB_IO_N_STATS];
+static  read_mode_t     read_mode = READ_MODE_PROBE;
+static  unsigned int    accept_budget = DEFAULT_ACCEPT_BUDGET; /* Connections accepted per event */
+static  int             writeq_high_water = 0;  /* Write queue size of clients that pauses reads */
+static  int             writeq_low_water = 0;   /* Write queue size of clients that resumes reads */
+
+#define DCB_IO_STAT_ADD(stat, value) do { if (io_stats[stat]) { ts_stats_add(io_stats[stat], value); } } while (false)
+
+/** Add to the bytes in or out of the session of a client DCB, the field is a member of SESSION_STATS */
+#define DCB_SESSION_STAT_ADD(dcb, field, value) do { if ((dcb)->dcb_role == DCB_ROLE_CLIENT_HANDLER && (dcb)->session) { \
+            __atomic_add_fetch(&(dcb)->session->stats.field, value, __ATOMIC_RELAXED); } } while (false)
+
+/** The maximum number of free DCBs a thread keeps for its own use */
+#define DCB_THREAD_POOL_SIZE 256
+
+static thread_local DCB *thread_freeDCBs = NULL;  /* Free DCBs of this thread */
+static thread_local int thread_nfreeDCBs = 0;     /* Number of free DCBs of this thread */
+
+/** The most backend DCBs whose writes one thread defers in a write batch */
+#define DCB_WRITE_BATCH_MAX 64
+
+static thread_local bool thread_write_batch = false;    /* A write batch is open */
+static thread_local DCB *thread_batch_dcbs[DCB_WRITE_BATCH_MAX]; /* DCBs with deferred writes */
+static thread_local int thread_n_batch_dcbs = 0;        /* Number of DCBs in the batch */
+
+/** The number of operations one io_uring submission holds */
+#define DCB_URING_ENTRIES 256
+
+/** The most buffers of a write queue sent with one io_uring sendmsg */
+#define DCB_URING_MAX_IOV 64
+
+static bool use_io_uring = false;                       /* Reads and writes are batched with io_uring */
+static thread_local URING *thread_uring = NULL;         /* The io_uring of this thread */
+static thread_local bool thread_uring_failed = false;   /* The io_uring of this thread can not be used */
 
 static void dcb_final_free(DCB *dcb);
+static void dcb_add_connect_timer(DCB *dcb, long timeout);
+static DCB *dcb_connect_new(SERVER *server, SESSION *session, const char *protocol, int flags);
+static void dcb_fill_persistent(SERVER *server, SESSION *session, const char *protocol);
 static void dcb_call_callback(DCB *dcb, DCB_REASON reason);
 static int  dcb_null_write(DCB *dcb, GWBUF *buf);
 static int  dcb_null_auth(DCB *dcb, SERVER *server, SESSION *session, GWBUF *buf);
 static inline int  dcb_isvalid_nolock(DCB *dcb);
 static inline DCB * dcb_find_in_list(DCB *dcb);
 static inline void dcb_process_victim_queue(DCB *listofdcb);
+static void dcb_add_to_zombies(DCB *dcb);
+static void dcb_count_role(dcb_role_t role, int n);
+static void dcb_release_memory(DCB *dcb);
+static void dcb_add_to_server(DCB *dcb);
+static void dcb_remove_from_server(DCB *dcb);
+static void dcb_free_retired(void);
 static void dcb_stop_polling_and_shutdown (DCB *dcb);
 static bool dcb_maybe_add_persistent(DCB *);
 static inline bool dcb_write_parameter_check(DCB *dcb, GWBUF *queue);
+static bool dcb_write_batch_add(DCB *dcb);
+static URING *dcb_thread_uring();
+static void dcb_thread_uring_failed(int err);
+static int dcb_write_batch_send(URING *ring);
+static void dcb_wrote(DCB *dcb, bool above_water, int total_written);
 static int dcb_bytes_readable(DCB *dcb);
 static int dcb_read_no_bytes_available(DCB *dcb, int nreadtotal);
 static int dcb_create_SSL(DCB* dcb, SSL_LISTENER *ssl);
+static void dcb_SSL_established(DCB *dcb, SSL_LISTENER *ssl);
 static int dcb_read_SSL(DCB *dcb, GWBUF **head);
 static GWBUF *dcb_basic_read(DCB *dcb, int bytesavailable, int maxbytes, int nreadtotal, int *nsingleread);
+static GWBUF *dcb_basic_readv(DCB *dcb, int bufsize, int *nsingleread);
+static int dcb_read_direct(DCB *dcb, GWBUF **head, int maxbytes, int nreadtotal);
+static int dcb_read_data(DCB *dcb, GWBUF **head, int maxbytes);
+static void dcb_log_read_failure(DCB *dcb);
 static GWBUF *dcb_basic_read_SSL(DCB *dcb, int *nsingleread);
 #if defined(FAKE_CODE)
 static inline void dcb_write_fake_code(DCB *dcb);
 #endif
 static void dcb_log_write_failure(DCB *dcb, GWBUF *queue, int eno);
 static inline void dcb_write_tidy_up(DCB *dcb, bool below_water);
+static void dcb_pause_backends(DCB *client);
+static void dcb_resume_backends(DCB *client);
+static void dcb_pause_client(DCB *backend);
+static void dcb_resume_client(DCB *backend, bool closing);
+static void dcb_print_compression(DCB *pdcb, DCB *dcb);
 static int gw_write(DCB *dcb, GWBUF *writeq, bool *stop_writing);
+static int dcb_writev(int fd, GWBUF *writeq);
 static int gw_write_SSL(DCB *dcb, GWBUF *writeq, bool *stop_writing);
 static int dcb_log_errors_SSL (DCB *dcb, const char *called_by, int ret);
 static int dcb_accept_one_connection(DCB *listener, struct sockaddr *client_conn);
-static int dcb_listen_create_socket_inet(const char *config_bind);
+static bool dcb_queue_connection(DCB *client_dcb);
+static DCB *dcb_take_admitted(SERV_LISTENER *port);
+static int dcb_listen_socket(const char *config, const char *protocol_name, bool reuseport);
+static void dcb_listen_per_thread(DCB *listener, const char *config, const char *protocol_name);
+static int dcb_listen_create_socket_inet(const char *config_bind, bool reuseport);
 static int dcb_listen_create_socket_unix(const char *config_bind);
 static int dcb_set_socket_option(int sockfd, int level, int optname, void *optval, socklen_t optlen);
 static void dcb_add_to_all_list(DCB *dcb);
 static DCB *dcb_find_free();
+static void dcb_add_to_free_pool(DCB *dcb);
 static GWBUF *dcb_grab_writeq(DCB *dcb, bool first_time);
 
 size_t dcb_get_session_id(
@@ -189,32 +333,38 @@ DCB *
 dcb_alloc(dcb_role_t role, SERV_LISTENER *listener)
 {
     DCB *newdcb;
+    int n;
 
-    spinlock_acquire(&dcbspin);
     if ((newdcb = dcb_find_free()) == NULL)
     {
-        spinlock_release(&dcbspin);
         return NULL;
     }
-    nDCBs++;
-    if (nDCBs > maxDCBs)
+    n = atomic_add(&nDCBs, 1) + 1;
+    if (n > maxDCBs)
     {
-        maxDCBs = nDCBs;
+        maxDCBs = n;
     }
-    spinlock_release(&dcbspin);
 
     newdcb->dcb_chk_top = CHK_NUM_DCB;
     newdcb->dcb_chk_tail = CHK_NUM_DCB;
 
     newdcb->dcb_errhandle_called = false;
     newdcb->dcb_role = role;
+    dcb_count_role(role, 1);
     spinlock_init(&newdcb->dcb_initlock);
+    spinlock_set_name(&newdcb->dcb_initlock, "dcb_initlock");
     spinlock_init(&newdcb->writeqlock);
+    spinlock_set_name(&newdcb->writeqlock, "writeqlock");
     spinlock_init(&newdcb->delayqlock);
+    spinlock_set_name(&newdcb->delayqlock, "delayqlock");
     spinlock_init(&newdcb->authlock);
+    spinlock_set_name(&newdcb->authlock, "authlock");
     spinlock_init(&newdcb->cb_lock);
+    spinlock_set_name(&newdcb->cb_lock, "cb_lock");
     spinlock_init(&newdcb->pollinlock);
+    spinlock_set_name(&newdcb->pollinlock, "pollinlock");
     spinlock_init(&newdcb->polloutlock);
+    spinlock_set_name(&newdcb->polloutlock, "polloutlock");
     newdcb->pollinbusy = 0;
     newdcb->readcheck = 0;
     newdcb->polloutbusy = 0;
@@ -226,13 +376,18 @@ dcb_alloc(dcb_role_t role, SERV_LISTENER *listener)
     newdcb->evq.pending_events = 0;
     newdcb->evq.processing = 0;
     spinlock_init(&newdcb->evq.eventqlock);
+    spinlock_set_name(&newdcb->evq.eventqlock, "eventqlock");
+    newdcb->owner = -1;
 
     memset(&newdcb->stats, 0, sizeof(DCBSTATS));        // Zero the statistics
     newdcb->state = DCB_STATE_ALLOC;
-    bitmask_init(&newdcb->memdata.bitmask);
     newdcb->writeqlen = 0;
     newdcb->high_water = 0;
     newdcb->low_water = 0;
+    newdcb->backends_paused = false;
+    newdcb->reads_paused = false;
+    newdcb->client_paused = false;
+    newdcb->n_pausing = 0;
     newdcb->session = NULL;
     newdcb->server = NULL;
     newdcb->service = NULL;
@@ -242,11 +397,19 @@ dcb_alloc(dcb_role_t role, SERV_LISTENER *listener)
     newdcb->data = NULL;
 
     newdcb->listener = listener;
+    newdcb->admit_next = NULL;
     newdcb->ssl_state = SSL_HANDSHAKE_UNKNOWN;
+    newdcb->ssl_ktls_send = false;
+    newdcb->in_write_batch = false;
+    newdcb->readahead = NULL;
+    newdcb->readahead_drained = false;
 
     newdcb->remote = NULL;
     newdcb->user = NULL;
     newdcb->flags = 0;
+    newdcb->nextlistener = NULL;
+    newdcb->n_accepted = 0;
+    timerwheel_entry_init(&newdcb->connect_timer);
     return newdcb;
 }
 
@@ -256,10 +419,8 @@ dcb_alloc(dcb_role_t role, SERV_LISTENER *listener)
  * Must be called with the general DCB lock held.
  *
  * A pointer, lastDCB, is held to find the end of the list, and the new DCB
- * is linked to the end of the list.  The pointer, wasfreeDCB, that is used to
- * search for a free DCB is initialised if not already set. There cannot be
- * any free DCBs until this routine has been called at least once, so
- * wasfreeDCB will not be referred to before it is initialised.
+ * is linked to the end of the list. The list is only used for diagnostics,
+ * DCBs are never removed from it.
  *
  * @param dcb    The DCB to be added to the list
  */
@@ -275,68 +436,212 @@ dcb_add_to_all_list(DCB *dcb)
         lastDCB->next = dcb;
     }
     lastDCB = dcb;
-    if (NULL == wasfreeDCB)
+}
+
+/**
+ * Update the count of the DCBs in a role
+ *
+ * @param role  The role of the DCB
+ * @param n     1 for a new DCB, -1 for a freed one
+ */
+static void
+dcb_count_role(dcb_role_t role, int n)
+{
+    if (role == DCB_ROLE_CLIENT_HANDLER)
+    {
+        atomic_add(&nclients, n);
+    }
+    else if (role == DCB_ROLE_BACKEND_HANDLER)
+    {
+        atomic_add(&nbackends, n);
+    }
+}
+
+/**
+ * Charge queued bytes to the session of a DCB
+ *
+ * The write queue and the delay queue are charged. The bytes still charged
+ * when the DCB leaves its session are released with dcb_release_memory.
+ *
+ * @param dcb   The DCB
+ * @param n     Number of bytes queued, negative when they leave the queue
+ */
+void
+dcb_account_memory(DCB *dcb, int n)
+{
+    SESSION *session = dcb->session;
+
+    if (n == 0 || session == NULL || SESSION_STATE_DUMMY == session->state)
+    {
+        return;
+    }
+
+    /** The bytes that were queued for an earlier session are not released */
+    if (n < 0 && -n > dcb->memory)
+    {
+        n = -dcb->memory;
+    }
+
+    if (n)
+    {
+        atomic_add(&dcb->memory, n);
+        session_account_memory(session, n);
+    }
+}
+
+/**
+ * Release the bytes still charged to the session of a DCB that is leaving it
+ *
+ * @param dcb   The DCB
+ */
+static void
+dcb_release_memory(DCB *dcb)
+{
+    int n = dcb->memory;
+
+    if (n)
+    {
+        dcb_account_memory(dcb, -n);
+    }
+}
+
+/**
+ * Add a backend DCB to the list of DCBs of its server
+ *
+ * The list lets the DCBs of a failed server be found without scanning
+ * all DCBs. A DCB stays in the list until it is freed.
+ *
+ * @param dcb   The DCB whose server has been set
+ */
+static void
+dcb_add_to_server(DCB *dcb)
+{
+    SERVER *server = dcb->server;
+
+    spinlock_acquire(&server->dcbs_lock);
+    dcb->server_prev = NULL;
+    dcb->server_next = server->dcbs;
+    if (server->dcbs)
+    {
+        server->dcbs->server_prev = dcb;
+    }
+    server->dcbs = dcb;
+    spinlock_release(&server->dcbs_lock);
+}
+
+/**
+ * Remove a DCB from the list of DCBs of its server
+ *
+ * @param dcb   The DCB being freed
+ */
+static void
+dcb_remove_from_server(DCB *dcb)
+{
+    SERVER *server = dcb->server;
+
+    if (server == NULL)
+    {
+        return;
+    }
+
+    spinlock_acquire(&server->dcbs_lock);
+    if (dcb->server_prev)
+    {
+        dcb->server_prev->server_next = dcb->server_next;
+    }
+    else if (server->dcbs == dcb)
     {
-        wasfreeDCB = dcb;
+        server->dcbs = dcb->server_next;
     }
+    if (dcb->server_next)
+    {
+        dcb->server_next->server_prev = dcb->server_prev;
+    }
+    dcb->server_next = NULL;
+    dcb->server_prev = NULL;
+    spinlock_release(&server->dcbs_lock);
 }
 
 /**
  * Find a free DCB or allocate memory for a new one.
  *
- * This routine looks to see whether there are free DCB memory areas.
- * If not, new memory is allocated, if possible, and the new DCB is added to
- * the list of all DCBs.
+ * The free DCBs of the calling thread are used first, so in the common case
+ * no locks are needed. If the thread has no free DCBs, the shared pool of free
+ * DCBs is used and if that is empty, new memory is allocated and the new DCB
+ * is added to the list of all DCBs.
  *
- * Must be called with the general DCB lock held.
+ * The list link of a recycled DCB is not cleared since other threads may be
+ * iterating over the list of all DCBs.
  *
  * @return An available DCB or NULL if none could be allocated.
  */
 static DCB *
 dcb_find_free()
 {
-    DCB *nextdcb;
-    int loopcount = 0;
+    DCB *dcb;
 
-    if (freeDCBcount <= 0)
+    if ((dcb = thread_freeDCBs) != NULL)
     {
-        DCB *newdcb;
-        if ((newdcb = calloc(1, sizeof(DCB))) == NULL)
+        thread_freeDCBs = dcb->nextfree;
+        thread_nfreeDCBs--;
+    }
+    else
+    {
+        spinlock_acquire(&dcbspin);
+        if ((dcb = freeDCBs) != NULL)
         {
-            return NULL;
+            freeDCBs = dcb->nextfree;
         }
-        newdcb->next = NULL;
-        dcb_add_to_all_list(newdcb);
-        newdcb->dcb_is_in_use = true;
-        return newdcb;
+        spinlock_release(&dcbspin);
     }
-    /* Starting at the last place a free DCB was found, loop through the */
-    /* list of DCBs searching for one that is not in use. */
-    while (wasfreeDCB->dcb_is_in_use)
+
+    if (dcb == NULL)
     {
-        wasfreeDCB = wasfreeDCB->next;
-        if (NULL == wasfreeDCB)
+        if ((dcb = hugepage_alloc(&dcb_arena)) == NULL)
         {
-            loopcount++;
-            if (loopcount > 1)
-            {
-                /* Shouldn't need to loop round more than once */
-                MXS_ERROR("Find free DCB failed to find a free DCB even"
-                          " though the free count was positive");
-                return NULL;
-            }
-            wasfreeDCB = allDCBs;
+            return NULL;
         }
+        memset(dcb, 0, sizeof(DCB));
+        spinlock_acquire(&dcbspin);
+        dcb_add_to_all_list(dcb);
+        spinlock_release(&dcbspin);
+    }
+    else
+    {
+        /* Clear the old data except the list forward link */
+        memset(dcb, 0, offsetof(DCB, next));
+        memset(&dcb->next + 1, 0, sizeof(DCB) - offsetof(DCB, next) - sizeof(dcb->next));
+    }
+    dcb->dcb_is_in_use = true;
+    return dcb;
+}
+
+/**
+ * Return a DCB to the pool of free DCBs
+ *
+ * The DCB is kept by the calling thread unless the thread already holds
+ * DCB_THREAD_POOL_SIZE free DCBs, in which case it is placed in the shared pool.
+ *
+ * @param dcb   The DCB that is no longer in use
+ */
+static void
+dcb_add_to_free_pool(DCB *dcb)
+{
+    dcb->dcb_is_in_use = false;
+
+    if (thread_nfreeDCBs < DCB_THREAD_POOL_SIZE)
+    {
+        dcb->nextfree = thread_freeDCBs;
+        thread_freeDCBs = dcb;
+        thread_nfreeDCBs++;
+    }
+    else
+    {
+        spinlock_acquire(&dcbspin);
+        dcb->nextfree = freeDCBs;
+        freeDCBs = dcb;
+        spinlock_release(&dcbspin);
     }
-    /* Dropping out of the loop means we have found a DCB that is not in use */
-    freeDCBcount--;
-    ss_dassert(freeDCBcount >= 0);
-    /* Clear the old data, then reset the list forward link */
-    nextdcb = wasfreeDCB->next;
-    memset(wasfreeDCB, 0, sizeof(DCB));
-    wasfreeDCB->next = nextdcb;
-    wasfreeDCB->dcb_is_in_use = true;
-    return wasfreeDCB;
 }
 
 
@@ -412,6 +717,8 @@ dcb_final_free(DCB *dcb)
         /* Check if DCB has outstanding poll events */
         MXS_ERROR("dcb_final_free: DCB %p has outstanding events.", dcb);
     }
+    dcb_connect_responded(dcb);
+    dcb_release_memory(dcb);
 
     if (dcb->session)
     {
@@ -493,6 +800,11 @@ dcb_free_all_memory(DCB *dcb)
         gwbuf_free(dcb->dcb_readqueue);
         dcb->dcb_readqueue = NULL;
     }
+    if (dcb->readahead)
+    {
+        gwbuf_free(dcb->readahead);
+        dcb->readahead = NULL;
+    }
 
     spinlock_acquire(&dcb->cb_lock);
     while ((cb_dcb = dcb->callbacks) != NULL)
@@ -505,193 +817,444 @@ dcb_free_all_memory(DCB *dcb)
     {
         SSL_free(dcb->ssl);
     }
-    bitmask_free(&dcb->memdata.bitmask);
+
+    dcb_remove_from_server(dcb);
 
     /* We never free the actual DCB, it is available for reuse*/
-    spinlock_acquire(&dcbspin);
-    dcb->dcb_is_in_use = false;
-    freeDCBcount++;
-    nDCBs--;
-    spinlock_release(&dcbspin);
+    dcb_count_role(dcb->dcb_role, -1);
+    atomic_add(&nDCBs, -1);
+    dcb_add_to_free_pool(dcb);
 
 }
 
 /**
- * Process the DCB zombie queue
+ * Initialise the global data of the DCBs
  *
- * This routine is called by each of the polling threads with
- * the thread id of the polling thread. It must clear the bit in
- * the memdata bitmask for the polling thread that calls it. If the
- * operation of clearing this bit means that no bits are set in
- * the memdata.bitmask then the DCB is no longer able to be
- * referenced and it can be finally removed.
+ * This allocates the epochs used for reclaiming zombie DCBs and the socket
+ * I/O statistics. Must be called before the polling threads are started.
  *
- * @param       threadid        The thread ID of the caller
+ * @param n_threads The number of polling threads
+ * @return True on success, false if memory allocation failed
  */
-DCB *
-dcb_process_zombies(int threadid)
+bool
+dcb_global_init(int n_threads)
 {
-    DCB *zombiedcb;
-    DCB *previousdcb = NULL, *nextdcb;
-    DCB *listofdcb = NULL;
+    void *epochs;
+    size_t size = n_threads * sizeof(ZOMBIE_EPOCH);
 
-    /**
-     * Perform a dirty read to see if there is anything in the queue.
-     * This avoids threads hitting the queue spinlock when the queue
-     * is empty. This will really help when the only entry is being
-     * freed, since the queue is updated before the expensive call to
-     * dcb_final_free.
-     */
-    if (!zombies)
+    if (posix_memalign(&epochs, MXS_CACHE_LINE_SIZE, size) != 0)
     {
-        return NULL;
+        MXS_ERROR("Failed to allocate memory for the zombie epochs.");
+        return false;
     }
+    memset(epochs, 0, size);
+    read_mode = config_read_mode();
+    accept_budget = config_accept_budget();
+    use_io_uring = config_io_uring();
 
-    /*
-     * Process the zombie queue and create a list of DCB's that can be
-     * finally freed. This processing is down under a spinlock that
-     * will prevent new entries being added to the zombie queue. Therefore
-     * we do not want to do any expensive operations under this spinlock
-     * as it will block other threads. The expensive operations will be
-     * performed on the victim queue within holding the zombie queue
-     * spinlock.
-     */
-    spinlock_acquire(&zombiespin);
-    zombiedcb = zombies;
-    while (zombiedcb)
+    if (use_io_uring && config_poll_mode() != POLL_MODE_PER_THREAD)
     {
-        CHK_DCB(zombiedcb);
-        nextdcb = zombiedcb->memdata.next;
-        /*
-         * Skip processing of DCB's that are
-         * in the event queue waiting to be processed.
-         */
-        if (zombiedcb->evq.next || zombiedcb->evq.prev)
+        /** The data read ahead must be consumed by the thread that read it */
+        MXS_WARNING("'io_uring' requires 'poll_mode=per_thread', it is not used.");
+        use_io_uring = false;
+    }
+    writeq_high_water = config_writeq_high_water();
+    writeq_low_water = config_writeq_low_water();
+
+    if (writeq_high_water && (writeq_low_water == 0 || writeq_low_water >= writeq_high_water))
+    {
+        if (writeq_low_water)
         {
-            previousdcb = zombiedcb;
+            MXS_WARNING("The value of 'writeq_low_water' must be less than the value of "
+                        "'writeq_high_water', using %d.", writeq_high_water / 2);
         }
-        else
+        writeq_low_water = writeq_high_water / 2;
+    }
+
+    if ((connect_timers = (TIMER_WHEEL *)malloc(sizeof(TIMER_WHEEL))) == NULL)
+    {
+        MXS_ERROR("Failed to allocate memory for the connection timers.");
+        free(epochs);
+        return false;
+    }
+    timerwheel_init(connect_timers, (uint64_t)hkheartbeat * 100);
+
+    for (int i = 0; i < DCB_IO_N_STATS; i++)
+    {
+        if ((io_stats[i] = ts_stats_alloc()) == NULL)
         {
+            MXS_ERROR("Failed to allocate memory for the DCB statistics.");
+            free(epochs);
+            return false;
+        }
+    }
+    thread_epochs = (ZOMBIE_EPOCH *)epochs;
+    n_epoch_threads = n_threads;
+    owner_zombies = config_poll_mode() == POLL_MODE_PER_THREAD;
+    return true;
+}
 
-            if (bitmask_clear_without_spinlock(&zombiedcb->memdata.bitmask, threadid))
-            {
-                /**
-                 * Remove the DCB from the zombie queue
-                 * and call the final free routine for the
-                 * DCB
-                 *
-                 * zombiedcb is the DCB we are processing
-                 * previousdcb is the previous DCB on the zombie
-                 * queue or NULL if the DCB is at the head of the
-                 * queue.  Remove zombiedcb from the zombies list.
-                 */
-                if (NULL == previousdcb)
-                {
-                    zombies = zombiedcb->memdata.next;
-                }
-                else
-                {
-                    previousdcb->memdata.next = zombiedcb->memdata.next;
-                }
+/**
+ * Release the DCBs of a polling thread that stops. The zombies the thread has
+ * not yet been able to free are put back on the shared list of zombies, with
+ * their epochs, for the other threads to free. The free DCBs of the thread
+ * are moved to the shared pool of free DCBs.
+ */
+void
+dcb_thread_end()
+{
+    if (thread_zombies)
+    {
+        DCB *last = thread_zombies;
+        DCB *head;
 
-                MXS_DEBUG("%lu [%s] Remove dcb "
-                          "%p fd %d in state %s from the "
-                          "list of zombies.",
-                          pthread_self(),
-                          __func__,
-                          zombiedcb,
-                          zombiedcb->fd,
-                          STRDCBSTATE(zombiedcb->state));
-                /*<
-                 * Move zombie dcb to linked list of victim dcbs.
-                 * The variable dcb is used to hold the last DCB
-                 * to have been added to the linked list, or NULL
-                 * if none has yet been added.  If the list
-                 * (listofdcb) is not NULL, then it follows that
-                 * dcb will also not be null.
-                 */
-                nzombies--;
-                zombiedcb->memdata.next = listofdcb;
-                listofdcb = zombiedcb;
-            }
-            else
-            {
-                /* Since we didn't remove this dcb from the zombies
-                   list, we need to advance the previous pointer */
-                previousdcb = zombiedcb;
-            }
+        while (last->memdata.next)
+        {
+            last = last->memdata.next;
         }
-        zombiedcb = nextdcb;
+
+        do
+        {
+            head = zombies;
+            last->memdata.next = head;
+        }
+        while (!__sync_bool_compare_and_swap(&zombies, head, thread_zombies));
+
+        thread_zombies = NULL;
     }
-    spinlock_release(&zombiespin);
 
-    if (listofdcb)
+    if (thread_freeDCBs)
     {
-        dcb_process_victim_queue(listofdcb);
+        DCB *last = thread_freeDCBs;
+
+        while (last->nextfree)
+        {
+            last = last->nextfree;
+        }
+
+        spinlock_acquire(&dcbspin);
+        last->nextfree = freeDCBs;
+        freeDCBs = thread_freeDCBs;
+        spinlock_release(&dcbspin);
+
+        thread_freeDCBs = NULL;
+        thread_nfreeDCBs = 0;
     }
 
-    return zombies;
+    uring_free(thread_uring);
+    thread_uring = NULL;
+    thread_uring_failed = false;
 }
 
 /**
- * Process the victim queue, selected from the list of zombies
+ * Place a DCB on the list of zombies
  *
- * These are the DCBs that are not in use by any thread.  The corresponding
- * file descriptor is closed, the DCB marked as disconnected and the DCB
- * itself is finally freed.
+ * The DCB is stamped with a new epoch and pushed onto the shared list of
+ * zombies, or the list of its owning thread, without taking any locks. A
+ * polling thread will later move it to its own list and free it once all
+ * polling threads have passed the epoch.
  *
- * @param       listofdcb       The first victim DCB
+ * @param dcb The DCB to retire
  */
-static inline void
-dcb_process_victim_queue(DCB *listofdcb)
+static void
+dcb_add_to_zombies(DCB *dcb)
 {
-    DCB *dcb = listofdcb;
+    DCB **list = &zombies;
+    DCB *head;
+    int n;
 
-    while (dcb != NULL)
+    if (owner_zombies && dcb->owner >= 0 && dcb->owner < n_epoch_threads)
     {
-        DCB *nextdcb;
-        /*<
-         * Stop dcb's listening and modify state accordingly.
-         */
-        spinlock_acquire(&dcb->dcb_initlock);
-        if (dcb->state == DCB_STATE_POLLING  || dcb->state == DCB_STATE_LISTENING)
-        {
-            if (dcb->state == DCB_STATE_LISTENING)
-            {
-                MXS_ERROR("%lu [%s] Error : Removing DCB %p but was in state %s "
-                          "which is not expected for a call to dcb_close, although it"
-                          "should be processed correctly. ",
-                          pthread_self(),
-                          __func__,
-                          dcb,
-                          STRDCBSTATE(dcb->state));
-            }
-            else
-            {
-                /* Must be DCB_STATE_POLLING */
-                spinlock_release(&dcb->dcb_initlock);
-                if (0 == dcb->persistentstart && dcb_maybe_add_persistent(dcb))
-                {
-                    /* Have taken DCB into persistent pool, no further killing */
-                    dcb = dcb->memdata.next;
-                    continue;
-                }
-                else
-                {
-                    DCB *next2dcb;
-                    dcb_stop_polling_and_shutdown(dcb);
-                    spinlock_acquire(&zombiespin);
-                    bitmask_copy(&dcb->memdata.bitmask, poll_bitmask());
-                    next2dcb = dcb->memdata.next;
-                    dcb->memdata.next = zombies;
-                    zombies = dcb;
-                    nzombies++;
-                    if (nzombies > maxzombies)
-                    {
-                        maxzombies = nzombies;
-                    }
-                    spinlock_release(&zombiespin);
-                    dcb = next2dcb;
+        list = &thread_epochs[dcb->owner].zombies;
+    }
+
+    dcb->memdata.epoch = __sync_add_and_fetch(&zombie_epoch, 1);
+
+    do
+    {
+        head = *list;
+        dcb->memdata.next = head;
+    }
+    while (!__sync_bool_compare_and_swap(list, head, dcb));
+
+    n = atomic_add(&nzombies, 1) + 1;
+    if (n > maxzombies)
+    {
+        maxzombies = n;
+    }
+}
+
+/**
+ * Retire an object that the polling threads may still be reading
+ *
+ * This is used to replace data that is read without locks, for example a
+ * configuration that the sessions copy when they notice that it has changed.
+ * The new version is published first and the old one is then retired. It is
+ * stamped with a new epoch, the same way as a zombie DCB, and freed once every
+ * running polling thread has passed that epoch.
+ *
+ * @param data    The object
+ * @param free_fn Function that frees the object
+ */
+void
+dcb_retire(void *data, void (*free_fn)(void *))
+{
+    RETIRED_OBJECT *obj = (RETIRED_OBJECT *)malloc(sizeof(RETIRED_OBJECT));
+
+    if (obj == NULL)
+    {
+        /** The object can not be freed safely, it is leaked */
+        MXS_ERROR("Failed to allocate memory for a retired object.");
+        return;
+    }
+
+    obj->data = data;
+    obj->free_fn = free_fn;
+    obj->epoch = __sync_add_and_fetch(&zombie_epoch, 1);
+
+    spinlock_acquire(&retired_lock);
+    obj->next = retired_objects;
+    retired_objects = obj;
+    spinlock_release(&retired_lock);
+}
+
+/**
+ * Return the oldest epoch that a running polling thread has announced
+ *
+ * Threads that are not in the polling loop hold no references to DCBs
+ * and are ignored.
+ *
+ * @return The epoch up to which every zombie can be freed
+ */
+static uint64_t
+dcb_safe_epoch(void)
+{
+    uint64_t safe = zombie_epoch;
+    GWBITMASK *mask = poll_bitmask();
+
+    for (int i = 0; i < n_epoch_threads; i++)
+    {
+        if (bitmask_isset(mask, i) && thread_epochs[i].epoch < safe)
+        {
+            safe = thread_epochs[i].epoch;
+        }
+    }
+    return safe;
+}
+
+/**
+ * Move a list of zombies to the list of the calling thread
+ *
+ * A dirty read is done to see if there is anything to take. This keeps the
+ * atomic exchange out of the polling loop when no DCBs are closed.
+ *
+ * @param list The shared list of zombies or the list of the calling thread
+ */
+static void
+dcb_take_zombies(DCB **list)
+{
+    if (*list)
+    {
+        DCB *taken = __sync_lock_test_and_set(list, NULL);
+
+        while (taken)
+        {
+            DCB *next = taken->memdata.next;
+            taken->memdata.next = thread_zombies;
+            thread_zombies = taken;
+            taken = next;
+        }
+    }
+}
+
+/**
+ * Process the DCB zombie queue
+ *
+ * This routine is called by each of the polling threads once per loop with
+ * the thread id of the polling thread. The thread first announces the current
+ * epoch, which tells that it no longer holds references to any DCB retired
+ * before it. It then moves the shared list of zombies, and the zombies of the
+ * DCBs it owns, to its own list and frees, in one batch, those DCBs whose epoch every running polling thread
+ * has passed.
+ *
+ * @param       threadid        The thread ID of the caller
+ * @return      The zombies still waiting to be freed by this thread
+ */
+DCB *
+dcb_process_zombies(int threadid)
+{
+    DCB *zombiedcb;
+    DCB *previousdcb = NULL, *nextdcb;
+    DCB *listofdcb = NULL;
+    uint64_t safe;
+
+    if (threadid < n_epoch_threads)
+    {
+        thread_epochs[threadid].epoch = zombie_epoch;
+        __sync_synchronize();
+    }
+
+    /** Dirty read, the objects are rarely retired */
+    if (retired_objects)
+    {
+        dcb_free_retired();
+    }
+
+    dcb_take_zombies(&zombies);
+
+    if (threadid < n_epoch_threads)
+    {
+        dcb_take_zombies(&thread_epochs[threadid].zombies);
+    }
+
+    if (!thread_zombies)
+    {
+        return NULL;
+    }
+
+    safe = dcb_safe_epoch();
+    zombiedcb = thread_zombies;
+
+    while (zombiedcb)
+    {
+        CHK_DCB(zombiedcb);
+        nextdcb = zombiedcb->memdata.next;
+        /*
+         * Skip processing of DCB's that are in the event queue
+         * waiting to be processed or that a running thread might
+         * still be referring to.
+         */
+        if (zombiedcb->evq.next || zombiedcb->evq.prev ||
+            zombiedcb->memdata.epoch > safe)
+        {
+            previousdcb = zombiedcb;
+        }
+        else
+        {
+            if (NULL == previousdcb)
+            {
+                thread_zombies = nextdcb;
+            }
+            else
+            {
+                previousdcb->memdata.next = nextdcb;
+            }
+
+            MXS_DEBUG("%lu [%s] Remove dcb "
+                      "%p fd %d in state %s from the "
+                      "list of zombies.",
+                      pthread_self(),
+                      __func__,
+                      zombiedcb,
+                      zombiedcb->fd,
+                      STRDCBSTATE(zombiedcb->state));
+            /*<
+             * Move zombie dcb to linked list of victim dcbs.
+             */
+            atomic_add(&nzombies, -1);
+            zombiedcb->memdata.next = listofdcb;
+            listofdcb = zombiedcb;
+        }
+        zombiedcb = nextdcb;
+    }
+
+    if (listofdcb)
+    {
+        dcb_process_victim_queue(listofdcb);
+    }
+
+    return thread_zombies;
+}
+
+/**
+ * Free the retired objects whose epoch every running polling thread has passed
+ */
+static void
+dcb_free_retired(void)
+{
+    uint64_t safe = dcb_safe_epoch();
+    RETIRED_OBJECT *victims = NULL;
+
+    spinlock_acquire(&retired_lock);
+    RETIRED_OBJECT **prev = &retired_objects;
+
+    while (*prev)
+    {
+        RETIRED_OBJECT *obj = *prev;
+
+        if (obj->epoch > safe)
+        {
+            prev = &obj->next;
+        }
+        else
+        {
+            *prev = obj->next;
+            obj->next = victims;
+            victims = obj;
+        }
+    }
+    spinlock_release(&retired_lock);
+
+    while (victims)
+    {
+        RETIRED_OBJECT *obj = victims;
+        victims = obj->next;
+        obj->free_fn(obj->data);
+        free(obj);
+    }
+}
+
+/**
+ * Process the victim queue, selected from the list of zombies
+ *
+ * These are the DCBs that are not in use by any thread.  The corresponding
+ * file descriptor is closed, the DCB marked as disconnected and the DCB
+ * itself is finally freed.
+ *
+ * @param       listofdcb       The first victim DCB
+ */
+static inline void
+dcb_process_victim_queue(DCB *listofdcb)
+{
+    DCB *dcb = listofdcb;
+
+    while (dcb != NULL)
+    {
+        DCB *nextdcb;
+        SERVICE *admit = NULL;
+        /*<
+         * Stop dcb's listening and modify state accordingly.
+         */
+        spinlock_acquire(&dcb->dcb_initlock);
+        if (dcb->state == DCB_STATE_POLLING  || dcb->state == DCB_STATE_LISTENING)
+        {
+            if (dcb->state == DCB_STATE_LISTENING)
+            {
+                MXS_ERROR("%lu [%s] Error : Removing DCB %p but was in state %s "
+                          "which is not expected for a call to dcb_close, although it"
+                          "should be processed correctly. ",
+                          pthread_self(),
+                          __func__,
+                          dcb,
+                          STRDCBSTATE(dcb->state));
+            }
+            else
+            {
+                /* Must be DCB_STATE_POLLING */
+                spinlock_release(&dcb->dcb_initlock);
+                if (0 == dcb->persistentstart && dcb_maybe_add_persistent(dcb))
+                {
+                    /* Have taken DCB into persistent pool, no further killing */
+                    dcb = dcb->memdata.next;
+                    continue;
+                }
+                else
+                {
+                    DCB *next2dcb;
+                    dcb_stop_polling_and_shutdown(dcb);
+                    next2dcb = dcb->memdata.next;
+                    dcb_add_to_zombies(dcb);
+                    dcb = next2dcb;
                     continue;
                 }
             }
@@ -707,6 +1270,7 @@ dcb_process_victim_queue(DCB *listofdcb)
                 if (dcb->protocol)
                 {
                     atomic_add(&dcb->service->client_count, -1);
+                    admit = dcb->service;
                 }
             }
             else
@@ -752,15 +1316,19 @@ dcb_process_victim_queue(DCB *listofdcb)
             }
         }
 
-        dcb_get_ses_log_info(dcb,
-                             &mxs_log_tls.li_sesid,
-                             &mxs_log_tls.li_enabled_priorities);
+        dcb_set_ses_log_info(dcb);
 
         dcb->state = DCB_STATE_DISCONNECTED;
         nextdcb = dcb->memdata.next;
         spinlock_release(&dcb->dcb_initlock);
         dcb_final_free(dcb);
         dcb = nextdcb;
+
+        if (admit && admit->queued_connections)
+        {
+            /** The client freed a connection slot, give it to a queued connection */
+            dcb_admit_queued(admit);
+        }
     }
     /** Reset threads session data */
     mxs_log_tls.li_sesid = 0;
@@ -800,9 +1368,6 @@ DCB *
 dcb_connect(SERVER *server, SESSION *session, const char *protocol)
 {
     DCB         *dcb;
-    GWPROTOCOL  *funcs;
-    int         fd;
-    int         rc;
     char        *user;
 
     user = session_getUser(session);
@@ -810,7 +1375,8 @@ dcb_connect(SERVER *server, SESSION *session, const char *protocol)
     {
         MXS_DEBUG("%lu [dcb_connect] Looking for persistent connection DCB "
                   "user %s protocol %s\n", pthread_self(), user, protocol);
-        dcb = server_get_persistent(server, user, protocol);
+        dcb = server_get_persistent(server, user, protocol,
+                                    poll_session_owner(session));
         if (dcb)
         {
             /**
@@ -827,20 +1393,71 @@ dcb_connect(SERVER *server, SESSION *session, const char *protocol)
             MXS_DEBUG("%lu [dcb_connect] Reusing a persistent connection, dcb %p\n",
                       pthread_self(), dcb);
             dcb->persistentstart = 0;
-            return dcb;
+
+            /**
+             * Let the protocol clear the state the previous session left in
+             * the connection. The reset is only queued, it does not wait for
+             * the server to respond.
+             */
+            if (dcb->func.session == NULL || dcb->func.session(dcb, session))
+            {
+                __sync_add_and_fetch(&server->stats.n_pool_hits, 1);
+                dcb_fill_persistent(server, session, protocol);
+                return dcb;
+            }
+
+            MXS_WARNING("Failed to reset a persistent connection to server '%s', "
+                        "creating a new connection.", server->unique_name);
+            /** Prevent the connection from going back into the pool */
+            dcb->dcb_errhandle_called = true;
+            dcb_close(dcb);
         }
         else
         {
             MXS_DEBUG("%lu [dcb_connect] Failed to find a reusable persistent connection.\n",
                       pthread_self());
         }
+
+        if (server->persistpoolmax)
+        {
+            __sync_add_and_fetch(&server->stats.n_pool_misses, 1);
+        }
     }
 
+    if ((dcb = dcb_connect_new(server, session, protocol, 0)) && user && strlen(user))
+    {
+        dcb_fill_persistent(server, session, protocol);
+    }
+
+    return dcb;
+}
+
+/**
+ * Create a new connection to a server
+ *
+ * @param server        The server to connect to
+ * @param session       The session this connection is being made for
+ * @param protocol      The protocol module to use
+ * @param flags         DCB flags to set before the DCB is added to the poll set
+ * @return              The new allocated dcb or NULL if the DCB was not connected
+ */
+static DCB *
+dcb_connect_new(SERVER *server, SESSION *session, const char *protocol, int flags)
+{
+    DCB         *dcb;
+    GWPROTOCOL  *funcs;
+    int         fd;
+    int         rc;
+
+
     if ((dcb = dcb_alloc(DCB_ROLE_BACKEND_HANDLER, NULL)) == NULL)
     {
         return NULL;
     }
 
+    dcb->high_water = writeq_high_water;
+    dcb->low_water = writeq_low_water;
+
     if ((funcs = (GWPROTOCOL *)load_module(protocol,
                                            MODULE_PROTOCOL)) == NULL)
     {
@@ -901,10 +1518,12 @@ dcb_connect(SERVER *server, SESSION *session, const char *protocol)
      * Add server pointer to dcb
      */
     dcb->server = server;
+    dcb_add_to_server(dcb);
 
     /** Copy status field to DCB */
     dcb->dcb_server_status = server->status;
     dcb->dcb_port = server->port;
+    dcb->flags |= flags;
 
     /**
      * backend_dcb is connected to backend server, and once backend_dcb
@@ -913,6 +1532,15 @@ dcb_connect(SERVER *server, SESSION *session, const char *protocol)
      * is established.
      */
 
+    /**
+     * The timer is started before the DCB is added to the poll set, where
+     * another thread may already see the response of the server.
+     */
+    if (server->connect_timeout > 0)
+    {
+        dcb_add_connect_timer(dcb, server->connect_timeout);
+    }
+
     /**
      * Add the dcb in the poll set
      */
@@ -927,59 +1555,244 @@ dcb_connect(SERVER *server, SESSION *session, const char *protocol)
     /**
      * The dcb will be addded into poll set by dcb->func.connect
      */
-    atomic_add(&server->stats.n_connections, 1);
+    ts_stats_add(server->stats.n_connections, 1);
     atomic_add(&server->stats.n_current, 1);
 
     return dcb;
 }
 
 /**
- * General purpose read routine to read data from a socket in the
- * Descriptor Control Block and append it to a linked list of buffers.
- * The list may be empty, in which case *head == NULL. The third
- * parameter indicates the maximum number of bytes to be read (needed
- * for SSL processing) with 0 meaning no limit.
+ * Open connections that fill the persistent pool of a server up to its
+ * persistpoolmin. The pooled connections are authenticated with the
+ * credentials of a client, so the connections are opened on behalf of the
+ * session that is connecting. They are linked to the session only until
+ * they have been authenticated, at which point dcb_pool_fill_done moves
+ * them into the pool.
  *
- * @param dcb       The DCB to read from
- * @param head      Pointer to linked list to append data to
- * @param maxbytes  Maximum bytes to read (0 = no limit)
- * @return          -1 on error, otherwise the total number of bytes read
+ * @param server        The server
+ * @param session       The session whose credentials are used
+ * @param protocol      The protocol module to use
  */
-int dcb_read(DCB   *dcb,
-             GWBUF **head,
-             int maxbytes)
+static void
+dcb_fill_persistent(SERVER *server, SESSION *session, const char *protocol)
 {
-    int     nsingleread = 0;
-    int     nreadtotal = 0;
+    int n_missing = server->persistpoolmin - server->stats.n_persistent - server->stats.n_filling;
 
-    if (dcb->dcb_readqueue)
+    if (n_missing <= 0 || !(server->status & SERVER_RUNNING))
     {
-        spinlock_acquire(&dcb->authlock);
-        *head = gwbuf_append(*head, dcb->dcb_readqueue);
-        dcb->dcb_readqueue = NULL;
-        nreadtotal = gwbuf_length(*head);
-        spinlock_release(&dcb->authlock);
+        return;
     }
 
-    if (SSL_HANDSHAKE_DONE == dcb->ssl_state || SSL_ESTABLISHED == dcb->ssl_state)
+    if (n_missing > DCB_POOL_FILL_BATCH)
     {
-        return dcb_read_SSL(dcb, head);
+        n_missing = DCB_POOL_FILL_BATCH;
     }
 
-    CHK_DCB(dcb);
-
-    if (dcb->fd <= 0)
+    for (int i = 0; i < n_missing; i++)
     {
-        /* <editor-fold defaultstate="collapsed" desc=" Error Logging "> */
-        MXS_ERROR("%lu [dcb_read] Error : Read failed, dcb is %s.",
-                  pthread_self(),
-                  dcb->fd == DCBFD_CLOSED ? "closed" : "cloned, not readable");
-        /* </editor-fold> */
-        return 0;
-    }
+        atomic_add(&server->stats.n_filling, 1);
 
-    while (0 == maxbytes || nreadtotal < maxbytes)
-    {
+        if (dcb_connect_new(server, session, protocol, DCBF_POOL_FILL) == NULL)
+        {
+            atomic_add(&server->stats.n_filling, -1);
+            break;
+        }
+    }
+}
+
+/**
+ * Finish a connection that was opened to fill the persistent pool. A
+ * connection that was authenticated goes to the pool and one that failed is
+ * closed, without involving the router of the session in either case.
+ *
+ * @param dcb           The backend DCB
+ * @param success       Whether the connection was authenticated
+ * @return True if the DCB was opened to fill the pool and has been closed
+ */
+bool
+dcb_pool_fill_done(DCB *dcb, bool success)
+{
+    if (!(dcb->flags & DCBF_POOL_FILL))
+    {
+        return false;
+    }
+
+    dcb->flags &= ~DCBF_POOL_FILL;
+    atomic_add(&dcb->server->stats.n_filling, -1);
+
+    if (!success)
+    {
+        /** Keep the failed connection out of the pool */
+        dcb->dcb_errhandle_called = true;
+    }
+
+    dcb_close(dcb);
+    return true;
+}
+
+/**
+ * Start the timer of a new backend connection
+ *
+ * @param dcb       The backend DCB
+ * @param timeout   The number of seconds the server has to respond
+ */
+static void
+dcb_add_connect_timer(DCB *dcb, long timeout)
+{
+    uint64_t expiry = ((uint64_t)hkheartbeat + timeout * 10) * 100;
+
+    spinlock_acquire(&connect_timer_lock);
+    timerwheel_add(connect_timers, &dcb->connect_timer, expiry);
+    connect_timers_next = timerwheel_next_expiry(connect_timers);
+    spinlock_release(&connect_timer_lock);
+}
+
+/**
+ * Stop the timer of a new backend connection
+ *
+ * Called when the first data arrives from the server and when the DCB is
+ * closed. Only a freshly connected DCB has a timer running, so usually this
+ * does not need to take the lock.
+ *
+ * @param dcb   The DCB
+ */
+void
+dcb_connect_responded(DCB *dcb)
+{
+    if (timerwheel_is_linked(&dcb->connect_timer))
+    {
+        spinlock_acquire(&connect_timer_lock);
+        timerwheel_remove(&dcb->connect_timer);
+        spinlock_release(&connect_timer_lock);
+    }
+}
+
+/**
+ * Hang up the new backend connections whose server has not responded in time
+ *
+ * Called by the polling threads on every round, before they free zombies.
+ * A DCB whose timer is still running has not been closed, so it can not be
+ * freed before the calling thread has processed its zombies.
+ */
+void
+dcb_process_connect_timeouts(void)
+{
+    uint64_t now = (uint64_t)hkheartbeat * 100;
+    TIMER_ENTRY expired;
+
+    if (now < connect_timers_next)
+    {
+        return;
+    }
+
+    timerwheel_list_init(&expired);
+    spinlock_acquire(&connect_timer_lock);
+    timerwheel_advance(connect_timers, now, &expired);
+
+    while (!timerwheel_list_empty(&expired))
+    {
+        DCB *dcb = (DCB *)((char *)expired.next - offsetof(DCB, connect_timer));
+
+        timerwheel_remove(&dcb->connect_timer);
+        MXS_ERROR("Server '%s' at %s:%d did not respond to a new connection in %ld "
+                  "seconds, closing the connection.",
+                  dcb->server->unique_name,
+                  dcb->server->name,
+                  dcb->server->port,
+                  dcb->server->connect_timeout);
+        poll_fake_hangup_event(dcb);
+    }
+    connect_timers_next = timerwheel_next_expiry(connect_timers);
+    spinlock_release(&connect_timer_lock);
+}
+
+/**
+ * General purpose read routine to read data from a socket in the
+ * Descriptor Control Block and append it to a linked list of buffers.
+ * The list may be empty, in which case *head == NULL. The third
+ * parameter indicates the maximum number of bytes to be read (needed
+ * for SSL processing) with 0 meaning no limit.
+ *
+ * @param dcb       The DCB to read from
+ * @param head      Pointer to linked list to append data to
+ * @param maxbytes  Maximum bytes to read (0 = no limit)
+ * @return          -1 on error, otherwise the total number of bytes read
+ */
+int dcb_read(DCB   *dcb,
+             GWBUF **head,
+             int maxbytes)
+{
+    int n = dcb_read_data(dcb, head, maxbytes);
+    MXS_PROBE3(dcb_read, dcb, dcb->fd, n);
+    return n;
+}
+
+/**
+ * Read the data of a DCB, see dcb_read
+ */
+static int dcb_read_data(DCB *dcb, GWBUF **head, int maxbytes)
+{
+    int     nsingleread = 0;
+    int     nreadtotal = 0;
+
+    if (dcb->dcb_readqueue)
+    {
+        spinlock_acquire(&dcb->authlock);
+        *head = gwbuf_append(*head, dcb->dcb_readqueue);
+        dcb->dcb_readqueue = NULL;
+        nreadtotal = gwbuf_length(*head);
+        spinlock_release(&dcb->authlock);
+    }
+
+    if (SSL_HANDSHAKE_DONE == dcb->ssl_state || SSL_ESTABLISHED == dcb->ssl_state)
+    {
+        return dcb_read_SSL(dcb, head);
+    }
+
+    CHK_DCB(dcb);
+
+    if (dcb->fd <= 0)
+    {
+        /* <editor-fold defaultstate="collapsed" desc=" Error Logging "> */
+        MXS_ERROR("%lu [dcb_read] Error : Read failed, dcb is %s.",
+                  pthread_self(),
+                  dcb->fd == DCBFD_CLOSED ? "closed" : "cloned, not readable");
+        /* </editor-fold> */
+        return 0;
+    }
+
+    if (dcb->readahead)
+    {
+        /** The data read through io_uring is older than what is still in the socket */
+        int len = gwbuf_length(dcb->readahead);
+
+        if (maxbytes && nreadtotal + len > maxbytes)
+        {
+            if (nreadtotal < maxbytes)
+            {
+                *head = gwbuf_append(*head, gwbuf_split(&dcb->readahead, maxbytes - nreadtotal));
+            }
+            return maxbytes > nreadtotal ? maxbytes : nreadtotal;
+        }
+
+        *head = gwbuf_append(*head, dcb->readahead);
+        dcb->readahead = NULL;
+        nreadtotal += len;
+        dcb->last_read = hkheartbeat;
+
+        if (dcb->readahead_drained)
+        {
+            return nreadtotal;
+        }
+    }
+
+    if (READ_MODE_DIRECT == read_mode)
+    {
+        return dcb_read_direct(dcb, head, maxbytes, nreadtotal);
+    }
+
+    while (0 == maxbytes || nreadtotal < maxbytes)
+    {
         int bytes_available;
 
         bytes_available = dcb_bytes_readable(dcb);
@@ -1020,6 +1833,76 @@ int dcb_read(DCB   *dcb,
     return nreadtotal;
 }
 
+/**
+ * Read from the DCB's socket without probing the number of readable bytes
+ *
+ * The data is read into pooled buffers of a fixed size until the socket is
+ * drained. A read that does not fill its buffer means that the socket had no
+ * more data, so the common case of a small packet costs one system call.
+ *
+ * @param dcb       The DCB to read from
+ * @param head      Pointer to linked list to append data to
+ * @param maxbytes  Maximum bytes to read (0 = no limit)
+ * @param nreadtotal Number of bytes already in the list
+ * @return          -1 on error, otherwise the total number of bytes read
+ */
+static int
+dcb_read_direct(DCB *dcb, GWBUF **head, int maxbytes, int nreadtotal)
+{
+    while (0 == maxbytes || nreadtotal < maxbytes)
+    {
+        GWBUF *buffer;
+        int nsingleread;
+        int bufsize = GWBUF_MAX_POOLED_SIZE;
+
+        if (maxbytes)
+        {
+            bufsize = MIN(bufsize, maxbytes - nreadtotal);
+        }
+
+        if ((buffer = gwbuf_alloc(bufsize)) == NULL)
+        {
+            char errbuf[STRERROR_BUFLEN];
+            MXS_ERROR("%lu [dcb_read] Error : Failed to allocate read buffer "
+                      "for dcb %p fd %d, due %d, %s.",
+                      pthread_self(),
+                      dcb,
+                      dcb->fd,
+                      errno,
+                      strerror_r(errno, errbuf, sizeof(errbuf)));
+            break;
+        }
+
+        errno = 0;
+        nsingleread = read(dcb->fd, GWBUF_DATA(buffer), bufsize);
+        dcb->stats.n_reads++;
+        DCB_IO_STAT_ADD(DCB_IO_READ_CALLS, 1);
+
+        if (nsingleread <= 0)
+        {
+            gwbuf_free(buffer);
+            dcb_log_read_failure(dcb);
+            /** Handle closed client socket */
+            return dcb_read_no_bytes_available(dcb, nreadtotal);
+        }
+
+        DCB_IO_STAT_ADD(DCB_IO_READ_BYTES, nsingleread);
+        DCB_SESSION_STAT_ADD(dcb, bytes_in, nsingleread);
+        dcb->last_read = hkheartbeat;
+        GWBUF_RTRIM(buffer, bufsize - nsingleread);
+        *head = gwbuf_append(*head, buffer);
+        nreadtotal += nsingleread;
+
+        if (nsingleread < bufsize)
+        {
+            /** The socket has been drained */
+            break;
+        }
+    }
+
+    return nreadtotal;
+}
+
 /**
  * Find the number of bytes available for the DCB's socket
  *
@@ -1084,9 +1967,36 @@ dcb_read_no_bytes_available(DCB *dcb, int nreadtotal)
     return nreadtotal;
 }
 
+/**
+ * Log a failed read unless the socket would merely have blocked
+ *
+ * @param dcb The DCB that was read from
+ */
+static void
+dcb_log_read_failure(DCB *dcb)
+{
+    if (errno != 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        /* <editor-fold defaultstate="collapsed" desc=" Error Logging "> */
+        MXS_ERROR("%lu [dcb_read] Error : Read failed, dcb %p in state "
+                  "%s fd %d, due %d, %s.",
+                  pthread_self(),
+                  dcb,
+                  STRDCBSTATE(dcb->state),
+                  dcb->fd,
+                  errno,
+                  strerror_r(errno, errbuf, sizeof(errbuf)));
+        /* </editor-fold> */
+    }
+}
+
 /**
  * Basic read function to carry out a single read operation on the DCB socket.
  *
+ * Reads that do not fit into one pooled buffer are done with readv into
+ * a chain of pooled buffers.
+ *
  * @param dcb               The DCB to read from
  * @param bytesavailable    Pointer to linked list to append data to
  * @param maxbytes          Maximum bytes to read (0 = no limit)
@@ -1105,6 +2015,11 @@ dcb_basic_read(DCB *dcb, int bytesavailable, int maxbytes, int nreadtotal, int *
         bufsize = MIN(bufsize, maxbytes - nreadtotal);
     }
 
+    if (bufsize > GWBUF_MAX_POOLED_SIZE)
+    {
+        return dcb_basic_readv(dcb, bufsize, nsingleread);
+    }
+
     if ((buffer = gwbuf_alloc(bufsize)) == NULL)
     {
         /*<
@@ -1127,30 +2042,101 @@ dcb_basic_read(DCB *dcb, int bytesavailable, int maxbytes, int nreadtotal, int *
     {
         *nsingleread = read(dcb->fd, GWBUF_DATA(buffer), bufsize);
         dcb->stats.n_reads++;
+        DCB_IO_STAT_ADD(DCB_IO_READ_CALLS, 1);
 
         if (*nsingleread <= 0)
         {
-            if (errno != 0 && errno != EAGAIN && errno != EWOULDBLOCK)
-            {
-                char errbuf[STRERROR_BUFLEN];
-                /* <editor-fold defaultstate="collapsed" desc=" Error Logging "> */
-                MXS_ERROR("%lu [dcb_read] Error : Read failed, dcb %p in state "
-                          "%s fd %d, due %d, %s.",
-                          pthread_self(),
-                          dcb,
-                          STRDCBSTATE(dcb->state),
-                          dcb->fd,
-                          errno,
-                          strerror_r(errno, errbuf, sizeof(errbuf)));
-                /* </editor-fold> */
-            }
+            dcb_log_read_failure(dcb);
             gwbuf_free(buffer);
             buffer = NULL;
         }
+        else
+        {
+            DCB_IO_STAT_ADD(DCB_IO_READ_BYTES, *nsingleread);
+            DCB_SESSION_STAT_ADD(dcb, bytes_in, *nsingleread);
+        }
     }
     return buffer;
 }
 
+/**
+ * Read from the DCB socket into a chain of pooled buffers with one readv call
+ *
+ * @param dcb               The DCB to read from
+ * @param bufsize           The number of bytes to read
+ * @param nsingleread       To be set as the number of bytes read this time
+ * @return                  GWBUF* chain containing new data, or null.
+ */
+static GWBUF *
+dcb_basic_readv(DCB *dcb, int bufsize, int *nsingleread)
+{
+    struct iovec iov[DCB_READV_MAX_IOV];
+    GWBUF *buffers[DCB_READV_MAX_IOV];
+    GWBUF *head = NULL;
+    int n_iov = 0;
+    int nread;
+
+    while (bufsize > 0 && n_iov < DCB_READV_MAX_IOV)
+    {
+        int size = MIN(bufsize, GWBUF_MAX_POOLED_SIZE);
+
+        if ((buffers[n_iov] = gwbuf_alloc(size)) == NULL)
+        {
+            char errbuf[STRERROR_BUFLEN];
+            MXS_ERROR("%lu [dcb_read] Error : Failed to allocate read buffer "
+                      "for dcb %p fd %d, due %d, %s.",
+                      pthread_self(),
+                      dcb,
+                      dcb->fd,
+                      errno,
+                      strerror_r(errno, errbuf, sizeof(errbuf)));
+
+            while (n_iov > 0)
+            {
+                gwbuf_free(buffers[--n_iov]);
+            }
+            *nsingleread = -1;
+            return NULL;
+        }
+        iov[n_iov].iov_base = GWBUF_DATA(buffers[n_iov]);
+        iov[n_iov].iov_len = size;
+        bufsize -= size;
+        n_iov++;
+    }
+
+    nread = readv(dcb->fd, iov, n_iov);
+    dcb->stats.n_reads++;
+    DCB_IO_STAT_ADD(DCB_IO_READ_CALLS, 1);
+    *nsingleread = nread;
+
+    if (nread <= 0)
+    {
+        dcb_log_read_failure(dcb);
+    }
+    else
+    {
+        DCB_IO_STAT_ADD(DCB_IO_READ_BYTES, nread);
+        DCB_SESSION_STAT_ADD(dcb, bytes_in, nread);
+    }
+
+    /** Keep the buffers that received data and trim the last one */
+    for (int i = 0; i < n_iov; i++)
+    {
+        if (nread > 0)
+        {
+            int len = MIN(nread, (int)iov[i].iov_len);
+            GWBUF_RTRIM(buffers[i], iov[i].iov_len - len);
+            head = gwbuf_append(head, buffers[i]);
+            nread -= len;
+        }
+        else
+        {
+            gwbuf_free(buffers[i]);
+        }
+    }
+    return head;
+}
+
 /**
  * General purpose read routine to read data from a socket through the SSL
  * structure lined with this DCB and append it to a linked list of buffers.
@@ -1182,6 +2168,11 @@ dcb_read_SSL(DCB *dcb, GWBUF **head)
         dcb_drain_writeq(dcb);
     }
 
+    /**
+     * OpenSSL reads ahead from the socket, so data can be left in its buffers
+     * after the socket has been drained. Reading continues until OpenSSL needs
+     * more data from the socket, as no new event would arrive for the rest.
+     */
     dcb->last_read = hkheartbeat;
     buffer = dcb_basic_read_SSL(dcb, &nsingleread);
     if (buffer)
@@ -1217,10 +2208,31 @@ dcb_read_SSL(DCB *dcb, GWBUF **head)
 static GWBUF *
 dcb_basic_read_SSL(DCB *dcb, int *nsingleread)
 {
-    unsigned char temp_buffer[MAX_BUFFER_SIZE];
     GWBUF *buffer = NULL;
+    GWBUF *pooled;
+    int pending = SSL_pending(dcb->ssl);
+    /**
+     * Decrypt straight into a pooled buffer. If OpenSSL already holds decrypted
+     * data, the buffer is sized to it so that small records do not occupy a
+     * full sized buffer.
+     */
+    int bufsize = pending > 0 && pending < GWBUF_MAX_POOLED_SIZE ? pending : GWBUF_MAX_POOLED_SIZE;
 
-    *nsingleread = SSL_read(dcb->ssl, (void *)temp_buffer, MAX_BUFFER_SIZE);
+    if ((pooled = gwbuf_alloc(bufsize)) == NULL)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("%lu [dcb_read] Error : Failed to allocate read buffer "
+                  "for dcb %p fd %d, due %d, %s.",
+                  pthread_self(),
+                  dcb,
+                  dcb->fd,
+                  errno,
+                  strerror_r(errno, errbuf, sizeof(errbuf)));
+        *nsingleread = -1;
+        return NULL;
+    }
+
+    *nsingleread = SSL_read(dcb->ssl, GWBUF_DATA(pooled), bufsize);
     dcb->stats.n_reads++;
 
     switch (SSL_get_error(dcb->ssl, *nsingleread))
@@ -1235,24 +2247,11 @@ dcb_basic_read_SSL(DCB *dcb, int *nsingleread)
                   dcb,
                   STRDCBSTATE(dcb->state),
                   dcb->fd);
-        if (*nsingleread && (buffer = gwbuf_alloc_and_load(*nsingleread, (void *)temp_buffer)) == NULL)
+        if (*nsingleread > 0)
         {
-            /*<
-             * This is a fatal error which should cause shutdown.
-             * Todo shutdown if memory allocation fails.
-             */
-            char errbuf[STRERROR_BUFLEN];
-            /* <editor-fold defaultstate="collapsed" desc=" Error Logging "> */
-            MXS_ERROR("%lu [dcb_read] Error : Failed to allocate read buffer "
-                      "for dcb %p fd %d, due %d, %s.",
-                      pthread_self(),
-                      dcb,
-                      dcb->fd,
-                      errno,
-                      strerror_r(errno, errbuf, sizeof(errbuf)));
-            /* </editor-fold> */
-            *nsingleread = -1;
-            return NULL;
+            GWBUF_RTRIM(pooled, bufsize - *nsingleread);
+            buffer = pooled;
+            DCB_SESSION_STAT_ADD(dcb, bytes_in, *nsingleread);
         }
         spinlock_acquire(&dcb->writeqlock);
         /* If we were in a retry situation, need to clear flag and attempt write */
@@ -1313,6 +2312,11 @@ dcb_basic_read_SSL(DCB *dcb, int *nsingleread)
         *nsingleread = dcb_log_errors_SSL(dcb, __func__, *nsingleread);
         break;
     }
+
+    if (pooled != buffer)
+    {
+        gwbuf_free(pooled);
+    }
     return buffer;
 }
 
@@ -1362,55 +2366,431 @@ dcb_log_errors_SSL (DCB *dcb, const char *called_by, int ret)
             ssl_errno = ERR_get_error();
         }
     }
-    return -1;
+    return -1;
+}
+
+/**
+ * General purpose routine to write to a DCB
+ *
+ * @param dcb   The DCB of the client
+ * @param queue Queue of buffers to write
+ * @return      0 on failure, 1 on success
+ */
+int
+dcb_write(DCB *dcb, GWBUF *queue)
+{
+    bool empty_queue;
+    bool below_water;
+
+    below_water = (dcb->high_water && dcb->writeqlen < dcb->high_water);
+    // The following guarantees that queue is not NULL
+    if (!dcb_write_parameter_check(dcb, queue))
+    {
+        return 0;
+    }
+
+    if (dcb->dcb_role == DCB_ROLE_BACKEND_HANDLER && dcb->session)
+    {
+        QUERY_TRACE_POINT(dcb->session, QTRACE_WRITE);
+    }
+
+    spinlock_acquire(&dcb->writeqlock);
+    empty_queue = (dcb->writeq == NULL);
+    /*
+     * Add our data to the write queue.  If the queue already had data,
+     * then there will be an EPOLLOUT event to drain what is already queued.
+     * If it did not already have data, we call the drain write queue
+     * function immediately to attempt to write the data.
+     */
+    int len = gwbuf_length(queue);
+    atomic_add(&dcb->writeqlen, len);
+    dcb->writeq = gwbuf_append(dcb->writeq, queue);
+    spinlock_release(&dcb->writeqlock);
+    dcb_account_memory(dcb, len);
+    dcb->stats.n_buffered++;
+    MXS_DEBUG("%lu [dcb_write] Append to writequeue. %d writes "
+              "buffered for dcb %p in state %s fd %d",
+              pthread_self(),
+              dcb->stats.n_buffered,
+              dcb,
+              STRDCBSTATE(dcb->state),
+              dcb->fd);
+    if (empty_queue && !dcb_write_batch_add(dcb))
+    {
+        dcb_drain_writeq(dcb);
+    }
+    dcb_write_tidy_up(dcb, below_water);
+
+    return 1;
+}
+
+/**
+ * Defer the draining of a backend DCB's write queue to the end of the open
+ * write batch
+ *
+ * @param dcb The DCB that was written to
+ * @return True if the DCB is in the write batch and must not be drained now
+ */
+static bool
+dcb_write_batch_add(DCB *dcb)
+{
+    if (!thread_write_batch || dcb->dcb_role != DCB_ROLE_BACKEND_HANDLER)
+    {
+        return false;
+    }
+
+    if (!dcb->in_write_batch)
+    {
+        if (thread_n_batch_dcbs == DCB_WRITE_BATCH_MAX)
+        {
+            return false;
+        }
+        dcb->in_write_batch = true;
+        thread_batch_dcbs[thread_n_batch_dcbs++] = dcb;
+    }
+
+    return true;
+}
+
+/**
+ * Open a write batch for the calling thread
+ *
+ * Until the batch is ended, the data that is written to backend DCBs is only
+ * queued. The queries that a client pipelines are then sent to each backend
+ * with one system call instead of one per query.
+ */
+void
+dcb_write_batch_begin(void)
+{
+    ss_dassert(!thread_write_batch && thread_n_batch_dcbs == 0);
+    thread_write_batch = true;
+}
+
+/**
+ * End the write batch of the calling thread and drain the write queues of the
+ * DCBs that were written to during it
+ */
+void
+dcb_write_batch_end(void)
+{
+    URING *ring;
+
+    thread_write_batch = false;
+
+    /** With io_uring the write queues are sent with one system call */
+    if (thread_n_batch_dcbs > 1 && (ring = dcb_thread_uring()))
+    {
+        dcb_write_batch_send(ring);
+    }
+
+    for (int i = 0; i < thread_n_batch_dcbs; i++)
+    {
+        DCB *dcb = thread_batch_dcbs[i];
+
+        if (dcb == NULL)
+        {
+            /** Its socket became full when the batch was sent through io_uring */
+            continue;
+        }
+
+        dcb->in_write_batch = false;
+
+        /** A DCB that was closed during the batch is not freed before the batch ends */
+        if (dcb->state == DCB_STATE_POLLING && !dcb->dcb_is_zombie && dcb->writeq)
+        {
+            dcb_drain_writeq(dcb);
+        }
+    }
+
+    thread_n_batch_dcbs = 0;
+}
+
+/**
+ * Return the io_uring of the calling thread, creating it if needed
+ *
+ * @return The ring or NULL if io_uring is not used
+ */
+static URING *
+dcb_thread_uring()
+{
+    if (thread_uring == NULL && use_io_uring && !thread_uring_failed)
+    {
+        if ((thread_uring = uring_create(DCB_URING_ENTRIES)) == NULL)
+        {
+            dcb_thread_uring_failed(errno);
+        }
+    }
+
+    return thread_uring;
+}
+
+/**
+ * Stop using the io_uring of the calling thread after an error, the thread
+ * then reads and writes with the normal system calls
+ *
+ * @param err The error number
+ */
+static void
+dcb_thread_uring_failed(int err)
+{
+    char errbuf[STRERROR_BUFLEN];
+
+    MXS_ERROR("%lu [%s] io_uring can not be used by this thread, falling back to "
+              "read and write. Error %d: %s", pthread_self(), __func__, err,
+              strerror_r(err, errbuf, sizeof(errbuf)));
+    uring_free(thread_uring);
+    thread_uring = NULL;
+    thread_uring_failed = true;
+}
+
+/**
+ * Send the write queues of the DCBs in the write batch through io_uring
+ *
+ * Each write queue is sent with a sendmsg and all of them are submitted with
+ * one system call. What could not be sent is put back in the write queue,
+ * a DCB whose socket was full then waits for EPOLLOUT as usual and the
+ * write errors are left to dcb_drain_writeq.
+ *
+ * @param ring The io_uring of the calling thread
+ * @return Number of DCBs that were sent to
+ */
+static int
+dcb_write_batch_send(URING *ring)
+{
+    struct iovec iov[DCB_WRITE_BATCH_MAX][DCB_URING_MAX_IOV];
+    struct msghdr msg[DCB_WRITE_BATCH_MAX];
+    GWBUF *queues[DCB_WRITE_BATCH_MAX];
+    size_t lengths[DCB_WRITE_BATCH_MAX];
+    bool above_water[DCB_WRITE_BATCH_MAX];
+    int n_sent = 0;
+
+    for (int i = 0; i < thread_n_batch_dcbs; i++)
+    {
+        DCB *dcb = thread_batch_dcbs[i];
+
+        queues[i] = NULL;
+
+        if (dcb->state != DCB_STATE_POLLING || dcb->dcb_is_zombie || dcb->fd <= 0 ||
+            (dcb->ssl && !dcb->ssl_ktls_send) || (queues[i] = dcb_grab_writeq(dcb, true)) == NULL)
+        {
+            continue;
+        }
+
+        int n_iov = 0;
+
+        lengths[i] = 0;
+
+        for (GWBUF *buf = queues[i]; buf && n_iov < DCB_URING_MAX_IOV; buf = buf->next)
+        {
+            if (!GWBUF_EMPTY(buf))
+            {
+                iov[i][n_iov].iov_base = GWBUF_DATA(buf);
+                iov[i][n_iov].iov_len = GWBUF_LENGTH(buf);
+                lengths[i] += GWBUF_LENGTH(buf);
+                n_iov++;
+            }
+        }
+
+        memset(&msg[i], 0, sizeof(msg[i]));
+        msg[i].msg_iov = iov[i];
+        msg[i].msg_iovlen = n_iov;
+        above_water[i] = dcb->low_water && gwbuf_length(queues[i]) > dcb->low_water;
+
+        if (uring_prep_sendmsg(ring, dcb->fd, &msg[i], i))
+        {
+            DCB_IO_STAT_ADD(DCB_IO_WRITE_BUFFERS, n_iov);
+            n_sent++;
+        }
+        else
+        {
+            /** Put the queue back, dcb_write_batch_end drains it */
+            spinlock_acquire(&dcb->writeqlock);
+            dcb->writeq = gwbuf_append(queues[i], dcb->writeq);
+            dcb->draining_flag = false;
+            spinlock_release(&dcb->writeqlock);
+            queues[i] = NULL;
+        }
+    }
+
+    if (n_sent == 0)
+    {
+        return 0;
+    }
+
+    int rc = uring_submit_and_wait(ring, n_sent);
+    DCB_IO_STAT_ADD(DCB_IO_URING_CALLS, 1);
+
+    uint64_t user_data;
+    int res;
+
+    while (uring_reap(ring, &user_data, &res))
+    {
+        int i = user_data;
+        DCB *dcb = thread_batch_dcbs[i];
+        int written = res > 0 ? res : 0;
+
+        DCB_IO_STAT_ADD(DCB_IO_URING_WRITES, 1);
+        DCB_IO_STAT_ADD(DCB_IO_WRITE_BYTES, written);
+        DCB_SESSION_STAT_ADD(dcb, bytes_out, written);
+
+        queues[i] = gwbuf_consume(queues[i], written);
+
+        spinlock_acquire(&dcb->writeqlock);
+        dcb->writeq = gwbuf_append(queues[i], dcb->writeq);
+        dcb->draining_flag = false;
+        dcb->drain_called_while_busy = false;
+        spinlock_release(&dcb->writeqlock);
+        queues[i] = NULL;
+
+        dcb_wrote(dcb, above_water[i], written);
+
+        if (dcb->writeq == NULL)
+        {
+            dcb_call_callback(dcb, DCB_REASON_DRAINED);
+        }
+        else if (res == -EAGAIN || (res >= 0 && (size_t)res < lengths[i]))
+        {
+            /** The socket is full, the rest is written on EPOLLOUT */
+            dcb->in_write_batch = false;
+            thread_batch_dcbs[i] = NULL;
+        }
+    }
+
+    /** The queues whose sendmsg was not submitted are put back */
+    for (int i = 0; i < thread_n_batch_dcbs; i++)
+    {
+        if (queues[i])
+        {
+            DCB *dcb = thread_batch_dcbs[i];
+
+            spinlock_acquire(&dcb->writeqlock);
+            dcb->writeq = gwbuf_append(queues[i], dcb->writeq);
+            dcb->draining_flag = false;
+            spinlock_release(&dcb->writeqlock);
+        }
+    }
+
+    if (rc != n_sent)
+    {
+        dcb_thread_uring_failed(rc < 0 ? -rc : EIO);
+    }
+
+    return n_sent;
 }
 
 /**
- * General purpose routine to write to a DCB
+ * Check whether data can be read from a DCB before its read handler is called
  *
- * @param dcb   The DCB of the client
- * @param queue Queue of buffers to write
- * @return      0 on failure, 1 on success
+ * Only the connections of sessions that are ready for routing are read ahead
+ * so that the authentication and the SSL handshake, which read exact amounts
+ * of data, are not affected.
+ *
+ * @param dcb The DCB
+ * @return True if the DCB can be read ahead
  */
-int
-dcb_write(DCB *dcb, GWBUF *queue)
+static inline bool
+dcb_can_read_ahead(DCB *dcb)
 {
-    bool empty_queue;
-    bool below_water;
+    return dcb->state == DCB_STATE_POLLING && !dcb->dcb_is_zombie && dcb->fd > 0 &&
+           dcb->readahead == NULL && dcb->ssl == NULL &&
+           (dcb->dcb_role == DCB_ROLE_CLIENT_HANDLER || dcb->dcb_role == DCB_ROLE_BACKEND_HANDLER) &&
+           dcb->session && dcb->session->state == SESSION_STATE_ROUTER_READY;
+}
 
-    below_water = (dcb->high_water && dcb->writeqlen < dcb->high_water);
-    // The following guarantees that queue is not NULL
-    if (!dcb_write_parameter_check(dcb, queue))
+/**
+ * Read the DCBs that epoll reported readable with one io_uring submission
+ *
+ * The data is kept in the DCB until the read handler calls dcb_read, which
+ * returns it before reading the socket. If a socket had less data than fits
+ * in the buffer, dcb_read does not read the socket at all. Does nothing if
+ * io_uring is not used.
+ *
+ * @param dcbs The readable DCBs, all owned by the calling thread
+ * @param n    Number of DCBs
+ */
+void
+dcb_read_ahead(DCB **dcbs, int n)
+{
+    URING *ring;
+
+    /** A single read is not made cheaper by the ring */
+    if (n < 2 || (ring = dcb_thread_uring()) == NULL)
     {
-        return 0;
+        return;
     }
 
-    spinlock_acquire(&dcb->writeqlock);
-    empty_queue = (dcb->writeq == NULL);
-    /*
-     * Add our data to the write queue.  If the queue already had data,
-     * then there will be an EPOLLOUT event to drain what is already queued.
-     * If it did not already have data, we call the drain write queue
-     * function immediately to attempt to write the data.
-     */
-    atomic_add(&dcb->writeqlen, gwbuf_length(queue));
-    dcb->writeq = gwbuf_append(dcb->writeq, queue);
-    spinlock_release(&dcb->writeqlock);
-    dcb->stats.n_buffered++;
-    MXS_DEBUG("%lu [dcb_write] Append to writequeue. %d writes "
-              "buffered for dcb %p in state %s fd %d",
-              pthread_self(),
-              dcb->stats.n_buffered,
-              dcb,
-              STRDCBSTATE(dcb->state),
-              dcb->fd);
-    if (empty_queue)
+    for (int start = 0; start < n && thread_uring; start += DCB_URING_ENTRIES)
     {
-        dcb_drain_writeq(dcb);
-    }
-    dcb_write_tidy_up(dcb, below_water);
+        int end = MIN(n, start + DCB_URING_ENTRIES);
+        GWBUF *buffers[DCB_URING_ENTRIES];
+        int n_prep = 0;
 
-    return 1;
+        for (int i = start; i < end; i++)
+        {
+            DCB *dcb = dcbs[i];
+            GWBUF *buf;
+
+            buffers[i - start] = NULL;
+
+            if (!dcb_can_read_ahead(dcb) || (buf = gwbuf_alloc(GWBUF_MAX_POOLED_SIZE)) == NULL)
+            {
+                continue;
+            }
+
+            if (!uring_prep_recv(ring, dcb->fd, GWBUF_DATA(buf), GWBUF_MAX_POOLED_SIZE, i - start))
+            {
+                gwbuf_free(buf);
+                break;
+            }
+
+            buffers[i - start] = buf;
+            n_prep++;
+        }
+
+        if (n_prep == 0)
+        {
+            continue;
+        }
+
+        int rc = uring_submit_and_wait(ring, n_prep);
+        DCB_IO_STAT_ADD(DCB_IO_URING_CALLS, 1);
+
+        uint64_t user_data;
+        int res;
+
+        while (uring_reap(ring, &user_data, &res))
+        {
+            int i = user_data;
+            DCB *dcb = dcbs[start + i];
+
+            DCB_IO_STAT_ADD(DCB_IO_URING_READS, 1);
+
+            if (res > 0)
+            {
+                GWBUF_RTRIM(buffers[i], GWBUF_MAX_POOLED_SIZE - res);
+                dcb->readahead = buffers[i];
+                dcb->readahead_drained = res < GWBUF_MAX_POOLED_SIZE;
+                dcb->stats.n_reads++;
+                buffers[i] = NULL;
+                DCB_IO_STAT_ADD(DCB_IO_READ_BYTES, res);
+                DCB_SESSION_STAT_ADD(dcb, bytes_in, res);
+            }
+            /** The end of file and the errors are seen again by dcb_read */
+        }
+
+        for (int i = 0; i < end - start; i++)
+        {
+            if (buffers[i])
+            {
+                gwbuf_free(buffers[i]);
+            }
+        }
+
+        if (rc != n_prep)
+        {
+            dcb_thread_uring_failed(rc < 0 ? -rc : EIO);
+        }
+    }
 }
 
 #if defined(FAKE_CODE)
@@ -1581,7 +2961,234 @@ dcb_write_tidy_up(DCB *dcb, bool below_water)
     {
         atomic_add(&dcb->stats.n_high_water, 1);
         dcb_call_callback(dcb, DCB_REASON_HIGH_WATER);
+
+        if (DCB_ROLE_CLIENT_HANDLER == dcb->dcb_role)
+        {
+            dcb_pause_backends(dcb);
+        }
+        else if (DCB_ROLE_BACKEND_HANDLER == dcb->dcb_role)
+        {
+            dcb_pause_client(dcb);
+        }
+    }
+}
+
+/**
+ * Stop reading from the backend DCBs of the session of a client DCB whose
+ * write queue has grown above its high water mark. Without this a client
+ * that reads a large result slowly would make the whole result accumulate in
+ * its write queue.
+ *
+ * The flag of the client DCB is set before the length of the write queue is
+ * checked, and the write queue is drained before the flag is checked. Either
+ * this function sees that the queue has already been drained or the drain
+ * sees the flag and resumes the reads.
+ *
+ * @param client    The client DCB
+ */
+static void
+dcb_pause_backends(DCB *client)
+{
+    SESSION *session = client->session;
+    DCB *dcbs[DCB_MAX_THROTTLED];
+    int n, i;
+
+    if (session == NULL || SESSION_STATE_DUMMY == session->state)
+    {
+        return;
+    }
+
+    spinlock_acquire(&throttle_lock);
+
+    if (!client->backends_paused)
+    {
+        client->backends_paused = true;
+        __sync_synchronize();
+
+        if (client->writeqlen > client->low_water)
+        {
+            n = dcb_get_session_dcbs(session, dcbs, DCB_MAX_THROTTLED);
+            n = n < DCB_MAX_THROTTLED ? n : DCB_MAX_THROTTLED;
+
+            for (i = 0; i < n; i++)
+            {
+                if (DCB_ROLE_BACKEND_HANDLER == dcbs[i]->dcb_role && !dcbs[i]->reads_paused &&
+                    poll_set_read_events(dcbs[i], false) == 0)
+                {
+                    dcbs[i]->reads_paused = true;
+                }
+            }
+            MXS_DEBUG("%lu [dcb_pause_backends] Write queue of client DCB %p is %d bytes, "
+                      "paused reads from the backends.", pthread_self(), client,
+                      client->writeqlen);
+        }
+        else
+        {
+            client->backends_paused = false;
+        }
+    }
+
+    spinlock_release(&throttle_lock);
+}
+
+/**
+ * Resume the reads from the backend DCBs of a session once the write queue of
+ * the client DCB has been drained below its low water mark
+ *
+ * @param client    The client DCB
+ */
+static void
+dcb_resume_backends(DCB *client)
+{
+    SESSION *session = client->session;
+    DCB *dcbs[DCB_MAX_THROTTLED];
+    int n, i;
+
+    spinlock_acquire(&throttle_lock);
+
+    if (client->backends_paused && client->writeqlen < client->low_water)
+    {
+        client->backends_paused = false;
+        n = session ? dcb_get_session_dcbs(session, dcbs, DCB_MAX_THROTTLED) : 0;
+        n = n < DCB_MAX_THROTTLED ? n : DCB_MAX_THROTTLED;
+
+        for (i = 0; i < n; i++)
+        {
+            if (dcbs[i]->reads_paused)
+            {
+                dcbs[i]->reads_paused = false;
+                poll_set_read_events(dcbs[i], true);
+            }
+        }
+        MXS_DEBUG("%lu [dcb_resume_backends] Write queue of client DCB %p is %d bytes, "
+                  "resumed reads from the backends.", pthread_self(), client,
+                  client->writeqlen);
+    }
+
+    spinlock_release(&throttle_lock);
+}
+
+/**
+ * Stop reading from the client of a backend DCB whose write queue has grown
+ * above its high water mark. Without this a client that sends a large
+ * statement or the file of a LOAD DATA LOCAL INFILE faster than the server
+ * reads it would make the data accumulate in the write queue.
+ *
+ * The reads stay paused until all the backend DCBs that paused them have
+ * drained their write queues below the low water mark.
+ *
+ * @param backend   The backend DCB
+ */
+static void
+dcb_pause_client(DCB *backend)
+{
+    SESSION *session = backend->session;
+    DCB *client;
+
+    if (session == NULL || SESSION_STATE_DUMMY == session->state ||
+        (client = session->client_dcb) == NULL)
+    {
+        return;
+    }
+
+    spinlock_acquire(&throttle_lock);
+
+    if (!backend->client_paused)
+    {
+        backend->client_paused = true;
+        __sync_synchronize();
+
+        if (backend->writeqlen > backend->low_water)
+        {
+            if (client->n_pausing++ == 0 && !client->reads_paused &&
+                poll_set_read_events(client, false) == 0)
+            {
+                client->reads_paused = true;
+            }
+            MXS_DEBUG("%lu [dcb_pause_client] Write queue of backend DCB %p is %d bytes, "
+                      "paused reads from the client.", pthread_self(), backend,
+                      backend->writeqlen);
+        }
+        else
+        {
+            backend->client_paused = false;
+        }
+    }
+
+    spinlock_release(&throttle_lock);
+}
+
+/**
+ * Resume the reads from the client once the write queue of a backend DCB has
+ * been drained below its low water mark or the backend DCB is closed
+ *
+ * @param backend   The backend DCB
+ * @param closing   The backend DCB is being closed
+ */
+static void
+dcb_resume_client(DCB *backend, bool closing)
+{
+    SESSION *session = backend->session;
+    DCB *client = session ? session->client_dcb : NULL;
+
+    spinlock_acquire(&throttle_lock);
+
+    if (backend->client_paused && (closing || backend->writeqlen < backend->low_water))
+    {
+        backend->client_paused = false;
+
+        if (client && --client->n_pausing == 0 && client->reads_paused)
+        {
+            client->reads_paused = false;
+            poll_set_read_events(client, true);
+            MXS_DEBUG("%lu [dcb_resume_client] Write queue of backend DCB %p is %d bytes, "
+                      "resumed reads from the client.", pthread_self(), backend,
+                      backend->writeqlen);
+        }
+    }
+
+    spinlock_release(&throttle_lock);
+}
+
+/**
+ * Stop reading from a client DCB until dcb_resume_reads is called. The pauses
+ * nest with the ones of the backend write queues, the reads are resumed when
+ * the last of them ends.
+ *
+ * @param client    The client DCB
+ */
+void
+dcb_suspend_reads(DCB *client)
+{
+    spinlock_acquire(&throttle_lock);
+
+    if (client->n_pausing++ == 0 && !client->reads_paused &&
+        poll_set_read_events(client, false) == 0)
+    {
+        client->reads_paused = true;
+    }
+
+    spinlock_release(&throttle_lock);
+}
+
+/**
+ * End a pause of the reads of a client DCB that was started with
+ * dcb_suspend_reads
+ *
+ * @param client    The client DCB
+ */
+void
+dcb_resume_reads(DCB *client)
+{
+    spinlock_acquire(&throttle_lock);
+
+    if (--client->n_pausing == 0 && client->reads_paused)
+    {
+        client->reads_paused = false;
+        poll_set_read_events(client, true);
     }
+
+    spinlock_release(&throttle_lock);
 }
 
 /**
@@ -1634,7 +3241,7 @@ dcb_drain_writeq(DCB *dcb)
             bool stop_writing = false;
             int written;
             /* The value put into written will be >= 0 */
-            if (dcb->ssl)
+            if (dcb->ssl && !dcb->ssl_ktls_send)
             {
                 written = gw_write_SSL(dcb, local_writeq, &stop_writing);
             }
@@ -1642,6 +3249,7 @@ dcb_drain_writeq(DCB *dcb)
             {
                 written = gw_write(dcb, local_writeq, &stop_writing);
             }
+            DCB_SESSION_STAT_ADD(dcb, bytes_out, written);
             /*
              * If the stop_writing boolean is set, writing has become blocked,
              * so the remaining data is put back at the front of the write
@@ -1672,37 +3280,210 @@ dcb_drain_writeq(DCB *dcb)
                     goto wrap_up;
                 }
             }
-            /*
-             * Consume the bytes we have written from the list of buffers,
-             * and increment the total bytes written.
-             */
-            local_writeq = gwbuf_consume(local_writeq, written);
-            total_written += written;
+            /*
+             * Consume the bytes we have written from the list of buffers,
+             * and increment the total bytes written.
+             */
+            local_writeq = gwbuf_consume(local_writeq, written);
+            total_written += written;
+        }
+    }
+    while ((local_writeq = dcb_grab_writeq(dcb, false)) != NULL);
+    /* The write queue has drained, potentially need to call a callback function */
+    dcb_call_callback(dcb, DCB_REASON_DRAINED);
+
+wrap_up:
+    dcb_wrote(dcb, above_water, total_written);
+    MXS_PROBE3(dcb_drain_writeq, dcb, dcb->fd, total_written);
+    return total_written;
+}
+
+/**
+ * Adjust the length of the write queue after data has been written and call
+ * the low water callbacks
+ *
+ * @param dcb           The DCB that was written to
+ * @param above_water   Whether the write queue was above the low water mark
+ * @param total_written Number of bytes written
+ */
+static void
+dcb_wrote(DCB *dcb, bool above_water, int total_written)
+{
+    /*
+     * If nothing has been written, the callback events cannot have occurred
+     * and there is no need to adjust the length of the write queue.
+     */
+    if (total_written)
+    {
+        atomic_add(&dcb->writeqlen, -total_written);
+        dcb_account_memory(dcb, -total_written);
+
+        /* Check if the draining has taken us from above water to below water */
+        if (above_water && dcb->writeqlen < dcb->low_water)
+        {
+            atomic_add(&dcb->stats.n_low_water, 1);
+            dcb_call_callback(dcb, DCB_REASON_LOW_WATER);
+        }
+
+        if (dcb->backends_paused && dcb->writeqlen < dcb->low_water)
+        {
+            dcb_resume_backends(dcb);
+        }
+
+        if (dcb->client_paused && dcb->writeqlen < dcb->low_water)
+        {
+            dcb_resume_client(dcb, false);
+        }
+
+    }
+}
+
+/**
+ * Write a header followed by a region of a file to a DCB. The file data is
+ * sent with sendfile() so that it is not copied through user space. This is
+ * only done when nothing else is being written to the DCB and the data is
+ * not encrypted by MaxScale.
+ *
+ * If the socket blocks, the data that was not sent is read into a buffer and
+ * put at the front of the write queue, from where it is written when the
+ * socket becomes writable again.
+ *
+ * @param dcb       The DCB to write to
+ * @param head      Data that is sent before the file data
+ * @param head_len  Length of the head
+ * @param in_fd     The file
+ * @param offset    Offset of the region in the file
+ * @param count     Length of the region
+ * @param blocked   Set to true if the socket blocked and the rest was queued
+ * @return 1 if the data was written or queued, 0 if it was not written because
+ * it must go through the write queue and -1 if the write failed
+ */
+int
+dcb_sendfile(DCB *dcb, uint8_t *head, size_t head_len, int in_fd, off_t offset,
+             size_t count, bool *blocked)
+{
+    size_t head_sent = 0;
+    size_t sent = 0;
+    GWBUF *rest = NULL;
+    int saved_errno = 0;
+    int rval = 1;
+
+    *blocked = false;
+
+    if ((dcb->ssl && !dcb->ssl_ktls_send) || dcb->fd <= 0 || dcb->state != DCB_STATE_POLLING)
+    {
+        return 0;
+    }
+
+    /** Keep others from writing to the socket, their data is queued meanwhile */
+    spinlock_acquire(&dcb->writeqlock);
+    if (dcb->writeq || dcb->draining_flag)
+    {
+        spinlock_release(&dcb->writeqlock);
+        return 0;
+    }
+    dcb->draining_flag = true;
+    spinlock_release(&dcb->writeqlock);
+
+    while (head_sent < head_len)
+    {
+        ssize_t n = send(dcb->fd, head + head_sent, head_len - head_sent, MSG_MORE | MSG_NOSIGNAL);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            saved_errno = errno;
+            break;
         }
+        head_sent += n;
     }
-    while ((local_writeq = dcb_grab_writeq(dcb, false)) != NULL);
-    /* The write queue has drained, potentially need to call a callback function */
-    dcb_call_callback(dcb, DCB_REASON_DRAINED);
+    DCB_IO_STAT_ADD(DCB_IO_WRITE_CALLS, 1);
 
-wrap_up:
+    while (head_sent == head_len && sent < count)
+    {
+        off_t pos = offset + sent;
+        ssize_t n = sendfile(dcb->fd, in_fd, &pos, count - sent);
 
-    /*
-     * If nothing has been written, the callback events cannot have occurred
-     * and there is no need to adjust the length of the write queue.
-     */
-    if (total_written)
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            /** A short file is an error, not a blocked socket */
+            saved_errno = n < 0 ? errno : EIO;
+            break;
+        }
+        sent += n;
+        DCB_IO_STAT_ADD(DCB_IO_WRITE_CALLS, 1);
+    }
+    DCB_IO_STAT_ADD(DCB_IO_WRITE_BYTES, head_sent + sent);
+    DCB_SESSION_STAT_ADD(dcb, bytes_out, head_sent + sent);
+
+    if (head_sent < head_len || sent < count)
     {
-        atomic_add(&dcb->writeqlen, -total_written);
+        size_t head_left = head_len - head_sent;
+        size_t left = count - sent;
 
-        /* Check if the draining has taken us from above water to below water */
-        if (above_water && dcb->writeqlen < dcb->low_water)
+        if (saved_errno == EAGAIN || saved_errno == EWOULDBLOCK)
         {
-            atomic_add(&dcb->stats.n_low_water, 1);
-            dcb_call_callback(dcb, DCB_REASON_LOW_WATER);
+            if ((rest = gwbuf_alloc(head_left + left)) != NULL)
+            {
+                uint8_t *data = GWBUF_DATA(rest);
+
+                memcpy(data, head + head_sent, head_left);
+
+                if (pread(in_fd, data + head_left, left, offset + sent) != (ssize_t)left)
+                {
+                    gwbuf_free(rest);
+                    rest = NULL;
+                }
+            }
+
+            if (rest)
+            {
+                *blocked = true;
+            }
+            else
+            {
+                MXS_ERROR("Failed to queue the %lu bytes that could not be sent to dcb %p.",
+                          (unsigned long)(head_left + left), dcb);
+                rval = -1;
+            }
+        }
+        else
+        {
+            char errbuf[STRERROR_BUFLEN];
+            MXS_ERROR("Write to dcb %p in state %s fd %d failed due errno %d, %s",
+                      dcb, STRDCBSTATE(dcb->state), dcb->fd, saved_errno,
+                      strerror_r(saved_errno, errbuf, sizeof(errbuf)));
+            rval = -1;
         }
+    }
+
+    int rest_len = rest ? gwbuf_length(rest) : 0;
+    spinlock_acquire(&dcb->writeqlock);
+    if (rest)
+    {
+        atomic_add(&dcb->writeqlen, rest_len);
+        dcb->writeq = gwbuf_append(rest, dcb->writeq);
+    }
+    bool drain = dcb->writeq != NULL && !*blocked;
+    dcb->draining_flag = false;
+    dcb->drain_called_while_busy = false;
+    spinlock_release(&dcb->writeqlock);
+    dcb_account_memory(dcb, rest_len);
 
+    if (drain)
+    {
+        /** Write what others queued while the file was being sent */
+        dcb_drain_writeq(dcb);
     }
-    return total_written;
+
+    return rval;
 }
 
 /**
@@ -1802,6 +3583,20 @@ dcb_close(DCB *dcb)
         raise(SIGABRT);
     }
 
+    dcb_connect_responded(dcb);
+
+    /**
+     * The SO_REUSEPORT listeners of the other threads are closed with the
+     * first one. They do not hold a reference to its session.
+     */
+    if (dcb->nextlistener)
+    {
+        DCB *next = dcb->nextlistener;
+        dcb->nextlistener = NULL;
+        next->session = NULL;
+        dcb_close(next);
+    }
+
     /**
      * dcb_close may be called for freshly created dcb, in which case
      * it only needs to be freed.
@@ -1821,8 +3616,13 @@ dcb_close(DCB *dcb)
         return;
     }
 
-    spinlock_acquire(&zombiespin);
-    if (!dcb->dcb_is_zombie)
+    if (dcb->client_paused)
+    {
+        /** The client must not wait for a connection that is gone */
+        dcb_resume_client(dcb, true);
+    }
+
+    if (__sync_bool_compare_and_swap(&dcb->dcb_is_zombie, false, true))
     {
         if (DCB_ROLE_BACKEND_HANDLER == dcb->dcb_role && 0 == dcb->persistentstart
             && dcb->server && DCB_STATE_POLLING == dcb->state)
@@ -1836,25 +3636,11 @@ dcb_close(DCB *dcb)
             }
         }
         /*<
-         * Add closing dcb to the top of the list, setting zombie marker
+         * Add closing dcb to the top of the list. The epoch it gets
+         * protects it from premature destruction.
          */
-        dcb->dcb_is_zombie = true;
-        dcb->memdata.next = zombies;
-        zombies = dcb;
-        nzombies++;
-        if (nzombies > maxzombies)
-        {
-            maxzombies = nzombies;
-        }
-        /*< Set bit for each maxscale thread. This should be done before
-         * the state is changed, so as to protect the DCB from premature
-         * destruction. */
-        if (dcb->server)
-        {
-            bitmask_copy(&dcb->memdata.bitmask, poll_bitmask());
-        }
+        dcb_add_to_zombies(dcb);
     }
-    spinlock_release(&zombiespin);
 }
 
 /**
@@ -1875,9 +3661,19 @@ dcb_maybe_add_persistent(DCB *dcb)
         && (dcb->server->status & SERVER_RUNNING)
         && !dcb->dcb_errhandle_called
         && !(dcb->flags & DCBF_HUNG)
-        && (poolcount = dcb_persistent_clean_count(dcb, false)) < dcb->server->persistpoolmax)
+        && (poolcount = dcb->server->stats.n_persistent) < dcb->server->persistpoolmax)
     {
         DCB_CALLBACK *loopcallback;
+
+        spinlock_acquire(&throttle_lock);
+        if (dcb->reads_paused)
+        {
+            /** The next session must be able to read from the connection */
+            dcb->reads_paused = false;
+            poll_set_read_events(dcb, true);
+        }
+        spinlock_release(&throttle_lock);
+
         MXS_DEBUG("%lu [dcb_maybe_add_persistent] Adding DCB to persistent pool, user %s.\n",
                   pthread_self(),
                   dcb->user);
@@ -1889,6 +3685,7 @@ dcb_maybe_add_persistent(DCB *dcb)
              */
         {
             SESSION *local_session = dcb->session;
+            dcb_release_memory(dcb);
             session_set_dummy(dcb);
             CHK_SESSION(local_session);
             if (SESSION_STATE_DUMMY != local_session->state)
@@ -1903,10 +3700,11 @@ dcb_maybe_add_persistent(DCB *dcb)
             free(loopcallback);
         }
         spinlock_release(&dcb->cb_lock);
-        spinlock_acquire(&dcb->server->persistlock);
-        dcb->nextpersistent = dcb->server->persistent;
-        dcb->server->persistent = dcb;
-        spinlock_release(&dcb->server->persistlock);
+        SERVER_POOL_SHARD *shard = server_pool_shard(dcb->server, dcb->owner);
+        spinlock_acquire(&shard->lock);
+        dcb->nextpersistent = shard->persistent;
+        shard->persistent = dcb;
+        spinlock_release(&shard->lock);
         atomic_add(&dcb->server->stats.n_persistent, 1);
         atomic_add(&dcb->server->stats.n_current, -1);
         return true;
@@ -2017,6 +3815,29 @@ void printAllDCBs()
     spinlock_release(&dcbspin);
 }
 
+/**
+ * Print the protocol compression statistics of a DCB, if it uses compression
+ *
+ * @param pdcb  DCB to print results to
+ * @param dcb   DCB to be printed
+ */
+static void
+dcb_print_compression(DCB *pdcb, DCB *dcb)
+{
+    if (dcb->stats.n_compress_in || dcb->stats.n_decompress_in)
+    {
+        uint64_t in = dcb->stats.n_compress_in;
+        uint64_t out = dcb->stats.n_decompress_out;
+
+        dcb_printf(pdcb, "\t\tCompression ratio, writes: %.2f\n",
+                   in ? (double)in / dcb->stats.n_compress_out : 0.0);
+        dcb_printf(pdcb, "\t\tCompression ratio, reads:  %.2f\n",
+                   out ? (double)out / dcb->stats.n_decompress_in : 0.0);
+        dcb_printf(pdcb, "\t\tCompression CPU time (ms): %.3f\n",
+                   dcb->stats.n_compress_usecs / 1000.0);
+    }
+}
+
 /**
  * Diagnostic to print one DCB in the system
  *
@@ -2083,14 +3904,9 @@ dprintOneDCB(DCB *pdcb, DCB *dcb)
         dcb_printf(pdcb, "\tRole:                     %s\n", rolename);
         free(rolename);
     }
-    if (!bitmask_isallclear(&dcb->memdata.bitmask))
+    if (dcb->dcb_is_zombie)
     {
-        char *bitmasktext = bitmask_render_readable(&dcb->memdata.bitmask);
-        if (bitmasktext)
-        {
-            dcb_printf(pdcb, "\tBitMask:                %s\n", bitmasktext);
-            free(bitmasktext);
-        }
+        dcb_printf(pdcb, "\tZombie epoch:             %" PRIu64 "\n", dcb->memdata.epoch);
     }
     dcb_printf(pdcb, "\tStatistics:\n");
     dcb_printf(pdcb, "\t\tNo. of Reads:             %d\n", dcb->stats.n_reads);
@@ -2099,6 +3915,7 @@ dprintOneDCB(DCB *pdcb, DCB *dcb)
     dcb_printf(pdcb, "\t\tNo. of Accepts:           %d\n", dcb->stats.n_accepts);
     dcb_printf(pdcb, "\t\tNo. of High Water Events: %d\n", dcb->stats.n_high_water);
     dcb_printf(pdcb, "\t\tNo. of Low Water Events:  %d\n", dcb->stats.n_low_water);
+    dcb_print_compression(pdcb, dcb);
     if (dcb->flags & DCBF_CLONE)
     {
         dcb_printf(pdcb, "\t\tDCB is a clone.\n");
@@ -2112,6 +3929,49 @@ dprintOneDCB(DCB *pdcb, DCB *dcb)
         dcb_printf(pdcb, "\t\tAdded to persistent pool:       %s\n", buff);
     }
 }
+
+/**
+ * Take a copy of the list of all DCBs. The DCBs are never freed so the
+ * copied pointers stay valid, which allows the diagnostic output to be
+ * written without holding dcbspin.
+ *
+ * @param count Set to the number of DCBs in the returned array
+ * @return Array of DCB pointers that must be freed by the caller, NULL
+ *         if there are no DCBs or memory allocation failed
+ */
+static DCB **
+dcb_snapshot(int *count)
+{
+    DCB **dcbs = NULL;
+    int n = 0;
+
+    spinlock_acquire(&dcbspin);
+
+    for (DCB *dcb = allDCBs; dcb; dcb = dcb->next)
+    {
+        n++;
+    }
+
+    if (n > 0 && (dcbs = malloc(n * sizeof(DCB *))) != NULL)
+    {
+        n = 0;
+
+        for (DCB *dcb = allDCBs; dcb; dcb = dcb->next)
+        {
+            dcbs[n++] = dcb;
+        }
+    }
+    else
+    {
+        n = 0;
+    }
+
+    spinlock_release(&dcbspin);
+
+    *count = n;
+    return dcbs;
+}
+
 /**
  * Diagnostic to print all DCB allocated in the system
  *
@@ -2120,22 +3980,21 @@ dprintOneDCB(DCB *pdcb, DCB *dcb)
 void
 dprintAllDCBs(DCB *pdcb)
 {
-    DCB *dcb;
+    int n;
+    DCB **dcbs;
 
-    spinlock_acquire(&dcbspin);
 #if SPINLOCK_PROFILE
     dcb_printf(pdcb, "DCB List Spinlock Statistics:\n");
     spinlock_stats(&dcbspin, spin_reporter, pdcb);
-    dcb_printf(pdcb, "Zombie Queue Lock Statistics:\n");
-    spinlock_stats(&zombiespin, spin_reporter, pdcb);
 #endif
-    dcb = allDCBs;
-    while (dcb)
+    dcbs = dcb_snapshot(&n);
+
+    for (int i = 0; i < n; i++)
     {
-        dprintOneDCB(pdcb, dcb);
-        dcb = dcb->next;
+        dprintOneDCB(pdcb, dcbs[i]);
     }
-    spinlock_release(&dcbspin);
+
+    free(dcbs);
 }
 
 /**
@@ -2146,17 +4005,18 @@ dprintAllDCBs(DCB *pdcb)
 void
 dListDCBs(DCB *pdcb)
 {
-    DCB *dcb;
+    int n;
+    DCB **dcbs = dcb_snapshot(&n);
 
-    spinlock_acquire(&dcbspin);
-    dcb = allDCBs;
     dcb_printf(pdcb, "Descriptor Control Blocks\n");
     dcb_printf(pdcb, "------------------+----------------------------+--------------------+----------\n");
     dcb_printf(pdcb, " %-16s | %-26s | %-18s | %s\n",
                "DCB", "State", "Service", "Remote");
     dcb_printf(pdcb, "------------------+----------------------------+--------------------+----------\n");
-    while (dcb)
+    for (int i = 0; i < n; i++)
     {
+        DCB *dcb = dcbs[i];
+
         if (dcb->dcb_is_in_use && dcb->state == DCB_STATE_POLLING)
         {
             dcb_printf(pdcb, " %-16p | %-26s | %-18s | %s\n",
@@ -2164,10 +4024,9 @@ dListDCBs(DCB *pdcb)
                        ((dcb->session && dcb->session->service) ? dcb->session->service->name : ""),
                        (dcb->remote ? dcb->remote : ""));
         }
-        dcb = dcb->next;
     }
     dcb_printf(pdcb, "------------------+----------------------------+--------------------+----------\n\n");
-    spinlock_release(&dcbspin);
+    free(dcbs);
 }
 
 /**
@@ -2178,17 +4037,18 @@ dListDCBs(DCB *pdcb)
 void
 dListClients(DCB *pdcb)
 {
-    DCB *dcb;
+    int n;
+    DCB **dcbs = dcb_snapshot(&n);
 
-    spinlock_acquire(&dcbspin);
-    dcb = allDCBs;
     dcb_printf(pdcb, "Client Connections\n");
     dcb_printf(pdcb, "-----------------+------------------+----------------------+------------\n");
     dcb_printf(pdcb, " %-15s | %-16s | %-20s | %s\n",
                "Client", "DCB", "Service", "Session");
     dcb_printf(pdcb, "-----------------+------------------+----------------------+------------\n");
-    while (dcb)
+    for (int i = 0; i < n; i++)
     {
+        DCB *dcb = dcbs[i];
+
         if (dcb->dcb_is_in_use && dcb->dcb_role == DCB_ROLE_CLIENT_HANDLER &&
             dcb->state == DCB_STATE_POLLING)
         {
@@ -2198,10 +4058,9 @@ dListClients(DCB *pdcb)
                              dcb->session->service->name : ""),
                        dcb->session);
         }
-        dcb = dcb->next;
     }
     dcb_printf(pdcb, "-----------------+------------------+----------------------+------------\n\n");
-    spinlock_release(&dcbspin);
+    free(dcbs);
 }
 
 
@@ -2273,6 +4132,7 @@ dprintDCB(DCB *pdcb, DCB *dcb)
                dcb->stats.n_high_water);
     dcb_printf(pdcb, "\t\tNo. of Low Water Events:  %d\n",
                dcb->stats.n_low_water);
+    dcb_print_compression(pdcb, dcb);
     if (DCB_POLL_BUSY(dcb))
     {
         dcb_printf(pdcb, "\t\tPending events in the queue:      %x %s\n",
@@ -2461,9 +4321,57 @@ gw_write_SSL(DCB *dcb, GWBUF *writeq, bool *stop_writing)
     return written > 0 ? written : 0;
 }
 
+/**
+ * Write a chain of buffers to a socket with one system call
+ *
+ * At most IOV_MAX buffers of the chain are written. A single buffer is
+ * written with a plain write.
+ *
+ * @param fd            The socket to write to
+ * @param writeq        A buffer list containing the data to be written
+ * @return              Number of written bytes or -1 on error
+ */
+static int
+dcb_writev(int fd, GWBUF *writeq)
+{
+    struct iovec iov[IOV_MAX];
+    int n_iov = 0;
+    int written;
+
+    if (writeq->next == NULL)
+    {
+        DCB_IO_STAT_ADD(DCB_IO_WRITE_CALLS, 1);
+        DCB_IO_STAT_ADD(DCB_IO_WRITE_BUFFERS, 1);
+        written = write(fd, GWBUF_DATA(writeq), GWBUF_LENGTH(writeq));
+    }
+    else
+    {
+        for (GWBUF *buf = writeq; buf && n_iov < IOV_MAX; buf = buf->next)
+        {
+            if (!GWBUF_EMPTY(buf))
+            {
+                iov[n_iov].iov_base = GWBUF_DATA(buf);
+                iov[n_iov].iov_len = GWBUF_LENGTH(buf);
+                n_iov++;
+            }
+        }
+        DCB_IO_STAT_ADD(DCB_IO_WRITE_CALLS, 1);
+        DCB_IO_STAT_ADD(DCB_IO_WRITE_BUFFERS, n_iov);
+        written = writev(fd, iov, n_iov);
+    }
+
+    if (written > 0)
+    {
+        DCB_IO_STAT_ADD(DCB_IO_WRITE_BYTES, written);
+    }
+    return written;
+}
+
 /**
  * Write data to a DCB. The data is taken from the DCB's write queue.
  *
+ * As many buffers of the chain as possible are written with one system call.
+ *
  * @param dcb           The DCB to write buffer
  * @param writeq        A buffer list containing the data to be written
  * @param stop_writing  Set to true if the caller should stop writing, false otherwise
@@ -2499,7 +4407,7 @@ gw_write(DCB *dcb, GWBUF *writeq, bool *stop_writing)
 #else
     if (fd > 0)
     {
-        written = write(fd, buf, nbytes);
+        written = dcb_writev(fd, writeq);
     }
 #endif /* FAKE_CODE */
 
@@ -2792,9 +4700,49 @@ dcb_isvalid_nolock(DCB *dcb)
     return (dcb == dcb_find_in_list(dcb));
 }
 
+/**
+ * Collect the client and backend DCBs that are linked to a session
+ *
+ * @param session   The session
+ * @param dcbs      Array where the DCBs are stored
+ * @param size      Size of the array
+ * @return          The number of DCBs linked to the session, if this is larger
+ *                  than @c size only the first @c size DCBs are stored
+ */
+int
+dcb_get_session_dcbs(SESSION *session, DCB **dcbs, int size)
+{
+    DCB *dcb;
+    int n = 0;
+
+    spinlock_acquire(&dcbspin);
+    dcb = allDCBs;
+
+    while (dcb != NULL)
+    {
+        if (dcb->dcb_is_in_use && dcb->session == session &&
+            (dcb->dcb_role == DCB_ROLE_CLIENT_HANDLER ||
+             dcb->dcb_role == DCB_ROLE_BACKEND_HANDLER))
+        {
+            if (n < size)
+            {
+                dcbs[n] = dcb;
+            }
+            n++;
+        }
+        dcb = dcb->next;
+    }
+    spinlock_release(&dcbspin);
+
+    return n;
+}
+
 /**
  * Call all the callbacks on all DCB's that match the server and the reason given
  *
+ * Only the list of the DCBs of the server is scanned.
+ *
+ * @param server        The server whose DCBs are notified
  * @param reason        The DCB_REASON that triggers the callback
  */
 void
@@ -2810,27 +4758,18 @@ dcb_call_foreach(struct server* server, DCB_REASON reason)
     case DCB_REASON_HUP:
     case DCB_REASON_NOT_RESPONDING:
     {
-        DCB *dcb;
-        spinlock_acquire(&dcbspin);
-        dcb = allDCBs;
+        spinlock_acquire(&server->dcbs_lock);
 
-        while (dcb != NULL)
+        for (DCB *dcb = server->dcbs; dcb; dcb = dcb->server_next)
         {
-            if (false == dcb->dcb_is_in_use)
-            {
-                dcb = dcb->next;
-                continue;
-            }
             spinlock_acquire(&dcb->dcb_initlock);
-            if (dcb->state == DCB_STATE_POLLING && dcb->server &&
-                strcmp(dcb->server->unique_name,server->unique_name) == 0)
+            if (dcb->state == DCB_STATE_POLLING)
             {
                 dcb_call_callback(dcb, DCB_REASON_NOT_RESPONDING);
             }
             spinlock_release(&dcb->dcb_initlock);
-            dcb = dcb->next;
         }
-        spinlock_release(&dcbspin);
+        spinlock_release(&server->dcbs_lock);
         break;
     }
 
@@ -2841,36 +4780,29 @@ dcb_call_foreach(struct server* server, DCB_REASON reason)
 }
 
 /**
- * Call all the callbacks on all DCB's that match the server and the reason given
+ * Send a fake hangup event to all the polling DCBs of a server
  *
- * @param reason        The DCB_REASON that triggers the callback
+ * Only the list of the DCBs of the server is scanned.
+ *
+ * @param server        The server that has failed
  */
 void
 dcb_hangup_foreach(struct server* server)
 {
     MXS_DEBUG("%lu [dcb_hangup_foreach]", pthread_self());
 
-    DCB *dcb;
-    spinlock_acquire(&dcbspin);
-    dcb = allDCBs;
+    spinlock_acquire(&server->dcbs_lock);
 
-    while (dcb != NULL)
+    for (DCB *dcb = server->dcbs; dcb; dcb = dcb->server_next)
     {
-        if (false == dcb->dcb_is_in_use)
-        {
-            dcb = dcb->next;
-            continue;
-        }
         spinlock_acquire(&dcb->dcb_initlock);
-        if (dcb->state == DCB_STATE_POLLING && dcb->server &&
-            strcmp(dcb->server->unique_name, server->unique_name) == 0)
+        if (dcb->state == DCB_STATE_POLLING)
         {
             poll_fake_hangup_event(dcb);
         }
         spinlock_release(&dcb->dcb_initlock);
-        dcb = dcb->next;
     }
-    spinlock_release(&dcbspin);
+    spinlock_release(&server->dcbs_lock);
 }
 
 
@@ -2912,59 +4844,67 @@ dcb_null_auth(DCB *dcb, SERVER *server, SESSION *session, GWBUF *buf)
 /**
  * Check persistent pool for expiry or excess size and count
  *
- * @param dcb           The DCB being closed.
- * @param cleanall      Boolean, if true the whole pool is cleared for the
- *                      server related to the given DCB
+ * All shards of the pool are checked. The DCBs that are removed are closed
+ * after the locks of the shards have been released.
+ *
+ * @param server        The server whose pool is checked
+ * @param cleanall      Boolean, if true the whole pool is cleared
  * @return              A count of the DCBs remaining in the pool
  */
 int
-dcb_persistent_clean_count(DCB *dcb, bool cleanall)
+dcb_persistent_clean_count(SERVER *server, bool cleanall)
 {
     int count = 0;
-    if (dcb && dcb->server)
+    if (server)
     {
-        SERVER *server = dcb->server;
-        DCB *previousdcb = NULL;
         DCB *persistentdcb, *nextdcb;
         DCB *disposals = NULL;
+        time_t now = time(NULL);
 
         CHK_SERVER(server);
-        spinlock_acquire(&server->persistlock);
-        persistentdcb = server->persistent;
-        while (persistentdcb)
-        {
-            CHK_DCB(persistentdcb);
-            nextdcb = persistentdcb->nextpersistent;
-            if (cleanall
-                || persistentdcb-> dcb_errhandle_called
-                || count >= server->persistpoolmax
-                || persistentdcb->server == NULL
-                || !(persistentdcb->server->status & SERVER_RUNNING)
-                || (time(NULL) - persistentdcb->persistentstart) > server->persistmaxtime)
-            {
-                /* Remove from persistent pool */
-                if (previousdcb)
+        for (int i = 0; i < SERVER_POOL_SHARDS; i++)
+        {
+            SERVER_POOL_SHARD *shard = &server->pool[i];
+            DCB *previousdcb = NULL;
+
+            spinlock_acquire(&shard->lock);
+            persistentdcb = shard->persistent;
+            while (persistentdcb)
+            {
+                CHK_DCB(persistentdcb);
+                nextdcb = persistentdcb->nextpersistent;
+                if (cleanall
+                    || persistentdcb-> dcb_errhandle_called
+                    || (persistentdcb->flags & DCBF_HUNG)
+                    || count >= server->persistpoolmax
+                    || persistentdcb->server == NULL
+                    || !(persistentdcb->server->status & SERVER_RUNNING)
+                    || (now - persistentdcb->persistentstart) > server->persistmaxtime)
                 {
-                    previousdcb->nextpersistent = nextdcb;
+                    /* Remove from persistent pool */
+                    if (previousdcb)
+                    {
+                        previousdcb->nextpersistent = nextdcb;
+                    }
+                    else
+                    {
+                        shard->persistent = nextdcb;
+                    }
+                    /* Add removed DCBs to disposal list for processing outside spinlock */
+                    persistentdcb->nextpersistent = disposals;
+                    disposals = persistentdcb;
+                    atomic_add(&server->stats.n_persistent, -1);
                 }
                 else
                 {
-                    server->persistent = nextdcb;
+                    count++;
+                    previousdcb = persistentdcb;
                 }
-                /* Add removed DCBs to disposal list for processing outside spinlock */
-                persistentdcb->nextpersistent = disposals;
-                disposals = persistentdcb;
-                atomic_add(&server->stats.n_persistent, -1);
-            }
-            else
-            {
-                count++;
-                previousdcb = persistentdcb;
+                persistentdcb = nextdcb;
             }
-            persistentdcb = nextdcb;
+            spinlock_release(&shard->lock);
         }
         server->persistmax = MAX(server->persistmax, count);
-        spinlock_release(&server->persistlock);
         /** Call possible callback for this DCB in case of close */
         while (disposals)
         {
@@ -2984,63 +4924,48 @@ dcb_persistent_clean_count(DCB *dcb, bool cleanall)
 /**
  * Return DCB counts optionally filtered by usage
  *
+ * The counts are maintained when the DCBs are allocated, freed and change
+ * state, so no DCBs are scanned.
+ *
  * @param       usage   The usage of the DCB
  * @return      A count of DCBs in the desired state
  */
 int
 dcb_count_by_usage(DCB_USAGE usage)
-{
-    int rval = 0;
-    DCB *dcb;
-
-    spinlock_acquire(&dcbspin);
-    dcb = allDCBs;
-    while (dcb)
-    {
-        if (dcb->dcb_is_in_use)
-        {
-            switch (usage)
-            {
-            case DCB_USAGE_CLIENT:
-                if (DCB_ROLE_CLIENT_HANDLER == dcb->dcb_role)
-                {
-                    rval++;
-                }
-                break;
-            case DCB_USAGE_LISTENER:
-                if (dcb->state == DCB_STATE_LISTENING)
-                {
-                    rval++;
-                }
-                break;
-            case DCB_USAGE_BACKEND:
-                if (dcb->dcb_role == DCB_ROLE_BACKEND_HANDLER)
-                {
-                    rval++;
-                }
-                break;
-            case DCB_USAGE_INTERNAL:
-                if (dcb->dcb_role == DCB_ROLE_CLIENT_HANDLER ||
-                    dcb->dcb_role == DCB_ROLE_BACKEND_HANDLER)
-                {
-                    rval++;
-                }
-                break;
-            case DCB_USAGE_ZOMBIE:
-                if (DCB_ISZOMBIE(dcb))
-                {
-                    rval++;
-                }
-                break;
-            case DCB_USAGE_ALL:
-                rval++;
-                break;
-            }
-        }
-        dcb = dcb->next;
+{
+    int clients = __atomic_load_n(&nclients, __ATOMIC_RELAXED);
+    int backends = __atomic_load_n(&nbackends, __ATOMIC_RELAXED);
+
+    switch (usage)
+    {
+    case DCB_USAGE_CLIENT:
+        return clients;
+    case DCB_USAGE_LISTENER:
+        return __atomic_load_n(&nlistening, __ATOMIC_RELAXED);
+    case DCB_USAGE_BACKEND:
+        return backends;
+    case DCB_USAGE_INTERNAL:
+        return clients + backends;
+    case DCB_USAGE_ZOMBIE:
+        return __atomic_load_n(&nzombies, __ATOMIC_RELAXED);
+    case DCB_USAGE_ALL:
+        return __atomic_load_n(&nDCBs, __ATOMIC_RELAXED);
     }
-    spinlock_release(&dcbspin);
-    return rval;
+    return 0;
+}
+
+/**
+ * Update the count of DCBs in the listening state
+ *
+ * Called by the polling code when a listener is added to or removed from
+ * the poll set.
+ *
+ * @param n     1 when a DCB starts listening, -1 when it stops
+ */
+void
+dcb_count_listening(int n)
+{
+    atomic_add(&nlistening, n);
 }
 
 /**
@@ -3068,6 +4993,54 @@ dcb_create_SSL(DCB* dcb, SSL_LISTENER *ssl)
     return 0;
 }
 
+/**
+ * Update the state of a connection whose SSL handshake has completed
+ *
+ * The handshake is counted as resumed or full. On a connection to a server, the
+ * session of a full handshake is kept so that the next connections can resume
+ * it. If the kernel took over the sending of the TLS records, the data is
+ * written to the socket without going through OpenSSL.
+ *
+ * @param dcb The DCB of the connection
+ * @param ssl The SSL configuration of the listener or the server
+ */
+static void
+dcb_SSL_established(DCB *dcb, SSL_LISTENER *ssl)
+{
+    if (SSL_session_reused(dcb->ssl))
+    {
+        atomic_add(&ssl->n_resumed, 1);
+    }
+    else
+    {
+        atomic_add(&ssl->n_full_handshakes, 1);
+
+        if (dcb->dcb_role == DCB_ROLE_BACKEND_HANDLER)
+        {
+            SSL_SESSION *session = SSL_get1_session(dcb->ssl);
+            SSL_SESSION *old;
+
+            spinlock_acquire(&ssl->session_lock);
+            old = ssl->client_session;
+            ssl->client_session = session;
+            spinlock_release(&ssl->session_lock);
+
+            if (old)
+            {
+                SSL_SESSION_free(old);
+            }
+        }
+    }
+
+#ifdef SSL_OP_ENABLE_KTLS
+    if (ssl->ssl_ktls && BIO_get_ktls_send(SSL_get_wbio(dcb->ssl)))
+    {
+        MXS_INFO("Kernel TLS is used for sending to %s.", dcb->remote ? dcb->remote : "");
+        dcb->ssl_ktls_send = true;
+    }
+#endif
+}
+
 /**
  * Accept a SSL connection and do the SSL authentication handshake.
  * This function accepts a client connection to a DCB. It assumes that the SSL
@@ -3102,6 +5075,7 @@ int dcb_accept_SSL(DCB* dcb)
             MXS_DEBUG("SSL_accept done for %s@%s", user, remote);
             dcb->ssl_state = SSL_ESTABLISHED;
             dcb->ssl_read_want_write = false;
+            dcb_SSL_established(dcb, dcb->listener->ssl);
             return 1;
 
         case SSL_ERROR_WANT_READ:
@@ -3162,12 +5136,29 @@ int dcb_connect_SSL(DCB* dcb)
     int ssl_rval;
     int return_code;
 
-    if ((NULL == dcb->server || NULL == dcb->server->server_ssl) ||
-        (NULL == dcb->ssl && dcb_create_SSL(dcb, dcb->server->server_ssl) != 0))
+    if (NULL == dcb->server || NULL == dcb->server->server_ssl)
     {
         ss_dassert((NULL != dcb->server) && (NULL != dcb->server->server_ssl));
         return -1;
     }
+
+    if (NULL == dcb->ssl)
+    {
+        SSL_LISTENER *ssl = dcb->server->server_ssl;
+
+        if (dcb_create_SSL(dcb, ssl) != 0)
+        {
+            return -1;
+        }
+
+        /** Offer the session of an earlier connection for an abbreviated handshake */
+        spinlock_acquire(&ssl->session_lock);
+        if (ssl->client_session)
+        {
+            SSL_set_session(dcb->ssl, ssl->client_session);
+        }
+        spinlock_release(&ssl->session_lock);
+    }
     dcb->ssl_state = SSL_HANDSHAKE_REQUIRED;
     ssl_rval = SSL_connect(dcb->ssl);
     switch (SSL_get_error(dcb->ssl, ssl_rval))
@@ -3176,6 +5167,7 @@ int dcb_connect_SSL(DCB* dcb)
             MXS_DEBUG("SSL_connect done for %s", dcb->remote);
             dcb->ssl_state = SSL_ESTABLISHED;
             dcb->ssl_read_want_write = false;
+            dcb_SSL_established(dcb, dcb->server->server_ssl);
             return_code = 1;
             break;
 
@@ -3230,6 +5222,146 @@ int dcb_connect_SSL(DCB* dcb)
     return return_code;
 }
 
+/**
+ * @brief Queue a client connection that is over the connection limit
+ *
+ * The connection is queued in the priority class of its listener. It waits
+ * until a client of the service closes its connection or until the queue
+ * timeout of the service expires.
+ *
+ * @param client_dcb The new client DCB
+ * @return True if the connection was queued
+ */
+static bool
+dcb_queue_connection(DCB *client_dcb)
+{
+    SERVICE *service = client_dcb->service;
+    QUEUE_CONFIG *queue = service->queued_connections;
+    int priority = client_dcb->listener ? client_dcb->listener->priority : QUEUE_PRIORITY_NORMAL;
+
+    if (queue == NULL)
+    {
+        return false;
+    }
+
+    if (!mxs_enqueue(queue, client_dcb, priority))
+    {
+        metric_add(service->queue_rejected, 1);
+        return false;
+    }
+
+    metric_add(service->queue_length, 1);
+    service_queue_expires_at(mxs_queue_now() + queue->timeout);
+
+    /** There may be room if a queued connection failed before it was accepted */
+    dcb_admit_queued(service);
+    return true;
+}
+
+/**
+ * @brief Admit queued client connections of a service
+ *
+ * The queued connections that have waited for longer than the queue timeout
+ * are rejected with the connection limit error. Then, for as long as there is
+ * room under max_connections, the next queued connection is handed to its
+ * listener and a read event is faked for the listener. The protocol module
+ * of the listener then gets the connection from dcb_accept as if it were new.
+ *
+ * This is called whenever a client of the service closes its connection.
+ *
+ * @param service The service
+ */
+void
+dcb_admit_queued(SERVICE *service)
+{
+    QUEUE_CONFIG *queue = service->queued_connections;
+
+    if (queue == NULL || mxs_queue_count(queue) == 0)
+    {
+        return;
+    }
+
+    uint64_t now = mxs_queue_now();
+    QUEUE_ENTRY entry;
+
+    while (mxs_dequeue_expired(queue, now, &entry))
+    {
+        DCB *dcb = (DCB *)entry.queued_object;
+
+        metric_add(service->queue_length, -1);
+        metric_add(service->queue_expired, 1);
+        metric_observe(service->queue_wait, now - entry.queued_at);
+        MXS_INFO("Connection from %s to service '%s' waited for %lu ms in the "
+                 "queue, rejecting it.", dcb->remote ? dcb->remote : "<unknown>",
+                 service->name, now - entry.queued_at);
+
+        if (dcb->func.connlimit)
+        {
+            dcb->func.connlimit(dcb, service->max_connections);
+        }
+        dcb_close(dcb);
+    }
+
+    while (service->client_count + service->n_admitting < service->max_connections &&
+           mxs_dequeue(queue, now, &entry))
+    {
+        DCB *dcb = (DCB *)entry.queued_object;
+        SERV_LISTENER *port = dcb->listener;
+
+        metric_add(service->queue_length, -1);
+        metric_observe(service->queue_wait, now - entry.queued_at);
+
+        if (port == NULL || port->listener == NULL)
+        {
+            /** The listener is gone, there is nobody to accept the connection */
+            metric_add(service->queue_expired, 1);
+            dcb_close(dcb);
+            continue;
+        }
+
+        metric_add(service->queue_admitted, 1);
+        atomic_add(&service->n_admitting, 1);
+
+        spinlock_acquire(&port->admit_lock);
+        DCB **tail = &port->admitted;
+        while (*tail)
+        {
+            tail = &(*tail)->admit_next;
+        }
+        dcb->admit_next = NULL;
+        *tail = dcb;
+        spinlock_release(&port->admit_lock);
+
+        poll_fake_read_event(port->listener);
+    }
+}
+
+/**
+ * @brief Take the first admitted queued connection of a listener
+ *
+ * @param port The listener
+ * @return The client DCB or NULL if there are no admitted connections
+ */
+static DCB *
+dcb_take_admitted(SERV_LISTENER *port)
+{
+    spinlock_acquire(&port->admit_lock);
+    DCB *dcb = port->admitted;
+    if (dcb)
+    {
+        port->admitted = dcb->admit_next;
+        dcb->admit_next = NULL;
+    }
+    spinlock_release(&port->admit_lock);
+
+    if (dcb)
+    {
+        atomic_add(&dcb->service->n_admitting, -1);
+    }
+
+    return dcb;
+}
+
 /**
  * @brief Accept a new client connection, given a listener, return new DCB
  *
@@ -3239,6 +5371,14 @@ int dcb_connect_SSL(DCB* dcb)
  * are set before returning the new DCB to the caller, or returning NULL if
  * no new connection could be achieved.
  *
+ * The protocol modules call this until it returns NULL. Once the listener has
+ * accepted accept_budget connections in one event, NULL is returned and a
+ * fake read event is queued for the listener so that the remaining
+ * connections are accepted after the other pending events.
+ *
+ * Queued connections that have been admitted by dcb_admit_queued are
+ * returned before any new connections are accepted.
+ *
  * @param dcb Listener DCB that has detected new connection request
  * @return DCB - The new client DCB for the new connection, or NULL if failed
  */
@@ -3252,8 +5392,26 @@ dcb_accept(DCB *listener, GWPROTOCOL *protocol_funcs)
     socklen_t optlen = sizeof(sendbuf);
     char errbuf[STRERROR_BUFLEN];
 
-    if ((c_sock = dcb_accept_one_connection(listener, (struct sockaddr *)&client_conn)) >= 0)
+    if (listener->listener && listener->listener->admitted &&
+        (client_dcb = dcb_take_admitted(listener->listener)) != NULL)
+    {
+        return client_dcb;
+    }
+
+    if (accept_budget && listener->n_accepted >= accept_budget)
+    {
+        listener->n_accepted = 0;
+        poll_fake_read_event(listener);
+        return NULL;
+    }
+
+    if ((c_sock = dcb_accept_one_connection(listener, (struct sockaddr *)&client_conn)) < 0)
+    {
+        listener->n_accepted = 0;
+    }
+    else
     {
+        listener->n_accepted++;
         listener->stats.n_accepts++;
 #if defined(SS_DEBUG)
         MXS_DEBUG("%lu [gw_MySQLAccept] Accepted fd %d.",
@@ -3263,23 +5421,32 @@ dcb_accept(DCB *listener, GWPROTOCOL *protocol_funcs)
 #if defined(FAKE_CODE)
         conn_open[c_sock] = true;
 #endif /* FAKE_CODE */
-        /* set nonblocking  */
-        sendbuf = GW_CLIENT_SO_SNDBUF;
-
-        if (setsockopt(c_sock, SOL_SOCKET, SO_SNDBUF, &sendbuf, optlen) != 0)
+        /**
+         * A TCP socket inherits the buffer sizes and TCP_NODELAY from the
+         * listener, a Unix domain socket does not.
+         */
+        if (client_conn.ss_family == AF_UNIX)
         {
-            MXS_ERROR("Failed to set socket options. Error %d: %s",
-                      errno, strerror_r(errno, errbuf, sizeof(errbuf)));
-        }
+            sendbuf = GW_CLIENT_SO_SNDBUF;
 
-        sendbuf = GW_CLIENT_SO_RCVBUF;
+            if (setsockopt(c_sock, SOL_SOCKET, SO_SNDBUF, &sendbuf, optlen) != 0)
+            {
+                MXS_ERROR("Failed to set socket options. Error %d: %s",
+                          errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+            }
 
-        if (setsockopt(c_sock, SOL_SOCKET, SO_RCVBUF, &sendbuf, optlen) != 0)
-        {
-            MXS_ERROR("Failed to set socket options. Error %d: %s",
-                      errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+            sendbuf = GW_CLIENT_SO_RCVBUF;
+
+            if (setsockopt(c_sock, SOL_SOCKET, SO_RCVBUF, &sendbuf, optlen) != 0)
+            {
+                MXS_ERROR("Failed to set socket options. Error %d: %s",
+                          errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+            }
         }
+#if !defined(SOCK_NONBLOCK)
+        /* set nonblocking  */
         setnonblocking(c_sock);
+#endif
 
         client_dcb = dcb_alloc(DCB_ROLE_CLIENT_HANDLER, listener->listener);
 
@@ -3295,8 +5462,16 @@ dcb_accept(DCB *listener, GWPROTOCOL *protocol_funcs)
 
             client_dcb->service = listener->session->service;
             client_dcb->session = session_set_dummy(client_dcb);
+            client_dcb->high_water = writeq_high_water;
+            client_dcb->low_water = writeq_low_water;
             client_dcb->fd = c_sock;
 
+            if (listener->flags & DCBF_REUSEPORT)
+            {
+                /** The connection stays on the thread whose socket accepted it */
+                client_dcb->owner = listener->owner;
+            }
+
             // get client address
             if (((struct sockaddr *)&client_conn)->sa_family == AF_UNIX)
             {
@@ -3345,14 +5520,18 @@ dcb_accept(DCB *listener, GWPROTOCOL *protocol_funcs)
                 }
             }
             memcpy(&(client_dcb->authfunc), authfuncs, sizeof(GWAUTHENTICATOR));
-            if (client_dcb->service->max_connections &&
-                client_dcb->service->client_count >= client_dcb->service->max_connections)
+            SERVICE *service = client_dcb->service;
+
+            if (service->max_connections &&
+                (service->client_count + service->n_admitting >= service->max_connections ||
+                 (service->queued_connections && mxs_queue_count(service->queued_connections) > 0)))
             {
-                if (!mxs_enqueue(client_dcb->service->queued_connections, client_dcb))
+                /** Connections that are already waiting are served first */
+                if (!dcb_queue_connection(client_dcb))
                 {
                     if (client_dcb->func.connlimit)
                     {
-                        client_dcb->func.connlimit(client_dcb, client_dcb->service->max_connections);
+                        client_dcb->func.connlimit(client_dcb, service->max_connections);
                     }
                     dcb_close(client_dcb);
                 }
@@ -3368,7 +5547,8 @@ dcb_accept(DCB *listener, GWPROTOCOL *protocol_funcs)
  *
  * Up to 10 retries will be attempted in case of non-permanent errors.  Calls
  * the accept function and analyses the return, logging any errors and making
- * an appropriate return.
+ * an appropriate return. Where accept4 is available, the new socket is made
+ * non-blocking and close-on-exec by the same system call.
  *
  * @param dcb Listener DCB that has detected new connection request
  * @return -1 for failure, or a file descriptor for the new connection
@@ -3397,9 +5577,16 @@ dcb_accept_one_connection(DCB *listener, struct sockaddr *client_conn)
 #endif /* FAKE_CODE */
 
             /* new connection from client */
+#if defined(SOCK_NONBLOCK)
+            c_sock = accept4(listener->fd,
+                             client_conn,
+                             &client_len,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
             c_sock = accept(listener->fd,
                             client_conn,
                             &client_len);
+#endif
             eno = errno;
             errno = 0;
 #if defined(FAKE_CODE)
@@ -3483,15 +5670,85 @@ int
 dcb_listen(DCB *listener, const char *config, const char *protocol_name)
 {
     int listener_socket;
+    bool reuseport = config_reuseport() &&
+        config_poll_mode() == POLL_MODE_PER_THREAD &&
+        config_threadcount() > 1 &&
+        strchr(config, '/') == NULL;
 
     listener->fd = -1;
+    if ((listener_socket = dcb_listen_socket(config, protocol_name, reuseport)) < 0)
+    {
+        return -1;
+    }
+
+    MXS_NOTICE("Listening connections at %s with protocol %s", config, protocol_name);
+
+    // assign listener_socket to dcb
+    listener->fd = listener_socket;
+
+    if (reuseport)
+    {
+        /** The first socket belongs to the first thread, the others get their own */
+        listener->owner = 0;
+        listener->flags |= DCBF_REUSEPORT;
+        poll_set_socket_incoming_cpu(listener_socket, 0);
+    }
+
+    // add listening socket to poll structure
+    if (poll_add_dcb(listener) != 0)
+    {
+        MXS_ERROR("MaxScale encountered system limit while "
+                  "attempting to register on an epoll instance.");
+        return -1;
+    }
+#if defined(FAKE_CODE)
+    conn_open[listener_socket] = true;
+#endif /* FAKE_CODE */
+
+    if (reuseport)
+    {
+        dcb_listen_per_thread(listener, config, protocol_name);
+    }
+    return 0;
+}
+
+/**
+ * @brief Give the session of a listener to its other SO_REUSEPORT listeners
+ *
+ * Only the first listener holds a reference to the session, the others are
+ * closed together with it.
+ *
+ * @param listener The listener DCB whose session has been created
+ */
+void
+dcb_listener_set_session(DCB *listener)
+{
+    for (DCB *dcb = listener->nextlistener; dcb; dcb = dcb->nextlistener)
+    {
+        dcb->session = listener->session;
+    }
+}
+
+/**
+ * @brief Create a socket and start listening on it
+ *
+ * @param config Configuration for port to listen on
+ * @param protocol_name Name of protocol that is listening
+ * @param reuseport Whether other sockets may listen on the same port
+ * @return The listening socket or -1 on error
+ */
+static int
+dcb_listen_socket(const char *config, const char *protocol_name, bool reuseport)
+{
+    int listener_socket;
+
     if (strchr(config, '/'))
     {
         listener_socket = dcb_listen_create_socket_unix(config);
     }
     else
     {
-        listener_socket = dcb_listen_create_socket_inet(config);
+        listener_socket = dcb_listen_create_socket_inet(config, reuseport);
     }
     if (listener_socket < 0)
     {
@@ -3516,40 +5773,89 @@ dcb_listen(DCB *listener, const char *config, const char *protocol_name)
         close(listener_socket);
         return -1;
     }
+    return listener_socket;
+}
 
-    MXS_NOTICE("Listening connections at %s with protocol %s", config, protocol_name);
-
-    // assign listener_socket to dcb
-    listener->fd = listener_socket;
+/**
+ * @brief Open a SO_REUSEPORT listener for each of the other threads
+ *
+ * The kernel spreads the new connections of the port between the sockets and
+ * each socket is polled only by its own thread, so a connection is accepted
+ * and then handled by the same thread. The extra listener DCBs are linked
+ * to the first one and share its protocol functions. They also share its
+ * session once it has been created, see dcb_listener_set_session. If a
+ * socket can not be opened, the threads that already have one accept all the
+ * connections.
+ *
+ * @param listener The listener DCB of the first thread
+ * @param config Configuration for port to listen on
+ * @param protocol_name Name of protocol that is listening
+ */
+static void
+dcb_listen_per_thread(DCB *listener, const char *config, const char *protocol_name)
+{
+    int n_threads = config_threadcount();
+    DCB *last = listener;
 
-    // add listening socket to poll structure
-    if (poll_add_dcb(listener) != 0)
+    for (int i = 1; i < n_threads; i++)
     {
-        MXS_ERROR("MaxScale encountered system limit while "
-                  "attempting to register on an epoll instance.");
-        return -1;
-    }
+        DCB *dcb;
+        int listener_socket;
+
+        if ((dcb = dcb_alloc(DCB_ROLE_SERVICE_LISTENER, listener->listener)) == NULL)
+        {
+            break;
+        }
+
+        if ((listener_socket = dcb_listen_socket(config, protocol_name, true)) < 0)
+        {
+            dcb_close(dcb);
+            break;
+        }
+
+        memcpy(&dcb->func, &listener->func, sizeof(GWPROTOCOL));
+        dcb->service = listener->service;
+        dcb->fd = listener_socket;
+        dcb->owner = i;
+        dcb->flags |= DCBF_REUSEPORT;
+        poll_set_socket_incoming_cpu(listener_socket, i);
+
+        if (poll_add_dcb(dcb) != 0)
+        {
+            MXS_ERROR("MaxScale encountered system limit while "
+                      "attempting to register on an epoll instance.");
+            close(listener_socket);
+            dcb->fd = DCBFD_CLOSED;
+            dcb_close(dcb);
+            break;
+        }
 #if defined(FAKE_CODE)
-    conn_open[listener_socket] = true;
+        conn_open[listener_socket] = true;
 #endif /* FAKE_CODE */
-    return 0;
+        last->nextlistener = dcb;
+        last = dcb;
+    }
 }
 
 /**
  * @brief Create a listening socket, TCP
  *
  * Parse the configuration provided and if valid create a socket.
- * Set options, set non-blocking and bind to the socket.
+ * Set options, set non-blocking and bind to the socket. The buffer sizes of
+ * the client connections are set here as the accepted sockets inherit them.
  *
  * @param config_bind The configuration information
+ * @param reuseport Whether to set SO_REUSEPORT on the socket
  * @return socket if successful, -1 otherwise
  */
 static int
-dcb_listen_create_socket_inet(const char *config_bind)
+dcb_listen_create_socket_inet(const char *config_bind, bool reuseport)
 {
     int listener_socket;
     struct sockaddr_in server_address;
     int one = 1;
+    int sndbuf = GW_CLIENT_SO_SNDBUF;
+    int rcvbuf = GW_CLIENT_SO_RCVBUF;
 
     memset(&server_address, 0, sizeof(server_address));
     if (!parse_bindconfig(config_bind, &server_address))
@@ -3570,11 +5876,25 @@ dcb_listen_create_socket_inet(const char *config_bind)
 
     // socket options
     if (dcb_set_socket_option(listener_socket, SOL_SOCKET, SO_REUSEADDR, (char *) &one, sizeof(one)) != 0 ||
-        dcb_set_socket_option(listener_socket, IPPROTO_TCP, TCP_NODELAY, (char *) &one, sizeof(one)) != 0)
+        dcb_set_socket_option(listener_socket, IPPROTO_TCP, TCP_NODELAY, (char *) &one, sizeof(one)) != 0 ||
+        dcb_set_socket_option(listener_socket, SOL_SOCKET, SO_SNDBUF, (char *) &sndbuf, sizeof(sndbuf)) != 0 ||
+        dcb_set_socket_option(listener_socket, SOL_SOCKET, SO_RCVBUF, (char *) &rcvbuf, sizeof(rcvbuf)) != 0)
     {
         return -1;
     }
 
+#ifdef SO_REUSEPORT
+    if (reuseport &&
+        dcb_set_socket_option(listener_socket, SOL_SOCKET, SO_REUSEPORT, (char *) &one, sizeof(one)) != 0)
+    {
+        close(listener_socket);
+        return -1;
+    }
+#endif
+
+    /** The accepted sockets inherit the busy poll time */
+    poll_set_socket_busy_poll(listener_socket);
+
     // set NONBLOCKING mode
     if (setnonblocking(listener_socket) != 0)
     {
@@ -3758,3 +6078,43 @@ void dcb_append_readqueue(DCB *dcb, GWBUF *buffer)
     dcb->dcb_readqueue = gwbuf_append(dcb->dcb_readqueue, buffer);
     spinlock_release(&dcb->authlock);
 }
+
+/**
+ * Print the socket I/O statistics of all DCBs
+ *
+ * The bytes per system call show how well reads and writes are batched.
+ *
+ * @param pdcb  The DCB to print the statistics to
+ */
+void
+dShowIOStats(DCB *pdcb)
+{
+    int64_t stats[DCB_IO_N_STATS] = {0};
+
+    for (int i = 0; i < DCB_IO_N_STATS; i++)
+    {
+        if (io_stats[i])
+        {
+            stats[i] = ts_stats_sum(io_stats[i]);
+        }
+    }
+
+    dcb_printf(pdcb, "Socket I/O statistics.\n");
+    dcb_printf(pdcb, "Read system calls:              %" PRId64 "\n", stats[DCB_IO_READ_CALLS]);
+    dcb_printf(pdcb, "Bytes read:                     %" PRId64 "\n", stats[DCB_IO_READ_BYTES]);
+    dcb_printf(pdcb, "Bytes per read call:            %" PRId64 "\n",
+               stats[DCB_IO_READ_CALLS] ? stats[DCB_IO_READ_BYTES] / stats[DCB_IO_READ_CALLS] : 0);
+    dcb_printf(pdcb, "Write system calls:             %" PRId64 "\n", stats[DCB_IO_WRITE_CALLS]);
+    dcb_printf(pdcb, "Bytes written:                  %" PRId64 "\n", stats[DCB_IO_WRITE_BYTES]);
+    dcb_printf(pdcb, "Bytes per write call:           %" PRId64 "\n",
+               stats[DCB_IO_WRITE_CALLS] ? stats[DCB_IO_WRITE_BYTES] / stats[DCB_IO_WRITE_CALLS] : 0);
+    dcb_printf(pdcb, "Buffers per write call:         %" PRId64 "\n",
+               stats[DCB_IO_WRITE_CALLS] ? stats[DCB_IO_WRITE_BUFFERS] / stats[DCB_IO_WRITE_CALLS] : 0);
+
+    if (use_io_uring)
+    {
+        dcb_printf(pdcb, "io_uring system calls:          %" PRId64 "\n", stats[DCB_IO_URING_CALLS]);
+        dcb_printf(pdcb, "Reads through io_uring:         %" PRId64 "\n", stats[DCB_IO_URING_READS]);
+        dcb_printf(pdcb, "Writes through io_uring:        %" PRId64 "\n", stats[DCB_IO_URING_WRITES]);
+    }
+}
@@ -12,6 +12,27 @@
  */
 
 #include <externcmd.h>
+#include <spawn.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <sys/wait.h>
+#include <spinlock.h>
+#include <thread.h>
+
+/** Seconds a timed out command has to exit after SIGTERM before it is sent SIGKILL */
+#define EXTERNCMD_KILL_GRACE 5
+
+extern char **environ;
+
+/**
+ * The commands started with externcmd_start that have not exited yet. The
+ * children are reaped by the reaper thread which is woken up by SIGCHLD and
+ * once a second to check the timeouts.
+ */
+static SPINLOCK running_lock = SPINLOCK_INIT;
+static EXTERNCMD *running = NULL;
+static sem_t reaper_sem;
+static volatile int reaper_started = 0;
 
 /**
  * Tokenize a string into arguments suitable for a execvp call.
@@ -104,6 +125,14 @@ EXTERNCMD* externcmd_allocate(char* argstr)
     if (argstr && cmd && argv)
     {
         cmd->argv = argv;
+        cmd->n_exec = 0;
+        cmd->child = -1;
+        cmd->timeout = 0;
+        cmd->started = 0;
+        cmd->killed = 0;
+        cmd->callback = NULL;
+        cmd->data = NULL;
+        cmd->next = NULL;
         if (tokenize_arguments(argstr, cmd->argv) == 0)
         {
             if (access(cmd->argv[0], X_OK) != 0)
@@ -158,37 +187,253 @@ void externcmd_free(EXTERNCMD* cmd)
 }
 
 /**
- *Execute a command in a separate process.
- *@param cmd Command to execute
- *@return 0 on success, -1 on error.
+ * Log how a child process exited
+ * @param pid The child process
+ * @param status Status returned by waitpid
  */
-int externcmd_execute(EXTERNCMD* cmd)
+static void externcmd_log_status(pid_t pid, int status)
 {
-    int rval = 0;
-    pid_t pid;
+    if (WIFEXITED(status))
+    {
+        if (WEXITSTATUS(status) != 0)
+        {
+            MXS_ERROR("Child process %d exited with status %d",
+                      pid, WEXITSTATUS(status));
+        }
+        else
+        {
+            MXS_INFO("Child process %d exited with status %d",
+                     pid, WEXITSTATUS(status));
+        }
+    }
+    else if (WIFSIGNALED(status))
+    {
+        MXS_ERROR("Child process %d was stopped by signal %d.",
+                  pid, WTERMSIG(status));
+    }
+    else
+    {
+        MXS_ERROR("Child process %d did not exit normally. Exit status: %d",
+                  pid, status);
+    }
+}
 
-    pid = fork();
+/**
+ * Remove a running command from the list
+ * @param pid The child process of the command
+ * @return The command or NULL if the child was not started by externcmd_start
+ */
+static EXTERNCMD* externcmd_remove_running(pid_t pid)
+{
+    EXTERNCMD *cmd = NULL;
+
+    spinlock_acquire(&running_lock);
 
-    if (pid < 0)
+    for (EXTERNCMD **prev = &running; *prev; prev = &(*prev)->next)
     {
-        char errbuf[STRERROR_BUFLEN];
-        MXS_ERROR("Failed to execute command '%s', fork failed: [%d] %s",
-                  cmd->argv[0], errno, strerror_r(errno, errbuf, sizeof(errbuf)));
-        rval = -1;
+        if ((*prev)->child == pid)
+        {
+            cmd = *prev;
+            *prev = cmd->next;
+            cmd->next = NULL;
+            break;
+        }
     }
-    else if (pid == 0)
+
+    spinlock_release(&running_lock);
+
+    return cmd;
+}
+
+/**
+ * Terminate the running commands that have exceeded their timeout
+ * @param now The current time
+ */
+static void externcmd_check_timeouts(time_t now)
+{
+    spinlock_acquire(&running_lock);
+
+    for (EXTERNCMD *cmd = running; cmd; cmd = cmd->next)
     {
-        /** Child process, execute command */
-        execvp(cmd->argv[0], cmd->argv);
-        _exit(1);
+        if (cmd->killed == 0 && cmd->timeout > 0 && now - cmd->started >= cmd->timeout)
+        {
+            MXS_WARNING("Command '%s' (pid %d) has been running for more than %d seconds, "
+                        "terminating it.", cmd->argv[0], cmd->child, cmd->timeout);
+            kill(cmd->child, SIGTERM);
+            cmd->killed = now;
+        }
+        else if (cmd->killed && now - cmd->killed >= EXTERNCMD_KILL_GRACE)
+        {
+            kill(cmd->child, SIGKILL);
+        }
     }
-    else
+
+    spinlock_release(&running_lock);
+}
+
+/**
+ * The thread that reaps the child processes and calls the completion callbacks
+ */
+static void externcmd_reaper(void *data)
+{
+    while (true)
     {
-        cmd->child = pid;
-        cmd->n_exec++;
-        MXS_DEBUG("[monitor_exec_cmd] Forked child process %d : %s.", pid, cmd->argv[0]);
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += 1;
+        sem_timedwait(&reaper_sem, &ts);
+
+        int status;
+        pid_t pid;
+
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        {
+            EXTERNCMD *cmd = externcmd_remove_running(pid);
+
+            if (cmd)
+            {
+                if (cmd->callback)
+                {
+                    cmd->callback(cmd, status, cmd->data);
+                }
+                else
+                {
+                    externcmd_log_status(pid, status);
+                }
+                externcmd_free(cmd);
+            }
+            else
+            {
+                externcmd_log_status(pid, status);
+            }
+        }
+
+        externcmd_check_timeouts(time(NULL));
+    }
+}
+
+/**
+ * Start the reaper thread if it is not yet running
+ */
+static void externcmd_start_reaper()
+{
+    static SPINLOCK lock = SPINLOCK_INIT;
+
+    spinlock_acquire(&lock);
+
+    if (!reaper_started)
+    {
+        THREAD thr;
+        sem_init(&reaper_sem, 0, 0);
+
+        if (thread_start(&thr, externcmd_reaper, NULL) == NULL)
+        {
+            MXS_ERROR("Failed to start the thread that waits for external commands.");
+        }
+        reaper_started = 1;
     }
 
+    spinlock_release(&lock);
+}
+
+/**
+ * Wake up the reaper thread, called by the SIGCHLD handler
+ */
+void externcmd_sigchld()
+{
+    if (reaper_started)
+    {
+        sem_post(&reaper_sem);
+    }
+}
+
+/**
+ * Spawn the process of a command. The process starts with an empty signal mask
+ * and with the default action for SIGPIPE.
+ * @param cmd Command to execute
+ * @return 0 on success, -1 on error.
+ */
+static int externcmd_spawn(EXTERNCMD* cmd)
+{
+    posix_spawnattr_t attr;
+    sigset_t sigs;
+    pid_t pid;
+    int rc = posix_spawnattr_init(&attr);
+
+    if (rc == 0)
+    {
+        sigemptyset(&sigs);
+        posix_spawnattr_setsigmask(&attr, &sigs);
+        sigaddset(&sigs, SIGPIPE);
+        posix_spawnattr_setsigdefault(&attr, &sigs);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+        rc = posix_spawnp(&pid, cmd->argv[0], NULL, &attr, cmd->argv, environ);
+        posix_spawnattr_destroy(&attr);
+    }
+
+    if (rc != 0)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("Failed to execute command '%s': [%d] %s",
+                  cmd->argv[0], rc, strerror_r(rc, errbuf, sizeof(errbuf)));
+        return -1;
+    }
+
+    cmd->child = pid;
+    cmd->n_exec++;
+    MXS_DEBUG("Spawned child process %d : %s.", pid, cmd->argv[0]);
+
+    return 0;
+}
+
+/**
+ *Execute a command in a separate process. The function does not wait for the
+ *command, its exit status is logged when it exits.
+ *@param cmd Command to execute
+ *@return 0 on success, -1 on error.
+ */
+int externcmd_execute(EXTERNCMD* cmd)
+{
+    externcmd_start_reaper();
+    return externcmd_spawn(cmd);
+}
+
+/**
+ * Execute a command in a separate process and call a function when it exits.
+ *
+ * On success the command is owned by the reaper thread, which calls the
+ * callback and then frees the command. On failure the caller still owns it.
+ * @param cmd Command to execute
+ * @param timeout Seconds after which the command is terminated, 0 for no limit
+ * @param callback Function called when the command exits or NULL to only log
+ * the exit status
+ * @param data Data passed to the callback
+ * @return True if the command was started
+ */
+bool externcmd_start(EXTERNCMD* cmd, int timeout, EXTERNCMD_CB callback, void *data)
+{
+    externcmd_start_reaper();
+
+    cmd->timeout = timeout;
+    cmd->started = time(NULL);
+    cmd->killed = 0;
+    cmd->callback = callback;
+    cmd->data = data;
+
+    /** The lock is held while spawning so that the child is listed before it can be reaped */
+    spinlock_acquire(&running_lock);
+
+    bool rval = externcmd_spawn(cmd) == 0;
+
+    if (rval)
+    {
+        cmd->next = running;
+        running = cmd;
+    }
+
+    spinlock_release(&running_lock);
+
     return rval;
 }
 
@@ -32,6 +32,7 @@
 #include <spinlock.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
+#include <mysql_client_server_protocol.h>
 
 static SPINLOCK filter_spin = SPINLOCK_INIT;    /**< Protects the list of all filters */
 static FILTER_DEF *allFilters = NULL;           /**< The list of all filters */
@@ -452,7 +453,8 @@ filterUpstream(FILTER_DEF *filter, void *fsession, UPSTREAM *upstream)
      * The the filter has no setUpstream entry point then is does
      * not require to see results and can be left out of the chain.
      */
-    if (filter->obj->setUpstream == NULL)
+    if (filter->obj->setUpstream == NULL ||
+        !(filterInterest(filter) & FILTER_INTEREST_REPLIES))
     {
         return upstream;
     }
@@ -470,3 +472,55 @@ filterUpstream(FILTER_DEF *filter, void *fsession, UPSTREAM *upstream)
     }
     return me;
 }
+
+/**
+ * Get the classes of packets a filter instance is interested in
+ *
+ * @param filter        The filter
+ * @return              The FILTER_INTEREST_* bits of the filter
+ */
+uint32_t
+filterInterest(FILTER_DEF *filter)
+{
+    if (filter->obj->getInterest == NULL)
+    {
+        return FILTER_INTEREST_ALL;
+    }
+    return filter->obj->getInterest(filter->filter);
+}
+
+/**
+ * Get the class of a client packet
+ *
+ * @param queue         The client packet
+ * @return              The class of the packet
+ */
+filter_class_t
+filter_packet_class(GWBUF *queue)
+{
+    uint8_t cmd;
+
+    if (GWBUF_LENGTH(queue) > MYSQL_HEADER_LEN)
+    {
+        cmd = ((uint8_t *)GWBUF_DATA(queue))[MYSQL_HEADER_LEN];
+    }
+    else if (gwbuf_copy_data(queue, MYSQL_HEADER_LEN, 1, &cmd) != 1)
+    {
+        return FILTER_CLASS_OTHER;
+    }
+
+    switch (cmd)
+    {
+    case MYSQL_COM_QUERY:
+        return FILTER_CLASS_QUERY;
+
+    case MYSQL_COM_STMT_PREPARE:
+        return FILTER_CLASS_PREPARE;
+
+    case MYSQL_COM_INIT_DB:
+        return FILTER_CLASS_INIT_DB;
+
+    default:
+        return FILTER_CLASS_OTHER;
+    }
+}
@@ -0,0 +1,455 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file fingerprint.c SQL statement fingerprints
+ *
+ * The statement is split into tokens by a small lexer that knows the MySQL
+ * quoting and comment rules. Each token is written to the fingerprint as it
+ * is found, the only look-back is the last byte written and the state of an
+ * IN list, so the fingerprint is produced in one pass.
+ */
+
+#include <fingerprint.h>
+#include <stdbool.h>
+#include <scan.h>
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME        1099511628211ULL
+
+/** Where the lexer is in an IN list */
+typedef enum
+{
+    IN_NONE,    /*< Not in an IN list */
+    IN_KEYWORD, /*< After the IN keyword */
+    IN_OPEN,    /*< After the opening parenthesis */
+    IN_VALUE,   /*< After a literal of the list */
+    IN_COMMA    /*< After a comma between literals */
+} in_state_t;
+
+typedef enum
+{
+    TOKEN_WORD,     /*< A keyword or a name, written in lower case */
+    TOKEN_QUOTED,   /*< A name in backticks, written as is */
+    TOKEN_LITERAL,  /*< A literal value, written as ? */
+    TOKEN_PUNCT     /*< Anything else, a single byte */
+} token_type_t;
+
+/** The fingerprint being written */
+typedef struct
+{
+    char      *dest;    /*< Output buffer, may be NULL */
+    size_t     size;    /*< Size of the output buffer */
+    size_t     len;     /*< Length of the whole fingerprint */
+    uint64_t   hash;    /*< FNV-1a hash of the whole fingerprint */
+    char       last;    /*< Last byte written, 0 at the start */
+    in_state_t in;      /*< IN list state */
+} fingerprint_t;
+
+/**
+ * Check whether a byte can be a part of a word. Two tokens that start and end
+ * with such bytes are separated with a space.
+ */
+static inline bool is_word_byte(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           c == '_' || c == '$' || (unsigned char)c >= 0x80;
+}
+
+static inline bool is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static inline bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+/** Bytes that are separated from a word with a space */
+static inline bool is_spaced(char c)
+{
+    return is_word_byte(c) || c == '?' || c == '`' || c == '@';
+}
+
+static inline void put(fingerprint_t *fp, char c)
+{
+    if (fp->len + 1 < fp->size)
+    {
+        fp->dest[fp->len] = c;
+    }
+
+    fp->len++;
+    fp->hash = (fp->hash ^ (uint8_t)c) * FNV_PRIME;
+    fp->last = c;
+}
+
+static void put_text(fingerprint_t *fp, const char *text, size_t len, bool fold)
+{
+    if (is_spaced(fp->last) && is_spaced(*text))
+    {
+        put(fp, ' ');
+    }
+
+    for (size_t i = 0; i < len; i++)
+    {
+        char c = text[i];
+        put(fp, fold && c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c);
+    }
+}
+
+/**
+ * Write a token to the fingerprint. This is where the literals of an IN list
+ * are collapsed, everything else is written as it is.
+ *
+ * @param fp   The fingerprint
+ * @param type Type of the token
+ * @param text Start of the token
+ * @param len  Length of the token
+ */
+static void put_token(fingerprint_t *fp, token_type_t type, const char *text, size_t len)
+{
+    bool punct = type == TOKEN_PUNCT;
+
+    switch (fp->in)
+    {
+    case IN_KEYWORD:
+        fp->in = IN_NONE;
+        if (punct && *text == '(')
+        {
+            put(fp, '(');
+            fp->in = IN_OPEN;
+            return;
+        }
+        break;
+
+    case IN_OPEN:
+        fp->in = IN_NONE;
+        if (type == TOKEN_LITERAL)
+        {
+            put_text(fp, "?+", 2, false);
+            fp->in = IN_VALUE;
+            return;
+        }
+        break;
+
+    case IN_VALUE:
+        fp->in = IN_NONE;
+        if (punct && *text == ',')
+        {
+            fp->in = IN_COMMA;
+            return;
+        }
+        break;
+
+    case IN_COMMA:
+        if (type == TOKEN_LITERAL)
+        {
+            fp->in = IN_VALUE;
+            return;
+        }
+        /** Something other than a literal, the list can't be collapsed */
+        fp->in = IN_NONE;
+        put(fp, ',');
+        break;
+
+    default:
+        break;
+    }
+
+    switch (type)
+    {
+    case TOKEN_LITERAL:
+        put_text(fp, "?", 1, false);
+        break;
+
+    case TOKEN_WORD:
+        put_text(fp, text, len, true);
+        if (len == 2 && (text[0] | 0x20) == 'i' && (text[1] | 0x20) == 'n')
+        {
+            fp->in = IN_KEYWORD;
+        }
+        break;
+
+    default:
+        put_text(fp, text, len, false);
+        break;
+    }
+}
+
+/**
+ * Find the end of a quoted string or name
+ *
+ * @param ptr   The byte after the opening quote
+ * @param end   End of the statement
+ * @param quote The quote character
+ * @return The byte after the closing quote
+ */
+static const char *skip_quoted(const char *ptr, const char *end, char quote)
+{
+    const char set[] = {quote, '\\'};
+    int n_set = quote == '`' ? 1 : 2;
+
+    while ((ptr = scan_find_any(ptr, end, set, n_set)) < end)
+    {
+        if (*ptr == '\\')
+        {
+            ptr += 2;
+        }
+        else if (ptr + 1 < end && ptr[1] == quote)
+        {
+            /** A doubled quote character */
+            ptr += 2;
+        }
+        else
+        {
+            return ptr + 1;
+        }
+    }
+
+    return end;
+}
+
+/**
+ * Find the end of a number
+ *
+ * @param ptr Start of the number
+ * @param end End of the statement
+ * @return The byte after the number
+ */
+static const char *skip_number(const char *ptr, const char *end)
+{
+    if (end - ptr > 2 && ptr[0] == '0' && (ptr[1] == 'x' || ptr[1] == 'b'))
+    {
+        ptr += 2;
+        while (ptr < end && is_word_byte(*ptr))
+        {
+            ptr++;
+        }
+        return ptr;
+    }
+
+    while (ptr < end && is_digit(*ptr))
+    {
+        ptr++;
+    }
+
+    if (ptr < end && *ptr == '.')
+    {
+        ptr++;
+        while (ptr < end && is_digit(*ptr))
+        {
+            ptr++;
+        }
+    }
+
+    if (ptr < end && (*ptr == 'e' || *ptr == 'E'))
+    {
+        const char *exp = ptr + 1;
+
+        if (exp < end && (*exp == '+' || *exp == '-'))
+        {
+            exp++;
+        }
+
+        if (exp < end && is_digit(*exp))
+        {
+            ptr = exp;
+            while (ptr < end && is_digit(*ptr))
+            {
+                ptr++;
+            }
+        }
+    }
+
+    return ptr;
+}
+
+/**
+ * Check whether a word introduces a string literal, as in X'4D' or
+ * _utf8'text'
+ */
+static inline bool is_introducer(const char *word, size_t len)
+{
+    if (len == 1)
+    {
+        char c = word[0] | 0x20;
+        return c == 'x' || c == 'b' || c == 'n';
+    }
+
+    return word[0] == '_';
+}
+
+/**
+ * Create the fingerprint of an SQL statement
+ *
+ * @param sql  The statement, does not need to be null terminated
+ * @param len  Length of the statement
+ * @param dest Where the fingerprint is written, may be NULL if @c size is 0
+ * @param size Size of @c dest, at most size - 1 bytes and a terminating null
+ *             byte are written
+ * @param hash If not NULL, the 64-bit FNV-1a hash of the whole fingerprint is
+ *             stored here even if it did not fit in @c dest
+ * @return The length of the whole fingerprint. If this is @c size or more, the
+ *         fingerprint in @c dest was truncated.
+ */
+size_t fingerprint_sql(const char *sql, size_t len, char *dest, size_t size, uint64_t *hash)
+{
+    fingerprint_t fp = {dest, size, 0, FNV_OFFSET_BASIS, 0, IN_NONE};
+    const char *ptr = sql;
+    const char *end = sql + len;
+    int semicolons = 0;
+
+    while (ptr < end)
+    {
+        char c = *ptr;
+        const char *start = ptr;
+
+        if (is_space(c))
+        {
+            ptr++;
+            continue;
+        }
+        else if (c == '#' || (c == '-' && end - ptr > 1 && ptr[1] == '-' &&
+                              (end - ptr == 2 || is_space(ptr[2]))))
+        {
+            ptr = scan_find_any(ptr, end, "\n", 1);
+            continue;
+        }
+        else if (c == '/' && end - ptr > 1 && ptr[1] == '*')
+        {
+            ptr += 2;
+            while ((ptr = scan_find_any(ptr, end, "*", 1)) < end)
+            {
+                if (++ptr < end && *ptr == '/')
+                {
+                    ptr++;
+                    break;
+                }
+            }
+            continue;
+        }
+        else if (c == ';')
+        {
+            /** Only the semicolons between statements are written */
+            semicolons++;
+            ptr++;
+            continue;
+        }
+
+        for (; semicolons > 0; semicolons--)
+        {
+            put_token(&fp, TOKEN_PUNCT, ";", 1);
+        }
+
+        if (c == '\'' || c == '"')
+        {
+            ptr = skip_quoted(ptr + 1, end, c);
+            put_token(&fp, TOKEN_LITERAL, start, ptr - start);
+        }
+        else if (c == '`')
+        {
+            ptr = skip_quoted(ptr + 1, end, c);
+            put_token(&fp, TOKEN_QUOTED, start, ptr - start);
+        }
+        else if (is_digit(c) || (c == '.' && end - ptr > 1 && is_digit(ptr[1]) &&
+                                 !is_spaced(fp.last)) ||
+                 ((c == '-' || c == '+') && end - ptr > 1 && is_digit(ptr[1]) &&
+                  !is_spaced(fp.last) && fp.last != ')'))
+        {
+            /** A number, possibly with a unary sign. A sign after a word is
+             * an operator. */
+            ptr = skip_number(c == '-' || c == '+' ? ptr + 1 : ptr, end);
+
+            if (ptr < end && is_word_byte(*ptr) && (c == '.' || is_digit(c)))
+            {
+                /** A name that starts with digits, like 1abc */
+                while (ptr < end && is_word_byte(*ptr))
+                {
+                    ptr++;
+                }
+                put_token(&fp, TOKEN_WORD, start, ptr - start);
+            }
+            else
+            {
+                put_token(&fp, TOKEN_LITERAL, start, ptr - start);
+            }
+        }
+        else if (is_word_byte(c) || c == '@')
+        {
+            /** A variable like @@version is a single word */
+            while (ptr < end && *ptr == '@')
+            {
+                ptr++;
+            }
+
+            while (ptr < end && is_word_byte(*ptr))
+            {
+                ptr++;
+            }
+
+            if (ptr < end && *ptr == '\'' && is_introducer(start, ptr - start))
+            {
+                ptr = skip_quoted(ptr + 1, end, '\'');
+                put_token(&fp, TOKEN_LITERAL, start, ptr - start);
+            }
+            else
+            {
+                put_token(&fp, TOKEN_WORD, start, ptr - start);
+            }
+        }
+        else if (c == '?')
+        {
+            ptr++;
+            put_token(&fp, TOKEN_LITERAL, start, 1);
+        }
+        else
+        {
+            ptr++;
+            put_token(&fp, TOKEN_PUNCT, start, 1);
+        }
+    }
+
+    /** A list that was not closed is written as far as it was collapsed */
+    if (fp.in == IN_COMMA)
+    {
+        put(&fp, ',');
+    }
+
+    if (size > 0)
+    {
+        dest[fp.len < size ? fp.len : size - 1] = '\0';
+    }
+
+    if (hash)
+    {
+        *hash = fp.hash;
+    }
+
+    return fp.len;
+}
+
+/**
+ * Calculate the hash of the fingerprint of an SQL statement without
+ * storing the fingerprint
+ *
+ * @param sql The statement
+ * @param len Length of the statement
+ * @return The hash of the fingerprint, the same as fingerprint_sql() stores
+ */
+uint64_t fingerprint_hash(const char *sql, size_t len)
+{
+    uint64_t hash;
+    fingerprint_sql(sql, len, NULL, 0, &hash);
+    return hash;
+}
@@ -0,0 +1,467 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file flatmap.c An open addressing hash map
+ *
+ * The entries are kept in a single array whose size is a power of two. An
+ * entry is placed in the first free slot at or after the slot its hash points
+ * to. With Robin Hood probing an entry being inserted takes the slot of an
+ * entry that is closer to its own home slot, which keeps the probe sequences
+ * short and lets a lookup stop as soon as it passes the point where the key
+ * would have been. Deletion shifts the following entries back instead of
+ * leaving tombstones.
+ *
+ * The full hash of each key is stored in its entry so that the comparison
+ * function is only called for keys whose hash matches.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <flatmap.h>
+
+/** The smallest number of entries in a map */
+#define FLATMAP_MIN_CAPACITY 8
+
+/**
+ * The map is grown when more than FLATMAP_LOAD_NUM / FLATMAP_LOAD_DEN
+ * of its entries are used
+ */
+#define FLATMAP_LOAD_NUM 3
+#define FLATMAP_LOAD_DEN 4
+
+static bool flatmap_grow(FLATMAP *map);
+
+/**
+ * Null function used as the default memory function. This avoids having to
+ * special case the code that manipulates the keys and values.
+ *
+ * @param       data    The data pointer
+ * @return      Return the value we were called with
+ */
+static void *
+nullfn(void *data)
+{
+    return data;
+}
+
+/**
+ * Calculate the stored hash of a key
+ *
+ * The user supplied hash is mixed so that the low bits used for the home
+ * slot depend on all bits of the hash. Zero is reserved for empty entries.
+ *
+ * @param map   The map
+ * @param key   The key
+ * @return The hash of the key, never zero
+ */
+static inline uint32_t
+flatmap_hash(FLATMAP *map, void *key)
+{
+    uint32_t hash = (uint32_t)map->hashfn(key) * 2654435769U;
+    hash ^= hash >> 16;
+    return hash ? hash : 1;
+}
+
+/**
+ * Return how far an entry is from its home slot
+ *
+ * @param map   The map
+ * @param index The slot the entry is in
+ * @param hash  The hash of the entry
+ * @return The probe distance of the entry
+ */
+static inline unsigned int
+flatmap_distance(FLATMAP *map, unsigned int index, uint32_t hash)
+{
+    return (index - (hash & (map->capacity - 1))) & (map->capacity - 1);
+}
+
+/**
+ * Allocate a new map.
+ *
+ * @param size          The expected number of entries
+ * @param hashfn        The user supplied hash function
+ * @param cmpfn         The user supplied key comparison function
+ * @return The new map or NULL if memory allocation failed
+ */
+FLATMAP *
+flatmap_alloc(int size, int (*hashfn)(), int (*cmpfn)())
+{
+    FLATMAP *rval;
+    unsigned int capacity = FLATMAP_MIN_CAPACITY;
+
+    while (size > 0 && capacity * FLATMAP_LOAD_NUM < (unsigned int)size * FLATMAP_LOAD_DEN)
+    {
+        capacity *= 2;
+    }
+
+    if ((rval = (FLATMAP *)malloc(sizeof(FLATMAP))) == NULL)
+    {
+        return NULL;
+    }
+
+    if ((rval->entries = (FLATMAP_ENTRY *)calloc(capacity, sizeof(FLATMAP_ENTRY))) == NULL)
+    {
+        free(rval);
+        return NULL;
+    }
+
+    rval->capacity = capacity;
+    rval->n_elements = 0;
+    rval->hashfn = hashfn;
+    rval->cmpfn = cmpfn;
+    rval->kcopyfn = nullfn;
+    rval->vcopyfn = nullfn;
+    rval->kfreefn = nullfn;
+    rval->vfreefn = nullfn;
+    return rval;
+}
+
+/**
+ * Provide memory management functions to the map. This allows
+ * function pointers to be registered that can make copies of the
+ * key and value and free them as well.
+ *
+ * @param map           The map
+ * @param kcopyfn       The copy function for the key
+ * @param vcopyfn       The copy function for the value
+ * @param kfreefn       The free function for the key
+ * @param vfreefn       The free function for the value
+ */
+void
+flatmap_memory_fns(FLATMAP      *map,
+                   HASHMEMORYFN kcopyfn,
+                   HASHMEMORYFN vcopyfn,
+                   HASHMEMORYFN kfreefn,
+                   HASHMEMORYFN vfreefn)
+{
+    if (kcopyfn != NULL)
+    {
+        map->kcopyfn = kcopyfn;
+    }
+    if (vcopyfn != NULL)
+    {
+        map->vcopyfn = vcopyfn;
+    }
+    if (kfreefn != NULL)
+    {
+        map->kfreefn = kfreefn;
+    }
+    if (vfreefn != NULL)
+    {
+        map->vfreefn = vfreefn;
+    }
+}
+
+/**
+ * Free a map and all its entries
+ *
+ * @param map   The map to free
+ */
+void
+flatmap_free(FLATMAP *map)
+{
+    if (map == NULL)
+    {
+        return;
+    }
+
+    for (unsigned int i = 0; i < map->capacity; i++)
+    {
+        if (map->entries[i].hash)
+        {
+            map->kfreefn(map->entries[i].key);
+            map->vfreefn(map->entries[i].value);
+        }
+    }
+    free(map->entries);
+    free(map);
+}
+
+/**
+ * Place an entry into the entry array without checking for duplicates
+ *
+ * @param map   The map
+ * @param entry The entry to place
+ */
+static void
+flatmap_place(FLATMAP *map, FLATMAP_ENTRY entry)
+{
+    unsigned int mask = map->capacity - 1;
+    unsigned int index = entry.hash & mask;
+    unsigned int distance = 0;
+
+    while (map->entries[index].hash)
+    {
+        unsigned int existing = flatmap_distance(map, index, map->entries[index].hash);
+
+        if (existing < distance)
+        {
+            /** Take the slot from the entry that is closer to its home */
+            FLATMAP_ENTRY tmp = map->entries[index];
+            map->entries[index] = entry;
+            entry = tmp;
+            distance = existing;
+        }
+        index = (index + 1) & mask;
+        distance++;
+    }
+    map->entries[index] = entry;
+}
+
+/**
+ * Double the size of the map
+ *
+ * @param map   The map to grow
+ * @return True on success, false if memory allocation failed
+ */
+static bool
+flatmap_grow(FLATMAP *map)
+{
+    FLATMAP_ENTRY *old = map->entries;
+    unsigned int old_capacity = map->capacity;
+    FLATMAP_ENTRY *entries = (FLATMAP_ENTRY *)calloc(old_capacity * 2, sizeof(FLATMAP_ENTRY));
+
+    if (entries == NULL)
+    {
+        return false;
+    }
+
+    map->entries = entries;
+    map->capacity = old_capacity * 2;
+
+    for (unsigned int i = 0; i < old_capacity; i++)
+    {
+        if (old[i].hash)
+        {
+            flatmap_place(map, old[i]);
+        }
+    }
+    free(old);
+    return true;
+}
+
+/**
+ * Find the slot of a key
+ *
+ * @param map   The map
+ * @param key   The key to look for
+ * @param hash  The hash of the key
+ * @return The index of the entry or -1 if the key is not in the map
+ */
+static int
+flatmap_find(FLATMAP *map, void *key, uint32_t hash)
+{
+    unsigned int mask = map->capacity - 1;
+    unsigned int index = hash & mask;
+    unsigned int distance = 0;
+
+    while (map->entries[index].hash &&
+           flatmap_distance(map, index, map->entries[index].hash) >= distance)
+    {
+        if (map->entries[index].hash == hash &&
+            map->cmpfn(key, map->entries[index].key) == 0)
+        {
+            return index;
+        }
+        index = (index + 1) & mask;
+        distance++;
+    }
+    return -1;
+}
+
+/**
+ * Add an item to the map.
+ *
+ * @param map           The map to which to add the item
+ * @param key           The key of the item
+ * @param value         The value for the item
+ * @return      Return the number of items added
+ */
+int
+flatmap_add(FLATMAP *map, void *key, void *value)
+{
+    FLATMAP_ENTRY entry;
+
+    if (map == NULL || key == NULL || value == NULL)
+    {
+        return 0;
+    }
+
+    entry.hash = flatmap_hash(map, key);
+
+    if (flatmap_find(map, key, entry.hash) != -1)
+    {
+        /* Duplicate key value */
+        return 0;
+    }
+
+    if ((map->n_elements + 1) * FLATMAP_LOAD_DEN > map->capacity * FLATMAP_LOAD_NUM &&
+        !flatmap_grow(map))
+    {
+        return 0;
+    }
+
+    if ((entry.key = map->kcopyfn(key)) == NULL)
+    {
+        return 0;
+    }
+
+    if ((entry.value = map->vcopyfn(value)) == NULL)
+    {
+        map->kfreefn(entry.key);
+        return 0;
+    }
+
+    flatmap_place(map, entry);
+    map->n_elements++;
+    return 1;
+}
+
+/**
+ * Delete an item from the map that has a given key
+ *
+ * The entries that follow the deleted one are shifted back so that no
+ * probe sequence is broken.
+ *
+ * @param map           The map to delete from
+ * @param key           The key value of the item to remove
+ * @return Return the number of items deleted
+ */
+int
+flatmap_delete(FLATMAP *map, void *key)
+{
+    unsigned int mask;
+    unsigned int next;
+    int index;
+
+    if (map == NULL || key == NULL)
+    {
+        return 0;
+    }
+
+    if ((index = flatmap_find(map, key, flatmap_hash(map, key))) == -1)
+    {
+        return 0;
+    }
+
+    map->kfreefn(map->entries[index].key);
+    map->vfreefn(map->entries[index].value);
+
+    mask = map->capacity - 1;
+    next = (index + 1) & mask;
+
+    while (map->entries[next].hash &&
+           flatmap_distance(map, next, map->entries[next].hash) > 0)
+    {
+        map->entries[index] = map->entries[next];
+        index = next;
+        next = (next + 1) & mask;
+    }
+
+    memset(&map->entries[index], 0, sizeof(FLATMAP_ENTRY));
+    map->n_elements--;
+    return 1;
+}
+
+/**
+ * Fetch an item with a given key value from the map
+ *
+ * @param map           The map
+ * @param key           The key value
+ * @return The item or NULL if the item was not found
+ */
+void *
+flatmap_fetch(FLATMAP *map, void *key)
+{
+    int index;
+
+    if (map == NULL || key == NULL)
+    {
+        return NULL;
+    }
+
+    index = flatmap_find(map, key, flatmap_hash(map, key));
+    return index == -1 ? NULL : map->entries[index].value;
+}
+
+/**
+ * Return the number of elements in the map
+ *
+ * @param map   The map to measure
+ * @return Number of elements or 0 if map is NULL
+ */
+int
+flatmap_size(FLATMAP *map)
+{
+    return map ? map->n_elements : 0;
+}
+
+/**
+ * Create an iterator on a map
+ *
+ * The map must not be modified while the iterator is in use.
+ *
+ * @param map   The map to ceate an iterator on
+ * @return An iterator to use in future calls or NULL if memory allocation failed
+ */
+FLATMAP_ITERATOR *
+flatmap_iterator(FLATMAP *map)
+{
+    FLATMAP_ITERATOR *rval;
+
+    if ((rval = (FLATMAP_ITERATOR *)malloc(sizeof(FLATMAP_ITERATOR))) != NULL)
+    {
+        rval->map = map;
+        rval->index = 0;
+    }
+    return rval;
+}
+
+/**
+ * Return the next key for a map iterator
+ *
+ * @param iter  The map iterator
+ * @return      The next key value or NULL
+ */
+void *
+flatmap_next(FLATMAP_ITERATOR *iter)
+{
+    if (iter == NULL)
+    {
+        return NULL;
+    }
+
+    while (iter->index < iter->map->capacity)
+    {
+        FLATMAP_ENTRY *entry = &iter->map->entries[iter->index++];
+
+        if (entry->hash)
+        {
+            return entry->key;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Free a map iterator
+ *
+ * @param iter  The iterator to free
+ */
+void
+flatmap_iterator_free(FLATMAP_ITERATOR *iter)
+{
+    free(iter);
+}
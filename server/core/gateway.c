@@ -59,6 +59,7 @@
 #include <maxconfig.h>
 #include <maxscale/poll.h>
 #include <housekeeper.h>
+#include <admin_thread.h>
 #include <service.h>
 #include <memlog.h>
 
@@ -74,7 +75,11 @@
 
 #include <skygw_utils.h>
 #include <log_manager.h>
+#include <trace.h>
+#include <querytrace.h>
+#include <hugepage.h>
 #include <query_classifier.h>
+#include <qc_offload.h>
 
 #include <execinfo.h>
 
@@ -306,44 +311,14 @@ sigint_handler(int i)
     write(STDERR_FILENO, shutdown_msg, sizeof(shutdown_msg) - 1);
 }
 
+/**
+ * The children are reaped by the external command thread, the handler only
+ * wakes it up.
+ */
 static void
 sigchld_handler (int i)
 {
-    int exit_status = 0;
-    pid_t child = -1;
-
-    if ((child = wait(&exit_status)) == -1)
-    {
-        char errbuf[STRERROR_BUFLEN];
-        MXS_ERROR("Failed to wait child process: %d %s",
-                  errno, strerror_r(errno, errbuf, sizeof(errbuf)));
-    }
-    else
-    {
-        if (WIFEXITED(exit_status))
-        {
-            if (WEXITSTATUS(exit_status) != 0)
-            {
-                MXS_ERROR("Child process %d exited with status %d",
-                          child, WEXITSTATUS(exit_status));
-            }
-            else
-            {
-                MXS_INFO("Child process %d exited with status %d",
-                         child, WEXITSTATUS(exit_status));
-            }
-        }
-        else if (WIFSIGNALED(exit_status))
-        {
-            MXS_ERROR("Child process %d was stopped by signal %d.",
-                      child, WTERMSIG(exit_status));
-        }
-        else
-        {
-            MXS_ERROR("Child process %d did not exit normally. Exit status: %d",
-                      child, exit_status);
-        }
-    }
+    externcmd_sigchld();
 }
 
 int fatal_handling = 0;
@@ -1234,15 +1209,12 @@ int main(int argc, char **argv)
     int      i;
     int      n;
     int      ini_rval;
-    intptr_t thread_id;
-    int      n_threads; /*< number of epoll listener threads */
     int      n_services;
     int      eno = 0;   /*< local variable for errno */
     int      opt;
     int      daemon_pipe[2] = { -1, -1};
     bool     parent_process;
     int      child_status;
-    THREAD*   threads = NULL;   /*< thread list */
     char     mysql_home[PATH_MAX + 1];
     char*    cnf_file_path = NULL;        /*< conf file, to be freed */
     char*    cnf_file_arg = NULL;         /*< conf filename from cmd-line arg */
@@ -1858,6 +1830,12 @@ int main(int argc, char **argv)
         goto return_main;
     }
 
+    if (cnf->qc_offload_size > 0 && !config_check && !qc_offload_init(cnf->qc_offload_threads))
+    {
+        MXS_WARNING("Failed to start the classifier threads, large statements are "
+                    "classified by the polling threads.");
+    }
+
     if (config_check)
     {
         MXS_NOTICE("Configuration was successfully verified.");
@@ -1932,6 +1910,18 @@ int main(int argc, char **argv)
     /** Initialize statistics */
     ts_stats_init();
 
+    /** Enable the event trace */
+    if (config_trace_records() > 0)
+    {
+        trace_init(get_logdir(), config_trace_records());
+    }
+
+    /** Enable the sampled tracing of the routing of queries */
+    query_trace_init(config_trace_sample_rate(), config_trace_sample_user());
+
+    /** Choose where the buffers, DCBs and sessions are allocated from */
+    hugepage_init(config_huge_pages());
+
     /* Init MaxScale poll system */
     poll_init();
 
@@ -1944,6 +1934,20 @@ int main(int argc, char **argv)
     /** Start all monitors */
     monitorStartAll();
 
+    /*<
+     * Start the polling threads, note this is one less than is
+     * configured as the main thread will also poll. They are started
+     * before the services so that the listeners of a service are served
+     * as soon as it has started, while the other services are starting.
+     */
+    if (!poll_start_threads(worker_thread_main))
+    {
+        char* logerr = "Failed to start worker thread.";
+        print_log_n_stderr(true, true, logerr, logerr, 0);
+        rc = MAXSCALE_INTERNALERROR;
+        goto return_main;
+    }
+
     /** Start the services that were created above */
     n_services = serviceStartAll();
 
@@ -1951,6 +1955,8 @@ int main(int argc, char **argv)
     {
         char* logerr = "Failed to start all MaxScale services. Exiting.";
         print_log_n_stderr(true, true, logerr, logerr, 0);
+        poll_shutdown();
+        poll_wait_threads();
         rc = MAXSCALE_NOSERVICES;
         goto return_main;
     }
@@ -1972,28 +1978,15 @@ int main(int argc, char **argv)
      */
     hkinit();
 
-    /*<
-     * Start the polling threads, note this is one less than is
-     * configured as the main thread will also poll.
-     */
-    n_threads = config_threadcount();
-    threads = calloc(n_threads, sizeof(THREAD));
-    /*<
-     * Start server threads.
+    /** Expired connections are removed from the persistent pools once a second */
+    hktask_add("Persistent Pool Expiry", server_persistent_expire, NULL, 1);
+
+    /*
+     * Start the thread that runs the maxadmin and maxinfo commands
      */
-    for (thread_id = 0; thread_id < n_threads - 1; thread_id++)
-    {
-        if (thread_start(&threads[thread_id], worker_thread_main,
-                         (void *)(thread_id + 1)) == NULL)
-        {
-            char* logerr = "Failed to start worker thread.";
-            print_log_n_stderr(true, true, logerr, logerr, 0);
-            rc = MAXSCALE_INTERNALERROR;
-            goto return_main;
-        }
-    }
+    admin_thread_init();
 
-    MXS_NOTICE("MaxScale started with %d server threads.", config_threadcount());
+    MXS_NOTICE("MaxScale started with %d server threads.", config_initial_threads());
     /**
      * Successful start, notify the parent process that it can exit.
      */
@@ -2011,10 +2004,7 @@ int main(int argc, char **argv)
     /*<
      * Wait server threads' completion.
      */
-    for (thread_id = 0; thread_id < n_threads - 1; thread_id++)
-    {
-        thread_wait(threads[thread_id]);
-    }
+    poll_wait_threads();
     /*<
      * Wait the flush thread.
      */
@@ -2049,10 +2039,6 @@ return_main:
         write_child_exit_code(daemon_pipe[1], rc);
     }
 
-    if (threads)
-    {
-        free(threads);
-    }
     if (cnf_file_path)
     {
         free(cnf_file_path);
@@ -2070,6 +2056,7 @@ shutdown_server()
     service_shutdown();
     poll_shutdown();
     hkshutdown();
+    admin_thread_shutdown();
     memlog_flush_all();
     log_flush_shutdown();
 }
@@ -140,7 +140,8 @@ ssl_check_data_to_process(DCB *dcb)
     {
         int b = 0;
         ioctl(dcb->fd, FIONREAD, &b);
-        if (b != 0)
+        /** With read-ahead, the data may already be buffered by OpenSSL */
+        if (b != 0 || SSL_pending(dcb->ssl) > 0)
         {
             return true;
         }
@@ -17,6 +17,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sched.h>
 #include <hashtable.h>
 
 /**
@@ -45,6 +46,12 @@
  * number of readers and writers counters when taking out locks. Releasing of
  * locks uses pure atomic actions and thus does not require spinlock protection.
  *
+ * A concurrent hashtable, created with hashtable_alloc_concurrent, instead
+ * splits the chains into stripes that each have their own pair of counters.
+ * Readers never take a spinlock, they only increment the reader counter of
+ * the stripe that holds their chain. Writers lock only the stripe that they
+ * modify, so readers and writers of different stripes do not interfere.
+ *
  * @verbatim
  * Revision History
  *
@@ -59,14 +66,42 @@
  * @endverbatim
  */
 
-static  void hashtable_read_lock(HASHTABLE *table);
-static  void hashtable_read_unlock(HASHTABLE *table);
-static  void hashtable_write_lock(HASHTABLE *table);
-static  void hashtable_write_unlock(HASHTABLE *table);
+static  void hashtable_read_lock(HASHTABLE *table, unsigned int chain);
+static  void hashtable_read_unlock(HASHTABLE *table, unsigned int chain);
+static  void hashtable_write_lock(HASHTABLE *table, unsigned int chain);
+static  void hashtable_write_unlock(HASHTABLE *table, unsigned int chain);
 static HASHTABLE *hashtable_alloc_real(HASHTABLE* target,
                                        int size,
                                        int (*hashfn)(),
-                                       int (*cmpfn)());
+                                       int (*cmpfn)(),
+                                       int n_stripes);
+
+/** Number of spins after which a waiting thread yields the processor */
+#define HASHTABLE_SPINS_BEFORE_YIELD 100
+
+/**
+ * Wait while a lock counter is non-zero
+ *
+ * The counter is read with a dirty read. The thread backs off by yielding
+ * the processor once it has spun for a while, which lets the lock holder
+ * run when there are more threads than processors.
+ *
+ * @param counter The counter to wait on
+ */
+static inline void
+hashtable_wait_for_zero(int *counter)
+{
+    int spins = 0;
+
+    while (*(volatile int *)counter)
+    {
+        if (++spins > HASHTABLE_SPINS_BEFORE_YIELD)
+        {
+            sched_yield();
+            spins = 0;
+        }
+    }
+}
 
 /**
  * Special null function used as default memory allfunctions in the hashtable
@@ -97,7 +132,27 @@ nullfn(void *data)
 HASHTABLE *
 hashtable_alloc(int size, int (*hashfn)(), int (*cmpfn)())
 {
-    return hashtable_alloc_real(NULL, size, hashfn, cmpfn);
+    return hashtable_alloc_real(NULL, size, hashfn, cmpfn, 0);
+}
+
+/**
+ * Allocate a new hash table for concurrent use.
+ *
+ * The table is used with the same functions as a table created with
+ * hashtable_alloc. Instead of one lock for the whole table, the hash chains
+ * are protected by a set of striped locks and readers do not take any
+ * spinlocks. This suits tables that are read by many threads at a time.
+ *
+ * @param size          The size of the hash table, msut be > 0
+ * @param hashfn        The user supplied hash function
+ * @param cmpfn         The user supplied key comparison function
+ * @return The hashtable table
+ */
+HASHTABLE *
+hashtable_alloc_concurrent(int size, int (*hashfn)(), int (*cmpfn)())
+{
+    int n_stripes = size < HASHTABLE_MAX_STRIPES ? size : HASHTABLE_MAX_STRIPES;
+    return hashtable_alloc_real(NULL, size, hashfn, cmpfn, n_stripes > 0 ? n_stripes : 1);
 }
 
 HASHTABLE* hashtable_alloc_flat(HASHTABLE* target,
@@ -105,14 +160,15 @@ HASHTABLE* hashtable_alloc_flat(HASHTABLE* target,
                                 int (*hashfn)(),
                                 int (*cmpfn)())
 {
-    return hashtable_alloc_real(target, size, hashfn, cmpfn);
+    return hashtable_alloc_real(target, size, hashfn, cmpfn, 0);
 }
 
 static HASHTABLE *
 hashtable_alloc_real(HASHTABLE* target,
                      int        size,
                      int (*hashfn)(),
-                     int (*cmpfn)())
+                     int (*cmpfn)(),
+                     int n_stripes)
 {
     HASHTABLE *rval;
 
@@ -144,14 +200,37 @@ hashtable_alloc_real(HASHTABLE* target,
     rval->n_readers = 0;
     rval->writelock = 0;
     rval->n_elements = 0;
+    rval->stripes = NULL;
+    rval->n_stripes = 0;
     spinlock_init(&rval->spin);
     if ((rval->entries = (HASHENTRIES **)calloc(rval->hashsize, sizeof(HASHENTRIES *))) == NULL)
     {
-        free(rval);
+        if (!rval->ht_isflat)
+        {
+            free(rval);
+        }
         return NULL;
     }
     memset(rval->entries, 0, rval->hashsize * sizeof(HASHENTRIES *));
 
+    if (n_stripes > 0)
+    {
+        void *stripes;
+
+        if (posix_memalign(&stripes, MXS_CACHE_LINE_SIZE, n_stripes * sizeof(HASHSTRIPE)) != 0)
+        {
+            free(rval->entries);
+            if (!rval->ht_isflat)
+            {
+                free(rval);
+            }
+            return NULL;
+        }
+        memset(stripes, 0, n_stripes * sizeof(HASHSTRIPE));
+        rval->stripes = (HASHSTRIPE *)stripes;
+        rval->n_stripes = n_stripes;
+    }
+
     return rval;
 }
 
@@ -171,9 +250,9 @@ hashtable_free(HASHTABLE *table)
         return;
     }
 
-    hashtable_write_lock(table);
     for (i = 0; i < table->hashsize; i++)
     {
+        hashtable_write_lock(table, i);
         entry = table->entries[i];
         while (entry)
         {
@@ -183,10 +262,12 @@ hashtable_free(HASHTABLE *table)
             free(entry);
             entry = ptr;
         }
+        table->entries[i] = NULL;
+        hashtable_write_unlock(table, i);
     }
     free(table->entries);
+    free(table->stripes);
 
-    hashtable_write_unlock(table);
     if (!table->ht_isflat)
     {
         free(table);
@@ -256,7 +337,7 @@ hashtable_add(HASHTABLE *table, void *key, void *value)
     {
         hashkey = table->hashfn(key) % table->hashsize;
     }
-    hashtable_write_lock(table);
+    hashtable_write_lock(table, hashkey);
     entry = table->entries[hashkey % table->hashsize];
     while (entry && table->cmpfn(key, entry->key) != 0)
     {
@@ -265,7 +346,7 @@ hashtable_add(HASHTABLE *table, void *key, void *value)
     if (entry && table->cmpfn(key, entry->key) == 0)
     {
         /* Duplicate key value */
-        hashtable_write_unlock(table);
+        hashtable_write_unlock(table, hashkey);
         return 0;
     }
     else
@@ -273,7 +354,7 @@ hashtable_add(HASHTABLE *table, void *key, void *value)
         HASHENTRIES *ptr = (HASHENTRIES *)malloc(sizeof(HASHENTRIES));
         if (ptr == NULL)
         {
-            hashtable_write_unlock(table);
+            hashtable_write_unlock(table, hashkey);
             return 0;
         }
 
@@ -284,7 +365,7 @@ hashtable_add(HASHTABLE *table, void *key, void *value)
         if (ptr->key  == NULL)
         {
             free(ptr);
-            hashtable_write_unlock(table);
+            hashtable_write_unlock(table, hashkey);
 
             return 0;
         }
@@ -300,16 +381,18 @@ hashtable_add(HASHTABLE *table, void *key, void *value)
             free(ptr);
 
             /* value not copied, return */
-            hashtable_write_unlock(table);
+            hashtable_write_unlock(table, hashkey);
 
             return 0;
         }
 
         ptr->next = table->entries[hashkey % table->hashsize];
+        /* The entry must be complete before readers can see it */
+        __sync_synchronize();
         table->entries[hashkey % table->hashsize] = ptr;
     }
-    table->n_elements++;
-    hashtable_write_unlock(table);
+    atomic_add(&table->n_elements, 1);
+    hashtable_write_unlock(table, hashkey);
 
     return 1;
 }
@@ -333,7 +416,7 @@ hashtable_delete(HASHTABLE *table, void *key)
     }
 
     hashkey = table->hashfn(key) % table->hashsize;
-    hashtable_write_lock(table);
+    hashtable_write_lock(table, hashkey);
     entry = table->entries[hashkey % table->hashsize];
     while (entry && entry->key && table->cmpfn(key, entry->key) != 0)
     {
@@ -342,7 +425,7 @@ hashtable_delete(HASHTABLE *table, void *key)
     if (entry == NULL)
     {
         /* Not found */
-        hashtable_write_unlock(table);
+        hashtable_write_unlock(table, hashkey);
         return 0;
     }
 
@@ -374,7 +457,7 @@ hashtable_delete(HASHTABLE *table, void *key)
         }
         if (ptr == NULL)
         {
-            hashtable_write_unlock(table);
+            hashtable_write_unlock(table, hashkey);
             return 0;       /* This should never happen */
         }
         ptr->next = entry->next;
@@ -382,9 +465,9 @@ hashtable_delete(HASHTABLE *table, void *key)
         table->vfreefn(entry->value);
         free(entry);
     }
-    table->n_elements--;
+    atomic_add(&table->n_elements, -1);
     assert(table->n_elements >= 0);
-    hashtable_write_unlock(table);
+    hashtable_write_unlock(table, hashkey);
     return 1;
 }
 
@@ -407,7 +490,7 @@ hashtable_fetch(HASHTABLE *table, void *key)
     }
 
     hashkey = table->hashfn(key) % table->hashsize;
-    hashtable_read_lock(table);
+    hashtable_read_lock(table, hashkey);
     entry = table->entries[hashkey % table->hashsize];
     while (entry && entry->key && table->cmpfn(key, entry->key) != 0)
     {
@@ -415,13 +498,14 @@ hashtable_fetch(HASHTABLE *table, void *key)
     }
     if (entry == NULL)
     {
-        hashtable_read_unlock(table);
+        hashtable_read_unlock(table, hashkey);
         return NULL;
     }
     else
     {
-        hashtable_read_unlock(table);
-        return entry->value;
+        void *value = entry->value;
+        hashtable_read_unlock(table, hashkey);
+        return value;
     }
 }
 
@@ -444,23 +528,23 @@ hashtable_stats(HASHTABLE *table)
     printf("Hashtable: %p, size %d\n", table, table->hashsize);
     total = 0;
     longest = 0;
-    hashtable_read_lock(table);
     for (i = 0; i < table->hashsize; i++)
     {
         j = 0;
+        hashtable_read_lock(table, i);
         entries = table->entries[i];
         while (entries)
         {
             j++;
             entries = entries->next;
         }
+        hashtable_read_unlock(table, i);
         total += j;
         if (j > longest)
         {
             longest = j;
         }
     }
-    hashtable_read_unlock(table);
     printf("\tNo. of entries:       %d\n", total);
     printf("\tAverage chain length: %.1f\n", (float)total / table->hashsize);
     printf("\tLongest chain length: %d\n", longest);
@@ -504,17 +588,18 @@ void hashtable_get_stats(void* table,
     {
         ht = (HASHTABLE *)table;
         CHK_HASHTABLE(ht);
-        hashtable_read_lock(ht);
 
         for (i = 0; i < ht->hashsize; i++)
         {
             j = 0;
+            hashtable_read_lock(ht, i);
             entries = ht->entries[i];
             while (entries)
             {
                 j++;
                 entries = entries->next;
             }
+            hashtable_read_unlock(ht, i);
             *nelems += j;
             if (j > *longest)
             {
@@ -522,7 +607,6 @@ void hashtable_get_stats(void* table,
             }
         }
         *hashsize = ht->hashsize;
-        hashtable_read_unlock(ht);
     }
 }
 
@@ -543,19 +627,39 @@ void hashtable_get_stats(void* table,
  * With writelock set to zero we increment n_readers with the
  * spinlock still held.
  *
+ * In a concurrent table only the stripe of the chain is locked. The reader
+ * announces itself by incrementing n_readers of the stripe and then checks
+ * that no writer holds the stripe. If one does, the reader backs out and
+ * waits for the writer to finish. No spinlock is needed.
+ *
  * @param table         The hashtable to lock.
+ * @param chain         The hash chain that is read
  */
 static void
-hashtable_read_lock(HASHTABLE *table)
+hashtable_read_lock(HASHTABLE *table, unsigned int chain)
 {
+    if (table->stripes)
+    {
+        HASHSTRIPE *stripe = &table->stripes[chain % table->n_stripes];
+
+        while (true)
+        {
+            atomic_add(&stripe->n_readers, 1);
+            if (*(volatile int *)&stripe->writelock == 0)
+            {
+                break;
+            }
+            atomic_add(&stripe->n_readers, -1);
+            hashtable_wait_for_zero(&stripe->writelock);
+        }
+        return;
+    }
+
     spinlock_acquire(&table->spin);
     while (table->writelock)
     {
         spinlock_release(&table->spin);
-        while (table->writelock)
-        {
-            ;
-        }
+        hashtable_wait_for_zero(&table->writelock);
         spinlock_acquire(&table->spin);
     }
     atomic_add(&table->n_readers, 1);
@@ -568,11 +672,19 @@ hashtable_read_lock(HASHTABLE *table)
  * Simply decrement the n_readers value for the hash table
  *
  * @param table         The hash table to unlock
+ * @param chain         The hash chain that was read
  */
 static void
-hashtable_read_unlock(HASHTABLE *table)
+hashtable_read_unlock(HASHTABLE *table, unsigned int chain)
 {
-    atomic_add(&table->n_readers, -1);
+    if (table->stripes)
+    {
+        atomic_add(&table->stripes[chain % table->n_stripes].n_readers, -1);
+    }
+    else
+    {
+        atomic_add(&table->n_readers, -1);
+    }
 }
 
 /**
@@ -589,20 +701,34 @@ hashtable_read_unlock(HASHTABLE *table)
  * the spinlock throughout the process since both read and write
  * locks do not require the spinlock to be acquired.
  *
+ * In a concurrent table the writer claims the writelock of the stripe
+ * of the chain, which stops new readers of the stripe, and then waits
+ * for the current readers of the stripe to leave.
+ *
  * @param table The table to lock for updates
+ * @param chain The hash chain that is modified
  */
 static void
-hashtable_write_lock(HASHTABLE *table)
+hashtable_write_lock(HASHTABLE *table, unsigned int chain)
 {
     int available;
 
-    spinlock_acquire(&table->spin);
-    do
+    if (table->stripes)
     {
-        while (table->n_readers)
+        HASHSTRIPE *stripe = &table->stripes[chain % table->n_stripes];
+
+        while (!__sync_bool_compare_and_swap(&stripe->writelock, 0, 1))
         {
-            ;
+            hashtable_wait_for_zero(&stripe->writelock);
         }
+        hashtable_wait_for_zero(&stripe->n_readers);
+        return;
+    }
+
+    spinlock_acquire(&table->spin);
+    do
+    {
+        hashtable_wait_for_zero(&table->n_readers);
         available = atomic_add(&table->writelock, 1);
         if (available != 0)
         {
@@ -617,11 +743,19 @@ hashtable_write_lock(HASHTABLE *table)
  * Release the write lock on the hash table.
  *
  * @param table The hash table to unlock
+ * @param chain The hash chain that was modified
  */
 static void
-hashtable_write_unlock(HASHTABLE *table)
+hashtable_write_unlock(HASHTABLE *table, unsigned int chain)
 {
-    atomic_add(&table->writelock, -1);
+    if (table->stripes)
+    {
+        atomic_add(&table->stripes[chain % table->n_stripes].writelock, -1);
+    }
+    else
+    {
+        atomic_add(&table->writelock, -1);
+    }
 }
 
 /**
@@ -664,7 +798,7 @@ hashtable_next(HASHITERATOR *iter)
     iter->depth++;
     while (iter->chain < iter->table->hashsize)
     {
-        hashtable_read_lock(iter->table);
+        hashtable_read_lock(iter->table, iter->chain);
         if ((entries = iter->table->entries[iter->chain]) != NULL)
         {
             i = 0;
@@ -673,7 +807,7 @@ hashtable_next(HASHITERATOR *iter)
                 entries = entries->next;
                 i++;
             }
-            hashtable_read_unlock(iter->table);
+            hashtable_read_unlock(iter->table, iter->chain);
             if (entries)
             {
                 return entries->key;
@@ -681,7 +815,7 @@ hashtable_next(HASHITERATOR *iter)
         }
         else
         {
-            hashtable_read_unlock(iter->table);
+            hashtable_read_unlock(iter->table, iter->chain);
         }
         iter->depth = 0;
         iter->chain++;
@@ -821,6 +955,10 @@ hashtable_load(HASHTABLE *table, const char *filename,
 int hashtable_size(HASHTABLE *table)
 {
     assert(table);
+    if (table->stripes)
+    {
+        return table->n_elements;
+    }
     spinlock_acquire(&table->spin);
     int rval = table->n_elements;
     spinlock_release(&table->spin);
@@ -14,6 +14,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <hint.h>
+#include <atomic.h>
 
 /**
  * @file hint.c generic support routines for hints.
@@ -23,6 +24,7 @@
  *
  * Date         Who             Description
  * 25/07/14     Mark Riddoch    Initial implementation
+ * 14/10/16                     Added hint_share and hint_release
  *
  * @endverbatim
  */
@@ -49,6 +51,7 @@ hint_dup(HINT *hint)
             return nlhead;
         }
         ptr2->type = ptr1->type;
+        ptr2->refcount = 1;
         if (ptr1->data)
         {
             ptr2->data = strdup(ptr1->data);
@@ -100,6 +103,7 @@ hint_create_route(HINT *head, HINT_TYPE type, char *data)
     }
     hint->next = head;
     hint->type = type;
+    hint->refcount = 1;
     if (data)
     {
         hint->data = strdup(data);
@@ -131,14 +135,52 @@ hint_create_parameter(HINT *head, char *pname, char *value)
     }
     hint->next = head;
     hint->type = HINT_PARAMETER;
+    hint->refcount = 1;
     hint->data = strdup(pname);
     hint->value = strdup(value);
     return hint;
 }
 
+/**
+ * Share a list of hints. The list is not copied, the caller gets a reference
+ * to it and the hints of the list must no longer be modified.
+ *
+ * @param hint  The hint list to share, may be NULL
+ * @return      The same list
+ */
+HINT *
+hint_share(HINT *hint)
+{
+    if (hint)
+    {
+        atomic_add(&hint->refcount, 1);
+    }
+    return hint;
+}
+
+/**
+ * Release a reference to a list of hints. The hints that are no longer
+ * referenced are freed.
+ *
+ * @param hint  The hint list, may be NULL
+ */
+void
+hint_release(HINT *hint)
+{
+    while (hint && atomic_add(&hint->refcount, -1) == 1)
+    {
+        HINT *next = hint->next;
+        hint_free(hint);
+        hint = next;
+    }
+}
+
 /**
  * free_hint - free a hint
  *
+ * Only frees the hint itself, not the hints after it. A hint that is shared
+ * is released with hint_release().
+ *
  * @param hint          The hint to free
  */
 void
@@ -12,6 +12,8 @@
  */
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
 #include <housekeeper.h>
 #include <thread.h>
 #include <spinlock.h>
@@ -22,9 +24,14 @@
  *
  * The housekeeper provides a mechanism to allow for tasks, function
  * calls basically, to be run on a tiem basis. A task may be run
- * repeatedly, with a given frequency (in seconds), or may be a one
- * shot task that will only be run once after a specified number of
- * seconds.
+ * repeatedly, with a given frequency, or may be a one shot task that
+ * will only be run once after a specified time.
+ *
+ * The tasks are kept in a hierarchical timing wheel with a resolution
+ * of one millisecond, so adding and removing a task does not depend on
+ * the number of tasks and the housekeeper thread only looks at the tasks
+ * that are due. The thread sleeps until the next task is due or until
+ * a task is added.
  *
  * The housekeeper also maintains a global variable, hkheartbeat, that
  * is incremented every 100ms.
@@ -44,22 +51,154 @@
  */
 static HKTASK *tasks = NULL;
 /**
- * Spinlock to protect the tasks list
+ * Spinlock to protect the tasks list and the timing wheel
  */
 static SPINLOCK tasklock = SPINLOCK_INIT;
+/**
+ * The timing wheel the tasks are scheduled in, initialised when the first
+ * task is added
+ */
+static TIMER_WHEEL hk_wheel;
+static bool hk_wheel_ready = false;
+
+/**
+ * The housekeeper thread sleeps on this condition and is woken up when a
+ * task is added or the housekeeper is shut down
+ */
+static pthread_mutex_t hk_sleep_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hk_sleep_cond;
+static bool hk_wakeup_pending = false;
+static bool hk_started = false;
 
 static int do_shutdown = 0;
 long hkheartbeat = 0; /*< One heartbeat is 100 milliseconds */
+static uint64_t hk_start_time = 0; /*< When the housekeeper was started, in milliseconds */
 static THREAD hk_thr_handle;
 
 static void hkthread(void *);
 
+/**
+ * Return the value of the monotonic clock in milliseconds
+ *
+ * @return The current time in milliseconds
+ */
+static uint64_t
+hk_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Wake up the housekeeper thread so that it reconsiders when the next
+ * task is due
+ */
+static void
+hk_wakeup()
+{
+    if (hk_started)
+    {
+        pthread_mutex_lock(&hk_sleep_lock);
+        hk_wakeup_pending = true;
+        pthread_cond_signal(&hk_sleep_cond);
+        pthread_mutex_unlock(&hk_sleep_lock);
+    }
+}
+
+/**
+ * Sleep until a point in time or until the housekeeper is woken up
+ *
+ * @param until The time to wake up at, in milliseconds of the monotonic clock
+ */
+static void
+hk_sleep(uint64_t until)
+{
+    struct timespec ts;
+
+    ts.tv_sec = until / 1000;
+    ts.tv_nsec = (until % 1000) * 1000000;
+
+    pthread_mutex_lock(&hk_sleep_lock);
+    while (!hk_wakeup_pending && !do_shutdown)
+    {
+        if (pthread_cond_timedwait(&hk_sleep_cond, &hk_sleep_lock, &ts) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+    hk_wakeup_pending = false;
+    pthread_mutex_unlock(&hk_sleep_lock);
+}
+
+/**
+ * Schedule a task in the timing wheel. The caller must hold the tasklock.
+ *
+ * @param task  The task to schedule
+ * @param now   The current time in milliseconds
+ * @param delay How many milliseconds from now the task is due
+ */
+static void
+hktask_schedule(HKTASK *task, uint64_t now, int delay)
+{
+    if (!hk_wheel_ready)
+    {
+        timerwheel_init(&hk_wheel, now);
+        hk_wheel_ready = true;
+    }
+    timerwheel_add(&hk_wheel, &task->timer, now + delay);
+    task->nextdue = time(0) + delay / 1000;
+}
+
+/**
+ * Allocate a new task
+ *
+ * @param name          The name for this housekeeper task
+ * @param taskfn        The function to call for the task
+ * @param data          Data to pass to the task function
+ * @param frequency     How often to run the task in milliseconds
+ * @param type          The task type
+ * @return The new task or NULL if memory allocation failed
+ */
+static HKTASK *
+hktask_alloc(const char *name, void (*taskfn)(void *), void *data, int frequency, HKTASK_TYPE type)
+{
+    HKTASK *task;
+
+    if ((task = (HKTASK *)malloc(sizeof(HKTASK))) == NULL)
+    {
+        return NULL;
+    }
+    if ((task->name = strdup(name)) == NULL)
+    {
+        free(task);
+        return NULL;
+    }
+    timerwheel_entry_init(&task->timer);
+    task->task = taskfn;
+    task->data = data;
+    task->frequency = frequency;
+    task->type = type;
+    task->next = NULL;
+    return task;
+}
+
 /**
  * Initialise the housekeeper thread
  */
 void
 hkinit()
 {
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&hk_sleep_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    hk_start_time = hk_now();
+    hk_started = true;
+
     if (thread_start(&hk_thr_handle, hkthread, NULL) == NULL)
     {
         MXS_ERROR("Failed to start housekeeper thread.");
@@ -85,24 +224,33 @@ hkinit()
  */
 int
 hktask_add(const char *name, void (*taskfn)(void *), void *data, int frequency)
+{
+    return hktask_add_ms(name, taskfn, data, frequency * 1000);
+}
+
+/**
+ * Add a new task that is run periodically, with the frequency given in
+ * milliseconds.
+ *
+ * Task names must be unique.
+ *
+ * @param name          The unique name for this housekeeper task
+ * @param taskfn        The function to call for the task
+ * @param data          Data to pass to the task function
+ * @param frequency     How often to run the task, expressed in milliseconds
+ * @return              Return the time in seconds when the task will be first run
+ *                      if the task was added, otherwise 0
+ */
+int
+hktask_add_ms(const char *name, void (*taskfn)(void *), void *data, int frequency)
 {
     HKTASK *task, *ptr;
+    time_t nextdue;
 
-    if ((task = (HKTASK *)malloc(sizeof(HKTASK))) == NULL)
+    if ((task = hktask_alloc(name, taskfn, data, frequency, HK_REPEATED)) == NULL)
     {
         return 0;
     }
-    if ((task->name = strdup(name)) == NULL)
-    {
-        free(task);
-        return 0;
-    }
-    task->task = taskfn;
-    task->data = data;
-    task->frequency = frequency;
-    task->type = HK_REPEATED;
-    task->nextdue = time(0) + frequency;
-    task->next = NULL;
     spinlock_acquire(&tasklock);
     ptr = tasks;
     while (ptr && ptr->next)
@@ -131,9 +279,12 @@ hktask_add(const char *name, void (*taskfn)(void *), void *data, int frequency)
     {
         tasks = task;
     }
+    hktask_schedule(task, hk_now(), frequency);
+    nextdue = task->nextdue;
     spinlock_release(&tasklock);
+    hk_wakeup();
 
-    return task->nextdue;
+    return nextdue;
 }
 
 /**
@@ -151,24 +302,30 @@ hktask_add(const char *name, void (*taskfn)(void *), void *data, int frequency)
  */
 int
 hktask_oneshot(const char *name, void (*taskfn)(void *), void *data, int when)
+{
+    return hktask_oneshot_ms(name, taskfn, data, when * 1000);
+}
+
+/**
+ * Add a one-shot task that is executed after a number of milliseconds
+ *
+ * @param name          The unique name for this housekeeper task
+ * @param taskfn        The function to call for the task
+ * @param data          Data to pass to the task function
+ * @param when          How many milliseconds until the task is executed
+ * @return              Return the time in seconds when the task will be first run
+ *                      if the task was added, otherwise 0
+ */
+int
+hktask_oneshot_ms(const char *name, void (*taskfn)(void *), void *data, int when)
 {
     HKTASK *task, *ptr;
+    time_t nextdue;
 
-    if ((task = (HKTASK *)malloc(sizeof(HKTASK))) == NULL)
-    {
-        return 0;
-    }
-    if ((task->name = strdup(name)) == NULL)
+    if ((task = hktask_alloc(name, taskfn, data, 0, HK_ONESHOT)) == NULL)
     {
-        free(task);
         return 0;
     }
-    task->task = taskfn;
-    task->data = data;
-    task->frequency = 0;
-    task->type = HK_ONESHOT;
-    task->nextdue = time(0) + when;
-    task->next = NULL;
     spinlock_acquire(&tasklock);
     ptr = tasks;
     while (ptr && ptr->next)
@@ -183,9 +340,12 @@ hktask_oneshot(const char *name, void (*taskfn)(void *), void *data, int when)
     {
         tasks = task;
     }
+    hktask_schedule(task, hk_now(), when);
+    nextdue = task->nextdue;
     spinlock_release(&tasklock);
+    hk_wakeup();
 
-    return task->nextdue;
+    return nextdue;
 }
 
 
@@ -215,6 +375,10 @@ hktask_remove(const char *name)
     {
         tasks = ptr->next;
     }
+    if (ptr)
+    {
+        timerwheel_remove(&ptr->timer);
+    }
     spinlock_release(&tasklock);
 
     if (ptr)
@@ -235,66 +399,65 @@ hktask_remove(const char *name)
  *
  * This function is responsible for executing the housekeeper tasks.
  *
- * The implementation of the callng of the task functions is such that
- * the tasks are called without the tasklock spinlock being held. This
- * allows manipulation of the housekeeper task list during execution of
- * one of the tasks. The resutl is that upon completion of a task the
- * search for tasks to run must restart from the start of the queue.
- * It is vital that the task->nextdue tiem is updated before the task
- * is run.
+ * The tasks that are due are moved from the timing wheel to a list of
+ * due tasks. The task functions are called without the tasklock spinlock
+ * being held, which allows manipulation of the tasks during execution of
+ * one of the tasks. A task that is removed while it waits in the list of
+ * due tasks is unlinked from the list and is not run. It is vital that a
+ * repeated task is rescheduled before the task is run.
  *
  * @param       data            Unused, here to satisfy the thread system
  */
 void
 hkthread(void *data)
 {
-    HKTASK *ptr;
-    time_t now;
+    TIMER_ENTRY due;
+    uint64_t now, next;
     void (*taskfn)(void *);
     void *taskdata;
-    int i;
 
-    for (;;)
+    timerwheel_list_init(&due);
+
+    while (!do_shutdown)
     {
-        for (i = 0; i < 10; i++)
+        now = hk_now();
+        hkheartbeat = (now - hk_start_time) / 100;
+
+        spinlock_acquire(&tasklock);
+        if (hk_wheel_ready)
         {
-            if (do_shutdown)
-            {
-                return;
-            }
-            thread_millisleep(100);
-            hkheartbeat++;
+            timerwheel_advance(&hk_wheel, now, &due);
         }
-        now = time(0);
-        spinlock_acquire(&tasklock);
-        ptr = tasks;
-        while (ptr)
+        while (!timerwheel_list_empty(&due))
         {
-            if (ptr->nextdue <= now)
+            HKTASK *ptr = (HKTASK *)due.next;
+
+            timerwheel_remove(&ptr->timer);
+            if (ptr->type == HK_REPEATED)
             {
-                ptr->nextdue = now + ptr->frequency;
-                taskfn = ptr->task;
-                taskdata = ptr->data;
-                // We need to copy type and name, in case hktask_remove is called from
-                // the callback. Otherwise we will access freed data.
-                HKTASK_TYPE type = ptr->type;
-                char name[strlen(ptr->name) + 1];
-                strcpy(name, ptr->name);
-                spinlock_release(&tasklock);
-                (*taskfn)(taskdata);
-                if (type == HK_ONESHOT)
-                {
-                    hktask_remove(name);
-                }
-                spinlock_acquire(&tasklock);
-                ptr = tasks;
+                hktask_schedule(ptr, now, ptr->frequency);
             }
-            else
+            taskfn = ptr->task;
+            taskdata = ptr->data;
+            // We need to copy type and name, in case hktask_remove is called from
+            // the callback. Otherwise we will access freed data.
+            HKTASK_TYPE type = ptr->type;
+            char name[strlen(ptr->name) + 1];
+            strcpy(name, ptr->name);
+            spinlock_release(&tasklock);
+            (*taskfn)(taskdata);
+            if (type == HK_ONESHOT)
             {
-                ptr = ptr->next;
+                hktask_remove(name);
             }
+            spinlock_acquire(&tasklock);
         }
+        next = hk_wheel_ready ? timerwheel_next_expiry(&hk_wheel) : UINT64_MAX;
         spinlock_release(&tasklock);
+
+        /** Wake up at the latest when the next heartbeat is due */
+        uint64_t beat = hk_start_time + (hkheartbeat + 1) * 100;
+        hk_sleep(next < beat ? next : beat);
     }
 }
 
@@ -306,6 +469,7 @@ void
 hkshutdown()
 {
     do_shutdown = 1;
+    hk_wakeup();
 }
 
 /**
@@ -319,6 +483,7 @@ hkshow_tasks(DCB *pdcb)
     HKTASK *ptr;
     struct tm tm;
     char buf[40];
+    char freq[20];
 
     dcb_printf(pdcb, "%-25s | Type     | Frequency | Next Due\n", "Name");
     dcb_printf(pdcb, "--------------------------+----------+-----------+-------------------------\n");
@@ -328,10 +493,18 @@ hkshow_tasks(DCB *pdcb)
     {
         localtime_r(&ptr->nextdue, &tm);
         asctime_r(&tm, buf);
-        dcb_printf(pdcb, "%-25s | %-8s | %-9d | %s",
+        if (ptr->frequency % 1000 == 0)
+        {
+            snprintf(freq, sizeof(freq), "%d", ptr->frequency / 1000);
+        }
+        else
+        {
+            snprintf(freq, sizeof(freq), "%dms", ptr->frequency);
+        }
+        dcb_printf(pdcb, "%-25s | %-8s | %-9s | %s",
                    ptr->name,
                    ptr->type == HK_REPEATED ? "Repeated" : "One-Shot",
-                   ptr->frequency,
+                   freq,
                    buf);
         ptr = ptr->next;
     }
@@ -0,0 +1,442 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file hugepage.c Arenas of objects in 2MB huge pages
+ *
+ * A region of transparent huge pages is mapped with an extra 2MB and trimmed
+ * to a 2MB boundary, as the kernel only backs aligned ranges with huge pages.
+ * Regions from the hugetlbfs pool are always aligned.
+ *
+ * The statistics of the arenas are updated under the lock of the arena and
+ * read without it by the diagnostics, as the lock of an arena is held while
+ * a region is mapped. An arena is only used when the free list of a pool is
+ * empty or full, so the lock is taken far less often than objects are
+ * allocated.
+ */
+
+#include <hugepage.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <dcb.h>
+#include <metrics.h>
+#include <log_manager.h>
+
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+
+/** Objects are aligned like the memory returned by malloc */
+#define HUGEPAGE_ALIGN(s) (((s) + 15) & ~(size_t)15)
+
+/** Round a size up to whole regions */
+#define HUGEPAGE_ROUND(s) (((s) + HUGEPAGE_SIZE - 1) & ~(size_t)(HUGEPAGE_SIZE - 1))
+
+/** An object on the free list of an arena */
+typedef struct hugepage_free_entry
+{
+    struct hugepage_free_entry *next;
+} HUGEPAGE_FREE_ENTRY;
+
+/** The regions of all arenas and of hugepage_map */
+typedef struct hugepage_stats
+{
+    int64_t explicit_regions;    /**< Regions from the hugetlbfs pool */
+    int64_t transparent_regions; /**< Regions of transparent huge pages */
+    int64_t hugetlb_failures;    /**< Regions that were not available in the hugetlbfs pool */
+    int64_t advise_failures;     /**< Regions the kernel refused to back with huge pages */
+    int64_t map_failures;        /**< Regions that could not be mapped at all */
+    int64_t mapped_bytes;        /**< Bytes in the regions */
+} HUGEPAGE_STATS;
+
+static huge_pages_t hugepage_current_mode = HUGE_PAGES_OFF;
+static HUGEPAGE_STATS hugepage_stats;
+static HUGEPAGE_ARENA *all_arenas = NULL;
+static SPINLOCK hugepage_lock = SPINLOCK_INIT; /*< Protects the statistics and the list of arenas */
+
+static const char *hugepage_mode_names[] = {"off", "transparent", "explicit"};
+
+static void hugepage_print_metrics(DCB *dcb);
+
+/**
+ * Check that the kernel may back the regions with transparent huge pages
+ *
+ * @return False if transparent huge pages are disabled
+ */
+static bool
+hugepage_transparent_available()
+{
+    FILE *file = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    bool rval = true;
+
+    if (file)
+    {
+        char line[128];
+
+        if (fgets(line, sizeof(line), file) && strstr(line, "[never]"))
+        {
+            rval = false;
+        }
+        fclose(file);
+    }
+    return rval;
+}
+
+/**
+ * Set how the arenas allocate memory. Called once at startup before the
+ * polling threads are started.
+ *
+ * @param mode The huge_pages parameter
+ */
+void
+hugepage_init(huge_pages_t mode)
+{
+    hugepage_current_mode = mode;
+
+    if (mode == HUGE_PAGES_OFF)
+    {
+        return;
+    }
+
+    if (!hugepage_transparent_available())
+    {
+        MXS_WARNING("Transparent huge pages are disabled in the kernel, the huge page "
+                    "arenas %s.", mode == HUGE_PAGES_EXPLICIT ?
+                    "fall back to ordinary pages when the hugetlbfs pool is empty" :
+                    "use ordinary pages");
+    }
+
+    metrics_add_printer(hugepage_print_metrics);
+    MXS_NOTICE("Allocating the buffers, DCBs and sessions from %s huge page arenas.",
+               hugepage_mode_names[mode]);
+}
+
+/**
+ * @return The huge_pages mode the arenas use
+ */
+huge_pages_t
+hugepage_mode()
+{
+    return hugepage_current_mode;
+}
+
+/**
+ * Map a region of whole huge pages
+ *
+ * @param size The size of the region, a multiple of HUGEPAGE_SIZE
+ * @return The region or NULL if it could not be mapped
+ */
+static void *
+hugepage_map_region(size_t size)
+{
+    void *ptr = MAP_FAILED;
+    bool hugetlb_failed = false;
+    bool advise_failed = false;
+
+    if (hugepage_current_mode == HUGE_PAGES_EXPLICIT)
+    {
+        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+        hugetlb_failed = ptr == MAP_FAILED;
+    }
+
+    if (ptr == MAP_FAILED)
+    {
+        char *mem = mmap(NULL, size + HUGEPAGE_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (mem != MAP_FAILED)
+        {
+            char *start = (char *)HUGEPAGE_ROUND((uintptr_t)mem);
+            size_t head = start - mem;
+
+            if (head > 0)
+            {
+                munmap(mem, head);
+            }
+            munmap(start + size, HUGEPAGE_SIZE - head);
+            advise_failed = madvise(start, size, MADV_HUGEPAGE) != 0;
+            ptr = start;
+        }
+    }
+
+    bool first_failure = false;
+
+    spinlock_acquire(&hugepage_lock);
+    if (hugetlb_failed)
+    {
+        first_failure = hugepage_stats.hugetlb_failures++ == 0;
+    }
+    if (ptr == MAP_FAILED)
+    {
+        hugepage_stats.map_failures++;
+    }
+    else
+    {
+        if (hugetlb_failed || hugepage_current_mode == HUGE_PAGES_TRANSPARENT)
+        {
+            hugepage_stats.transparent_regions++;
+        }
+        else
+        {
+            hugepage_stats.explicit_regions++;
+        }
+        hugepage_stats.advise_failures += advise_failed;
+        hugepage_stats.mapped_bytes += size;
+    }
+    spinlock_release(&hugepage_lock);
+
+    if (first_failure)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_WARNING("Failed to map huge pages from the hugetlbfs pool, using transparent "
+                    "huge pages instead: %s. Reserve more huge pages with vm.nr_hugepages.",
+                    strerror_r(errno, errbuf, sizeof(errbuf)));
+    }
+
+    return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+/**
+ * Allocate an object from an arena. The memory is not cleared.
+ *
+ * @param arena The arena
+ * @return The object or NULL if memory could not be allocated
+ */
+void *
+hugepage_alloc(HUGEPAGE_ARENA *arena)
+{
+    size_t size = HUGEPAGE_ALIGN(arena->size);
+    void *rval = NULL;
+
+    if (hugepage_current_mode == HUGE_PAGES_OFF || size > HUGEPAGE_SIZE)
+    {
+        return malloc(arena->size);
+    }
+
+    spinlock_acquire(&arena->lock);
+
+    if (arena->free)
+    {
+        HUGEPAGE_FREE_ENTRY *entry = arena->free;
+        arena->free = entry->next;
+        arena->n_free--;
+        rval = entry;
+    }
+    else
+    {
+        if (arena->next == NULL || (size_t)(arena->end - arena->next) < size)
+        {
+            char *region = hugepage_map_region(HUGEPAGE_SIZE);
+
+            if (region)
+            {
+                arena->next = region;
+                arena->end = region + HUGEPAGE_SIZE;
+                arena->regions++;
+            }
+        }
+
+        if (arena->next && (size_t)(arena->end - arena->next) >= size)
+        {
+            rval = arena->next;
+            arena->next += size;
+            arena->objects++;
+        }
+        else if ((rval = malloc(arena->size)) != NULL)
+        {
+            arena->fallbacks++;
+        }
+    }
+
+    bool first = !arena->registered;
+    arena->registered = true;
+    spinlock_release(&arena->lock);
+
+    if (first)
+    {
+        spinlock_acquire(&hugepage_lock);
+        arena->next_arena = all_arenas;
+        all_arenas = arena;
+        spinlock_release(&hugepage_lock);
+    }
+
+    return rval;
+}
+
+/**
+ * Return an object to its arena
+ *
+ * @param arena The arena the object was allocated from
+ * @param ptr   The object
+ */
+void
+hugepage_free(HUGEPAGE_ARENA *arena, void *ptr)
+{
+    if (hugepage_current_mode == HUGE_PAGES_OFF || HUGEPAGE_ALIGN(arena->size) > HUGEPAGE_SIZE)
+    {
+        free(ptr);
+        return;
+    }
+
+    HUGEPAGE_FREE_ENTRY *entry = (HUGEPAGE_FREE_ENTRY *)ptr;
+
+    spinlock_acquire(&arena->lock);
+    entry->next = arena->free;
+    arena->free = entry;
+    arena->n_free++;
+    spinlock_release(&arena->lock);
+}
+
+/**
+ * Allocate a large array from huge pages. The memory is cleared.
+ *
+ * @param size The size of the array
+ * @return The array or NULL if memory could not be allocated
+ */
+void *
+hugepage_map(size_t size)
+{
+    if (hugepage_current_mode == HUGE_PAGES_OFF)
+    {
+        return calloc(1, size);
+    }
+    return hugepage_map_region(HUGEPAGE_ROUND(size));
+}
+
+/**
+ * Free an array allocated with hugepage_map
+ *
+ * @param ptr  The array
+ * @param size The size that was given to hugepage_map
+ */
+void
+hugepage_unmap(void *ptr, size_t size)
+{
+    if (hugepage_current_mode == HUGE_PAGES_OFF)
+    {
+        free(ptr);
+    }
+    else if (ptr)
+    {
+        munmap(ptr, HUGEPAGE_ROUND(size));
+
+        spinlock_acquire(&hugepage_lock);
+        hugepage_stats.mapped_bytes -= HUGEPAGE_ROUND(size);
+        spinlock_release(&hugepage_lock);
+    }
+}
+
+/**
+ * Print the huge page arenas
+ *
+ * @param dcb The DCB to print to
+ */
+void
+dprintHugePages(DCB *dcb)
+{
+    HUGEPAGE_STATS stats;
+
+    spinlock_acquire(&hugepage_lock);
+    stats = hugepage_stats;
+    spinlock_release(&hugepage_lock);
+
+    dcb_printf(dcb, "Huge page arenas.\n");
+    dcb_printf(dcb, "Mode:                               %s\n", hugepage_mode_names[hugepage_current_mode]);
+    dcb_printf(dcb, "Regions from the hugetlbfs pool:    %" PRId64 "\n", stats.explicit_regions);
+    dcb_printf(dcb, "Regions of transparent huge pages:  %" PRId64 "\n", stats.transparent_regions);
+    dcb_printf(dcb, "Empty hugetlbfs pool fallbacks:     %" PRId64 "\n", stats.hugetlb_failures);
+    dcb_printf(dcb, "Regions not advised as huge pages:  %" PRId64 "\n", stats.advise_failures);
+    dcb_printf(dcb, "Regions that could not be mapped:   %" PRId64 "\n", stats.map_failures);
+    dcb_printf(dcb, "Mapped bytes:                       %" PRId64 "\n", stats.mapped_bytes);
+
+    if (all_arenas == NULL)
+    {
+        return;
+    }
+
+    dcb_printf(dcb, "Arena            | Object size | Regions | Objects    | Free       | Malloc\n");
+    dcb_printf(dcb, "-----------------+-------------+---------+------------+------------+-----------\n");
+
+    spinlock_acquire(&hugepage_lock);
+    for (HUGEPAGE_ARENA *arena = all_arenas; arena; arena = arena->next_arena)
+    {
+        dcb_printf(dcb, " %-15s | %-11lu | %-7" PRId64 " | %-10" PRId64 " | %-10" PRId64 " | %" PRId64 "\n",
+                   arena->name, (unsigned long)HUGEPAGE_ALIGN(arena->size), arena->regions,
+                   arena->objects, arena->n_free, arena->fallbacks);
+    }
+    spinlock_release(&hugepage_lock);
+}
+
+/**
+ * Print the huge page metrics, added as a metrics printer by hugepage_init
+ *
+ * @param dcb The DCB to print to
+ */
+static void
+hugepage_print_metrics(DCB *dcb)
+{
+    HUGEPAGE_STATS stats;
+
+    spinlock_acquire(&hugepage_lock);
+    stats = hugepage_stats;
+    spinlock_release(&hugepage_lock);
+
+    metrics_print_family(dcb, "maxscale_hugepage_regions", METRIC_GAUGE,
+                         "Huge page regions mapped by the arenas");
+    metrics_print_value(dcb, "maxscale_hugepage_regions", "", "type=\"explicit\"",
+                        stats.explicit_regions);
+    metrics_print_value(dcb, "maxscale_hugepage_regions", "", "type=\"transparent\"",
+                        stats.transparent_regions);
+
+    metrics_print_family(dcb, "maxscale_hugepage_mapped_bytes", METRIC_GAUGE,
+                         "Bytes of huge page regions mapped by the arenas");
+    metrics_print_value(dcb, "maxscale_hugepage_mapped_bytes", "", NULL, stats.mapped_bytes);
+
+    metrics_print_family(dcb, "maxscale_hugepage_fallbacks", METRIC_COUNTER,
+                         "Regions that did not get the requested kind of huge pages");
+    metrics_print_value(dcb, "maxscale_hugepage_fallbacks", "_total", "reason=\"hugetlb_empty\"",
+                        stats.hugetlb_failures);
+    metrics_print_value(dcb, "maxscale_hugepage_fallbacks", "_total", "reason=\"advise_failed\"",
+                        stats.advise_failures);
+    metrics_print_value(dcb, "maxscale_hugepage_fallbacks", "_total", "reason=\"map_failed\"",
+                        stats.map_failures);
+
+    metrics_print_family(dcb, "maxscale_hugepage_arena_objects", METRIC_GAUGE,
+                         "Objects of each arena by where they were allocated from and the freed objects");
+
+    spinlock_acquire(&hugepage_lock);
+    for (HUGEPAGE_ARENA *arena = all_arenas; arena; arena = arena->next_arena)
+    {
+        char labels[128];
+        snprintf(labels, sizeof(labels), "arena=\"%s\",state=\"region\"", arena->name);
+        metrics_print_value(dcb, "maxscale_hugepage_arena_objects", "", labels, arena->objects);
+        snprintf(labels, sizeof(labels), "arena=\"%s\",state=\"malloc\"", arena->name);
+        metrics_print_value(dcb, "maxscale_hugepage_arena_objects", "", labels, arena->fallbacks);
+        snprintf(labels, sizeof(labels), "arena=\"%s\",state=\"free\"", arena->name);
+        metrics_print_value(dcb, "maxscale_hugepage_arena_objects", "", labels, arena->n_free);
+    }
+    spinlock_release(&hugepage_lock);
+}
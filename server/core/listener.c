@@ -24,6 +24,8 @@
  *
  * Date         Who                     Description
  * 26/01/16     Martin Brampton         Initial implementation
+ * 14/10/16                             Connection queue priority and admitted connections
+ * 14/10/26                             Handshake template of the protocol module
  *
  * @endverbatim
  */
@@ -34,11 +36,18 @@
 #include <gw_ssl.h>
 #include <gw_protocol.h>
 #include <log_manager.h>
+#include <queuemanager.h>
+#include <openssl/rand.h>
+#include <openssl/hmac.h>
+#include <openssl/evp.h>
 
 static RSA *rsa_512 = NULL;
 static RSA *rsa_1024 = NULL;
 
 static RSA *tmp_rsa_callback(SSL *s, int is_export, int keylength);
+static int ticket_key_callback(SSL *ssl, unsigned char key_name[16], unsigned char *iv,
+                               EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc);
+static bool generate_ticket_key(SSL_TICKET_KEY *key);
 
 /**
  * Create a new listener structure
@@ -62,6 +71,11 @@ listener_alloc(char *protocol, char *address, unsigned short port, char *authent
         proto->port = port;
         proto->authenticator = authenticator ? strdup(authenticator) : NULL;
         proto->ssl = ssl;
+        proto->priority = QUEUE_PRIORITY_NORMAL;
+        spinlock_init(&proto->admit_lock);
+        proto->admitted = NULL;
+        spinlock_init(&proto->handshake_lock);
+        proto->handshake = NULL;
     }
     return proto;
 }
@@ -170,7 +184,8 @@ listener_init_SSL(SSL_LISTENER *ssl_listener)
             return -1;
         }
 
-        SSL_CTX_set_default_read_ahead(ssl_listener->ctx, 0);
+        /** Read whole records and more with one system call where possible */
+        SSL_CTX_set_default_read_ahead(ssl_listener->ctx, 1);
 
         /** Enable all OpenSSL bug fixes */
         SSL_CTX_set_options(ssl_listener->ctx, SSL_OP_ALL);
@@ -242,6 +257,51 @@ listener_init_SSL(SSL_LISTENER *ssl_listener)
 
         /* Set the verification depth */
         SSL_CTX_set_verify_depth(ssl_listener->ctx, ssl_listener->ssl_cert_verify_depth);
+
+        /**
+         * Let reconnecting clients resume their earlier sessions instead of
+         * doing a full handshake. The cache of the context is shared by all
+         * threads. The session id context must be set for the resumption to
+         * work when client certificates are verified.
+         */
+        SSL_CTX_set_app_data(ssl_listener->ctx, ssl_listener);
+        SSL_CTX_set_session_id_context(ssl_listener->ctx, (const unsigned char*)"MaxScale", 8);
+        SSL_CTX_set_timeout(ssl_listener->ctx, ssl_listener->ssl_session_timeout);
+
+        if (ssl_listener->ssl_session_cache_size > 0)
+        {
+            SSL_CTX_set_session_cache_mode(ssl_listener->ctx, SSL_SESS_CACHE_SERVER);
+            SSL_CTX_sess_set_cache_size(ssl_listener->ctx, ssl_listener->ssl_session_cache_size);
+        }
+        else
+        {
+            SSL_CTX_set_session_cache_mode(ssl_listener->ctx, SSL_SESS_CACHE_OFF);
+        }
+
+        spinlock_init(&ssl_listener->session_lock);
+
+#ifdef SSL_OP_ENABLE_KTLS
+        if (ssl_listener->ssl_ktls)
+        {
+            SSL_CTX_set_options(ssl_listener->ctx, SSL_OP_ENABLE_KTLS);
+        }
+#endif
+
+        if (ssl_listener->ssl_session_tickets)
+        {
+            if (!generate_ticket_key(&ssl_listener->ticket_keys[0]))
+            {
+                MXS_ERROR("Failed to generate the TLS session ticket key.");
+                return -1;
+            }
+            ssl_listener->ticket_key_time = time(NULL);
+            SSL_CTX_set_tlsext_ticket_key_cb(ssl_listener->ctx, ticket_key_callback);
+        }
+        else
+        {
+            SSL_CTX_set_options(ssl_listener->ctx, SSL_OP_NO_TICKET);
+        }
+
         ssl_listener->ssl_init_done = true;
     }
     return 0;
@@ -291,3 +351,99 @@ tmp_rsa_callback(SSL *s, int is_export, int keylength)
     }
     return(rsa_tmp);
 }
+
+/**
+ * Generate a new random session ticket key
+ *
+ * @param key The key to fill
+ * @return True if the key was generated
+ */
+static bool
+generate_ticket_key(SSL_TICKET_KEY *key)
+{
+    key->valid = RAND_bytes(key->name, sizeof(key->name)) == 1 &&
+        RAND_bytes(key->aes_key, sizeof(key->aes_key)) == 1 &&
+        RAND_bytes(key->hmac_key, sizeof(key->hmac_key)) == 1;
+
+    return key->valid;
+}
+
+/**
+ * The session ticket callback function for OpenSSL.
+ *
+ * New tickets are encrypted with the current key. The key is replaced once it
+ * is older than the session timeout and the replaced key is kept for one more
+ * period so that the tickets it encrypted can still be used. A client that
+ * presents a ticket of the previous key is given a new ticket.
+ *
+ * @param ssl      The SSL connection
+ * @param key_name Name of the key, stored into the ticket when encrypting
+ * @param iv       Initialisation vector
+ * @param ectx     Cipher context to initialise
+ * @param hctx     HMAC context to initialise
+ * @param enc      1 when a ticket is encrypted, 0 when it is decrypted
+ * @return 1 on success, 2 if the ticket should be renewed, 0 if the ticket key
+ * is not known and -1 on error
+ */
+static int
+ticket_key_callback(SSL *ssl, unsigned char key_name[16], unsigned char *iv,
+                    EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc)
+{
+    SSL_LISTENER *listener = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+    SSL_TICKET_KEY *keys = listener->ticket_keys;
+    int rval = 0;
+
+    spinlock_acquire(&listener->session_lock);
+
+    if (enc)
+    {
+        time_t now = time(NULL);
+
+        if (now - listener->ticket_key_time >= listener->ssl_session_timeout)
+        {
+            SSL_TICKET_KEY next;
+
+            if (generate_ticket_key(&next))
+            {
+                keys[1] = keys[0];
+                keys[0] = next;
+                listener->ticket_key_time = now;
+            }
+        }
+
+        if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) == 1 &&
+            EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, keys[0].aes_key, iv) == 1 &&
+            HMAC_Init_ex(hctx, keys[0].hmac_key, SSL_TICKET_KEY_LEN, EVP_sha256(), NULL) == 1)
+        {
+            memcpy(key_name, keys[0].name, sizeof(keys[0].name));
+            rval = 1;
+        }
+        else
+        {
+            rval = -1;
+        }
+    }
+    else
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            if (keys[i].valid && memcmp(key_name, keys[i].name, sizeof(keys[i].name)) == 0)
+            {
+                if (HMAC_Init_ex(hctx, keys[i].hmac_key, SSL_TICKET_KEY_LEN, EVP_sha256(), NULL) == 1 &&
+                    EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, keys[i].aes_key, iv) == 1)
+                {
+                    rval = i == 0 ? 1 : 2;
+                }
+                else
+                {
+                    rval = -1;
+                }
+                break;
+            }
+        }
+    }
+
+    spinlock_release(&listener->session_lock);
+
+    return rval;
+}
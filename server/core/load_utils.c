@@ -34,6 +34,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <dlfcn.h>
+#include <pthread.h>
 #include <modules.h>
 #include <modinfo.h>
 #include <skygw_utils.h>
@@ -48,6 +49,13 @@
 
 static MODULES *registered = NULL;
 
+/**
+ * Protects the list of modules. The services are started by several threads
+ * and the authenticators are loaded by the polling threads. The lock is
+ * recursive because a module may load other modules in ModuleInit.
+ */
+static pthread_mutex_t modules_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
 static MODULES *find_module(const char *module);
 static void register_module(const char *module,
                             const char  *type,
@@ -56,6 +64,7 @@ static void register_module(const char *module,
                             void        *modobj,
                             MODULE_INFO *info);
 static void unregister_module(const char *module);
+static void *load_module_locked(const char *module, const char *type);
 int module_create_feedback_report(GWBUF **buffer, MODULES *modules, FEEDBACK_CONF *cfg);
 int do_http_post(GWBUF *buffer, void *cfg);
 
@@ -114,6 +123,23 @@ WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp)
  */
 void *
 load_module(const char *module, const char *type)
+{
+    pthread_mutex_lock(&modules_lock);
+    void *modobj = load_module_locked(module, type);
+    pthread_mutex_unlock(&modules_lock);
+
+    return modobj;
+}
+
+/**
+ * Load a module, the modules lock must be held
+ *
+ * @param module        Name of the module to load
+ * @param type          Type of module
+ * @return              The module specific entry point structure or NULL
+ */
+static void *
+load_module_locked(const char *module, const char *type)
 {
     char *home, *version;
     char fname[MAXPATHLEN + 1];
@@ -265,16 +291,16 @@ load_module(const char *module, const char *type)
 void
 unload_module(const char *module)
 {
+    pthread_mutex_lock(&modules_lock);
     MODULES *mod = find_module(module);
-    void *handle;
 
-    if (!mod)
+    if (mod)
     {
-        return;
+        void *handle = mod->handle;
+        unregister_module(module);
+        dlclose(handle);
     }
-    handle = mod->handle;
-    unregister_module(module);
-    dlclose(handle);
+    pthread_mutex_unlock(&modules_lock);
 }
 
 /**
@@ -23,16 +23,34 @@
 #include <errno.h>
 #include <syslog.h>
 #include <atomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
 
-#include <mlist.h>
 #include <skygw_debug.h>
+#include <ilist.h>
+#include <mpsc_queue.h>
 #include <skygw_types.h>
 #include <skygw_utils.h>
+#include <probes.h>
 
 #define MAX_PREFIXLEN 250
 #define MAX_SUFFIXLEN 250
 #define MAX_PATHLEN   512
-#define MAXNBLOCKBUFS 10
+
+/** Size of the log buffer of each thread, must be a power of two */
+#define LOGBUF_SIZE (128 * 1024)
+/** Size of the buffer where the file writer merges the messages of the threads */
+#define LOG_WRITEBUF_SIZE (64 * 1024)
+/** How often the file writer writes the buffered messages, in milliseconds */
+#define LOG_WRITE_INTERVAL 100
+/** How many times a message that must be flushed is retried if the buffer is full */
+#define LOG_FLUSH_RETRIES 10
+/** Record length that marks the unused space at the end of a log buffer */
+#define LOGREC_PAD UINT32_MAX
+/** Space taken by a record of len bytes in a log buffer */
+#define LOGREC_SIZE(len) ((sizeof(logrec_t) + (len) + 7) & ~((size_t)7))
 
 /** for procname */
 #if !defined(_GNU_SOURCE)
@@ -45,13 +63,6 @@ static const char LOGFILE_NAME_SUFFIX[] = ".log";
 extern char *program_invocation_name;
 extern char *program_invocation_short_name;
 
-typedef enum
-{
-    BB_READY = 0x00,
-    BB_FULL,
-    BB_CLEARED
-} blockbuf_state_t;
-
 typedef enum
 {
     FILEWRITER_INIT,
@@ -86,7 +97,6 @@ enum log_flush
 
 #if defined(SS_DEBUG)
 static int write_index;
-static int block_start_index;
 static int prevval;
 static simple_mutex_t msg_mutex;
 #endif
@@ -96,6 +106,19 @@ static simple_mutex_t msg_mutex;
  */
 static int DEFAULT_LOG_AUGMENTATION = 0;
 
+/**
+ * Default throttling, at most 10 similar messages in a second, after which
+ * they are suppressed for 10 seconds.
+ */
+#define DEFAULT_LOG_THROTTLING_COUNT       10
+#define DEFAULT_LOG_THROTTLING_WINDOW_MS   1000
+#define DEFAULT_LOG_THROTTLING_SUPPRESS_MS 10000
+
+/** Number of call sites that can be throttled, must be a power of two */
+#define LOG_THROTTLE_SLOTS 1024
+/** How many slots are probed for the call site */
+#define LOG_THROTTLE_PROBES 8
+
 static struct
 {
     int  augmentation;     // Can change during the lifetime of log_manager.
@@ -103,15 +126,43 @@ static struct
     bool do_syslog;        // Can change during the lifetime of log_manager.
     bool do_maxlog;        // Can change during the lifetime of log_manager.
     bool use_stdout;       // Can NOT changed during the lifetime of log_manager.
+    MXS_LOG_THROTTLING throttling; // Can change during the lifetime of log_manager.
 } log_config =
 {
     DEFAULT_LOG_AUGMENTATION, // augmentation
     false,                    // do_highprecision
     true,                     // do_syslog
     true,                     // do_maxlog
-    false                     // use_stdout
+    false,                    // use_stdout
+    {
+        DEFAULT_LOG_THROTTLING_COUNT,
+        DEFAULT_LOG_THROTTLING_WINDOW_MS,
+        DEFAULT_LOG_THROTTLING_SUPPRESS_MS
+    }                         // throttling
 };
 
+/**
+ * Throttling state of a call site. The slot is claimed by storing the key
+ * of the call site, after which all fields are only updated atomically.
+ */
+typedef struct log_throttle
+{
+    uint64_t lt_key;          /**< Key of the call site, 0 if the slot is free */
+    int64_t  lt_window_start; /**< Start of the current window, in milliseconds */
+    int64_t  lt_suppress_end; /**< End of the suppression, in milliseconds */
+    int      lt_count;        /**< Messages logged in the current window */
+    int      lt_suppressed;   /**< Messages suppressed since the last logged one */
+} log_throttle_t;
+
+typedef enum
+{
+    LOG_THROTTLE_LOG,      /**< Log the message */
+    LOG_THROTTLE_LOG_LAST, /**< Log the message, similar ones are suppressed after it */
+    LOG_THROTTLE_SUPPRESS  /**< Suppress the message */
+} log_throttle_action_t;
+
+static log_throttle_t log_throttles[LOG_THROTTLE_SLOTS];
+
 /**
  * Variable holding the enabled priorities information.
  * Used from logging macros.
@@ -129,6 +180,10 @@ __thread mxs_log_info_t mxs_log_tls = {0, 0};
  * each log type is currently enabled.
  */
 ssize_t mxs_log_session_count[LOG_DEBUG + 1] = {0};
+/**
+ * Sum of mxs_log_session_count
+ */
+int mxs_log_session_count_total = 0;
 
 /**
  * BUFSIZ comes from the system. It equals with block size or
@@ -184,26 +239,49 @@ struct filewriter
 };
 
 /**
- * Log client's string is copied to block-sized log buffer, which is passed
- * to file writer thread.
+ * Header of a message in a log buffer. The message follows the header and
+ * the next header starts at the next 8 byte boundary.
  */
-typedef struct blockbuf
+typedef struct logrec
 {
-#if defined(SS_DEBUG)
-    skygw_chk_t    bb_chk_top;
-#endif
-    blockbuf_state_t bb_state; /**State of the block buffer*/
-    simple_mutex_t bb_mutex;    /**< bb_buf_used, bb_isfull */
-    int            bb_refcount; /**< protected by list mutex. #of clients */
-//        int            bb_blankcount; /**< # of blanks used btw strings */
-    size_t         bb_buf_size;
-    size_t         bb_buf_left;
-    size_t         bb_buf_used;
-    char           bb_buf[MAX_LOGSTRLEN];
-#if defined(SS_DEBUG)
-    skygw_chk_t    bb_chk_tail;
-#endif
-} blockbuf_t;
+    uint32_t lr_len;   /**< Length of the message or LOGREC_PAD */
+    uint32_t lr_unused;
+    uint64_t lr_stamp; /**< Monotonic time stamp in nanoseconds */
+} logrec_t;
+
+/**
+ * Log buffer of a thread. The thread appends its messages to the buffer
+ * and the file writer consumes them, so neither ever waits for the other.
+ * The offsets only grow and are masked with the buffer size when used.
+ */
+typedef struct logbuf
+{
+    uint64_t       lb_head;    /**< Write offset, updated by the owning thread */
+    char           lb_pad1[56];
+    uint64_t       lb_tail;    /**< Read offset, updated by the file writer */
+    char           lb_pad2[56];
+    MPSC_NODE      lb_qnode;   /**< Node in the queue of new buffers */
+    ILIST_NODE     lb_node;    /**< Node in the list of the file writer */
+    int            lb_dropped; /**< Messages dropped because the buffer was full */
+    bool           lb_orphan;  /**< The owning thread has exited */
+    uint64_t       lb_data[LOGBUF_SIZE / sizeof(uint64_t)];
+} logbuf_t;
+
+/** New log buffers, pushed by the threads and moved to log_buffers by the file writer */
+static MPSC_QUEUE log_new_buffers = MPSC_QUEUE_INIT(log_new_buffers);
+/** The log buffers of all threads, only used by the file writer */
+static ILIST log_buffers = ILIST_INIT(log_buffers);
+/** The log buffer of the current thread */
+static __thread logbuf_t* log_thread_buf;
+/** Key whose destructor marks the buffer of an exiting thread orphaned */
+static pthread_key_t log_buf_key;
+static pthread_once_t log_buf_once = PTHREAD_ONCE_INIT;
+/** Set when the file writer has been woken up but hasn't started writing */
+static int log_wakeup_pending;
+/** Number of threads currently using the log manager */
+static int lm_nlinks;
+/** Whether log clients can use the log manager without taking lmlock */
+static bool lm_running;
 
 /**
  * logfile object corresponds to physical file(s) where
@@ -229,8 +307,6 @@ struct logfile
     char*            lf_full_link_name; /**< complete symlink name */
     int              lf_nfiles_max;
     size_t           lf_file_size;
-    /** list of block-sized log buffers */
-    mlist_t          lf_blockbuf_list;
     size_t           lf_buf_size;
     bool             lf_flushflag;
     bool                 lf_rotateflag;
@@ -261,7 +337,6 @@ struct logmanager
 #endif
     bool             lm_enabled;
     simple_mutex_t   lm_mutex;
-    size_t           lm_nlinks;
     /** fwr_logmes is for messages from log clients */
     skygw_message_t* lm_logmes;
     /** fwr_clientmes is for messages to log clients */
@@ -321,14 +396,10 @@ static int logmanager_write_log(int            priority,
                                 size_t         len,
                                 const char*    str);
 
-static blockbuf_t* blockbuf_init();
-static void blockbuf_node_done(void* bb_data);
-static char* blockbuf_get_writepos(blockbuf_t** p_bb,
-                                   size_t       str_len,
-                                   bool         flush);
-
-static void blockbuf_register(blockbuf_t* bb);
-static void blockbuf_unregister(blockbuf_t* bb);
+static logbuf_t* logbuf_get(void);
+static bool logbuf_append(logbuf_t* lb, const char* str, size_t len);
+static void logfile_wakeup(logfile_t* lf);
+static int logbufs_write(skygw_file_t* file, bool flush);
 static char* add_slash(char* str);
 
 static bool check_file_and_path(char* filename,
@@ -362,7 +433,6 @@ static bool logmanager_init_nomutex(const char* ident,
     lm->lm_chk_top   = CHK_NUM_LOGMANAGER;
     lm->lm_chk_tail  = CHK_NUM_LOGMANAGER;
     write_index = 0;
-    block_start_index = 0;
     prevval = -1;
     simple_mutex_init(&msg_mutex, "Message mutex");
 #endif
@@ -437,6 +507,7 @@ static bool logmanager_init_nomutex(const char* ident,
 
     succ = true;
     lm->lm_enabled = true;
+    __atomic_store_n(&lm_running, true, __ATOMIC_SEQ_CST);
 
 return_succ:
     if (err != 0)
@@ -541,11 +612,12 @@ void mxs_log_finish(void)
         CHK_LOGMANAGER(lm);
         /** Mark logmanager unavailable */
         lm->lm_enabled = false;
+        __atomic_store_n(&lm_running, false, __ATOMIC_SEQ_CST);
 
         /** Wait until all users have left or someone shuts down
          * logmanager between lock release and acquire.
          */
-        while (lm != NULL && lm->lm_nlinks != 0)
+        while (lm != NULL && __atomic_load_n(&lm_nlinks, __ATOMIC_SEQ_CST) != 0)
         {
             release_lock(&lmlock);
             pthread_yield();
@@ -555,7 +627,7 @@ void mxs_log_finish(void)
         /** Shut down if not already shutted down. */
         if (lm)
         {
-            ss_dassert(lm->lm_nlinks == 0);
+            ss_dassert(lm_nlinks == 0);
             logmanager_done_nomutex();
         }
     }
@@ -577,7 +649,7 @@ static logfile_t* logmanager_get_logfile(logmanager_t* lmgr)
 }
 
 /**
- * Finds write position from block buffer for log string and writes there.
+ * Formats the log string and appends it to the log buffer of the thread.
  *
  * Parameters:
  *
@@ -600,10 +672,9 @@ static int logmanager_write_log(int            priority,
                                 const char*    str)
 {
     logfile_t*   lf;
-    char*        wp;
+    char         buf[MAX_LOGSTRLEN];
+    char*        wp = buf;
     int          err = 0;
-    blockbuf_t*  bb;
-    blockbuf_t*  bb_c;
     size_t       timestamp_len;
     int          i;
 
@@ -661,11 +732,6 @@ static int logmanager_write_log(int            priority,
     {
         safe_str_len = timestamp_len - sizeof(char) + cmplen + str_len;
     }
-    /**
-     * Seek write position and register to block buffer.
-     * Then print formatted string to write position.
-     */
-
 #if defined (SS_LOG_DEBUG)
     {
         char *copy, *tok;
@@ -690,22 +756,6 @@ static int logmanager_write_log(int            priority,
         simple_mutex_unlock(&msg_mutex);
     }
 #endif
-    /** Book space for log string from buffer */
-    if (do_maxlog)
-    {
-        // All messages are now logged to the error log file.
-        wp = blockbuf_get_writepos(&bb, safe_str_len, flush);
-    }
-    else
-    {
-        wp = (char*)malloc(sizeof(char) * (timestamp_len - sizeof(char) + cmplen + str_len + 1));
-    }
-
-    if (wp == NULL)
-    {
-        return -1;
-    }
-
 #if defined (SS_LOG_DEBUG)
     {
         sprintf(wp, "[msg:%d]", atomic_add(&write_index, 1));
@@ -779,360 +829,286 @@ static int logmanager_write_log(int            priority,
 
     if (do_maxlog)
     {
-        blockbuf_unregister(bb);
-    }
-    else
-    {
-        free(wp);
+        // All messages are now logged to the error log file.
+        logbuf_t* lb = logbuf_get();
+
+        if (lb == NULL)
+        {
+            return -1;
+        }
+
+        bool added = logbuf_append(lb, buf, wp - buf + safe_str_len);
+
+        /**
+         * A message that must be flushed is retried a few times after waking
+         * up the file writer, other messages are dropped if the buffer is full.
+         */
+        for (int i = 0; !added && flush && i < LOG_FLUSH_RETRIES; i++)
+        {
+            logfile_wakeup(lf);
+            sched_yield();
+            added = logbuf_append(lb, buf, wp - buf + safe_str_len);
+        }
+
+        if (!added)
+        {
+            atomic_add(&lb->lb_dropped, 1);
+            err = -1;
+        }
+
+        if (flush || lb->lb_head - __atomic_load_n(&lb->lb_tail, __ATOMIC_ACQUIRE) > LOGBUF_SIZE / 2)
+        {
+            logfile_wakeup(lf);
+        }
     }
 
     return err;
 }
 
 /**
- * Register writer to a block buffer. When reference counter is non-zero the
- * flusher thread doesn't write the block to disk.
+ * Marks the log buffer of an exiting thread orphaned. The file writer frees
+ * it once the messages in it have been written.
  *
- * @param bb    block buffer
+ * @param data The log buffer of the thread
  */
-static void blockbuf_register(blockbuf_t* bb)
+static void logbuf_orphan(void* data)
+{
+    logbuf_t* lb = (logbuf_t*)data;
+    __atomic_store_n(&lb->lb_orphan, true, __ATOMIC_RELEASE);
+}
+
+static void logbuf_key_init(void)
 {
-    CHK_BLOCKBUF(bb);
-    ss_dassert(bb->bb_refcount >= 0);
-    atomic_add(&bb->bb_refcount, 1);
+    pthread_key_create(&log_buf_key, logbuf_orphan);
 }
 
 /**
- * Unregister writer from block buffer. If the buffer got filled up and there
- * are no other registered writers anymore, notify the flusher thread.
+ * Get the log buffer of the current thread. The buffer is created and pushed
+ * to the queue of new buffers the first time the thread logs something.
  *
- * @param bb    block buffer
+ * @return The log buffer of the thread or NULL if memory allocation failed
  */
-static void blockbuf_unregister(blockbuf_t* bb)
+static logbuf_t* logbuf_get(void)
 {
-    logfile_t* lf;
+    logbuf_t* lb = log_thread_buf;
 
-    CHK_BLOCKBUF(bb);
-    ss_dassert(bb->bb_refcount >= 1);
-    lf = &lm->lm_logfile;
-    CHK_LOGFILE(lf);
-    /**
-     * if this is the last client in a full buffer, send write request.
-     */
-    if (atomic_add(&bb->bb_refcount, -1) == 1 && bb->bb_state == BB_FULL)
+    if (lb == NULL)
     {
-        skygw_message_send(lf->lf_logmes);
+        pthread_once(&log_buf_once, logbuf_key_init);
+
+        if ((lb = (logbuf_t*)calloc(1, sizeof(logbuf_t))) == NULL)
+        {
+            fprintf(stderr, "Error: Memory allocation failed when initializing log buffer.");
+            return NULL;
+        }
+
+        mpsc_queue_push(&log_new_buffers, &lb->lb_qnode);
+        pthread_setspecific(log_buf_key, lb);
+        log_thread_buf = lb;
     }
-    ss_dassert(bb->bb_refcount >= 0);
-}
 
+    return lb;
+}
 
 /**
- * @node (write brief function description here)
- *
- * Parameters:
- * @param id - <usage>
- *          <description>
- *
- * @param str_len - <usage>
- *          <description>
- *
- * @return
- *
+ * Append a message to a log buffer. Only called by the thread owning the buffer.
  *
- * @details List mutex now protects both the list and the contents of it.
- * TODO : It should be so that adding and removing nodes of the list is protected
- * by the list mutex. Buffer modifications should be protected by buffer
- * mutex.
+ * @param lb  Log buffer
+ * @param str The message
+ * @param len Length of the message
  *
+ * @return True if the message was added, false if the buffer was full
  */
-static char* blockbuf_get_writepos(blockbuf_t** p_bb,
-                                   size_t       str_len,
-                                   bool         flush)
-{
-    logfile_t*     lf;
-    mlist_t*       bb_list;
-    char*          pos = NULL;
-    mlist_node_t*  node;
-    blockbuf_t*    bb;
-#if defined(SS_DEBUG)
-    bool           succ;
-#endif
-
-    CHK_LOGMANAGER(lm);
-    lf = &lm->lm_logfile;
-    CHK_LOGFILE(lf);
-    bb_list = &lf->lf_blockbuf_list;
-
-    /** Lock list */
-    simple_mutex_lock(&bb_list->mlist_mutex, true);
-    CHK_MLIST(bb_list);
+static bool logbuf_append(logbuf_t* lb, const char* str, size_t len)
+{
+    char* data = (char*)lb->lb_data;
+    size_t size = LOGREC_SIZE(len);
+    uint64_t head = lb->lb_head;
+    uint64_t tail = __atomic_load_n(&lb->lb_tail, __ATOMIC_ACQUIRE);
+    size_t offset = head & (LOGBUF_SIZE - 1);
+    size_t pad = LOGBUF_SIZE - offset < size ? LOGBUF_SIZE - offset : 0;
 
-    if (bb_list->mlist_nodecount > 0)
+    if (LOGBUF_SIZE - (head - tail) < size + pad)
     {
-        /**
-         * At least block buffer exists on the list.
-         */
-        node = bb_list->mlist_first;
+        return false;
+    }
 
-        /** Loop over blockbuf list to find write position */
-        while (true)
+    if (pad > 0)
+    {
+        /** The message doesn't fit into the end of the buffer, skip it */
+        if (pad >= sizeof(logrec_t))
         {
-            CHK_MLIST_NODE(node);
-
-            /** Unlock list */
-            simple_mutex_unlock(&bb_list->mlist_mutex);
-
-            bb = (blockbuf_t *)node->mlnode_data;
-            CHK_BLOCKBUF(bb);
-
-            /** Lock buffer */
-            simple_mutex_lock(&bb->bb_mutex, true);
-
-            if (bb->bb_state == BB_FULL || bb->bb_buf_left < str_len)
-            {
-                /**
-                 * This block buffer is too full.
-                 * Send flush request to file writer thread. This causes
-                 * flushing all buffers, and (eventually) frees buffer space.
-                 */
-                blockbuf_register(bb);
-
-                bb->bb_state = BB_FULL;
-
-                blockbuf_unregister(bb);
-
-                /** Unlock buffer */
-                simple_mutex_unlock(&bb->bb_mutex);
+            ((logrec_t*)(data + offset))->lr_len = LOGREC_PAD;
+        }
+        head += pad;
+        offset = 0;
+    }
 
-                /** Lock list */
-                simple_mutex_lock(&bb_list->mlist_mutex, true);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
 
+    logrec_t* rec = (logrec_t*)(data + offset);
+    rec->lr_len = len;
+    rec->lr_stamp = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    memcpy(rec + 1, str, len);
 
-                /**
-                 * If next node exists move forward. Else check if there is
-                 * space for a new block buffer on the list.
-                 */
-                if (node != bb_list->mlist_last)
-                {
-                    node = node->mlnode_next;
-                    continue;
-                }
-                /**
-                 * All buffers on the list are full.
-                 */
-                if (bb_list->mlist_nodecount < bb_list->mlist_nodecount_max)
-                {
-                    /**
-                     * New node is created
-                     */
-                    if ((bb = blockbuf_init()) == NULL)
-                    {
-                        simple_mutex_unlock(&bb_list->mlist_mutex);
-                        return NULL;
-                    }
+    __atomic_store_n(&lb->lb_head, head + size, __ATOMIC_RELEASE);
+    return true;
+}
 
-                    CHK_BLOCKBUF(bb);
+/**
+ * Get the oldest message in a log buffer. Only called by the file writer.
+ *
+ * @param lb   Log buffer
+ * @param head Write offset of the buffer read when the writing started
+ *
+ * @return The oldest message or NULL if there are none before @c head
+ */
+static logrec_t* logbuf_peek(logbuf_t* lb, uint64_t head)
+{
+    uint64_t tail = lb->lb_tail;
 
-                    /**
-                     * Increase version to odd to mark list update active
-                     * update.
-                     */
-                    bb_list->mlist_versno += 1;
-                    ss_dassert(bb_list->mlist_versno % 2 == 1);
+    while (tail != head)
+    {
+        size_t offset = tail & (LOGBUF_SIZE - 1);
+        logrec_t* rec = (logrec_t*)((char*)lb->lb_data + offset);
 
-                    ss_debug(succ = ) mlist_add_data_nomutex(bb_list, bb);
-                    ss_dassert(succ);
+        if (LOGBUF_SIZE - offset >= sizeof(logrec_t) && rec->lr_len != LOGREC_PAD)
+        {
+            return rec;
+        }
 
-                    /**
-                     * Increase version to even to mark completion of update.
-                     */
-                    bb_list->mlist_versno += 1;
-                    ss_dassert(bb_list->mlist_versno % 2 == 0);
-                }
-                else
-                {
-                    /**
-                     * List and buffers are full.
-                     * Reset to the beginning of the list, and wait until
-                     * there is a block buffer with enough space.
-                     */
-                    simple_mutex_unlock(&bb_list->mlist_mutex);
-                    simple_mutex_lock(&bb_list->mlist_mutex, true);
-
-                    node = bb_list->mlist_first;
-                    continue;
-                }
+        tail += LOGBUF_SIZE - offset;
+        __atomic_store_n(&lb->lb_tail, tail, __ATOMIC_RELEASE);
+    }
 
-            }
-            else if (bb->bb_state == BB_CLEARED)
-            {
+    return NULL;
+}
 
-                /**
-                 *Move the cleared buffer to the end of the list if it is the first one in the list
-                 */
+/**
+ * Wake up the file writer unless it has already been woken up
+ *
+ * @param lf The log file
+ */
+static void logfile_wakeup(logfile_t* lf)
+{
+    if (__atomic_exchange_n(&log_wakeup_pending, 1, __ATOMIC_SEQ_CST) == 0)
+    {
+        skygw_message_send(lf->lf_logmes);
+    }
+}
 
-                simple_mutex_unlock(&bb->bb_mutex);
-                simple_mutex_lock(&bb_list->mlist_mutex, true);
+/**
+ * Write the messages in the log buffers of the threads to the log file. The
+ * messages of different threads are merged in the order of their time stamps.
+ * Messages added after the writing started are left for the next round.
+ *
+ * The new buffers are first moved from the queue to the list of the file
+ * writer. Log buffers of exited threads are freed once they are empty.
+ *
+ * @param file  The log file
+ * @param flush Whether the file is synced to disk
+ *
+ * @return 0 on success, error number on failure
+ */
+static int logbufs_write(skygw_file_t* file, bool flush)
+{
+    static char writebuf[LOG_WRITEBUF_SIZE];
+    static int nbufs = 0;
+    MPSC_NODE* qnode;
 
-                if (node == bb_list->mlist_first)
-                {
+    while ((qnode = mpsc_queue_pop(&log_new_buffers)))
+    {
+        logbuf_t* lb = ILIST_ENTRY(qnode, logbuf_t, lb_qnode);
+        ilist_push_back(&log_buffers, &lb->lb_node);
+        nbufs++;
+    }
 
-                    if ((bb_list->mlist_nodecount > 1) && (node != bb_list->mlist_last))
-                    {
-                        bb_list->mlist_last->mlnode_next = bb_list->mlist_first;
-                        bb_list->mlist_first = bb_list->mlist_first->mlnode_next;
-                        bb_list->mlist_last->mlnode_next->mlnode_next = NULL;
-                        bb_list->mlist_last = bb_list->mlist_last->mlnode_next;
-                    }
+    logbuf_t* bufs[nbufs + 1];
+    uint64_t heads[nbufs + 1];
+    int dropped = 0;
+    int n = 0;
 
-                    ss_dassert(node == bb_list->mlist_last);
+    for (ILIST_NODE* node = ilist_first(&log_buffers); node;
+         node = ilist_next(&log_buffers, node))
+    {
+        logbuf_t* lb = ILIST_ENTRY(node, logbuf_t, lb_node);
+        bufs[n] = lb;
+        heads[n] = __atomic_load_n(&lb->lb_head, __ATOMIC_ACQUIRE);
+        dropped += __atomic_exchange_n(&lb->lb_dropped, 0, __ATOMIC_SEQ_CST);
+        n++;
+    }
 
-                    simple_mutex_unlock(&bb_list->mlist_mutex);
-                    simple_mutex_lock(&bb->bb_mutex, true);
+    size_t used = 0;
+    int err = 0;
 
-                    bb->bb_state = BB_READY;
+    while (err == 0)
+    {
+        logbuf_t* next = NULL;
+        logrec_t* rec = NULL;
 
-                    simple_mutex_unlock(&bb->bb_mutex);
-                    simple_mutex_lock(&bb_list->mlist_mutex, true);
-                    node = bb_list->mlist_first;
-                }
-                else
-                {
-                    if (node->mlnode_next)
-                    {
-                        node = node->mlnode_next;
-                    }
-                    else
-                    {
-                        node = bb_list->mlist_first;
-                    }
-                    continue;
-                }
+        for (int i = 0; i < n; i++)
+        {
+            logrec_t* r = logbuf_peek(bufs[i], heads[i]);
 
-            }
-            else if (bb->bb_state == BB_READY)
+            if (r && (rec == NULL || r->lr_stamp < rec->lr_stamp))
             {
-                /**
-                 * There is space for new log string.
-                 */
-                break;
+                rec = r;
+                next = bufs[i];
             }
-        } /** while (true) */
-    }
-    else
-    {
-
-        /**
-         * Create the first block buffer to logfile's blockbuf list.
-         */
+        }
 
-        if ((bb = blockbuf_init()) == NULL)
+        if (rec == NULL)
         {
-            return NULL;
+            break;
         }
 
-        CHK_BLOCKBUF(bb);
-
-        /** Lock buffer */
-        simple_mutex_lock(&bb->bb_mutex, true);
-        /**
-         * Increase version to odd to mark list update active update.
-         */
-        bb_list->mlist_versno += 1;
-        ss_dassert(bb_list->mlist_versno % 2 == 1);
-
-        ss_debug(succ = ) mlist_add_data_nomutex(bb_list, bb);
-        ss_dassert(succ);
-
-        /**
-         * Increase version to even to mark completion of update.
-         */
-        bb_list->mlist_versno += 1;
-        ss_dassert(bb_list->mlist_versno % 2 == 0);
-
-        /** Unlock list */
-        simple_mutex_unlock(&bb_list->mlist_mutex);
-    } /* if (bb_list->mlist_nodecount > 0) */
-
-    ss_dassert(pos == NULL);
-    ss_dassert(!(bb->bb_state == BB_FULL || bb->bb_buf_left < str_len));
-    ss_dassert(bb_list->mlist_nodecount <= bb_list->mlist_nodecount_max);
-
-    /**
-     * Registration to blockbuf adds reference for the write operation.
-     * It indicates that client has allocated space from the buffer,
-     * but not written yet. As long as refcount > 0 buffer can't be
-     * written to disk.
-     */
-    blockbuf_register(bb);
-    *p_bb = bb;
-    /**
-     * At this point list mutex is held and bb points to a node with
-     * enough space available. pos is not yet set.
-     */
-    pos = &bb->bb_buf[bb->bb_buf_used];
-    bb->bb_buf_used += str_len;
-    bb->bb_buf_left -= str_len;
-
-    ss_dassert((pos >= &bb->bb_buf[0]) && (pos <= &bb->bb_buf[MAX_LOGSTRLEN - str_len]));
-
-    /** read checkmark */
-    /** TODO: add buffer overflow checkmark
-        chk_val = (int)bb->bb_buf[bb->bb_buf_used-count_len];
-        ss_dassert(chk_val == bb->bb_strcount);
-    */
-
-    /** TODO : write next checkmark
-        bb->bb_strcount += 1;
-        memcpy(&bb->bb_buf[bb->bb_buf_used], &bb->bb_strcount, count_len);
-        bb->bb_buf_used += count_len;
-        bb->bb_buf_left -= count_len;
-    */
-
-    /**
-     * If flush flag is set, set buffer full. As a consequence, no-one
-     * can write to it before it is flushed to disk.
-     */
-    bb->bb_state = (flush == true ? BB_FULL : bb->bb_state);
-
-    /** Unlock buffer */
-    simple_mutex_unlock(&bb->bb_mutex);
-    return pos;
-}
+        if (used + rec->lr_len > sizeof(writebuf))
+        {
+            err = skygw_file_write(file, writebuf, used, false);
+            used = 0;
+        }
 
-static void blockbuf_node_done(void* bb_data)
-{
-    blockbuf_t* bb = (blockbuf_t *)bb_data;
-    simple_mutex_done(&bb->bb_mutex);
-}
+        memcpy(writebuf + used, rec + 1, rec->lr_len);
+        used += rec->lr_len;
+        __atomic_store_n(&next->lb_tail, next->lb_tail + LOGREC_SIZE(rec->lr_len), __ATOMIC_RELEASE);
+    }
 
+    if (err == 0 && dropped > 0)
+    {
+        if (used + MAX_PREFIXLEN > sizeof(writebuf))
+        {
+            err = skygw_file_write(file, writebuf, used, false);
+            used = 0;
+        }
 
-static blockbuf_t* blockbuf_init()
-{
-    blockbuf_t* bb;
+        used += snprint_timestamp(writebuf + used, sizeof(writebuf) - used);
+        used += snprintf(writebuf + used, sizeof(writebuf) - used,
+                         "warning: %d log messages were dropped because "
+                         "the log buffer of a thread was full.\n", dropped);
+    }
 
-    if ((bb = (blockbuf_t *) calloc(1, sizeof (blockbuf_t))))
+    if (err == 0 && (used > 0 || flush))
     {
-#if defined(SS_DEBUG)
-        bb->bb_chk_top = CHK_NUM_BLOCKBUF;
-        bb->bb_chk_tail = CHK_NUM_BLOCKBUF;
-#endif
-        simple_mutex_init(&bb->bb_mutex, "Blockbuf mutex");
-        bb->bb_buf_left = MAX_LOGSTRLEN;
-        bb->bb_buf_size = MAX_LOGSTRLEN;
-#if defined(SS_LOG_DEBUG)
-        sprintf(bb->bb_buf, "[block:%d]", atomic_add(&block_start_index, 1));
-        bb->bb_buf_used += strlen(bb->bb_buf);
-        bb->bb_buf_left -= strlen(bb->bb_buf);
-#endif
-        CHK_BLOCKBUF(bb);
+        err = skygw_file_write(file, writebuf, used, flush);
     }
-    else
+
+    /** Free the emptied buffers of exited threads */
+    for (ILIST_NODE* node = ilist_first(&log_buffers); node;)
     {
-        fprintf(stderr, "Error: Memory allocation failed when initializing log manager block buffers.");
+        logbuf_t* lb = ILIST_ENTRY(node, logbuf_t, lb_node);
+        node = ilist_next(&log_buffers, node);
+
+        if (__atomic_load_n(&lb->lb_orphan, __ATOMIC_ACQUIRE) &&
+            lb->lb_tail == __atomic_load_n(&lb->lb_head, __ATOMIC_ACQUIRE))
+        {
+            ilist_remove(&lb->lb_node);
+            free(lb);
+            nbufs--;
+        }
     }
-    return bb;
+
+    return err;
 }
 
 /**
@@ -1193,13 +1169,27 @@ static int log_write(int            priority,
  * @return
  *
  *
- * @details Link count modify is protected by mutex.
+ * @details Link count is modified atomically. The mutex is only taken if
+ * the log manager is not running.
  *
  */
 static bool logmanager_register(bool writep)
 {
     bool succ = true;
 
+    /**
+     * Fast path: the link is added first so that mxs_log_finish, which
+     * clears lm_running before waiting for the links to go away, either
+     * sees the link or is seen here.
+     */
+    atomic_add(&lm_nlinks, 1);
+
+    if (__atomic_load_n(&lm_running, __ATOMIC_SEQ_CST))
+    {
+        return true;
+    }
+
+    atomic_add(&lm_nlinks, -1);
     acquire_lock(&lmlock);
 
     if (lm == NULL || !lm->lm_enabled)
@@ -1241,7 +1231,7 @@ static bool logmanager_register(bool writep)
     /** if logmanager existed or was succesfully restarted, increase link */
     if (succ)
     {
-        lm->lm_nlinks += 1;
+        atomic_add(&lm_nlinks, 1);
     }
 
 return_succ:
@@ -1264,17 +1254,13 @@ return_succ:
  * @return
  *
  *
- * @details Link count modify is protected by mutex.
+ * @details Link count is modified atomically.
  *
  */
 static void logmanager_unregister(void)
 {
-    acquire_lock(&lmlock);
-
-    lm->lm_nlinks -= 1;
-    ss_dassert(lm->lm_nlinks >= 0);
-
-    release_lock(&lmlock);
+    ss_debug(int nlinks = ) atomic_add(&lm_nlinks, -1);
+    ss_dassert(nlinks > 0);
 }
 
 
@@ -1904,23 +1890,6 @@ static bool logfile_init(logfile_t*    logfile,
     {
         goto return_with_succ;
     }
-    /**
-     * Create a block buffer list for log file. Clients' writes go to buffers
-     * from where separate log flusher thread writes them to disk.
-     */
-    if (mlist_init(&logfile->lf_blockbuf_list,
-                   NULL,
-                   strdup("logfile block buffer list"),
-                   blockbuf_node_done,
-                   MAXNBLOCKBUFS) == NULL)
-    {
-        ss_dfprintf(stderr,
-                    "*\n* Error : Initializing buffers for log files "
-                    "failed.");
-        logfile_free_memory(logfile);
-        goto return_with_succ;
-    }
-
     succ = true;
     logfile->lf_state = RUN;
     CHK_LOGFILE(logfile);
@@ -1962,11 +1931,6 @@ static void logfile_done(logfile_t* lf)
             ss_dassert(lf->lf_npending_writes == 0);
         /** fallthrough */
         case INIT:
-            /** Test if list is initialized before freeing it */
-            if (lf->lf_blockbuf_list.mlist_versno != 0)
-            {
-                mlist_done(&lf->lf_blockbuf_list);
-            }
             logfile_free_memory(lf);
             lf->lf_state = DONE;
         /** fallthrough */
@@ -2123,92 +2087,24 @@ static bool thr_flush_file(logmanager_t *lm, filewriter_t *fwr)
         }
         return true;
     }
-    /**
-     * get logfile's block buffer list
-     */
-    mlist_t *bb_list = &lf->lf_blockbuf_list;
-#if defined(SS_DEBUG)
-    simple_mutex_lock(&bb_list->mlist_mutex, true);
-    CHK_MLIST(bb_list);
-    simple_mutex_unlock(&bb_list->mlist_mutex);
-#endif
-    mlist_node_t *node = bb_list->mlist_first;
+    /** Allow log clients to wake up the file writer again */
+    __atomic_store_n(&log_wakeup_pending, 0, __ATOMIC_SEQ_CST);
 
-    while (node != NULL)
-    {
-        int err = 0;
+    int err = logbufs_write(file, flush_logfile || do_flushall);
 
-        CHK_MLIST_NODE(node);
-        blockbuf_t *bb = (blockbuf_t *)node->mlnode_data;
-        CHK_BLOCKBUF(bb);
-
-        /** Lock block buffer */
-        simple_mutex_lock(&bb->bb_mutex, true);
-
-        blockbuf_state_t flush_blockbuf = bb->bb_state;
-
-        if (bb->bb_buf_used != 0 &&
-            ((flush_blockbuf == BB_FULL) || flush_logfile || do_flushall))
-        {
-            /**
-             * buffer is at least half-full
-             * -> write to disk
-             */
-            while (bb->bb_refcount > 0)
-            {
-                simple_mutex_unlock(&bb->bb_mutex);
-                simple_mutex_lock(&bb->bb_mutex, true);
-            }
-            err = skygw_file_write(file,
-                                   (void *)bb->bb_buf,
-                                   bb->bb_buf_used,
-                                   (flush_logfile || do_flushall));
-            if (err)
-            {
-                // TODO: Log this to syslog.
-                char errbuf[STRERROR_BUFLEN];
-                fprintf(stderr,
-                        "Error : Writing to the log-file %s failed due to (%d, %s). "
-                        "Disabling writing to the log.",
-                        lf->lf_full_file_name,
-                        err,
-                        strerror_r(err, errbuf, sizeof(errbuf)));
-
-                mxs_log_set_maxlog_enabled(false);
-            }
-            /**
-             * Reset buffer's counters and mark
-             * not full.
-             */
-            bb->bb_buf_left = bb->bb_buf_size;
-            bb->bb_buf_used = 0;
-            memset(bb->bb_buf, 0, bb->bb_buf_size);
-            bb->bb_state = BB_CLEARED;
-#if defined(SS_LOG_DEBUG)
-            sprintf(bb->bb_buf, "[block:%d]", atomic_add(&block_start_index, 1));
-            bb->bb_buf_used += strlen(bb->bb_buf);
-            bb->bb_buf_left -= strlen(bb->bb_buf);
-#endif
-
-        }
-        /** Release lock to block buffer */
-        simple_mutex_unlock(&bb->bb_mutex);
-
-        size_t vn1;
-        size_t vn2;
-        /** Consistent lock-free read on the list */
-        do
-        {
-            while ((vn1 = bb_list->mlist_versno) % 2 != 0)
-            {
-                continue;
-            }
-            node = node->mlnode_next;
-            vn2 = bb_list->mlist_versno;
-        }
-        while (vn1 != vn2 && node);
+    if (err)
+    {
+        // TODO: Log this to syslog.
+        char errbuf[STRERROR_BUFLEN];
+        fprintf(stderr,
+                "Error : Writing to the log-file %s failed due to (%d, %s). "
+                "Disabling writing to the log.",
+                lf->lf_full_file_name,
+                err,
+                strerror_r(err, errbuf, sizeof(errbuf)));
 
-    } /* while (node != NULL) */
+        mxs_log_set_maxlog_enabled(false);
+    }
 
     /**
      * Writer's exit flag was set after checking it.
@@ -2229,7 +2125,7 @@ static bool thr_flush_file(logmanager_t *lm, filewriter_t *fwr)
 }
 
 /**
- * @node Writes block buffers of logfiles to physical log files on disk.
+ * @node Writes the log buffers of the threads to the log file on disk.
  *
  * Parameters:
  * @param data - thread context, skygw_thread_t
@@ -2238,38 +2134,21 @@ static bool thr_flush_file(logmanager_t *lm, filewriter_t *fwr)
  * @return
  *
  *
- * @details Waits until receives wake-up message. Scans through block buffer
- * lists of each logfile object.
- *
- * Block buffer is written to log file if
- * 1. bb_state == true,
- * 2. logfile object's lf_flushflag == true, or
- * 3. skygw_thread_must_exit returns true.
- *
- * Log file is flushed (fsync'd) in cases #2 and #3.
- *
- * Concurrency control : block buffer is accessed by file writer (this) and
- * log clients. File writer reads and sets each logfile object's flushflag
- * with spinlock. Another protected section is when block buffer's metadata is
- * read, and optionally the write operation.
- *
- * When block buffer is marked full, logfile's flushflag is set, other
- * log clients don't try to access buffer(s). There may, however, be
- * active writes, on the block in parallel with file writer operations.
- * Each active write corresponds to bb_refcounter values.
- * On the other hand, file writer doesn't process the block buffer before
- * its refcount is zero.
- *
- * Every log file obj. has its own block buffer (linked) list.
- * List is accessed by log clients, which add nodes if necessary, and
- * by file writer which traverses the list and accesses block buffers
- * included in list nodes.
- * List modifications are protected with version numbers.
- * Before
- modification, version is increased by one to be odd. After the
- * completion, it is increased again to even. List can be read only when
- * version is even and read is consistent only if version hasn't changed
- * during the read.
+ * @details Waits until receives wake-up message or LOG_WRITE_INTERVAL
+ * milliseconds have passed and writes the messages in the log buffers of
+ * the threads to the log file.
+ *
+ * Log clients wake the file writer up when a message must be flushed or
+ * when their buffer is half full. The log file is flushed (fsync'd) if
+ * logfile object's lf_flushflag == true or skygw_thread_must_exit returns
+ * true.
+ *
+ * Concurrency control : every thread has its own log buffer to which only
+ * it writes and from which only the file writer reads. The write and read
+ * offsets are updated atomically, so neither side takes a lock. The list of
+ * buffers is only added to by log clients and only removed from by the file
+ * writer. The logfile object's flushflag and rotateflag are read and set
+ * with spinlock.
  */
 static void* thr_filewriter_fun(void* data)
 {
@@ -2286,10 +2165,10 @@ static void* thr_filewriter_fun(void* data)
     while (!skygw_thread_must_exit(thr))
     {
         /**
-         * Wait until new log arrival message appears.
-         * Reset message to avoid redundant calls.
+         * Wait until new log arrival message appears or it is time to
+         * write the buffered messages. Reset message to avoid redundant calls.
          */
-        skygw_message_wait(fwr->fwr_logmes);
+        skygw_message_wait_timeout(fwr->fwr_logmes, LOG_WRITE_INTERVAL);
         if (skygw_thread_must_exit(thr))
         {
             flushall_logfiles(true);
@@ -2432,6 +2311,31 @@ void flushall_logfiles(bool flush)
  *
  * @param enabled True, if high precision logging should be enabled, false if it should be disabled.
  */
+void mxs_log_set_throttling(const MXS_LOG_THROTTLING* throttling)
+{
+    // No locking; it does not have any real impact, even if the struct
+    // is used right when its values are modified.
+    log_config.throttling = *throttling;
+
+    if (log_config.throttling.count == 0)
+    {
+        MXS_NOTICE("Log throttling has been disabled.");
+    }
+    else
+    {
+        MXS_NOTICE("A message that is logged %lu times in %lu milliseconds, "
+                   "will be suppressed for %lu milliseconds.",
+                   log_config.throttling.count,
+                   log_config.throttling.window_ms,
+                   log_config.throttling.suppress_ms);
+    }
+}
+
+void mxs_log_get_throttling(MXS_LOG_THROTTLING* throttling)
+{
+    *throttling = log_config.throttling;
+}
+
 void mxs_log_set_highprecision_enabled(bool enabled)
 {
     log_config.do_highprecision = enabled;
@@ -2733,6 +2637,104 @@ static enum log_flush priority_to_flush(int priority)
     }
 }
 
+/**
+ * Find the throttling state of a call site
+ *
+ * @param file The file of the call site
+ * @param line The line of the call site
+ *
+ * @return The throttling state or NULL if no free slot was found
+ */
+static log_throttle_t* log_throttle_get(const char* file, int line)
+{
+    uint64_t key = (uint64_t)(uintptr_t)file ^ ((uint64_t)line << 48);
+    key = key ? key : 1;
+
+    uint64_t hash = key * 0x9e3779b97f4a7c15ULL;
+    size_t slot = (hash >> 32) & (LOG_THROTTLE_SLOTS - 1);
+
+    for (int i = 0; i < LOG_THROTTLE_PROBES; i++)
+    {
+        log_throttle_t* lt = &log_throttles[(slot + i) & (LOG_THROTTLE_SLOTS - 1)];
+        uint64_t current = __atomic_load_n(&lt->lt_key, __ATOMIC_ACQUIRE);
+
+        if (current == key)
+        {
+            return lt;
+        }
+
+        if (current == 0 &&
+            (__atomic_compare_exchange_n(&lt->lt_key, &current, key, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || current == key))
+        {
+            return lt;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Check whether a message should be suppressed
+ *
+ * @param file       The file of the call site
+ * @param line       The line of the call site
+ * @param throttling The throttling configuration
+ * @param suppressed Set to the number of messages suppressed since the
+ *                   previous one was logged
+ *
+ * @return What to do with the message
+ */
+static log_throttle_action_t log_throttle_check(const char* file, int line,
+                                                const MXS_LOG_THROTTLING* throttling,
+                                                int* suppressed)
+{
+    log_throttle_t* lt = log_throttle_get(file, line);
+    *suppressed = 0;
+
+    if (lt == NULL)
+    {
+        return LOG_THROTTLE_LOG;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    int64_t now = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+    if (now < __atomic_load_n(&lt->lt_suppress_end, __ATOMIC_RELAXED))
+    {
+        atomic_add(&lt->lt_suppressed, 1);
+        return LOG_THROTTLE_SUPPRESS;
+    }
+
+    int64_t start = __atomic_load_n(&lt->lt_window_start, __ATOMIC_RELAXED);
+
+    if (now - start >= (int64_t)throttling->window_ms &&
+        __atomic_compare_exchange_n(&lt->lt_window_start, &start, now, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        __atomic_store_n(&lt->lt_count, 0, __ATOMIC_RELAXED);
+    }
+
+    size_t count = atomic_add(&lt->lt_count, 1) + 1;
+
+    if (count > throttling->count)
+    {
+        atomic_add(&lt->lt_suppressed, 1);
+        return LOG_THROTTLE_SUPPRESS;
+    }
+
+    *suppressed = __atomic_exchange_n(&lt->lt_suppressed, 0, __ATOMIC_RELAXED);
+
+    if (count == throttling->count)
+    {
+        __atomic_store_n(&lt->lt_suppress_end, now + throttling->suppress_ms, __ATOMIC_RELAXED);
+        return LOG_THROTTLE_LOG_LAST;
+    }
+
+    return LOG_THROTTLE_LOG;
+}
+
 /**
  * Log a message of a particular priority.
  *
@@ -2753,7 +2755,17 @@ int mxs_log_message(int priority,
 
     if ((priority & ~LOG_PRIMASK) == 0) // Check that the priority is ok,
     {
-        if (MXS_LOG_PRIORITY_IS_ENABLED(priority))
+        MXS_LOG_THROTTLING throttling = log_config.throttling;
+        log_throttle_action_t action = LOG_THROTTLE_LOG;
+        int suppressed = 0;
+
+        if (throttling.count != 0 &&
+            (priority == LOG_ERR || priority == LOG_WARNING || priority == LOG_NOTICE))
+        {
+            action = log_throttle_check(file, line, &throttling, &suppressed);
+        }
+
+        if (MXS_LOG_PRIORITY_IS_ENABLED(priority) && action != LOG_THROTTLE_SUPPRESS)
         {
             va_list valist;
 
@@ -2786,14 +2798,30 @@ int mxs_log_message(int priority,
                         break;
                 }
 
-                int buffer_len = prefix.len + augmentation_len + message_len + 1; // Trailing NULL
+                char suffix[128] = "";
+                int suffix_len = 0;
+
+                if (suppressed > 0)
+                {
+                    suffix_len += snprintf(suffix, sizeof(suffix),
+                                           " (%d similar messages were suppressed)", suppressed);
+                }
+
+                if (action == LOG_THROTTLE_LOG_LAST)
+                {
+                    suffix_len += snprintf(suffix + suffix_len, sizeof(suffix) - suffix_len,
+                                           " (subsequent similar messages suppressed for %lu milliseconds)",
+                                           throttling.suppress_ms);
+                }
+
+                int buffer_len = prefix.len + augmentation_len + message_len + suffix_len + 1; // Trailing NULL
 
                 if (buffer_len > MAX_LOGSTRLEN)
                 {
                     message_len -= (buffer_len - MAX_LOGSTRLEN);
                     buffer_len = MAX_LOGSTRLEN;
 
-                    assert(prefix.len + augmentation_len + message_len + 1 == buffer_len);
+                    assert(prefix.len + augmentation_len + message_len + suffix_len + 1 == buffer_len);
                 }
 
                 char buffer[buffer_len];
@@ -2825,6 +2853,10 @@ int mxs_log_message(int priority,
                 vsnprintf(message_text, message_len + 1, format, valist);
                 va_end(valist);
 
+                strcpy(message_text + message_len, suffix);
+
+                MXS_PROBE2(log_message, priority, message_text);
+
                 enum log_flush flush = priority_to_flush(priority);
 
                 err = log_write(priority, file, line, function, prefix.len, buffer_len, buffer, flush);
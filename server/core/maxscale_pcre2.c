@@ -25,6 +25,94 @@
  */
 
 #include <maxscale_pcre2.h>
+#include <platform.h>
+
+/** Initial and maximum size of the JIT stack of a thread */
+#define MXS_PCRE2_JIT_STACK_START 32768
+#define MXS_PCRE2_JIT_STACK_MAX   524288
+
+/** The matching resources of the calling thread */
+static thread_local pcre2_match_data *thread_mdata = NULL;
+static thread_local uint32_t thread_mdata_size = 0;
+static thread_local pcre2_match_context *thread_mcontext = NULL;
+static thread_local pcre2_jit_stack *thread_jit_stack = NULL;
+
+/**
+ * JIT compile a pattern. If the PCRE2 library has no JIT support or the
+ * compilation fails, the pattern is still matched by the interpreter.
+ *
+ * @param re Compiled pattern
+ * @return True if the pattern was JIT compiled
+ */
+bool mxs_pcre2_jit_compile(pcre2_code *re)
+{
+    return pcre2_jit_compile(re, PCRE2_JIT_COMPLETE) == 0;
+}
+
+/**
+ * Get the matching data of the calling thread. The data is reused by all
+ * matches made by the thread, so it is only valid until the next call.
+ *
+ * @param ovector_size Number of ovector pairs needed, the capture count of
+ * the pattern plus one
+ * @return The matching data or NULL if memory allocation failed
+ */
+pcre2_match_data* mxs_pcre2_thread_match_data(uint32_t ovector_size)
+{
+    if (thread_mdata_size < ovector_size)
+    {
+        pcre2_match_data *mdata = pcre2_match_data_create(ovector_size, NULL);
+
+        if (mdata == NULL)
+        {
+            return NULL;
+        }
+
+        if (thread_mdata)
+        {
+            pcre2_match_data_free(thread_mdata);
+        }
+
+        thread_mdata = mdata;
+        thread_mdata_size = ovector_size;
+    }
+
+    return thread_mdata;
+}
+
+/**
+ * Get the matching context of the calling thread. The context has a JIT
+ * stack of the thread so that the JIT compiled patterns do not run out of
+ * the default stack of 32 kilobytes.
+ *
+ * @return The matching context or NULL if it could not be created, in which
+ * case the default context is used
+ */
+pcre2_match_context* mxs_pcre2_thread_match_context()
+{
+    if (thread_mcontext == NULL &&
+        (thread_mcontext = pcre2_match_context_create(NULL)) != NULL &&
+        (thread_jit_stack = pcre2_jit_stack_create(MXS_PCRE2_JIT_STACK_START,
+                                                   MXS_PCRE2_JIT_STACK_MAX, NULL)) != NULL)
+    {
+        pcre2_jit_stack_assign(thread_mcontext, NULL, thread_jit_stack);
+    }
+
+    return thread_mcontext;
+}
+
+/**
+ * Get the ovector size a pattern needs
+ *
+ * @param re Compiled pattern
+ * @return The capture count of the pattern plus one
+ */
+static uint32_t ovector_size(const pcre2_code *re)
+{
+    uint32_t captures = 0;
+    pcre2_pattern_info(re, PCRE2_INFO_CAPTURECOUNT, &captures);
+    return captures + 1;
+}
 
 /**
  * Utility wrapper for PCRE2 library function call pcre2_substitute.
@@ -47,12 +135,13 @@ mxs_pcre2_result_t mxs_pcre2_substitute(pcre2_code *re, const char *subject, con
 {
     int rc;
     mxs_pcre2_result_t rval = MXS_PCRE2_ERROR;
-    pcre2_match_data *mdata = pcre2_match_data_create_from_pattern(re, NULL);
+    pcre2_match_data *mdata = mxs_pcre2_thread_match_data(ovector_size(re));
+    pcre2_match_context *mcontext = mxs_pcre2_thread_match_context();
 
     if (mdata)
     {
         while ((rc = pcre2_substitute(re, (PCRE2_SPTR) subject, PCRE2_ZERO_TERMINATED, 0,
-                                      PCRE2_SUBSTITUTE_GLOBAL, mdata, NULL,
+                                      PCRE2_SUBSTITUTE_GLOBAL, mdata, mcontext,
                                       (PCRE2_SPTR) replace, PCRE2_ZERO_TERMINATED,
                                       (PCRE2_UCHAR*) *dest, size)) == PCRE2_ERROR_NOMEMORY)
         {
@@ -73,7 +162,6 @@ mxs_pcre2_result_t mxs_pcre2_substitute(pcre2_code *re, const char *subject, con
         {
             rval = MXS_PCRE2_NOMATCH;
         }
-        pcre2_match_data_free(mdata);
     }
 
     return rval;
@@ -103,7 +191,7 @@ mxs_pcre2_result_t mxs_pcre2_simple_match(const char* pattern, const char* subje
                                    options, &err, &erroff, NULL);
     if (re)
     {
-        pcre2_match_data *mdata = pcre2_match_data_create_from_pattern(re, NULL);
+        pcre2_match_data *mdata = mxs_pcre2_thread_match_data(ovector_size(re));
         if (mdata)
         {
             int rc = pcre2_match(re, (PCRE2_SPTR) subject, PCRE2_ZERO_TERMINATED,
@@ -118,7 +206,6 @@ mxs_pcre2_result_t mxs_pcre2_simple_match(const char* pattern, const char* subje
                  * pcre2_match will never return 0 */
                 rval = MXS_PCRE2_MATCH;
             }
-            pcre2_match_data_free(mdata);
         }
         else
         {
@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file maxtrace.c - Decode the binary event trace files of maxscale
+ *
+ * The records of all given files are merged in time order and printed either
+ * as text or as Chrome trace event JSON, which can be opened in
+ * chrome://tracing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <trace.h>
+
+/** A record with the information of the file it came from */
+typedef struct
+{
+    TRACE_RECORD rec;
+    uint64_t     realtime; /**< CLOCK_REALTIME of the record in nanoseconds */
+    uint64_t     thread;
+} trace_entry_t;
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-j] FILE...\n"
+            "\n"
+            "Decode maxscale trace files.\n"
+            "\n"
+            "  -j  Print the events as Chrome trace JSON instead of text\n",
+            name);
+}
+
+/**
+ * Read the records of a trace file. Only the records that are still in the
+ * ring are read, the oldest first.
+ *
+ * @param fname   The file to read
+ * @param entries The entries, reallocated to fit the new ones
+ * @param n       The number of entries, increased by the number read
+ * @return True if the file was read
+ */
+static bool read_trace_file(const char *fname, trace_entry_t **entries, size_t *n)
+{
+    FILE *file = fopen(fname, "rb");
+
+    if (file == NULL)
+    {
+        perror(fname);
+        return false;
+    }
+
+    TRACE_FILE_HEADER hdr;
+    bool rval = false;
+
+    if (fread(&hdr, sizeof(hdr), 1, file) != 1 ||
+        memcmp(hdr.th_magic, TRACE_MAGIC, sizeof(hdr.th_magic)) != 0)
+    {
+        fprintf(stderr, "%s: Not a trace file.\n", fname);
+    }
+    else if (hdr.th_version != TRACE_VERSION || hdr.th_record_size != sizeof(TRACE_RECORD) ||
+             hdr.th_records == 0)
+    {
+        fprintf(stderr, "%s: Unsupported trace file version %u.\n", fname, hdr.th_version);
+    }
+    else
+    {
+        uint64_t count = hdr.th_written < hdr.th_records ? hdr.th_written : hdr.th_records;
+        trace_entry_t *e = realloc(*entries, (*n + count) * sizeof(trace_entry_t));
+
+        if (e == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed.\n");
+        }
+        else
+        {
+            *entries = e;
+            rval = true;
+
+            for (uint64_t i = hdr.th_written - count; i < hdr.th_written; i++)
+            {
+                trace_entry_t *entry = &e[*n];
+                long offset = sizeof(hdr) + (i % hdr.th_records) * sizeof(TRACE_RECORD);
+
+                if (fseek(file, offset, SEEK_SET) != 0 ||
+                    fread(&entry->rec, sizeof(entry->rec), 1, file) != 1)
+                {
+                    fprintf(stderr, "%s: Failed to read record %lu.\n", fname, i);
+                    rval = false;
+                    break;
+                }
+
+                entry->realtime = entry->rec.tr_time - hdr.th_mono_start + hdr.th_real_start;
+                entry->thread = hdr.th_thread;
+                (*n)++;
+            }
+        }
+    }
+
+    fclose(file);
+    return rval;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    const trace_entry_t *ea = (const trace_entry_t*)a;
+    const trace_entry_t *eb = (const trace_entry_t*)b;
+
+    return ea->realtime < eb->realtime ? -1 : ea->realtime > eb->realtime ? 1 : 0;
+}
+
+static void print_text(trace_entry_t *entries, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        trace_entry_t *e = &entries[i];
+        time_t secs = e->realtime / 1000000000;
+        struct tm tm;
+        char timestr[32];
+
+        localtime_r(&secs, &tm);
+        strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", &tm);
+
+        const char *begin_end = "";
+        char phase = trace_event_phase(e->rec.tr_event);
+
+        if (phase == 'B')
+        {
+            begin_end = " begin";
+        }
+        else if (phase == 'E')
+        {
+            begin_end = " end";
+        }
+
+        printf("%s.%09lu thread %lu session %lu %s%s arg1=%u arg2=%lu\n",
+               timestr, e->realtime % 1000000000, e->thread, e->rec.tr_session,
+               trace_event_name(e->rec.tr_event), begin_end,
+               e->rec.tr_arg1, e->rec.tr_arg2);
+    }
+}
+
+static void print_json(trace_entry_t *entries, size_t n)
+{
+    uint64_t start = n > 0 ? entries[0].realtime : 0;
+
+    printf("{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+
+    for (size_t i = 0; i < n; i++)
+    {
+        trace_entry_t *e = &entries[i];
+        char phase = trace_event_phase(e->rec.tr_event);
+
+        printf("{\"name\": \"%s\", \"ph\": \"%c\", %s\"ts\": %.3f, \"pid\": 1, \"tid\": %lu, "
+               "\"args\": {\"session\": %lu, \"arg1\": %u, \"arg2\": %lu}}%s\n",
+               trace_event_name(e->rec.tr_event), phase,
+               phase == 'i' ? "\"s\": \"t\", " : "",
+               (e->realtime - start) / 1000.0, e->thread,
+               e->rec.tr_session, e->rec.tr_arg1, e->rec.tr_arg2,
+               i + 1 < n ? "," : "");
+    }
+
+    printf("]}\n");
+}
+
+int main(int argc, char **argv)
+{
+    bool json = false;
+    int c;
+
+    while ((c = getopt(argc, argv, "jh")) != -1)
+    {
+        switch (c)
+        {
+            case 'j':
+                json = true;
+                break;
+
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind >= argc)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    trace_entry_t *entries = NULL;
+    size_t n = 0;
+    int rval = 0;
+
+    for (int i = optind; i < argc; i++)
+    {
+        if (!read_trace_file(argv[i], &entries, &n))
+        {
+            rval = 1;
+        }
+    }
+
+    qsort(entries, n, sizeof(trace_entry_t), compare_entries);
+
+    if (json)
+    {
+        print_json(entries, n);
+    }
+    else
+    {
+        print_text(entries, n);
+    }
+
+    free(entries);
+    return rval;
+}
@@ -21,16 +21,69 @@
  * 26/09/14     Mark Riddoch    Initial implementation
  *
  * @endverbatim
+ *
+ * Each thread that logs to a memory log has a ring of its own, the items are
+ * written to it without locks or atomic read-modify-write operations. When
+ * a thread has written a batch of size items the flusher thread is woken up
+ * and appends the complete batches of all threads to the file. If the
+ * flusher falls behind by more than MEMLOG_RING_BATCHES batches, the items
+ * that do not fit are dropped and counted instead of making the thread wait.
+ *
+ * A log with the MLNOAUTOFLUSH flag is only written to the file when it is
+ * flushed explicitly and it then holds the last size items of each thread.
  */
 #include <memlog.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <semaphore.h>
+#include <platform.h>
+#include <thread.h>
+#include <atomic.h>
+#include <log_manager.h>
 
 static MEMLOG *memlogs = NULL;
 static SPINLOCK memlock = SPINLOCK_INIT;
 
+/** Wakes up the flusher thread when a batch is complete */
+static sem_t flusher_sem;
+static bool flusher_started = false;
+
+/** The slot of the calling thread in the rings of the logs, -1 if not known */
+static thread_local int memlog_thread = -1;
+static int memlog_n_threads = 0;
+
+static void memlog_flusher(void *data);
+static void memlog_flush_log(MEMLOG *log, bool all);
+
+/**
+ * Start the flusher thread if it is not yet running
+ */
+static void memlog_start_flusher()
+{
+    static SPINLOCK lock = SPINLOCK_INIT;
+
+    spinlock_acquire(&lock);
+
+    if (!flusher_started)
+    {
+        THREAD thr;
+        sem_init(&flusher_sem, 0, 0);
+
+        if (thread_start(&thr, memlog_flusher, NULL) == NULL)
+        {
+            MXS_ERROR("Failed to start the thread that flushes the memory logs.");
+        }
+        flusher_started = true;
+    }
+
+    spinlock_release(&lock);
+}
+
 /**
  * Create a new instance of a memory logger.
  *
@@ -45,37 +98,24 @@ memlog_create(char *name, MEMLOGTYPE type, int size)
 {
     MEMLOG *log;
 
-    if ((log = (MEMLOG *)malloc(sizeof(MEMLOG))) == NULL)
+    if (size <= 0 || (log = (MEMLOG *)calloc(1, sizeof(MEMLOG))) == NULL)
     {
         return NULL;
     }
 
-    log->name = strdup(name);
-    spinlock_init(&log->lock);
-    log->type = type;
-    log->offset = 0;
-    log->size = size;
-    log->flags = 0;
-    switch (type)
-    {
-    case ML_INT:
-        log->values = malloc(sizeof(int) * size);
-        break;
-    case ML_LONG:
-        log->values = malloc(sizeof(long) * size);
-        break;
-    case ML_LONGLONG:
-        log->values = malloc(sizeof(long long) * size);
-        break;
-    case ML_STRING:
-        log->values = malloc(sizeof(char *) * size);
-        break;
-    }
-    if (log->values == NULL)
+    if ((log->name = strdup(name)) == NULL)
     {
         free(log);
         return NULL;
     }
+    spinlock_init(&log->lock);
+    log->type = type;
+    log->size = size;
+    log->capacity = size * MEMLOG_RING_BATCHES;
+    log->flags = 0;
+
+    memlog_start_flusher();
+
     spinlock_acquire(&memlock);
     log->next = memlogs;
     memlogs = log;
@@ -94,12 +134,7 @@ memlog_destroy(MEMLOG *log)
 {
     MEMLOG *ptr;
 
-    if ((log->flags & MLNOAUTOFLUSH) == 0)
-    {
-        memlog_flush(log);
-    }
-    free(log->values);
-
+    /** Once the log is off the list the flusher thread no longer sees it */
     spinlock_acquire(&memlock);
     if (memlogs == log)
     {
@@ -118,10 +153,104 @@ memlog_destroy(MEMLOG *log)
         }
     }
     spinlock_release(&memlock);
+
+    if ((log->flags & MLNOAUTOFLUSH) == 0)
+    {
+        memlog_flush(log);
+    }
+
+    for (int i = 0; i < MEMLOG_MAX_THREADS; i++)
+    {
+        if (log->rings[i])
+        {
+            free(log->rings[i]->records);
+            free(log->rings[i]);
+        }
+    }
     free(log->name);
     free(log);
 }
 
+/**
+ * Get the ring of the calling thread, allocating it on the first call
+ *
+ * @param log   The memory logger
+ * @return The ring or NULL if the thread can not have one
+ */
+static MEMLOG_RING *
+memlog_thread_ring(MEMLOG *log)
+{
+    MEMLOG_RING *ring;
+
+    if (memlog_thread == -1)
+    {
+        memlog_thread = atomic_add(&memlog_n_threads, 1);
+    }
+
+    if (memlog_thread >= MEMLOG_MAX_THREADS)
+    {
+        return NULL;
+    }
+
+    if ((ring = log->rings[memlog_thread]) == NULL)
+    {
+        if ((ring = (MEMLOG_RING *)calloc(1, sizeof(MEMLOG_RING))) == NULL)
+        {
+            return NULL;
+        }
+        if ((ring->records = (MEMLOG_RECORD *)malloc(sizeof(MEMLOG_RECORD) * log->capacity)) == NULL)
+        {
+            free(ring);
+            return NULL;
+        }
+        /** Only this thread stores into its slot, the flusher reads it */
+        __atomic_store_n(&log->rings[memlog_thread], ring, __ATOMIC_RELEASE);
+    }
+
+    return ring;
+}
+
+/**
+ * Write an item to the ring of the calling thread
+ *
+ * @param log           The memory logger
+ * @param timestamp     The timestamp of the item
+ * @param id            The identifier of the item
+ * @param value         The value to log
+ */
+static void
+memlog_write(MEMLOG *log, uint64_t timestamp, uint64_t id, long long value)
+{
+    MEMLOG_RING *ring = memlog_thread_ring(log);
+    MEMLOG_RECORD *record;
+    uint64_t head;
+
+    if (ring == NULL)
+    {
+        return;
+    }
+
+    head = ring->head;
+
+    if ((log->flags & MLNOAUTOFLUSH) == 0 &&
+        head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= log->capacity)
+    {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    record = &ring->records[head % log->capacity];
+    record->timestamp = timestamp;
+    record->id = id;
+    record->value = value;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    if ((log->flags & MLNOAUTOFLUSH) == 0 && (head + 1) % log->size == 0)
+    {
+        sem_post(&flusher_sem);
+    }
+}
+
 /**
  * Log a data item to the memory logger
  *
@@ -135,33 +264,65 @@ memlog_log(MEMLOG *log, void *value)
     {
         return;
     }
-    spinlock_acquire(&log->lock);
-    switch (log->type)
+    memlog_write(log, 0, 0, (long long)(intptr_t)value);
+}
+
+/**
+ * Log a structured record to the memory logger. The record is stamped
+ * with the monotonic clock of the system.
+ *
+ * @param log   The memory logger
+ * @param id    The identifier of the record, e.g. the thread or the event
+ * @param value The value to log
+ */
+void
+memlog_record(MEMLOG *log, uint64_t id, long long value)
+{
+    struct timespec ts;
+
+    if (!log)
     {
-    case ML_INT:
-        ((int *)(log->values))[log->offset] = (intptr_t)value;
-        break;
-    case ML_LONG:
-        ((long *)(log->values))[log->offset] = (long)value;
-        break;
-    case ML_LONGLONG:
-        ((long long *)(log->values))[log->offset] = (long long)value;
-        break;
-    case ML_STRING:
-        ((char **)(log->values))[log->offset] = (char *)value;
-        break;
+        return;
     }
-    log->offset++;
-    if (log->offset == log->size)
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    memlog_write(log, (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec, id, value);
+}
+
+/**
+ * The flusher thread, writes the complete batches of the logs to the files
+ *
+ * @param data  Not used
+ */
+static void
+memlog_flusher(void *data)
+{
+    while (true)
     {
-        if ((log->flags & MLNOAUTOFLUSH) == 0)
+        if (sem_wait(&flusher_sem) == -1)
+        {
+            if (errno != EINTR)
+            {
+                thread_millisleep(100);
+            }
+            continue;
+        }
+
+        /** One pass handles all the batches completed so far */
+        while (sem_trywait(&flusher_sem) == 0)
+        {
+            ;
+        }
+
+        spinlock_acquire(&memlock);
+        for (MEMLOG *log = memlogs; log; log = log->next)
         {
-            memlog_flush(log);
+            if ((log->flags & MLNOAUTOFLUSH) == 0)
+            {
+                memlog_flush_log(log, false);
+            }
         }
-        log->offset = 0;
-        log->iflags = MLWRAPPED;
+        spinlock_release(&memlock);
     }
-    spinlock_release(&log->lock);
 }
 
 /**
@@ -177,9 +338,7 @@ memlog_flush_all()
     log = memlogs;
     while (log)
     {
-        spinlock_acquire(&log->lock);
         memlog_flush(log);
-        spinlock_release(&log->lock);
         log = log->next;
     }
     spinlock_release(&memlock);
@@ -198,69 +357,137 @@ memlog_set(MEMLOG *log, unsigned int flags)
 }
 
 /**
- * Flush a memory log to disk
+ * Print one item of a memory log
  *
- * Assumes the the log->lock has been acquired by the caller
- *
- * @param log   The memory log to flush
+ * @param fp            The file
+ * @param type          The type of the log
+ * @param record        The item
  */
-void
-memlog_flush(MEMLOG *log)
+static void
+memlog_print(FILE *fp, MEMLOGTYPE type, MEMLOG_RECORD *record)
 {
-    FILE *fp;
-    int i;
-
-    if ((fp = fopen(log->name, "a")) == NULL)
+    switch (type)
     {
-        return;
+    case ML_INT:
+        fprintf(fp, "%d\n", (int)record->value);
+        break;
+    case ML_LONG:
+        fprintf(fp, "%ld\n", (long)record->value);
+        break;
+    case ML_LONGLONG:
+        fprintf(fp, "%lld\n", record->value);
+        break;
+    case ML_STRING:
+        fprintf(fp, "%s\n", (char *)(intptr_t)record->value);
+        break;
+    case ML_RECORD:
+        fprintf(fp, "%lu %lu %lld\n", record->timestamp, record->id, record->value);
+        break;
     }
-    if ((log->flags & MLNOAUTOFLUSH) && (log->iflags & MLWRAPPED))
+}
+
+/**
+ * Append the items of the rings of a log to its file
+ *
+ * @param log   The memory log
+ * @param all   Flush all items, if false only complete batches are flushed
+ */
+static void
+memlog_flush_log(MEMLOG *log, bool all)
+{
+    FILE *fp = NULL;
+
+    spinlock_acquire(&log->lock);
+    for (int i = 0; i < MEMLOG_MAX_THREADS; i++)
     {
-        for (i = 0; i < log->size; i++)
+        MEMLOG_RING *ring = __atomic_load_n(&log->rings[i], __ATOMIC_ACQUIRE);
+        uint64_t head, tail, n;
+
+        if (ring == NULL)
         {
-            int ind = (i + log->offset) % log->size;
-            switch (log->type)
-            {
-            case ML_INT:
-                fprintf(fp, "%d\n",
-                        ((int *)(log->values))[ind]);
-                break;
-            case ML_LONG:
-                fprintf(fp, "%ld\n",
-                        ((long *)(log->values))[ind]);
-                break;
-            case ML_LONGLONG:
-                fprintf(fp, "%lld\n",
-                        ((long long *)(log->values))[ind]);
-                break;
-            case ML_STRING:
-                fprintf(fp, "%s\n",
-                        ((char **)(log->values))[ind]);
-                break;
-            }
+            continue;
+        }
+
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        tail = ring->tail;
+
+        /** Without automatic flushing the older items have been overwritten */
+        if ((log->flags & MLNOAUTOFLUSH) && head - tail > log->size)
+        {
+            tail = head - log->size;
+        }
+
+        n = head - tail;
+        if (!all)
+        {
+            n -= n % log->size;
+        }
+
+        if (n == 0 || (fp == NULL && (fp = fopen(log->name, "a")) == NULL))
+        {
+            continue;
         }
+
+        for (uint64_t j = tail; j < tail + n; j++)
+        {
+            memlog_print(fp, log->type, &ring->records[j % log->capacity]);
+        }
+        __atomic_store_n(&ring->tail, tail + n, __ATOMIC_RELEASE);
     }
-    else
+    spinlock_release(&log->lock);
+
+    if (fp)
+    {
+        fclose(fp);
+    }
+}
+
+/**
+ * Flush a memory log to disk
+ *
+ * All the items in the rings of the threads are appended to the file.
+ *
+ * @param log   The memory log to flush
+ */
+void
+memlog_flush(MEMLOG *log)
+{
+    memlog_flush_log(log, true);
+}
+
+/**
+ * Flush the complete batches of a memory log now instead of waiting for
+ * the flusher thread to do it
+ *
+ * @param log   The memory log
+ */
+void
+memlog_sync(MEMLOG *log)
+{
+    memlog_flush_log(log, false);
+}
+
+/**
+ * Get the number of items that were dropped because the flushing fell
+ * behind the threads logging the items
+ *
+ * @param log   The memory log
+ * @return The number of dropped items
+ */
+uint64_t
+memlog_dropped(MEMLOG *log)
+{
+    uint64_t dropped = 0;
+
+    for (int i = 0; i < MEMLOG_MAX_THREADS; i++)
     {
-        for (i = 0; i < log->offset; i++)
+        MEMLOG_RING *ring = __atomic_load_n(&log->rings[i], __ATOMIC_ACQUIRE);
+
+        if (ring)
         {
-            switch (log->type)
-            {
-            case ML_INT:
-                fprintf(fp, "%d\n", ((int *)(log->values))[i]);
-                break;
-            case ML_LONG:
-                fprintf(fp, "%ld\n", ((long *)(log->values))[i]);
-                break;
-            case ML_LONGLONG:
-                fprintf(fp, "%lld\n", ((long long *)(log->values))[i]);
-                break;
-            case ML_STRING:
-                fprintf(fp, "%s\n", ((char **)(log->values))[i]);
-                break;
-            }
+            dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
         }
     }
-    log->offset = 0;
-    fclose(fp);
+
+    return dropped;
 }
@@ -0,0 +1,455 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file metrics.c The metrics registry
+ *
+ * The registry is a list of metrics where the metrics of a family are next
+ * to each other. Metrics are only ever inserted, and a metric is fully
+ * initialised before it is linked to the list, so the list can be walked
+ * without holding the lock that serialises the insertions.
+ */
+
+#include <metrics.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <spinlock.h>
+#include <dcb.h>
+#include <log_manager.h>
+#include <skygw_debug.h>
+
+static SPINLOCK metrics_lock = SPINLOCK_INIT;
+static METRIC  *metrics = NULL;
+static METRICS_PRINT_FN printers[METRICS_MAX_PRINTERS];
+static int      n_printers = 0;
+
+static const char *metric_type_name(metric_type_t type)
+{
+    switch (type)
+    {
+    case METRIC_COUNTER:
+        return "counter";
+    case METRIC_GAUGE:
+        return "gauge";
+    case METRIC_HISTOGRAM:
+        return "histogram";
+    default:
+        return "unknown";
+    }
+}
+
+static bool same_labels(const char *a, const char *b)
+{
+    return (a == NULL && b == NULL) || (a && b && strcmp(a, b) == 0);
+}
+
+static void metric_free(METRIC *metric)
+{
+    free(metric->name);
+    free(metric->labels);
+    free(metric->help);
+    ts_stats_free(metric->value);
+
+    for (int i = 0; i <= METRIC_MAX_BUCKETS; i++)
+    {
+        ts_stats_free(metric->buckets[i]);
+    }
+
+    free(metric);
+}
+
+/**
+ * Allocate a metric
+ *
+ * @return The new metric or NULL if memory allocation failed
+ */
+static METRIC *metric_alloc(const char *name, const char *labels, const char *help,
+                            metric_type_t type, int n_bounds)
+{
+    METRIC *metric = calloc(1, sizeof(METRIC));
+
+    if (metric == NULL)
+    {
+        return NULL;
+    }
+
+    metric->type = type;
+    metric->unit = 1.0;
+    metric->n_bounds = n_bounds;
+
+    bool ok = (metric->name = strdup(name)) != NULL &&
+              (labels == NULL || (metric->labels = strdup(labels)) != NULL) &&
+              (metric->help = strdup(help)) != NULL &&
+              (metric->value = ts_stats_alloc()) != NULL;
+
+    for (int i = 0; ok && type == METRIC_HISTOGRAM && i <= n_bounds; i++)
+    {
+        ok = (metric->buckets[i] = ts_stats_alloc()) != NULL;
+    }
+
+    if (!ok)
+    {
+        metric_free(metric);
+        metric = NULL;
+    }
+
+    return metric;
+}
+
+/**
+ * Add a metric to the registry. If a metric with the same name and labels
+ * already exists, the new metric is freed and the existing one is returned.
+ *
+ * @param metric The metric to add or NULL
+ * @return The registered metric or NULL on error
+ */
+static METRIC *metric_register(METRIC *metric)
+{
+    if (metric == NULL)
+    {
+        MXS_ERROR("Memory allocation failed when registering a metric.");
+        return NULL;
+    }
+
+    spinlock_acquire(&metrics_lock);
+
+    METRIC *prev = NULL;
+    METRIC *last = NULL;
+    METRIC *found = NULL;
+
+    for (METRIC *m = metrics; m; m = m->next)
+    {
+        if (strcmp(m->name, metric->name) == 0)
+        {
+            if (same_labels(m->labels, metric->labels))
+            {
+                found = m;
+                break;
+            }
+            prev = m;
+        }
+        last = m;
+    }
+
+    if (found == NULL)
+    {
+        /** Keep the metrics of a family together */
+        if (prev == NULL)
+        {
+            prev = last;
+        }
+
+        if (prev)
+        {
+            metric->next = prev->next;
+            __atomic_store_n(&prev->next, metric, __ATOMIC_RELEASE);
+        }
+        else
+        {
+            __atomic_store_n(&metrics, metric, __ATOMIC_RELEASE);
+        }
+    }
+
+    spinlock_release(&metrics_lock);
+
+    if (found)
+    {
+        if (found->type != metric->type)
+        {
+            MXS_ERROR("Metric '%s' is already registered as a %s.",
+                      found->name, metric_type_name(found->type));
+            found = NULL;
+        }
+
+        metric_free(metric);
+        return found;
+    }
+
+    return metric;
+}
+
+/**
+ * Register a counter
+ *
+ * @param name   Name of the metric family without the _total suffix
+ * @param labels Comma separated labels of this metric, e.g. service="RW", or NULL
+ * @param help   Description of the metric family
+ * @return The counter or NULL on error
+ */
+METRIC *metric_counter(const char *name, const char *labels, const char *help)
+{
+    return metric_register(metric_alloc(name, labels, help, METRIC_COUNTER, 0));
+}
+
+/**
+ * Register a gauge
+ *
+ * @param name   Name of the metric family
+ * @param labels Comma separated labels of this metric or NULL
+ * @param help   Description of the metric family
+ * @return The gauge or NULL on error
+ */
+METRIC *metric_gauge(const char *name, const char *labels, const char *help)
+{
+    return metric_register(metric_alloc(name, labels, help, METRIC_GAUGE, 0));
+}
+
+/**
+ * Register a counter or a gauge whose value is read from a function. This
+ * allows values that are already maintained elsewhere to be exported.
+ *
+ * @param name   Name of the metric family
+ * @param labels Comma separated labels of this metric or NULL
+ * @param help   Description of the metric family
+ * @param type   METRIC_COUNTER or METRIC_GAUGE
+ * @param fn     Function that returns the value
+ * @return The metric or NULL on error
+ */
+METRIC *metric_function(const char *name, const char *labels, const char *help,
+                        metric_type_t type, METRIC_FN fn)
+{
+    ss_dassert(type != METRIC_HISTOGRAM);
+    METRIC *metric = metric_alloc(name, labels, help, type, 0);
+
+    if (metric)
+    {
+        metric->fn = fn;
+    }
+
+    return metric_register(metric);
+}
+
+/**
+ * Register a histogram
+ *
+ * @param name     Name of the metric family
+ * @param labels   Comma separated labels of this metric or NULL
+ * @param help     Description of the metric family
+ * @param bounds   Upper bounds of the buckets in ascending order
+ * @param n_bounds Number of bounds, at most METRIC_MAX_BUCKETS
+ * @param unit     Multiplier that converts the observed values to base
+ *                 units, e.g. 0.001 if the values are milliseconds
+ * @return The histogram or NULL on error
+ */
+METRIC *metric_histogram(const char *name, const char *labels, const char *help,
+                         const int64_t *bounds, int n_bounds, double unit)
+{
+    if (n_bounds < 0 || n_bounds > METRIC_MAX_BUCKETS)
+    {
+        MXS_ERROR("Histogram '%s' has %d buckets, at most %d are allowed.",
+                  name, n_bounds, METRIC_MAX_BUCKETS);
+        return NULL;
+    }
+
+    METRIC *metric = metric_alloc(name, labels, help, METRIC_HISTOGRAM, n_bounds);
+
+    if (metric)
+    {
+        memcpy(metric->bounds, bounds, n_bounds * sizeof(int64_t));
+        metric->unit = unit;
+    }
+
+    return metric_register(metric);
+}
+
+/**
+ * Estimate a quantile of a histogram. The estimate is the upper bound of the
+ * bucket the quantile falls in.
+ *
+ * @param metric The histogram
+ * @param q      The quantile, between 0 and 1
+ * @param count  If not NULL, set to the number of observed values
+ * @return The estimate in the units of the observed values, -1 if there are
+ *         no observations and INT64_MAX if the quantile is above the largest bound
+ */
+int64_t metric_histogram_quantile(METRIC *metric, double q, int64_t *count)
+{
+    int64_t counts[METRIC_MAX_BUCKETS + 1];
+    int64_t total = 0;
+
+    for (int i = 0; i <= metric->n_bounds; i++)
+    {
+        counts[i] = ts_stats_sum(metric->buckets[i]);
+        total += counts[i];
+    }
+
+    if (count)
+    {
+        *count = total;
+    }
+
+    if (total == 0)
+    {
+        return -1;
+    }
+
+    int64_t rank = (int64_t)(q * total + 0.5);
+    int64_t seen = 0;
+
+    for (int i = 0; i < metric->n_bounds; i++)
+    {
+        seen += counts[i];
+
+        if (seen >= rank && seen > 0)
+        {
+            return metric->bounds[i];
+        }
+    }
+
+    return INT64_MAX;
+}
+
+/**
+ * Print a sample of a metric
+ *
+ * @param dcb    DCB to print to
+ * @param metric The metric
+ * @param suffix Suffix of the sample name
+ * @param le     The le label of a histogram bucket or NULL
+ * @param value  The value in the units of the metric
+ */
+static void print_sample(DCB *dcb, METRIC *metric, const char *suffix, const char *le, double value)
+{
+    const char *labels = metric->labels ? metric->labels : "";
+    const char *sep = metric->labels && le ? "," : "";
+    bool braces = metric->labels || le;
+
+    dcb_printf(dcb, "%s%s%s%s%s%s%s%s%s %.15g\n", metric->name, suffix,
+               braces ? "{" : "", labels, sep,
+               le ? "le=\"" : "", le ? le : "", le ? "\"" : "",
+               braces ? "}" : "", value);
+}
+
+/**
+ * Add a function that prints metrics that are not in the registry, for
+ * example metrics whose labels change over time
+ *
+ * @param fn Function that prints the metric families with metrics_print_family
+ *           and metrics_print_value
+ * @return True if the function was added
+ */
+bool metrics_add_printer(METRICS_PRINT_FN fn)
+{
+    bool rval = false;
+
+    spinlock_acquire(&metrics_lock);
+
+    if (n_printers < METRICS_MAX_PRINTERS)
+    {
+        printers[n_printers] = fn;
+        __atomic_store_n(&n_printers, n_printers + 1, __ATOMIC_RELEASE);
+        rval = true;
+    }
+
+    spinlock_release(&metrics_lock);
+
+    if (!rval)
+    {
+        MXS_ERROR("At most %d metric printers can be added.", METRICS_MAX_PRINTERS);
+    }
+
+    return rval;
+}
+
+/**
+ * Print the type and the description of a metric family
+ *
+ * @param dcb  DCB to print to
+ * @param name Name of the metric family
+ * @param type Type of the metric family
+ * @param help Description of the metric family
+ */
+void metrics_print_family(DCB *dcb, const char *name, metric_type_t type, const char *help)
+{
+    dcb_printf(dcb, "# TYPE %s %s\n", name, metric_type_name(type));
+    dcb_printf(dcb, "# HELP %s %s\n", name, help);
+}
+
+/**
+ * Print a sample of a metric family
+ *
+ * @param dcb    DCB to print to
+ * @param name   Name of the metric family
+ * @param suffix Suffix of the sample name, e.g. _total for counters
+ * @param labels Comma separated labels or NULL
+ * @param value  The value in base units
+ */
+void metrics_print_value(DCB *dcb, const char *name, const char *suffix,
+                         const char *labels, double value)
+{
+    dcb_printf(dcb, "%s%s%s%s%s %.15g\n", name, suffix, labels ? "{" : "",
+               labels ? labels : "", labels ? "}" : "", value);
+}
+
+/**
+ * Print all metrics in the OpenMetrics text format
+ *
+ * @param dcb DCB to print to
+ */
+void metrics_print(DCB *dcb)
+{
+    const char *family = NULL;
+
+    for (METRIC *m = __atomic_load_n(&metrics, __ATOMIC_ACQUIRE); m;
+         m = __atomic_load_n(&m->next, __ATOMIC_ACQUIRE))
+    {
+        if (family == NULL || strcmp(family, m->name) != 0)
+        {
+            family = m->name;
+            metrics_print_family(dcb, m->name, m->type, m->help);
+        }
+
+        int64_t value = m->fn ? m->fn() : ts_stats_sum(m->value);
+
+        switch (m->type)
+        {
+        case METRIC_COUNTER:
+            print_sample(dcb, m, "_total", NULL, value * m->unit);
+            break;
+
+        case METRIC_GAUGE:
+            print_sample(dcb, m, "", NULL, value * m->unit);
+            break;
+
+        case METRIC_HISTOGRAM:
+            {
+                int64_t count = 0;
+
+                for (int i = 0; i < m->n_bounds; i++)
+                {
+                    char le[64];
+                    snprintf(le, sizeof(le), "%.15g", m->bounds[i] * m->unit);
+                    count += ts_stats_sum(m->buckets[i]);
+                    print_sample(dcb, m, "_bucket", le, count);
+                }
+
+                count += ts_stats_sum(m->buckets[m->n_bounds]);
+                print_sample(dcb, m, "_bucket", "+Inf", count);
+                print_sample(dcb, m, "_count", NULL, count);
+                print_sample(dcb, m, "_sum", NULL, value * m->unit);
+            }
+            break;
+        }
+    }
+
+    int n = __atomic_load_n(&n_printers, __ATOMIC_ACQUIRE);
+
+    for (int i = 0; i < n; i++)
+    {
+        printers[i](dcb);
+    }
+
+    dcb_printf(dcb, "# EOF\n");
+}
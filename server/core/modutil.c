@@ -30,6 +30,8 @@
 #include <maxscale/poll.h>
 #include <modutil.h>
 #include <strings.h>
+#include <scan.h>
+#include <fingerprint.h>
 
 /** These are used when converting MySQL wildcards to regular expressions */
 static SPINLOCK re_lock = SPINLOCK_INIT;
@@ -42,6 +44,8 @@ static const PCRE2_SPTR pattern_single = (PCRE2_SPTR) "([^\\\\]|^)_";
 static const PCRE2_SPTR pattern_escape = (PCRE2_SPTR) "[.]";
 static const char* sub_percent = ".*";
 static const char* sub_single = "$1.";
+/** The characters isspace() accepts in the C locale and the semicolon */
+static const char space_or_semicolon[] = {' ', '\t', '\n', '\v', '\f', '\r', ';'};
 static const char* sub_escape = "\\.";
 
 static void modutil_reply_routing_error(
@@ -226,6 +230,9 @@ modutil_replace_SQL(GWBUF *orig, char *sql)
     length += (*ptr++ << 16);
     ptr += 2;  // Skip sequence id  and COM_QUERY byte
 
+    /** The parsing information of the old statement is no longer valid */
+    gwbuf_clear_buffer_object(orig, GWBUF_PARSING_INFO);
+
     newlength = strlen(sql);
     if (length - 1 == newlength)
     {
@@ -480,128 +487,289 @@ int modutil_send_mysql_err_packet(DCB        *dcb,
 }
 
 /**
- * Buffer contains at least one of the following:
- * complete [complete] [partial] mysql packet
+ * Initialise a packet framer for an empty buffer chain
  *
- * return pointer to gwbuf containing a complete packet or
- *   NULL if no complete packet was found.
+ * @param framer The framer to initialise
  */
-GWBUF* modutil_get_next_MySQL_packet(GWBUF** p_readbuf)
+void modutil_framer_init(packet_framer_t *framer)
+{
+    framer->parsed = 0;
+    framer->complete = 0;
+    framer->left = 0;
+    framer->hdr_len = 0;
+}
+
+/**
+ * Parse the data that was appended to a buffer chain since the last call
+ *
+ * Only the bytes after the ones the framer has already parsed are looked at.
+ * The buffers before them are skipped by their length alone. Appending to the
+ * chain keeps the framer valid and so does taking packets from it with the
+ * framer functions. The framer can't tell whether the chain it is given is the
+ * one it parsed, buffers are reused at the same addresses, so whoever takes
+ * the chain, puts data before it or replaces it must reset the framer with
+ * modutil_framer_init.
+ *
+ * @param framer The framer of the chain
+ * @param head   The head of the buffer chain, may be NULL
+ * @return The number of bytes from the head of the chain that form complete
+ * packets
+ */
+size_t modutil_framer_feed(packet_framer_t *framer, GWBUF *head)
 {
-    GWBUF*   packetbuf;
-    GWBUF*   readbuf;
-    size_t   buflen;
-    size_t   packetlen;
-    size_t   totalbuflen;
-    uint8_t* data;
-    size_t   nbytes_copied = 0;
-    uint8_t* target;
-
-    readbuf = *p_readbuf;
-
-    if (readbuf == NULL)
+    GWBUF *buffer = head;
+    size_t skip = framer->parsed;
+
+    while (buffer && skip >= GWBUF_LENGTH(buffer))
     {
-        packetbuf = NULL;
-        goto return_packetbuf;
+        skip -= GWBUF_LENGTH(buffer);
+        buffer = buffer->next;
     }
-    CHK_GWBUF(readbuf);
 
-    if (GWBUF_EMPTY(readbuf))
+    if (buffer == NULL && skip > 0)
     {
-        packetbuf = NULL;
-        goto return_packetbuf;
+        /** The chain was cut shorter than what was parsed, start over */
+        modutil_framer_init(framer);
+        buffer = head;
     }
-    totalbuflen = gwbuf_length(readbuf);
-    data        = (uint8_t *)GWBUF_DATA((readbuf));
-    packetlen   = MYSQL_GET_PACKET_LEN(data) + 4;
 
-    /** packet is incomplete */
-    if (packetlen > totalbuflen)
+    for (; buffer; buffer = buffer->next, skip = 0)
     {
-        packetbuf = NULL;
-        goto return_packetbuf;
+        uint8_t *ptr = (uint8_t *)GWBUF_DATA(buffer) + skip;
+        uint8_t *end = (uint8_t *)GWBUF_DATA(buffer) + GWBUF_LENGTH(buffer);
+
+        while (ptr < end)
+        {
+            if (framer->hdr_len < MYSQL_HEADER_LEN)
+            {
+                if (framer->hdr_len < (int)sizeof(framer->hdr))
+                {
+                    framer->hdr[framer->hdr_len] = *ptr;
+                }
+                framer->hdr_len++;
+                ptr++;
+
+                if (framer->hdr_len == MYSQL_HEADER_LEN)
+                {
+                    framer->left = gw_mysql_get_byte3(framer->hdr);
+                }
+            }
+            else
+            {
+                size_t n = MIN((size_t)(end - ptr), framer->left);
+                framer->left -= n;
+                ptr += n;
+            }
+
+            if (framer->hdr_len == MYSQL_HEADER_LEN && framer->left == 0)
+            {
+                framer->complete = framer->parsed + (ptr - ((uint8_t *)GWBUF_DATA(buffer) + skip));
+                framer->hdr_len = 0;
+            }
+        }
+
+        framer->parsed += GWBUF_LENGTH(buffer) - skip;
     }
 
-    packetbuf = gwbuf_alloc(packetlen);
-    target    = GWBUF_DATA(packetbuf);
-    packetbuf->gwbuf_type = readbuf->gwbuf_type; /*< Copy the type too */
-    /**
-     * Copy first MySQL packet to packetbuf and leave posible other
-     * packets to read buffer.
-     */
-    while (nbytes_copied < packetlen && totalbuflen > 0)
+    return framer->complete;
+}
+
+/**
+ * Update the framer after bytes of complete packets were removed from the
+ * head of the chain
+ *
+ * @param framer    The framer
+ * @param consumed  Number of bytes that were removed
+ * @param remaining The chain that is left
+ */
+static void modutil_framer_consumed(packet_framer_t *framer, size_t consumed, GWBUF *remaining)
+{
+    ss_dassert(consumed <= framer->complete);
+
+    if (remaining == NULL)
     {
-        uint8_t* src = GWBUF_DATA((*p_readbuf));
-        size_t   bytestocopy;
+        modutil_framer_init(framer);
+    }
+    else
+    {
+        framer->parsed -= consumed;
+        framer->complete -= consumed;
+    }
+}
 
-        buflen = GWBUF_LENGTH((*p_readbuf));
-        bytestocopy = MIN(buflen, packetlen - nbytes_copied);
+/**
+ * Take the first complete packet from a buffer chain
+ *
+ * The packet is split from the chain without copying its data, unless it is
+ * spread across several buffers, in which case it is made contiguous.
+ *
+ * @param framer    The framer of the chain
+ * @param p_readbuf The chain, set to NULL when no data is left
+ * @return The packet or NULL if the chain does not begin with a complete packet
+ */
+GWBUF* modutil_framer_get_next(packet_framer_t *framer, GWBUF **p_readbuf)
+{
+    GWBUF *packet = modutil_framer_split_next(framer, p_readbuf);
 
-        memcpy(target + nbytes_copied, src, bytestocopy);
-        *p_readbuf = gwbuf_consume((*p_readbuf), bytestocopy);
-        totalbuflen = gwbuf_length((*p_readbuf));
-        nbytes_copied += bytestocopy;
+    if (packet && packet->next)
+    {
+        packet = gwbuf_make_contiguous(packet);
     }
-    ss_dassert(buflen == 0 || nbytes_copied == packetlen);
 
-return_packetbuf:
-    return packetbuf;
+    return packet;
 }
 
 /**
- * @brief Calculate the length of the complete MySQL packets in the buffer
+ * Take the first complete packet from a buffer chain without copying it
+ *
+ * The packet may be spread across several buffers. This is meant for data
+ * that is forwarded as it is, such as the packets that continue a statement
+ * that is longer than 16MB.
  *
- * @param buffer Buffer to inspect
- * @return Length of the complete MySQL packets in bytes
+ * @param framer    The framer of the chain
+ * @param p_readbuf The chain, set to NULL when no data is left
+ * @return The packet or NULL if the chain does not begin with a complete packet
  */
-static size_t get_complete_packets_length(GWBUF *buffer)
+GWBUF* modutil_framer_split_next(packet_framer_t *framer, GWBUF **p_readbuf)
 {
-    uint8_t packet_len[3];
-    uint32_t buflen = GWBUF_LENGTH(buffer);
-    size_t offset = 0;
-    size_t total = 0;
+    GWBUF *packet = NULL;
 
-    while (buffer && gwbuf_copy_data(buffer, offset, 3, packet_len) == 3)
+    if (modutil_framer_feed(framer, *p_readbuf) > 0)
     {
-        uint32_t len = gw_mysql_get_byte3(packet_len) + MYSQL_HEADER_LEN;
+        uint8_t len[3];
+        gwbuf_copy_data(*p_readbuf, 0, sizeof(len), len);
+        size_t packetlen = gw_mysql_get_byte3(len) + MYSQL_HEADER_LEN;
 
-        if (len < buflen)
+        packet = gwbuf_split(p_readbuf, packetlen);
+        modutil_framer_consumed(framer, packetlen, *p_readbuf);
+    }
+
+    return packet;
+}
+
+/**
+ * Split the complete packets from the head of a buffer chain
+ *
+ * @param framer    The framer of the chain
+ * @param p_readbuf The chain, set to NULL when no partial packet is left
+ * @return The complete packets or NULL if there are none
+ */
+GWBUF* modutil_framer_get_complete(packet_framer_t *framer, GWBUF **p_readbuf)
+{
+    GWBUF *complete = NULL;
+    size_t total = modutil_framer_feed(framer, *p_readbuf);
+
+    if (total > 0)
+    {
+        if (framer->parsed == total)
         {
-            offset += len;
-            total += len;
-            buflen -= len;
+            complete = *p_readbuf;
+            *p_readbuf = NULL;
         }
-        /** The packet is spread across multiple buffers or a buffer ends with
-         * a complete packet. */
         else
         {
-            uint32_t read_len = len;
+            complete = gwbuf_split(p_readbuf, total);
+        }
+        ss_dassert(gwbuf_length(complete) == total);
+        modutil_framer_consumed(framer, total, *p_readbuf);
+    }
 
-            while (read_len >= buflen && buffer)
-            {
-                read_len -= buflen;
-                buffer = buffer->next;
-                buflen = buffer ? GWBUF_LENGTH(buffer) : 0;
-            }
+    return complete;
+}
 
-            /** Either the buffer ended with a complete packet or the buffer
-             * contains more data than is required. */
-            if (read_len == 0 || (buffer && read_len < buflen))
-            {
-                total += len;
-                offset = read_len;
-                buflen -= read_len;
-            }
-            /** The buffer chain contains at least one incomplete packet */
-            else
-            {
-                ss_dassert(!buffer);
-                break;
-            }
-        }
+/**
+ * Move a view to the next complete packet of a buffer chain
+ *
+ * A view whose buffer is NULL is moved to the first packet of the chain. The
+ * packets can thus be inspected in place, without splitting the chain.
+ *
+ * @param head The head of the chain
+ * @param view The view to move
+ * @return True if the view now shows a complete packet, false if no complete
+ * packet follows
+ */
+bool modutil_packet_view_next(GWBUF *head, packet_view_t *view)
+{
+    GWBUF *buffer = view->buffer;
+    size_t offset = view->offset + view->length;
+
+    if (buffer == NULL)
+    {
+        buffer = head;
+        offset = 0;
+    }
+
+    while (buffer && offset >= GWBUF_LENGTH(buffer))
+    {
+        offset -= GWBUF_LENGTH(buffer);
+        buffer = buffer->next;
+    }
+
+    uint8_t len[3];
+
+    if (buffer == NULL || gwbuf_copy_data(buffer, offset, sizeof(len), len) != sizeof(len))
+    {
+        return false;
     }
 
-    return total;
+    uint32_t packetlen = gw_mysql_get_byte3(len) + MYSQL_HEADER_LEN;
+    size_t avail = GWBUF_LENGTH(buffer) - offset;
+
+    for (GWBUF *b = buffer->next; b && avail < packetlen; b = b->next)
+    {
+        avail += GWBUF_LENGTH(b);
+    }
+
+    if (avail < packetlen)
+    {
+        return false;
+    }
+
+    view->buffer = buffer;
+    view->offset = offset;
+    view->length = packetlen;
+    return true;
+}
+
+/**
+ * Copy bytes of a packet that a view shows
+ *
+ * @param view   The view of the packet
+ * @param offset Offset in the packet, the header included
+ * @param n      Number of bytes to copy
+ * @param dest   Where the bytes are copied
+ * @return The number of bytes copied
+ */
+size_t modutil_packet_view_copy(const packet_view_t *view, size_t offset, size_t n, uint8_t *dest)
+{
+    if (offset >= view->length)
+    {
+        return 0;
+    }
+
+    return gwbuf_copy_data(view->buffer, view->offset + offset,
+                           MIN(n, view->length - offset), dest);
+}
+
+/**
+ * Buffer contains at least one of the following:
+ * complete [complete] [partial] mysql packet
+ *
+ * return pointer to gwbuf containing a complete packet or
+ *   NULL if no complete packet was found.
+ */
+GWBUF* modutil_get_next_MySQL_packet(GWBUF** p_readbuf)
+{
+    packet_framer_t framer;
+
+    if (p_readbuf == NULL || *p_readbuf == NULL)
+    {
+        return NULL;
+    }
+
+    CHK_GWBUF(*p_readbuf);
+    modutil_framer_init(&framer);
+    return modutil_framer_get_next(&framer, p_readbuf);
 }
 
 /**
@@ -613,33 +781,15 @@ static size_t get_complete_packets_length(GWBUF *buffer)
  */
 GWBUF* modutil_get_complete_packets(GWBUF **p_readbuf)
 {
-    size_t buflen;
-    /** At least 3 bytes are needed to calculate the packet length. */
-    if (p_readbuf == NULL || (*p_readbuf) == NULL || (buflen = gwbuf_length(*p_readbuf)) < 3)
+    packet_framer_t framer;
+
+    if (p_readbuf == NULL || *p_readbuf == NULL)
     {
         return NULL;
     }
 
-    size_t total = get_complete_packets_length(*p_readbuf);
-    GWBUF* complete = NULL;
-
-    if (buflen == total)
-    {
-        complete = *p_readbuf;
-        *p_readbuf = NULL;
-    }
-    else if (total > 0)
-    {
-#ifdef SS_DEBUG
-        size_t before = gwbuf_length(*p_readbuf);
-#endif
-        complete = gwbuf_split(p_readbuf, total);
-#ifdef SS_DEBUG
-        ss_dassert(gwbuf_length(complete) == total);
-        ss_dassert(*p_readbuf == NULL || before - total == gwbuf_length(*p_readbuf));
-#endif
-    }
-    return complete;
+    modutil_framer_init(&framer);
+    return modutil_framer_get_complete(&framer, p_readbuf);
 }
 
 /**
@@ -802,35 +952,35 @@ static void modutil_reply_routing_error(DCB*     backend_dcb,
  */
 char* strnchr_esc(char* ptr, char c, int len)
 {
-    char* p = (char*)ptr;
-    char* start = p;
-    bool quoted = false, escaped = false;
-    char qc;
-
-    while (p < start + len)
+    const char* p = ptr;
+    const char* end = ptr + len;
+    /** Outside quotes, only these characters change the state */
+    const char outside[] = {'\\', '\'', '"', c};
+    char inside[] = {'\\', 0};
+    char qc = 0;
+
+    while ((p = qc ? scan_find_any(p, end, inside, sizeof(inside)) :
+                scan_find_any(p, end, outside, sizeof(outside))) < end)
     {
-        if (escaped)
-        {
-            escaped = false;
-        }
-        else if (*p == '\\')
+        if (*p == '\\')
         {
-            escaped = true;
+            /** Skip the escaped character */
+            p += 2;
         }
-        else if ((*p == '\'' || *p  == '"') && !quoted)
+        else if (qc)
         {
-            quoted = true;
-            qc = *p;
+            qc = 0;
+            p++;
         }
-        else if (quoted && *p == qc)
+        else if (*p == '\'' || *p == '"')
         {
-            quoted = false;
+            qc = inside[1] = *p;
+            p++;
         }
-        else if (*p == c && !escaped && !quoted)
+        else
         {
-            return p;
+            return (char*)p;
         }
-        p++;
     }
 
     return NULL;
@@ -848,81 +998,84 @@ char* strnchr_esc(char* ptr, char c, int len)
  */
 char* strnchr_esc_mysql(char* ptr, char c, int len)
 {
-    char* p = (char*) ptr;
-    char* start = p, *end = start + len;
-    bool quoted = false, escaped = false, backtick = false, comment = false;
-    char qc;
+    const char* p = ptr;
+    const char* end = ptr + len;
+    /** Outside quotes, comments and identifiers, only these characters change the state */
+    const char outside[] = {'\\', '\'', '"', '/', '`', '#', '-', c};
+    const char star[] = {'*'};
+    const char backtick[] = {'`'};
+    char quote[] = {0};
 
     while (p < end)
     {
-        if (escaped)
+        if (quote[0])
         {
-            escaped = false;
+            /** Escapes are not interpreted inside quotes */
+            if ((p = scan_find_any(p, end, quote, sizeof(quote))) < end)
+            {
+                quote[0] = 0;
+                p++;
+            }
         }
-        else if ((!comment && !quoted && !backtick) || (comment && *p == '*') ||
-                 (!comment && quoted && *p == qc) || (!comment && backtick && *p == '`'))
+        else if ((p = scan_find_any(p, end, outside, sizeof(outside))) < end)
         {
             switch (*p)
             {
-                case '\\':
-                    escaped = true;
-                    break;
+            case '\\':
+                p += 2;
+                continue;
 
-                case '\'':
-                case '"':
-                    if (!quoted)
-                    {
-                        quoted = true;
-                        qc = *p;
-                    }
-                    else if (*p == qc)
-                    {
-                        quoted = false;
-                    }
-                    break;
+            case '\'':
+            case '"':
+                quote[0] = *p++;
+                continue;
 
-                case '/':
-                    if (p + 1 < end && *(p + 1) == '*')
-                    {
-                        comment = true;
-                        p += 1;
-                    }
-                    break;
+            case '`':
+                if ((p = scan_find_any(p + 1, end, backtick, sizeof(backtick))) < end)
+                {
+                    p++;
+                }
+                continue;
 
-                case '*':
-                    if (comment && p + 1 < end && *(p + 1) == '/')
+            case '/':
+                if (p + 1 < end && *(p + 1) == '*')
+                {
+                    /** Find the end of the comment block */
+                    for (p = scan_find_any(p + 2, end, star, sizeof(star)); p < end;
+                         p = scan_find_any(p + 1, end, star, sizeof(star)))
                     {
-                        comment = false;
-                        p += 1;
+                        if (p + 1 < end && *(p + 1) == '/')
+                        {
+                            p += 2;
+                            break;
+                        }
                     }
-                    break;
+                    continue;
+                }
+                break;
 
-                case '`':
-                    backtick = !backtick;
-                    break;
+            case '#':
+                return NULL;
 
-                case '#':
+            case '-':
+                if (p + 2 < end && *(p + 1) == '-' && isspace(*(p + 2)))
+                {
                     return NULL;
+                }
+                break;
 
-                case '-':
-                    if (p + 2 < end && *(p + 1) == '-' &&
-                        isspace(*(p + 2)))
-                    {
-                        return NULL;
-                    }
-                    break;
-
-                default:
-                    break;
+            default:
+                break;
             }
 
-            if (*p == c && !escaped && !quoted && !comment && !backtick)
+            if (*p == c)
             {
-                return p;
+                return (char*)p;
             }
+            p++;
         }
-        p++;
     }
+
     return NULL;
 }
 
@@ -937,14 +1090,10 @@ char* strnchr_esc_mysql(char* ptr, char c, int len)
  */
 bool is_mysql_statement_end(const char* start, int len)
 {
-    const char *ptr = start;
+    const char *ptr = scan_skip_any(start, start + len, space_or_semicolon,
+                                    sizeof(space_or_semicolon));
     bool rval = false;
 
-    while (ptr < start + len && (isspace(*ptr) || *ptr == ';'))
-    {
-        ptr++;
-    }
-
     if (ptr < start + len)
     {
         switch (*ptr)
@@ -983,12 +1132,8 @@ bool is_mysql_statement_end(const char* start, int len)
  */
 bool is_mysql_sp_end(const char* start, int len)
 {
-    const char *ptr = start;
-
-    while (ptr < start + len && (isspace(*ptr) || *ptr == ';'))
-    {
-        ptr++;
-    }
+    const char *ptr = scan_skip_any(start, start + len, space_or_semicolon,
+                                    sizeof(space_or_semicolon));
 
     return ptr < start + len - 3 && strncasecmp(ptr, "end", 3) == 0;
 }
@@ -1038,10 +1183,7 @@ int modutil_count_statements(GWBUF* buffer)
     while (ptr < end && (ptr = strnchr_esc(ptr, ';', end - ptr)))
     {
         num++;
-        while (*ptr == ';')
-        {
-            ptr++;
-        }
+        ptr = (char*)scan_skip_any(ptr, end, ";", 1);
     }
 
     ptr = end - 1;
@@ -1078,6 +1220,9 @@ void prepare_pcre2_patterns()
                                        0, &err, &erroff, NULL)))
         {
             assert(!pattern_init);
+            mxs_pcre2_jit_compile(re_percent);
+            mxs_pcre2_jit_compile(re_single);
+            mxs_pcre2_jit_compile(re_escape);
             pattern_init = true;
         }
         else
@@ -1120,11 +1265,7 @@ mxs_pcre2_result_t modutil_mysql_wildcard_match(const char* pattern, const char*
     char* matchstr = (char*) malloc(matchsize);
     char* tempstr = (char*) malloc(tempsize);
 
-    pcre2_match_data *mdata_percent = pcre2_match_data_create_from_pattern(re_percent, NULL);
-    pcre2_match_data *mdata_single = pcre2_match_data_create_from_pattern(re_single, NULL);
-    pcre2_match_data *mdata_escape = pcre2_match_data_create_from_pattern(re_escape, NULL);
-
-    if (matchstr && tempstr && mdata_percent && mdata_single && mdata_escape)
+    if (matchstr && tempstr)
     {
         if (mxs_pcre2_substitute(re_escape, pattern, sub_escape,
                                  &matchstr, &matchsize) == MXS_PCRE2_ERROR ||
@@ -1162,9 +1303,6 @@ mxs_pcre2_result_t modutil_mysql_wildcard_match(const char* pattern, const char*
         MXS_ERROR("Fatal error when matching wildcard patterns.");
     }
 
-    pcre2_match_data_free(mdata_percent);
-    pcre2_match_data_free(mdata_single);
-    pcre2_match_data_free(mdata_escape);
     free(matchstr);
     free(tempstr);
     return rval;
@@ -1222,3 +1360,67 @@ char* modutil_get_canonical(GWBUF* querybuf)
 
     return querystr;
 }
+
+/**
+ * Create the fingerprint of a COM_QUERY statement
+ *
+ * Unlike modutil_get_canonical(), this does not use regular expressions and
+ * allocates only the returned string. The statement may span several buffers.
+ *
+ * @param querybuf GWBUF with a COM_QUERY statement
+ * @param hash     If not NULL, the hash of the fingerprint is stored here
+ * @return The fingerprint or NULL if the buffer is not a COM_QUERY or memory
+ * allocation failed
+ * @see fingerprint.h
+ */
+char* modutil_get_fingerprint(GWBUF* querybuf, uint64_t* hash)
+{
+    if (!modutil_is_SQL(querybuf))
+    {
+        return NULL;
+    }
+
+    size_t len = gwbuf_length(querybuf) - MYSQL_HEADER_LEN - 1;
+    char *sql = (char*)GWBUF_DATA(querybuf) + MYSQL_HEADER_LEN + 1;
+    char *copy = NULL;
+
+    if (!GWBUF_IS_CONTIGUOUS(querybuf))
+    {
+        if ((copy = malloc(len)) == NULL)
+        {
+            return NULL;
+        }
+
+        gwbuf_copy_data(querybuf, MYSQL_HEADER_LEN + 1, len, (uint8_t*)copy);
+        sql = copy;
+    }
+
+    /** The fingerprint is rarely longer than the statement, only a collapsed
+     * single value IN list adds a byte. */
+    size_t size = len + 16;
+    char *rval = malloc(size);
+
+    if (rval)
+    {
+        size_t needed = fingerprint_sql(sql, len, rval, size, hash);
+
+        if (needed >= size)
+        {
+            char *tmp = realloc(rval, needed + 1);
+
+            if (tmp)
+            {
+                rval = tmp;
+                fingerprint_sql(sql, len, rval, needed + 1, hash);
+            }
+            else
+            {
+                free(rval);
+                rval = NULL;
+            }
+        }
+    }
+
+    free(copy);
+    return rval;
+}
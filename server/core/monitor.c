@@ -30,6 +30,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/wait.h>
 #include <monitor.h>
 #include <spinlock.h>
 #include <modules.h>
@@ -40,6 +44,9 @@
 #include <externcmd.h>
 #include <mysqld_error.h>
 #include <mysql_utils.h>
+#include <mysql_pool.h>
+#include <thread.h>
+#include <timerwheel.h>
 
 /*
  *  Create declarations of the enum for monitor events and also the array of
@@ -95,6 +102,13 @@ monitor_alloc(char *name, char *module)
     mon->write_timeout = DEFAULT_WRITE_TIMEOUT;
     mon->connect_timeout = DEFAULT_CONNECT_TIMEOUT;
     mon->interval = MONITOR_INTERVAL;
+    mon->fast_interval = 0;
+    mon->script_timeout = DEFAULT_SCRIPT_TIMEOUT;
+    mon->script_max_running = DEFAULT_SCRIPT_MAX_RUNNING;
+    mon->scripts_running = 0;
+    mon->scripts_pending = 0;
+    mon->script_queue = NULL;
+    mon->script_queue_tail = NULL;
     mon->parameters = NULL;
     spinlock_init(&mon->lock);
     spinlock_acquire(&monLock);
@@ -255,6 +269,7 @@ monitorAddServer(MONITOR *mon, SERVER *server)
     db->mon_prev_status = -1;
     /* pending status is updated by get_replication_tree */
     db->pending_status = 0;
+    db->fast_rounds = 0;
 
     spinlock_acquire(&mon->lock);
 
@@ -418,6 +433,42 @@ monitorSetInterval(MONITOR *mon, unsigned long interval)
     mon->interval = interval;
 }
 
+/**
+ * Set the interval at which failing servers are probed
+ *
+ * @param mon           The monitor instance
+ * @param interval      The interval in milliseconds, 0 to disable
+ */
+void
+monitorSetFastInterval(MONITOR *mon, unsigned long interval)
+{
+    mon->fast_interval = interval;
+}
+
+/**
+ * Set how long a monitor script may run before it is terminated
+ *
+ * @param mon           The monitor instance
+ * @param timeout       The timeout in seconds, 0 for no limit
+ */
+void
+monitorSetScriptTimeout(MONITOR *mon, int timeout)
+{
+    mon->script_timeout = timeout;
+}
+
+/**
+ * Set how many monitor scripts may run at the same time
+ *
+ * @param mon           The monitor instance
+ * @param max_running   The number of scripts, at least 1
+ */
+void
+monitorSetScriptMaxRunning(MONITOR *mon, int max_running)
+{
+    mon->script_max_running = max_running;
+}
+
 /**
  * Set Monitor timeouts for connect/read/write
  *
@@ -542,30 +593,19 @@ bool check_monitor_permissions(MONITOR* monitor, const char* query)
 
     char *user = monitor->user;
     char *dpasswd = decryptPassword(monitor->password);
-    GATEWAY_CONF* cnf = config_get_global_options();
     bool rval = false;
 
     for (MONITOR_SERVERS *mondb = monitor->databases; mondb; mondb = mondb->next)
     {
-        MYSQL *mysql = mysql_init(NULL);
+        MYSQL *mysql = mxs_mysql_pool_get(mondb->server, user, dpasswd);
 
         if (mysql == NULL)
-        {
-            MXS_ERROR("[%s] Error: MySQL connection initialization failed.", __FUNCTION__);
-            break;
-        }
-
-        mysql_options(mysql, MYSQL_OPT_READ_TIMEOUT, &cnf->auth_read_timeout);
-        mysql_options(mysql, MYSQL_OPT_CONNECT_TIMEOUT, &cnf->auth_conn_timeout);
-        mysql_options(mysql, MYSQL_OPT_WRITE_TIMEOUT, &cnf->auth_write_timeout);
-
-        if (mxs_mysql_real_connect(mysql, mondb->server, user, dpasswd) == NULL)
         {
             MXS_ERROR("[%s] Failed to connect to server '%s' (%s:%d) when"
                       " checking monitor user credentials and permissions: %s",
                       monitor->name, mondb->server->unique_name, mondb->server->name,
-                      mondb->server->port, mysql_error(mysql));
-            switch (mysql_errno(mysql))
+                      mondb->server->port, mxs_mysql_pool_error());
+            switch (mxs_mysql_pool_errno())
             {
                 case ER_ACCESS_DENIED_ERROR:
                 case ER_DBACCESS_DENIED_ERROR:
@@ -610,7 +650,11 @@ bool check_monitor_permissions(MONITOR* monitor, const char* query)
                 mysql_free_result(res);
             }
         }
-        mysql_close(mysql);
+
+        if (mysql)
+        {
+            mxs_mysql_pool_put(mondb->server, mysql);
+        }
     }
 
     free(dpasswd);
@@ -846,6 +890,102 @@ mon_print_fail_status(MONITOR_SERVERS* mon_srv)
     return (SERVER_IS_DOWN(mon_srv->server) && mon_srv->mon_err_count == 0);
 }
 
+/** A monitor script that is waiting to be started or running */
+typedef struct monitor_script
+{
+    MONITOR *mon;                /**< The monitor that launched the script */
+    EXTERNCMD *cmd;              /**< The command to execute */
+    const char *event;           /**< Name of the event that launched the script */
+    struct monitor_script *next; /**< Next waiting script */
+} MONITOR_SCRIPT;
+
+static void monitor_script_done(EXTERNCMD *cmd, int status, void *data);
+
+/**
+ * Start waiting scripts until the limit of running scripts is reached
+ *
+ * @param mon The monitor
+ */
+static void
+monitor_start_scripts(MONITOR *mon)
+{
+    while (true)
+    {
+        MONITOR_SCRIPT *script = NULL;
+
+        spinlock_acquire(&mon->lock);
+        if (mon->script_queue && mon->scripts_running < mon->script_max_running)
+        {
+            script = mon->script_queue;
+            mon->script_queue = script->next;
+            if (mon->script_queue == NULL)
+            {
+                mon->script_queue_tail = NULL;
+            }
+            mon->scripts_pending--;
+            mon->scripts_running++;
+        }
+        spinlock_release(&mon->lock);
+
+        if (script == NULL)
+        {
+            break;
+        }
+
+        if (!externcmd_start(script->cmd, mon->script_timeout, monitor_script_done, script))
+        {
+            MXS_ERROR("Failed to execute script '%s' on server state change event '%s'.",
+                      script->cmd->argv[0], script->event);
+            externcmd_free(script->cmd);
+            free(script);
+            spinlock_acquire(&mon->lock);
+            mon->scripts_running--;
+            spinlock_release(&mon->lock);
+        }
+    }
+}
+
+/**
+ * Called by the external command thread when a monitor script exits
+ *
+ * @param cmd    The command of the script
+ * @param status Exit status of the script
+ * @param data   The monitor script
+ */
+static void
+monitor_script_done(EXTERNCMD *cmd, int status, void *data)
+{
+    MONITOR_SCRIPT *script = (MONITOR_SCRIPT*)data;
+    MONITOR *mon = script->mon;
+
+    if (cmd->killed)
+    {
+        MXS_ERROR("Monitor script '%s' on event '%s' was terminated because it ran "
+                  "for longer than %d seconds.", cmd->argv[0], script->event, cmd->timeout);
+    }
+    else if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+    {
+        MXS_NOTICE("Executed monitor script '%s' on event '%s'.",
+                   cmd->argv[0], script->event);
+    }
+    else if (WIFEXITED(status))
+    {
+        MXS_ERROR("Monitor script '%s' on event '%s' exited with status %d.",
+                  cmd->argv[0], script->event, WEXITSTATUS(status));
+    }
+    else
+    {
+        MXS_ERROR("Monitor script '%s' on event '%s' did not exit normally, status %d.",
+                  cmd->argv[0], script->event, status);
+    }
+
+    free(script);
+    spinlock_acquire(&mon->lock);
+    mon->scripts_running--;
+    spinlock_release(&mon->lock);
+    monitor_start_scripts(mon);
+}
+
 /**
  * Launch a script
  * @param mon Owning monitor
@@ -908,18 +1048,50 @@ monitor_launch_script(MONITOR* mon, MONITOR_SERVERS* ptr, char* script)
         externcmd_substitute_arg(cmd, "[$]SYNCEDLIST", nodelist);
     }
 
-    if (externcmd_execute(cmd))
+    MONITOR_SCRIPT *item = (MONITOR_SCRIPT*)malloc(sizeof(MONITOR_SCRIPT));
+
+    if (item == NULL)
     {
         MXS_ERROR("Failed to execute script '%s' on server state change event '%s'.",
                   script, mon_get_event_name(ptr));
+        externcmd_free(cmd);
+        return;
     }
-    else
+
+    item->mon = mon;
+    item->cmd = cmd;
+    item->event = mon_get_event_name(ptr);
+    item->next = NULL;
+
+    /** The script is started when fewer than script_max_running scripts are running */
+    spinlock_acquire(&mon->lock);
+    if (mon->scripts_pending < MONITOR_MAX_PENDING_SCRIPTS)
     {
-        MXS_NOTICE("Executed monitor script '%s' on event '%s'.",
-                   script, mon_get_event_name(ptr));
+        if (mon->script_queue_tail)
+        {
+            mon->script_queue_tail->next = item;
+        }
+        else
+        {
+            mon->script_queue = item;
+        }
+        mon->script_queue_tail = item;
+        mon->scripts_pending++;
+        item = NULL;
+    }
+    spinlock_release(&mon->lock);
+
+    if (item)
+    {
+        MXS_ERROR("Monitor '%s' has %d scripts waiting to be executed, not executing "
+                  "script '%s' on event '%s'.", mon->name, MONITOR_MAX_PENDING_SCRIPTS,
+                  script, item->event);
+        externcmd_free(cmd);
+        free(item);
+        return;
     }
 
-    externcmd_free(cmd);
+    monitor_start_scripts(mon);
 }
 
 /**
@@ -1068,3 +1240,455 @@ void mon_hangup_failed_servers(MONITOR *monitor)
         }
     }
 }
+
+/** The maximum number of threads that probe the servers of a monitor at the same time */
+#define MON_PROBE_MAX_THREADS 16
+
+/**
+ * The state shared by the threads that probe the servers of a monitor
+ */
+typedef struct
+{
+    MONITOR         *monitor;   /*< The monitor */
+    void (*probe)(MONITOR *, MONITOR_SERVERS *); /*< The probe function of the monitor */
+    SPINLOCK        lock;       /*< Protects next */
+    MONITOR_SERVERS *next;      /*< The next server to probe */
+} MON_PROBE_STATE;
+
+/**
+ * Probe servers until all of them have been probed
+ *
+ * @param data The shared probe state
+ */
+static void
+mon_probe_worker(void *data)
+{
+    MON_PROBE_STATE *state = (MON_PROBE_STATE *) data;
+
+    while (true)
+    {
+        spinlock_acquire(&state->lock);
+        MONITOR_SERVERS *database = state->next;
+
+        if (database)
+        {
+            state->next = database->next;
+        }
+        spinlock_release(&state->lock);
+
+        if (database == NULL)
+        {
+            break;
+        }
+
+        state->probe(state->monitor, database);
+    }
+}
+
+/**
+ * Thread entry point of a probe thread
+ *
+ * @param data The shared probe state
+ */
+static void
+mon_probe_thread(void *data)
+{
+    mysql_thread_init();
+    mon_probe_worker(data);
+    mysql_thread_end();
+}
+
+/**
+ * @brief Probe all servers of a monitor concurrently
+ *
+ * The servers are handed out one at a time to a small set of threads so that
+ * a server that does not respond only holds up its own probe. The duration of
+ * a monitoring round is thus bounded by the slowest server instead of the sum
+ * of the probes. The calling thread takes part in the probing and the function
+ * returns once all servers have been probed.
+ *
+ * The probe function must only modify the server it is given.
+ *
+ * @param monitor Monitor object
+ * @param probe   Function that probes one server
+ */
+void
+mon_probe_servers(MONITOR *monitor, void (*probe)(MONITOR *, MONITOR_SERVERS *))
+{
+    MON_PROBE_STATE state;
+    THREAD threads[MON_PROBE_MAX_THREADS];
+    int n_servers = 0;
+    int n_threads = 0;
+
+    state.monitor = monitor;
+    state.probe = probe;
+    state.next = monitor->databases;
+    spinlock_init(&state.lock);
+
+    for (MONITOR_SERVERS *ptr = monitor->databases; ptr; ptr = ptr->next)
+    {
+        n_servers++;
+    }
+
+    /** The calling thread is one of the probing threads */
+    while (n_threads < n_servers - 1 && n_threads < MON_PROBE_MAX_THREADS)
+    {
+        if (thread_start(&threads[n_threads], mon_probe_thread, &state) == NULL)
+        {
+            MXS_WARNING("Failed to start a probe thread for monitor '%s', "
+                        "probing with %d threads.", monitor->name, n_threads + 1);
+            break;
+        }
+        n_threads++;
+    }
+
+    mon_probe_worker(&state);
+
+    for (int i = 0; i < n_threads; i++)
+    {
+        thread_wait(threads[i]);
+    }
+}
+
+/**
+ * Check whether any server of a monitor is failing and count down its fast
+ * rounds
+ *
+ * A server that went down is probed at the fast interval for the next
+ * MON_FAST_ROUNDS rounds, as is a server to which a failed connection was
+ * reported. Only the cadence changes: the servers still go through the
+ * normal monitoring round, so the confirmation of a state change works as
+ * with the normal interval.
+ *
+ * @param monitor Monitor object
+ * @return True if a server is failing
+ */
+static bool
+mon_servers_failing(MONITOR *monitor)
+{
+    bool rval = false;
+
+    for (MONITOR_SERVERS *ptr = monitor->databases; ptr; ptr = ptr->next)
+    {
+        if (server_take_failure_reports(ptr->server) > 0 ||
+            ptr->mon_err_count == 1)
+        {
+            ptr->fast_rounds = MON_FAST_ROUNDS;
+        }
+
+        if (ptr->fast_rounds > 0)
+        {
+            ptr->fast_rounds--;
+            rval = true;
+        }
+    }
+
+    return rval;
+}
+
+/** The most threads the monitor scheduler starts */
+#define MON_SCHED_MAX_THREADS 64
+
+/**
+ * A monitor whose rounds are run by the shared monitor threads
+ */
+typedef struct mon_task
+{
+    TIMER_ENTRY     timer;          /*< Expires when the monitor needs attention, must be first */
+    MONITOR         *monitor;       /*< The monitor */
+    void            (*round)(MONITOR *); /*< Runs one monitoring round */
+    uint64_t        next_round;     /*< When the next round of the monitor interval is due */
+    bool            running;        /*< A thread is checking or running the monitor */
+    bool            removed;        /*< The monitor has been unscheduled */
+    struct mon_task *next;          /*< The next task */
+} MON_TASK;
+
+/**
+ * The state of the monitor scheduler, protected by mon_sched_lock. One of the
+ * threads sleeps until the next timer expires; the others sleep until there
+ * are expired timers to process, so an idle monitor costs no wakeups between
+ * its rounds.
+ */
+static pthread_mutex_t mon_sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  mon_sched_timer_cond; /*< The timekeeper sleeps on this */
+static pthread_cond_t  mon_sched_work_cond;  /*< The other threads sleep on this */
+static pthread_cond_t  mon_sched_done_cond;  /*< Signaled when a task has been processed */
+static TIMER_WHEEL     mon_sched_wheel;
+static TIMER_ENTRY     mon_sched_due;        /*< The expired tasks */
+static MON_TASK        *mon_sched_tasks = NULL;
+static int             mon_sched_n_tasks = 0;
+static THREAD          mon_sched_threads[MON_SCHED_MAX_THREADS];
+static int             mon_sched_n_threads = 0;
+static bool            mon_sched_ready = false;
+static bool            mon_sched_have_timekeeper = false;
+static uint64_t        mon_sched_deadline = UINT64_MAX; /*< When the timekeeper wakes up */
+
+/**
+ * Return the value of the monotonic clock in milliseconds
+ */
+static uint64_t
+mon_sched_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Initialise the scheduler. The caller must hold mon_sched_lock.
+ */
+static void
+mon_sched_init()
+{
+    if (!mon_sched_ready)
+    {
+        pthread_condattr_t attr;
+
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&mon_sched_timer_cond, &attr);
+        pthread_condattr_destroy(&attr);
+        pthread_cond_init(&mon_sched_work_cond, NULL);
+        pthread_cond_init(&mon_sched_done_cond, NULL);
+        timerwheel_init(&mon_sched_wheel, mon_sched_now());
+        timerwheel_list_init(&mon_sched_due);
+        mon_sched_ready = true;
+    }
+}
+
+/**
+ * Put a task in the wheel. The caller must hold mon_sched_lock.
+ *
+ * @param task   The task
+ * @param expiry When the task needs attention next
+ */
+static void
+mon_sched_arm(MON_TASK *task, uint64_t expiry)
+{
+    timerwheel_add(&mon_sched_wheel, &task->timer, expiry);
+
+    if (!mon_sched_have_timekeeper)
+    {
+        /** Let an idle thread take over the timers */
+        pthread_cond_signal(&mon_sched_work_cond);
+    }
+    else if (expiry < mon_sched_deadline)
+    {
+        /** The timekeeper sleeps past the new timer */
+        pthread_cond_signal(&mon_sched_timer_cond);
+    }
+}
+
+/**
+ * Check a monitor whose timer expired and run a round if one is due
+ *
+ * A round is due at the monitor interval. With a fast interval the monitor
+ * is also checked at the fast interval and a round is run when one of its
+ * servers is failing.
+ *
+ * @param task The task of the monitor
+ * @return When the monitor should next be checked
+ */
+static uint64_t
+mon_sched_run(MON_TASK *task)
+{
+    MONITOR *mon = task->monitor;
+    uint64_t now = mon_sched_now();
+    bool regular = now >= task->next_round;
+
+    if (regular || (mon->fast_interval && mon_servers_failing(mon)))
+    {
+        task->round(mon);
+        now = mon_sched_now();
+
+        if (regular)
+        {
+            task->next_round = now + mon->interval;
+        }
+    }
+
+    if (task->next_round > now + mon->interval)
+    {
+        /** The interval was made shorter */
+        task->next_round = now + mon->interval;
+    }
+
+    uint64_t next = task->next_round;
+
+    if (mon->fast_interval && now + mon->fast_interval < next)
+    {
+        next = now + mon->fast_interval;
+    }
+
+    return next;
+}
+
+/**
+ * The main loop of the monitor threads
+ */
+static void
+mon_sched_thread(void *data)
+{
+    if (mysql_thread_init())
+    {
+        MXS_ERROR("mysql_thread_init failed in the monitor scheduler. Exiting.");
+        return;
+    }
+
+    pthread_mutex_lock(&mon_sched_lock);
+
+    while (true)
+    {
+        if (!timerwheel_list_empty(&mon_sched_due))
+        {
+            MON_TASK *task = (MON_TASK *)mon_sched_due.next;
+
+            timerwheel_remove(&task->timer);
+            task->running = true;
+
+            if (!timerwheel_list_empty(&mon_sched_due))
+            {
+                pthread_cond_signal(&mon_sched_work_cond);
+            }
+            pthread_mutex_unlock(&mon_sched_lock);
+
+            uint64_t next = mon_sched_run(task);
+
+            pthread_mutex_lock(&mon_sched_lock);
+            task->running = false;
+
+            if (task->removed)
+            {
+                pthread_cond_broadcast(&mon_sched_done_cond);
+            }
+            else
+            {
+                mon_sched_arm(task, next);
+            }
+            continue;
+        }
+
+        uint64_t now = mon_sched_now();
+
+        if (timerwheel_advance(&mon_sched_wheel, now, &mon_sched_due) > 0)
+        {
+            continue;
+        }
+
+        if (mon_sched_have_timekeeper)
+        {
+            pthread_cond_wait(&mon_sched_work_cond, &mon_sched_lock);
+        }
+        else
+        {
+            mon_sched_have_timekeeper = true;
+            mon_sched_deadline = timerwheel_next_expiry(&mon_sched_wheel);
+
+            if (mon_sched_deadline == UINT64_MAX)
+            {
+                pthread_cond_wait(&mon_sched_timer_cond, &mon_sched_lock);
+            }
+            else
+            {
+                struct timespec ts;
+
+                ts.tv_sec = mon_sched_deadline / 1000;
+                ts.tv_nsec = (mon_sched_deadline % 1000) * 1000000;
+                pthread_cond_timedwait(&mon_sched_timer_cond, &mon_sched_lock, &ts);
+            }
+
+            /** Hand the timers over in case this thread ends up running a round */
+            mon_sched_deadline = UINT64_MAX;
+            mon_sched_have_timekeeper = false;
+            pthread_cond_signal(&mon_sched_work_cond);
+        }
+    }
+}
+
+bool
+mon_schedule_rounds(MONITOR *monitor, void (*round)(MONITOR *))
+{
+    MON_TASK *task = (MON_TASK *)malloc(sizeof(MON_TASK));
+
+    if (task == NULL)
+    {
+        return false;
+    }
+
+    timerwheel_entry_init(&task->timer);
+    task->monitor = monitor;
+    task->round = round;
+    task->running = false;
+    task->removed = false;
+
+    pthread_mutex_lock(&mon_sched_lock);
+    mon_sched_init();
+
+    task->next_round = mon_sched_now();
+    task->next = mon_sched_tasks;
+    mon_sched_tasks = task;
+    mon_sched_n_tasks++;
+
+    /** Start threads as monitors are added, up to the configured number */
+    if (mon_sched_n_threads < mon_sched_n_tasks &&
+        mon_sched_n_threads < (int)config_monitor_threads() &&
+        mon_sched_n_threads < MON_SCHED_MAX_THREADS)
+    {
+        if (thread_start(&mon_sched_threads[mon_sched_n_threads], mon_sched_thread, NULL))
+        {
+            mon_sched_n_threads++;
+        }
+        else if (mon_sched_n_threads == 0)
+        {
+            MXS_ERROR("Failed to start a thread for monitor '%s'.", monitor->name);
+        }
+    }
+
+    mon_sched_arm(task, task->next_round);
+    pthread_mutex_unlock(&mon_sched_lock);
+
+    return mon_sched_n_threads > 0;
+}
+
+void
+mon_unschedule_rounds(MONITOR *monitor)
+{
+    MON_TASK *task;
+
+    pthread_mutex_lock(&mon_sched_lock);
+
+    for (task = mon_sched_tasks; task; task = task->next)
+    {
+        if (task->monitor == monitor && !task->removed)
+        {
+            break;
+        }
+    }
+
+    if (task)
+    {
+        task->removed = true;
+        timerwheel_remove(&task->timer);
+
+        while (task->running)
+        {
+            pthread_cond_wait(&mon_sched_done_cond, &mon_sched_lock);
+        }
+
+        /** The list may have changed while waiting */
+        for (MON_TASK **prev = &mon_sched_tasks; *prev; prev = &(*prev)->next)
+        {
+            if (*prev == task)
+            {
+                *prev = task->next;
+                break;
+            }
+        }
+
+        mon_sched_n_tasks--;
+        free(task);
+    }
+
+    pthread_mutex_unlock(&mon_sched_lock);
+}
@@ -0,0 +1,434 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file mysql_pool.c Shared administrative connections to the servers
+ *
+ * Each server has MYSQL_POOL_SIZE slots. A slot that is not in use keeps
+ * the connection it was last used with together with the user and a digest
+ * of the password, so that the next caller with the same credentials gets
+ * the connection without connecting again. A caller with other credentials
+ * closes the idle connection of a slot and opens its own.
+ *
+ * A connection that has been idle for more than MYSQL_POOL_PING_AFTER
+ * seconds is pinged before it is given out and one that has been idle for
+ * more than MYSQL_POOL_MAX_IDLE seconds is closed. A connection that got a
+ * client error, for example a lost connection, is closed when it is
+ * returned.
+ */
+
+#include <mysql_pool.h>
+#include <errmsg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <openssl/sha.h>
+#include <atomic.h>
+#include <spinlock.h>
+#include <platform.h>
+#include <maxconfig.h>
+#include <metrics.h>
+#include <mysql_utils.h>
+#include <users.h>
+#include <dbusers.h>
+#include <log_manager.h>
+
+/** Microseconds to sleep while waiting for a slot */
+#define MYSQL_POOL_WAIT 10000
+
+typedef struct mysql_pool_slot
+{
+    MYSQL         *con;      /*< The connection, NULL if none is open */
+    char           user[MYSQL_USER_MAXLEN + 1]; /*< The user of the connection */
+    unsigned char  passwd[SHA_DIGEST_LENGTH];   /*< Digest of the password */
+    time_t         last_used; /*< When the connection was returned */
+    bool           in_use;    /*< The slot has been given to a caller */
+} MYSQL_POOL_SLOT;
+
+typedef struct mysql_pool
+{
+    SERVER          *server;    /*< The server of the connections */
+    SPINLOCK         lock;      /*< Protects the slots */
+    MYSQL_POOL_SLOT  slots[MYSQL_POOL_SIZE];
+    int              n_connects; /*< Connections opened */
+    int              n_reuses;   /*< Connections given out without connecting */
+    int              n_waits;    /*< Callers that waited for a slot */
+    struct mysql_pool *next;
+} MYSQL_POOL;
+
+static SPINLOCK pools_lock = SPINLOCK_INIT;
+static MYSQL_POOL *pools = NULL;
+
+static thread_local unsigned int pool_errno;
+static thread_local char pool_error[512];
+
+static void mysql_pool_print_metrics(DCB *dcb);
+
+/**
+ * Find the pool of a server, creating it if the server has none
+ *
+ * @param server The server
+ * @return The pool or NULL if memory allocation failed
+ */
+static MYSQL_POOL *
+mysql_pool_find(SERVER *server)
+{
+    MYSQL_POOL *pool;
+    bool first = false;
+
+    spinlock_acquire(&pools_lock);
+
+    for (pool = pools; pool && pool->server != server; pool = pool->next)
+    {
+        ;
+    }
+
+    if (pool == NULL && (pool = calloc(1, sizeof(MYSQL_POOL))))
+    {
+        first = pools == NULL;
+        pool->server = server;
+        spinlock_init(&pool->lock);
+        pool->next = pools;
+        pools = pool;
+    }
+
+    spinlock_release(&pools_lock);
+
+    if (first)
+    {
+        metrics_add_printer(mysql_pool_print_metrics);
+    }
+
+    return pool;
+}
+
+/**
+ * Reserve a slot for a caller. An idle connection with the same credentials
+ * is preferred, then a slot without a connection and last the idle
+ * connection of some other user.
+ *
+ * @param pool   The pool
+ * @param user   The user
+ * @param passwd Digest of the password
+ * @param stale  The idle connection of another user that the caller must
+ *               close is stored here
+ * @return The reserved slot or NULL if all slots are in use
+ */
+static MYSQL_POOL_SLOT *
+mysql_pool_reserve(MYSQL_POOL *pool, const char *user, const unsigned char *passwd, MYSQL **stale)
+{
+    MYSQL_POOL_SLOT *empty = NULL;
+    MYSQL_POOL_SLOT *other = NULL;
+    MYSQL_POOL_SLOT *slot = NULL;
+
+    *stale = NULL;
+    spinlock_acquire(&pool->lock);
+
+    for (int i = 0; i < MYSQL_POOL_SIZE && slot == NULL; i++)
+    {
+        MYSQL_POOL_SLOT *s = &pool->slots[i];
+
+        if (s->in_use)
+        {
+            continue;
+        }
+        else if (s->con == NULL)
+        {
+            empty = empty ? empty : s;
+        }
+        else if (strcmp(s->user, user) == 0 && memcmp(s->passwd, passwd, SHA_DIGEST_LENGTH) == 0)
+        {
+            slot = s;
+        }
+        else
+        {
+            other = other ? other : s;
+        }
+    }
+
+    if (slot == NULL && (slot = empty ? empty : other))
+    {
+        *stale = slot->con;
+        slot->con = NULL;
+        snprintf(slot->user, sizeof(slot->user), "%s", user);
+        memcpy(slot->passwd, passwd, SHA_DIGEST_LENGTH);
+    }
+
+    if (slot)
+    {
+        slot->in_use = true;
+    }
+
+    spinlock_release(&pool->lock);
+
+    return slot;
+}
+
+/**
+ * Open a new connection with the timeouts of the authentication connections
+ *
+ * @param server The server
+ * @param user   The user
+ * @param passwd The password
+ * @return The connection or NULL on error
+ */
+static MYSQL *
+mysql_pool_connect(SERVER *server, const char *user, const char *passwd)
+{
+    GATEWAY_CONF *cnf = config_get_global_options();
+    MYSQL *con = mysql_init(NULL);
+
+    if (con == NULL)
+    {
+        pool_errno = CR_OUT_OF_MEMORY;
+        snprintf(pool_error, sizeof(pool_error), "mysql_init: %s", mysql_error(NULL));
+        return NULL;
+    }
+
+    mysql_options(con, MYSQL_OPT_READ_TIMEOUT, &cnf->auth_read_timeout);
+    mysql_options(con, MYSQL_OPT_CONNECT_TIMEOUT, &cnf->auth_conn_timeout);
+    mysql_options(con, MYSQL_OPT_WRITE_TIMEOUT, &cnf->auth_write_timeout);
+
+#if !defined(LIBMARIADB)
+    mysql_options(con, MYSQL_OPT_USE_REMOTE_CONNECTION, NULL);
+#endif
+
+    if (mxs_mysql_real_connect(con, server, user, passwd) == NULL)
+    {
+        pool_errno = mysql_errno(con);
+        snprintf(pool_error, sizeof(pool_error), "%s", mysql_error(con));
+        mysql_close(con);
+        return NULL;
+    }
+
+    return con;
+}
+
+/**
+ * Get an administrative connection to a server
+ *
+ * The connection must be returned with mxs_mysql_pool_put once the caller
+ * has read all results. If no connection could be given, the reason is
+ * returned by mxs_mysql_pool_errno and mxs_mysql_pool_error.
+ *
+ * @param server The server
+ * @param user   The user
+ * @param passwd The password in clear text
+ * @return A connected connection or NULL on error
+ */
+MYSQL *
+mxs_mysql_pool_get(SERVER *server, const char *user, const char *passwd)
+{
+    MYSQL_POOL *pool = mysql_pool_find(server);
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    MYSQL_POOL_SLOT *slot;
+    MYSQL *stale;
+
+    pool_errno = 0;
+    *pool_error = '\0';
+    passwd = passwd ? passwd : "";
+
+    if (pool == NULL)
+    {
+        pool_errno = CR_OUT_OF_MEMORY;
+        snprintf(pool_error, sizeof(pool_error), "Out of memory");
+        return NULL;
+    }
+
+    SHA1((const unsigned char *)passwd, strlen(passwd), digest);
+
+    time_t give_up = time(NULL) + config_get_global_options()->auth_conn_timeout;
+    bool waited = false;
+
+    while ((slot = mysql_pool_reserve(pool, user, digest, &stale)) == NULL)
+    {
+        if (time(NULL) >= give_up)
+        {
+            pool_errno = CR_CONN_HOST_ERROR;
+            snprintf(pool_error, sizeof(pool_error), "All %d administrative connections "
+                     "to the server are in use", MYSQL_POOL_SIZE);
+            return NULL;
+        }
+
+        if (!waited)
+        {
+            atomic_add(&pool->n_waits, 1);
+            waited = true;
+        }
+        usleep(MYSQL_POOL_WAIT);
+    }
+
+    if (stale)
+    {
+        mysql_close(stale);
+    }
+
+    /** The slot belongs to this thread until it is returned */
+    MYSQL *con = slot->con;
+
+    if (con)
+    {
+        time_t idle = time(NULL) - slot->last_used;
+
+        if (idle > MYSQL_POOL_MAX_IDLE || (idle > MYSQL_POOL_PING_AFTER && mysql_ping(con) != 0))
+        {
+            mysql_close(con);
+            con = NULL;
+        }
+        else
+        {
+            atomic_add(&pool->n_reuses, 1);
+        }
+    }
+
+    if (con == NULL && (con = mysql_pool_connect(server, user, passwd)))
+    {
+        atomic_add(&pool->n_connects, 1);
+    }
+
+    spinlock_acquire(&pool->lock);
+    slot->con = con;
+    slot->in_use = con != NULL;
+    spinlock_release(&pool->lock);
+
+    return con;
+}
+
+/**
+ * Return a connection to the pool of a server. A connection that got a
+ * client error is closed.
+ *
+ * @param server The server that the connection was got for
+ * @param con    The connection
+ */
+void
+mxs_mysql_pool_put(SERVER *server, MYSQL *con)
+{
+    MYSQL_POOL *pool = mysql_pool_find(server);
+    bool close = true;
+
+    if (pool)
+    {
+        spinlock_acquire(&pool->lock);
+
+        for (int i = 0; i < MYSQL_POOL_SIZE; i++)
+        {
+            MYSQL_POOL_SLOT *slot = &pool->slots[i];
+
+            if (slot->in_use && slot->con == con)
+            {
+                if (mysql_errno(con) >= CR_MIN_ERROR)
+                {
+                    slot->con = NULL;
+                }
+                else
+                {
+                    close = false;
+                }
+                slot->last_used = time(NULL);
+                slot->in_use = false;
+                break;
+            }
+        }
+
+        spinlock_release(&pool->lock);
+    }
+
+    if (close)
+    {
+        mysql_close(con);
+    }
+}
+
+/**
+ * @return The error number of the last failed mxs_mysql_pool_get of this thread
+ */
+unsigned int
+mxs_mysql_pool_errno()
+{
+    return pool_errno;
+}
+
+/**
+ * @return The error message of the last failed mxs_mysql_pool_get of this thread
+ */
+const char *
+mxs_mysql_pool_error()
+{
+    return pool_error;
+}
+
+/**
+ * Print the metrics of the pools, added as a metrics printer when the first
+ * pool is created
+ *
+ * @param dcb The DCB to print to
+ */
+static void
+mysql_pool_print_metrics(DCB *dcb)
+{
+    metrics_print_family(dcb, "maxscale_admin_connections", METRIC_GAUGE,
+                         "Open administrative connections of each server");
+
+    spinlock_acquire(&pools_lock);
+    for (MYSQL_POOL *pool = pools; pool; pool = pool->next)
+    {
+        int n_idle = 0;
+        int n_in_use = 0;
+        char labels[256];
+
+        spinlock_acquire(&pool->lock);
+        for (int i = 0; i < MYSQL_POOL_SIZE; i++)
+        {
+            if (pool->slots[i].in_use)
+            {
+                n_in_use++;
+            }
+            else if (pool->slots[i].con)
+            {
+                n_idle++;
+            }
+        }
+        spinlock_release(&pool->lock);
+
+        snprintf(labels, sizeof(labels), "server=\"%s\",state=\"idle\"", pool->server->unique_name);
+        metrics_print_value(dcb, "maxscale_admin_connections", "", labels, n_idle);
+        snprintf(labels, sizeof(labels), "server=\"%s\",state=\"in_use\"", pool->server->unique_name);
+        metrics_print_value(dcb, "maxscale_admin_connections", "", labels, n_in_use);
+    }
+
+    metrics_print_family(dcb, "maxscale_admin_connection_uses", METRIC_COUNTER,
+                         "Administrative connections given out, by whether a new connection was opened");
+
+    for (MYSQL_POOL *pool = pools; pool; pool = pool->next)
+    {
+        char labels[256];
+
+        snprintf(labels, sizeof(labels), "server=\"%s\",result=\"connect\"", pool->server->unique_name);
+        metrics_print_value(dcb, "maxscale_admin_connection_uses", "_total", labels, pool->n_connects);
+        snprintf(labels, sizeof(labels), "server=\"%s\",result=\"reuse\"", pool->server->unique_name);
+        metrics_print_value(dcb, "maxscale_admin_connection_uses", "_total", labels, pool->n_reuses);
+    }
+
+    metrics_print_family(dcb, "maxscale_admin_connection_waits", METRIC_COUNTER,
+                         "Callers that waited for an administrative connection that was in use");
+
+    for (MYSQL_POOL *pool = pools; pool; pool = pool->next)
+    {
+        char labels[256];
+
+        snprintf(labels, sizeof(labels), "server=\"%s\"", pool->server->unique_name);
+        metrics_print_value(dcb, "maxscale_admin_connection_waits", "_total", labels, pool->n_waits);
+    }
+    spinlock_release(&pools_lock);
+}
@@ -16,7 +16,14 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <linux/mempolicy.h>
+#include <inttypes.h>
 #include <errno.h>
 #include <maxscale/poll.h>
 #include <dcb.h>
@@ -24,20 +31,42 @@
 #include <gwbitmask.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
+#include <trace.h>
+#include <probes.h>
 #include <gw.h>
 #include <maxconfig.h>
 #include <housekeeper.h>
 #include <maxconfig.h>
 #include <mysql.h>
 #include <resultset.h>
+#include <server.h>
 #include <session.h>
+#include <service.h>
 #include <statistics.h>
+#include <metrics.h>
 #include <query_classifier.h>
+#include <platform.h>
+#include <rdtsc.h>
+#include <thread.h>
 
 #define         PROFILE_POLL    0
 
+#if !defined(SO_BUSY_POLL)
+#define SO_BUSY_POLL    46
+#endif
+
+#if !defined(SO_INCOMING_CPU)
+#define SO_INCOMING_CPU 49
+#endif
+
+#if !defined(EPOLLEXCLUSIVE)
+#define EPOLLEXCLUSIVE  (1u << 28)
+#endif
+
+/** The most NUMA nodes that are read from sysfs */
+#define POLL_MAX_NUMA_NODES 64
+
 #if PROFILE_POLL
-#include <rdtsc.h>
 #include <memlog.h>
 
 extern unsigned long hkheartbeat;
@@ -69,6 +98,8 @@ int max_poll_sleep;
  * 07/07/15     Martin Brampton Simplified add and remove DCB, improve error handling.
  * 23/08/15     Martin Brampton Added test so only DCB with a session link can be added to the poll list
  * 07/02/16     Martin Brampton Added a small piece of SSL logic to EPOLLIN
+ * 14/10/16                     Scale the number of polling threads at runtime
+ * 14/10/16                     Added adaptive polling
  *
  * @endverbatim
  */
@@ -80,7 +111,30 @@ int max_poll_sleep;
  */
 #define MUTEX_EPOLL     0
 
-static int epoll_fd = -1;    /*< The epoll file descriptor */
+/**
+ * A poll set is an epoll instance together with the queue of DCBs that have
+ * events pending processing. In the shared poll mode there is a single poll
+ * set used by all threads. In the per thread mode each thread owns a poll set
+ * and only processes the DCBs that have been added to it, so the event queue
+ * lock is only contended when another thread injects a fake event.
+ */
+typedef struct
+{
+    int      epoll_fd;        /*< The epoll file descriptor */
+    int      wakeup_fd;       /*< Eventfd used to wake up the owner, -1 if not used */
+    DCB      *eventq;         /*< The queue of DCBs with pending events */
+    SPINLOCK lock;            /*< Lock protecting the event queue */
+    int      evq_length;      /*< Event queue length */
+    int      evq_pending;     /*< Number of pending descriptors in event queue */
+    int      evq_max;         /*< Maximum event queue length */
+    int      n_dcbs;          /*< Number of DCBs in the epoll instance */
+} POLL_SET;
+
+static POLL_SET *poll_sets = NULL;  /*< The poll sets */
+static int n_poll_sets = 0;         /*< Number of poll sets */
+static poll_mode_t poll_mode = POLL_MODE_SHARED;
+static int poll_batch_size = 1;     /*< DCBs taken from the event queue at a time */
+static thread_local int poll_thread_id = -1; /*< Id of the polling thread, -1 for others */
 static int do_shutdown = 0;  /*< Flag the shutdown of the poll subsystem */
 static GWBITMASK poll_mask;
 #if MUTEX_EPOLL
@@ -89,11 +143,22 @@ static simple_mutex_t epoll_wait_mutex; /*< serializes calls to epoll_wait */
 static int n_waiting = 0;    /*< No. of threads in epoll_wait */
 
 static int process_pollq(int thread_id);
+static int poll_set_dequeue(POLL_SET *set, DCB **dcbs, uint32_t *events, int max);
+static void poll_set_requeue(POLL_SET *set, DCB *dcb);
+static bool process_dcb_events(int thread_id, DCB *dcb, uint32_t ev);
 static void poll_add_event_to_dcb(DCB* dcb, GWBUF* buf, __uint32_t ev);
 static bool poll_dcb_session_check(DCB *dcb, const char *);
-
-DCB *eventq = NULL;
-SPINLOCK pollqlock = SPINLOCK_INIT;
+static void poll_report_server_failure(DCB *dcb);
+static POLL_SET *poll_dcb_set(DCB *dcb);
+static void poll_set_enqueue(POLL_SET *set, DCB *dcb, uint32_t ev);
+static void poll_set_wakeup(POLL_SET *set);
+static POLL_SET *poll_lock_dcb_set(DCB *dcb);
+static void poll_request_steal(int thread_id);
+static void poll_give_session(int thread_id, DCB *dcb);
+static void poll_retire_thread(int thread_id);
+static void poll_scale_threads(void *data);
+static int poll_evq_pending();
+static uint64_t poll_clock_usecs();
 
 /**
  * Thread load average, this is the average number of descriptors in each
@@ -120,7 +185,8 @@ typedef enum
     THREAD_IDLE,
     THREAD_POLLING,
     THREAD_PROCESSING,
-    THREAD_ZPROCESSING
+    THREAD_ZPROCESSING,
+    THREAD_RETIRING
 } THREAD_STATE;
 
 /**
@@ -133,10 +199,137 @@ typedef struct
     int n_fds;          /*< No. of descriptors thread is processing */
     DCB *cur_dcb;       /*< Current DCB being processed */
     uint32_t event;     /*< Current event being processed */
+    int steal_request;  /*< Thread asking to take over a session, -1 if none */
+    int n_stolen;       /*< No. of sessions taken over from other threads */
+    int n_given;        /*< No. of sessions handed over to other threads */
+    uint64_t avg_gap;   /*< Average time between events in microseconds */
+    unsigned long n_busy_polls;     /*< No. of non-blocking polls with adaptive polling */
+    unsigned long n_blocking_polls; /*< No. of blocking polls with adaptive polling */
 } THREAD_DATA;
 
+/**
+ * The minimum number of DCBs with pending events a thread must have before
+ * an idle thread attempts to take over one of its sessions
+ */
+#define POLL_STEAL_THRESHOLD    2
+
+/** The maximum number of DCBs in a session that can be moved between threads */
+#define POLL_STEAL_MAX_DCBS     16
+
 static THREAD_DATA *thread_data = NULL;    /*< Status of each thread */
 
+/**
+ * The states of a polling thread id when the number of threads is scaled. The
+ * ids of the running threads are kept consecutive, the thread with the
+ * highest id is the one that is stopped.
+ */
+typedef enum
+{
+    SLOT_STOPPED,         /*< No thread is running with the id */
+    SLOT_RUNNING,         /*< A thread is running with the id */
+    SLOT_STOP_REQUESTED,  /*< The thread has been asked to stop */
+    SLOT_STOPPING         /*< The thread is stopping */
+} SLOT_STATE;
+
+/** A polling thread id */
+typedef struct
+{
+    THREAD thread;      /*< The thread started with the id */
+    bool   started;     /*< The thread has been started but not joined */
+    int    state;       /*< SLOT_STATE, changed with compare and swap */
+} POLL_THREAD;
+
+static POLL_THREAD *poll_threads = NULL;    /*< The thread ids, from 0 to n_threads - 1 */
+static void (*poll_thread_main)(void *) = NULL; /*< Entry point of a started thread */
+static int n_target_threads = 0;    /*< Number of threads that should be running */
+static int n_running_threads = 0;   /*< Number of threads in the polling loop */
+static int min_threads = 0;         /*< The thread count is not scaled below this */
+
+/** The timers of a polling thread, in milliseconds of the monotonic clock */
+typedef struct
+{
+    SPINLOCK    lock;   /*< Protects the wheel and the running flags of its timers */
+    TIMER_WHEEL wheel;  /*< The started timers */
+    uint64_t    next;   /*< The earliest expiry, UINT64_MAX if there are no timers */
+} POLL_TIMERS;
+
+static POLL_TIMERS *poll_timers = NULL; /*< The timers of each thread id */
+
+/** The messages posted to a polling thread */
+typedef struct
+{
+    SPINLOCK    lock;   /*< Taken by the thread that pops the messages */
+    MPSC_QUEUE  queue;  /*< The posted messages */
+} POLL_MESSAGES;
+
+static POLL_MESSAGES *poll_messages = NULL; /*< The messages of each thread id */
+
+static void poll_process_messages(int thread_id);
+
+static void poll_process_timers(int thread_id);
+static int poll_timer_timeout(int thread_id, int timeout);
+
+/**
+ * With adaptive polling a thread that finds no events keeps polling without
+ * blocking only if the next event is expected within busy_poll_time. The
+ * expectation is the moving average of the time between the events found by
+ * the thread, each new gap has the weight 1 / 2^POLL_GAP_WEIGHT.
+ */
+#define POLL_GAP_WEIGHT     3
+
+/** The longest gap included in the average, in microseconds */
+#define POLL_GAP_MAX        1000000
+
+/** The time between events in a thread */
+typedef struct
+{
+    uint64_t last_event;    /*< When the thread last found events, in microseconds */
+    uint64_t avg_gap;       /*< Average time between events in microseconds */
+} POLL_ARRIVALS;
+
+static bool adaptive_poll = false;  /*< Busy poll only when events are expected soon */
+static unsigned int busy_poll_time = DEFAULT_BUSY_POLL_TIME; /*< Longest busy poll in microseconds */
+static int socket_busy_poll = 0;    /*< SO_BUSY_POLL of the sockets, 0 if not used */
+
+/**
+ * Whether the listeners are added with EPOLLEXCLUSIVE. Cleared when the
+ * kernel, older than 4.5, rejects the flag.
+ */
+static bool poll_exclusive_listeners = true;
+
+/** How often, in seconds, the number of threads is checked */
+#define POLL_SCALE_FREQ             1
+
+/**
+ * A thread is added when at least this percentage of the events waited in the
+ * event queue for a housekeeper heartbeat or more, or when there are more
+ * DCBs waiting in the queue than there are threads
+ */
+#define POLL_SCALE_DELAYED_PCT      1
+
+/** A thread is only added when the threads are busy for this percentage of the time */
+#define POLL_SCALE_GROW_BUSY_PCT    50
+
+/** A thread is removed when the threads are busy for less than this percentage of the time */
+#define POLL_SCALE_SHRINK_BUSY_PCT  20
+
+/** How many consecutive checks the threads must be idle before a thread is removed */
+#define POLL_SCALE_SHRINK_ROUNDS    30
+
+/** The measurements of the last check of the number of threads */
+static struct
+{
+    unsigned long events;   /*< Events processed */
+    unsigned long delayed;  /*< Events that waited a heartbeat or more */
+    double        cpu;      /*< CPU time used by MaxScale in seconds */
+    double        wall;     /*< Monotonic time in seconds */
+    double        busy_pct; /*< How busy the threads were in the last interval */
+    double        delayed_pct; /*< Percentage of delayed events in the last interval */
+    int           idle_rounds; /*< Consecutive checks with idle threads */
+    int           n_added;   /*< Threads added */
+    int           n_removed; /*< Threads removed */
+} scaleStats;
+
 /**
  * The number of buckets used to gather statistics about how many
  * descriptors where processed on each epoll completion.
@@ -153,21 +346,19 @@ static THREAD_DATA *thread_data = NULL;    /*< Status of each thread */
  */
 static struct
 {
-    ts_stats_t *n_read;         /*< Number of read events   */
-    ts_stats_t *n_write;        /*< Number of write events  */
-    ts_stats_t *n_error;        /*< Number of error events  */
-    ts_stats_t *n_hup;          /*< Number of hangup events */
-    ts_stats_t *n_accept;       /*< Number of accept events */
-    ts_stats_t *n_polls;        /*< Number of poll cycles   */
-    ts_stats_t *n_pollev;       /*< Number of polls returning events */
-    ts_stats_t *n_nbpollev;     /*< Number of polls returning events */
-    ts_stats_t *n_nothreads;    /*< Number of times no threads are polling */
+    ts_stats_t n_read;         /*< Number of read events   */
+    ts_stats_t n_write;        /*< Number of write events  */
+    ts_stats_t n_error;        /*< Number of error events  */
+    ts_stats_t n_hup;          /*< Number of hangup events */
+    ts_stats_t n_accept;       /*< Number of accept events */
+    ts_stats_t n_polls;        /*< Number of poll cycles   */
+    ts_stats_t n_pollev;       /*< Number of polls returning events */
+    ts_stats_t n_nbpollev;     /*< Number of polls returning events */
+    ts_stats_t n_nothreads;    /*< Number of times no threads are polling */
     int n_fds[MAXNFDS];         /*< Number of wakeups with particular n_fds value */
-    int evq_length;             /*< Event queue length */
-    int evq_pending;            /*< Number of pending descriptors in event queue */
-    int evq_max;                /*< Maximum event queue length */
     int wake_evqpending;        /*< Woken from epoll_wait with pending events in queue */
-    ts_stats_t *blockingpolls;  /*< Number of epoll_waits with a timeout specified */
+    ts_stats_t blockingpolls;  /*< Number of epoll_waits with a timeout specified */
+    ts_stats_t n_idlewakes;    /*< Blocking epoll_waits with events after which no DCB was processed */
 } pollStats;
 
 #define N_QUEUE_TIMES   30
@@ -182,6 +373,77 @@ static struct
     unsigned long maxexectime;
 } queueStats;
 
+/**
+ * The number of buckets in the high precision event time histograms. Bucket
+ * n counts the events that took from 2^n to 2^(n+1) microseconds, the first
+ * bucket also counts the events that took less than one microsecond and the
+ * last bucket counts all events that took longer than the others cover.
+ */
+#define N_HP_TIMES      24
+
+/** The event types for which the high precision times are gathered */
+typedef enum
+{
+    HP_EVENT_READ,
+    HP_EVENT_WRITE,
+    HP_EVENT_ACCEPT,
+    HP_EVENT_HANGUP,
+    N_HP_EVENTS
+} HP_EVENT;
+
+static const char *hp_event_names[N_HP_EVENTS] =
+{
+    "Read", "Write", "Accept", "Hangup"
+};
+
+/**
+ * The high precision event time histograms of one thread. Each thread only
+ * updates its own histograms so no locking is required.
+ */
+typedef struct
+{
+    unsigned int qtimes[N_HP_EVENTS][N_HP_TIMES + 1];
+    unsigned int exectimes[N_HP_EVENTS][N_HP_TIMES + 1];
+} HP_TIMES;
+
+static HP_TIMES *hp_times = NULL;       /*< Per thread histograms, NULL if not enabled */
+static double cycles_per_usec = 1.0;    /*< Calibrated CPU cycles in a microsecond */
+
+static double poll_calibrate_cycles();
+static void poll_account_session(DCB *dcb, CYCLES start);
+static void poll_hp_queue_time(int thread_id, DCB *dcb, uint32_t ev);
+static void poll_hp_exec_time(int thread_id, HP_EVENT type, CYCLES start);
+static void poll_hp_bucket_name(int bucket, char *buf, size_t len);
+static unsigned int poll_hp_sum(int type, int bucket, bool queued);
+
+/**
+ * The exported metrics of the polling system. The event counts and queue
+ * lengths are read from the existing statistics when the metrics are printed.
+ */
+static METRIC *queue_time_metric = NULL;
+static METRIC *exec_time_metric = NULL;
+
+/** Bucket bounds of the event time histograms, in housekeeper heartbeats */
+static const int64_t event_time_bounds[] = { 0, 1, 2, 5, 10, 20, 30 };
+
+static void poll_register_metrics();
+
+/**
+ * The CPUs a polling thread is bound to with the thread_affinity parameter.
+ * The threads bind themselves when they start so that the memory of the
+ * thread local pools is first touched, and thus allocated, on their own node.
+ */
+typedef struct
+{
+    cpu_set_t cpus;          /*< The CPUs the thread runs on */
+    int       incoming_cpu;  /*< CPU whose connections the listeners of the thread prefer */
+} POLL_AFFINITY;
+
+static POLL_AFFINITY *poll_affinity = NULL; /*< Per thread CPUs, NULL if the threads are not bound */
+
+static void poll_init_affinity();
+static void poll_bind_thread(int thread_id);
+
 /**
  * How frequently to call the poll_loadav function used to monitor the load
  * average of the poll subsystem.
@@ -207,24 +469,96 @@ poll_init()
 {
     int i;
 
-    if (epoll_fd != -1)
+    if (poll_sets != NULL)
     {
         return;
     }
-    if ((epoll_fd = epoll_create(MAX_EVENTS)) == -1)
+    n_threads = config_threadcount();
+    n_target_threads = config_initial_threads();
+    min_threads = config_min_threads();
+    poll_mode = config_poll_mode();
+    n_poll_sets = poll_mode == POLL_MODE_PER_THREAD ? n_threads : 1;
+
+    if ((poll_sets = (POLL_SET *)calloc(n_poll_sets, sizeof(POLL_SET))) == NULL ||
+        (poll_threads = (POLL_THREAD *)calloc(n_threads, sizeof(POLL_THREAD))) == NULL)
+    {
+        perror("Fatal error: Memory allocation failed.");
+        exit(-1);
+    }
+    if (!dcb_global_init(n_threads) || !session_init_timeouts(n_threads))
     {
-        perror("epoll_create");
         exit(-1);
     }
+    if ((poll_timers = (POLL_TIMERS *)calloc(n_threads, sizeof(POLL_TIMERS))) == NULL ||
+        (poll_messages = (POLL_MESSAGES *)calloc(n_threads, sizeof(POLL_MESSAGES))) == NULL)
+    {
+        perror("Fatal error: Memory allocation failed.");
+        exit(-1);
+    }
+    for (i = 0; i < n_threads; i++)
+    {
+        spinlock_init(&poll_timers[i].lock);
+        spinlock_set_name(&poll_timers[i].lock, "poll timers");
+        timerwheel_init(&poll_timers[i].wheel, poll_clock_usecs() / 1000);
+        poll_timers[i].next = UINT64_MAX;
+        spinlock_init(&poll_messages[i].lock);
+        mpsc_queue_init(&poll_messages[i].queue);
+    }
+    for (i = 0; i < n_poll_sets; i++)
+    {
+        POLL_SET *set = &poll_sets[i];
+
+        spinlock_init(&set->lock);
+        spinlock_set_name(&set->lock, "poll set");
+        set->wakeup_fd = -1;
+
+        if ((set->epoll_fd = epoll_create(MAX_EVENTS)) == -1)
+        {
+            perror("epoll_create");
+            exit(-1);
+        }
+
+        if (poll_mode == POLL_MODE_PER_THREAD)
+        {
+            /**
+             * Fake events can be added to the queue of a thread by any
+             * other thread. The eventfd is used to wake the owning thread
+             * from epoll_wait when that happens.
+             */
+            struct epoll_event ev;
+
+            if ((set->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+            {
+                perror("eventfd");
+                exit(-1);
+            }
+            ev.events = EPOLLIN | EPOLLET;
+            ev.data.ptr = NULL;
+
+            if (epoll_ctl(set->epoll_fd, EPOLL_CTL_ADD, set->wakeup_fd, &ev) == -1)
+            {
+                perror("epoll_ctl");
+                exit(-1);
+            }
+        }
+    }
+
+    poll_init_affinity();
+
     memset(&pollStats, 0, sizeof(pollStats));
     memset(&queueStats, 0, sizeof(queueStats));
     bitmask_init(&poll_mask);
-    n_threads = config_threadcount();
     if ((thread_data = (THREAD_DATA *)malloc(n_threads * sizeof(THREAD_DATA))) != NULL)
     {
         for (i = 0; i < n_threads; i++)
         {
             thread_data[i].state = THREAD_STOPPED;
+            thread_data[i].steal_request = -1;
+            thread_data[i].n_stolen = 0;
+            thread_data[i].n_given = 0;
+            thread_data[i].avg_gap = POLL_GAP_MAX;
+            thread_data[i].n_busy_polls = 0;
+            thread_data[i].n_blocking_polls = 0;
         }
     }
 
@@ -237,7 +571,8 @@ poll_init()
         (pollStats.n_pollev = ts_stats_alloc()) == NULL ||
         (pollStats.n_nbpollev = ts_stats_alloc()) == NULL ||
         (pollStats.n_nothreads = ts_stats_alloc()) == NULL ||
-        (pollStats.blockingpolls = ts_stats_alloc()) == NULL)
+        (pollStats.blockingpolls = ts_stats_alloc()) == NULL ||
+        (pollStats.n_idlewakes = ts_stats_alloc()) == NULL)
     {
         perror("Fatal error: Memory allocation failed.");
         exit(-1);
@@ -247,7 +582,15 @@ poll_init()
     simple_mutex_init(&epoll_wait_mutex, "epoll_wait_mutex");
 #endif
 
+    poll_register_metrics();
+
     hktask_add("Load Average", poll_loadav, NULL, POLL_LOAD_FREQ);
+
+    if (min_threads < n_threads)
+    {
+        hktask_add("Thread Scaling", poll_scale_threads, NULL, POLL_SCALE_FREQ);
+        MXS_NOTICE("The number of threads is scaled between %d and %d.", min_threads, n_threads);
+    }
     n_avg_samples = 15 * 60 / POLL_LOAD_FREQ;
     avg_samples = (double *)malloc(sizeof(double) * n_avg_samples);
     for (i = 0; i < n_avg_samples; i++)
@@ -262,10 +605,198 @@ poll_init()
 
     number_poll_spins = config_nbpolls();
     max_poll_sleep = config_pollsleep();
+    poll_batch_size = config_poll_batch_size();
+    adaptive_poll = config_adaptive_poll();
+    busy_poll_time = config_busy_poll_time();
+    socket_busy_poll = config_socket_busy_poll();
+
+    /** The cycles are needed for the CPU time of the sessions */
+    cycles_per_usec = poll_calibrate_cycles();
+
+    if (config_high_precision_event_times())
+    {
+        if ((hp_times = (HP_TIMES *)calloc(n_threads, sizeof(HP_TIMES))) == NULL)
+        {
+            MXS_ERROR("Failed to allocate memory for high precision event times.");
+        }
+        else
+        {
+            MXS_NOTICE("High precision event times enabled, %.0f CPU cycles per microsecond.",
+                       cycles_per_usec);
+        }
+    }
 
 #if PROFILE_POLL
     plog = memlog_create("EventQueueWaitTime", ML_LONG, 10000);
 #endif
+
+    if (poll_mode == POLL_MODE_PER_THREAD)
+    {
+        MXS_NOTICE("Using %d per thread poll sets.", n_poll_sets);
+    }
+}
+
+/**
+ * Return the poll set that a DCB belongs to
+ *
+ * @param dcb   The DCB
+ * @return      The poll set of the owning thread or the shared poll set
+ */
+static POLL_SET *
+poll_dcb_set(DCB *dcb)
+{
+    if (poll_mode == POLL_MODE_PER_THREAD && dcb->owner >= 0 && dcb->owner < n_poll_sets)
+    {
+        return &poll_sets[dcb->owner];
+    }
+    return &poll_sets[0];
+}
+
+/**
+ * Lock the poll set that a DCB belongs to
+ *
+ * The owner of a DCB may change while the lock is being acquired if its
+ * session is handed over to another thread, in which case the lock of the
+ * new owner is acquired instead.
+ *
+ * @param dcb   The DCB
+ * @return      The locked poll set
+ */
+static POLL_SET *
+poll_lock_dcb_set(DCB *dcb)
+{
+    POLL_SET *set = poll_dcb_set(dcb);
+
+    spinlock_acquire(&set->lock);
+
+    while (set != poll_dcb_set(dcb))
+    {
+        spinlock_release(&set->lock);
+        set = poll_dcb_set(dcb);
+        spinlock_acquire(&set->lock);
+    }
+
+    return set;
+}
+
+/**
+ * Choose the thread that will own a DCB in the per thread poll mode.
+ *
+ * Backend DCBs are pinned to the thread that owns the client DCB of the
+ * session so that all events of a session are processed by one thread.
+ * Other DCBs are given to the thread that currently has the fewest DCBs.
+ *
+ * @param dcb   The DCB being added to the poll sets
+ * @return      The id of the owning thread
+ */
+static int
+poll_choose_owner(DCB *dcb)
+{
+    int owner = poll_session_owner(dcb->session);
+
+    if (owner < 0)
+    {
+        int i;
+
+        owner = 0;
+        for (i = 1; i < n_poll_sets; i++)
+        {
+            if (poll_sets[i].n_dcbs < poll_sets[owner].n_dcbs)
+            {
+                owner = i;
+            }
+        }
+    }
+    return owner;
+}
+
+/**
+ * Return the id of the calling polling thread
+ *
+ * @return The id of the thread or -1 if it is not a polling thread
+ */
+int
+poll_current_thread()
+{
+    return poll_thread_id;
+}
+
+/**
+ * Return the thread that owns the DCBs of a session
+ *
+ * This is only meaningful in the per thread poll mode, in the shared mode
+ * any thread may process the events of any DCB.
+ *
+ * @param session   The session
+ * @return          The owning thread or -1 if the DCBs can be processed by any thread
+ */
+int
+poll_session_owner(SESSION *session)
+{
+    if (poll_mode == POLL_MODE_PER_THREAD &&
+        session &&
+        session->state != SESSION_STATE_DUMMY &&
+        session->client_dcb &&
+        session->client_dcb->owner >= 0)
+    {
+        return session->client_dcb->owner;
+    }
+    return -1;
+}
+
+/**
+ * Check whether a session is confined to the thread that owns it
+ *
+ * In the per thread poll mode, all events of the DCBs of a session are
+ * processed by the owning thread, the DCBs are closed by it and the other
+ * threads only inject fake events into its event queue or post messages to
+ * it with poll_post_message. A router does not
+ * then need to lock its session against concurrent events. A session is
+ * moved to another thread only between two events, at a safe point.
+ *
+ * @param session   The session
+ * @return          True if the session is only processed by its owning thread
+ */
+bool
+poll_session_confined(SESSION *session)
+{
+    return poll_session_owner(session) >= 0;
+}
+
+/**
+ * Add a listener to a poll set
+ *
+ * A listener is added with EPOLLEXCLUSIVE so that a new connection wakes
+ * only one of the threads that wait for it instead of all of them. The flag
+ * only allows EPOLLIN, EPOLLOUT and EPOLLET, which is all a listener needs.
+ * If the kernel does not know the flag, the listeners are added without it.
+ *
+ * @param set   The poll set
+ * @param ev    The events of the listener
+ * @param fd    The socket of the listener
+ * @return      The return value of epoll_ctl
+ */
+static int
+poll_add_listener(POLL_SET *set, struct epoll_event *ev, int fd)
+{
+    int rc = -1;
+
+    if (poll_exclusive_listeners)
+    {
+        struct epoll_event exclusive = *ev;
+        exclusive.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+
+        if ((rc = epoll_ctl(set->epoll_fd, EPOLL_CTL_ADD, fd, &exclusive)) == 0 || errno != EINVAL)
+        {
+            return rc;
+        }
+
+        poll_exclusive_listeners = false;
+        MXS_NOTICE("The kernel does not support EPOLLEXCLUSIVE, the listeners are polled "
+                   "without it.");
+    }
+
+    return epoll_ctl(set->epoll_fd, EPOLL_CTL_ADD, fd, ev);
 }
 
 /**
@@ -282,6 +813,7 @@ poll_add_dcb(DCB *dcb)
     dcb_state_t old_state = dcb->state;
     dcb_state_t new_state;
     struct epoll_event ev;
+    POLL_SET *set;
 
     CHK_DCB(dcb);
 
@@ -329,12 +861,24 @@ poll_add_dcb(DCB *dcb)
                   STRDCBSTATE(dcb->state));
     }
     dcb->state = new_state;
+    if (poll_mode == POLL_MODE_PER_THREAD && dcb->owner < 0)
+    {
+        dcb->owner = poll_choose_owner(dcb);
+    }
     spinlock_release(&dcb->dcb_initlock);
+    set = poll_dcb_set(dcb);
     /*
      * The only possible failure that will not cause a crash is
      * running out of system resources.
      */
-    rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, dcb->fd, &ev);
+    if (new_state == DCB_STATE_LISTENING)
+    {
+        rc = poll_add_listener(set, &ev, dcb->fd);
+    }
+    else
+    {
+        rc = epoll_ctl(set->epoll_fd, EPOLL_CTL_ADD, dcb->fd, &ev);
+    }
     if (rc)
     {
         /* Some errors are actually considered acceptable */
@@ -342,10 +886,16 @@ poll_add_dcb(DCB *dcb)
     }
     if (0 == rc)
     {
-        MXS_DEBUG("%lu [poll_add_dcb] Added dcb %p in state %s to poll set.",
+        atomic_add(&set->n_dcbs, 1);
+        if (new_state == DCB_STATE_LISTENING)
+        {
+            dcb_count_listening(1);
+        }
+        MXS_DEBUG("%lu [poll_add_dcb] Added dcb %p in state %s to poll set %ld.",
                   pthread_self(),
                   dcb,
-                  STRDCBSTATE(dcb->state));
+                  STRDCBSTATE(dcb->state),
+                  (long)(set - poll_sets));
     }
     else
     {
@@ -388,6 +938,10 @@ poll_remove_dcb(DCB *dcb)
     /*<
      * Set state to NOPOLLING and remove dcb from poll set.
      */
+    if (dcb->state == DCB_STATE_LISTENING)
+    {
+        dcb_count_listening(-1);
+    }
     dcb->state = DCB_STATE_NOPOLLING;
 
     /**
@@ -401,7 +955,8 @@ poll_remove_dcb(DCB *dcb)
     spinlock_release(&dcb->dcb_initlock);
     if (dcbfd > 0)
     {
-        rc = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, dcbfd, &ev);
+        POLL_SET *set = poll_dcb_set(dcb);
+        rc = epoll_ctl(set->epoll_fd, EPOLL_CTL_DEL, dcbfd, &ev);
         /**
          * The poll_resolve_error function will always
          * return 0 or crash.  So if it returns non-zero result,
@@ -411,6 +966,10 @@ poll_remove_dcb(DCB *dcb)
         {
             rc = poll_resolve_error(dcb, errno, false);
         }
+        else
+        {
+            atomic_add(&set->n_dcbs, -1);
+        }
         if (rc)
         {
             raise(SIGABRT);
@@ -419,6 +978,55 @@ poll_remove_dcb(DCB *dcb)
     return rc;
 }
 
+/**
+ * Stop or resume the read events of a DCB. Data that arrives while the read
+ * events are stopped stays in the socket, and once the socket buffer is full
+ * TCP flow control stops the peer from sending more. Because the DCB is
+ * modified in the edge triggered mode, a read event is reported right away
+ * when the read events are resumed if there is data to read.
+ *
+ * @param dcb       The DCB
+ * @param enable    Whether read events are reported
+ * @return          0 on success, -1 on error
+ */
+int
+poll_set_read_events(DCB *dcb, bool enable)
+{
+    struct epoll_event ev;
+    POLL_SET *set;
+    int rc = -1;
+
+#ifdef EPOLLRDHUP
+    ev.events = EPOLLOUT | EPOLLRDHUP | EPOLLHUP | EPOLLET;
+#else
+    ev.events = EPOLLOUT | EPOLLHUP | EPOLLET;
+#endif
+    if (enable)
+    {
+        ev.events |= EPOLLIN;
+    }
+    ev.data.ptr = dcb;
+
+    /** The lock keeps the DCB in the same poll set while it is modified */
+    set = poll_lock_dcb_set(dcb);
+
+    if (dcb->state == DCB_STATE_POLLING && dcb->fd > 0)
+    {
+        rc = epoll_ctl(set->epoll_fd, EPOLL_CTL_MOD, dcb->fd, &ev);
+
+        if (rc)
+        {
+            char errbuf[STRERROR_BUFLEN];
+            MXS_ERROR("Failed to %s read events of DCB %p: %d, %s",
+                      enable ? "resume" : "stop", dcb, errno,
+                      strerror_r(errno, errbuf, sizeof(errbuf)));
+        }
+    }
+
+    spinlock_release(&set->lock);
+    return rc;
+}
+
 /**
  * Check error returns from epoll_ctl. Most result in a crash since they
  * are "impossible". Adding when already present is assumed non-fatal.
@@ -493,12 +1101,64 @@ poll_resolve_error(DCB *dcb, int errornum, bool adding)
     return -1;
 }
 
-#define BLOCKINGPOLL 0  /*< Set BLOCKING POLL to 1 if using a single thread and to make
-                         *  debugging easier.
-                         */
-
 /**
- * The main polling loop
+ * Record that a thread found events
+ *
+ * @param arrivals  The event arrivals of the thread
+ * @param now       The current time in microseconds
+ */
+static inline void
+poll_record_arrival(POLL_ARRIVALS *arrivals, uint64_t now)
+{
+    uint64_t gap = now - arrivals->last_event;
+
+    if (gap > POLL_GAP_MAX)
+    {
+        gap = POLL_GAP_MAX;
+    }
+
+    arrivals->avg_gap += ((int64_t)gap - (int64_t)arrivals->avg_gap) / (1 << POLL_GAP_WEIGHT);
+    arrivals->last_event = now;
+}
+
+/**
+ * Check whether a thread that found no events should block in epoll_wait
+ *
+ * Without adaptive polling the thread blocks after number_poll_spins
+ * non-blocking polls. With it, the thread keeps polling only while the next
+ * event is expected soon: the average time between its events must be less
+ * than busy_poll_time and the thread must not have waited for more than twice
+ * the average or busy_poll_time, whichever is shorter.
+ *
+ * @param arrivals   The event arrivals of the thread
+ * @param poll_spins The number of non-blocking polls done without events
+ * @return True if the thread should block
+ */
+static inline bool
+poll_should_block(POLL_ARRIVALS *arrivals, int *poll_spins)
+{
+    if (!adaptive_poll)
+    {
+        return (*poll_spins)++ > number_poll_spins;
+    }
+
+    if (arrivals->avg_gap >= busy_poll_time)
+    {
+        return true;
+    }
+
+    uint64_t waited = poll_clock_usecs() - arrivals->last_event;
+    uint64_t limit = 2 * arrivals->avg_gap < busy_poll_time ? 2 * arrivals->avg_gap : busy_poll_time;
+
+    return waited >= limit;
+}
+
+#define BLOCKINGPOLL 0  /*< Set BLOCKING POLL to 1 if using a single thread and to make
+                         *  debugging easier.
+                         */
+
+/**
+ * The main polling loop
  *
  * This routine does the polling and despatches of IO events
  * to the DCB's. It may be called either directly or as the entry point
@@ -546,6 +1206,12 @@ poll_resolve_error(DCB *dcb, int errornum, bool adding)
  * point there is an event to be processed then the value will be reduced to 10% again
  * for the next blocking call.
  *
+ * With adaptive polling the number of non-blocking polls is not fixed. Each
+ * thread keeps an average of the time between the events it finds and polls
+ * without blocking only when the next event is expected within busy_poll_time,
+ * see poll_should_block. A thread with busy connections avoids the latency of
+ * waking up from epoll_wait while an idle thread blocks at once.
+ *
  * @param arg   The thread ID passed as a void * to satisfy the threading package
  */
 void
@@ -555,8 +1221,16 @@ poll_waitevents(void *arg)
     int i, nfds, timeout_bias = 1;
     intptr_t thread_id = (intptr_t)arg;
     int poll_spins = 0;
+    bool blocked = false;
+    POLL_SET *set = &poll_sets[poll_mode == POLL_MODE_PER_THREAD ? thread_id : 0];
+    POLL_ARRIVALS arrivals = {poll_clock_usecs(), POLL_GAP_MAX};
 
     ts_stats_set_thread_id(thread_id);
+    poll_thread_id = thread_id;
+    poll_bind_thread(thread_id);
+    /** The started threads are already marked running, the main thread is not */
+    __sync_bool_compare_and_swap(&poll_threads[thread_id].state, SLOT_STOPPED, SLOT_RUNNING);
+    atomic_add(&n_running_threads, 1);
 
     /** Add this thread to the bitmask of running polling threads */
     bitmask_set(&poll_mask, thread_id);
@@ -567,14 +1241,14 @@ poll_waitevents(void *arg)
 
     while (1)
     {
-        if (pollStats.evq_pending == 0 && timeout_bias < 10)
+        if (set->evq_pending == 0 && timeout_bias < 10)
         {
             timeout_bias++;
         }
 
         atomic_add(&n_waiting, 1);
 #if BLOCKINGPOLL
-        nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        nfds = epoll_wait(set->epoll_fd, events, MAX_EVENTS, -1);
         atomic_add(&n_waiting, -1);
 #else /* BLOCKINGPOLL */
 #if MUTEX_EPOLL
@@ -586,7 +1260,8 @@ poll_waitevents(void *arg)
         }
 
         ts_stats_add(pollStats.n_polls, 1);
-        if ((nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, 0)) == -1)
+        blocked = false;
+        if ((nfds = epoll_wait(set->epoll_fd, events, MAX_EVENTS, 0)) == -1)
         {
             atomic_add(&n_waiting, -1);
             int eno = errno;
@@ -606,14 +1281,20 @@ poll_waitevents(void *arg)
          * We calculate a timeout bias to alter the length of the blocking
          * call based on the time since we last received an event to process
          */
-        else if (nfds == 0 && pollStats.evq_pending == 0 && poll_spins++ > number_poll_spins)
+        else if (nfds == 0 && set->evq_pending == 0 && poll_should_block(&arrivals, &poll_spins))
         {
+            if (poll_mode == POLL_MODE_PER_THREAD)
+            {
+                poll_request_steal(thread_id);
+            }
             ts_stats_add(pollStats.blockingpolls, 1);
-            nfds = epoll_wait(epoll_fd,
+            blocked = true;
+            nfds = epoll_wait(set->epoll_fd,
                               events,
                               MAX_EVENTS,
-                              (max_poll_sleep * timeout_bias) / 10);
-            if (nfds == 0 && pollStats.evq_pending)
+                              poll_timer_timeout(thread_id,
+                                                 service_queue_poll_timeout((max_poll_sleep * timeout_bias) / 10)));
+            if (nfds == 0 && set->evq_pending)
             {
                 atomic_add(&pollStats.wake_evqpending, 1);
                 poll_spins = 0;
@@ -632,14 +1313,34 @@ poll_waitevents(void *arg)
         simple_mutex_unlock(&epoll_wait_mutex);
 #endif
 #endif /* BLOCKINGPOLL */
+        if (adaptive_poll && thread_data)
+        {
+            if (blocked)
+            {
+                thread_data[thread_id].n_blocking_polls++;
+            }
+            else
+            {
+                thread_data[thread_id].n_busy_polls++;
+            }
+        }
+
         if (nfds > 0)
         {
             timeout_bias = 1;
-            if (poll_spins <= number_poll_spins + 1)
+            if (!blocked)
             {
                 ts_stats_add(pollStats.n_nbpollev, 1);
             }
             poll_spins = 0;
+            if (adaptive_poll)
+            {
+                poll_record_arrival(&arrivals, poll_clock_usecs());
+                if (thread_data)
+                {
+                    thread_data[thread_id].avg_gap = arrivals.avg_gap;
+                }
+            }
             MXS_DEBUG("%lu [poll_waitevents] epoll_wait found %d fds",
                       pthread_self(),
                       nfds);
@@ -668,47 +1369,38 @@ poll_waitevents(void *arg)
              * idle and is added to the queue to process after
              * setting the event bits.
              */
+            DCB *readable[MAX_EVENTS];
+            int n_readable = 0;
+
             for (i = 0; i < nfds; i++)
             {
                 DCB *dcb = (DCB *)events[i].data.ptr;
                 __uint32_t ev = events[i].events;
 
-                spinlock_acquire(&pollqlock);
-                if (DCB_POLL_BUSY(dcb))
+                if (dcb == NULL)
                 {
-                    if (dcb->evq.pending_events == 0)
+                    /** A wakeup from another thread, the fake events are already queued */
+                    uint64_t count;
+                    while (read(set->wakeup_fd, &count, sizeof(count)) > 0)
                     {
-                        pollStats.evq_pending++;
-                        dcb->evq.inserted = hkheartbeat;
+                        ;
                     }
-                    dcb->evq.pending_events |= ev;
+                    continue;
                 }
-                else
+
+                ss_dassert(poll_mode == POLL_MODE_SHARED || dcb->owner == thread_id);
+                spinlock_acquire(&set->lock);
+                poll_set_enqueue(set, dcb, ev);
+                spinlock_release(&set->lock);
+
+                if (ev & EPOLLIN)
                 {
-                    dcb->evq.pending_events = ev;
-                    if (eventq)
-                    {
-                        dcb->evq.prev = eventq->evq.prev;
-                        eventq->evq.prev->evq.next = dcb;
-                        eventq->evq.prev = dcb;
-                        dcb->evq.next = eventq;
-                    }
-                    else
-                    {
-                        eventq = dcb;
-                        dcb->evq.prev = dcb;
-                        dcb->evq.next = dcb;
-                    }
-                    pollStats.evq_length++;
-                    pollStats.evq_pending++;
-                    dcb->evq.inserted = hkheartbeat;
-                    if (pollStats.evq_length > pollStats.evq_max)
-                    {
-                        pollStats.evq_max = pollStats.evq_length;
-                    }
+                    readable[n_readable++] = dcb;
                 }
-                spinlock_release(&pollqlock);
             }
+
+            /** With io_uring the readable sockets are read with one system call */
+            dcb_read_ahead(readable, n_readable);
         }
 
         /*
@@ -721,12 +1413,32 @@ poll_waitevents(void *arg)
         {
             timeout_bias = 1;
         }
+        else if (blocked && nfds > 0)
+        {
+            /** Woken up for events that another thread processed */
+            ts_stats_add(pollStats.n_idlewakes, 1);
+        }
 
-        if (check_timeouts && hkheartbeat >= next_timeout_check)
+        if (check_timeouts)
         {
-            process_idle_sessions();
+            /** The timers of the stopped thread ids are checked by the running threads */
+            int step = n_target_threads;
+
+            for (int i = thread_id; i < n_threads; i += step)
+            {
+                session_process_timeouts(i);
+            }
         }
 
+        /** Like the session timeouts, the timers and messages of the stopped thread ids */
+        for (int i = thread_id; i < n_threads; i += n_target_threads)
+        {
+            poll_process_messages(i);
+            poll_process_timers(i);
+        }
+        dcb_process_connect_timeouts();
+        service_process_queued_connections();
+
         if (thread_data)
         {
             thread_data[thread_id].state = THREAD_ZPROCESSING;
@@ -748,8 +1460,18 @@ poll_waitevents(void *arg)
                 thread_data[thread_id].state = THREAD_STOPPED;
             }
             bitmask_clear(&poll_mask, thread_id);
+            atomic_add(&n_running_threads, -1);
+            return;
+        }
+
+        if (poll_threads[thread_id].state == SLOT_STOP_REQUESTED &&
+            __sync_bool_compare_and_swap(&poll_threads[thread_id].state,
+                                         SLOT_STOP_REQUESTED, SLOT_STOPPING))
+        {
+            poll_retire_thread(thread_id);
             return;
         }
+
         if (thread_data)
         {
             thread_data[thread_id].state = THREAD_IDLE;
@@ -757,6 +1479,712 @@ poll_waitevents(void *arg)
     } /*< while(1) */
 }
 
+/**
+ * Stop a polling thread that is no longer needed
+ *
+ * This is called by the thread itself between two rounds of the polling loop,
+ * when it is not processing any DCB. In the shared poll mode the DCBs are not
+ * owned by any thread so only the resources cached by the thread need to be
+ * released: the zombies it has not yet freed are handed over to the other
+ * threads and its free DCBs, sessions and buffers are returned to the shared
+ * pools.
+ *
+ * @param thread_id     The id of the thread
+ */
+static void
+poll_retire_thread(int thread_id)
+{
+    if (thread_data)
+    {
+        thread_data[thread_id].state = THREAD_RETIRING;
+    }
+
+    dcb_process_zombies(thread_id);
+    dcb_thread_end();
+    session_thread_end();
+    gwbuf_thread_end();
+
+    bitmask_clear(&poll_mask, thread_id);
+    int running = atomic_add(&n_running_threads, -1) - 1;
+
+    if (thread_data)
+    {
+        thread_data[thread_id].state = THREAD_STOPPED;
+    }
+    poll_threads[thread_id].state = SLOT_STOPPED;
+
+    MXS_NOTICE("Polling thread %d stopped, %d threads running.", thread_id, running);
+}
+
+/**
+ * Start a polling thread with an id that is not in use
+ *
+ * @param thread_id     The id of the thread
+ * @return              True if the thread was started
+ */
+static bool
+poll_start_thread(int thread_id)
+{
+    POLL_THREAD *slot = &poll_threads[thread_id];
+
+    ss_dassert(slot->state == SLOT_STOPPED);
+
+    if (slot->started)
+    {
+        /** The previous thread with this id has stopped, it only needs to be joined */
+        thread_wait(slot->thread);
+        slot->started = false;
+    }
+
+    slot->state = SLOT_RUNNING;
+
+    if (thread_start(&slot->thread, poll_thread_main, (void *)(intptr_t)thread_id) == NULL)
+    {
+        slot->state = SLOT_STOPPED;
+        return false;
+    }
+
+    slot->started = true;
+    return true;
+}
+
+/**
+ * Start the polling threads. The main thread is the thread with id 0 and it
+ * polls by calling poll_waitevents itself, the others are started here. The
+ * same entry point is used for the threads started later when the number of
+ * threads is scaled up.
+ *
+ * @param entry The entry point of the threads, it must call poll_waitevents
+ *              with the argument it is given
+ * @return True if all the threads were started
+ */
+bool
+poll_start_threads(void (*entry)(void *))
+{
+    poll_thread_main = entry;
+
+    for (int i = 1; i < n_target_threads; i++)
+    {
+        if (!poll_start_thread(i))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Wait for all the started polling threads to exit after poll_shutdown
+ * has been called
+ */
+void
+poll_wait_threads()
+{
+    for (int i = 1; i < n_threads; i++)
+    {
+        if (poll_threads[i].started)
+        {
+            thread_wait(poll_threads[i].thread);
+            poll_threads[i].started = false;
+        }
+    }
+}
+
+/**
+ * Return the number of polling threads that are running
+ *
+ * @return The number of threads in the polling loop
+ */
+int
+poll_running_threads()
+{
+    return n_running_threads;
+}
+
+/**
+ * Add a polling thread. The thread with the next free id is started unless
+ * the previous thread with that id is still running, in which case it is
+ * asked to continue if it has not yet started to stop.
+ *
+ * @return True if the number of threads grew
+ */
+static bool
+poll_add_thread()
+{
+    int thread_id = n_target_threads;
+    POLL_THREAD *slot = &poll_threads[thread_id];
+
+    if (__sync_bool_compare_and_swap(&slot->state, SLOT_STOP_REQUESTED, SLOT_RUNNING) ||
+        (slot->state == SLOT_STOPPED && poll_start_thread(thread_id)))
+    {
+        n_target_threads++;
+        MXS_NOTICE("Added polling thread %d, %.0f%% of the events were delayed and the "
+                   "threads were busy %.0f%% of the time.", thread_id,
+                   scaleStats.delayed_pct, scaleStats.busy_pct);
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * Remove the polling thread with the highest id. The thread stops the next
+ * time it goes through the polling loop.
+ */
+static void
+poll_remove_thread()
+{
+    int thread_id = n_target_threads - 1;
+
+    n_target_threads--;
+    poll_threads[thread_id].state = SLOT_STOP_REQUESTED;
+    MXS_NOTICE("Removing polling thread %d, the threads were busy %.0f%% of the time.",
+               thread_id, scaleStats.busy_pct);
+}
+
+/**
+ * Check whether the number of polling threads should change. This is called
+ * by the housekeeper every POLL_SCALE_FREQ seconds.
+ *
+ * The threads are needed when the events have to wait in the event queue
+ * before a thread is free to process them. A thread is only added if the
+ * running threads are busy, as measured by the CPU time MaxScale uses, and
+ * there are processors left for it. A thread is removed when no events have
+ * been delayed and the threads have been mostly idle for a while.
+ *
+ * @param data  Argument required by the housekeeper but not used here
+ */
+static void
+poll_scale_threads(void *data)
+{
+    unsigned long events = 0;
+    struct rusage usage;
+    struct timespec now;
+
+    for (int i = 0; i <= N_QUEUE_TIMES; i++)
+    {
+        events += queueStats.qtimes[i];
+    }
+
+    unsigned long delayed = events - queueStats.qtimes[0];
+
+    getrusage(RUSAGE_SELF, &usage);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    double cpu = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+                 (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0;
+    double wall = now.tv_sec + now.tv_nsec / 1000000000.0;
+    double elapsed = wall - scaleStats.wall;
+    double used = cpu - scaleStats.cpu;
+    unsigned long new_events = events - scaleStats.events;
+    unsigned long new_delayed = delayed - scaleStats.delayed;
+    bool first = scaleStats.wall == 0;
+
+    scaleStats.events = events;
+    scaleStats.delayed = delayed;
+    scaleStats.cpu = cpu;
+    scaleStats.wall = wall;
+
+    if (first || elapsed <= 0 || do_shutdown)
+    {
+        return;
+    }
+
+    scaleStats.busy_pct = 100.0 * used / (elapsed * n_target_threads);
+    scaleStats.delayed_pct = new_events ? 100.0 * new_delayed / new_events : 0;
+
+    bool queueing = scaleStats.delayed_pct >= POLL_SCALE_DELAYED_PCT ||
+                    poll_evq_pending() > n_target_threads;
+
+    if (queueing && scaleStats.busy_pct >= POLL_SCALE_GROW_BUSY_PCT &&
+        n_target_threads < n_threads && used / elapsed < get_processor_count() - 0.5)
+    {
+        scaleStats.idle_rounds = 0;
+
+        if (poll_add_thread())
+        {
+            scaleStats.n_added++;
+        }
+    }
+    else if (new_delayed == 0 && scaleStats.busy_pct < POLL_SCALE_SHRINK_BUSY_PCT &&
+             n_target_threads > min_threads)
+    {
+        if (++scaleStats.idle_rounds >= POLL_SCALE_SHRINK_ROUNDS)
+        {
+            scaleStats.idle_rounds = 0;
+            scaleStats.n_removed++;
+            poll_remove_thread();
+        }
+    }
+    else
+    {
+        scaleStats.idle_rounds = 0;
+    }
+}
+
+/**
+ * Return the current monotonic time in microseconds
+ *
+ * @return The time in microseconds
+ */
+static uint64_t
+poll_clock_usecs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Initialize a timer
+ *
+ * @param timer The timer
+ * @param fn    Function called in a polling thread when the timer expires
+ * @param data  The argument of fn
+ */
+void
+poll_timer_init(POLL_TIMER *timer, void (*fn)(void *), void *data)
+{
+    timerwheel_entry_init(&timer->entry);
+    timer->fn = fn;
+    timer->data = data;
+    timer->thread_id = -1;
+    timer->running = false;
+}
+
+/**
+ * Start a timer, or restart it if it is already running
+ *
+ * The timer expires in the polling thread that first started it, or in the
+ * first thread if it was started outside the polling threads. In the per
+ * thread poll mode a timer that is not pending moves to the polling thread
+ * that starts it, so the timers of a session follow it when it is given to
+ * another thread. The function is called without any locks held so it may
+ * start the timer again.
+ *
+ * @param timer    The timer
+ * @param delay_ms Milliseconds from now when the timer expires
+ */
+void
+poll_timer_start(POLL_TIMER *timer, int delay_ms)
+{
+    if (timer->thread_id < 0)
+    {
+        timer->thread_id = poll_thread_id >= 0 ? poll_thread_id : 0;
+    }
+    else if (poll_mode == POLL_MODE_PER_THREAD && poll_thread_id >= 0 &&
+             timer->thread_id != poll_thread_id)
+    {
+        POLL_TIMERS *old = &poll_timers[timer->thread_id];
+
+        spinlock_acquire(&old->lock);
+        if (!timer->running && !timerwheel_is_linked(&timer->entry))
+        {
+            timer->thread_id = poll_thread_id;
+        }
+        spinlock_release(&old->lock);
+    }
+
+    POLL_TIMERS *timers = &poll_timers[timer->thread_id];
+    uint64_t expiry = poll_clock_usecs() / 1000 + delay_ms;
+
+    spinlock_acquire(&timers->lock);
+    timerwheel_add(&timers->wheel, &timer->entry, expiry);
+    if (expiry < timers->next)
+    {
+        timers->next = expiry;
+    }
+    spinlock_release(&timers->lock);
+}
+
+/**
+ * Stop a timer. If the function of the timer is being called, this waits for
+ * it to return, so the caller may free the data of the timer afterwards. The
+ * caller must not hold locks that the function takes.
+ *
+ * @param timer The timer
+ */
+void
+poll_timer_stop(POLL_TIMER *timer)
+{
+    if (timer->thread_id >= 0)
+    {
+        POLL_TIMERS *timers = &poll_timers[timer->thread_id];
+
+        spinlock_acquire(&timers->lock);
+        timerwheel_remove(&timer->entry);
+
+        while (timer->running)
+        {
+            spinlock_release(&timers->lock);
+            sched_yield();
+            spinlock_acquire(&timers->lock);
+        }
+        spinlock_release(&timers->lock);
+    }
+}
+
+/**
+ * Call the functions of the expired timers of a thread
+ *
+ * @param thread_id The thread id whose timers are processed
+ */
+static void
+poll_process_timers(int thread_id)
+{
+    POLL_TIMERS *timers = &poll_timers[thread_id];
+
+    /** Dirty reads, the lock is only taken when a timer is due */
+    if (timers->next == UINT64_MAX)
+    {
+        return;
+    }
+
+    uint64_t now = poll_clock_usecs() / 1000;
+
+    if (now < timers->next || !spinlock_acquire_nowait(&timers->lock))
+    {
+        return;
+    }
+
+    TIMER_ENTRY expired;
+    timerwheel_list_init(&expired);
+    timerwheel_advance(&timers->wheel, now, &expired);
+
+    while (!timerwheel_list_empty(&expired))
+    {
+        POLL_TIMER *timer = (POLL_TIMER *)((char *)expired.next - offsetof(POLL_TIMER, entry));
+
+        timerwheel_remove(&timer->entry);
+        timer->running = true;
+        spinlock_release(&timers->lock);
+
+        timer->fn(timer->data);
+
+        spinlock_acquire(&timers->lock);
+        timer->running = false;
+    }
+
+    timers->next = timerwheel_next_expiry(&timers->wheel);
+    spinlock_release(&timers->lock);
+}
+
+/**
+ * Initialise a message
+ *
+ * @param msg  The message
+ * @param fn   Function called in the polling thread the message is posted to
+ * @param data The argument of fn
+ */
+void
+poll_message_init(POLL_MESSAGE *msg, void (*fn)(void *), void *data)
+{
+    msg->node.next = NULL;
+    msg->fn = fn;
+    msg->data = data;
+}
+
+/**
+ * Post a message to a polling thread
+ *
+ * The function of the message is called by the thread between two rounds of
+ * its polling loop, when it is not processing any DCB. This is how the other
+ * threads hand work to the owner of a confined session. A message of a
+ * thread id that is not running is processed by a running thread, so the
+ * function must check that it runs in the thread it expects and otherwise
+ * post the message again. A message must not be posted again before its
+ * function has been called.
+ *
+ * @param thread_id The thread id
+ * @param msg       The message
+ */
+void
+poll_post_message(int thread_id, POLL_MESSAGE *msg)
+{
+    ss_dassert(thread_id >= 0 && thread_id < n_threads);
+    mpsc_queue_push(&poll_messages[thread_id].queue, &msg->node);
+    poll_set_wakeup(&poll_sets[poll_mode == POLL_MODE_PER_THREAD ? thread_id : 0]);
+}
+
+/**
+ * Call the functions of the messages posted to a thread
+ *
+ * @param thread_id The thread id whose messages are processed
+ */
+static void
+poll_process_messages(int thread_id)
+{
+    POLL_MESSAGES *messages = &poll_messages[thread_id];
+
+    /** Dirty reads, the lock is only taken when there are messages */
+    MPSC_NODE *tail = __atomic_load_n(&messages->queue.tail, __ATOMIC_RELAXED);
+
+    if (tail == &messages->queue.stub && __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE) == NULL)
+    {
+        return;
+    }
+
+    /** The queue has one consumer, the lock is only contended for stopped thread ids */
+
+    if (spinlock_acquire_nowait(&messages->lock))
+    {
+        MPSC_NODE *node;
+
+        while ((node = mpsc_queue_pop(&messages->queue)))
+        {
+            POLL_MESSAGE *msg = (POLL_MESSAGE *)((char *)node - offsetof(POLL_MESSAGE, node));
+            msg->fn(msg->data);
+        }
+
+        spinlock_release(&messages->lock);
+    }
+}
+
+/**
+ * Shorten the timeout of a blocking epoll_wait so that the thread wakes up
+ * when its next timer expires
+ *
+ * @param thread_id The thread id
+ * @param timeout   The timeout in milliseconds
+ * @return The timeout to use
+ */
+static int
+poll_timer_timeout(int thread_id, int timeout)
+{
+    uint64_t next = poll_timers[thread_id].next;
+
+    if (next != UINT64_MAX)
+    {
+        uint64_t now = poll_clock_usecs() / 1000;
+        uint64_t wait = next > now ? next - now : 0;
+
+        if (wait < (uint64_t)timeout)
+        {
+            timeout = wait;
+        }
+    }
+
+    return timeout;
+}
+
+/**
+ * Set the SO_BUSY_POLL option of a socket if socket_busy_poll is configured.
+ * The kernel then polls the device queue of the NIC for the given time when a
+ * read finds no data, instead of waiting for an interrupt. A socket accepted
+ * from a listener inherits the option of the listener.
+ *
+ * Raising the value above the net.core.busy_read setting requires the
+ * CAP_NET_ADMIN capability. If the option can not be set, a warning is logged
+ * once and the option is no longer tried.
+ *
+ * @param fd    The socket
+ */
+void
+poll_set_socket_busy_poll(int fd)
+{
+    static bool warned = false;
+    int usecs = socket_busy_poll;
+
+    if (usecs > 0 && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) != 0)
+    {
+        char errbuf[STRERROR_BUFLEN];
+
+        if (!warned)
+        {
+            warned = true;
+            MXS_WARNING("Failed to set SO_BUSY_POLL, socket_busy_poll is ignored. Error %d: %s",
+                        errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        }
+        socket_busy_poll = 0;
+    }
+}
+
+/**
+ * Read the CPUs of the NUMA nodes from sysfs
+ *
+ * @param nodes Array where the CPUs of the nodes are stored
+ * @param max   Size of the array
+ * @return Number of nodes that have CPUs
+ */
+static int
+poll_read_numa_nodes(cpu_set_t *nodes, int max)
+{
+    int n_nodes = 0;
+
+    for (int node = 0; node < POLL_MAX_NUMA_NODES && n_nodes < max; node++)
+    {
+        char path[PATH_MAX];
+        char list[4096];
+        FILE *file;
+
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+
+        if ((file = fopen(path, "r")) == NULL)
+        {
+            continue;
+        }
+
+        if (fgets(list, sizeof(list), file))
+        {
+            char *end = strchr(list, '\n');
+
+            if (end)
+            {
+                *end = '\0';
+            }
+
+            /** Nodes without CPUs, e.g. memory only nodes, have an empty list */
+            if (config_parse_cpu_list(list, &nodes[n_nodes]))
+            {
+                n_nodes++;
+            }
+        }
+
+        fclose(file);
+    }
+
+    return n_nodes;
+}
+
+/**
+ * Assign CPUs to the polling threads according to the thread_affinity
+ * parameter. With a list of CPUs each thread gets one CPU of the list, with
+ * numa the threads are spread over the nodes and each thread may run on all
+ * the CPUs of its node. The CPUs are reused if there are more threads than
+ * CPUs or nodes.
+ */
+static void
+poll_init_affinity()
+{
+    thread_affinity_t mode = config_thread_affinity();
+    int max_sets = mode == THREAD_AFFINITY_NUMA ? POLL_MAX_NUMA_NODES : CPU_SETSIZE;
+    cpu_set_t *sets;
+    int n_sets = 0;
+
+    if (mode == THREAD_AFFINITY_NONE)
+    {
+        return;
+    }
+
+    if ((sets = (cpu_set_t *)calloc(max_sets, sizeof(cpu_set_t))) == NULL ||
+        (poll_affinity = (POLL_AFFINITY *)calloc(n_threads, sizeof(POLL_AFFINITY))) == NULL)
+    {
+        MXS_ERROR("Failed to allocate memory for the thread affinity, "
+                  "the polling threads are not bound to CPUs.");
+        free(sets);
+        return;
+    }
+
+    if (mode == THREAD_AFFINITY_NUMA)
+    {
+        n_sets = poll_read_numa_nodes(sets, max_sets);
+    }
+    else
+    {
+        const cpu_set_t *cpus = config_thread_cpus();
+
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, cpus))
+            {
+                CPU_SET(cpu, &sets[n_sets]);
+                n_sets++;
+            }
+        }
+    }
+
+    if (n_sets == 0)
+    {
+        MXS_WARNING("No NUMA nodes found in /sys/devices/system/node, "
+                    "the polling threads are not bound to CPUs.");
+        free(poll_affinity);
+        poll_affinity = NULL;
+        free(sets);
+        return;
+    }
+
+    for (int i = 0; i < n_threads; i++)
+    {
+        POLL_AFFINITY *affinity = &poll_affinity[i];
+        int nth = (i / n_sets) % CPU_COUNT(&sets[i % n_sets]);
+
+        affinity->cpus = sets[i % n_sets];
+        affinity->incoming_cpu = -1;
+
+        for (int cpu = 0; cpu < CPU_SETSIZE && affinity->incoming_cpu == -1; cpu++)
+        {
+            if (CPU_ISSET(cpu, &affinity->cpus) && nth-- == 0)
+            {
+                affinity->incoming_cpu = cpu;
+            }
+        }
+    }
+
+    MXS_NOTICE("Polling threads are bound to %d %s.", n_sets,
+               mode == THREAD_AFFINITY_NUMA ? "NUMA nodes" : "CPUs");
+    free(sets);
+}
+
+/**
+ * Bind the calling polling thread to its CPUs. With NUMA affinity the memory
+ * policy of the thread is also set to allocate from the local node in case
+ * MaxScale was started with a different policy, e.g. by numactl.
+ *
+ * @param thread_id The id of the thread
+ */
+static void
+poll_bind_thread(int thread_id)
+{
+    if (poll_affinity)
+    {
+        int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                                        &poll_affinity[thread_id].cpus);
+        if (rc != 0)
+        {
+            char errbuf[STRERROR_BUFLEN];
+            MXS_ERROR("Failed to bind polling thread %d to its CPUs. Error %d: %s",
+                      thread_id, rc, strerror_r(rc, errbuf, sizeof(errbuf)));
+        }
+#if defined(SYS_set_mempolicy)
+        else if (config_thread_affinity() == THREAD_AFFINITY_NUMA &&
+                 syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0) != 0)
+        {
+            char errbuf[STRERROR_BUFLEN];
+            MXS_WARNING("Failed to set the memory policy of polling thread %d. Error %d: %s",
+                        thread_id, errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        }
+#endif
+    }
+}
+
+/**
+ * Make a SO_REUSEPORT listener of a polling thread prefer the connections
+ * whose packets are processed on a CPU the thread runs on. When the interrupts
+ * of the receive queues of the NIC are spread over the CPUs, the connections
+ * are then accepted on the node they arrive on. This is only done when the
+ * threads are bound to CPUs and it requires Linux 6.2 or later to take effect
+ * with SO_REUSEPORT.
+ *
+ * @param fd        The listening socket
+ * @param thread_id The thread that polls the socket
+ */
+void
+poll_set_socket_incoming_cpu(int fd, int thread_id)
+{
+    if (poll_affinity && thread_id >= 0 && thread_id < n_threads)
+    {
+        int cpu = poll_affinity[thread_id].incoming_cpu;
+
+        if (setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) != 0)
+        {
+            char errbuf[STRERROR_BUFLEN];
+            MXS_WARNING("Failed to set SO_INCOMING_CPU of a listener of thread %d. Error %d: %s",
+                        thread_id, errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        }
+    }
+}
+
 /**
  * Set the number of non-blocking poll cycles that will be done before
  * a blocking poll will take place. Whenever an event arrives on a thread
@@ -788,81 +2216,204 @@ poll_set_maxwait(unsigned int maxwait)
 /**
  * Process of the queue of DCB's that have outstanding events
  *
- * The first event on the queue will be chosen to be executed by this thread,
+ * The first DCBs on the queue, up to poll_batch_size of them, will be chosen
+ * to be executed by this thread with a single acquisition of the queue lock,
  * all other events will be left on the queue and may be picked up by other
- * threads. When the processing is complete the thread will take the DCB off the
+ * threads. The DCBs are processed in the order they were taken from the queue.
+ * When the processing is complete the thread will take the DCBs off the
  * queue if there are no pending events that have arrived since the thread started
  * to process the DCB. If there are pending events the DCB will be moved to the
  * back of the queue so that other DCB's will have a share of the threads to
  * execute events for them.
  *
- * Including session id to log entries depends on this function. Assumption is
- * that when maxscale thread starts processing of an event it processes one
- * and only one session until it returns from this function. Session id is
- * read to thread's local storage if LOG_MAY_BE_ENABLED(LOGFILE_TRACE) returns true
- * reset back to zero just before returning in LOG_IS_ENABLED(LOGFILE_TRACE) returns true.
- * Thread local storage (tls_log_info_t) follows thread and is accessed every
- * time log is written to particular log.
+ * Including session id to log entries depends on this function. Assumption is
+ * that when maxscale thread starts processing of an event it processes one
+ * and only one session until the event has been processed. Session id is
+ * read to thread's local storage if LOG_MAY_BE_ENABLED(LOGFILE_TRACE) returns true
+ * reset back to zero just before returning in LOG_IS_ENABLED(LOGFILE_TRACE) returns true.
+ * Thread local storage (tls_log_info_t) follows thread and is accessed every
+ * time log is written to particular log.
+ *
+ * @param thread_id     The thread ID of the calling thread
+ * @return              0 if no DCB's have been processed
+ */
+static int
+process_pollq(int thread_id)
+{
+    DCB *batch[MAX_POLL_BATCH_SIZE];
+    uint32_t events[MAX_POLL_BATCH_SIZE];
+    bool processed[MAX_POLL_BATCH_SIZE];
+    POLL_SET *set = &poll_sets[poll_mode == POLL_MODE_PER_THREAD ? thread_id : 0];
+    int n, i;
+
+    spinlock_acquire(&set->lock);
+    n = poll_set_dequeue(set, batch, events, poll_batch_size);
+    spinlock_release(&set->lock);
+
+    if (n == 0)
+    {
+        return 0;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        TRACE_EVENT(TRACE_POLL_EVENTS_BEGIN, dcb_get_session_id(batch[i]), events[i], batch[i]->fd);
+        MXS_PROBE4(poll_events_start, thread_id, batch[i], batch[i]->fd, events[i]);
+        processed[i] = process_dcb_events(thread_id, batch[i], events[i]);
+        MXS_PROBE3(poll_events_end, thread_id, batch[i], processed[i]);
+        TRACE_EVENT(TRACE_POLL_EVENTS_END, 0, processed[i], 0);
+        /** Reset session id from thread's local storage */
+        mxs_log_tls.li_sesid = 0;
+    }
+
+    spinlock_acquire(&set->lock);
+    for (i = 0; i < n; i++)
+    {
+        if (processed[i])
+        {
+            poll_set_requeue(set, batch[i]);
+        }
+    }
+    spinlock_release(&set->lock);
+
+    if (poll_mode == POLL_MODE_PER_THREAD && thread_data)
+    {
+        for (i = 0; i < n && thread_data[thread_id].steal_request >= 0; i++)
+        {
+            if (processed[i] && batch[i]->dcb_role == DCB_ROLE_CLIENT_HANDLER)
+            {
+                poll_give_session(thread_id, batch[i]);
+            }
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Take DCBs with pending events from the event queue of a poll set.
+ *
+ * The DCBs are marked as being processed and their pending events are moved
+ * to the processing events. The DCBs stay in the event queue so that events
+ * arriving while they are processed are not lost. The caller must hold the
+ * lock of the poll set.
  *
- * @param thread_id     The thread ID of the calling thread
- * @return              0 if no DCB's have been processed
+ * @param set       The poll set
+ * @param dcbs      Array where the DCBs are stored
+ * @param events    Array where the events of each DCB are stored
+ * @param max       Maximum number of DCBs to take
+ * @return          Number of DCBs taken from the queue
  */
 static int
-process_pollq(int thread_id)
+poll_set_dequeue(POLL_SET *set, DCB **dcbs, uint32_t *events, int max)
 {
-    DCB *dcb;
-    int found = 0;
-    uint32_t ev;
-    unsigned long qtime;
+    DCB *first, *dcb;
+    int n = 0;
 
-    spinlock_acquire(&pollqlock);
-    if (eventq == NULL)
+    if (set->eventq == NULL)
     {
         /* Nothing to process */
-        spinlock_release(&pollqlock);
         return 0;
     }
-    dcb = eventq;
-    if (dcb->evq.next == dcb->evq.prev && dcb->evq.processing == 0)
-    {
-        found = 1;
-        dcb->evq.processing = 1;
-    }
-    else if (dcb->evq.next == dcb->evq.prev)
+
+    /**
+     * The head of the queue is the last DCB to be considered, it is the one
+     * that most recently had its events processed.
+     */
+    first = dcb = set->eventq->evq.next;
+    do
     {
-        /* Only item in queue is being processed */
-        spinlock_release(&pollqlock);
-        return 0;
+        if (dcb->evq.processing == 0)
+        {
+            dcb->evq.processing = 1;
+            events[n] = dcb->evq.pending_events;
+            dcb->evq.processing_events = events[n];
+            dcb->evq.pending_events = 0;
+            dcbs[n++] = dcb;
+            set->evq_pending--;
+            ss_dassert(set->evq_pending >= 0);
+        }
+        dcb = dcb->evq.next;
     }
-    else
+    while (dcb != first && n < max);
+
+    return n;
+}
+
+/**
+ * Take a DCB off the event queue after its events have been processed or
+ * move it to the back of the queue if new events arrived while it was being
+ * processed. The caller must hold the lock of the poll set.
+ *
+ * @param set   The poll set
+ * @param dcb   The processed DCB
+ */
+static void
+poll_set_requeue(POLL_SET *set, DCB *dcb)
+{
+    dcb->evq.processing_events = 0;
+
+    if (dcb->evq.pending_events == 0)
     {
-        do
+        /* No pending events so remove from the queue */
+        if (dcb->evq.prev != dcb)
         {
-            dcb = dcb->evq.next;
+            dcb->evq.prev->evq.next = dcb->evq.next;
+            dcb->evq.next->evq.prev = dcb->evq.prev;
+            if (set->eventq == dcb)
+            {
+                set->eventq = dcb->evq.next;
+            }
         }
-        while (dcb != eventq && dcb->evq.processing == 1);
-
-        if (dcb->evq.processing == 0)
+        else
         {
-            /* Found DCB to process */
-            dcb->evq.processing = 1;
-            found = 1;
+            set->eventq = NULL;
         }
+        dcb->evq.next = NULL;
+        dcb->evq.prev = NULL;
+        set->evq_length--;
     }
-    if (found)
+    else
     {
-        ev = dcb->evq.pending_events;
-        dcb->evq.processing_events = ev;
-        dcb->evq.pending_events = 0;
-        pollStats.evq_pending--;
-        ss_dassert(pollStats.evq_pending >= 0);
+        /*
+         * We have a pending event, move to the end of the queue
+         * if there are any other DCB's in the queue.
+         *
+         * If we are the first item on the queue this is easy, we
+         * just bump the eventq pointer.
+         */
+        if (dcb->evq.prev != dcb)
+        {
+            if (set->eventq == dcb)
+            {
+                set->eventq = dcb->evq.next;
+            }
+            else
+            {
+                dcb->evq.prev->evq.next = dcb->evq.next;
+                dcb->evq.next->evq.prev = dcb->evq.prev;
+                dcb->evq.prev = set->eventq->evq.prev;
+                dcb->evq.next = set->eventq;
+                set->eventq->evq.prev = dcb;
+                dcb->evq.prev->evq.next = dcb;
+            }
+        }
     }
-    spinlock_release(&pollqlock);
+    dcb->evq.processing = 0;
+}
 
-    if (found == 0)
-    {
-        return 0;
-    }
+/**
+ * Process the events of a DCB taken from the event queue
+ *
+ * @param thread_id     The thread ID of the calling thread
+ * @param dcb           The DCB to process
+ * @param ev            The events to process
+ * @return              False if the DCB was disconnected and was not processed
+ */
+static bool
+process_dcb_events(int thread_id, DCB *dcb, uint32_t ev)
+{
+    unsigned long qtime;
 
 #if PROFILE_POLL
     memlog_log(plog, hkheartbeat - dcb->evq.inserted);
@@ -882,7 +2433,12 @@ process_pollq(int thread_id)
     {
         queueStats.maxqtime = qtime;
     }
+    metric_observe(queue_time_metric, qtime);
 
+    if (hp_times)
+    {
+        poll_hp_queue_time(thread_id, dcb, ev);
+    }
 
     CHK_DCB(dcb);
     if (thread_data)
@@ -910,10 +2466,13 @@ process_pollq(int thread_id)
     /* ss_dassert(dcb->state != DCB_STATE_DISCONNECTED); */
     if (DCB_STATE_DISCONNECTED == dcb->state)
     {
-        return 0;
+        ss_debug(spinlock_release(&dcb->dcb_initlock));
+        return false;
     }
     ss_debug(spinlock_release(&dcb->dcb_initlock));
 
+    CYCLES cpu_start = rdtsc();
+
     MXS_DEBUG("%lu [poll_waitevents] event %d dcb %p "
               "role %s",
               pthread_self(),
@@ -930,13 +2489,13 @@ process_pollq(int thread_id)
         {
             ts_stats_add(pollStats.n_write, 1);
             /** Read session id to thread's local storage */
-            dcb_get_ses_log_info(dcb,
-                                 &mxs_log_tls.li_sesid,
-                                 &mxs_log_tls.li_enabled_priorities);
+            dcb_set_ses_log_info(dcb);
 
             if (poll_dcb_session_check(dcb, "write_ready"))
             {
+                CYCLES start = hp_times ? rdtsc() : 0;
                 dcb->func.write_ready(dcb);
+                poll_hp_exec_time(thread_id, HP_EVENT_WRITE, start);
             }
         }
         else
@@ -961,13 +2520,13 @@ process_pollq(int thread_id)
                       pthread_self(),
                       dcb->fd);
             ts_stats_add(pollStats.n_accept, 1);
-            dcb_get_ses_log_info(dcb,
-                                 &mxs_log_tls.li_sesid,
-                                 &mxs_log_tls.li_enabled_priorities);
+            dcb_set_ses_log_info(dcb);
 
             if (poll_dcb_session_check(dcb, "accept"))
             {
+                CYCLES start = hp_times ? rdtsc() : 0;
                 dcb->func.accept(dcb);
+                poll_hp_exec_time(thread_id, HP_EVENT_ACCEPT, start);
             }
         }
         else
@@ -979,12 +2538,11 @@ process_pollq(int thread_id)
                       dcb->fd);
             ts_stats_add(pollStats.n_read, 1);
             /** Read session id to thread's local storage */
-            dcb_get_ses_log_info(dcb,
-                                 &mxs_log_tls.li_sesid,
-                                 &mxs_log_tls.li_enabled_priorities);
+            dcb_set_ses_log_info(dcb);
 
             if (poll_dcb_session_check(dcb, "read"))
             {
+                CYCLES start = hp_times ? rdtsc() : 0;
                 int return_code = 1;
                 /** SSL authentication is still going on, we need to call dcb_accept_SSL
                  * until it return 1 for success or -1 for error */
@@ -994,10 +2552,15 @@ process_pollq(int thread_id)
                                   dcb_accept_SSL(dcb) :
                                   dcb_connect_SSL(dcb);
                 }
+                if (DCB_ROLE_BACKEND_HANDLER == dcb->dcb_role)
+                {
+                    dcb_connect_responded(dcb);
+                }
                 if (1 == return_code)
                 {
                     dcb->func.read(dcb);
                 }
+                poll_hp_exec_time(thread_id, HP_EVENT_READ, start);
             }
         }
     }
@@ -1028,10 +2591,9 @@ process_pollq(int thread_id)
                       strerror_r(eno, errbuf, sizeof(errbuf)));
         }
         ts_stats_add(pollStats.n_error, 1);
+        poll_report_server_failure(dcb);
         /** Read session id to thread's local storage */
-        dcb_get_ses_log_info(dcb,
-                             &mxs_log_tls.li_sesid,
-                             &mxs_log_tls.li_enabled_priorities);
+        dcb_set_ses_log_info(dcb);
 
         if (poll_dcb_session_check(dcb, "error"))
         {
@@ -1058,14 +2620,15 @@ process_pollq(int thread_id)
         {
             dcb->flags |= DCBF_HUNG;
             spinlock_release(&dcb->dcb_initlock);
+            poll_report_server_failure(dcb);
             /** Read session id to thread's local storage */
-            dcb_get_ses_log_info(dcb,
-                                 &mxs_log_tls.li_sesid,
-                                 &mxs_log_tls.li_enabled_priorities);
+            dcb_set_ses_log_info(dcb);
 
             if (poll_dcb_session_check(dcb, "hangup EPOLLHUP"))
             {
+                CYCLES start = hp_times ? rdtsc() : 0;
                 dcb->func.hangup(dcb);
+                poll_hp_exec_time(thread_id, HP_EVENT_HANGUP, start);
             }
         }
         else
@@ -1094,14 +2657,15 @@ process_pollq(int thread_id)
         {
             dcb->flags |= DCBF_HUNG;
             spinlock_release(&dcb->dcb_initlock);
+            poll_report_server_failure(dcb);
             /** Read session id to thread's local storage */
-            dcb_get_ses_log_info(dcb,
-                                 &mxs_log_tls.li_sesid,
-                                 &mxs_log_tls.li_enabled_priorities);
+            dcb_set_ses_log_info(dcb);
 
             if (poll_dcb_session_check(dcb, "hangup EPOLLRDHUP"))
             {
+                CYCLES start = hp_times ? rdtsc() : 0;
                 dcb->func.hangup(dcb);
+                poll_hp_exec_time(thread_id, HP_EVENT_HANGUP, start);
             }
         }
         else
@@ -1124,62 +2688,301 @@ process_pollq(int thread_id)
     {
         queueStats.maxexectime = qtime;
     }
+    metric_observe(exec_time_metric, qtime);
+    poll_account_session(dcb, cpu_start);
 
-    spinlock_acquire(&pollqlock);
-    dcb->evq.processing_events = 0;
+    return true;
+}
 
-    if (dcb->evq.pending_events == 0)
+/**
+ * Measure how many CPU cycles there are in a microsecond
+ *
+ * @return The number of CPU cycles in a microsecond
+ */
+static double
+poll_calibrate_cycles()
+{
+    struct timespec start, end;
+    struct timespec delay = {0, 10000000};
+    CYCLES c_start, c_end;
+    double usecs;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    c_start = rdtsc();
+    nanosleep(&delay, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    c_end = rdtsc();
+
+    usecs = (end.tv_sec - start.tv_sec) * 1000000.0 + (end.tv_nsec - start.tv_nsec) / 1000.0;
+
+    return usecs > 0 && c_end > c_start ? (c_end - c_start) / usecs : 1.0;
+}
+
+/**
+ * Add the CPU cycles spent processing the events of a DCB to its session
+ *
+ * The session is read after the handlers have been called so that the
+ * authentication of a client is accounted to the session it created. The
+ * memory of a session is never freed so the DCB of a closed session can
+ * still be used here.
+ *
+ * @param dcb   The DCB whose events were processed
+ * @param start CPU cycle count when the processing started
+ */
+static void
+poll_account_session(DCB *dcb, CYCLES start)
+{
+    SESSION *session = dcb->session;
+
+    if (session && session->state != SESSION_STATE_DUMMY &&
+        session->state != SESSION_STATE_LISTENER &&
+        session->state != SESSION_STATE_LISTENER_STOPPED)
     {
-        /* No pending events so remove from the queue */
-        if (dcb->evq.prev != dcb)
+        __atomic_add_fetch(&session->stats.cpu_cycles, rdtsc() - start, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Convert CPU cycles to microseconds
+ *
+ * @param cycles The number of CPU cycles
+ * @return The number of microseconds
+ */
+double
+poll_cycles_to_usecs(unsigned long long cycles)
+{
+    return cycles / cycles_per_usec;
+}
+
+/**
+ * Return the high precision histogram bucket for a number of CPU cycles
+ *
+ * @param cycles    The duration in CPU cycles
+ * @return          The histogram bucket
+ */
+static int
+poll_hp_bucket(CYCLES cycles)
+{
+    unsigned long long usecs = cycles / cycles_per_usec;
+    int bucket = usecs < 2 ? 0 : 63 - __builtin_clzll(usecs);
+
+    return bucket > N_HP_TIMES ? N_HP_TIMES : bucket;
+}
+
+/**
+ * Record the time a DCB spent in the event queue for each type of event
+ * that is about to be processed
+ *
+ * @param thread_id     The thread processing the DCB
+ * @param dcb           The DCB
+ * @param ev            The events that will be processed
+ */
+static void
+poll_hp_queue_time(int thread_id, DCB *dcb, uint32_t ev)
+{
+    HP_TIMES *times = &hp_times[thread_id];
+    int bucket = poll_hp_bucket(rdtsc() - dcb->evq.inserted_cycles);
+
+    if (ev & EPOLLOUT)
+    {
+        times->qtimes[HP_EVENT_WRITE][bucket]++;
+    }
+    if (ev & EPOLLIN)
+    {
+        times->qtimes[dcb->state == DCB_STATE_LISTENING ?
+                      HP_EVENT_ACCEPT : HP_EVENT_READ][bucket]++;
+    }
+#ifdef EPOLLRDHUP
+    if (ev & (EPOLLHUP | EPOLLRDHUP))
+#else
+    if (ev & EPOLLHUP)
+#endif
+    {
+        times->qtimes[HP_EVENT_HANGUP][bucket]++;
+    }
+}
+
+/**
+ * Record the time taken to execute the handler of an event
+ *
+ * @param thread_id     The thread that executed the handler
+ * @param type          The type of the event
+ * @param start         The CPU cycle count when the handler was called
+ */
+static void
+poll_hp_exec_time(int thread_id, HP_EVENT type, CYCLES start)
+{
+    if (hp_times)
+    {
+        hp_times[thread_id].exectimes[type][poll_hp_bucket(rdtsc() - start)]++;
+    }
+}
+
+/**
+ * Ask a busy thread to hand over one of its sessions to an idle thread.
+ *
+ * This is called by a thread in the per thread poll mode when it has nothing
+ * to process. The thread with the most DCBs with pending events is asked to
+ * move a session to the calling thread, the actual move is done by the busy
+ * thread the next time one of its sessions is at a safe point.
+ *
+ * @param thread_id     The idle thread
+ */
+static void
+poll_request_steal(int thread_id)
+{
+    int victim = -1;
+    int depth = POLL_STEAL_THRESHOLD - 1;
+    int i;
+
+    if (thread_data == NULL)
+    {
+        return;
+    }
+
+    for (i = 0; i < n_poll_sets; i++)
+    {
+        if (i != thread_id && poll_sets[i].evq_pending > depth)
         {
-            dcb->evq.prev->evq.next = dcb->evq.next;
-            dcb->evq.next->evq.prev = dcb->evq.prev;
-            if (eventq == dcb)
-            {
-                eventq = dcb->evq.next;
-            }
+            victim = i;
+            depth = poll_sets[i].evq_pending;
         }
-        else
+    }
+
+    if (victim >= 0 && poll_sets[victim].n_dcbs > poll_sets[thread_id].n_dcbs)
+    {
+        __sync_bool_compare_and_swap(&thread_data[victim].steal_request, -1, thread_id);
+    }
+}
+
+/**
+ * Check that none of the DCBs of a session are waiting in the event queue,
+ * have queued data or are closed.
+ *
+ * @param thread_id     The thread that owns the session
+ * @param dcbs          The DCBs of the session
+ * @param n             Number of DCBs
+ * @return True if the DCBs can be moved to another poll set
+ */
+static bool
+poll_session_dcbs_idle(int thread_id, DCB **dcbs, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        if (dcbs[i]->state != DCB_STATE_POLLING || dcbs[i]->owner != thread_id ||
+            dcbs[i]->dcb_is_zombie || DCB_POLL_BUSY(dcbs[i]) || dcbs[i]->writeq ||
+            dcbs[i]->dcb_readqueue || dcbs[i]->reads_paused)
         {
-            eventq = NULL;
+            return false;
         }
-        dcb->evq.next = NULL;
-        dcb->evq.prev = NULL;
-        pollStats.evq_length--;
     }
-    else
+
+    return true;
+}
+
+/**
+ * Move all the DCBs of a session to the poll set of the thread that has asked
+ * to take over work from this thread.
+ *
+ * This is called by the owning thread right after it has processed an event
+ * for the client DCB of the session. The move is only done if the client
+ * protocol does not expect any more data for the current packet and none of
+ * the DCBs of the session are waiting in the event queue or have queued
+ * data or are closed, as the zombies are freed by the owner. The owner of
+ * the DCBs is changed while holding the locks of both
+ * poll sets so that fake events injected by other threads end up in the
+ * event queue of the new owner. Other threads can queue events or data for
+ * the DCBs until the locks are held, which is why the DCBs are checked again
+ * under the locks and the move is abandoned if they are no longer idle.
+ *
+ * @param thread_id     The thread that owns the session
+ * @param dcb           The client DCB of the session
+ */
+static void
+poll_give_session(int thread_id, DCB *dcb)
+{
+    SESSION *session = dcb->session;
+    DCB *dcbs[POLL_STEAL_MAX_DCBS];
+    int thief = thread_data[thread_id].steal_request;
+    POLL_SET *from = &poll_sets[thread_id];
+    POLL_SET *to = &poll_sets[thief];
+    struct epoll_event ev;
+    int n, i;
+
+    if (to->n_dcbs >= from->n_dcbs)
     {
-        /*
-         * We have a pending event, move to the end of the queue
-         * if there are any other DCB's in the queue.
-         *
-         * If we are the first item on the queue this is easy, we
-         * just bump the eventq pointer.
-         */
-        if (dcb->evq.prev != dcb)
+        /** The requesting thread is no longer less loaded than this one */
+        thread_data[thread_id].steal_request = -1;
+        return;
+    }
+
+    if (session == NULL || session->state != SESSION_STATE_ROUTER_READY ||
+        dcb->state != DCB_STATE_POLLING ||
+        dcb->protocol_bytes_processed != dcb->protocol_packet_length)
+    {
+        return;
+    }
+
+    n = dcb_get_session_dcbs(session, dcbs, POLL_STEAL_MAX_DCBS);
+
+    if (n > POLL_STEAL_MAX_DCBS)
+    {
+        return;
+    }
+
+    if (!poll_session_dcbs_idle(thread_id, dcbs, n))
+    {
+        return;
+    }
+
+#ifdef EPOLLRDHUP
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLHUP | EPOLLET;
+#else
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLHUP | EPOLLET;
+#endif
+
+    /** Always lock the poll sets in the same order to prevent deadlocks */
+    spinlock_acquire(thread_id < thief ? &from->lock : &to->lock);
+    spinlock_acquire(thread_id < thief ? &to->lock : &from->lock);
+
+    if (!poll_session_dcbs_idle(thread_id, dcbs, n))
+    {
+        spinlock_release(&to->lock);
+        spinlock_release(&from->lock);
+        return;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        ev.data.ptr = dcbs[i];
+
+        if (epoll_ctl(from->epoll_fd, EPOLL_CTL_DEL, dcbs[i]->fd, &ev) == 0)
         {
-            if (eventq == dcb)
-            {
-                eventq = dcb->evq.next;
-            }
-            else
-            {
-                dcb->evq.prev->evq.next = dcb->evq.next;
-                dcb->evq.next->evq.prev = dcb->evq.prev;
-                dcb->evq.prev = eventq->evq.prev;
-                dcb->evq.next = eventq;
-                eventq->evq.prev = dcb;
-                dcb->evq.prev->evq.next = dcb;
-            }
+            atomic_add(&from->n_dcbs, -1);
+        }
+        dcbs[i]->owner = thief;
+
+        if (epoll_ctl(to->epoll_fd, EPOLL_CTL_ADD, dcbs[i]->fd, &ev) == 0)
+        {
+            atomic_add(&to->n_dcbs, 1);
+        }
+        else
+        {
+            char errbuf[STRERROR_BUFLEN];
+            MXS_ERROR("Failed to move DCB %p to the poll set of thread %d: %d, %s",
+                      dcbs[i], thief, errno, strerror_r(errno, errbuf, sizeof(errbuf)));
         }
     }
-    dcb->evq.processing = 0;
-    /** Reset session id from thread's local storage */
-    mxs_log_tls.li_sesid = 0;
-    spinlock_release(&pollqlock);
 
-    return 1;
+    spinlock_release(&to->lock);
+    spinlock_release(&from->lock);
+
+    thread_data[thread_id].steal_request = -1;
+    thread_data[thread_id].n_given++;
+    atomic_add(&thread_data[thief].n_stolen, 1);
+
+    MXS_DEBUG("%lu [poll_give_session] Moved %d DCBs of session %p from thread %d "
+              "to thread %d.", pthread_self(), n, session, thread_id, thief);
 }
 
 /**
@@ -1210,6 +3013,21 @@ poll_dcb_session_check(DCB *dcb, const char *function)
     }
 }
 
+/**
+ * Report the failure of a backend connection to the server so that its
+ * monitor can check the server without waiting for the monitor interval
+ *
+ * @param   dcb         The DCB that failed
+ */
+static void
+poll_report_server_failure(DCB *dcb)
+{
+    if (dcb->dcb_role == DCB_ROLE_BACKEND_HANDLER && dcb->server)
+    {
+        server_report_failure(dcb->server);
+    }
+}
+
 /**
  * Shutdown the polling loop
  */
@@ -1230,6 +3048,60 @@ poll_bitmask()
     return &poll_mask;
 }
 
+/**
+ * Return the combined length of the event queues of all poll sets
+ *
+ * @return Number of DCBs in the event queues
+ */
+static int
+poll_evq_length()
+{
+    int total = 0;
+
+    for (int i = 0; i < n_poll_sets; i++)
+    {
+        total += poll_sets[i].evq_length;
+    }
+    return total;
+}
+
+/**
+ * Return the combined number of DCBs with pending events in all poll sets
+ *
+ * @return Number of DCBs with pending events
+ */
+static int
+poll_evq_pending()
+{
+    int total = 0;
+
+    for (int i = 0; i < n_poll_sets; i++)
+    {
+        total += poll_sets[i].evq_pending;
+    }
+    return total;
+}
+
+/**
+ * Return the longest event queue length seen in any of the poll sets
+ *
+ * @return Maximum event queue length
+ */
+static int
+poll_evq_max()
+{
+    int max = 0;
+
+    for (int i = 0; i < n_poll_sets; i++)
+    {
+        if (poll_sets[i].evq_max > max)
+        {
+            max = poll_sets[i].evq_max;
+        }
+    }
+    return max;
+}
+
 /**
  * Display an entry from the spinlock statistics data
  *
@@ -1254,34 +3126,38 @@ dprintPollStats(DCB *dcb)
     int i;
 
     dcb_printf(dcb, "\nPoll Statistics.\n\n");
-    dcb_printf(dcb, "No. of epoll cycles:                           %d\n",
+    dcb_printf(dcb, "No. of epoll cycles:                           %" PRId64 "\n",
                ts_stats_sum(pollStats.n_polls));
-    dcb_printf(dcb, "No. of epoll cycles with wait:                         %d\n",
+    dcb_printf(dcb, "No. of epoll cycles with wait:                         %" PRId64 "\n",
                ts_stats_sum(pollStats.blockingpolls));
-    dcb_printf(dcb, "No. of epoll calls returning events:           %d\n",
+    dcb_printf(dcb, "No. of epoll calls returning events:           %" PRId64 "\n",
                ts_stats_sum(pollStats.n_pollev));
-    dcb_printf(dcb, "No. of non-blocking calls returning events:    %d\n",
+    dcb_printf(dcb, "No. of non-blocking calls returning events:    %" PRId64 "\n",
                ts_stats_sum(pollStats.n_nbpollev));
-    dcb_printf(dcb, "No. of read events:                            %d\n",
+    dcb_printf(dcb, "No. of read events:                            %" PRId64 "\n",
                ts_stats_sum(pollStats.n_read));
-    dcb_printf(dcb, "No. of write events:                           %d\n",
+    dcb_printf(dcb, "No. of write events:                           %" PRId64 "\n",
                ts_stats_sum(pollStats.n_write));
-    dcb_printf(dcb, "No. of error events:                           %d\n",
+    dcb_printf(dcb, "No. of error events:                           %" PRId64 "\n",
                ts_stats_sum(pollStats.n_error));
-    dcb_printf(dcb, "No. of hangup events:                          %d\n",
+    dcb_printf(dcb, "No. of hangup events:                          %" PRId64 "\n",
                ts_stats_sum(pollStats.n_hup));
-    dcb_printf(dcb, "No. of accept events:                          %d\n",
+    dcb_printf(dcb, "No. of accept events:                          %" PRId64 "\n",
                ts_stats_sum(pollStats.n_accept));
-    dcb_printf(dcb, "No. of times no threads polling:               %d\n",
+    dcb_printf(dcb, "No. of times no threads polling:               %" PRId64 "\n",
                ts_stats_sum(pollStats.n_nothreads));
     dcb_printf(dcb, "Current event queue length:                    %d\n",
-               pollStats.evq_length);
+               poll_evq_length());
     dcb_printf(dcb, "Maximum event queue length:                    %d\n",
-               pollStats.evq_max);
+               poll_evq_max());
     dcb_printf(dcb, "No. of DCBs with pending events:               %d\n",
-               pollStats.evq_pending);
+               poll_evq_pending());
     dcb_printf(dcb, "No. of wakeups with pending queue:             %d\n",
                pollStats.wake_evqpending);
+    dcb_printf(dcb, "No. of wakeups with no DCB to process:         %" PRId64 "\n",
+               ts_stats_sum(pollStats.n_idlewakes));
+    dcb_printf(dcb, "Listeners polled with EPOLLEXCLUSIVE:          %s\n",
+               poll_exclusive_listeners ? "Yes" : "No");
 
     dcb_printf(dcb, "No of poll completions with descriptors\n");
     dcb_printf(dcb, "\tNo. of descriptors\tNo. of poll completions.\n");
@@ -1292,9 +3168,22 @@ dprintPollStats(DCB *dcb)
     dcb_printf(dcb, "\t>= %d\t\t\t%d\n", MAXNFDS,
                pollStats.n_fds[MAXNFDS - 1]);
 
+    if (poll_mode == POLL_MODE_PER_THREAD)
+    {
+        dcb_printf(dcb, "No of DCBs in per thread poll sets\n");
+        dcb_printf(dcb, "\tThread\t\t\tNo. of DCBs\n");
+        for (i = 0; i < n_poll_sets; i++)
+        {
+            dcb_printf(dcb, "\t%2d\t\t\t%d\n", i, poll_sets[i].n_dcbs);
+        }
+    }
+
 #if SPINLOCK_PROFILE
-    dcb_printf(dcb, "Event queue lock statistics:\n");
-    spinlock_stats(&pollqlock, spin_reporter, dcb);
+    for (i = 0; i < n_poll_sets; i++)
+    {
+        dcb_printf(dcb, "Event queue %d lock statistics:\n", i);
+        spinlock_stats(&poll_sets[i].lock, spin_reporter, dcb);
+    }
 #endif
 }
 
@@ -1419,6 +3308,16 @@ dShowThreads(DCB *dcb)
     dcb_printf(dcb, "15 Minute Average: %.2f, 5 Minute Average: %.2f, "
                "1 Minute Average: %.2f\n\n", qavg15, qavg5, qavg1);
 
+    if (min_threads < n_threads)
+    {
+        dcb_printf(dcb, "Running threads: %d, between %d and %d.\n",
+                   n_running_threads, min_threads, n_threads);
+        dcb_printf(dcb, "Threads busy: %.0f%%, delayed events: %.0f%%.\n",
+                   scaleStats.busy_pct, scaleStats.delayed_pct);
+        dcb_printf(dcb, "Threads added: %d, threads removed: %d.\n\n",
+                   scaleStats.n_added, scaleStats.n_removed);
+    }
+
     if (thread_data == NULL)
     {
         return;
@@ -1444,6 +3343,9 @@ dShowThreads(DCB *dcb)
         case THREAD_ZPROCESSING:
             state = "Collecting";
             break;
+        case THREAD_RETIRING:
+            state = "Retiring";
+            break;
         }
         if (thread_data[i].state != THREAD_PROCESSING)
         {
@@ -1483,6 +3385,31 @@ dShowThreads(DCB *dcb)
             }
         }
     }
+
+    if (poll_mode == POLL_MODE_PER_THREAD)
+    {
+        dcb_printf(dcb, "\n ID | # DCBs | Queue  | Stolen   | Given\n");
+        dcb_printf(dcb, "----+--------+--------+----------+----------\n");
+        for (i = 0; i < n_threads; i++)
+        {
+            dcb_printf(dcb, " %2d | %6d | %6d | %8d | %8d\n",
+                       i, poll_sets[i].n_dcbs, poll_sets[i].evq_pending,
+                       thread_data[i].n_stolen, thread_data[i].n_given);
+        }
+    }
+
+    if (adaptive_poll)
+    {
+        dcb_printf(dcb, "\nAdaptive polling, busy polling for at most %u us.\n", busy_poll_time);
+        dcb_printf(dcb, " ID | Event gap  | Busy polls   | Blocking polls\n");
+        dcb_printf(dcb, "----+------------+--------------+---------------\n");
+        for (i = 0; i < n_threads; i++)
+        {
+            dcb_printf(dcb, " %2d | %7" PRIu64 " us | %12lu | %12lu\n",
+                       i, thread_data[i].avg_gap,
+                       thread_data[i].n_busy_polls, thread_data[i].n_blocking_polls);
+        }
+    }
 }
 
 /**
@@ -1512,7 +3439,7 @@ poll_loadav(void *data)
         current_avg = 0.0;
     }
     avg_samples[next_sample] = current_avg;
-    evqp_samples[next_sample] = pollStats.evq_pending;
+    evqp_samples[next_sample] = poll_evq_pending();
     next_sample++;
     if (next_sample >= n_avg_samples)
     {
@@ -1544,48 +3471,101 @@ static void poll_add_event_to_dcb(DCB*       dcb,
                                   GWBUF*     buf,
                                   __uint32_t ev)
 {
+    POLL_SET *set;
+
     /** Add buf to readqueue */
     spinlock_acquire(&dcb->authlock);
     dcb->dcb_readqueue = gwbuf_append(dcb->dcb_readqueue, buf);
     spinlock_release(&dcb->authlock);
 
-    spinlock_acquire(&pollqlock);
+    set = poll_lock_dcb_set(dcb);
+    poll_set_enqueue(set, dcb, ev);
+    spinlock_release(&set->lock);
+    poll_set_wakeup(set);
+}
 
-    /** Set event to DCB */
+/**
+ * Add events to a DCB and place it in the event queue of a poll set if it
+ * isn't already there.
+ *
+ * If the DCB is already in the queue the events are added to its pending
+ * events and the DCB keeps its place in the queue. The caller must hold
+ * the lock of the poll set.
+ *
+ * @param set   The poll set the DCB belongs to
+ * @param dcb   The DCB with new events
+ * @param ev    The events
+ */
+static void
+poll_set_enqueue(POLL_SET *set, DCB *dcb, uint32_t ev)
+{
     if (DCB_POLL_BUSY(dcb))
     {
         if (dcb->evq.pending_events == 0)
         {
-            pollStats.evq_pending++;
+            set->evq_pending++;
+            dcb->evq.inserted = hkheartbeat;
+            if (hp_times)
+            {
+                dcb->evq.inserted_cycles = rdtsc();
+            }
         }
         dcb->evq.pending_events |= ev;
     }
     else
     {
         dcb->evq.pending_events = ev;
-        /** Add DCB to eventqueue if it isn't already there */
-        if (eventq)
+        if (set->eventq)
         {
-            dcb->evq.prev = eventq->evq.prev;
-            eventq->evq.prev->evq.next = dcb;
-            eventq->evq.prev = dcb;
-            dcb->evq.next = eventq;
+            dcb->evq.prev = set->eventq->evq.prev;
+            set->eventq->evq.prev->evq.next = dcb;
+            set->eventq->evq.prev = dcb;
+            dcb->evq.next = set->eventq;
         }
         else
         {
-            eventq = dcb;
+            set->eventq = dcb;
             dcb->evq.prev = dcb;
             dcb->evq.next = dcb;
         }
-        pollStats.evq_length++;
-        pollStats.evq_pending++;
+        set->evq_length++;
+        set->evq_pending++;
+        dcb->evq.inserted = hkheartbeat;
+        if (hp_times)
+        {
+            dcb->evq.inserted_cycles = rdtsc();
+        }
+        if (set->evq_length > set->evq_max)
+        {
+            set->evq_max = set->evq_length;
+        }
+    }
+}
 
-        if (pollStats.evq_length > pollStats.evq_max)
+/**
+ * Wake up the thread that owns a poll set
+ *
+ * This is needed in the per thread poll mode when an event is added to the
+ * queue of another thread, as that thread may be blocked in epoll_wait. In
+ * the shared mode the polling threads pick up the event when their blocking
+ * epoll_wait times out.
+ *
+ * @param set   The poll set that had an event added to it
+ */
+static void
+poll_set_wakeup(POLL_SET *set)
+{
+    if (set->wakeup_fd != -1 &&
+        (poll_thread_id < 0 || set != &poll_sets[poll_thread_id]))
+    {
+        uint64_t one = 1;
+        if (write(set->wakeup_fd, &one, sizeof(one)) != sizeof(one))
         {
-            pollStats.evq_max = pollStats.evq_length;
+            /** The counter can only overflow if the owner is not reading it */
+            MXS_DEBUG("%lu [poll_set_wakeup] Failed to write to eventfd %d.",
+                      pthread_self(), set->wakeup_fd);
         }
     }
-    spinlock_release(&pollqlock);
 }
 
 /*
@@ -1642,8 +3622,8 @@ poll_fake_read_event(DCB *dcb)
 void
 poll_fake_event(DCB *dcb, enum EPOLL_EVENTS ev)
 {
+    POLL_SET *set = poll_lock_dcb_set(dcb);
 
-    spinlock_acquire(&pollqlock);
     /*
      * If the DCB is already on the queue, there are no pending events and
      * there are other events on the queue, then
@@ -1653,49 +3633,18 @@ poll_fake_event(DCB *dcb, enum EPOLL_EVENTS ev)
     {
         dcb->evq.prev->evq.next = dcb->evq.next;
         dcb->evq.next->evq.prev = dcb->evq.prev;
-        if (eventq == dcb)
+        if (set->eventq == dcb)
         {
-            eventq = dcb->evq.next;
+            set->eventq = dcb->evq.next;
         }
         dcb->evq.next = NULL;
         dcb->evq.prev = NULL;
-        pollStats.evq_length--;
+        set->evq_length--;
     }
 
-    if (DCB_POLL_BUSY(dcb))
-    {
-        if (dcb->evq.pending_events == 0)
-        {
-            pollStats.evq_pending++;
-        }
-        dcb->evq.pending_events |= ev;
-    }
-    else
-    {
-        dcb->evq.pending_events = ev;
-        dcb->evq.inserted = hkheartbeat;
-        if (eventq)
-        {
-            dcb->evq.prev = eventq->evq.prev;
-            eventq->evq.prev->evq.next = dcb;
-            eventq->evq.prev = dcb;
-            dcb->evq.next = eventq;
-        }
-        else
-        {
-            eventq = dcb;
-            dcb->evq.prev = dcb;
-            dcb->evq.next = dcb;
-        }
-        pollStats.evq_length++;
-        pollStats.evq_pending++;
-        dcb->evq.inserted = hkheartbeat;
-        if (pollStats.evq_length > pollStats.evq_max)
-        {
-            pollStats.evq_max = pollStats.evq_length;
-        }
-    }
-    spinlock_release(&pollqlock);
+    poll_set_enqueue(set, dcb, ev);
+    spinlock_release(&set->lock);
+    poll_set_wakeup(set);
 }
 
 /*
@@ -1714,41 +3663,11 @@ poll_fake_hangup_event(DCB *dcb)
     uint32_t ev = EPOLLHUP;
 #endif
 
-    spinlock_acquire(&pollqlock);
-    if (DCB_POLL_BUSY(dcb))
-    {
-        if (dcb->evq.pending_events == 0)
-        {
-            pollStats.evq_pending++;
-        }
-        dcb->evq.pending_events |= ev;
-    }
-    else
-    {
-        dcb->evq.pending_events = ev;
-        dcb->evq.inserted = hkheartbeat;
-        if (eventq)
-        {
-            dcb->evq.prev = eventq->evq.prev;
-            eventq->evq.prev->evq.next = dcb;
-            eventq->evq.prev = dcb;
-            dcb->evq.next = eventq;
-        }
-        else
-        {
-            eventq = dcb;
-            dcb->evq.prev = dcb;
-            dcb->evq.next = dcb;
-        }
-        pollStats.evq_length++;
-        pollStats.evq_pending++;
-        dcb->evq.inserted = hkheartbeat;
-        if (pollStats.evq_length > pollStats.evq_max)
-        {
-            pollStats.evq_max = pollStats.evq_length;
-        }
-    }
-    spinlock_release(&pollqlock);
+    POLL_SET *set = poll_lock_dcb_set(dcb);
+
+    poll_set_enqueue(set, dcb, ev);
+    spinlock_release(&set->lock);
+    poll_set_wakeup(set);
 }
 
 /**
@@ -1761,31 +3680,41 @@ dShowEventQ(DCB *pdcb)
 {
     DCB *dcb;
     char *tmp1, *tmp2;
+    bool header = false;
 
-    spinlock_acquire(&pollqlock);
-    if (eventq == NULL)
-    {
-        /* Nothing to process */
-        spinlock_release(&pollqlock);
-        return;
-    }
-    dcb = eventq;
-    dcb_printf(pdcb, "\nEvent Queue.\n");
-    dcb_printf(pdcb, "%-16s | %-10s | %-18s | %s\n", "DCB", "Status", "Processing Events",
-               "Pending Events");
-    dcb_printf(pdcb, "-----------------+------------+--------------------+-------------------\n");
-    do
+    for (int i = 0; i < n_poll_sets; i++)
     {
-        dcb_printf(pdcb, "%-16p | %-10s | %-18s | %-18s\n", dcb,
-                   dcb->evq.processing ? "Processing" : "Pending",
-                   (tmp1 = event_to_string(dcb->evq.processing_events)),
-                   (tmp2 = event_to_string(dcb->evq.pending_events)));
-        free(tmp1);
-        free(tmp2);
-        dcb = dcb->evq.next;
+        POLL_SET *set = &poll_sets[i];
+
+        spinlock_acquire(&set->lock);
+        if (set->eventq == NULL)
+        {
+            /* Nothing to process */
+            spinlock_release(&set->lock);
+            continue;
+        }
+        if (!header)
+        {
+            dcb_printf(pdcb, "\nEvent Queue.\n");
+            dcb_printf(pdcb, "%-16s | %-10s | %-18s | %s\n", "DCB", "Status", "Processing Events",
+                       "Pending Events");
+            dcb_printf(pdcb, "-----------------+------------+--------------------+-------------------\n");
+            header = true;
+        }
+        dcb = set->eventq;
+        do
+        {
+            dcb_printf(pdcb, "%-16p | %-10s | %-18s | %-18s\n", dcb,
+                       dcb->evq.processing ? "Processing" : "Pending",
+                       (tmp1 = event_to_string(dcb->evq.processing_events)),
+                       (tmp2 = event_to_string(dcb->evq.pending_events)));
+            free(tmp1);
+            free(tmp2);
+            dcb = dcb->evq.next;
+        }
+        while (dcb != set->eventq);
+        spinlock_release(&set->lock);
     }
-    while (dcb != eventq);
-    spinlock_release(&pollqlock);
 }
 
 
@@ -1802,8 +3731,8 @@ dShowEventStats(DCB *pdcb)
     dcb_printf(pdcb, "\nEvent statistics.\n");
     dcb_printf(pdcb, "Maximum queue time:           %3lu00ms\n", queueStats.maxqtime);
     dcb_printf(pdcb, "Maximum execution time:       %3lu00ms\n", queueStats.maxexectime);
-    dcb_printf(pdcb, "Maximum event queue length:   %3d\n", pollStats.evq_max);
-    dcb_printf(pdcb, "Current event queue length:   %3d\n", pollStats.evq_length);
+    dcb_printf(pdcb, "Maximum event queue length:   %3d\n", poll_evq_max());
+    dcb_printf(pdcb, "Current event queue length:   %3d\n", poll_evq_length());
     dcb_printf(pdcb, "\n");
     dcb_printf(pdcb, "               |    Number of events\n");
     dcb_printf(pdcb, "Duration       | Queued     | Executed\n");
@@ -1817,6 +3746,86 @@ dShowEventStats(DCB *pdcb)
     }
     dcb_printf(pdcb, " > %2d00ms      | %-10d | %-10d\n", N_QUEUE_TIMES,
                queueStats.qtimes[N_QUEUE_TIMES], queueStats.exectimes[N_QUEUE_TIMES]);
+
+    if (hp_times)
+    {
+        dcb_printf(pdcb, "\nHigh precision event times.\n");
+        dcb_printf(pdcb, "                |");
+        for (int type = 0; type < N_HP_EVENTS; type++)
+        {
+            dcb_printf(pdcb, " %-21s |", hp_event_names[type]);
+        }
+        dcb_printf(pdcb, "\nDuration        |");
+        for (int type = 0; type < N_HP_EVENTS; type++)
+        {
+            dcb_printf(pdcb, " Queued     | Executed |");
+        }
+        dcb_printf(pdcb, "\n----------------+");
+        for (int type = 0; type < N_HP_EVENTS; type++)
+        {
+            dcb_printf(pdcb, "------------+----------+");
+        }
+        dcb_printf(pdcb, "\n");
+
+        for (i = 0; i <= N_HP_TIMES; i++)
+        {
+            char name[40];
+
+            poll_hp_bucket_name(i, name, sizeof(name));
+            dcb_printf(pdcb, " %-14s |", name);
+            for (int type = 0; type < N_HP_EVENTS; type++)
+            {
+                dcb_printf(pdcb, " %-10u | %-8u |",
+                           poll_hp_sum(type, i, true), poll_hp_sum(type, i, false));
+            }
+            dcb_printf(pdcb, "\n");
+        }
+    }
+}
+
+/**
+ * Format the name of a high precision event time histogram bucket
+ *
+ * @param bucket    The bucket
+ * @param buf       Buffer where the name is written
+ * @param len       Size of the buffer
+ */
+static void
+poll_hp_bucket_name(int bucket, char *buf, size_t len)
+{
+    if (bucket == 0)
+    {
+        snprintf(buf, len, "< 2us");
+    }
+    else if (bucket == N_HP_TIMES)
+    {
+        snprintf(buf, len, "> %luus", 1UL << N_HP_TIMES);
+    }
+    else
+    {
+        snprintf(buf, len, "%lu - %luus", 1UL << bucket, 1UL << (bucket + 1));
+    }
+}
+
+/**
+ * Return the sum of a high precision event time histogram bucket over all
+ * the threads
+ *
+ * @param type      The event type
+ * @param bucket    The bucket
+ * @param queued    True for the queue times, false for the execution times
+ * @return          Number of events in the bucket
+ */
+static unsigned int
+poll_hp_sum(int type, int bucket, bool queued)
+{
+    unsigned int total = 0;
+
+    for (int i = 0; i < n_threads; i++)
+    {
+        total += queued ? hp_times[i].qtimes[type][bucket] : hp_times[i].exectimes[type][bucket];
+    }
+    return total;
 }
 
 /**
@@ -1841,11 +3850,11 @@ poll_get_stat(POLL_STAT stat)
     case POLL_STAT_ACCEPT:
         return ts_stats_sum(pollStats.n_accept);
     case POLL_STAT_EVQ_LEN:
-        return pollStats.evq_length;
+        return poll_evq_length();
     case POLL_STAT_EVQ_PENDING:
-        return pollStats.evq_pending;
+        return poll_evq_pending();
     case POLL_STAT_EVQ_MAX:
-        return pollStats.evq_max;
+        return poll_evq_max();
     case POLL_STAT_MAX_QTIME:
         return (int)queueStats.maxqtime;
     case POLL_STAT_MAX_EXECTIME:
@@ -1854,6 +3863,101 @@ poll_get_stat(POLL_STAT stat)
     return 0;
 }
 
+static int64_t poll_metric_read()
+{
+    return ts_stats_sum(pollStats.n_read);
+}
+
+static int64_t poll_metric_write()
+{
+    return ts_stats_sum(pollStats.n_write);
+}
+
+static int64_t poll_metric_error()
+{
+    return ts_stats_sum(pollStats.n_error);
+}
+
+static int64_t poll_metric_hangup()
+{
+    return ts_stats_sum(pollStats.n_hup);
+}
+
+static int64_t poll_metric_accept()
+{
+    return ts_stats_sum(pollStats.n_accept);
+}
+
+static int64_t poll_metric_polls()
+{
+    return ts_stats_sum(pollStats.n_polls);
+}
+
+static int64_t poll_metric_blocking_polls()
+{
+    return ts_stats_sum(pollStats.blockingpolls);
+}
+
+static int64_t poll_metric_idle_wakeups()
+{
+    return ts_stats_sum(pollStats.n_idlewakes);
+}
+
+static int64_t poll_metric_evq_length()
+{
+    return poll_evq_length();
+}
+
+static int64_t poll_metric_evq_pending()
+{
+    return poll_evq_pending();
+}
+
+/**
+ * Register the metrics of the polling system
+ */
+static void
+poll_register_metrics()
+{
+    const char *events = "Number of events processed by the polling threads";
+    int n_bounds = sizeof(event_time_bounds) / sizeof(event_time_bounds[0]);
+
+    metric_function("maxscale_poll_events", "event=\"read\"", events,
+                    METRIC_COUNTER, poll_metric_read);
+    metric_function("maxscale_poll_events", "event=\"write\"", events,
+                    METRIC_COUNTER, poll_metric_write);
+    metric_function("maxscale_poll_events", "event=\"error\"", events,
+                    METRIC_COUNTER, poll_metric_error);
+    metric_function("maxscale_poll_events", "event=\"hangup\"", events,
+                    METRIC_COUNTER, poll_metric_hangup);
+    metric_function("maxscale_poll_events", "event=\"accept\"", events,
+                    METRIC_COUNTER, poll_metric_accept);
+    metric_function("maxscale_polls", NULL, "Number of epoll_wait calls",
+                    METRIC_COUNTER, poll_metric_polls);
+    metric_function("maxscale_blocking_polls", NULL, "Number of epoll_wait calls with a timeout",
+                    METRIC_COUNTER, poll_metric_blocking_polls);
+    metric_function("maxscale_idle_wakeups", NULL,
+                    "Number of blocking epoll_wait calls after which the thread had no DCB to process",
+                    METRIC_COUNTER, poll_metric_idle_wakeups);
+    metric_function("maxscale_event_queue_length", NULL,
+                    "Number of DCBs in the event queues",
+                    METRIC_GAUGE, poll_metric_evq_length);
+    metric_function("maxscale_event_queue_pending", NULL,
+                    "Number of DCBs with pending events",
+                    METRIC_GAUGE, poll_metric_evq_pending);
+
+    /** The times are measured in heartbeats, one heartbeat is 100ms */
+    queue_time_metric = metric_histogram("maxscale_event_queue_seconds", NULL,
+                                         "Time events spent in the event queue",
+                                         event_time_bounds, n_bounds, 0.1);
+    exec_time_metric = metric_histogram("maxscale_event_execution_seconds", NULL,
+                                        "Time spent processing events",
+                                        event_time_bounds, n_bounds, 0.1);
+
+    /** The CPU time of the sessions is accounted by the polling threads */
+    metrics_add_printer(session_print_metrics);
+}
+
 /**
  * Provide a row to the result set that defines the event queue statistics
  *
@@ -1900,9 +4004,48 @@ eventTimesRowCallback(RESULTSET *set, void *data)
     return row;
 }
 
+/**
+ * Provide a row to the result set that defines the high precision event
+ * time histograms
+ *
+ * @param set   The result set
+ * @param data  The index of the row to send
+ * @return The next row or NULL
+ */
+static RESULT_ROW *
+eventTimesHPRowCallback(RESULTSET *set, void *data)
+{
+    int *rowno = (int *)data;
+    char buf[40];
+    RESULT_ROW *row;
+    int col = 1;
+
+    if (*rowno > N_HP_TIMES)
+    {
+        free(data);
+        return NULL;
+    }
+    row = resultset_make_row(set);
+    poll_hp_bucket_name(*rowno, buf, sizeof(buf));
+    resultset_row_set(row, 0, buf);
+
+    for (int type = 0; type < N_HP_EVENTS; type++)
+    {
+        snprintf(buf, sizeof(buf), "%u", poll_hp_sum(type, *rowno, true));
+        resultset_row_set(row, col++, buf);
+        snprintf(buf, sizeof(buf), "%u", poll_hp_sum(type, *rowno, false));
+        resultset_row_set(row, col++, buf);
+    }
+    (*rowno)++;
+    return row;
+}
+
 /**
  * Return a result set that has the current set of services in it
  *
+ * When high precision event times are enabled the result set has microsecond
+ * histograms of the queue and execution times of each event type.
+ *
  * @return A Result set
  */
 RESULTSET *
@@ -1916,14 +4059,31 @@ eventTimesGetList()
         return NULL;
     }
     *data = 0;
-    if ((set = resultset_create(eventTimesRowCallback, data)) == NULL)
+    if ((set = resultset_create(hp_times ? eventTimesHPRowCallback : eventTimesRowCallback,
+                                data)) == NULL)
     {
         free(data);
         return NULL;
     }
     resultset_add_column(set, "Duration", 20, COL_TYPE_VARCHAR);
-    resultset_add_column(set, "No. Events Queued", 12, COL_TYPE_VARCHAR);
-    resultset_add_column(set, "No. Events Executed", 12, COL_TYPE_VARCHAR);
+
+    if (hp_times)
+    {
+        for (int type = 0; type < N_HP_EVENTS; type++)
+        {
+            char name[40];
+
+            snprintf(name, sizeof(name), "%s Events Queued", hp_event_names[type]);
+            resultset_add_column(set, name, 12, COL_TYPE_VARCHAR);
+            snprintf(name, sizeof(name), "%s Events Executed", hp_event_names[type]);
+            resultset_add_column(set, name, 12, COL_TYPE_VARCHAR);
+        }
+    }
+    else
+    {
+        resultset_add_column(set, "No. Events Queued", 12, COL_TYPE_VARCHAR);
+        resultset_add_column(set, "No. Events Executed", 12, COL_TYPE_VARCHAR);
+    }
 
     return set;
 }
@@ -0,0 +1,287 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file qc_offload.c Classification of large statements by a thread pool
+ *
+ * The jobs are kept in a FIFO and the classifier threads wait for them on a
+ * semaphore. A job is shared by the classifier thread and the client DCB
+ * until both are done with it: the one that is done last frees it. When the
+ * client is closed before the statement has been parsed, the classifier
+ * thread frees the job and does not touch the DCB.
+ */
+
+#include <qc_offload.h>
+#include <stdlib.h>
+#include <semaphore.h>
+#include <maxconfig.h>
+#include <query_classifier.h>
+#include <mysql_client_server_protocol.h>
+#include <maxscale/poll.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <atomic.h>
+#include <metrics.h>
+#include <log_manager.h>
+
+struct qc_offload_job
+{
+    SPINLOCK               lock;      /**< Protects done and cancelled */
+    GWBUF                 *packet;    /**< The statement being classified */
+    DCB                   *dcb;       /**< The client DCB that waits for the statement */
+    bool                   done;      /**< The statement has been classified */
+    bool                   cancelled; /**< The client DCB was closed */
+    struct qc_offload_job *next;      /**< Next job in the queue */
+};
+
+static SPINLOCK        queue_lock = SPINLOCK_INIT;
+static QC_OFFLOAD_JOB *queue_head = NULL;
+static QC_OFFLOAD_JOB *queue_tail = NULL;
+static sem_t           queue_sem;
+static int             n_started = 0;
+static int             n_offloaded = 0;
+
+/**
+ * Free a job and the statement it still holds
+ */
+static void job_free(QC_OFFLOAD_JOB *job)
+{
+    gwbuf_free(job->packet);
+    free(job);
+}
+
+/**
+ * Take the next job from the queue, waiting for one if the queue is empty
+ */
+static QC_OFFLOAD_JOB *job_next()
+{
+    QC_OFFLOAD_JOB *job = NULL;
+
+    while (job == NULL)
+    {
+        while (sem_wait(&queue_sem) != 0)
+        {
+            ss_dassert(errno == EINTR);
+        }
+
+        spinlock_acquire(&queue_lock);
+        job = queue_head;
+
+        if (job)
+        {
+            queue_head = job->next;
+
+            if (queue_head == NULL)
+            {
+                queue_tail = NULL;
+            }
+        }
+        spinlock_release(&queue_lock);
+    }
+
+    return job;
+}
+
+/**
+ * The entry point of the classifier threads
+ */
+static void qc_offload_main(void *data)
+{
+    if (!qc_thread_init())
+    {
+        MXS_ERROR("Could not perform thread initialization for query classifier, "
+                  "exiting the classifier thread.");
+        return;
+    }
+
+    while (true)
+    {
+        QC_OFFLOAD_JOB *job = job_next();
+        bool cancelled;
+
+        /** A job that was cancelled in the queue is not parsed */
+        spinlock_acquire(&job->lock);
+        cancelled = job->cancelled;
+        spinlock_release(&job->lock);
+
+        if (!cancelled)
+        {
+            qc_parse(job->packet, QC_COLLECT_ALL);
+        }
+
+        spinlock_acquire(&job->lock);
+        cancelled = job->cancelled;
+        job->done = true;
+
+        if (!cancelled)
+        {
+            /** The DCB is not freed while its close waits for the lock */
+            poll_add_epollin_event_to_dcb(job->dcb, NULL);
+        }
+        spinlock_release(&job->lock);
+
+        if (cancelled)
+        {
+            job_free(job);
+        }
+    }
+}
+
+static int64_t qc_offload_metric_count()
+{
+    return n_offloaded;
+}
+
+/**
+ * Start the classifier threads
+ *
+ * @param n_threads Number of threads
+ * @return True if at least one thread was started
+ */
+bool qc_offload_init(unsigned int n_threads)
+{
+    sem_init(&queue_sem, 0, 0);
+
+    for (unsigned int i = 0; i < n_threads; i++)
+    {
+        THREAD thr;
+
+        if (thread_start(&thr, qc_offload_main, NULL) == NULL)
+        {
+            MXS_ERROR("Failed to start classifier thread %u.", i);
+            break;
+        }
+        n_started++;
+    }
+
+    if (n_started > 0)
+    {
+        metric_function("maxscale_qc_offloaded", NULL,
+                        "Number of statements classified by the classifier threads",
+                        METRIC_COUNTER, qc_offload_metric_count);
+        MXS_NOTICE("Statements larger than %u bytes are classified by %d classifier threads.",
+                   config_qc_offload_size(), n_started);
+    }
+
+    return n_started > 0;
+}
+
+/**
+ * Check whether a statement should be classified by the classifier threads
+ *
+ * @param packet A complete MySQL packet
+ * @return True for a COM_QUERY larger than query_classifier_offload_size
+ *         that has not been parsed yet
+ */
+bool qc_offload_wanted(GWBUF *packet)
+{
+    unsigned int size = config_qc_offload_size();
+    uint8_t cmd;
+
+    return n_started > 0 && size > 0 && gwbuf_length(packet) > size &&
+           gwbuf_copy_data(packet, MYSQL_HEADER_LEN, 1, &cmd) == 1 &&
+           cmd == MYSQL_COM_QUERY && !GWBUF_IS_PARSED(packet);
+}
+
+/**
+ * Classify a statement in a classifier thread
+ *
+ * When the statement has been classified, a read event is added to the DCB.
+ * The caller must suspend the reads of the DCB until it has called
+ * qc_offload_finish.
+ *
+ * @param packet The statement, owned by the job until it is finished
+ * @param dcb    The client DCB
+ * @return The job or NULL if memory could not be allocated
+ */
+QC_OFFLOAD_JOB *qc_offload_start(GWBUF *packet, DCB *dcb)
+{
+    QC_OFFLOAD_JOB *job = (QC_OFFLOAD_JOB*)malloc(sizeof(QC_OFFLOAD_JOB));
+
+    if (job)
+    {
+        spinlock_init(&job->lock);
+        job->packet = packet;
+        job->dcb = dcb;
+        job->done = false;
+        job->cancelled = false;
+        job->next = NULL;
+
+        spinlock_acquire(&queue_lock);
+        if (queue_tail)
+        {
+            queue_tail->next = job;
+        }
+        else
+        {
+            queue_head = job;
+        }
+        queue_tail = job;
+        spinlock_release(&queue_lock);
+
+        atomic_add(&n_offloaded, 1);
+        sem_post(&queue_sem);
+    }
+
+    return job;
+}
+
+/**
+ * Check whether the statement of a job has been classified
+ *
+ * @param job The job
+ * @return True if qc_offload_finish can be called
+ */
+bool qc_offload_done(QC_OFFLOAD_JOB *job)
+{
+    spinlock_acquire(&job->lock);
+    bool done = job->done;
+    spinlock_release(&job->lock);
+
+    return done;
+}
+
+/**
+ * Free a job whose statement has been classified
+ *
+ * @param job The job
+ * @return The classified statement
+ */
+GWBUF *qc_offload_finish(QC_OFFLOAD_JOB *job)
+{
+    ss_dassert(qc_offload_done(job));
+    GWBUF *packet = job->packet;
+    job->packet = NULL;
+    job_free(job);
+
+    return packet;
+}
+
+/**
+ * Give up a job because the client DCB is closed. The DCB is not used by the
+ * job after this returns.
+ *
+ * @param job The job
+ */
+void qc_offload_cancel(QC_OFFLOAD_JOB *job)
+{
+    spinlock_acquire(&job->lock);
+    bool done = job->done;
+    job->cancelled = true;
+    spinlock_release(&job->lock);
+
+    if (done)
+    {
+        job_free(job);
+    }
+}
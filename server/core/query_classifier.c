@@ -12,9 +12,12 @@
  */
 
 #include <query_classifier.h>
+#include <ctype.h>
+#include <strings.h>
 #include <log_manager.h>
 #include <modules.h>
 #include <modutil.h>
+#include <probes.h>
 
 //#define QC_TRACE_ENABLED
 #undef QC_TRACE_ENABLED
@@ -29,6 +32,9 @@ static const char default_qc_name[] = "qc_sqlite";
 
 static QUERY_CLASSIFIER* classifier;
 
+/** The command byte of a COM_QUERY packet */
+#define QC_COM_QUERY 0x03
+
 
 bool qc_init(const char* plugin_name, const char* plugin_args)
 {
@@ -108,17 +114,612 @@ void qc_thread_end(void)
  * a query is asked for, the query will be parsed if it has not been parsed
  * yet. Also, if the query in the provided buffer has been parsed already
  * then this function will only return the result of that parsing; the query
- * will not be parsed again.
+ * will not be parsed again, unless information not collected the first
+ * time is asked for.
  *
- * @param query A GWBUF containing an SQL statement.
+ * @param query   A GWBUF containing an SQL statement.
+ * @param collect A bitmask of qc_collect_info_t values specifying what
+ *                information should be collected in addition to the type
+ *                and operation.
  * @result To what extent the query could be parsed.
  */
-qc_parse_result_t qc_parse(GWBUF* query)
+qc_parse_result_t qc_parse(GWBUF* query, uint32_t collect)
 {
     QC_TRACE();
     ss_dassert(classifier);
 
-    return classifier->qc_parse(query);
+    MXS_PROBE2(qc_parse_start, query, collect);
+    qc_parse_result_t result = classifier->qc_parse(query, collect);
+    MXS_PROBE2(qc_parse_end, query, result);
+
+    return result;
+}
+
+static inline bool qc_is_word_char(char c)
+{
+    return isalnum((unsigned char) c) || c == '_' || c == '$';
+}
+
+static const char* qc_skip_space(const char* p, const char* end)
+{
+    while (p < end && isspace((unsigned char) *p))
+    {
+        ++p;
+    }
+
+    return p;
+}
+
+/**
+ * Matches a keyword at the start of a string.
+ *
+ * @param p    The start of the string, leading whitespace is skipped.
+ * @param end  The end of the string.
+ * @param word The keyword in upper case.
+ *
+ * @return A pointer past the keyword or NULL if the string does not start
+ *         with the keyword.
+ */
+static const char* qc_match_word(const char* p, const char* end, const char* word)
+{
+    size_t len = strlen(word);
+
+    p = qc_skip_space(p, end);
+
+    if ((size_t) (end - p) >= len &&
+        toupper((unsigned char) *p) == word[0] &&
+        strncasecmp(p, word, len) == 0 &&
+        (p + len == end || !qc_is_word_char(p[len])))
+    {
+        return p + len;
+    }
+
+    return NULL;
+}
+
+/**
+ * A keyword in a table of keywords. The tables end with an entry whose word
+ * is NULL.
+ */
+typedef struct qc_keyword
+{
+    const char* word; /*< The keyword in upper case */
+    size_t      len;  /*< The length of the keyword */
+} QC_KEYWORD;
+
+#define QC_WORD(w) {w, sizeof(w) - 1}
+
+/**
+ * Checks whether a word is one of the keywords of a table. The length and
+ * the first character are compared before the whole word.
+ *
+ * @param start The start of the word.
+ * @param len   The length of the word.
+ * @param words The keywords.
+ *
+ * @return True if the word is one of the keywords.
+ */
+static bool qc_is_keyword(const char* start, size_t len, const QC_KEYWORD* words)
+{
+    char first = toupper((unsigned char) *start);
+
+    for (; words->word; words++)
+    {
+        if (words->len == len && words->word[0] == first &&
+            strncasecmp(start + 1, words->word + 1, len - 1) == 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Checks whether only whitespace and an optional semicolon remain.
+ *
+ * @param p   The start of the remaining string.
+ * @param end The end of the string.
+ *
+ * @return True if the statement ends at @c p.
+ */
+static bool qc_at_end(const char* p, const char* end)
+{
+    p = qc_skip_space(p, end);
+
+    if (p < end && *p == ';')
+    {
+        p = qc_skip_space(p + 1, end);
+    }
+
+    return p == end;
+}
+
+/**
+ * Checks whether the rest of a SELECT can be classified as a plain read. The
+ * statement must not contain functions, subqueries, variables, comments or
+ * multiple statements, nor clauses that turn it into a locking read or a write.
+ *
+ * @param p   The first character after SELECT.
+ * @param end The end of the statement.
+ *
+ * @return True if the statement is a plain read.
+ */
+static bool qc_is_plain_select(const char* p, const char* end)
+{
+    static const QC_KEYWORD rejected_words[] =
+    {
+        QC_WORD("INTO"), QC_WORD("FOR"), QC_WORD("LOCK"), QC_WORD("PROCEDURE"), {NULL, 0}
+    };
+
+    while (p < end)
+    {
+        char c = *p;
+
+        if (c == '\'' || c == '"')
+        {
+            for (++p; p < end && *p != c; ++p)
+            {
+                if (*p == '\\')
+                {
+                    ++p;
+                }
+            }
+
+            if (p >= end)
+            {
+                return false;
+            }
+
+            ++p;
+        }
+        else if (c == '`')
+        {
+            for (++p; p < end && *p != '`'; ++p)
+            {
+            }
+
+            if (p >= end)
+            {
+                return false;
+            }
+
+            ++p;
+        }
+        else if (qc_is_word_char(c))
+        {
+            const char* start = p;
+
+            while (p < end && qc_is_word_char(*p))
+            {
+                ++p;
+            }
+
+            if (qc_is_keyword(start, p - start, rejected_words))
+            {
+                return false;
+            }
+        }
+        else if (c == '(' || c == '@' || c == ';' || c == '#' || c == '{' ||
+                 (c == '/' && p + 1 < end && p[1] == '*') ||
+                 (c == '-' && p + 1 < end && p[1] == '-'))
+        {
+            return false;
+        }
+        else
+        {
+            ++p;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Skips a quoted string or identifier.
+ *
+ * @param p   The opening quote.
+ * @param end The end of the statement.
+ *
+ * @return A pointer past the closing quote or NULL if it is missing.
+ */
+static const char* qc_skip_quoted(const char* p, const char* end)
+{
+    char c = *p;
+
+    for (++p; p < end; ++p)
+    {
+        if (*p == '\\' && c != '`')
+        {
+            ++p;
+        }
+        else if (*p == c)
+        {
+            if (p + 1 < end && p[1] == c)
+            {
+                // A doubled quote stands for the quote itself.
+                ++p;
+            }
+            else
+            {
+                return p + 1;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Skips a parenthesized list, following the nesting and the quotes.
+ *
+ * @param p   The opening parenthesis.
+ * @param end The end of the statement.
+ * @param literals Set to false if the list contains anything else than number
+ *                 and string literals, NULL, TRUE, FALSE and DEFAULT.
+ *
+ * @return A pointer past the closing parenthesis or NULL if it is missing or
+ *         the list contains a comment.
+ */
+static const char* qc_skip_row(const char* p, const char* end, bool* literals)
+{
+    static const QC_KEYWORD literal_words[] =
+    {
+        QC_WORD("NULL"), QC_WORD("TRUE"), QC_WORD("FALSE"), QC_WORD("DEFAULT"), {NULL, 0}
+    };
+    int depth = 0;
+
+    while (p < end)
+    {
+        char c = *p;
+
+        if (c == '(')
+        {
+            if (depth++ > 0)
+            {
+                *literals = false;
+            }
+            ++p;
+        }
+        else if (c == ')')
+        {
+            ++p;
+
+            if (--depth == 0)
+            {
+                return p;
+            }
+        }
+        else if (c == '\'')
+        {
+            if ((p = qc_skip_quoted(p, end)) == NULL)
+            {
+                return NULL;
+            }
+        }
+        else if (c == '"' || c == '`')
+        {
+            // Double quotes may be identifiers, depending on the SQL mode.
+            *literals = false;
+
+            if ((p = qc_skip_quoted(p, end)) == NULL)
+            {
+                return NULL;
+            }
+        }
+        else if (isdigit((unsigned char) c) ||
+                 (c == '.' && p + 1 < end && isdigit((unsigned char) p[1])))
+        {
+            // A number, possibly hexadecimal or with an exponent.
+            for (++p; p < end && (qc_is_word_char(*p) || *p == '.' ||
+                                  ((*p == '+' || *p == '-') && (p[-1] == 'e' || p[-1] == 'E')));
+                 ++p)
+            {
+            }
+        }
+        else if (qc_is_word_char(c))
+        {
+            const char* start = p;
+
+            while (p < end && qc_is_word_char(*p))
+            {
+                ++p;
+            }
+
+            if (!qc_is_keyword(start, p - start, literal_words))
+            {
+                *literals = false;
+            }
+        }
+        else if (c == '#' || (c == '/' && p + 1 < end && p[1] == '*') ||
+                 (c == '-' && p + 1 < end && p[1] == '-'))
+        {
+            // The end of a comment is not looked for.
+            return NULL;
+        }
+        else if (c == ',' || c == '-' || c == '+' || isspace((unsigned char) c))
+        {
+            ++p;
+        }
+        else
+        {
+            // Operators, variables and placeholders.
+            *literals = false;
+            ++p;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Finds the end of the first row of an INSERT or REPLACE with a VALUES list.
+ *
+ * Everything that the classifier reports about such a statement, its type,
+ * operation, tables and affected fields, is determined by the part before the
+ * rows and by the rows that contain more than literals. If all the rows after
+ * the first one contain only literals, the statement can be classified by
+ * parsing it up to the end of the first row, instead of parsing every row into
+ * expressions. INSERT ... SELECT and statements with anything after the rows,
+ * such as ON DUPLICATE KEY UPDATE, are not recognized.
+ *
+ * @param sql      The statement, without the packet header and command byte.
+ * @param len      The length of the statement.
+ * @param literals If not NULL, set to true if the first row also contains only
+ *                 literals.
+ *
+ * @return The length of the statement up to and including its first row, or 0
+ *         if the statement must be classified as a whole.
+ */
+size_t qc_get_insert_values_prefix(const char* sql, size_t len, bool* literals)
+{
+    const char* end = sql + len;
+    const char* p;
+
+    if (!(p = qc_match_word(sql, end, "INSERT")) && !(p = qc_match_word(sql, end, "REPLACE")))
+    {
+        return 0;
+    }
+
+    static const char* const modifiers[] = {"LOW_PRIORITY", "DELAYED", "HIGH_PRIORITY", "IGNORE", NULL};
+
+    for (int i = 0; modifiers[i]; i++)
+    {
+        const char* q = qc_match_word(p, end, modifiers[i]);
+
+        if (q)
+        {
+            p = q;
+        }
+    }
+
+    const char* q = qc_match_word(p, end, "INTO");
+    p = q ? q : p;
+
+    // The table name, possibly qualified with the database name.
+    do
+    {
+        p = qc_skip_space(p, end);
+
+        if (p < end && *p == '`')
+        {
+            p = qc_skip_quoted(p, end);
+        }
+        else if (p < end && qc_is_word_char(*p))
+        {
+            while (p < end && qc_is_word_char(*p))
+            {
+                ++p;
+            }
+        }
+        else
+        {
+            p = NULL;
+        }
+    }
+    while (p && p < end && *p == '.' && ++p);
+
+    if (p == NULL)
+    {
+        return 0;
+    }
+
+    p = qc_skip_space(p, end);
+
+    if (p < end && *p == '(')
+    {
+        bool columns_literal = true;
+
+        if ((p = qc_skip_row(p, end, &columns_literal)) == NULL)
+        {
+            return 0;
+        }
+    }
+
+    if (!(q = qc_match_word(p, end, "VALUES")) && !(q = qc_match_word(p, end, "VALUE")))
+    {
+        return 0;
+    }
+
+    p = qc_skip_space(q, end);
+
+    bool first_literals = true;
+
+    if (p == end || *p != '(' || (p = qc_skip_row(p, end, &first_literals)) == NULL)
+    {
+        return 0;
+    }
+
+    size_t prefix_len = p - sql;
+
+    while (true)
+    {
+        p = qc_skip_space(p, end);
+
+        if (p == end || *p != ',')
+        {
+            break;
+        }
+
+        bool row_literals = true;
+        p = qc_skip_space(p + 1, end);
+
+        if (p == end || *p != '(' || (p = qc_skip_row(p, end, &row_literals)) == NULL ||
+            !row_literals)
+        {
+            return 0;
+        }
+    }
+
+    if (!qc_at_end(p, end))
+    {
+        return 0;
+    }
+
+    if (literals)
+    {
+        *literals = first_literals;
+    }
+
+    return prefix_len;
+}
+
+/**
+ * Classifies the statements that can be recognized from their first few
+ * tokens: plain SELECTs, BEGIN, START TRANSACTION, COMMIT, ROLLBACK,
+ * SET autocommit and USE. The result is the same as the one the full
+ * classifier would produce. Nothing is allocated and the buffer is not
+ * modified, so a subsequent request for e.g. the table names still parses
+ * the statement.
+ *
+ * @param query A buffer containing a query.
+ * @param type  On success, the type of the query.
+ * @param op    On success, the operation of the query.
+ *
+ * @return True if the statement was classified.
+ */
+static bool qc_fast_classify(GWBUF* query, uint32_t* type, qc_query_op_t* op)
+{
+    if (GWBUF_IS_PARSED(query) || GWBUF_LENGTH(query) < 5)
+    {
+        return false;
+    }
+
+    const uint8_t* data = GWBUF_DATA(query);
+    size_t len = data[0] | (data[1] << 8) | (data[2] << 16);
+
+    if (data[4] != QC_COM_QUERY || len < 1 || GWBUF_LENGTH(query) < len + 4)
+    {
+        return false;
+    }
+
+    const char* p = (const char*) &data[5];
+    const char* end = p + len - 1;
+    const char* q;
+
+    *op = QUERY_OP_UNDEFINED;
+
+    if ((q = qc_match_word(p, end, "SELECT")))
+    {
+        *type = QUERY_TYPE_READ;
+        *op = QUERY_OP_SELECT;
+        return qc_is_plain_select(q, end);
+    }
+    else if (qc_match_word(p, end, "INSERT"))
+    {
+        bool literals = false;
+
+        *type = QUERY_TYPE_WRITE;
+        *op = QUERY_OP_INSERT;
+        return qc_get_insert_values_prefix(p, end - p, &literals) > 0 && literals;
+    }
+    else if ((q = qc_match_word(p, end, "BEGIN")))
+    {
+        const char* w = qc_match_word(q, end, "WORK");
+
+        *type = QUERY_TYPE_BEGIN_TRX;
+        return qc_at_end(w ? w : q, end);
+    }
+    else if ((q = qc_match_word(p, end, "START")))
+    {
+        q = qc_match_word(q, end, "TRANSACTION");
+
+        *type = QUERY_TYPE_BEGIN_TRX;
+        return q && qc_at_end(q, end);
+    }
+    else if ((q = qc_match_word(p, end, "COMMIT")))
+    {
+        const char* w = qc_match_word(q, end, "WORK");
+
+        *type = QUERY_TYPE_COMMIT;
+        return qc_at_end(w ? w : q, end);
+    }
+    else if ((q = qc_match_word(p, end, "ROLLBACK")))
+    {
+        const char* w = qc_match_word(q, end, "WORK");
+
+        *type = QUERY_TYPE_ROLLBACK;
+        return qc_at_end(w ? w : q, end);
+    }
+    else if ((q = qc_match_word(p, end, "USE")))
+    {
+        q = qc_skip_space(q, end);
+
+        if (q < end && *q == '`')
+        {
+            const char* close = memchr(q + 1, '`', end - q - 1);
+            q = close ? close + 1 : NULL;
+        }
+        else if (q < end && qc_is_word_char(*q))
+        {
+            while (q < end && qc_is_word_char(*q))
+            {
+                ++q;
+            }
+        }
+        else
+        {
+            q = NULL;
+        }
+
+        *type = QUERY_TYPE_SESSION_WRITE;
+        *op = QUERY_OP_CHANGE_DB;
+        return q && qc_at_end(q, end);
+    }
+    else if ((q = qc_match_word(p, end, "SET")) && (q = qc_match_word(q, end, "AUTOCOMMIT")))
+    {
+        q = qc_skip_space(q, end);
+
+        if (q < end && *q == '=')
+        {
+            const char* w;
+            int enable = -1;
+
+            if ((w = qc_match_word(q + 1, end, "1")) ||
+                (w = qc_match_word(q + 1, end, "TRUE")) ||
+                (w = qc_match_word(q + 1, end, "ON")))
+            {
+                enable = 1;
+            }
+            else if ((w = qc_match_word(q + 1, end, "0")) ||
+                     (w = qc_match_word(q + 1, end, "FALSE")) ||
+                     (w = qc_match_word(q + 1, end, "OFF")))
+            {
+                enable = 0;
+            }
+
+            if (enable != -1 && qc_at_end(w, end))
+            {
+                *type = QUERY_TYPE_GSYSVAR_WRITE;
+                *type |= enable ?
+                    (QUERY_TYPE_ENABLE_AUTOCOMMIT | QUERY_TYPE_COMMIT) :
+                    (QUERY_TYPE_DISABLE_AUTOCOMMIT | QUERY_TYPE_BEGIN_TRX);
+                return true;
+            }
+        }
+    }
+
+    return false;
 }
 
 /**
@@ -135,6 +736,14 @@ uint32_t qc_get_type(GWBUF* query)
     QC_TRACE();
     ss_dassert(classifier);
 
+    uint32_t type;
+    qc_query_op_t op;
+
+    if (qc_fast_classify(query, &type, &op))
+    {
+        return type;
+    }
+
     return classifier->qc_get_type(query);
 }
 
@@ -143,6 +752,14 @@ qc_query_op_t qc_get_operation(GWBUF* query)
     QC_TRACE();
     ss_dassert(classifier);
 
+    uint32_t type;
+    qc_query_op_t op;
+
+    if (qc_fast_classify(query, &type, &op))
+    {
+        return op;
+    }
+
     return classifier->qc_get_operation(query);
 }
 
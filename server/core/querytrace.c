@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file querytrace.c The sampled routing breakdown of queries
+ *
+ * The points are time-stamp counter values. The rate of the counter is
+ * measured against the monotonic clock when the tracing is enabled so that
+ * the stage times can be stored in the histograms in nanoseconds.
+ *
+ * A point that the query did not pass, for example the classification with
+ * a router that does not classify the statements, gets the time of the
+ * point before it and the stage that ends with it takes no time.
+ */
+
+#include <querytrace.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <platform.h>
+#include <session.h>
+#include <dcb.h>
+#include <trace.h>
+#include <metrics.h>
+#include <log_manager.h>
+
+bool query_trace_enabled = false;
+
+static unsigned int query_trace_rate;
+static char query_trace_user[128];
+static double query_trace_ns_per_cycle = 1.0;
+static METRIC *query_trace_stages[QTRACE_STAGE_MAX];
+
+/** Queries read by this thread since the last sampled query */
+static thread_local unsigned int query_trace_count;
+
+static const char *query_trace_point_names[QTRACE_POINT_MAX] =
+{
+    "client",
+    "filter",
+    "router",
+    "route",
+    "classified",
+    "write",
+    "first_byte",
+    "reply"
+};
+
+static const char *query_trace_stage_names[QTRACE_STAGE_MAX] =
+{
+    "filter",
+    "classify",
+    "select",
+    "backend",
+    "reply",
+    "total"
+};
+
+/** The points where each stage starts and ends */
+static const qtrace_point_t query_trace_stage_starts[QTRACE_STAGE_MAX] =
+{
+    QTRACE_CLIENT,
+    QTRACE_ROUTER,
+    QTRACE_CLASSIFIED,
+    QTRACE_WRITE,
+    QTRACE_FIRST_BYTE,
+    QTRACE_CLIENT
+};
+
+static const qtrace_point_t query_trace_stage_ends[QTRACE_STAGE_MAX] =
+{
+    QTRACE_ROUTER,
+    QTRACE_CLASSIFIED,
+    QTRACE_WRITE,
+    QTRACE_FIRST_BYTE,
+    QTRACE_REPLY,
+    QTRACE_REPLY
+};
+
+/** The stage times in nanoseconds */
+static const int64_t query_trace_bounds[] =
+{
+    1000, 3000, 10000, 30000, 100000, 300000,
+    1000000, 3000000, 10000000, 30000000, 100000000, 300000000,
+    1000000000, 3000000000
+};
+
+static uint64_t query_trace_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Measure the rate of the time-stamp counter
+ *
+ * @return Nanoseconds per cycle
+ */
+static double query_trace_calibrate()
+{
+    struct timespec delay = {0, 10000000};
+    uint64_t start = query_trace_clock();
+    CYCLES cycles = rdtsc();
+
+    nanosleep(&delay, NULL);
+
+    uint64_t ns = query_trace_clock() - start;
+    cycles = rdtsc() - cycles;
+
+    return cycles > 0 ? (double)ns / cycles : 1.0;
+}
+
+/**
+ * Enable the sampled tracing of queries
+ *
+ * @param rate Trace one in this many queries of each thread, 0 for none
+ * @param user Trace all queries of this user, NULL or empty for none
+ */
+void query_trace_init(unsigned int rate, const char *user)
+{
+    query_trace_rate = rate;
+    snprintf(query_trace_user, sizeof(query_trace_user), "%s", user ? user : "");
+
+    if (query_trace_rate == 0 && *query_trace_user == '\0')
+    {
+        return;
+    }
+
+    query_trace_ns_per_cycle = query_trace_calibrate();
+
+    for (int i = 0; i < QTRACE_STAGE_MAX; i++)
+    {
+        char labels[64];
+        snprintf(labels, sizeof(labels), "stage=\"%s\"", query_trace_stage_names[i]);
+        query_trace_stages[i] = metric_histogram("maxscale_query_stage_seconds", labels,
+                                                 "Time the sampled queries spent in each routing stage",
+                                                 query_trace_bounds,
+                                                 sizeof(query_trace_bounds) / sizeof(query_trace_bounds[0]),
+                                                 0.000000001);
+    }
+
+    query_trace_enabled = true;
+
+    if (query_trace_rate)
+    {
+        MXS_NOTICE("Tracing the routing of one in %u queries%s%s.", query_trace_rate,
+                   *query_trace_user ? " and all queries of user " : "", query_trace_user);
+    }
+    else
+    {
+        MXS_NOTICE("Tracing the routing of all queries of user %s.", query_trace_user);
+    }
+}
+
+/**
+ * Write a point to the binary event trace
+ *
+ * @param session The session
+ * @param point   The point
+ * @param filter  Number of the filter for QTRACE_FILTER
+ * @param cycles  The time-stamp counter at the point
+ */
+static void query_trace_emit(SESSION *session, qtrace_point_t point, int filter, CYCLES cycles)
+{
+    TRACE_EVENT(TRACE_QUERY_POINT, session->ses_id, point | (uint32_t)filter << 16, cycles);
+}
+
+/**
+ * Decide whether the query that was read from the client of the session is
+ * traced. Use the QUERY_TRACE_START macro instead of calling this directly.
+ *
+ * @param session The session
+ */
+void query_trace_start(SESSION *session)
+{
+    QUERY_TRACE *trace = &session->trace;
+    bool sample = false;
+
+    if (*query_trace_user)
+    {
+        if (trace->user < 0)
+        {
+            const char *user = session->client_dcb ? session->client_dcb->user : NULL;
+            trace->user = user && strcmp(user, query_trace_user) == 0;
+        }
+        sample = trace->user;
+    }
+
+    if (!sample && query_trace_rate && ++query_trace_count >= query_trace_rate)
+    {
+        query_trace_count = 0;
+        sample = true;
+    }
+
+    trace->active = sample;
+
+    if (sample)
+    {
+        memset(trace->points, 0, sizeof(trace->points));
+        trace->points[QTRACE_CLIENT] = rdtsc();
+        query_trace_emit(session, QTRACE_CLIENT, 0, trace->points[QTRACE_CLIENT]);
+    }
+}
+
+/**
+ * Record a point of the traced query of a session. Use the QUERY_TRACE_POINT
+ * macro instead of calling this directly.
+ *
+ * @param session The session
+ * @param point   The point
+ * @param filter  Number of the filter for QTRACE_FILTER
+ */
+void query_trace_point(SESSION *session, qtrace_point_t point, int filter)
+{
+    QUERY_TRACE *trace = &session->trace;
+
+    if (point == QTRACE_FILTER || trace->points[point] == 0)
+    {
+        CYCLES cycles = rdtsc();
+        trace->points[point] = cycles;
+        query_trace_emit(session, point, filter, cycles);
+    }
+}
+
+/**
+ * End the trace of the query of a session and add the stage times to the
+ * histograms. Use the QUERY_TRACE_END macro instead of calling this directly.
+ *
+ * @param session The session
+ */
+void query_trace_end(SESSION *session)
+{
+    QUERY_TRACE *trace = &session->trace;
+    CYCLES *points = trace->points;
+
+    trace->active = false;
+    points[QTRACE_REPLY] = rdtsc();
+    query_trace_emit(session, QTRACE_REPLY, 0, points[QTRACE_REPLY]);
+
+    /** The filter points are not used for the stages */
+    points[QTRACE_FILTER] = points[QTRACE_CLIENT];
+
+    for (int i = QTRACE_FILTER + 1; i < QTRACE_POINT_MAX; i++)
+    {
+        if (points[i] < points[i - 1])
+        {
+            points[i] = points[i - 1];
+        }
+    }
+
+    for (int i = 0; i < QTRACE_STAGE_MAX; i++)
+    {
+        CYCLES cycles = points[query_trace_stage_ends[i]] - points[query_trace_stage_starts[i]];
+        metric_observe(query_trace_stages[i], (int64_t)(cycles * query_trace_ns_per_cycle));
+    }
+}
+
+/**
+ * @param point One of qtrace_point_t
+ * @return The name of the point
+ */
+const char *query_trace_point_name(uint32_t point)
+{
+    return point < QTRACE_POINT_MAX ? query_trace_point_names[point] : "unknown";
+}
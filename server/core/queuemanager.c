@@ -17,19 +17,33 @@
  * MaxScale contains a number of FIFO queues. This code attempts to provide
  * standard functions for handling them.
  *
+ * Each priority class has a ring of its own. Entries are normally taken from
+ * the highest priority class that has any, but an entry that has waited for
+ * more than half of the timeout is taken before the entries of the higher
+ * classes so that the lower classes are not starved under a steady load.
+ *
  * @verbatim
  * Revision History
  *
  * Date         Who                     Description
  * 27/04/16     Martin Brampton         Initial implementation
+ * 14/10/16                             Priority classes, millisecond time stamps
  *
  * @endverbatim
  */
 #include <stdlib.h>
+#include <strings.h>
+#include <time.h>
 #include <queuemanager.h>
 #include <spinlock.h>
 #include <log_manager.h>
-#include <hk_heartbeat.h>
+
+static const char *priority_names[QUEUE_PRIORITIES] =
+{
+    "high",
+    "normal",
+    "low"
+};
 
 /**
  * @brief Allocate a new queue
@@ -38,7 +52,7 @@
  * for the use of a queue.
  *
  * @param limit         The maximum size of the queue
- * @param timeout       The maximum time for which an entry is valid
+ * @param timeout       The maximum time in milliseconds for which an entry is valid
  * @return QUEUE_CONFIG A queue configuration and anchor structure
  */
 QUEUE_CONFIG
@@ -78,65 +92,247 @@ void mxs_queue_free(QUEUE_CONFIG *queue_config)
     free(queue_config);
 }
 
+/**
+ * @brief Change the limits of a queue
+ *
+ * The entries already in the queue are kept even if there are more of them
+ * than the new limit allows.
+ *
+ * @param queue_config  The configuration and anchor structure for the queue
+ * @param limit         The maximum size of the queue
+ * @param timeout       The maximum time in milliseconds for which an entry is valid
+ */
+void mxs_queue_configure(QUEUE_CONFIG *queue_config, int limit, int timeout)
+{
+    if (limit > CONNECTION_QUEUE_LIMIT)
+    {
+        MXS_ERROR("Limit configured for connection queue exceeds system maximum");
+        limit = CONNECTION_QUEUE_LIMIT;
+    }
+    spinlock_acquire(&queue_config->queue_lock);
+    queue_config->queue_limit = limit;
+    queue_config->timeout = timeout;
+    spinlock_release(&queue_config->queue_lock);
+}
+
+/**
+ * @brief The current time for queue time stamps
+ *
+ * @return Monotonic time in milliseconds
+ */
+uint64_t mxs_queue_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 /**
  * @brief Add an item to a queue
  *
- * Add a new item to a FIFO queue
+ * Add a new item to the FIFO ring of its priority class
  *
  * @param queue_config  The configuration and anchor structure for the queue
  * @param new_entry     The new entry, to be added
+ * @param priority      The priority class of the entry
  * @return bool         Whether the enqueue succeeded
  */
-bool mxs_enqueue(QUEUE_CONFIG *queue_config, void *new_entry)
+bool mxs_enqueue(QUEUE_CONFIG *queue_config, void *new_entry, int priority)
 {
     bool result = false;
 
+    if (priority < 0 || priority >= QUEUE_PRIORITIES)
+    {
+        priority = QUEUE_PRIORITY_NORMAL;
+    }
+
     if (queue_config)
     {
+        uint64_t now = mxs_queue_now();
+
         spinlock_acquire(&queue_config->queue_lock);
-        if (queue_config->queue_limit < queue_config->queue_size
-            && mxs_queue_count(queue_config) < queue_config->queue_size)
+        if (queue_config->count < queue_config->queue_limit)
         {
-            queue_config->queue_array[queue_config->end].queued_object = new_entry;
-            queue_config->queue_array[queue_config->end].heartbeat = hkheartbeat;
-            queue_config->end++;
-            if (queue_config->end >= queue_config->queue_size)
+            QUEUE_RING *ring = &queue_config->rings[priority];
+            QUEUE_ENTRY *entry = &ring->queue_array[ring->end];
+
+            entry->queued_object = new_entry;
+            entry->queued_at = now;
+            entry->priority = priority;
+            ring->end++;
+            if (ring->end >= queue_config->queue_size)
             {
-                queue_config->end = 0;
+                ring->end = 0;
             }
+            queue_config->count++;
             result = true;
         }
-        else
-        {
-            result = false;
-        }
         spinlock_release(&queue_config->queue_lock);
     }
     return result;
 }
 
+/**
+ * @brief Whether a ring has no entries
+ */
+static inline bool ring_empty(QUEUE_RING *ring)
+{
+    return ring->start == ring->end;
+}
+
+/**
+ * @brief Remove the first entry of a ring, the queue lock must be held
+ */
+static void ring_take(QUEUE_CONFIG *queue_config, QUEUE_RING *ring, QUEUE_ENTRY *entry)
+{
+    *entry = ring->queue_array[ring->start++];
+    if (ring->start >= queue_config->queue_size)
+    {
+        ring->start = 0;
+    }
+    queue_config->count--;
+}
+
+/**
+ * @brief Find the ring whose first entry was queued before a given time
+ *
+ * @param queue_config  The queue, the queue lock must be held
+ * @param before        Only entries queued before this time are considered
+ * @return The ring with the oldest such entry or NULL if there are none
+ */
+static QUEUE_RING *oldest_ring(QUEUE_CONFIG *queue_config, uint64_t before)
+{
+    QUEUE_RING *oldest = NULL;
+
+    for (int i = 0; i < QUEUE_PRIORITIES; i++)
+    {
+        QUEUE_RING *ring = &queue_config->rings[i];
+
+        if (!ring_empty(ring) && ring->queue_array[ring->start].queued_at < before &&
+            (oldest == NULL ||
+             ring->queue_array[ring->start].queued_at < oldest->queue_array[oldest->start].queued_at))
+        {
+            oldest = ring;
+        }
+    }
+
+    return oldest;
+}
+
 /**
  * @brief Remove an item from a queue
  *
- * Remove an item from a FIFO queue
+ * Remove the next item from the queue. This is the first item of the highest
+ * priority class unless an item has waited for more than half of the timeout,
+ * in which case the item that has waited the longest is removed.
+ *
+ * @param queue_config  The configuration and anchor structure for the queue
+ * @param now           The current time, see mxs_queue_now
+ * @param entry         The removed entry is copied here
+ * @return bool         Whether an entry was removed
+ */
+bool mxs_dequeue(QUEUE_CONFIG *queue_config, uint64_t now, QUEUE_ENTRY *entry)
+{
+    bool result = false;
+
+    spinlock_acquire(&queue_config->queue_lock);
+    if (queue_config->count > 0)
+    {
+        uint64_t aged = now - queue_config->timeout / 2;
+        QUEUE_RING *ring = now >= (uint64_t)queue_config->timeout / 2 ?
+                           oldest_ring(queue_config, aged + 1) : NULL;
+
+        for (int i = 0; ring == NULL && i < QUEUE_PRIORITIES; i++)
+        {
+            if (!ring_empty(&queue_config->rings[i]))
+            {
+                ring = &queue_config->rings[i];
+            }
+        }
+
+        ss_dassert(ring);
+        ring_take(queue_config, ring, entry);
+        result = true;
+    }
+    spinlock_release(&queue_config->queue_lock);
+    return result;
+}
+
+/**
+ * @brief Remove an expired item from a queue
+ *
+ * Remove the item that has waited the longest if it has waited for at least
+ * the timeout of the queue.
  *
  * @param queue_config  The configuration and anchor structure for the queue
- * @return QUEUE_ENTRY  A structure defining the removed entry
+ * @param now           The current time, see mxs_queue_now
+ * @param entry         The removed entry is copied here
+ * @return bool         Whether an entry was removed
  */
-QUEUE_ENTRY *mxs_dequeue(QUEUE_CONFIG *queue_config)
+bool mxs_dequeue_expired(QUEUE_CONFIG *queue_config, uint64_t now, QUEUE_ENTRY *entry)
 {
-    int count;
-    QUEUE_ENTRY *result = NULL;
+    bool result = false;
 
     spinlock_acquire(&queue_config->queue_lock);
-    if (NULL == result && (count = mxs_queue_count(queue_config)) > 0)
+    if (queue_config->count > 0 && now >= (uint64_t)queue_config->timeout)
     {
-        result = &(queue_config->queue_array[queue_config->start++]);
-        if (queue_config->start >= queue_config->queue_size)
+        QUEUE_RING *ring = oldest_ring(queue_config, now - queue_config->timeout + 1);
+
+        if (ring)
         {
-            queue_config->start = 0;
+            ring_take(queue_config, ring, entry);
+            result = true;
         }
     }
     spinlock_release(&queue_config->queue_lock);
     return result;
 }
+
+/**
+ * @brief When the next item of a queue expires
+ *
+ * @param queue_config  The configuration and anchor structure for the queue
+ * @return The time when the oldest item expires or UINT64_MAX if the queue is empty
+ */
+uint64_t mxs_queue_next_expiry(QUEUE_CONFIG *queue_config)
+{
+    uint64_t result = UINT64_MAX;
+
+    spinlock_acquire(&queue_config->queue_lock);
+    QUEUE_RING *ring = oldest_ring(queue_config, UINT64_MAX);
+    if (ring)
+    {
+        result = ring->queue_array[ring->start].queued_at + queue_config->timeout;
+    }
+    spinlock_release(&queue_config->queue_lock);
+    return result;
+}
+
+/**
+ * @brief Convert the name of a priority class to the class
+ *
+ * @param name  One of high, normal or low
+ * @return The priority class or -1 if the name is not valid
+ */
+int mxs_queue_priority(const char *name)
+{
+    for (int i = 0; i < QUEUE_PRIORITIES; i++)
+    {
+        if (strcasecmp(name, priority_names[i]) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief The name of a priority class
+ *
+ * @param priority  The priority class
+ * @return The name of the class
+ */
+const char *mxs_queue_priority_name(int priority)
+{
+    return priority >= 0 && priority < QUEUE_PRIORITIES ? priority_names[priority] : "unknown";
+}
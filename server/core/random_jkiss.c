@@ -46,6 +46,7 @@ static SPINLOCK random_jkiss_spinlock = SPINLOCK_INIT;
 
 static unsigned int random_jkiss_devrand(void);
 static void random_init_jkiss(void);
+static inline unsigned int random_jkiss_next(void);
 
 /***
  *
@@ -57,7 +58,6 @@ static void random_init_jkiss(void);
 unsigned int
 random_jkiss(void)
 {
-    unsigned long long t;
     unsigned int result;
 
     spinlock_acquire(&random_jkiss_spinlock);
@@ -69,6 +69,50 @@ random_jkiss(void)
         random_init_jkiss();
         spinlock_acquire(&random_jkiss_spinlock);
     }
+    result = random_jkiss_next();
+    spinlock_release(&random_jkiss_spinlock);
+    return result;
+}
+
+/***
+ *
+ * Fill an array with pseudo-random numbers, taking the lock only once
+ *
+ * @param values    The array to fill
+ * @param n         Number of values to generate
+ *
+ */
+void
+random_jkiss_fill(unsigned int *values, int n)
+{
+    if (n <= 0)
+    {
+        return;
+    }
+
+    /* Initialises the generator if needed */
+    values[0] = random_jkiss();
+
+    spinlock_acquire(&random_jkiss_spinlock);
+    for (int i = 1; i < n; i++)
+    {
+        values[i] = random_jkiss_next();
+    }
+    spinlock_release(&random_jkiss_spinlock);
+}
+
+/***
+ *
+ * Advance the generator, the spinlock must be held
+ *
+ * @return  uint    Random number
+ *
+ */
+static inline unsigned int
+random_jkiss_next(void)
+{
+    unsigned long long t;
+
     x = 314527869 * x + 1234567;
     y ^= y << 5;
     y ^= y >> 7;
@@ -76,9 +120,7 @@ random_jkiss(void)
     t = 4294584393ULL * z + c;
     c = t >> 32;
     z = t;
-    result = x + y + z;
-    spinlock_release(&random_jkiss_spinlock);
-    return result;
+    return x + y + z;
 }
 
 /* Own code adapted from http://www0.cs.ucl.ac.uk/staff/d.jones/GoodPracticeRNG.pdf */
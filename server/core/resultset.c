@@ -23,17 +23,41 @@
  * @endverbatim
  */
 
+#include <stdarg.h>
+#include <stdio.h>
 #include <string.h>
 #include <ctype.h>
 #include <resultset.h>
 #include <buffer.h>
 #include <dcb.h>
 
+/**
+ * The amount of output collected before it is written to the client. The
+ * packets and the JSON text of the rows are serialised into buffers of this
+ * size and a buffer is written only when the next part does not fit into it.
+ */
+#define RESULTSET_FLUSH_SIZE GWBUF_MAX_POOLED_SIZE
 
-static int mysql_send_fieldcount(DCB *, int);
-static int mysql_send_columndef(DCB *, char *, int, int, uint8_t);
-static int mysql_send_eof(DCB *, int);
-static int mysql_send_row(DCB *, RESULT_ROW *, int);
+/**
+ * The output of a result set that is being streamed
+ */
+typedef struct
+{
+    DCB     *dcb;           /*< The connection the result set is sent to */
+    GWBUF   *buffer;        /*< The buffer being filled, NULL if none */
+    size_t  size;           /*< The size of the buffer */
+    size_t  used;           /*< The bytes used in the buffer */
+    bool    error;          /*< Writing to the connection has failed */
+} RESULTSET_WRITER;
+
+static void writer_init(RESULTSET_WRITER *, DCB *);
+static void writer_flush(RESULTSET_WRITER *);
+static uint8_t *writer_reserve(RESULTSET_WRITER *, size_t);
+static void writer_printf(RESULTSET_WRITER *, const char *, ...) __attribute__((format(printf, 2, 3)));
+static int mysql_send_fieldcount(RESULTSET_WRITER *, int);
+static int mysql_send_columndef(RESULTSET_WRITER *, char *, int, int, uint8_t);
+static int mysql_send_eof(RESULTSET_WRITER *, int);
+static int mysql_send_row(RESULTSET_WRITER *, RESULT_ROW *, int);
 
 
 /**
@@ -228,10 +252,150 @@ resultset_row_set(RESULT_ROW *row, int col, char *value)
     return 1;
 }
 
+/**
+ * Initialise the output of a result set
+ *
+ * @param writer        The output
+ * @param dcb           The connection the result set is sent to
+ */
+static void
+writer_init(RESULTSET_WRITER *writer, DCB *dcb)
+{
+    writer->dcb = dcb;
+    writer->buffer = NULL;
+    writer->size = 0;
+    writer->used = 0;
+    writer->error = false;
+}
+
+/**
+ * Write the collected output to the connection. Once a write has failed
+ * the rest of the output is discarded.
+ *
+ * @param writer        The output
+ */
+static void
+writer_flush(RESULTSET_WRITER *writer)
+{
+    GWBUF *buf = writer->buffer;
+
+    if (buf == NULL)
+    {
+        return;
+    }
+    writer->buffer = NULL;
+
+    if (writer->used == 0 || writer->error)
+    {
+        gwbuf_free(buf);
+        return;
+    }
+
+    GWBUF_RTRIM(buf, writer->size - writer->used);
+    if (writer->dcb->func.write(writer->dcb, buf) == 0)
+    {
+        writer->error = true;
+    }
+}
+
+/**
+ * Reserve space for the next part of the output. The caller must fill all
+ * of the reserved space. If the part does not fit into the current buffer,
+ * the buffer is written first. A part that is larger than the flush size is
+ * placed into a buffer of its own.
+ *
+ * @param writer        The output
+ * @param len           The length of the part
+ * @return              Pointer to the reserved space or NULL on error
+ */
+static uint8_t *
+writer_reserve(RESULTSET_WRITER *writer, size_t len)
+{
+    uint8_t *ptr;
+
+    if (writer->buffer && writer->used + len > writer->size)
+    {
+        writer_flush(writer);
+    }
+
+    if (writer->error)
+    {
+        return NULL;
+    }
+
+    if (writer->buffer == NULL)
+    {
+        size_t size = len > RESULTSET_FLUSH_SIZE ? len : RESULTSET_FLUSH_SIZE;
+
+        if ((writer->buffer = gwbuf_alloc(size)) == NULL)
+        {
+            writer->error = true;
+            return NULL;
+        }
+        writer->size = size;
+        writer->used = 0;
+    }
+
+    ptr = (uint8_t *)GWBUF_DATA(writer->buffer) + writer->used;
+    writer->used += len;
+    return ptr;
+}
+
+/**
+ * Append formatted text to the output
+ *
+ * @param writer        The output
+ * @param fmt           The format, as for printf
+ */
+static void
+writer_printf(RESULTSET_WRITER *writer, const char *fmt, ...)
+{
+    va_list args;
+    int len;
+    uint8_t *ptr;
+
+    if (writer->error)
+    {
+        return;
+    }
+
+    if (writer->buffer && writer->used < writer->size)
+    {
+        size_t avail = writer->size - writer->used;
+
+        va_start(args, fmt);
+        len = vsnprintf((char *)GWBUF_DATA(writer->buffer) + writer->used, avail, fmt, args);
+        va_end(args);
+
+        if (len >= 0 && (size_t)len < avail)
+        {
+            writer->used += len;
+            return;
+        }
+    }
+    else
+    {
+        va_start(args, fmt);
+        len = vsnprintf(NULL, 0, fmt, args);
+        va_end(args);
+    }
+
+    /** The text did not fit, reserve room for it and the terminating NUL */
+    if (len < 0 || (ptr = writer_reserve(writer, len + 1)) == NULL)
+    {
+        return;
+    }
+    va_start(args, fmt);
+    vsnprintf((char *)ptr, len + 1, fmt, args);
+    va_end(args);
+    writer->used--;
+}
+
 /**
  * Stream a result set using the MySQL protocol for encodign the result
  * set. Each row is retrieved by calling the function passed in the
- * argument list.
+ * argument list. The packets are collected into large buffers that are
+ * written to the connection as they fill up.
  *
  * @param set   The result set to stream
  * @param dcb   The connection to stream the result set to
@@ -239,58 +403,59 @@ resultset_row_set(RESULT_ROW *row, int col, char *value)
 void
 resultset_stream_mysql(RESULTSET *set, DCB *dcb)
 {
+    RESULTSET_WRITER writer;
     RESULT_COLUMN *col;
     RESULT_ROW *row;
     uint8_t seqno = 2;
 
-    mysql_send_fieldcount(dcb, set->n_cols);
+    writer_init(&writer, dcb);
+    mysql_send_fieldcount(&writer, set->n_cols);
 
     col = set->column;
     while (col)
     {
-        mysql_send_columndef(dcb, col->name, col->type, col->len, seqno++);
+        mysql_send_columndef(&writer, col->name, col->type, col->len, seqno++);
         col = col->next;
     }
-    mysql_send_eof(dcb, seqno++);
+    mysql_send_eof(&writer, seqno++);
     while ((row = (*set->fetchrow)(set, set->userdata)) != NULL)
     {
-        mysql_send_row(dcb, row, seqno++);
+        mysql_send_row(&writer, row, seqno++);
         resultset_free_row(row);
     }
-    mysql_send_eof(dcb, seqno);
+    mysql_send_eof(&writer, seqno);
+    writer_flush(&writer);
 }
 
 /**
  * Send the field count packet in a response packet sequence.
  *
- * @param dcb           DCB of connection to send result set to
+ * @param writer        The output of the result set
  * @param count         Number of columns in the result set
  * @return              Non-zero on success
  */
 static int
-mysql_send_fieldcount(DCB *dcb, int count)
+mysql_send_fieldcount(RESULTSET_WRITER *writer, int count)
 {
-    GWBUF *pkt;
     uint8_t *ptr;
 
-    if ((pkt = gwbuf_alloc(5)) == NULL)
+    if ((ptr = writer_reserve(writer, 5)) == NULL)
     {
         return 0;
     }
-    ptr = GWBUF_DATA(pkt);
     *ptr++ = 0x01;                  // Payload length
     *ptr++ = 0x00;
     *ptr++ = 0x00;
     *ptr++ = 0x01;                  // Sequence number in response
     *ptr++ = count;                 // Length of result string
-    return dcb->func.write(dcb, pkt);
+    return 1;
 }
 
 
 /**
  * Send the column definition packet in a response packet sequence.
  *
- * @param dcb           The DCB of the connection
+ * @param writer        The output of the result set
  * @param name          Name of the column
  * @param type          Column type
  * @param len           Column length
@@ -298,17 +463,15 @@ mysql_send_fieldcount(DCB *dcb, int count)
  * @return              Non-zero on success
  */
 static int
-mysql_send_columndef(DCB *dcb, char *name, int type, int len, uint8_t seqno)
+mysql_send_columndef(RESULTSET_WRITER *writer, char *name, int type, int len, uint8_t seqno)
 {
-    GWBUF *pkt;
     uint8_t *ptr;
     int plen;
 
-    if ((pkt = gwbuf_alloc(26 + strlen(name))) == NULL)
+    if ((ptr = writer_reserve(writer, 26 + strlen(name))) == NULL)
     {
         return 0;
     }
-    ptr = GWBUF_DATA(pkt);
     plen = 22 + strlen(name);
     *ptr++ = plen & 0xff;
     *ptr++ = (plen >> 8) & 0xff;
@@ -347,28 +510,26 @@ mysql_send_columndef(DCB *dcb, char *name, int type, int len, uint8_t seqno)
     *ptr++ = 0;
     *ptr++ = 0;
     *ptr++ = 0;
-    return dcb->func.write(dcb, pkt);
+    return 1;
 }
 
 
 /**
  * Send an EOF packet in a response packet sequence.
  *
- * @param dcb           The client connection
+ * @param writer        The output of the result set
  * @param seqno         The sequence number of the EOF packet
  * @return              Non-zero on success
  */
 static int
-mysql_send_eof(DCB *dcb, int seqno)
+mysql_send_eof(RESULTSET_WRITER *writer, int seqno)
 {
-    GWBUF   *pkt;
     uint8_t *ptr;
 
-    if ((pkt = gwbuf_alloc(9)) == NULL)
+    if ((ptr = writer_reserve(writer, 9)) == NULL)
     {
         return 0;
     }
-    ptr = GWBUF_DATA(pkt);
     *ptr++ = 0x05;
     *ptr++ = 0x00;
     *ptr++ = 0x00;
@@ -378,41 +539,93 @@ mysql_send_eof(DCB *dcb, int seqno)
     *ptr++ = 0x00;
     *ptr++ = 0x02;                          // Autocommit enabled
     *ptr++ = 0x00;
-    return dcb->func.write(dcb, pkt);
+    return 1;
+}
+
+/**
+ * The length of the length-encoded integer that precedes a value
+ *
+ * @param len           The length of the value
+ * @return              The number of bytes needed to encode @c len
+ */
+static size_t
+mysql_lenenc_size(size_t len)
+{
+    return len < 251 ? 1 : len < 0x10000 ? 3 : len < 0x1000000 ? 4 : 9;
 }
 
+/**
+ * Encode the length of a value as a length-encoded integer
+ *
+ * @param ptr           Where to encode the length
+ * @param len           The length of the value
+ * @return              Pointer to the byte after the length
+ */
+static uint8_t *
+mysql_lenenc_write(uint8_t *ptr, size_t len)
+{
+    int n;
 
+    if (len < 251)
+    {
+        *ptr++ = len;
+        return ptr;
+    }
+    else if (len < 0x10000)
+    {
+        *ptr++ = 0xfc;
+        n = 2;
+    }
+    else if (len < 0x1000000)
+    {
+        *ptr++ = 0xfd;
+        n = 3;
+    }
+    else
+    {
+        *ptr++ = 0xfe;
+        n = 8;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        *ptr++ = (len >> (8 * i)) & 0xff;
+    }
+    return ptr;
+}
 
 /**
  * Send a row packet in a response packet sequence.
  *
- * @param dcb           The client connection
+ * @param writer        The output of the result set
  * @param row           The row to send
  * @param seqno         The sequence number of the EOF packet
  * @return              Non-zero on success
  */
 static int
-mysql_send_row(DCB *dcb, RESULT_ROW *row, int seqno)
+mysql_send_row(RESULTSET_WRITER *writer, RESULT_ROW *row, int seqno)
 {
-    GWBUF *pkt;
-    int i, len = 4;
+    int i;
+    size_t len = 0;
     uint8_t *ptr;
 
     for (i = 0; i < row->n_cols; i++)
     {
         if (row->cols[i])
         {
-            len += strlen(row->cols[i]);
+            size_t vlen = strlen(row->cols[i]);
+            len += mysql_lenenc_size(vlen) + vlen;
+        }
+        else
+        {
+            len++;
         }
-        len++;
     }
 
-    if ((pkt = gwbuf_alloc(len)) == NULL)
+    if ((ptr = writer_reserve(writer, len + 4)) == NULL)
     {
         return 0;
     }
-    ptr = GWBUF_DATA(pkt);
-    len -= 4;
     *ptr++ = len & 0xff;
     *ptr++ = (len >> 8) & 0xff;
     *ptr++ = (len >> 16) & 0xff;
@@ -422,8 +635,8 @@ mysql_send_row(DCB *dcb, RESULT_ROW *row, int seqno)
         if (row->cols[i])
         {
             len = strlen(row->cols[i]);
-            *ptr++ = len;
-            strncpy((char *)ptr, row->cols[i], len);
+            ptr = mysql_lenenc_write(ptr, len);
+            memcpy(ptr, row->cols[i], len);
             ptr += len;
         }
         else
@@ -432,7 +645,7 @@ mysql_send_row(DCB *dcb, RESULT_ROW *row, int seqno)
         }
     }
 
-    return dcb->func.write(dcb, pkt);
+    return 1;
 }
 
 /**
@@ -465,7 +678,8 @@ value_is_numeric(char *value)
 /**
  * Stream a result set encoding it as a JSON object
  * Each row is retrieved by calling the function passed in the
- * argument list.
+ * argument list. The text is collected into large buffers that are
+ * written to the connection as they fill up.
  *
  * @param set   The result set to stream
  * @param dcb   The connection to stream the result set to
@@ -473,47 +687,50 @@ value_is_numeric(char *value)
 void
 resultset_stream_json(RESULTSET *set, DCB *dcb)
 {
+    RESULTSET_WRITER writer;
     RESULT_COLUMN *col;
     RESULT_ROW *row;
     int rowno = 0;
 
-    dcb_printf(dcb, "[ ");
+    writer_init(&writer, dcb);
+    writer_printf(&writer, "[ ");
     while ((row = (*set->fetchrow)(set, set->userdata)) != NULL)
     {
         int i = 0;
         if (rowno++ > 0)
         {
-            dcb_printf(dcb, ",\n");
+            writer_printf(&writer, ",\n");
         }
-        dcb_printf(dcb, "{ ");
+        writer_printf(&writer, "{ ");
         col = set->column;
         while (col)
         {
-            dcb_printf(dcb, "\"%s\" : ", col->name);
+            writer_printf(&writer, "\"%s\" : ", col->name);
             if (row->cols[i])
             {
                 if (value_is_numeric(row->cols[i]))
                 {
-                    dcb_printf(dcb, "%s", row->cols[i]);
+                    writer_printf(&writer, "%s", row->cols[i]);
                 }
                 else
                 {
-                    dcb_printf(dcb, "\"%s\"", row->cols[i]);
+                    writer_printf(&writer, "\"%s\"", row->cols[i]);
                 }
             }
             else
             {
-                dcb_printf(dcb, "null");
+                writer_printf(&writer, "null");
             }
             i++;
             col = col->next;
             if (col)
             {
-                dcb_printf(dcb, ", ");
+                writer_printf(&writer, ", ");
             }
         }
         resultset_free_row(row);
-        dcb_printf(dcb, "}");
+        writer_printf(&writer, "}");
     }
-    dcb_printf(dcb, "]\n");
+    writer_printf(&writer, "]\n");
+    writer_flush(&writer);
 }
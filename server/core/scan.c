@@ -0,0 +1,308 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file scan.c Byte scanning primitives
+ *
+ * The vector implementations are compiled with function specific target
+ * attributes so that the rest of MaxScale does not need to be built for a
+ * particular processor. The implementation is chosen at startup from what
+ * the processor supports.
+ */
+
+#include <scan.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define SCAN_HAVE_SIMD 1
+#include <immintrin.h>
+#endif
+
+typedef const char *(*scan_fn)(const char *ptr, const char *end, const char *set, int n_set);
+
+/** A set of bytes as a bitmap */
+typedef struct
+{
+    uint64_t bits[4];
+} byte_set_t;
+
+static inline void byte_set_init(byte_set_t *bs, const char *set, int n_set)
+{
+    memset(bs, 0, sizeof(*bs));
+
+    for (int i = 0; i < n_set; i++)
+    {
+        uint8_t c = set[i];
+        bs->bits[c >> 6] |= 1ULL << (c & 63);
+    }
+}
+
+static inline bool byte_set_has(const byte_set_t *bs, char ch)
+{
+    uint8_t c = ch;
+    return (bs->bits[c >> 6] >> (c & 63)) & 1;
+}
+
+static const char *find_any_scalar(const char *ptr, const char *end, const char *set, int n_set)
+{
+    byte_set_t bs;
+    byte_set_init(&bs, set, n_set);
+
+    while (ptr < end && !byte_set_has(&bs, *ptr))
+    {
+        ptr++;
+    }
+
+    return ptr < end ? ptr : end;
+}
+
+static const char *skip_any_scalar(const char *ptr, const char *end, const char *set, int n_set)
+{
+    byte_set_t bs;
+    byte_set_init(&bs, set, n_set);
+
+    while (ptr < end && byte_set_has(&bs, *ptr))
+    {
+        ptr++;
+    }
+
+    return ptr < end ? ptr : end;
+}
+
+#if defined(SCAN_HAVE_SIMD)
+
+__attribute__((target("sse4.2")))
+static inline const char *scan_sse42(const char *ptr, const char *end, const char *set, int n_set,
+                                     bool negate)
+{
+    char buf[SCAN_MAX_SET] = {0};
+    memcpy(buf, set, n_set);
+    __m128i needles = _mm_loadu_si128((const __m128i*)buf);
+
+    while (end - ptr >= 16)
+    {
+        __m128i data = _mm_loadu_si128((const __m128i*)ptr);
+        int idx = negate ?
+                  _mm_cmpestri(needles, n_set, data, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY |
+                               _SIDD_NEGATIVE_POLARITY | _SIDD_LEAST_SIGNIFICANT) :
+                  _mm_cmpestri(needles, n_set, data, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY |
+                               _SIDD_LEAST_SIGNIFICANT);
+
+        if (idx < 16)
+        {
+            return ptr + idx;
+        }
+
+        ptr += 16;
+    }
+
+    return negate ? skip_any_scalar(ptr, end, set, n_set) : find_any_scalar(ptr, end, set, n_set);
+}
+
+__attribute__((target("sse4.2")))
+static const char *find_any_sse42(const char *ptr, const char *end, const char *set, int n_set)
+{
+    return scan_sse42(ptr, end, set, n_set, false);
+}
+
+__attribute__((target("sse4.2")))
+static const char *skip_any_sse42(const char *ptr, const char *end, const char *set, int n_set)
+{
+    return scan_sse42(ptr, end, set, n_set, true);
+}
+
+__attribute__((target("avx2")))
+static inline const char *scan_avx2(const char *ptr, const char *end, const char *set, int n_set,
+                                    bool negate)
+{
+    __m256i needles[SCAN_MAX_SET];
+
+    for (int i = 0; i < n_set; i++)
+    {
+        needles[i] = _mm256_set1_epi8(set[i]);
+    }
+
+    while (end - ptr >= 32)
+    {
+        __m256i data = _mm256_loadu_si256((const __m256i*)ptr);
+        __m256i match = _mm256_cmpeq_epi8(data, needles[0]);
+
+        for (int i = 1; i < n_set; i++)
+        {
+            match = _mm256_or_si256(match, _mm256_cmpeq_epi8(data, needles[i]));
+        }
+
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(match);
+
+        if (negate)
+        {
+            mask = ~mask;
+        }
+
+        if (mask)
+        {
+            return ptr + __builtin_ctz(mask);
+        }
+
+        ptr += 32;
+    }
+
+    return negate ? skip_any_scalar(ptr, end, set, n_set) : find_any_scalar(ptr, end, set, n_set);
+}
+
+__attribute__((target("avx2")))
+static const char *find_any_avx2(const char *ptr, const char *end, const char *set, int n_set)
+{
+    return scan_avx2(ptr, end, set, n_set, false);
+}
+
+__attribute__((target("avx2")))
+static const char *skip_any_avx2(const char *ptr, const char *end, const char *set, int n_set)
+{
+    return scan_avx2(ptr, end, set, n_set, true);
+}
+
+#endif
+
+static scan_impl_t scan_impl = SCAN_IMPL_SCALAR;
+static scan_fn find_any_impl = find_any_scalar;
+static scan_fn skip_any_impl = skip_any_scalar;
+
+/**
+ * Check whether the processor supports an implementation
+ *
+ * @param impl The implementation
+ * @return True if it can be used
+ */
+static bool scan_impl_supported(scan_impl_t impl)
+{
+    switch (impl)
+    {
+    case SCAN_IMPL_SCALAR:
+        return true;
+#if defined(SCAN_HAVE_SIMD)
+    case SCAN_IMPL_SSE42:
+        return __builtin_cpu_supports("sse4.2");
+    case SCAN_IMPL_AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+/**
+ * Choose the implementation of the primitives. This is done at startup and
+ * by the tests, it must not be called while the primitives are in use.
+ *
+ * @param impl The implementation to use
+ * @return True if the processor supports the implementation
+ */
+bool scan_set_impl(scan_impl_t impl)
+{
+    if (!scan_impl_supported(impl))
+    {
+        return false;
+    }
+
+    scan_impl = impl;
+
+    switch (impl)
+    {
+#if defined(SCAN_HAVE_SIMD)
+    case SCAN_IMPL_SSE42:
+        find_any_impl = find_any_sse42;
+        skip_any_impl = skip_any_sse42;
+        break;
+    case SCAN_IMPL_AVX2:
+        find_any_impl = find_any_avx2;
+        skip_any_impl = skip_any_avx2;
+        break;
+#endif
+    default:
+        find_any_impl = find_any_scalar;
+        skip_any_impl = skip_any_scalar;
+        break;
+    }
+
+    return true;
+}
+
+/** Choose the best implementation the processor supports */
+__attribute__((constructor))
+static void scan_init(void)
+{
+#if defined(SCAN_HAVE_SIMD)
+    __builtin_cpu_init();
+#endif
+
+    if (!scan_set_impl(SCAN_IMPL_AVX2))
+    {
+        scan_set_impl(SCAN_IMPL_SSE42);
+    }
+}
+
+/**
+ * @return The implementation in use
+ */
+scan_impl_t scan_get_impl(void)
+{
+    return scan_impl;
+}
+
+/**
+ * @param impl An implementation
+ * @return The name of the implementation
+ */
+const char *scan_impl_name(scan_impl_t impl)
+{
+    switch (impl)
+    {
+    case SCAN_IMPL_SSE42:
+        return "SSE4.2";
+    case SCAN_IMPL_AVX2:
+        return "AVX2";
+    default:
+        return "scalar";
+    }
+}
+
+/**
+ * Find the first byte that is in a set
+ *
+ * @param ptr   Start of the range
+ * @param end   End of the range
+ * @param set   The bytes to look for
+ * @param n_set Number of bytes in the set, from 1 to SCAN_MAX_SET
+ * @return The first byte of the range that is in the set or @c end if there is none
+ */
+const char *scan_find_any(const char *ptr, const char *end, const char *set, int n_set)
+{
+    return ptr < end ? find_any_impl(ptr, end, set, n_set) : end;
+}
+
+/**
+ * Find the first byte that is not in a set
+ *
+ * @param ptr   Start of the range
+ * @param end   End of the range
+ * @param set   The bytes to skip
+ * @param n_set Number of bytes in the set, from 1 to SCAN_MAX_SET
+ * @return The first byte of the range that is not in the set or @c end if there is none
+ */
+const char *scan_skip_any(const char *ptr, const char *end, const char *set, int n_set)
+{
+    return ptr < end ? skip_any_impl(ptr, end, set, n_set) : end;
+}
@@ -43,12 +43,30 @@
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <gw_ssl.h>
+#include <gw.h>
+#include <hk_heartbeat.h>
+#include <atomic.h>
+#include <platform.h>
 
 /** The latin1 charset */
 #define SERVER_DEFAULT_CHARSET 0x08
 
+/** How long a resolved server address is used, in heartbeats */
+#define SERVER_ADDRESS_TTL 600
+
 static SPINLOCK server_spin = SPINLOCK_INIT;
 static SERVER *allServers = NULL;
+/** The topology index of the next server, protected by server_spin */
+static int next_topology_index = 0;
+
+/** Protects the published topology */
+static SPINLOCK topology_lock = SPINLOCK_INIT;
+/** The latest published topology */
+static SERVER_TOPOLOGY topology = {0, 0, 0, NULL};
+/** The version of the published topology, read without the lock */
+static int topology_version = 0;
+/** The copy of the topology of this thread */
+static thread_local SERVER_TOPOLOGY local_topology = {0, 0, 0, NULL};
 
 static void spin_reporter(void *, char *, int);
 static void server_parameter_free(SERVER_PARAM *tofree);
@@ -72,6 +90,13 @@ server_alloc(char *servname, char *protocol, unsigned short port)
     {
         return NULL;
     }
+    if ((server->stats.n_connections = ts_stats_alloc()) == NULL ||
+        (server->stats.n_current_ops = ts_stats_alloc()) == NULL)
+    {
+        ts_stats_free(server->stats.n_connections);
+        free(server);
+        return NULL;
+    }
 #if defined(SS_DEBUG)
     server->server_chk_top = CHK_NUM_SERVER;
     server->server_chk_tail = CHK_NUM_SERVER;
@@ -82,20 +107,37 @@ server_alloc(char *servname, char *protocol, unsigned short port)
     server->status = SERVER_RUNNING;
     server->node_id = -1;
     server->rlag = -2;
+    server->rlag_ms = -1;
+    server->load_weight = SERVER_FULL_LOAD_WEIGHT;
+    server->rlag_jitter_ms = 0;
+    server->rlag_sample_ms = -1;
     server->master_id = -1;
     server->depth = -1;
     server->parameters = NULL;
     server->server_string = NULL;
     spinlock_init(&server->lock);
-    server->persistent = NULL;
+    spinlock_set_name(&server->lock, "server lock");
+    server->dcbs = NULL;
     server->persistmax = 0;
     server->persistmaxtime = 0;
     server->persistpoolmax = 0;
+    server->persistpoolmin = 0;
+    server->connect_timeout = 0;
+    server->compression = false;
+    server->address_time = 0;
     server->slave_configured = false;
     server->charset = SERVER_DEFAULT_CHARSET;
-    spinlock_init(&server->persistlock);
+    for (int i = 0; i < SERVER_POOL_SHARDS; i++)
+    {
+        spinlock_init(&server->pool[i].lock);
+        spinlock_set_name(&server->pool[i].lock, "persistlock");
+        server->pool[i].persistent = NULL;
+    }
+    spinlock_init(&server->dcbs_lock);
+    spinlock_set_name(&server->dcbs_lock, "dcbs_lock");
 
     spinlock_acquire(&server_spin);
+    server->topology_index = next_topology_index++;
     server->next = allServers;
     allServers = server;
     spinlock_release(&server_spin);
@@ -142,79 +184,169 @@ server_free(SERVER *tofreeserver)
     free(tofreeserver->server_string);
     server_parameter_free(tofreeserver->parameters);
 
-    if (tofreeserver->persistent)
+    if (tofreeserver->stats.n_persistent)
     {
-        dcb_persistent_clean_count(tofreeserver->persistent, true);
+        dcb_persistent_clean_count(tofreeserver, true);
     }
+    ts_stats_free(tofreeserver->stats.n_connections);
+    ts_stats_free(tofreeserver->stats.n_current_ops);
     free(tofreeserver);
     return 1;
 }
 
 /**
- * Get a DCB from the persistent connection pool, if possible
+ * Get the shard of the persistent connection pool of a polling thread
  *
- * @param       server      The server to set the name on
+ * @param       server      The server
+ * @param       owner       The thread that owns the connections, -1 for the
+ *                          calling thread
+ * @return      The shard of the thread
+ */
+SERVER_POOL_SHARD *
+server_pool_shard(SERVER *server, int owner)
+{
+    if (owner < 0)
+    {
+        owner = poll_current_thread();
+    }
+
+    return &server->pool[owner < 0 ? 0 : owner % SERVER_POOL_SHARDS];
+}
+
+/**
+ * Take a matching DCB from a shard of the persistent connection pool
+ *
+ * @param       server      The server
+ * @param       shard       The shard to search
  * @param       user        The name of the user needing the connection
  * @param       protocol    The name of the protocol needed for the connection
+ * @param       owner       The thread that must own the DCB, -1 for any thread
+ * @return      The DCB or NULL if the shard has no matching DCB
  */
-DCB *
-server_get_persistent(SERVER *server, char *user, const char *protocol)
+static DCB *
+server_take_persistent(SERVER *server, SERVER_POOL_SHARD *shard, char *user,
+                       const char *protocol, int owner)
 {
     DCB *dcb, *previous = NULL;
+    time_t now = time(NULL);
 
-    if (server->persistent
-        && dcb_persistent_clean_count(server->persistent, false)
-        && server->persistent
-        && (server->status & SERVER_RUNNING))
+    spinlock_acquire(&shard->lock);
+    dcb = shard->persistent;
+    while (dcb)
     {
-        spinlock_acquire(&server->persistlock);
-        dcb = server->persistent;
-        while (dcb)
+        if (dcb->user
+            && dcb->protoname
+            && !dcb-> dcb_errhandle_called
+            && !(dcb->flags & DCBF_HUNG)
+            && (owner < 0 || dcb->owner == owner)
+            && now - dcb->persistentstart <= server->persistmaxtime
+            && 0 == strcmp(dcb->user, user)
+            && 0 == strcmp(dcb->protoname, protocol))
         {
-            if (dcb->user
-                && dcb->protoname
-                && !dcb-> dcb_errhandle_called
-                && !(dcb->flags & DCBF_HUNG)
-                && 0 == strcmp(dcb->user, user)
-                && 0 == strcmp(dcb->protoname, protocol))
+            if (NULL == previous)
             {
-                if (NULL == previous)
-                {
-                    server->persistent = dcb->nextpersistent;
-                }
-                else
-                {
-                    previous->nextpersistent = dcb->nextpersistent;
-                }
-                free(dcb->user);
-                dcb->user = NULL;
-                spinlock_release(&server->persistlock);
-                atomic_add(&server->stats.n_persistent, -1);
-                atomic_add(&server->stats.n_current, 1);
-                return dcb;
+                shard->persistent = dcb->nextpersistent;
             }
             else
             {
-                MXS_DEBUG("%lu [server_get_persistent] Rejected dcb "
-                          "%p from pool, user %s looking for %s, protocol %s "
-                          "looking for %s, hung flag %s, error handle called %s.",
-                          pthread_self(),
-                          dcb,
-                          dcb->user ? dcb->user : "NULL",
-                          user,
-                          dcb->protoname ? dcb->protoname : "NULL",
-                          protocol,
-                          (dcb->flags & DCBF_HUNG) ? "true" : "false",
-                          dcb-> dcb_errhandle_called ? "true" : "false");
+                previous->nextpersistent = dcb->nextpersistent;
             }
-            previous = dcb;
-            dcb = dcb->nextpersistent;
+            free(dcb->user);
+            dcb->user = NULL;
+            spinlock_release(&shard->lock);
+            atomic_add(&server->stats.n_persistent, -1);
+            atomic_add(&server->stats.n_current, 1);
+            return dcb;
+        }
+        else
+        {
+            MXS_DEBUG("%lu [server_get_persistent] Rejected dcb "
+                      "%p from pool, user %s looking for %s, protocol %s "
+                      "looking for %s, hung flag %s, error handle called %s.",
+                      pthread_self(),
+                      dcb,
+                      dcb->user ? dcb->user : "NULL",
+                      user,
+                      dcb->protoname ? dcb->protoname : "NULL",
+                      protocol,
+                      (dcb->flags & DCBF_HUNG) ? "true" : "false",
+                      dcb-> dcb_errhandle_called ? "true" : "false");
         }
-        spinlock_release(&server->persistlock);
+        previous = dcb;
+        dcb = dcb->nextpersistent;
     }
+    spinlock_release(&shard->lock);
     return NULL;
 }
 
+/**
+ * Get a DCB from the persistent connection pool, if possible
+ *
+ * The shard of the owning thread is searched first. If the DCB may be owned
+ * by any thread, the DCBs of the other shards are taken when that shard has
+ * none. Expired and broken DCBs are skipped, server_persistent_expire
+ * removes them from the pool.
+ *
+ * @param       server      The server to set the name on
+ * @param       user        The name of the user needing the connection
+ * @param       protocol    The name of the protocol needed for the connection
+ * @param       owner       The thread that must own the DCB, -1 for any thread
+ */
+DCB *
+server_get_persistent(SERVER *server, char *user, const char *protocol, int owner)
+{
+    DCB *dcb = NULL;
+
+    if (server->stats.n_persistent > 0 && (server->status & SERVER_RUNNING))
+    {
+        SERVER_POOL_SHARD *first = server_pool_shard(server, owner);
+
+        dcb = server_take_persistent(server, first, user, protocol, owner);
+
+        /** In the per thread poll mode the other shards hold the DCBs of other threads */
+        for (int i = 1; dcb == NULL && owner < 0 && i < SERVER_POOL_SHARDS &&
+             server->stats.n_persistent > 0; i++)
+        {
+            SERVER_POOL_SHARD *shard = &server->pool[(first - server->pool + i) % SERVER_POOL_SHARDS];
+
+            if (shard->persistent)
+            {
+                dcb = server_take_persistent(server, shard, user, protocol, owner);
+            }
+        }
+    }
+
+    return dcb;
+}
+
+/**
+ * Housekeeper task that removes the expired and broken connections from the
+ * persistent connection pools of all servers
+ *
+ * @param       data        Not used
+ */
+void
+server_persistent_expire(void *data)
+{
+    SERVER *server;
+
+    spinlock_acquire(&server_spin);
+    server = allServers;
+    spinlock_release(&server_spin);
+
+    while (server)
+    {
+        if (server->stats.n_persistent > 0)
+        {
+            dcb_persistent_clean_count(server, false);
+        }
+
+        spinlock_acquire(&server_spin);
+        server = server->next;
+        spinlock_release(&server_spin);
+    }
+}
+
 /**
  * Set a unique name for the server
  *
@@ -292,7 +424,7 @@ printServer(SERVER *server)
     printf("\tServer:                       %s\n", server->name);
     printf("\tProtocol:             %s\n", server->protocol);
     printf("\tPort:                 %d\n", server->port);
-    printf("\tTotal connections:    %d\n", server->stats.n_connections);
+    printf("\tTotal connections:    %" PRId64 "\n", ts_stats_sum(server->stats.n_connections));
     printf("\tCurrent connections:  %d\n", server->stats.n_current);
     printf("\tPersistent connections:       %d\n", server->stats.n_persistent);
     printf("\tPersistent actual max:        %d\n", server->persistmax);
@@ -409,17 +541,22 @@ dprintAllServersJson(DCB *dcb)
             {
                 dcb_printf(dcb, "    \"slaveDelay\": \"%d\",\n", server->rlag);
             }
+            if (server->rlag_ms >= 0)
+            {
+                dcb_printf(dcb, "    \"slaveDelayMs\": \"%d\",\n", server->rlag_ms);
+                dcb_printf(dcb, "    \"slaveDelayJitterMs\": \"%d\",\n", server->rlag_jitter_ms);
+            }
         }
         if (server->node_ts > 0)
         {
             dcb_printf(dcb, "    \"lastReplHeartbeat\": \"%lu\",\n", server->node_ts);
         }
-        dcb_printf(dcb, "    \"totalConnections\": \"%d\",\n",
-                   server->stats.n_connections);
+        dcb_printf(dcb, "    \"totalConnections\": \"%" PRId64 "\",\n",
+                   ts_stats_sum(server->stats.n_connections));
         dcb_printf(dcb, "    \"currentConnections\": \"%d\",\n",
                    server->stats.n_current);
-        dcb_printf(dcb, "    \"currentOps\": \"%d\"\n",
-                   server->stats.n_current_ops);
+        dcb_printf(dcb, "    \"currentOps\": \"%" PRId64 "\"\n",
+                   ts_stats_sum(server->stats.n_current_ops));
         if (el < len)
         {
             dcb_printf(dcb, "  },\n");
@@ -475,6 +612,11 @@ dprintServer(DCB *dcb, SERVER *server)
         }
         dcb_printf(dcb, "\n");
     }
+    if (server->load_weight != SERVER_FULL_LOAD_WEIGHT)
+    {
+        dcb_printf(dcb, "\tLoad weight:                         %.1f%%\n",
+                   (float)server->load_weight / 10);
+    }
     dcb_printf(dcb, "\tRepl Depth:                          %d\n", server->depth);
     if (SERVER_IS_SLAVE(server) || SERVER_IS_RELAY_SERVER(server))
     {
@@ -482,6 +624,11 @@ dprintServer(DCB *dcb, SERVER *server)
         {
             dcb_printf(dcb, "\tSlave delay:                         %d\n", server->rlag);
         }
+        if (server->rlag_ms >= 0)
+        {
+            dcb_printf(dcb, "\tSlave delay (ms):                    %d +/- %d\n",
+                       server->rlag_ms, server->rlag_jitter_ms);
+        }
     }
     if (server->node_ts > 0)
     {
@@ -500,17 +647,35 @@ dprintServer(DCB *dcb, SERVER *server)
             param = param->next;
         }
     }
-    dcb_printf(dcb, "\tNumber of connections:               %d\n", server->stats.n_connections);
+    dcb_printf(dcb, "\tNumber of connections:               %" PRId64 "\n",
+               ts_stats_sum(server->stats.n_connections));
     dcb_printf(dcb, "\tCurrent no. of conns:                %d\n", server->stats.n_current);
-    dcb_printf(dcb, "\tCurrent no. of operations:           %d\n", server->stats.n_current_ops);
+    dcb_printf(dcb, "\tCurrent no. of operations:           %" PRId64 "\n",
+               ts_stats_sum(server->stats.n_current_ops));
     if (server->persistpoolmax)
     {
         dcb_printf(dcb, "\tPersistent pool size:                %d\n", server->stats.n_persistent);
         dcb_printf(dcb, "\tPersistent measured pool size:       %d\n",
-                   dcb_persistent_clean_count(server->persistent, false));
+                   dcb_persistent_clean_count(server, false));
         dcb_printf(dcb, "\tPersistent actual size max:          %d\n", server->persistmax);
         dcb_printf(dcb, "\tPersistent pool size limit:          %ld\n", server->persistpoolmax);
         dcb_printf(dcb, "\tPersistent max time (secs):          %ld\n", server->persistmaxtime);
+        if (server->persistpoolmin)
+        {
+            dcb_printf(dcb, "\tPersistent pool size minimum:        %ld\n", server->persistpoolmin);
+        }
+        uint64_t hits = server->stats.n_pool_hits;
+        uint64_t total = hits + server->stats.n_pool_misses;
+        dcb_printf(dcb, "\tPersistent pool hits/misses:         %" PRIu64 "/%" PRIu64 " (%.1f%% hits)\n",
+                   hits, total - hits, total ? hits * 100.0 / total : 0.0);
+    }
+    if (server->connect_timeout)
+    {
+        dcb_printf(dcb, "\tConnect timeout (secs):              %ld\n", server->connect_timeout);
+    }
+    if (server->compression)
+    {
+        dcb_printf(dcb, "\tCompressed protocol:                 requested\n");
     }
     if (server->server_ssl)
     {
@@ -526,6 +691,10 @@ dprintServer(DCB *dcb, SERVER *server)
                    l->ssl_key ? l->ssl_key : "null");
         dcb_printf(dcb, "\tSSL CA certificate:                  %s\n",
                    l->ssl_ca_cert ? l->ssl_ca_cert : "null");
+        dcb_printf(dcb, "\tSSL sessions resumed:                %d of %d\n",
+                   l->n_resumed, l->n_resumed + l->n_full_handshakes);
+        dcb_printf(dcb, "\tKernel TLS:                          %s\n",
+                   l->ssl_ktls ? "requested" : "no");
     }
 }
 
@@ -553,18 +722,21 @@ dprintPersistentDCBs(DCB *pdcb, SERVER *server)
 {
     DCB *dcb;
 
-    spinlock_acquire(&server->persistlock);
+    for (int i = 0; i < SERVER_POOL_SHARDS; i++)
+    {
+        spinlock_acquire(&server->pool[i].lock);
 #if SPINLOCK_PROFILE
-    dcb_printf(pdcb, "DCB List Spinlock Statistics:\n");
-    spinlock_stats(&server->persistlock, spin_reporter, pdcb);
+        dcb_printf(pdcb, "DCB List Spinlock Statistics:\n");
+        spinlock_stats(&server->pool[i].lock, spin_reporter, pdcb);
 #endif
-    dcb = server->persistent;
-    while (dcb)
-    {
-        dprintOneDCB(pdcb, dcb);
-        dcb = dcb->nextpersistent;
+        dcb = server->pool[i].persistent;
+        while (dcb)
+        {
+            dprintOneDCB(pdcb, dcb);
+            dcb = dcb->nextpersistent;
+        }
+        spinlock_release(&server->pool[i].lock);
     }
-    spinlock_release(&server->persistlock);
 }
 
 /**
@@ -955,10 +1127,59 @@ server_update_address(SERVER *server, char *address)
             free(server->name);
         }
         server->name = strdup(address);
+        server->address_time = 0;
     }
     spinlock_release(&server_spin);
 }
 
+/**
+ * Get the network address of a server
+ *
+ * The name of the server is resolved only when the address is first needed
+ * or when the previously resolved address is older than SERVER_ADDRESS_TTL
+ * heartbeats. This keeps name resolution out of the way of the connections
+ * that are created for new sessions.
+ *
+ * @param server        The server
+ * @param addr          The address is stored here
+ * @return True if the address is known, false if the name could not be resolved
+ */
+bool
+server_get_address(SERVER *server, struct in_addr *addr)
+{
+    bool rval = true;
+
+    spinlock_acquire(&server->lock);
+    long resolved = server->address_time;
+    *addr = server->address;
+    spinlock_release(&server->lock);
+
+    if (resolved == 0 || hkheartbeat - resolved > SERVER_ADDRESS_TTL)
+    {
+        struct in_addr new_addr;
+
+        spinlock_acquire(&server_spin);
+        char *name = strdup(server->name);
+        spinlock_release(&server_spin);
+
+        if (name && setipaddress(&new_addr, name))
+        {
+            spinlock_acquire(&server->lock);
+            server->address = new_addr;
+            server->address_time = hkheartbeat ? hkheartbeat : 1;
+            spinlock_release(&server->lock);
+            *addr = new_addr;
+        }
+        else if (resolved == 0)
+        {
+            rval = false;
+        }
+        free(name);
+    }
+
+    return rval;
+}
+
 /*
  * Update the port value of a specific server
  *
@@ -1035,3 +1256,128 @@ bool server_set_version_string(SERVER* server, const char* string)
     spinlock_release(&server->lock);
     return rval;
 }
+
+/**
+ * Report an unexpected failure of a connection to a server. The monitor of
+ * the server uses the reports to check the server sooner than it would
+ * otherwise.
+ *
+ * @param server The server
+ */
+void
+server_report_failure(SERVER *server)
+{
+    atomic_add(&server->failure_reports, 1);
+}
+
+/**
+ * Return the number of failure reports since the last call and clear them
+ *
+ * @param server The server
+ * @return The number of failed connections reported
+ */
+int
+server_take_failure_reports(SERVER *server)
+{
+    int n = server->failure_reports;
+
+    if (n > 0)
+    {
+        atomic_add(&server->failure_reports, -n);
+    }
+
+    return n;
+}
+
+/**
+ * Publish a new topology snapshot if the state of a server has changed since
+ * the last one. The monitors call this at the end of each monitoring round so
+ * that the routers only ever see the complete result of a round and not the
+ * intermediate states a monitor goes through while it probes the servers.
+ */
+void
+server_publish_topology()
+{
+    SERVER_STATE *states;
+    int n_states;
+
+    spinlock_acquire(&server_spin);
+    n_states = next_topology_index;
+
+    if ((states = calloc(n_states ? n_states : 1, sizeof(SERVER_STATE))) == NULL)
+    {
+        spinlock_release(&server_spin);
+        return;
+    }
+
+    for (SERVER *server = allServers; server; server = server->next)
+    {
+        SERVER_STATE *state = &states[server->topology_index];
+        state->server = server;
+        state->status = server->status;
+        state->depth = server->depth;
+        state->rlag = server->rlag;
+        state->node_ts = server->node_ts;
+    }
+    spinlock_release(&server_spin);
+
+    spinlock_acquire(&topology_lock);
+
+    if (topology.version != 0 && topology.n_states == n_states &&
+        memcmp(topology.states, states, n_states * sizeof(SERVER_STATE)) == 0)
+    {
+        free(states);
+    }
+    else
+    {
+        free(topology.states);
+        topology.states = states;
+        topology.n_states = n_states;
+        topology.capacity = n_states;
+        topology.version++;
+        topology_version = topology.version;
+    }
+
+    spinlock_release(&topology_lock);
+}
+
+/**
+ * Get the latest topology snapshot. The snapshot is a copy private to the
+ * calling thread which is only refreshed when a new version has been
+ * published. It stays valid until the next call from the same thread.
+ *
+ * Before the first snapshot is published, the returned topology has no
+ * servers and the live state in the SERVER structures must be used.
+ *
+ * @return The topology as seen by this thread
+ */
+const SERVER_TOPOLOGY *
+server_get_topology()
+{
+    if (local_topology.version != topology_version)
+    {
+        spinlock_acquire(&topology_lock);
+
+        if (local_topology.capacity < topology.n_states)
+        {
+            SERVER_STATE *states = realloc(local_topology.states,
+                                           topology.n_states * sizeof(SERVER_STATE));
+            if (states == NULL)
+            {
+                /** Keep using the old copy, a later call tries again */
+                spinlock_release(&topology_lock);
+                return &local_topology;
+            }
+            local_topology.states = states;
+            local_topology.capacity = topology.n_states;
+        }
+
+        memcpy(local_topology.states, topology.states, topology.n_states * sizeof(SERVER_STATE));
+        local_topology.n_states = topology.n_states;
+        local_topology.version = topology.version;
+
+        spinlock_release(&topology_lock);
+    }
+
+    return &local_topology;
+}
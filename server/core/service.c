@@ -34,6 +34,7 @@
  * 03/03/15     Massimiliano Pinto      Added config_enable_feedback_task() call in serviceStartAll
  * 19/06/15     Martin Brampton         More meaningful names for temp variables
  * 31/05/16     Martin Brampton         Implement connection throttling
+ * 14/10/16                             Priority classes and timeouts of queued connections
  *
  * @endverbatim
  */
@@ -66,6 +67,9 @@
 #include <math.h>
 #include <version.h>
 #include <queuemanager.h>
+#include <thread.h>
+#include <pthread.h>
+#include <mysql.h>
 
 /** To be used with configuration type checks */
 typedef struct typelib_st
@@ -91,11 +95,39 @@ typelib_t sqlvar_target_type =
 static SPINLOCK service_spin = SPINLOCK_INIT;
 static SERVICE  *allServices = NULL;
 
+/** The thread that reloads users in the background and what it waits on */
+static THREAD          users_loader_thr;
+static pthread_once_t  users_loader_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t users_loader_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  users_loader_cond = PTHREAD_COND_INITIALIZER;
+static bool            users_loader_wakeup = false;
+static bool            users_loader_running = false;
+
+struct users_reload_waiter
+{
+    SPINLOCK                   lock;      /*< Protects done and cancelled */
+    DCB                        *dcb;      /*< The client DCB whose login waits */
+    bool                       done;      /*< The reload has finished */
+    bool                       cancelled; /*< The client DCB was closed */
+    struct users_reload_waiter *next;     /*< Next login waiting for the same reload */
+};
+
+/** The services that are still to be started by the service start threads */
+typedef struct
+{
+    SPINLOCK lock;      /*< Protects the fields below */
+    SERVICE  *next;     /*< The next service to start */
+    int      listeners; /*< Number of listeners started */
+    bool     error;     /*< A service failed to start */
+} SERVICE_STARTER;
+
 static int find_type(typelib_t* tl, const char* needle, int maxlen);
 
 static void service_add_qualified_param(SERVICE*          svc,
                                         CONFIG_PARAMETER* param);
 static void service_internal_restart(void *data);
+static void service_save_users(SERVICE *service);
+static void service_register_queue_metrics(SERVICE *service);
 
 /**
  * Allocate a new service for the gateway to support
@@ -115,6 +147,11 @@ service_alloc(const char *servname, const char *router)
     {
         return NULL;
     }
+    if ((service->stats.n_sessions = ts_stats_alloc()) == NULL)
+    {
+        free(service);
+        return NULL;
+    }
     if ((service->router = load_module(router, MODULE_ROUTER)) == NULL)
     {
         char* home = get_libdir();
@@ -130,6 +167,7 @@ service_alloc(const char *servname, const char *router)
                   home,
                   ldpath ? "\t\t\t      - " : "",
                   ldpath ? ldpath : "");
+        ts_stats_free(service->stats.n_sessions);
         free(service);
         return NULL;
     }
@@ -148,6 +186,7 @@ service_alloc(const char *servname, const char *router)
     service->version_string = NULL;
     service->svc_config_param = NULL;
     service->users = NULL;
+    service->users_generation = 0;
     service->routerOptions = NULL;
     service->log_auth_warnings = true;
     service->strip_db_esc = true;
@@ -164,7 +203,9 @@ service_alloc(const char *servname, const char *router)
     service->stats.n_failed_starts = 0;
     service->state = SERVICE_STATE_ALLOC;
     spinlock_init(&service->spin);
+    spinlock_set_name(&service->spin, "service spin");
     spinlock_init(&service->users_table_spin);
+    spinlock_set_name(&service->users_table_spin, "users_table_spin");
 
     spinlock_acquire(&service_spin);
     service->next = allServices;
@@ -201,6 +242,60 @@ service_isvalid(SERVICE *service)
     return rval;
 }
 
+/**
+ * Save the users of a service to the file cache from where they are loaded
+ * if the backend servers can't be reached when the service is next started
+ *
+ * @param service The service whose users are saved
+ */
+static void
+service_save_users(SERVICE *service)
+{
+    char path[PATH_MAX + 1];
+    int mkdir_rval = 0;
+    strncpy(path, get_cachedir(), PATH_MAX);
+    strncat(path, "/", 4096);
+    strncat(path, service->name, PATH_MAX);
+    if (access(path, R_OK) == -1)
+    {
+        mkdir_rval = mkdir(path, 0777);
+    }
+
+    if (mkdir_rval)
+    {
+        if (errno != EEXIST)
+        {
+            char errbuf[STRERROR_BUFLEN];
+            MXS_ERROR("Failed to create directory '%s': [%d] %s",
+                      path,
+                      errno,
+                      strerror_r(errno, errbuf, sizeof(errbuf)));
+        }
+        mkdir_rval = 0;
+    }
+
+    strncat(path, "/.cache", PATH_MAX);
+    if (access(path, R_OK) == -1)
+    {
+        mkdir_rval = mkdir(path, 0777);
+    }
+
+    if (mkdir_rval)
+    {
+        if (errno != EEXIST)
+        {
+            char errbuf[STRERROR_BUFLEN];
+            MXS_ERROR("Failed to create directory '%s': [%d] %s",
+                      path,
+                      errno,
+                      strerror_r(errno, errbuf, sizeof(errbuf)));
+        }
+        mkdir_rval = 0;
+    }
+    strncat(path, "/dbusers", PATH_MAX);
+    dbusers_save(service->users, path);
+}
+
 /**
  * Start an individual port/protocol pair
  *
@@ -278,49 +373,7 @@ serviceStartPort(SERVICE *service, SERV_LISTENER *port)
             else
             {
                 /* Save authentication data to file cache */
-                char *ptr, path[PATH_MAX + 1];
-                int mkdir_rval = 0;
-                strncpy(path, get_cachedir(), PATH_MAX);
-                strncat(path, "/", 4096);
-                strncat(path, service->name, PATH_MAX);
-                if (access(path, R_OK) == -1)
-                {
-                    mkdir_rval = mkdir(path, 0777);
-                }
-
-                if (mkdir_rval)
-                {
-                    if (errno != EEXIST)
-                    {
-                        char errbuf[STRERROR_BUFLEN];
-                        MXS_ERROR("Failed to create directory '%s': [%d] %s",
-                                  path,
-                                  errno,
-                                  strerror_r(errno, errbuf, sizeof(errbuf)));
-                    }
-                    mkdir_rval = 0;
-                }
-
-                strncat(path, "/.cache", PATH_MAX);
-                if (access(path, R_OK) == -1)
-                {
-                    mkdir_rval = mkdir(path, 0777);
-                }
-
-                if (mkdir_rval)
-                {
-                    if (errno != EEXIST)
-                    {
-                        char errbuf[STRERROR_BUFLEN];
-                        MXS_ERROR("Failed to create directory '%s': [%d] %s",
-                                  path,
-                                  errno,
-                                  strerror_r(errno, errbuf, sizeof(errbuf)));
-                    }
-                    mkdir_rval = 0;
-                }
-                strncat(path, "/dbusers", PATH_MAX);
-                dbusers_save(service->users, path);
+                service_save_users(service);
             }
             if (loaded == 0)
             {
@@ -377,6 +430,7 @@ serviceStartPort(SERVICE *service, SERV_LISTENER *port)
         if (port->listener->session != NULL)
         {
             port->listener->session->state = SESSION_STATE_LISTENER;
+            dcb_listener_set_session(port->listener);
             listeners += 1;
         }
         else
@@ -562,34 +616,109 @@ serviceStartProtocol(SERVICE *service, char *protocol, int port)
 }
 
 
+/**
+ * Start services until all of them have been started
+ *
+ * Each service opens its listeners as soon as its router instance has been
+ * created and its users have been loaded, so a service that waits for a slow
+ * backend does not hold up the listeners of the other services.
+ *
+ * @param data The SERVICE_STARTER
+ */
+static void
+service_start_services(void *data)
+{
+    SERVICE_STARTER *starter = (SERVICE_STARTER*)data;
+
+    while (true)
+    {
+        spinlock_acquire(&starter->lock);
+        SERVICE *service = starter->next;
+
+        if (service && service->svc_do_shutdown)
+        {
+            service = NULL;
+        }
+        starter->next = service ? service->next : NULL;
+        spinlock_release(&starter->lock);
+
+        if (service == NULL)
+        {
+            break;
+        }
+
+        int listeners = serviceStart(service);
+
+        if (listeners == 0)
+        {
+            MXS_ERROR("Failed to start service '%s'.", service->name);
+        }
+
+        spinlock_acquire(&starter->lock);
+        starter->listeners += listeners;
+        starter->error = starter->error || listeners == 0;
+        spinlock_release(&starter->lock);
+    }
+}
+
+/**
+ * The main function of a service start thread
+ *
+ * @param data The SERVICE_STARTER
+ */
+static void
+service_start_thread(void *data)
+{
+    /** The users are queried from the backends */
+    mysql_thread_init();
+    service_start_services(data);
+    mysql_thread_end();
+}
+
 /**
  * Start all the services
  *
+ * The services are started by at most service_start_threads threads, the
+ * calling thread being one of them.
+ *
  * @return Return the number of services started
  */
 int
 serviceStartAll()
 {
-    SERVICE *ptr;
-    int n = 0, i;
-    bool error = false;
+    SERVICE_STARTER starter;
+    int n_services = 0;
 
     config_enable_feedback_task();
 
-    ptr = allServices;
-    while (ptr && !ptr->svc_do_shutdown)
+    spinlock_init(&starter.lock);
+    starter.next = allServices;
+    starter.listeners = 0;
+    starter.error = false;
+
+    for (SERVICE *service = allServices; service; service = service->next)
     {
-        n += (i = serviceStart(ptr));
+        n_services++;
+    }
 
-        if (i == 0)
-        {
-            MXS_ERROR("Failed to start service '%s'.", ptr->name);
-            error = true;
-        }
+    int n_threads = MIN(n_services, (int)config_service_start_threads()) - 1;
+    THREAD threads[n_threads > 0 ? n_threads : 1];
+    int started = 0;
 
-        ptr = ptr->next;
+    while (started < n_threads &&
+           thread_start(&threads[started], service_start_thread, &starter))
+    {
+        started++;
+    }
+
+    service_start_services(&starter);
+
+    for (int i = 0; i < started; i++)
+    {
+        thread_wait(threads[i]);
     }
-    return error ? 0 : n;
+
+    return starter.error ? 0 : starter.listeners;
 }
 
 /**
@@ -613,6 +742,10 @@ serviceStop(SERVICE *service)
         {
             if (poll_remove_dcb(port->listener) == 0)
             {
+                for (DCB *dcb = port->listener->nextlistener; dcb; dcb = dcb->nextlistener)
+                {
+                    poll_remove_dcb(dcb);
+                }
                 port->listener->session->state = SESSION_STATE_LISTENER_STOPPED;
                 listeners++;
             }
@@ -645,6 +778,10 @@ serviceRestart(SERVICE *service)
         {
             if (poll_add_dcb(port->listener) == 0)
             {
+                for (DCB *dcb = port->listener->nextlistener; dcb; dcb = dcb->nextlistener)
+                {
+                    poll_add_dcb(dcb);
+                }
                 port->listener->session->state = SESSION_STATE_LISTENER;
                 listeners++;
             }
@@ -710,6 +847,7 @@ service_free(SERVICE *service)
     users_free(service->users);
     hashtable_free(service->resources);
     serviceClearRouterOptions(service);
+    ts_stats_free(service->stats.n_sessions);
 
     free(service);
     return 1;
@@ -784,7 +922,7 @@ int serviceHasProtocol(SERVICE *service, const char *protocol,
 void
 serviceAddBackend(SERVICE *service, SERVER *server)
 {
-    SERVER_REF *sref = malloc(sizeof(SERVER_REF));
+    SERVER_REF *sref = calloc(1, sizeof(SERVER_REF));
 
     if (sref)
     {
@@ -1038,21 +1176,140 @@ int
 serviceSetConnectionLimits(SERVICE *service, int max, int queued, int timeout)
 {
 
-    if (max < 0 || queued < 0)
+    if (max < 0 || queued < 0 || timeout < 0)
     {
         return 0;
     }
 
+    if (timeout == 0)
+    {
+        timeout = SERVICE_DEFAULT_QUEUE_TIMEOUT;
+    }
+
     service->max_connections = max;
-    if (queued && timeout)
+    if (service->queued_connections)
+    {
+        /* The connections already in the queue are kept on reconfiguration */
+        mxs_queue_configure(service->queued_connections, queued, timeout);
+    }
+    else if (queued)
     {
         /* If memory allocation fails, result will be null so no queue */
         service->queued_connections = mxs_queue_alloc(queued, timeout);
+        service_register_queue_metrics(service);
     }
 
     return 1;
 }
 
+/**
+ * Register the metrics of the connection queue of a service
+ *
+ * @param service The service
+ */
+static void service_register_queue_metrics(SERVICE *service)
+{
+    /** The wait times in milliseconds */
+    static const int64_t bounds[] =
+    {
+        1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000
+    };
+    char labels[strlen(service->name) + 64];
+
+    snprintf(labels, sizeof(labels), "service=\"%s\"", service->name);
+    service->queue_length = metric_gauge("maxscale_connection_queue_length", labels,
+                                         "Number of client connections waiting in the queue");
+    service->queue_wait = metric_histogram("maxscale_connection_queue_wait_seconds", labels,
+                                           "Time client connections waited in the queue",
+                                           bounds, sizeof(bounds) / sizeof(bounds[0]), 0.001);
+
+    snprintf(labels, sizeof(labels), "service=\"%s\",result=\"admitted\"", service->name);
+    service->queue_admitted = metric_counter("maxscale_queued_connections", labels,
+                                             "Client connections that were queued, by result");
+    snprintf(labels, sizeof(labels), "service=\"%s\",result=\"expired\"", service->name);
+    service->queue_expired = metric_counter("maxscale_queued_connections", labels,
+                                            "Client connections that were queued, by result");
+    snprintf(labels, sizeof(labels), "service=\"%s\",result=\"rejected\"", service->name);
+    service->queue_rejected = metric_counter("maxscale_queued_connections", labels,
+                                             "Client connections that were queued, by result");
+}
+
+/** When the connection queues next need to be checked for expired connections */
+static uint64_t queue_expiry_next = UINT64_MAX;
+static int queue_expiry_busy = 0;
+
+/**
+ * Note that a queued connection expires at a given time. The connection
+ * queues are checked when the first connection expires.
+ *
+ * @param expiry When the connection expires, see mxs_queue_now
+ */
+void service_queue_expires_at(uint64_t expiry)
+{
+    uint64_t next = __atomic_load_n(&queue_expiry_next, __ATOMIC_RELAXED);
+
+    while (expiry < next &&
+           !__atomic_compare_exchange_n(&queue_expiry_next, &next, expiry, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        ;
+    }
+}
+
+/**
+ * Reject the expired queued connections of all services and accept the
+ * queued connections there is room for. This is called by the polling
+ * threads, only one of them processes the queues at a time.
+ */
+void service_process_queued_connections()
+{
+    if (queue_expiry_next == UINT64_MAX || mxs_queue_now() < queue_expiry_next ||
+        !__sync_bool_compare_and_swap(&queue_expiry_busy, 0, 1))
+    {
+        return;
+    }
+
+    __atomic_store_n(&queue_expiry_next, UINT64_MAX, __ATOMIC_RELAXED);
+
+    spinlock_acquire(&service_spin);
+    for (SERVICE *service = allServices; service; service = service->next)
+    {
+        if (service->queued_connections)
+        {
+            dcb_admit_queued(service);
+            service_queue_expires_at(mxs_queue_next_expiry(service->queued_connections));
+        }
+    }
+    spinlock_release(&service_spin);
+
+    __sync_lock_release(&queue_expiry_busy);
+}
+
+/**
+ * Limit the time a polling thread blocks so that the queued connections are
+ * rejected when they have waited for their timeout.
+ *
+ * @param timeout The timeout of the poll in milliseconds
+ * @return The timeout, reduced to the time until the next queued connection expires
+ */
+int service_queue_poll_timeout(int timeout)
+{
+    uint64_t next = queue_expiry_next;
+
+    if (next != UINT64_MAX)
+    {
+        uint64_t now = mxs_queue_now();
+        uint64_t wait = next > now ? next - now : 0;
+
+        if (wait < (uint64_t)timeout)
+        {
+            timeout = wait;
+        }
+    }
+
+    return timeout;
+}
+
 /**
  * Enable or disable the restarting of the service on failure.
  * @param service Service to configure
@@ -1197,7 +1454,7 @@ printService(SERVICE *service)
         printf("\n");
     }
     printf("\tUsers data:           %p\n", (void *)service->users);
-    printf("\tTotal connections:    %d\n", service->stats.n_sessions);
+    printf("\tTotal connections:    %" PRId64 "\n", ts_stats_sum(service->stats.n_sessions));
     printf("\tCurrently connected:  %d\n", service->stats.n_current);
 }
 
@@ -1308,10 +1565,37 @@ void dprintService(DCB *dcb, SERVICE *service)
     }
     dcb_printf(dcb, "\tUsers data:                          %p\n",
                service->users);
-    dcb_printf(dcb, "\tTotal connections:                   %d\n",
-               service->stats.n_sessions);
+    if (service->rate_limit.n_reloads)
+    {
+        dcb_printf(dcb, "\tUser reloads:                        %d, last took %ld ms\n",
+                   service->rate_limit.n_reloads, service->rate_limit.last_duration);
+    }
+    dcb_printf(dcb, "\tTotal connections:                   %" PRId64 "\n",
+               ts_stats_sum(service->stats.n_sessions));
     dcb_printf(dcb, "\tCurrently connected:                 %d\n",
                service->stats.n_current);
+    dcb_printf(dcb, "\tBuffered memory:                     %" PRId64 " bytes\n",
+               service->stats.memory);
+    if (service->queued_connections)
+    {
+        QUEUE_CONFIG *queue = service->queued_connections;
+        dcb_printf(dcb, "\tQueued connections:                  %d (limit %d, timeout %d ms)\n",
+                   mxs_queue_count(queue), queue->queue_limit, queue->timeout);
+    }
+
+    for (SERV_LISTENER *port = service->ports; port; port = port->next)
+    {
+        SSL_LISTENER *ssl = port->ssl;
+
+        if (ssl && ssl->ssl_init_done)
+        {
+            int total = ssl->n_full_handshakes + ssl->n_resumed;
+            dcb_printf(dcb, "\tTLS sessions on port %d: %d resumed, %d full handshakes "
+                       "(%.1f%% hits), %ld cached\n", port->port, ssl->n_resumed,
+                       ssl->n_full_handshakes, total ? ssl->n_resumed * 100.0 / total : 0.0,
+                       SSL_CTX_sess_number(ssl->ctx));
+        }
+    }
 }
 
 /**
@@ -1337,9 +1621,9 @@ dListServices(DCB *dcb)
     while (service)
     {
         ss_dassert(service->stats.n_current >= 0);
-        dcb_printf(dcb, "%-25s | %-20s | %6d | %5d\n",
+        dcb_printf(dcb, "%-25s | %-20s | %6d | %5" PRId64 "\n",
                    service->name, service->routerModule,
-                   service->stats.n_current, service->stats.n_sessions);
+                   service->stats.n_current, ts_stats_sum(service->stats.n_sessions));
         service = service->next;
     }
     if (allServices)
@@ -1477,11 +1761,32 @@ int service_refresh_users(SERVICE *service)
         service->rate_limit.last = time(NULL);
     }
 
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
     ret = replace_mysql_users(service);
 
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    service->rate_limit.last_duration = (end.tv_sec - start.tv_sec) * 1000 +
+                                        (end.tv_nsec - start.tv_nsec) / 1000000;
+    service->rate_limit.n_reloads++;
+
+    if (ret > 0)
+    {
+        /** Keep the file cache current so that a cold start has the latest users */
+        service_save_users(service);
+    }
+
     /* remove lock */
     spinlock_release(&service->users_table_spin);
 
+    if (ret >= 0)
+    {
+        MXS_NOTICE("%s: Reloaded the users in %ld ms, %s.", service->name,
+                   service->rate_limit.last_duration,
+                   ret > 0 ? "the users had changed" : "no changes");
+    }
+
     if (ret >= 0)
     {
         return 0;
@@ -1492,6 +1797,259 @@ int service_refresh_users(SERVICE *service)
     }
 }
 
+/**
+ * Wake up the logins that waited for a reload of the users
+ *
+ * @param waiter The first of the waiting logins
+ */
+static void
+users_loader_wake(USERS_RELOAD_WAITER *waiter)
+{
+    while (waiter)
+    {
+        USERS_RELOAD_WAITER *next = waiter->next;
+
+        spinlock_acquire(&waiter->lock);
+        bool cancelled = waiter->cancelled;
+        waiter->done = true;
+
+        if (!cancelled)
+        {
+            /** The DCB is not freed while its close waits for the lock */
+            poll_add_epollin_event_to_dcb(waiter->dcb, NULL);
+        }
+        spinlock_release(&waiter->lock);
+
+        if (cancelled)
+        {
+            free(waiter);
+        }
+
+        waiter = next;
+    }
+}
+
+/**
+ * Ask the background thread to reload the users of a service
+ *
+ * The users loader lock must be held.
+ *
+ * @param service Service whose users are reloaded
+ */
+static void
+users_loader_request(SERVICE *service)
+{
+    service->rate_limit.pending = true;
+    users_loader_wakeup = true;
+    pthread_cond_signal(&users_loader_cond);
+}
+
+/**
+ * Check if the refresh rate limit rejects a reload of the users
+ *
+ * @param service The service
+ * @return True if the users can't be reloaded now
+ */
+static bool
+users_refresh_limited(SERVICE *service)
+{
+    return time(NULL) < service->rate_limit.last + USERS_REFRESH_TIME ||
+           service->rate_limit.nloads > USERS_REFRESH_MAX_PER_TIME;
+}
+
+/**
+ * The main loop of the thread that reloads the users of the services
+ *
+ * @param data Unused
+ */
+static void
+users_loader_main(void *data)
+{
+    while (true)
+    {
+        SERVICE *service = NULL;
+
+        pthread_mutex_lock(&users_loader_lock);
+        while (!users_loader_wakeup)
+        {
+            pthread_cond_wait(&users_loader_cond, &users_loader_lock);
+        }
+
+        spinlock_acquire(&service_spin);
+        for (service = allServices; service; service = service->next)
+        {
+            if (service->rate_limit.pending)
+            {
+                service->rate_limit.pending = false;
+                service->rate_limit.loading = true;
+                break;
+            }
+        }
+        spinlock_release(&service_spin);
+
+        if (service == NULL)
+        {
+            users_loader_wakeup = false;
+        }
+        pthread_mutex_unlock(&users_loader_lock);
+
+        if (service)
+        {
+            service_refresh_users(service);
+
+            pthread_mutex_lock(&users_loader_lock);
+            USERS_RELOAD_WAITER *waiter = service->rate_limit.waiters;
+            service->rate_limit.waiters = NULL;
+            service->rate_limit.loading = false;
+            pthread_mutex_unlock(&users_loader_lock);
+
+            users_loader_wake(waiter);
+        }
+    }
+}
+
+/**
+ * Start the thread that reloads the users in the background
+ */
+static void
+users_loader_start()
+{
+    if (thread_start(&users_loader_thr, users_loader_main, NULL) == NULL)
+    {
+        MXS_ERROR("Failed to start the thread that reloads the users.");
+    }
+    else
+    {
+        users_loader_running = true;
+    }
+}
+
+/**
+ * Request the users of a service to be reloaded in the background
+ *
+ * The caller does not wait for the reload. The requests that arrive while
+ * a reload is already pending are merged into it and the requests that the
+ * refresh rate limit would reject are dropped, so a burst of failed logins
+ * causes at most one reload. The new users table is swapped in only when
+ * it is complete.
+ *
+ * @param service Service whose users are reloaded
+ */
+void service_refresh_users_async(SERVICE *service)
+{
+    if (users_refresh_limited(service))
+    {
+        MXS_DEBUG("%s: Refresh rate limit exceeded, not reloading the users.",
+                  service->name);
+        return;
+    }
+
+    pthread_once(&users_loader_once, users_loader_start);
+
+    pthread_mutex_lock(&users_loader_lock);
+    users_loader_request(service);
+    pthread_mutex_unlock(&users_loader_lock);
+}
+
+/**
+ * Wait for the users of a service to be reloaded in the background
+ *
+ * This is service_refresh_users_async for a login that failed. The login waits
+ * for the reload that it requested, or for the one that is already pending or
+ * running, and is checked again when it has finished. When the reload has
+ * finished, a read event is added to the DCB. The caller must suspend the
+ * reads of the DCB until it has called service_refresh_users_finish.
+ *
+ * @param service Service whose users are reloaded
+ * @param dcb     The client DCB whose login waits
+ * @return The waiter or NULL if the users are not going to be reloaded
+ */
+USERS_RELOAD_WAITER *service_refresh_users_wait(SERVICE *service, DCB *dcb)
+{
+    USERS_RELOAD_WAITER *waiter = NULL;
+    bool limited = users_refresh_limited(service);
+
+    pthread_once(&users_loader_once, users_loader_start);
+
+    if (!users_loader_running)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&users_loader_lock);
+
+    if ((!limited || service->rate_limit.pending || service->rate_limit.loading) &&
+        (waiter = (USERS_RELOAD_WAITER *)malloc(sizeof(USERS_RELOAD_WAITER))))
+    {
+        spinlock_init(&waiter->lock);
+        waiter->dcb = dcb;
+        waiter->done = false;
+        waiter->cancelled = false;
+        waiter->next = service->rate_limit.waiters;
+        service->rate_limit.waiters = waiter;
+
+        if (!service->rate_limit.pending && !service->rate_limit.loading)
+        {
+            users_loader_request(service);
+        }
+    }
+
+    pthread_mutex_unlock(&users_loader_lock);
+
+    if (waiter == NULL)
+    {
+        MXS_DEBUG("%s: Refresh rate limit exceeded, not reloading the users.",
+                  service->name);
+    }
+
+    return waiter;
+}
+
+/**
+ * Check whether the reload a login waits for has finished
+ *
+ * @param waiter The waiter
+ * @return True if service_refresh_users_finish can be called
+ */
+bool service_refresh_users_done(USERS_RELOAD_WAITER *waiter)
+{
+    spinlock_acquire(&waiter->lock);
+    bool done = waiter->done;
+    spinlock_release(&waiter->lock);
+
+    return done;
+}
+
+/**
+ * Free a waiter whose reload has finished
+ *
+ * @param waiter The waiter
+ */
+void service_refresh_users_finish(USERS_RELOAD_WAITER *waiter)
+{
+    ss_dassert(service_refresh_users_done(waiter));
+    free(waiter);
+}
+
+/**
+ * Stop waiting for a reload because the client DCB is closed. The DCB is not
+ * used by the waiter after this returns.
+ *
+ * @param waiter The waiter
+ */
+void service_refresh_users_cancel(USERS_RELOAD_WAITER *waiter)
+{
+    spinlock_acquire(&waiter->lock);
+    bool done = waiter->done;
+    waiter->cancelled = true;
+    spinlock_release(&waiter->lock);
+
+    if (done)
+    {
+        free(waiter);
+    }
+}
+
 bool service_set_param_value(SERVICE*            service,
                              CONFIG_PARAMETER*   param,
                              char*               valstr,
@@ -1909,6 +2467,226 @@ serviceGetListenerList()
     return set;
 }
 
+/** Names of the query types in the latency metrics */
+static char *latency_type_names[SERVICE_LATENCY_MAX] = { "read", "write", "other" };
+
+/**
+ * Bucket bounds of the latency histograms in microseconds. The buckets grow
+ * in 1-2-5 steps so the relative error of a bucket is the same from 100
+ * microseconds to 10 seconds.
+ */
+static const int64_t latency_bounds[] =
+{
+    100, 200, 500,
+    1000, 2000, 5000,
+    10000, 20000, 50000,
+    100000, 200000, 500000,
+    1000000, 2000000, 5000000,
+    10000000
+};
+
+/**
+ * Get the latency histogram of a server of a service, registering it if it
+ * does not yet exist
+ *
+ * @param ref  The server reference of the service
+ * @param name Name of the service
+ * @param type Query type
+ * @return The histogram or NULL on error
+ */
+static METRIC *service_latency_metric(SERVER_REF *ref, const char *name, service_latency_t type)
+{
+    METRIC *metric = __atomic_load_n(&ref->latency[type], __ATOMIC_ACQUIRE);
+
+    if (metric == NULL)
+    {
+        char labels[strlen(name) + strlen(ref->server->unique_name) + 64];
+        snprintf(labels, sizeof(labels), "service=\"%s\",server=\"%s\",type=\"%s\"",
+                 name, ref->server->unique_name, latency_type_names[type]);
+
+        /** Registering an existing metric returns it so a race here is harmless */
+        metric = metric_histogram("maxscale_query_latency_seconds", labels,
+                                  "Time from sending a query to a server to its response",
+                                  latency_bounds, sizeof(latency_bounds) / sizeof(latency_bounds[0]),
+                                  0.000001);
+        __atomic_store_n(&ref->latency[type], metric, __ATOMIC_RELEASE);
+    }
+
+    return metric;
+}
+
+/**
+ * Record the latency of a query. Must be called from a polling thread.
+ *
+ * @param service The service that routed the query
+ * @param server  The server that executed the query
+ * @param type    Query type
+ * @param usec    Time from sending the query to the response in microseconds
+ */
+void
+service_record_latency(SERVICE *service, SERVER *server, service_latency_t type, uint64_t usec)
+{
+    /** Servers are only ever appended to the list */
+    for (SERVER_REF *ref = service->dbref; ref; ref = ref->next)
+    {
+        if (ref->server == server)
+        {
+            metric_observe(service_latency_metric(ref, service->name, type), usec);
+            break;
+        }
+    }
+}
+
+/**
+ * Estimate a quantile of the query latencies of a server
+ *
+ * @param service The service that routed the queries
+ * @param server  The server that executed them
+ * @param type    Query type
+ * @param q       The quantile, between 0 and 1
+ * @param count   If not NULL, set to the number of measured queries
+ * @return The latency in microseconds, -1 if nothing has been measured and
+ *         INT64_MAX if it is above the largest bucket of the histogram
+ */
+int64_t
+service_latency_quantile(SERVICE *service, SERVER *server, service_latency_t type,
+                         double q, int64_t *count)
+{
+    for (SERVER_REF *ref = service->dbref; ref; ref = ref->next)
+    {
+        METRIC *metric;
+
+        if (ref->server == server &&
+            (metric = __atomic_load_n(&ref->latency[type], __ATOMIC_ACQUIRE)))
+        {
+            return metric_histogram_quantile(metric, q, count);
+        }
+    }
+
+    if (count)
+    {
+        *count = 0;
+    }
+    return -1;
+}
+
+/**
+ * Format a latency in milliseconds
+ *
+ * @param buf  Buffer of at least 20 characters
+ * @param usec The latency in microseconds as returned by metric_histogram_quantile
+ */
+static void format_latency(char *buf, int64_t usec)
+{
+    if (usec < 0)
+    {
+        strcpy(buf, "");
+    }
+    else if (usec == INT64_MAX)
+    {
+        sprintf(buf, "> %.1f", latency_bounds[sizeof(latency_bounds) /
+                                              sizeof(latency_bounds[0]) - 1] / 1000.0);
+    }
+    else
+    {
+        sprintf(buf, "%.1f", usec / 1000.0);
+    }
+}
+
+/**
+ * Provide a row to the result set of the query latencies
+ *
+ * @param set   The result set
+ * @param data  The index of the row to send
+ * @return The next row or NULL
+ */
+static RESULT_ROW *
+serviceLatencyRowCallback(RESULTSET *set, void *data)
+{
+    int *rowno = (int *)data;
+    int i = 0;
+    RESULT_ROW *row = NULL;
+
+    spinlock_acquire(&service_spin);
+
+    for (SERVICE *service = allServices; service && row == NULL; service = service->next)
+    {
+        for (SERVER_REF *ref = service->dbref; ref && row == NULL; ref = ref->next)
+        {
+            for (int type = 0; type < SERVICE_LATENCY_MAX && row == NULL; type++)
+            {
+                METRIC *metric = __atomic_load_n(&ref->latency[type], __ATOMIC_ACQUIRE);
+
+                if (metric && i++ == *rowno)
+                {
+                    char buf[40];
+                    int64_t count;
+                    int64_t p50 = metric_histogram_quantile(metric, 0.5, &count);
+
+                    row = resultset_make_row(set);
+                    resultset_row_set(row, 0, service->name);
+                    resultset_row_set(row, 1, ref->server->unique_name);
+                    resultset_row_set(row, 2, latency_type_names[type]);
+                    sprintf(buf, "%" PRId64, count);
+                    resultset_row_set(row, 3, buf);
+                    sprintf(buf, "%.3f", count ? ts_stats_sum(metric->value) / 1000.0 / count : 0.0);
+                    resultset_row_set(row, 4, buf);
+                    format_latency(buf, p50);
+                    resultset_row_set(row, 5, buf);
+                    format_latency(buf, metric_histogram_quantile(metric, 0.95, NULL));
+                    resultset_row_set(row, 6, buf);
+                    format_latency(buf, metric_histogram_quantile(metric, 0.99, NULL));
+                    resultset_row_set(row, 7, buf);
+                }
+            }
+        }
+    }
+
+    spinlock_release(&service_spin);
+
+    if (row == NULL)
+    {
+        free(data);
+        return NULL;
+    }
+
+    (*rowno)++;
+    return row;
+}
+
+/**
+ * Return a resultset with the query latencies of the servers of all services
+ *
+ * @return A Result set
+ */
+RESULTSET *
+serviceGetLatencyList()
+{
+    RESULTSET *set;
+    int *data;
+
+    if ((data = (int *)malloc(sizeof(int))) == NULL)
+    {
+        return NULL;
+    }
+    *data = 0;
+    if ((set = resultset_create(serviceLatencyRowCallback, data)) == NULL)
+    {
+        free(data);
+        return NULL;
+    }
+    resultset_add_column(set, "Service", 25, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Server", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Type", 5, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Queries", 10, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Average (ms)", 12, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "p50 (ms)", 10, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "p95 (ms)", 10, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "p99 (ms)", 10, COL_TYPE_VARCHAR);
+
+    return set;
+}
+
 /**
  * Provide a row to the result set that defines the set of services
  *
@@ -1944,7 +2722,7 @@ serviceRowCallback(RESULTSET *set, void *data)
     resultset_row_set(row, 1, service->routerModule);
     sprintf(buf, "%d", service->stats.n_current);
     resultset_row_set(row, 2, buf);
-    sprintf(buf, "%d", service->stats.n_sessions);
+    sprintf(buf, "%" PRId64, ts_stats_sum(service->stats.n_sessions));
     resultset_row_set(row, 3, buf);
     spinlock_release(&service_spin);
     return row;
@@ -31,6 +31,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <session.h>
 #include <service.h>
 #include <router.h>
@@ -39,32 +40,82 @@
 #include <atomic.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
+#include <trace.h>
+#include <probes.h>
+#include <hugepage.h>
 #include <housekeeper.h>
+#include <metrics.h>
+#include <maxscale/poll.h>
+#include <maxconfig.h>
 
-/** Global session id; updated safely by holding session_spin */
+/** Global session id; updated atomically */
 static size_t session_id;
 
-static SPINLOCK session_spin = SPINLOCK_INIT;
+/**
+ * The list of all sessions that have ever been allocated. Sessions are never
+ * freed, so the list only grows and it can be walked without a lock. It is
+ * only used for diagnostics, creating a session does not need to look at it.
+ * A session of the list can be freed and reused at any time, the walkers take
+ * a reference with session_ref_in_use before they look at its contents.
+ */
 static SESSION *allSessions = NULL;
-static SESSION *lastSession = NULL;
-static SESSION *wasfreeSession = NULL;
-static int freeSessionCount = 0;
+
+/**
+ * The free sessions of one thread. A session is taken from the pool of the
+ * thread that creates it and returned to the same pool when it is freed,
+ * whichever thread frees it. The lock is normally only taken by the owning
+ * thread so it is practically never contended.
+ */
+typedef struct session_pool
+{
+    SPINLOCK lock;      /*< Protects the free list */
+    SESSION  *free;     /*< The free sessions, linked via next_free */
+    int      n_free;    /*< Number of free sessions */
+    struct session_pool *next_spare; /*< Next pool of a stopped thread */
+} SESSION_POOL;
+
+static thread_local SESSION_POOL *session_pool = NULL;
+
+/**
+ * The pools of the threads that have stopped. Their sessions still return to
+ * them so they are given to the next threads that start.
+ */
+static SESSION_POOL *spare_pools = NULL;
+static SPINLOCK spare_pools_lock = SPINLOCK_INIT;
+
+/** The memory of the sessions that are not found in the pools */
+static HUGEPAGE_ARENA session_arena = HUGEPAGE_ARENA_INIT("session", sizeof(SESSION));
 
 static struct session session_dummy_struct;
 
 /**
- * These two are declared in session.h
+ * This is declared in session.h
  */
 bool check_timeouts = false;
-long next_timeout_check = 0;
 
-static SPINLOCK timeout_lock = SPINLOCK_INIT;
+/**
+ * The connection idle timeout timers of the sessions that one thread checks.
+ * The timers are in milliseconds, as measured by the housekeeper heartbeat.
+ */
+typedef struct
+{
+    SPINLOCK    lock;   /*< Protects the wheel */
+    uint64_t    next;   /*< When the wheel next needs to be advanced */
+    TIMER_WHEEL wheel;  /*< The timers */
+} SESSION_TIMEOUTS;
+
+static SESSION_TIMEOUTS *session_timeouts = NULL;
+static int n_session_timeouts = 0;
 
 static int session_setup_filters(SESSION *session);
+static int session_filter_route(void *instance, void *fsession, GWBUF *queue);
 static void session_simple_free(SESSION *session, DCB *dcb);
 static void session_add_to_all_list(SESSION *session);
 static SESSION *session_find_free();
 static void session_final_free(SESSION *session);
+static void session_add_idle_timer(SESSION *session);
+static void session_remove_idle_timer(SESSION *session);
+static bool session_ref_in_use(SESSION *session);
 
 /**
  * Allocate a new session for a new client of the specified service.
@@ -82,9 +133,7 @@ session_alloc(SERVICE *service, DCB *client_dcb)
 {
     SESSION *session;
 
-    spinlock_acquire(&session_spin);
     session = session_find_free();
-    spinlock_release(&session_spin);
     ss_info_dassert(session != NULL, "Allocating memory for session failed.");
 
     if (session == NULL)
@@ -101,12 +150,16 @@ session_alloc(SERVICE *service, DCB *client_dcb)
     session->ses_chk_tail = CHK_NUM_SESSION;
 #endif
     session->ses_is_child = (bool) DCB_IS_CLONE(client_dcb);
+    timerwheel_entry_init(&session->idle_timer);
     spinlock_init(&session->ses_lock);
+    spinlock_set_name(&session->ses_lock, "ses_lock");
     session->service = service;
     session->client_dcb = client_dcb;
     session->n_filters = 0;
     memset(&session->stats, 0, sizeof(SESSION_STATS));
     session->stats.connect = time(0);
+    session->trace.active = false;
+    session->trace.user = -1;
     session->state = SESSION_STATE_ALLOC;
     /*<
      * Associate the session to the client DCB and set the reference count on
@@ -199,104 +252,131 @@ session_alloc(SERVICE *service, DCB *client_dcb)
                  session->client_dcb->user,
                  session->client_dcb->remote);
     }
-    spinlock_acquire(&session_spin);
-    /** Assign a session id and increase, insert session into list */
-    session->ses_id = ++session_id;
-    spinlock_release(&session_spin);
-    atomic_add(&service->stats.n_sessions, 1);
+    /** Assign a session id and increase */
+    session->ses_id = __sync_add_and_fetch(&session_id, 1);
+    TRACE_EVENT(TRACE_SESSION_START, session->ses_id, 0, 0);
+    MXS_PROBE2(session_alloc, session, session->ses_id);
+    ts_stats_add(service->stats.n_sessions, 1);
     atomic_add(&service->stats.n_current, 1);
     CHK_SESSION(session);
 
     client_dcb->session = session;
+    if (SESSION_STATE_TO_BE_FREED != session->state)
+    {
+        session_add_idle_timer(session);
+    }
     return SESSION_STATE_TO_BE_FREED == session->state ? NULL : session;
 }
 
 /**
  * Add a new session to the list of all sessions.
  *
- * Must be called with the general session lock held.
- *
- * A pointer, lastSession, is held to find the end of the list, and the new session
- * is linked to the end of the list.  The pointer, wasfreeSession, that is used to
- * search for a free session is initialised if not already set. There cannot be
- * any free sessions (or any at all) until this routine has been called at least
- * once. Hence it will not be referred to until after it is initialised.
+ * The session is pushed to the head of the list with a compare-and-swap so
+ * that the list can be walked at the same time without a lock.
  *
  * @param session       The session to be added to the list
  */
 static void
 session_add_to_all_list(SESSION *session)
 {
-    if (allSessions == NULL)
+    do
     {
-        allSessions = session;
+        session->next = allSessions;
     }
-    else
+    while (!__sync_bool_compare_and_swap(&allSessions, session->next, session));
+}
+
+/**
+ * Return the session pool of the calling thread, creating it if needed.
+ *
+ * @return The pool or NULL if memory allocation failed
+ */
+static SESSION_POOL *
+session_get_pool()
+{
+    if (session_pool == NULL && spare_pools)
     {
-        lastSession->next = session;
+        spinlock_acquire(&spare_pools_lock);
+        if ((session_pool = spare_pools) != NULL)
+        {
+            spare_pools = session_pool->next_spare;
+        }
+        spinlock_release(&spare_pools_lock);
     }
-    lastSession = session;
-    if (NULL == wasfreeSession)
+
+    if (session_pool == NULL && (session_pool = calloc(1, sizeof(SESSION_POOL))) != NULL)
     {
-        wasfreeSession = session;
+        spinlock_init(&session_pool->lock);
+        spinlock_set_name(&session_pool->lock, "session pool");
+    }
+    return session_pool;
+}
+
+/**
+ * Give the session pool of a stopping thread to the next thread that starts
+ */
+void session_thread_end()
+{
+    if (session_pool)
+    {
+        spinlock_acquire(&spare_pools_lock);
+        session_pool->next_spare = spare_pools;
+        spare_pools = session_pool;
+        spinlock_release(&spare_pools_lock);
+        session_pool = NULL;
     }
 }
 
 /**
  * Find a free session or allocate memory for a new one.
  *
- * This routine looks to see whether there are free session memory areas.
- * If not, new memory is allocated, if possible, and the new session is added to
+ * A free session is taken from the pool of the calling thread. If the pool is
+ * empty, new memory is allocated, if possible, and the new session is added to
  * the list of all sessions.
  *
- * Must be called with the general session lock held.
- *
  * @return An available session or NULL if none could be allocated.
  */
 static SESSION *
 session_find_free()
 {
-    SESSION *nextsession;
+    SESSION_POOL *pool = session_get_pool();
+    SESSION *session = NULL;
 
-    if (freeSessionCount <= 0)
+    if (pool == NULL)
     {
-        SESSION *newsession;
-        if ((newsession = calloc(1, sizeof(SESSION))) == NULL)
+        return NULL;
+    }
+
+    spinlock_acquire(&pool->lock);
+    if ((session = pool->free) != NULL)
+    {
+        pool->free = session->next_free;
+        pool->n_free--;
+    }
+    spinlock_release(&pool->lock);
+
+    if (session)
+    {
+        /**
+         * Clear the old data but keep the list of all sessions intact, it may
+         * be walked by another thread right now.
+         */
+        memset(session, 0, offsetof(SESSION, next));
+        session->next_free = NULL;
+    }
+    else
+    {
+        if ((session = hugepage_alloc(&session_arena)) == NULL)
         {
             return NULL;
         }
-        newsession->next = NULL;
-        session_add_to_all_list(newsession);
-        newsession->ses_is_in_use = true;
-        return newsession;
-    }
-    /* Starting at the last place a free session was found, loop through the */
-    /* list of sessions searching for one that is not in use. */
-    while (wasfreeSession->ses_is_in_use)
-    {
-        int loopcount = 0;
-        wasfreeSession = wasfreeSession->next;
-        if (NULL == wasfreeSession)
-        {
-            loopcount++;
-            if (loopcount > 1)
-            {
-                /* Shouldn't need to loop round more than once */
-                MXS_ERROR("Find free session failed to find a session even"
-                          " though free count was positive");
-                return NULL;
-            }
-            wasfreeSession = allSessions;
-        }
+        memset(session, 0, sizeof(SESSION));
+        session->pool = pool;
+        session_add_to_all_list(session);
     }
-    /* Dropping out of the loop means we have found a session that is not in use */
-    freeSessionCount--;
-    /* Clear the old data, then reset the list forward link */
-    nextsession = wasfreeSession->next;
-    memset(wasfreeSession, 0, sizeof(SESSION));
-    wasfreeSession->next = nextsession;
-    wasfreeSession->ses_is_in_use = true;
-    return wasfreeSession;
+
+    session->ses_is_in_use = true;
+    return session;
 }
 
 /**
@@ -319,6 +399,7 @@ session_set_dummy(DCB *client_dcb)
 #endif
     session->ses_is_child = false;
     spinlock_init(&session->ses_lock);
+    spinlock_set_name(&session->ses_lock, "ses_lock");
     session->service = NULL;
     session->client_dcb = NULL;
     session->n_filters = 0;
@@ -345,6 +426,7 @@ void session_enable_log_priority(SESSION* session, int priority)
 {
     session->enabled_log_priorities |= (1 << priority);
     atomic_add((int *)&mxs_log_session_count[priority], 1);
+    atomic_add(&mxs_log_session_count_total, 1);
 }
 
 /**
@@ -361,6 +443,7 @@ void session_disable_log_priority(SESSION* session, int priority)
     {
         session->enabled_log_priorities &= ~(1 << priority);
         atomic_add((int *)&mxs_log_session_count[priority], -1);
+        atomic_add(&mxs_log_session_count_total, -1);
     }
 }
 
@@ -449,6 +532,7 @@ session_free(SESSION *session)
         return false;
     }
     session->state = SESSION_STATE_TO_BE_FREED;
+    session_remove_idle_timer(session);
 
     atomic_add(&session->service->stats.n_current, -1);
 
@@ -496,6 +580,8 @@ session_free(SESSION *session)
 
     /** Disable trace and decrease trace logger counter */
     session_disable_log_priority(session, LOG_INFO);
+    TRACE_EVENT(TRACE_SESSION_END, session->ses_id, 0, 0);
+    MXS_PROBE2(session_free, session, session->ses_id);
 
     /** If session doesn't have parent referencing to it, it can be freed */
     if (!session->ses_is_child)
@@ -509,11 +595,42 @@ session_free(SESSION *session)
 static void
 session_final_free(SESSION *session)
 {
-    /* We never free the actual session, it is available for reuse*/
-    spinlock_acquire(&session_spin);
+    /* We never free the actual session, it is returned to its pool for reuse */
+    SESSION_POOL *pool = session->pool;
+
+    spinlock_acquire(&pool->lock);
     session->ses_is_in_use = false;
-    freeSessionCount++;
-    spinlock_release(&session_spin);
+    session->next_free = pool->free;
+    pool->free = session;
+    pool->n_free++;
+    spinlock_release(&pool->lock);
+}
+
+/**
+ * Take a reference to a session of the list of all sessions if it is in use
+ *
+ * The reference keeps the session, its client DCB, its router session and its
+ * filter sessions from being freed. A session whose last reference is gone is
+ * not referenced again until it has been reused. The reference is released
+ * with session_free.
+ *
+ * @param session       The session
+ * @return              True if the reference was taken
+ */
+static bool
+session_ref_in_use(SESSION *session)
+{
+    int refcount;
+
+    while ((refcount = session->refcount) > 0 && session->ses_is_in_use)
+    {
+        if (__sync_bool_compare_and_swap(&session->refcount, refcount, refcount + 1))
+        {
+            return true;
+        }
+    }
+
+    return false;
 }
 
 /**
@@ -528,18 +645,20 @@ session_isvalid(SESSION *session)
     SESSION *list_session;
     int rval = 0;
 
-    spinlock_acquire(&session_spin);
     list_session = allSessions;
     while (list_session)
     {
-        if (list_session->ses_is_in_use && list_session == session)
+        if (list_session == session)
         {
-            rval = 1;
+            if (session_ref_in_use(list_session))
+            {
+                rval = 1;
+                session_free(list_session);
+            }
             break;
         }
         list_session = list_session->next;
     }
-    spinlock_release(&session_spin);
 
     return rval;
 }
@@ -574,17 +693,16 @@ printAllSessions()
 {
     SESSION *list_session;
 
-    spinlock_acquire(&session_spin);
     list_session = allSessions;
     while (list_session)
     {
-        if (list_session->ses_is_in_use)
+        if (session_ref_in_use(list_session))
         {
             printSession(list_session);
+            session_free(list_session);
         }
         list_session = list_session->next;
     }
-    spinlock_release(&session_spin);
 }
 
 
@@ -601,7 +719,6 @@ CheckSessions()
     int noclients = 0;
     int norouter = 0;
 
-    spinlock_acquire(&session_spin);
     list_session = allSessions;
     while (list_session)
     {
@@ -626,12 +743,10 @@ CheckSessions()
         }
         list_session = list_session->next;
     }
-    spinlock_release(&session_spin);
     if (noclients)
     {
         printf("%d Sessions have no clients\n", noclients);
     }
-    spinlock_acquire(&session_spin);
     list_session = allSessions;
     while (list_session)
     {
@@ -656,7 +771,6 @@ CheckSessions()
         }
         list_session = list_session->next;
     }
-    spinlock_release(&session_spin);
     if (norouter)
     {
         printf("%d Sessions have no router session\n", norouter);
@@ -676,21 +790,17 @@ dprintAllSessions(DCB *dcb)
 {
     SESSION *list_session;
 
-    spinlock_acquire(&session_spin);
     list_session = allSessions;
     while (list_session)
     {
-        if (false == list_session->ses_is_in_use)
+        if (session_ref_in_use(list_session))
         {
-            list_session = list_session->next;
-            continue;
+            dprintSession(dcb, list_session);
+            session_free(list_session);
         }
 
-        dprintSession(dcb, list_session);
-
         list_session = list_session->next;
     }
-    spinlock_release(&session_spin);
 }
 
 /**
@@ -723,6 +833,11 @@ dprintSession(DCB *dcb, SESSION *print_session)
 
     dcb_printf(dcb, "\tConnected:           %s", // asctime inserts newline.
                asctime_r(localtime_r(&print_session->stats.connect, &result), buf));
+    dcb_printf(dcb, "\tCPU time:            %.3f seconds\n",
+               poll_cycles_to_usecs(print_session->stats.cpu_cycles) / 1000000.0);
+    dcb_printf(dcb, "\tBytes in:            %" PRIu64 "\n", print_session->stats.bytes_in);
+    dcb_printf(dcb, "\tBytes out:           %" PRIu64 "\n", print_session->stats.bytes_out);
+    dcb_printf(dcb, "\tQueries:             %" PRIu64 "\n", print_session->stats.n_queries);
 
     if (print_session->client_dcb && print_session->client_dcb->state == DCB_STATE_POLLING)
     {
@@ -757,7 +872,6 @@ dListSessions(DCB *dcb)
 {
     SESSION *list_session;
 
-    spinlock_acquire(&session_spin);
     list_session = allSessions;
     if (list_session)
     {
@@ -768,7 +882,7 @@ dListSessions(DCB *dcb)
     }
     while (list_session)
     {
-        if (list_session->ses_is_in_use)
+        if (session_ref_in_use(list_session))
         {
             dcb_printf(dcb, "%-16p | %-15s | %-14s | %s\n", list_session,
                        ((list_session->client_dcb && list_session->client_dcb->remote)
@@ -776,6 +890,7 @@ dListSessions(DCB *dcb)
                        (list_session->service && list_session->service->name ? list_session->service->name
                         : ""),
                        session_state(list_session->state));
+            session_free(list_session);
         }
         list_session = list_session->next;
     }
@@ -784,7 +899,317 @@ dListSessions(DCB *dcb)
         dcb_printf(dcb,
                    "-----------------+-----------------+----------------+--------------------------\n\n");
     }
-    spinlock_release(&session_spin);
+}
+
+/**
+ * Collect the sessions that have used the most CPU time or hold the most memory
+ *
+ * The list of all sessions is walked without a lock so the counters are a
+ * snapshot that may be slightly out of date. Each session is referenced while
+ * its details are copied.
+ *
+ * @param usage     Array where the usage of the sessions is stored
+ * @param n         Size of the array, at most SESSION_TOP_MAX
+ * @param by_memory Order the sessions by the buffered memory instead of the CPU time
+ * @return Number of sessions stored, in descending order
+ */
+int
+session_top_usage(SESSION_USAGE *usage, int n, bool by_memory)
+{
+    int found = 0;
+
+    for (SESSION *ses = allSessions; ses; ses = ses->next)
+    {
+        if (!session_ref_in_use(ses))
+        {
+            continue;
+        }
+
+        DCB *client = ses->client_dcb;
+
+        if (ses->state == SESSION_STATE_LISTENER ||
+            ses->state == SESSION_STATE_LISTENER_STOPPED || client == NULL ||
+            client->dcb_role != DCB_ROLE_CLIENT_HANDLER)
+        {
+            session_free(ses);
+            continue;
+        }
+
+        SESSION_USAGE current;
+        memcpy(&current.stats, &ses->stats, sizeof(current.stats));
+        current.id = ses->ses_id;
+        snprintf(current.user, sizeof(current.user), "%s", client->user ? client->user : "");
+        snprintf(current.remote, sizeof(current.remote), "%s", client->remote ? client->remote : "");
+        snprintf(current.service, sizeof(current.service), "%s", ses->service ? ses->service->name : "");
+        session_free(ses);
+
+        SESSION_STATS stats = current.stats;
+
+        /** Insert the session sorted by the CPU time or the memory */
+        int i = found < n ? found : n;
+
+        while (i > 0 && (by_memory ? usage[i - 1].stats.memory < stats.memory :
+                         usage[i - 1].stats.cpu_cycles < stats.cpu_cycles))
+        {
+            if (i < n)
+            {
+                usage[i] = usage[i - 1];
+            }
+            i--;
+        }
+
+        if (i < n)
+        {
+            usage[i] = current;
+
+            if (found < n)
+            {
+                found++;
+            }
+        }
+    }
+
+    return found;
+}
+
+/**
+ * List the sessions that have used the most CPU time
+ *
+ * @param dcb The DCB to print to
+ * @param n   Number of sessions to list
+ */
+void
+dListTopSessions(DCB *dcb, int n)
+{
+    SESSION_USAGE usage[SESSION_TOP_MAX];
+
+    if (n <= 0 || n > SESSION_TOP_MAX)
+    {
+        n = SESSION_TOP_MAX;
+    }
+
+    int found = session_top_usage(usage, n, false);
+
+    dcb_printf(dcb, "Sessions by CPU time.\n");
+    dcb_printf(dcb, "-----------+--------------------------------+----------------+----------+------------+------------+----------\n");
+    dcb_printf(dcb, "Session    | Client                         | Service        | CPU (s)  | Bytes in   | Bytes out  | Queries\n");
+    dcb_printf(dcb, "-----------+--------------------------------+----------------+----------+------------+------------+----------\n");
+
+    for (int i = 0; i < found; i++)
+    {
+        char client[sizeof(usage[i].user) + sizeof(usage[i].remote) + 1];
+        snprintf(client, sizeof(client), "%s%s%s", usage[i].user,
+                 *usage[i].user ? "@" : "", usage[i].remote);
+
+        dcb_printf(dcb, "%-10lu | %-30s | %-14s | %8.3f | %10" PRIu64 " | %10" PRIu64 " | %" PRIu64 "\n",
+                   usage[i].id, client, usage[i].service,
+                   poll_cycles_to_usecs(usage[i].stats.cpu_cycles) / 1000000.0,
+                   usage[i].stats.bytes_in, usage[i].stats.bytes_out, usage[i].stats.n_queries);
+    }
+
+    dcb_printf(dcb, "-----------+--------------------------------+----------------+----------+------------+------------+----------\n\n");
+}
+
+/**
+ * List the sessions that hold the most buffered memory
+ *
+ * @param dcb The DCB to print to
+ * @param n   Number of sessions to list
+ */
+void
+dListTopMemorySessions(DCB *dcb, int n)
+{
+    SESSION_USAGE usage[SESSION_TOP_MAX];
+
+    if (n <= 0 || n > SESSION_TOP_MAX)
+    {
+        n = SESSION_TOP_MAX;
+    }
+
+    int found = session_top_usage(usage, n, true);
+
+    dcb_printf(dcb, "Sessions by buffered memory.\n");
+    dcb_printf(dcb, "-----------+--------------------------------+----------------+------------+------------+------------\n");
+    dcb_printf(dcb, "Session    | Client                         | Service        | Memory     | Bytes in   | Bytes out\n");
+    dcb_printf(dcb, "-----------+--------------------------------+----------------+------------+------------+------------\n");
+
+    for (int i = 0; i < found; i++)
+    {
+        char client[sizeof(usage[i].user) + sizeof(usage[i].remote) + 1];
+        snprintf(client, sizeof(client), "%s%s%s", usage[i].user,
+                 *usage[i].user ? "@" : "", usage[i].remote);
+
+        dcb_printf(dcb, "%-10lu | %-30s | %-14s | %10" PRId64 " | %10" PRIu64 " | %" PRIu64 "\n",
+                   usage[i].id, client, usage[i].service, usage[i].stats.memory,
+                   usage[i].stats.bytes_in, usage[i].stats.bytes_out);
+    }
+
+    dcb_printf(dcb, "-----------+--------------------------------+----------------+------------+------------+------------\n\n");
+}
+
+/**
+ * Account for buffers that a session starts or stops holding
+ *
+ * When all the memory of the session grows above the hard limit, the client
+ * connection is closed. The soft limit only looks at the memory that drains
+ * as the queued data is written: when it grows above the limit, the reads from
+ * the client are paused until it drops below three quarters of the limit.
+ *
+ * @param session The session
+ * @param n       Number of bytes, negative when the buffers are released
+ * @param kept    True if the buffers are kept until the session releases them
+ */
+static void
+session_account(SESSION *session, int n, bool kept)
+{
+    int64_t memory = __atomic_add_fetch(&session->stats.memory, n, __ATOMIC_RELAXED);
+    int64_t kept_memory = kept ?
+        __atomic_add_fetch(&session->stats.memory_kept, n, __ATOMIC_RELAXED) :
+        __atomic_load_n(&session->stats.memory_kept, __ATOMIC_RELAXED);
+    int64_t draining = memory - kept_memory;
+    int64_t soft = config_session_memory_soft_limit();
+    int64_t hard = config_session_memory_hard_limit();
+    DCB *client = session->client_dcb;
+
+    __atomic_add_fetch(&session->service->stats.memory, n, __ATOMIC_RELAXED);
+
+    if (client == NULL || client->dcb_role != DCB_ROLE_CLIENT_HANDLER)
+    {
+        return;
+    }
+
+    if (n > 0)
+    {
+        if (hard && memory > hard && !session->memory_closed &&
+            __sync_bool_compare_and_swap(&session->memory_closed, false, true))
+        {
+            MXS_WARNING("Session %lu of %s@%s holds %" PRId64 " bytes of buffers which exceeds "
+                        "session_memory_hard_limit, closing the client connection.",
+                        session->ses_id, client->user ? client->user : "",
+                        client->remote ? client->remote : "", memory);
+            poll_fake_hangup_event(client);
+        }
+        else if (!kept && soft && draining > soft && !session->memory_paused &&
+                 __sync_bool_compare_and_swap(&session->memory_paused, false, true))
+        {
+            MXS_INFO("Session %lu has %" PRId64 " bytes of buffers queued, pausing the reads "
+                     "from the client.", session->ses_id, draining);
+            dcb_suspend_reads(client);
+        }
+    }
+    else if (session->memory_paused && draining < soft - soft / 4 &&
+             __sync_bool_compare_and_swap(&session->memory_paused, true, false))
+    {
+        dcb_resume_reads(client);
+    }
+}
+
+/**
+ * Account for buffers queued in the DCBs of a session
+ *
+ * @param session The session
+ * @param n       Number of bytes, negative when the buffers are released
+ */
+void
+session_account_memory(SESSION *session, int n)
+{
+    session_account(session, n, false);
+}
+
+/**
+ * Account for buffers a session keeps until it releases them, such as its
+ * session command history
+ *
+ * The buffers count toward the hard limit but not toward the soft one, the
+ * reads that the soft limit pauses would otherwise never be resumed.
+ *
+ * @param session The session
+ * @param n       Number of bytes, negative when the buffers are released
+ */
+void
+session_account_kept_memory(SESSION *session, int n)
+{
+    session_account(session, n, true);
+}
+
+/**
+ * Copy a label value and replace the characters that would need escaping
+ *
+ * @param dest Destination buffer
+ * @param src  The value
+ * @param size Size of the destination buffer
+ */
+static void
+session_label_value(char *dest, const char *src, size_t size)
+{
+    snprintf(dest, size, "%s", src);
+
+    for (char *ptr = dest; *ptr; ptr++)
+    {
+        if (*ptr == '"' || *ptr == '\\' || *ptr == '\n')
+        {
+            *ptr = '_';
+        }
+    }
+}
+
+/**
+ * Print the usage of the sessions that have used the most CPU time in the
+ * OpenMetrics text format. This is added to the metrics printers.
+ *
+ * @param dcb The DCB to print to
+ */
+void
+session_print_metrics(DCB *dcb)
+{
+    SESSION_USAGE usage[SESSION_TOP_METRICS];
+    char labels[SESSION_TOP_METRICS][sizeof(SESSION_USAGE) + 64];
+    int found = session_top_usage(usage, SESSION_TOP_METRICS, false);
+
+    for (int i = 0; i < found; i++)
+    {
+        char user[sizeof(usage[i].user)];
+        char remote[sizeof(usage[i].remote)];
+        char service[sizeof(usage[i].service)];
+        session_label_value(user, usage[i].user, sizeof(user));
+        session_label_value(remote, usage[i].remote, sizeof(remote));
+        session_label_value(service, usage[i].service, sizeof(service));
+        snprintf(labels[i], sizeof(labels[i]),
+                 "session=\"%lu\",user=\"%s\",remote=\"%s\",service=\"%s\"",
+                 usage[i].id, user, remote, service);
+    }
+
+    metrics_print_family(dcb, "maxscale_session_cpu_seconds", METRIC_COUNTER,
+                         "CPU time used by the sessions that have used the most of it");
+    for (int i = 0; i < found; i++)
+    {
+        metrics_print_value(dcb, "maxscale_session_cpu_seconds", "_total", labels[i],
+                            poll_cycles_to_usecs(usage[i].stats.cpu_cycles) / 1000000.0);
+    }
+
+    metrics_print_family(dcb, "maxscale_session_received_bytes", METRIC_COUNTER,
+                         "Bytes read from the clients of the sessions that have used the most CPU time");
+    for (int i = 0; i < found; i++)
+    {
+        metrics_print_value(dcb, "maxscale_session_received_bytes", "_total", labels[i],
+                            usage[i].stats.bytes_in);
+    }
+
+    metrics_print_family(dcb, "maxscale_session_sent_bytes", METRIC_COUNTER,
+                         "Bytes written to the clients of the sessions that have used the most CPU time");
+    for (int i = 0; i < found; i++)
+    {
+        metrics_print_value(dcb, "maxscale_session_sent_bytes", "_total", labels[i],
+                            usage[i].stats.bytes_out);
+    }
+
+    metrics_print_family(dcb, "maxscale_session_queries", METRIC_COUNTER,
+                         "Queries routed by the sessions that have used the most CPU time");
+    for (int i = 0; i < found; i++)
+    {
+        metrics_print_value(dcb, "maxscale_session_queries", "_total", labels[i],
+                            usage[i].stats.n_queries);
+    }
 }
 
 /**
@@ -847,6 +1272,12 @@ SESSION* get_session_by_router_ses(void* rses)
  * this head becomes the destination for the filter. The newly created
  * filter becomes the new head of the filter chain.
  *
+ * If a filter is followed by filters that are not interested in all client
+ * packets, its downstream component is session_filter_route which passes
+ * each packet directly to the next filter that is interested in it. When
+ * the queries are traced, session_filter_route is used for all filters so
+ * that it records when a traced query reaches each filter.
+ *
  * @param       session         The session that requires the chain
  * @return      0 if filter creation fails
  */
@@ -854,11 +1285,15 @@ static int
 session_setup_filters(SESSION *session)
 {
     SERVICE *service = session->service;
+    uint32_t all = FILTER_INTEREST_SQL | FILTER_INTEREST_OTHER;
+    /** The sampled queries are traced when they pass each filter */
+    bool bypass = query_trace_enabled;
     DOWNSTREAM *head;
     UPSTREAM *tail;
-    int i;
+    SESSION_FILTER *sf;
+    int i, c;
 
-    if ((session->filters = calloc(service->n_filters,
+    if ((session->filters = calloc(service->n_filters + 1,
                                    sizeof(SESSION_FILTER))) == NULL)
     {
         MXS_ERROR("Insufficient memory to allocate session filter "
@@ -866,6 +1301,17 @@ session_setup_filters(SESSION *session)
         return 0;
     }
     session->n_filters = service->n_filters;
+
+    sf = &session->filters[service->n_filters];
+    sf->instance = session->head.instance;
+    sf->session = session->head.session;
+    sf->routeQuery = session->head.routeQuery;
+    sf->interest = FILTER_INTEREST_ALL;
+    for (c = 0; c < SESSION_FILTER_CLASSES; c++)
+    {
+        sf->next[c] = service->n_filters;
+    }
+
     for (i = service->n_filters - 1; i >= 0; i--)
     {
         if (service->filters[i] == NULL)
@@ -873,6 +1319,12 @@ session_setup_filters(SESSION *session)
             MXS_ERROR("Service '%s' contians an unresolved filter.", service->name);
             return 0;
         }
+        if (bypass)
+        {
+            session->head.instance = session;
+            session->head.session = &session->filters[i + 1];
+            session->head.routeQuery = session_filter_route;
+        }
         if ((head = filterApply(service->filters[i], session,
                                 &session->head)) == NULL)
         {
@@ -882,13 +1334,28 @@ session_setup_filters(SESSION *session)
                       service->name);
             return 0;
         }
-        session->filters[i].filter = service->filters[i];
-        session->filters[i].session = head->session;
-        session->filters[i].instance = head->instance;
+        sf = &session->filters[i];
+        sf->filter = service->filters[i];
+        sf->session = head->session;
+        sf->instance = head->instance;
+        sf->routeQuery = head->routeQuery;
+        sf->interest = filterInterest(service->filters[i]);
+        for (c = 0; c < SESSION_FILTER_CLASSES; c++)
+        {
+            sf->next[c] = (sf->interest & (1 << c)) ? i : sf[1].next[c];
+        }
+        bypass = bypass || (sf->interest & all) != all;
         session->head = *head;
         free(head);
     }
 
+    if (bypass)
+    {
+        session->head.instance = session;
+        session->head.session = &session->filters[0];
+        session->head.routeQuery = session_filter_route;
+    }
+
     for (i = 0; i < service->n_filters; i++)
     {
         if ((tail = filterUpstream(service->filters[i],
@@ -916,6 +1383,33 @@ session_setup_filters(SESSION *session)
     return 1;
 }
 
+/**
+ * Route a client packet to the next filter that is interested in it
+ *
+ * @param       instance        The session
+ * @param       fsession        The first element of the session filters that
+ *                              may receive the packet
+ * @param       queue           The client packet
+ * @return      The return value of the filter or the router
+ */
+static int
+session_filter_route(void *instance, void *fsession, GWBUF *queue)
+{
+    SESSION *session = (SESSION *)instance;
+    SESSION_FILTER *sf = (SESSION_FILTER *)fsession;
+
+    int i = sf->next[filter_packet_class(queue)];
+
+    if (session->trace.active)
+    {
+        query_trace_point(session, i < session->n_filters ? QTRACE_FILTER : QTRACE_ROUTER, i);
+    }
+
+    sf = &session->filters[i];
+
+    return sf->routeQuery(sf->instance, sf->session, queue);
+}
+
 /**
  * Entry point for the final element int he upstream filter, i.e. the writing
  * of the data to the client.
@@ -985,7 +1479,9 @@ session_getUser(SESSION *session)
     return (session && session->client_dcb) ? session->client_dcb->user : NULL;
 }
 /**
- * Return the pointer to the list of all sessions.
+ * Return the pointer to the list of all sessions. The list can be walked
+ * without a lock as sessions are never removed from it, but a session that is
+ * not in use may be reused at any time.
  * @return Pointer to the list of all sessions.
  */
 SESSION *get_all_sessions()
@@ -1005,39 +1501,147 @@ void enable_session_timeouts()
 }
 
 /**
- * Close sessions that have been idle for too long.
+ * Allocate the connection idle timeout timers of the polling threads
+ *
+ * @param n_threads Number of polling threads
+ * @return True on success, false if memory allocation failed
+ */
+bool session_init_timeouts(int n_threads)
+{
+    if ((session_timeouts = (SESSION_TIMEOUTS *)calloc(n_threads, sizeof(SESSION_TIMEOUTS))) == NULL)
+    {
+        MXS_ERROR("Failed to allocate memory for session timeouts.");
+        return false;
+    }
+
+    for (int i = 0; i < n_threads; i++)
+    {
+        spinlock_init(&session_timeouts[i].lock);
+        spinlock_set_name(&session_timeouts[i].lock, "session timeouts");
+        session_timeouts[i].next = UINT64_MAX;
+        timerwheel_init(&session_timeouts[i].wheel, (uint64_t)hkheartbeat * 100);
+    }
+    n_session_timeouts = n_threads;
+    return true;
+}
+
+/**
+ * Return the time when a session has been idle for longer than the
+ * connection idle timeout of its service
+ *
+ * @param session   The session
+ * @return The time in milliseconds
+ */
+static inline uint64_t
+session_idle_expiry(SESSION *session)
+{
+    return (session->client_dcb->last_read + session->service->conn_idle_timeout * 10 + 1) * 100;
+}
+
+/**
+ * Start the connection idle timeout timer of a new session. The timer is
+ * not moved when data is read from the client, it is only checked against
+ * the time of the last read when it expires.
+ *
+ * @param session   The session
+ */
+static void
+session_add_idle_timer(SESSION *session)
+{
+    if (check_timeouts && session_timeouts && session->client_dcb &&
+        session->service->conn_idle_timeout)
+    {
+        SESSION_TIMEOUTS *timeouts = &session_timeouts[session->ses_id % n_session_timeouts];
+        uint64_t expiry = session_idle_expiry(session);
+
+        spinlock_acquire(&timeouts->lock);
+        timerwheel_add(&timeouts->wheel, &session->idle_timer, expiry);
+        if (expiry < timeouts->next)
+        {
+            timeouts->next = expiry;
+        }
+        spinlock_release(&timeouts->lock);
+    }
+}
+
+/**
+ * Stop the connection idle timeout timer of a session. The lock is taken even
+ * if the timer looks stopped, as it may be on the list of expired timers of
+ * the thread that is checking them.
+ *
+ * @param session   The session
+ */
+static void
+session_remove_idle_timer(SESSION *session)
+{
+    if (check_timeouts && session_timeouts)
+    {
+        SESSION_TIMEOUTS *timeouts = &session_timeouts[session->ses_id % n_session_timeouts];
+
+        spinlock_acquire(&timeouts->lock);
+        timerwheel_remove(&session->idle_timer);
+        spinlock_release(&timeouts->lock);
+    }
+}
+
+/**
+ * Close the sessions of a thread that have been idle for too long.
  *
  * If the time since a session last sent data is greater than the set value in the
  * service, it is disconnected. The connection timeout is disabled by default.
+ *
+ * Only the sessions whose timers have expired are looked at. A session that
+ * has read data since its timer was started gets a new timer that expires
+ * a full timeout after the last read.
+ *
+ * @param thread_id The id of the polling thread
  */
-void process_idle_sessions()
+void session_process_timeouts(int thread_id)
 {
-    if (spinlock_acquire_nowait(&timeout_lock))
+    uint64_t now = (uint64_t)hkheartbeat * 100;
+    SESSION_TIMEOUTS *timeouts;
+
+    if (session_timeouts == NULL || thread_id >= n_session_timeouts ||
+        now < session_timeouts[thread_id].next)
     {
-        if (hkheartbeat >= next_timeout_check)
+        return;
+    }
+
+    timeouts = &session_timeouts[thread_id];
+
+    if (spinlock_acquire_nowait(&timeouts->lock))
+    {
+        TIMER_ENTRY expired;
+
+        timerwheel_list_init(&expired);
+        timerwheel_advance(&timeouts->wheel, now, &expired);
+
+        while (!timerwheel_list_empty(&expired))
         {
-            /** Because the resolution of the timeout is one second, we only need to
-             * check for it once per second. One heartbeat is 100 milliseconds. */
-            next_timeout_check = hkheartbeat + 10;
-            spinlock_acquire(&session_spin);
-            SESSION *all_session = allSessions;
+            SESSION *session = (SESSION *)((char *)expired.next - offsetof(SESSION, idle_timer));
+
+            timerwheel_remove(&session->idle_timer);
 
-            while (all_session)
+            if (session->ses_is_in_use &&
+                session->service && session->client_dcb &&
+                session->client_dcb->state == DCB_STATE_POLLING &&
+                session->service->conn_idle_timeout)
             {
-                if (all_session->ses_is_in_use &&
-                    all_session->service && all_session->client_dcb &&
-                    all_session->client_dcb->state == DCB_STATE_POLLING &&
-                    all_session->service->conn_idle_timeout &&
-                    hkheartbeat - all_session->client_dcb->last_read > all_session->service->conn_idle_timeout * 10)
+                if (hkheartbeat - session->client_dcb->last_read >
+                    session->service->conn_idle_timeout * 10)
                 {
-                    dcb_close(all_session->client_dcb);
+                    dcb_close(session->client_dcb);
+                }
+                else
+                {
+                    timerwheel_add(&timeouts->wheel, &session->idle_timer,
+                                   session_idle_expiry(session));
                 }
-
-                all_session = all_session->next;
             }
-            spinlock_release(&session_spin);
         }
-        spinlock_release(&timeout_lock);
+
+        timeouts->next = timerwheel_next_expiry(&timeouts->wheel);
+        spinlock_release(&timeouts->lock);
     }
 }
 
@@ -1046,65 +1650,51 @@ void process_idle_sessions()
  */
 typedef struct
 {
-    int index;
+    SESSION *next;              /*< The session to examine next */
     SESSIONLISTFILTER filter;
 } SESSIONFILTER;
 
 /**
  * Provide a row to the result set that defines the set of sessions
  *
+ * The sessions are never removed from the list of all sessions, the
+ * callback data remembers where the previous call stopped so that each
+ * row only examines the sessions after the previous one. The session of
+ * the row is referenced while the row is filled.
+ *
  * @param set   The result set
- * @param data  The index of the row to send
+ * @param data  The position of the row to send
  * @return The next row or NULL
  */
 static RESULT_ROW *
 sessionRowCallback(RESULTSET *set, void *data)
 {
     SESSIONFILTER *cbdata = (SESSIONFILTER *)data;
-    int i = 0;
     char buf[20];
     RESULT_ROW *row;
     SESSION *list_session;
 
-    spinlock_acquire(&session_spin);
-    list_session = allSessions;
-    /* Skip to the first non-listener if not showing listeners */
-    while (false == list_session->ses_is_in_use ||
-           (list_session && cbdata->filter == SESSION_LIST_CONNECTION &&
-            list_session->state == SESSION_STATE_LISTENER))
-    {
-        list_session = list_session->next;
-    }
-    while (i < cbdata->index && list_session)
+    list_session = cbdata->next;
+    /* Skip to the next non-listener if not showing listeners */
+    while (list_session)
     {
-        if (list_session->ses_is_in_use)
+        if (session_ref_in_use(list_session))
         {
-            if (cbdata->filter == SESSION_LIST_CONNECTION &&
-                list_session->state !=  SESSION_STATE_LISTENER)
-            {
-                i++;
-            }
-            else if (cbdata->filter == SESSION_LIST_ALL)
+            if (cbdata->filter != SESSION_LIST_CONNECTION ||
+                list_session->state != SESSION_STATE_LISTENER)
             {
-                i++;
+                break;
             }
+            session_free(list_session);
         }
         list_session = list_session->next;
     }
-    /* Skip to the next non-listener if not showing listeners */
-    while (list_session && (false == list_session->ses_is_in_use ||
-                            (cbdata->filter == SESSION_LIST_CONNECTION &&
-                             list_session->state == SESSION_STATE_LISTENER)))
-    {
-        list_session = list_session->next;
-    }
     if (list_session == NULL)
     {
-        spinlock_release(&session_spin);
         free(data);
         return NULL;
     }
-    cbdata->index++;
+    cbdata->next = list_session->next;
     row = resultset_make_row(set);
     snprintf(buf,19, "%p", list_session);
     buf[19] = '\0';
@@ -1114,7 +1704,7 @@ sessionRowCallback(RESULTSET *set, void *data)
     resultset_row_set(row, 2, (list_session->service && list_session->service->name
                                ? list_session->service->name : ""));
     resultset_row_set(row, 3, session_state(list_session->state));
-    spinlock_release(&session_spin);
+    session_free(list_session);
     return row;
 }
 
@@ -1139,7 +1729,7 @@ sessionGetList(SESSIONLISTFILTER filter)
     {
         return NULL;
     }
-    data->index = 0;
+    data->next = allSessions;
     data->filter = filter;
     if ((set = resultset_create(sessionRowCallback, data)) == NULL)
     {
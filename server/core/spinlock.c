@@ -25,9 +25,77 @@
 
 #include <spinlock.h>
 #include <atomic.h>
+#include <platform.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <execinfo.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <skygw_debug.h>
 
+/** The number of rounds a thread spins before it sleeps on the lock */
+#define SPINLOCK_SPIN_ROUNDS 64
+
+/** The maximum number of pause instructions between two spin rounds */
+#define SPINLOCK_MAX_PAUSES 64
+
+/** The lock value of a lock that is held while other threads may sleep on it */
+#define SPINLOCK_SLEEPERS 2
+
+#if defined(__i386__) || defined(__x86_64__)
+#define SPINLOCK_PAUSE() __builtin_ia32_pause()
+#else
+#define SPINLOCK_PAUSE() __asm__ __volatile__("" ::: "memory")
+#endif
+
+/** The number of lock and call site pairs the contention profile can hold */
+#define SPINLOCK_PROFILE_SLOTS 1024
+
+/** One in this many acquisitions of each thread is sampled, must be a power of two */
+#define SPINLOCK_PROFILE_SAMPLE 16
+
+/**
+ * A slot in the contention profile. The slot is claimed for a lock and call
+ * site pair when the pair is first sampled and the pair is not changed after
+ * the slot has been marked as used.
+ */
+typedef struct spinlock_site
+{
+    int used;                      /*< Whether the slot holds a profile */
+    SPINLOCK_PROFILE_ENTRY stats;  /*< The profile of the lock at the call site */
+} SPINLOCK_SITE;
+
+static SPINLOCK_SITE profile[SPINLOCK_PROFILE_SLOTS];
+static int profile_lock = 0;      /*< Protects the claiming of profile slots */
+static int profiling = 0;         /*< Whether acquisitions are being sampled */
+static thread_local unsigned int sample_count = 0;
+
+/**
+ * Sleep until the lock value changes from the expected value
+ *
+ * @param lock     The lock to sleep on
+ * @param expected The value the lock is expected to have
+ */
+static inline void
+spinlock_futex_wait(SPINLOCK *lock, int expected)
+{
+    syscall(SYS_futex, &lock->lock, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+/**
+ * Wake up one thread sleeping on the lock
+ *
+ * @param lock The lock to wake a thread for
+ */
+static inline void
+spinlock_futex_wake(SPINLOCK *lock)
+{
+    syscall(SYS_futex, &lock->lock, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
 /**
  * Initialise a spinlock.
  *
@@ -37,6 +105,9 @@ void
 spinlock_init(SPINLOCK *lock)
 {
     lock->lock = 0;
+    lock->name = NULL;
+    lock->site = NULL;
+    lock->hold_start = 0;
 #if SPINLOCK_PROFILE
     lock->spins = 0;
     lock->acquired = 0;
@@ -46,37 +117,168 @@ spinlock_init(SPINLOCK *lock)
 #endif
 }
 
+/**
+ * Raise a maximum value to at least a given value
+ *
+ * @param max   The maximum to update
+ * @param value The new value
+ */
+static inline void
+spinlock_profile_max(uint64_t *max, uint64_t value)
+{
+    uint64_t old;
+
+    while ((old = *(volatile uint64_t *)max) < value &&
+           !__sync_bool_compare_and_swap(max, old, value))
+    {
+        ;
+    }
+}
+
+/**
+ * Find the profile slot of a lock and call site pair, claiming a free
+ * slot if the pair has not been sampled before
+ *
+ * @param lock  The lock
+ * @param site  The call site
+ * @return The slot or NULL if the profile is full
+ */
+static SPINLOCK_SITE *
+spinlock_profile_find(SPINLOCK *lock, void *site)
+{
+    uintptr_t hash = ((uintptr_t)lock >> 4) ^ ((uintptr_t)site * 2654435761U);
+    unsigned int index = hash & (SPINLOCK_PROFILE_SLOTS - 1);
+
+    for (int probes = 0; probes < SPINLOCK_PROFILE_SLOTS; probes++)
+    {
+        SPINLOCK_SITE *slot = &profile[index];
+
+        if (!*(volatile int *)&slot->used)
+        {
+            while (__sync_lock_test_and_set(&profile_lock, 1))
+            {
+                SPINLOCK_PAUSE();
+            }
+            if (!slot->used)
+            {
+                memset(&slot->stats, 0, sizeof(slot->stats));
+                slot->stats.lock = lock;
+                slot->stats.name = lock->name;
+                slot->stats.site = site;
+                __sync_synchronize();
+                slot->used = 1;
+            }
+            __sync_lock_release(&profile_lock);
+        }
+
+        if (slot->stats.lock == lock && slot->stats.site == site)
+        {
+            return slot;
+        }
+        index = (index + 1) & (SPINLOCK_PROFILE_SLOTS - 1);
+    }
+    return NULL;
+}
+
+/**
+ * Wait until a spinlock is acquired.
+ *
+ * An uncontended lock is taken with one atomic operation. Otherwise the
+ * thread spins for a bounded number of rounds, backing off with an
+ * increasing number of pause instructions, and then sleeps on a futex
+ * until the holder releases the lock.
+ *
+ * @param lock The spinlock to acquire
+ * @return The number of spin rounds and sleeps before the lock was acquired
+ */
+static inline int
+spinlock_wait(SPINLOCK *lock)
+{
+    int spins = 0;
+
+    if (!__sync_bool_compare_and_swap(&(lock->lock), 0, 1))
+    {
+        int pauses = 1;
+        bool acquired = false;
+
+        while (!acquired && spins < SPINLOCK_SPIN_ROUNDS)
+        {
+            for (int i = 0; i < pauses; i++)
+            {
+                SPINLOCK_PAUSE();
+            }
+            if (pauses < SPINLOCK_MAX_PAUSES)
+            {
+                pauses *= 2;
+            }
+            spins++;
+            acquired = *(volatile int *)&lock->lock == 0 &&
+                       __sync_bool_compare_and_swap(&(lock->lock), 0, 1);
+        }
+
+        if (!acquired)
+        {
+            /**
+             * Mark the lock as having sleepers so that the releasing thread
+             * knows to wake one up. A thread that gets the lock this way keeps
+             * the mark, as other threads may still be sleeping on it.
+             */
+            while (__sync_lock_test_and_set(&(lock->lock), SPINLOCK_SLEEPERS) != 0)
+            {
+                spinlock_futex_wait(lock, SPINLOCK_SLEEPERS);
+                spins++;
+            }
+        }
+    }
+    return spins;
+}
+
 /**
  * Acquire a spinlock.
  *
+ * When the contention profile is enabled, a sample of the acquisitions is
+ * timed and the time the lock is then held is measured in spinlock_release.
+ *
  * @param lock The spinlock to acquire
  */
 void
 spinlock_acquire(SPINLOCK *lock)
 {
+    int spins;
 #if SPINLOCK_PROFILE
-    int spins = 0;
-
     atomic_add(&(lock->waiting), 1);
 #endif
 
-#ifdef __GNUC__
-    while (__sync_lock_test_and_set(&(lock->lock), 1))
-        while (lock->lock)
-        {
-#else
-    while (atomic_add(&(lock->lock), 1) != 0)
+    if (profiling && (++sample_count & (SPINLOCK_PROFILE_SAMPLE - 1)) == 0)
     {
-        atomic_add(&(lock->lock), -1);
-#endif
-#if SPINLOCK_PROFILE
-            atomic_add(&(lock->spins), 1);
-            spins++;
-#endif
+        CYCLES start = rdtsc();
+        SPINLOCK_SITE *site;
+
+        spins = spinlock_wait(lock);
+        lock->hold_start = rdtsc();
+
+        if ((site = spinlock_profile_find(lock, __builtin_return_address(0))))
+        {
+            uint64_t wait = lock->hold_start - start;
+
+            __sync_fetch_and_add(&site->stats.acquired, 1);
+            __sync_fetch_and_add(&site->stats.wait, wait);
+            spinlock_profile_max(&site->stats.max_wait, wait);
+            if (spins)
+            {
+                __sync_fetch_and_add(&site->stats.contended, 1);
+            }
         }
+        lock->site = site;
+    }
+    else
+    {
+        spins = spinlock_wait(lock);
+    }
 #if SPINLOCK_PROFILE
     if (spins)
     {
+        atomic_add(&(lock->spins), spins);
         lock->contended++;
         if (lock->maxspins < spins)
         {
@@ -98,18 +300,10 @@ spinlock_acquire(SPINLOCK *lock)
 int
 spinlock_acquire_nowait(SPINLOCK *lock)
 {
-#ifdef __GNUC__
-    if (__sync_lock_test_and_set(&(lock->lock), 1))
+    if (!__sync_bool_compare_and_swap(&(lock->lock), 0, 1))
     {
         return FALSE;
     }
-#else
-    if (atomic_add(&(lock->lock), 1) != 0)
-    {
-        atomic_add(&(lock->lock), -1);
-        return FALSE;
-    }
-#endif
 #if SPINLOCK_PROFILE
     lock->acquired++;
     lock->owner = thread_self();
@@ -120,6 +314,8 @@ spinlock_acquire_nowait(SPINLOCK *lock)
 /*
  * Release a spinlock.
  *
+ * If threads may be sleeping on the lock, one of them is woken up.
+ *
  * @param lock The spinlock to release
  */
 void
@@ -132,12 +328,20 @@ spinlock_release(SPINLOCK *lock)
         lock->max_waiting = lock->waiting;
     }
 #endif
-#ifdef __GNUC__
+    if (lock->site)
+    {
+        SPINLOCK_SITE *site = lock->site;
+        uint64_t hold = rdtsc() - lock->hold_start;
+
+        lock->site = NULL;
+        __sync_fetch_and_add(&site->stats.hold, hold);
+        spinlock_profile_max(&site->stats.max_hold, hold);
+    }
     __sync_synchronize(); /* Memory barrier. */
-    lock->lock = 0;
-#else
-    atomic_add(&(lock->lock), -1);
-#endif
+    if (__sync_lock_test_and_set(&(lock->lock), 0) == SPINLOCK_SLEEPERS)
+    {
+        spinlock_futex_wake(lock);
+    }
 }
 
 /**
@@ -177,3 +381,120 @@ spinlock_stats(SPINLOCK *lock, void (*reporter)(void *, char *, int), void *hdl)
     }
 #endif
 }
+
+/**
+ * Give a lock a name that identifies it in the contention profile
+ *
+ * @param lock The lock to name
+ * @param name The name, must outlive the lock
+ */
+void
+spinlock_set_name(SPINLOCK *lock, const char *name)
+{
+    lock->name = name;
+}
+
+/**
+ * Enable or disable the contention profile. Enabling the profile discards
+ * the data that was collected when it was last enabled.
+ *
+ * @param enable True to enable the profile, false to disable it
+ */
+void
+spinlock_profile_enable(bool enable)
+{
+    if (enable && !profiling)
+    {
+        while (__sync_lock_test_and_set(&profile_lock, 1))
+        {
+            SPINLOCK_PAUSE();
+        }
+        for (int i = 0; i < SPINLOCK_PROFILE_SLOTS; i++)
+        {
+            profile[i].used = 0;
+        }
+        __sync_lock_release(&profile_lock);
+    }
+    profiling = enable;
+}
+
+/**
+ * Check whether the contention profile is enabled
+ *
+ * @return True if acquisitions are being sampled
+ */
+bool
+spinlock_profile_enabled()
+{
+    return profiling;
+}
+
+/**
+ * Compare two profile entries so that the one that spent more time waiting
+ * for its lock comes first
+ */
+static int
+spinlock_profile_cmp(const void *a, const void *b)
+{
+    const SPINLOCK_PROFILE_ENTRY *e1 = (const SPINLOCK_PROFILE_ENTRY *)a;
+    const SPINLOCK_PROFILE_ENTRY *e2 = (const SPINLOCK_PROFILE_ENTRY *)b;
+
+    return e1->wait < e2->wait ? 1 : (e1->wait > e2->wait ? -1 : 0);
+}
+
+/**
+ * Copy the most contended entries of the contention profile. The entries are
+ * ordered by the total time spent waiting for the lock.
+ *
+ * @param entries   Array where the entries are copied
+ * @param n         Size of the array
+ * @return The number of entries copied
+ */
+int
+spinlock_profile_top(SPINLOCK_PROFILE_ENTRY *entries, int n)
+{
+    SPINLOCK_PROFILE_ENTRY *all;
+    int count = 0;
+
+    if ((all = (SPINLOCK_PROFILE_ENTRY *)malloc(sizeof(*all) * SPINLOCK_PROFILE_SLOTS)) == NULL)
+    {
+        return 0;
+    }
+
+    for (int i = 0; i < SPINLOCK_PROFILE_SLOTS; i++)
+    {
+        if (*(volatile int *)&profile[i].used)
+        {
+            all[count++] = profile[i].stats;
+        }
+    }
+
+    qsort(all, count, sizeof(*all), spinlock_profile_cmp);
+    count = count < n ? count : n;
+    memcpy(entries, all, sizeof(*all) * count);
+    free(all);
+    return count;
+}
+
+/**
+ * Describe a call site of the contention profile
+ *
+ * @param site  The call site
+ * @param buf   Buffer where the description is written
+ * @param len   Size of the buffer
+ */
+void
+spinlock_profile_site_name(void *site, char *buf, int len)
+{
+    char **symbols = backtrace_symbols(&site, 1);
+
+    if (symbols)
+    {
+        snprintf(buf, len, "%s", symbols[0]);
+        free(symbols);
+    }
+    else
+    {
+        snprintf(buf, len, "%p", site);
+    }
+}
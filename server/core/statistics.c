@@ -13,8 +13,24 @@
 
 #include <statistics.h>
 #include <maxconfig.h>
+#include <stdlib.h>
 #include <string.h>
 #include <platform.h>
+#include <skygw_debug.h>
+
+/**
+ * The value of one thread. Each value is on its own cache line.
+ */
+typedef struct ts_stats_slot
+{
+    int64_t value;
+    char    padding[MXS_CACHE_LINE_SIZE - sizeof(int64_t)];
+} TS_STATS_SLOT;
+
+struct ts_stats
+{
+    TS_STATS_SLOT slots[0];
+};
 
 thread_local int current_thread_id = 0;
 
@@ -23,12 +39,23 @@ static bool initialized = false;
 
 /**
  * Initialize the statistics gathering
+ *
+ * The number of threads must be known when this is called. Calling this
+ * more than once has no effect. If no threads have been configured, the
+ * statistics are only gathered for one thread.
  */
 void ts_stats_init()
 {
-    ss_dassert(!initialized);
-    thread_count = config_threadcount();
-    initialized = true;
+    if (!initialized)
+    {
+        thread_count = config_threadcount();
+
+        if (thread_count < 1)
+        {
+            thread_count = 1;
+        }
+        initialized = true;
+    }
 }
 
 /**
@@ -46,8 +73,22 @@ void ts_stats_end()
  */
 ts_stats_t ts_stats_alloc()
 {
-    ss_dassert(initialized);
-    return calloc(thread_count, sizeof(int));
+    void *stats;
+    size_t size;
+
+    if (!initialized)
+    {
+        ts_stats_init();
+    }
+
+    size = thread_count * sizeof(TS_STATS_SLOT);
+
+    if (posix_memalign(&stats, MXS_CACHE_LINE_SIZE, size) != 0)
+    {
+        return NULL;
+    }
+    memset(stats, 0, size);
+    return (ts_stats_t)stats;
 }
 
 /**
@@ -57,7 +98,6 @@ ts_stats_t ts_stats_alloc()
  */
 void ts_stats_free(ts_stats_t stats)
 {
-    ss_dassert(initialized);
     free(stats);
 }
 
@@ -70,6 +110,7 @@ void ts_stats_free(ts_stats_t stats)
 void ts_stats_set_thread_id(int id)
 {
     ss_dassert(initialized);
+    ss_dassert(id >= 0 && id < thread_count);
     current_thread_id = id;
 }
 
@@ -79,10 +120,10 @@ void ts_stats_set_thread_id(int id)
  * @param stats Statistics to add to
  * @param value Value to add
  */
-void ts_stats_add(ts_stats_t stats, int value)
+void ts_stats_add(ts_stats_t stats, int64_t value)
 {
     ss_dassert(initialized);
-    ((int*)stats)[current_thread_id] += value;
+    stats->slots[current_thread_id].value += value;
 }
 
 /**
@@ -92,10 +133,10 @@ void ts_stats_add(ts_stats_t stats, int value)
  * @param stats Statistics to set
  * @param value Value to set to
  */
-void ts_stats_set(ts_stats_t stats, int value)
+void ts_stats_set(ts_stats_t stats, int64_t value)
 {
     ss_dassert(initialized);
-    ((int*)stats)[current_thread_id] = value;
+    stats->slots[current_thread_id].value = value;
 }
 
 /**
@@ -104,13 +145,56 @@ void ts_stats_set(ts_stats_t stats, int value)
  * @param stats Statistics to read
  * @return Value of statistics
  */
-int ts_stats_sum(ts_stats_t stats)
+int64_t ts_stats_sum(ts_stats_t stats)
 {
     ss_dassert(initialized);
-    int sum = 0;
+    int64_t sum = 0;
     for (int i = 0; i < thread_count; i++)
     {
-        sum += ((int*)stats)[i];
+        sum += stats->slots[i].value;
     }
     return sum;
 }
+
+/**
+ * Read the combined value of the statistics object
+ *
+ * @param stats Statistics to read
+ * @param type  How the values of the threads are combined
+ * @return Combined value of statistics
+ */
+int64_t ts_stats_get(ts_stats_t stats, ts_stats_type_t type)
+{
+    ss_dassert(initialized);
+    int64_t best = stats->slots[0].value;
+
+    switch (type)
+    {
+    case TS_STATS_MAX:
+        for (int i = 1; i < thread_count; i++)
+        {
+            if (stats->slots[i].value > best)
+            {
+                best = stats->slots[i].value;
+            }
+        }
+        return best;
+
+    case TS_STATS_MIN:
+        for (int i = 1; i < thread_count; i++)
+        {
+            if (stats->slots[i].value < best)
+            {
+                best = stats->slots[i].value;
+            }
+        }
+        return best;
+
+    case TS_STATS_AVG:
+        return ts_stats_sum(stats) / thread_count;
+
+    case TS_STATS_SUM:
+    default:
+        return ts_stats_sum(stats);
+    }
+}
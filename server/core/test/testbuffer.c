@@ -32,6 +32,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <buffer.h>
 #include <hint.h>
@@ -314,10 +315,150 @@ void test_consume()
     consume_buffer(n_buffers - 1, -1);
 }
 
+/** gwbuf_iter, gwbuf_iovec and gwbuf_compare tests */
+void test_iterators()
+{
+    uint8_t data[] = {1, 2, 3, 4, 5, 6, 7, 8};
+    GWBUF* chain = gwbuf_append(gwbuf_alloc_and_load(3, data), gwbuf_alloc_and_load(5, data + 3));
+    GWBUF* flat = gwbuf_alloc_and_load(8, data);
+    GWBUF* other = gwbuf_alloc_and_load(7, data);
+    struct iovec iov[4];
+    GWBUF_ITER iter;
+    uint8_t *ptr;
+    size_t len;
+
+    ss_dfprintf(stderr, "testbuffer : iterating over buffer segments");
+    ss_info_dassert(!GWBUF_IS_CONTIGUOUS(chain) && GWBUF_IS_CONTIGUOUS(flat),
+                    "Only the chain should be non-contiguous");
+
+    gwbuf_iter_init(&iter, chain, 2, 4);
+    ss_info_dassert(gwbuf_iter_next(&iter, &ptr, &len) && len == 1 && *ptr == 3,
+                    "First segment should be the last byte of the first buffer");
+    ss_info_dassert(gwbuf_iter_next(&iter, &ptr, &len) && len == 3 && *ptr == 4,
+                    "Second segment should be three bytes of the second buffer");
+    ss_info_dassert(!gwbuf_iter_next(&iter, &ptr, &len), "The range should end after 4 bytes");
+
+    ss_info_dassert(gwbuf_iovec(chain, 0, SIZE_MAX, iov, 4) == 2, "The chain should have two segments");
+    ss_info_dassert(iov[0].iov_len == 3 && iov[1].iov_len == 5, "The segments should be 3 and 5 bytes");
+    ss_info_dassert(gwbuf_iovec(chain, 0, SIZE_MAX, iov, 1) == -1, "One vector should not be enough");
+    ss_info_dassert(gwbuf_iovec(chain, 4, 2, iov, 1) == 1 && iov[0].iov_len == 2,
+                    "A range within one buffer should be one segment");
+
+    ss_info_dassert(gwbuf_compare(chain, flat) == 0, "The chain should equal the contiguous buffer");
+    ss_info_dassert(gwbuf_compare(other, chain) < 0, "A prefix should be smaller");
+    ss_info_dassert(gwbuf_compare(chain, other) > 0, "A longer buffer should be greater");
+    ss_info_dassert(gwbuf_compare(NULL, NULL) == 0, "Empty buffers should be equal");
+    ((uint8_t*)GWBUF_DATA(flat))[6] = 0;
+    ss_info_dassert(gwbuf_compare(chain, flat) > 0, "A differing byte should decide the order");
+
+    gwbuf_free(chain);
+    gwbuf_free(flat);
+    gwbuf_free(other);
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+static int n_objects_freed = 0;
+
+static void free_test_object(void *data)
+{
+    n_objects_freed++;
+}
+
+void test_buffer_objects()
+{
+    uint8_t data[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+    int object = 0;
+    GWBUF* buffer = gwbuf_alloc_and_load(sizeof(data), data);
+
+    gwbuf_add_buffer_object(buffer, GWBUF_PARSING_INFO, &object, free_test_object);
+    ss_info_dassert(GWBUF_IS_PARSED(buffer), "Buffer should have the object");
+
+    GWBUF* clone = gwbuf_clone(buffer);
+    ss_info_dassert(gwbuf_get_buffer_object_data(clone, GWBUF_PARSING_INFO) == &object,
+                    "Clone should see the object of the original buffer");
+
+    clone = gwbuf_consume(clone, 1);
+    ss_info_dassert(!GWBUF_IS_PARSED(clone), "Consumed clone should not see the object");
+    ss_info_dassert(GWBUF_IS_PARSED(buffer), "Original buffer should still see the object");
+
+    gwbuf_clear_buffer_object(buffer, GWBUF_PARSING_INFO);
+    ss_info_dassert(n_objects_freed == 1, "Cleared object should be freed");
+    ss_info_dassert(!GWBUF_IS_PARSED(buffer), "Buffer should not have the cleared object");
+
+    gwbuf_add_buffer_object(buffer, GWBUF_PARSING_INFO, &object, free_test_object);
+    gwbuf_free(buffer);
+    ss_info_dassert(n_objects_freed == 1, "Object should live as long as the clone");
+    gwbuf_free(clone);
+    ss_info_dassert(n_objects_freed == 2, "Object should be freed with the data");
+
+    buffer = gwbuf_append(gwbuf_alloc_and_load(5, data),
+                          gwbuf_alloc_and_load(5, data + 5));
+    gwbuf_add_buffer_object(buffer, GWBUF_PARSING_INFO, &object, free_test_object);
+    buffer = gwbuf_make_contiguous(buffer);
+    ss_info_dassert(gwbuf_get_buffer_object_data(buffer, GWBUF_PARSING_INFO) == &object,
+                    "Contiguous buffer should keep the object");
+    gwbuf_free(buffer);
+    ss_info_dassert(n_objects_freed == 3, "Object should be freed with the contiguous buffer");
+}
+
 /**
  * test1    Allocate a buffer and do lots of things
  *
  */
+#define N_SMALL_BUFFERS 10000
+
+/**
+ * Allocation counts and timing of tiny buffers, e.g. OK packets
+ */
+void test_small_buffers()
+{
+    static GWBUF *buffers[N_SMALL_BUFFERS];
+    static const uint8_t ok_packet[] = {0x07, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00};
+    struct timespec start, end;
+
+    ss_dfprintf(stderr, "testbuffer : allocating %d small buffers", N_SMALL_BUFFERS);
+
+    GWBUF *buffer = gwbuf_alloc_and_load(sizeof(ok_packet), (void*)ok_packet);
+    ss_info_dassert((uint8_t*)GWBUF_DATA(buffer) > (uint8_t*)buffer &&
+                    (uint8_t*)GWBUF_DATA(buffer) < (uint8_t*)buffer + 256,
+                    "The data of a small buffer should be stored with its header");
+    gwbuf_free(buffer);
+
+    int64_t before = gwbuf_pool_allocations();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < N_SMALL_BUFFERS; i++)
+    {
+        buffers[i] = gwbuf_alloc_and_load(sizeof(ok_packet), (void*)ok_packet);
+    }
+    for (int i = 0; i < N_SMALL_BUFFERS; i++)
+    {
+        gwbuf_free(buffers[i]);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    int64_t first = gwbuf_pool_allocations() - before;
+    ss_info_dassert(first <= N_SMALL_BUFFERS, "A small buffer should take at most one allocation");
+    ss_dfprintf(stderr, "\t..done\n%ld allocations, %ld ns per buffer",
+                (long)first, (long)(((end.tv_sec - start.tv_sec) * 1000000000 +
+                                     end.tv_nsec - start.tv_nsec) / N_SMALL_BUFFERS));
+
+    before = gwbuf_pool_allocations();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < N_SMALL_BUFFERS; i++)
+    {
+        gwbuf_free(gwbuf_alloc_and_load(sizeof(ok_packet), (void*)ok_packet));
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ss_info_dassert(gwbuf_pool_allocations() == before,
+                    "Reused small buffers should not be allocated");
+    ss_dfprintf(stderr, "\nReused buffers: 0 allocations, %ld ns per buffer\t..done\n",
+                (long)(((end.tv_sec - start.tv_sec) * 1000000000 +
+                        end.tv_nsec - start.tv_nsec) / N_SMALL_BUFFERS));
+}
+
 static int
 test1()
 {
@@ -371,6 +512,15 @@ test1()
     ss_dfprintf(stderr, "\nCloned buffer length is now %d", buflen);
     ss_info_dassert(size == buflen, "Incorrect buffer size");
     ss_info_dassert(0 == GWBUF_EMPTY(clone), "Cloned buffer should not be empty");
+    ss_info_dassert(clone->hint == buffer->hint, "Cloned buffer should share the hints");
+    ss_info_dassert(0 == strcmp("value", gwbuf_get_property(clone, "name")),
+                    "Cloned buffer should have the property");
+    gwbuf_add_hint(clone, hint_create_route(NULL, HINT_ROUTE_TO_MASTER, NULL));
+    ss_info_dassert(clone->hint != buffer->hint, "Shared hints should be copied when added to");
+    ss_info_dassert(clone->hint->next && clone->hint->next->type == HINT_ROUTE_TO_MASTER,
+                    "Cloned buffer should have both hints");
+    ss_info_dassert(buffer->hint == hint && hint->next == NULL,
+                    "Original buffer should only have the first hint");
     ss_dfprintf(stderr, "\t..done\n");
     gwbuf_free(clone);
     ss_dfprintf(stderr, "Freed cloned buffer");
@@ -441,6 +591,9 @@ test1()
     test_split();
     test_load_and_copy();
     test_consume();
+    test_buffer_objects();
+    test_iterators();
+    test_small_buffers();
 
     return 0;
 }
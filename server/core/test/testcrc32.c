@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * Tests of the CRC-32 computed with the instructions of the CPU and a
+ * comparison of its speed with zlib.
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+#include <skygw_debug.h>
+#include <crc32.h>
+
+/** Size of the test data */
+#define DATA_LEN 4096
+
+/** Bytes checksummed by the benchmark for each event size */
+#define BENCH_BYTES (256 * 1024 * 1024)
+
+static uint8_t data[DATA_LEN + 16];
+
+static void test_lengths()
+{
+    ss_dfprintf(stderr, "testcrc32 : all lengths and alignments.");
+
+    for (int offset = 0; offset < 16; offset++)
+    {
+        for (size_t len = 0; len <= DATA_LEN; len += len < 300 ? 1 : 61)
+        {
+            uint32_t expected = crc32(0L, data + offset, len);
+            ss_info_dassert(mxs_crc32(0, data + offset, len) == expected,
+                            "Checksum must match zlib");
+        }
+    }
+
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+static void test_parts()
+{
+    ss_dfprintf(stderr, "testcrc32 : checksum computed in parts.");
+
+    uint32_t expected = crc32(0L, data, DATA_LEN);
+
+    for (size_t split = 0; split <= DATA_LEN; split += 7)
+    {
+        uint32_t crc = mxs_crc32(0, data, split);
+        crc = mxs_crc32(crc, data + split, DATA_LEN - split);
+        ss_info_dassert(crc == expected, "Checksum of the parts must match the whole");
+    }
+
+    ss_info_dassert(mxs_crc32(0, NULL, 0) == 0, "Initial value must be zero");
+    ss_info_dassert(mxs_crc32(0, (const uint8_t *)"123456789", 9) == 0xcbf43926,
+                    "Checksum must match the check value of CRC-32");
+
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+static void bench(size_t len)
+{
+    size_t n = BENCH_BYTES / len;
+    uint8_t *buf = malloc(len);
+    uint32_t crc = 0;
+    clock_t start;
+
+    ss_info_dassert(buf, "Allocation must succeed");
+    memset(buf, 0xa5, len);
+
+    start = clock();
+    for (size_t i = 0; i < n; i++)
+    {
+        crc = crc32(crc, buf, len);
+    }
+    double zlib_time = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    start = clock();
+    for (size_t i = 0; i < n; i++)
+    {
+        crc = mxs_crc32(crc, buf, len);
+    }
+    double crc_time = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    ss_dfprintf(stderr, "testcrc32 : %lu byte events: zlib %.0f MB/s, %s %.0f MB/s (%08x)\n",
+                len, BENCH_BYTES / 1048576.0 / (zlib_time ? zlib_time : 1e-9), mxs_crc32_impl(),
+                BENCH_BYTES / 1048576.0 / (crc_time ? crc_time : 1e-9), crc);
+    free(buf);
+}
+
+int main(void)
+{
+    for (int i = 0; i < sizeof(data); i++)
+    {
+        data[i] = random();
+    }
+
+    test_lengths();
+    test_parts();
+
+    bench(64);
+    bench(512);
+    bench(8192);
+    bench(65536);
+
+    return 0;
+}
@@ -32,6 +32,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
 #include <listener.h>
 #include <dcb.h>
 
@@ -77,11 +79,112 @@ test1()
     return 0;
 }
 
+/**
+ * test2    Send a header and a file region to a socket with dcb_sendfile
+ *
+ */
+static int
+test2()
+{
+    DCB *dcb;
+    SERV_LISTENER dummy;
+    int fds[2];
+    char path[] = "/tmp/testdcb_XXXXXX";
+    char data[4096];
+    char head[] = "head";
+    char result[sizeof(head) - 1 + 1000];
+    bool blocked;
+    int fd;
+    int n = 0;
+
+    ss_dfprintf(stderr, "testdcb : sending a file region with dcb_sendfile");
+
+    for (int i = 0; i < sizeof(data); i++)
+    {
+        data[i] = i % 251;
+    }
+    fd = mkstemp(path);
+    ss_info_dassert(fd != -1, "Temporary file must be created");
+    ss_info_dassert(write(fd, data, sizeof(data)) == sizeof(data), "File must be written");
+    ss_info_dassert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0, "Socket pair must be created");
+
+    dcb = dcb_alloc(DCB_ROLE_CLIENT_HANDLER, &dummy);
+    dcb->fd = fds[0];
+    dcb->state = DCB_STATE_POLLING;
+
+    ss_info_dassert(dcb_sendfile(dcb, (uint8_t *)head, sizeof(head) - 1, fd, 100, 1000, &blocked) == 1,
+                    "Sending must succeed");
+    ss_info_dassert(!blocked, "Sending must not block");
+    ss_info_dassert(dcb->writeq == NULL, "Nothing must be queued");
+
+    while (n < sizeof(result))
+    {
+        int rc = read(fds[1], result + n, sizeof(result) - n);
+        ss_info_dassert(rc > 0, "Data must be readable");
+        n += rc;
+    }
+    ss_info_dassert(memcmp(result, head, sizeof(head) - 1) == 0, "Header must be sent first");
+    ss_info_dassert(memcmp(result + sizeof(head) - 1, data + 100, 1000) == 0,
+                    "File region must follow the header");
+
+    dcb->writeq = gwbuf_alloc(1);
+    ss_info_dassert(dcb_sendfile(dcb, (uint8_t *)head, sizeof(head) - 1, fd, 0, 10, &blocked) == 0,
+                    "Nothing must be sent while data is queued");
+    gwbuf_free(dcb->writeq);
+    dcb->writeq = NULL;
+
+    dcb->fd = DCBFD_CLOSED;
+    dcb->state = DCB_STATE_ALLOC;
+    dcb_close(dcb);
+    close(fds[0]);
+    close(fds[1]);
+    close(fd);
+    unlink(path);
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+/**
+ * test3    The DCB counts follow the allocation and freeing of DCBs
+ *
+ */
+static int
+test3()
+{
+    DCB *client, *backend;
+    SERV_LISTENER dummy;
+    int all = dcb_count_by_usage(DCB_USAGE_ALL);
+    int clients = dcb_count_by_usage(DCB_USAGE_CLIENT);
+    int backends = dcb_count_by_usage(DCB_USAGE_BACKEND);
+
+    ss_dfprintf(stderr, "testdcb : counting DCBs by usage");
+
+    client = dcb_alloc(DCB_ROLE_CLIENT_HANDLER, &dummy);
+    backend = dcb_alloc(DCB_ROLE_BACKEND_HANDLER, NULL);
+    ss_info_dassert(dcb_count_by_usage(DCB_USAGE_ALL) == all + 2, "Both DCBs must be counted");
+    ss_info_dassert(dcb_count_by_usage(DCB_USAGE_CLIENT) == clients + 1, "Client DCB must be counted");
+    ss_info_dassert(dcb_count_by_usage(DCB_USAGE_BACKEND) == backends + 1, "Backend DCB must be counted");
+    ss_info_dassert(dcb_count_by_usage(DCB_USAGE_INTERNAL) == clients + backends + 2,
+                    "Internal DCBs are the clients and the backends");
+
+    dcb_close(client);
+    dcb_close(backend);
+    ss_info_dassert(dcb_count_by_usage(DCB_USAGE_ALL) == all, "Freed DCBs must not be counted");
+    ss_info_dassert(dcb_count_by_usage(DCB_USAGE_CLIENT) == clients, "Freed client must not be counted");
+    ss_info_dassert(dcb_count_by_usage(DCB_USAGE_BACKEND) == backends, "Freed backend must not be counted");
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     int result = 0;
 
     result += test1();
+    result += test2();
+    result += test3();
 
     exit(result);
 }
@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * Tests of the SQL statement fingerprints
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fingerprint.h>
+#include <modutil.h>
+#include <mysql_client_server_protocol.h>
+#include <skygw_debug.h>
+
+static struct
+{
+    const char *sql;
+    const char *fingerprint;
+} tests[] =
+{
+    {"SELECT * FROM t1 WHERE id = 1", "select*from t1 where id=?"},
+    {"select  *\n from\tT1 where ID=  42 ;", "select*from t1 where id=?"},
+    {"SELECT a FROM t1 WHERE b = 'it''s' AND c = \"x\\\"y\"", "select a from t1 where b=? and c=?"},
+    {"SELECT * FROM t1 WHERE id IN (1, 2, 3)", "select*from t1 where id in(?+)"},
+    {"SELECT * FROM t1 WHERE id in ('a')", "select*from t1 where id in(?+)"},
+    {"SELECT * FROM t1 WHERE id IN (1, a, 3)", "select*from t1 where id in(?+,a,?)"},
+    {"SELECT * FROM t1 WHERE id IN (SELECT id FROM t2)", "select*from t1 where id in(select id from t2)"},
+    {"SELECT 1.5, -2, .5e10, 0x1F, X'4D', b'01', _utf8'x', ?", "select ?,?,?,?,?,?,?,?"},
+    {"SELECT a-1, a - -1 FROM t1", "select a-?,a-? from t1"},
+    {"SELECT /* comment */ a # another\n FROM t1 -- and one more", "select a from t1"},
+    {"SELECT 1; SELECT 2;;", "select ?;select ?"},
+    {"SELECT `Weird Name`, t1.c2 FROM `db`.`T1`", "select `Weird Name`,t1.c2 from `db`.`T1`"},
+    {"SELECT @@version, @a", "select @@version,@a"},
+    {"INSERT INTO t1 VALUES (1, 'a'), (2, 'b')", "insert into t1 values(?,?),(?,?)"},
+    {"SELECT 1abc FROM t1", "select 1abc from t1"},
+    {"SELECT 'unterminated", "select ?"},
+    {"", ""}
+};
+
+static void test_fingerprints()
+{
+    char buf[256];
+
+    ss_dfprintf(stderr, "testfingerprint : fingerprints of statements");
+
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+    {
+        uint64_t hash;
+        size_t len = fingerprint_sql(tests[i].sql, strlen(tests[i].sql), buf, sizeof(buf), &hash);
+
+        if (strcmp(buf, tests[i].fingerprint) != 0)
+        {
+            ss_dfprintf(stderr, "\nExpected \"%s\", got \"%s\"\n", tests[i].fingerprint, buf);
+        }
+        ss_info_dassert(strcmp(buf, tests[i].fingerprint) == 0, "The fingerprint must be the expected one");
+        ss_info_dassert(len == strlen(buf), "The length must be that of the fingerprint");
+        ss_info_dassert(hash == fingerprint_hash(tests[i].sql, strlen(tests[i].sql)),
+                        "The hash must not depend on whether the fingerprint is stored");
+    }
+
+    const char *a = "SELECT * FROM t1 WHERE id IN (1, 2, 3)";
+    const char *b = "select * from T1 where id in (42)";
+    ss_info_dassert(fingerprint_hash(a, strlen(a)) == fingerprint_hash(b, strlen(b)),
+                    "Statements that differ in literals must have the same hash");
+
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+static void test_truncation()
+{
+    const char *sql = "SELECT * FROM t1 WHERE id = 1";
+    const char *expected = "select*from t1 where id=?";
+    char buf[10];
+    uint64_t hash;
+
+    ss_dfprintf(stderr, "testfingerprint : truncated fingerprints");
+
+    size_t len = fingerprint_sql(sql, strlen(sql), buf, sizeof(buf), &hash);
+    ss_info_dassert(len == strlen(expected), "The length must be that of the whole fingerprint");
+    ss_info_dassert(strlen(buf) == sizeof(buf) - 1, "The fingerprint must fill the buffer");
+    ss_info_dassert(strncmp(buf, expected, sizeof(buf) - 1) == 0, "The start must be correct");
+    ss_info_dassert(hash == fingerprint_hash(sql, strlen(sql)), "The hash must cover the whole fingerprint");
+    ss_info_dassert(fingerprint_sql(sql, strlen(sql), NULL, 0, NULL) == len,
+                    "The length must be returned without an output buffer");
+
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+static void test_buffers()
+{
+    const char *sql = "SELECT * FROM t1 WHERE id IN (1)";
+    const char *expected = "select*from t1 where id in(?+)";
+    int len = strlen(sql);
+
+    ss_dfprintf(stderr, "testfingerprint : fingerprints of buffers");
+
+    GWBUF *buf = gwbuf_alloc(MYSQL_HEADER_LEN + 1 + len);
+    uint8_t *data = GWBUF_DATA(buf);
+    data[0] = len + 1;
+    data[1] = 0;
+    data[2] = 0;
+    data[3] = 0;
+    data[4] = 0x03;
+    memcpy(data + 5, sql, len);
+
+    uint64_t hash;
+    char *fp = modutil_get_fingerprint(buf, &hash);
+    ss_info_dassert(fp && strcmp(fp, expected) == 0, "The fingerprint of a buffer must be correct");
+    ss_info_dassert(hash == fingerprint_hash(sql, len), "The hash must be the one of the statement");
+    free(fp);
+
+    /** The same statement split across three buffers */
+    GWBUF *rest = gwbuf_clone(buf);
+    GWBUF *chain = gwbuf_split(&rest, 10);
+    chain = gwbuf_append(chain, gwbuf_split(&rest, 12));
+    chain = gwbuf_append(chain, rest);
+    ss_info_dassert(!GWBUF_IS_CONTIGUOUS(chain), "The statement must be in a chain");
+    fp = modutil_get_fingerprint(chain, NULL);
+    ss_info_dassert(fp && strcmp(fp, expected) == 0, "The fingerprint of a chain must be correct");
+    free(fp);
+
+    gwbuf_free(chain);
+    gwbuf_free(buf);
+
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+static void benchmark()
+{
+    static char sql[16 * 1024];
+    static char dest[sizeof(sql) + 16];
+    int len = snprintf(sql, sizeof(sql), "INSERT INTO t1 VALUES ");
+
+    while (len < (int)sizeof(sql) - 64)
+    {
+        len += snprintf(sql + len, sizeof(sql) - len, "(1234, 'some text value', \"more\"),");
+    }
+    sql[len - 1] = ';';
+
+    const int rounds = 200;
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < rounds; i++)
+    {
+        fingerprint_sql(sql, len, dest, sizeof(dest), NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double ns = ((end.tv_sec - start.tv_sec) * 1e9 + end.tv_nsec - start.tv_nsec) / rounds;
+    ss_dfprintf(stderr, "testfingerprint : fingerprints of a %d byte statement at %.2f GB/s\n",
+                len, len / ns);
+}
+
+int main(int argc, char **argv)
+{
+    test_fingerprints();
+    test_truncation();
+    test_buffers();
+    benchmark();
+    return 0;
+}
@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * Tests of the open addressing hash map and a comparison of its lookup
+ * speed with the chained hashtable.
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <flatmap.h>
+#include <hashtable.h>
+
+/** Number of lookups done by the benchmark for each table */
+#define N_LOOKUPS 2000000
+
+static int hfun(void* key)
+{
+    int *i = (int *)key;
+    int j = (*i * 23) + 41;
+    return j;
+}
+
+static int cmpfun(void* v1, void* v2)
+{
+    int i1 = *(int *)v1;
+    int i2 = *(int *)v2;
+
+    return (i1 < i2 ? -1 : (i1 > i2 ? 1 : 0));
+}
+
+/**
+ * Add, fetch, delete and iterate over a number of elements
+ *
+ * @param nelems Number of elements to use
+ * @param size   Initial size of the map
+ * @return True if the test passed
+ */
+static bool do_flatmaptest(int nelems, int size)
+{
+    FLATMAP *map;
+    FLATMAP_ITERATOR *iter;
+    int *val_arr;
+    int i;
+
+    ss_dfprintf(stderr, "testflatmap : map of size %d with %d elements.", size, nelems);
+
+    val_arr = (int *)malloc(sizeof(int) * nelems);
+    map = flatmap_alloc(size, hfun, cmpfun);
+    ss_info_dassert(map != NULL, "Map allocation must succeed");
+
+    for (i = 0; i < nelems; i++)
+    {
+        val_arr[i] = i;
+        ss_info_dassert(flatmap_add(map, &val_arr[i], &val_arr[i]) == 1, "Add must succeed");
+    }
+    ss_info_dassert(flatmap_size(map) == nelems, "Invalid element count");
+
+    for (i = 0; i < nelems; i++)
+    {
+        ss_info_dassert(flatmap_add(map, &val_arr[i], &val_arr[i]) == 0, "Duplicate add must fail");
+        ss_info_dassert(flatmap_fetch(map, &val_arr[i]) == &val_arr[i], "Fetched wrong value");
+    }
+
+    /** Delete every other element and check that the rest are still found */
+    for (i = 0; i < nelems; i += 2)
+    {
+        ss_info_dassert(flatmap_delete(map, &val_arr[i]) == 1, "Delete must succeed");
+    }
+    for (i = 0; i < nelems; i++)
+    {
+        void *value = flatmap_fetch(map, &val_arr[i]);
+        ss_info_dassert(i % 2 ? value == &val_arr[i] : value == NULL, "Wrong value after delete");
+    }
+    ss_info_dassert(flatmap_size(map) == nelems / 2, "Invalid element count after delete");
+
+    iter = flatmap_iterator(map);
+    for (i = 0; flatmap_next(iter); i++)
+    {
+        ;
+    }
+    flatmap_iterator_free(iter);
+    ss_info_dassert(i == nelems / 2, "Incorrect number of elements from iterator");
+
+    flatmap_free(map);
+    free(val_arr);
+    ss_dfprintf(stderr, "\t..done\n");
+    return true;
+}
+
+/**
+ * Compare the lookup speed of the map and the hashtable
+ *
+ * @param nelems Number of elements in the tables
+ */
+static void do_benchmark(int nelems)
+{
+    FLATMAP *map = flatmap_alloc(nelems, hfun, cmpfun);
+    HASHTABLE *table = hashtable_alloc(nelems, hfun, cmpfun);
+    int *val_arr = (int *)malloc(sizeof(int) * nelems);
+    clock_t start;
+    double map_time, table_time;
+    int i;
+
+    for (i = 0; i < nelems; i++)
+    {
+        val_arr[i] = i;
+        flatmap_add(map, &val_arr[i], &val_arr[i]);
+        hashtable_add(table, &val_arr[i], &val_arr[i]);
+    }
+
+    start = clock();
+    for (i = 0; i < N_LOOKUPS; i++)
+    {
+        ss_info_dassert(flatmap_fetch(map, &val_arr[i % nelems]), "Value must be found");
+    }
+    map_time = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    start = clock();
+    for (i = 0; i < N_LOOKUPS; i++)
+    {
+        ss_info_dassert(hashtable_fetch(table, &val_arr[i % nelems]), "Value must be found");
+    }
+    table_time = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    ss_dfprintf(stderr, "testflatmap : %d lookups from %d elements: "
+                "flatmap %.3fs, hashtable %.3fs\n",
+                N_LOOKUPS, nelems, map_time, table_time);
+
+    flatmap_free(map);
+    hashtable_free(table);
+    free(val_arr);
+}
+
+int main(void)
+{
+    if (!do_flatmaptest(0, 0) ||
+        !do_flatmaptest(1, 1) ||
+        !do_flatmaptest(10, 1) ||
+        !do_flatmaptest(1000, 10) ||
+        !do_flatmaptest(10000, 10000))
+    {
+        return 1;
+    }
+
+    do_benchmark(16);
+    do_benchmark(1000);
+    do_benchmark(100000);
+
+    return 0;
+}
@@ -98,7 +98,8 @@ static double start;
  */
 static bool do_hashtest(
     int argelems,
-    int argsize)
+    int argsize,
+    bool concurrent)
 {
     bool       succp = true;
     HASHTABLE* h;
@@ -110,15 +111,17 @@ static bool do_hashtest(
     int*       iter;
 
     ss_dfprintf(stderr,
-                "testhash : creating hash table of size %d, including %d "
+                "testhash : creating %shash table of size %d, including %d "
                 "elements in total, at time %g.",
+                concurrent ? "concurrent " : "",
                 argsize,
                 argelems,
                 (double)clock() - start);
 
     val_arr = (int *)malloc(sizeof(void *)*argelems);
 
-    h = hashtable_alloc(argsize, hfun, cmpfun);
+    h = concurrent ? hashtable_alloc_concurrent(argsize, hfun, cmpfun) :
+        hashtable_alloc(argsize, hfun, cmpfun);
 
     ss_dfprintf(stderr, "\t..done\nAdd %d elements to hash table.", argelems);
 
@@ -142,6 +145,12 @@ static bool do_hashtest(
     ss_info_dassert((nelems == argelems) || (nelems == 0 && argsize == 0),
                     "Invalid element count");
     ss_info_dassert(longest <= nelems, "Too large longest list value");
+    ss_info_dassert(hashtable_size(h) == argelems, "Invalid number of added elements");
+
+    for (i = 0; i < argelems; i++)
+    {
+        ss_info_dassert(hashtable_fetch(h, &val_arr[i]) == &val_arr[i], "Fetched wrong value");
+    }
     if (argelems > 1000)
     {
         ss_dfprintf(stderr, "\t..done\nOperation took %g", (double)clock() - start);
@@ -191,53 +200,59 @@ static bool do_hashtest(
  * @details (write detailed description here)
  *
  */
-int main(void)
+static bool run_tests(bool concurrent)
 {
-    int rc = 1;
-    start = (double) clock();
+    bool rc = false;
 
-    if (!do_hashtest(0, 1))
+    if (!do_hashtest(0, 1, concurrent))
     {
         goto return_rc;
     }
-    if (!do_hashtest(10, 1))
+    if (!do_hashtest(10, 1, concurrent))
     {
         goto return_rc;
     }
-    if (!do_hashtest(1000, 10))
+    if (!do_hashtest(1000, 10, concurrent))
     {
         goto return_rc;
     }
-    if (!do_hashtest(10, 0))
+    if (!do_hashtest(10, 0, concurrent))
     {
         goto return_rc;
     }
-    if (!do_hashtest(10, -5))
+    if (!do_hashtest(10, -5, concurrent))
     {
         goto return_rc;
     }
-    if (!do_hashtest(1500, 17))
+    if (!do_hashtest(1500, 17, concurrent))
     {
         goto return_rc;
     }
-    if (!do_hashtest(1, 1))
+    if (!do_hashtest(1, 1, concurrent))
     {
         goto return_rc;
     }
-    if (!do_hashtest(10000, 133))
+    if (!do_hashtest(10000, 133, concurrent))
     {
         goto return_rc;
     }
-    if (!do_hashtest(1000, 1000))
+    if (!do_hashtest(1000, 1000, concurrent))
     {
         goto return_rc;
     }
-    if (!do_hashtest(1000, 100000))
+    if (!do_hashtest(1000, 100000, concurrent))
     {
         goto return_rc;
     }
 
-    rc = 0;
+    rc = true;
 return_rc:
     return rc;
 }
+
+int main(void)
+{
+    start = (double) clock();
+
+    return run_tests(false) && run_tests(true) ? 0 : 1;
+}
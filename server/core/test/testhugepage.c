@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * Tests of the huge page arenas
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <hugepage.h>
+#include <skygw_debug.h>
+
+#define N_OBJECTS 20000
+
+static HUGEPAGE_ARENA test_arena = HUGEPAGE_ARENA_INIT("test", 200);
+static void *objects[N_OBJECTS];
+
+static void test_arena_objects()
+{
+    ss_dfprintf(stderr, "testhugepage : allocating from an arena.");
+
+    /** A malloc'd object of the same size can be freed to the arena */
+    void *early = hugepage_alloc(&test_arena);
+    ss_info_dassert(early != NULL, "Allocation before the initialisation must succeed");
+
+    hugepage_init(HUGE_PAGES_TRANSPARENT);
+    hugepage_free(&test_arena, early);
+    ss_info_dassert(test_arena.n_free == 1, "The early object must be on the free list");
+    ss_info_dassert(hugepage_alloc(&test_arena) == early, "The early object must be reused");
+
+    for (int i = 0; i < N_OBJECTS; i++)
+    {
+        objects[i] = hugepage_alloc(&test_arena);
+        ss_info_dassert(objects[i] != NULL, "Allocation must succeed");
+        ss_info_dassert(((uintptr_t)objects[i] & 15) == 0, "Objects must be aligned");
+        memset(objects[i], i & 0xff, 200);
+    }
+
+    ss_info_dassert(test_arena.regions + test_arena.fallbacks >= 2,
+                    "The objects must not fit in one region");
+    ss_info_dassert(test_arena.objects + test_arena.fallbacks == N_OBJECTS,
+                    "Each object must be counted once");
+
+    for (int i = 0; i < N_OBJECTS; i++)
+    {
+        unsigned char *obj = objects[i];
+        ss_info_dassert(obj[0] == (i & 0xff) && obj[199] == (i & 0xff),
+                        "Objects must not overlap");
+    }
+
+    for (int i = 0; i < N_OBJECTS; i++)
+    {
+        hugepage_free(&test_arena, objects[i]);
+    }
+    ss_info_dassert(test_arena.n_free == N_OBJECTS, "All objects must be on the free list");
+
+    int64_t regions = test_arena.regions;
+    for (int i = 0; i < N_OBJECTS; i++)
+    {
+        objects[i] = hugepage_alloc(&test_arena);
+    }
+    ss_info_dassert(test_arena.regions == regions, "Freed objects must be reused");
+    ss_info_dassert(test_arena.n_free == 0, "The free list must be empty");
+
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+static void test_map()
+{
+    ss_dfprintf(stderr, "testhugepage : mapping an array.");
+
+    size_t size = HUGEPAGE_SIZE + 1000;
+    unsigned char *array = hugepage_map(size);
+
+    ss_info_dassert(array != NULL, "Mapping must succeed");
+    ss_info_dassert(((uintptr_t)array & (HUGEPAGE_SIZE - 1)) == 0, "The array must be aligned");
+
+    for (size_t i = 0; i < size; i++)
+    {
+        ss_info_dassert(array[i] == 0, "The array must be cleared");
+    }
+
+    memset(array, 1, size);
+    hugepage_unmap(array, size);
+
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+int main(void)
+{
+    test_arena_objects();
+    test_map();
+    return 0;
+}
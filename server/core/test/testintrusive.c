@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * Tests of the intrusive list and the lock-free queue
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <ilist.h>
+#include <mpsc_queue.h>
+#include <skygw_debug.h>
+
+#define N_ITEMS     1000
+#define N_PRODUCERS 4
+#define N_PUSHES    100000
+
+typedef struct
+{
+    int        value;
+    ILIST_NODE node;
+} ITEM;
+
+typedef struct
+{
+    int       producer;
+    int       seq;
+    MPSC_NODE node;
+} MESSAGE;
+
+static ITEM items[N_ITEMS];
+static MPSC_QUEUE queue = MPSC_QUEUE_INIT(queue);
+static MESSAGE messages[N_PRODUCERS][N_PUSHES];
+
+static void test_list()
+{
+    ss_dfprintf(stderr, "testintrusive : adding to and removing from a list.");
+
+    ILIST list;
+    ilist_init(&list);
+    ss_info_dassert(ilist_empty(&list), "A new list must be empty");
+    ss_info_dassert(ilist_first(&list) == NULL, "An empty list must have no first node");
+
+    for (int i = 0; i < N_ITEMS; i++)
+    {
+        items[i].value = i;
+
+        if (i & 1)
+        {
+            ilist_push_back(&list, &items[i].node);
+        }
+        else
+        {
+            ilist_push_front(&list, &items[i].node);
+        }
+    }
+
+    /** The even items are in the front in descending order, the odd ones after them */
+    int n = 0;
+    for (ILIST_NODE *node = ilist_first(&list); node; node = ilist_next(&list, node))
+    {
+        int expected = n < N_ITEMS / 2 ? N_ITEMS - 2 - 2 * n : 2 * (n - N_ITEMS / 2) + 1;
+        ss_info_dassert(ILIST_ENTRY(node, ITEM, node)->value == expected,
+                        "The items must be in the order they were added");
+        n++;
+    }
+    ss_info_dassert(n == N_ITEMS, "All items must be in the list");
+
+    /** Remove every third item while walking the list */
+    for (ILIST_NODE *node = ilist_first(&list); node;)
+    {
+        ITEM *item = ILIST_ENTRY(node, ITEM, node);
+        node = ilist_next(&list, node);
+
+        if (item->value % 3 == 0)
+        {
+            ilist_remove(&item->node);
+        }
+    }
+
+    n = 0;
+    for (ILIST_NODE *node = ilist_first(&list); node; node = ilist_next(&list, node))
+    {
+        ss_info_dassert(ILIST_ENTRY(node, ITEM, node)->value % 3 != 0,
+                        "The removed items must not be in the list");
+        n++;
+    }
+    ss_info_dassert(n == N_ITEMS - (N_ITEMS + 2) / 3, "The other items must stay in the list");
+
+    while (ilist_pop_front(&list))
+    {
+        n--;
+    }
+    ss_info_dassert(n == 0 && ilist_empty(&list), "The list must be empty after popping all items");
+
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+static void *producer(void *data)
+{
+    int id = (int)(intptr_t)data;
+
+    for (int i = 0; i < N_PUSHES; i++)
+    {
+        messages[id][i].producer = id;
+        messages[id][i].seq = i;
+        mpsc_queue_push(&queue, &messages[id][i].node);
+    }
+
+    return NULL;
+}
+
+static void test_queue()
+{
+    ss_dfprintf(stderr, "testintrusive : pushing to a queue from %d threads.", N_PRODUCERS);
+
+    ss_info_dassert(mpsc_queue_pop(&queue) == NULL, "A new queue must be empty");
+
+    MESSAGE one = {0, 0};
+    mpsc_queue_push(&queue, &one.node);
+    ss_info_dassert(mpsc_queue_pop(&queue) == &one.node, "The pushed node must be popped");
+    ss_info_dassert(mpsc_queue_pop(&queue) == NULL, "The queue must be empty after the pop");
+
+    pthread_t threads[N_PRODUCERS];
+
+    for (int i = 0; i < N_PRODUCERS; i++)
+    {
+        pthread_create(&threads[i], NULL, producer, (void*)(intptr_t)i);
+    }
+
+    /** The messages of each producer must be popped in the order they were pushed */
+    int next[N_PRODUCERS] = {0};
+    int total = 0;
+
+    while (total < N_PRODUCERS * N_PUSHES)
+    {
+        MPSC_NODE *node = mpsc_queue_pop(&queue);
+
+        if (node == NULL)
+        {
+            sched_yield();
+            continue;
+        }
+
+        MESSAGE *msg = ILIST_ENTRY(node, MESSAGE, node);
+        ss_info_dassert(msg->seq == next[msg->producer], "The messages must be in order");
+        next[msg->producer]++;
+        total++;
+    }
+
+    for (int i = 0; i < N_PRODUCERS; i++)
+    {
+        pthread_join(threads[i], NULL);
+        ss_info_dassert(next[i] == N_PUSHES, "All messages of a producer must be popped");
+    }
+
+    ss_info_dassert(mpsc_queue_pop(&queue) == NULL, "The queue must be empty at the end");
+
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+int main(void)
+{
+    test_list();
+    test_queue();
+    return 0;
+}
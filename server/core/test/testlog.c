@@ -134,6 +134,10 @@ int main(int argc, char* argv[])
     }
     ss_dassert(succp);
 
+    /** The same messages are logged repeatedly, don't throttle them */
+    MXS_LOG_THROTTLING throttling = { 0, 0, 0 };
+    mxs_log_set_throttling(&throttling);
+
     t = time(NULL);
     localtime_r(&t, &tm);
     err = MXS_ERROR("%04d %02d/%02d %02d.%02d.%02d",
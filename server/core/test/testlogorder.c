@@ -80,6 +80,10 @@ int main(int argc, char** argv)
     }
     ss_dassert(succp);
 
+    /** The same message is logged repeatedly, don't throttle it */
+    MXS_LOG_THROTTLING throttling = { 0, 0, 0 };
+    mxs_log_set_throttling(&throttling);
+
     skygw_log_disable(LOG_INFO);
     skygw_log_disable(LOG_NOTICE);
     skygw_log_disable(LOG_DEBUG);
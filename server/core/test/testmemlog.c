@@ -33,6 +33,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
 #include <memlog.h>
 
 /**
@@ -60,6 +61,67 @@ linecount(char *file)
     return i;
 }
 
+/** Threads and records per thread of the structured record test */
+#define N_RECORD_THREADS 4
+#define N_RECORDS 5000
+
+static MEMLOG *record_log;
+
+static void *
+record_thread(void *data)
+{
+    long id = (long)data;
+
+    for (long i = 0; i < N_RECORDS; i++)
+    {
+        memlog_record(record_log, id, i);
+    }
+    return NULL;
+}
+
+/**
+ * Check that the records of each thread are all in the file and in the
+ * order they were logged
+ *
+ * @param file      The name of the file
+ * @return  Non-zero if the records are correct
+ */
+static int
+check_records(char *file)
+{
+    FILE                *fp;
+    unsigned long       timestamp, id;
+    long long           value;
+    long long           next[N_RECORD_THREADS] = {0};
+    unsigned long       last[N_RECORD_THREADS] = {0};
+    int                 rval = 1;
+
+    if ((fp = fopen(file, "r")) == NULL)
+    {
+        return 0;
+    }
+    while (fscanf(fp, "%lu %lu %lld", &timestamp, &id, &value) == 3)
+    {
+        if (id >= N_RECORD_THREADS || value != next[id] || timestamp < last[id])
+        {
+            rval = 0;
+            break;
+        }
+        next[id]++;
+        last[id] = timestamp;
+    }
+    fclose(fp);
+
+    for (int i = 0; i < N_RECORD_THREADS; i++)
+    {
+        if (next[i] != N_RECORDS)
+        {
+            rval = 0;
+        }
+    }
+    return rval;
+}
+
 /* Some strings to log */
 char    *strings[] =
 {
@@ -114,6 +176,7 @@ main()
         {
             memlog_log(log, (void *)i);
         }
+        memlog_sync(log);
         if (access("memlog1", R_OK) != 0)
         {
             printf("File existance 3:		Failed\n");
@@ -192,6 +255,7 @@ main()
         {
             memlog_log(log, (void *)j);
         }
+        memlog_sync(log);
         if (access("memlog2", R_OK) != 0)
         {
             printf("File existance 3:		Failed\n");
@@ -270,6 +334,7 @@ main()
         {
             memlog_log(log, (void *)k);
         }
+        memlog_sync(log);
         if (access("memlog3", R_OK) != 0)
         {
             printf("File existance 3:		Failed\n");
@@ -348,6 +413,7 @@ main()
         {
             memlog_log(log, strings[i % 5]);
         }
+        memlog_sync(log);
         if (access("memlog4", R_OK) != 0)
         {
             printf("File existance 3:		Failed\n");
@@ -452,6 +518,11 @@ main()
         for (i = 0; i < 5050; i++)
         {
             memlog_log(log, (void *)i);
+            if (i % 100 == 99)
+            {
+                /** Do not let the writes get ahead of the flusher thread */
+                memlog_sync(log);
+            }
         }
         if (access("memlog7", R_OK) != 0)
         {
@@ -475,6 +546,7 @@ main()
         {
             memlog_log(log, (void *)i);
         }
+        memlog_sync(log);
         if (linecount("memlog7") != 5100)
         {
             printf("Residual flushing:		Failed\n");
@@ -487,6 +559,10 @@ main()
         for (i = 0; i < 10120; i++)
         {
             memlog_log(log, (void *)i);
+            if (i % 100 == 99)
+            {
+                memlog_sync(log);
+            }
         }
         memlog_destroy(log);
         if (linecount("memlog7") != 15220)
@@ -499,5 +575,45 @@ main()
             printf("Flush on destroy:		Passed\n");
         }
     }
+
+    unlink("memlog8");
+    if ((record_log = memlog_create("memlog8", ML_RECORD, N_RECORDS)) == NULL)
+    {
+        printf("Memlog Creation:		Failed\n");
+        failures++;
+    }
+    else
+    {
+        pthread_t threads[N_RECORD_THREADS];
+
+        printf("Memlog Creation:		Passed\n");
+        for (long l = 0; l < N_RECORD_THREADS; l++)
+        {
+            pthread_create(&threads[l], NULL, record_thread, (void *)l);
+        }
+        for (int l = 0; l < N_RECORD_THREADS; l++)
+        {
+            pthread_join(threads[l], NULL);
+        }
+        if (memlog_dropped(record_log) != 0)
+        {
+            printf("Records dropped:		Failed\n");
+            failures++;
+        }
+        else
+        {
+            printf("Records dropped:		Passed\n");
+        }
+        memlog_destroy(record_log);
+        if (!check_records("memlog8"))
+        {
+            printf("Records of the threads:		Failed\n");
+            failures++;
+        }
+        else
+        {
+            printf("Records of the threads:		Passed\n");
+        }
+    }
     exit(failures);
 }
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * Tests of the metrics registry
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <metrics.h>
+#include <skygw_debug.h>
+
+static int64_t metric_value()
+{
+    return 42;
+}
+
+static void test_register()
+{
+    ss_dfprintf(stderr, "testmetrics : registering metrics.");
+
+    METRIC *a = metric_counter("test_requests", "service=\"a\"", "Requests");
+    METRIC *b = metric_counter("test_requests", "service=\"b\"", "Requests");
+    METRIC *c = metric_gauge("test_connections", NULL, "Connections");
+
+    ss_info_dassert(a && b && c, "Registration must succeed");
+    ss_info_dassert(a != b, "Metrics with different labels must be different");
+    ss_info_dassert(metric_counter("test_requests", "service=\"a\"", "Requests") == a,
+                    "Registering the same metric must return the existing one");
+    ss_info_dassert(metric_gauge("test_requests", "service=\"a\"", "Requests") == NULL,
+                    "Registering a metric with a different type must fail");
+
+    METRIC *f = metric_function("test_value", NULL, "Value", METRIC_GAUGE, metric_value);
+    ss_info_dassert(f && f->fn() == 42, "Function metric must return the value");
+
+    metric_add(a, 3);
+    metric_add(a, 2);
+    metric_add(c, 5);
+    metric_add(c, -1);
+    metric_add(NULL, 1);
+    ss_info_dassert(ts_stats_sum(a->value) == 5, "Counter must be 5");
+    ss_info_dassert(ts_stats_sum(b->value) == 0, "Counter must be 0");
+    ss_info_dassert(ts_stats_sum(c->value) == 4, "Gauge must be 4");
+
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+static void test_histogram()
+{
+    ss_dfprintf(stderr, "testmetrics : histogram buckets.");
+
+    int64_t bounds[] = { 10, 100, 1000 };
+    int64_t too_many[METRIC_MAX_BUCKETS + 1] = { 0 };
+    METRIC *h = metric_histogram("test_latency", NULL, "Latency", bounds, 3, 0.001);
+
+    ss_info_dassert(h != NULL, "Registration must succeed");
+    ss_info_dassert(metric_histogram("test_big", NULL, "Too many buckets", too_many,
+                                     METRIC_MAX_BUCKETS + 1, 1.0) == NULL,
+                    "Too many buckets must be rejected");
+
+    metric_observe(h, 1);
+    metric_observe(h, 10);
+    metric_observe(h, 11);
+    metric_observe(h, 500);
+    metric_observe(h, 5000);
+
+    ss_info_dassert(ts_stats_sum(h->buckets[0]) == 2, "Two values must be <= 10");
+    ss_info_dassert(ts_stats_sum(h->buckets[1]) == 1, "One value must be in (10, 100]");
+    ss_info_dassert(ts_stats_sum(h->buckets[2]) == 1, "One value must be in (100, 1000]");
+    ss_info_dassert(ts_stats_sum(h->buckets[3]) == 1, "One value must be in +Inf");
+    ss_info_dassert(ts_stats_sum(h->value) == 5522, "Sum must be 5522");
+
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+int main(void)
+{
+    test_register();
+    test_histogram();
+    return 0;
+}
@@ -383,6 +383,82 @@ void test_large_packets()
     }
 }
 
+void test_packet_framer()
+{
+    packet_framer_t framer;
+    GWBUF* head = NULL;
+    GWBUF* complete = NULL;
+    size_t total = 0;
+
+    /** Feed the resultset one byte at a time and take the packets as they complete */
+    modutil_framer_init(&framer);
+
+    for (size_t i = 0; i < sizeof(resultset); i++)
+    {
+        head = gwbuf_append(head, gwbuf_alloc_and_load(1, resultset + i));
+        GWBUF* packets = modutil_framer_get_complete(&framer, &head);
+
+        if (packets)
+        {
+            total += gwbuf_length(packets);
+            complete = gwbuf_append(complete, packets);
+        }
+        ss_info_dassert(total + gwbuf_length(head) == i + 1, "No data should be lost");
+    }
+
+    ss_info_dassert(head == NULL, "All data should be in complete packets");
+    ss_info_dassert(total == sizeof(resultset), "All packets should be complete");
+    uint8_t databuf[sizeof(resultset)];
+    gwbuf_copy_data(complete, 0, total, databuf);
+    ss_info_dassert(memcmp(databuf, resultset, sizeof(resultset)) == 0, "Data should be OK");
+
+    /** Take the packets one by one and check them with views of the original */
+    packet_view_t view = {NULL, 0, 0};
+    int n_packets = 0;
+
+    head = gwbuf_append(gwbuf_alloc_and_load(7, resultset),
+                        gwbuf_alloc_and_load(sizeof(resultset) - 7, resultset + 7));
+
+    while (modutil_packet_view_next(complete, &view))
+    {
+        GWBUF* packet = modutil_framer_get_next(&framer, &head);
+        uint8_t viewdata[sizeof(resultset)];
+
+        ss_info_dassert(packet, "A packet should be available for each view");
+        ss_info_dassert(packet->next == NULL, "The packet should be contiguous");
+        ss_info_dassert(GWBUF_LENGTH(packet) == view.length, "Packet should be as long as the view");
+        ss_info_dassert(modutil_packet_view_copy(&view, 0, view.length, viewdata) == view.length,
+                        "The view should be readable");
+        ss_info_dassert(memcmp(GWBUF_DATA(packet), viewdata, view.length) == 0,
+                        "Packet should be equal to the view");
+        gwbuf_free(packet);
+        n_packets++;
+    }
+
+    ss_info_dassert(n_packets > 1, "The resultset should have several packets");
+    ss_info_dassert(head == NULL, "All packets should have been taken");
+    ss_info_dassert(modutil_framer_get_next(&framer, &head) == NULL, "No packets should be left");
+
+    /** Data put before a parsed partial packet is framed after a reset */
+    head = gwbuf_alloc_and_load(sizeof(ok) - 1, ok);
+    ss_info_dassert(modutil_framer_get_complete(&framer, &head) == NULL, "Packet should be partial");
+    head = gwbuf_append(gwbuf_alloc_and_load(sizeof(ok), ok), head);
+    head = gwbuf_append(head, gwbuf_alloc_and_load(1, ok + sizeof(ok) - 1));
+    modutil_framer_init(&framer);
+    GWBUF* both = modutil_framer_get_complete(&framer, &head);
+    ss_info_dassert(head == NULL, "Both packets should be complete");
+    ss_info_dassert(gwbuf_length(both) == 2 * sizeof(ok), "Both packets should be returned");
+    gwbuf_free(both);
+
+    /** A partial packet is not shown by a view */
+    GWBUF* partial = gwbuf_alloc_and_load(sizeof(ok) - 1, ok);
+    view.buffer = NULL;
+    ss_info_dassert(!modutil_packet_view_next(partial, &view), "Partial packet has no view");
+
+    gwbuf_free(partial);
+    gwbuf_free(complete);
+}
+
 int main(int argc, char **argv)
 {
     int result = 0;
@@ -394,5 +470,6 @@ int main(int argc, char **argv)
     test_strnchr_esc();
     test_strnchr_esc_mysql();
     test_large_packets();
+    test_packet_framer();
     exit(result);
 }
@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * Tests of the queue manager
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <queuemanager.h>
+#include <skygw_debug.h>
+
+static int objects[10];
+
+static void test_priority()
+{
+    ss_dfprintf(stderr, "testqueuemanager : priority classes.");
+
+    QUEUE_CONFIG *queue = mxs_queue_alloc(4, 1000);
+    uint64_t now = mxs_queue_now();
+    QUEUE_ENTRY entry;
+
+    ss_info_dassert(queue != NULL, "Allocation must succeed");
+    ss_info_dassert(!mxs_dequeue(queue, now, &entry), "Empty queue must return nothing");
+
+    ss_info_dassert(mxs_enqueue(queue, &objects[0], QUEUE_PRIORITY_LOW), "Enqueue must succeed");
+    ss_info_dassert(mxs_enqueue(queue, &objects[1], QUEUE_PRIORITY_NORMAL), "Enqueue must succeed");
+    ss_info_dassert(mxs_enqueue(queue, &objects[2], QUEUE_PRIORITY_HIGH), "Enqueue must succeed");
+    ss_info_dassert(mxs_enqueue(queue, &objects[3], QUEUE_PRIORITY_HIGH), "Enqueue must succeed");
+    ss_info_dassert(!mxs_enqueue(queue, &objects[4], QUEUE_PRIORITY_HIGH),
+                    "Enqueue over the limit must fail");
+    ss_info_dassert(mxs_queue_count(queue) == 4, "Queue must have four entries");
+
+    ss_info_dassert(mxs_dequeue(queue, now, &entry) && entry.queued_object == &objects[2],
+                    "First high priority entry must come first");
+    ss_info_dassert(mxs_dequeue(queue, now, &entry) && entry.queued_object == &objects[3],
+                    "Second high priority entry must come second");
+    ss_info_dassert(mxs_dequeue(queue, now, &entry) && entry.queued_object == &objects[1],
+                    "Normal priority entry must come third");
+    ss_info_dassert(mxs_dequeue(queue, now, &entry) && entry.queued_object == &objects[0] &&
+                    entry.priority == QUEUE_PRIORITY_LOW, "Low priority entry must come last");
+    ss_info_dassert(mxs_queue_count(queue) == 0, "Queue must be empty");
+
+    mxs_queue_free(queue);
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+static void test_timeouts()
+{
+    ss_dfprintf(stderr, "testqueuemanager : aging and expiry.");
+
+    QUEUE_CONFIG *queue = mxs_queue_alloc(10, 1000);
+    QUEUE_ENTRY entry;
+
+    uint64_t start = mxs_queue_now();
+
+    /** Sleep so that the entries have different time stamps */
+    mxs_enqueue(queue, &objects[0], QUEUE_PRIORITY_LOW);
+    usleep(5000);
+    mxs_enqueue(queue, &objects[1], QUEUE_PRIORITY_HIGH);
+    usleep(5000);
+    mxs_enqueue(queue, &objects[2], QUEUE_PRIORITY_LOW);
+
+    uint64_t now = mxs_queue_now();
+    uint64_t expiry = mxs_queue_next_expiry(queue);
+
+    ss_info_dassert(expiry >= start + 1000 && expiry <= now + 1000,
+                    "First entry must expire after the timeout");
+    ss_info_dassert(!mxs_dequeue_expired(queue, now, &entry), "No entry must have expired");
+
+    /** An entry that has waited for half of the timeout goes first */
+    ss_info_dassert(mxs_dequeue(queue, now + 600, &entry) && entry.queued_object == &objects[0],
+                    "Aged low priority entry must come before high priority entry");
+
+    ss_info_dassert(mxs_dequeue_expired(queue, now + 1000, &entry) &&
+                    entry.queued_object == &objects[1], "Oldest entry must expire first");
+    ss_info_dassert(mxs_dequeue_expired(queue, now + 1000, &entry) &&
+                    entry.queued_object == &objects[2], "Last entry must expire");
+    ss_info_dassert(!mxs_dequeue_expired(queue, now + 1000, &entry), "Queue must be empty");
+    ss_info_dassert(mxs_queue_next_expiry(queue) == UINT64_MAX, "Empty queue never expires");
+
+    mxs_queue_configure(queue, 1, 1000);
+    ss_info_dassert(mxs_enqueue(queue, &objects[3], QUEUE_PRIORITY_NORMAL), "Enqueue must succeed");
+    ss_info_dassert(!mxs_enqueue(queue, &objects[4], QUEUE_PRIORITY_NORMAL),
+                    "Enqueue over the new limit must fail");
+
+    mxs_queue_free(queue);
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+static void test_names()
+{
+    ss_dfprintf(stderr, "testqueuemanager : priority names.");
+
+    ss_info_dassert(mxs_queue_priority("high") == QUEUE_PRIORITY_HIGH, "high must be valid");
+    ss_info_dassert(mxs_queue_priority("Normal") == QUEUE_PRIORITY_NORMAL, "Normal must be valid");
+    ss_info_dassert(mxs_queue_priority("low") == QUEUE_PRIORITY_LOW, "low must be valid");
+    ss_info_dassert(mxs_queue_priority("urgent") == -1, "urgent must not be valid");
+
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+int main(void)
+{
+    test_priority();
+    test_timeouts();
+    test_names();
+    return 0;
+}
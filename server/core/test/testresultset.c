@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * Tests of the streaming of result sets in larger buffers
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <listener.h>
+#include <dcb.h>
+#include <resultset.h>
+
+/** Number of rows in the test result set */
+#define N_ROWS 5000
+
+/** Length of the value that needs a three byte length */
+#define LONG_VALUE_LEN 300
+
+static uint8_t output[4 * 1024 * 1024];
+static size_t output_len;
+static int n_writes;
+
+/** Collect the output instead of writing it to a socket */
+static int collect_write(DCB *dcb, GWBUF *buf)
+{
+    size_t len = gwbuf_length(buf);
+
+    ss_info_dassert(output_len + len <= sizeof(output), "Output must fit into the test buffer");
+    gwbuf_copy_data(buf, 0, len, output + output_len);
+    output_len += len;
+    n_writes++;
+    gwbuf_free(buf);
+    return 1;
+}
+
+static RESULT_ROW *row_callback(RESULTSET *set, void *data)
+{
+    int *rowno = (int *)data;
+    RESULT_ROW *row = NULL;
+
+    if (*rowno < N_ROWS)
+    {
+        char buf[LONG_VALUE_LEN + 1];
+
+        row = resultset_make_row(set);
+        snprintf(buf, sizeof(buf), "%d", *rowno);
+        resultset_row_set(row, 0, buf);
+        if (*rowno % 100 == 0)
+        {
+            memset(buf, 'x', LONG_VALUE_LEN);
+            buf[LONG_VALUE_LEN] = '\0';
+            resultset_row_set(row, 1, buf);
+        }
+        else if (*rowno % 2 == 0)
+        {
+            resultset_row_set(row, 1, "value");
+        }
+        (*rowno)++;
+    }
+    return row;
+}
+
+static DCB *test_dcb(SERV_LISTENER *listener)
+{
+    DCB *dcb = dcb_alloc(DCB_ROLE_CLIENT_HANDLER, listener);
+    dcb->func.write = collect_write;
+    output_len = 0;
+    n_writes = 0;
+    return dcb;
+}
+
+static RESULTSET *test_set(int *rowno)
+{
+    RESULTSET *set = resultset_create(row_callback, rowno);
+    resultset_add_column(set, "id", 10, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "value", 10, COL_TYPE_VARCHAR);
+    return set;
+}
+
+static int test_mysql()
+{
+    SERV_LISTENER dummy;
+    DCB *dcb = test_dcb(&dummy);
+    int rowno = 0;
+    RESULTSET *set = test_set(&rowno);
+    size_t pos = 0;
+    int n_packets = 0;
+
+    ss_dfprintf(stderr, "testresultset : streaming with the MySQL protocol.");
+    resultset_stream_mysql(set, dcb);
+    resultset_free(set);
+
+    ss_info_dassert(n_writes <= output_len / GWBUF_MAX_POOLED_SIZE + 1,
+                    "Packets must be written in large buffers");
+
+    while (pos < output_len)
+    {
+        size_t len = output[pos] | (output[pos + 1] << 8) | (output[pos + 2] << 16);
+        uint8_t *payload = output + pos + 4;
+
+        ss_info_dassert(output[pos + 3] == (uint8_t)(n_packets + 1), "Sequence numbers must be consecutive");
+        ss_info_dassert(pos + 4 + len <= output_len, "Packets must be complete");
+
+        /** The rows follow the field count, two column definitions and an EOF */
+        if (n_packets >= 4 && n_packets < 4 + N_ROWS)
+        {
+            int row = n_packets - 4;
+            char id[20];
+            uint8_t *ptr = payload;
+
+            snprintf(id, sizeof(id), "%d", row);
+            ss_info_dassert(*ptr == strlen(id) && memcmp(ptr + 1, id, *ptr) == 0, "Id must match");
+            ptr += 1 + *ptr;
+
+            if (row % 100 == 0)
+            {
+                ss_info_dassert(ptr[0] == 0xfc && (ptr[1] | (ptr[2] << 8)) == LONG_VALUE_LEN,
+                                "Long value must have a length-encoded length");
+                ptr += 3 + LONG_VALUE_LEN;
+            }
+            else if (row % 2 == 0)
+            {
+                ss_info_dassert(*ptr == 5 && memcmp(ptr + 1, "value", 5) == 0, "Value must match");
+                ptr += 6;
+            }
+            else
+            {
+                ss_info_dassert(*ptr == 0, "NULL value must be empty");
+                ptr++;
+            }
+            ss_info_dassert(ptr == payload + len, "Row must end after the values");
+        }
+
+        pos += 4 + len;
+        n_packets++;
+    }
+
+    ss_info_dassert(n_packets == N_ROWS + 5, "All packets must be sent");
+    ss_info_dassert(output[output_len - 5] == 0xfe, "Result set must end with an EOF packet");
+
+    dcb_close(dcb);
+    ss_dfprintf(stderr, "\t..done\n");
+    return 0;
+}
+
+static int test_json()
+{
+    SERV_LISTENER dummy;
+    DCB *dcb = test_dcb(&dummy);
+    int rowno = 0;
+    RESULTSET *set = test_set(&rowno);
+
+    ss_dfprintf(stderr, "testresultset : streaming as JSON.");
+    resultset_stream_json(set, dcb);
+    resultset_free(set);
+
+    ss_info_dassert(n_writes <= output_len / GWBUF_MAX_POOLED_SIZE + 1,
+                    "Text must be written in large buffers");
+    ss_info_dassert(output_len > 2 && memcmp(output, "[ { \"id\" : 0, \"value\" : \"xxx", 28) == 0,
+                    "First row must be at the start");
+    ss_info_dassert(memmem(output, output_len, ",\n{ \"id\" : 1, \"value\" : null}", 29) != NULL,
+                    "NULL value must be null");
+    ss_info_dassert(memmem(output, output_len, "{ \"id\" : 4998, \"value\" : \"value\"}", 33) != NULL,
+                    "Values must be quoted");
+    ss_info_dassert(memcmp(output + output_len - 32, "{ \"id\" : 4999, \"value\" : null}]\n", 32) == 0,
+                    "Last row must end the array");
+
+    dcb_close(dcb);
+    ss_dfprintf(stderr, "\t..done\n");
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+
+    result += test_mysql();
+    result += test_json();
+
+    exit(result);
+}
@@ -0,0 +1,344 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * Tests and benchmarks of the byte scanning primitives and the SQL scanning
+ * functions of modutil that use them
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <scan.h>
+#include <modutil.h>
+#include <skygw_debug.h>
+
+static const scan_impl_t impls[] = {SCAN_IMPL_SCALAR, SCAN_IMPL_SSE42, SCAN_IMPL_AVX2};
+
+#define N_IMPLS (sizeof(impls) / sizeof(impls[0]))
+
+/** The byte by byte version of strnchr_esc_mysql that the new one must match */
+static char* reference_strnchr_esc_mysql(char* ptr, char c, int len)
+{
+    char* p = (char*) ptr;
+    char* start = p, *end = start + len;
+    bool quoted = false, escaped = false, backtick = false, comment = false;
+    char qc = 0;
+
+    while (p < end)
+    {
+        if (escaped)
+        {
+            escaped = false;
+        }
+        else if ((!comment && !quoted && !backtick) || (comment && *p == '*') ||
+                 (!comment && quoted && *p == qc) || (!comment && backtick && *p == '`'))
+        {
+            switch (*p)
+            {
+            case '\\':
+                escaped = true;
+                break;
+
+            case '\'':
+            case '"':
+                if (!quoted)
+                {
+                    quoted = true;
+                    qc = *p;
+                }
+                else if (*p == qc)
+                {
+                    quoted = false;
+                }
+                break;
+
+            case '/':
+                if (p + 1 < end && *(p + 1) == '*')
+                {
+                    comment = true;
+                    p += 1;
+                }
+                break;
+
+            case '*':
+                if (comment && p + 1 < end && *(p + 1) == '/')
+                {
+                    comment = false;
+                    p += 1;
+                }
+                break;
+
+            case '`':
+                backtick = !backtick;
+                break;
+
+            case '#':
+                return NULL;
+
+            case '-':
+                if (p + 2 < end && *(p + 1) == '-' && isspace(*(p + 2)))
+                {
+                    return NULL;
+                }
+                break;
+
+            default:
+                break;
+            }
+
+            if (*p == c && !escaped && !quoted && !comment && !backtick)
+            {
+                return p;
+            }
+        }
+        p++;
+    }
+    return NULL;
+}
+
+/** The byte by byte version of strnchr_esc */
+static char* reference_strnchr_esc(char* ptr, char c, int len)
+{
+    char* p = (char*)ptr;
+    char* start = p;
+    bool quoted = false, escaped = false;
+    char qc = 0;
+
+    while (p < start + len)
+    {
+        if (escaped)
+        {
+            escaped = false;
+        }
+        else if (*p == '\\')
+        {
+            escaped = true;
+        }
+        else if ((*p == '\'' || *p  == '"') && !quoted)
+        {
+            quoted = true;
+            qc = *p;
+        }
+        else if (quoted && *p == qc)
+        {
+            quoted = false;
+        }
+        else if (*p == c && !escaped && !quoted)
+        {
+            return p;
+        }
+        p++;
+    }
+
+    return NULL;
+}
+
+/** Go back to the implementation chosen at startup */
+static void use_best_impl()
+{
+    if (!scan_set_impl(SCAN_IMPL_AVX2))
+    {
+        scan_set_impl(SCAN_IMPL_SSE42);
+    }
+}
+
+static void random_sql(char *buf, int len)
+{
+    static const char alphabet[] = "ab ;'\"`\\/*#-\n";
+
+    for (int i = 0; i < len; i++)
+    {
+        buf[i] = alphabet[random() % (sizeof(alphabet) - 1)];
+    }
+}
+
+static void test_primitives()
+{
+    char data[300];
+    const char set[] = {';', '\'', '"', '\\'};
+
+    ss_dfprintf(stderr, "testscan : comparing the implementations");
+
+    for (int i = 0; i < (int)N_IMPLS; i++)
+    {
+        if (!scan_set_impl(impls[i]))
+        {
+            continue;
+        }
+
+        for (int round = 0; round < 2000; round++)
+        {
+            int len = random() % sizeof(data);
+            int n_set = 1 + random() % sizeof(set);
+
+            for (int j = 0; j < len; j++)
+            {
+                data[j] = random() % 8 ? 'x' : set[random() % sizeof(set)];
+            }
+
+            const char *end = data + len;
+            const char *expect_find = data;
+            const char *expect_skip = data;
+
+            while (expect_find < end && !memchr(set, *expect_find, n_set))
+            {
+                expect_find++;
+            }
+            while (expect_skip < end && memchr("x", *expect_skip, 1))
+            {
+                expect_skip++;
+            }
+
+            ss_info_dassert(scan_find_any(data, end, set, n_set) == expect_find,
+                            "scan_find_any must find the first byte in the set");
+            ss_info_dassert(scan_skip_any(data, end, "x", 1) == expect_skip,
+                            "scan_skip_any must find the first byte not in the set");
+        }
+
+        ss_info_dassert(scan_find_any(data, data, set, 1) == data, "An empty range has no match");
+        ss_info_dassert(scan_skip_any(data + 2, data, set, 1) == data, "A negative range has no match");
+    }
+
+    use_best_impl();
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+static void test_sql_scanning()
+{
+    char sql[200];
+
+    ss_dfprintf(stderr, "testscan : comparing SQL scanning with the byte by byte versions");
+
+    for (int i = 0; i < (int)N_IMPLS; i++)
+    {
+        if (!scan_set_impl(impls[i]))
+        {
+            continue;
+        }
+
+        for (int round = 0; round < 20000; round++)
+        {
+            int len = random() % sizeof(sql);
+            random_sql(sql, len);
+
+            ss_info_dassert(strnchr_esc(sql, ';', len) == reference_strnchr_esc(sql, ';', len),
+                            "strnchr_esc must match the byte by byte version");
+            ss_info_dassert(strnchr_esc_mysql(sql, ';', len) ==
+                            reference_strnchr_esc_mysql(sql, ';', len),
+                            "strnchr_esc_mysql must match the byte by byte version");
+        }
+    }
+
+    ss_info_dassert(is_mysql_statement_end(" ;\n -- comment", 14), "A comment ends a statement");
+    ss_info_dassert(!is_mysql_statement_end(" ; SELECT 1", 11), "A second statement is not an end");
+    ss_info_dassert(is_mysql_sp_end(" ;END ", 6), "END ends a block");
+
+    use_best_impl();
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+static double elapsed_ns(struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 + end.tv_nsec - start->tv_nsec;
+}
+
+/**
+ * Time the scanning of a long INSERT statement, the kind of statement where
+ * the vector implementations matter the most
+ */
+static void benchmark()
+{
+    static char sql[64 * 1024];
+    int len = snprintf(sql, sizeof(sql), "INSERT INTO t1 VALUES ");
+
+    while (len < (int)sizeof(sql) - 64)
+    {
+        len += snprintf(sql + len, sizeof(sql) - len, "(1234, 'some text value', \"more\"),");
+    }
+    sql[len - 1] = ';';
+
+    ss_dfprintf(stderr, "testscan : scanning a statement of %d bytes\n", len);
+
+    for (int i = 0; i < (int)N_IMPLS; i++)
+    {
+        if (!scan_set_impl(impls[i]))
+        {
+            ss_dfprintf(stderr, "%-8s not supported\n", scan_impl_name(impls[i]));
+            continue;
+        }
+
+        const int rounds = 200;
+        struct timespec start;
+        volatile char *found;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int r = 0; r < rounds; r++)
+        {
+            found = (char*)scan_find_any(sql, sql + len, ";", 1);
+        }
+        double find_ns = elapsed_ns(&start) / rounds;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int r = 0; r < rounds; r++)
+        {
+            found = strnchr_esc(sql, ';', len);
+        }
+        double esc_ns = elapsed_ns(&start) / rounds;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int r = 0; r < rounds; r++)
+        {
+            found = strnchr_esc_mysql(sql, ';', len);
+        }
+        double mysql_ns = elapsed_ns(&start) / rounds;
+
+        ss_info_dassert(found == sql + len - 1, "The semicolon must be found");
+        ss_dfprintf(stderr, "%-8s scan_find_any %.2f GB/s, strnchr_esc %.2f GB/s, "
+                    "strnchr_esc_mysql %.2f GB/s\n", scan_impl_name(impls[i]),
+                    len / find_ns, len / esc_ns, len / mysql_ns);
+    }
+
+    struct timespec start;
+    volatile char *found;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int r = 0; r < 200; r++)
+    {
+        found = reference_strnchr_esc_mysql(sql, ';', len);
+    }
+    ss_dfprintf(stderr, "byte by byte strnchr_esc_mysql %.2f GB/s\n", len / (elapsed_ns(&start) / 200));
+    ss_info_dassert(found == sql + len - 1, "The semicolon must be found");
+
+    use_best_impl();
+}
+
+int main(int argc, char **argv)
+{
+    srandom(time(NULL));
+    test_primitives();
+    test_sql_scanning();
+    benchmark();
+    return 0;
+}
@@ -245,6 +245,54 @@ test3()
     return 0 == failures ? 0 : 1;
 }
 
+/**
+ * test4    contention profile tests
+ *
+ * Test that a sample of the acquisitions of a named lock is recorded in the
+ * contention profile when the profile is enabled and that enabling the
+ * profile again discards the old samples.
+ */
+static int
+test4()
+{
+    SPINLOCK    lck;
+    SPINLOCK_PROFILE_ENTRY entries[SPINLOCK_PROFILE_TOP];
+    int         i, n;
+
+    spinlock_init(&lck);
+    spinlock_set_name(&lck, "test4");
+    spinlock_profile_enable(true);
+    for (i = 0; i < 1000; i++)
+    {
+        spinlock_acquire(&lck);
+        spinlock_release(&lck);
+    }
+    spinlock_profile_enable(false);
+
+    n = spinlock_profile_top(entries, SPINLOCK_PROFILE_TOP);
+    if (n != 1 || entries[0].lock != &lck || strcmp(entries[0].name, "test4") != 0 ||
+        entries[0].acquired == 0 || entries[0].acquired > 1000)
+    {
+        fprintf(stderr, "spinlock_profile: test 4.1 failed.\n");
+        return 1;
+    }
+    if (SPINLOCK_IS_LOCKED(&lck))
+    {
+        fprintf(stderr, "spinlock_profile: test 4.2 failed.\n");
+        return 1;
+    }
+
+    spinlock_profile_enable(true);
+    spinlock_profile_enable(false);
+    if (spinlock_profile_top(entries, SPINLOCK_PROFILE_TOP) != 0)
+    {
+        fprintf(stderr, "spinlock_profile: test 4.3 failed.\n");
+        return 1;
+    }
+
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     int result = 0;
@@ -252,6 +300,7 @@ int main(int argc, char **argv)
     result += test1();
     result += test2();
     result += test3();
+    result += test4();
 
     exit(result);
 }
@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * Tests of the hierarchical timing wheel
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <skygw_debug.h>
+#include <timerwheel.h>
+
+/** Number of timers used by the tests */
+#define N_TIMERS 1000
+
+typedef struct
+{
+    TIMER_ENTRY timer;      /*< The timer, must be the first member */
+    uint64_t    fired;      /*< One more than when the timer expired, 0 if it has not expired */
+} TEST_TIMER;
+
+static TEST_TIMER timers[N_TIMERS];
+
+/**
+ * Advance the wheel to a time and record when the expired timers expired
+ *
+ * @param wheel The wheel
+ * @param now   The time to advance to
+ * @param step  How much the time is advanced at a time
+ */
+static void advance(TIMER_WHEEL *wheel, uint64_t now, uint64_t step)
+{
+    TIMER_ENTRY expired;
+
+    timerwheel_list_init(&expired);
+
+    for (uint64_t t = wheel->now; t <= now; t += step)
+    {
+        timerwheel_advance(wheel, t, &expired);
+
+        while (!timerwheel_list_empty(&expired))
+        {
+            TEST_TIMER *timer = (TEST_TIMER *)expired.next;
+
+            timerwheel_remove(&timer->timer);
+            ss_info_dassert(timer->fired == 0, "Timer must expire only once");
+            ss_info_dassert(timer->timer.expiry <= t, "Timer expired too early");
+            ss_info_dassert(timer->timer.expiry + step > t, "Timer expired too late");
+            timer->fired = t + 1;
+        }
+    }
+    timerwheel_advance(wheel, now, &expired);
+    ss_info_dassert(timerwheel_list_empty(&expired), "No timers should be left");
+}
+
+/**
+ * Add timers with random expiry times, remove some of them and check that
+ * the others expire at the right time
+ *
+ * @param start The time the wheel starts at
+ * @param range The range of the expiry times
+ * @param step  How much the time is advanced at a time
+ * @return True if the test passed
+ */
+static bool test_expiry(uint64_t start, uint64_t range, uint64_t step)
+{
+    TIMER_WHEEL *wheel = malloc(sizeof(TIMER_WHEEL));
+    uint64_t last = start;
+    int i;
+
+    ss_dfprintf(stderr, "testtimerwheel : %d timers in %lu ms, advancing %lu ms at a time.",
+                N_TIMERS, (unsigned long)range, (unsigned long)step);
+
+    timerwheel_init(wheel, start);
+
+    for (i = 0; i < N_TIMERS; i++)
+    {
+        uint64_t expiry = start + ((uint64_t)random() * random()) % range;
+
+        timerwheel_entry_init(&timers[i].timer);
+        timers[i].fired = 0;
+        timerwheel_add(wheel, &timers[i].timer, expiry);
+        last = expiry > last ? expiry : last;
+    }
+    ss_info_dassert(wheel->count == N_TIMERS, "All timers must be in the wheel");
+
+    for (i = 0; i < N_TIMERS; i += 10)
+    {
+        timerwheel_remove(&timers[i].timer);
+        ss_info_dassert(!timerwheel_is_linked(&timers[i].timer), "Removed timer must be unlinked");
+    }
+    ss_info_dassert(wheel->count == N_TIMERS - N_TIMERS / 10, "Invalid count after remove");
+
+    uint64_t first = UINT64_MAX;
+
+    for (i = 0; i < N_TIMERS; i++)
+    {
+        if (i % 10 && timers[i].timer.expiry < first)
+        {
+            first = timers[i].timer.expiry;
+        }
+    }
+    ss_info_dassert(timerwheel_next_expiry(wheel) >= start, "Next expiry must not be in the past");
+    ss_info_dassert(timerwheel_next_expiry(wheel) <= first, "Next expiry must not be after a timer");
+
+    advance(wheel, last + step, step);
+
+    for (i = 0; i < N_TIMERS; i++)
+    {
+        ss_info_dassert(i % 10 == 0 ? timers[i].fired == 0 : timers[i].fired != 0,
+                        "Only the timers that were not removed must expire");
+    }
+    ss_info_dassert(wheel->count == 0, "Wheel must be empty");
+    ss_info_dassert(timerwheel_next_expiry(wheel) == UINT64_MAX, "Empty wheel has no next expiry");
+
+    free(wheel);
+    ss_dfprintf(stderr, "\t..done\n");
+    return true;
+}
+
+/**
+ * Check that a timer that is re-added when it expires keeps expiring at the
+ * right interval
+ *
+ * @return True if the test passed
+ */
+static bool test_rearm()
+{
+    TIMER_WHEEL *wheel = malloc(sizeof(TIMER_WHEEL));
+    TIMER_ENTRY timer;
+    TIMER_ENTRY expired;
+    int n_fired = 0;
+
+    ss_dfprintf(stderr, "testtimerwheel : re-adding a timer after it expires.");
+
+    timerwheel_init(wheel, 0);
+    timerwheel_entry_init(&timer);
+    timerwheel_list_init(&expired);
+    timerwheel_add(wheel, &timer, 300);
+
+    for (uint64_t t = 0; t <= 100000; t++)
+    {
+        if (timerwheel_advance(wheel, t, &expired))
+        {
+            ss_info_dassert(t % 300 == 0 && t > 0, "Timer expired at the wrong time");
+            timerwheel_add(wheel, &timer, t + 300);
+            ss_info_dassert(timerwheel_list_empty(&expired), "Adding must remove from the list");
+            n_fired++;
+        }
+    }
+    ss_info_dassert(n_fired == 100000 / 300, "Timer expired the wrong number of times");
+
+    free(wheel);
+    ss_dfprintf(stderr, "\t..done\n");
+    return true;
+}
+
+int main(void)
+{
+    if (!test_expiry(0, 200, 1) ||
+        !test_expiry(12345, 100000, 1) ||
+        !test_expiry(1000, 100000000, 997) ||
+        !test_expiry((1ULL << 32) - 5000, 1ULL << 34, 1000003) ||
+        !test_rearm())
+    {
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * Tests of the io_uring ring
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <skygw_debug.h>
+#include <uring.h>
+
+/** Number of socket pairs used by the tests */
+#define N_PAIRS 8
+
+static int pairs[N_PAIRS][2];
+
+static void test_sendmsg(URING *ring)
+{
+    ss_dfprintf(stderr, "testuring : batched sendmsg.");
+
+    char data[N_PAIRS][32];
+    struct iovec iov[N_PAIRS][2];
+    struct msghdr msg[N_PAIRS];
+
+    for (int i = 0; i < N_PAIRS; i++)
+    {
+        snprintf(data[i], sizeof(data[i]), "pair %d", i);
+        iov[i][0].iov_base = data[i];
+        iov[i][0].iov_len = strlen(data[i]);
+        iov[i][1].iov_base = "!";
+        iov[i][1].iov_len = 1;
+        memset(&msg[i], 0, sizeof(msg[i]));
+        msg[i].msg_iov = iov[i];
+        msg[i].msg_iovlen = 2;
+        ss_info_dassert(uring_prep_sendmsg(ring, pairs[i][0], &msg[i], i), "Preparing must succeed");
+    }
+
+    ss_info_dassert(uring_submit_and_wait(ring, N_PAIRS) == N_PAIRS, "All sends must be submitted");
+
+    uint64_t user_data;
+    int res;
+    int n = 0;
+
+    while (uring_reap(ring, &user_data, &res))
+    {
+        ss_info_dassert(user_data < N_PAIRS, "User data must be returned");
+        ss_info_dassert(res == (int)strlen(data[user_data]) + 1, "Whole message must be sent");
+        n++;
+    }
+
+    ss_info_dassert(n == N_PAIRS, "All sends must complete");
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+static void test_recv(URING *ring)
+{
+    ss_dfprintf(stderr, "testuring : batched recv.");
+
+    char bufs[N_PAIRS][64];
+
+    for (int i = 0; i < N_PAIRS; i++)
+    {
+        ss_info_dassert(uring_prep_recv(ring, pairs[i][1], bufs[i], sizeof(bufs[i]), i),
+                        "Preparing must succeed");
+    }
+
+    ss_info_dassert(uring_submit_and_wait(ring, N_PAIRS) == N_PAIRS, "All receives must be submitted");
+
+    uint64_t user_data;
+    int res;
+    int n = 0;
+
+    while (uring_reap(ring, &user_data, &res))
+    {
+        char expected[32];
+        snprintf(expected, sizeof(expected), "pair %d!", (int)user_data);
+        ss_info_dassert(res == (int)strlen(expected), "Whole message must be received");
+        ss_info_dassert(memcmp(bufs[user_data], expected, res) == 0, "Data must match");
+        n++;
+    }
+
+    ss_info_dassert(n == N_PAIRS, "All receives must complete");
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+static void test_not_ready(URING *ring)
+{
+    ss_dfprintf(stderr, "testuring : receive from an empty socket.");
+
+    char buf[16];
+    uint64_t user_data;
+    int res;
+
+    ss_info_dassert(uring_prep_recv(ring, pairs[0][1], buf, sizeof(buf), 42), "Preparing must succeed");
+    ss_info_dassert(uring_submit_and_wait(ring, 1) == 1, "The receive must be submitted");
+    ss_info_dassert(uring_reap(ring, &user_data, &res), "The receive must complete at once");
+    ss_info_dassert(user_data == 42 && res == -EAGAIN, "An empty socket must return EAGAIN");
+    ss_info_dassert(!uring_reap(ring, &user_data, &res), "There must be no more completions");
+
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+static void test_full(URING *ring)
+{
+    ss_dfprintf(stderr, "testuring : full submission queue.");
+
+    char buf[16];
+    int n = 0;
+
+    while (uring_prep_recv(ring, pairs[0][1], buf, sizeof(buf), n))
+    {
+        n++;
+    }
+
+    ss_info_dassert(n == 16, "The queue must hold the requested number of entries");
+    ss_info_dassert(uring_submit_and_wait(ring, n) == n, "All entries must be submitted");
+
+    uint64_t user_data;
+    int res;
+
+    while (uring_reap(ring, &user_data, &res))
+    {
+        n--;
+    }
+
+    ss_info_dassert(n == 0, "All entries must complete");
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+int main(void)
+{
+    URING *ring = uring_create(16);
+
+    if (ring == NULL)
+    {
+        /** The kernel does not support io_uring or it is disabled */
+        ss_dfprintf(stderr, "testuring : io_uring is not available, error %d.\n", errno);
+        return 0;
+    }
+
+    for (int i = 0; i < N_PAIRS; i++)
+    {
+        ss_info_dassert(socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[i]) == 0, "socketpair must succeed");
+        fcntl(pairs[i][1], F_SETFL, O_NONBLOCK);
+    }
+
+    test_sendmsg(ring);
+    test_recv(ring);
+    test_not_ready(ring);
+    test_full(ring);
+
+    for (int i = 0; i < N_PAIRS; i++)
+    {
+        close(pairs[i][0]);
+        close(pairs[i][1]);
+    }
+
+    uring_free(ring);
+    return 0;
+}
@@ -0,0 +1,361 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file timerwheel.c A hierarchical timing wheel
+ *
+ * A timer that expires within TIMERWHEEL_SLOTS milliseconds is kept on the
+ * lowest level, in the slot of its expiry time. A timer that expires later
+ * is kept on the level whose slots are wide enough to cover the time that
+ * is left. Whenever the lowest level wraps around, the timers of the next
+ * slot of the level above are moved down to the slots that now cover them.
+ * A timer is thus moved at most once per level before it expires.
+ */
+
+#include <timerwheel.h>
+
+/** The mask that selects the slot index from a shifted expiry time */
+#define TIMERWHEEL_MASK (TIMERWHEEL_SLOTS - 1)
+
+/** The longest time, in milliseconds, the levels of the wheel can cover */
+#define TIMERWHEEL_RANGE ((1ULL << (TIMERWHEEL_BITS * TIMERWHEEL_LEVELS)) - 1)
+
+/**
+ * Link a timer to the end of a list
+ *
+ * @param head  The list head
+ * @param entry The timer to link
+ */
+static inline void
+timerwheel_link(TIMER_ENTRY *head, TIMER_ENTRY *entry)
+{
+    entry->next = head;
+    entry->prev = head->prev;
+    head->prev->next = entry;
+    head->prev = entry;
+}
+
+/**
+ * Unlink a timer from the list it is in
+ *
+ * @param entry The timer to unlink
+ */
+static inline void
+timerwheel_unlink(TIMER_ENTRY *entry)
+{
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->next = NULL;
+    entry->prev = NULL;
+}
+
+/**
+ * Place a timer in the slot where it belongs
+ *
+ * @param wheel     The wheel
+ * @param entry     The timer, its expiry time must not be earlier than wheel->now
+ */
+static void
+timerwheel_place(TIMER_WHEEL *wheel, TIMER_ENTRY *entry)
+{
+    uint64_t expiry = entry->expiry;
+    uint64_t delta = expiry - wheel->now;
+    int level;
+
+    if (delta > TIMERWHEEL_RANGE)
+    {
+        /** Park the timer in the furthest slot, it is placed again when it is cascaded */
+        expiry = wheel->now + TIMERWHEEL_RANGE;
+        delta = TIMERWHEEL_RANGE;
+    }
+
+    for (level = 0; level < TIMERWHEEL_LEVELS - 1; level++)
+    {
+        if (delta < (1ULL << (TIMERWHEEL_BITS * (level + 1))))
+        {
+            break;
+        }
+    }
+
+    timerwheel_link(&wheel->slots[level][(expiry >> (TIMERWHEEL_BITS * level)) & TIMERWHEEL_MASK],
+                    entry);
+    entry->level = level;
+    wheel->level_count[level]++;
+}
+
+/**
+ * Move the timers of a slot on a higher level to the slots that cover them now
+ *
+ * @param wheel The wheel
+ * @param level The level of the slot
+ * @param index The index of the slot
+ */
+static void
+timerwheel_cascade(TIMER_WHEEL *wheel, int level, int index)
+{
+    TIMER_ENTRY list;
+    TIMER_ENTRY *head = &wheel->slots[level][index];
+
+    if (timerwheel_list_empty(head))
+    {
+        return;
+    }
+
+    /** Detach the slot first, a parked timer may belong to the same slot again */
+    list.next = head->next;
+    list.prev = head->prev;
+    list.next->prev = &list;
+    list.prev->next = &list;
+    timerwheel_list_init(head);
+
+    while (!timerwheel_list_empty(&list))
+    {
+        TIMER_ENTRY *entry = list.next;
+
+        timerwheel_unlink(entry);
+        wheel->level_count[level]--;
+        timerwheel_place(wheel, entry);
+    }
+}
+
+/**
+ * Initialise a timing wheel
+ *
+ * @param wheel The wheel to initialise
+ * @param now   The current time in milliseconds
+ */
+void
+timerwheel_init(TIMER_WHEEL *wheel, uint64_t now)
+{
+    wheel->now = now;
+    wheel->count = 0;
+
+    for (int level = 0; level < TIMERWHEEL_LEVELS; level++)
+    {
+        wheel->level_count[level] = 0;
+
+        for (int i = 0; i < TIMERWHEEL_SLOTS; i++)
+        {
+            timerwheel_list_init(&wheel->slots[level][i]);
+        }
+    }
+}
+
+/**
+ * Initialise a timer that is not in any list
+ *
+ * @param entry The timer to initialise
+ */
+void
+timerwheel_entry_init(TIMER_ENTRY *entry)
+{
+    entry->next = NULL;
+    entry->prev = NULL;
+    entry->wheel = NULL;
+    entry->level = 0;
+    entry->expiry = 0;
+}
+
+/**
+ * Initialise an empty list of timers
+ *
+ * @param head The head of the list
+ */
+void
+timerwheel_list_init(TIMER_ENTRY *head)
+{
+    head->next = head;
+    head->prev = head;
+    head->wheel = NULL;
+    head->level = 0;
+    head->expiry = 0;
+}
+
+/**
+ * Add a timer to a wheel. A timer that is already in a wheel or a list is
+ * first removed from it. A timer whose expiry time has already passed
+ * expires the next time the wheel is advanced.
+ *
+ * @param wheel     The wheel
+ * @param entry     The timer to add
+ * @param expiry    When the timer expires, in milliseconds
+ */
+void
+timerwheel_add(TIMER_WHEEL *wheel, TIMER_ENTRY *entry, uint64_t expiry)
+{
+    timerwheel_remove(entry);
+
+    entry->expiry = expiry < wheel->now ? wheel->now : expiry;
+    timerwheel_place(wheel, entry);
+    entry->wheel = wheel;
+    wheel->count++;
+}
+
+/**
+ * Remove a timer from the wheel or the list of expired timers it is in.
+ * Removing a timer that is in neither has no effect.
+ *
+ * @param entry The timer to remove
+ */
+void
+timerwheel_remove(TIMER_ENTRY *entry)
+{
+    if (entry->next)
+    {
+        timerwheel_unlink(entry);
+
+        if (entry->wheel)
+        {
+            entry->wheel->level_count[entry->level]--;
+            entry->wheel->count--;
+            entry->wheel = NULL;
+        }
+    }
+}
+
+/**
+ * Check whether a timer is in a wheel or a list of expired timers
+ *
+ * @param entry The timer
+ * @return True if the timer is in a wheel or a list
+ */
+bool
+timerwheel_is_linked(TIMER_ENTRY *entry)
+{
+    return entry->next != NULL;
+}
+
+/**
+ * Advance the wheel to the current time
+ *
+ * The timers that expire at or before the given time are moved to the list
+ * of expired timers, in the order in which they expired. The caller can then
+ * process the list without being affected by timers that are added to or
+ * removed from the wheel during the processing.
+ *
+ * @param wheel     The wheel
+ * @param now       The current time in milliseconds
+ * @param expired   Initialised list where the expired timers are appended
+ * @return The number of timers that expired
+ */
+int
+timerwheel_advance(TIMER_WHEEL *wheel, uint64_t now, TIMER_ENTRY *expired)
+{
+    int n_expired = 0;
+
+    while (wheel->now <= now)
+    {
+        if (wheel->count == 0)
+        {
+            wheel->now = now + 1;
+            break;
+        }
+
+        if (wheel->level_count[0] == 0)
+        {
+            /**
+             * Nothing expires before the timers of the lowest occupied level
+             * are cascaded, which happens at a multiple of its slot width.
+             */
+            int level = 1;
+
+            while (wheel->level_count[level] == 0)
+            {
+                level++;
+            }
+
+            uint64_t width = 1ULL << (TIMERWHEEL_BITS * level);
+            uint64_t next = (wheel->now + width - 1) & ~(width - 1);
+
+            if (next > now)
+            {
+                wheel->now = now + 1;
+                break;
+            }
+            wheel->now = next;
+        }
+
+        int index = wheel->now & TIMERWHEEL_MASK;
+
+        if (index == 0)
+        {
+            for (int level = 1; level < TIMERWHEEL_LEVELS; level++)
+            {
+                int slot = (wheel->now >> (TIMERWHEEL_BITS * level)) & TIMERWHEEL_MASK;
+
+                timerwheel_cascade(wheel, level, slot);
+
+                if (slot != 0)
+                {
+                    break;
+                }
+            }
+        }
+
+        TIMER_ENTRY *head = &wheel->slots[0][index];
+
+        while (!timerwheel_list_empty(head))
+        {
+            TIMER_ENTRY *entry = head->next;
+
+            timerwheel_remove(entry);
+            timerwheel_link(expired, entry);
+            n_expired++;
+        }
+
+        wheel->now++;
+    }
+
+    return n_expired;
+}
+
+/**
+ * Return a time at which the wheel should next be advanced. The time is
+ * never later than the expiry time of the next timer, but it may be earlier
+ * if the next timer is on a higher level.
+ *
+ * @param wheel The wheel
+ * @return The time in milliseconds or UINT64_MAX if the wheel is empty
+ */
+uint64_t
+timerwheel_next_expiry(TIMER_WHEEL *wheel)
+{
+    if (wheel->count == 0)
+    {
+        return UINT64_MAX;
+    }
+
+    if (wheel->level_count[0] == 0)
+    {
+        int level = 1;
+
+        while (wheel->level_count[level] == 0)
+        {
+            level++;
+        }
+
+        uint64_t width = 1ULL << (TIMERWHEEL_BITS * level);
+        return (wheel->now + width - 1) & ~(width - 1);
+    }
+
+    for (uint64_t t = wheel->now; t < wheel->now + TIMERWHEEL_SLOTS; t++)
+    {
+        if ((t & TIMERWHEEL_MASK) == 0 ||
+            !timerwheel_list_empty(&wheel->slots[0][t & TIMERWHEEL_MASK]))
+        {
+            return t;
+        }
+    }
+
+    return wheel->now + TIMERWHEEL_SLOTS;
+}
@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file trace.c The binary event trace
+ *
+ * The trace file of a thread is created when the thread traces its first
+ * event. Only the owning thread writes to the file, so no locking is needed.
+ * As the files are shared memory mappings, the records written before a
+ * crash are in the files.
+ */
+
+#include <trace.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <atomic.h>
+#include <log_manager.h>
+
+bool trace_enabled = false;
+
+static char trace_dir[PATH_MAX + 1];
+static size_t trace_records;
+static int trace_nfiles;
+
+/** The trace file of the thread */
+static __thread TRACE_FILE_HEADER *trace_file;
+/** Set if the trace file of the thread could not be created */
+static __thread bool trace_failed;
+
+static const struct
+{
+    const char *name;
+    char        phase; /**< Chrome trace phase, B for begin, E for end, i for instant */
+} trace_events[TRACE_EVENT_MAX] =
+{
+    { "session_start",     'i' },
+    { "session_end",       'i' },
+    { "poll_events",       'B' },
+    { "poll_events",       'E' },
+    { "route_query",       'i' },
+    { "client_reply",      'i' },
+    { "query_point",       'i' },
+};
+
+static uint64_t trace_clock(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Enable tracing
+ *
+ * @param dir     Directory where the trace files are created
+ * @param records Number of records in the trace file of each thread, rounded
+ *                up to a power of two
+ * @return True if tracing was enabled
+ */
+bool trace_init(const char *dir, size_t records)
+{
+    /** Leave room for the file name */
+    if (strlen(dir) > PATH_MAX - 64)
+    {
+        MXS_ERROR("Trace directory name '%s' is too long.", dir);
+        return false;
+    }
+
+    size_t n = 1;
+
+    while (n < records)
+    {
+        n <<= 1;
+    }
+
+    strcpy(trace_dir, dir);
+    trace_records = n;
+    trace_enabled = true;
+
+    MXS_NOTICE("Tracing events to %s/maxscale.%d.*.trace, %lu records per thread.",
+               trace_dir, getpid(), trace_records);
+    return true;
+}
+
+/**
+ * Create and map the trace file of the calling thread
+ *
+ * @return The header of the mapped file or NULL on error
+ */
+static TRACE_FILE_HEADER *trace_open()
+{
+    char path[PATH_MAX + 1];
+    int n = atomic_add(&trace_nfiles, 1);
+    snprintf(path, sizeof(path), "%s/maxscale.%d.%d.trace", trace_dir, getpid(), n);
+
+    size_t size = sizeof(TRACE_FILE_HEADER) + trace_records * sizeof(TRACE_RECORD);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+    if (fd == -1)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("Failed to create trace file '%s': %d, %s", path, errno,
+                  strerror_r(errno, errbuf, sizeof(errbuf)));
+        return NULL;
+    }
+
+    void *map = MAP_FAILED;
+
+    if (ftruncate(fd, size) == 0)
+    {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+
+    if (map == MAP_FAILED)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("Failed to map trace file '%s': %d, %s", path, errno,
+                  strerror_r(errno, errbuf, sizeof(errbuf)));
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+
+    close(fd);
+
+    TRACE_FILE_HEADER *hdr = (TRACE_FILE_HEADER*)map;
+    memcpy(hdr->th_magic, TRACE_MAGIC, sizeof(hdr->th_magic));
+    hdr->th_version = TRACE_VERSION;
+    hdr->th_record_size = sizeof(TRACE_RECORD);
+    hdr->th_records = trace_records;
+    hdr->th_written = 0;
+    hdr->th_thread = n;
+    hdr->th_mono_start = trace_clock(CLOCK_MONOTONIC);
+    hdr->th_real_start = trace_clock(CLOCK_REALTIME);
+
+    return hdr;
+}
+
+/**
+ * Write an event to the trace file of the calling thread. Use the TRACE_EVENT
+ * macro instead of calling this directly.
+ *
+ * @param event   One of trace_event_t
+ * @param session Session id or 0
+ * @param arg1    Event specific argument
+ * @param arg2    Event specific argument
+ */
+void trace_event(uint32_t event, uint64_t session, uint32_t arg1, uint64_t arg2)
+{
+    TRACE_FILE_HEADER *hdr = trace_file;
+
+    if (hdr == NULL)
+    {
+        if (trace_failed || (hdr = trace_open()) == NULL)
+        {
+            trace_failed = true;
+            return;
+        }
+
+        trace_file = hdr;
+    }
+
+    uint64_t n = hdr->th_written;
+    TRACE_RECORD *rec = (TRACE_RECORD*)(hdr + 1) + (n & (hdr->th_records - 1));
+
+    rec->tr_time = trace_clock(CLOCK_MONOTONIC);
+    rec->tr_session = session;
+    rec->tr_event = event;
+    rec->tr_arg1 = arg1;
+    rec->tr_arg2 = arg2;
+
+    __atomic_store_n(&hdr->th_written, n + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @param event One of trace_event_t
+ * @return The name of the event
+ */
+const char *trace_event_name(uint32_t event)
+{
+    return event < TRACE_EVENT_MAX ? trace_events[event].name : "unknown";
+}
+
+/**
+ * @param event One of trace_event_t
+ * @return The Chrome trace phase of the event
+ */
+char trace_event_phase(uint32_t event)
+{
+    return event < TRACE_EVENT_MAX ? trace_events[event].phase : 'i';
+}
@@ -0,0 +1,362 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file uring.c A minimal io_uring submission and completion ring
+ *
+ * The submission queue entries are filled in at the local tail and published
+ * to the kernel with a release store of the ring tail when they are
+ * submitted. The completions are read up to the tail the kernel has
+ * published and consumed by advancing the head of the completion ring.
+ */
+
+#include <uring.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+
+#if defined(HAVE_IO_URING)
+
+struct uring
+{
+    int                  fd;            /*< The ring file descriptor */
+    /** The submission ring */
+    unsigned int         *sq_head;
+    unsigned int         *sq_tail;
+    unsigned int         *sq_mask;
+    unsigned int         *sq_array;
+    unsigned int         sq_entries;
+    unsigned int         sq_local_tail; /*< Tail of the prepared entries */
+    unsigned int         sq_submitted;  /*< Tail that has been given to the kernel */
+    struct io_uring_sqe  *sqes;
+    /** The completion ring */
+    unsigned int         *cq_head;
+    unsigned int         *cq_tail;
+    unsigned int         *cq_mask;
+    struct io_uring_cqe  *cqes;
+    /** The mappings */
+    void                 *sq_ring;
+    size_t               sq_ring_size;
+    void                 *cq_ring;
+    size_t               cq_ring_size;
+    size_t               sqes_size;
+};
+
+static int uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/**
+ * Create a ring
+ *
+ * @param entries Number of submission queue entries, rounded up to a power of two
+ * @return The ring or NULL if io_uring is not available, errno is set
+ */
+URING *uring_create(unsigned int entries)
+{
+    struct io_uring_params params;
+    URING *ring = calloc(1, sizeof(URING));
+
+    if (ring == NULL)
+    {
+        return NULL;
+    }
+
+    memset(&params, 0, sizeof(params));
+
+    if ((ring->fd = uring_setup(entries, &params)) < 0)
+    {
+        free(ring);
+        return NULL;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+        {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+
+    if (ring->sq_ring == MAP_FAILED)
+    {
+        close(ring->fd);
+        free(ring);
+        return NULL;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cq_ring = ring->sq_ring;
+    }
+    else
+    {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+
+        if (ring->cq_ring == MAP_FAILED)
+        {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            close(ring->fd);
+            free(ring);
+            return NULL;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+    if (ring->sqes == MAP_FAILED)
+    {
+        if (ring->cq_ring != ring->sq_ring)
+        {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        free(ring);
+        return NULL;
+    }
+
+    char *sq = ring->sq_ring;
+    ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->sq_submitted = ring->sq_local_tail;
+
+    char *cq = ring->cq_ring;
+    ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return ring;
+}
+
+/**
+ * Free a ring
+ *
+ * @param ring The ring, may be NULL
+ */
+void uring_free(URING *ring)
+{
+    if (ring)
+    {
+        munmap(ring->sqes, ring->sqes_size);
+        if (ring->cq_ring != ring->sq_ring)
+        {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        free(ring);
+    }
+}
+
+/**
+ * Get the next free submission queue entry
+ *
+ * @param ring The ring
+ * @return A cleared entry or NULL if the submission queue is full
+ */
+static struct io_uring_sqe *uring_get_sqe(URING *ring)
+{
+    unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if (ring->sq_local_tail - head >= ring->sq_entries)
+    {
+        return NULL;
+    }
+
+    unsigned int index = ring->sq_local_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+
+    return sqe;
+}
+
+/**
+ * Prepare a receive from a socket
+ *
+ * @param ring      The ring
+ * @param fd        The socket
+ * @param buf       Buffer for the data
+ * @param len       Size of the buffer
+ * @param user_data Value returned with the completion
+ * @return True if the operation was prepared, false if the queue is full
+ */
+bool uring_prep_recv(URING *ring, int fd, void *buf, size_t len, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+
+    if (sqe == NULL)
+    {
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->msg_flags = MSG_DONTWAIT;
+    sqe->user_data = user_data;
+
+    return true;
+}
+
+/**
+ * Prepare a sendmsg to a socket
+ *
+ * The message and the buffers it refers to must be valid until the
+ * operation has completed.
+ *
+ * @param ring      The ring
+ * @param fd        The socket
+ * @param msg       The message
+ * @param user_data Value returned with the completion
+ * @return True if the operation was prepared, false if the queue is full
+ */
+bool uring_prep_sendmsg(URING *ring, int fd, const struct msghdr *msg, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+
+    if (sqe == NULL)
+    {
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+
+    return true;
+}
+
+/**
+ * Submit the prepared operations and wait for completions
+ *
+ * @param ring    The ring
+ * @param wait_nr Number of completions to wait for
+ * @return Number of submitted operations or -errno on error
+ */
+int uring_submit_and_wait(URING *ring, unsigned int wait_nr)
+{
+    unsigned int to_submit = ring->sq_local_tail - ring->sq_submitted;
+    int rc;
+
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    do
+    {
+        rc = uring_enter(ring->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    }
+    while (rc < 0 && errno == EINTR);
+
+    if (rc < 0)
+    {
+        return -errno;
+    }
+
+    ring->sq_submitted += rc;
+    return rc;
+}
+
+/**
+ * Consume one completion
+ *
+ * @param ring      The ring
+ * @param user_data Set to the value given when the operation was prepared
+ * @param res       Set to the result of the operation, -errno on error
+ * @return True if there was a completion
+ */
+bool uring_reap(URING *ring, uint64_t *user_data, int *res)
+{
+    unsigned int head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        return false;
+    }
+
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+#else /* HAVE_IO_URING */
+
+URING *uring_create(unsigned int entries)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+void uring_free(URING *ring)
+{
+}
+
+bool uring_prep_recv(URING *ring, int fd, void *buf, size_t len, uint64_t user_data)
+{
+    return false;
+}
+
+bool uring_prep_sendmsg(URING *ring, int fd, const struct msghdr *msg, uint64_t user_data)
+{
+    return false;
+}
+
+int uring_submit_and_wait(URING *ring, unsigned int wait_nr)
+{
+    return -ENOSYS;
+}
+
+bool uring_reap(URING *ring, uint64_t *user_data, int *res)
+{
+    return false;
+}
+
+#endif /* HAVE_IO_URING */
@@ -38,6 +38,10 @@
 #include <log_manager.h>
 #include <secrets.h>
 #include <random_jkiss.h>
+#include <platform.h>
+
+/** Number of random characters that a thread generates at a time */
+#define RANDOM_POOL_SIZE 512
 
 /* used in the hex2bin function */
 #define char_val(X) (X >= '0' && X <= '9' ? X-'0' :     \
@@ -89,12 +93,33 @@ char *gw_strend(register const char *s)
     return (char*) (s - 1);
 }
 
+/** The random characters not yet used by this thread */
+static thread_local char random_pool[RANDOM_POOL_SIZE];
+static thread_local int random_pool_used = RANDOM_POOL_SIZE;
+
 /*****************************************
  * generate a random char
+ *
+ * The characters are taken from a pool of
+ * the thread which is refilled with one
+ * acquisition of the generator lock
  *****************************************/
 static char gw_randomchar()
 {
-    return (char)((random_jkiss() % 78) + 30);
+    if (random_pool_used == RANDOM_POOL_SIZE)
+    {
+        unsigned int values[RANDOM_POOL_SIZE];
+
+        random_jkiss_fill(values, RANDOM_POOL_SIZE);
+
+        for (int i = 0; i < RANDOM_POOL_SIZE; i++)
+        {
+            random_pool[i] = (char)((values[i] % 78) + 30);
+        }
+        random_pool_used = 0;
+    }
+
+    return random_pool[random_pool_used++];
 }
 
 /*****************************************
@@ -0,0 +1,37 @@
+#ifndef _ADMIN_THREAD_H
+#define _ADMIN_THREAD_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file admin_thread.h The thread that runs the administrative commands
+ *
+ * The commands of maxadmin and maxinfo are run in a separate low priority
+ * thread so that the diagnostic output doesn't stall the worker threads.
+ * The tasks are run one at a time in the order they were added.
+ */
+
+#include <stdbool.h>
+#include <session.h>
+
+/**
+ * An administrative task. The session that added the task stays allocated
+ * until the task has returned.
+ */
+typedef void (*ADMIN_TASK_FN)(SESSION *session, void *data);
+
+extern void admin_thread_init();
+extern void admin_thread_shutdown();
+extern bool admin_task_add(SESSION *session, ADMIN_TASK_FN task, void *data);
+
+#endif
@@ -39,6 +39,8 @@
  *                                      Add more buffer handling macros
  *                                      Add gwbuf_rtrim (handle chains)
  * 09/11/2014   Martin Brampton         Add dprintAllBuffers (conditional compilation)
+ * 14/10/2016                           Share the hints and properties between clones
+ * 14/10/2016                           Add iterators over the segments of a buffer chain
  *
  * @endverbatim
  */
@@ -47,6 +49,8 @@
 #include <hint.h>
 #include <spinlock.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <sys/uio.h>
 
 EXTERN_C_BLOCK_BEGIN
 
@@ -54,12 +58,17 @@ EXTERN_C_BLOCK_BEGIN
  * Buffer properties - used to store properties related to the buffer
  * contents. This may be added at any point during the processing of the
  * data, especially in the protocol stage of the processing.
+ *
+ * Like the hints, the properties are shared with the clones of the buffer
+ * and are never modified once added. A new property is added in front of
+ * the list.
  */
 typedef struct buf_property
 {
     char                    *name;
     char                    *value;
-    struct buf_property     *next;
+    int                     refcount; /*< Number of references to the property */
+    struct buf_property     *next;    /*< The next property, referenced by this one */
 } BUF_PROPERTY;
 
 typedef enum
@@ -82,30 +91,15 @@ typedef enum
 #define GWBUF_IS_TYPE_RESPONSE_END(b)    (b->gwbuf_type & GWBUF_TYPE_RESPONSE_END)
 #define GWBUF_IS_TYPE_SESCMD(b)          (b->gwbuf_type & GWBUF_TYPE_SESCMD)
 
-/**
- * A structure to encapsulate the data in a form that the data itself can be
- * shared between multiple GWBUF's without the need to make multiple copies
- * but still maintain separate data pointers.
- */
-typedef struct
-{
-    unsigned char   *data;                  /*< Physical memory that was allocated */
-    int             refcount;               /*< Reference count on the buffer */
-} SHARED_BUF;
-
-typedef enum
-{
-    GWBUF_INFO_NONE         = 0x0,
-    GWBUF_INFO_PARSED       = 0x1
-} gwbuf_info_t;
-
-#define GWBUF_IS_PARSED(b)      (b->gwbuf_info & GWBUF_INFO_PARSED)
-
 /**
  * A structure for cleaning up memory allocations of structures which are
  * referred to by GWBUF and deallocated in gwbuf_free but GWBUF doesn't
  * know what they are.
  * All functions on the list are executed before freeing memory of GWBUF struct.
+ *
+ * The objects are kept with the shared data so that the clones of a buffer
+ * see them. An object is only valid for the range of data it was added for,
+ * a buffer that has been split, consumed or appended to does not see it.
  */
 typedef enum
 {
@@ -119,9 +113,33 @@ struct buffer_object_st
     bufobj_id_t      bo_id;
     void*            bo_data;
     void            (*bo_donefun_fp)(void *);
+    void*            bo_start;  /*< Start of the data the object was added for */
+    size_t           bo_length; /*< Length of the data the object was added for */
     buffer_object_t* bo_next;
 };
 
+/**
+ * A structure to encapsulate the data in a form that the data itself can be
+ * shared between multiple GWBUF's without the need to make multiple copies
+ * but still maintain separate data pointers.
+ */
+typedef struct
+{
+    unsigned char   *data;                  /*< Physical memory that was allocated */
+    int             refcount;               /*< Reference count on the buffer */
+    int             pool;                   /*< Size class of the block, -1 if none */
+    SPINLOCK        bufobj_lock;            /*< Protects the buffer object list */
+    buffer_object_t *bufobj;                /*< Objects referred to by the data */
+} SHARED_BUF;
+
+typedef enum
+{
+    GWBUF_INFO_NONE         = 0x0,
+    GWBUF_INFO_PARSED       = 0x1
+} gwbuf_info_t;
+
+#define GWBUF_IS_PARSED(b)      (gwbuf_get_buffer_object_data((b), GWBUF_PARSING_INFO) != NULL)
+
 
 /**
  * The buffer structure used by the descriptor control blocks.
@@ -133,17 +151,15 @@ struct buffer_object_st
  */
 typedef struct gwbuf
 {
-    SPINLOCK        gwbuf_lock;
     struct gwbuf    *next;  /*< Next buffer in a linked chain of buffers */
     struct gwbuf    *tail;  /*< Last buffer in a linked chain of buffers */
     void            *start; /*< Start of the valid data */
     void            *end;   /*< First byte after the valid data */
     SHARED_BUF      *sbuf;  /*< The shared buffer with the real data */
-    buffer_object_t *gwbuf_bufobj; /*< List of objects referred to by GWBUF */
     gwbuf_info_t    gwbuf_info; /*< Info bits */
     gwbuf_type_t    gwbuf_type; /*< buffer's data type information */
-    HINT            *hint;  /*< Hint data for this buffer */
-    BUF_PROPERTY    *properties; /*< Buffer properties */
+    HINT            *hint;  /*< Hint data for this buffer, shared with the clones */
+    BUF_PROPERTY    *properties; /*< Buffer properties, shared with the clones */
 } GWBUF;
 
 /*<
@@ -179,6 +195,26 @@ typedef struct gwbuf
      (void *)((char *)(b)->end - (bytes)));
 
 #define GWBUF_TYPE(b) (b)->gwbuf_type
+
+/*< True if the data of a chain is in one buffer */
+#define GWBUF_IS_CONTIGUOUS(b)  ((b)->next == NULL)
+
+/**
+ * An iterator over the segments of a chain of buffers. The iterator gives the
+ * data of each buffer in turn so that a chain can be read without making it
+ * contiguous first.
+ */
+typedef struct gwbuf_iter
+{
+    GWBUF   *buffer;    /*< The current buffer */
+    size_t  offset;     /*< Offset into the current buffer */
+    size_t  left;       /*< Bytes left in the range being iterated */
+} GWBUF_ITER;
+/*< The largest data size that is allocated from the buffer pools */
+#define GWBUF_MAX_POOLED_SIZE 16384
+/*< The data size of the smallest buffers, e.g. OK packets and COM_PING */
+#define GWBUF_SMALL_SIZE 64
+
 /*<
  * Function prototypes for the API to maniplate the buffers
  */
@@ -201,6 +237,11 @@ extern void             gwbuf_set_type(GWBUF *head, gwbuf_type_t type);
 extern int              gwbuf_add_property(GWBUF *buf, char *name, char *value);
 extern char             *gwbuf_get_property(GWBUF *buf, char *name);
 extern GWBUF            *gwbuf_make_contiguous(GWBUF *);
+extern void             gwbuf_iter_init(GWBUF_ITER *iter, GWBUF *head, size_t offset, size_t length);
+extern bool             gwbuf_iter_next(GWBUF_ITER *iter, uint8_t **data, size_t *length);
+extern int              gwbuf_iovec(GWBUF *head, size_t offset, size_t length,
+                                    struct iovec *iov, int n_iov);
+extern int              gwbuf_compare(GWBUF *lhs, GWBUF *rhs);
 extern int              gwbuf_add_hint(GWBUF *, HINT *);
 
 void                    gwbuf_add_buffer_object(GWBUF* buf,
@@ -208,9 +249,13 @@ void                    gwbuf_add_buffer_object(GWBUF* buf,
                                                 void*  data,
                                                 void (*donefun_fp)(void *));
 void*                   gwbuf_get_buffer_object_data(GWBUF* buf, bufobj_id_t id);
+void                    gwbuf_clear_buffer_object(GWBUF* buf, bufobj_id_t id);
 #if defined(BUFFER_TRACE)
 extern void             dprintAllBuffers(void *pdcb);
 #endif
+extern void             dprintBufferPools(void *pdcb);
+extern int64_t          gwbuf_pool_allocations(void);
+extern void             gwbuf_thread_end(void);
 EXTERN_C_BLOCK_END
 
 
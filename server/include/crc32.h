@@ -0,0 +1,36 @@
+#ifndef _CRC32_H
+#define _CRC32_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file crc32.h The CRC-32 of zlib computed with the instructions of the CPU
+ *
+ * The checksum is the same as the one returned by the @c crc32 function of
+ * zlib, which is used for the binlog event checksums. The implementation is
+ * chosen when the checksum is first computed: carry-less multiplication
+ * (PCLMULQDQ) on x86-64, the CRC32 instructions on ARMv8 and zlib on other
+ * processors.
+ *
+ * As with zlib, the checksum of a buffer that is split into parts is computed
+ * by passing the checksum of the previous parts as @c crc, the initial value
+ * is 0.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+extern uint32_t    mxs_crc32(uint32_t crc, const uint8_t *buf, size_t len);
+extern const char *mxs_crc32_impl();
+
+#endif
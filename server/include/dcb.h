@@ -20,7 +20,10 @@
 #include <modinfo.h>
 #include <gwbitmask.h>
 #include <skygw_utils.h>
+#include <timerwheel.h>
+#include <log_manager.h>
 #include <netinet/in.h>
+#include <sys/types.h>
 
 #define ERRHANDLE
 
@@ -75,6 +78,8 @@ struct dcb;
  *      eventqlock              Spinlock to protect this structure
  *      inserted                Insertion time for logging purposes
  *      started                 Time that the processign started
+ *      inserted_cycles         Insertion time in CPU cycles, only set when
+ *                              high precision event times are enabled
  */
 typedef struct
 {
@@ -86,6 +91,7 @@ typedef struct
     SPINLOCK        eventqlock;
     unsigned long   inserted;
     unsigned long   started;
+    unsigned long long inserted_cycles;
 } DCBEVENTQ;
 
 #define DCBFD_CLOSED -1
@@ -101,6 +107,11 @@ typedef struct dcbstats
     int     n_buffered;     /*< Number of buffered writes */
     int     n_high_water;   /*< Number of crosses of high water mark */
     int     n_low_water;    /*< Number of crosses of low water mark */
+    uint64_t n_compress_in;     /*< Bytes given to the protocol compression */
+    uint64_t n_compress_out;    /*< Bytes written after the compression */
+    uint64_t n_decompress_in;   /*< Compressed bytes read */
+    uint64_t n_decompress_out;  /*< Bytes the decompression produced */
+    uint64_t n_compress_usecs;  /*< CPU time used by compression and decompression */
 } DCBSTATS;
 
 /**
@@ -115,15 +126,15 @@ typedef struct dcbstats
  * processing an event that will access the DCB.
  *
  * We solve this issue by making the dcb_free routine merely mark a DCB as a zombie and
- * place it on a special zombie list. Before placing the DCB on the zombie list we create
- * a bitmask with a bit set in it for each active polling thread. Each thread will call
- * a routine to process the zombie list at the end of the polling loop. This routine
- * will clear the bit value that corresponds to the calling thread. Once the bitmask
- * is completely cleared the DCB can finally be freed and removed from the zombie list.
+ * place it on a special zombie list. Before placing the DCB on the zombie list it is
+ * given a new epoch. Each thread will call a routine to process the zombie list at the
+ * end of the polling loop. This routine announces that the calling thread has passed
+ * the current epoch. Once every active polling thread has passed the epoch of the DCB
+ * it can finally be freed and removed from the zombie list.
  */
 typedef struct
 {
-    GWBITMASK       bitmask;        /*< The bitmask of threads */
+    uint64_t        epoch;          /*< The epoch in which the DCB was retired */
     struct dcb      *next;          /*< Next pointer for the zombie list */
 } DCBMM;
 
@@ -206,6 +217,7 @@ typedef struct dcb
     dcb_role_t      dcb_role;
     SPINLOCK        dcb_initlock;
     DCBEVENTQ       evq;            /**< The event queue for this DCB */
+    int             owner;          /**< Thread whose poll set holds the DCB, -1 if none */
     int             fd;             /**< The descriptor */
     dcb_state_t     state;          /**< Current descriptor state */
     SSL_STATE       ssl_state;      /**< Current state of SSL if in use */
@@ -219,10 +231,12 @@ typedef struct dcb
     size_t           protocol_bytes_processed; /**< How many bytes of a packet have been read */
     struct session  *session;       /**< The owning session */
     struct servlistener *listener;  /**< For a client DCB, the listener data */
+    struct dcb      *admit_next;    /**< Next queued connection admitted on the same listener */
     GWPROTOCOL      func;           /**< The protocol functions for this descriptor */
     GWAUTHENTICATOR authfunc;       /**< The authenticator functions for this descriptor */
 
     int             writeqlen;      /**< Current number of byes in the write queue */
+    int             memory;         /**< Bytes of the queues charged to the session */
     SPINLOCK        writeqlock;     /**< Write Queue spinlock */
     GWBUF           *writeq;        /**< Write Data Queue */
     SPINLOCK        delayqlock;     /**< Delay Backend Write Queue spinlock */
@@ -234,6 +248,10 @@ typedef struct dcb
     unsigned int    dcb_server_status; /*< the server role indicator from SERVER */
     struct dcb      *next;          /**< Next DCB in the chain of allocated DCB's */
     struct dcb      *nextpersistent;   /**< Next DCB in the persistent pool for SERVER */
+    struct dcb      *nextfree;      /**< Next DCB in a pool of free DCBs */
+    struct dcb      *nextlistener;  /**< Next SO_REUSEPORT listener of the same port */
+    unsigned int    n_accepted;     /**< Connections accepted in the current accept event */
+    TIMER_ENTRY     connect_timer;  /**< Expires if a new backend connection does not respond */
     time_t          persistentstart;   /**< Time when DCB placed in persistent pool */
     struct service  *service;       /**< The related service */
     void            *data;          /**< Specific client data */
@@ -250,12 +268,23 @@ typedef struct dcb
     long            last_read;      /*< Last time the DCB received data */
     int             high_water;     /**< High water mark */
     int             low_water;      /**< Low water mark */
+    bool            backends_paused; /**< Reads from the backend DCBs of the session are paused */
+    bool            reads_paused;   /**< Read events of this DCB are not reported */
+    bool            client_paused;  /**< This backend DCB paused the reads from the client */
+    int             n_pausing;      /**< Number of backend DCBs and other reasons that paused
+                                     * the reads of this client DCB */
     struct server   *server;        /**< The associated backend server */
+    struct dcb      *server_next;   /**< Next DCB in the list of DCBs of the server */
+    struct dcb      *server_prev;   /**< Previous DCB in the list of DCBs of the server */
     SSL*            ssl;            /*< SSL struct for connection */
     bool            ssl_read_want_read;    /*< Flag */
     bool            ssl_read_want_write;    /*< Flag */
     bool            ssl_write_want_read;    /*< Flag */
     bool            ssl_write_want_write;    /*< Flag */
+    bool            ssl_ktls_send;  /*< The kernel encrypts the data written to the socket */
+    bool            in_write_batch; /*< The write queue is drained when the write batch ends */
+    GWBUF           *readahead;     /*< Data received through io_uring before the read handler */
+    bool            readahead_drained; /*< The socket had no more data after the read ahead */
     int             dcb_port;       /**< port of target server */
     skygw_chk_t     dcb_chk_tail;
 } DCB;
@@ -288,7 +317,7 @@ int           fail_accept_errno;
 #define DCB_ISZOMBIE(x)                 ((x)->state == DCB_STATE_ZOMBIE)
 #define DCB_WRITEQLEN(x)                (x)->writeqlen
 #define DCB_SET_LOW_WATER(x, lo)        (x)->low_water = (lo);
-#define DCB_SET_HIGH_WATER(x, hi)       (x)->low_water = (hi);
+#define DCB_SET_HIGH_WATER(x, hi)       (x)->high_water = (hi);
 #define DCB_BELOW_LOW_WATER(x)          ((x)->low_water && (x)->writeqlen < (x)->low_water)
 #define DCB_ABOVE_HIGH_WATER(x)         ((x)->high_water && (x)->writeqlen > (x)->high_water)
 
@@ -296,6 +325,7 @@ int           fail_accept_errno;
 
 DCB *dcb_get_zombies(void);
 int dcb_write(DCB *, GWBUF *);
+int dcb_sendfile(DCB *, uint8_t *, size_t, int, off_t, size_t, bool *);
 DCB *dcb_accept(DCB *listener, GWPROTOCOL *protocol_funcs);
 DCB *dcb_alloc(dcb_role_t, struct servlistener *);
 void dcb_free(DCB *);
@@ -304,8 +334,17 @@ DCB *dcb_connect(struct server *, struct session *, const char *);
 DCB *dcb_clone(DCB *);
 int dcb_read(DCB *, GWBUF **, int);
 int dcb_drain_writeq(DCB *);
+void dcb_write_batch_begin(void);
+void dcb_write_batch_end(void);
+void dcb_read_ahead(DCB **dcbs, int n);
 void dcb_close(DCB *);
 DCB *dcb_process_zombies(int);              /* Process Zombies except the one behind the pointer */
+void dcb_retire(void *data, void (*free_fn)(void *));
+bool dcb_global_init(int n_threads);
+void dcb_thread_end();
+void dcb_connect_responded(DCB *dcb);
+void dcb_process_connect_timeouts(void);
+void dcb_admit_queued(struct service *service);
 void printAllDCBs();                         /* Debug to print all DCB in the system */
 void printDCB(DCB *);                        /* Debug print routine */
 void dprintAllDCBs(DCB *);                   /* Debug to print all DCB in the system */
@@ -313,6 +352,7 @@ void dprintOneDCB(DCB *, DCB *);             /* Debug to print one DCB */
 void dprintDCB(DCB *, DCB *);                /* Debug to print a DCB in the system */
 void dListDCBs(DCB *);                       /* List all DCBs in the system */
 void dListClients(DCB *);                    /* List al the client DCBs */
+void dShowIOStats(DCB *);                    /* Show the socket I/O statistics */
 const char *gw_dcb_state2string(dcb_state_t);              /* DCB state to string */
 void dcb_printf(DCB *, const char *, ...) __attribute__((format(printf, 2, 3))); /* DCB version of printf */
 void dcb_hashtable_stats(DCB *, void *);     /**< Print statisitics */
@@ -320,17 +360,38 @@ int dcb_add_callback(DCB *, DCB_REASON, int (*)(struct dcb *, DCB_REASON, void *
 int dcb_remove_callback(DCB *, DCB_REASON, int (*)(struct dcb *, DCB_REASON, void *), void *);
 int dcb_isvalid(DCB *);                     /* Check the DCB is in the linked list */
 int dcb_count_by_usage(DCB_USAGE);          /* Return counts of DCBs */
-int dcb_persistent_clean_count(DCB *, bool);      /* Clean persistent and return count */
+void dcb_count_listening(int n);            /* Count DCBs entering or leaving the listening state */
+void dcb_account_memory(DCB *dcb, int n);   /* Charge queued bytes to the session of a DCB */
+int dcb_persistent_clean_count(struct server *, bool); /* Clean persistent and return count */
 
 void dcb_call_foreach (struct server* server, DCB_REASON reason);
 void dcb_hangup_foreach (struct server* server);
+int dcb_get_session_dcbs(struct session *session, DCB **dcbs, int size);
 size_t dcb_get_session_id(DCB* dcb);
 bool dcb_get_ses_log_info(DCB* dcb, size_t* sesid, int* enabled_logs);
+
+/**
+ * Store the session id and log priorities of a DCB to the thread's log
+ * information. The session is only looked up if the information is used.
+ *
+ * @param dcb DCB
+ */
+static inline void dcb_set_ses_log_info(DCB *dcb)
+{
+    if (MXS_LOG_SESSION_INFO_IS_NEEDED())
+    {
+        dcb_get_ses_log_info(dcb, &mxs_log_tls.li_sesid, &mxs_log_tls.li_enabled_priorities);
+    }
+}
 char *dcb_role_name(DCB *);                  /* Return the name of a role */
 int dcb_accept_SSL(DCB* dcb);
 int dcb_connect_SSL(DCB* dcb);
 int dcb_listen(DCB *listener, const char *config, const char *protocol_name);
+void dcb_listener_set_session(DCB *listener);
 void dcb_append_readqueue(DCB *dcb, GWBUF *buffer);
+bool dcb_pool_fill_done(DCB *dcb, bool success);
+void dcb_suspend_reads(DCB *client);
+void dcb_resume_reads(DCB *client);
 
 /**
  * DCB flags values
@@ -338,6 +399,8 @@ void dcb_append_readqueue(DCB *dcb, GWBUF *buffer);
 #define DCBF_CLONE              0x0001  /*< DCB is a clone */
 #define DCBF_HUNG               0x0002  /*< Hangup has been dispatched */
 #define DCBF_REPLIED    0x0004  /*< DCB was written to */
+#define DCBF_REUSEPORT          0x0008  /*< Listener has a SO_REUSEPORT socket of its own thread */
+#define DCBF_POOL_FILL          0x0010  /*< Connection is opened to fill the persistent pool */
 
 #define DCB_IS_CLONE(d) ((d)->flags & DCBF_CLONE)
 #define DCB_REPLIED(d) ((d)->flags & DCBF_REPLIED)
@@ -14,6 +14,7 @@
  */
 
 #include <unistd.h>
+#include <time.h>
 #include <string.h>
 #include <errno.h>
 #include <skygw_utils.h>
@@ -22,18 +23,34 @@
 
 #define MAXSCALE_EXTCMD_ARG_MAX 256
 
+struct extern_cmd_t;
+
+/**
+ * Called when a command started with externcmd_start exits. The status is the
+ * one returned by waitpid. The command is freed when the callback returns.
+ */
+typedef void (*EXTERNCMD_CB)(struct extern_cmd_t *cmd, int status, void *data);
+
 typedef struct extern_cmd_t
 {
     char** argv; /*< Argument vector for the command, first being the actual command
                 * being executed. */
     int n_exec; /*< Number of times executed */
     pid_t child; /*< PID of the child process */
+    int timeout; /*< Seconds the command may run, 0 for no limit */
+    time_t started; /*< When the command was started */
+    time_t killed; /*< When the command was terminated for running too long, 0 if not */
+    EXTERNCMD_CB callback; /*< Called when the command exits */
+    void *data; /*< Data passed to the callback */
+    struct extern_cmd_t *next; /*< Next running command */
 } EXTERNCMD;
 
 char* externcmd_extract_command(const char* argstr);
 EXTERNCMD* externcmd_allocate(char* argstr);
 void externcmd_free(EXTERNCMD* cmd);
 int externcmd_execute(EXTERNCMD* cmd);
+bool externcmd_start(EXTERNCMD* cmd, int timeout, EXTERNCMD_CB callback, void *data);
+void externcmd_sigchld();
 bool externcmd_substitute_arg(EXTERNCMD* cmd, const char* re, const char* replace);
 bool externcmd_can_execute(const char* argstr);
 bool externcmd_matches(const EXTERNCMD* cmd, const char* match);
@@ -60,6 +60,10 @@ typedef struct
  *      clientReply             Called for each reply packet
  *      diagnostics             Called to force the filter to print
  *                              diagnostic output
+ *      getInterest             Optional, returns the FILTER_INTEREST_* bits
+ *                              of the packets the filter acts on. The packets
+ *                              of other classes bypass the filter. A filter
+ *                              without the entry point sees all packets.
  *
  * @endverbatim
  *
@@ -76,14 +80,38 @@ typedef struct filter_object
     int    (*routeQuery)(FILTER *instance, void *fsession, GWBUF *queue);
     int    (*clientReply)(FILTER *instance, void *fsession, GWBUF *queue);
     void   (*diagnostics)(FILTER *instance, void *fsession, DCB *dcb);
+    uint32_t (*getInterest)(FILTER *instance);
 } FILTER_OBJECT;
 
+/**
+ * The classes of packets a filter can declare an interest in. The class of
+ * a client packet is the command byte of its first packet, a filter that is
+ * not interested in it must pass such packets through unmodified.
+ */
+typedef enum
+{
+    FILTER_CLASS_QUERY,   /**< COM_QUERY */
+    FILTER_CLASS_PREPARE, /**< COM_STMT_PREPARE */
+    FILTER_CLASS_INIT_DB, /**< COM_INIT_DB */
+    FILTER_CLASS_OTHER    /**< All other client packets */
+} filter_class_t;
+
+#define FILTER_INTEREST_QUERY   (1 << FILTER_CLASS_QUERY)
+#define FILTER_INTEREST_PREPARE (1 << FILTER_CLASS_PREPARE)
+#define FILTER_INTEREST_INIT_DB (1 << FILTER_CLASS_INIT_DB)
+#define FILTER_INTEREST_OTHER   (1 << FILTER_CLASS_OTHER)
+#define FILTER_INTEREST_REPLIES 0x10 /**< The replies of the servers */
+
+/** The packets that contain SQL, see modutil_get_SQL */
+#define FILTER_INTEREST_SQL (FILTER_INTEREST_QUERY | FILTER_INTEREST_PREPARE | FILTER_INTEREST_INIT_DB)
+#define FILTER_INTEREST_ALL (FILTER_INTEREST_SQL | FILTER_INTEREST_OTHER | FILTER_INTEREST_REPLIES)
+
 /**
  * The filter API version. If the FILTER_OBJECT structure or the filter API
  * is changed these values must be updated in line with the rules in the
  * file modinfo.h.
  */
-#define FILTER_VERSION  {1, 1, 0}
+#define FILTER_VERSION  {1, 2, 0}
 /**
  * The definition of a filter from the configuration file.
  * This is basically the link between a plugin to load and the
@@ -109,6 +137,8 @@ void filterAddOption(FILTER_DEF *, char *);
 void filterAddParameter(FILTER_DEF *, char *, char *);
 DOWNSTREAM *filterApply(FILTER_DEF *, SESSION *, DOWNSTREAM *);
 UPSTREAM *filterUpstream(FILTER_DEF *, void *, UPSTREAM *);
+uint32_t filterInterest(FILTER_DEF *);
+filter_class_t filter_packet_class(GWBUF *);
 int filter_standard_parameter(char *);
 void dprintAllFilters(DCB *);
 void dprintFilter(DCB *, FILTER_DEF *);
@@ -0,0 +1,41 @@
+#ifndef _FINGERPRINT_H
+#define _FINGERPRINT_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file fingerprint.h SQL statement fingerprints
+ *
+ * A fingerprint is a normalized form of a statement that is the same for all
+ * the statements that differ only in their literal values, comments, white
+ * space or the case of keywords and names. It is produced in one pass over
+ * the statement without allocating memory. In a fingerprint
+ *
+ * - string, numeric, hexadecimal and bit literals are replaced with @c ?
+ * - an IN list of only literals is replaced with @c (?+)
+ * - comments and trailing semicolons are removed
+ * - names and keywords are in lower case, names in backticks are kept as is
+ * - there is a single space between two words and none around punctuation
+ *
+ * For example, both <tt>SELECT * FROM t1 WHERE id IN (1, 2, 3) -- x</tt> and
+ * <tt>select * from T1 where id in ('a')</tt> have the fingerprint
+ * <tt>select*from t1 where id in(?+)</tt>.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+extern size_t   fingerprint_sql(const char *sql, size_t len, char *dest, size_t size, uint64_t *hash);
+extern uint64_t fingerprint_hash(const char *sql, size_t len);
+
+#endif
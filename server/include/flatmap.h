@@ -0,0 +1,84 @@
+#ifndef _FLATMAP_H
+#define _FLATMAP_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file flatmap.h An open addressing hash map for small, read-mostly tables
+ *
+ * The map stores the keys, values and hashes of the entries inline in one
+ * array and resolves collisions with Robin Hood linear probing. A lookup
+ * touches consecutive memory and there is no allocation per entry. The
+ * functions parallel those of hashtable.h.
+ *
+ * Unlike HASHTABLE, the map does no locking of its own. It is meant for data
+ * that is owned by one thread at a time, such as the data of a session, or
+ * that the caller protects with its own lock.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <hashtable.h>
+
+/**
+ * An entry in the map. A hash value of zero marks an empty entry.
+ */
+typedef struct flatmap_entry
+{
+    uint32_t hash;          /**< The hash of the key, 0 if the entry is empty */
+    void     *key;          /**< The key */
+    void     *value;        /**< The value associated with key */
+} FLATMAP_ENTRY;
+
+/**
+ * The open addressing hash map
+ */
+typedef struct flatmap
+{
+    unsigned int  capacity;         /**< Number of entries, always a power of two */
+    unsigned int  n_elements;       /**< Number of used entries */
+    FLATMAP_ENTRY *entries;         /**< The entries themselves */
+    int (*hashfn)(void *);          /**< The hash function */
+    int (*cmpfn)(void *, void *);   /**< The key comparison function */
+    HASHMEMORYFN  kcopyfn;          /**< Optional key copy function */
+    HASHMEMORYFN  vcopyfn;          /**< Optional value copy function */
+    HASHMEMORYFN  kfreefn;          /**< Optional key free function */
+    HASHMEMORYFN  vfreefn;          /**< Optional value free function */
+} FLATMAP;
+
+/**
+ * FLATMAP iterator - used to walk the entries of the map
+ */
+typedef struct flatmap_iterator
+{
+    FLATMAP      *map;      /**< The map the iterator refers to */
+    unsigned int index;     /**< The next entry to examine */
+} FLATMAP_ITERATOR;
+
+extern FLATMAP *flatmap_alloc(int size, int (*hashfn)(), int (*cmpfn)());
+extern void flatmap_memory_fns(FLATMAP      *map,
+                               HASHMEMORYFN kcopyfn,
+                               HASHMEMORYFN vcopyfn,
+                               HASHMEMORYFN kfreefn,
+                               HASHMEMORYFN vfreefn);
+extern void flatmap_free(FLATMAP *map);
+extern int flatmap_add(FLATMAP *map, void *key, void *value);
+extern int flatmap_delete(FLATMAP *map, void *key);
+extern void *flatmap_fetch(FLATMAP *map, void *key);
+extern int flatmap_size(FLATMAP *map);
+
+extern FLATMAP_ITERATOR *flatmap_iterator(FLATMAP *map);
+extern void *flatmap_next(FLATMAP_ITERATOR *iter);
+extern void flatmap_iterator_free(FLATMAP_ITERATOR *iter);
+
+#endif
@@ -50,7 +50,8 @@ struct session;
  *      close           MaxScale close entry point for the socket
  *      listen          Create a listener for the protocol
  *      auth            Authentication entry point
- *  session         Session handling entry point
+ *      session         Called when a persistent connection is taken into
+ *                      use by a new session, resets the connection state
  * @endverbatim
  *
  * This forms the "module object" for protocol modules within the gateway.
@@ -32,6 +32,8 @@
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/dh.h>
+#include <spinlock.h>
+#include <time.h>
 
 struct dcb;
 
@@ -54,6 +56,24 @@ typedef enum ssl_method_type
 #define SSL_ERROR_CLIENT_NOT_SSL 1
 #define SSL_ERROR_ACCEPT_FAILED 2
 
+/** Default number of TLS sessions a listener keeps for resumption */
+#define SSL_DEFAULT_SESSION_CACHE_SIZE 20480
+/** Default number of seconds a TLS session can be resumed */
+#define SSL_DEFAULT_SESSION_TIMEOUT    300
+/** Length of the encryption and authentication keys of a session ticket key */
+#define SSL_TICKET_KEY_LEN             32
+
+/**
+ * A key that encrypts and authenticates TLS session tickets
+ */
+typedef struct ssl_ticket_key
+{
+    unsigned char name[16];                 /*< Identifies the key in a ticket */
+    unsigned char aes_key[SSL_TICKET_KEY_LEN];  /*< Encryption key */
+    unsigned char hmac_key[SSL_TICKET_KEY_LEN]; /*< Authentication key */
+    bool valid;                             /*< The key has been generated */
+} SSL_TICKET_KEY;
+
 /**
  * The ssl_listener structure is used to aggregate the SSL configuration items
  * and data for a particular listener
@@ -69,6 +89,17 @@ typedef struct ssl_listener
     char *ssl_key;                      /*< SSL private key */
     char *ssl_ca_cert;                  /*< SSL CA certificate */
     bool ssl_init_done;                 /*< If SSL has already been initialized for this service */
+    int ssl_session_cache_size;         /*< Sessions kept for resumption, 0 disables the cache */
+    int ssl_session_timeout;            /*< Seconds a session can be resumed */
+    bool ssl_session_tickets;           /*< Whether session tickets are issued to clients */
+    bool ssl_ktls;                      /*< Offload the sending of TLS records to the kernel */
+    SPINLOCK session_lock;              /*< Protects the ticket keys and the client session */
+    SSL_SESSION *client_session;        /*< Session of the last connection to a server,
+                                         * offered for resumption by new connections */
+    SSL_TICKET_KEY ticket_keys[2];      /*< The current and the previous ticket key */
+    time_t ticket_key_time;             /*< When the current ticket key was generated */
+    int n_full_handshakes;              /*< Handshakes that created a new session */
+    int n_resumed;                      /*< Handshakes that resumed a session */
 } SSL_LISTENER;
 
 int ssl_authenticate_client(struct dcb *dcb, bool is_capable);
@@ -31,6 +31,7 @@
 #include <skygw_debug.h>
 #include <spinlock.h>
 #include <atomic.h>
+#include <platform.h>
 #include <dcb.h>
 
 /**
@@ -57,6 +58,21 @@ typedef struct hashiterator
     int depth;               /**< The current depth down the chain */
 } HASHITERATOR;
 
+/**
+ * The lock of a group of hash chains in a concurrent hashtable. Each
+ * stripe is on its own cache line so that readers of different stripes
+ * do not contend with each other.
+ */
+typedef struct hashstripe
+{
+    int n_readers;                /**< Number of clients reading the stripe */
+    int writelock;                /**< The stripe is locked by a writer */
+    char padding[MXS_CACHE_LINE_SIZE - 2 * sizeof(int)];
+} HASHSTRIPE;
+
+/** The maximum number of lock stripes in a concurrent hashtable */
+#define HASHTABLE_MAX_STRIPES 32
+
 /**
  * The type definition for the memory allocation functions
  */
@@ -83,12 +99,15 @@ typedef struct hashtable
     int writelock;                /**< The table is locked by a writer */
     bool ht_isflat;               /**< Indicates whether hashtable is in stack or heap */
     int n_elements;               /**< Number of added elements */
+    HASHSTRIPE *stripes;          /**< Chain locks of a concurrent table, NULL otherwise */
+    int n_stripes;                /**< Number of chain locks */
 #if defined(SS_DEBUG)
     skygw_chk_t ht_chk_tail;
 #endif
 } HASHTABLE;
 
 extern HASHTABLE *hashtable_alloc(int, int (*hashfn)(), int (*cmpfn)());
+extern HASHTABLE *hashtable_alloc_concurrent(int, int (*hashfn)(), int (*cmpfn)());
 HASHTABLE *hashtable_alloc_flat(HASHTABLE* target,
                                 int size,
                                 int (*hashfn)(),
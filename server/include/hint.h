@@ -21,6 +21,7 @@
  *
  * Date         Who             Description
  * 10/07/14     Mark Riddoch    Initial implementation
+ * 14/10/16                     Reference counted hints shared between buffers
  *
  * @endverbatim
  */
@@ -37,7 +38,7 @@ typedef enum
     HINT_ROUTE_TO_SLAVE,
     HINT_ROUTE_TO_NAMED_SERVER,
     HINT_ROUTE_TO_UPTODATE_SERVER,
-    HINT_ROUTE_TO_ALL, /*< not implemented yet */
+    HINT_ROUTE_TO_ALL, /*< Only implemented by schemarouter */
     HINT_PARAMETER
 } HINT_TYPE;
 
@@ -47,6 +48,11 @@ typedef enum
  * A hint has a type associated with it and may optionally have hint
  * specific data.
  * Multiple hints may be attached to a single buffer.
+ *
+ * The hints of a buffer are shared with its clones. A hint that is shared,
+ * and every hint after it in the list, must not be modified. Hints can be
+ * added in front of a shared list but a shared list must be copied before
+ * anything is added to its end, see gwbuf_add_hint().
  */
 typedef struct hint
 {
@@ -54,7 +60,8 @@ typedef struct hint
     void            *data;  /*< Type specific data */
     void            *value; /*< Parameter value for hint */
     unsigned int    dsize;  /*< Size of the hint data */
-    struct hint     *next;  /*< Another hint for this buffer */
+    int             refcount; /*< Number of references to this hint */
+    struct hint     *next;  /*< Another hint for this buffer, referenced by this hint */
 } HINT;
 
 extern  HINT    *hint_alloc(HINT_TYPE, void *, unsigned int);
@@ -62,5 +69,7 @@ extern  HINT    *hint_create_parameter(HINT *, char *, char *);
 extern  HINT    *hint_create_route(HINT *, HINT_TYPE, char *);
 extern  void    hint_free(HINT *);
 extern  HINT    *hint_dup(HINT *);
+extern  HINT    *hint_share(HINT *);
+extern  void    hint_release(HINT *);
 bool            hint_exists(HINT **, HINT_TYPE);
 #endif
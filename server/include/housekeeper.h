@@ -15,6 +15,7 @@
 #include <time.h>
 #include <dcb.h>
 #include <hk_heartbeat.h>
+#include <timerwheel.h>
 /**
  * @file housekeeper.h A mechanism to have task run periodically
  *
@@ -38,10 +39,11 @@ typedef enum
  */
 typedef struct hktask
 {
+    TIMER_ENTRY timer;        /*< The timer of the task, must be the first member */
     char *name;               /*< A simple task name */
     void (*task)(void *data); /*< The task to call */
     void *data;               /*< Data to pass the task */
-    int frequency;            /*< How often to call the tasks (seconds) */
+    int frequency;            /*< How often to call the tasks (milliseconds) */
     time_t nextdue;           /*< When the task should be next run */
     HKTASK_TYPE type;         /*< The task type */
     struct hktask *next;      /*< Next task in the list */
@@ -49,7 +51,9 @@ typedef struct hktask
 
 extern void hkinit();
 extern int  hktask_add(const char *name, void (*task)(void *), void *data, int frequency);
+extern int  hktask_add_ms(const char *name, void (*task)(void *), void *data, int frequency);
 extern int  hktask_oneshot(const char *name, void (*task)(void *), void *data, int when);
+extern int  hktask_oneshot_ms(const char *name, void (*task)(void *), void *data, int when);
 extern int  hktask_remove(const char *name);
 extern void hkshutdown();
 extern void hkshow_tasks(DCB *pdcb);
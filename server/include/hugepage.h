@@ -0,0 +1,79 @@
+#ifndef _HUGEPAGE_H
+#define _HUGEPAGE_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file hugepage.h Arenas of objects in 2MB huge pages
+ *
+ * An arena hands out objects of one size from 2MB regions. With
+ * huge_pages=explicit the regions are taken from the hugetlbfs pool of the
+ * kernel and with huge_pages=transparent, or when the pool is empty, they are
+ * ordinary memory that is advised to be backed by transparent huge pages.
+ * If no region can be mapped, the objects are allocated with malloc. With
+ * huge_pages=off, the default, the arenas are plain malloc and free.
+ *
+ * The memory of the regions is never returned to the system. A freed object
+ * is kept on the free list of its arena and handed out again, so the pools
+ * that keep objects for reuse, such as the buffer, DCB and session pools, use
+ * the arenas for the objects they could not find in the pool.
+ *
+ * The mode is set once with hugepage_init before the arenas are used. The
+ * objects allocated before that come from malloc and they can be put to the
+ * free list of the arena like any other object of the same size.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <spinlock.h>
+#include <maxconfig.h>
+
+struct dcb;
+
+/** The size of a region */
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+/** An arena of objects of one size */
+typedef struct hugepage_arena
+{
+    const char    *name;       /**< Name of the arena in the diagnostics */
+    size_t         size;       /**< Size of an object */
+    SPINLOCK       lock;       /**< Protects the arena */
+    void          *free;       /**< The freed objects */
+    char          *next;       /**< The next unused object of the current region */
+    char          *end;        /**< The end of the current region */
+    int64_t        regions;    /**< Number of regions mapped */
+    int64_t        objects;    /**< Number of objects taken from the regions */
+    int64_t        n_free;     /**< Number of objects on the free list */
+    int64_t        fallbacks;  /**< Objects allocated with malloc as no region could be mapped */
+    bool           registered; /**< The arena is in the list of all arenas */
+    struct hugepage_arena *next_arena; /**< The next arena in the list of all arenas */
+} HUGEPAGE_ARENA;
+
+/**
+ * Initialise a statically declared arena
+ *
+ * @param n The name of the arena
+ * @param s The size of the objects
+ */
+#define HUGEPAGE_ARENA_INIT(n, s) {n, s, SPINLOCK_INIT, NULL, NULL, NULL, 0, 0, 0, 0, false, NULL}
+
+extern void         hugepage_init(huge_pages_t mode);
+extern huge_pages_t hugepage_mode();
+extern void        *hugepage_alloc(HUGEPAGE_ARENA *arena);
+extern void         hugepage_free(HUGEPAGE_ARENA *arena, void *ptr);
+extern void        *hugepage_map(size_t size);
+extern void         hugepage_unmap(void *ptr, size_t size);
+extern void         dprintHugePages(struct dcb *dcb);
+
+#endif
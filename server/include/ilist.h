@@ -0,0 +1,182 @@
+#ifndef _ILIST_H
+#define _ILIST_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file ilist.h An intrusive doubly linked list
+ *
+ * An ILIST_NODE is embedded in the structure that is put to the list, so
+ * adding and removing do not allocate and a node can be unlinked in constant
+ * time without knowing its list. The list is circular with the list head as
+ * its sentinel. The list does no locking of its own, it is meant to be owned
+ * by one thread or protected by a lock of the caller.
+ *
+ * @verbatim
+ * typedef struct item
+ * {
+ *     int        value;
+ *     ILIST_NODE node;
+ * } ITEM;
+ *
+ * for (ILIST_NODE *n = ilist_first(&list); n; n = ilist_next(&list, n))
+ * {
+ *     ITEM *item = ILIST_ENTRY(n, ITEM, node);
+ * }
+ * @endverbatim
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/** A node of a list */
+typedef struct ilist_node
+{
+    struct ilist_node *next;    /*< The next node, the list head after the last node */
+    struct ilist_node *prev;    /*< The previous node, the list head before the first node */
+} ILIST_NODE;
+
+/** A list */
+typedef struct ilist
+{
+    ILIST_NODE head;            /*< The sentinel of the list */
+} ILIST;
+
+/**
+ * Initialise a statically declared list
+ *
+ * @param l The list
+ */
+#define ILIST_INIT(l) {{&(l).head, &(l).head}}
+
+/**
+ * The structure that a node is embedded in
+ *
+ * @param ptr    The node
+ * @param type   The type of the structure
+ * @param member The name of the node in the structure
+ */
+#define ILIST_ENTRY(ptr, type, member) ((type*)((char*)(ptr) - offsetof(type, member)))
+
+/**
+ * Initialise a list
+ *
+ * @param list The list
+ */
+static inline void ilist_init(ILIST *list)
+{
+    list->head.next = &list->head;
+    list->head.prev = &list->head;
+}
+
+/**
+ * Check whether a list is empty
+ *
+ * @param list The list
+ * @return True if the list has no nodes
+ */
+static inline bool ilist_empty(const ILIST *list)
+{
+    return list->head.next == &list->head;
+}
+
+/**
+ * Link a node between two adjacent nodes
+ */
+static inline void ilist_link(ILIST_NODE *node, ILIST_NODE *prev, ILIST_NODE *next)
+{
+    node->prev = prev;
+    node->next = next;
+    prev->next = node;
+    next->prev = node;
+}
+
+/**
+ * Add a node to the front of a list
+ *
+ * @param list The list
+ * @param node A node that is not in any list
+ */
+static inline void ilist_push_front(ILIST *list, ILIST_NODE *node)
+{
+    ilist_link(node, &list->head, list->head.next);
+}
+
+/**
+ * Add a node to the back of a list
+ *
+ * @param list The list
+ * @param node A node that is not in any list
+ */
+static inline void ilist_push_back(ILIST *list, ILIST_NODE *node)
+{
+    ilist_link(node, list->head.prev, &list->head);
+}
+
+/**
+ * Remove a node from its list
+ *
+ * @param node A node in a list
+ */
+static inline void ilist_remove(ILIST_NODE *node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->next = NULL;
+    node->prev = NULL;
+}
+
+/**
+ * The first node of a list
+ *
+ * @param list The list
+ * @return The first node, NULL if the list is empty
+ */
+static inline ILIST_NODE *ilist_first(ILIST *list)
+{
+    return ilist_empty(list) ? NULL : list->head.next;
+}
+
+/**
+ * The node after a node
+ *
+ * The next node must be taken before the node is removed.
+ *
+ * @param list The list of the node
+ * @param node A node in the list
+ * @return The next node, NULL if the node is the last one
+ */
+static inline ILIST_NODE *ilist_next(ILIST *list, ILIST_NODE *node)
+{
+    return node->next == &list->head ? NULL : node->next;
+}
+
+/**
+ * Remove the first node of a list
+ *
+ * @param list The list
+ * @return The removed node, NULL if the list is empty
+ */
+static inline ILIST_NODE *ilist_pop_front(ILIST *list)
+{
+    ILIST_NODE *node = ilist_first(list);
+
+    if (node)
+    {
+        ilist_remove(node);
+    }
+
+    return node;
+}
+
+#endif
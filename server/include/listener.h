@@ -23,12 +23,14 @@
  *
  * Date         Who                     Description
  * 19/01/16     Martin Brampton         Initial implementation
+ * 14/10/16                             Connection queue priority and admitted connections
  *
  * @endverbatim
  */
 
 #include <gw_protocol.h>
 #include <gw_ssl.h>
+#include <spinlock.h>
 
 struct dcb;
 
@@ -46,6 +48,11 @@ typedef struct servlistener
     char *authenticator;        /**< Name of authenticator */
     SSL_LISTENER *ssl;          /**< Structure of SSL data or NULL */
     struct dcb *listener;       /**< The DCB for the listener */
+    int priority;               /**< Priority class of the queued connections */
+    SPINLOCK admit_lock;        /**< Protects the list of admitted connections */
+    struct dcb *admitted;       /**< Queued connections that are to be accepted */
+    SPINLOCK handshake_lock;    /**< Protects the handshake template */
+    void *handshake;            /**< Initial handshake built by the protocol module or NULL */
     struct  servlistener *next; /**< Next service protocol */
 } SERV_LISTENER;
 
@@ -64,6 +64,8 @@ extern int mxs_log_enabled_priorities;
 extern ssize_t mxs_log_session_count[];
 extern __thread mxs_log_info_t mxs_log_tls;
 
+extern int mxs_log_session_count_total;
+
 /**
  * Check if specified log type is enabled in general or if it is enabled
  * for the current session.
@@ -73,6 +75,22 @@ extern __thread mxs_log_info_t mxs_log_tls;
       (mxs_log_session_count[priority] > 0 && \
        mxs_log_tls.li_enabled_priorities & (1 << priority))) ? true : false)
 
+/**
+ * Check if the session information must be stored to the thread's log
+ * information. It is only used for the session id of info messages and
+ * for session specific log priorities.
+ */
+#define MXS_LOG_SESSION_INFO_IS_NEEDED() \
+    ((mxs_log_enabled_priorities & MXS_LOG_INFO) || mxs_log_session_count_total > 0)
+
+/**
+ * The log priorities that are compiled in. Messages of other priorities are
+ * removed at compile time, e.g. -DMXS_LOG_STATIC_MASK='(MXS_LOG_MASK & ~MXS_LOG_DEBUG)'
+ */
+#if !defined(MXS_LOG_STATIC_MASK)
+#define MXS_LOG_STATIC_MASK MXS_LOG_MASK
+#endif
+
 /**
  * LOG_AUGMENT_WITH_FUNCTION Each logged line is suffixed with [function-name].
  */
@@ -82,6 +100,20 @@ typedef enum
     MXS_LOG_AUGMENTATION_MASK     = (MXS_LOG_AUGMENT_WITH_FUNCTION)
 } mxs_log_augmentation_t;
 
+/**
+ * Log throttling. If a message is logged more than @c count times during
+ * @c window_ms milliseconds, the message is suppressed for @c suppress_ms
+ * milliseconds. Only error, warning and notice messages are throttled and a
+ * message is identified by the place in the source code where it is logged.
+ * A @c count of 0 disables the throttling.
+ */
+typedef struct mxs_log_throttling
+{
+    size_t count;       /**< Maximum number of a specific message... */
+    size_t window_ms;   /**< ...during this many milliseconds. */
+    size_t suppress_ms; /**< If exceeded, suppress such messages for this many ms. */
+} MXS_LOG_THROTTLING;
+
 bool mxs_log_init(const char* ident, const char* logdir, mxs_log_target_t target);
 void mxs_log_finish(void);
 
@@ -94,6 +126,8 @@ void mxs_log_set_syslog_enabled(bool enabled);
 void mxs_log_set_maxlog_enabled(bool enabled);
 void mxs_log_set_highprecision_enabled(bool enabled);
 void mxs_log_set_augmentation(int bits);
+void mxs_log_set_throttling(const MXS_LOG_THROTTLING* throttling);
+void mxs_log_get_throttling(MXS_LOG_THROTTLING* throttling);
 
 int mxs_log_message(int priority,
                     const char* file, int line, const char* function,
@@ -107,9 +141,15 @@ int mxs_log_message(int priority,
  *
  * NOTE: Should typically not be called directly. Use some of the
  *       MXS_ERROR, MXS_WARNING, etc. macros instead.
+ *
+ * The priority is checked before the call so the arguments of a disabled
+ * message are not evaluated. Invalid priorities are passed on to be caught
+ * by mxs_log_message.
  */
 #define MXS_LOG_MESSAGE(priority, format, ...)\
-    mxs_log_message(priority, __FILE__, __LINE__, __func__, format, ##__VA_ARGS__)
+    ((((priority) & ~LOG_PRIMASK) != 0 ||                               \
+      ((MXS_LOG_STATIC_MASK & (1 << (priority))) && MXS_LOG_PRIORITY_IS_ENABLED(priority))) ? \
+     mxs_log_message(priority, __FILE__, __LINE__, __func__, format, ##__VA_ARGS__) : 0)
 
 /**
  * Log an error, warning, notice, info, or debug  message.
@@ -14,6 +14,7 @@
  */
 #include <skygw_utils.h>
 #include <stdint.h>
+#include <sched.h>
 #include <openssl/sha.h>
 #include <spinlock.h>
 /**
@@ -34,6 +35,14 @@
 
 #define DEFAULT_NBPOLLS         3       /**< Default number of non block polls before we block */
 #define DEFAULT_POLLSLEEP       1000    /**< Default poll wait time (milliseconds) */
+#define DEFAULT_POLL_BATCH_SIZE 1       /**< Default number of DCBs taken from the event queue at a time */
+#define MAX_POLL_BATCH_SIZE     64      /**< Maximum number of DCBs taken from the event queue at a time */
+#define DEFAULT_BUSY_POLL_TIME  50      /**< Default longest busy poll with adaptive polling (microseconds) */
+#define DEFAULT_ACCEPT_BUDGET   64      /**< Default number of connections accepted per accept event */
+#define DEFAULT_MONITOR_THREADS 4       /**< Default number of threads that run the monitors */
+#define DEFAULT_SERVICE_START_THREADS 8 /**< Default number of threads that start the services */
+#define DEFAULT_COMPRESSION_THRESHOLD 50 /**< Default payload size below which packets are not compressed */
+#define DEFAULT_QC_OFFLOAD_THREADS 2    /**< Default number of threads that classify large statements */
 #define _SYSNAME_STR_LENGTH     256     /**< sysname len */
 #define _RELEASE_STR_LENGTH     256     /**< release len */
 #define DEFAULT_NTHREADS        1 /**< Default number of polling threads */
@@ -55,6 +64,32 @@ typedef enum
     SQLVAR_TARGET_TYPE = 0x10
 } config_param_type_t;
 
+typedef enum
+{
+    POLL_MODE_SHARED,       /**< All threads share one epoll instance and event queue */
+    POLL_MODE_PER_THREAD    /**< Each thread owns an epoll instance and its DCBs */
+} poll_mode_t;
+
+typedef enum
+{
+    READ_MODE_PROBE,        /**< The readable bytes are probed with FIONREAD before reading */
+    READ_MODE_DIRECT        /**< Sockets are read into pooled buffers until drained */
+} read_mode_t;
+
+typedef enum
+{
+    THREAD_AFFINITY_NONE,   /**< The polling threads may run on any CPU */
+    THREAD_AFFINITY_CPUS,   /**< Each thread is bound to one CPU of a list */
+    THREAD_AFFINITY_NUMA    /**< Each thread is bound to the CPUs of one NUMA node */
+} thread_affinity_t;
+
+typedef enum
+{
+    HUGE_PAGES_OFF,         /**< The arenas allocate with malloc */
+    HUGE_PAGES_TRANSPARENT, /**< The arenas use transparent huge pages */
+    HUGE_PAGES_EXPLICIT     /**< The arenas use the hugetlbfs pool, then transparent huge pages */
+} huge_pages_t;
+
 typedef enum
 {
     TYPE_UNDEFINED = 0,
@@ -107,7 +142,10 @@ typedef struct config_context
  */
 typedef struct
 {
-    int           n_threads;                           /**< Number of polling threads */
+    int           n_threads;                           /**< Most polling threads that can run */
+    int           initial_threads;                     /**< Polling threads started at startup */
+    int           min_threads;                         /**< Fewest polling threads, 0 if not set */
+    int           max_threads;                         /**< Most polling threads, 0 if not set */
     char          *version_string;                     /**< The version string of embedded db library */
     char          release_string[_SYSNAME_STR_LENGTH]; /**< The release name string of the system */
     char          sysname[_SYSNAME_STR_LENGTH];        /**< The release name string of the system */
@@ -115,6 +153,31 @@ typedef struct
     unsigned long id;                                  /**< MaxScale ID */
     unsigned int  n_nbpoll;                            /**< Tune number of non-blocking polls */
     unsigned int  pollsleep;                           /**< Wait time in blocking polls */
+    poll_mode_t   poll_mode;                           /**< How epoll instances are used by threads */
+    unsigned int  poll_batch_size;                     /**< DCBs taken from the event queue at a time */
+    bool          adaptive_poll;                       /**< Busy poll only when events are expected soon */
+    unsigned int  busy_poll_time;                      /**< Longest busy poll in microseconds */
+    unsigned int  socket_busy_poll;                    /**< SO_BUSY_POLL of the sockets, 0 if not set */
+    bool          hp_event_times;                      /**< Measure event times in microseconds */
+    read_mode_t   read_mode;                           /**< How data is read from sockets */
+    bool          reuseport;                           /**< One SO_REUSEPORT listener per thread */
+    bool          io_uring;                            /**< Batch socket reads and writes with io_uring */
+    thread_affinity_t thread_affinity;                 /**< How polling threads are bound to CPUs */
+    cpu_set_t     thread_cpus;                         /**< The CPUs of THREAD_AFFINITY_CPUS */
+    unsigned int  accept_budget;                       /**< Connections accepted per event, 0 for no limit */
+    unsigned int  writeq_high_water;                   /**< Client write queue size that pauses backend reads */
+    unsigned int  writeq_low_water;                    /**< Client write queue size that resumes backend reads */
+    bool          client_compression;                  /**< Offer the compressed protocol to clients */
+    unsigned int  compression_threshold;               /**< Smallest payload that is compressed */
+    bool          session_track;                       /**< Offer session state tracking to clients */
+    bool          pipeline_batching;                   /**< Write pipelined queries once per backend */
+    unsigned int  monitor_threads;                     /**< Threads that run the monitoring rounds */
+    unsigned int  service_start_threads;               /**< Threads that start the services */
+    unsigned int  trace_records;                       /**< Trace records per thread, 0 disables tracing */
+    unsigned int  trace_sample_rate;                   /**< Trace the routing of one in this many
+                                                        * queries, 0 if disabled */
+    char          trace_sample_user[128];              /**< Trace the routing of all queries of this user */
+    huge_pages_t  huge_pages;                          /**< Where the arenas allocate memory from */
     int           syslog;                              /**< Log to syslog */
     int           maxlog;                              /**< Log to MaxScale's own logs */
     int           log_to_shm;                          /**< Write log-file to shared memory */
@@ -123,6 +186,13 @@ typedef struct
     unsigned int  auth_write_timeout;                  /**< Write timeout for the user authentication */
     char          qc_name[PATH_MAX];                   /**< The name of the query classifier to load */
     char*         qc_args;                             /**< Arguments for the query classifier */
+    unsigned int  qc_offload_size;                     /**< Statements larger than this are classified by
+                                                        * the classifier threads, 0 if disabled */
+    unsigned int  qc_offload_threads;                  /**< Threads that classify large statements */
+    unsigned int  session_memory_soft_limit;           /**< Buffered bytes of a session that pause
+                                                        * its client reads, 0 if disabled */
+    unsigned int  session_memory_hard_limit;           /**< Buffered bytes of a session that close
+                                                        * its client, 0 if disabled */
 } GATEWAY_CONF;
 
 
@@ -149,12 +219,43 @@ bool                config_get_valtarget(target_t*           val,
 bool                config_load(char *);
 unsigned int        config_nbpolls();
 double              config_percentage_value(char *str);
+poll_mode_t         config_poll_mode();
+unsigned int        config_poll_batch_size();
+bool                config_adaptive_poll();
+unsigned int        config_busy_poll_time();
+unsigned int        config_socket_busy_poll();
+bool                config_high_precision_event_times();
+read_mode_t         config_read_mode();
+bool                config_reuseport();
+bool                config_io_uring();
+thread_affinity_t   config_thread_affinity();
+const cpu_set_t*    config_thread_cpus();
+bool                config_parse_cpu_list(const char *list, cpu_set_t *set);
+unsigned int        config_accept_budget();
+unsigned int        config_writeq_high_water();
+unsigned int        config_writeq_low_water();
+bool                config_client_compression();
+bool                config_session_track();
+unsigned int        config_compression_threshold();
+bool                config_pipeline_batching();
+unsigned int        config_trace_records();
+unsigned int        config_trace_sample_rate();
+const char*         config_trace_sample_user();
+huge_pages_t        config_huge_pages();
+unsigned int        config_monitor_threads();
+unsigned int        config_service_start_threads();
+unsigned int        config_qc_offload_size();
+unsigned int        config_qc_offload_threads();
+unsigned int        config_session_memory_soft_limit();
+unsigned int        config_session_memory_hard_limit();
 unsigned int        config_pollsleep();
 int                 config_reload();
 bool                config_set_qualified_param(CONFIG_PARAMETER* param,
                                                void* val,
                                                config_param_type_t type);
 int                 config_threadcount();
+int                 config_initial_threads();
+int                 config_min_threads();
 int                 config_truth_value(char *);
 void                free_config_parameter(CONFIG_PARAMETER* p1);
 bool                is_internal_service(const char *router);
@@ -15,6 +15,8 @@
 #include <dcb.h>
 #include <gwbitmask.h>
 #include <resultset.h>
+#include <timerwheel.h>
+#include <mpsc_queue.h>
 #include <sys/epoll.h>
 
 /**
@@ -48,10 +50,41 @@ typedef enum
     POLL_STAT_MAX_EXECTIME
 } POLL_STAT;
 
+/**
+ * A timer that calls a function in a polling thread. The timer is embedded in
+ * the structure that it times and it expires in the thread that started it.
+ */
+typedef struct poll_timer
+{
+    TIMER_ENTRY entry;         /*< The entry in the timing wheel of the thread */
+    void        (*fn)(void *); /*< Called when the timer expires */
+    void        *data;         /*< The argument of fn */
+    int         thread_id;     /*< The thread of the timer, -1 if it has not been started */
+    bool        running;       /*< fn is being called */
+} POLL_TIMER;
+
+/**
+ * A function call posted to a polling thread. The message is embedded in the
+ * structure that it is about. Once its function is called the message is no
+ * longer used by the poll module, so the function may post it again or free it.
+ */
+typedef struct poll_message
+{
+    MPSC_NODE   node;          /*< The node in the queue of the thread */
+    void        (*fn)(void *); /*< Called in the thread the message is posted to */
+    void        *data;         /*< The argument of fn */
+} POLL_MESSAGE;
+
 extern  void            poll_init();
 extern  int             poll_add_dcb(DCB *);
 extern  int             poll_remove_dcb(DCB *);
+extern  int             poll_set_read_events(DCB *dcb, bool enable);
 extern  void            poll_waitevents(void *);
+extern  bool            poll_start_threads(void (*entry)(void *));
+extern  void            poll_wait_threads();
+extern  int             poll_running_threads();
+extern  void            poll_set_socket_busy_poll(int fd);
+extern  void            poll_set_socket_incoming_cpu(int fd, int thread_id);
 extern  void            poll_shutdown();
 extern  GWBITMASK       *poll_bitmask();
 extern  void            poll_set_maxwait(unsigned int);
@@ -67,4 +100,13 @@ extern  void            poll_fake_event(DCB *dcb, enum EPOLL_EVENTS ev);
 extern  void            poll_fake_hangup_event(DCB *dcb);
 extern  void            poll_fake_write_event(DCB *dcb);
 extern  void            poll_fake_read_event(DCB *dcb);
+extern  int             poll_session_owner(struct session *session);
+extern  bool            poll_session_confined(struct session *session);
+extern  int             poll_current_thread();
+extern  double          poll_cycles_to_usecs(unsigned long long cycles);
+extern  void            poll_timer_init(POLL_TIMER *timer, void (*fn)(void *), void *data);
+extern  void            poll_timer_start(POLL_TIMER *timer, int delay_ms);
+extern  void            poll_timer_stop(POLL_TIMER *timer);
+extern  void            poll_message_init(POLL_MESSAGE *msg, void (*fn)(void *), void *data);
+extern  void            poll_post_message(int thread_id, POLL_MESSAGE *msg);
 #endif
@@ -19,6 +19,7 @@
 #endif
 
 #include <pcre2.h>
+#include <stdbool.h>
 
 /**
  * @file maxscale_pcre2.h - Utility functions for regular expression matching
@@ -43,5 +44,8 @@ mxs_pcre2_result_t mxs_pcre2_substitute(pcre2_code *re, const char *subject,
                                         const char *replace, char** dest, size_t* size);
 mxs_pcre2_result_t mxs_pcre2_simple_match(const char* pattern, const char* subject,
                                           int options, int* error);
+bool mxs_pcre2_jit_compile(pcre2_code *re);
+pcre2_match_data* mxs_pcre2_thread_match_data(uint32_t ovector_size);
+pcre2_match_context* mxs_pcre2_thread_match_context();
 
 #endif
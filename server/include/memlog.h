@@ -25,19 +25,49 @@
  * @endverbatim
  */
 #include <spinlock.h>
+#include <stdint.h>
 
-typedef enum { ML_INT, ML_LONG, ML_LONGLONG, ML_STRING } MEMLOGTYPE;
+typedef enum { ML_INT, ML_LONG, ML_LONGLONG, ML_STRING, ML_RECORD } MEMLOGTYPE;
+
+/**
+ * A logged item. The timestamp and the identifier are only used by the
+ * structured records of the ML_RECORD logs.
+ */
+typedef struct memlog_record
+{
+    uint64_t        timestamp;      /*< CLOCK_MONOTONIC nanoseconds */
+    uint64_t        id;             /*< Identifier given by the caller */
+    long long       value;          /*< The value, a pointer for ML_STRING */
+} MEMLOG_RECORD;
+
+/**
+ * The items logged by one thread. The owning thread is the only writer of
+ * the head and the flushing the only writer of the tail, so neither needs
+ * a lock.
+ */
+typedef struct memlog_ring
+{
+    MEMLOG_RECORD   *records;       /*< The ring of items */
+    uint64_t        head;           /*< Number of items written */
+    uint64_t        tail;           /*< Number of items flushed */
+    uint64_t        dropped;        /*< Items dropped because the ring was full */
+} MEMLOG_RING;
+
+/** The largest number of threads that can write to the memory logs */
+#define MEMLOG_MAX_THREADS      256
+
+/** The number of batches of size items that fit into the ring of a thread */
+#define MEMLOG_RING_BATCHES     4
 
 typedef struct memlog
 {
     char            *name;
-    SPINLOCK        lock;
-    void            *values;
-    int             offset;
-    int             size;
+    SPINLOCK        lock;           /*< Serialises the flushing */
+    MEMLOG_RING     *rings[MEMLOG_MAX_THREADS]; /*< The ring of each thread */
+    int             capacity;       /*< Items in the ring of a thread */
+    int             size;           /*< Items in a batch that is flushed */
     MEMLOGTYPE      type;
     unsigned int    flags;
-    unsigned int    iflags;
     struct memlog   *next;
 } MEMLOG;
 
@@ -46,17 +76,15 @@ typedef struct memlog
  */
 #define MLNOAUTOFLUSH           0x0001
 
-/*
- * MEMLOG internal flags
- */
-#define MLWRAPPED               0x0001
-
 
-extern MEMLOG *memlog_create(char *, MEMLOGTYPE, int);
-extern void    memlog_destroy(MEMLOG *);
-extern void    memlog_set(MEMLOG *, unsigned int);
-extern void    memlog_log(MEMLOG *, void *);
-extern void    memlog_flush_all();
-extern void    memlog_flush(MEMLOG *);
+extern MEMLOG  *memlog_create(char *, MEMLOGTYPE, int);
+extern void     memlog_destroy(MEMLOG *);
+extern void     memlog_set(MEMLOG *, unsigned int);
+extern void     memlog_log(MEMLOG *, void *);
+extern void     memlog_record(MEMLOG *, uint64_t, long long);
+extern void     memlog_flush_all();
+extern void     memlog_flush(MEMLOG *);
+extern void     memlog_sync(MEMLOG *);
+extern uint64_t memlog_dropped(MEMLOG *);
 
 #endif
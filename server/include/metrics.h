@@ -0,0 +1,119 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file metrics.h The metrics registry
+ *
+ * Metrics are registered once and are never freed. The values are stored in
+ * ts_stats counters so updating a metric is a store to a slot of the calling
+ * thread and reading the metrics never takes a lock. As with ts_stats, the
+ * values should only be updated by the polling threads.
+ *
+ * The metrics are printed in the OpenMetrics text format, for example by
+ * requesting /metrics from the maxinfo HTTP listener.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <statistics.h>
+
+struct dcb;
+
+/** The type of a metric */
+typedef enum
+{
+    METRIC_COUNTER,  /**< A value that only increases */
+    METRIC_GAUGE,    /**< A value that can go up and down */
+    METRIC_HISTOGRAM /**< Counts of observed values in buckets */
+} metric_type_t;
+
+/** Maximum number of buckets in a histogram, the +Inf bucket not included */
+#define METRIC_MAX_BUCKETS 16
+
+/** Function that returns the current value of a metric */
+typedef int64_t (*METRIC_FN)();
+
+/** Function that prints metrics that are not in the registry */
+typedef void (*METRICS_PRINT_FN)(struct dcb *dcb);
+
+/** Maximum number of functions added with metrics_add_printer */
+#define METRICS_MAX_PRINTERS 8
+
+typedef struct metric
+{
+    char          *name;     /**< Name of the metric family */
+    char          *labels;   /**< Labels of the metric, e.g. server="db1", or NULL */
+    char          *help;     /**< Description of the metric family */
+    metric_type_t  type;     /**< Type of the metric */
+    double         unit;     /**< Multiplier that converts the values to base units */
+    METRIC_FN      fn;       /**< Function returning the value or NULL */
+    ts_stats_t     value;    /**< The value or the sum of the observed values */
+    int            n_bounds; /**< Number of buckets of a histogram */
+    int64_t        bounds[METRIC_MAX_BUCKETS];  /**< Upper bounds of the buckets */
+    ts_stats_t     buckets[METRIC_MAX_BUCKETS + 1]; /**< Non-cumulative bucket counts */
+    struct metric *next;     /**< Next metric in the registry */
+} METRIC;
+
+extern METRIC *metric_counter(const char *name, const char *labels, const char *help);
+extern METRIC *metric_gauge(const char *name, const char *labels, const char *help);
+extern METRIC *metric_function(const char *name, const char *labels, const char *help,
+                               metric_type_t type, METRIC_FN fn);
+extern METRIC *metric_histogram(const char *name, const char *labels, const char *help,
+                                const int64_t *bounds, int n_bounds, double unit);
+extern int64_t metric_histogram_quantile(METRIC *metric, double q, int64_t *count);
+extern void    metrics_print(struct dcb *dcb);
+extern bool    metrics_add_printer(METRICS_PRINT_FN fn);
+extern void    metrics_print_family(struct dcb *dcb, const char *name, metric_type_t type,
+                                    const char *help);
+extern void    metrics_print_value(struct dcb *dcb, const char *name, const char *suffix,
+                                   const char *labels, double value);
+
+/**
+ * Add to the value of a counter or a gauge
+ *
+ * @param metric The metric, may be NULL
+ * @param value  The value to add
+ */
+static inline void metric_add(METRIC *metric, int64_t value)
+{
+    if (metric)
+    {
+        ts_stats_add(metric->value, value);
+    }
+}
+
+/**
+ * Add an observation to a histogram
+ *
+ * @param metric The histogram, may be NULL
+ * @param value  The observed value
+ */
+static inline void metric_observe(METRIC *metric, int64_t value)
+{
+    if (metric)
+    {
+        int i = 0;
+
+        while (i < metric->n_bounds && value > metric->bounds[i])
+        {
+            i++;
+        }
+
+        ts_stats_add(metric->buckets[i], 1);
+        ts_stats_add(metric->value, value);
+    }
+}
+
+#endif
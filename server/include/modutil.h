@@ -39,6 +39,34 @@
 #define IS_FULL_RESPONSE(buf) (modutil_count_signal_packets(buf,0,0) == 2)
 #define PTR_EOF_MORE_RESULTS(b) ((PTR_IS_EOF(b) && ptr[7] & 0x08))
 
+/**
+ * The state of an incremental MySQL packet parser. The framer remembers how
+ * much of a buffer chain it has already parsed, so that data that is appended
+ * to the chain later is parsed without walking the earlier data again. The
+ * state is relative to the head of the chain. If the head is replaced or data
+ * is consumed from it by other means, the framer must be reset with
+ * modutil_framer_init.
+ */
+typedef struct
+{
+    size_t   parsed;        /*< Bytes from the head of the chain that have been parsed */
+    size_t   complete;      /*< Bytes from the head of the chain that form complete packets */
+    uint32_t left;          /*< Payload bytes of the current packet that are still missing */
+    int      hdr_len;       /*< Header bytes of the current packet that have been parsed */
+    uint8_t  hdr[3];        /*< The payload length of the current packet */
+} packet_framer_t;
+
+/**
+ * A view of a complete MySQL packet in a buffer chain. The data stays where it
+ * is, the view only tells where the packet is.
+ */
+typedef struct
+{
+    GWBUF    *buffer;       /*< The buffer where the packet starts */
+    size_t   offset;        /*< The offset of the packet in the buffer */
+    uint32_t length;        /*< The length of the packet, header included */
+} packet_view_t;
+
 
 extern int      modutil_is_SQL(GWBUF *);
 extern int      modutil_is_SQL_prepare(GWBUF *);
@@ -50,6 +78,13 @@ extern char*    modutil_get_query(GWBUF* buf);
 extern int      modutil_send_mysql_err_packet(DCB *, int, int, int, const char *, const char *);
 GWBUF*          modutil_get_next_MySQL_packet(GWBUF** p_readbuf);
 GWBUF*          modutil_get_complete_packets(GWBUF** p_readbuf);
+void            modutil_framer_init(packet_framer_t *framer);
+size_t          modutil_framer_feed(packet_framer_t *framer, GWBUF *head);
+GWBUF*          modutil_framer_get_next(packet_framer_t *framer, GWBUF **p_readbuf);
+GWBUF*          modutil_framer_split_next(packet_framer_t *framer, GWBUF **p_readbuf);
+GWBUF*          modutil_framer_get_complete(packet_framer_t *framer, GWBUF **p_readbuf);
+bool            modutil_packet_view_next(GWBUF *head, packet_view_t *view);
+size_t          modutil_packet_view_copy(const packet_view_t *view, size_t offset, size_t n, uint8_t *dest);
 int             modutil_MySQL_query_len(GWBUF* buf, int* nbytes_missing);
 void            modutil_reply_parse_error(DCB* backend_dcb, char* errstr, uint32_t flags);
 void            modutil_reply_auth_error(DCB* backend_dcb, char* errstr, uint32_t flags);
@@ -69,5 +104,6 @@ char* strnchr_esc_mysql(char* ptr, char c, int len);
 bool is_mysql_statement_end(const char* start, int len);
 bool is_mysql_sp_end(const char* start, int len);
 char* modutil_get_canonical(GWBUF* querybuf);
+char* modutil_get_fingerprint(GWBUF* querybuf, uint64_t* hash);
 
 #endif
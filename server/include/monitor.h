@@ -122,12 +122,19 @@ typedef enum
 #define DEFAULT_READ_TIMEOUT 1
 #define DEFAULT_WRITE_TIMEOUT 2
 
+#define DEFAULT_SCRIPT_TIMEOUT 90     /**< Seconds a monitor script may run */
+#define DEFAULT_SCRIPT_MAX_RUNNING 8  /**< Scripts of a monitor running at the same time */
+#define MONITOR_MAX_PENDING_SCRIPTS 64 /**< Scripts of a monitor waiting to be started */
+
 
 #define MONITOR_RUNNING 1
 #define MONITOR_STOPPING 2
 #define MONITOR_STOPPED 3
 
 #define MONITOR_INTERVAL 10000 // in milliseconds
+
+/** Number of monitoring rounds a failing server is probed at the fast interval */
+#define MON_FAST_ROUNDS 10
 #define MONITOR_DEFAULT_ID 1UL // unsigned long value
 
 /*
@@ -161,6 +168,7 @@ typedef struct monitor_servers
     int mon_err_count;
     unsigned int mon_prev_status;
     unsigned int pending_status;  /**< Pending Status flag bitmap */
+    int fast_rounds;              /**< Rounds left to probe at the fast interval */
     struct monitor_servers *next; /**< The next server in the list */
 } MONITOR_SERVERS;
 
@@ -188,6 +196,13 @@ typedef struct monitor
     MONITOR_OBJECT *module;       /**< The "monitor object" */
     void *handle;                 /**< Handle returned from startMonitor */
     size_t interval;              /**< The monitor interval */
+    size_t fast_interval;         /**< The interval used while a server is failing, 0 if disabled */
+    int script_timeout;           /**< Seconds a script may run, 0 for no limit */
+    int script_max_running;       /**< Scripts that may run at the same time */
+    int scripts_running;          /**< Scripts that are running */
+    int scripts_pending;          /**< Scripts waiting for a running one to exit */
+    struct monitor_script *script_queue;      /**< First of the waiting scripts */
+    struct monitor_script *script_queue_tail; /**< Last of the waiting scripts */
     struct monitor *next;         /**< Next monitor in the linked list */
 } MONITOR;
 
@@ -205,6 +220,9 @@ extern void monitorShowAll(DCB *);
 extern void monitorShow(DCB *, MONITOR *);
 extern void monitorList(DCB *);
 extern void monitorSetInterval (MONITOR *, unsigned long);
+extern void monitorSetFastInterval(MONITOR *, unsigned long);
+extern void monitorSetScriptTimeout(MONITOR *, int);
+extern void monitorSetScriptMaxRunning(MONITOR *, int);
 extern bool monitorSetNetworkTimeout(MONITOR *, int, int);
 extern RESULTSET *monitorGetList();
 extern bool check_monitor_permissions(MONITOR* monitor, const char* query);
@@ -231,4 +249,39 @@ void mon_log_state_change(MONITOR_SERVERS *ptr);
  */
 void mon_hangup_failed_servers(MONITOR *monitor);
 
+/**
+ * @brief Probe all servers of a monitor concurrently
+ *
+ * Calls the probe function for each server of the monitor from a small set of
+ * threads and returns when all servers have been probed.
+ *
+ * @param monitor Monitor object
+ * @param probe   Function that probes one server
+ */
+void mon_probe_servers(MONITOR *monitor, void (*probe)(MONITOR *, MONITOR_SERVERS *));
+
+/**
+ * @brief Run the monitoring rounds of a monitor on the shared monitor threads
+ *
+ * The round function is called at the monitor interval, and at the fast
+ * interval while a server is failing, by one of a small pool of threads that
+ * all monitors share. A monitor module calls this from startMonitor instead
+ * of starting a thread of its own.
+ *
+ * @param monitor Monitor object
+ * @param round   Function that runs one monitoring round
+ * @return True if the monitor was scheduled
+ */
+bool mon_schedule_rounds(MONITOR *monitor, void (*round)(MONITOR *));
+
+/**
+ * @brief Stop running the monitoring rounds of a monitor
+ *
+ * Returns when a round that is in progress has finished. Called from
+ * stopMonitor.
+ *
+ * @param monitor Monitor object
+ */
+void mon_unschedule_rounds(MONITOR *monitor);
+
 #endif
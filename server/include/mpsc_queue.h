@@ -0,0 +1,128 @@
+#ifndef _MPSC_QUEUE_H
+#define _MPSC_QUEUE_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file mpsc_queue.h An intrusive lock-free queue with many producers and one consumer
+ *
+ * Any number of threads can push nodes to the queue at the same time and one
+ * thread at a time pops them in the order they were pushed. A push is one
+ * atomic exchange and a store, and neither the producers nor the consumer
+ * ever wait for a lock. The MPSC_NODE is embedded in the structure that is
+ * queued, see ILIST_ENTRY in ilist.h for getting the structure of a node.
+ *
+ * A producer that is interrupted between the exchange and the store hides
+ * the nodes pushed after its own from the consumer for that time and the pop
+ * returns NULL even though the queue is not empty. The consumer is expected
+ * to try again when it is next woken up, which the producers do after they
+ * have pushed.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/** A node of a queue */
+typedef struct mpsc_node
+{
+    struct mpsc_node *next;     /*< The node pushed after this one */
+} MPSC_NODE;
+
+/** A queue */
+typedef struct mpsc_queue
+{
+    MPSC_NODE *head;            /*< The node pushed last, exchanged by the producers */
+    char       pad[56];         /*< Keeps the producers and the consumer on separate cache lines */
+    MPSC_NODE *tail;            /*< The node popped next, only used by the consumer */
+    MPSC_NODE  stub;            /*< Keeps the queue non-empty when all nodes are popped */
+} MPSC_QUEUE;
+
+/**
+ * Initialise a statically declared queue
+ *
+ * @param q The queue
+ */
+#define MPSC_QUEUE_INIT(q) {&(q).stub, {0}, &(q).stub, {NULL}}
+
+/**
+ * Initialise a queue
+ *
+ * @param queue The queue
+ */
+static inline void mpsc_queue_init(MPSC_QUEUE *queue)
+{
+    queue->stub.next = NULL;
+    queue->head = &queue->stub;
+    queue->tail = &queue->stub;
+}
+
+/**
+ * Push a node to a queue, can be called by any thread
+ *
+ * @param queue The queue
+ * @param node  A node that is not in any queue
+ */
+static inline void mpsc_queue_push(MPSC_QUEUE *queue, MPSC_NODE *node)
+{
+    __atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+    MPSC_NODE *prev = __atomic_exchange_n(&queue->head, node, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+/**
+ * Pop the oldest node of a queue, only called by the consumer
+ *
+ * @param queue The queue
+ * @return The popped node, NULL if the queue is empty or the next node is
+ * still being pushed
+ */
+static inline MPSC_NODE *mpsc_queue_pop(MPSC_QUEUE *queue)
+{
+    MPSC_NODE *tail = queue->tail;
+    MPSC_NODE *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &queue->stub)
+    {
+        if (next == NULL)
+        {
+            return NULL;
+        }
+
+        queue->tail = next;
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next == NULL)
+    {
+        if (tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE))
+        {
+            /** A push is in progress */
+            return NULL;
+        }
+
+        /** The stub takes the place of the last node so that it can be popped */
+        mpsc_queue_push(queue, &queue->stub);
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+        if (next == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    queue->tail = next;
+    return tail;
+}
+
+#endif
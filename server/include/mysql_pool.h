@@ -0,0 +1,45 @@
+#ifndef _MYSQL_POOL_H
+#define _MYSQL_POOL_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file mysql_pool.h Shared administrative connections to the servers
+ *
+ * The loading of the users and the permission checks of the services and
+ * the monitors take a connection from the pool of the server instead of
+ * connecting every time. A connection is only given to a caller with the
+ * same user and password that it was opened with. At most
+ * MYSQL_POOL_SIZE connections of a server are in use at the same time, the
+ * other callers wait for one to be returned.
+ */
+
+#include <stdbool.h>
+#include <mysql.h>
+#include <server.h>
+
+/** The connections of a server, the most that are in use at the same time */
+#define MYSQL_POOL_SIZE 4
+
+/** Seconds after which an idle connection is checked before it is used */
+#define MYSQL_POOL_PING_AFTER 10
+
+/** Seconds after which an idle connection is closed instead of used */
+#define MYSQL_POOL_MAX_IDLE 300
+
+extern MYSQL      *mxs_mysql_pool_get(SERVER *server, const char *user, const char *passwd);
+extern void        mxs_mysql_pool_put(SERVER *server, MYSQL *con);
+extern unsigned int mxs_mysql_pool_errno();
+extern const char *mxs_mysql_pool_error();
+
+#endif
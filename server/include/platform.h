@@ -48,4 +48,7 @@
 
 #endif // __cplusplus
 
+/** The assumed size of a CPU cache line, used to avoid false sharing */
+#define MXS_CACHE_LINE_SIZE 64
+
 #endif // _PLATFORM_H
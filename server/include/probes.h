@@ -0,0 +1,51 @@
+#ifndef _PROBES_H
+#define _PROBES_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file probes.h Static tracepoints of the hot paths
+ *
+ * When MaxScale is built with -DWITH_USDT=Y, each probe is a SystemTap SDT
+ * marker in the provider "maxscale". A marker is a single no-op instruction
+ * and a note in the ELF file, so the probes cost nothing until a tool such
+ * as bpftrace, perf or SystemTap attaches to them. Without the option the
+ * probes are not compiled and their arguments are not evaluated.
+ *
+ * Ready-made bpftrace scripts are in the script/bpftrace directory and the
+ * probes are listed in Debug-And-Diagnostic-Support.md.
+ *
+ * The arguments must be integers or pointers.
+ */
+
+#if defined(HAVE_USDT)
+
+#include <sys/sdt.h>
+
+#define MXS_PROBE(name)                         DTRACE_PROBE(maxscale, name)
+#define MXS_PROBE1(name, a1)                    DTRACE_PROBE1(maxscale, name, a1)
+#define MXS_PROBE2(name, a1, a2)                DTRACE_PROBE2(maxscale, name, a1, a2)
+#define MXS_PROBE3(name, a1, a2, a3)            DTRACE_PROBE3(maxscale, name, a1, a2, a3)
+#define MXS_PROBE4(name, a1, a2, a3, a4)        DTRACE_PROBE4(maxscale, name, a1, a2, a3, a4)
+
+#else
+
+#define MXS_PROBE(name)                         do { } while (0)
+#define MXS_PROBE1(name, a1)                    do { } while (0)
+#define MXS_PROBE2(name, a1, a2)                do { } while (0)
+#define MXS_PROBE3(name, a1, a2, a3)            do { } while (0)
+#define MXS_PROBE4(name, a1, a2, a3, a4)        do { } while (0)
+
+#endif
+
+#endif
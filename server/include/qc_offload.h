@@ -0,0 +1,40 @@
+#ifndef _QC_OFFLOAD_H
+#define _QC_OFFLOAD_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file qc_offload.h Classification of large statements by a thread pool
+ *
+ * Parsing a statement of megabytes takes tens of milliseconds, during which
+ * the other sessions of the polling thread would wait. A statement that is
+ * larger than query_classifier_offload_size is parsed by one of the classifier
+ * threads while the reads of its client are suspended. The classifier thread
+ * then adds a read event to the client DCB, so that the statement is routed
+ * by the thread that owns the DCB. The parse result is stored in the buffer
+ * as usual and the routers and filters find the statement already parsed.
+ */
+
+#include <buffer.h>
+#include <dcb.h>
+
+typedef struct qc_offload_job QC_OFFLOAD_JOB;
+
+extern bool            qc_offload_init(unsigned int n_threads);
+extern bool            qc_offload_wanted(GWBUF *packet);
+extern QC_OFFLOAD_JOB *qc_offload_start(GWBUF *packet, DCB *dcb);
+extern bool            qc_offload_done(QC_OFFLOAD_JOB *job);
+extern GWBUF          *qc_offload_finish(QC_OFFLOAD_JOB *job);
+extern void            qc_offload_cancel(QC_OFFLOAD_JOB *job);
+
+#endif
@@ -72,6 +72,22 @@ typedef enum qc_parse_result
     QC_QUERY_PARSED           = 3  /*< The query was fully parsed; completely classified. */
 } qc_parse_result_t;
 
+/**
+ * What information a classifier should collect when parsing a statement. The
+ * type, operation and the other essential properties are always collected.
+ * If information that was not collected is later asked for, the statement
+ * is parsed again.
+ */
+typedef enum qc_collect_info
+{
+    QC_COLLECT_ESSENTIALS = 0x00, /*< Type, operation and the other boolean properties. */
+    QC_COLLECT_TABLES     = 0x01, /*< The table names, qc_get_table_names. */
+    QC_COLLECT_DATABASES  = 0x02, /*< The database names, qc_get_database_names. */
+    QC_COLLECT_FIELDS     = 0x04, /*< The affected fields, qc_get_affected_fields. */
+
+    QC_COLLECT_ALL = (QC_COLLECT_TABLES | QC_COLLECT_DATABASES | QC_COLLECT_FIELDS)
+} qc_collect_info_t;
+
 #define QUERY_IS_TYPE(mask,type) ((mask & type) == type)
 
 bool qc_init(const char* plugin_name, const char* plugin_args);
@@ -85,7 +101,8 @@ void qc_unload(QUERY_CLASSIFIER* classifier);
 bool qc_thread_init(void);
 void qc_thread_end(void);
 
-qc_parse_result_t qc_parse(GWBUF* querybuf);
+qc_parse_result_t qc_parse(GWBUF* querybuf, uint32_t collect);
+size_t qc_get_insert_values_prefix(const char* sql, size_t len, bool* literals);
 
 uint32_t qc_get_type(GWBUF* querybuf);
 qc_query_op_t qc_get_operation(GWBUF* querybuf);
@@ -112,7 +129,7 @@ struct query_classifier
     bool (*qc_thread_init)(void);
     void (*qc_thread_end)(void);
 
-    qc_parse_result_t (*qc_parse)(GWBUF* querybuf);
+    qc_parse_result_t (*qc_parse)(GWBUF* querybuf, uint32_t collect);
 
     uint32_t (*qc_get_type)(GWBUF* querybuf);
     qc_query_op_t (*qc_get_operation)(GWBUF* querybuf);
@@ -127,7 +144,7 @@ struct query_classifier
     char** (*qc_get_database_names)(GWBUF* querybuf, int* size);
 };
 
-#define QUERY_CLASSIFIER_VERSION {1, 0, 0}
+#define QUERY_CLASSIFIER_VERSION {2, 0, 0}
 
 EXTERN_C_BLOCK_END
 
@@ -0,0 +1,120 @@
+#ifndef _QUERYTRACE_H
+#define _QUERYTRACE_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file querytrace.h The sampled routing breakdown of queries
+ *
+ * One in trace_sample_rate queries, and every query of trace_sample_user,
+ * is traced through the routing pipeline. The time-stamp counter is read at
+ * each point the query passes. The points are written to the binary event
+ * trace and, when the reply has been routed to the client, the time spent in
+ * each stage is added to the maxscale_query_stage_seconds histograms.
+ *
+ * A session traces one query at a time. The points are only recorded while
+ * the query of the session is being traced, so a query that is not sampled
+ * only costs a test of a flag.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <rdtsc.h>
+
+struct session;
+
+/** The points of the routing of a query */
+typedef enum
+{
+    QTRACE_CLIENT,     /**< The query was read from the client */
+    QTRACE_FILTER,     /**< A filter got the query, once for each filter */
+    QTRACE_ROUTER,     /**< The router got the query */
+    QTRACE_ROUTE,      /**< The router started routing the statement */
+    QTRACE_CLASSIFIED, /**< The router classified the statement */
+    QTRACE_WRITE,      /**< The query was written to a backend */
+    QTRACE_FIRST_BYTE, /**< The first bytes of the response were read */
+    QTRACE_REPLY,      /**< The reply was routed to the client */
+    QTRACE_POINT_MAX
+} qtrace_point_t;
+
+/** The stages whose times are collected in the histograms */
+typedef enum
+{
+    QTRACE_STAGE_FILTER,   /**< From reading the query to the router */
+    QTRACE_STAGE_CLASSIFY, /**< From the router to the classified statement */
+    QTRACE_STAGE_SELECT,   /**< From the classification to the write to a backend */
+    QTRACE_STAGE_BACKEND,  /**< From the write to the first bytes of the response */
+    QTRACE_STAGE_REPLY,    /**< From the first bytes to the reply to the client */
+    QTRACE_STAGE_TOTAL,    /**< From reading the query to the reply to the client */
+    QTRACE_STAGE_MAX
+} qtrace_stage_t;
+
+/** The trace of the query of a session */
+typedef struct query_trace
+{
+    bool   active;                    /**< The current query is traced */
+    int    user;                      /**< 1 if the user is traced, 0 if not, -1 if not checked */
+    CYCLES points[QTRACE_POINT_MAX];  /**< When the query passed each point, 0 if it did not */
+} QUERY_TRACE;
+
+extern bool query_trace_enabled;
+
+extern void        query_trace_init(unsigned int rate, const char *user);
+extern void        query_trace_start(struct session *session);
+extern void        query_trace_point(struct session *session, qtrace_point_t point, int filter);
+extern void        query_trace_end(struct session *session);
+extern const char *query_trace_point_name(uint32_t point);
+
+/**
+ * Decide whether the query that was read from the client of the session is
+ * traced. Called for each query before it is routed.
+ */
+#define QUERY_TRACE_START(session)                          \
+    do                                                      \
+    {                                                       \
+        if (query_trace_enabled)                            \
+        {                                                   \
+            query_trace_start(session);                     \
+        }                                                   \
+    }                                                       \
+    while (false)
+
+/**
+ * Record a point if the query of the session is traced. The points other
+ * than QTRACE_FILTER are only recorded the first time the query passes them.
+ */
+#define QUERY_TRACE_POINT(session, point)                   \
+    do                                                      \
+    {                                                       \
+        if ((session)->trace.active)                        \
+        {                                                   \
+            query_trace_point(session, point, 0);           \
+        }                                                   \
+    }                                                       \
+    while (false)
+
+/**
+ * End the trace of the query of the session when its reply has been routed
+ * to the client.
+ */
+#define QUERY_TRACE_END(session)                            \
+    do                                                      \
+    {                                                       \
+        if ((session)->trace.active)                        \
+        {                                                   \
+            query_trace_end(session);                       \
+        }                                                   \
+    }                                                       \
+    while (false)
+
+#endif
@@ -16,48 +16,80 @@
 /**
  * @file queuemanager.h  The Queue Manager header file
  *
+ * A queue holds its entries in one FIFO ring per priority class. The entries
+ * are time stamped in milliseconds so that the wait of an entry is known when
+ * it is removed and the entries that have waited for longer than the timeout
+ * of the queue can be found.
  *
  * @verbatim
  * Revision History
  *
  * Date         Who                     Description
  * 27/04/2016   Martin Brampton         Initial implementation
+ * 14/10/2016                           Priority classes and millisecond timeouts
  *
  * @endverbatim
  */
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <spinlock.h>
 #include <skygw_debug.h>
 
 #define CONNECTION_QUEUE_LIMIT 1000
 
+/** The priority classes of the queue entries, highest first */
+typedef enum
+{
+    QUEUE_PRIORITY_HIGH,
+    QUEUE_PRIORITY_NORMAL,
+    QUEUE_PRIORITY_LOW,
+    QUEUE_PRIORITIES
+} queue_priority_t;
+
 typedef struct queue_entry
 {
     void            *queued_object;
-    long            heartbeat;
+    uint64_t        queued_at;      /**< When the entry was queued, see mxs_queue_now */
+    int             priority;       /**< The priority class of the entry */
 } QUEUE_ENTRY;
 
-typedef struct queue_config
+typedef struct queue_ring
 {
-    int             queue_size;
-    int             queue_limit;
     int             start;
     int             end;
-    int             timeout;
-    SPINLOCK        queue_lock;
     QUEUE_ENTRY     queue_array[CONNECTION_QUEUE_LIMIT];
+} QUEUE_RING;
+
+typedef struct queue_config
+{
+    int             queue_size;
+    int             queue_limit;    /**< Maximum number of entries in all classes */
+    int             count;          /**< Number of entries in all classes */
+    int             timeout;        /**< Maximum wait of an entry in milliseconds */
+    SPINLOCK        queue_lock;
+    QUEUE_RING      rings[QUEUE_PRIORITIES];
 } QUEUE_CONFIG;
 
 QUEUE_CONFIG *mxs_queue_alloc(int limit, int timeout);
 void mxs_queue_free(QUEUE_CONFIG *queue_config);
-bool mxs_enqueue(QUEUE_CONFIG *queue_config, void *new_entry);
-QUEUE_ENTRY *mxs_dequeue(QUEUE_CONFIG *queue_config);
+void mxs_queue_configure(QUEUE_CONFIG *queue_config, int limit, int timeout);
+bool mxs_enqueue(QUEUE_CONFIG *queue_config, void *new_entry, int priority);
+bool mxs_dequeue(QUEUE_CONFIG *queue_config, uint64_t now, QUEUE_ENTRY *entry);
+bool mxs_dequeue_expired(QUEUE_CONFIG *queue_config, uint64_t now, QUEUE_ENTRY *entry);
+uint64_t mxs_queue_next_expiry(QUEUE_CONFIG *queue_config);
+uint64_t mxs_queue_now();
+int mxs_queue_priority(const char *name);
+const char *mxs_queue_priority_name(int priority);
 
+/**
+ * The number of entries in all priority classes of a queue. The value is
+ * read without the queue lock and may be out of date when it is used.
+ */
 static inline int
 mxs_queue_count(QUEUE_CONFIG *queue_config)
 {
-    int count = queue_config->end - queue_config->start;
-    return count < 0 ? (count + queue_config->queue_size) : count;
+    return queue_config->count;
 }
 
 #endif /* QUEUEMANAGER_H */
@@ -25,6 +25,7 @@ extern "C" {
 #endif
 
 extern unsigned int random_jkiss(void);
+extern void random_jkiss_fill(unsigned int *values, int n);
 
 #ifdef  __cplusplus
 }
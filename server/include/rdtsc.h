@@ -31,6 +31,8 @@
  * @endverbatim
  */
 
+#include <time.h>
+
 typedef unsigned long long CYCLES;
 
 /**
@@ -49,8 +51,15 @@ typedef unsigned long long CYCLES;
  */
 static __inline__ CYCLES rdtsc(void)
 {
-    unsigned long long int x;
-    __asm__ volatile (".byte 0x0f, 0x31" : "=A" (x));
-    return x;
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int lo, hi;
+    __asm__ volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((CYCLES)hi << 32) | lo;
+#else
+    /** No time-stamp counter, fall back to the monotonic clock in nanoseconds */
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (CYCLES)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
 }
 #endif
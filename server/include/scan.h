@@ -0,0 +1,45 @@
+#ifndef _SCAN_H
+#define _SCAN_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file scan.h Byte scanning primitives
+ *
+ * Functions for finding the first byte that is, or is not, one of a small set
+ * of bytes. On x86-64 the bytes are compared 32 or 16 at a time with AVX2 or
+ * SSE4.2 instructions if the processor supports them. Otherwise, and for the
+ * last bytes of a range, they are compared one at a time.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/** The largest number of bytes in a set */
+#define SCAN_MAX_SET 16
+
+/** The implementations of the primitives */
+typedef enum
+{
+    SCAN_IMPL_SCALAR,   /*< One byte at a time */
+    SCAN_IMPL_SSE42,    /*< 16 bytes at a time with PCMPESTRI */
+    SCAN_IMPL_AVX2      /*< 32 bytes at a time with VPCMPEQB */
+} scan_impl_t;
+
+extern const char *scan_find_any(const char *ptr, const char *end, const char *set, int n_set);
+extern const char *scan_skip_any(const char *ptr, const char *end, const char *set, int n_set);
+extern bool        scan_set_impl(scan_impl_t impl);
+extern scan_impl_t scan_get_impl(void);
+extern const char *scan_impl_name(scan_impl_t impl);
+
+#endif
@@ -14,6 +14,7 @@
  */
 #include <dcb.h>
 #include <resultset.h>
+#include <statistics.h>
 
 /**
  * @file service.h
@@ -46,6 +47,7 @@
 
 #define MAX_SERVER_NAME_LEN 1024
 #define MAX_NUM_SLAVES 128 /**< Maximum number of slaves under a single server*/
+#define SERVER_FULL_LOAD_WEIGHT 1000 /**< Load weight of a server that can take its full share */
 
 /**
  * The server parameters used for weighting routing decissions
@@ -64,12 +66,30 @@ typedef struct server_params
  */
 typedef struct
 {
-    int n_connections; /**< Number of connections */
+    ts_stats_t n_connections; /**< Number of connections */
     int n_current;     /**< Current connections */
-    int n_current_ops; /**< Current active operations */
+    ts_stats_t n_current_ops; /**< Current active operations, one slot per worker
+                               * thread so that routing does not share a cache line */
     int n_persistent;  /**< Current persistent pool */
+    int n_filling;     /**< Connections being opened to fill the persistent pool */
+    uint64_t n_pool_hits;   /**< Connections taken from the persistent pool */
+    uint64_t n_pool_misses; /**< Connections created because the pool had none */
 } SERVER_STATS;
 
+/** Number of shards of the persistent connection pool of a server */
+#define SERVER_POOL_SHARDS 16
+
+/**
+ * A shard of the persistent connection pool of a server. A connection is
+ * pooled in the shard of the polling thread that owns it, so the threads
+ * seldom contend for the same lock.
+ */
+typedef struct
+{
+    SPINLOCK lock;          /**< Lock for adjusting the connections of the shard */
+    DCB      *persistent;   /**< The unused persistent connections */
+} SERVER_POOL_SHARD;
+
 /**
  * The SERVER structure defines a backend server. Each server has a name
  * or IP address for the server, a port that the server listens on and
@@ -96,6 +116,9 @@ typedef struct server
     char           *server_string; /**< Server version string, i.e. MySQL server version */
     long           node_id;        /**< Node id, server_id for M/S or local_index for Galera */
     int            rlag;           /**< Replication Lag for Master / Slave replication */
+    int            rlag_ms;        /**< Smoothed replication lag in milliseconds, -1 if not measured */
+    int            rlag_jitter_ms; /**< Mean deviation of the replication lag in milliseconds */
+    int            rlag_sample_ms; /**< The previous replication lag sample in milliseconds */
     unsigned long  node_ts;        /**< Last timestamp set from M/S monitor module */
     SERVER_PARAM   *parameters;    /**< Parameters of a server that may be used to weight routing decisions */
     long           master_id;      /**< Master server id of this node */
@@ -104,17 +127,53 @@ typedef struct server
     bool           master_err_is_logged; /*< If node failed, this indicates whether it is logged */
     bool           slave_configured; /**< Server is configured as a replication slave
                                       * TODO: Remove this for 2.1 */
-    DCB            *persistent;    /**< List of unused persistent connections to the server */
-    SPINLOCK       persistlock;    /**< Lock for adjusting the persistent connections list */
+    SERVER_POOL_SHARD pool[SERVER_POOL_SHARDS]; /**< The unused persistent connections */
+    DCB            *dcbs;          /**< The backend DCBs connected to the server */
+    SPINLOCK       dcbs_lock;      /**< Lock for the list of backend DCBs */
     long           persistpoolmax; /**< Maximum size of persistent connections pool */
+    long           persistpoolmin; /**< Number of connections the pool is filled to */
     long           persistmaxtime; /**< Maximum number of seconds connection can live */
     int            persistmax;     /**< Maximum pool size actually achieved since startup */
+    long           connect_timeout; /**< Seconds a new connection may take to respond, 0 for no limit */
+    bool           compression;    /**< Use the compressed protocol if the server supports it */
+    struct in_addr address;        /**< The resolved address of the server */
+    long           address_time;   /**< Heartbeat when the address was resolved, 0 if never */
     uint8_t        charset;        /**< Default server character set */
+    int            failure_reports; /**< Failed connections since the monitor last checked */
+    int            topology_index; /**< Index of the server in the topology snapshots */
+    int            load_weight;    /**< Share of its normal load the server can take as reported
+                                    * by the monitor, in per mille of SERVER_FULL_LOAD_WEIGHT */
 #if defined(SS_DEBUG)
     skygw_chk_t    server_chk_tail;
 #endif
 } SERVER;
 
+/**
+ * The state of a server as seen in a topology snapshot. The field names match
+ * those of SERVER so that the SERVER_IS_* macros work on both.
+ */
+typedef struct server_state
+{
+    SERVER         *server;        /**< The server, NULL for an unused index */
+    unsigned int   status;         /**< Status flag bitmap for the server */
+    int            depth;          /**< Replication level in the tree */
+    int            rlag;           /**< Replication Lag for Master / Slave replication */
+    unsigned long  node_ts;        /**< Last timestamp set from M/S monitor module */
+} SERVER_STATE;
+
+/**
+ * A consistent snapshot of the states of all servers. The monitors publish a
+ * new version at the end of each monitoring round in which a state changed
+ * and each thread keeps a private copy of the latest version it has seen.
+ */
+typedef struct server_topology
+{
+    int            version;        /**< Version of the snapshot, 0 if none is published */
+    int            n_states;       /**< Number of entries in states */
+    int            capacity;       /**< Allocated size of states */
+    SERVER_STATE   *states;        /**< The states, indexed by SERVER->topology_index */
+} SERVER_TOPOLOGY;
+
 /**
  * Status bits in the server->status member.
  *
@@ -215,11 +274,52 @@ extern void serverAddParameter(SERVER *, char *, char *);
 extern char *serverGetParameter(SERVER *, char *);
 extern void server_update(SERVER *, char *, char *, char *);
 extern void server_set_unique_name(SERVER *, char *);
-extern DCB  *server_get_persistent(SERVER *, char *, const char *);
+extern DCB  *server_get_persistent(SERVER *, char *, const char *, int);
+extern SERVER_POOL_SHARD *server_pool_shard(SERVER *, int);
+extern void server_persistent_expire(void *);
 extern void server_update_address(SERVER *, char *);
+extern bool server_get_address(SERVER *, struct in_addr *);
 extern void server_update_port(SERVER *,  unsigned short);
 extern RESULTSET *serverGetList();
 extern unsigned int server_map_status(char *str);
 extern bool server_set_version_string(SERVER* server, const char* string);
+extern void server_report_failure(SERVER *server);
+extern void server_publish_topology();
+extern const SERVER_TOPOLOGY *server_get_topology();
+extern int server_take_failure_reports(SERVER *server);
+
+/**
+ * Find the state of a server in a topology snapshot
+ *
+ * @param topology The snapshot returned by server_get_topology()
+ * @param server   The server
+ * @return The state of the server or NULL if the server is not in the snapshot
+ */
+static inline const SERVER_STATE *server_topology_state(const SERVER_TOPOLOGY *topology,
+                                                        const SERVER *server)
+{
+    int i = server->topology_index;
+
+    if (i < topology->n_states && topology->states[i].server == server)
+    {
+        return &topology->states[i];
+    }
+
+    return NULL;
+}
+
+/**
+ * Scale a routing weight by the load weight of a server
+ *
+ * @param server The server
+ * @param weight The configured weight of the server, 0 if it is not to be used
+ * @return The scaled weight, at least 1 unless the configured weight is 0
+ */
+static inline int server_scale_weight(const SERVER *server, int weight)
+{
+    int scaled = (int)((int64_t)weight * server->load_weight / SERVER_FULL_LOAD_WEIGHT);
+
+    return weight > 0 && scaled == 0 ? 1 : scaled;
+}
 
 #endif
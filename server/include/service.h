@@ -28,6 +28,7 @@
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/dh.h>
+#include <metrics.h>
 /**
  * @file service.h
  *
@@ -65,8 +66,9 @@ typedef struct
 {
     time_t started;         /**< The time when the service was started */
     int    n_failed_starts; /**< Number of times this service has failed to start */
-    int    n_sessions;      /**< Number of sessions created on service since start */
+    ts_stats_t n_sessions;  /**< Number of sessions created on service since start */
     int    n_current;       /**< Current number of sessions */
+    int64_t memory;         /**< Bytes of buffers held by the sessions, see SESSION_STATS */
 } SERVICE_STATS;
 
 /**
@@ -89,12 +91,30 @@ typedef struct
 {
     int nloads;
     time_t last;
+    bool pending;           /*< A reload was requested from the background thread */
+    bool loading;           /*< The background thread is reloading the users */
+    struct users_reload_waiter *waiters; /*< Logins that wait for the reload */
+    int n_reloads;          /*< Number of reloads done */
+    long last_duration;     /*< Duration of the last reload in milliseconds */
 } SERVICE_REFRESH_RATE;
 
+/** A client login that waits for the users of its service to be reloaded */
+typedef struct users_reload_waiter USERS_RELOAD_WAITER;
+
+/** The query types whose latencies are measured separately */
+typedef enum
+{
+    SERVICE_LATENCY_READ,   /**< Queries classified as reads */
+    SERVICE_LATENCY_WRITE,  /**< Queries classified as writes */
+    SERVICE_LATENCY_OTHER,  /**< Queries that were not classified */
+    SERVICE_LATENCY_MAX
+} service_latency_t;
+
 typedef struct server_ref_t
 {
     struct server_ref_t *next;
     SERVER* server;
+    METRIC *latency[SERVICE_LATENCY_MAX]; /**< Latency histograms, registered on first use */
 } SERVER_REF;
 
 #define SERVICE_MAX_RETRY_INTERVAL 3600 /*< The maximum interval between service start retries */
@@ -102,6 +122,9 @@ typedef struct server_ref_t
 /** Value of service timeout if timeout checks are disabled */
 #define SERVICE_NO_SESSION_TIMEOUT 0
 
+/** Default maximum wait of a queued connection in milliseconds */
+#define SERVICE_DEFAULT_QUEUE_TIMEOUT 10000
+
 /**
  * Parameters that are automatically detected but can also be configured by the
  * user are initially set to this value.
@@ -122,6 +145,12 @@ typedef struct service
     int client_count;                  /**< Number of connected clients */
     int max_connections;               /**< Maximum client connections */
     QUEUE_CONFIG *queued_connections;  /**< Queued connections, if set */
+    int n_admitting;                   /**< Queued connections that are being accepted */
+    METRIC *queue_length;              /**< Number of queued connections */
+    METRIC *queue_wait;                /**< Wait times of the queued connections */
+    METRIC *queue_admitted;            /**< Queued connections that were accepted */
+    METRIC *queue_expired;             /**< Queued connections that timed out */
+    METRIC *queue_rejected;            /**< Connections rejected because the queue was full */
     SERV_LISTENER *ports;              /**< Linked list of ports and protocols
                                         * that this service will listen on.
                                         */
@@ -135,6 +164,7 @@ typedef struct service
     SPINLOCK spin;                     /**< The service spinlock */
     SERVICE_STATS stats;               /**< The service statistics */
     struct users *users;               /**< The user data for this service */
+    int users_generation;              /**< Incremented whenever the user data is replaced */
     int enable_root;                   /**< Allow root user  access */
     int localhost_match_wildcard_host; /**< Match localhost against wildcard */
     HASHTABLE *resources;              /**< hastable for service resources, i.e. database names */
@@ -203,6 +233,11 @@ extern int serviceStripDbEsc(SERVICE* service, int action);
 extern int serviceAuthAllServers(SERVICE *service, int action);
 extern void service_update(SERVICE *, char *, char *, char *);
 extern int service_refresh_users(SERVICE *);
+extern void service_refresh_users_async(SERVICE *);
+extern USERS_RELOAD_WAITER *service_refresh_users_wait(SERVICE *, DCB *);
+extern bool service_refresh_users_done(USERS_RELOAD_WAITER *);
+extern void service_refresh_users_finish(USERS_RELOAD_WAITER *);
+extern void service_refresh_users_cancel(USERS_RELOAD_WAITER *);
 extern void printService(SERVICE *);
 extern void printAllServices();
 extern void dprintAllServices(DCB *);
@@ -219,6 +254,26 @@ extern void service_shutdown();
 extern int serviceSessionCountAll();
 extern RESULTSET *serviceGetList();
 extern RESULTSET *serviceGetListenerList();
+extern RESULTSET *serviceGetLatencyList();
+extern void service_record_latency(SERVICE *service, SERVER *server,
+                                   service_latency_t type, uint64_t usec);
+extern int64_t service_latency_quantile(SERVICE *service, SERVER *server,
+                                        service_latency_t type, double q, int64_t *count);
+extern void service_queue_expires_at(uint64_t expiry);
+extern void service_process_queued_connections();
+extern int service_queue_poll_timeout(int timeout);
+
+/**
+ * Get the time used for the latency measurements
+ *
+ * @return The monotonic clock in microseconds
+ */
+static inline uint64_t service_latency_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 extern bool service_all_services_have_listeners();
 
 #endif
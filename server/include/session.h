@@ -37,6 +37,8 @@
 #include <buffer.h>
 #include <spinlock.h>
 #include <resultset.h>
+#include <timerwheel.h>
+#include <querytrace.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
 
@@ -46,10 +48,22 @@ struct filter_def;
 
 /**
  * The session statistics structure
+ *
+ * The counters are updated by the polling threads with relaxed atomic adds.
+ * The CPU cycles are the time spent in the event handlers of the DCBs
+ * of the session.
  */
 typedef struct
 {
     time_t          connect;        /**< Time when the session was started */
+    uint64_t        cpu_cycles;     /**< CPU cycles spent processing the events */
+    uint64_t        bytes_in;       /**< Bytes read from the client */
+    uint64_t        bytes_out;      /**< Bytes written to the client */
+    uint64_t        n_queries;      /**< Queries routed from the client */
+    int64_t         memory;         /**< Bytes of buffers queued in the DCBs of the session
+                                     * and kept in its session command history */
+    int64_t         memory_kept;    /**< Part of memory that is kept for the session's lifetime
+                                     * and does not drain, e.g. the session command history */
 } SESSION_STATS;
 
 typedef enum
@@ -88,15 +102,25 @@ typedef struct
     int (*error)(void *instance, void *session, void *);
 } UPSTREAM;
 
+/** Number of the classes of client packets, see filter_class_t */
+#define SESSION_FILTER_CLASSES 4
+
 /**
  * Structure used to track the filter instances and sessions of the filters
  * that are in use within a session.
+ *
+ * The array has an extra element after the filters for the router. The next
+ * array holds, for each class of packets, the index of the first element
+ * at or after this one that is interested in the class.
  */
 typedef struct
 {
     struct filter_def *filter;
     void *instance;
     void *session;
+    int (*routeQuery)(void *instance, void *session, GWBUF *request);
+    uint32_t interest;                    /**< The FILTER_INTEREST_* bits */
+    int next[SESSION_FILTER_CLASSES];
 } SESSION_FILTER;
 
 /**
@@ -133,21 +157,42 @@ typedef struct session
     SESSION_FILTER  *filters;         /*< The filters in use within this session */
     DOWNSTREAM      head;             /*< Head of the filter chain */
     UPSTREAM        tail;             /*< The tail of the filter chain */
-    struct session  *next;            /*< Linked list of all sessions */
     int             refcount;         /*< Reference count on the session */
     bool            ses_is_child;     /*< this is a child session */
+    TIMER_ENTRY     idle_timer;       /*< The connection idle timeout timer */
+    bool            memory_paused;    /*< Client reads paused by the soft memory limit */
+    bool            memory_closed;    /*< Client closed by the hard memory limit */
+    QUERY_TRACE     trace;            /*< The sampled routing trace of the current query */
+    /** The members below are kept when a session is reused */
+    struct session  *next;            /*< Linked list of all sessions */
+    struct session_pool *pool;        /*< The pool the session is returned to */
+    struct session  *next_free;       /*< Next free session in the pool */
 #if defined(SS_DEBUG)
     skygw_chk_t     ses_chk_tail;
 #endif
 } SESSION;
 
+/** Maximum number of sessions returned by session_top_usage */
+#define SESSION_TOP_MAX 100
+
+/** Number of sessions whose usage is printed with the metrics */
+#define SESSION_TOP_METRICS 10
+
+/**
+ * A snapshot of the resource usage of a session
+ */
+typedef struct
+{
+    size_t          id;               /*< The session id */
+    char            user[128];        /*< The client user */
+    char            remote[64];       /*< The client address */
+    char            service[64];      /*< The name of the service */
+    SESSION_STATS   stats;            /*< The counters of the session */
+} SESSION_USAGE;
+
 /** Whether to do session timeout checks */
 extern bool check_timeouts;
 
-/** When the next timeout check is done. This is compared to hkheartbeat in
- * hk_heartbeat.h */
-extern long next_timeout_check;
-
 #define SESSION_PROTOCOL(x, type)       DCB_PROTOCOL((x)->client_dcb, type)
 
 /**
@@ -156,8 +201,9 @@ extern long next_timeout_check;
  * routers.
  */
 #define SESSION_ROUTE_QUERY(sess, buf)                          \
-    ((sess)->head.routeQuery)((sess)->head.instance,            \
-                              (sess)->head.session, (buf))
+    (__atomic_add_fetch(&(sess)->stats.n_queries, 1, __ATOMIC_RELAXED), \
+     ((sess)->head.routeQuery)((sess)->head.instance,           \
+                               (sess)->head.session, (buf)))
 /**
  * A convenience macro that can be used by the router modules to route
  * the replies to the first element in the pipeline of filters and
@@ -180,12 +226,20 @@ void printSession(SESSION *);
 void dprintAllSessions(struct dcb *);
 void dprintSession(struct dcb *, SESSION *);
 void dListSessions(struct dcb *);
+void dListTopSessions(struct dcb *, int n);
+void dListTopMemorySessions(struct dcb *, int n);
+int session_top_usage(SESSION_USAGE *usage, int n, bool by_memory);
+void session_account_memory(SESSION *session, int n);
+void session_account_kept_memory(SESSION *session, int n);
+void session_print_metrics(struct dcb *);
 char *session_state(session_state_t);
 bool session_link_dcb(SESSION *, struct dcb *);
 SESSION* get_session_by_router_ses(void* rses);
 void session_enable_log_priority(SESSION* ses, int priority);
 void session_disable_log_priority(SESSION* ses, int priority);
 RESULTSET *sessionGetList(SESSIONLISTFILTER);
-void process_idle_sessions();
+bool session_init_timeouts(int n_threads);
+void session_process_timeouts(int thread_id);
+void session_thread_end();
 void enable_session_timeouts();
 #endif
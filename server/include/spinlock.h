@@ -22,9 +22,15 @@
  * generally wasteful as any blocked threads will spin, consuming CPU cycles, waiting
  * for the lock to be released. However they are useful in that they do not involve
  * system calls and are light weight when the expected wait time for a lock is low.
+ *
+ * To limit the waste when the holder of a lock is descheduled, a thread spins only
+ * for a bounded number of rounds, with an increasing number of pause instructions
+ * between the rounds. After that it sleeps on a futex until the lock is released.
  */
 #include <thread.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <rdtsc.h>
 
 #define SPINLOCK_PROFILE 0
 
@@ -37,10 +43,17 @@
  * In builds with the SPINLOCK_PROFILE option set this structure also holds
  * a number of profile related fields that count the number of spins, number
  * of waiting threads and the number of times the lock has been acquired.
+ *
+ * The name and the fields after it are used by the contention profiler that
+ * can be enabled at runtime. The name must be a string that outlives the lock,
+ * usually a string literal.
  */
 typedef struct spinlock
 {
-    int lock;         /*< Is the lock held? */
+    int lock;         /*< 0 if free, 1 if held, 2 if held and threads may be sleeping */
+    const char *name; /*< The name of the lock in the contention profile, may be NULL */
+    struct spinlock_site *site; /*< Profile of a sampled holder, NULL if not sampled */
+    CYCLES hold_start; /*< When the sampled holder acquired the lock */
 #if SPINLOCK_PROFILE
     int spins;        /*< Number of spins on this lock */
     int maxspins;     /*< Max no of spins to acquire lock */
@@ -60,17 +73,42 @@ typedef struct spinlock
 #endif
 
 #if SPINLOCK_PROFILE
-#define SPINLOCK_INIT { 0, 0, 0, 0, 0, 0, 0, 0 }
+#define SPINLOCK_INIT { 0, NULL, NULL, 0, 0, 0, 0, 0, 0, 0, 0 }
 #else
 #define SPINLOCK_INIT { 0 }
 #endif
 
 #define SPINLOCK_IS_LOCKED(l) ((l)->lock != 0 ? true : false)
 
+/**
+ * The contention profile of one lock at one call site. The counts only
+ * include the sampled acquisitions and the times are in CPU cycles.
+ */
+typedef struct spinlock_profile_entry
+{
+    const SPINLOCK *lock;   /*< The profiled lock, must not be dereferenced */
+    const char *name;       /*< The name of the lock or NULL if it has no name */
+    void *site;             /*< The address that acquired the lock */
+    uint64_t acquired;      /*< Sampled acquisitions */
+    uint64_t contended;     /*< Sampled acquisitions that had to wait */
+    uint64_t wait;          /*< Total time spent acquiring the lock */
+    uint64_t max_wait;      /*< Longest time spent acquiring the lock */
+    uint64_t hold;          /*< Total time the lock was held */
+    uint64_t max_hold;      /*< Longest time the lock was held */
+} SPINLOCK_PROFILE_ENTRY;
+
+/** The number of entries in the top list of contended locks */
+#define SPINLOCK_PROFILE_TOP 20
+
 extern void spinlock_init(SPINLOCK *lock);
 extern void spinlock_acquire(SPINLOCK *lock);
 extern int spinlock_acquire_nowait(SPINLOCK *lock);
 extern void spinlock_release(SPINLOCK *lock);
 extern void spinlock_stats(SPINLOCK *lock, void (*reporter)(void *, char *, int), void *hdl);
+extern void spinlock_set_name(SPINLOCK *lock, const char *name);
+extern void spinlock_profile_enable(bool enable);
+extern bool spinlock_profile_enabled();
+extern int spinlock_profile_top(SPINLOCK_PROFILE_ENTRY *entries, int n);
+extern void spinlock_profile_site_name(void *site, char *buf, int len);
 
 #endif
@@ -24,9 +24,26 @@
  * @endverbatim
  */
 
-typedef void* ts_stats_t;
+#include <inttypes.h>
 
-/** stats_init should be called only once */
+/**
+ * A thread-safe counter. Each thread has its own 64-bit slot on its own
+ * cache line so updating the counter never requires locking and threads
+ * updating the same counter do not invalidate each other's caches. Reading
+ * the counter combines the values of all the threads.
+ */
+typedef struct ts_stats *ts_stats_t;
+
+/** How the values of the threads are combined when a counter is read */
+typedef enum ts_stats_type
+{
+    TS_STATS_MAX,   /**< Largest value of any thread */
+    TS_STATS_MIN,   /**< Smallest value of any thread */
+    TS_STATS_SUM,   /**< Sum of the values of all threads */
+    TS_STATS_AVG    /**< Average of the values of all threads */
+} ts_stats_type_t;
+
+/** stats_init should be called before any statistics are allocated */
 void ts_stats_init();
 
 /** No-op for now */
@@ -37,8 +54,9 @@ void ts_stats_set_thread_id(int id);
 
 ts_stats_t ts_stats_alloc();
 void ts_stats_free(ts_stats_t stats);
-void ts_stats_add(ts_stats_t stats, int value);
-void ts_stats_set(ts_stats_t stats, int value);
-int ts_stats_sum(ts_stats_t stats);
+void ts_stats_add(ts_stats_t stats, int64_t value);
+void ts_stats_set(ts_stats_t stats, int64_t value);
+int64_t ts_stats_sum(ts_stats_t stats);
+int64_t ts_stats_get(ts_stats_t stats, ts_stats_type_t type);
 
 #endif
@@ -0,0 +1,86 @@
+#ifndef _TIMERWHEEL_H
+#define _TIMERWHEEL_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file timerwheel.h A hierarchical timing wheel
+ *
+ * The wheel keeps timers in slots by their expiry time, with one slot per
+ * millisecond at the lowest level and coarser slots at the higher levels.
+ * Adding and removing a timer are constant time operations and advancing
+ * the wheel only touches the slots that are passed.
+ *
+ * The timers are intrusive: a TIMER_ENTRY is embedded in the structure that
+ * it times. The wheel does no locking of its own, it is meant to be owned by
+ * one thread or protected by a lock of the caller.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** The number of bits of the expiry time that select a slot on one level */
+#define TIMERWHEEL_BITS   8
+/** The number of slots on each level */
+#define TIMERWHEEL_SLOTS  (1 << TIMERWHEEL_BITS)
+/** The number of levels, the wheel covers 2^32 milliseconds or about 49 days */
+#define TIMERWHEEL_LEVELS 4
+
+struct timer_wheel;
+
+/**
+ * A timer, or the head of a list of timers. The lists are circular and
+ * doubly linked so that a timer can be unlinked without knowing its list.
+ */
+typedef struct timer_entry
+{
+    struct timer_entry *next;       /*< The next timer in the list */
+    struct timer_entry *prev;       /*< The previous timer in the list */
+    struct timer_wheel *wheel;      /*< The wheel the timer is in, NULL if not in a wheel */
+    int                level;       /*< The level of the wheel the timer is on */
+    uint64_t           expiry;      /*< When the timer expires, in milliseconds */
+} TIMER_ENTRY;
+
+/**
+ * The timing wheel
+ */
+typedef struct timer_wheel
+{
+    uint64_t    now;            /*< The next millisecond to be processed */
+    int         count;          /*< Number of timers in the wheel */
+    int         level_count[TIMERWHEEL_LEVELS]; /*< Number of timers on each level */
+    TIMER_ENTRY slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS]; /*< The slot list heads */
+} TIMER_WHEEL;
+
+extern void timerwheel_init(TIMER_WHEEL *wheel, uint64_t now);
+extern void timerwheel_entry_init(TIMER_ENTRY *entry);
+extern void timerwheel_list_init(TIMER_ENTRY *head);
+extern void timerwheel_add(TIMER_WHEEL *wheel, TIMER_ENTRY *entry, uint64_t expiry);
+extern void timerwheel_remove(TIMER_ENTRY *entry);
+extern bool timerwheel_is_linked(TIMER_ENTRY *entry);
+extern int  timerwheel_advance(TIMER_WHEEL *wheel, uint64_t now, TIMER_ENTRY *expired);
+extern uint64_t timerwheel_next_expiry(TIMER_WHEEL *wheel);
+
+/**
+ * Check whether a list of timers is empty
+ *
+ * @param head The head of the list
+ * @return True if there are no timers in the list
+ */
+static inline bool timerwheel_list_empty(TIMER_ENTRY *head)
+{
+    return head->next == head;
+}
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file trace.h The binary event trace
+ *
+ * Every thread writes fixed-size event records to its own memory mapped ring
+ * file. Writing a record takes a clock read and a few stores, so the trace
+ * can be left on in production. The files are decoded offline with maxtrace.
+ *
+ * A trace file starts with a TRACE_FILE_HEADER after which there are
+ * th_records TRACE_RECORDs. The record number n is written to the slot
+ * n % th_records and th_written is updated after the record is complete.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define TRACE_MAGIC   "MXSTRACE"
+#define TRACE_VERSION 1
+
+/** Events that are traced */
+typedef enum
+{
+    TRACE_SESSION_START,     /**< A session was created */
+    TRACE_SESSION_END,       /**< A session was freed */
+    TRACE_POLL_EVENTS_BEGIN, /**< Started processing events of a DCB, arg1: events, arg2: fd */
+    TRACE_POLL_EVENTS_END,   /**< Processed events of a DCB, arg1: 1 if DCB was processed */
+    TRACE_ROUTE_QUERY,       /**< Routed a query, arg1: command, arg2: route target */
+    TRACE_CLIENT_REPLY,      /**< Got a reply from a backend, arg2: bytes */
+    TRACE_QUERY_POINT,       /**< A sampled query passed a point, arg1: qtrace_point_t and the
+                              * filter number in the upper 16 bits, arg2: time-stamp counter */
+    TRACE_EVENT_MAX
+} trace_event_t;
+
+typedef struct trace_record
+{
+    uint64_t tr_time;    /**< CLOCK_MONOTONIC time in nanoseconds */
+    uint64_t tr_session; /**< Session id, 0 if not known */
+    uint32_t tr_event;   /**< One of trace_event_t */
+    uint32_t tr_arg1;    /**< Event specific argument */
+    uint64_t tr_arg2;    /**< Event specific argument */
+} TRACE_RECORD;
+
+typedef struct trace_file_header
+{
+    char     th_magic[8];     /**< TRACE_MAGIC without the terminating null */
+    uint32_t th_version;      /**< TRACE_VERSION */
+    uint32_t th_record_size;  /**< sizeof(TRACE_RECORD) */
+    uint64_t th_records;      /**< Number of record slots in the file */
+    uint64_t th_written;      /**< Number of records written since the start */
+    uint64_t th_thread;       /**< Number of the thread writing the file */
+    uint64_t th_mono_start;   /**< CLOCK_MONOTONIC when the file was created, in nanoseconds */
+    uint64_t th_real_start;   /**< CLOCK_REALTIME when the file was created, in nanoseconds */
+    uint64_t th_unused;
+} TRACE_FILE_HEADER;
+
+extern bool trace_enabled;
+
+/**
+ * Trace an event if tracing is enabled
+ *
+ * @param event   One of trace_event_t
+ * @param session Session id or 0
+ * @param arg1    Event specific argument
+ * @param arg2    Event specific argument
+ */
+#define TRACE_EVENT(event, session, arg1, arg2)                 \
+    do                                                          \
+    {                                                           \
+        if (trace_enabled)                                      \
+        {                                                       \
+            trace_event(event, session, arg1, arg2);            \
+        }                                                       \
+    }                                                           \
+    while (false)
+
+extern bool        trace_init(const char *dir, size_t records);
+extern void        trace_event(uint32_t event, uint64_t session, uint32_t arg1, uint64_t arg2);
+extern const char *trace_event_name(uint32_t event);
+extern char        trace_event_phase(uint32_t event);
+
+#endif
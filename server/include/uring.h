@@ -0,0 +1,43 @@
+#ifndef _URING_H
+#define _URING_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file uring.h A minimal io_uring submission and completion ring
+ *
+ * The ring is used through the io_uring system calls directly so that
+ * liburing is not needed. A ring is meant to be owned by one thread: the
+ * operations are prepared, submitted together with one system call and the
+ * completions are then reaped by the same thread.
+ *
+ * The socket operations are prepared with MSG_DONTWAIT so that a socket that
+ * is not ready completes at once with -EAGAIN instead of being left pending
+ * in the kernel. This keeps the readiness of the sockets in epoll.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+typedef struct uring URING;
+
+extern URING *uring_create(unsigned int entries);
+extern void   uring_free(URING *ring);
+extern bool   uring_prep_recv(URING *ring, int fd, void *buf, size_t len, uint64_t user_data);
+extern bool   uring_prep_sendmsg(URING *ring, int fd, const struct msghdr *msg, uint64_t user_data);
+extern int    uring_submit_and_wait(URING *ring, unsigned int wait_nr);
+extern bool   uring_reap(URING *ring, uint64_t *user_data, int *res);
+
+#endif
@@ -29,6 +29,7 @@
 #include <mysql_client_server_protocol.h>
 #include <gw_authenticator.h>
 #include <maxscale/poll.h>
+#include <platform.h>
 
 /* @see function load_module in load_utils.c for explanation of the following
  * lint directives.
@@ -50,6 +51,25 @@ static bool mysql_auth_is_client_ssl_capable(DCB *dcb);
 static int mysql_auth_authenticate(DCB *dcb);
 static void mysql_auth_free_client_data(DCB *dcb);
 
+/** Number of resolved logins that each thread caches */
+#define AUTH_CACHE_SIZE 128
+
+/**
+ * A resolved login: the password of the user entry that matched a user
+ * connecting from an address to a database.
+ */
+typedef struct
+{
+    SERVICE  *service;                          /*< The service, NULL for an unused entry */
+    int      generation;                        /*< The users_generation of the service */
+    uint32_t addr;                              /*< The client's IPv4 address */
+    char     user[MYSQL_USER_MAXLEN + 1];       /*< The user name */
+    char     db[MYSQL_DATABASE_MAXLEN + 1];     /*< The default database */
+    uint8_t  password[SHA_DIGEST_LENGTH];       /*< SHA1(SHA1(password)) of the entry */
+} AUTH_CACHE_ENTRY;
+
+static thread_local AUTH_CACHE_ENTRY auth_cache[AUTH_CACHE_SIZE];
+
 /*
  * The "module object" for mysql client authenticator module.
  */
@@ -111,6 +131,66 @@ GWAUTHENTICATOR* GetModuleObject()
 }
 /*lint +e14 */
 
+/**
+ * @brief Check the user, password and database of a client
+ *
+ * If the check fails, the users are reloaded from the backend databases in the
+ * background. The login waits for the reload without blocking this thread, see
+ * service_refresh_users_wait, and is checked again when it has finished.
+ *
+ * @param dcb Request handler DCB connected to the client
+ * @return Authentication status, MYSQL_AUTH_USERS_WAIT if the login waits
+ */
+static int
+mysql_auth_check_user(DCB *dcb)
+{
+    MySQLProtocol *protocol = DCB_PROTOCOL(dcb, MySQLProtocol);
+    MYSQL_session *client_data = (MYSQL_session *)dcb->data;
+    int auth_ret;
+
+    MXS_DEBUG("Receiving connection from '%s' to database '%s'.",
+              client_data->user, client_data->db);
+
+    auth_ret = combined_auth_check(dcb, client_data->auth_token, client_data->auth_token_len,
+                                   protocol, client_data->user, client_data->client_sha1, client_data->db);
+
+    if (MYSQL_AUTH_SUCCEEDED != auth_ret && !client_data->users_reloaded &&
+        (client_data->users_wait = service_refresh_users_wait(dcb->service, dcb)))
+    {
+        /** The users are reloaded just once for each login */
+        client_data->users_reloaded = true;
+        return MYSQL_AUTH_USERS_WAIT;
+    }
+
+    /* on successful authentication, set user into dcb field */
+    if (MYSQL_AUTH_SUCCEEDED == auth_ret)
+    {
+        dcb->user = strdup(client_data->user);
+    }
+    else if (dcb->service->log_auth_warnings)
+    {
+        MXS_NOTICE("%s: login attempt for user '%s'@%s:%d, authentication failed.",
+                   dcb->service->name, client_data->user, dcb->remote, ntohs(dcb->ipv4.sin_port));
+        if (dcb->ipv4.sin_addr.s_addr == 0x0100007F &&
+            !dcb->service->localhost_match_wildcard_host)
+        {
+            MXS_NOTICE("If you have a wildcard grant that covers"
+                       " this address, try adding "
+                       "'localhost_match_wildcard_host=true' for "
+                       "service '%s'. ", dcb->service->name);
+        }
+    }
+
+    /* let's free the auth_token now */
+    if (client_data->auth_token)
+    {
+        free(client_data->auth_token);
+        client_data->auth_token = NULL;
+    }
+
+    return auth_ret;
+}
+
 /**
  * @brief Authenticates a MySQL user who is a client to MaxScale.
  *
@@ -120,6 +200,9 @@ GWAUTHENTICATOR* GetModuleObject()
  * user name.  Call other functions to validate the user, reloading the user
  * data if the first attempt fails.
  *
+ * A login that waits for the users to be reloaded is checked again when this
+ * is called after the reload has finished.
+ *
  * @param dcb Request handler DCB connected to the client
  * @return Authentication status
  * @note Authentication status codes are defined in mysql_client_server_protocol.h
@@ -127,10 +210,21 @@ GWAUTHENTICATOR* GetModuleObject()
 static int
 mysql_auth_authenticate(DCB *dcb)
 {
-    MySQLProtocol *protocol = DCB_PROTOCOL(dcb, MySQLProtocol);
     MYSQL_session *client_data = (MYSQL_session *)dcb->data;
     int auth_ret;
 
+    if (client_data->users_wait)
+    {
+        if (!service_refresh_users_done(client_data->users_wait))
+        {
+            return MYSQL_AUTH_USERS_WAIT;
+        }
+
+        service_refresh_users_finish(client_data->users_wait);
+        client_data->users_wait = NULL;
+        return mysql_auth_check_user(dcb);
+    }
+
     /**
      * We record the SSL status before and after the authentication. This allows
      * us to detect if the SSL handshake is immediately completed which means more
@@ -164,45 +258,7 @@ mysql_auth_authenticate(DCB *dcb)
 
     else
     {
-        MXS_DEBUG("Receiving connection from '%s' to database '%s'.",
-                  client_data->user, client_data->db);
-
-        auth_ret = combined_auth_check(dcb, client_data->auth_token, client_data->auth_token_len,
-                                       protocol, client_data->user, client_data->client_sha1, client_data->db);
-
-        /* On failed authentication try to load user table from backend database */
-        /* Success for service_refresh_users returns 0 */
-        if (MYSQL_AUTH_SUCCEEDED != auth_ret && 0 == service_refresh_users(dcb->service))
-        {
-            auth_ret = combined_auth_check(dcb, client_data->auth_token, client_data->auth_token_len, protocol,
-                                           client_data->user, client_data->client_sha1, client_data->db);
-        }
-
-        /* on successful authentication, set user into dcb field */
-        if (MYSQL_AUTH_SUCCEEDED == auth_ret)
-        {
-            dcb->user = strdup(client_data->user);
-        }
-        else if (dcb->service->log_auth_warnings)
-        {
-            MXS_NOTICE("%s: login attempt for user '%s'@%s:%d, authentication failed.",
-                       dcb->service->name, client_data->user, dcb->remote, ntohs(dcb->ipv4.sin_port));
-            if (dcb->ipv4.sin_addr.s_addr == 0x0100007F &&
-                !dcb->service->localhost_match_wildcard_host)
-            {
-                MXS_NOTICE("If you have a wildcard grant that covers"
-                           " this address, try adding "
-                           "'localhost_match_wildcard_host=true' for "
-                           "service '%s'. ", dcb->service->name);
-            }
-        }
-
-        /* let's free the auth_token now */
-        if (client_data->auth_token)
-        {
-            free(client_data->auth_token);
-            client_data->auth_token = NULL;
-        }
+        auth_ret = mysql_auth_check_user(dcb);
     }
 
     return auth_ret;
@@ -410,6 +466,90 @@ mysql_auth_is_client_ssl_capable(DCB *dcb)
     return (protocol->client_capabilities & (int)GW_MYSQL_CAPABILITIES_SSL) ? true : false;
 }
 
+/**
+ * Find the cache slot of a login
+ *
+ * @param service The service
+ * @param user    The user name
+ * @param addr    The client's IPv4 address
+ * @param db      The default database
+ * @return The slot where the login is or would be cached
+ */
+static AUTH_CACHE_ENTRY *
+auth_cache_slot(SERVICE *service, const char *user, uint32_t addr, const char *db)
+{
+    uint32_t hash = (uint32_t)(uintptr_t)service ^ addr;
+
+    for (const char *p = user; *p; p++)
+    {
+        hash = hash * 31 + (unsigned char)*p;
+    }
+    for (const char *p = db; *p; p++)
+    {
+        hash = hash * 31 + (unsigned char)*p;
+    }
+
+    return &auth_cache[hash % AUTH_CACHE_SIZE];
+}
+
+/**
+ * Look up a login in the cache of this thread
+ *
+ * @param service   The service
+ * @param user      The user name
+ * @param addr      The client's IPv4 address
+ * @param db        The default database
+ * @param password  Where the SHA1(SHA1(password)) is copied on a hit
+ * @return True if the login was found
+ */
+static bool
+auth_cache_find(SERVICE *service, const char *user, uint32_t addr, const char *db,
+                uint8_t *password)
+{
+    AUTH_CACHE_ENTRY *entry = auth_cache_slot(service, user, addr, db);
+
+    if (entry->service == service &&
+        entry->generation == service->users_generation &&
+        entry->addr == addr &&
+        strcmp(entry->user, user) == 0 &&
+        strcmp(entry->db, db) == 0)
+    {
+        memcpy(password, entry->password, SHA_DIGEST_LENGTH);
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * Store a resolved login in the cache of this thread
+ *
+ * @param service    The service
+ * @param generation The users_generation of the service when the user was found
+ * @param user       The user name
+ * @param addr       The client's IPv4 address
+ * @param db         The default database
+ * @param password   The SHA1(SHA1(password)) of the matching user entry
+ */
+static void
+auth_cache_add(SERVICE *service, int generation, const char *user, uint32_t addr,
+               const char *db, const uint8_t *password)
+{
+    if (strlen(user) > MYSQL_USER_MAXLEN || strlen(db) > MYSQL_DATABASE_MAXLEN)
+    {
+        return;
+    }
+
+    AUTH_CACHE_ENTRY *entry = auth_cache_slot(service, user, addr, db);
+
+    entry->service = service;
+    entry->generation = generation;
+    entry->addr = addr;
+    strcpy(entry->user, user);
+    strcpy(entry->db, db);
+    memcpy(entry->password, password, SHA_DIGEST_LENGTH);
+}
+
 /**
  * gw_find_mysql_user_password_sha1
  *
@@ -438,6 +578,20 @@ int gw_find_mysql_user_password_sha1(char *username, uint8_t *gateway_password,
     service = (SERVICE *) dcb->service;
     client = (struct sockaddr_in *) &dcb->ipv4;
 
+    /**
+     * A repeated login of the same user from the same address to the same
+     * database resolves to the same user entry until the users are reloaded.
+     * The generation is read before the lookup so that a reload that happens
+     * during it makes the cached result stale instead of hiding the reload.
+     */
+    int generation = service->users_generation;
+    const char *db = client_data->db;
+
+    if (auth_cache_find(service, username, client->sin_addr.s_addr, db, gateway_password))
+    {
+        return 0;
+    }
+
     key.user = username;
     memcpy(&key.ipv4, client, sizeof(struct sockaddr_in));
     key.netmask = 32;
@@ -566,6 +720,7 @@ int gw_find_mysql_user_password_sha1(char *username, uint8_t *gateway_password,
             gw_hex2bin(gateway_password, user_password, passwd_len);
         }
 
+        auth_cache_add(service, generation, username, client->sin_addr.s_addr, db, gateway_password);
         return 0;
     }
     else
@@ -811,5 +966,13 @@ static int combined_auth_check(
 static void
 mysql_auth_free_client_data(DCB *dcb)
 {
+    MYSQL_session *client_data = (MYSQL_session *)dcb->data;
+
+    /** A login that waited for the users may still hold its token */
+    if (client_data->users_wait)
+    {
+        service_refresh_users_cancel(client_data->users_wait);
+    }
+    free(client_data->auth_token);
     free(dcb->data);
 }
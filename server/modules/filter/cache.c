@@ -0,0 +1,1430 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file cache.c - A query result cache
+ * @verbatim
+ *
+ * The cache filter stores the result sets of SELECT statements and returns
+ * them to clients that send the same statement again, without routing the
+ * statement to a server.
+ *
+ * A statement is cached only if its result can't depend on anything but the
+ * contents of the tables it reads. Statements that use user or system
+ * variables, non-deterministic functions, locking reads or that are executed
+ * inside a transaction are never cached. The cache key consists of the user,
+ * the default database and the SQL text.
+ *
+ * The cache is split into shards, each of which has its own lock and LRU list.
+ * A cached result is discarded when it is older than the configured time to
+ * live, when it is evicted to make room for newer results or when a table it
+ * reads is modified through this filter.
+ *
+ * Date         Who             Description
+ * 14/10/2016   MaxScale        Initial implementation
+ *
+ * @endverbatim
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <filter.h>
+#include <modinfo.h>
+#include <modutil.h>
+#include <log_manager.h>
+#include <spinlock.h>
+#include <hashtable.h>
+#include <statistics.h>
+#include <query_classifier.h>
+#include <mysql_client_server_protocol.h>
+#include <hk_heartbeat.h>
+
+MODULE_INFO info =
+{
+    MODULE_API_FILTER,
+    MODULE_EXPERIMENTAL,
+    FILTER_VERSION,
+    "A query result cache"
+};
+
+static char *version_str = "V1.0.0";
+
+/** Number of independently locked parts of the cache */
+#define CACHE_N_SHARDS 16
+
+/** Number of hash chains in each shard */
+#define CACHE_SHARD_BUCKETS 1024
+
+/** Default time to live of a cached result in seconds */
+#define CACHE_DEFAULT_TTL 10
+
+/** Default maximum size of the cache in bytes */
+#define CACHE_DEFAULT_MAX_SIZE (64 * 1024 * 1024)
+
+/** Default maximum size of a single cached result in bytes */
+#define CACHE_DEFAULT_MAX_RESULTSET_SIZE (1024 * 1024)
+
+/** Maximum length of the session state in a key, the session isn't cached beyond it */
+#define CACHE_MAX_STATE_LEN 4096
+
+/*
+ * The filter entry points
+ */
+static FILTER *createInstance(char **options, FILTER_PARAMETER **);
+static void *newSession(FILTER *instance, SESSION *session);
+static void closeSession(FILTER *instance, void *session);
+static void freeSession(FILTER *instance, void *session);
+static void setDownstream(FILTER *instance, void *fsession, DOWNSTREAM *downstream);
+static void setUpstream(FILTER *instance, void *fsession, UPSTREAM *upstream);
+static int routeQuery(FILTER *instance, void *fsession, GWBUF *queue);
+static int clientReply(FILTER *instance, void *fsession, GWBUF *queue);
+static void diagnostic(FILTER *instance, void *fsession, DCB *dcb);
+
+
+static FILTER_OBJECT MyObject =
+{
+    createInstance,
+    newSession,
+    closeSession,
+    freeSession,
+    setDownstream,
+    setUpstream,
+    routeQuery,
+    clientReply,
+    diagnostic,
+};
+
+/**
+ * A cached result set
+ */
+typedef struct cache_entry
+{
+    struct cache_entry *hnext;      /*< The next entry in the hash chain */
+    struct cache_entry *prev;       /*< The more recently used entry */
+    struct cache_entry *next;       /*< The less recently used entry */
+    uint32_t           hash;        /*< Hash of the key */
+    char               *key;        /*< The key */
+    size_t             keylen;      /*< Length of the key */
+    GWBUF              *result;     /*< The result set, a contiguous buffer */
+    size_t             size;        /*< Memory used by the entry */
+    long               expires;     /*< Heartbeat at which the entry expires */
+    uint64_t           seq;         /*< Invalidation sequence when the query was sent */
+    char               **tables;    /*< The tables the query reads */
+    int                n_tables;    /*< Number of tables */
+} CACHE_ENTRY;
+
+/**
+ * A part of the cache with a lock of its own
+ */
+typedef struct
+{
+    SPINLOCK    lock;                           /*< Protects the shard */
+    CACHE_ENTRY *buckets[CACHE_SHARD_BUCKETS];  /*< The hash chains */
+    CACHE_ENTRY *head;                          /*< The most recently used entry */
+    CACHE_ENTRY *tail;                          /*< The least recently used entry */
+    size_t      size;                           /*< Memory used by the entries */
+    int         n_entries;                      /*< Number of entries */
+} CACHE_SHARD;
+
+/**
+ * The filter instance
+ */
+typedef struct
+{
+    long        ttl;                /*< Time to live of a result in heartbeats */
+    size_t      max_size;           /*< Maximum size of each shard */
+    size_t      max_resultset_size; /*< Maximum size of a single result */
+    CACHE_SHARD shards[CACHE_N_SHARDS]; /*< The cached results */
+    SPINLOCK    tables_lock;        /*< Protects seq, all_seq and tables */
+    uint64_t    seq;                /*< Incremented by each invalidation */
+    uint64_t    all_seq;            /*< Sequence of the last invalidation of everything */
+    HASHTABLE   *tables;            /*< Sequence of the last invalidation by table */
+    ts_stats_t  n_hits;             /*< Queries answered from the cache */
+    ts_stats_t  n_misses;           /*< Cacheable queries that were routed */
+    ts_stats_t  n_stores;           /*< Results that were stored */
+    ts_stats_t  n_evictions;        /*< Results evicted to make room */
+    ts_stats_t  n_invalidations;    /*< Tables invalidated by writes */
+} CACHE_INSTANCE;
+
+/**
+ * The session structure for the cache filter
+ */
+typedef struct
+{
+    DOWNSTREAM  down;
+    UPSTREAM    up;
+    char        *user;          /*< The user of the session */
+    char        db[MYSQL_DATABASE_MAXLEN + 1]; /*< The current default database */
+    bool        autocommit;     /*< Whether autocommit is enabled */
+    bool        in_trx;         /*< Whether a transaction is active */
+    char        *state;         /*< The statements that changed the session state, in order */
+    size_t      state_len;      /*< Length of the state including the terminating nul */
+    size_t      last_state;     /*< Offset of the last statement in the state */
+    bool        no_cache;       /*< The state is too long, nothing is cached */
+    char        *key;           /*< Key of the result being captured, NULL if none */
+    size_t      keylen;         /*< Length of the key */
+    uint32_t    hash;           /*< Hash of the key */
+    uint64_t    seq;            /*< Invalidation sequence when the query was sent */
+    char        **tables;       /*< The tables the captured query reads */
+    int         n_tables;       /*< Number of tables */
+    GWBUF       *reply;         /*< The reply captured so far */
+    size_t      offset;         /*< Offset of the first packet not yet inspected */
+    int         n_packets;      /*< Number of packets inspected */
+    int         n_eof;          /*< Number of EOF packets seen */
+    char        **written;      /*< Tables written and not yet invalidated after the reply */
+    int         n_written;      /*< Number of written tables */
+    bool        write_all;      /*< A write whose tables are not known was sent */
+    char        **ps_tables;    /*< Tables written by the prepared statements */
+    int         n_ps_tables;    /*< Number of tables */
+    bool        ps_write_all;   /*< A prepared statement writes tables that are not known */
+} CACHE_SESSION;
+
+/**
+ * Functions whose result depends on something else than the tables read
+ */
+static const char *nondeterministic_functions[] =
+{
+    "benchmark", "connection_id", "curdate", "current_date", "current_time",
+    "current_timestamp", "current_user", "curtime", "database", "found_rows",
+    "get_lock", "is_free_lock", "is_used_lock", "last_insert_id", "load_file",
+    "localtime", "localtimestamp", "master_gtid_wait", "master_pos_wait",
+    "now", "rand", "release_lock", "row_count", "schema", "session_user",
+    "sleep", "sysdate", "system_user", "unix_timestamp", "user", "utc_date",
+    "utc_time", "utc_timestamp", "uuid", "uuid_short", "version", NULL
+};
+
+/**
+ * Implementation of the mandatory version entry point
+ *
+ * @return version string of the module
+ */
+char *
+version()
+{
+    return version_str;
+}
+
+/**
+ * The module initialisation routine, called when the module
+ * is first loaded.
+ * @see function load_module in load_utils.c for explanation of lint
+ */
+/*lint -e14 */
+void
+ModuleInit()
+{
+}
+/*lint +e14 */
+
+/**
+ * The module entry point routine. It is this routine that
+ * must populate the structure that is referred to as the
+ * "module object", this is a structure with the set of
+ * external entry points for this module.
+ *
+ * @return The module object
+ */
+FILTER_OBJECT *
+GetModuleObject()
+{
+    return &MyObject;
+}
+
+/**
+ * Hash a block of memory with FNV-1a
+ *
+ * @param data The data
+ * @param len  Length of the data
+ * @return The hash
+ */
+static uint32_t
+cache_hash(const char *data, size_t len)
+{
+    uint32_t hash = 2166136261U;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= (uint8_t)data[i];
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+static int
+cache_strhash(void *key)
+{
+    return (int)cache_hash((char *)key, strlen((char *)key));
+}
+
+static int
+cache_strcmp(void *v1, void *v2)
+{
+    return strcmp((char *)v1, (char *)v2);
+}
+
+static void *
+cache_strdup(void *str)
+{
+    return strdup((char *)str);
+}
+
+static void *
+cache_strfree(void *str)
+{
+    free(str);
+    return NULL;
+}
+
+/**
+ * Free an array of strings
+ *
+ * @param strs The array
+ * @param n    Number of strings
+ */
+static void
+free_strings(char **strs, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        free(strs[i]);
+    }
+    free(strs);
+}
+
+/**
+ * Copy an array of strings
+ *
+ * @param strs The array
+ * @param n    Number of strings, set to the number copied
+ * @return The copy or NULL if memory allocation failed
+ */
+static char **
+copy_strings(char **strs, int *n)
+{
+    char **copy = malloc(sizeof(char *) * (*n > 0 ? *n : 1));
+    int n_copied = 0;
+
+    for (int i = 0; copy && i < *n; i++)
+    {
+        if ((copy[n_copied] = strdup(strs[i])))
+        {
+            n_copied++;
+        }
+    }
+
+    *n = n_copied;
+    return copy;
+}
+
+/**
+ * Create an instance of the filter for a particular service
+ * within MaxScale.
+ *
+ * @param options   The options for this filter
+ * @param params    The array of name/value pair parameters for the filter
+ *
+ * @return The instance data for this new instance
+ */
+static FILTER *
+createInstance(char **options, FILTER_PARAMETER **params)
+{
+    CACHE_INSTANCE *my_instance;
+
+    if ((my_instance = calloc(1, sizeof(CACHE_INSTANCE))) != NULL)
+    {
+        bool error = false;
+        long ttl = CACHE_DEFAULT_TTL;
+        long max_size = CACHE_DEFAULT_MAX_SIZE;
+        long max_resultset_size = CACHE_DEFAULT_MAX_RESULTSET_SIZE;
+
+        for (int i = 0; params && params[i]; i++)
+        {
+            if (!strcmp(params[i]->name, "ttl"))
+            {
+                ttl = atol(params[i]->value);
+            }
+            else if (!strcmp(params[i]->name, "max_size"))
+            {
+                max_size = atol(params[i]->value);
+            }
+            else if (!strcmp(params[i]->name, "max_resultset_size"))
+            {
+                max_resultset_size = atol(params[i]->value);
+            }
+            else if (!filter_standard_parameter(params[i]->name))
+            {
+                MXS_ERROR("cache: Unexpected parameter '%s'.", params[i]->name);
+                error = true;
+            }
+        }
+
+        for (int i = 0; options && options[i]; i++)
+        {
+            MXS_ERROR("cache: Unsupported option '%s'.", options[i]);
+            error = true;
+        }
+
+        if (ttl <= 0 || max_size <= 0 || max_resultset_size <= 0)
+        {
+            MXS_ERROR("cache: The values of 'ttl', 'max_size' and "
+                      "'max_resultset_size' must be positive.");
+            error = true;
+        }
+
+        my_instance->ttl = ttl * 10;
+        my_instance->max_size = max_size / CACHE_N_SHARDS;
+        my_instance->max_resultset_size = max_resultset_size;
+
+        for (int i = 0; i < CACHE_N_SHARDS; i++)
+        {
+            spinlock_init(&my_instance->shards[i].lock);
+        }
+
+        spinlock_init(&my_instance->tables_lock);
+        my_instance->tables = hashtable_alloc(1000, cache_strhash, cache_strcmp);
+        my_instance->n_hits = ts_stats_alloc();
+        my_instance->n_misses = ts_stats_alloc();
+        my_instance->n_stores = ts_stats_alloc();
+        my_instance->n_evictions = ts_stats_alloc();
+        my_instance->n_invalidations = ts_stats_alloc();
+
+        if (my_instance->tables == NULL || my_instance->n_hits == NULL ||
+            my_instance->n_misses == NULL || my_instance->n_stores == NULL ||
+            my_instance->n_evictions == NULL || my_instance->n_invalidations == NULL)
+        {
+            MXS_ERROR("cache: Memory allocation failed.");
+            error = true;
+        }
+        else
+        {
+            hashtable_memory_fns(my_instance->tables, cache_strdup, NULL, cache_strfree, NULL);
+        }
+
+        if (error)
+        {
+            hashtable_free(my_instance->tables);
+            ts_stats_free(my_instance->n_hits);
+            ts_stats_free(my_instance->n_misses);
+            ts_stats_free(my_instance->n_stores);
+            ts_stats_free(my_instance->n_evictions);
+            ts_stats_free(my_instance->n_invalidations);
+            free(my_instance);
+            my_instance = NULL;
+        }
+    }
+
+    return (FILTER *) my_instance;
+}
+
+/**
+ * Associate a new session with this instance of the filter.
+ *
+ * @param instance  The filter instance data
+ * @param session   The session itself
+ * @return Session specific data for this session
+ */
+static void *
+newSession(FILTER *instance, SESSION *session)
+{
+    CACHE_SESSION *my_session;
+    char *user, *remote;
+
+    if ((my_session = calloc(1, sizeof(CACHE_SESSION))) != NULL)
+    {
+        MYSQL_session *data = (MYSQL_session *)session->client_dcb->data;
+
+        user = session_getUser(session);
+        remote = session_get_remote(session);
+
+        /** Users may have different privileges, each has its own results */
+        if ((my_session->user = malloc(strlen(user ? user : "") +
+                                       strlen(remote ? remote : "") + 2)) == NULL)
+        {
+            free(my_session);
+            return NULL;
+        }
+        sprintf(my_session->user, "%s@%s", user ? user : "", remote ? remote : "");
+
+        if (data)
+        {
+            strncpy(my_session->db, data->db, MYSQL_DATABASE_MAXLEN);
+        }
+        my_session->autocommit = true;
+    }
+
+    return my_session;
+}
+
+/**
+ * Close a session with the filter, this is the mechanism
+ * by which a filter may cleanup data structure etc.
+ *
+ * @param instance  The filter instance data
+ * @param session   The session being closed
+ */
+static void
+closeSession(FILTER *instance, void *session)
+{
+}
+
+/**
+ * Stop capturing the reply of the current query
+ *
+ * @param my_session The filter session
+ */
+static void
+reset_capture(CACHE_SESSION *my_session)
+{
+    free(my_session->key);
+    free_strings(my_session->tables, my_session->n_tables);
+    gwbuf_free(my_session->reply);
+    my_session->key = NULL;
+    my_session->tables = NULL;
+    my_session->n_tables = 0;
+    my_session->reply = NULL;
+    my_session->offset = 0;
+    my_session->n_packets = 0;
+    my_session->n_eof = 0;
+}
+
+/**
+ * Free the memory associated with the session
+ *
+ * @param instance  The filter instance
+ * @param session   The filter session
+ */
+static void
+freeSession(FILTER *instance, void *session)
+{
+    CACHE_SESSION *my_session = (CACHE_SESSION *) session;
+
+    reset_capture(my_session);
+    free_strings(my_session->written, my_session->n_written);
+    free_strings(my_session->ps_tables, my_session->n_ps_tables);
+    free(my_session->user);
+    free(my_session->state);
+    free(session);
+}
+
+/**
+ * Set the downstream filter or router to which queries will be
+ * passed from this filter.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param downstream    The downstream filter or router.
+ */
+static void
+setDownstream(FILTER *instance, void *session, DOWNSTREAM *downstream)
+{
+    CACHE_SESSION *my_session = (CACHE_SESSION *) session;
+
+    my_session->down = *downstream;
+}
+
+/**
+ * Set the upstream filter or session to which results will be
+ * passed from this filter.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param upstream  The upstream filter or session.
+ */
+static void
+setUpstream(FILTER *instance, void *session, UPSTREAM *upstream)
+{
+    CACHE_SESSION *my_session = (CACHE_SESSION *) session;
+
+    my_session->up = *upstream;
+}
+
+/**
+ * Unlink an entry from the LRU list of its shard
+ */
+static void
+lru_unlink(CACHE_SHARD *shard, CACHE_ENTRY *entry)
+{
+    if (entry->prev)
+    {
+        entry->prev->next = entry->next;
+    }
+    else
+    {
+        shard->head = entry->next;
+    }
+
+    if (entry->next)
+    {
+        entry->next->prev = entry->prev;
+    }
+    else
+    {
+        shard->tail = entry->prev;
+    }
+
+    entry->prev = entry->next = NULL;
+}
+
+/**
+ * Link an entry as the most recently used one of its shard
+ */
+static void
+lru_push(CACHE_SHARD *shard, CACHE_ENTRY *entry)
+{
+    entry->prev = NULL;
+    entry->next = shard->head;
+
+    if (shard->head)
+    {
+        shard->head->prev = entry;
+    }
+    else
+    {
+        shard->tail = entry;
+    }
+    shard->head = entry;
+}
+
+/**
+ * Remove an entry from its shard and free it. The shard must be locked.
+ *
+ * @param shard The shard
+ * @param entry The entry to remove
+ */
+static void
+entry_remove(CACHE_SHARD *shard, CACHE_ENTRY *entry)
+{
+    CACHE_ENTRY **ptr = &shard->buckets[entry->hash % CACHE_SHARD_BUCKETS];
+
+    while (*ptr != entry)
+    {
+        ptr = &(*ptr)->hnext;
+    }
+    *ptr = entry->hnext;
+
+    lru_unlink(shard, entry);
+    shard->size -= entry->size;
+    shard->n_entries--;
+
+    gwbuf_free(entry->result);
+    free_strings(entry->tables, entry->n_tables);
+    free(entry->key);
+    free(entry);
+}
+
+/**
+ * Find an entry from a shard. The shard must be locked.
+ */
+static CACHE_ENTRY *
+entry_find(CACHE_SHARD *shard, const char *key, size_t keylen, uint32_t hash)
+{
+    CACHE_ENTRY *entry = shard->buckets[hash % CACHE_SHARD_BUCKETS];
+
+    while (entry && (entry->hash != hash || entry->keylen != keylen ||
+                     memcmp(entry->key, key, keylen) != 0))
+    {
+        entry = entry->hnext;
+    }
+
+    return entry;
+}
+
+/**
+ * Get the shard a key belongs to
+ */
+static CACHE_SHARD *
+get_shard(CACHE_INSTANCE *my_instance, uint32_t hash)
+{
+    /** The low bits select the hash chain */
+    return &my_instance->shards[(hash >> 16) % CACHE_N_SHARDS];
+}
+
+/**
+ * Check whether the tables an entry reads have been modified after the query
+ * of the entry was sent
+ *
+ * @param my_instance The filter instance
+ * @param entry       The entry
+ * @return True if the entry is still valid
+ */
+static bool
+entry_is_valid(CACHE_INSTANCE *my_instance, CACHE_ENTRY *entry)
+{
+    bool valid;
+
+    spinlock_acquire(&my_instance->tables_lock);
+    valid = my_instance->all_seq <= entry->seq;
+
+    for (int i = 0; valid && i < entry->n_tables; i++)
+    {
+        void *seq = hashtable_fetch(my_instance->tables, entry->tables[i]);
+        valid = (uint64_t)(uintptr_t)seq <= entry->seq;
+    }
+    spinlock_release(&my_instance->tables_lock);
+
+    return valid;
+}
+
+/**
+ * Find a valid cached result
+ *
+ * @param my_instance The filter instance
+ * @param key         The key
+ * @param keylen      Length of the key
+ * @param hash        Hash of the key
+ * @return A clone of the result or NULL if there is no valid result
+ */
+static GWBUF *
+cache_get(CACHE_INSTANCE *my_instance, const char *key, size_t keylen, uint32_t hash)
+{
+    CACHE_SHARD *shard = get_shard(my_instance, hash);
+    GWBUF *result = NULL;
+
+    spinlock_acquire(&shard->lock);
+    CACHE_ENTRY *entry = entry_find(shard, key, keylen, hash);
+
+    if (entry)
+    {
+        if (entry->expires < hkheartbeat || !entry_is_valid(my_instance, entry))
+        {
+            entry_remove(shard, entry);
+        }
+        else
+        {
+            lru_unlink(shard, entry);
+            lru_push(shard, entry);
+            result = gwbuf_clone(entry->result);
+        }
+    }
+    spinlock_release(&shard->lock);
+
+    return result;
+}
+
+/**
+ * Store the captured result of a session. The key, the tables and the result
+ * are moved to the cache.
+ *
+ * @param my_instance The filter instance
+ * @param my_session  The filter session
+ */
+static void
+cache_put(CACHE_INSTANCE *my_instance, CACHE_SESSION *my_session)
+{
+    CACHE_ENTRY *entry = calloc(1, sizeof(CACHE_ENTRY));
+    GWBUF *result = gwbuf_make_contiguous(my_session->reply);
+
+    my_session->reply = NULL;
+
+    if (entry == NULL || result == NULL)
+    {
+        free(entry);
+        gwbuf_free(result);
+        return;
+    }
+
+    entry->hash = my_session->hash;
+    entry->key = my_session->key;
+    entry->keylen = my_session->keylen;
+    entry->result = result;
+    entry->seq = my_session->seq;
+    entry->tables = my_session->tables;
+    entry->n_tables = my_session->n_tables;
+    entry->expires = hkheartbeat + my_instance->ttl;
+    entry->size = sizeof(CACHE_ENTRY) + entry->keylen + GWBUF_LENGTH(result);
+
+    for (int i = 0; i < entry->n_tables; i++)
+    {
+        entry->size += strlen(entry->tables[i]) + 1 + sizeof(char *);
+    }
+
+    my_session->key = NULL;
+    my_session->tables = NULL;
+    my_session->n_tables = 0;
+
+    CACHE_SHARD *shard = get_shard(my_instance, entry->hash);
+    CACHE_ENTRY *old;
+    int n_evicted = 0;
+
+    spinlock_acquire(&shard->lock);
+
+    if ((old = entry_find(shard, entry->key, entry->keylen, entry->hash)))
+    {
+        entry_remove(shard, old);
+    }
+
+    while (shard->tail && shard->size + entry->size > my_instance->max_size)
+    {
+        entry_remove(shard, shard->tail);
+        n_evicted++;
+    }
+
+    if (entry->size <= my_instance->max_size)
+    {
+        CACHE_ENTRY **bucket = &shard->buckets[entry->hash % CACHE_SHARD_BUCKETS];
+
+        entry->hnext = *bucket;
+        *bucket = entry;
+        lru_push(shard, entry);
+        shard->size += entry->size;
+        shard->n_entries++;
+        entry = NULL;
+    }
+    spinlock_release(&shard->lock);
+
+    if (entry)
+    {
+        gwbuf_free(entry->result);
+        free_strings(entry->tables, entry->n_tables);
+        free(entry->key);
+        free(entry);
+    }
+    else
+    {
+        ts_stats_add(my_instance->n_stores, 1);
+    }
+    ts_stats_add(my_instance->n_evictions, n_evicted);
+}
+
+/**
+ * Get the current invalidation sequence
+ */
+static uint64_t
+current_seq(CACHE_INSTANCE *my_instance)
+{
+    uint64_t seq;
+
+    spinlock_acquire(&my_instance->tables_lock);
+    seq = my_instance->seq;
+    spinlock_release(&my_instance->tables_lock);
+
+    return seq;
+}
+
+/**
+ * Invalidate the cached results that read some tables
+ *
+ * @param my_instance The filter instance
+ * @param tables      The tables, fully qualified
+ * @param n_tables    Number of tables
+ * @param all         Invalidate all results
+ */
+static void
+invalidate(CACHE_INSTANCE *my_instance, char **tables, int n_tables, bool all)
+{
+    spinlock_acquire(&my_instance->tables_lock);
+    uint64_t seq = ++my_instance->seq;
+
+    if (all)
+    {
+        my_instance->all_seq = seq;
+    }
+
+    for (int i = 0; i < n_tables; i++)
+    {
+        hashtable_delete(my_instance->tables, tables[i]);
+        hashtable_add(my_instance->tables, tables[i], (void *)(uintptr_t)seq);
+    }
+    spinlock_release(&my_instance->tables_lock);
+
+    ts_stats_add(my_instance->n_invalidations, all ? 1 : n_tables);
+}
+
+/**
+ * Add tables to a set of tables
+ *
+ * @param set    The set
+ * @param n_set  Number of tables in the set
+ * @param tables Tables to add, the strings are moved to the set
+ * @param n      Number of tables to add
+ */
+static void
+add_tables(char ***set, int *n_set, char **tables, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        bool found = false;
+
+        for (int j = 0; j < *n_set && !found; j++)
+        {
+            found = strcmp((*set)[j], tables[i]) == 0;
+        }
+
+        char **tmp;
+
+        if (found || (tmp = realloc(*set, sizeof(char *) * (*n_set + 1))) == NULL)
+        {
+            free(tables[i]);
+        }
+        else
+        {
+            tmp[(*n_set)++] = tables[i];
+            *set = tmp;
+        }
+    }
+    free(tables);
+}
+
+/**
+ * Get the fully qualified names of the tables a query uses
+ *
+ * @param my_session The filter session
+ * @param queue      The query
+ * @param n_tables   Number of tables is stored here
+ * @return The table names or NULL if there are none
+ */
+static char **
+get_tables(CACHE_SESSION *my_session, GWBUF *queue, int *n_tables)
+{
+    char **tables = qc_get_table_names(queue, n_tables, true);
+
+    for (int i = 0; tables && i < *n_tables; i++)
+    {
+        char *name;
+
+        if (strchr(tables[i], '.') == NULL &&
+            (name = malloc(strlen(my_session->db) + strlen(tables[i]) + 2)))
+        {
+            sprintf(name, "%s.%s", my_session->db, tables[i]);
+            free(tables[i]);
+            tables[i] = name;
+        }
+    }
+
+    if (tables == NULL)
+    {
+        *n_tables = 0;
+    }
+
+    return tables;
+}
+
+/**
+ * Check whether the text of a SELECT can produce a result that depends on
+ * something else than the tables it reads. String literals and quoted
+ * identifiers are skipped.
+ *
+ * @param sql The SQL text
+ * @return True if the result may be cached
+ */
+static bool
+is_deterministic_sql(const char *sql)
+{
+    const char *ptr = sql;
+    char prev[16] = "";
+
+    while (*ptr)
+    {
+        if (*ptr == '\'' || *ptr == '"' || *ptr == '`')
+        {
+            char quote = *ptr++;
+
+            while (*ptr && *ptr != quote)
+            {
+                if (*ptr == '\\' && quote != '`' && ptr[1])
+                {
+                    ptr++;
+                }
+                ptr++;
+            }
+            if (*ptr)
+            {
+                ptr++;
+            }
+        }
+        else if (*ptr == '@' || *ptr == '?')
+        {
+            /** User and system variables and placeholders */
+            return false;
+        }
+        else if (isalpha(*ptr) || *ptr == '_')
+        {
+            char word[32];
+            size_t len = 0;
+
+            while (isalnum(*ptr) || *ptr == '_' || *ptr == '$')
+            {
+                if (len < sizeof(word) - 1)
+                {
+                    word[len++] = tolower(*ptr);
+                }
+                ptr++;
+            }
+            word[len] = '\0';
+
+            if (strcmp(word, "into") == 0 || strcmp(word, "sql_no_cache") == 0 ||
+                (strcmp(prev, "for") == 0 && strcmp(word, "update") == 0) ||
+                (strcmp(prev, "lock") == 0 && strcmp(word, "in") == 0))
+            {
+                return false;
+            }
+
+            for (int i = 0; nondeterministic_functions[i]; i++)
+            {
+                if (strcmp(word, nondeterministic_functions[i]) == 0)
+                {
+                    return false;
+                }
+            }
+
+            strncpy(prev, word, sizeof(prev) - 1);
+        }
+        else
+        {
+            ptr++;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Check whether a query starts with SELECT
+ */
+static bool
+is_select(const char *sql, int len)
+{
+    while (len > 0 && isspace(*sql))
+    {
+        sql++;
+        len--;
+    }
+
+    return len > 6 && strncasecmp(sql, "select", 6) == 0 && !isalnum(sql[6]);
+}
+
+/**
+ * Build the cache key of a query
+ *
+ * @param my_session The filter session
+ * @param sql        The SQL text
+ * @param len        Length of the SQL text
+ * @param keylen     Length of the key is stored here
+ * @return The key or NULL if memory allocation failed
+ */
+static char *
+build_key(CACHE_SESSION *my_session, const char *sql, int len, size_t *keylen)
+{
+    size_t ulen = strlen(my_session->user) + 1;
+    size_t dblen = strlen(my_session->db) + 1;
+    size_t slen = my_session->state_len + 2;
+    char *key = malloc(ulen + dblen + slen + len);
+
+    if (key)
+    {
+        memcpy(key, my_session->user, ulen);
+        memcpy(key + ulen, my_session->db, dblen);
+        /** The state is prefixed with its length so that it can't run into the SQL */
+        gw_mysql_set_byte2((uint8_t *)key + ulen + dblen, my_session->state_len);
+        memcpy(key + ulen + dblen + 2, my_session->state, my_session->state_len);
+        memcpy(key + ulen + dblen + slen, sql, len);
+        *keylen = ulen + dblen + slen + len;
+    }
+
+    return key;
+}
+
+/**
+ * Record a statement that changes the state of the session
+ *
+ * Statements such as SET NAMES, SET time_zone and SET sql_mode change the
+ * results of the same SELECT. The statements are kept in the order they were
+ * sent and they are a part of the key, so that only sessions that have done
+ * the same changes share results. A statement that repeats the previous one
+ * is not recorded again. If the state grows too long, the session isn't
+ * cached anymore.
+ *
+ * @param my_session The filter session
+ * @param sql        The SQL text
+ * @param len        Length of the SQL text
+ */
+static void
+record_state(CACHE_SESSION *my_session, const char *sql, int len)
+{
+    if (my_session->no_cache)
+    {
+        return;
+    }
+
+    if (my_session->state &&
+        strlen(my_session->state + my_session->last_state) == (size_t)len &&
+        memcmp(my_session->state + my_session->last_state, sql, len) == 0)
+    {
+        return;
+    }
+
+    size_t state_len = my_session->state_len + len + 1;
+    char *state;
+
+    if (state_len > CACHE_MAX_STATE_LEN || memchr(sql, '\0', len) ||
+        (state = realloc(my_session->state, state_len)) == NULL)
+    {
+        free(my_session->state);
+        my_session->state = NULL;
+        my_session->state_len = 0;
+        my_session->no_cache = true;
+        return;
+    }
+
+    memcpy(state + my_session->state_len, sql, len);
+    state[state_len - 1] = '\0';
+    my_session->last_state = my_session->state_len;
+    my_session->state = state;
+    my_session->state_len = state_len;
+}
+
+/**
+ * Track the transaction state, the default database and the state of the session and
+ * invalidate the tables that a query writes
+ *
+ * @param my_instance The filter instance
+ * @param my_session  The filter session
+ * @param queue       The query
+ * @param type        Type of the query
+ */
+static void
+track_query(CACHE_INSTANCE *my_instance, CACHE_SESSION *my_session, GWBUF *queue, uint32_t type)
+{
+    qc_query_op_t op = qc_get_operation(queue);
+
+    if (QUERY_IS_TYPE(type, QUERY_TYPE_BEGIN_TRX))
+    {
+        my_session->in_trx = true;
+    }
+    else if (QUERY_IS_TYPE(type, QUERY_TYPE_DISABLE_AUTOCOMMIT))
+    {
+        my_session->autocommit = false;
+        my_session->in_trx = true;
+    }
+    else if (QUERY_IS_TYPE(type, QUERY_TYPE_ENABLE_AUTOCOMMIT))
+    {
+        my_session->autocommit = true;
+        my_session->in_trx = false;
+    }
+    else if ((QUERY_IS_TYPE(type, QUERY_TYPE_COMMIT) ||
+              QUERY_IS_TYPE(type, QUERY_TYPE_ROLLBACK)) && my_session->autocommit)
+    {
+        my_session->in_trx = false;
+    }
+    else if ((QUERY_IS_TYPE(type, QUERY_TYPE_SESSION_WRITE) ||
+              QUERY_IS_TYPE(type, QUERY_TYPE_GSYSVAR_WRITE)) && op != QUERY_OP_CHANGE_DB)
+    {
+        /** The default database is a part of the key already */
+        char *sql;
+        int len;
+
+        if (modutil_extract_SQL(queue, &sql, &len))
+        {
+            record_state(my_session, sql, len);
+        }
+    }
+
+    if (op == QUERY_OP_CHANGE_DB)
+    {
+        char **dbs;
+        int n_dbs = 0;
+
+        if ((dbs = qc_get_database_names(queue, &n_dbs)) && n_dbs > 0)
+        {
+            strncpy(my_session->db, dbs[0], MYSQL_DATABASE_MAXLEN);
+        }
+        free_strings(dbs, n_dbs);
+    }
+    else if (QUERY_IS_TYPE(type, QUERY_TYPE_WRITE) || op == QUERY_OP_LOAD)
+    {
+        int n_tables;
+        char **tables = get_tables(my_session, queue, &n_tables);
+
+        if (n_tables == 0 || op == QUERY_OP_DROP || op == QUERY_OP_ALTER)
+        {
+            /** DROP DATABASE, RENAME and the like can affect any table */
+            my_session->write_all = true;
+        }
+
+        /** The tables are invalidated again when the write has been done */
+        invalidate(my_instance, tables, n_tables, my_session->write_all);
+        add_tables(&my_session->written, &my_session->n_written, tables, n_tables);
+    }
+}
+
+/**
+ * The routeQuery entry point. This is passed the query buffer
+ * to which the filter should be applied. Once applied the
+ * query should normally be passed to the downstream component
+ * (filter or router) in the filter chain.
+ *
+ * A SELECT whose result is in the cache is answered directly. Otherwise a
+ * cacheable SELECT has its reply captured.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param queue     The query data
+ */
+static int
+routeQuery(FILTER *instance, void *session, GWBUF *queue)
+{
+    CACHE_INSTANCE *my_instance = (CACHE_INSTANCE *) instance;
+    CACHE_SESSION *my_session = (CACHE_SESSION *) session;
+    char *sql;
+    int len;
+
+    if (my_session->key || my_session->reply)
+    {
+        /** A new query arrived before the whole reply: don't cache it */
+        reset_capture(my_session);
+    }
+
+    if (queue->next != NULL)
+    {
+        queue = gwbuf_make_contiguous(queue);
+    }
+
+    uint8_t *data = GWBUF_DATA(queue);
+
+    if (GWBUF_LENGTH(queue) > MYSQL_HEADER_LEN && data[MYSQL_HEADER_LEN] == MYSQL_COM_INIT_DB)
+    {
+        size_t dblen = GWBUF_LENGTH(queue) - MYSQL_HEADER_LEN - 1;
+
+        dblen = dblen < MYSQL_DATABASE_MAXLEN ? dblen : MYSQL_DATABASE_MAXLEN;
+        memcpy(my_session->db, data + MYSQL_HEADER_LEN + 1, dblen);
+        my_session->db[dblen] = '\0';
+    }
+    else if (GWBUF_LENGTH(queue) > MYSQL_HEADER_LEN &&
+             data[MYSQL_HEADER_LEN] == MYSQL_COM_STMT_PREPARE)
+    {
+        uint32_t type = qc_get_type(queue);
+
+        if (QUERY_IS_TYPE(type, QUERY_TYPE_WRITE))
+        {
+            /** Executions of the statement are seen only by their ID */
+            int n_tables;
+            char **tables = get_tables(my_session, queue, &n_tables);
+
+            my_session->ps_write_all |= n_tables == 0;
+            add_tables(&my_session->ps_tables, &my_session->n_ps_tables, tables, n_tables);
+        }
+    }
+    else if (GWBUF_LENGTH(queue) > MYSQL_HEADER_LEN &&
+             data[MYSQL_HEADER_LEN] == MYSQL_COM_STMT_EXECUTE)
+    {
+        if (my_session->ps_write_all || my_session->n_ps_tables > 0)
+        {
+            invalidate(my_instance, my_session->ps_tables, my_session->n_ps_tables,
+                       my_session->ps_write_all);
+            my_session->write_all |= my_session->ps_write_all;
+
+            int n_tables = my_session->n_ps_tables;
+            char **tables = copy_strings(my_session->ps_tables, &n_tables);
+
+            add_tables(&my_session->written, &my_session->n_written, tables, n_tables);
+        }
+    }
+    else if (modutil_extract_SQL(queue, &sql, &len) && modutil_is_SQL(queue))
+    {
+        GWBUF *result = NULL;
+        bool select = !my_session->in_trx && !my_session->no_cache && is_select(sql, len);
+        size_t keylen = 0;
+        char *key = select ? build_key(my_session, sql, len, &keylen) : NULL;
+        uint32_t hash = key ? cache_hash(key, keylen) : 0;
+
+        if (key && (result = cache_get(my_instance, key, keylen, hash)))
+        {
+            /** The key was classified as cacheable when the result was stored */
+            free(key);
+            gwbuf_free(queue);
+            ts_stats_add(my_instance->n_hits, 1);
+            return my_session->up.clientReply(my_session->up.instance,
+                                              my_session->up.session, result);
+        }
+
+        uint32_t type = qc_get_type(queue);
+
+        if (key && type == QUERY_TYPE_READ &&
+            qc_parse(queue, QC_COLLECT_TABLES) == QC_QUERY_PARSED &&
+            qc_get_operation(queue) == QUERY_OP_SELECT)
+        {
+            char *text = modutil_get_SQL(queue);
+
+            if (text && is_deterministic_sql(text))
+            {
+                my_session->key = key;
+                my_session->keylen = keylen;
+                my_session->hash = hash;
+                my_session->seq = current_seq(my_instance);
+                my_session->tables = get_tables(my_session, queue, &my_session->n_tables);
+                key = NULL;
+                ts_stats_add(my_instance->n_misses, 1);
+            }
+            free(text);
+        }
+        free(key);
+
+        if (my_session->key == NULL)
+        {
+            track_query(my_instance, my_session, queue, type);
+        }
+    }
+
+    /* Pass the query downstream */
+    return my_session->down.routeQuery(my_session->down.instance,
+                                       my_session->down.session, queue);
+}
+
+/**
+ * Inspect the captured reply
+ *
+ * @param my_instance The filter instance
+ * @param my_session  The filter session
+ * @return True if the reply is still being captured
+ */
+static bool
+inspect_reply(CACHE_INSTANCE *my_instance, CACHE_SESSION *my_session)
+{
+    GWBUF *reply = my_session->reply = gwbuf_make_contiguous(my_session->reply);
+
+    if (reply == NULL || GWBUF_LENGTH(reply) > my_instance->max_resultset_size)
+    {
+        return false;
+    }
+
+    uint8_t *data = GWBUF_DATA(reply);
+    size_t len = GWBUF_LENGTH(reply);
+
+    while (my_session->offset + MYSQL_HEADER_LEN < len)
+    {
+        uint8_t *packet = data + my_session->offset;
+        size_t plen = MYSQL_GET_PACKET_LEN(packet);
+        uint8_t cmd = packet[MYSQL_HEADER_LEN];
+
+        if (my_session->offset + MYSQL_HEADER_LEN + plen > len)
+        {
+            break;
+        }
+
+        if (cmd == 0xff || (my_session->n_packets == 0 && (cmd == 0x00 || cmd == 0xfb)))
+        {
+            /** Errors, OK packets and LOAD DATA requests are not cached */
+            return false;
+        }
+
+        if (cmd == 0xfe && plen < 9 && ++my_session->n_eof == 2)
+        {
+            uint16_t status = plen >= 5 ? gw_mysql_get_byte2(packet + MYSQL_HEADER_LEN + 3) : 0;
+
+            if ((status & SERVER_MORE_RESULTS_EXIST) == 0 &&
+                my_session->offset + MYSQL_HEADER_LEN + plen == len)
+            {
+                cache_put(my_instance, my_session);
+            }
+            return false;
+        }
+
+        my_session->offset += MYSQL_HEADER_LEN + plen;
+        my_session->n_packets++;
+    }
+
+    return true;
+}
+
+/**
+ * The clientReply entry point. A reply to a cacheable query is captured and
+ * stored once it is complete. Tables written by earlier queries are
+ * invalidated again when the reply to the write arrives, to make sure that
+ * no result read before the write was done remains in the cache.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param reply     The reply
+ */
+static int
+clientReply(FILTER *instance, void *session, GWBUF *reply)
+{
+    CACHE_INSTANCE *my_instance = (CACHE_INSTANCE *) instance;
+    CACHE_SESSION *my_session = (CACHE_SESSION *) session;
+
+    if (my_session->key)
+    {
+        size_t len = gwbuf_length(reply);
+        GWBUF *copy = gwbuf_alloc(len);
+
+        if (copy)
+        {
+            gwbuf_copy_data(reply, 0, len, GWBUF_DATA(copy));
+            my_session->reply = gwbuf_append(my_session->reply, copy);
+        }
+
+        if (copy == NULL || !inspect_reply(my_instance, my_session))
+        {
+            reset_capture(my_session);
+        }
+    }
+    else if (!my_session->in_trx && (my_session->n_written > 0 || my_session->write_all))
+    {
+        invalidate(my_instance, my_session->written, my_session->n_written,
+                   my_session->write_all);
+        free_strings(my_session->written, my_session->n_written);
+        my_session->written = NULL;
+        my_session->n_written = 0;
+        my_session->write_all = false;
+    }
+
+    /* Pass the result upstream */
+    return my_session->up.clientReply(my_session->up.instance,
+                                      my_session->up.session, reply);
+}
+
+/**
+ * Diagnostics routine
+ *
+ * If fsession is NULL then print diagnostics on the filter
+ * instance as a whole, otherwise print diagnostics for the
+ * particular session.
+ *
+ * @param   instance    The filter instance
+ * @param   fsession    Filter session, may be NULL
+ * @param   dcb     The DCB for diagnostic output
+ */
+static void
+diagnostic(FILTER *instance, void *fsession, DCB *dcb)
+{
+    CACHE_INSTANCE *my_instance = (CACHE_INSTANCE *) instance;
+    size_t size = 0;
+    int n_entries = 0;
+
+    for (int i = 0; i < CACHE_N_SHARDS; i++)
+    {
+        spinlock_acquire(&my_instance->shards[i].lock);
+        size += my_instance->shards[i].size;
+        n_entries += my_instance->shards[i].n_entries;
+        spinlock_release(&my_instance->shards[i].lock);
+    }
+
+    dcb_printf(dcb, "\t\tTime to live                   %ld seconds\n",
+               my_instance->ttl / 10);
+    dcb_printf(dcb, "\t\tCached results                 %d\n", n_entries);
+    dcb_printf(dcb, "\t\tCache size                     %lu of %lu bytes\n",
+               (unsigned long)size, (unsigned long)my_instance->max_size * CACHE_N_SHARDS);
+    dcb_printf(dcb, "\t\tHits                           %ld\n",
+               (long)ts_stats_sum(my_instance->n_hits));
+    dcb_printf(dcb, "\t\tMisses                         %ld\n",
+               (long)ts_stats_sum(my_instance->n_misses));
+    dcb_printf(dcb, "\t\tStored results                 %ld\n",
+               (long)ts_stats_sum(my_instance->n_stores));
+    dcb_printf(dcb, "\t\tEvicted results                %ld\n",
+               (long)ts_stats_sum(my_instance->n_evictions));
+    dcb_printf(dcb, "\t\tInvalidations                  %ld\n",
+               (long)ts_stats_sum(my_instance->n_invalidations));
+}
@@ -163,21 +163,47 @@ typedef struct timerange_t
 } TIMERANGE;
 
 /**
- * Query speed measurement and limitation structure
+ * Query speed limitation structure
  */
 typedef struct queryspeed_t
 {
-    time_t first_query; /*< Time when the first query occurred */
-    time_t triggered; /*< Time when the limit was exceeded */
     int period; /*< Measurement interval in seconds */
     int cooldown; /*< Time the user is denied access for */
-    int count; /*< Number of queries done */
     int limit; /*< Maximum number of queries */
-    long id; /*< Unique id of the rule */
-    bool active; /*< If the rule has been triggered */
-    struct queryspeed_t* next; /*< Next node in the list */
+    int index; /*< Index of the rule in the rate counters of a session */
 } QUERYSPEED;
 
+/**
+ * The query rate of one client user@host for one limit_queries rule. The
+ * counter is shared by all the sessions of the client and is updated with
+ * atomic operations. The rate is the number of queries in the current period
+ * added to the part of the previous period that is still inside the sliding
+ * window of one period.
+ */
+typedef struct fw_rate_counter
+{
+    char* client; /*< The user@host of the client */
+    int rule; /*< Index of the limit_queries rule */
+    uint64_t window; /*< Number of the current period in the high 32 bits and
+                      * the number of its queries in the low 32 bits */
+    uint32_t previous; /*< Number of queries in the previous period */
+    int64_t blocked_until; /*< Time in milliseconds until which queries are denied */
+    struct fw_rate_counter* next; /*< Next counter in the shard */
+} FW_RATE_COUNTER;
+
+/** Number of shards the rate counters are divided into */
+#define FW_RATE_SHARDS 64
+
+/**
+ * A shard of the rate counters. The lock is only needed to find or add a
+ * counter, which is done once per session.
+ */
+typedef struct
+{
+    SPINLOCK lock; /*< Protects the list of counters */
+    FW_RATE_COUNTER* counters; /*< The counters of the shard */
+} FW_RATE_SHARD;
+
 /**
  * A structure used to identify individual rules and to store their contents
  *
@@ -192,6 +218,8 @@ typedef struct rule_t
     qc_query_op_t on_queries; /*< Types of queries to inspect */
     int times_matched; /*< Number of times this rule has been matched */
     TIMERANGE* active; /*< List of times when this rule is active */
+    char** columns; /*< Column names of a columns rule sorted for bsearch() */
+    int n_columns; /*< Number of column names */
     struct rule_t *next;
 } RULE;
 
@@ -216,7 +244,6 @@ typedef struct user_t
 {
     char* name; /*< Name of the user */
     SPINLOCK lock; /*< User spinlock */
-    QUERYSPEED* qs_limit; /*< The query speed structure unique to this user */
     RULELIST* rules_or; /*< If any of these rules match the action is triggered */
     RULELIST* rules_and; /*< All of these rules must match for the action to trigger */
     RULELIST* rules_strict_and; /*< rules that skip the rest of the rules if one of them
@@ -266,6 +293,10 @@ typedef struct
     int log_match; /*< Log matching and/or non-matching queries */
     SPINLOCK lock; /*< Instance spinlock */
     int idgen; /*< UID generator */
+    uint32_t regex_ovector; /*< Ovector size that fits the captures of all regex rules */
+    int n_rate_rules; /*< Number of limit_queries rules */
+    FW_RATE_SHARD rate_shards[FW_RATE_SHARDS]; /*< Query rates of the clients */
+    int rules_generation; /*< Incremented when the users or rules are replaced */
 } FW_INSTANCE;
 
 /**
@@ -275,12 +306,36 @@ typedef struct
 {
     SESSION* session; /*< Client session structure */
     char* errmsg; /*< Rule specific error message */
+    FW_RATE_COUNTER** rate_counters; /*< Rate counters of the client, by rule */
+    USER* user; /*< The rules of the client, NULL if none apply */
+    int rules_generation; /*< Generation of the rules the user was resolved from, -1 if
+                           * the user must be resolved again */
     DOWNSTREAM down; /*< Next object in the downstream chain */
     UPSTREAM up; /*< Next object in the upstream chain */
 } FW_SESSION;
 
+/**
+ * A query that is checked against the rules. The query is classified once
+ * and the results are shared by all the rules that are checked against it.
+ */
+typedef struct
+{
+    GWBUF* queue; /*< The query buffer */
+    char* query; /*< The SQL of the query, NULL if it is not an SQL query */
+    bool is_sql; /*< Whether the query is an SQL query */
+    bool is_real; /*< Whether the query is a real query */
+    qc_parse_result_t parse_result; /*< Result of parsing the query */
+    qc_query_op_t optype; /*< The operation of the query */
+    bool fields_read; /*< Whether the affected fields have been read */
+    char* fields; /*< The affected fields, split into field_list */
+    char** field_list; /*< The names of the affected fields */
+    int n_fields; /*< Number of affected fields */
+    bool wildcard; /*< Whether the fields have a wildcard */
+} QUERY_INFO;
+
 bool parse_at_times(const char** tok, char** saveptr, RULE* ruledef);
 bool parse_limit_queries(FW_INSTANCE* instance, RULE* ruledef, const char* rule, char** saveptr);
+static bool compile_rules(FW_INSTANCE* instance, RULE* rules);
 
 /**
  * Push a string onto a string stack
@@ -413,7 +468,6 @@ static void* huserfree(void* fval)
     rulelist_free(value->rules_and);
     rulelist_free(value->rules_or);
     rulelist_free(value->rules_strict_and);
-    free(value->qs_limit);
     free(value->name);
     free(value);
     return NULL;
@@ -732,7 +786,6 @@ static bool apply_rule_to_user(FW_INSTANCE *instance, char *username,
     }
 
     user->name = (char*) strdup(username);
-    user->qs_limit = NULL;
     RULELIST *tl = (RULELIST*) rulelist_clone(rulelist);
     RULELIST *tail = tl;
 
@@ -885,6 +938,8 @@ bool create_rule(void* scanner, const char* name)
         ruledef->active = NULL;
         ruledef->times_matched = 0;
         ruledef->data = NULL;
+        ruledef->columns = NULL;
+        ruledef->n_columns = 0;
         rstack->rule = ruledef;
     }
     else
@@ -917,6 +972,7 @@ static void free_rules(RULE* rule)
         {
             case RT_COLUMN:
                 strlink_free((STRLINK*) rule->data);
+                free(rule->columns);
                 break;
 
             case RT_THROTTLE:
@@ -1180,6 +1236,7 @@ bool define_regex_rule(void* scanner, char* pattern)
         ss_dassert(rstack);
         rstack->rule->type = RT_REGEX;
         rstack->rule->data = (void*) re;
+        mxs_pcre2_jit_compile(re);
     }
     else
     {
@@ -1338,7 +1395,8 @@ static bool process_rule_file(const char* filename, FW_INSTANCE* instance)
         dbfw_yylex_destroy(scanner);
         fclose(file);
 
-        if (rc == 0 && process_user_templates(instance, pstack.templates, pstack.rule))
+        if (rc == 0 && process_user_templates(instance, pstack.templates, pstack.rule) &&
+            compile_rules(instance, pstack.rule))
         {
             instance->rules = pstack.rule;
         }
@@ -1390,7 +1448,12 @@ createInstance(char **options, FILTER_PARAMETER **params)
 
     spinlock_init(&my_instance->lock);
 
-    if ((ht = hashtable_alloc(100, simple_str_hash, strcmp)) == NULL)
+    for (i = 0; i < FW_RATE_SHARDS; i++)
+    {
+        spinlock_init(&my_instance->rate_shards[i].lock);
+    }
+
+    if ((ht = hashtable_alloc_concurrent(100, simple_str_hash, strcmp)) == NULL)
     {
         MXS_ERROR("Unable to allocate hashtable.");
         free(my_instance);
@@ -1482,6 +1545,7 @@ newSession(FILTER *instance, SESSION *session)
         return NULL;
     }
     my_session->session = session;
+    my_session->rules_generation = -1;
     return my_session;
 }
 
@@ -1511,6 +1575,7 @@ freeSession(FILTER *instance, void *session)
     {
         free(my_session->errmsg);
     }
+    free(my_session->rate_counters);
     free(my_session);
 }
 
@@ -1693,31 +1758,291 @@ static char* create_parse_error(FW_INSTANCE* my_instance,
     return msg;
 }
 
+/**
+ * Classify a query for checking it against the rules
+ * @param info The query information to initialize
+ * @param queue The GWBUF containing the query
+ */
+static void query_info_init(QUERY_INFO* info, GWBUF* queue)
+{
+    memset(info, 0, sizeof(*info));
+    info->queue = queue;
+    info->optype = QUERY_OP_UNDEFINED;
+    info->is_sql = modutil_is_SQL(queue) || modutil_is_SQL_prepare(queue);
+
+    if (info->is_sql || MYSQL_IS_COM_INIT_DB((uint8_t*)GWBUF_DATA(queue)))
+    {
+        info->query = modutil_get_SQL(queue);
+    }
+
+    if (info->is_sql)
+    {
+        info->parse_result = qc_parse(queue, QC_COLLECT_ALL);
+
+        if (info->parse_result != QC_QUERY_INVALID)
+        {
+            info->optype = qc_get_operation(queue);
+            info->is_real = qc_is_real_query(queue);
+        }
+    }
+}
+
+/**
+ * Free the query information
+ * @param info The query information
+ */
+static void query_info_free(QUERY_INFO* info)
+{
+    free(info->query);
+    free(info->fields);
+    free(info->field_list);
+}
+
+/**
+ * Read the fields the query affects. The fields are only read for the first
+ * rule that needs them.
+ * @param info The query information
+ * @return True if the fields are available
+ */
+static bool query_info_read_fields(QUERY_INFO* info)
+{
+    if (!info->fields_read)
+    {
+        info->fields_read = true;
+
+        if ((info->fields = qc_get_affected_fields(info->queue)))
+        {
+            int n = 1;
+
+            for (char *ptr = info->fields; *ptr; ptr++)
+            {
+                if (*ptr == ' ' || *ptr == ',')
+                {
+                    n++;
+                }
+            }
+
+            info->wildcard = strchr(info->fields, '*') != NULL;
+
+            if ((info->field_list = malloc(n * sizeof(char*))))
+            {
+                char* saveptr;
+                char* tok = strtok_r(info->fields, " ,", &saveptr);
+
+                while (tok)
+                {
+                    info->field_list[info->n_fields++] = tok;
+                    tok = strtok_r(NULL, " ,", &saveptr);
+                }
+            }
+        }
+    }
+
+    return info->fields != NULL;
+}
+
+/**
+ * Compare two column names for sorting and searching the columns of a rule
+ */
+static int column_cmp(const void* a, const void* b)
+{
+    return strcasecmp(*(const char**)a, *(const char**)b);
+}
+
+/**
+ * Prepare the rules for matching. The column names of the columns rules are
+ * sorted so that a field is found with a binary search and the size of the
+ * regex match data that fits all regex rules is calculated.
+ * @param instance The filter instance
+ * @param rules The rules
+ * @return True if the rules were prepared
+ */
+static bool compile_rules(FW_INSTANCE* instance, RULE* rules)
+{
+    instance->regex_ovector = 1;
+
+    for (RULE* rule = rules; rule; rule = rule->next)
+    {
+        if (rule->type == RT_COLUMN)
+        {
+            int n = 0;
+
+            for (STRLINK* strln = rule->data; strln; strln = strln->next)
+            {
+                n++;
+            }
+
+            if ((rule->columns = malloc(n * sizeof(char*))) == NULL)
+            {
+                MXS_ERROR("Memory allocation failed when preparing rule '%s'.", rule->name);
+                return false;
+            }
+
+            for (STRLINK* strln = rule->data; strln; strln = strln->next)
+            {
+                rule->columns[rule->n_columns++] = strln->value;
+            }
+
+            qsort(rule->columns, rule->n_columns, sizeof(char*), column_cmp);
+        }
+        else if (rule->type == RT_REGEX)
+        {
+            uint32_t captures = 0;
+            pcre2_pattern_info((pcre2_code*) rule->data, PCRE2_INFO_CAPTURECOUNT, &captures);
+            instance->regex_ovector = MAX(instance->regex_ovector, captures + 1);
+        }
+        else if (rule->type == RT_THROTTLE)
+        {
+            ((QUERYSPEED*) rule->data)->index = instance->n_rate_rules++;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Find the rate counter of the client of a session for a limit_queries rule.
+ * The counter is created when the client is first seen and is cached in the
+ * session.
+ *
+ * @param instance Fwfilter instance
+ * @param session Fwfilter session
+ * @param qs The limit_queries rule
+ * @return The rate counter or NULL if memory allocation failed
+ */
+static FW_RATE_COUNTER* rate_counter_get(FW_INSTANCE* instance, FW_SESSION* session,
+                                         QUERYSPEED* qs)
+{
+    if (session->rate_counters == NULL &&
+        (session->rate_counters = calloc(instance->n_rate_rules,
+                                         sizeof(FW_RATE_COUNTER*))) == NULL)
+    {
+        return NULL;
+    }
+
+    if (session->rate_counters[qs->index] == NULL)
+    {
+        DCB* dcb = session->session->client_dcb;
+        char client[strlen(dcb->user) + strlen(dcb->remote) + 2];
+        sprintf(client, "%s@%s", dcb->user, dcb->remote);
+
+        FW_RATE_SHARD* shard =
+            &instance->rate_shards[(simple_str_hash(client) + qs->index) % FW_RATE_SHARDS];
+        FW_RATE_COUNTER* counter;
+
+        spinlock_acquire(&shard->lock);
+
+        for (counter = shard->counters; counter; counter = counter->next)
+        {
+            if (counter->rule == qs->index && strcmp(counter->client, client) == 0)
+            {
+                break;
+            }
+        }
+
+        if (counter == NULL && (counter = calloc(1, sizeof(FW_RATE_COUNTER))))
+        {
+            if ((counter->client = strdup(client)))
+            {
+                counter->rule = qs->index;
+                counter->next = shard->counters;
+                shard->counters = counter;
+            }
+            else
+            {
+                free(counter);
+                counter = NULL;
+            }
+        }
+
+        spinlock_release(&shard->lock);
+        session->rate_counters[qs->index] = counter;
+    }
+
+    return session->rate_counters[qs->index];
+}
+
+/**
+ * Count a query of a client against a limit_queries rule
+ *
+ * @param counter The rate counter of the client
+ * @param qs The limit_queries rule
+ * @param triggered Set to true if this query exceeded the limit
+ * @return Number of milliseconds the queries of the client are denied for,
+ * 0 if the query is allowed
+ */
+static int64_t rate_counter_check(FW_RATE_COUNTER* counter, QUERYSPEED* qs, bool* triggered)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    int64_t now = (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    int64_t blocked_until = __atomic_load_n(&counter->blocked_until, __ATOMIC_RELAXED);
+
+    *triggered = false;
+
+    if (now < blocked_until)
+    {
+        return blocked_until - now;
+    }
+
+    int64_t period = MAX(qs->period, 1) * 1000;
+    uint32_t current = now / period;
+    uint64_t old = __atomic_load_n(&counter->window, __ATOMIC_RELAXED);
+    uint64_t new;
+
+    do
+    {
+        new = (uint32_t)(old >> 32) == current ? old + 1 : ((uint64_t) current << 32) | 1;
+    }
+    while (!__atomic_compare_exchange_n(&counter->window, &old, new, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    if ((uint32_t)(old >> 32) != current)
+    {
+        /** This query started a new period */
+        uint32_t previous = (uint32_t)(old >> 32) == current - 1 ? (uint32_t) old : 0;
+        __atomic_store_n(&counter->previous, previous, __ATOMIC_RELAXED);
+    }
+
+    uint64_t previous = __atomic_load_n(&counter->previous, __ATOMIC_RELAXED);
+    uint64_t count = (uint32_t) new + previous * (period - now % period) / period;
+
+    if (count > (uint64_t) qs->limit)
+    {
+        __atomic_store_n(&counter->blocked_until, now + (int64_t) qs->cooldown * 1000,
+                         __ATOMIC_RELAXED);
+
+        /** The queries are counted from zero once the cooldown is over */
+        __atomic_store_n(&counter->window, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&counter->previous, 0, __ATOMIC_RELAXED);
+        *triggered = true;
+        return (int64_t) qs->cooldown * 1000;
+    }
+
+    return 0;
+}
+
 /**
  * Check if a query matches a single rule
  * @param my_instance Fwfilter instance
  * @param my_session Fwfilter session
- * @param queue The GWBUF containing the query
+ * @param info The query
  * @param rulelist The rule to check
- * @param query Pointer to the null-terminated query string
  * @return true if the query matches the rule
  */
 bool rule_matches(FW_INSTANCE* my_instance,
                   FW_SESSION* my_session,
-                  GWBUF *queue,
+                  QUERY_INFO* info,
                   USER* user,
-                  RULELIST *rulelist,
-                  char* query)
+                  RULELIST *rulelist)
 {
-    char *ptr, *where, *msg = NULL;
+    char *msg = NULL;
     char emsg[512];
 
-    unsigned char* memptr = (unsigned char*) queue->start;
-    bool is_sql, is_real, matches;
-    qc_query_op_t optype = QUERY_OP_UNDEFINED;
-    STRLINK* strln = NULL;
-    QUERYSPEED* queryspeed = NULL;
-    QUERYSPEED* rule_qs = NULL;
+    GWBUF *queue = info->queue;
+    char *query = info->query;
+    bool matches;
+    qc_query_op_t optype = info->optype;
     time_t time_now;
     struct tm tm_now;
 
@@ -1725,11 +2050,10 @@ bool rule_matches(FW_INSTANCE* my_instance,
     localtime_r(&time_now, &tm_now);
 
     matches = false;
-    is_sql = modutil_is_SQL(queue) || modutil_is_SQL_prepare(queue);
 
-    if (is_sql)
+    if (info->is_sql)
     {
-        qc_parse_result_t parse_result = qc_parse(queue);
+        qc_parse_result_t parse_result = info->parse_result;
 
         if (parse_result == QC_QUERY_INVALID)
         {
@@ -1738,9 +2062,6 @@ bool rule_matches(FW_INSTANCE* my_instance,
         }
         else
         {
-            optype = qc_get_operation(queue);
-            is_real = qc_is_real_query(queue);
-
             if (parse_result != QC_QUERY_PARSED)
             {
                 if ((rulelist->rule->type == RT_COLUMN) ||
@@ -1765,10 +2086,6 @@ bool rule_matches(FW_INSTANCE* my_instance,
             }
         }
     }
-    else
-    {
-        is_real = false;
-    }
 
     if (rulelist->rule->on_queries == QUERY_OP_UNDEFINED ||
         rulelist->rule->on_queries & optype ||
@@ -1784,18 +2101,16 @@ bool rule_matches(FW_INSTANCE* my_instance,
             case RT_REGEX:
                 if (query)
                 {
-                    pcre2_match_data *mdata = pcre2_match_data_create_from_pattern(
-                                                  rulelist->rule->data, NULL);
+                    pcre2_match_data *mdata = mxs_pcre2_thread_match_data(my_instance->regex_ovector);
 
                     if (mdata)
                     {
                         if (pcre2_match((pcre2_code*) rulelist->rule->data,
                                         (PCRE2_SPTR) query, PCRE2_ZERO_TERMINATED,
-                                        0, 0, mdata, NULL) > 0)
+                                        0, 0, mdata, mxs_pcre2_thread_match_context()) > 0)
                         {
                             matches = true;
                         }
-                        pcre2_match_data_free(mdata);
                         if (matches)
                         {
                             msg = strdup("Permission denied, query matched regular expression.");
@@ -1823,151 +2138,75 @@ bool rule_matches(FW_INSTANCE* my_instance,
                 break;
 
             case RT_COLUMN:
-                if (is_sql && is_real)
+                if (info->is_sql && info->is_real && query_info_read_fields(info))
                 {
-                    where = qc_get_affected_fields(queue);
-                    if (where != NULL)
+                    for (int i = 0; i < info->n_fields; i++)
                     {
-                        char* saveptr;
-                        char* tok = strtok_r(where, " ", &saveptr);
-                        while (tok)
+                        char** column = bsearch(&info->field_list[i], rulelist->rule->columns,
+                                                rulelist->rule->n_columns, sizeof(char*),
+                                                column_cmp);
+                        if (column)
                         {
-                            strln = (STRLINK*) rulelist->rule->data;
-                            while (strln)
-                            {
-                                if (strcasecmp(tok, strln->value) == 0)
-                                {
-                                    matches = true;
-
-                                    sprintf(emsg, "Permission denied to column '%s'.", strln->value);
-                                    MXS_INFO("dbfwfilter: rule '%s': query targets forbidden column: %s",
-                                             rulelist->rule->name, strln->value);
-                                    msg = strdup(emsg);
-                                    free(where);
-                                    goto queryresolved;
-                                }
-                                strln = strln->next;
-                            }
-                            tok = strtok_r(NULL, ",", &saveptr);
+                            matches = true;
+
+                            snprintf(emsg, sizeof(emsg), "Permission denied to column '%s'.", *column);
+                            MXS_INFO("dbfwfilter: rule '%s': query targets forbidden column: %s",
+                                     rulelist->rule->name, *column);
+                            msg = strdup(emsg);
+                            goto queryresolved;
                         }
-                        free(where);
                     }
                 }
                 break;
 
             case RT_WILDCARD:
-                if (is_sql && is_real)
+                if (info->is_sql && info->is_real && query_info_read_fields(info) && info->wildcard)
                 {
-                    char * strptr;
-                    where = qc_get_affected_fields(queue);
-
-                    if (where != NULL)
-                    {
-                        strptr = where;
-
-                        if (strchr(strptr, '*'))
-                        {
-                            matches = true;
-                            msg = strdup("Usage of wildcard denied.");
-                            MXS_INFO("dbfwfilter: rule '%s': query contains a wildcard.",
-                                     rulelist->rule->name);
-                            free(where);
-                            goto queryresolved;
-                        }
-                        free(where);
-                    }
+                    matches = true;
+                    msg = strdup("Usage of wildcard denied.");
+                    MXS_INFO("dbfwfilter: rule '%s': query contains a wildcard.",
+                             rulelist->rule->name);
+                    goto queryresolved;
                 }
                 break;
 
             case RT_THROTTLE:
-                /**
-                 * Check if this is the first time this rule is matched and if so, allocate
-                 * and initialize a new QUERYSPEED struct for this session.
-                 */
-                spinlock_acquire(&my_instance->lock);
-                rule_qs = (QUERYSPEED*) rulelist->rule->data;
-                spinlock_release(&my_instance->lock);
-
-                spinlock_acquire(&user->lock);
-                queryspeed = user->qs_limit;
-                spinlock_release(&user->lock);
-
-                while (queryspeed)
                 {
-                    if (queryspeed->id == rule_qs->id)
+                    /**
+                     * The queries are counted for the client user@host over
+                     * all of its sessions.
+                     */
+                    QUERYSPEED* qs = (QUERYSPEED*) rulelist->rule->data;
+                    FW_RATE_COUNTER* counter = rate_counter_get(my_instance, my_session, qs);
+                    bool triggered;
+                    int64_t blocked_for;
+
+                    if (counter && (blocked_for = rate_counter_check(counter, qs, &triggered)) > 0)
                     {
-                        break;
-                    }
-                    queryspeed = queryspeed->next;
-                }
-
-                if (queryspeed == NULL)
-                {
-
-                    /**No match found*/
-                    queryspeed = (QUERYSPEED*) calloc(1, sizeof(QUERYSPEED));
-                    queryspeed->period = rule_qs->period;
-                    queryspeed->cooldown = rule_qs->cooldown;
-                    queryspeed->limit = rule_qs->limit;
-                    queryspeed->id = rule_qs->id;
-                    queryspeed->next = user->qs_limit;
-                    user->qs_limit = queryspeed;
-                }
-
-                if (queryspeed->active)
-                {
-                    if (difftime(time_now, queryspeed->triggered) < queryspeed->cooldown)
-                    {
-
-                        double blocked_for =
-                            queryspeed->cooldown - difftime(time_now, queryspeed->triggered);
+                        if (triggered)
+                        {
+                            MXS_INFO("dbfwfilter: rule '%s': query limit triggered (%d queries in %d seconds), "
+                                     "denying queries from user for %d seconds.",
+                                     rulelist->rule->name,
+                                     qs->limit,
+                                     qs->period,
+                                     qs->cooldown);
+                        }
+                        else
+                        {
+                            MXS_INFO("dbfwfilter: rule '%s': user denied for %f seconds",
+                                     rulelist->rule->name, blocked_for / 1000.0);
+                        }
 
-                        sprintf(emsg, "Queries denied for %f seconds", blocked_for);
-                        MXS_INFO("dbfwfilter: rule '%s': user denied for %f seconds",
-                                 rulelist->rule->name, blocked_for);
+                        sprintf(emsg, "Queries denied for %f seconds", blocked_for / 1000.0);
                         msg = strdup(emsg);
                         matches = true;
                     }
-                    else
-                    {
-                        queryspeed->active = false;
-                        queryspeed->count = 0;
-                    }
-                }
-                else
-                {
-                    if (queryspeed->count >= queryspeed->limit)
-                    {
-                        queryspeed->triggered = time_now;
-                        matches = true;
-                        queryspeed->active = true;
-
-                        MXS_INFO("dbfwfilter: rule '%s': query limit triggered (%d queries in %d seconds), "
-                                 "denying queries from user for %d seconds.",
-                                 rulelist->rule->name,
-                                 queryspeed->limit,
-                                 queryspeed->period,
-                                 queryspeed->cooldown);
-                        double blocked_for =
-                            queryspeed->cooldown - difftime(time_now, queryspeed->triggered);
-                        sprintf(emsg, "Queries denied for %f seconds", blocked_for);
-                        msg = strdup(emsg);
-                    }
-                    else if (queryspeed->count > 0 &&
-                             difftime(time_now, queryspeed->first_query) <= queryspeed->period)
-                    {
-                        queryspeed->count++;
-                    }
-                    else
-                    {
-                        queryspeed->first_query = time_now;
-                        queryspeed->count = 1;
-                    }
                 }
                 break;
 
             case RT_CLAUSE:
-                if (is_sql && is_real &&
+                if (info->is_sql && info->is_real &&
                     !qc_query_has_clause(queue))
                 {
                     matches = true;
@@ -2006,21 +2245,19 @@ queryresolved:
  * Check if the query matches any of the rules in the user's rulelist.
  * @param my_instance Fwfilter instance
  * @param my_session Fwfilter session
- * @param queue The GWBUF containing the query
+ * @param info The query
  * @param user The user whose rulelist is checked
  * @return True if the query matches at least one of the rules otherwise false
  */
 bool check_match_any(FW_INSTANCE* my_instance, FW_SESSION* my_session,
-                     GWBUF *queue, USER* user, char** rulename)
+                     QUERY_INFO* info, USER* user, char** rulename)
 {
     RULELIST* rulelist;
     bool rval = false;
 
     if ((rulelist = user->rules_or) &&
-        (modutil_is_SQL(queue) || modutil_is_SQL_prepare(queue) ||
-         MYSQL_IS_COM_INIT_DB((uint8_t*)GWBUF_DATA(queue))))
+        (info->is_sql || MYSQL_IS_COM_INIT_DB((uint8_t*)GWBUF_DATA(info->queue))))
     {
-        char *fullquery = modutil_get_SQL(queue);
         while (rulelist)
         {
             if (!rule_is_active(rulelist->rule))
@@ -2028,7 +2265,7 @@ bool check_match_any(FW_INSTANCE* my_instance, FW_SESSION* my_session,
                 rulelist = rulelist->next;
                 continue;
             }
-            if (rule_matches(my_instance, my_session, queue, user, rulelist, fullquery))
+            if (rule_matches(my_instance, my_session, info, user, rulelist))
             {
                 *rulename = strdup(rulelist->rule->name);
                 rval = true;
@@ -2036,8 +2273,6 @@ bool check_match_any(FW_INSTANCE* my_instance, FW_SESSION* my_session,
             }
             rulelist = rulelist->next;
         }
-
-        free(fullquery);
     }
     return rval;
 }
@@ -2082,12 +2317,12 @@ void append_string(char** dest, size_t* size, const char* src)
  * Check if the query matches all rules in the user's rulelist.
  * @param my_instance Fwfilter instance
  * @param my_session Fwfilter session
- * @param queue The GWBUF containing the query
+ * @param info The query
  * @param user The user whose rulelist is checked
  * @return True if the query matches all of the rules otherwise false
  */
 bool check_match_all(FW_INSTANCE* my_instance, FW_SESSION* my_session,
-                     GWBUF *queue, USER* user, bool strict_all, char** rulename)
+                     QUERY_INFO* info, USER* user, bool strict_all, char** rulename)
 {
     bool rval = false;
     bool have_active_rule = false;
@@ -2095,9 +2330,8 @@ bool check_match_all(FW_INSTANCE* my_instance, FW_SESSION* my_session,
     char *matched_rules = NULL;
     size_t size = 0;
 
-    if (rulelist && (modutil_is_SQL(queue) || modutil_is_SQL_prepare(queue)))
+    if (rulelist && info->is_sql)
     {
-        char *fullquery = modutil_get_SQL(queue);
         rval = true;
         while (rulelist)
         {
@@ -2109,7 +2343,7 @@ bool check_match_all(FW_INSTANCE* my_instance, FW_SESSION* my_session,
 
             have_active_rule = true;
 
-            if (rule_matches(my_instance, my_session, queue, user, rulelist, fullquery))
+            if (rule_matches(my_instance, my_session, info, user, rulelist))
             {
                 append_string(&matched_rules, &size, rulelist->rule->name);
             }
@@ -2130,7 +2364,6 @@ bool check_match_all(FW_INSTANCE* my_instance, FW_SESSION* my_session,
             /** No active rules */
             rval = false;
         }
-        free(fullquery);
     }
 
     /** Set the list of matched rule names */
@@ -2173,6 +2406,29 @@ USER* find_user_data(HASHTABLE *hash, const char *name, const char *remote)
     return user;
 }
 
+/**
+ * Retrieve the user specific data of a session. The user is looked up when it
+ * is first needed, and again only if the rules are replaced or the client
+ * changes its user.
+ *
+ * @param my_instance The filter instance
+ * @param my_session The filter session
+ * @return The user data or NULL if no rules apply to the client
+ */
+static USER* session_user_data(FW_INSTANCE *my_instance, FW_SESSION *my_session)
+{
+    int generation = __atomic_load_n(&my_instance->rules_generation, __ATOMIC_ACQUIRE);
+
+    if (my_session->rules_generation != generation)
+    {
+        DCB *dcb = my_session->session->client_dcb;
+        my_session->user = find_user_data(my_instance->htable, dcb->user, dcb->remote);
+        my_session->rules_generation = generation;
+    }
+
+    return my_session->user;
+}
+
 static bool command_is_mandatory(const GWBUF *buffer)
 {
     switch (MYSQL_GET_COMMAND((uint8_t*)GWBUF_DATA(buffer)))
@@ -2239,21 +2495,32 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
     }
     else
     {
-        USER *user = find_user_data(my_instance->htable, dcb->user, dcb->remote);
+        USER *user = session_user_data(my_instance, my_session);
         bool query_ok = command_is_mandatory(queue);
 
+        if (MYSQL_GET_COMMAND((uint8_t*)GWBUF_DATA(queue)) == MYSQL_COM_CHANGE_USER)
+        {
+            /** The rules of the new user are looked up with the next query */
+            my_session->rules_generation = -1;
+        }
+
         if (user)
         {
             bool match = false;
             char* rname = NULL;
+            QUERY_INFO info;
+
+            query_info_init(&info, queue);
 
-            if (check_match_any(my_instance, my_session, queue, user, &rname) ||
-                check_match_all(my_instance, my_session, queue, user, false, &rname) ||
-                check_match_all(my_instance, my_session, queue, user, true, &rname))
+            if (check_match_any(my_instance, my_session, &info, user, &rname) ||
+                check_match_all(my_instance, my_session, &info, user, false, &rname) ||
+                check_match_all(my_instance, my_session, &info, user, true, &rname))
             {
                 match = true;
             }
 
+            query_info_free(&info);
+
             switch (my_instance->action)
             {
                 case FW_ACTION_ALLOW:
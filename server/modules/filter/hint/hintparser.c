@@ -23,8 +23,15 @@
 /**
  * hintparser.c - Find any comment in the SQL packet and look for MAXSCALE
  * hints in that comment.
+ *
+ * The SQL is parsed in place in the request buffer. Statements that do not
+ * contain the word maxscale are not parsed at all.
  */
 
+/** The word that starts a hint comment */
+#define HINT_MARKER     "maxscale"
+#define HINT_MARKER_LEN (sizeof(HINT_MARKER) - 1)
+
 /**
  * The keywords in the hint syntax
  */
@@ -46,6 +53,7 @@ struct
     { "master", TOK_MASTER},
     { "slave", TOK_SLAVE},
     { "server", TOK_SERVER},
+    { "all", TOK_ALL},
     { NULL, 0}
 };
 /**
@@ -62,32 +70,23 @@ HINT_TOKEN kwords[] = {
         { TOK_MASTER,   "master" },
         { TOK_SLAVE,    "slave" },
         { TOK_SERVER,   "server" },
+        { TOK_ALL,      "all" },
         { 0,            NULL}
 };
  */
 
-static HINT_TOKEN *hint_next_token(GWBUF **buf, char **ptr);
+static HINT_TOKEN *hint_next_token(GWBUF **buf, char **ptr, HINT_TOKEN *tok);
 static void hint_pop(HINT_SESSION *);
 static HINT *lookup_named_hint(HINT_SESSION *, char *);
 static void create_named_hint(HINT_SESSION *, char *, HINT *);
 static void hint_push(HINT_SESSION *, HINT *);
 static const char* token_get_keyword(HINT_TOKEN* token);
-static void token_free(HINT_TOKEN* token);
 
 typedef enum
 {
     HM_EXECUTE, HM_START, HM_PREPARE
 } HINT_MODE;
 
-void token_free(HINT_TOKEN* token)
-{
-    if (token->value != NULL)
-    {
-        free(token->value);
-    }
-    free(token);
-}
-
 static const char* token_get_keyword(
     HINT_TOKEN* token)
 {
@@ -124,6 +123,44 @@ static const char* token_get_keyword(
     }
 }
 
+/**
+ * Check if the SQL contains the hint marker. The marker is searched for with
+ * memchr so that the statements without hints are skipped quickly.
+ *
+ * @param ptr   The SQL
+ * @param len   Length of the SQL
+ * @return True if the marker was found in any case
+ */
+static bool
+hint_marker_present(const char *ptr, int len)
+{
+    const char *end = ptr + len;
+    const char *lower = memchr(ptr, HINT_MARKER[0], len);
+    const char *upper = memchr(ptr, toupper(HINT_MARKER[0]), len);
+
+    while (lower || upper)
+    {
+        const char *p = upper == NULL || (lower && lower < upper) ? lower : upper;
+
+        if ((size_t)(end - p) >= HINT_MARKER_LEN &&
+            strncasecmp(p, HINT_MARKER, HINT_MARKER_LEN) == 0)
+        {
+            return true;
+        }
+
+        if (p == lower)
+        {
+            lower = memchr(p + 1, HINT_MARKER[0], end - p - 1);
+        }
+        else
+        {
+            upper = memchr(p + 1, toupper(HINT_MARKER[0]), end - p - 1);
+        }
+    }
+
+    return false;
+}
+
 /**
  * Parse the hint comments in the MySQL statement passed in request.
  * Add any hints to the buffer for later processing.
@@ -142,11 +179,19 @@ hint_parser(HINT_SESSION *session, GWBUF *request)
     HINT *rval = NULL;
     char *pname, *lvalue, *hintname = NULL;
     GWBUF *buf;
-    HINT_TOKEN *tok;
+    HINT_TOKEN token, *tok;
     HINT_MODE mode = HM_EXECUTE;
 
-    /* First look for any comment in the SQL */
     modutil_MySQL_Query(request, &ptr, &len, &residual);
+
+    /* A statement in a single buffer is checked for the hint marker before
+     * looking for the comments */
+    if (request->next == NULL && !hint_marker_present(ptr, len))
+    {
+        goto retblock;
+    }
+
+    /* First look for any comment in the SQL */
     buf = request;
     found = 0;
     escape = 0;
@@ -251,25 +296,17 @@ hint_parser(HINT_SESSION *session, GWBUF *request)
         }
     }
 
-    tok = hint_next_token(&buf, &ptr);
-
-    if (tok == NULL)
-    {
-        goto retblock;
-    }
+    tok = hint_next_token(&buf, &ptr, &token);
 
     /** This is not MaxScale hint because it doesn't start with 'maxscale' */
     if (tok->token != TOK_MAXSCALE)
     {
-        token_free(tok);
         goto retblock;
     }
-    token_free(tok);
 
     state = HS_INIT;
 
-    while ((tok = hint_next_token(&buf, &ptr)) != NULL
-           && tok->token != TOK_EOL)
+    while ((tok = hint_next_token(&buf, &ptr, &token))->token != TOK_EOL)
     {
         switch (state)
         {
@@ -299,7 +336,6 @@ hint_parser(HINT_SESSION *session, GWBUF *request)
                                   "'route', 'stop' or hint name instead of "
                                   "'%s'. Hint ignored.",
                                   token_get_keyword(tok));
-                        token_free(tok);
                         goto retblock;
                 }
                 break;
@@ -310,7 +346,6 @@ hint_parser(HINT_SESSION *session, GWBUF *request)
                     MXS_ERROR("Syntax error in hint. Expected "
                               "'to' instead of '%s'. Hint ignored.",
                               token_get_keyword(tok));
-                    token_free(tok);
                     goto retblock;
                 }
                 state = HS_ROUTE1;
@@ -329,14 +364,16 @@ hint_parser(HINT_SESSION *session, GWBUF *request)
                     case TOK_SERVER:
                         state = HS_ROUTE_SERVER;
                         break;
+                    case TOK_ALL:
+                        rval = hint_create_route(rval,
+                                                 HINT_ROUTE_TO_ALL, NULL);
+                        break;
                     default:
-                        /* Error expected MASTER, SLAVE or SERVER */
+                        /* Error expected MASTER, SLAVE, SERVER or ALL */
                         MXS_ERROR("Syntax error in hint. Expected "
-                                  "'master', 'slave', or 'server' instead "
+                                  "'master', 'slave', 'server' or 'all' instead "
                                   "of '%s'. Hint ignored.",
                                   token_get_keyword(tok));
-
-                        token_free(tok);
                         goto retblock;
                 }
                 break;
@@ -353,7 +390,6 @@ hint_parser(HINT_SESSION *session, GWBUF *request)
                               "server name instead of '%s'. Hint "
                               "ignored.",
                               token_get_keyword(tok));
-                    token_free(tok);
                     goto retblock;
                 }
                 break;
@@ -380,13 +416,13 @@ hint_parser(HINT_SESSION *session, GWBUF *request)
                                   "'=', 'prepare', or 'start' instead of "
                                   "'%s'. Hint ignored.",
                                   token_get_keyword(tok));
-                        token_free(tok);
                         goto retblock;
                 }
                 break;
             case HS_PVALUE:
                 /* Action: pname = tok->value */
                 rval = hint_create_parameter(rval, pname, tok->value);
+                free(pname);
                 state = HS_INIT;
                 break;
             case HS_PREPARE:
@@ -399,7 +435,7 @@ hint_parser(HINT_SESSION *session, GWBUF *request)
                         break;
                     case TOK_STRING:
                         state = HS_NAME;
-                        lvalue = tok->value;
+                        lvalue = strdup(tok->value);
                         break;
                     default:
                         /* Error, token tok->value not expected */
@@ -407,19 +443,12 @@ hint_parser(HINT_SESSION *session, GWBUF *request)
                                   "'route' or hint name instead of "
                                   "'%s'. Hint ignored.",
                                   token_get_keyword(tok));
-                        token_free(tok);
                         goto retblock;
                 }
                 break;
         }
-        token_free(tok);
     } /*< while */
 
-    if (tok && tok->token == TOK_EOL)
-    {
-        token_free(tok);
-    }
-
     switch (mode)
     {
         case HM_START:
@@ -506,23 +535,18 @@ retblock:
  * @param buf   A pointer to the buffer point, will be updated if a
  *      new buffer is used.
  * @param ptr   The pointer within the buffer we are processing
- * @return A HINT token
+ * @param tok   The token to populate, the word is copied into it
+ * @return The populated token
  */
 static HINT_TOKEN *
-hint_next_token(GWBUF **buf, char **ptr)
+hint_next_token(GWBUF **buf, char **ptr, HINT_TOKEN *tok)
 {
-    char word[100], *dest;
+    char *word = tok->value, *dest;
     int inword = 0;
     int endtag = 0;
     char inquote = '\0';
     int i, found;
-    HINT_TOKEN *tok;
 
-    if ((tok = (HINT_TOKEN *)malloc(sizeof(HINT_TOKEN))) == NULL)
-    {
-        return NULL;
-    }
-    tok->value = NULL;
     dest = word;
     while (*ptr < (char *)((*buf)->end) || (*buf)->next)
     {
@@ -575,7 +599,7 @@ hint_next_token(GWBUF **buf, char **ptr)
             *ptr = (*buf)->start;
         }
 
-        if (dest - word > 98)
+        if (dest - word >= HINT_TOKEN_MAXLEN)
         {
             break;
         }
@@ -603,7 +627,6 @@ hint_next_token(GWBUF **buf, char **ptr)
     if (found == 0)
     {
         tok->token = TOK_STRING;
-        tok->value = strdup(word);
     }
 
     return tok;
@@ -665,13 +688,22 @@ static HINT *
 lookup_named_hint(HINT_SESSION *session, char *name)
 {
     NAMEDHINTS *ptr = session->named_hints;
+    NAMEDHINTS *prev = NULL;
 
     while (ptr)
     {
         if (strcmp(ptr->name, name) == 0)
         {
+            if (prev)
+            {
+                /** Keep the most recently used hints at the head of the list */
+                prev->next = ptr->next;
+                ptr->next = session->named_hints;
+                session->named_hints = ptr;
+            }
             return ptr->hints;
         }
+        prev = ptr;
         ptr = ptr->next;
     }
     return NULL;
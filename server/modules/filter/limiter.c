@@ -0,0 +1,1132 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file limiter.c - A query concurrency limiter
+ * @verbatim
+ *
+ * The limiter filter limits the number of queries that are executed at the
+ * same time by the sessions of a user, or by all sessions of a service.
+ *
+ * Each user or service has a limit of tokens. A session takes a token before
+ * it routes a query and gives it back when the whole reply to the query has
+ * passed through the filter. Taking a token is a compare-and-swap of the
+ * counter of tokens in use. A session that can't take a token keeps the query
+ * and waits in the list of its user or service, the worker thread is not
+ * blocked. When a token is given back, the first waiting session takes it and
+ * its query is routed by the thread that processed the reply. With
+ * poll_mode=per_thread a session is only processed by the thread that owns
+ * it, so the query of a session owned by another thread is routed by that
+ * thread after the wakeup is posted to it.
+ *
+ * A session has at most one query in flight so that the end of its reply can
+ * be found by following the packets of the reply.
+ *
+ * Date         Who             Description
+ * 14/10/2016   MaxScale        Initial implementation
+ *
+ * @endverbatim
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <filter.h>
+#include <modinfo.h>
+#include <modutil.h>
+#include <log_manager.h>
+#include <spinlock.h>
+#include <atomic.h>
+#include <hashtable.h>
+#include <statistics.h>
+#include <maxscale/poll.h>
+#include <mysql_client_server_protocol.h>
+
+MODULE_INFO info =
+{
+    MODULE_API_FILTER,
+    MODULE_EXPERIMENTAL,
+    FILTER_VERSION,
+    "A query concurrency limiter"
+};
+
+static char *version_str = "V1.0.0";
+
+/** Default number of queries executed at the same time */
+#define LIMITER_DEFAULT_MAX_CONCURRENCY 10
+
+/** Number of bytes of each reply packet that are looked at */
+#define LIMITER_PEEK_LEN 24
+
+/*
+ * The filter entry points
+ */
+static FILTER *createInstance(char **options, FILTER_PARAMETER **);
+static void *newSession(FILTER *instance, SESSION *session);
+static void closeSession(FILTER *instance, void *session);
+static void freeSession(FILTER *instance, void *session);
+static void setDownstream(FILTER *instance, void *fsession, DOWNSTREAM *downstream);
+static void setUpstream(FILTER *instance, void *fsession, UPSTREAM *upstream);
+static int routeQuery(FILTER *instance, void *fsession, GWBUF *queue);
+static int clientReply(FILTER *instance, void *fsession, GWBUF *queue);
+static void diagnostic(FILTER *instance, void *fsession, DCB *dcb);
+
+
+static FILTER_OBJECT MyObject =
+{
+    createInstance,
+    newSession,
+    closeSession,
+    freeSession,
+    setDownstream,
+    setUpstream,
+    routeQuery,
+    clientReply,
+    diagnostic,
+};
+
+/** What the filter does with the packets of a session */
+typedef enum
+{
+    LIMITER_SCOPE_USER,     /*< The sessions of a user share the tokens */
+    LIMITER_SCOPE_SERVICE   /*< All sessions of a service share the tokens */
+} limiter_scope_t;
+
+/** Where the parser of a reply is */
+typedef enum
+{
+    REPLY_FIRST,        /*< Waiting for the first packet of a result */
+    REPLY_COLUMNS,      /*< Reading the column definitions */
+    REPLY_ROWS,         /*< Reading the rows */
+    REPLY_FIELDS,       /*< Reading the reply to COM_FIELD_LIST */
+    REPLY_PREPARE,      /*< Reading the definitions of a prepared statement */
+    REPLY_WAIT_OK,      /*< Client data is forwarded until an OK or an error */
+    REPLY_DONE          /*< The reply is complete */
+} reply_state_t;
+
+struct limiter_session;
+
+/**
+ * The tokens of a user or a service
+ */
+typedef struct limiter_key
+{
+    char                   *name;       /*< The user or the service */
+    int                    in_use;      /*< Number of tokens taken */
+    int                    n_waiting;   /*< Number of waiting sessions */
+    SPINLOCK               lock;        /*< Protects the list of waiting sessions */
+    struct limiter_session *head;       /*< The session that has waited the longest */
+    struct limiter_session *tail;       /*< The session that started waiting last */
+    struct limiter_key     *next;       /*< The next key of the filter instance */
+} LIMITER_KEY;
+
+/**
+ * A query that is waiting to be routed
+ */
+typedef struct limiter_query
+{
+    GWBUF                *buffer;
+    struct limiter_query *next;
+} LIMITER_QUERY;
+
+/**
+ * The filter instance
+ */
+typedef struct
+{
+    int             max_concurrency;    /*< Tokens of each user or service */
+    limiter_scope_t scope;              /*< Who shares the tokens */
+    char            *user;              /*< Only limit the sessions of this user */
+    SPINLOCK        lock;               /*< Protects the keys */
+    HASHTABLE       *keys;              /*< The keys by name */
+    LIMITER_KEY     *all_keys;          /*< The keys in creation order */
+    ts_stats_t      n_queries;          /*< Queries that took a token */
+    ts_stats_t      n_delayed;          /*< Queries that waited for a token */
+} LIMITER_INSTANCE;
+
+/**
+ * The session structure for the limiter filter
+ */
+typedef struct limiter_session
+{
+    DOWNSTREAM             down;
+    UPSTREAM               up;
+    SESSION                *session;
+    LIMITER_INSTANCE       *instance;
+    LIMITER_KEY            *key;        /*< The tokens of the session, NULL if not limited */
+    SPINLOCK               lock;        /*< Protects the state below */
+    LIMITER_QUERY          *head;       /*< The first query waiting to be routed */
+    LIMITER_QUERY          *tail;       /*< The last query waiting to be routed */
+    int                    n_queued;    /*< Number of queries waiting to be routed */
+    bool                   has_token;   /*< The session holds a token */
+    bool                   in_flight;   /*< A query that holds the token has been routed */
+    bool                   waiting;     /*< The session is in the waiting list of its key */
+    bool                   routing;     /*< A thread is routing the queries of the session */
+    bool                   passthrough; /*< All queries are routed as they are */
+    struct limiter_session *next_waiting; /*< The next session waiting for a token */
+    POLL_MESSAGE           wakeup;      /*< Routes the queries in the owning thread */
+    /** The parser of the reply */
+    uint8_t                command;     /*< The command being replied to */
+    reply_state_t          state;       /*< Where the parser is */
+    int                    n_left;      /*< Packets left of a prepared statement reply */
+    uint8_t                hdr[MYSQL_HEADER_LEN]; /*< The header of the current packet */
+    int                    hdr_len;     /*< Bytes of the header read */
+    uint32_t               left;        /*< Bytes of the current packet left */
+    uint32_t               plen;        /*< Length of the current packet */
+    bool                   continued;   /*< The current packet continues a large packet */
+    bool                   large;       /*< The current packet is continued by the next one */
+    uint8_t                peek[LIMITER_PEEK_LEN]; /*< The start of the current packet */
+    int                    peek_len;    /*< Bytes in peek */
+} LIMITER_SESSION;
+
+static void dispatch(LIMITER_SESSION *my_session);
+static void wakeup_session(void *data);
+
+/**
+ * Implementation of the mandatory version entry point
+ *
+ * @return version string of the module
+ */
+char *
+version()
+{
+    return version_str;
+}
+
+/**
+ * The module initialisation routine, called when the module
+ * is first loaded.
+ * @see function load_module in load_utils.c for explanation of lint
+ */
+/*lint -e14 */
+void
+ModuleInit()
+{
+}
+/*lint +e14 */
+
+/**
+ * The module entry point routine. It is this routine that
+ * must populate the structure that is referred to as the
+ * "module object", this is a structure with the set of
+ * external entry points for this module.
+ *
+ * @return The module object
+ */
+FILTER_OBJECT *
+GetModuleObject()
+{
+    return &MyObject;
+}
+
+static int
+limiter_strhash(void *key)
+{
+    uint32_t hash = 2166136261U;
+
+    for (const char *ptr = (const char *)key; *ptr; ptr++)
+    {
+        hash ^= (uint8_t)*ptr;
+        hash *= 16777619U;
+    }
+
+    return (int)hash;
+}
+
+static int
+limiter_strcmp(void *v1, void *v2)
+{
+    return strcmp((char *)v1, (char *)v2);
+}
+
+/**
+ * Create an instance of the filter for a particular service
+ * within MaxScale.
+ *
+ * @param options   The options for this filter
+ * @param params    The array of name/value pair parameters for the filter
+ *
+ * @return The instance data for this new instance
+ */
+static FILTER *
+createInstance(char **options, FILTER_PARAMETER **params)
+{
+    LIMITER_INSTANCE *my_instance;
+
+    if ((my_instance = calloc(1, sizeof(LIMITER_INSTANCE))) != NULL)
+    {
+        bool error = false;
+
+        my_instance->max_concurrency = LIMITER_DEFAULT_MAX_CONCURRENCY;
+        my_instance->scope = LIMITER_SCOPE_USER;
+
+        for (int i = 0; params && params[i]; i++)
+        {
+            if (!strcmp(params[i]->name, "max_concurrency"))
+            {
+                my_instance->max_concurrency = atoi(params[i]->value);
+            }
+            else if (!strcmp(params[i]->name, "scope"))
+            {
+                if (!strcasecmp(params[i]->value, "user"))
+                {
+                    my_instance->scope = LIMITER_SCOPE_USER;
+                }
+                else if (!strcasecmp(params[i]->value, "service"))
+                {
+                    my_instance->scope = LIMITER_SCOPE_SERVICE;
+                }
+                else
+                {
+                    MXS_ERROR("limiter: The value of 'scope' must be 'user' or "
+                              "'service', not '%s'.", params[i]->value);
+                    error = true;
+                }
+            }
+            else if (!strcmp(params[i]->name, "user"))
+            {
+                free(my_instance->user);
+                my_instance->user = strdup(params[i]->value);
+            }
+            else if (!filter_standard_parameter(params[i]->name))
+            {
+                MXS_ERROR("limiter: Unexpected parameter '%s'.", params[i]->name);
+                error = true;
+            }
+        }
+
+        for (int i = 0; options && options[i]; i++)
+        {
+            MXS_ERROR("limiter: Unsupported option '%s'.", options[i]);
+            error = true;
+        }
+
+        if (my_instance->max_concurrency <= 0)
+        {
+            MXS_ERROR("limiter: The value of 'max_concurrency' must be positive.");
+            error = true;
+        }
+
+        spinlock_init(&my_instance->lock);
+        my_instance->keys = hashtable_alloc(100, limiter_strhash, limiter_strcmp);
+        my_instance->n_queries = ts_stats_alloc();
+        my_instance->n_delayed = ts_stats_alloc();
+
+        if (my_instance->keys == NULL || my_instance->n_queries == NULL ||
+            my_instance->n_delayed == NULL)
+        {
+            MXS_ERROR("limiter: Memory allocation failed.");
+            error = true;
+        }
+
+        if (error)
+        {
+            hashtable_free(my_instance->keys);
+            ts_stats_free(my_instance->n_queries);
+            ts_stats_free(my_instance->n_delayed);
+            free(my_instance->user);
+            free(my_instance);
+            my_instance = NULL;
+        }
+    }
+
+    return (FILTER *) my_instance;
+}
+
+/**
+ * Find the key of a user or a service, creating it if needed. The keys are
+ * never freed as the sessions refer to them.
+ *
+ * @param my_instance The filter instance
+ * @param name        The user or the service
+ * @return The key or NULL if memory allocation failed
+ */
+static LIMITER_KEY *
+get_key(LIMITER_INSTANCE *my_instance, const char *name)
+{
+    spinlock_acquire(&my_instance->lock);
+    LIMITER_KEY *key = hashtable_fetch(my_instance->keys, (void *)name);
+
+    if (key == NULL && (key = calloc(1, sizeof(LIMITER_KEY))) != NULL)
+    {
+        if ((key->name = strdup(name)) != NULL &&
+            hashtable_add(my_instance->keys, key->name, key))
+        {
+            spinlock_init(&key->lock);
+            key->next = my_instance->all_keys;
+            my_instance->all_keys = key;
+        }
+        else
+        {
+            free(key->name);
+            free(key);
+            key = NULL;
+        }
+    }
+    spinlock_release(&my_instance->lock);
+
+    return key;
+}
+
+/**
+ * Associate a new session with this instance of the filter.
+ *
+ * @param instance  The filter instance data
+ * @param session   The session itself
+ * @return Session specific data for this session
+ */
+static void *
+newSession(FILTER *instance, SESSION *session)
+{
+    LIMITER_INSTANCE *my_instance = (LIMITER_INSTANCE *) instance;
+    LIMITER_SESSION *my_session;
+
+    if ((my_session = calloc(1, sizeof(LIMITER_SESSION))) != NULL)
+    {
+        char *user = session_getUser(session);
+
+        my_session->session = session;
+        my_session->instance = my_instance;
+        my_session->state = REPLY_DONE;
+        spinlock_init(&my_session->lock);
+        poll_message_init(&my_session->wakeup, wakeup_session, my_session);
+
+        if (my_instance->user == NULL || (user && !strcmp(user, my_instance->user)))
+        {
+            const char *name = my_instance->scope == LIMITER_SCOPE_USER ?
+                               (user ? user : "") : session->service->name;
+
+            if ((my_session->key = get_key(my_instance, name)) == NULL)
+            {
+                MXS_ERROR("limiter: Memory allocation failed.");
+                free(my_session);
+                my_session = NULL;
+            }
+        }
+    }
+
+    return my_session;
+}
+
+/**
+ * Take a token if one is free
+ *
+ * @param key The key to take the token from
+ * @return True if a token was taken
+ */
+static bool
+token_take(LIMITER_INSTANCE *my_instance, LIMITER_KEY *key)
+{
+    int in_use = __atomic_load_n(&key->in_use, __ATOMIC_RELAXED);
+
+    while (in_use < my_instance->max_concurrency)
+    {
+        if (__atomic_compare_exchange_n(&key->in_use, &in_use, in_use + 1, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Give the free tokens of a key to the sessions that wait for them. A waiting
+ * session holds a reference to its session so that it is not freed while it
+ * is in the list.
+ *
+ * @param my_instance The filter instance
+ * @param key         The key
+ */
+static void
+wake_waiting(LIMITER_INSTANCE *my_instance, LIMITER_KEY *key)
+{
+    while (key->head)
+    {
+        spinlock_acquire(&key->lock);
+        LIMITER_SESSION *waiter = key->head;
+
+        if (waiter == NULL || !token_take(my_instance, key))
+        {
+            spinlock_release(&key->lock);
+            break;
+        }
+
+        key->head = waiter->next_waiting;
+        if (key->head == NULL)
+        {
+            key->tail = NULL;
+        }
+        key->n_waiting--;
+        waiter->next_waiting = NULL;
+        spinlock_release(&key->lock);
+
+        spinlock_acquire(&waiter->lock);
+        waiter->waiting = false;
+        waiter->has_token = true;
+        spinlock_release(&waiter->lock);
+
+        int owner = poll_session_owner(waiter->session);
+
+        if (owner >= 0 && owner != poll_current_thread())
+        {
+            /** The owner routes the query, the reference is kept until then */
+            poll_post_message(owner, &waiter->wakeup);
+        }
+        else
+        {
+            wakeup_session(waiter);
+        }
+    }
+}
+
+/**
+ * Route the queries of a session that took a token while it waited and drop
+ * the reference of the waiting session. A confined session is only routed by
+ * its owning thread, if the session has been given to another thread the
+ * wakeup is posted to it.
+ *
+ * @param data The session
+ */
+static void
+wakeup_session(void *data)
+{
+    LIMITER_SESSION *my_session = (LIMITER_SESSION *)data;
+    SESSION *session = my_session->session;
+    int owner = poll_session_owner(session);
+
+    if (owner >= 0 && owner != poll_current_thread())
+    {
+        poll_post_message(owner, &my_session->wakeup);
+        return;
+    }
+
+    if (session->state == SESSION_STATE_ROUTER_READY)
+    {
+        dispatch(my_session);
+    }
+
+    session_free(session);
+}
+
+/**
+ * Give a token back
+ *
+ * @param my_instance The filter instance
+ * @param key         The key the token was taken from
+ */
+static void
+token_give(LIMITER_INSTANCE *my_instance, LIMITER_KEY *key)
+{
+    __atomic_sub_fetch(&key->in_use, 1, __ATOMIC_RELEASE);
+    wake_waiting(my_instance, key);
+}
+
+/**
+ * Add a session to the end of the list of sessions waiting for a token. The
+ * session lock must be held.
+ *
+ * @param my_session The session
+ */
+static void
+start_waiting(LIMITER_SESSION *my_session)
+{
+    LIMITER_KEY *key = my_session->key;
+
+    atomic_add(&my_session->session->refcount, 1);
+    my_session->waiting = true;
+    my_session->next_waiting = NULL;
+
+    spinlock_acquire(&key->lock);
+    if (key->tail)
+    {
+        key->tail->next_waiting = my_session;
+    }
+    else
+    {
+        key->head = my_session;
+    }
+    key->tail = my_session;
+    key->n_waiting++;
+    spinlock_release(&key->lock);
+
+    ts_stats_add(my_session->instance->n_delayed, 1);
+}
+
+/**
+ * Check whether a query is answered with a reply that can be followed
+ *
+ * @param buffer The query
+ * @return True if the query is to hold a token until its reply ends
+ */
+static bool
+needs_token(LIMITER_SESSION *my_session, GWBUF *buffer)
+{
+    uint8_t cmd;
+
+    if (my_session->key == NULL || my_session->passthrough ||
+        gwbuf_copy_data(buffer, MYSQL_HEADER_LEN, 1, &cmd) != 1)
+    {
+        return false;
+    }
+
+    switch (cmd)
+    {
+    case MYSQL_COM_QUIT:
+    case MYSQL_COM_STMT_CLOSE:
+    case MYSQL_COM_STMT_SEND_LONG_DATA:
+        /** No reply */
+        return false;
+
+    case MYSQL_COM_BINLOG_DUMP:
+        /** The reply never ends */
+        my_session->passthrough = true;
+        return false;
+
+    default:
+        return true;
+    }
+}
+
+/**
+ * Start following the reply to a query
+ *
+ * @param my_session The session
+ * @param buffer     The query
+ */
+static void
+reply_start(LIMITER_SESSION *my_session, GWBUF *buffer)
+{
+    gwbuf_copy_data(buffer, MYSQL_HEADER_LEN, 1, &my_session->command);
+    my_session->state = REPLY_FIRST;
+    my_session->n_left = 0;
+    my_session->hdr_len = 0;
+    my_session->left = 0;
+    my_session->continued = false;
+    my_session->large = false;
+    my_session->peek_len = 0;
+}
+
+/**
+ * Get the server status of an OK packet
+ *
+ * @param ptr The payload of the packet
+ * @param len Number of bytes in ptr
+ * @return The status or 0 if the packet is too short
+ */
+static uint16_t
+ok_status(uint8_t *ptr, int len)
+{
+    int offset = 1;
+
+    for (int i = 0; i < 2; i++)
+    {
+        if (offset >= len)
+        {
+            return 0;
+        }
+
+        /** The affected rows and the last insert ID are length encoded */
+        switch (ptr[offset])
+        {
+        case 0xfc:
+            offset += 3;
+            break;
+        case 0xfd:
+            offset += 4;
+            break;
+        case 0xfe:
+            offset += 9;
+            break;
+        default:
+            offset += 1;
+            break;
+        }
+    }
+
+    return offset + 2 <= len ? gw_mysql_get_byte2(ptr + offset) : 0;
+}
+
+/**
+ * Process a complete packet of a reply
+ *
+ * @param my_session The session
+ */
+static void
+reply_packet(LIMITER_SESSION *my_session)
+{
+    uint8_t *ptr = my_session->peek;
+    uint8_t cmd = my_session->peek_len > 0 ? ptr[0] : 0;
+    bool is_eof = cmd == 0xfe && my_session->plen < 9;
+
+    switch (my_session->state)
+    {
+    case REPLY_FIRST:
+        if (cmd == 0x00 && my_session->command == MYSQL_COM_STMT_PREPARE)
+        {
+            int columns = my_session->peek_len >= 9 ? gw_mysql_get_byte2(ptr + 5) : 0;
+            int params = my_session->peek_len >= 9 ? gw_mysql_get_byte2(ptr + 7) : 0;
+
+            my_session->n_left = (params ? params + 1 : 0) + (columns ? columns + 1 : 0);
+            my_session->state = my_session->n_left ? REPLY_PREPARE : REPLY_DONE;
+        }
+        else if (cmd == 0x00)
+        {
+            uint16_t status = ok_status(ptr, my_session->peek_len);
+            my_session->state = status & MYSQL_SERVER_MORE_RESULTS_EXIST ? REPLY_FIRST : REPLY_DONE;
+        }
+        else if (cmd == 0xff)
+        {
+            my_session->state = REPLY_DONE;
+        }
+        else if (cmd == 0xfb || (cmd == 0xfe && my_session->command == MYSQL_COM_CHANGE_USER))
+        {
+            /** LOAD DATA LOCAL INFILE or an authentication switch */
+            my_session->state = REPLY_WAIT_OK;
+        }
+        else if (is_eof || my_session->command == MYSQL_COM_STATISTICS)
+        {
+            my_session->state = REPLY_DONE;
+        }
+        else
+        {
+            my_session->state = my_session->command == MYSQL_COM_FIELD_LIST ?
+                                REPLY_FIELDS : REPLY_COLUMNS;
+        }
+        break;
+
+    case REPLY_COLUMNS:
+        if (is_eof)
+        {
+            my_session->state = REPLY_ROWS;
+        }
+        else if (cmd == 0xff)
+        {
+            my_session->state = REPLY_DONE;
+        }
+        break;
+
+    case REPLY_ROWS:
+        if (is_eof)
+        {
+            uint16_t status = my_session->peek_len >= 5 ? gw_mysql_get_byte2(ptr + 3) : 0;
+            my_session->state = status & MYSQL_SERVER_MORE_RESULTS_EXIST ? REPLY_FIRST : REPLY_DONE;
+        }
+        else if (cmd == 0xff)
+        {
+            my_session->state = REPLY_DONE;
+        }
+        break;
+
+    case REPLY_FIELDS:
+        if (is_eof || cmd == 0xff)
+        {
+            my_session->state = REPLY_DONE;
+        }
+        break;
+
+    case REPLY_PREPARE:
+        if (--my_session->n_left == 0)
+        {
+            my_session->state = REPLY_DONE;
+        }
+        break;
+
+    case REPLY_WAIT_OK:
+        if (cmd == 0x00)
+        {
+            uint16_t status = ok_status(ptr, my_session->peek_len);
+            my_session->state = status & MYSQL_SERVER_MORE_RESULTS_EXIST ? REPLY_FIRST : REPLY_DONE;
+        }
+        else if (cmd == 0xff)
+        {
+            my_session->state = REPLY_DONE;
+        }
+        break;
+
+    case REPLY_DONE:
+        break;
+    }
+}
+
+/**
+ * Follow the packets of a reply
+ *
+ * @param my_session The session, its lock must be held
+ * @param reply      The part of the reply that arrived
+ */
+static void
+reply_feed(LIMITER_SESSION *my_session, GWBUF *reply)
+{
+    for (GWBUF *buffer = reply; buffer && my_session->state != REPLY_DONE; buffer = buffer->next)
+    {
+        uint8_t *ptr = GWBUF_DATA(buffer);
+        uint8_t *end = ptr + GWBUF_LENGTH(buffer);
+
+        while (ptr < end && my_session->state != REPLY_DONE)
+        {
+            if (my_session->hdr_len < MYSQL_HEADER_LEN)
+            {
+                my_session->hdr[my_session->hdr_len++] = *ptr++;
+
+                if (my_session->hdr_len == MYSQL_HEADER_LEN)
+                {
+                    my_session->plen = gw_mysql_get_byte3(my_session->hdr);
+                    my_session->left = my_session->plen;
+                    my_session->peek_len = 0;
+                    my_session->continued = my_session->large;
+                    my_session->large = my_session->plen == 0xffffff;
+                }
+            }
+            else
+            {
+                uint32_t n = MIN((uint32_t)(end - ptr), my_session->left);
+                int peek = MIN((int)n, LIMITER_PEEK_LEN - my_session->peek_len);
+
+                if (peek > 0)
+                {
+                    memcpy(my_session->peek + my_session->peek_len, ptr, peek);
+                    my_session->peek_len += peek;
+                }
+                my_session->left -= n;
+                ptr += n;
+            }
+
+            if (my_session->hdr_len == MYSQL_HEADER_LEN && my_session->left == 0)
+            {
+                /** The rest of a large packet is not a packet of its own */
+                if (!my_session->continued)
+                {
+                    reply_packet(my_session);
+                }
+                my_session->hdr_len = 0;
+            }
+        }
+    }
+}
+
+/**
+ * Route the queries of a session for as long as they can be routed. Only one
+ * thread at a time routes the queries of a session, the others leave them to it.
+ *
+ * @param my_session The session
+ */
+static void
+dispatch(LIMITER_SESSION *my_session)
+{
+    bool start_wait = false;
+    bool failed = false;
+
+    spinlock_acquire(&my_session->lock);
+
+    while (!my_session->routing && !my_session->in_flight && !my_session->waiting && my_session->head)
+    {
+        LIMITER_QUERY *query = my_session->head;
+        bool token = needs_token(my_session, query->buffer);
+
+        if (token && !my_session->has_token)
+        {
+            /** Queries that waited before this one get the free tokens first */
+            if (my_session->key->head == NULL && token_take(my_session->instance, my_session->key))
+            {
+                my_session->has_token = true;
+            }
+            else
+            {
+                start_waiting(my_session);
+                start_wait = true;
+                break;
+            }
+        }
+
+        my_session->head = query->next;
+        if (my_session->head == NULL)
+        {
+            my_session->tail = NULL;
+        }
+        my_session->n_queued--;
+
+        if (token)
+        {
+            my_session->in_flight = true;
+            reply_start(my_session, query->buffer);
+            ts_stats_add(my_session->instance->n_queries, 1);
+        }
+
+        my_session->routing = true;
+        spinlock_release(&my_session->lock);
+
+        int rc = my_session->down.routeQuery(my_session->down.instance,
+                                             my_session->down.session, query->buffer);
+        free(query);
+
+        spinlock_acquire(&my_session->lock);
+        my_session->routing = false;
+
+        if (rc == 0)
+        {
+            failed = true;
+            break;
+        }
+    }
+
+    spinlock_release(&my_session->lock);
+
+    if (start_wait)
+    {
+        /** A token may have been given back before the session started to wait */
+        wake_waiting(my_session->instance, my_session->key);
+    }
+
+    if (failed && my_session->session->client_dcb)
+    {
+        /** Routing failed, the session is closed like the protocol would do */
+        poll_fake_hangup_event(my_session->session->client_dcb);
+    }
+}
+
+/**
+ * Close a session with the filter, this is the mechanism
+ * by which a filter may cleanup data structure etc.
+ *
+ * @param instance  The filter instance data
+ * @param session   The session being closed
+ */
+static void
+closeSession(FILTER *instance, void *session)
+{
+    LIMITER_INSTANCE *my_instance = (LIMITER_INSTANCE *) instance;
+    LIMITER_SESSION *my_session = (LIMITER_SESSION *) session;
+
+    /** A waiting session holds a reference, so it is no longer waiting */
+    spinlock_acquire(&my_session->lock);
+    bool has_token = my_session->has_token;
+    my_session->has_token = false;
+    my_session->in_flight = false;
+    spinlock_release(&my_session->lock);
+
+    if (has_token)
+    {
+        token_give(my_instance, my_session->key);
+    }
+}
+
+/**
+ * Free the memory associated with the session
+ *
+ * @param instance  The filter instance
+ * @param session   The filter session
+ */
+static void
+freeSession(FILTER *instance, void *session)
+{
+    LIMITER_SESSION *my_session = (LIMITER_SESSION *) session;
+    LIMITER_QUERY *query = my_session->head;
+
+    while (query)
+    {
+        LIMITER_QUERY *next = query->next;
+        gwbuf_free(query->buffer);
+        free(query);
+        query = next;
+    }
+
+    free(session);
+}
+
+/**
+ * Set the downstream filter or router to which queries will be
+ * passed from this filter.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param downstream    The downstream filter or router.
+ */
+static void
+setDownstream(FILTER *instance, void *session, DOWNSTREAM *downstream)
+{
+    LIMITER_SESSION *my_session = (LIMITER_SESSION *) session;
+
+    my_session->down = *downstream;
+}
+
+/**
+ * Set the upstream filter or session to which results will be
+ * passed from this filter.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param upstream  The upstream filter or session.
+ */
+static void
+setUpstream(FILTER *instance, void *session, UPSTREAM *upstream)
+{
+    LIMITER_SESSION *my_session = (LIMITER_SESSION *) session;
+
+    my_session->up = *upstream;
+}
+
+/**
+ * The routeQuery entry point. The query is routed if the session has no
+ * queries waiting and a token can be taken, otherwise it waits.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param queue     The query data
+ */
+static int
+routeQuery(FILTER *instance, void *session, GWBUF *queue)
+{
+    LIMITER_SESSION *my_session = (LIMITER_SESSION *) session;
+
+    if (my_session->key == NULL)
+    {
+        return my_session->down.routeQuery(my_session->down.instance,
+                                           my_session->down.session, queue);
+    }
+
+    spinlock_acquire(&my_session->lock);
+    bool direct = my_session->passthrough ||
+                  (my_session->in_flight && my_session->state == REPLY_WAIT_OK);
+    spinlock_release(&my_session->lock);
+
+    if (direct)
+    {
+        /** The data of LOAD DATA LOCAL INFILE or an authentication exchange */
+        return my_session->down.routeQuery(my_session->down.instance,
+                                           my_session->down.session, queue);
+    }
+
+    LIMITER_QUERY *query = malloc(sizeof(LIMITER_QUERY));
+
+    if (query == NULL)
+    {
+        MXS_ERROR("limiter: Memory allocation failed.");
+        gwbuf_free(queue);
+        return 0;
+    }
+
+    query->buffer = queue;
+    query->next = NULL;
+
+    spinlock_acquire(&my_session->lock);
+    if (my_session->tail)
+    {
+        my_session->tail->next = query;
+    }
+    else
+    {
+        my_session->head = query;
+    }
+    my_session->tail = query;
+    my_session->n_queued++;
+    spinlock_release(&my_session->lock);
+
+    dispatch(my_session);
+    return 1;
+}
+
+/**
+ * The clientReply entry point. When the reply to the query that holds the
+ * token ends, the token is given back and the next query of the session,
+ * if any, is routed.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param reply     The reply
+ */
+static int
+clientReply(FILTER *instance, void *session, GWBUF *reply)
+{
+    LIMITER_INSTANCE *my_instance = (LIMITER_INSTANCE *) instance;
+    LIMITER_SESSION *my_session = (LIMITER_SESSION *) session;
+    bool done = false;
+
+    if (my_session->key)
+    {
+        spinlock_acquire(&my_session->lock);
+        if (my_session->in_flight)
+        {
+            reply_feed(my_session, reply);
+
+            if (my_session->state == REPLY_DONE)
+            {
+                my_session->in_flight = false;
+                my_session->has_token = false;
+                done = true;
+            }
+        }
+        spinlock_release(&my_session->lock);
+    }
+
+    /* Pass the result upstream */
+    int rc = my_session->up.clientReply(my_session->up.instance,
+                                        my_session->up.session, reply);
+
+    if (done)
+    {
+        token_give(my_instance, my_session->key);
+        dispatch(my_session);
+    }
+
+    return rc;
+}
+
+/**
+ * Diagnostics routine
+ *
+ * If fsession is NULL then print diagnostics on the filter
+ * instance as a whole, otherwise print diagnostics for the
+ * particular session.
+ *
+ * @param   instance    The filter instance
+ * @param   fsession    Filter session, may be NULL
+ * @param   dcb     The DCB for diagnostic output
+ */
+static void
+diagnostic(FILTER *instance, void *fsession, DCB *dcb)
+{
+    LIMITER_INSTANCE *my_instance = (LIMITER_INSTANCE *) instance;
+    LIMITER_SESSION *my_session = (LIMITER_SESSION *) fsession;
+
+    dcb_printf(dcb, "\t\tMaximum concurrency            %d per %s\n",
+               my_instance->max_concurrency,
+               my_instance->scope == LIMITER_SCOPE_USER ? "user" : "service");
+    if (my_instance->user)
+    {
+        dcb_printf(dcb, "\t\tLimited user                   %s\n", my_instance->user);
+    }
+    dcb_printf(dcb, "\t\tQueries                        %ld\n",
+               (long)ts_stats_sum(my_instance->n_queries));
+    dcb_printf(dcb, "\t\tDelayed queries                %ld\n",
+               (long)ts_stats_sum(my_instance->n_delayed));
+
+    if (my_session)
+    {
+        dcb_printf(dcb, "\t\tQueued queries of the session  %d\n", my_session->n_queued);
+    }
+    else
+    {
+        spinlock_acquire(&my_instance->lock);
+        LIMITER_KEY *keys = my_instance->all_keys;
+        spinlock_release(&my_instance->lock);
+
+        /** The keys are never freed and new ones are added to the head */
+        for (LIMITER_KEY *key = keys; key; key = key->next)
+        {
+            dcb_printf(dcb, "\t\t%-30s %d running, %d waiting\n", key->name,
+                       key->in_use, key->n_waiting);
+        }
+    }
+}
@@ -34,6 +34,12 @@
  * is defined and valid, the matching entry point function in Lua will be called.
  * The same holds true for session script apart from no calls to createInstance
  * or diagnostic being made for the session script.
+ *
+ * The scripts are compiled once when the instance is created and the states
+ * are loaded from the compiled chunks. By default all sessions share one
+ * global state and the calls to it are serialized. With per_thread=true each
+ * worker thread has its own global state, created when the thread first uses
+ * it, and the calls to it are not locked. The states do not share any data.
  */
 
 #include <skygw_types.h>
@@ -44,6 +50,9 @@
 #include <filter.h>
 #include <session.h>
 #include <modutil.h>
+#include <atomic.h>
+#include <platform.h>
+#include "maxconfig.h"
 #include "lua.h"
 #include "lualib.h"
 #include "lauxlib.h"
@@ -112,6 +121,10 @@ GetModuleObject()
 
 static int id_pool = 0;
 
+/** The index of the global state of the current thread in per_thread mode */
+static thread_local int lua_thread_id = -1;
+static int lua_n_threads = 0;
+
 /**
  * Push an unique integer to the Lua state's stack
  * @param state Lua state
@@ -123,6 +136,27 @@ static int id_gen(lua_State* state)
     return 1;
 }
 
+/**
+ * Push the index of the global state of the current thread to the Lua
+ * state's stack
+ * @param state Lua state
+ * @return Always 1
+ */
+static int thread_id(lua_State* state)
+{
+    lua_pushinteger(state, lua_thread_id);
+    return 1;
+}
+
+/**
+ * A compiled Lua script
+ */
+typedef struct
+{
+    char* code;
+    size_t size;
+} LUA_CHUNK;
+
 /**
  * The Lua filter instance.
  */
@@ -131,7 +165,12 @@ typedef struct
     lua_State* global_lua_state;
     char* global_script;
     char* session_script;
-    SPINLOCK lock;
+    LUA_CHUNK global_chunk; /* The compiled global script */
+    LUA_CHUNK session_chunk; /* The compiled session script */
+    bool per_thread; /* Use a global state per worker thread */
+    int n_thread_states;
+    lua_State** thread_states; /* The global states of the threads */
+    SPINLOCK lock; /* Protects global_lua_state */
 } LUA_INSTANCE;
 
 /**
@@ -158,6 +197,187 @@ ModuleInit()
 }
 /*lint +e14 */
 
+/**
+ * Append a part of a compiled chunk to the chunk buffer
+ * @param state Lua state
+ * @param data Compiled code
+ * @param size Size of the code
+ * @param ud The LUA_CHUNK being written
+ * @return 0 on success, 1 on memory allocation failure
+ */
+static int chunk_writer(lua_State* state, const void* data, size_t size, void* ud)
+{
+    LUA_CHUNK* chunk = (LUA_CHUNK*) ud;
+    char* code = realloc(chunk->code, chunk->size + size);
+
+    if (code == NULL)
+    {
+        return 1;
+    }
+
+    memcpy(code + chunk->size, data, size);
+    chunk->code = code;
+    chunk->size += size;
+    return 0;
+}
+
+/**
+ * Compile a script into a chunk
+ * @param path Path to the script
+ * @param chunk The chunk to compile the script into
+ * @return True if the script was compiled
+ */
+static bool compile_script(const char* path, LUA_CHUNK* chunk)
+{
+    lua_State* state = luaL_newstate();
+    bool rval = false;
+
+    if (state == NULL)
+    {
+        MXS_ERROR("Unable to initialize new Lua state.");
+        return false;
+    }
+
+    if (luaL_loadfile(state, path))
+    {
+        MXS_ERROR("luafilter: Failed to load script at '%s': %s.",
+                  path, lua_tostring(state, -1));
+    }
+#if LUA_VERSION_NUM >= 503
+    else if (lua_dump(state, chunk_writer, chunk, 0))
+#else
+    else if (lua_dump(state, chunk_writer, chunk))
+#endif
+    {
+        MXS_ERROR("luafilter: Failed to compile script at '%s'.", path);
+    }
+    else
+    {
+        rval = true;
+    }
+
+    lua_close(state);
+    return rval;
+}
+
+/**
+ * Create a new Lua state and execute a compiled script in it on a global level
+ * @param chunk The compiled script
+ * @param scope Scope of the script, global or session
+ * @param path Path of the script
+ * @return The new state or NULL on error
+ */
+static lua_State* load_chunk(LUA_CHUNK* chunk, const char* scope, const char* path)
+{
+    lua_State* state = luaL_newstate();
+
+    if (state == NULL)
+    {
+        MXS_ERROR("Unable to initialize new Lua state.");
+        return NULL;
+    }
+
+    luaL_openlibs(state);
+
+    if (luaL_loadbuffer(state, chunk->code, chunk->size, path) ||
+        lua_pcall(state, 0, 0, 0))
+    {
+        MXS_ERROR("luafilter: Failed to execute %s script at '%s': %s.",
+                  scope, path, lua_tostring(state, -1));
+        lua_close(state);
+        state = NULL;
+    }
+
+    return state;
+}
+
+/**
+ * Prepare a global state: export the C functions of per_thread mode and
+ * call the createInstance function of the script.
+ * @param my_instance The filter instance
+ * @param state The global state
+ */
+static void init_global_state(LUA_INSTANCE* my_instance, lua_State* state)
+{
+    if (my_instance->per_thread)
+    {
+        lua_pushcfunction(state, id_gen);
+        lua_setglobal(state, "id_gen");
+        lua_pushcfunction(state, thread_id);
+        lua_setglobal(state, "thread_id");
+    }
+
+    lua_getglobal(state, "createInstance");
+    if (lua_pcall(state, 0, 0, 0))
+    {
+        MXS_WARNING("luafilter: Failed to get global variable 'createInstance':  %s."
+                    " The createInstance entry point will not be called for the global script.",
+                    lua_tostring(state, -1));
+    }
+}
+
+/**
+ * Get the global state for the current thread. In per_thread mode the state
+ * of the thread is created on first use. If the thread has no state of its
+ * own, the shared state is locked and returned.
+ * @param my_instance The filter instance
+ * @return The global state, release it with release_global_state
+ */
+static lua_State* get_global_state(LUA_INSTANCE* my_instance)
+{
+    lua_State* state = my_instance->global_lua_state;
+
+    if (my_instance->per_thread)
+    {
+        if (lua_thread_id == -1)
+        {
+            lua_thread_id = atomic_add(&lua_n_threads, 1);
+        }
+
+        if (lua_thread_id < my_instance->n_thread_states)
+        {
+            if (my_instance->thread_states[lua_thread_id] == NULL)
+            {
+                lua_State* thread_state = load_chunk(&my_instance->global_chunk, "global",
+                                                     my_instance->global_script);
+                if (thread_state)
+                {
+                    init_global_state(my_instance, thread_state);
+                }
+                else
+                {
+                    /** Use the shared state from now on */
+                    thread_state = my_instance->global_lua_state;
+                }
+
+                my_instance->thread_states[lua_thread_id] = thread_state;
+            }
+
+            state = my_instance->thread_states[lua_thread_id];
+        }
+    }
+
+    if (state == my_instance->global_lua_state)
+    {
+        spinlock_acquire(&my_instance->lock);
+    }
+
+    return state;
+}
+
+/**
+ * Release a state returned by get_global_state
+ * @param my_instance The filter instance
+ * @param state The global state
+ */
+static void release_global_state(LUA_INSTANCE* my_instance, lua_State* state)
+{
+    if (state == my_instance->global_lua_state)
+    {
+        spinlock_release(&my_instance->lock);
+    }
+}
+
 /**
  * Create a new instance of the Lua filter.
  *
@@ -190,6 +410,10 @@ createInstance(char **options, FILTER_PARAMETER **params)
         {
             error = (my_instance->session_script = strdup(params[i]->value)) == NULL;
         }
+        else if (strcmp(params[i]->name, "per_thread") == 0)
+        {
+            my_instance->per_thread = config_truth_value(params[i]->value);
+        }
         else if (!filter_standard_parameter(params[i]->name))
         {
             MXS_ERROR("Unexpected parameter '%s'", params[i]->name);
@@ -197,46 +421,45 @@ createInstance(char **options, FILTER_PARAMETER **params)
         }
     }
 
-    if (error)
+    if (!error && my_instance->session_script)
     {
-        free(my_instance->global_script);
-        free(my_instance->session_script);
-        free(my_instance);
-        return NULL;
+        error = !compile_script(my_instance->session_script, &my_instance->session_chunk);
     }
 
-    if (my_instance->global_script)
+    if (!error && my_instance->global_script)
     {
-        if ((my_instance->global_lua_state = luaL_newstate()))
+        if (!compile_script(my_instance->global_script, &my_instance->global_chunk) ||
+            (my_instance->global_lua_state = load_chunk(&my_instance->global_chunk, "global",
+                                                        my_instance->global_script)) == NULL)
+        {
+            error = true;
+        }
+        else
         {
-            luaL_openlibs(my_instance->global_lua_state);
+            init_global_state(my_instance, my_instance->global_lua_state);
 
-            if (luaL_dofile(my_instance->global_lua_state, my_instance->global_script))
+            if (my_instance->per_thread)
             {
-                MXS_ERROR("luafilter: Failed to execute global script at '%s':%s.",
-                          my_instance->global_script, lua_tostring(my_instance->global_lua_state, -1));
-                free(my_instance->global_script);
-                free(my_instance->session_script);
-                free(my_instance);
-                my_instance = NULL;
-            }
-            else if (my_instance->global_lua_state)
-            {
-                lua_getglobal(my_instance->global_lua_state, "createInstance");
-                if (lua_pcall(my_instance->global_lua_state, 0, 0, 0))
-                {
-                    MXS_WARNING("luafilter: Failed to get global variable 'createInstance':  %s."
-                                " The createInstance entry point will not be called for the global script.",
-                                lua_tostring(my_instance->global_lua_state, -1));
-                }
+                /** Worker threads beyond this use the shared state */
+                my_instance->n_thread_states = config_threadcount() + 1;
+                error = (my_instance->thread_states =
+                             calloc(my_instance->n_thread_states, sizeof(lua_State*))) == NULL;
             }
         }
-        else
+    }
+
+    if (error)
+    {
+        if (my_instance->global_lua_state)
         {
-            MXS_ERROR("Unable to initialize new Lua state.");
-            free(my_instance);
-            my_instance = NULL;
+            lua_close(my_instance->global_lua_state);
         }
+        free(my_instance->global_chunk.code);
+        free(my_instance->session_chunk.code);
+        free(my_instance->global_script);
+        free(my_instance->session_script);
+        free(my_instance);
+        return NULL;
     }
 
     return (FILTER *) my_instance;
@@ -273,15 +496,9 @@ static void * newSession(FILTER *instance, SESSION *session)
 
     if (my_instance->session_script)
     {
-        my_session->lua_state = luaL_newstate();
-        luaL_openlibs(my_session->lua_state);
-
-        if (luaL_dofile(my_session->lua_state, my_instance->session_script))
+        if ((my_session->lua_state = load_chunk(&my_instance->session_chunk, "session",
+                                                my_instance->session_script)) == NULL)
         {
-            MXS_ERROR("luafilter: Failed to execute session script at '%s': %s.",
-                      my_instance->session_script,
-                      lua_tostring(my_session->lua_state, -1));
-            lua_close(my_session->lua_state);
             free(my_session);
             my_session = NULL;
         }
@@ -302,15 +519,15 @@ static void * newSession(FILTER *instance, SESSION *session)
 
     if (my_session && my_instance->global_lua_state)
     {
-        spinlock_acquire(&my_instance->lock);
-        lua_getglobal(my_instance->global_lua_state, "newSession");
-        if (lua_pcall(my_instance->global_lua_state, 0, 0, 0))
+        lua_State* state = get_global_state(my_instance);
+        lua_getglobal(state, "newSession");
+        if (lua_pcall(state, 0, 0, 0))
         {
             MXS_WARNING("luafilter: Failed to get global variable 'newSession': '%s'."
                         " The newSession entry point will not be called for the global script.",
-                        lua_tostring(my_instance->global_lua_state, -1));
+                        lua_tostring(state, -1));
         }
-        spinlock_release(&my_instance->lock);
+        release_global_state(my_instance, state);
     }
 
     return my_session;
@@ -345,15 +562,15 @@ static void closeSession(FILTER *instance, void *session)
 
     if (my_instance->global_lua_state)
     {
-        spinlock_acquire(&my_instance->lock);
-        lua_getglobal(my_instance->global_lua_state, "closeSession");
-        if (lua_pcall(my_instance->global_lua_state, 0, 0, 0))
+        lua_State* state = get_global_state(my_instance);
+        lua_getglobal(state, "closeSession");
+        if (lua_pcall(state, 0, 0, 0))
         {
             MXS_WARNING("luafilter: Failed to get global variable 'closeSession': '%s'."
                         " The closeSession entry point will not be called for the global script.",
-                        lua_tostring(my_instance->global_lua_state, -1));
+                        lua_tostring(state, -1));
         }
-        spinlock_release(&my_instance->lock);
+        release_global_state(my_instance, state);
     }
 }
 
@@ -423,14 +640,14 @@ static int clientReply(FILTER *instance, void *session, GWBUF *queue)
     }
     if (my_instance->global_lua_state)
     {
-        spinlock_acquire(&my_instance->lock);
-        lua_getglobal(my_instance->global_lua_state, "clientReply");
-        if (lua_pcall(my_instance->global_lua_state, 0, 0, 0))
+        lua_State* state = get_global_state(my_instance);
+        lua_getglobal(state, "clientReply");
+        if (lua_pcall(state, 0, 0, 0))
         {
             MXS_ERROR("luafilter: Global scope call to 'clientReply' failed: '%s'.",
-                      lua_tostring(my_session->lua_state, -1));
+                      lua_tostring(state, -1));
         }
-        spinlock_release(&my_instance->lock);
+        release_global_state(my_instance, state);
     }
 
     return my_session->up.clientReply(my_session->up.instance,
@@ -497,33 +714,32 @@ static int routeQuery(FILTER *instance, void *session, GWBUF *queue)
             spinlock_release(&my_session->lock);
         }
 
-        if (my_instance->global_lua_state)
+        if (fullquery && my_instance->global_lua_state)
         {
-            spinlock_acquire(&my_instance->lock);
-            lua_getglobal(my_instance->global_lua_state, "routeQuery");
-            lua_pushlstring(my_instance->global_lua_state, fullquery, strlen(fullquery));
-            if (lua_pcall(my_instance->global_lua_state, 1, 0, 0))
+            lua_State* state = get_global_state(my_instance);
+            lua_getglobal(state, "routeQuery");
+            lua_pushlstring(state, fullquery, strlen(fullquery));
+            if (lua_pcall(state, 1, 0, 0))
             {
                 MXS_ERROR("luafilter: Global scope call to 'routeQuery' failed: '%s'.",
-                          lua_tostring(my_session->lua_state, -1));
+                          lua_tostring(state, -1));
             }
-            else if (lua_gettop(my_instance->global_lua_state))
+            else if (lua_gettop(state))
             {
-                if (lua_isstring(my_instance->global_lua_state, -1))
+                if (lua_isstring(state, -1))
                 {
                     if (forward)
                     {
                         gwbuf_free(forward);
                     }
-                    forward = modutil_create_query((char*)
-                                                   lua_tostring(my_instance->global_lua_state, -1));
+                    forward = modutil_create_query((char*) lua_tostring(state, -1));
                 }
-                else if (lua_isboolean(my_instance->global_lua_state, -1))
+                else if (lua_isboolean(state, -1))
                 {
-                    route = lua_toboolean(my_instance->global_lua_state, -1);
+                    route = lua_toboolean(state, -1);
                 }
             }
-            spinlock_release(&my_instance->lock);
+            release_global_state(my_instance, state);
         }
 
         free(fullquery);
@@ -587,5 +803,9 @@ static void diagnostic(FILTER *instance, void *fsession, DCB *dcb)
         {
             dcb_printf(dcb, "Session script: %s\n", my_instance->session_script);
         }
+        if (my_instance->per_thread)
+        {
+            dcb_printf(dcb, "Global state: one per thread\n");
+        }
     }
 }
@@ -46,6 +46,10 @@
  *      ssl_CA_cert     Path to the CA certificate in PEM format
  *      ssl_client_cert Path to the client cerificate in PEM format
  *      ssl_client_key  Path to the client public key in PEM format
+ *      queue_size      The maximum number of messages waiting to be published
+ *      on_full         What to do when the queue is full, drop or block
+ *      batch_size      The maximum number of messages published at a time
+ *      confirm         Use publisher confirms
  *
  * The logging trigger levels are:
  *      all     Log everything
@@ -55,6 +59,11 @@
  *      object  Trigger on a particular database object (table or view)
  *@endverbatim
  * See the individual struct documentations for logging trigger parameters
+ *
+ * The messages are published by a thread of the filter instance. The sessions
+ * add the messages to a bounded lock-free queue that the thread takes them
+ * from in batches. The thread also reconnects to the server, so the sessions
+ * never wait for the server unless on_full=block is used.
  */
 #include <stdio.h>
 #include <fcntl.h>
@@ -64,7 +73,9 @@
 #include <string.h>
 #include <time.h>
 #include <sys/time.h>
+#include <semaphore.h>
 #include <atomic.h>
+#include <thread.h>
 #include <amqp.h>
 #include <amqp_framing.h>
 #include <amqp_tcp_socket.h>
@@ -74,7 +85,6 @@
 #include <query_classifier.h>
 #include <spinlock.h>
 #include <session.h>
-#include <housekeeper.h>
 
 MODULE_INFO info =
 {
@@ -86,7 +96,11 @@ MODULE_INFO info =
 
 static char *version_str = "V1.0.2";
 static int uid_gen;
-static int hktask_id = 0;
+
+#define MQ_DEFAULT_QUEUE_SIZE 65536
+#define MQ_DEFAULT_BATCH_SIZE 128
+/** Seconds to wait for the confirmation of a batch */
+#define MQ_CONFIRM_TIMEOUT    5
 /*
  * The filter entry points
  */
@@ -121,9 +135,33 @@ typedef struct mqmessage_t
 {
     amqp_basic_properties_t *prop;
     char *msg;
-    struct mqmessage_t *next;
+    uint64_t queued; /*< When the message was queued, in microseconds */
 } mqmessage;
 
+/**
+ * A slot of the message queue. The sequence number tells whether the slot
+ * is free for the producer or full for the consumer of the position.
+ */
+typedef struct mqslot_t
+{
+    uint32_t seq;
+    mqmessage *msg;
+} MQ_SLOT;
+
+/**
+ * A bounded multi-producer single-consumer queue of messages. The sessions
+ * add messages to it and the publisher thread takes them from it.
+ */
+typedef struct mqqueue_t
+{
+    MQ_SLOT *slots;
+    uint32_t mask; /*< Number of slots minus one, the number is a power of two */
+    uint32_t tail; /*< The next position to add a message to */
+    uint32_t head; /*< The next position to take a message from */
+    bool sleeping; /*< The publisher is waiting for messages */
+    sem_t sem;
+} MQ_QUEUE;
+
 /**
  *Logging trigger levels
  */
@@ -183,6 +221,13 @@ typedef struct object_trigger_t
     int size;
 } OBJ_TRIG;
 
+/** What is done with a message when the queue is full */
+enum mq_on_full_t
+{
+    MQ_DROP, /*< The message is dropped */
+    MQ_BLOCK /*< The session waits until the message fits in the queue */
+};
+
 /**
  * Statistics for the mqfilter.
  */
@@ -191,6 +236,11 @@ typedef struct mqstats_t
     int n_msg; /*< Total number of messages */
     int n_sent; /*< Number of sent messages */
     int n_queued; /*< Number of unsent messages */
+    int n_dropped; /*< Number of messages dropped because the queue was full */
+    int n_batches; /*< Number of published batches */
+    int n_failed; /*< Number of batches that were not published or confirmed */
+    uint64_t latency_total; /*< Total time from queueing to publishing, in microseconds */
+    uint64_t latency_max; /*< Longest time from queueing to publishing */
 } MQSTATS;
 
 /**
@@ -227,8 +277,13 @@ typedef struct
     int rconn_intv; /**delay for reconnects, in seconds*/
     time_t last_rconn; /**last reconnect attempt*/
     SPINLOCK rconn_lock;
-    SPINLOCK msg_lock;
-    mqmessage* messages;
+    MQ_QUEUE queue_msg; /**Messages waiting to be published*/
+    enum mq_on_full_t on_full;
+    int batch_size;
+    bool confirm; /**Wait for the server to confirm the messages*/
+    uint64_t delivery_tag; /**Tag of the last published message*/
+    uint64_t acked_tag; /**Tag of the last confirmed message*/
+    THREAD publisher;
     enum log_trigger_t trgtype;
     SRC_TRIG* src_trg;
     SHM_TRIG* shm_trg;
@@ -255,7 +310,8 @@ typedef struct
     bool was_query; /**True if the previous routeQuery call had valid content*/
 } MQ_SESSION;
 
-void sendMessage(void* data);
+static bool mq_queue_init(MQ_QUEUE *queue, int size);
+static void mq_publisher(void* data);
 
 /**
  * Implementation of the mandatory version entry point
@@ -415,11 +471,22 @@ init_conn(MQ_INSTANCE *my_instance)
         }
     }
 
-    if (my_instance->queue)
+    if (my_instance->confirm)
     {
+        amqp_confirm_select(my_instance->conn, my_instance->channel);
+        reply = amqp_get_rpc_reply(my_instance->conn);
+        if (reply.reply_type != AMQP_RESPONSE_NORMAL)
+        {
+            MXS_ERROR("Failed to enable publisher confirms.");
+            goto cleanup;
+        }
+        /** The delivery tags start from one on a new channel */
+        my_instance->delivery_tag = 0;
+        my_instance->acked_tag = 0;
+    }
 
-
-
+    if (my_instance->queue)
+    {
         amqp_queue_declare(my_instance->conn, my_instance->channel,
                            amqp_cstring_bytes(my_instance->queue),
                            0, 1, 0, 0,
@@ -507,12 +574,12 @@ createInstance(char **options, FILTER_PARAMETER **params)
     int paramcount = 0, parammax = 64, i = 0, x = 0, arrsize = 0;
     FILTER_PARAMETER** paramlist;
     char** arr = NULL;
-    char taskname[512];
 
     if ((my_instance = calloc(1, sizeof(MQ_INSTANCE))))
     {
+        int queue_size = MQ_DEFAULT_QUEUE_SIZE;
+
         spinlock_init(&my_instance->rconn_lock);
-        spinlock_init(&my_instance->msg_lock);
         uid_gen = 0;
         paramlist = malloc(sizeof(FILTER_PARAMETER*) * 64);
 
@@ -530,6 +597,8 @@ createInstance(char **options, FILTER_PARAMETER **params)
         my_instance->trgtype = TRG_ALL;
         my_instance->log_all = false;
         my_instance->strict_logging = true;
+        my_instance->on_full = MQ_DROP;
+        my_instance->batch_size = MQ_DEFAULT_BATCH_SIZE;
 
         for (i = 0; params[i]; i++)
         {
@@ -585,6 +654,41 @@ createInstance(char **options, FILTER_PARAMETER **params)
 
                 my_instance->exchange_type = strdup(params[i]->value);
             }
+            else if (!strcmp(params[i]->name, "queue_size"))
+            {
+                if ((queue_size = atoi(params[i]->value)) <= 0)
+                {
+                    MXS_ERROR("Invalid value for 'queue_size': %s.", params[i]->value);
+                    queue_size = MQ_DEFAULT_QUEUE_SIZE;
+                }
+            }
+            else if (!strcmp(params[i]->name, "batch_size"))
+            {
+                if ((my_instance->batch_size = atoi(params[i]->value)) <= 0)
+                {
+                    MXS_ERROR("Invalid value for 'batch_size': %s.", params[i]->value);
+                    my_instance->batch_size = MQ_DEFAULT_BATCH_SIZE;
+                }
+            }
+            else if (!strcmp(params[i]->name, "on_full"))
+            {
+                if (!strcmp(params[i]->value, "block"))
+                {
+                    my_instance->on_full = MQ_BLOCK;
+                }
+                else if (!strcmp(params[i]->value, "drop"))
+                {
+                    my_instance->on_full = MQ_DROP;
+                }
+                else
+                {
+                    MXS_ERROR("Unknown option for 'on_full': %s.", params[i]->value);
+                }
+            }
+            else if (!strcmp(params[i]->name, "confirm"))
+            {
+                my_instance->confirm = config_truth_value(params[i]->value);
+            }
             else if (!strcmp(params[i]->name, "logging_trigger"))
             {
 
@@ -784,11 +888,27 @@ createInstance(char **options, FILTER_PARAMETER **params)
             amqp_set_initialize_ssl_library(0);
         }
 
+        if (!mq_queue_init(&my_instance->queue_msg, queue_size))
+        {
+            MXS_ERROR("Cannot allocate enough memory.");
+            free(my_instance);
+            return NULL;
+        }
+
         /**Connect to the server*/
-        init_conn(my_instance);
+        if (!init_conn(my_instance))
+        {
+            my_instance->conn_stat = AMQP_STATUS_SOCKET_ERROR;
+        }
+
+        if (thread_start(&my_instance->publisher, mq_publisher, my_instance) == NULL)
+        {
+            MXS_ERROR("Failed to start the message publishing thread.");
+            free(my_instance->queue_msg.slots);
+            free(my_instance);
+            return NULL;
+        }
 
-        snprintf(taskname, 511, "mqtask%d", atomic_add(&hktask_id, 1));
-        hktask_add(taskname, sendMessage, (void*) my_instance, 5);
         if (arr)
         {
             for (int x = 0; x < arrsize; x++)
@@ -844,103 +964,331 @@ int declareQueue(MQ_INSTANCE *my_instance, MQ_SESSION* my_session, char* qname)
 }
 
 /**
- * Broadcasts a message on the message stack to the RabbitMQ server
- * and frees the allocated memory if successful. This function is only called by
- * the housekeeper thread.
- * @param data MQfilter instance
+ * Get the time of a monotonic clock in microseconds
+ * @return The current time
  */
-void sendMessage(void* data)
+static uint64_t mq_now()
 {
-    MQ_INSTANCE *instance = (MQ_INSTANCE*) data;
-    mqmessage *tmp;
-    int err_num = AMQP_STATUS_OK;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-    spinlock_acquire(&instance->rconn_lock);
-    if (instance->conn_stat != AMQP_STATUS_OK)
+/**
+ * Initialize a message queue
+ * @param queue The queue
+ * @param size Minimum number of messages the queue can hold
+ * @return True on success
+ */
+static bool mq_queue_init(MQ_QUEUE *queue, int size)
+{
+    uint32_t nslots = 1;
+
+    while (nslots < (uint32_t)size)
     {
-        if (difftime(time(NULL), instance->last_rconn) > instance->rconn_intv)
-        {
-            instance->last_rconn = time(NULL);
+        nslots <<= 1;
+    }
 
-            if (init_conn(instance))
-            {
-                instance->rconn_intv = 1.0;
-                instance->conn_stat = AMQP_STATUS_OK;
-            }
-            else
+    if ((queue->slots = malloc(nslots * sizeof(MQ_SLOT))) == NULL)
+    {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < nslots; i++)
+    {
+        queue->slots[i].seq = i;
+        queue->slots[i].msg = NULL;
+    }
+
+    queue->mask = nslots - 1;
+    queue->head = 0;
+    queue->tail = 0;
+    queue->sleeping = false;
+    sem_init(&queue->sem, 0, 0);
+    return true;
+}
+
+/**
+ * Add a message to the queue. Any thread can add messages.
+ * @param queue The queue
+ * @param msg The message
+ * @return True if the message was added, false if the queue is full
+ */
+static bool mq_queue_push(MQ_QUEUE *queue, mqmessage *msg)
+{
+    uint32_t pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    MQ_SLOT *slot;
+
+    while (true)
+    {
+        slot = &queue->slots[pos & queue->mask];
+        int32_t diff = (int32_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&queue->tail, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
             {
-                instance->rconn_intv += 5.0;
-                MXS_ERROR("Failed to reconnect to the MQRabbit server ");
+                break;
             }
         }
-        err_num = instance->conn_stat;
+        else if (diff < 0)
+        {
+            return false;
+        }
+        else
+        {
+            pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+        }
     }
-    spinlock_release(&instance->rconn_lock);
 
-    if (err_num != AMQP_STATUS_OK)
+    slot->msg = msg;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    if (__atomic_load_n(&queue->sleeping, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&queue->sleeping, false, __ATOMIC_SEQ_CST))
     {
-        /** No connection to the broker */
-        return;
+        sem_post(&queue->sem);
     }
 
-    spinlock_acquire(&instance->msg_lock);
-    tmp = instance->messages;
+    return true;
+}
 
-    if (tmp == NULL)
+/**
+ * Take the oldest message from the queue. Only the publisher thread takes
+ * messages.
+ * @param queue The queue
+ * @return The message or NULL if the queue is empty
+ */
+static mqmessage* mq_queue_pop(MQ_QUEUE *queue)
+{
+    MQ_SLOT *slot = &queue->slots[queue->head & queue->mask];
+    mqmessage *msg = NULL;
+
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == queue->head + 1)
     {
-        spinlock_release(&instance->msg_lock);
-        return;
+        msg = slot->msg;
+        __atomic_store_n(&slot->seq, queue->head + queue->mask + 1, __ATOMIC_RELEASE);
+        queue->head++;
+    }
+
+    return msg;
+}
+
+/**
+ * Wait until messages are added to the queue or a second has passed.
+ * @param queue The queue
+ */
+static void mq_queue_wait(MQ_QUEUE *queue)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += 1;
+
+    __atomic_store_n(&queue->sleeping, true, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&queue->slots[queue->head & queue->mask].seq, __ATOMIC_ACQUIRE) != queue->head + 1)
+    {
+        sem_timedwait(&queue->sem, &ts);
+    }
+
+    __atomic_store_n(&queue->sleeping, false, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Reconnect to the server if the connection has failed and enough time has
+ * passed since the last attempt. The caller must hold rconn_lock.
+ * @param instance MQfilter instance
+ * @return True if the connection is usable
+ */
+static bool mq_reconnect(MQ_INSTANCE *instance)
+{
+    if (instance->conn_stat != AMQP_STATUS_OK &&
+        difftime(time(NULL), instance->last_rconn) > instance->rconn_intv)
+    {
+        instance->last_rconn = time(NULL);
+
+        if (init_conn(instance))
+        {
+            instance->rconn_intv = 1.0;
+            instance->conn_stat = AMQP_STATUS_OK;
+        }
+        else
+        {
+            instance->rconn_intv += 5.0;
+            MXS_ERROR("Failed to reconnect to the MQRabbit server ");
+        }
+    }
+
+    return instance->conn_stat == AMQP_STATUS_OK;
+}
+
+/**
+ * Wait for the server to confirm the published messages. The caller must
+ * hold rconn_lock.
+ * @param instance MQfilter instance
+ * @return True if all messages were acknowledged
+ */
+static bool mq_wait_confirms(MQ_INSTANCE *instance)
+{
+    struct timeval timeout = {MQ_CONFIRM_TIMEOUT, 0};
+    bool rval = true;
+
+    while (rval && instance->acked_tag < instance->delivery_tag)
+    {
+        amqp_frame_t frame;
+        int rc = amqp_simple_wait_frame_noblock(instance->conn, &frame, &timeout);
+
+        if (rc != AMQP_STATUS_OK)
+        {
+            MXS_ERROR("Failed to receive the publisher confirms: %s", amqp_error_string2(rc));
+            instance->conn_stat = rc;
+            rval = false;
+        }
+        else if (frame.frame_type == AMQP_FRAME_METHOD)
+        {
+            switch (frame.payload.method.id)
+            {
+                case AMQP_BASIC_ACK_METHOD:
+                {
+                    amqp_basic_ack_t *ack = (amqp_basic_ack_t*) frame.payload.method.decoded;
+                    if (ack->delivery_tag > instance->acked_tag)
+                    {
+                        instance->acked_tag = ack->delivery_tag;
+                    }
+                }
+                break;
+
+                case AMQP_BASIC_NACK_METHOD:
+                    /** The batch is published again */
+                    instance->acked_tag = instance->delivery_tag;
+                    rval = false;
+                    break;
+
+                case AMQP_CHANNEL_CLOSE_METHOD:
+                case AMQP_CONNECTION_CLOSE_METHOD:
+                    MXS_ERROR("The RabbitMQ server closed the connection.");
+                    instance->conn_stat = AMQP_STATUS_CONNECTION_CLOSED;
+                    rval = false;
+                    break;
+
+                default:
+                    break;
+            }
+        }
     }
 
-    instance->messages = instance->messages->next;
-    spinlock_release(&instance->msg_lock);
+    return rval;
+}
+
+/**
+ * Publish a batch of messages and, with publisher confirms, wait until the
+ * server has confirmed them.
+ * @param instance MQfilter instance
+ * @param batch The messages
+ * @param n Number of messages
+ * @return True if the batch was published, false if it should be published again
+ */
+static bool mq_publish_batch(MQ_INSTANCE *instance, mqmessage **batch, int n)
+{
+    bool rval = false;
 
-    while (tmp)
+    spinlock_acquire(&instance->rconn_lock);
+
+    if (mq_reconnect(instance))
     {
-        err_num = amqp_basic_publish(instance->conn, instance->channel,
-                                     amqp_cstring_bytes(instance->exchange),
-                                     amqp_cstring_bytes(instance->key),
-                                     0, 0, tmp->prop, amqp_cstring_bytes(tmp->msg));
+        int err_num = AMQP_STATUS_OK;
+
+        for (int i = 0; i < n && err_num == AMQP_STATUS_OK; i++)
+        {
+            err_num = amqp_basic_publish(instance->conn, instance->channel,
+                                         amqp_cstring_bytes(instance->exchange),
+                                         amqp_cstring_bytes(instance->key),
+                                         0, 0, batch[i]->prop, amqp_cstring_bytes(batch[i]->msg));
+            instance->delivery_tag++;
+        }
 
-        spinlock_acquire(&instance->rconn_lock);
         instance->conn_stat = err_num;
-        spinlock_release(&instance->rconn_lock);
+        rval = err_num == AMQP_STATUS_OK && (!instance->confirm || mq_wait_confirms(instance));
+    }
 
-        if (err_num == AMQP_STATUS_OK)
+    spinlock_release(&instance->rconn_lock);
+
+    return rval;
+}
+
+/**
+ * The publisher thread of a filter instance. Takes the messages from the
+ * queue and broadcasts them to the RabbitMQ server in batches. A batch that
+ * fails is retried until it succeeds, so a message may be published more
+ * than once if the connection fails.
+ * @param data MQfilter instance
+ */
+static void mq_publisher(void* data)
+{
+    MQ_INSTANCE *instance = (MQ_INSTANCE*) data;
+    mqmessage **batch = malloc(instance->batch_size * sizeof(mqmessage*));
+    int n = 0;
+
+    if (batch == NULL)
+    {
+        MXS_ERROR("Cannot allocate enough memory.");
+        return;
+    }
+
+    while (true)
+    {
+        mqmessage *msg;
+
+        while (n < instance->batch_size && (msg = mq_queue_pop(&instance->queue_msg)))
         {
-            /**Message was sent successfully*/
-            free(tmp->prop);
-            free(tmp->msg);
-            free(tmp);
+            batch[n++] = msg;
+        }
 
-            atomic_add(&instance->stats.n_sent, 1);
-            atomic_add(&instance->stats.n_queued, -1);
-            spinlock_acquire(&instance->msg_lock);
-            tmp = instance->messages;
+        if (n == 0)
+        {
+            mq_queue_wait(&instance->queue_msg);
+        }
+        else if (mq_publish_batch(instance, batch, n))
+        {
+            uint64_t now = mq_now();
 
-            if (tmp == NULL)
+            for (int i = 0; i < n; i++)
             {
-                spinlock_release(&instance->msg_lock);
-                return;
+                uint64_t latency = now - batch[i]->queued;
+                instance->stats.latency_total += latency;
+                if (latency > instance->stats.latency_max)
+                {
+                    instance->stats.latency_max = latency;
+                }
+                free(batch[i]->prop);
+                free(batch[i]->msg);
+                free(batch[i]);
             }
 
-            instance->messages = instance->messages->next;
-            spinlock_release(&instance->msg_lock);
+            atomic_add(&instance->stats.n_sent, n);
+            atomic_add(&instance->stats.n_queued, -n);
+            atomic_add(&instance->stats.n_batches, 1);
+            n = 0;
         }
         else
         {
-            spinlock_acquire(&instance->msg_lock);
-            tmp->next = instance->messages;
-            instance->messages = tmp;
-            spinlock_release(&instance->msg_lock);
-            return;
+            atomic_add(&instance->stats.n_failed, 1);
+
+            if (instance->conn_stat != AMQP_STATUS_OK)
+            {
+                /** No connection to the broker */
+                thread_millisleep(1000);
+            }
         }
     }
 }
 
 /**
- * Push a new message on the stack to be broadcasted later.
+ * Push a new message on the queue to be broadcasted later.
  * The message assumes ownership of the memory allocated to the message content and properties.
+ * If the queue is full, the message is dropped or the caller waits until
+ * there is room for it, depending on the on_full parameter.
  * @param prop Message properties
  * @param msg Message content
  */
@@ -952,6 +1300,7 @@ void pushMessage(MQ_INSTANCE *instance, amqp_basic_properties_t* prop, char* msg
     {
         newmsg->msg = msg;
         newmsg->prop = prop;
+        newmsg->queued = mq_now();
     }
     else
     {
@@ -961,14 +1310,22 @@ void pushMessage(MQ_INSTANCE *instance, amqp_basic_properties_t* prop, char* msg
         return;
     }
 
-    spinlock_acquire(&instance->msg_lock);
+    atomic_add(&instance->stats.n_msg, 1);
 
-    newmsg->next = instance->messages;
-    instance->messages = newmsg;
+    while (!mq_queue_push(&instance->queue_msg, newmsg))
+    {
+        if (instance->on_full == MQ_DROP)
+        {
+            atomic_add(&instance->stats.n_dropped, 1);
+            free(prop);
+            free(msg);
+            free(newmsg);
+            return;
+        }
 
-    spinlock_release(&instance->msg_lock);
+        thread_millisleep(1);
+    }
 
-    atomic_add(&instance->stats.n_msg, 1);
     atomic_add(&instance->stats.n_queued, 1);
 }
 
@@ -1684,11 +2041,20 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
                    my_instance->vhost, my_instance->exchange,
                    my_instance->key, my_instance->queue
                   );
-        dcb_printf(dcb, "%-16s%-16s%-16s\n",
-                   "Messages", "Queued", "Sent");
-        dcb_printf(dcb, "%-16d%-16d%-16d\n",
+        dcb_printf(dcb, "%-16s%-16s%-16s%-16s\n",
+                   "Messages", "Queued", "Sent", "Dropped");
+        dcb_printf(dcb, "%-16d%-16d%-16d%-16d\n",
                    my_instance->stats.n_msg,
                    my_instance->stats.n_queued,
-                   my_instance->stats.n_sent);
+                   my_instance->stats.n_sent,
+                   my_instance->stats.n_dropped);
+        dcb_printf(dcb, "Queue size: %u\tBatches: %d\tFailed batches: %d\n",
+                   my_instance->queue_msg.mask + 1,
+                   my_instance->stats.n_batches,
+                   my_instance->stats.n_failed);
+        dcb_printf(dcb, "Publish latency: average %.3f ms\tmaximum %.3f ms\n",
+                   my_instance->stats.n_sent ?
+                   (double) my_instance->stats.latency_total / my_instance->stats.n_sent / 1000.0 : 0.0,
+                   (double) my_instance->stats.latency_max / 1000.0);
     }
 }
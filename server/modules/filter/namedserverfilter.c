@@ -11,7 +11,9 @@
  * Public License.
  */
 
+#define PCRE2_CODE_UNIT_WIDTH 8
 #include <stdio.h>
+#include <ctype.h>
 #include <filter.h>
 #include <modinfo.h>
 #include <modutil.h>
@@ -20,6 +22,7 @@
 #include <string.h>
 #include <regex.h>
 #include <hint.h>
+#include <maxscale_pcre2.h>
 
 /**
  * @file namedserverfilter.c - a very simple regular expression based filter
@@ -34,6 +37,13 @@
  *      source=<source address to limit filter>
  *      user=<username to limit filter>
  *
+ * Any number of numbered rules can be defined instead of or in addition to
+ * the match and server parameters
+ *      match<N>=<PCRE2 regular expression>
+ *      target<N>=<server to route statement to>
+ * The rules are combined into a single regular expression so that one match
+ * finds the rule that applies to the statement.
+ *
  * Date         Who             Description
  * 22/01/2015   Mark Riddoch    Written as example based on regex filter
  * @endverbatim
@@ -56,6 +66,7 @@ static void freeSession(FILTER *instance, void *session);
 static void setDownstream(FILTER *instance, void *fsession, DOWNSTREAM *downstream);
 static int routeQuery(FILTER *instance, void *fsession, GWBUF *queue);
 static void diagnostic(FILTER *instance, void *fsession, DCB *dcb);
+static uint32_t getInterest(FILTER *instance);
 
 
 static FILTER_OBJECT MyObject =
@@ -69,8 +80,21 @@ static FILTER_OBJECT MyObject =
     routeQuery,
     NULL,
     diagnostic,
+    getInterest
 };
 
+/** The highest number of a numbered rule */
+#define NSF_MAX_RULES 99
+
+/**
+ * A numbered match and target rule
+ */
+typedef struct
+{
+    char *match; /* Regular expression to match */
+    char *target; /* Server to route to */
+} REGEXHINT_RULE;
+
 /**
  * Instance structure
  */
@@ -81,6 +105,9 @@ typedef struct
     char *match; /* Regular expression to match */
     char *server; /* Server to route to */
     regex_t re; /* Compiled regex text */
+    REGEXHINT_RULE rules[NSF_MAX_RULES + 1]; /* The numbered rules by number */
+    pcre2_code *rules_re; /* The rules combined into one regular expression */
+    uint32_t ovector_size; /* Ovector size needed by rules_re */
 } REGEXHINT_INSTANCE;
 
 /**
@@ -131,6 +158,181 @@ GetModuleObject()
     return &MyObject;
 }
 
+/**
+ * Get the number of a numbered rule parameter
+ *
+ * @param name      The parameter name
+ * @param prefix    The rule parameter prefix, match or target
+ * @return The number of the rule or 0 if the name is not a rule parameter
+ */
+static int
+rule_number(const char *name, const char *prefix)
+{
+    size_t len = strlen(prefix);
+    char *end;
+    long n;
+
+    if (strncmp(name, prefix, len) != 0 || !isdigit(name[len]))
+    {
+        return 0;
+    }
+
+    n = strtol(name + len, &end, 10);
+
+    return *end == '\0' && n > 0 && n <= NSF_MAX_RULES ? n : 0;
+}
+
+/**
+ * Combine the numbered rules into one regular expression. Each rule is an
+ * alternative that sets a mark with the number of the rule so that a single
+ * match finds both whether any rule matches and which one.
+ *
+ * @param my_instance   The filter instance
+ * @param options       The PCRE2 compile options
+ * @return True if the rules were compiled
+ */
+static bool
+compile_rules(REGEXHINT_INSTANCE *my_instance, uint32_t options)
+{
+    char errbuffer[512];
+    PCRE2_SIZE erroffset;
+    int errnumber;
+    size_t len = 1;
+    bool error = false;
+
+    for (int i = 1; i <= NSF_MAX_RULES; i++)
+    {
+        REGEXHINT_RULE *rule = &my_instance->rules[i];
+
+        if (rule->match || rule->target)
+        {
+            pcre2_code *re;
+
+            if (rule->match == NULL || rule->target == NULL)
+            {
+                MXS_ERROR("namedserverfilter: Missing parameter '%s%d' for rule %d.",
+                          rule->match ? "target" : "match", i, i);
+                error = true;
+            }
+            /** Compile each rule alone for the error messages */
+            else if ((re = pcre2_compile((PCRE2_SPTR) rule->match, PCRE2_ZERO_TERMINATED,
+                                         options, &errnumber, &erroffset, NULL)) == NULL)
+            {
+                pcre2_get_error_message(errnumber, (PCRE2_UCHAR*) errbuffer, sizeof(errbuffer));
+                MXS_ERROR("namedserverfilter: Invalid regular expression '%s' for "
+                          "parameter 'match%d' at %lu: %s", rule->match, i,
+                          erroffset, errbuffer);
+                error = true;
+            }
+            else
+            {
+                pcre2_code_free(re);
+                len += strlen(rule->match) + sizeof("|(?:)(*MARK:)") + 3;
+            }
+        }
+    }
+
+    if (error || len == 1)
+    {
+        return !error;
+    }
+
+    char *pattern = malloc(len);
+
+    if (pattern == NULL)
+    {
+        return false;
+    }
+
+    char *ptr = pattern;
+    *ptr = '\0';
+
+    for (int i = 1; i <= NSF_MAX_RULES; i++)
+    {
+        if (my_instance->rules[i].match)
+        {
+            ptr += sprintf(ptr, "%s(?:%s)(*MARK:%d)", ptr == pattern ? "" : "|",
+                           my_instance->rules[i].match, i);
+        }
+    }
+
+    if ((my_instance->rules_re = pcre2_compile((PCRE2_SPTR) pattern, PCRE2_ZERO_TERMINATED,
+                                               options, &errnumber, &erroffset, NULL)) == NULL)
+    {
+        pcre2_get_error_message(errnumber, (PCRE2_UCHAR*) errbuffer, sizeof(errbuffer));
+        MXS_ERROR("namedserverfilter: Failed to combine the match rules: %s", errbuffer);
+        error = true;
+    }
+    else
+    {
+        uint32_t captures = 0;
+        pcre2_pattern_info(my_instance->rules_re, PCRE2_INFO_CAPTURECOUNT, &captures);
+        my_instance->ovector_size = captures + 1;
+        mxs_pcre2_jit_compile(my_instance->rules_re);
+    }
+
+    free(pattern);
+    return !error;
+}
+
+/**
+ * Find the target of the numbered rule that matches a statement. The rule
+ * that matches earliest in the statement is used, and of the rules that
+ * match at the same position the one with the lowest number.
+ *
+ * @param my_instance   The filter instance
+ * @param sql           The SQL of the statement
+ * @return The target server or NULL if no rule matched
+ */
+static char *
+match_rules(REGEXHINT_INSTANCE *my_instance, const char *sql)
+{
+    pcre2_match_data *mdata = mxs_pcre2_thread_match_data(my_instance->ovector_size);
+    char *target = NULL;
+
+    if (mdata && pcre2_match(my_instance->rules_re, (PCRE2_SPTR) sql, PCRE2_ZERO_TERMINATED,
+                             0, 0, mdata, mxs_pcre2_thread_match_context()) >= 0)
+    {
+        PCRE2_SPTR mark = pcre2_get_mark(mdata);
+        int n = mark ? atoi((const char*) mark) : 0;
+
+        if (n > 0 && n <= NSF_MAX_RULES)
+        {
+            target = my_instance->rules[n].target;
+        }
+    }
+
+    return target;
+}
+
+/**
+ * Free a filter instance
+ *
+ * @param my_instance   The filter instance
+ */
+static void
+free_instance(REGEXHINT_INSTANCE *my_instance)
+{
+    if (my_instance->match)
+    {
+        regfree(&my_instance->re);
+        free(my_instance->match);
+    }
+    for (int i = 1; i <= NSF_MAX_RULES; i++)
+    {
+        free(my_instance->rules[i].match);
+        free(my_instance->rules[i].target);
+    }
+    if (my_instance->rules_re)
+    {
+        pcre2_code_free(my_instance->rules_re);
+    }
+    free(my_instance->server);
+    free(my_instance->source);
+    free(my_instance->user);
+    free(my_instance);
+}
+
 /**
  * Create an instance of the filter for a particular service
  * within MaxScale.
@@ -146,13 +348,11 @@ createInstance(char **options, FILTER_PARAMETER **params)
     REGEXHINT_INSTANCE *my_instance;
     int cflags = REG_ICASE;
 
-    if ((my_instance = malloc(sizeof(REGEXHINT_INSTANCE))) != NULL)
+    if ((my_instance = calloc(1, sizeof(REGEXHINT_INSTANCE))) != NULL)
     {
-        my_instance->match = NULL;
-        my_instance->server = NULL;
-        my_instance->source = NULL;
-        my_instance->user = NULL;
         bool error = false;
+        bool have_rules = false;
+        int n;
 
         for (int i = 0; params && params[i]; i++)
         {
@@ -172,6 +372,18 @@ createInstance(char **options, FILTER_PARAMETER **params)
             {
                 my_instance->user = strdup(params[i]->value);
             }
+            else if ((n = rule_number(params[i]->name, "match")))
+            {
+                free(my_instance->rules[n].match);
+                my_instance->rules[n].match = strdup(params[i]->value);
+                have_rules = true;
+            }
+            else if ((n = rule_number(params[i]->name, "target")))
+            {
+                free(my_instance->rules[n].target);
+                my_instance->rules[n].target = strdup(params[i]->value);
+                have_rules = true;
+            }
             else if (!filter_standard_parameter(params[i]->name))
             {
                 MXS_ERROR("namedserverfilter: Unexpected parameter '%s'.",
@@ -205,13 +417,13 @@ createInstance(char **options, FILTER_PARAMETER **params)
             }
         }
 
-        if (my_instance->match == NULL)
+        if (my_instance->match == NULL && (my_instance->server || !have_rules))
         {
             MXS_ERROR("namedserverfilter: Missing required parameters 'match'.");
             error = true;
         }
 
-        if (my_instance->server == NULL)
+        if (my_instance->server == NULL && (my_instance->match || !have_rules))
         {
             MXS_ERROR("namedserverfilter: Missing required parameters 'server'.");
             error = true;
@@ -226,17 +438,15 @@ createInstance(char **options, FILTER_PARAMETER **params)
             error = true;
         }
 
+        if (!error && have_rules &&
+            !compile_rules(my_instance, (cflags & REG_ICASE) ? PCRE2_CASELESS : 0))
+        {
+            error = true;
+        }
+
         if (error)
         {
-            if (my_instance->match)
-            {
-                regfree(&my_instance->re);
-                free(my_instance->match);
-            }
-            free(my_instance->server);
-            free(my_instance->source);
-            free(my_instance->user);
-            free(my_instance);
+            free_instance(my_instance);
             my_instance = NULL;
         }
 
@@ -329,7 +539,8 @@ setDownstream(FILTER *instance, void *session, DOWNSTREAM *downstream)
  *
  * If the regular expressed configured in the match parameter of the
  * filter definition matches the SQL text then add the hint
- * "Route to named server" with the name defined in the server parameter
+ * "Route to named server" with the name defined in the server parameter.
+ * Otherwise the target of the numbered rule that matches is used.
  *
  * @param instance  The filter instance data
  * @param session   The filter session
@@ -344,17 +555,24 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
 
     if (modutil_is_SQL(queue) && my_session->active)
     {
-        if (queue->next != NULL)
-        {
-            queue = gwbuf_make_contiguous(queue);
-        }
         if ((sql = modutil_get_SQL(queue)) != NULL)
         {
-            if (regexec(&my_instance->re, sql, 0, NULL, 0) == 0)
+            char *target = NULL;
+
+            if (my_instance->match && regexec(&my_instance->re, sql, 0, NULL, 0) == 0)
+            {
+                target = my_instance->server;
+            }
+            else if (my_instance->rules_re)
+            {
+                target = match_rules(my_instance, sql);
+            }
+
+            if (target)
             {
                 queue->hint = hint_create_route(queue->hint,
                                                 HINT_ROUTE_TO_NAMED_SERVER,
-                                                my_instance->server);
+                                                target);
                 my_session->n_diverted++;
             }
             else
@@ -368,6 +586,18 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
                                        my_session->down.session, queue);
 }
 
+/**
+ * Only COM_QUERY packets are matched against the rules
+ *
+ * @param instance  The filter instance
+ * @return The classes of packets the filter acts on
+ */
+static uint32_t
+getInterest(FILTER *instance)
+{
+    return FILTER_INTEREST_QUERY;
+}
+
 /**
  * Diagnostics routine
  *
@@ -385,8 +615,19 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
     REGEXHINT_INSTANCE *my_instance = (REGEXHINT_INSTANCE *) instance;
     REGEXHINT_SESSION *my_session = (REGEXHINT_SESSION *) fsession;
 
-    dcb_printf(dcb, "\t\tMatch and route:           /%s/ -> %s\n",
-               my_instance->match, my_instance->server);
+    if (my_instance->match)
+    {
+        dcb_printf(dcb, "\t\tMatch and route:           /%s/ -> %s\n",
+                   my_instance->match, my_instance->server);
+    }
+    for (int i = 1; i <= NSF_MAX_RULES; i++)
+    {
+        if (my_instance->rules[i].match)
+        {
+            dcb_printf(dcb, "\t\tRule %d match and route:   /%s/ -> %s\n", i,
+                       my_instance->rules[i].match, my_instance->rules[i].target);
+        }
+    }
     if (my_session)
     {
         dcb_printf(dcb, "\t\tNo. of queries diverted by filter: %d\n",
@@ -0,0 +1,2445 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file psfilter.c - Promotion of text queries to prepared statements
+ * @verbatim
+ *
+ * The psfilter executes the text queries that a session sends often as
+ * prepared statements so that the server doesn't have to parse them again.
+ *
+ * The literals of a COM_QUERY are replaced with placeholders and the result
+ * is looked up by its fingerprint hash among the statements of the session.
+ * When the same statement has been seen threshold times, it is prepared with
+ * COM_STMT_PREPARE on the backend connection of the session. From then on the
+ * queries with that statement are sent as COM_STMT_EXECUTE with the literals
+ * as parameters and the rows of the binary result sets are converted back to
+ * text protocol rows. The client never sees the prepared statements.
+ *
+ * Only the literals that can't change the metadata of the result are replaced:
+ * the literals in a select list, the numbers after BY and the strings with
+ * backslashes or character set introducers are kept as they are. Queries with
+ * comments or several statements are not promoted. A statement that the server
+ * fails to prepare is sent as text from then on. If the server no longer knows
+ * a statement, for example after the router reconnected, all statements are
+ * forgotten and the query is sent as text.
+ *
+ * A session has at most one query in flight so that the replies can be
+ * followed, pipelined queries wait in the filter. The prepared statements
+ * belong to the backend connection of the session, which is why queries are
+ * promoted only in the services that use readconnroute.
+ *
+ * Date         Who             Description
+ * 14/10/2016   MaxScale        Initial implementation
+ *
+ * @endverbatim
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <float.h>
+#include <filter.h>
+#include <modinfo.h>
+#include <modutil.h>
+#include <log_manager.h>
+#include <spinlock.h>
+#include <atomic.h>
+#include <statistics.h>
+#include <fingerprint.h>
+#include <maxscale/poll.h>
+#include <mysql_client_server_protocol.h>
+
+MODULE_INFO info =
+{
+    MODULE_API_FILTER,
+    MODULE_EXPERIMENTAL,
+    FILTER_VERSION,
+    "Promotion of repeated text queries to prepared statements"
+};
+
+static char *version_str = "V1.0.0";
+
+/** Default number of times a statement is seen before it is prepared */
+#define PS_DEFAULT_THRESHOLD 5
+
+/** Default number of statements tracked by each session */
+#define PS_DEFAULT_MAX_STATEMENTS 32
+
+/** Longest query that is promoted */
+#define PS_MAX_SQL_LEN 16384
+
+/** Most literals replaced in a query */
+#define PS_MAX_PARAMS 256
+
+/** Deepest nesting of parentheses in a promoted query */
+#define PS_MAX_DEPTH 64
+
+/** Number of bytes of each reply packet that are looked at */
+#define PS_PEEK_LEN 24
+
+/** Payload length of a packet that is continued by the next one */
+#define PS_MAX_PAYLOAD 0xffffff
+
+/** The server doesn't know the statement in a COM_STMT_EXECUTE */
+#define PS_ER_UNKNOWN_STMT_HANDLER 1243
+
+/** The column flag of unsigned numbers */
+#define PS_UNSIGNED_FLAG 0x20
+
+/** The decimals of a floating point column without a fixed number of decimals */
+#define PS_NOT_FIXED_DEC 31
+
+/** Size of the buffer for the text of a converted value */
+#define PS_VALUE_LEN 512
+
+/*
+ * The filter entry points
+ */
+static FILTER *createInstance(char **options, FILTER_PARAMETER **);
+static void *newSession(FILTER *instance, SESSION *session);
+static void closeSession(FILTER *instance, void *session);
+static void freeSession(FILTER *instance, void *session);
+static void setDownstream(FILTER *instance, void *fsession, DOWNSTREAM *downstream);
+static void setUpstream(FILTER *instance, void *fsession, UPSTREAM *upstream);
+static int routeQuery(FILTER *instance, void *fsession, GWBUF *queue);
+static int clientReply(FILTER *instance, void *fsession, GWBUF *queue);
+static void diagnostic(FILTER *instance, void *fsession, DCB *dcb);
+
+
+static FILTER_OBJECT MyObject =
+{
+    createInstance,
+    newSession,
+    closeSession,
+    freeSession,
+    setDownstream,
+    setUpstream,
+    routeQuery,
+    clientReply,
+    diagnostic,
+};
+
+/** Where the parser of a reply is */
+typedef enum
+{
+    REPLY_FIRST,        /*< Waiting for the first packet of a result */
+    REPLY_COLUMNS,      /*< Reading the column definitions */
+    REPLY_ROWS,         /*< Reading the rows */
+    REPLY_FIELDS,       /*< Reading the reply to COM_FIELD_LIST */
+    REPLY_PREPARE,      /*< Reading the definitions of a prepared statement */
+    REPLY_WAIT_OK,      /*< Client data is forwarded until an OK or an error */
+    REPLY_SKIP,         /*< The rest of a converted result is not returned */
+    REPLY_DONE          /*< The reply is complete */
+} reply_state_t;
+
+/** What the reply in flight is to */
+typedef enum
+{
+    PS_WAIT_NONE,       /*< No query in flight */
+    PS_WAIT_REPLY,      /*< A query routed as it is, the reply is forwarded */
+    PS_WAIT_PREPARE,    /*< The preparation of a statement */
+    PS_WAIT_EXECUTE     /*< The execution of a statement */
+} ps_wait_t;
+
+/** The state of a statement of a session */
+typedef enum
+{
+    STMT_COUNTING,      /*< Not yet seen threshold times */
+    STMT_PREPARED,      /*< Prepared on the backend connection */
+    STMT_FAILED         /*< The server failed to prepare it */
+} stmt_state_t;
+
+/** The type of a literal */
+typedef enum
+{
+    PARAM_STRING,       /*< A string in single quotes */
+    PARAM_INTEGER,      /*< An integer */
+    PARAM_DECIMAL,      /*< A number with a decimal point */
+    PARAM_DOUBLE        /*< A number with an exponent */
+} param_type_t;
+
+/**
+ * A literal of a query
+ */
+typedef struct
+{
+    param_type_t type;
+    int          offset;    /*< Offset of the literal in the query, after the quote of a string */
+    int          len;       /*< Length of the literal, without the quotes */
+} PS_PARAM;
+
+/**
+ * A statement of a session
+ */
+typedef struct
+{
+    uint64_t     hash;      /*< The fingerprint hash of the statement */
+    char         *sql;      /*< The statement with placeholders */
+    int          len;       /*< Length of the statement */
+    int          count;     /*< Number of times the statement was seen */
+    stmt_state_t state;
+    uint32_t     id;        /*< The ID of the prepared statement */
+} PS_STMT;
+
+/**
+ * A column of a converted result set
+ */
+typedef struct
+{
+    uint8_t  type;
+    uint16_t flags;
+    uint8_t  decimals;
+} PS_COLUMN;
+
+/**
+ * A command that is waiting to be routed
+ */
+typedef struct ps_query
+{
+    GWBUF           *buffer;
+    bool            continued;  /*< The packet continues a large packet */
+    struct ps_query *next;
+} PS_QUERY;
+
+/**
+ * The filter instance
+ */
+typedef struct
+{
+    int        threshold;       /*< Times a statement is seen before it is prepared */
+    int        max_statements;  /*< Statements tracked by each session */
+    int        warned;          /*< The warning about the router has been logged */
+    ts_stats_t n_prepared;      /*< Statements prepared */
+    ts_stats_t n_failed;        /*< Statements the server failed to prepare */
+    ts_stats_t n_executed;      /*< Queries executed as prepared statements */
+} PS_INSTANCE;
+
+/**
+ * The session structure for the psfilter
+ */
+typedef struct
+{
+    DOWNSTREAM    down;
+    UPSTREAM      up;
+    SESSION       *session;
+    PS_INSTANCE   *instance;
+    bool          active;       /*< Queries are promoted */
+    SPINLOCK      lock;         /*< Protects the state below */
+    GWBUF         *input;       /*< A partial packet from the client */
+    bool          input_large;  /*< The next packet from the client continues a large one */
+    PS_QUERY      *head;        /*< The first command waiting to be routed */
+    PS_QUERY      *tail;        /*< The last command waiting to be routed */
+    int           n_queued;     /*< Number of commands waiting to be routed */
+    GWBUF         *send;        /*< Packets to route before the waiting commands */
+    bool          routing;      /*< A thread is routing the commands of the session */
+    bool          passthrough;  /*< Everything is routed as it is */
+    ps_wait_t     wait;         /*< What the reply in flight is to */
+    PS_STMT       *stmts;       /*< The statements of the session */
+    int           n_stmts;      /*< Number of statements */
+    /** The query being promoted */
+    GWBUF         *query;       /*< The COM_QUERY, sent as it is if the promotion fails */
+    PS_STMT       *stmt;        /*< The statement of the query */
+    char          *text;        /*< The statement with placeholders, not yet in stmts */
+    int           text_len;     /*< Length of text */
+    PS_PARAM      params[PS_MAX_PARAMS]; /*< The literals of the query */
+    int           n_params;     /*< Number of literals */
+    /** The reply to a promoted query */
+    GWBUF         *reply;       /*< Packets not yet processed */
+    GWBUF         *large;       /*< The payload of a large packet read so far */
+    uint8_t       seq;          /*< Sequence number of the last packet returned */
+    PS_COLUMN     *columns;     /*< The columns of the result */
+    int           n_columns;    /*< Number of columns */
+    int           n_defs;       /*< Number of column definitions read */
+    uint8_t       *row;         /*< A converted row */
+    size_t        row_size;     /*< Size of the row buffer */
+    size_t        row_len;      /*< Length of the converted row */
+    /** The parser of the reply */
+    uint8_t       command;      /*< The command being replied to */
+    reply_state_t state;        /*< Where the parser is */
+    int           n_left;       /*< Packets left of a prepared statement reply */
+    uint8_t       hdr[MYSQL_HEADER_LEN]; /*< The header of the current packet */
+    int           hdr_len;      /*< Bytes of the header read */
+    uint32_t      left;         /*< Bytes of the current packet left */
+    uint32_t      plen;         /*< Length of the current packet */
+    bool          continued;    /*< The current packet continues a large packet */
+    bool          large_packet; /*< The current packet is continued by the next one */
+    uint8_t       peek[PS_PEEK_LEN]; /*< The start of the current packet */
+    int           peek_len;     /*< Bytes in peek */
+} PS_SESSION;
+
+static void dispatch(PS_SESSION *my_session);
+
+/**
+ * Implementation of the mandatory version entry point
+ *
+ * @return version string of the module
+ */
+char *
+version()
+{
+    return version_str;
+}
+
+/**
+ * The module initialisation routine, called when the module
+ * is first loaded.
+ * @see function load_module in load_utils.c for explanation of lint
+ */
+/*lint -e14 */
+void
+ModuleInit()
+{
+}
+/*lint +e14 */
+
+/**
+ * The module entry point routine. It is this routine that
+ * must populate the structure that is referred to as the
+ * "module object", this is a structure with the set of
+ * external entry points for this module.
+ *
+ * @return The module object
+ */
+FILTER_OBJECT *
+GetModuleObject()
+{
+    return &MyObject;
+}
+
+/**
+ * Create an instance of the filter for a particular service
+ * within MaxScale.
+ *
+ * @param options   The options for this filter
+ * @param params    The array of name/value pair parameters for the filter
+ *
+ * @return The instance data for this new instance
+ */
+static FILTER *
+createInstance(char **options, FILTER_PARAMETER **params)
+{
+    PS_INSTANCE *my_instance;
+
+    if ((my_instance = calloc(1, sizeof(PS_INSTANCE))) != NULL)
+    {
+        bool error = false;
+
+        my_instance->threshold = PS_DEFAULT_THRESHOLD;
+        my_instance->max_statements = PS_DEFAULT_MAX_STATEMENTS;
+
+        for (int i = 0; params && params[i]; i++)
+        {
+            if (!strcmp(params[i]->name, "threshold"))
+            {
+                my_instance->threshold = atoi(params[i]->value);
+            }
+            else if (!strcmp(params[i]->name, "max_statements"))
+            {
+                my_instance->max_statements = atoi(params[i]->value);
+            }
+            else if (!filter_standard_parameter(params[i]->name))
+            {
+                MXS_ERROR("psfilter: Unexpected parameter '%s'.", params[i]->name);
+                error = true;
+            }
+        }
+
+        for (int i = 0; options && options[i]; i++)
+        {
+            MXS_ERROR("psfilter: Unsupported option '%s'.", options[i]);
+            error = true;
+        }
+
+        if (my_instance->threshold <= 0 || my_instance->max_statements <= 0)
+        {
+            MXS_ERROR("psfilter: The values of 'threshold' and 'max_statements' "
+                      "must be positive.");
+            error = true;
+        }
+
+        my_instance->n_prepared = ts_stats_alloc();
+        my_instance->n_failed = ts_stats_alloc();
+        my_instance->n_executed = ts_stats_alloc();
+
+        if (my_instance->n_prepared == NULL || my_instance->n_failed == NULL ||
+            my_instance->n_executed == NULL)
+        {
+            MXS_ERROR("psfilter: Memory allocation failed.");
+            error = true;
+        }
+
+        if (error)
+        {
+            ts_stats_free(my_instance->n_prepared);
+            ts_stats_free(my_instance->n_failed);
+            ts_stats_free(my_instance->n_executed);
+            free(my_instance);
+            my_instance = NULL;
+        }
+    }
+
+    return (FILTER *) my_instance;
+}
+
+/**
+ * Associate a new session with this instance of the filter.
+ *
+ * @param instance  The filter instance data
+ * @param session   The session itself
+ * @return Session specific data for this session
+ */
+static void *
+newSession(FILTER *instance, SESSION *session)
+{
+    PS_INSTANCE *my_instance = (PS_INSTANCE *) instance;
+    PS_SESSION *my_session;
+
+    if ((my_session = calloc(1, sizeof(PS_SESSION))) != NULL)
+    {
+        my_session->session = session;
+        my_session->instance = my_instance;
+        my_session->state = REPLY_DONE;
+        spinlock_init(&my_session->lock);
+
+        /** The statements must stay on the one backend connection of the session */
+        my_session->active = !strcmp(session->service->routerModule, "readconnroute");
+
+        if (my_session->active)
+        {
+            my_session->stmts = calloc(my_instance->max_statements, sizeof(PS_STMT));
+
+            if (my_session->stmts == NULL)
+            {
+                MXS_ERROR("psfilter: Memory allocation failed.");
+                free(my_session);
+                my_session = NULL;
+            }
+        }
+        else if (atomic_add(&my_instance->warned, 1) == 0)
+        {
+            MXS_WARNING("psfilter: Service '%s' uses the router '%s', queries are "
+                        "promoted only with readconnroute.",
+                        session->service->name, session->service->routerModule);
+        }
+    }
+
+    return my_session;
+}
+
+/**
+ * Check whether a byte can be a part of a name or a keyword
+ */
+static inline bool
+is_word_byte(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           c == '_' || c == '$' || (unsigned char)c >= 0x80;
+}
+
+static inline bool
+is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static inline bool
+is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+static inline bool
+word_is(const char *word, int len, const char *keyword)
+{
+    return (int)strlen(keyword) == len && strncasecmp(word, keyword, len) == 0;
+}
+
+/**
+ * Check whether a keyword starts a clause that can follow a BY clause
+ */
+static bool
+is_clause(const char *word, int len)
+{
+    static const char *clauses[] =
+    {
+        "for", "having", "into", "limit", "lock", "on", "procedure", "select",
+        "set", "union", "values", "where", "window", NULL
+    };
+
+    for (int i = 0; clauses[i]; i++)
+    {
+        if (word_is(word, len, clauses[i]))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Find the end of a quoted string or name
+ *
+ * @param sql   The query
+ * @param i     Offset of the opening quote
+ * @param len   Length of the query
+ * @param slash Set to true if the string has a backslash
+ * @return Offset after the closing quote or -1 if the quote is not closed
+ */
+static int
+skip_quoted(const char *sql, int i, int len, bool *slash)
+{
+    char quote = sql[i++];
+
+    while (i < len)
+    {
+        if (sql[i] == '\\' && quote != '`')
+        {
+            *slash = true;
+            i += 2;
+        }
+        else if (sql[i] == quote)
+        {
+            if (i + 1 < len && sql[i + 1] == quote)
+            {
+                i += 2;
+            }
+            else
+            {
+                return i + 1;
+            }
+        }
+        else
+        {
+            i++;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Replace the literals of a query with placeholders
+ *
+ * The statement with placeholders is stored in the text of the session and
+ * the literals in its params.
+ *
+ * @param my_session The session
+ * @param sql        The query
+ * @param len        Length of the query
+ * @return True if the query can be promoted
+ */
+static bool
+parameterize(PS_SESSION *my_session, const char *sql, int len)
+{
+    char *text;
+
+    if (len > PS_MAX_SQL_LEN || (text = malloc(len + 1)) == NULL)
+    {
+        return false;
+    }
+
+    uint64_t select_list = 0;   /*< A bit for each level of parentheses in a select list */
+    bool in_by = false;         /*< After ORDER BY, GROUP BY or PARTITION BY */
+    bool first = true;
+    bool valid = true;
+    int depth = 0;
+    int out = 0;
+    int i = 0;
+
+    my_session->n_params = 0;
+
+    while (i < len)
+    {
+        char c = sql[i];
+        int start = i;
+        bool keep = select_list || my_session->n_params == PS_MAX_PARAMS;
+
+        if (c == '\'' || c == '"' || c == '`')
+        {
+            bool slash = false;
+
+            if ((i = skip_quoted(sql, i, len, &slash)) < 0)
+            {
+                valid = false;
+                break;
+            }
+
+            /** A string after a word has a character set introducer or it is X'', B'' or N'' */
+            if (c == '\'' && !keep && !slash && !(start > 0 && is_word_byte(sql[start - 1])))
+            {
+                PS_PARAM *param = &my_session->params[my_session->n_params++];
+                param->type = PARAM_STRING;
+                param->offset = start + 1;
+                param->len = i - start - 2;
+                text[out++] = '?';
+                continue;
+            }
+        }
+        else if ((c == '/' && i + 1 < len && sql[i + 1] == '*') || c == '#' || c == '?' ||
+                 (c == '-' && i + 1 < len && sql[i + 1] == '-' &&
+                  (i + 2 == len || is_space(sql[i + 2]))))
+        {
+            /** Comments and placeholders */
+            valid = false;
+            break;
+        }
+        else if (c == ';')
+        {
+            while (++i < len && is_space(sql[i]))
+            {
+            }
+
+            if (i < len)
+            {
+                /** Several statements */
+                valid = false;
+                break;
+            }
+            len = start;
+            continue;
+        }
+        else if ((is_digit(c) || (c == '.' && i + 1 < len && is_digit(sql[i + 1]))) &&
+                 !(start > 0 && (is_word_byte(sql[start - 1]) || sql[start - 1] == '.' ||
+                                 sql[start - 1] == '@' || sql[start - 1] == '`')))
+        {
+            param_type_t type = PARAM_INTEGER;
+
+            while (i < len && is_digit(sql[i]))
+            {
+                i++;
+            }
+
+            if (i < len && sql[i] == '.')
+            {
+                type = PARAM_DECIMAL;
+                while (++i < len && is_digit(sql[i]))
+                {
+                }
+            }
+
+            if (i + 1 < len && (sql[i] == 'e' || sql[i] == 'E') &&
+                (is_digit(sql[i + 1]) ||
+                 ((sql[i + 1] == '+' || sql[i + 1] == '-') && i + 2 < len && is_digit(sql[i + 2]))))
+            {
+                type = PARAM_DOUBLE;
+                i += 2;
+                while (i < len && is_digit(sql[i]))
+                {
+                    i++;
+                }
+            }
+
+            if (i < len && is_word_byte(sql[i]))
+            {
+                /** A name that starts with digits or a hexadecimal or bit literal */
+                while (i < len && is_word_byte(sql[i]))
+                {
+                    i++;
+                }
+            }
+            else if (!keep && !in_by)
+            {
+                PS_PARAM *param = &my_session->params[my_session->n_params++];
+                param->type = type;
+                param->offset = start;
+                param->len = i - start;
+                text[out++] = '?';
+                continue;
+            }
+        }
+        else if (is_word_byte(c))
+        {
+            while (i < len && is_word_byte(sql[i]))
+            {
+                i++;
+            }
+
+            const char *word = sql + start;
+            int wlen = i - start;
+
+            if (first)
+            {
+                first = false;
+
+                if (!word_is(word, wlen, "select") && !word_is(word, wlen, "insert") &&
+                    !word_is(word, wlen, "update") && !word_is(word, wlen, "delete") &&
+                    !word_is(word, wlen, "replace"))
+                {
+                    valid = false;
+                    break;
+                }
+            }
+
+            /** The names of the columns of the result come from the text of the select list */
+            if (word_is(word, wlen, "select"))
+            {
+                select_list |= 1ULL << depth;
+            }
+            else if (word_is(word, wlen, "from"))
+            {
+                select_list &= ~(1ULL << depth);
+            }
+
+            /** The numbers after BY are positions of columns until the next clause */
+            if (word_is(word, wlen, "by"))
+            {
+                in_by = true;
+            }
+            else if (in_by && is_clause(word, wlen))
+            {
+                in_by = false;
+            }
+        }
+        else if (c == '(')
+        {
+            if (++depth == PS_MAX_DEPTH)
+            {
+                valid = false;
+                break;
+            }
+            i++;
+        }
+        else if (c == ')')
+        {
+            if (depth == 0)
+            {
+                valid = false;
+                break;
+            }
+            select_list &= ~(1ULL << depth);
+            depth--;
+            i++;
+        }
+        else
+        {
+            i++;
+        }
+
+        memcpy(text + out, sql + start, i - start);
+        out += i - start;
+    }
+
+    if (!valid || first)
+    {
+        free(text);
+        return false;
+    }
+
+    text[out] = '\0';
+    my_session->text = text;
+    my_session->text_len = out;
+    return true;
+}
+
+/**
+ * Find the statement of the query in the statements of the session, add it if
+ * it's not there
+ *
+ * @param my_session The session, the text of the query has been parameterized
+ * @return The statement or NULL if it couldn't be added
+ */
+static PS_STMT *
+find_stmt(PS_SESSION *my_session)
+{
+    uint64_t hash = fingerprint_hash(my_session->text, my_session->text_len);
+    PS_STMT *victim = NULL;
+
+    for (int i = 0; i < my_session->n_stmts; i++)
+    {
+        PS_STMT *stmt = &my_session->stmts[i];
+
+        if (stmt->hash == hash && stmt->len == my_session->text_len &&
+            memcmp(stmt->sql, my_session->text, stmt->len) == 0)
+        {
+            return stmt;
+        }
+
+        /** The statement seen the least often makes room, the prepared ones stay */
+        if (stmt->state != STMT_PREPARED && (victim == NULL || stmt->count < victim->count))
+        {
+            victim = stmt;
+        }
+    }
+
+    if (my_session->n_stmts < my_session->instance->max_statements)
+    {
+        victim = &my_session->stmts[my_session->n_stmts++];
+    }
+    else if (victim == NULL)
+    {
+        return NULL;
+    }
+
+    free(victim->sql);
+    victim->hash = hash;
+    victim->sql = my_session->text;
+    victim->len = my_session->text_len;
+    victim->count = 0;
+    victim->state = STMT_COUNTING;
+    victim->id = 0;
+    my_session->text = NULL;
+
+    return victim;
+}
+
+/**
+ * Create a packet with a payload
+ *
+ * @param cmd  The first byte of the payload
+ * @param data The rest of the payload
+ * @param len  Length of the data
+ * @return The packet or NULL if memory allocation failed
+ */
+static GWBUF *
+create_packet(uint8_t cmd, const void *data, size_t len)
+{
+    GWBUF *buffer = gwbuf_alloc(MYSQL_HEADER_LEN + 1 + len);
+
+    if (buffer)
+    {
+        uint8_t *ptr = GWBUF_DATA(buffer);
+        gw_mysql_set_byte3(ptr, 1 + len);
+        ptr[3] = 0;
+        ptr[4] = cmd;
+        memcpy(ptr + 5, data, len);
+    }
+
+    return buffer;
+}
+
+static size_t
+lenenc_size(uint64_t value)
+{
+    return value < 251 ? 1 : value < 0x10000 ? 3 : value < 0x1000000 ? 4 : 9;
+}
+
+static uint8_t *
+put_lenenc(uint8_t *ptr, uint64_t value)
+{
+    int n = 0;
+
+    if (value < 251)
+    {
+        *ptr++ = value;
+    }
+    else if (value < 0x10000)
+    {
+        *ptr++ = 0xfc;
+        n = 2;
+    }
+    else if (value < 0x1000000)
+    {
+        *ptr++ = 0xfd;
+        n = 3;
+    }
+    else
+    {
+        *ptr++ = 0xfe;
+        n = 8;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        *ptr++ = value >> (8 * i);
+    }
+
+    return ptr;
+}
+
+/**
+ * Read a length-encoded integer
+ *
+ * @param ptr   The integer, moved past it
+ * @param end   End of the data
+ * @param value The value
+ * @return False if the data ends before the integer
+ */
+static bool
+get_lenenc(uint8_t **ptr, uint8_t *end, uint64_t *value)
+{
+    uint8_t *p = *ptr;
+
+    if (p >= end || *p == 0xfb || *p == 0xff)
+    {
+        return false;
+    }
+
+    int n = *p < 0xfb ? 0 : *p == 0xfc ? 2 : *p == 0xfd ? 3 : 8;
+
+    if (end - p < n + 1)
+    {
+        return false;
+    }
+
+    *value = n ? 0 : *p;
+
+    for (int i = 0; i < n; i++)
+    {
+        *value |= (uint64_t)p[1 + i] << (8 * i);
+    }
+
+    *ptr = p + 1 + n;
+    return true;
+}
+
+/**
+ * Create the COM_STMT_EXECUTE of the query being promoted
+ *
+ * @param my_session The session
+ * @return The packet or NULL if the literals can't be sent as parameters
+ */
+static GWBUF *
+create_execute(PS_SESSION *my_session)
+{
+    const char *sql = (const char *)GWBUF_DATA(my_session->query) + MYSQL_HEADER_LEN + 1;
+    int n = my_session->n_params;
+    uint64_t values[n ? n : 1];
+    uint16_t types[n ? n : 1];
+    size_t len = 9 + (n ? (n + 7) / 8 + 1 + 2 * n : 0);
+
+    for (int i = 0; i < n; i++)
+    {
+        PS_PARAM *param = &my_session->params[i];
+        char number[64];
+
+        if (param->type != PARAM_STRING)
+        {
+            if (param->len >= (int)sizeof(number))
+            {
+                return NULL;
+            }
+            memcpy(number, sql + param->offset, param->len);
+            number[param->len] = '\0';
+        }
+
+        switch (param->type)
+        {
+        case PARAM_INTEGER:
+            errno = 0;
+            values[i] = strtoull(number, NULL, 10);
+
+            if (errno == 0)
+            {
+                /** The second byte of the type is 0x80 for unsigned values */
+                types[i] = MYSQL_TYPE_LONGLONG | (values[i] > INT64_MAX ? 0x8000 : 0);
+                len += 8;
+                break;
+            }
+            /** An integer that doesn't fit into 64 bits is a decimal */
+            param->type = PARAM_DECIMAL;
+
+        /* FALLTHROUGH */
+        case PARAM_DECIMAL:
+            types[i] = MYSQL_TYPE_NEWDECIMAL;
+            len += lenenc_size(param->len) + param->len;
+            break;
+
+        case PARAM_DOUBLE:
+            {
+                errno = 0;
+                double value = strtod(number, NULL);
+
+                if (errno)
+                {
+                    return NULL;
+                }
+                memcpy(&values[i], &value, sizeof(value));
+                types[i] = MYSQL_TYPE_DOUBLE;
+                len += 8;
+            }
+            break;
+
+        case PARAM_STRING:
+            {
+                /** The quotes of the string are doubled */
+                int n_quotes = 0;
+
+                for (int j = 0; j < param->len; j++)
+                {
+                    if (sql[param->offset + j] == sql[param->offset - 1])
+                    {
+                        n_quotes++;
+                        j++;
+                    }
+                }
+                values[i] = param->len - n_quotes;
+                types[i] = MYSQL_TYPE_VAR_STRING;
+                len += lenenc_size(values[i]) + values[i];
+            }
+            break;
+        }
+    }
+
+    if (len >= PS_MAX_PAYLOAD)
+    {
+        return NULL;
+    }
+
+    GWBUF *buffer = gwbuf_alloc(MYSQL_HEADER_LEN + 1 + len);
+
+    if (buffer == NULL)
+    {
+        return NULL;
+    }
+
+    uint8_t *ptr = GWBUF_DATA(buffer);
+    gw_mysql_set_byte3(ptr, 1 + len);
+    ptr[3] = 0;
+    ptr[4] = MYSQL_COM_STMT_EXECUTE;
+    ptr += 5;
+    gw_mysql_set_byte4(ptr, my_session->stmt->id);
+    ptr[4] = 0; /*< No cursor */
+    gw_mysql_set_byte4(ptr + 5, 1);
+    ptr += 9;
+
+    if (n)
+    {
+        /** None of the parameters is NULL and they are all bound */
+        memset(ptr, 0, (n + 7) / 8);
+        ptr += (n + 7) / 8;
+        *ptr++ = 1;
+
+        for (int i = 0; i < n; i++)
+        {
+            gw_mysql_set_byte2(ptr, types[i]);
+            ptr += 2;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            PS_PARAM *param = &my_session->params[i];
+            const char *value = sql + param->offset;
+
+            switch (param->type)
+            {
+            case PARAM_INTEGER:
+            case PARAM_DOUBLE:
+                for (int j = 0; j < 8; j++)
+                {
+                    *ptr++ = values[i] >> (8 * j);
+                }
+                break;
+
+            case PARAM_DECIMAL:
+                ptr = put_lenenc(ptr, param->len);
+                memcpy(ptr, value, param->len);
+                ptr += param->len;
+                break;
+
+            case PARAM_STRING:
+                ptr = put_lenenc(ptr, values[i]);
+                for (int j = 0; j < param->len; j++)
+                {
+                    *ptr++ = value[j];
+                    if (value[j] == value[-1])
+                    {
+                        j++;
+                    }
+                }
+                break;
+            }
+        }
+    }
+
+    return buffer;
+}
+
+/**
+ * Forget the prepared statements of the session
+ *
+ * @param my_session The session
+ * @param close      Close the statements on the server
+ * @return The COM_STMT_CLOSE packets of the statements if close is true
+ */
+static GWBUF *
+forget_statements(PS_SESSION *my_session, bool close)
+{
+    GWBUF *packets = NULL;
+
+    for (int i = 0; i < my_session->n_stmts; i++)
+    {
+        PS_STMT *stmt = &my_session->stmts[i];
+
+        if (stmt->state == STMT_PREPARED && close)
+        {
+            uint8_t id[4];
+            gw_mysql_set_byte4(id, stmt->id);
+            packets = gwbuf_append(packets, create_packet(MYSQL_COM_STMT_CLOSE, id, sizeof(id)));
+        }
+
+        if (stmt->state == STMT_PREPARED)
+        {
+            stmt->state = STMT_COUNTING;
+            stmt->count = 0;
+        }
+    }
+
+    return packets;
+}
+
+/**
+ * Check whether a query is a USE statement
+ */
+static bool
+is_use(const char *sql, int len)
+{
+    int i = 0;
+
+    while (i < len && is_space(sql[i]))
+    {
+        i++;
+    }
+
+    return len - i > 3 && strncasecmp(sql + i, "use", 3) == 0 &&
+           (is_space(sql[i + 3]) || sql[i + 3] == '`');
+}
+
+/**
+ * Start following the reply to a command
+ *
+ * @param my_session The session
+ * @param command    The command
+ */
+static void
+reply_start(PS_SESSION *my_session, uint8_t command)
+{
+    my_session->command = command;
+    my_session->state = REPLY_FIRST;
+    my_session->n_left = 0;
+    my_session->hdr_len = 0;
+    my_session->left = 0;
+    my_session->continued = false;
+    my_session->large_packet = false;
+    my_session->peek_len = 0;
+}
+
+/**
+ * Decide what to do with a command
+ *
+ * @param my_session The session, its lock must be held
+ * @param buffer     The command, a complete packet
+ * @return The packets to route
+ */
+static GWBUF *
+promote(PS_SESSION *my_session, GWBUF *buffer)
+{
+    uint8_t *data = GWBUF_DATA(buffer);
+    size_t len = GWBUF_LENGTH(buffer);
+    uint8_t cmd = len > MYSQL_HEADER_LEN ? data[MYSQL_HEADER_LEN] : 0;
+    GWBUF *packets = NULL;
+
+    switch (cmd)
+    {
+    case MYSQL_COM_QUIT:
+    case MYSQL_COM_STMT_CLOSE:
+    case MYSQL_COM_STMT_SEND_LONG_DATA:
+        /** No reply */
+        return buffer;
+
+    case MYSQL_COM_BINLOG_DUMP:
+        /** The reply never ends */
+        my_session->passthrough = true;
+        return buffer;
+
+    case MYSQL_COM_CHANGE_USER:
+        /** The server closes the statements */
+        forget_statements(my_session, false);
+        break;
+
+    case MYSQL_COM_INIT_DB:
+        /** The tables of the statements were looked up in the old database */
+        packets = forget_statements(my_session, true);
+        break;
+
+    case MYSQL_COM_QUERY:
+        {
+            const char *sql = (const char *)data + MYSQL_HEADER_LEN + 1;
+            int sql_len = len - MYSQL_HEADER_LEN - 1;
+
+            if (is_use(sql, sql_len))
+            {
+                packets = forget_statements(my_session, true);
+            }
+            else if (my_session->active && GWBUF_LENGTH(buffer) < PS_MAX_PAYLOAD &&
+                     parameterize(my_session, sql, sql_len))
+            {
+                PS_STMT *stmt = find_stmt(my_session);
+                GWBUF *promoted = NULL;
+
+                free(my_session->text);
+                my_session->text = NULL;
+                my_session->query = buffer;
+                my_session->stmt = stmt;
+
+                if (stmt && stmt->state == STMT_PREPARED)
+                {
+                    if ((promoted = create_execute(my_session)))
+                    {
+                        my_session->wait = PS_WAIT_EXECUTE;
+                        ts_stats_add(my_session->instance->n_executed, 1);
+                    }
+                }
+                else if (stmt && stmt->state == STMT_COUNTING &&
+                         ++stmt->count >= my_session->instance->threshold)
+                {
+                    if ((promoted = create_packet(MYSQL_COM_STMT_PREPARE, stmt->sql, stmt->len)))
+                    {
+                        my_session->wait = PS_WAIT_PREPARE;
+                    }
+                }
+
+                if (promoted)
+                {
+                    reply_start(my_session, my_session->wait == PS_WAIT_EXECUTE ?
+                                MYSQL_COM_STMT_EXECUTE : MYSQL_COM_STMT_PREPARE);
+                    my_session->seq = 0;
+                    return promoted;
+                }
+
+                my_session->query = NULL;
+                my_session->stmt = NULL;
+            }
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    my_session->wait = PS_WAIT_REPLY;
+    reply_start(my_session, cmd);
+    return gwbuf_append(packets, buffer);
+}
+
+/**
+ * Get the server status of an OK packet
+ *
+ * @param ptr The payload of the packet
+ * @param len Number of bytes in ptr
+ * @return The status or 0 if the packet is too short
+ */
+static uint16_t
+ok_status(uint8_t *ptr, int len)
+{
+    int offset = 1;
+
+    for (int i = 0; i < 2; i++)
+    {
+        if (offset >= len)
+        {
+            return 0;
+        }
+
+        /** The affected rows and the last insert ID are length encoded */
+        switch (ptr[offset])
+        {
+        case 0xfc:
+            offset += 3;
+            break;
+        case 0xfd:
+            offset += 4;
+            break;
+        case 0xfe:
+            offset += 9;
+            break;
+        default:
+            offset += 1;
+            break;
+        }
+    }
+
+    return offset + 2 <= len ? gw_mysql_get_byte2(ptr + offset) : 0;
+}
+
+/**
+ * Process a complete packet of a reply that is forwarded as it is
+ *
+ * @param my_session The session
+ */
+static void
+reply_packet(PS_SESSION *my_session)
+{
+    uint8_t *ptr = my_session->peek;
+    uint8_t cmd = my_session->peek_len > 0 ? ptr[0] : 0;
+    bool is_eof = cmd == 0xfe && my_session->plen < 9;
+
+    switch (my_session->state)
+    {
+    case REPLY_FIRST:
+        if (cmd == 0x00 && my_session->command == MYSQL_COM_STMT_PREPARE)
+        {
+            int columns = my_session->peek_len >= 9 ? gw_mysql_get_byte2(ptr + 5) : 0;
+            int params = my_session->peek_len >= 9 ? gw_mysql_get_byte2(ptr + 7) : 0;
+
+            my_session->n_left = (params ? params + 1 : 0) + (columns ? columns + 1 : 0);
+            my_session->state = my_session->n_left ? REPLY_PREPARE : REPLY_DONE;
+        }
+        else if (cmd == 0x00)
+        {
+            uint16_t status = ok_status(ptr, my_session->peek_len);
+            my_session->state = status & MYSQL_SERVER_MORE_RESULTS_EXIST ? REPLY_FIRST : REPLY_DONE;
+        }
+        else if (cmd == 0xff)
+        {
+            my_session->state = REPLY_DONE;
+        }
+        else if (cmd == 0xfb || (cmd == 0xfe && my_session->command == MYSQL_COM_CHANGE_USER))
+        {
+            /** LOAD DATA LOCAL INFILE or an authentication switch */
+            my_session->state = REPLY_WAIT_OK;
+        }
+        else if (is_eof || my_session->command == MYSQL_COM_STATISTICS)
+        {
+            my_session->state = REPLY_DONE;
+        }
+        else
+        {
+            my_session->state = my_session->command == MYSQL_COM_FIELD_LIST ?
+                                REPLY_FIELDS : REPLY_COLUMNS;
+        }
+        break;
+
+    case REPLY_COLUMNS:
+        if (is_eof)
+        {
+            my_session->state = REPLY_ROWS;
+        }
+        else if (cmd == 0xff)
+        {
+            my_session->state = REPLY_DONE;
+        }
+        break;
+
+    case REPLY_ROWS:
+        if (is_eof)
+        {
+            uint16_t status = my_session->peek_len >= 5 ? gw_mysql_get_byte2(ptr + 3) : 0;
+            my_session->state = status & MYSQL_SERVER_MORE_RESULTS_EXIST ? REPLY_FIRST : REPLY_DONE;
+        }
+        else if (cmd == 0xff)
+        {
+            my_session->state = REPLY_DONE;
+        }
+        break;
+
+    case REPLY_FIELDS:
+        if (is_eof || cmd == 0xff)
+        {
+            my_session->state = REPLY_DONE;
+        }
+        break;
+
+    case REPLY_PREPARE:
+        if (--my_session->n_left == 0)
+        {
+            my_session->state = REPLY_DONE;
+        }
+        break;
+
+    case REPLY_WAIT_OK:
+        if (cmd == 0x00)
+        {
+            uint16_t status = ok_status(ptr, my_session->peek_len);
+            my_session->state = status & MYSQL_SERVER_MORE_RESULTS_EXIST ? REPLY_FIRST : REPLY_DONE;
+        }
+        else if (cmd == 0xff)
+        {
+            my_session->state = REPLY_DONE;
+        }
+        break;
+
+    case REPLY_SKIP:
+    case REPLY_DONE:
+        break;
+    }
+}
+
+/**
+ * Follow the packets of a reply that is forwarded as it is
+ *
+ * @param my_session The session, its lock must be held
+ * @param reply      The part of the reply that arrived
+ */
+static void
+reply_feed(PS_SESSION *my_session, GWBUF *reply)
+{
+    for (GWBUF *buffer = reply; buffer && my_session->state != REPLY_DONE; buffer = buffer->next)
+    {
+        uint8_t *ptr = GWBUF_DATA(buffer);
+        uint8_t *end = ptr + GWBUF_LENGTH(buffer);
+
+        while (ptr < end && my_session->state != REPLY_DONE)
+        {
+            if (my_session->hdr_len < MYSQL_HEADER_LEN)
+            {
+                my_session->hdr[my_session->hdr_len++] = *ptr++;
+
+                if (my_session->hdr_len == MYSQL_HEADER_LEN)
+                {
+                    my_session->plen = gw_mysql_get_byte3(my_session->hdr);
+                    my_session->left = my_session->plen;
+                    my_session->peek_len = 0;
+                    my_session->continued = my_session->large_packet;
+                    my_session->large_packet = my_session->plen == PS_MAX_PAYLOAD;
+                }
+            }
+            else
+            {
+                uint32_t n = MIN((uint32_t)(end - ptr), my_session->left);
+                int peek = MIN((int)n, PS_PEEK_LEN - my_session->peek_len);
+
+                if (peek > 0)
+                {
+                    memcpy(my_session->peek + my_session->peek_len, ptr, peek);
+                    my_session->peek_len += peek;
+                }
+                my_session->left -= n;
+                ptr += n;
+            }
+
+            if (my_session->hdr_len == MYSQL_HEADER_LEN && my_session->left == 0)
+            {
+                /** The rest of a large packet is not a packet of its own */
+                if (!my_session->continued)
+                {
+                    reply_packet(my_session);
+                }
+                my_session->hdr_len = 0;
+            }
+        }
+    }
+}
+
+/**
+ * Add a payload to the packets returned to the client
+ *
+ * @param my_session The session
+ * @param out        The packets returned to the client
+ * @param ptr        The payload
+ * @param len        Length of the payload
+ */
+static void
+emit(PS_SESSION *my_session, GWBUF **out, const uint8_t *ptr, size_t len)
+{
+    size_t n_packets = len / PS_MAX_PAYLOAD + 1;
+    GWBUF *buffer = gwbuf_alloc(len + n_packets * MYSQL_HEADER_LEN);
+
+    if (buffer)
+    {
+        uint8_t *dest = GWBUF_DATA(buffer);
+
+        for (size_t i = 0; i < n_packets; i++)
+        {
+            size_t plen = MIN(len, PS_MAX_PAYLOAD);
+            gw_mysql_set_byte3(dest, plen);
+            dest[3] = ++my_session->seq;
+            memcpy(dest + MYSQL_HEADER_LEN, ptr, plen);
+            dest += MYSQL_HEADER_LEN + plen;
+            ptr += plen;
+            len -= plen;
+        }
+
+        *out = gwbuf_append(*out, buffer);
+    }
+}
+
+/**
+ * Make room in the converted row
+ *
+ * @param my_session The session
+ * @param n          Number of bytes needed
+ * @return False if memory allocation failed
+ */
+static bool
+row_reserve(PS_SESSION *my_session, size_t n)
+{
+    if (my_session->row_len + n > my_session->row_size)
+    {
+        size_t size = MAX(my_session->row_size * 2, my_session->row_len + n + 256);
+        uint8_t *row = realloc(my_session->row, size);
+
+        if (row == NULL)
+        {
+            return false;
+        }
+        my_session->row = row;
+        my_session->row_size = size;
+    }
+
+    return true;
+}
+
+static bool
+row_put(PS_SESSION *my_session, const void *data, size_t len)
+{
+    if (!row_reserve(my_session, lenenc_size(len) + len))
+    {
+        return false;
+    }
+
+    uint8_t *ptr = put_lenenc(my_session->row + my_session->row_len, len);
+    memcpy(ptr, data, len);
+    my_session->row_len = ptr + len - my_session->row;
+    return true;
+}
+
+/**
+ * Print the fraction of a second of a temporal value
+ *
+ * @param text     The end of the value
+ * @param usec     The microseconds
+ * @param decimals Number of decimals of the column
+ * @return Number of bytes printed
+ */
+static int
+print_fraction(char *text, uint32_t usec, int decimals)
+{
+    if (decimals <= 0 || decimals > 6)
+    {
+        return 0;
+    }
+
+    char frac[8];
+    snprintf(frac, sizeof(frac), "%06u", usec % 1000000);
+    return sprintf(text, ".%.*s", decimals, frac);
+}
+
+/**
+ * Print a FLOAT or a DOUBLE the way the server does in the text protocol
+ *
+ * The value is printed with the fewest significant digits that read back as
+ * the same value and the exponent has no plus sign or leading zeros.
+ *
+ * @param text     The buffer, PS_VALUE_LEN bytes
+ * @param value    The value
+ * @param is_float The value is a FLOAT and must read back as one
+ * @return Length of the text
+ */
+static int
+print_real(char *text, double value, bool is_float)
+{
+    int max_digits = is_float ? FLT_DIG + 3 : DBL_DIG + 2;
+    int len = 0;
+
+    for (int digits = is_float ? FLT_DIG : DBL_DIG; digits <= max_digits; digits++)
+    {
+        len = snprintf(text, PS_VALUE_LEN, "%.*g", digits, value);
+
+        if (is_float ? strtof(text, NULL) == (float)value : strtod(text, NULL) == value)
+        {
+            break;
+        }
+    }
+
+    char *exp = strchr(text, 'e');
+
+    if (exp)
+    {
+        char *src = exp + 1;
+        char *dest = exp + 1;
+
+        if (*src == '+')
+        {
+            src++;
+        }
+        else if (*src == '-')
+        {
+            *dest++ = *src++;
+        }
+
+        while (*src == '0' && src[1])
+        {
+            src++;
+        }
+
+        memmove(dest, src, strlen(src) + 1);
+        len = strlen(text);
+    }
+
+    return len;
+}
+
+/**
+ * Convert a value of a binary row to text
+ *
+ * @param col  The column of the value
+ * @param ptr  The value, moved past it
+ * @param end  End of the row
+ * @param text The text of the value, PS_VALUE_LEN bytes
+ * @return Length of the text, -1 if the value is a string and -2 if the row
+ * ends before the value
+ */
+static int
+convert_value(PS_COLUMN *col, uint8_t **ptr, uint8_t *end, char *text)
+{
+    uint8_t *p = *ptr;
+    bool is_unsigned = col->flags & PS_UNSIGNED_FLAG;
+    size_t need;
+    int len;
+
+    switch (col->type)
+    {
+    case MYSQL_TYPE_TINY:
+        need = 1;
+        break;
+
+    case MYSQL_TYPE_SHORT:
+    case MYSQL_TYPE_YEAR:
+        need = 2;
+        break;
+
+    case MYSQL_TYPE_LONG:
+    case MYSQL_TYPE_INT24:
+    case MYSQL_TYPE_FLOAT:
+        need = 4;
+        break;
+
+    case MYSQL_TYPE_LONGLONG:
+    case MYSQL_TYPE_DOUBLE:
+        need = 8;
+        break;
+
+    case MYSQL_TYPE_DATE:
+    case MYSQL_TYPE_DATETIME:
+    case MYSQL_TYPE_TIMESTAMP:
+    case MYSQL_TYPE_TIME:
+        need = p < end ? 1 + *p : 1;
+        break;
+
+    default:
+        return -1;
+    }
+
+    if ((size_t)(end - p) < need)
+    {
+        return -2;
+    }
+
+    switch (col->type)
+    {
+    case MYSQL_TYPE_TINY:
+        len = is_unsigned ? sprintf(text, "%u", p[0]) : sprintf(text, "%d", (int8_t)p[0]);
+        break;
+
+    case MYSQL_TYPE_SHORT:
+        len = is_unsigned ? sprintf(text, "%u", gw_mysql_get_byte2(p)) :
+              sprintf(text, "%d", (int16_t)gw_mysql_get_byte2(p));
+        break;
+
+    case MYSQL_TYPE_YEAR:
+        len = sprintf(text, "%04u", gw_mysql_get_byte2(p));
+        break;
+
+    case MYSQL_TYPE_LONG:
+    case MYSQL_TYPE_INT24:
+        len = is_unsigned ? sprintf(text, "%u", (uint32_t)gw_mysql_get_byte4(p)) :
+              sprintf(text, "%d", (int32_t)gw_mysql_get_byte4(p));
+        break;
+
+    case MYSQL_TYPE_LONGLONG:
+        len = is_unsigned ?
+              sprintf(text, "%llu", (unsigned long long)gw_mysql_get_byte8(p)) :
+              sprintf(text, "%lld", (long long)gw_mysql_get_byte8(p));
+        break;
+
+    case MYSQL_TYPE_FLOAT:
+        {
+            float value;
+            memcpy(&value, p, sizeof(value));
+            len = col->decimals < PS_NOT_FIXED_DEC ?
+                  snprintf(text, PS_VALUE_LEN, "%.*f", col->decimals, value) :
+                  print_real(text, value, true);
+        }
+        break;
+
+    case MYSQL_TYPE_DOUBLE:
+        {
+            double value;
+            memcpy(&value, p, sizeof(value));
+            len = col->decimals < PS_NOT_FIXED_DEC ?
+                  snprintf(text, PS_VALUE_LEN, "%.*f", col->decimals, value) :
+                  print_real(text, value, false);
+        }
+        break;
+
+    case MYSQL_TYPE_DATE:
+    case MYSQL_TYPE_DATETIME:
+    case MYSQL_TYPE_TIMESTAMP:
+        {
+            unsigned year = p[0] >= 4 ? gw_mysql_get_byte2(p + 1) : 0;
+            unsigned month = p[0] >= 4 ? p[3] : 0;
+            unsigned day = p[0] >= 4 ? p[4] : 0;
+
+            len = sprintf(text, "%04u-%02u-%02u", year, month, day);
+
+            if (col->type != MYSQL_TYPE_DATE)
+            {
+                len += sprintf(text + len, " %02u:%02u:%02u",
+                               p[0] >= 7 ? p[5] : 0, p[0] >= 7 ? p[6] : 0, p[0] >= 7 ? p[7] : 0);
+                len += print_fraction(text + len, p[0] >= 11 ? gw_mysql_get_byte4(p + 8) : 0,
+                                      col->decimals);
+            }
+        }
+        break;
+
+    case MYSQL_TYPE_TIME:
+        {
+            bool negative = p[0] >= 8 && p[1];
+            unsigned long hours = p[0] >= 8 ? gw_mysql_get_byte4(p + 2) * 24UL + p[6] : 0;
+
+            len = sprintf(text, "%s%02lu:%02u:%02u", negative ? "-" : "", hours,
+                          p[0] >= 8 ? p[7] : 0, p[0] >= 8 ? p[8] : 0);
+            len += print_fraction(text + len, p[0] >= 12 ? gw_mysql_get_byte4(p + 9) : 0,
+                                  col->decimals);
+        }
+        break;
+
+    default:
+        len = 0;
+        break;
+    }
+
+    *ptr = p + need;
+    return MIN(len, PS_VALUE_LEN - 1);
+}
+
+/**
+ * Convert a binary row to a text row
+ *
+ * @param my_session The session
+ * @param ptr        The payload of the binary row
+ * @param len        Length of the payload
+ * @return False if the row is malformed or memory allocation failed
+ */
+static bool
+convert_row(PS_SESSION *my_session, uint8_t *ptr, size_t len)
+{
+    int n = my_session->n_columns;
+    size_t bitmap_len = (n + 7 + 2) / 8;
+    uint8_t *end = ptr + len;
+
+    if (len < 1 + bitmap_len)
+    {
+        return false;
+    }
+
+    /** The first two bits of the NULL bitmap of a binary row are not used */
+    uint8_t *nulls = ptr + 1;
+    ptr += 1 + bitmap_len;
+    my_session->row_len = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        if (nulls[(i + 2) / 8] & (1 << ((i + 2) % 8)))
+        {
+            if (!row_reserve(my_session, 1))
+            {
+                return false;
+            }
+            my_session->row[my_session->row_len++] = 0xfb;
+            continue;
+        }
+
+        char text[PS_VALUE_LEN];
+        uint8_t *value = ptr;
+        int text_len = convert_value(&my_session->columns[i], &ptr, end, text);
+
+        if (text_len == -1)
+        {
+            /** Strings, decimals and bits are length-encoded strings in both protocols */
+            uint64_t vlen;
+
+            if (!get_lenenc(&ptr, end, &vlen) || vlen > (uint64_t)(end - ptr))
+            {
+                return false;
+            }
+            ptr += vlen;
+
+            if (!row_reserve(my_session, ptr - value))
+            {
+                return false;
+            }
+            memcpy(my_session->row + my_session->row_len, value, ptr - value);
+            my_session->row_len += ptr - value;
+        }
+        else if (text_len < 0 || !row_put(my_session, text, text_len))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Read the type of a column from its definition
+ *
+ * @param ptr The payload of the column definition
+ * @param len Length of the payload
+ * @param col The column
+ * @return False if the definition is malformed
+ */
+static bool
+parse_column(uint8_t *ptr, size_t len, PS_COLUMN *col)
+{
+    uint8_t *end = ptr + len;
+    uint64_t value;
+
+    /** The catalog, schema, table, original table, name and original name */
+    for (int i = 0; i < 6; i++)
+    {
+        if (!get_lenenc(&ptr, end, &value) || value > (uint64_t)(end - ptr))
+        {
+            return false;
+        }
+        ptr += value;
+    }
+
+    /** The length of the fixed fields, the character set and the column length */
+    if (!get_lenenc(&ptr, end, &value) || end - ptr < 10)
+    {
+        return false;
+    }
+
+    col->type = ptr[6];
+    col->flags = gw_mysql_get_byte2(ptr + 7);
+    col->decimals = ptr[9];
+    return true;
+}
+
+/**
+ * End the promotion of the query in flight
+ *
+ * @param my_session The session
+ * @param resend     Send the query as it is
+ */
+static void
+promotion_end(PS_SESSION *my_session, bool resend)
+{
+    if (resend)
+    {
+        my_session->send = gwbuf_append(my_session->send, my_session->query);
+        my_session->wait = PS_WAIT_REPLY;
+        reply_start(my_session, MYSQL_COM_QUERY);
+    }
+    else
+    {
+        gwbuf_free(my_session->query);
+        my_session->wait = PS_WAIT_NONE;
+        my_session->state = REPLY_DONE;
+    }
+
+    my_session->query = NULL;
+    my_session->stmt = NULL;
+    free(my_session->columns);
+    my_session->columns = NULL;
+    my_session->n_columns = 0;
+    my_session->n_defs = 0;
+}
+
+/**
+ * Process a packet of the reply to the COM_STMT_PREPARE of a statement
+ *
+ * @param my_session The session
+ * @param ptr        The payload
+ * @param len        Length of the payload
+ */
+static void
+prepare_payload(PS_SESSION *my_session, uint8_t *ptr, size_t len)
+{
+    PS_STMT *stmt = my_session->stmt;
+
+    if (my_session->state == REPLY_FIRST)
+    {
+        if (len >= 9 && ptr[0] == 0x00)
+        {
+            int columns = gw_mysql_get_byte2(ptr + 5);
+            int params = gw_mysql_get_byte2(ptr + 7);
+
+            stmt->id = gw_mysql_get_byte4(ptr + 1);
+            my_session->n_left = (params ? params + 1 : 0) + (columns ? columns + 1 : 0);
+            my_session->state = REPLY_PREPARE;
+
+            if (params != my_session->n_params)
+            {
+                /** The server did not find the same literals, the statement isn't used */
+                uint8_t id[4];
+                gw_mysql_set_byte4(id, stmt->id);
+                my_session->send = create_packet(MYSQL_COM_STMT_CLOSE, id, sizeof(id));
+                stmt->state = STMT_FAILED;
+            }
+
+            if (my_session->n_left > 0)
+            {
+                return;
+            }
+        }
+        else
+        {
+            MXS_INFO("psfilter: Failed to prepare statement: %.*s", stmt->len, stmt->sql);
+            stmt->state = STMT_FAILED;
+            ts_stats_add(my_session->instance->n_failed, 1);
+            promotion_end(my_session, true);
+            return;
+        }
+    }
+
+    else if (--my_session->n_left > 0)
+    {
+        return;
+    }
+
+    if (stmt->state == STMT_FAILED)
+    {
+        ts_stats_add(my_session->instance->n_failed, 1);
+        promotion_end(my_session, true);
+    }
+    else
+    {
+        GWBUF *execute;
+
+        stmt->state = STMT_PREPARED;
+        ts_stats_add(my_session->instance->n_prepared, 1);
+
+        if ((execute = create_execute(my_session)))
+        {
+            my_session->send = execute;
+            my_session->wait = PS_WAIT_EXECUTE;
+            reply_start(my_session, MYSQL_COM_STMT_EXECUTE);
+            ts_stats_add(my_session->instance->n_executed, 1);
+        }
+        else
+        {
+            promotion_end(my_session, true);
+        }
+    }
+}
+
+/**
+ * Process a packet of the reply to the COM_STMT_EXECUTE of a promoted query
+ *
+ * @param my_session The session
+ * @param out        The packets returned to the client
+ * @param ptr        The payload
+ * @param len        Length of the payload
+ */
+static void
+execute_payload(PS_SESSION *my_session, GWBUF **out, uint8_t *ptr, size_t len)
+{
+    uint8_t cmd = len > 0 ? ptr[0] : 0;
+    bool is_eof = cmd == 0xfe && len < 9;
+
+    switch (my_session->state)
+    {
+    case REPLY_FIRST:
+        if (cmd == 0xff && len >= 3 && gw_mysql_get_byte2(ptr + 1) == PS_ER_UNKNOWN_STMT_HANDLER)
+        {
+            /** The connection to the server was created again */
+            forget_statements(my_session, false);
+            promotion_end(my_session, true);
+            return;
+        }
+        else if (cmd == 0x00 || cmd == 0xff)
+        {
+            emit(my_session, out, ptr, len);
+            promotion_end(my_session, false);
+            return;
+        }
+        else
+        {
+            uint8_t *p = ptr;
+            uint64_t n_columns;
+
+            if (!get_lenenc(&p, ptr + len, &n_columns) || n_columns == 0 ||
+                (my_session->columns = calloc(n_columns, sizeof(PS_COLUMN))) == NULL)
+            {
+                break;
+            }
+            my_session->n_columns = n_columns;
+            my_session->n_defs = 0;
+            my_session->state = REPLY_COLUMNS;
+            emit(my_session, out, ptr, len);
+        }
+        return;
+
+    case REPLY_COLUMNS:
+        if (my_session->n_defs < my_session->n_columns && cmd != 0xff)
+        {
+            if (!parse_column(ptr, len, &my_session->columns[my_session->n_defs++]))
+            {
+                break;
+            }
+        }
+        else if (is_eof)
+        {
+            my_session->state = REPLY_ROWS;
+        }
+        else
+        {
+            emit(my_session, out, ptr, len);
+            promotion_end(my_session, false);
+            return;
+        }
+        emit(my_session, out, ptr, len);
+        return;
+
+    case REPLY_ROWS:
+        if (is_eof || cmd == 0xff)
+        {
+            emit(my_session, out, ptr, len);
+            promotion_end(my_session, false);
+        }
+        else if (convert_row(my_session, ptr, len))
+        {
+            emit(my_session, out, my_session->row, my_session->row_len);
+        }
+        else
+        {
+            break;
+        }
+        return;
+
+    case REPLY_SKIP:
+        if (is_eof || cmd == 0xff)
+        {
+            promotion_end(my_session, false);
+        }
+        return;
+
+    default:
+        return;
+    }
+
+    /** The rest of the result can't be returned */
+    MXS_ERROR("psfilter: Failed to convert the result of a prepared statement.");
+    const char *msg = "Failed to convert the result of a prepared statement";
+    uint8_t err[3 + 6 + 64];
+    err[0] = 0xff;
+    gw_mysql_set_byte2(err + 1, 1105);
+    memcpy(err + 3, "#HY000", 6);
+    memcpy(err + 9, msg, strlen(msg));
+    emit(my_session, out, err, 9 + strlen(msg));
+    my_session->state = REPLY_SKIP;
+}
+
+/**
+ * Process the reply to a promoted query
+ *
+ * @param my_session The session, its lock must be held
+ * @return The packets returned to the client
+ */
+static GWBUF *
+promoted_reply(PS_SESSION *my_session)
+{
+    GWBUF *out = NULL;
+    GWBUF *packet;
+
+    while ((my_session->wait == PS_WAIT_PREPARE || my_session->wait == PS_WAIT_EXECUTE) &&
+           (packet = modutil_get_next_MySQL_packet(&my_session->reply)))
+    {
+        size_t len = MYSQL_GET_PACKET_LEN((uint8_t *)GWBUF_DATA(packet));
+
+        if (len == PS_MAX_PAYLOAD || my_session->large)
+        {
+            /** A large row, the payloads of the packets are joined */
+            packet = gwbuf_consume(packet, MYSQL_HEADER_LEN);
+            my_session->large = gwbuf_append(my_session->large, packet);
+
+            if (len == PS_MAX_PAYLOAD)
+            {
+                continue;
+            }
+            packet = gwbuf_make_contiguous(my_session->large);
+            my_session->large = NULL;
+
+            if (packet == NULL)
+            {
+                continue;
+            }
+            len = GWBUF_LENGTH(packet);
+        }
+        else
+        {
+            packet = gwbuf_consume(packet, MYSQL_HEADER_LEN);
+        }
+
+        uint8_t *ptr = packet ? GWBUF_DATA(packet) : (uint8_t *)"";
+
+        if (my_session->wait == PS_WAIT_PREPARE)
+        {
+            prepare_payload(my_session, ptr, len);
+        }
+        else
+        {
+            execute_payload(my_session, &out, ptr, len);
+        }
+        gwbuf_free(packet);
+    }
+
+    if (my_session->wait != PS_WAIT_PREPARE && my_session->wait != PS_WAIT_EXECUTE)
+    {
+        /** Anything after the end of the reply is not a part of it */
+        gwbuf_free(my_session->reply);
+        gwbuf_free(my_session->large);
+        my_session->reply = NULL;
+        my_session->large = NULL;
+    }
+
+    return out;
+}
+
+/**
+ * Route packets one at a time
+ *
+ * @param my_session The session
+ * @param packets    The packets
+ * @return 0 if routing failed
+ */
+static int
+route_packets(PS_SESSION *my_session, GWBUF *packets)
+{
+    int rc = 1;
+    GWBUF *packet;
+
+    while (rc && (packet = modutil_get_next_MySQL_packet(&packets)))
+    {
+        rc = my_session->down.routeQuery(my_session->down.instance,
+                                         my_session->down.session, packet);
+    }
+
+    gwbuf_free(packets);
+    return rc;
+}
+
+/**
+ * Route the commands of a session for as long as they can be routed. Only one
+ * thread at a time routes the commands of a session, the others leave them to it.
+ *
+ * @param my_session The session
+ */
+static void
+dispatch(PS_SESSION *my_session)
+{
+    bool failed = false;
+
+    spinlock_acquire(&my_session->lock);
+
+    while (!my_session->routing &&
+           (my_session->send ||
+            (my_session->head && (my_session->wait == PS_WAIT_NONE || my_session->head->continued))))
+    {
+        GWBUF *buffer;
+
+        if (my_session->send)
+        {
+            buffer = my_session->send;
+            my_session->send = NULL;
+        }
+        else
+        {
+            PS_QUERY *query = my_session->head;
+
+            my_session->head = query->next;
+            if (my_session->head == NULL)
+            {
+                my_session->tail = NULL;
+            }
+            my_session->n_queued--;
+
+            buffer = query->continued || my_session->passthrough ?
+                     query->buffer : promote(my_session, query->buffer);
+            free(query);
+        }
+
+        my_session->routing = true;
+        spinlock_release(&my_session->lock);
+
+        int rc = route_packets(my_session, buffer);
+
+        spinlock_acquire(&my_session->lock);
+        my_session->routing = false;
+
+        if (rc == 0)
+        {
+            failed = true;
+            break;
+        }
+    }
+
+    spinlock_release(&my_session->lock);
+
+    if (failed && my_session->session->client_dcb)
+    {
+        /** Routing failed, the session is closed like the protocol would do */
+        poll_fake_hangup_event(my_session->session->client_dcb);
+    }
+}
+
+/**
+ * Close a session with the filter, this is the mechanism
+ * by which a filter may cleanup data structure etc.
+ *
+ * @param instance  The filter instance data
+ * @param session   The session being closed
+ */
+static void
+closeSession(FILTER *instance, void *session)
+{
+}
+
+/**
+ * Free the memory associated with the session
+ *
+ * @param instance  The filter instance
+ * @param session   The filter session
+ */
+static void
+freeSession(FILTER *instance, void *session)
+{
+    PS_SESSION *my_session = (PS_SESSION *) session;
+    PS_QUERY *query = my_session->head;
+
+    while (query)
+    {
+        PS_QUERY *next = query->next;
+        gwbuf_free(query->buffer);
+        free(query);
+        query = next;
+    }
+
+    for (int i = 0; i < my_session->n_stmts; i++)
+    {
+        free(my_session->stmts[i].sql);
+    }
+
+    gwbuf_free(my_session->input);
+    gwbuf_free(my_session->send);
+    gwbuf_free(my_session->query);
+    gwbuf_free(my_session->reply);
+    gwbuf_free(my_session->large);
+    free(my_session->text);
+    free(my_session->columns);
+    free(my_session->row);
+    free(my_session->stmts);
+    free(session);
+}
+
+/**
+ * Set the downstream filter or router to which queries will be
+ * passed from this filter.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param downstream    The downstream filter or router.
+ */
+static void
+setDownstream(FILTER *instance, void *session, DOWNSTREAM *downstream)
+{
+    PS_SESSION *my_session = (PS_SESSION *) session;
+
+    my_session->down = *downstream;
+}
+
+/**
+ * Set the upstream filter or session to which results will be
+ * passed from this filter.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param upstream  The upstream filter or session.
+ */
+static void
+setUpstream(FILTER *instance, void *session, UPSTREAM *upstream)
+{
+    PS_SESSION *my_session = (PS_SESSION *) session;
+
+    my_session->up = *upstream;
+}
+
+/**
+ * The routeQuery entry point. The data from the client is split into
+ * commands, which are routed one at a time.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param queue     The query data
+ */
+static int
+routeQuery(FILTER *instance, void *session, GWBUF *queue)
+{
+    PS_SESSION *my_session = (PS_SESSION *) session;
+
+    if (!my_session->active)
+    {
+        return my_session->down.routeQuery(my_session->down.instance,
+                                           my_session->down.session, queue);
+    }
+
+    spinlock_acquire(&my_session->lock);
+    bool direct = my_session->passthrough ||
+                  (my_session->wait == PS_WAIT_REPLY && my_session->state == REPLY_WAIT_OK);
+    spinlock_release(&my_session->lock);
+
+    if (direct)
+    {
+        /** The data of LOAD DATA LOCAL INFILE or an authentication exchange */
+        return my_session->down.routeQuery(my_session->down.instance,
+                                           my_session->down.session, queue);
+    }
+
+    GWBUF *packet;
+    bool error = false;
+
+    spinlock_acquire(&my_session->lock);
+    my_session->input = gwbuf_append(my_session->input, queue);
+
+    while ((packet = modutil_get_next_MySQL_packet(&my_session->input)))
+    {
+        PS_QUERY *query = malloc(sizeof(PS_QUERY));
+
+        if (query == NULL)
+        {
+            gwbuf_free(packet);
+            error = true;
+            break;
+        }
+
+        query->buffer = packet;
+        query->continued = my_session->input_large;
+        query->next = NULL;
+        my_session->input_large = MYSQL_GET_PACKET_LEN((uint8_t *)GWBUF_DATA(packet)) == PS_MAX_PAYLOAD;
+
+        if (my_session->tail)
+        {
+            my_session->tail->next = query;
+        }
+        else
+        {
+            my_session->head = query;
+        }
+        my_session->tail = query;
+        my_session->n_queued++;
+    }
+    spinlock_release(&my_session->lock);
+
+    if (error)
+    {
+        MXS_ERROR("psfilter: Memory allocation failed.");
+        return 0;
+    }
+
+    dispatch(my_session);
+    return 1;
+}
+
+/**
+ * The clientReply entry point. The replies to promoted queries are converted
+ * to text protocol replies, other replies are followed to find their end.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param reply     The reply
+ */
+static int
+clientReply(FILTER *instance, void *session, GWBUF *reply)
+{
+    PS_SESSION *my_session = (PS_SESSION *) session;
+    bool done = false;
+
+    spinlock_acquire(&my_session->lock);
+    switch (my_session->wait)
+    {
+    case PS_WAIT_REPLY:
+        reply_feed(my_session, reply);
+
+        if (my_session->state == REPLY_DONE)
+        {
+            my_session->wait = PS_WAIT_NONE;
+            done = true;
+        }
+        break;
+
+    case PS_WAIT_PREPARE:
+    case PS_WAIT_EXECUTE:
+        my_session->reply = gwbuf_append(my_session->reply, reply);
+        reply = promoted_reply(my_session);
+        done = my_session->wait == PS_WAIT_NONE || my_session->send;
+        break;
+
+    default:
+        break;
+    }
+    spinlock_release(&my_session->lock);
+
+    int rc = 1;
+
+    if (reply)
+    {
+        /* Pass the result upstream */
+        rc = my_session->up.clientReply(my_session->up.instance,
+                                        my_session->up.session, reply);
+    }
+
+    if (done)
+    {
+        dispatch(my_session);
+    }
+
+    return rc;
+}
+
+/**
+ * Diagnostics routine
+ *
+ * If fsession is NULL then print diagnostics on the filter
+ * instance as a whole, otherwise print diagnostics for the
+ * particular session.
+ *
+ * @param   instance    The filter instance
+ * @param   fsession    Filter session, may be NULL
+ * @param   dcb     The DCB for diagnostic output
+ */
+static void
+diagnostic(FILTER *instance, void *fsession, DCB *dcb)
+{
+    PS_INSTANCE *my_instance = (PS_INSTANCE *) instance;
+    PS_SESSION *my_session = (PS_SESSION *) fsession;
+
+    dcb_printf(dcb, "\t\tThreshold                      %d\n", my_instance->threshold);
+    dcb_printf(dcb, "\t\tStatements per session         %d\n", my_instance->max_statements);
+    dcb_printf(dcb, "\t\tPrepared statements            %ld\n",
+               (long)ts_stats_sum(my_instance->n_prepared));
+    dcb_printf(dcb, "\t\tFailed preparations            %ld\n",
+               (long)ts_stats_sum(my_instance->n_failed));
+    dcb_printf(dcb, "\t\tPromoted queries               %ld\n",
+               (long)ts_stats_sum(my_instance->n_executed));
+
+    if (my_session)
+    {
+        int n_prepared = 0;
+
+        spinlock_acquire(&my_session->lock);
+        for (int i = 0; i < my_session->n_stmts; i++)
+        {
+            n_prepared += my_session->stmts[i].state == STMT_PREPARED;
+        }
+        spinlock_release(&my_session->lock);
+
+        dcb_printf(dcb, "\t\tStatements of the session      %d, %d prepared\n",
+                   my_session->n_stmts, n_prepared);
+    }
+}
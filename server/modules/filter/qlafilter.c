@@ -26,6 +26,13 @@
  * file to which the queries are logged. A serial number is appended to this
  * name in order that each session logs to a different file.
  *
+ * With log_type=unified all sessions log to one shared file. With async=true
+ * the worker threads only queue the queries and a writer thread of the filter
+ * instance formats them and writes them to the files in batches.
+ *
+ * With log_type=capture the packets the clients send are written as they are
+ * to one binary file, see qlacapture.h, from which qlareplay can replay them.
+ *
  * Date         Who             Description
  * 03/06/2014   Mark Riddoch    Initial implementation
  * 11/06/2014   Mark Riddoch    Addition of source and match parameters
@@ -46,7 +53,13 @@
 #include <sys/time.h>
 #include <regex.h>
 #include <string.h>
+#include <sched.h>
+#include <semaphore.h>
 #include <atomic.h>
+#include <thread.h>
+#include <platform.h>
+#include <qlacapture.h>
+#include "maxconfig.h"
 
 MODULE_INFO info =
 {
@@ -61,6 +74,31 @@ static char *version_str = "V1.1.1";
 /** Formatting buffer size */
 #define QLA_STRING_BUFFER_SIZE 1024
 
+/** Number of queries in the queue of a worker thread, a power of two */
+#define QLA_QUEUE_SIZE 4096
+
+/** Maximum number of session log files the writer thread keeps open */
+#define QLA_MAX_OPEN_FILES 64
+
+/** Size of the stdio buffer of the unified log file */
+#define QLA_WRITE_BUFFER_SIZE 65536
+
+/** Logging destinations */
+enum qla_log_type
+{
+    QLA_LOG_SESSION, /*< Each session logs to its own file */
+    QLA_LOG_UNIFIED, /*< All sessions log to one file */
+    QLA_LOG_CAPTURE  /*< The packets of all sessions are captured to one file */
+};
+
+/** Types of queued records */
+enum qla_record_type
+{
+    QLA_RECORD_QUERY, /*< A query of a session */
+    QLA_RECORD_START, /*< The start of a session, only queued when capturing */
+    QLA_RECORD_END    /*< The end of a session */
+};
+
 /*
  * The filter entry points
  */
@@ -71,6 +109,7 @@ static void freeSession(FILTER *instance, void *session);
 static void setDownstream(FILTER *instance, void *fsession, DOWNSTREAM *downstream);
 static int routeQuery(FILTER *instance, void *fsession, GWBUF *queue);
 static void diagnostic(FILTER *instance, void *fsession, DCB *dcb);
+static uint32_t getInterest(FILTER *instance);
 
 
 static FILTER_OBJECT MyObject =
@@ -84,8 +123,55 @@ static FILTER_OBJECT MyObject =
     routeQuery,
     NULL, // No client reply
     diagnostic,
+    getInterest
 };
 
+/**
+ * The log of a session in the asynchronous mode. It is owned by the writer
+ * thread, which frees it once the session has closed and all its queries
+ * have been written.
+ */
+typedef struct
+{
+    char *filename; /* The log file of the session, NULL with a unified log */
+    char *client; /* The user@host of the client */
+    size_t session_id; /* The id of the session */
+    FILE *fp; /* The open log file, NULL if it is not in the file cache */
+    int slot; /* Index in the file cache */
+    unsigned long last_used; /* When the file was last written to */
+    bool created; /* Whether the file has been created */
+    bool failed; /* Whether opening the file failed */
+    bool closed; /* Whether the session has closed */
+    int pending; /* Queued queries that have not been written */
+} QLA_LOG;
+
+/**
+ * A query queued for the writer thread. When capturing, the record holds a
+ * copy of the packets instead of the SQL.
+ */
+typedef struct
+{
+    enum qla_record_type type; /* What the record is */
+    struct timeval tv; /* When the query was received */
+    QLA_LOG *log; /* The log of the session */
+    char *sql; /* The SQL of the query */
+    uint8_t *packets; /* The captured packets */
+    uint32_t packets_len; /* Length of the captured packets */
+} QLA_RECORD;
+
+/**
+ * The queue of a worker thread. Only its own thread adds records to it and
+ * only the writer thread removes them. The last queue of an instance is
+ * shared by the threads that have no queue of their own and is locked.
+ */
+typedef struct
+{
+    QLA_RECORD records[QLA_QUEUE_SIZE];
+    uint32_t head; /* The next record to add */
+    uint32_t tail; /* The next record to write */
+    SPINLOCK lock; /* Used only for the shared queue */
+} QLA_QUEUE;
+
 /**
  * A instance structure, the assumption is that the option passed
  * to the filter is simply a base for the filename to which the queries
@@ -104,6 +190,18 @@ typedef struct
     regex_t re; /* Compiled regex text */
     char *nomatch; /* Optional text to match against for exclusion */
     regex_t nore; /* Compiled regex nomatch text */
+    enum qla_log_type log_type; /* Where the queries are logged */
+    char *unified_filename; /* The file of the unified log */
+    FILE *unified_fp; /* The unified log file */
+    bool async; /* Whether the queries are written by the writer thread */
+    QLA_QUEUE *queues; /* The queues of the worker threads */
+    int n_queues; /* Number of queues */
+    sem_t ready; /* Posted for every queued record */
+    THREAD writer; /* The writer thread */
+    QLA_LOG *open_files[QLA_MAX_OPEN_FILES]; /* Session log files kept open */
+    int n_open_files; /* Number of open session log files */
+    unsigned long use_count; /* Counter for the least recently used file */
+    unsigned long n_written; /* Queries written by the writer thread */
 } QLA_INSTANCE;
 
 /**
@@ -122,8 +220,16 @@ typedef struct
     int active;
     char *user;
     char *remote;
+    QLA_LOG *log; /* The log of the session in the asynchronous mode */
 } QLA_SESSION;
 
+/** The queue of the calling thread, assigned when the thread first logs a query */
+static thread_local int qla_thread_queue = -1;
+static int qla_n_threads = 0;
+
+static bool qla_start_writer(QLA_INSTANCE *instance);
+static void qla_queue_record(QLA_INSTANCE *instance, QLA_RECORD *record);
+
 /**
  * Implementation of the mandatory version entry point
  *
@@ -183,6 +289,15 @@ createInstance(char **options, FILTER_PARAMETER **params)
         my_instance->match = NULL;
         my_instance->nomatch = NULL;
         my_instance->filebase = NULL;
+        my_instance->log_type = QLA_LOG_SESSION;
+        my_instance->unified_filename = NULL;
+        my_instance->unified_fp = NULL;
+        my_instance->async = false;
+        my_instance->queues = NULL;
+        my_instance->n_queues = 0;
+        my_instance->n_open_files = 0;
+        my_instance->use_count = 0;
+        my_instance->n_written = 0;
         bool error = false;
 
         if (params)
@@ -209,6 +324,31 @@ createInstance(char **options, FILTER_PARAMETER **params)
                 {
                     my_instance->filebase = strdup(params[i]->value);
                 }
+                else if (!strcmp(params[i]->name, "log_type"))
+                {
+                    if (!strcmp(params[i]->value, "session"))
+                    {
+                        my_instance->log_type = QLA_LOG_SESSION;
+                    }
+                    else if (!strcmp(params[i]->value, "unified"))
+                    {
+                        my_instance->log_type = QLA_LOG_UNIFIED;
+                    }
+                    else if (!strcmp(params[i]->value, "capture"))
+                    {
+                        my_instance->log_type = QLA_LOG_CAPTURE;
+                    }
+                    else
+                    {
+                        MXS_ERROR("qlafilter: Unknown log_type '%s', expected "
+                                  "'session', 'unified' or 'capture'.", params[i]->value);
+                        error = true;
+                    }
+                }
+                else if (!strcmp(params[i]->name, "async"))
+                {
+                    my_instance->async = config_truth_value(params[i]->value);
+                }
                 else if (!filter_standard_parameter(params[i]->name))
                 {
                     MXS_ERROR("qlafilter: Unexpected parameter '%s'.",
@@ -273,8 +413,62 @@ createInstance(char **options, FILTER_PARAMETER **params)
             error = true;
         }
 
+        if (my_instance->log_type == QLA_LOG_CAPTURE)
+        {
+            /** The capture has the whole traffic and is always written asynchronously */
+            if (my_instance->match || my_instance->nomatch)
+            {
+                MXS_ERROR("qlafilter: The 'match' and 'exclude' parameters "
+                          "cannot be used with log_type=capture.");
+                error = true;
+            }
+            my_instance->async = true;
+        }
+
+        if (!error && my_instance->log_type != QLA_LOG_SESSION)
+        {
+            if ((my_instance->unified_filename = malloc(strlen(my_instance->filebase) + 9)) == NULL)
+            {
+                error = true;
+            }
+            else
+            {
+                sprintf(my_instance->unified_filename, "%s.%s", my_instance->filebase,
+                        my_instance->log_type == QLA_LOG_CAPTURE ? "capture" : "unified");
+
+                if ((my_instance->unified_fp = fopen(my_instance->unified_filename, "w")) == NULL)
+                {
+                    char errbuf[STRERROR_BUFLEN];
+                    MXS_ERROR("qlafilter: Opening output file '%s' failed due to %d, %s",
+                              my_instance->unified_filename, errno,
+                              strerror_r(errno, errbuf, sizeof(errbuf)));
+                    error = true;
+                }
+                else if (my_instance->async)
+                {
+                    setvbuf(my_instance->unified_fp, NULL, _IOFBF, QLA_WRITE_BUFFER_SIZE);
+
+                    if (my_instance->log_type == QLA_LOG_CAPTURE)
+                    {
+                        fwrite(QLA_CAPTURE_MAGIC, 1, QLA_CAPTURE_MAGIC_LEN, my_instance->unified_fp);
+                    }
+                }
+            }
+        }
+
+        if (!error && my_instance->async && !qla_start_writer(my_instance))
+        {
+            error = true;
+        }
+
         if (error)
         {
+            if (my_instance->unified_fp)
+            {
+                fclose(my_instance->unified_fp);
+            }
+            free(my_instance->unified_filename);
+
             if (my_instance->match)
             {
                 free(my_instance->match);
@@ -348,7 +542,43 @@ newSession(FILTER *instance, SESSION *session)
         // Multiple sessions can try to update my_instance->sessions simultaneously
         atomic_add(&(my_instance->sessions), 1);
 
-        if (my_session->active)
+        if (my_session->active && my_instance->async)
+        {
+            /** The writer thread creates the file when the first query is logged */
+            QLA_LOG *log = calloc(1, sizeof(QLA_LOG));
+
+            if (log == NULL ||
+                (my_instance->log_type == QLA_LOG_SESSION &&
+                 (log->filename = strdup(my_session->filename)) == NULL) ||
+                (log->client = malloc(strlen(userName) + strlen(remote) + 2)) == NULL)
+            {
+                if (log)
+                {
+                    free(log->filename);
+                }
+                free(log);
+                free(my_session->filename);
+                free(my_session);
+                return NULL;
+            }
+
+            sprintf(log->client, "%s@%s", userName, remote);
+            log->session_id = session->ses_id;
+            log->slot = -1;
+            my_session->log = log;
+
+            if (my_instance->log_type == QLA_LOG_CAPTURE)
+            {
+                QLA_RECORD record = {.type = QLA_RECORD_START, .log = log};
+                gettimeofday(&record.tv, NULL);
+                qla_queue_record(my_instance, &record);
+            }
+        }
+        else if (my_session->active && my_instance->log_type == QLA_LOG_UNIFIED)
+        {
+            my_session->fp = my_instance->unified_fp;
+        }
+        else if (my_session->active)
         {
             my_session->fp = fopen(my_session->filename, "w");
 
@@ -387,9 +617,19 @@ newSession(FILTER *instance, SESSION *session)
 static void
 closeSession(FILTER *instance, void *session)
 {
+    QLA_INSTANCE *my_instance = (QLA_INSTANCE *) instance;
     QLA_SESSION *my_session = (QLA_SESSION *) session;
 
-    if (my_session->active && my_session->fp)
+    if (my_session->log)
+    {
+        /** The writer thread frees the log once all its queries are written */
+        QLA_RECORD record = {.type = QLA_RECORD_END, .log = my_session->log};
+        gettimeofday(&record.tv, NULL);
+        qla_queue_record(my_instance, &record);
+        my_session->log = NULL;
+    }
+    else if (my_session->active && my_session->fp &&
+             my_session->fp != my_instance->unified_fp)
     {
         fclose(my_session->fp);
     }
@@ -447,12 +687,34 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
     struct tm t;
     struct timeval tv;
 
-    if (my_session->active)
+    if (my_session->log && my_instance->log_type == QLA_LOG_CAPTURE)
+    {
+        /** The buffer is copied as the routers may modify it */
+        size_t len = gwbuf_length(queue);
+        QLA_RECORD record = {.type = QLA_RECORD_QUERY, .log = my_session->log,
+                             .packets = malloc(len), .packets_len = len};
+
+        if (record.packets)
+        {
+            gwbuf_copy_data(queue, 0, len, record.packets);
+            gettimeofday(&record.tv, NULL);
+            atomic_add(&my_session->log->pending, 1);
+            qla_queue_record(my_instance, &record);
+        }
+    }
+    else if (my_session->log)
     {
-        if (queue->next != NULL)
+        /** The writer thread matches, formats and frees the SQL */
+        if ((ptr = modutil_get_SQL(queue)) != NULL)
         {
-            queue = gwbuf_make_contiguous(queue);
+            QLA_RECORD record = {.type = QLA_RECORD_QUERY, .log = my_session->log, .sql = ptr};
+            gettimeofday(&record.tv, NULL);
+            atomic_add(&my_session->log->pending, 1);
+            qla_queue_record(my_instance, &record);
         }
+    }
+    else if (my_session->active)
+    {
         if ((ptr = modutil_get_SQL(queue)) != NULL)
         {
             if ((my_instance->match == NULL ||
@@ -475,6 +737,24 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
                                        my_session->down.session, queue);
 }
 
+/**
+ * The statements are logged, the capture mode records all packets
+ *
+ * @param instance  The filter instance
+ * @return The classes of packets the filter acts on
+ */
+static uint32_t
+getInterest(FILTER *instance)
+{
+    QLA_INSTANCE *my_instance = (QLA_INSTANCE *) instance;
+
+    if (my_instance->log_type == QLA_LOG_CAPTURE)
+    {
+        return FILTER_INTEREST_ALL;
+    }
+    return FILTER_INTEREST_SQL;
+}
+
 /**
  * Diagnostics routine
  *
@@ -492,11 +772,26 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
     QLA_INSTANCE *my_instance = (QLA_INSTANCE *) instance;
     QLA_SESSION *my_session = (QLA_SESSION *) fsession;
 
-    if (my_session)
+    if (my_instance->unified_filename)
+    {
+        dcb_printf(dcb, "\t\tLogging to file            %s.\n",
+                   my_instance->unified_filename);
+    }
+    else if (my_session)
     {
         dcb_printf(dcb, "\t\tLogging to file            %s.\n",
                    my_session->filename);
     }
+    if (my_instance->log_type == QLA_LOG_CAPTURE)
+    {
+        dcb_printf(dcb, "\t\tPackets captured                %lu\n",
+                   __atomic_load_n(&my_instance->n_written, __ATOMIC_RELAXED));
+    }
+    else if (my_instance->async)
+    {
+        dcb_printf(dcb, "\t\tQueries written asynchronously  %lu\n",
+                   __atomic_load_n(&my_instance->n_written, __ATOMIC_RELAXED));
+    }
     if (my_instance->source)
     {
         dcb_printf(dcb, "\t\tLimit logging to connections from  %s\n",
@@ -518,3 +813,328 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
                    my_instance->nomatch);
     }
 }
+
+/**
+ * Add a record to the queue of the calling thread. If the queue is full the
+ * thread waits until the writer thread has made room in it so that no
+ * queries are lost.
+ *
+ * @param instance  The filter instance
+ * @param record    The record to add
+ */
+static void
+qla_queue_record(QLA_INSTANCE *instance, QLA_RECORD *record)
+{
+    if (qla_thread_queue == -1)
+    {
+        qla_thread_queue = atomic_add(&qla_n_threads, 1);
+    }
+
+    bool shared = qla_thread_queue >= instance->n_queues - 1;
+    QLA_QUEUE *queue = &instance->queues[shared ? instance->n_queues - 1 : qla_thread_queue];
+
+    if (shared)
+    {
+        spinlock_acquire(&queue->lock);
+    }
+
+    uint32_t head = queue->head;
+
+    while (head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) == QLA_QUEUE_SIZE)
+    {
+        sem_post(&instance->ready);
+        sched_yield();
+    }
+
+    queue->records[head & (QLA_QUEUE_SIZE - 1)] = *record;
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+
+    if (shared)
+    {
+        spinlock_release(&queue->lock);
+    }
+
+    sem_post(&instance->ready);
+}
+
+/**
+ * Get the open file of a session log. If the file cache is full, the least
+ * recently used file is closed. A file is created when it is first opened
+ * and appended to when it is opened again.
+ *
+ * @param instance  The filter instance
+ * @param log       The session log
+ * @return The open file or NULL if it could not be opened
+ */
+static FILE *
+qla_log_open(QLA_INSTANCE *instance, QLA_LOG *log)
+{
+    if (log->fp == NULL && !log->failed)
+    {
+        int slot = instance->n_open_files;
+
+        if (slot == QLA_MAX_OPEN_FILES)
+        {
+            slot = 0;
+
+            for (int i = 1; i < QLA_MAX_OPEN_FILES; i++)
+            {
+                if (instance->open_files[i]->last_used < instance->open_files[slot]->last_used)
+                {
+                    slot = i;
+                }
+            }
+
+            fclose(instance->open_files[slot]->fp);
+            instance->open_files[slot]->fp = NULL;
+            instance->open_files[slot]->slot = -1;
+        }
+
+        if ((log->fp = fopen(log->filename, log->created ? "a" : "w")) == NULL)
+        {
+            char errbuf[STRERROR_BUFLEN];
+            MXS_ERROR("qlafilter: Opening output file '%s' failed due to %d, %s",
+                      log->filename, errno,
+                      strerror_r(errno, errbuf, sizeof(errbuf)));
+            log->failed = true;
+
+            if (slot < instance->n_open_files)
+            {
+                /** Move the last open file to the freed slot */
+                instance->n_open_files--;
+                if (slot != instance->n_open_files)
+                {
+                    instance->open_files[slot] = instance->open_files[instance->n_open_files];
+                    instance->open_files[slot]->slot = slot;
+                }
+            }
+        }
+        else
+        {
+            log->created = true;
+            log->slot = slot;
+            instance->open_files[slot] = log;
+
+            if (slot == instance->n_open_files)
+            {
+                instance->n_open_files++;
+            }
+        }
+    }
+
+    log->last_used = ++instance->use_count;
+    return log->fp;
+}
+
+/**
+ * Free a session log and remove its file from the file cache
+ *
+ * @param instance  The filter instance
+ * @param log       The session log
+ */
+static void
+qla_log_free(QLA_INSTANCE *instance, QLA_LOG *log)
+{
+    if (log->fp)
+    {
+        fclose(log->fp);
+        instance->n_open_files--;
+
+        if (log->slot != instance->n_open_files)
+        {
+            instance->open_files[log->slot] = instance->open_files[instance->n_open_files];
+            instance->open_files[log->slot]->slot = log->slot;
+        }
+    }
+
+    free(log->filename);
+    free(log->client);
+    free(log);
+}
+
+/**
+ * Write a record to the capture file
+ *
+ * @param fp        The capture file
+ * @param record    The queued record
+ * @param type      The type of the record in the capture
+ * @param data      The data of the record
+ * @param len       Length of the data
+ */
+static void
+qla_capture_write(FILE *fp, QLA_RECORD *record, uint8_t type, const void *data, uint32_t len)
+{
+    uint8_t header[QLA_CAPTURE_HEADER_LEN];
+    uint64_t usecs = (uint64_t)record->tv.tv_sec * 1000000 + record->tv.tv_usec;
+    uint64_t id = record->log->session_id;
+
+    for (int i = 0; i < 8; i++)
+    {
+        header[i] = usecs >> (8 * i);
+        header[8 + i] = id >> (8 * i);
+    }
+
+    header[16] = type;
+
+    for (int i = 0; i < 4; i++)
+    {
+        header[17 + i] = len >> (8 * i);
+    }
+
+    fwrite(header, 1, sizeof(header), fp);
+
+    if (len > 0)
+    {
+        fwrite(data, 1, len, fp);
+    }
+}
+
+/**
+ * The writer thread of a filter instance. It waits for queued records,
+ * writes all the records of the queues and then flushes the files.
+ *
+ * @param data  The filter instance
+ */
+static void
+qla_writer_thread(void *data)
+{
+    QLA_INSTANCE *instance = (QLA_INSTANCE *) data;
+    time_t last_sec = 0;
+    char timestr[QLA_STRING_BUFFER_SIZE] = "";
+
+    while (true)
+    {
+        if (sem_wait(&instance->ready) == -1)
+        {
+            continue;
+        }
+
+        /** One pass writes all the records queued so far */
+        while (sem_trywait(&instance->ready) == 0)
+        {
+        }
+
+        for (int i = 0; i < instance->n_queues; i++)
+        {
+            QLA_QUEUE *queue = &instance->queues[i];
+            uint32_t tail = queue->tail;
+            uint32_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+
+            for (; tail != head; tail++)
+            {
+                QLA_RECORD *record = &queue->records[tail & (QLA_QUEUE_SIZE - 1)];
+                QLA_LOG *log = record->log;
+
+                if (record->type == QLA_RECORD_END)
+                {
+                    if (instance->log_type == QLA_LOG_CAPTURE)
+                    {
+                        qla_capture_write(instance->unified_fp, record, QLA_CAPTURE_END, NULL, 0);
+                    }
+                    log->closed = true;
+                }
+                else if (record->type == QLA_RECORD_START)
+                {
+                    qla_capture_write(instance->unified_fp, record, QLA_CAPTURE_START,
+                                      log->client, strlen(log->client));
+                }
+                else if (instance->log_type == QLA_LOG_CAPTURE)
+                {
+                    qla_capture_write(instance->unified_fp, record, QLA_CAPTURE_PACKETS,
+                                      record->packets, record->packets_len);
+                    __atomic_add_fetch(&instance->n_written, 1, __ATOMIC_RELAXED);
+                    free(record->packets);
+                    atomic_add(&log->pending, -1);
+                }
+                else
+                {
+                    if ((instance->match == NULL ||
+                         regexec(&instance->re, record->sql, 0, NULL, 0) == 0) &&
+                        (instance->nomatch == NULL ||
+                         regexec(&instance->nore, record->sql, 0, NULL, 0) != 0))
+                    {
+                        FILE *fp = instance->unified_fp ? instance->unified_fp :
+                                   qla_log_open(instance, log);
+
+                        if (record->tv.tv_sec != last_sec)
+                        {
+                            struct tm t;
+                            localtime_r(&record->tv.tv_sec, &t);
+                            strftime(timestr, sizeof(timestr), "%F %T", &t);
+                            last_sec = record->tv.tv_sec;
+                        }
+
+                        if (fp)
+                        {
+                            fprintf(fp, "%s,%s,%s\n", timestr, log->client,
+                                    trim(squeeze_whitespace(record->sql)));
+                            __atomic_add_fetch(&instance->n_written, 1, __ATOMIC_RELAXED);
+                        }
+                    }
+
+                    free(record->sql);
+                    atomic_add(&log->pending, -1);
+                }
+
+                if (log->closed && __atomic_load_n(&log->pending, __ATOMIC_ACQUIRE) == 0)
+                {
+                    qla_log_free(instance, log);
+                }
+            }
+
+            __atomic_store_n(&queue->tail, tail, __ATOMIC_RELEASE);
+        }
+
+        if (instance->unified_fp)
+        {
+            fflush(instance->unified_fp);
+        }
+
+        for (int i = 0; i < instance->n_open_files; i++)
+        {
+            fflush(instance->open_files[i]->fp);
+        }
+    }
+}
+
+/**
+ * Start the writer thread of a filter instance. Each worker thread gets a
+ * queue of its own and one more queue is shared by any other threads.
+ *
+ * @param instance  The filter instance
+ * @return True if the thread was started
+ */
+static bool
+qla_start_writer(QLA_INSTANCE *instance)
+{
+    instance->n_queues = config_threadcount() + 1;
+
+    if ((instance->queues = calloc(instance->n_queues, sizeof(QLA_QUEUE))) == NULL)
+    {
+        MXS_ERROR("qlafilter: Memory allocation for the query queues failed.");
+        return false;
+    }
+
+    for (int i = 0; i < instance->n_queues; i++)
+    {
+        spinlock_init(&instance->queues[i].lock);
+    }
+
+    if (sem_init(&instance->ready, 0, 0) == -1)
+    {
+        free(instance->queues);
+        instance->queues = NULL;
+        return false;
+    }
+
+    if (thread_start(&instance->writer, qla_writer_thread, instance) == NULL)
+    {
+        MXS_ERROR("qlafilter: Failed to start the writer thread.");
+        sem_destroy(&instance->ready);
+        free(instance->queues);
+        instance->queues = NULL;
+        return false;
+    }
+
+    return true;
+}
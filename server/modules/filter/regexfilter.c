@@ -20,6 +20,8 @@
 #include <log_manager.h>
 #include <string.h>
 #include <pcre2.h>
+#include <maxscale_pcre2.h>
+#include <platform.h>
 #include <atomic.h>
 #include "maxconfig.h"
 
@@ -57,8 +59,9 @@ static void freeSession(FILTER *instance, void *session);
 static void setDownstream(FILTER *instance, void *fsession, DOWNSTREAM *downstream);
 static int routeQuery(FILTER *instance, void *fsession, GWBUF *queue);
 static void diagnostic(FILTER *instance, void *fsession, DCB *dcb);
+static uint32_t getInterest(FILTER *instance);
 
-static char *regex_replace(const char *sql, pcre2_code *re, pcre2_match_data *study,
+static char *regex_replace(const char *sql, pcre2_code *re, uint32_t ovector_size,
                            const char *replace);
 
 static FILTER_OBJECT MyObject =
@@ -72,6 +75,7 @@ static FILTER_OBJECT MyObject =
     routeQuery,
     NULL,
     diagnostic,
+    getInterest
 };
 
 /**
@@ -84,7 +88,7 @@ typedef struct
     char *match; /*< Regular expression to match */
     char *replace; /*< Replacement text */
     pcre2_code *re; /*< Compiled regex text */
-    pcre2_match_data *match_data; /*< Matching data used by the compiled regex */
+    uint32_t ovector_size; /*< Ovector size for the captures of the regex */
     FILE* logfile; /*< Log file */
     bool log_trace; /*< Whether messages should be printed to tracelog */
 } REGEX_INSTANCE;
@@ -154,11 +158,6 @@ void free_instance(REGEX_INSTANCE *instance)
             pcre2_code_free(instance->re);
         }
 
-        if (instance->match_data)
-        {
-            pcre2_match_data_free(instance->match_data);
-        }
-
         free(instance->match);
         free(instance->replace);
         free(instance->source);
@@ -283,14 +282,10 @@ createInstance(char **options, FILTER_PARAMETER **params)
             return NULL;
         }
 
-        if ((my_instance->match_data =
-                 pcre2_match_data_create_from_pattern(my_instance->re, NULL)) == NULL)
-        {
-            MXS_ERROR("regexfilter: Failure to create PCRE2 matching data. "
-                      "This is most likely caused by a lack of available memory.");
-            free_instance(my_instance);
-            return NULL;
-        }
+        uint32_t captures = 0;
+        pcre2_pattern_info(my_instance->re, PCRE2_INFO_CAPTURECOUNT, &captures);
+        my_instance->ovector_size = captures + 1;
+        mxs_pcre2_jit_compile(my_instance->re);
     }
     return (FILTER *) my_instance;
 }
@@ -391,24 +386,21 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
 
     if (my_session->active && modutil_is_SQL(queue))
     {
-        if (queue->next != NULL)
-        {
-            queue = gwbuf_make_contiguous(queue);
-        }
         if ((sql = modutil_get_SQL(queue)) != NULL)
         {
             newsql = regex_replace(sql,
                                    my_instance->re,
-                                   my_instance->match_data,
+                                   my_instance->ovector_size,
                                    my_instance->replace);
             if (newsql)
             {
+                /** Only a statement that is rewritten needs to be contiguous */
+                queue = gwbuf_make_contiguous(queue);
                 queue = modutil_replace_SQL(queue, newsql);
                 queue = gwbuf_make_contiguous(queue);
                 spinlock_acquire(&my_session->lock);
                 log_match(my_instance, my_instance->match, sql, newsql);
                 spinlock_release(&my_session->lock);
-                free(newsql);
                 my_session->replacements++;
             }
             else
@@ -426,6 +418,18 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
                                        my_session->down.session, queue);
 }
 
+/**
+ * Only COM_QUERY packets are rewritten
+ *
+ * @param instance  The filter instance
+ * @return The classes of packets the filter acts on
+ */
+static uint32_t
+getInterest(FILTER *instance)
+{
+    return FILTER_INTEREST_QUERY;
+}
+
 /**
  * Diagnostics routine
  *
@@ -466,43 +470,64 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
     }
 }
 
+/** The buffer of the calling thread for the replaced SQL */
+static thread_local char *thread_result = NULL;
+static thread_local size_t thread_result_size = 0;
+
 /**
- * Perform a regular expression match and substitution on the SQL
+ * Perform a regular expression match and substitution on the SQL. The
+ * matching data and the result buffer are those of the calling thread.
  *
  * @param   sql The original SQL text
  * @param   re  The compiled regular expression
- * @param   match_data The PCRE2 matching data buffer
+ * @param   ovector_size The ovector size for the captures of the regex
  * @param   replace The replacement text
- * @return  The replaced text or NULL if no replacement was done.
+ * @return  The replaced text, valid until the next call by the same thread,
+ *          or NULL if no replacement was done.
  */
 static char *
-regex_replace(const char *sql, pcre2_code *re, pcre2_match_data *match_data, const char *replace)
+regex_replace(const char *sql, pcre2_code *re, uint32_t ovector_size, const char *replace)
 {
-    char *result = NULL;
-    size_t result_size;
+    pcre2_match_data *match_data = mxs_pcre2_thread_match_data(ovector_size);
+    pcre2_match_context *match_context = mxs_pcre2_thread_match_context();
+    size_t needed = strlen(sql) + strlen(replace);
+    int rc;
+
+    if (match_data == NULL ||
+        pcre2_match(re, (PCRE2_SPTR) sql, PCRE2_ZERO_TERMINATED, 0, 0,
+                    match_data, match_context) <= 0)
+    {
+        return NULL;
+    }
 
-    /** This should never fail with rc == 0 because we used pcre2_match_data_create_from_pattern() */
-    if (pcre2_match(re, (PCRE2_SPTR) sql, PCRE2_ZERO_TERMINATED, 0, 0, match_data, NULL) > 0)
+    while (true)
     {
-        result_size = strlen(sql) + strlen(replace);
-        result = malloc(result_size);
-
-        while (result &&
-               pcre2_substitute(re, (PCRE2_SPTR) sql, PCRE2_ZERO_TERMINATED, 0,
-                                PCRE2_SUBSTITUTE_GLOBAL, match_data, NULL,
-                                (PCRE2_SPTR) replace, PCRE2_ZERO_TERMINATED,
-                                (PCRE2_UCHAR*) result, (PCRE2_SIZE*) & result_size) == PCRE2_ERROR_NOMEMORY)
+        if (thread_result_size < needed)
         {
-            char *tmp;
-            if ((tmp = realloc(result, (result_size *= 1.5))) == NULL)
+            char *tmp = realloc(thread_result, needed);
+
+            if (tmp == NULL)
             {
-                free(result);
-                result = NULL;
+                return NULL;
             }
-            result = tmp;
+            thread_result = tmp;
+            thread_result_size = needed;
         }
+
+        PCRE2_SIZE result_size = thread_result_size;
+
+        if ((rc = pcre2_substitute(re, (PCRE2_SPTR) sql, PCRE2_ZERO_TERMINATED, 0,
+                                   PCRE2_SUBSTITUTE_GLOBAL, match_data, match_context,
+                                   (PCRE2_SPTR) replace, PCRE2_ZERO_TERMINATED,
+                                   (PCRE2_UCHAR*) thread_result, &result_size)) != PCRE2_ERROR_NOMEMORY)
+        {
+            break;
+        }
+
+        needed = thread_result_size * 2;
     }
-    return result;
+
+    return rc >= 0 ? thread_result : NULL;
 }
 
 /**
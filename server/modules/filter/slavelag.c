@@ -17,6 +17,8 @@
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <string.h>
+#include <ctype.h>
+#include <time.h>
 #include <hint.h>
 #include <query_classifier.h>
 #include <regex.h>
@@ -35,6 +37,14 @@
  *      time=<time period>          Seconds to wait before queries are routed to slaves.
  *      match=<regex>               Regex for matching
  *      ignore=<regex>              Regex for ignoring
+ *      track_tables=<session|global> Only route the queries that read the
+ *                                  modified tables to the master
+ *
+ * With track_tables, the time of the last write to each table is kept in a
+ * hash table of the session or of the filter instance. Reads of the tables
+ * written less than time seconds ago are routed to the master. The table
+ * names come from the query classifier so the match and ignore regexes are
+ * not used.
  *
  * The filter also has two options:
  *     @c case, which makes the regex case-sensitive, and
@@ -77,10 +87,44 @@ static FILTER_OBJECT MyObject =
     diagnostic,
 };
 
+/** Slots in the table maps of the filter instance and of a session */
+#define LAG_GLOBAL_TABLES   4096
+#define LAG_SESSION_TABLES  64
+/** How many slots are searched for a table */
+#define LAG_TABLE_PROBES    16
+
+/**
+ * The last write to a table
+ */
+typedef struct
+{
+    uint64_t hash;    /*< Hash of the table name, 0 for an unused slot */
+    int64_t  written; /*< Time of the last write in milliseconds */
+} LAG_TABLE;
+
+/**
+ * An open addressing hash table of the last writes to the tables. Slots whose
+ * write is older than the time window are reused. The slots are updated with
+ * atomic operations so that the sessions can share the table of the instance.
+ */
+typedef struct
+{
+    LAG_TABLE *slots;
+    uint32_t  mask;
+} LAG_TABLEMAP;
+
+typedef enum
+{
+    LAG_TRACK_NONE,
+    LAG_TRACK_SESSION,
+    LAG_TRACK_GLOBAL
+} lag_track_t;
+
 typedef struct lagstats
 {
     int n_add_count;  /*< No. of statements diverted based on count */
     int n_add_time;   /*< No. of statements diverted based on time */
+    int n_add_table;  /*< No. of statements diverted based on the tables */
     int n_modified;   /*< No. of statements not diverted */
 } LAGSTATS;
 
@@ -99,6 +143,8 @@ typedef struct
     LAGSTATS stats;
     regex_t re;      /* Compiled regex text of match */
     regex_t nore;    /* Compiled regex text of ignore */
+    lag_track_t track; /*< Whether the writes to the tables are tracked */
+    LAG_TABLEMAP tables; /*< The table map of the track_tables=global mode */
 } LAG_INSTANCE;
 
 /**
@@ -110,6 +156,7 @@ typedef struct
     int        hints_left;        /*< Number of hints left to add to queries*/
     time_t     last_modification; /*< Time of the last modifying operation */
     int        active;            /*< Is filter active */
+    LAG_TABLEMAP tables;          /*< The table map of the track_tables=session mode */
 } LAG_SESSION;
 
 /**
@@ -149,6 +196,178 @@ GetModuleObject()
     return &MyObject;
 }
 
+/**
+ * Allocate the slots of a table map
+ *
+ * @param map     The map
+ * @param nslots  The number of slots, a power of two
+ * @return True if the slots were allocated
+ */
+static bool
+lag_map_init(LAG_TABLEMAP *map, uint32_t nslots)
+{
+    map->mask = nslots - 1;
+    return (map->slots = calloc(nslots, sizeof(LAG_TABLE))) != NULL;
+}
+
+/**
+ * Hash a table name, ignoring the case of the name. Zero is not returned so
+ * that it can mark the unused slots.
+ *
+ * @param name  The table name
+ * @return The hash of the name
+ */
+static uint64_t
+lag_table_hash(const char *name)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    while (*name)
+    {
+        hash = (hash ^ (uint8_t)tolower(*name++)) * 1099511628211ULL;
+    }
+
+    return hash ? hash : 1;
+}
+
+/**
+ * Get the time of a monotonic clock in milliseconds
+ *
+ * @return The current time
+ */
+static int64_t
+lag_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Record a write to a table. The slot of the table is updated if the table
+ * is found, otherwise the first unused slot or a slot whose write is older
+ * than the time window is taken. If no slot is free the write is not
+ * recorded.
+ *
+ * @param map     The table map
+ * @param name    The table name
+ * @param now     The current time
+ * @param window  The time window in milliseconds
+ * @return True if the write was recorded
+ */
+static bool
+lag_map_write(LAG_TABLEMAP *map, const char *name, int64_t now, int64_t window)
+{
+    uint64_t hash = lag_table_hash(name);
+    LAG_TABLE *free_slot = NULL;
+
+    for (uint32_t i = 0; i < LAG_TABLE_PROBES; i++)
+    {
+        LAG_TABLE *slot = &map->slots[(hash + i) & map->mask];
+        uint64_t slot_hash = __atomic_load_n(&slot->hash, __ATOMIC_ACQUIRE);
+
+        if (slot_hash == hash)
+        {
+            __atomic_store_n(&slot->written, now, __ATOMIC_RELEASE);
+            return true;
+        }
+
+        if (free_slot == NULL &&
+            (slot_hash == 0 || now - __atomic_load_n(&slot->written, __ATOMIC_ACQUIRE) >= window))
+        {
+            free_slot = slot;
+        }
+
+        if (slot_hash == 0)
+        {
+            break;
+        }
+    }
+
+    if (free_slot)
+    {
+        uint64_t old_hash = __atomic_load_n(&free_slot->hash, __ATOMIC_ACQUIRE);
+
+        if (__atomic_compare_exchange_n(&free_slot->hash, &old_hash, hash, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            __atomic_store_n(&free_slot->written, now, __ATOMIC_RELEASE);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Check if a table was written to within the time window. All probed slots
+ * are checked since concurrent writes can record a table in two slots.
+ *
+ * @param map     The table map
+ * @param name    The table name
+ * @param now     The current time
+ * @param window  The time window in milliseconds
+ * @return True if the table was recently modified
+ */
+static bool
+lag_map_recent(LAG_TABLEMAP *map, const char *name, int64_t now, int64_t window)
+{
+    uint64_t hash = lag_table_hash(name);
+
+    for (uint32_t i = 0; i < LAG_TABLE_PROBES; i++)
+    {
+        LAG_TABLE *slot = &map->slots[(hash + i) & map->mask];
+        uint64_t slot_hash = __atomic_load_n(&slot->hash, __ATOMIC_ACQUIRE);
+
+        if (slot_hash == 0)
+        {
+            break;
+        }
+
+        if (slot_hash == hash && now - __atomic_load_n(&slot->written, __ATOMIC_ACQUIRE) < window)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Record the writes to or check the reads of the tables of a statement
+ *
+ * @param map     The table map
+ * @param queue   The statement
+ * @param write   Whether the statement modifies the tables
+ * @param window  The time window in milliseconds
+ * @return For a write, true if all tables were recorded. For a read, true if
+ * any of the tables was recently modified.
+ */
+static bool
+lag_check_tables(LAG_TABLEMAP *map, GWBUF *queue, bool write, int64_t window)
+{
+    int n_tables = 0;
+    char **tables = qc_get_table_names(queue, &n_tables, false);
+    int64_t now = lag_now();
+    bool rval = write && n_tables > 0;
+
+    for (int i = 0; i < n_tables; i++)
+    {
+        if (write)
+        {
+            rval = lag_map_write(map, tables[i], now, window) && rval;
+        }
+        else if (!rval)
+        {
+            rval = lag_map_recent(map, tables[i], now, window);
+        }
+        free(tables[i]);
+    }
+
+    free(tables);
+    return rval;
+}
+
 /**
  * Create an instance of the filter for a particular service
  * within MaxScale.
@@ -193,6 +412,22 @@ createInstance(char **options, FILTER_PARAMETER **params)
             {
                 my_instance->nomatch = strdup(params[i]->value);
             }
+            else if (!strcmp(params[i]->name, "track_tables"))
+            {
+                if (!strcmp(params[i]->value, "session"))
+                {
+                    my_instance->track = LAG_TRACK_SESSION;
+                }
+                else if (!strcmp(params[i]->value, "global"))
+                {
+                    my_instance->track = LAG_TRACK_GLOBAL;
+                }
+                else
+                {
+                    MXS_ERROR("lagfilter: Invalid value '%s' for 'track_tables', "
+                              "expected 'session' or 'global'.", params[i]->value);
+                }
+            }
             else
             {
                 MXS_ERROR("lagfilter: Unexpected parameter '%s'.\n", params[i]->name);
@@ -233,6 +468,16 @@ createInstance(char **options, FILTER_PARAMETER **params)
                 MXS_ERROR("lagfilter: Failed to compile regex '%s'.", my_instance->nomatch);
             }
         }
+
+        if (my_instance->track == LAG_TRACK_GLOBAL &&
+            !lag_map_init(&my_instance->tables, LAG_GLOBAL_TABLES))
+        {
+            MXS_ERROR("lagfilter: Memory allocation failed.");
+            free(my_instance->match);
+            free(my_instance->nomatch);
+            free(my_instance);
+            my_instance = NULL;
+        }
     }
 
     return (FILTER *)my_instance;
@@ -257,6 +502,14 @@ newSession(FILTER *instance, SESSION *session)
         my_session->active = 1;
         my_session->hints_left = 0;
         my_session->last_modification = 0;
+        my_session->tables.slots = NULL;
+
+        if (my_instance->track == LAG_TRACK_SESSION &&
+            !lag_map_init(&my_session->tables, LAG_SESSION_TABLES))
+        {
+            free(my_session);
+            my_session = NULL;
+        }
     }
 
     return my_session;
@@ -283,6 +536,9 @@ closeSession(FILTER *instance, void *session)
 static void
 freeSession(FILTER *instance, void *session)
 {
+    LAG_SESSION *my_session = (LAG_SESSION *)session;
+
+    free(my_session->tables.slots);
     free(session);
 }
 
@@ -311,6 +567,11 @@ setDownstream(FILTER *instance, void *session, DOWNSTREAM *downstream)
  * filter definition matches the SQL text then add the hint
  * "Route to named server" with the name defined in the server parameter
  *
+ * With track_tables, only the queries that read tables which were recently
+ * modified get the hint. A write whose tables are not known or could not be
+ * recorded makes all queries of the session get the hint as without
+ * track_tables.
+ *
  * @param instance  The filter instance data
  * @param session   The filter session
  * @param queue     The query data
@@ -325,12 +586,34 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
 
     if (modutil_is_SQL(queue))
     {
-        if (queue->next != NULL)
+        if (my_instance->track != LAG_TRACK_NONE)
         {
-            queue = gwbuf_make_contiguous(queue);
-        }
+            LAG_TABLEMAP *map = my_instance->track == LAG_TRACK_GLOBAL ?
+                                &my_instance->tables : &my_session->tables;
+            int64_t window = (int64_t)my_instance->time * 1000;
+
+            qc_parse(queue, QC_COLLECT_TABLES);
 
-        if (qc_get_operation(queue) & (QUERY_OP_DELETE | QUERY_OP_INSERT | QUERY_OP_UPDATE))
+            if (qc_get_operation(queue) & (QUERY_OP_DELETE | QUERY_OP_INSERT | QUERY_OP_UPDATE))
+            {
+                if (!lag_check_tables(map, queue, true, window))
+                {
+                    my_session->last_modification = now;
+                }
+                my_instance->stats.n_modified++;
+            }
+            else if (difftime(now, my_session->last_modification) < my_instance->time)
+            {
+                queue->hint = hint_create_route(queue->hint, HINT_ROUTE_TO_MASTER, NULL);
+                my_instance->stats.n_add_time++;
+            }
+            else if (lag_check_tables(map, queue, false, window))
+            {
+                queue->hint = hint_create_route(queue->hint, HINT_ROUTE_TO_MASTER, NULL);
+                my_instance->stats.n_add_table++;
+            }
+        }
+        else if (qc_get_operation(queue) & (QUERY_OP_DELETE | QUERY_OP_INSERT | QUERY_OP_UPDATE))
         {
             if ((sql = modutil_get_SQL(queue)) != NULL)
             {
@@ -390,4 +673,8 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
     dcb_printf(dcb, "\tNo. of data modifications: %d\n", my_instance->stats.n_modified);
     dcb_printf(dcb, "\tNo. of hints added based on count: %d\n", my_instance->stats.n_add_count);
     dcb_printf(dcb, "\tNo. of hints added based on time: %d\n",  my_instance->stats.n_add_time);
+    if (my_instance->track != LAG_TRACK_NONE)
+    {
+        dcb_printf(dcb, "\tNo. of hints added based on tables: %d\n",  my_instance->stats.n_add_table);
+    }
 }
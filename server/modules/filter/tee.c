@@ -29,6 +29,11 @@
  *          of the request (optional)
  * user     A user name to match against. If present only requests that
  *          originate from this user will be duplciated (optional)
+ * async    Queue the duplicates to the branch instead of waiting for its
+ *          replies (optional)
+ * queue_size   The number of duplicates queued per session in async mode
+ * drop_on_full Whether duplicates are dropped or the duplication stops when
+ *          the queue is full (optional)
  *
  * Revision History
  * ================
@@ -58,6 +63,7 @@
 #include <maxscale/poll.h>
 #include <mysql_client_server_protocol.h>
 #include <housekeeper.h>
+#include "maxconfig.h"
 
 #define MYSQL_COM_QUIT                  0x01
 #define MYSQL_COM_INITDB                0x02
@@ -74,6 +80,7 @@
 #define REPLY_TIMEOUT_MILLISECOND       1
 #define PARENT                          0
 #define CHILD                           1
+#define TEE_DEFAULT_QUEUE_SIZE          1024
 
 #ifdef SS_DEBUG
 static int debug_seq = 0;
@@ -142,6 +149,9 @@ typedef struct
     regex_t re; /* Compiled regex text */
     char *nomatch; /* Optional text to match against for exclusion */
     regex_t nore; /* Compiled regex nomatch text */
+    bool async; /* Do not wait for the replies of the branch */
+    int queue_size; /* Maximum number of queued duplicates in async mode */
+    bool drop_on_full; /* Drop the duplicates when the queue is full */
 } TEE_INSTANCE;
 
 /**
@@ -175,6 +185,10 @@ typedef struct
     GWBUF* tee_replybuf; /* Buffer for reply */
     GWBUF* tee_partials[2];
     GWBUF* queue;
+    GWBUF* branch_queue; /* Duplicates waiting to be sent to the branch in async mode */
+    int n_queued; /* Number of duplicates in branch_queue */
+    int n_dropped; /* Number of duplicates dropped because the queue was full */
+    bool branch_stopped; /* Duplication has stopped for this session */
     SPINLOCK tee_lock;
     DCB* client_dcb;
 
@@ -207,6 +221,8 @@ int route_single_query(TEE_INSTANCE* my_instance,
                        GWBUF* buffer,
                        GWBUF* clone);
 int reset_session_state(TEE_SESSION* my_session, GWBUF* buffer);
+static void queue_branch_queries(TEE_INSTANCE* my_instance, TEE_SESSION* my_session, GWBUF* queue);
+static void send_branch_queries(TEE_SESSION* my_session);
 void create_orphan(SESSION* ses);
 
 static void
@@ -370,6 +386,9 @@ createInstance(char **options, FILTER_PARAMETER **params)
         my_instance->userName = NULL;
         my_instance->match = NULL;
         my_instance->nomatch = NULL;
+        my_instance->async = false;
+        my_instance->queue_size = TEE_DEFAULT_QUEUE_SIZE;
+        my_instance->drop_on_full = true;
         if (params)
         {
             for (i = 0; params[i]; i++)
@@ -398,6 +417,24 @@ createInstance(char **options, FILTER_PARAMETER **params)
                 {
                     my_instance->userName = strdup(params[i]->value);
                 }
+                else if (!strcmp(params[i]->name, "async"))
+                {
+                    my_instance->async = config_truth_value(params[i]->value);
+                }
+                else if (!strcmp(params[i]->name, "queue_size"))
+                {
+                    if ((my_instance->queue_size = atoi(params[i]->value)) <= 0)
+                    {
+                        MXS_ERROR("tee: Invalid value '%s' for parameter queue_size, "
+                                  "using the default of %d.", params[i]->value,
+                                  TEE_DEFAULT_QUEUE_SIZE);
+                        my_instance->queue_size = TEE_DEFAULT_QUEUE_SIZE;
+                    }
+                }
+                else if (!strcmp(params[i]->name, "drop_on_full"))
+                {
+                    my_instance->drop_on_full = config_truth_value(params[i]->value);
+                }
                 else if (!filter_standard_parameter(params[i]->name))
                 {
                     MXS_ERROR("tee: Unexpected parameter '%s'.",
@@ -724,6 +761,7 @@ freeSession(FILTER *instance, void *session)
     {
         gwbuf_free(my_session->tee_replybuf);
     }
+    gwbuf_free(my_session->branch_queue);
     free(session);
 
     orphan_free(NULL);
@@ -808,6 +846,20 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
         return 0;
     }
 
+    if (my_instance->async)
+    {
+        /** The duplicates are queued and the query is routed without
+         * waiting for the branch */
+        queue_branch_queries(my_instance, my_session, queue);
+        spinlock_release(&my_session->tee_lock);
+
+        rval = my_session->down.routeQuery(my_session->down.instance,
+                                           my_session->down.session,
+                                           queue);
+        send_branch_queries(my_session);
+        return rval;
+    }
+
     if (my_session->queue)
     {
         my_session->queue = gwbuf_append(my_session->queue, queue);
@@ -944,6 +996,14 @@ clientReply(FILTER* instance, void *session, GWBUF *reply)
     uint16_t flags = 0;
     int more_results = 0;
 
+    if (instance && ((TEE_INSTANCE*) instance)->async)
+    {
+        /** In async mode the replies of the main service are not held back */
+        return my_session->up.clientReply(my_session->up.instance,
+                                          my_session->up.session,
+                                          reply);
+    }
+
     spinlock_acquire(&my_session->tee_lock);
     int min_eof = my_session->command != 0x04 ? 2 : 1;
 
@@ -1056,6 +1116,18 @@ clientReply(FILTER* instance, void *session, GWBUF *reply)
         my_session->tee_replybuf = NULL;
     }
 
+    if (my_session->instance->async)
+    {
+        bool done = !my_session->waiting[CHILD];
+        spinlock_release(&my_session->tee_lock);
+
+        if (done)
+        {
+            send_branch_queries(my_session);
+        }
+        return rc;
+    }
+
     if (my_session->queue &&
         !my_session->waiting[PARENT] &&
         !my_session->waiting[CHILD])
@@ -1111,12 +1183,26 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
         dcb_printf(dcb, "\t\tExclude queries that match		%s\n",
                    my_instance->nomatch);
     }
+    if (my_instance->async)
+    {
+        dcb_printf(dcb, "\t\tAsynchronous branch queue size		%d\n",
+                   my_instance->queue_size);
+        dcb_printf(dcb, "\t\tWhen the queue is full		%s\n",
+                   my_instance->drop_on_full ? "drop" : "stop duplication");
+    }
     if (my_session)
     {
         dcb_printf(dcb, "\t\tNo. of statements duplicated:	%d.\n",
                    my_session->n_duped);
         dcb_printf(dcb, "\t\tNo. of statements rejected:	%d.\n",
                    my_session->n_rejected);
+        if (my_instance->async)
+        {
+            dcb_printf(dcb, "\t\tNo. of statements queued:	%d.\n",
+                       my_session->n_queued);
+            dcb_printf(dcb, "\t\tNo. of statements dropped:	%d.\n",
+                       my_session->n_dropped);
+        }
     }
 }
 
@@ -1313,6 +1399,28 @@ int route_single_query(TEE_INSTANCE* my_instance, TEE_SESSION* my_session, GWBUF
     return rval;
 }
 
+/**
+ * Check if the reply to a command can consist of more than one packet
+ * @param command The command byte of the query
+ * @return True if the reply can be a result set
+ */
+static bool
+is_multipacket_command(unsigned char command)
+{
+    switch (command)
+    {
+        case 0x1b:
+        case 0x03:
+        case 0x16:
+        case 0x17:
+        case 0x04:
+        case 0x0a:
+            return true;
+        default:
+            return false;
+    }
+}
+
 /**
  * Reset the session's internal counters.
  * @param my_session Tee session
@@ -1328,24 +1436,14 @@ int reset_session_state(TEE_SESSION* my_session, GWBUF* buffer)
 
     unsigned char command = *((unsigned char*) buffer->start + 4);
 
-    switch (command)
+    if (command == 0x1b)
     {
-        case 0x1b:
-            my_session->client_multistatement = *((unsigned char*) buffer->start + 5);
-            MXS_INFO("tee: client %s multistatements",
-                     my_session->client_multistatement ? "enabled" : "disabled");
-        case 0x03:
-        case 0x16:
-        case 0x17:
-        case 0x04:
-        case 0x0a:
-            memset(my_session->multipacket, (char) true, 2 * sizeof(bool));
-            break;
-        default:
-            memset(my_session->multipacket, (char) false, 2 * sizeof(bool));
-            break;
+        my_session->client_multistatement = *((unsigned char*) buffer->start + 5);
+        MXS_INFO("tee: client %s multistatements",
+                 my_session->client_multistatement ? "enabled" : "disabled");
     }
 
+    memset(my_session->multipacket, (char) is_multipacket_command(command), 2 * sizeof(bool));
     memset(my_session->replies, 0, 2 * sizeof(int));
     memset(my_session->reply_packets, 0, 2 * sizeof(int));
     memset(my_session->eof, 0, 2 * sizeof(int));
@@ -1373,3 +1471,141 @@ void create_orphan(SESSION* ses)
         spinlock_release(&orphanLock);
     }
 }
+
+/**
+ * Queue the duplicates of the packets of a query for the branch session in
+ * async mode. Incomplete packets are kept in the session until the rest of
+ * the packet arrives. If the queue is full, the duplicate is either dropped
+ * or the duplication is stopped for the rest of the session.
+ *
+ * The caller must hold the session lock.
+ *
+ * @param my_instance Tee instance
+ * @param my_session Tee session
+ * @param queue The query routed to the main service
+ */
+static void
+queue_branch_queries(TEE_INSTANCE* my_instance, TEE_SESSION* my_session, GWBUF* queue)
+{
+    GWBUF* buffer;
+
+    if (my_session->branch_stopped)
+    {
+        return;
+    }
+
+    my_session->queue = gwbuf_append(my_session->queue, gwbuf_clone_all(queue));
+
+    while ((buffer = modutil_get_next_MySQL_packet(&my_session->queue)) != NULL)
+    {
+        GWBUF* clone = clone_query(my_instance, my_session, buffer);
+        gwbuf_free(buffer);
+
+        if (clone == NULL)
+        {
+            my_session->n_rejected++;
+        }
+        else if (my_session->n_queued >= my_instance->queue_size)
+        {
+            gwbuf_free(clone);
+
+            if (my_instance->drop_on_full)
+            {
+                my_session->n_dropped++;
+            }
+            else
+            {
+                MXS_WARNING("tee: The branch queue of service '%s' is full, "
+                            "duplication is stopped for this session.",
+                            my_instance->service->name);
+                my_session->branch_stopped = true;
+                gwbuf_free(my_session->queue);
+                my_session->queue = NULL;
+                break;
+            }
+        }
+        else
+        {
+            my_session->branch_queue = gwbuf_append(my_session->branch_queue, clone);
+            my_session->n_queued++;
+        }
+    }
+}
+
+/**
+ * Send the queued duplicates to the branch session in async mode. A query
+ * is sent only once the branch has replied to the previous one, the
+ * commands that get no reply are sent without waiting.
+ *
+ * @param my_session Tee session
+ */
+static void
+send_branch_queries(TEE_SESSION* my_session)
+{
+    GWBUF* buffer;
+    bool reply;
+
+    do
+    {
+        buffer = NULL;
+        reply = true;
+
+        spinlock_acquire(&my_session->tee_lock);
+
+        if (my_session->active && my_session->branch_queue &&
+            !my_session->waiting[CHILD] && !my_session->branch_stopped)
+        {
+            if (my_session->branch_session == NULL ||
+                my_session->branch_session->state != SESSION_STATE_ROUTER_READY)
+            {
+                MXS_INFO("tee: Branch session in invalid state, "
+                         "duplication is stopped for this session.");
+                my_session->branch_stopped = true;
+                gwbuf_free(my_session->branch_queue);
+                my_session->branch_queue = NULL;
+                my_session->n_queued = 0;
+            }
+            else if ((buffer = modutil_get_next_MySQL_packet(&my_session->branch_queue)) != NULL)
+            {
+                uint8_t header[6] = {0};
+                gwbuf_copy_data(buffer, 0, sizeof(header), header);
+                unsigned char command = header[4];
+
+                my_session->n_queued--;
+                my_session->n_duped++;
+                reply = command != MYSQL_COM_QUIT &&
+                    command != MYSQL_COM_STMT_SEND_LONG_DATA &&
+                    command != MYSQL_COM_STMT_CLOSE;
+
+                if (command == 0x1b)
+                {
+                    my_session->client_multistatement = header[5];
+                }
+
+                /** Also set while a query without a reply is routed to
+                 * keep the order of the queries */
+                my_session->command = command;
+                my_session->waiting[CHILD] = true;
+                my_session->multipacket[CHILD] = is_multipacket_command(command);
+                my_session->eof[CHILD] = 0;
+                my_session->replies[CHILD] = 0;
+                my_session->reply_packets[CHILD] = 0;
+            }
+        }
+
+        spinlock_release(&my_session->tee_lock);
+
+        if (buffer)
+        {
+            SESSION_ROUTE_QUERY(my_session->branch_session, buffer);
+
+            if (!reply)
+            {
+                spinlock_acquire(&my_session->tee_lock);
+                my_session->waiting[CHILD] = false;
+                spinlock_release(&my_session->tee_lock);
+            }
+        }
+    }
+    while (buffer && !reply);
+}
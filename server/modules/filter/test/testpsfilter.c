@@ -0,0 +1,295 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * Tests of the literal extraction and the row conversion of the psfilter
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+
+/** The functions under test are static */
+#include "../psfilter.c"
+
+#include <skygw_debug.h>
+
+static PS_SESSION test_session;
+
+/**
+ * Parameterize a query and check the statement and the types of the literals
+ *
+ * @param sql      The query
+ * @param expected The statement with placeholders, NULL if the query can't be promoted
+ * @param types    The types of the literals, in order
+ * @param n_types  Number of literals
+ */
+static void check_query(const char *sql, const char *expected, const param_type_t *types, int n_types)
+{
+    bool ok = parameterize(&test_session, sql, strlen(sql));
+
+    if (expected == NULL)
+    {
+        ss_info_dassert(!ok, "The query must not be promoted");
+        return;
+    }
+
+    ss_info_dassert(ok, "The query must be promoted");
+    ss_info_dassert(strcmp(test_session.text, expected) == 0, "The statement must match");
+    ss_info_dassert(test_session.text_len == (int)strlen(expected), "The length must match");
+    ss_info_dassert(test_session.n_params == n_types, "The number of literals must match");
+
+    for (int i = 0; i < n_types; i++)
+    {
+        ss_info_dassert(test_session.params[i].type == types[i], "The type of a literal must match");
+    }
+
+    free(test_session.text);
+    test_session.text = NULL;
+}
+
+static void test_parameterize()
+{
+    ss_dfprintf(stderr, "testpsfilter : replacing the literals of queries.");
+
+    const param_type_t one_int[] = {PARAM_INTEGER};
+    const param_type_t one_string[] = {PARAM_STRING};
+    const param_type_t numbers[] = {PARAM_INTEGER, PARAM_DECIMAL, PARAM_DOUBLE, PARAM_DOUBLE};
+
+    check_query("SELECT a FROM t WHERE id = 5", "SELECT a FROM t WHERE id = ?", one_int, 1);
+    check_query("select a from t where b = 'x'", "select a from t where b = ?", one_string, 1);
+    check_query("SELECT a FROM t WHERE b = 'it''s'", "SELECT a FROM t WHERE b = ?", one_string, 1);
+    check_query("SELECT a FROM t WHERE b = 1 AND c = 2.5 AND d = 3e2 AND e = .5E-1",
+                "SELECT a FROM t WHERE b = ? AND c = ? AND d = ? AND e = ?", numbers, 4);
+    check_query("INSERT INTO t VALUES (1, 'a')", "INSERT INTO t VALUES (?, ?)",
+                (param_type_t[]) {PARAM_INTEGER, PARAM_STRING}, 2);
+    check_query("UPDATE t SET a = 'b' WHERE c = 1", "UPDATE t SET a = ? WHERE c = ?",
+                (param_type_t[]) {PARAM_STRING, PARAM_INTEGER}, 2);
+    check_query("DELETE FROM t WHERE a = 1;", "DELETE FROM t WHERE a = ?", one_int, 1);
+    check_query("SELECT a FROM t WHERE a = 1 ;  \n", "SELECT a FROM t WHERE a = ? ", one_int, 1);
+
+    /** Names with digits are not literals */
+    check_query("SELECT a1 FROM t2 WHERE t2.c3 = @v4 AND `5` = 6", "SELECT a1 FROM t2 WHERE t2.c3 = @v4 AND `5` = ?",
+                one_int, 1);
+    check_query("SELECT a FROM 1t WHERE b = 0x1f AND c = 0b01", "SELECT a FROM 1t WHERE b = 0x1f AND c = 0b01",
+                NULL, 0);
+
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+static void test_excluded()
+{
+    ss_dfprintf(stderr, "testpsfilter : keeping the literals that change the result.");
+
+    const param_type_t one_int[] = {PARAM_INTEGER};
+
+    /** The select list names the columns of the result */
+    check_query("SELECT 1, 'a', b + 2 FROM t WHERE c = 3", "SELECT 1, 'a', b + 2 FROM t WHERE c = ?", one_int, 1);
+    check_query("SELECT a FROM t WHERE b IN (SELECT 1 FROM u WHERE c = 2)",
+                "SELECT a FROM t WHERE b IN (SELECT 1 FROM u WHERE c = ?)", one_int, 1);
+    check_query("SELECT (SELECT 1) FROM t WHERE c = 2", "SELECT (SELECT 1) FROM t WHERE c = ?", one_int, 1);
+
+    /** The numbers after BY are positions of columns until the next clause */
+    check_query("SELECT a, b FROM t GROUP BY 1, 2 HAVING b > 3 ORDER BY 2 LIMIT 10",
+                "SELECT a, b FROM t GROUP BY 1, 2 HAVING b > ? ORDER BY 2 LIMIT ?",
+                (param_type_t[]) {PARAM_INTEGER, PARAM_INTEGER}, 2);
+
+    /** Backslashes, introducers and hexadecimal, bit and national strings */
+    check_query("SELECT a FROM t WHERE b = 'a\\'b'", "SELECT a FROM t WHERE b = 'a\\'b'", NULL, 0);
+    check_query("SELECT a FROM t WHERE b = _utf8'x' AND c = X'00' AND d = N'e'",
+                "SELECT a FROM t WHERE b = _utf8'x' AND c = X'00' AND d = N'e'", NULL, 0);
+    check_query("SELECT a FROM t WHERE b = \"x\"", "SELECT a FROM t WHERE b = \"x\"", NULL, 0);
+
+    /** Comments, placeholders, several statements and other commands */
+    check_query("SELECT a FROM t WHERE b = 1 /* c */", NULL, NULL, 0);
+    check_query("SELECT a FROM t WHERE b = 1 # c", NULL, NULL, 0);
+    check_query("SELECT a FROM t WHERE b = 1 -- c", NULL, NULL, 0);
+    check_query("SELECT a FROM t WHERE b = ?", NULL, NULL, 0);
+    check_query("SELECT a FROM t WHERE b = 1; SELECT 2", NULL, NULL, 0);
+    check_query("SET @a = 1", NULL, NULL, 0);
+    check_query("SELECT a FROM t WHERE b = 'x", NULL, NULL, 0);
+    check_query("SELECT a FROM t WHERE (b = 1", "SELECT a FROM t WHERE (b = ?", one_int, 1);
+    check_query("SELECT a FROM t WHERE b = 1)", NULL, NULL, 0);
+    check_query("", NULL, NULL, 0);
+
+    /** A subtraction is not a comment */
+    check_query("SELECT a FROM t WHERE b = c--1", "SELECT a FROM t WHERE b = c--?", one_int, 1);
+
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+/**
+ * Convert a binary value and check the text
+ *
+ * @param type     The type of the column
+ * @param flags    The flags of the column
+ * @param decimals The decimals of the column
+ * @param value    The binary value
+ * @param len      Length of the value
+ * @param expected The text or NULL if the value must not be converted
+ */
+static void check_value(uint8_t type, uint16_t flags, uint8_t decimals,
+                        const void *value, size_t len, const char *expected)
+{
+    PS_COLUMN col = {.type = type, .flags = flags, .decimals = decimals};
+    uint8_t data[32];
+    uint8_t *ptr = data;
+    char text[PS_VALUE_LEN];
+
+    memcpy(data, value, len);
+    int text_len = convert_value(&col, &ptr, data + len, text);
+
+    if (expected == NULL)
+    {
+        ss_info_dassert(text_len == -1, "The value must be left as it is");
+        ss_info_dassert(ptr == data, "The value must not be consumed");
+        return;
+    }
+
+    ss_info_dassert(text_len == (int)strlen(expected), "The length of the text must match");
+    ss_info_dassert(memcmp(text, expected, text_len) == 0, "The text must match");
+    ss_info_dassert(ptr == data + len, "The whole value must be consumed");
+}
+
+static void check_double(double value, const char *expected)
+{
+    check_value(MYSQL_TYPE_DOUBLE, 0, PS_NOT_FIXED_DEC, &value, sizeof(value), expected);
+}
+
+static void check_float(float value, const char *expected)
+{
+    check_value(MYSQL_TYPE_FLOAT, 0, PS_NOT_FIXED_DEC, &value, sizeof(value), expected);
+}
+
+static void test_convert_value()
+{
+    ss_dfprintf(stderr, "testpsfilter : converting binary values to text.");
+
+    check_value(MYSQL_TYPE_TINY, 0, 0, "\xff", 1, "-1");
+    check_value(MYSQL_TYPE_TINY, PS_UNSIGNED_FLAG, 0, "\xff", 1, "255");
+    check_value(MYSQL_TYPE_SHORT, 0, 0, "\x00\x80", 2, "-32768");
+    check_value(MYSQL_TYPE_SHORT, PS_UNSIGNED_FLAG, 0, "\x00\x80", 2, "32768");
+    check_value(MYSQL_TYPE_YEAR, PS_UNSIGNED_FLAG, 0, "\xe0\x07", 2, "2016");
+    check_value(MYSQL_TYPE_YEAR, PS_UNSIGNED_FLAG, 0, "\x00\x00", 2, "0000");
+    check_value(MYSQL_TYPE_INT24, 0, 0, "\xff\xff\xff\xff", 4, "-1");
+    check_value(MYSQL_TYPE_LONG, 0, 0, "\x00\x00\x00\x80", 4, "-2147483648");
+    check_value(MYSQL_TYPE_LONG, PS_UNSIGNED_FLAG, 0, "\xff\xff\xff\xff", 4, "4294967295");
+    check_value(MYSQL_TYPE_LONGLONG, 0, 0, "\xfe\xff\xff\xff\xff\xff\xff\xff", 8, "-2");
+    check_value(MYSQL_TYPE_LONGLONG, PS_UNSIGNED_FLAG, 0, "\xff\xff\xff\xff\xff\xff\xff\xff", 8,
+                "18446744073709551615");
+
+    /** The shortest text that reads back as the same value */
+    check_double(1 / 3e0, "0.3333333333333333");
+    check_double(0.1 + 0.2, "0.30000000000000004");
+    check_double(0.1, "0.1");
+    check_double(-2.5, "-2.5");
+    check_double(0, "0");
+    check_double(1e20, "1e20");
+    check_double(1.5e-7, "1.5e-7");
+    check_double(1.7976931348623157e308, "1.7976931348623157e308");
+    check_float(0.1f, "0.1");
+    check_float(3.14159274f, "3.1415927");
+    check_float(1e20f, "1e20");
+    check_float(16777216.0f, "16777216");
+
+    double fixed = 2.3456;
+    check_value(MYSQL_TYPE_DOUBLE, 0, 2, &fixed, sizeof(fixed), "2.35");
+    float fixed_float = 1.5f;
+    check_value(MYSQL_TYPE_FLOAT, 0, 3, &fixed_float, sizeof(fixed_float), "1.500");
+
+    /** The temporal values start with their length */
+    check_value(MYSQL_TYPE_DATE, 0, 0, "\x04\xe0\x07\x0a\x0e", 5, "2016-10-14");
+    check_value(MYSQL_TYPE_DATE, 0, 0, "\x00", 1, "0000-00-00");
+    check_value(MYSQL_TYPE_DATETIME, 0, 0, "\x04\xe0\x07\x0a\x0e", 5, "2016-10-14 00:00:00");
+    check_value(MYSQL_TYPE_DATETIME, 0, 0, "\x07\xe0\x07\x0a\x0e\x0c\x22\x38", 8, "2016-10-14 12:34:56");
+    check_value(MYSQL_TYPE_TIMESTAMP, 0, 3, "\x0b\xe0\x07\x0a\x0e\x0c\x22\x38\x40\xe2\x01\x00", 12,
+                "2016-10-14 12:34:56.123");
+    check_value(MYSQL_TYPE_TIMESTAMP, 0, 6, "\x00", 1, "0000-00-00 00:00:00.000000");
+    check_value(MYSQL_TYPE_TIME, 0, 0, "\x08\x01\x01\x00\x00\x00\x02\x03\x04", 9, "-26:03:04");
+    check_value(MYSQL_TYPE_TIME, 0, 2, "\x0c\x00\x00\x00\x00\x00\x0c\x22\x38\x40\xe2\x01\x00", 13,
+                "12:34:56.12");
+    check_value(MYSQL_TYPE_TIME, 0, 0, "\x00", 1, "00:00:00");
+
+    /** Strings, decimals and bits are the same in both protocols */
+    check_value(MYSQL_TYPE_VAR_STRING, 0, 0, "\x01" "a", 2, NULL);
+    check_value(MYSQL_TYPE_NEWDECIMAL, 0, 2, "\x04" "1.50", 5, NULL);
+    check_value(MYSQL_TYPE_BIT, PS_UNSIGNED_FLAG, 0, "\x01\x01", 2, NULL);
+
+    /** A value that doesn't fit in the row */
+    PS_COLUMN col = {.type = MYSQL_TYPE_LONG};
+    uint8_t data[] = {1, 2};
+    uint8_t *ptr = data;
+    char text[PS_VALUE_LEN];
+    ss_info_dassert(convert_value(&col, &ptr, data + sizeof(data), text) == -2,
+                    "A truncated value must be detected");
+    col.type = MYSQL_TYPE_DATETIME;
+    data[0] = 7;
+    ss_info_dassert(convert_value(&col, &ptr, data + sizeof(data), text) == -2,
+                    "A truncated temporal value must be detected");
+
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+static void test_convert_row()
+{
+    ss_dfprintf(stderr, "testpsfilter : converting binary rows to text rows.");
+
+    PS_COLUMN columns[] =
+    {
+        {.type = MYSQL_TYPE_LONG},
+        {.type = MYSQL_TYPE_VAR_STRING},
+        {.type = MYSQL_TYPE_DOUBLE, .decimals = PS_NOT_FIXED_DEC},
+        {.type = MYSQL_TYPE_LONGLONG}
+    };
+    test_session.columns = columns;
+    test_session.n_columns = 4;
+
+    /** The header, the NULL bitmap with the last column NULL, 42, "ab" and 1.5 */
+    uint8_t row[1 + 1 + 4 + 3 + 8];
+    double value = 1.5;
+    memcpy(row, "\x00\x20\x2a\x00\x00\x00\x02" "ab", 9);
+    memcpy(row + 9, &value, sizeof(value));
+
+    const uint8_t expected[] = "\x02" "42" "\x02" "ab" "\x03" "1.5" "\xfb";
+    ss_info_dassert(convert_row(&test_session, row, sizeof(row)), "The row must be converted");
+    ss_info_dassert(test_session.row_len == sizeof(expected) - 1, "The length of the row must match");
+    ss_info_dassert(memcmp(test_session.row, expected, test_session.row_len) == 0, "The row must match");
+
+    /** A row without the last value */
+    row[1] = 0;
+    ss_info_dassert(!convert_row(&test_session, row, sizeof(row)), "A missing value must be detected");
+
+    /** A string longer than the row */
+    row[1] = 0x20;
+    row[6] = 0x40;
+    ss_info_dassert(!convert_row(&test_session, row, sizeof(row)), "A long string must be detected");
+    ss_info_dassert(!convert_row(&test_session, row, 1), "A missing NULL bitmap must be detected");
+
+    free(test_session.row);
+    test_session.row = NULL;
+    test_session.columns = NULL;
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+int main(int argc, char **argv)
+{
+    test_parameterize();
+    test_excluded();
+    test_convert_value();
+    test_convert_row();
+    return 0;
+}
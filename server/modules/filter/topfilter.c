@@ -26,8 +26,13 @@
  * file to which the queries are logged. A serial number is appended to this
  * name in order that each session logs to a different file.
  *
+ * With global=true the statements of all sessions are aggregated by their
+ * fingerprint and the top N of them by total execution time are shown
+ * by the diagnostics of the filter instead of the session reports.
+ *
  * Date         Who             Description
  * 18/06/2014   Mark Riddoch    Addition of source and user filters
+ * 14/10/2016                   Aggregate the global statistics by statement fingerprints
  *
  * @endverbatim
  */
@@ -44,6 +49,8 @@
 #include <sys/time.h>
 #include <regex.h>
 #include <atomic.h>
+#include <spinlock.h>
+#include "maxconfig.h"
 
 MODULE_INFO info =
 {
@@ -67,6 +74,7 @@ static void setUpstream(FILTER *instance, void *fsession, UPSTREAM *upstream);
 static int routeQuery(FILTER *instance, void *fsession, GWBUF *queue);
 static int clientReply(FILTER *instance, void *fsession, GWBUF *queue);
 static void diagnostic(FILTER *instance, void *fsession, DCB *dcb);
+static uint32_t getInterest(FILTER *instance);
 
 
 static FILTER_OBJECT MyObject =
@@ -80,8 +88,65 @@ static FILTER_OBJECT MyObject =
     routeQuery,
     clientReply,
     diagnostic,
+    getInterest
 };
 
+/** Number of rows in the count-min sketch */
+#define TOPN_SKETCH_DEPTH 4
+
+/** Number of counters in a row of the count-min sketch, a power of two */
+#define TOPN_SKETCH_WIDTH 4096
+
+/** Number of shards the tracked statements are divided into */
+#define TOPN_SHARDS 16
+
+/**
+ * Number of buckets in the latency histogram of a statement. Bucket n counts
+ * the executions that took from 2^n to 2^(n+1) microseconds.
+ */
+#define TOPN_HISTOGRAM_SIZE 32
+
+/**
+ * A tracked statement fingerprint. The count and total of a statement that
+ * started to be tracked after its first execution are estimates from the
+ * sketch, the histogram and the maximum cover only the tracked executions.
+ */
+typedef struct
+{
+    char *sql; /* The statement fingerprint */
+    uint64_t hash; /* Hash of the statement */
+    uint64_t count; /* Number of executions */
+    uint64_t total; /* Total execution time in microseconds */
+    uint64_t max; /* Longest execution time in microseconds */
+    uint64_t histogram[TOPN_HISTOGRAM_SIZE]; /* Execution time histogram */
+    int index; /* Position in the heap of the shard */
+} TOPN_STATEMENT;
+
+/**
+ * A shard of the tracked statements. The statements are in a min-heap on
+ * their total execution time of at most the top N of the instance.
+ */
+typedef struct
+{
+    SPINLOCK lock; /* Protects the heap */
+    uint64_t threshold; /* Total time a statement needs to get into a full heap */
+    TOPN_STATEMENT **heap; /* The tracked statements */
+    int n_heap; /* Number of tracked statements */
+} TOPN_SHARD;
+
+/**
+ * The statistics of all the sessions of a filter instance. The count-min
+ * sketch estimates the number of executions and the total execution time of
+ * every statement fingerprint and is updated with atomic operations. Only the
+ * statements that get into the top N of their shard take the shard lock.
+ */
+typedef struct
+{
+    uint64_t counts[TOPN_SKETCH_DEPTH][TOPN_SKETCH_WIDTH];
+    uint64_t totals[TOPN_SKETCH_DEPTH][TOPN_SKETCH_WIDTH];
+    TOPN_SHARD shards[TOPN_SHARDS];
+} TOPN_STATS;
+
 /**
  * A instance structure, the assumption is that the option passed
  * to the filter is simply a base for the filename to which the queries
@@ -101,6 +166,7 @@ typedef struct
     regex_t re; /* Compiled regex text */
     char *exclude; /* Optional text to match against for exclusion */
     regex_t exre; /* Compiled regex nomatch text */
+    TOPN_STATS *stats; /* Statistics of all sessions, NULL unless global */
 } TOPN_INSTANCE;
 
 /**
@@ -131,6 +197,7 @@ typedef struct
     int fd;
     struct timeval start;
     char *current;
+    uint64_t current_hash; /* Hash of the current fingerprint, with global=true */
     TOPNQ **top;
     int n_statements;
     struct timeval total;
@@ -197,6 +264,8 @@ createInstance(char **options, FILTER_PARAMETER **params)
         my_instance->source = NULL;
         my_instance->user = NULL;
         my_instance->filebase = NULL;
+        my_instance->stats = NULL;
+        bool global = false;
         bool error = false;
 
         for (i = 0; params && params[i]; i++)
@@ -225,6 +294,10 @@ createInstance(char **options, FILTER_PARAMETER **params)
             {
                 my_instance->user = strdup(params[i]->value);
             }
+            else if (!strcmp(params[i]->name, "global"))
+            {
+                global = config_truth_value(params[i]->value);
+            }
             else if (!filter_standard_parameter(params[i]->name))
             {
                 MXS_ERROR("topfilter: Unexpected parameter '%s'.",
@@ -260,7 +333,33 @@ createInstance(char **options, FILTER_PARAMETER **params)
             }
         }
 
-        if (my_instance->filebase == NULL)
+        if (my_instance->topN <= 0)
+        {
+            MXS_ERROR("topfilter: The 'count' parameter must be a positive number.");
+            error = true;
+        }
+
+        if (global)
+        {
+            if ((my_instance->stats = calloc(1, sizeof(TOPN_STATS))) == NULL)
+            {
+                error = true;
+            }
+            else
+            {
+                for (i = 0; i < TOPN_SHARDS; i++)
+                {
+                    spinlock_init(&my_instance->stats->shards[i].lock);
+
+                    if ((my_instance->stats->shards[i].heap =
+                             calloc(my_instance->topN, sizeof(TOPN_STATEMENT*))) == NULL)
+                    {
+                        error = true;
+                    }
+                }
+            }
+        }
+        else if (my_instance->filebase == NULL)
         {
             MXS_ERROR("topfilter: No 'filebase' parameter defined.");
             error = true;
@@ -302,6 +401,14 @@ createInstance(char **options, FILTER_PARAMETER **params)
                 regfree(&my_instance->re);
                 free(my_instance->match);
             }
+            if (my_instance->stats)
+            {
+                for (i = 0; i < TOPN_SHARDS; i++)
+                {
+                    free(my_instance->stats->shards[i].heap);
+                }
+                free(my_instance->stats);
+            }
             free(my_instance->filebase);
             free(my_instance->source);
             free(my_instance->user);
@@ -331,22 +438,27 @@ newSession(FILTER *instance, SESSION *session)
 
     if ((my_session = calloc(1, sizeof(TOPN_SESSION))) != NULL)
     {
-        if ((my_session->filename =
-                 (char *) malloc(strlen(my_instance->filebase) + 20))
-            == NULL)
-        {
-            free(my_session);
-            return NULL;
-        }
-        sprintf(my_session->filename, "%s.%d", my_instance->filebase,
-                my_instance->sessions);
         atomic_add(&my_instance->sessions, 1);
-        my_session->top = (TOPNQ **) calloc(my_instance->topN + 1,
-                                            sizeof(TOPNQ *));
-        for (i = 0; i < my_instance->topN; i++)
+
+        /** In the global mode the statements are only added to the statistics */
+        if (my_instance->stats == NULL)
         {
-            my_session->top[i] = (TOPNQ *) calloc(1, sizeof(TOPNQ));
-            my_session->top[i]->sql = NULL;
+            if ((my_session->filename =
+                     (char *) malloc(strlen(my_instance->filebase) + 20))
+                == NULL)
+            {
+                free(my_session);
+                return NULL;
+            }
+            sprintf(my_session->filename, "%s.%d", my_instance->filebase,
+                    my_instance->sessions);
+            my_session->top = (TOPNQ **) calloc(my_instance->topN + 1,
+                                                sizeof(TOPNQ *));
+            for (i = 0; i < my_instance->topN; i++)
+            {
+                my_session->top[i] = (TOPNQ *) calloc(1, sizeof(TOPNQ));
+                my_session->top[i]->sql = NULL;
+            }
         }
         my_session->n_statements = 0;
         my_session->total.tv_sec = 0;
@@ -380,8 +492,6 @@ newSession(FILTER *instance, SESSION *session)
             my_session->active = 0;
         }
 
-        sprintf(my_session->filename, "%s.%d", my_instance->filebase,
-                my_instance->sessions);
         gettimeofday(&my_session->connect, NULL);
     }
 
@@ -408,7 +518,7 @@ closeSession(FILTER *instance, void *session)
 
     gettimeofday(&my_session->disconnect, NULL);
     timersub((&my_session->disconnect), &(my_session->connect), &diff);
-    if ((fp = fopen(my_session->filename, "w")) != NULL)
+    if (my_session->filename && (fp = fopen(my_session->filename, "w")) != NULL)
     {
         statements = my_session->n_statements != 0 ? my_session->n_statements : 1;
 
@@ -525,10 +635,6 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
 
     if (my_session->active)
     {
-        if (queue->next != NULL)
-        {
-            queue = gwbuf_make_contiguous(queue);
-        }
         if ((ptr = modutil_get_SQL(queue)) != NULL)
         {
             if ((my_instance->match == NULL ||
@@ -541,6 +647,13 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
                 {
                     free(my_session->current);
                 }
+
+                if (my_instance->stats)
+                {
+                    /** If this fails, the statement is not tracked */
+                    free(ptr);
+                    ptr = modutil_get_fingerprint(queue, &my_session->current_hash);
+                }
                 gettimeofday(&my_session->start, NULL);
                 my_session->current = ptr;
             }
@@ -555,6 +668,282 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
                                        my_session->down.session, queue);
 }
 
+/**
+ * Restore the heap of a shard after the total of a statement has grown
+ *
+ * @param shard The shard
+ * @param i     The position of the statement
+ */
+static void
+topn_heap_down(TOPN_SHARD *shard, int i)
+{
+    TOPN_STATEMENT **heap = shard->heap;
+
+    while (true)
+    {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+
+        if (left < shard->n_heap && heap[left]->total < heap[smallest]->total)
+        {
+            smallest = left;
+        }
+        if (right < shard->n_heap && heap[right]->total < heap[smallest]->total)
+        {
+            smallest = right;
+        }
+        if (smallest == i)
+        {
+            break;
+        }
+
+        TOPN_STATEMENT *tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        heap[i]->index = i;
+        heap[smallest]->index = smallest;
+        i = smallest;
+    }
+}
+
+/**
+ * Restore the heap of a shard after a statement has been added to its end
+ *
+ * @param shard The shard
+ * @param i     The position of the statement
+ */
+static void
+topn_heap_up(TOPN_SHARD *shard, int i)
+{
+    TOPN_STATEMENT **heap = shard->heap;
+
+    while (i > 0 && heap[(i - 1) / 2]->total > heap[i]->total)
+    {
+        int parent = (i - 1) / 2;
+        TOPN_STATEMENT *tmp = heap[i];
+        heap[i] = heap[parent];
+        heap[parent] = tmp;
+        heap[i]->index = i;
+        heap[parent]->index = parent;
+        i = parent;
+    }
+}
+
+/**
+ * Get the histogram bucket of an execution time
+ *
+ * @param usec  The execution time in microseconds
+ * @return The bucket
+ */
+static int
+topn_bucket(uint64_t usec)
+{
+    int bucket = 0;
+
+    while (usec > 1 && bucket < TOPN_HISTOGRAM_SIZE - 1)
+    {
+        usec >>= 1;
+        bucket++;
+    }
+
+    return bucket;
+}
+
+/**
+ * Add an execution of a statement fingerprint to the statistics of the
+ * filter instance
+ *
+ * @param instance  The filter instance
+ * @param sql       The statement fingerprint
+ * @param hash      Hash of the fingerprint
+ * @param usec      The execution time in microseconds
+ */
+static void
+topn_stats_add(TOPN_INSTANCE *instance, const char *sql, uint64_t hash, uint64_t usec)
+{
+    TOPN_STATS *stats = instance->stats;
+    uint64_t step = (hash >> 32) | 1;
+    uint64_t count = UINT64_MAX;
+    uint64_t total = UINT64_MAX;
+
+    for (int i = 0; i < TOPN_SKETCH_DEPTH; i++)
+    {
+        int slot = (hash + i * step) & (TOPN_SKETCH_WIDTH - 1);
+        uint64_t c = __atomic_add_fetch(&stats->counts[i][slot], 1, __ATOMIC_RELAXED);
+        uint64_t t = __atomic_add_fetch(&stats->totals[i][slot], usec, __ATOMIC_RELAXED);
+        count = MIN(count, c);
+        total = MIN(total, t);
+    }
+
+    TOPN_SHARD *shard = &stats->shards[hash % TOPN_SHARDS];
+
+    /** A statement below the smallest total of a full shard is not tracked */
+    if (total <= __atomic_load_n(&shard->threshold, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+
+    spinlock_acquire(&shard->lock);
+
+    TOPN_STATEMENT *stmt = NULL;
+
+    for (int i = 0; i < shard->n_heap; i++)
+    {
+        if (shard->heap[i]->hash == hash && strcmp(shard->heap[i]->sql, sql) == 0)
+        {
+            stmt = shard->heap[i];
+            break;
+        }
+    }
+
+    if (stmt)
+    {
+        stmt->count++;
+        stmt->total += usec;
+        stmt->max = MAX(stmt->max, usec);
+        stmt->histogram[topn_bucket(usec)]++;
+        topn_heap_down(shard, stmt->index);
+    }
+    else if (shard->n_heap < instance->topN || total > shard->heap[0]->total)
+    {
+        char *copy = strdup(sql);
+
+        if (copy && shard->n_heap == instance->topN)
+        {
+            /** Replace the statement with the smallest total */
+            stmt = shard->heap[0];
+            free(stmt->sql);
+            memset(stmt->histogram, 0, sizeof(stmt->histogram));
+        }
+        else if (copy && (stmt = calloc(1, sizeof(TOPN_STATEMENT))))
+        {
+            stmt->index = shard->n_heap;
+            shard->heap[shard->n_heap++] = stmt;
+        }
+
+        if (stmt)
+        {
+            stmt->sql = copy;
+            stmt->hash = hash;
+            stmt->count = count;
+            stmt->total = total;
+            stmt->max = usec;
+            stmt->histogram[topn_bucket(usec)] = 1;
+            topn_heap_up(shard, stmt->index);
+            topn_heap_down(shard, stmt->index);
+        }
+        else
+        {
+            free(copy);
+        }
+    }
+
+    if (shard->n_heap == instance->topN)
+    {
+        __atomic_store_n(&shard->threshold, shard->heap[0]->total, __ATOMIC_RELAXED);
+    }
+
+    spinlock_release(&shard->lock);
+}
+
+/**
+ * Estimate the 99th percentile execution time of a statement from its
+ * histogram
+ *
+ * @param stmt  The statement
+ * @return The execution time in microseconds
+ */
+static uint64_t
+topn_p99(const TOPN_STATEMENT *stmt)
+{
+    uint64_t n = 0;
+    uint64_t seen = 0;
+
+    for (int i = 0; i < TOPN_HISTOGRAM_SIZE; i++)
+    {
+        n += stmt->histogram[i];
+    }
+
+    for (int i = 0; i < TOPN_HISTOGRAM_SIZE; i++)
+    {
+        seen += stmt->histogram[i];
+
+        if (seen * 100 >= n * 99)
+        {
+            return MIN((uint64_t) 2 << i, stmt->max);
+        }
+    }
+
+    return stmt->max;
+}
+
+static int
+cmp_statement(const void *va, const void *vb)
+{
+    const TOPN_STATEMENT *a = (const TOPN_STATEMENT *) va;
+    const TOPN_STATEMENT *b = (const TOPN_STATEMENT *) vb;
+
+    return a->total < b->total ? 1 : a->total > b->total ? -1 : 0;
+}
+
+/**
+ * Print the top N statements of all sessions
+ *
+ * @param instance  The filter instance
+ * @param dcb       The DCB for diagnostic output
+ */
+static void
+topn_stats_print(TOPN_INSTANCE *instance, DCB *dcb)
+{
+    TOPN_STATEMENT *all = malloc(TOPN_SHARDS * instance->topN * sizeof(TOPN_STATEMENT));
+    int n = 0;
+
+    if (all == NULL)
+    {
+        return;
+    }
+
+    for (int i = 0; i < TOPN_SHARDS; i++)
+    {
+        TOPN_SHARD *shard = &instance->stats->shards[i];
+
+        spinlock_acquire(&shard->lock);
+        for (int j = 0; j < shard->n_heap; j++)
+        {
+            all[n] = *shard->heap[j];
+            if ((all[n].sql = strdup(shard->heap[j]->sql)))
+            {
+                n++;
+            }
+        }
+        spinlock_release(&shard->lock);
+    }
+
+    qsort(all, n, sizeof(TOPN_STATEMENT), cmp_statement);
+
+    dcb_printf(dcb, "\t\tTop %d statements of all sessions:\n", instance->topN);
+    dcb_printf(dcb, "\t\t%10s | %12s | %10s | %10s | %10s | %s\n",
+               "Count", "Total (sec)", "Avg (sec)", "P99 (sec)", "Max (sec)", "Statement");
+
+    for (int i = 0; i < n; i++)
+    {
+        if (i < instance->topN)
+        {
+            dcb_printf(dcb, "\t\t%10lu | %12.3f | %10.3f | %10.3f | %10.3f | %s\n",
+                       (unsigned long) all[i].count,
+                       all[i].total / 1000000.0,
+                       all[i].total / 1000000.0 / MAX(all[i].count, 1),
+                       topn_p99(&all[i]) / 1000000.0,
+                       all[i].max / 1000000.0,
+                       all[i].sql);
+        }
+        free(all[i].sql);
+    }
+
+    free(all);
+}
+
 static int
 cmp_topn(const void *va, const void *vb)
 {
@@ -583,6 +972,17 @@ clientReply(FILTER *instance, void *session, GWBUF *reply)
 
         timeradd(&(my_session->total), &diff, &(my_session->total));
 
+        if (my_instance->stats)
+        {
+            topn_stats_add(my_instance, my_session->current, my_session->current_hash,
+                           (uint64_t) diff.tv_sec * 1000000 + diff.tv_usec);
+            free(my_session->current);
+            my_session->current = NULL;
+
+            return my_session->up.clientReply(my_session->up.instance,
+                                              my_session->up.session, reply);
+        }
+
         inserted = 0;
         for (i = 0; i < my_instance->topN; i++)
         {
@@ -622,6 +1022,18 @@ clientReply(FILTER *instance, void *session, GWBUF *reply)
                                       my_session->up.session, reply);
 }
 
+/**
+ * The statements are timed until their first reply
+ *
+ * @param instance  The filter instance
+ * @return The classes of packets the filter acts on
+ */
+static uint32_t
+getInterest(FILTER *instance)
+{
+    return FILTER_INTEREST_SQL | FILTER_INTEREST_REPLIES;
+}
+
 /**
  * Diagnostics routine
  *
@@ -662,7 +1074,11 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
         dcb_printf(dcb, "\t\tExclude queries that match     %s\n",
                    my_instance->exclude);
     }
-    if (my_session)
+    if (my_instance->stats)
+    {
+        topn_stats_print(my_instance, dcb);
+    }
+    else if (my_session)
     {
         dcb_printf(dcb, "\t\tLogging to file %s.\n",
                    my_session->filename);
@@ -6,6 +6,7 @@
 #define _MXS_AVRO_H
 #include <stdbool.h>
 #include <stdint.h>
+#include <pthread.h>
 #include <blr_constants.h>
 #include <gw.h>
 #include <dcb.h>
@@ -41,6 +42,12 @@
 
 #define MAX_MAPPED_TABLES 1024
 
+/** Maximum number of row events queued for one conversion thread */
+#define AVRO_SHARD_QUEUE_MAX 1024
+
+/** Number of decoded data blocks shared between the JSON clients */
+#define AVRO_BLOCK_CACHE_SIZE 256
+
 #define GTID_TABLE_NAME        "gtid"
 #define USED_TABLES_TABLE_NAME "used_tables"
 #define MEMORY_DATABASE_NAME   "memory"
@@ -69,6 +76,18 @@ static const char *avro_sequence     = "sequence";
 static const char *avro_event_number = "event_number";
 static const char *avro_event_type   = "event_type";
 static const char *avro_timestamp    = "timestamp";
+
+/** Positions of the generated fields in the schema, the columns follow them */
+enum avro_metadata_field
+{
+    AVRO_FIELD_DOMAIN,
+    AVRO_FIELD_SERVER_ID,
+    AVRO_FIELD_SEQUENCE,
+    AVRO_FIELD_EVENT_NUMBER,
+    AVRO_FIELD_TIMESTAMP,
+    AVRO_FIELD_EVENT_TYPE,
+    AVRO_METADATA_FIELDS
+};
 static char *avro_client_ouput[]     = { "Undefined", "JSON", "Avro" };
 
 
@@ -93,6 +112,15 @@ typedef enum avro_binlog_end
 /** How many bytes each thread tries to send */
 #define AVRO_DATA_BURST_SIZE MAX_BUFFER_SIZE
 
+/** Write queue size of a client that pauses the streaming */
+#define AVRO_CLIENT_HIGH_WATER (64 * AVRO_DATA_BURST_SIZE)
+
+/** Write queue size of a client that resumes the streaming */
+#define AVRO_CLIENT_LOW_WATER (16 * AVRO_DATA_BURST_SIZE)
+
+/** Size of the buffers that individual JSON rows are collected into */
+#define AVRO_ROW_BATCH_SIZE GWBUF_MAX_POOLED_SIZE
+
 /** A CREATE TABLE abstraction */
 typedef struct table_create
 {
@@ -151,6 +179,7 @@ typedef struct
     int             n_requests;     /*< Number of requests received */
     int             n_queries;      /*< Number of queries */
     int             n_failed_read;
+    int             n_paused;       /*< Times the streaming paused for a full write queue */
     uint64_t        lastsample;
     int             minno;
     int             minavgs[AVRO_NSTATS_MINUTES];
@@ -162,6 +191,7 @@ typedef struct avro_table_t
     char* json_schema; /*< JSON representation of the schema */
     avro_file_writer_t avro_file; /*< Current Avro data file */
     avro_value_iface_t *avro_writer_iface; /*< Avro C API writer interface */
+    avro_value_t avro_record; /*< Record reused for all rows of the table */
     avro_schema_t avro_schema; /*< Native Avro schema of the table */
 } AVRO_TABLE;
 
@@ -185,6 +215,56 @@ typedef struct gtid_pos
                          * rebuild GTID events in the correct order. */
 } gtid_pos_t;
 
+/**
+ * A row event queued for a conversion thread. The event is copied so that
+ * the binlog buffer can be freed, the table map and the Avro file of the
+ * table stay valid until all queued events have been converted.
+ */
+typedef struct avro_row_job
+{
+    REP_HEADER      hdr; /*< Replication header of the row event */
+    uint8_t         *data; /*< Copy of the event payload */
+    size_t          rows_offset; /*< Offset of the first row in data */
+    size_t          present_offset; /*< Offset of the present columns bitmap in data */
+    TABLE_MAP       *map; /*< Table map of the event */
+    AVRO_TABLE      *table; /*< The Avro file of the table */
+    gtid_pos_t      gtid; /*< GTID of the event, event_num is that of the
+                           * last record before this event */
+    uint64_t        pos; /*< Binlog position of the event */
+    struct avro_row_job *next;
+} AVRO_ROW_JOB;
+
+/**
+ * A conversion thread and its queue of row events. The tables are divided
+ * between the threads so that the events of a table are always converted in
+ * order by the same thread.
+ */
+typedef struct avro_shard
+{
+    pthread_mutex_t lock; /*< Protects the queue */
+    pthread_cond_t  cond; /*< Signaled when the queue changes */
+    AVRO_ROW_JOB    *head; /*< The oldest queued event */
+    AVRO_ROW_JOB    *tail; /*< The newest queued event */
+    int             njobs; /*< Number of queued events, including the one being converted */
+    uint64_t        n_events; /*< Number of row events converted */
+    THREAD          thread; /*< The conversion thread */
+} AVRO_SHARD;
+
+/**
+ * A data block decoded into JSON. The clients that stream the same table
+ * send the same buffer instead of each decoding the block again.
+ */
+typedef struct avro_cached_block
+{
+    char            filename[AVRO_MAX_FILENAME_LEN + 1]; /*< The Avro file */
+    long            offset; /*< Offset of the data of the block in the file */
+    uint64_t        block_size; /*< Size of the data of the block */
+    GWBUF           *json; /*< The records of the block, NULL if the slot is free */
+    uint64_t        domain; /*< GTID of the last record of the block */
+    uint64_t        server_id;
+    uint64_t        seq;
+} AVRO_CACHED_BLOCK;
+
 /**
  * The client structure used within this router.
  * This represents the clients that are requesting AVRO files from MaxScale.
@@ -213,6 +293,10 @@ typedef struct avro_client
     gtid_pos_t      gtid_start; /*< First sent GTID */
     unsigned int    cstate;         /*< Catch up state */
     sqlite3       *sqlite_handle;
+    char            *columns;       /*< Requested columns, NULL for all */
+    char            *where_column;  /*< Column of the row filter, NULL for all rows */
+    char            *where_value;   /*< Value of the row filter */
+    MAXAVRO_FILTER  *filter;        /*< Filter for the current file */
 #if defined(SS_DEBUG)
     skygw_chk_t     rses_chk_tail;
 #endif
@@ -250,6 +334,12 @@ typedef struct avro_instance
     HASHTABLE     *open_tables;
     HASHTABLE     *created_tables;
     sqlite3       *sqlite_handle;
+    sqlite3_stmt  *insert_gtid_stmt; /*< Adds a GTID to the index */
+    sqlite3_stmt  *select_progress_stmt; /*< Reads the indexed position of a file */
+    sqlite3_stmt  *update_progress_stmt; /*< Stores the indexed position of a file */
+    sqlite3_stmt  *insert_used_stmt; /*< Adds a table used by the current GTID */
+    sqlite3_stmt  *flush_used_stmt; /*< Moves the used tables from memory to disk */
+    sqlite3_stmt  *clear_used_stmt; /*< Clears the used tables in memory */
     char              prevbinlog[BINLOG_FNAMELEN + 1];
     int               rotating;     /*< Rotation in progress flag */
     SPINLOCK          fileslock;    /*< Lock for the files queue above */
@@ -262,6 +352,18 @@ typedef struct avro_instance
     uint64_t        row_target; /*< Minimum about of row events that will trigger
                                  * a flush of all tables */
     uint64_t        block_size; /**< Avro datablock size */
+    const char      *codec; /**< Compression codec of new Avro files */
+    bool            continuous; /**< Convert the binlog events as they are written */
+    int             notify_fd; /**< inotify instance watching binlogdir, -1 if none */
+    THREAD          converter; /**< The continuous conversion thread */
+    int             n_shards; /**< Number of conversion threads, 0 to convert inline */
+    AVRO_SHARD      *shards; /**< The conversion threads */
+    SPINLOCK        block_cache_lock; /**< Protects block_cache */
+    AVRO_CACHED_BLOCK block_cache[AVRO_BLOCK_CACHE_SIZE]; /**< Decoded data blocks */
+    uint64_t        block_cache_hits; /**< Data blocks sent from block_cache */
+    uint64_t        block_cache_misses; /**< Data blocks decoded for a client */
+    int             client_high_water; /**< Client write queue size that pauses streaming */
+    int             client_low_water; /**< Client write queue size that resumes streaming */
     struct avro_instance  *next;
 } AVRO_INSTANCE;
 
@@ -279,7 +381,8 @@ extern void avro_client_rotate(AVRO_INSTANCE *router, AVRO_CLIENT *client, uint8
 extern bool avro_open_binlog(const char *binlogdir, const char *file, int *fd);
 extern void avro_close_binlog(int fd);
 extern avro_binlog_end_t avro_read_all_events(AVRO_INSTANCE *router);
-extern AVRO_TABLE* avro_table_alloc(const char* filepath, const char* json_schema, size_t block_size);
+extern AVRO_TABLE* avro_table_alloc(const char* filepath, const char* json_schema,
+                                    const char *codec, size_t block_size);
 extern void* avro_table_free(AVRO_TABLE *table);
 extern void avro_flush_all_tables(AVRO_INSTANCE *router);
 extern char* json_new_schema_from_table(TABLE_MAP *map);
@@ -287,6 +390,10 @@ extern void save_avro_schema(const char *path, const char* schema, TABLE_MAP *ma
 extern bool handle_table_map_event(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr);
 extern bool handle_row_event(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr);
 extern void table_map_remap(uint8_t *ptr, uint8_t hdr_len, TABLE_MAP *map);
+extern void avro_row_job_convert(AVRO_ROW_JOB *job);
+extern bool avro_shards_start(AVRO_INSTANCE *router, int nthreads);
+extern void avro_shards_add(AVRO_INSTANCE *router, const char *table_ident, AVRO_ROW_JOB *job);
+extern void avro_shards_wait(AVRO_INSTANCE *router);
 
 #define AVRO_CLIENT_UNREGISTERED 0x0000
 #define AVRO_CLIENT_REGISTERED   0x0001
@@ -299,5 +406,6 @@ extern void table_map_remap(uint8_t *ptr, uint8_t hdr_len, TABLE_MAP *map);
  */
 #define AVRO_CS_BUSY             0x0001
 #define AVRO_WAIT_DATA           0x0002
+#define AVRO_CS_PAUSED           0x0004 /*< Waiting for the write queue to drain */
 
 #endif
@@ -37,9 +37,11 @@
 #include <dcb.h>
 #include <buffer.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <stdint.h>
 #include <memlog.h>
 #include <zlib.h>
+#include <crc32.h>
 #include <mysql_client_server_protocol.h>
 
 #define BINLOG_FNAMELEN         255
@@ -138,6 +140,48 @@
 #define DEF_SHORT_BURST         15
 #define DEF_LONG_BURST          500
 #define DEF_BURST_SIZE          1024000 /* 1 Mb */
+#define DEF_LAGGING_BURST_SIZE  256000  /* 256 Kb */
+#define DEF_CATCHUP_NEAR        8192000 /* 8 Mb */
+#define BLR_CATCHUP_PERIOD      100     /* Milliseconds between the refills of the catch-up bandwidth */
+#define BLR_DIST_QUEUE_SIZE     1024    /* Events waiting for distribution, a power of two */
+#define DEF_CACHE_SIZE          8192000 /* 8 Mb */
+#define DEF_WRITE_BUFFER_SIZE   65536   /* 64 Kb */
+#define DEF_SYNC_PERIOD         1000    /* Milliseconds */
+#define DEF_SYNC_BYTES          1024000 /* 1 Mb */
+#define BLR_WRITE_ALIGN         4096    /* Buffered writes end at a multiple of this */
+
+/**
+ * The number of buckets in the binlog file sync time histogram. Bucket n
+ * counts the syncs that took from 2^n to 2^(n+1) microseconds, the last one
+ * counts all the syncs that took longer.
+ */
+#define BLR_FSYNC_TIMES         24
+
+/**
+ * A semi-synchronous master puts a header of the indicator byte and a flags
+ * byte after the OK byte of each event. The acknowledgement is a packet that
+ * starts with the indicator byte.
+ */
+#define BLR_SEMISYNC_INDICATOR  0xef
+#define BLR_SEMISYNC_ACK_REQ    0x01
+#define BLR_SEMISYNC_HDR_LEN    2
+
+/** When the binlog file is synced to disk */
+enum blr_sync_policy
+{
+    BLR_SYNC_BATCH,         /*< After each batch of events read from the master */
+    BLR_SYNC_TRANSACTION,   /*< After the batches that end outside of a transaction */
+    BLR_SYNC_PERIOD,        /*< At most once per sync_period milliseconds */
+    BLR_SYNC_BYTES          /*< After sync_bytes bytes have been written */
+};
+#define BLR_CACHE_AVG_EVENT     512     /* Expected event size, sets the number of cache records */
+#define BLR_CACHE_MIN_RECORDS   64
+
+/* The size of the reads when a binlog file is scanned */
+#define BLR_READAHEAD_SIZE      1048576
+
+/* The suffix of the index files of the binlog files */
+#define BLR_INDEX_SUFFIX        ".idx"
 
 /**
  * master reconnect backoff constants
@@ -251,34 +295,67 @@ typedef struct rep_header
 } REP_HEADER;
 
 /**
- * The binlog record structure. This contains the actual packet read from the binlog
- * file.
+ * The binlog record structure. This contains an event that was written to the
+ * binlog file.
  */
 typedef struct
 {
+    char            binlogname[BINLOG_FNAMELEN + 1]; /*< The binlog file of the record */
+    struct router_instance *router; /*< The router instance that wrote the event */
     unsigned long   position;       /*< binlog record position for this cache entry */
-    GWBUF           *pkt;           /*< The packet received from the master */
-    REP_HEADER      hdr;            /*< The packet header */
+    GWBUF           *pkt;           /*< The event, NULL if the record is not in use */
+    REP_HEADER      hdr;            /*< The event header */
 } BLCACHE_RECORD;
 
 /**
- * The binlog cache. A cache exists for each file that hold cached bin log records.
- * Caches will be used for all files being read by more than 1 slave.
+ * The binlog cache. The most recently written events are kept in a ring that
+ * is shared by all the slaves of the router so that slaves that are close to
+ * the master can be sent the events without reading them from the file. The
+ * events are shared with the slaves by reference.
  */
 typedef struct
 {
-    BLCACHE_RECORD  **records;      /*< The actual binlog records */
+    BLCACHE_RECORD  *records;       /*< The actual binlog records */
+    int             *index;         /*< Hash of file and position to record, -1 if none */
+    int             nrecords;       /*< The number of records in the ring */
+    int             index_mask;     /*< The size of the index minus one */
     int             current;        /*< The next record that will be inserted */
     int             cnt;            /*< The number of records in the cache */
+    unsigned long   size;           /*< Bytes of events in the cache */
+    unsigned long   max_size;       /*< Maximum bytes of events in the cache */
+    bool            shared;         /*< Whether the cache is shared by router instances */
+    int             refcnt;         /*< The number of router instances using the cache */
     SPINLOCK        lock;           /*< The spinlock for the cache */
 } BLCACHE;
 
+/**
+ * An entry of the binlog index. The index of a binlog file is kept next to it
+ * in a file with the BLR_INDEX_SUFFIX and holds one entry for each MariaDB 10
+ * GTID event group in the order they were written. The end of an entry is a
+ * safe position, the start of the next event group.
+ */
+typedef struct blr_index_entry
+{
+    uint32_t        domain;         /*< GTID domain id */
+    uint32_t        server_id;      /*< GTID server id */
+    uint64_t        sequence;       /*< GTID sequence number */
+    uint64_t        start;          /*< Position of the GTID event, 0 if unset */
+    uint64_t        end;            /*< Position after the last event of the group */
+} BLR_INDEX_ENTRY;
+
+/** The suffix of a compressed binlog file */
+#define BLR_ZFILE_SUFFIX        ".z"
+/** Bytes of a binlog file that are compressed together */
+#define BLR_ZCHUNK_SIZE         (64 * 1024)
+
+typedef struct blr_zfile BLR_ZFILE;
+
 typedef struct blfile
 {
     char            binlogname[BINLOG_FNAMELEN + 1]; /*< Name of the binlog file */
     int             fd;                             /*< Actual file descriptor */
+    BLR_ZFILE       *zfile;                         /*< The file if it is compressed, else NULL */
     int             refcnt;                         /*< Reference count for file */
-    BLCACHE         *cache;                         /*< Record cache for this file */
     SPINLOCK        lock;                           /*< The file lock */
     struct blfile   *next;                          /*< Next file in list */
 } BLFILE;
@@ -300,6 +377,10 @@ typedef struct
     int             n_dcb;
     int             n_above;
     int             n_failed_read;
+    int             n_sendfile;     /*< Number of events sent straight from the file */
+    int             n_throttled;    /*< Number of catch-up rounds deferred by catchup_bandwidth */
+    uint64_t        lastbytes;      /*< Bytes sent at the last statistics sample */
+    unsigned long   bytes_per_sec;  /*< Bytes sent per second over the last sample */
     int             n_overrun;
     int             n_caughtup;
     int             n_actions[3];
@@ -335,6 +416,7 @@ typedef struct router_slave
     char            binlogfile[BINLOG_FNAMELEN + 1];
     /*< Current binlog file for this slave */
     char            *uuid;          /*< Slave UUID */
+    char            *connect_state; /*< GTID the slave registers with, if any */
 #ifdef BLFILE_IN_SLAVE
     BLFILE          *file;          /*< Currently open binlog file */
 #endif
@@ -386,6 +468,15 @@ typedef struct
     uint64_t        n_rotates;      /*< Number of binlog rotate events */
     uint64_t        n_cachehits;    /*< Number of hits on the binlog cache */
     uint64_t        n_cachemisses;  /*< Number of misses on the binlog cache */
+    uint64_t        n_semisync_acks; /*< Number of semi-sync acknowledgements sent */
+    uint64_t        n_throttled;    /*< Number of catch-up rounds deferred by catchup_bandwidth */
+    uint64_t        n_distqueued;   /*< Number of events queued for distribution */
+    uint64_t        n_distdropped;  /*< Number of events not queued because the queue was full */
+    uint64_t        n_binlog_writes; /*< Number of writes to the binlog files */
+    uint64_t        n_fsyncs;       /*< Number of binlog file syncs */
+    uint64_t        fsync_total_us; /*< Total time spent syncing, in microseconds */
+    uint64_t        fsync_max_us;   /*< Longest sync, in microseconds */
+    uint64_t        fsync_times[BLR_FSYNC_TIMES + 1]; /*< Histogram of the sync times */
     int             n_registered;   /*< Number of registered slaves */
     int             n_masterstarts; /*< Number of times connection restarted */
     int             n_delayedreconnects;
@@ -401,6 +492,39 @@ typedef struct
     int             minavgs[BLR_NSTATS_MINUTES];
 } ROUTER_STATS;
 
+/**
+ * An event that is waiting to be sent to the slaves that are up to date. The
+ * state of the router that decides which slaves are sent the event is copied
+ * when the event is distributed.
+ */
+typedef struct
+{
+    REP_HEADER        hdr;              /*< The event header */
+    GWBUF             *event;           /*< The event, NULL if it is not copied */
+    blr_thread_role_t role;             /*< The role of the distributing thread */
+    bool              queued;           /*< The event was queued for distribution */
+    bool              verify;           /*< Verify the checksum before the event is sent */
+    uint64_t          safe_pos;         /*< Position an up to date slave has to be at */
+    char              binlog[BINLOG_FNAMELEN + 1];     /*< The binlog file of the event */
+    char              prevbinlog[BINLOG_FNAMELEN + 1]; /*< The binlog file before a rotate */
+} BLR_DIST_EVENT;
+
+/**
+ * The bounded queue of the events that the master thread has written to the
+ * binlog file and the distribution thread sends to the slaves. There is only
+ * one producer and one consumer so the queue needs no lock: the head is only
+ * written by the master thread and the tail only by the distribution thread.
+ */
+typedef struct
+{
+    BLR_DIST_EVENT    events[BLR_DIST_QUEUE_SIZE];
+    uint32_t          head;             /*< The next event to add */
+    uint32_t          tail;             /*< The next event to distribute */
+    int               dropped;          /*< Events were dropped since the queue was last drained */
+    sem_t             ready;            /*< Posted for every event and drop */
+    THREAD            thread;           /*< The distribution thread */
+} BLR_DIST_QUEUE;
+
 /**
  * Saved responses from the master that will be forwarded to slaves
  */
@@ -485,6 +609,24 @@ typedef struct router_instance
     unsigned int      short_burst;  /*< Short burst for slave catchup */
     unsigned int      long_burst;   /*< Long burst for slave catchup */
     unsigned long     burst_size;   /*< Maximum size of burst to send */
+    unsigned long     lagging_burst_size; /*< Maximum size of burst to send to a lagging slave */
+    unsigned long     catchup_near; /*< Slaves this many bytes from the head are not lagging */
+    unsigned long     catchup_bandwidth; /*< Bytes per second read for catch-up, 0 for no limit */
+    long              catchup_tokens; /*< Bytes that may still be read for catch-up */
+    uint64_t          catchup_refill; /*< Time of the last refill of catchup_tokens, in milliseconds */
+    SPINLOCK          catchup_lock; /*< Protects catchup_tokens and catchup_refill */
+    unsigned long     cache_size;   /*< Maximum size of the binlog event cache */
+    BLCACHE           *cache;       /*< Cache of the latest binlog events */
+    int               shared_cache; /*< Share the cache with the other router instances */
+    uint8_t           *write_buf;   /*< Data not yet written to the binlog file */
+    unsigned long     write_buf_size; /*< Size of write_buf, 0 if writes are not buffered */
+    unsigned long     write_buf_len; /*< Bytes of data in write_buf */
+    uint64_t          write_buf_pos; /*< File position of the data in write_buf */
+    enum blr_sync_policy sync_policy; /*< When the binlog file is synced */
+    unsigned long     sync_period;  /*< Sync period for BLR_SYNC_PERIOD, in milliseconds */
+    unsigned long     sync_bytes;   /*< Bytes between syncs for BLR_SYNC_BYTES */
+    uint64_t          unsynced_bytes; /*< Bytes written since the last sync */
+    uint64_t          last_sync;    /*< Time of the last sync, in milliseconds */
     unsigned long     heartbeat;    /*< Configured heartbeat value */
     ROUTER_STATS      stats;        /*< Statistics for this router */
     int               active_logs;
@@ -499,9 +641,39 @@ typedef struct router_instance
     char              *set_master_uuid; /*< Send custom Master UUID to slaves */
     char              *set_master_server_id; /*< Send custom Master server_id to slaves */
     int               send_slave_heartbeat; /*< Enable sending heartbeat to slaves */
+    int               bulk_catchup; /*< Send events of lagging slaves with sendfile */
+    int               binlog_index; /*< Keep a GTID index of the binlog files */
+    int               index_fd;     /*< The index of the current binlog file, -1 if none */
+    BLR_INDEX_ENTRY   index_pending; /*< The event group that is being received */
+    uint64_t          index_first_event; /*< The first event after the pending GTID event */
+    int               semisync;     /*< Request semi-synchronous replication */
+    bool              semisync_active; /*< The master sends semi-sync headers */
+    bool              semisync_need_ack; /*< The master waits for an acknowledgement */
+    int               verify_threads; /*< Threads that verify the older binlog files at startup */
+    int               verify_running; /*< Verification threads still running */
+    int               verify_next;  /*< The next older binlog file to verify */
+    int               verify_files; /*< Older binlog files verified */
+    int               verify_errors; /*< Older binlog files with errors */
+    time_t            verify_started; /*< When the verification started */
+    int               async_distribution; /*< Distribute the events in a separate thread */
+    BLR_DIST_QUEUE    *dist_queue;  /*< The events waiting for distribution */
+    int               async_checksum; /*< Verify the checksums in the distribution thread */
+    int               compress_binlogs; /*< Compress the older binlog files */
+    int               badcrc_state; /*< BLR_BADCRC_* state of a failed verification */
+    uint64_t          badcrc_pos;   /*< Position of the event that failed the verification */
+    char              badcrc_binlog[BINLOG_FNAMELEN + 1]; /*< Binlog file of the event */
     struct router_instance  *next;
 } ROUTER_INSTANCE;
 
+/**
+ * The states of the checksum verification done by the distribution thread. The
+ * events are not sent to the slaves from the time a checksum error is found
+ * until the queue has been drained after the master thread has handled it.
+ */
+#define BLR_BADCRC_NONE         0
+#define BLR_BADCRC_FOUND        1 /*< Found, the master thread has not handled it */
+#define BLR_BADCRC_HANDLED      2 /*< The binlog file was truncated, the queue is drained */
+
 /**
  * State machine for the master to MaxScale replication
  */
@@ -528,8 +700,10 @@ typedef struct router_instance
 #define BLRM_BINLOGDUMP         0x0014
 #define BLRM_SLAVE_STOPPED      0x0015
 #define BLRM_MARIADB10          0x0016
+#define BLRM_CHECK_SEMISYNC     0x0017
+#define BLRM_REQUEST_SEMISYNC   0x0018
 
-#define BLRM_MAXSTATE           0x0016
+#define BLRM_MAXSTATE           0x0018
 
 static char *blrm_states[] =
 {
@@ -539,7 +713,7 @@ static char *blrm_states[] =
     "Set Slave UUID", "Set Names latin1", "Set Names utf8", "select 1",
     "select version()", "select @@version_comment", "select @@hostname",
     "select @@max_allowed_packet", "Register slave", "Binlog Dump", "Slave stopped",
-    "Set MariaDB slave capability"
+    "Set MariaDB slave capability", "Check semi-sync", "Request semi-sync"
 };
 
 #define BLRS_CREATED            0x0000
@@ -565,6 +739,7 @@ static char *blrs_states[] =
 #define CS_THRDWAIT             0x0040
 #define CS_BUSY                 0x0100
 #define CS_HOLD                 0x0200
+#define CS_THROTTLED            0x0400
 
 /**
  * MySQL protocol OpCodes needed for replication
@@ -607,12 +782,32 @@ extern int blr_master_connected(ROUTER_INSTANCE *);
 extern int blr_slave_request(ROUTER_INSTANCE *, ROUTER_SLAVE *, GWBUF *);
 extern void blr_slave_rotate(ROUTER_INSTANCE *, ROUTER_SLAVE *, uint8_t *);
 extern int blr_slave_catchup(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, bool large);
+extern void blr_slave_catchup_wakeup(void *);
+extern bool blr_distribute_start(ROUTER_INSTANCE *);
+extern uint64_t blr_slave_bytes_behind(ROUTER_INSTANCE *, ROUTER_SLAVE *);
 extern void blr_init_cache(ROUTER_INSTANCE *);
+extern void blr_free_cache(ROUTER_INSTANCE *);
+extern void blr_cache_add(ROUTER_INSTANCE *, REP_HEADER *, unsigned long, uint32_t, uint8_t *);
+extern GWBUF *blr_cache_get(ROUTER_INSTANCE *, char *, unsigned long, REP_HEADER *);
+extern void blr_cache_truncate(ROUTER_INSTANCE *, char *, unsigned long);
+
+extern void blr_index_open(ROUTER_INSTANCE *, bool);
+extern void blr_index_close(ROUTER_INSTANCE *);
+extern void blr_index_gtid(ROUTER_INSTANCE *, uint32_t, uint32_t, uint64_t, uint32_t);
+extern void blr_index_update(ROUTER_INSTANCE *);
+extern void blr_index_truncate(ROUTER_INSTANCE *, uint64_t);
+extern uint64_t blr_index_checkpoint(ROUTER_INSTANCE *);
+extern bool blr_index_find_gtid(ROUTER_INSTANCE *, uint32_t, uint32_t, uint64_t, char *, uint64_t *);
 
 extern int  blr_file_init(ROUTER_INSTANCE *);
+extern void blr_file_verify_old(ROUTER_INSTANCE *);
 extern int  blr_write_binlog_record(ROUTER_INSTANCE *, REP_HEADER *, uint32_t pos, uint8_t *);
 extern int  blr_file_rotate(ROUTER_INSTANCE *, char *, uint64_t);
 extern void blr_file_flush(ROUTER_INSTANCE *);
+extern bool blr_file_write(ROUTER_INSTANCE *, uint8_t *, uint32_t);
+extern bool blr_file_flush_buffer(ROUTER_INSTANCE *);
+extern bool blr_file_truncate(ROUTER_INSTANCE *, uint64_t);
+extern void blr_file_sync(ROUTER_INSTANCE *);
 extern BLFILE *blr_open_binlog(ROUTER_INSTANCE *, char *);
 extern GWBUF *blr_read_binlog(ROUTER_INSTANCE *, BLFILE *, unsigned long, REP_HEADER *, char *);
 extern void blr_close_binlog(ROUTER_INSTANCE *, BLFILE *);
@@ -621,9 +816,15 @@ extern int blr_statistics(ROUTER_INSTANCE *, ROUTER_SLAVE *, GWBUF *);
 extern int blr_ping(ROUTER_INSTANCE *, ROUTER_SLAVE *, GWBUF *);
 extern int blr_send_custom_error(DCB *, int, int, char *, char *, unsigned int);
 extern int blr_file_next_exists(ROUTER_INSTANCE *, ROUTER_SLAVE *);
+extern bool blr_zfile_compress(ROUTER_INSTANCE *, const char *);
+extern void blr_zfile_compress_async(ROUTER_INSTANCE *, const char *);
+extern BLR_ZFILE *blr_zfile_open(int);
+extern void blr_zfile_close(BLR_ZFILE *);
+extern uint64_t blr_zfile_size(BLR_ZFILE *);
+extern ssize_t blr_zfile_pread(BLR_ZFILE *, void *, size_t, uint64_t);
 uint32_t extract_field(uint8_t *src, int bits);
 void blr_cache_read_master_data(ROUTER_INSTANCE *router);
-int blr_read_events_all_events(ROUTER_INSTANCE *router, int fix, int debug);
+int blr_read_events_all_events(ROUTER_INSTANCE *router, uint64_t start_pos, int fix, int debug);
 int blr_save_dbusers(const ROUTER_INSTANCE *router);
 char    *blr_get_event_description(ROUTER_INSTANCE *router, uint8_t event);
 void blr_file_append(ROUTER_INSTANCE *router, char *file);
@@ -635,6 +836,7 @@ extern bool blr_send_event(blr_thread_role_t role,
                            uint32_t binlog_pos,
                            ROUTER_SLAVE *slave,
                            REP_HEADER *hdr,
-                           uint8_t *buf);
+                           uint8_t *buf,
+                           GWBUF *event);
 
 #endif
@@ -42,6 +42,10 @@
 #define HTTPD_USERAGENT_MAXLEN 1024
 #define HTTPD_FIELD_MAXLEN 8192
 #define HTTPD_REQUESTLINE_MAXLEN 8192
+#define HTTPD_HEADER_MAXLEN 16384       /*< Longest request line and headers */
+#define HTTPD_BODY_MAXLEN 65536         /*< Longest request body */
+#define HTTPD_CHUNK_HEADER_LEN 32       /*< Room for the chunk size line */
+#define HTTPD_OPENMETRICS_CONTENT_TYPE "application/openmetrics-text; version=1.0.0; charset=utf-8"
 
 /**
  * HTTPD session specific data
@@ -58,4 +62,18 @@ typedef struct httpd_session
     char *path_info;                /*< the Pathinfo, starts with /, is the extra path segments after the document name */
     char *query_string;             /*< the Query string, starts with ?, after path_info and document name */
     int headers_received;               /*< All the headers has been received, if 1 */
+    GWBUF *request;                 /*< Buffered data of the requests not yet handled */
+    bool chunked;                   /*< Writes are sent as chunks of the response */
+    int n_requests;                 /*< Requests handled on this connection */
 } HTTPD_session;
+
+/**
+ * A request parsed from the client data
+ */
+typedef struct httpd_request
+{
+    char url[HTTPD_SMALL_BUFFER];   /*< The URL without the query string */
+    long content_length;            /*< Length of the request body */
+    bool http11;                    /*< The request is HTTP/1.1 */
+    bool keep_alive;                /*< The connection stays open after the response */
+} HTTPD_request;
@@ -61,6 +61,7 @@
 #include <version.h>
 #include <housekeeper.h>
 #include <mysql.h>
+#include <modutil.h>
 
 #define GW_MYSQL_VERSION "5.5.5-10.0.0 " MAXSCALE_VERSION "-maxscale"
 #define GW_MYSQL_LOOP_TIMEOUT 300000000
@@ -100,6 +101,7 @@ struct dcb;
 #define MYSQL_FAILED_AUTH_SSL 3
 #define MYSQL_AUTH_SSL_INCOMPLETE 4
 #define MYSQL_AUTH_NO_SESSION 5
+#define MYSQL_AUTH_USERS_WAIT 6 /*< The login waits for the users to be reloaded */
 
 typedef enum
 {
@@ -146,6 +148,8 @@ typedef struct mysql_session
     char db[MYSQL_DATABASE_MAXLEN + 1];             /*< database       */
     int  auth_token_len;                            /*< token length   */
     uint8_t *auth_token;                            /*< token          */
+    struct users_reload_waiter *users_wait;         /*< Waits for the users to be reloaded */
+    bool users_reloaded;                            /*< The login waited for a reload already */
 #if defined(SS_DEBUG)
     skygw_chk_t myses_chk_tail;
 #endif
@@ -212,6 +216,7 @@ typedef enum
     GW_MYSQL_CAPABILITIES_MULTI_RESULTS =          (1 << 17),
     GW_MYSQL_CAPABILITIES_PS_MULTI_RESULTS =       (1 << 18),
     GW_MYSQL_CAPABILITIES_PLUGIN_AUTH =            (1 << 19),
+    GW_MYSQL_CAPABILITIES_SESSION_TRACK =          (1 << 23),
     GW_MYSQL_CAPABILITIES_SSL_VERIFY_SERVER_CERT = (1 << 30),
     GW_MYSQL_CAPABILITIES_REMEMBER_OPTIONS =       (1 << 31),
     GW_MYSQL_CAPABILITIES_CLIENT = (GW_MYSQL_CAPABILITIES_LONG_PASSWORD |
@@ -244,6 +249,8 @@ typedef enum
 typedef enum enum_server_command mysql_server_cmd_t;
 
 static const mysql_server_cmd_t MYSQL_COM_UNDEFINED = (mysql_server_cmd_t) - 1;
+/** COM_RESET_CONNECTION, missing from the command list of older client libraries */
+static const mysql_server_cmd_t MYSQL_COM_RESET = (mysql_server_cmd_t) 0x1f;
 
 /**
  * List of server commands, and number of response packets are stored here.
@@ -258,6 +265,42 @@ typedef struct server_command_st
     struct server_command_st* scom_next;
 } server_command_t;
 
+/** Bytes of the start of a packet the reply tracker needs to classify it */
+#define REPLY_TRACKER_HDR_LEN (MYSQL_HEADER_LEN + 21)
+
+/** Length of the header of a compressed packet */
+#define MYSQL_COMPRESSED_HEADER_LEN 7
+
+/** Server status flags in the OK and EOF packets */
+#define MYSQL_SERVER_STATUS_IN_TRANS        0x0001
+#define MYSQL_SERVER_STATUS_AUTOCOMMIT      0x0002
+#define MYSQL_SERVER_MORE_RESULTS_EXIST     0x0008
+#define MYSQL_SERVER_SESSION_STATE_CHANGED  0x4000
+
+/** Types of the session state changes in an OK packet */
+#define MYSQL_SESSION_TRACK_SYSTEM_VARIABLES 0
+#define MYSQL_SESSION_TRACK_SCHEMA           1
+#define MYSQL_SESSION_TRACK_STATE_CHANGE     2
+
+/**
+ * Incremental tracker of the packet boundaries of a backend reply. It follows
+ * the data as it is read, without the packets having to be complete, and keeps
+ * only the first bytes of the current packet.
+ */
+typedef struct
+{
+    uint8_t  rt_hdr[REPLY_TRACKER_HDR_LEN]; /*< Start of the current packet */
+    uint32_t rt_pos;                /*< Bytes of the current packet seen so far */
+    uint32_t rt_len;                /*< Length of the current packet with the header,
+                                     * 0 while the header is incomplete */
+    int      rt_eofs;               /*< EOF packets seen in the current result set */
+    bool     rt_first;              /*< Next packet starts a result */
+    bool     rt_continued;          /*< Next packet continues a 16MB packet */
+    int      rt_n_complete;         /*< Replies completed by the last tracked data */
+    int      rt_status;             /*< Last server status in the tracked data or -1 */
+    bool     rt_local_infile;       /*< The last tracked data had a LOCAL INFILE request */
+} reply_tracker_t;
+
 /**
  * MySQL Protocol specific state data.
  *
@@ -287,6 +330,27 @@ typedef struct
     unsigned        long tid;                         /*< MySQL Thread ID, in
         * handshake */
     unsigned int    charset;                          /*< MySQL character set at connect time */
+    int             ignore_replies;                   /*< Number of responses to the reset
+        * of a persistent connection that are not routed */
+    reply_tracker_t reply_tracker;                    /*< Packet boundaries of the replies */
+    packet_framer_t framer;                           /*< Packet boundaries of the read queue */
+    bool            large_packet;                     /*< The last packet routed was 0xffffff
+        * bytes, the next one continues the statement */
+    struct qc_offload_job* qc_job;                    /*< The statement being classified by a
+        * classifier thread, the reads are suspended until it is done */
+    GWBUF*          qc_rest;                          /*< The data read after the statement
+        * that is being classified */
+    bool            compress;                         /*< The compressed protocol is in use */
+    uint8_t         compress_seq;                     /*< Sequence number of the next
+        * compressed packet that is written */
+    GWBUF*          compress_readq;                   /*< Incomplete compressed packets */
+    SPINLOCK        compress_lock;                    /*< Keeps compressed writes in order */
+    bool            session_track;                    /*< The server reports the session state
+        * changes in the OK packets */
+    bool            state_tracked;                    /*< The server has reported a state change,
+        * so an OK packet without one did not change the state */
+    bool            state_changed;                    /*< The last reply to a session command
+        * changed the session state or it is not known whether it did */
 #if defined(SS_DEBUG)
     skygw_chk_t     protocol_chk_tail;
 #endif
@@ -384,6 +448,11 @@ int  get_stmt_nresponse_packets(GWBUF* buf, mysql_server_cmd_t cmd);
 bool protocol_get_response_status (MySQLProtocol* p, int* npackets, ssize_t* nbytes);
 void protocol_set_response_status (MySQLProtocol* p, int  npackets, ssize_t  nbytes);
 void protocol_archive_srv_command(MySQLProtocol* p);
+void protocol_reply_tracker_init(reply_tracker_t* t);
+void protocol_track_reply(reply_tracker_t* t, GWBUF* buf);
+uint32_t protocol_reply_tracker_left(reply_tracker_t* t);
+int mysql_dcb_read(DCB* dcb, GWBUF** head, int maxbytes);
+int mysql_dcb_write(DCB* dcb, GWBUF* queue);
 
 char* create_auth_fail_str(char *username, char *hostaddr, char *sha1, char *db, int);
 
@@ -35,14 +35,18 @@ typedef enum
     TOK_MASTER,
     TOK_SLAVE,
     TOK_SERVER,
+    TOK_ALL,
     TOK_EOL
 } TOKEN_VALUE;
 
+/* The maximum length of a token */
+#define HINT_TOKEN_MAXLEN 99
+
 /* The tokenising return type */
 typedef struct
 {
     TOKEN_VALUE token;      // The token itself
-    char        *value;     // The string version of the token
+    char        value[HINT_TOKEN_MAXLEN + 1]; // The string version of the token
 } HINT_TOKEN;
 
 /**
@@ -0,0 +1,51 @@
+#ifndef _QLACAPTURE_H
+#define _QLACAPTURE_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file qlacapture.h The traffic capture format of the qlafilter
+ *
+ * With log_type=capture the qlafilter writes the packets the clients send to
+ * one file that qlareplay can send to a listener again. The file starts with
+ * QLA_CAPTURE_MAGIC and a sequence of records follows it. Each record has a
+ * header of QLA_CAPTURE_HEADER_LEN bytes followed by its data:
+ *
+ * @verbatim
+ * Offset  Size  Field
+ * 0       8     Time in microseconds since the Epoch
+ * 8       8     Session id
+ * 16      1     Record type
+ * 17      4     Length of the data
+ * @endverbatim
+ *
+ * All integers are little-endian. The data of a start record is the user@host
+ * of the client, of a packet record the bytes the client sent as MySQL packets
+ * and an end record has no data. A COM packet can span more than one record.
+ *
+ * The records of a session are written in the order they were queued by each
+ * worker thread. A session that moved to another thread can therefore have
+ * records out of order in the file and a reader should order the records of
+ * each session by their time, keeping the order of the file for equal times.
+ */
+
+#define QLA_CAPTURE_MAGIC      "MXSCAP1\n"
+#define QLA_CAPTURE_MAGIC_LEN  8
+#define QLA_CAPTURE_HEADER_LEN 21
+
+/** Record types */
+#define QLA_CAPTURE_START      1 /*< A session was started */
+#define QLA_CAPTURE_PACKETS    2 /*< Packets sent by the client */
+#define QLA_CAPTURE_END        3 /*< The session was closed */
+
+#endif
@@ -26,6 +26,7 @@
  * @endverbatim
  */
 #include <dcb.h>
+#include <statistics.h>
 
 /**
  * Internal structure used to define the set of backend servers we are routing
@@ -37,8 +38,29 @@ typedef struct backend
     SERVER *server; /*< The server itself */
     int current_connection_count; /*< Number of connections to the server */
     int weight; /*< Desired routing weight */
+    ts_stats_t n_outstanding; /*< Number of sessions waiting for a response */
 } BACKEND;
 
+/** Servers needed before the connections are balanced by comparing two
+ * random servers instead of all servers */
+#define RCR_TWO_CHOICES_MIN 16
+
+/** Number of random picks made to find two eligible servers */
+#define RCR_TWO_CHOICES_TRIES 8
+
+/** What the server of a session is chosen by with consistent hashing */
+typedef enum
+{
+    RCR_HASH_NONE,     /*< Balance by load */
+    RCR_HASH_USER,     /*< The user name of the client */
+    RCR_HASH_DATABASE, /*< The default database of the client */
+    RCR_HASH_CLIENT    /*< The address of the client */
+} rcr_hash_t;
+
+/** How many times the average load of its weight a server may get with
+ * consistent hashing before the sessions go to the next server */
+#define RCR_HASH_LOAD_FACTOR 1.25
+
 /**
  * The client session structure used within this router.
  */
@@ -50,11 +72,16 @@ typedef struct router_client_session
     SPINLOCK rses_lock; /*< protects rses_deleted              */
     int rses_versno; /*< even = no active update, else odd  */
     bool rses_closed; /*< true when closeSession is called   */
+    bool rses_confined; /*< only the owning thread uses the session, rses_lock is not taken */
     BACKEND *backend; /*< Backend used by the client session */
     DCB *backend_dcb; /*< DCB Connection to the backend      */
     DCB *client_dcb; /**< Client DCB */
     struct router_client_session *next;
     int rses_capabilities; /*< input type, for example */
+    bool pinned; /*< The session state ties it to its backend connection */
+    bool trx_active; /*< The backend is in a transaction or has autocommit off */
+    int n_pending; /*< Number of routed queries without a complete response */
+    uint64_t query_start; /*< When the oldest query without a response was sent */
 #if defined(SS_DEBUG)
     skygw_chk_t rses_chk_tail;
 #endif
@@ -65,8 +92,10 @@ typedef struct router_client_session
  */
 typedef struct
 {
-    int n_sessions; /*< Number sessions created     */
-    int n_queries; /*< Number of queries forwarded */
+    ts_stats_t n_sessions; /*< Number sessions created     */
+    ts_stats_t n_queries;  /*< Number of queries forwarded */
+    ts_stats_t n_released; /*< Backend connections returned to the pool */
+    ts_stats_t n_acquired; /*< Backend connections taken for a query */
 } ROUTER_STATS;
 
 /**
@@ -78,9 +107,13 @@ typedef struct router_instance
     ROUTER_CLIENT_SES *connections; /*< Link list of all the client connections  */
     SPINLOCK lock; /*< Spinlock for the instance data           */
     BACKEND **servers; /*< List of backend servers                  */
+    int n_servers; /*< Number of backend servers                */
     unsigned int bitmask; /*< Bitmask to apply to server->status       */
     unsigned int bitvalue; /*< Required value of server->status         */
     ROUTER_STATS stats; /*< Statistics for this router               */
+    bool multiplex; /*< Share idle backend connections between sessions */
+    bool least_queries; /*< Balance by outstanding queries instead of connections */
+    rcr_hash_t hash; /*< What sessions are hashed by, if anything */
     struct router_instance
         *next;
 } ROUTER_INSTANCE;
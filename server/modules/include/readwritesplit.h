@@ -25,7 +25,10 @@
  */
 
 #include <dcb.h>
+#include <statistics.h>
 #include <hashtable.h>
+#include <flatmap.h>
+#include <maxscale/poll.h>
 #include <math.h>
 
 #undef PREP_STMT_CACHING
@@ -116,10 +119,14 @@ typedef enum select_criteria
     LEAST_ROUTER_CONNECTIONS,   /*< connections established by this router */
     LEAST_BEHIND_MASTER,
     LEAST_CURRENT_OPERATIONS,
-    DEFAULT_CRITERIA   = LEAST_CURRENT_OPERATIONS,
-    LAST_CRITERIA               /*< not used except for an index */
+    LEAST_RESPONSE_TIME,        /*< the better of two slaves by average response time */
+    LAST_CRITERIA,              /*< not used except for an index */
+    DEFAULT_CRITERIA   = LEAST_CURRENT_OPERATIONS
 } select_criteria_t;
 
+/** Weight of a new sample in the average response time of a server */
+#define RW_RESPONSE_TIME_ALPHA 0.1
+
 
 /** default values for rwsplit configuration parameters */
 #define CONFIG_MAX_SLAVE_CONN 1
@@ -134,7 +141,9 @@ typedef enum select_criteria
         strncmp(s,"LEAST_ROUTER_CONNECTIONS", strlen("LEAST_ROUTER_CONNECTIONS")) == 0 ?        \
         LEAST_ROUTER_CONNECTIONS : (                                                            \
         strncmp(s,"LEAST_CURRENT_OPERATIONS", strlen("LEAST_CURRENT_OPERATIONS")) == 0 ?        \
-        LEAST_CURRENT_OPERATIONS : UNDEFINED_CRITERIA))))
+        LEAST_CURRENT_OPERATIONS : (                                                            \
+        strncmp(s,"LEAST_RESPONSE_TIME", strlen("LEAST_RESPONSE_TIME")) == 0 ?                  \
+        LEAST_RESPONSE_TIME : UNDEFINED_CRITERIA)))))
 
 /**
  * Session variable command
@@ -152,6 +161,11 @@ typedef struct mysql_sescmd_st
                                    *  LOCAL_INFILE. Slave servers are compared to this
                                    *  when they return session command replies.*/
     int      position; /*< Position of this command */
+    char*              my_sescmd_key; /*< The session state this command sets or NULL. A later
+                                       *  command with the same key supersedes this one. */
+    SESSION*           my_sescmd_session; /*< The session the buffer is charged to */
+    bool               my_sescmd_noop; /*< The master reported that the command did not
+                                        *  change the session state */
 #if defined(SS_DEBUG)
     skygw_chk_t        my_sescmd_chk_tail;
 #endif
@@ -172,7 +186,7 @@ struct rses_property_st
     union rses_prop_data
     {
         mysql_sescmd_t   sescmd;
-        HASHTABLE*       temp_tables;
+        FLATMAP*         temp_tables;
     } rses_prop_data;
     rses_property_t*     rses_prop_next; /*< next property of same type */
 #if defined(SS_DEBUG)
@@ -211,11 +225,97 @@ typedef struct backend_st
     int             backend_conn_count;  /*< Number of connections to the server */
     bool            be_valid; /*< Valid when belongs to the router's configuration */
     int             weight; /*< Desired weighting on the load. Expressed in .1% increments */
+    double          response_time; /*< Moving average of the response time in seconds.
+                                    * Updated without locking, a lost sample is harmless. */
+    int64_t         hedge_delay; /*< Milliseconds after which a read is hedged, -1 if the
+                                  * latency is not known. Updated without locking. */
+    uint64_t        hedge_delay_updated; /*< When hedge_delay was calculated, in microseconds */
 #if defined(SS_DEBUG)
     skygw_chk_t     be_chk_tail;
 #endif
 } BACKEND;
 
+/** Maximum length of a GTID position stored for causal reads */
+#define RW_GTID_MAX_LEN 256
+
+/** Default number of seconds a slave is waited to catch up with a write */
+#define RW_CAUSAL_READS_DEFAULT_TIMEOUT 10
+
+/** Default maximum percentage of the slave reads that are hedged */
+#define RW_HEDGE_DEFAULT_BUDGET 5
+
+/** Reads a slave must have served before its latency is used as the hedge delay */
+#define RW_HEDGE_MIN_SAMPLES 100
+
+/** Microseconds between the calculations of the hedge delay of a slave */
+#define RW_HEDGE_DELAY_REFRESH 1000000
+
+/**
+ * Internal queries whose replies are consumed by the router
+ */
+typedef enum bref_internal
+{
+    BREF_INTERNAL_NONE,      /*< No internal query is active */
+    BREF_INTERNAL_GTID_POS,  /*< Reading the GTID position of the master */
+    BREF_INTERNAL_GTID_WAIT, /*< Waiting for a slave to reach a GTID position */
+    BREF_INTERNAL_PS_PREPARE /*< Preparing a statement before its first execution */
+} bref_internal_t;
+
+/**
+ * A prepared statement of the binary protocol. The client knows the statement
+ * by the ID that the backend it was first prepared on gave. The other backends
+ * prepare it when it is first executed on them and give IDs of their own.
+ *
+ * Owned by router client session.
+ */
+typedef struct rwsplit_ps
+{
+    uint32_t           ps_client_id;   /*< The ID the client uses for the statement */
+    bool               ps_read_only;   /*< Executions can be routed to slaves */
+    GWBUF*             ps_prepare;     /*< The COM_STMT_PREPARE packet */
+    int64_t*           ps_backend_ids; /*< IDs by backend reference, -1 if not prepared */
+    uint16_t           ps_n_params;    /*< Number of parameters of the statement */
+    uint8_t*           ps_param_types; /*< The parameter types the client last sent, or NULL */
+    bool*              ps_types_sent;  /*< By backend reference, the backend has the types */
+    int                ps_exec_backend; /*< Backend reference of the last execution, -1 if none */
+    struct rwsplit_ps* ps_next;        /*< The next statement of the session */
+} rwsplit_ps_t;
+
+/**
+ * A read-only multi-statement batch whose statements are executed on the
+ * slaves in parallel. The results are returned to the client in the order of
+ * the statements, as if one server had executed the whole batch.
+ *
+ * Owned by router client session.
+ */
+typedef struct rwsplit_mstmt
+{
+    int                     ms_n_stmts;   /*< Number of statements */
+    GWBUF**                 ms_stmts;     /*< The statements, NULL once sent */
+    GWBUF**                 ms_results;   /*< The results of the statements */
+    bool*                   ms_done;      /*< Whether a result is complete */
+    struct backend_ref_st** ms_brefs;     /*< The backend executing each statement */
+    int                     ms_n_pending; /*< Number of results that are not complete */
+    int                     ms_next;      /*< The next result to return to the client */
+    uint8_t                 ms_seq;       /*< Sequence number of the next packet to the client */
+    bool                    ms_discard;   /*< An error was returned, the rest is discarded */
+} rwsplit_mstmt_t;
+
+/**
+ * A read that is sent to a second slave if the first one has not started to
+ * reply when the timer expires. The slave that replies first returns the
+ * result to the client and the reply of the other one is discarded.
+ *
+ * Owned by router client session.
+ */
+typedef struct rwsplit_hedge
+{
+    POLL_TIMER              h_timer;     /*< Sends the read to the second slave */
+    GWBUF*                  h_query;     /*< The read, NULL when no read is hedged */
+    struct backend_ref_st*  h_primary;   /*< The slave the read was sent to first */
+    struct backend_ref_st*  h_secondary; /*< The second slave, NULL until the read is sent to it */
+} rwsplit_hedge_t;
+
 /**
  * Reference to BACKEND.
  *
@@ -232,8 +332,31 @@ typedef struct backend_ref_st
     int             bref_num_result_wait;
     sescmd_cursor_t bref_sescmd_cur;
     GWBUF*          bref_pending_cmd; /**< For stmt which can't be routed due active sescmd execution */
+    uint64_t        bref_query_start; /**< When the active query was sent, in microseconds */
+    service_latency_t bref_query_type; /**< Query type of the active query */
     unsigned char   reply_cmd;  /**< The reply the backend server sent to a session command.
                                  * Used to detect slaves that fail to execute session command. */
+    bool            bref_gtid_after_reply; /**< Read the GTID position when the reply arrives */
+    bref_internal_t bref_internal; /**< The internal query whose reply is being read */
+    int             bref_internal_eofs; /**< EOF packets read from the internal reply */
+    char            bref_internal_value[RW_GTID_MAX_LEN]; /**< Value read from the internal reply */
+    GWBUF*          bref_causal_query; /**< Query waiting for the slave to catch up */
+    char            bref_wait_gtid[RW_GTID_MAX_LEN]; /**< The position being waited for */
+    char            bref_gtid[RW_GTID_MAX_LEN]; /**< Position the slave is known to have reached */
+    int             bref_internal_eofs_expected; /**< EOF packets expected in a prepare reply,
+                                                  * -1 until the first packet is read */
+    rwsplit_ps_t*   bref_internal_ps; /**< The statement being prepared internally */
+    GWBUF*          bref_ps_exec; /**< Execution waiting for its statement to be prepared */
+    rwsplit_ps_t*   bref_ps_prepare; /**< Statement whose prepare reply goes to the client */
+    bool            bref_mstmt_active; /**< Executing a statement of a multi-statement batch */
+    int             bref_mstmt_stmt; /**< The statement of the batch being executed */
+    int             bref_mstmt_packets; /**< Packets read from the reply to the statement */
+    int             bref_mstmt_eofs; /**< EOF packets read from the reply to the statement */
+    bool            bref_hedge_drain; /**< Discarding the reply to a read that the other slave
+                                       * of a hedge answered first */
+    bool            bref_hedge_next; /**< A query was sent while the reply was being discarded */
+    int             bref_hedge_packets; /**< Packets read from the discarded reply */
+    int             bref_hedge_eofs; /**< EOF packets read from the discarded reply */
 #if defined(SS_DEBUG)
     skygw_chk_t     bref_chk_tail;
 #endif
@@ -261,13 +384,38 @@ typedef struct rwsplit_config_st
                                                 * to master or all nodes */
     int               rw_max_sescmd_history_size; /**< Maximum amount of session commands to store */
     bool              rw_disable_sescmd_hist; /**< Disable session command history */
+    bool              rw_compact_sescmd_hist; /**< Remove superseded session commands */
+    bool              rw_pipeline_sescmd; /**< Don't wait for slaves that execute session commands */
+    bool              rw_lazy_sescmd; /**< Execute session commands on a slave when it is next used */
+    bool              rw_route_read_only_trx; /**< Route read-only transactions to a slave */
+    bool              rw_route_prepared_reads; /**< Execute read-only prepared statements on slaves */
+    bool              rw_split_multi_stmt; /**< Execute read-only multi-statement batches on
+                                            * the slaves in parallel */
     bool              rw_master_reads; /**< Use master for reads */
     bool              rw_strict_multi_stmt; /**< Force non-multistatement queries to be routed
                                              * to the master after a multistatement query. */
     enum failure_mode rw_master_failure_mode; /**< Master server failure handling mode.
                                                * @see enum failure_mode */
+    bool              rw_causal_reads; /**< Read from slaves that have caught up with the writes */
+    int               rw_causal_reads_timeout; /**< Seconds to wait for a slave to catch up */
+    bool              rw_hedged_reads; /**< Send slow reads to a second slave */
+    int               rw_hedge_delay; /**< Milliseconds before a read is hedged, 0 to use the
+                                       * 95th percentile of the read latency of the slave */
+    int               rw_hedge_budget; /**< Maximum percentage of the slave reads that are hedged */
+    bool              rw_lazy_connect; /**< Connect to the slaves when the reads need them */
 } rwsplit_config_t;
 
+/**
+ * A published version of the router configuration. A version is never
+ * modified, a new one replaces it and the old one is retired with dcb_retire
+ * so that the sessions can read it without locking.
+ */
+typedef struct rwsplit_config_version_st
+{
+    rwsplit_config_t config;
+    int              version; /**< The service configuration version it was read from */
+} rwsplit_config_version_t;
+
 #if defined(PREP_STMT_CACHING)
 
 typedef struct prep_stmt_st
@@ -301,20 +449,35 @@ struct router_client_session
     SPINLOCK         rses_lock;      /*< protects rses_deleted */
     int              rses_versno;    /*< even = no active update, else odd. not used 4/14 */
     bool             rses_closed;    /*< true when closeSession is called */
+    bool             rses_confined;  /*< only the owning thread uses the session, rses_lock is not taken */
     rses_property_t* rses_properties[RSES_PROP_TYPE_COUNT]; /*< Properties listed by their type */
     backend_ref_t*   rses_master_ref;
     backend_ref_t*   rses_backend_ref; /*< Pointer to backend reference array */
     rwsplit_config_t rses_config;    /*< copied config info from router instance */
+    int              rses_config_version; /*< service config version of rses_config */
     int              rses_nbackends;
     int              rses_nsescmd;  /*< Number of executed session commands */
+    bool             rses_sescmd_noop; /*< The history has commands that changed nothing */
     bool             rses_autocommit_enabled;
     bool             rses_transaction_active;
     bool             rses_load_active; /*< If LOAD DATA LOCAL INFILE is being currently executed */
     bool             have_tmp_tables;
     uint64_t         rses_load_data_sent; /*< How much data has been sent */
+    bool             rses_large_query; /*< The last packet was 0xffffff bytes, the next one
+                                        * continues the same statement */
+    backend_ref_t    *rses_stream_target; /*< The backend that gets the rest of a large statement
+                                           * or the file of a LOAD DATA LOCAL INFILE */
     DCB*             client_dcb;
     int              pos_generator;
     backend_ref_t    *forced_node; /*< Current server where all queries should be sent */
+    char             rses_gtid[RW_GTID_MAX_LEN]; /*< GTID position after the last write */
+    bool             rses_gtid_pending; /*< The position after the last write is not yet known */
+    bool             rses_trx_read_only; /*< A read-only transaction is active */
+    backend_ref_t    *rses_trx_target; /*< The backend running the read-only transaction */
+    rwsplit_ps_t     *rses_ps;     /*< Prepared statements of the session */
+    FLATMAP          *rses_ps_map; /*< The prepared statements by the client's ID */
+    rwsplit_mstmt_t  *rses_mstmt;  /*< The multi-statement batch being executed */
+    rwsplit_hedge_t  rses_hedge;   /*< The read that is hedged */
 #if defined(PREP_STMT_CACHING)
     HASHTABLE*       rses_prep_stmt[2];
 #endif
@@ -325,16 +488,24 @@ struct router_client_session
 #endif
 } ;
 
+/** The session is locked or only the thread that owns it uses it */
+#define RSES_IS_LOCKED(r) ((r)->rses_confined || SPINLOCK_IS_LOCKED(&(r)->rses_lock))
+
 /**
  * The statistics for this router instance
  */
 typedef struct
 {
-    int     n_sessions; /*< Number sessions created */
-    int     n_queries;  /*< Number of queries forwarded */
-    int     n_master;   /*< Number of stmts sent to master */
-    int     n_slave;    /*< Number of stmts sent to slave */
-    int     n_all;      /*< Number of stmts sent to all */
+    ts_stats_t n_sessions; /*< Number sessions created */
+    ts_stats_t n_queries;  /*< Number of queries forwarded */
+    ts_stats_t n_master;   /*< Number of stmts sent to master */
+    ts_stats_t n_slave;    /*< Number of stmts sent to slave */
+    ts_stats_t n_all;      /*< Number of stmts sent to all */
+    ts_stats_t n_causal_waits;    /*< Number of waits for a slave to catch up */
+    ts_stats_t n_causal_timeouts; /*< Number of waits that timed out */
+    ts_stats_t n_hedges;          /*< Number of reads sent to a second slave */
+    ts_stats_t n_hedge_wins;      /*< Number of hedged reads the second slave answered first */
+    ts_stats_t n_sescmd_noop;     /*< Number of session commands that changed nothing */
 } ROUTER_STATS;
 
 /**
@@ -349,6 +520,7 @@ typedef struct router_instance
     BACKEND*                master;      /*< NULL or pointer */
     rwsplit_config_t        rwsplit_config; /*< expanded config info from SERVICE */
     int                     rwsplit_version; /*< version number for router's config */
+    rwsplit_config_version_t* rwsplit_published; /*< The config that the sessions pick up */
     ROUTER_STATS            stats;       /*< Statistics for this router */
     struct router_instance* next;        /*< Next router on the list */
     bool                    available_slaves; /*< The router has some slaves avialable */
@@ -29,6 +29,7 @@
 
 #include <dcb.h>
 #include <hashtable.h>
+#include <thread.h>
 #include <mysql_client_server_protocol.h>
 #include <pcre2.h>
 /**
@@ -60,7 +61,9 @@ enum shard_map_state
 };
 
 /**
- * A map of the shards tied to a single user.
+ * A map of the shards tied to a single user or, with shared_map, the map of the
+ * router. The shared map is not modified once it is published, a refresh
+ * replaces it with a new version and the old one is freed by its last session.
  */
 typedef struct shard_map
 {
@@ -69,6 +72,8 @@ typedef struct shard_map
     SPINLOCK lock;
     time_t last_updated;
     enum shard_map_state state; /*< State of the shard map */
+    int refcount; /*< References to a shared map */
+    unsigned long version; /*< Version of a shared map */
 } shard_map_t;
 
 /**
@@ -94,6 +99,8 @@ typedef enum bref_state
 #define SCHEMA_ERRSTR_DUPLICATEDB "DUPDB"
 #define SCHEMA_ERR_DBNOTFOUND 1049
 #define SCHEMA_ERRSTR_DBNOTFOUND "42000"
+#define SCHEMA_ERR_SCATTER 1235
+#define SCHEMA_ERRSTR_SCATTER "42000"
 /**
  * The type of the backend server
  */
@@ -129,6 +136,19 @@ typedef enum
 
 typedef struct rses_property_st rses_property_t;
 typedef struct router_client_session ROUTER_CLIENT_SES;
+typedef struct shard_gather SHARD_GATHER;
+typedef struct shard_table_rule SHARD_TABLE_RULE;
+
+/**
+ * How a query is routed by the sharding key of its table
+ */
+typedef enum shard_table_route
+{
+    SHARD_TABLE_NONE,   /*< The query has no sharded tables */
+    SHARD_TABLE_SERVER, /*< The key of the query belongs to one server */
+    SHARD_TABLE_ALL,    /*< The query has no key */
+    SHARD_TABLE_ERROR   /*< No server has the key or the rows of an INSERT are on several servers */
+} shard_table_route_t;
 
 /**
  * Router session properties
@@ -267,6 +287,8 @@ typedef struct backend_ref_st
     int             bref_num_result_wait; /*< Number of not yet received results */
     sescmd_cursor_t bref_sescmd_cur; /*< Session command cursor */
     GWBUF*          bref_pending_cmd; /*< For stmt which can't be routed due active sescmd execution */
+    time_t          bref_last_used; /*< When a query was last routed to the backend */
+    int             bref_gather_shard; /*< Index of the backend in the gathered query, -1 if none */
 #if defined(SS_DEBUG)
     skygw_chk_t     bref_chk_tail;
 #endif
@@ -285,6 +307,9 @@ typedef struct schemarouter_config_st
     time_t last_refresh; /*< Last time the database list was refreshed */
     double refresh_min_interval; /*< Minimum required interval between refreshes of databases */
     bool refresh_databases; /*< Are databases refreshed when they are not found in the hashtable */
+    bool shared_map; /*< Use the shard map of the router that is refreshed in the background */
+    bool lazy_connect; /*< Connect to a shard when it is first used */
+    double idle_timeout; /*< Seconds after which an idle lazy connection is closed, 0 to never close */
     bool debug; /*< Enable verbose debug messages to clients */
 } schemarouter_config_t;
 
@@ -304,6 +329,13 @@ typedef struct
     double          ses_average; /*< Average session length */
     int             shmap_cache_hit; /*< Shard map was found from the cache */
     int             shmap_cache_miss;/*< No shard map found from the cache */
+    int             shmap_refresh; /*< Number of refreshes of the shared shard map */
+    int             shmap_refresh_failed; /*< Number of failed refreshes of the shared shard map */
+    int             n_lazy_connect; /*< Number of connections opened on first use */
+    int             n_idle_closed; /*< Number of idle connections that were closed */
+    int             n_scatter; /*< Number of queries sent to all shards */
+    int             n_scatter_rejected; /*< Number of queries to all shards that could not be merged */
+    int             n_shard_key; /*< Number of queries routed by the sharding key of a table */
 } ROUTER_STATS;
 
 /**
@@ -317,6 +349,7 @@ struct router_client_session
     SPINLOCK         rses_lock;      /*< protects rses_deleted                 */
     int              rses_versno;    /*< even = no active update, else odd. not used 4/14 */
     bool             rses_closed;    /*< true when closeSession is called      */
+    bool             rses_confined;  /*< only the owning thread uses the session, rses_lock is not taken */
     DCB*             rses_client_dcb;
     MYSQL_session*   rses_mysql_session; /*< Session client data (username, password, SHA1). */
     /** Properties listed by their type */
@@ -331,10 +364,13 @@ struct router_client_session
     struct router_client_session* next; /*< List of router sessions */
     shard_map_t*
     shardmap; /*< Database hash containing names of the databases mapped to the servers that contain them */
+    bool            shardmap_shared; /*< shardmap is a reference to the shared map of the router */
+    bool            refresh_on_reply; /*< Refresh the shared map once the reply to a DDL arrives */
     char            connect_db[MYSQL_DATABASE_MAXLEN + 1]; /*< Database the user was trying to connect to */
     char            current_db[MYSQL_DATABASE_MAXLEN + 1]; /*< Current active database */
     init_mask_t    init; /*< Initialization state bitmask */
     GWBUF*          queue; /*< Query that was received before the session was ready */
+    SHARD_GATHER*   gather; /*< Query whose results are being merged from all shards */
     DCB*            dcb_route; /*< Internal DCB used to trigger re-routing of buffers */
     DCB*            dcb_reply; /*< Internal DCB used to send replies to the client */
     ROUTER_STATS    stats;     /*< Statistics for this router         */
@@ -345,6 +381,9 @@ struct router_client_session
 #endif
 };
 
+/** The session is locked or only the thread that owns it uses it */
+#define RSES_IS_LOCKED(r) ((r)->rses_confined || SPINLOCK_IS_LOCKED(&(r)->rses_lock))
+
 
 /**
  * The per instance data for the router.
@@ -352,6 +391,10 @@ struct router_client_session
 typedef struct router_instance
 {
     HASHTABLE*              shard_maps;  /*< Shard maps hashed by user name */
+    shard_map_t*            shared_map;  /*< The latest version of the shared shard map */
+    unsigned long           shared_map_version; /*< Version of the last shared map */
+    int                     shared_map_refresh; /*< A refresh of the shared map was requested */
+    THREAD                  shared_map_thread; /*< Thread that refreshes the shared map */
     SERVICE*                service;     /*< Pointer to service                 */
     ROUTER_CLIENT_SES*      connections; /*< List of client connections         */
     SPINLOCK                lock;        /*< Lock for the instance data         */
@@ -371,9 +414,30 @@ typedef struct router_instance
                                            * not cause the session to be terminated
                                            * if they are found on more than one server. */
     pcre2_match_data*             ignore_match_data;
+    SHARD_TABLE_RULE*       table_rules; /*< Tables sharded by the value of a column */
 
 } ROUTER_INSTANCE;
 
+SHARD_GATHER* gather_create(GWBUF* query, int nshards, GWBUF** shard_query, const char** err);
+GWBUF* gather_reply(SHARD_GATHER* gather, int shard, GWBUF* reply);
+GWBUF* gather_shard_failed(SHARD_GATHER* gather, int shard, GWBUF* error);
+bool gather_shard_done(SHARD_GATHER* gather, int shard);
+bool gather_done(SHARD_GATHER* gather);
+void gather_free(SHARD_GATHER* gather);
+
+bool sql_is_keyword(const char* ptr, const char* end, const char* word);
+const char* sql_skip_quoted(const char* ptr, const char* end);
+const char* sql_skip_space(const char* ptr, const char* end);
+
+bool shard_table_add_rule(SHARD_TABLE_RULE** rules, const char* value, const char* service);
+bool shard_table_init(SHARD_TABLE_RULE* rules, BACKEND** servers, HASHTABLE* ignored_dbs,
+                      const char* service);
+bool shard_table_has_server(SHARD_TABLE_RULE* rule, const char* name);
+SHARD_TABLE_RULE* shard_table_find(SHARD_TABLE_RULE* rules, GWBUF* query, const char* current_db);
+shard_table_route_t shard_table_route(SHARD_TABLE_RULE* rules, GWBUF* query, const char* current_db,
+                                      SHARD_TABLE_RULE** rule, const char** server, const char** err);
+void shard_table_free(SHARD_TABLE_RULE* rules);
+
 #define BACKEND_TYPE(b) (SERVER_IS_MASTER((b)->backend_server) ? BE_MASTER :    \
         (SERVER_IS_SLAVE((b)->backend_server) ? BE_SLAVE :  BE_UNDEFINED));
 
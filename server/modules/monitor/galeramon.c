@@ -37,13 +37,21 @@
 #include <galeramon.h>
 #include <dcb.h>
 
-static void monitorMain(void *);
+static void monitorRound(MONITOR *);
 
 static char *version_str = "V2.0.0";
 
 /** Log a warning when a bad 'wsrep_local_index' is found */
 static bool warn_erange_on_local_index = true;
 
+/** The status variables of a node that are read in each round */
+#define GALERA_STATUS_QUERY "SHOW STATUS WHERE Variable_name IN ('wsrep_local_state', " \
+    "'wsrep_local_index', 'wsrep_local_recv_queue_avg', 'wsrep_flow_control_paused', " \
+    "'wsrep_cert_deps_distance')"
+
+/** The load weight of a node is never lowered below this */
+#define GALERA_MIN_LOAD_WEIGHT 10
+
 /* @see function load_module in load_utils.c for explanation of the following
  * lint directives.
  */
@@ -219,7 +227,10 @@ startMonitor(void *arg, void* opt)
         memset(handle->events, true, sizeof(handle->events));
     }
 
-    if (thread_start(&handle->thread, monitorMain, mon) == NULL)
+    handle->log_no_members = true;
+    handle->status = MONITOR_RUNNING;
+
+    if (!mon_schedule_rounds(mon, monitorRound))
     {
         MXS_ERROR("Failed to start monitor thread for monitor '%s'.", mon->name);
     }
@@ -239,7 +250,8 @@ stopMonitor(void *arg)
     GALERA_MONITOR *handle = (GALERA_MONITOR *) mon->handle;
 
     handle->shutdown = 1;
-    thread_wait(handle->thread);
+    mon_unschedule_rounds(mon);
+    handle->status = MONITOR_STOPPED;
 }
 
 /**
@@ -290,6 +302,31 @@ diagnostics(DCB *dcb, void *arg)
     dcb_printf(dcb, "\n");
 }
 
+/**
+ * Calculate the share of the normal load that a Galera node can take
+ *
+ * A node with a long receive queue is behind in applying the write sets, and
+ * flow control pauses the replication while nodes catch up. The receive queue
+ * is divided by the certification dependency distance, which tells how many
+ * write sets can be applied in parallel, so that the queue is measured in the
+ * time it takes to apply it rather than in write sets.
+ *
+ * @param recv_queue_avg     Value of wsrep_local_recv_queue_avg
+ * @param fc_paused          Value of wsrep_flow_control_paused
+ * @param cert_deps_distance Value of wsrep_cert_deps_distance
+ * @return The load weight, between GALERA_MIN_LOAD_WEIGHT and SERVER_FULL_LOAD_WEIGHT
+ */
+static int
+galera_load_weight(double recv_queue_avg, double fc_paused, double cert_deps_distance)
+{
+    double parallel = cert_deps_distance > 1.0 ? cert_deps_distance : 1.0;
+    double backlog = recv_queue_avg > 0.0 ? recv_queue_avg / parallel : 0.0;
+    double running = fc_paused < 0.0 ? 1.0 : fc_paused > 1.0 ? 0.0 : 1.0 - fc_paused;
+    int weight = (int)(SERVER_FULL_LOAD_WEIGHT * running / (1.0 + backlog));
+
+    return weight < GALERA_MIN_LOAD_WEIGHT ? GALERA_MIN_LOAD_WEIGHT : weight;
+}
+
 /**
  * Monitor an individual server. Does not deal with the setting of master or
  * slave bits, except for clearing them when a server is not joined to the
@@ -356,94 +393,115 @@ monitorDatabase(MONITOR *mon, MONITOR_SERVERS *database)
         server_set_version_string(database->server, server_string);
     }
 
-    /* Check if the the Galera FSM shows this node is joined to the cluster */
-    if (mysql_query(database->con, "SHOW STATUS LIKE 'wsrep_local_state'") == 0
+    /* Read the Galera state and load of the node with one query */
+    long local_state = -1;
+    long local_index = -1;
+    double recv_queue_avg = 0.0;
+    double fc_paused = 0.0;
+    double cert_deps_distance = 0.0;
+    bool have_load = false;
+
+    if (mysql_query(database->con, GALERA_STATUS_QUERY) == 0
         && (result = mysql_store_result(database->con)) != NULL)
     {
         if (mysql_field_count(database->con) < 2)
         {
             mysql_free_result(result);
-            MXS_ERROR("Unexpected result for \"SHOW STATUS LIKE 'wsrep_local_state'\". "
-                      "Expected 2 columns. MySQL Version: %s", version_str);
+            MXS_ERROR("Unexpected result for \"%s\". Expected 2 columns. MySQL Version: %s",
+                      GALERA_STATUS_QUERY, version_str);
             return;
         }
 
         while ((row = mysql_fetch_row(result)))
         {
-            if (strcmp(row[1], "4") == 0)
+            if (strcasecmp(row[0], "wsrep_local_state") == 0)
             {
-                isjoined = 1;
+                local_state = strtol(row[1], NULL, 10);
             }
-
-            /* Check if the node is a donor and is using xtrabackup, in this case it can stay alive */
-            else if (strcmp(row[1], "2") == 0 && handle->availableWhenDonor == 1)
+            else if (strcasecmp(row[0], "wsrep_local_index") == 0)
             {
-                if (mysql_query(database->con, "SHOW VARIABLES LIKE 'wsrep_sst_method'") == 0
-                    && (result2 = mysql_store_result(database->con)) != NULL)
+                char* endchar;
+                errno = 0;
+                local_index = strtol(row[1], &endchar, 10);
+                if (*endchar != '\0' ||
+                    (errno == ERANGE && (local_index == LONG_MAX || local_index == LONG_MIN)))
                 {
-                    if (mysql_field_count(database->con) < 2)
-                    {
-                        mysql_free_result(result);
-                        mysql_free_result(result2);
-                        MXS_ERROR("Unexpected result for \"SHOW VARIABLES LIKE "
-                                  "'wsrep_sst_method'\". Expected 2 columns."
-                                  " MySQL Version: %s", version_str);
-                        return;
-                    }
-                    while ((row = mysql_fetch_row(result2)))
+                    /** TODO: Create a mechanism to log warnings on a per server basis */
+                    if (warn_erange_on_local_index)
                     {
-                        if (strncmp(row[1], "xtrabackup", 10) == 0)
-                        {
-                            isjoined = 1;
-                        }
+                        MXS_WARNING("Invalid 'wsrep_local_index' on server '%s': %s",
+                                    database->server->unique_name, row[1]);
+                        warn_erange_on_local_index = false;
                     }
-                    mysql_free_result(result2);
+                    local_index = -1;
                 }
             }
+            else if (strcasecmp(row[0], "wsrep_local_recv_queue_avg") == 0)
+            {
+                recv_queue_avg = strtod(row[1], NULL);
+                have_load = true;
+            }
+            else if (strcasecmp(row[0], "wsrep_flow_control_paused") == 0)
+            {
+                fc_paused = strtod(row[1], NULL);
+                have_load = true;
+            }
+            else if (strcasecmp(row[0], "wsrep_cert_deps_distance") == 0)
+            {
+                cert_deps_distance = strtod(row[1], NULL);
+            }
         }
         mysql_free_result(result);
     }
 
-    if (isjoined)
+    /* Check if the the Galera FSM shows this node is joined to the cluster */
+    if (local_state == 4)
+    {
+        isjoined = 1;
+    }
+    /* Check if the node is a donor and is using xtrabackup, in this case it can stay alive */
+    else if (local_state == 2 && handle->availableWhenDonor == 1)
     {
-        /* Check the the Galera node index in the cluster */
-        if (mysql_query(database->con, "SHOW STATUS LIKE 'wsrep_local_index'") == 0
-            && (result = mysql_store_result(database->con)) != NULL)
+        if (mysql_query(database->con, "SHOW VARIABLES LIKE 'wsrep_sst_method'") == 0
+            && (result2 = mysql_store_result(database->con)) != NULL)
         {
             if (mysql_field_count(database->con) < 2)
             {
-                mysql_free_result(result);
-                MXS_ERROR("Unexpected result for \"SHOW STATUS LIKE 'wsrep_local_index'\". "
-                          "Expected 2 columns. MySQL Version: %s", version_str);
+                mysql_free_result(result2);
+                MXS_ERROR("Unexpected result for \"SHOW VARIABLES LIKE "
+                          "'wsrep_sst_method'\". Expected 2 columns."
+                          " MySQL Version: %s", version_str);
                 return;
             }
-
-            while ((row = mysql_fetch_row(result)))
+            while ((row = mysql_fetch_row(result2)))
             {
-                char* endchar;
-                long local_index = strtol(row[1], &endchar, 10);
-                if (*endchar != '\0' ||
-                    (errno == ERANGE && (local_index == LONG_MAX || local_index == LONG_MIN)))
+                if (strncmp(row[1], "xtrabackup", 10) == 0)
                 {
-                    /** TODO: Create a mechanism to log warnings on a per server basis */
-                    if (warn_erange_on_local_index)
-                    {
-                        MXS_WARNING("Invalid 'wsrep_local_index' on server '%s': %s",
-                                    database->server->unique_name, row[1]);
-                        warn_erange_on_local_index = false;
-                    }
-                    local_index = -1;
+                    isjoined = 1;
                 }
-                database->server->node_id = local_index;
             }
-            mysql_free_result(result);
+            mysql_free_result(result2);
         }
+    }
+
+    if (isjoined)
+    {
+        /* The Galera node index in the cluster */
+        database->server->node_id = local_index;
+        database->server->load_weight = have_load ?
+                                        galera_load_weight(recv_queue_avg, fc_paused, cert_deps_distance) :
+                                        SERVER_FULL_LOAD_WEIGHT;
+
+        MXS_DEBUG("Galera node %s: recv queue %.2f, flow control paused %.3f, "
+                  "cert deps distance %.1f, load weight %d", database->server->unique_name,
+                  recv_queue_avg, fc_paused, cert_deps_distance, database->server->load_weight);
 
         server_set_status(&temp_server, SERVER_JOINED);
     }
     else
     {
         server_clear_status(&temp_server, SERVER_JOINED);
+        database->server->load_weight = SERVER_FULL_LOAD_WEIGHT;
     }
 
     /* clear bits for non member nodes */
@@ -463,192 +521,161 @@ monitorDatabase(MONITOR *mon, MONITOR_SERVERS *database)
 }
 
 /**
- * The entry point for the monitoring module thread
+ * Run one monitoring round
  *
- * @param arg   The handle of the monitor
+ * @param mon   The monitor
  */
 static void
-monitorMain(void *arg)
+monitorRound(MONITOR *mon)
 {
-    MONITOR* mon = (MONITOR*) arg;
     GALERA_MONITOR *handle;
     MONITOR_SERVERS *ptr;
-    size_t nrounds = 0;
     MONITOR_SERVERS *candidate_master = NULL;
     int master_stickiness;
     int is_cluster = 0;
-    int log_no_members = 1;
     monitor_event_t evtype;
 
     spinlock_acquire(&mon->lock);
     handle = (GALERA_MONITOR *) mon->handle;
     spinlock_release(&mon->lock);
     master_stickiness = handle->disableMasterFailback;
-    if (mysql_thread_init())
-    {
-        MXS_ERROR("mysql_thread_init failed in monitor module. Exiting.");
-        return;
-    }
-    handle->status = MONITOR_RUNNING;
 
-    while (1)
-    {
-        if (handle->shutdown)
-        {
-            handle->status = MONITOR_STOPPING;
-            mysql_thread_end();
-            handle->status = MONITOR_STOPPED;
-            return;
-        }
 
-        /** Wait base interval */
-        thread_millisleep(MON_BASE_INTERVAL_MS);
+    /* reset cluster members counter */
+    is_cluster = 0;
 
-        /**
-         * Calculate how far away the monitor interval is from its full
-         * cycle and if monitor interval time further than the base
-         * interval, then skip monitoring checks. Excluding the first
-         * round.
-         */
-        if (nrounds != 0 && ((nrounds * MON_BASE_INTERVAL_MS) % mon->interval) >= MON_BASE_INTERVAL_MS)
-        {
-            nrounds += 1;
-            continue;
-        }
-
-        nrounds += 1;
+    for (ptr = mon->databases; ptr; ptr = ptr->next)
+    {
+        ptr->mon_prev_status = ptr->server->status;
+    }
 
-        /* reset cluster members counter */
-        is_cluster = 0;
+    /* monitor all nodes at the same time */
+    mon_probe_servers(mon, monitorDatabase);
 
-        ptr = mon->databases;
+    ptr = mon->databases;
 
-        while (ptr)
+    while (ptr)
+    {
+        /* Log server status change */
+        if (mon_status_changed(ptr))
         {
-            ptr->mon_prev_status = ptr->server->status;
-
-            monitorDatabase(mon, ptr);
-
-            /* Log server status change */
-            if (mon_status_changed(ptr))
-            {
-                MXS_DEBUG("Backend server %s:%d state : %s",
-                          ptr->server->name,
-                          ptr->server->port,
-                          STRSRVSTATUS(ptr->server));
-            }
-
-            if (SERVER_IS_DOWN(ptr->server))
-            {
-                /** Increase this server'e error count */
-                ptr->mon_err_count += 1;
-
-            }
-            else
-            {
-                /** Reset this server's error count */
-                ptr->mon_err_count = 0;
-            }
-
-            ptr = ptr->next;
+            MXS_DEBUG("Backend server %s:%d state : %s",
+                      ptr->server->name,
+                      ptr->server->port,
+                      STRSRVSTATUS(ptr->server));
         }
 
-        /*
-         * Let's select a master server:
-         * it could be the candidate master following MIN(node_id) rule or
-         * the server that was master in the previous monitor polling cycle
-         * Decision depends on master_stickiness value set in configuration
-         */
-
-        /* get the candidate master, following MIN(node_id) rule */
-        candidate_master = get_candidate_master(mon);
-
-        /* Select the master, based on master_stickiness */
-        if (1 == handle->disableMasterRoleSetting)
+        if (SERVER_IS_DOWN(ptr->server))
         {
-            handle->master = NULL;
+            /** Increase this server'e error count */
+            ptr->mon_err_count += 1;
+
         }
         else
         {
-            handle->master = set_cluster_master(handle->master, candidate_master, master_stickiness);
+            /** Reset this server's error count */
+            ptr->mon_err_count = 0;
         }
 
-        ptr = mon->databases;
+        ptr = ptr->next;
+    }
+
+    /*
+     * Let's select a master server:
+     * it could be the candidate master following MIN(node_id) rule or
+     * the server that was master in the previous monitor polling cycle
+     * Decision depends on master_stickiness value set in configuration
+     */
+
+    /* get the candidate master, following MIN(node_id) rule */
+    candidate_master = get_candidate_master(mon);
+
+    /* Select the master, based on master_stickiness */
+    if (1 == handle->disableMasterRoleSetting)
+    {
+        handle->master = NULL;
+    }
+    else
+    {
+        handle->master = set_cluster_master(handle->master, candidate_master, master_stickiness);
+    }
+
+    ptr = mon->databases;
 
-        while (ptr)
+    while (ptr)
+    {
+        const int repl_bits = (SERVER_SLAVE | SERVER_MASTER | SERVER_MASTER_STICKINESS);
+        if (SERVER_IS_JOINED(ptr->server))
         {
-            const int repl_bits = (SERVER_SLAVE | SERVER_MASTER | SERVER_MASTER_STICKINESS);
-            if (SERVER_IS_JOINED(ptr->server))
+            if (handle->master)
             {
-                if (handle->master)
+                if (ptr != handle->master)
+                {
+                    /* set the Slave role and clear master stickiness */
+                    server_clear_set_status(ptr->server, repl_bits, SERVER_SLAVE);
+                }
+                else
                 {
-                    if (ptr != handle->master)
+                    if (candidate_master &&
+                        handle->master->server->node_id != candidate_master->server->node_id)
                     {
-                        /* set the Slave role and clear master stickiness */
-                        server_clear_set_status(ptr->server, repl_bits, SERVER_SLAVE);
+                        /* set master role and master stickiness */
+                        server_clear_set_status(ptr->server, repl_bits,
+                                                (SERVER_MASTER | SERVER_MASTER_STICKINESS));
                     }
                     else
                     {
-                        if (candidate_master &&
-                            handle->master->server->node_id != candidate_master->server->node_id)
-                        {
-                            /* set master role and master stickiness */
-                            server_clear_set_status(ptr->server, repl_bits,
-                                                    (SERVER_MASTER | SERVER_MASTER_STICKINESS));
-                        }
-                        else
-                        {
-                            /* set master role and clear master stickiness */
-                            server_clear_set_status(ptr->server, repl_bits, SERVER_MASTER);
-                        }
+                        /* set master role and clear master stickiness */
+                        server_clear_set_status(ptr->server, repl_bits, SERVER_MASTER);
                     }
                 }
-                is_cluster++;
-            }
-            else
-            {
-                server_clear_set_status(ptr->server, repl_bits, 0);
             }
-            ptr = ptr->next;
+            is_cluster++;
         }
-
-        if (is_cluster == 0 && log_no_members)
+        else
         {
-            MXS_ERROR("There are no cluster members");
-            log_no_members = 0;
+            server_clear_set_status(ptr->server, repl_bits, 0);
         }
-        else
+        ptr = ptr->next;
+    }
+
+    if (is_cluster == 0 && handle->log_no_members)
+    {
+        MXS_ERROR("There are no cluster members");
+        handle->log_no_members = false;
+    }
+    else
+    {
+        if (is_cluster > 0 && !handle->log_no_members)
         {
-            if (is_cluster > 0 && log_no_members == 0)
-            {
-                MXS_NOTICE("Found cluster members");
-                log_no_members = 1;
-            }
+            MXS_NOTICE("Found cluster members");
+            handle->log_no_members = true;
         }
+    }
 
-        ptr = mon->databases;
+    ptr = mon->databases;
 
-        while (ptr)
-        {
+    while (ptr)
+    {
 
-            /** Execute monitor script if a server state has changed */
-            if (mon_status_changed(ptr))
+        /** Execute monitor script if a server state has changed */
+        if (mon_status_changed(ptr))
+        {
+            evtype = mon_get_event_type(ptr);
+            if (isGaleraEvent(evtype))
             {
-                evtype = mon_get_event_type(ptr);
-                if (isGaleraEvent(evtype))
+                mon_log_state_change(ptr);
+                if (handle->script && handle->events[evtype])
                 {
-                    mon_log_state_change(ptr);
-                    if (handle->script && handle->events[evtype])
-                    {
-                        monitor_launch_script(mon, ptr, handle->script);
-                    }
+                    monitor_launch_script(mon, ptr, handle->script);
                 }
             }
-            ptr = ptr->next;
         }
-
-        mon_hangup_failed_servers(mon);
+        ptr = ptr->next;
     }
+
+    server_publish_topology();
+    mon_hangup_failed_servers(mon);
 }
 
 /**
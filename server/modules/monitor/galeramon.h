@@ -46,7 +46,6 @@
 typedef struct
 {
     SPINLOCK lock; /**< The monitor spinlock */
-    THREAD thread; /**< Monitor thread */
     int shutdown; /**< Flag to shutdown the monitor thread */
     int status; /**< Monitor status */
     unsigned long id; /**< Monitor ID */
@@ -57,6 +56,7 @@ typedef struct
     char* script;
     bool use_priority; /*< Use server priorities */
     bool events[MAX_MONITOR_EVENT]; /*< enabled events */
+    bool log_no_members; /*< Whether a cluster without members should be logged */
 } GALERA_MONITOR;
 
 #endif
@@ -28,7 +28,7 @@
 #include <mmmon.h>
 #include <dcb.h>
 
-static void monitorMain(void *);
+static void monitorRound(MONITOR *);
 
 static char *version_str = "V1.1.1";
 
@@ -188,7 +188,9 @@ startMonitor(void *arg, void* opt)
         memset(handle->events, true, sizeof(handle->events));
     }
 
-    if (thread_start(&handle->thread, monitorMain, mon) == NULL)
+    handle->status = MONITOR_RUNNING;
+
+    if (!mon_schedule_rounds(mon, monitorRound))
     {
         MXS_ERROR("Failed to start monitor thread for monitor '%s'.", mon->name);
     }
@@ -208,7 +210,8 @@ stopMonitor(void *arg)
     MM_MONITOR *handle = (MM_MONITOR *) mon->handle;
 
     handle->shutdown = 1;
-    thread_wait(handle->thread);
+    mon_unschedule_rounds(mon);
+    handle->status = MONITOR_STOPPED;
 }
 
 /**
@@ -535,144 +538,112 @@ monitorDatabase(MONITOR* mon, MONITOR_SERVERS *database)
 }
 
 /**
- * The entry point for the monitoring module thread
+ * Run one monitoring round
  *
- * @param arg   The handle of the monitor
+ * @param mon   The monitor
  */
 static void
-monitorMain(void *arg)
+monitorRound(MONITOR *mon)
 {
-    MONITOR* mon = (MONITOR*) arg;
     MM_MONITOR *handle;
     MONITOR_SERVERS *ptr;
     int detect_stale_master = false;
     MONITOR_SERVERS *root_master = NULL;
-    size_t nrounds = 0;
 
     spinlock_acquire(&mon->lock);
     handle = (MM_MONITOR *) mon->handle;
     spinlock_release(&mon->lock);
     detect_stale_master = handle->detectStaleMaster;
 
-    if (mysql_thread_init())
+
+    for (ptr = mon->databases; ptr; ptr = ptr->next)
     {
-        MXS_ERROR("Fatal : mysql_thread_init failed in monitor module. Exiting.");
-        return;
+        /* copy server status into monitor pending_status */
+        ptr->pending_status = ptr->server->status;
     }
 
-    handle->status = MONITOR_RUNNING;
-    while (1)
+    /* monitor all nodes at the same time */
+    mon_probe_servers(mon, monitorDatabase);
+
+    /* start from the first server in the list */
+    ptr = mon->databases;
+
+    while (ptr)
     {
-        if (handle->shutdown)
+        if (mon_status_changed(ptr) ||
+            mon_print_fail_status(ptr))
         {
-            handle->status = MONITOR_STOPPING;
-            mysql_thread_end();
-            handle->status = MONITOR_STOPPED;
-            return;
+            MXS_DEBUG("Backend server %s:%d state : %s",
+                      ptr->server->name,
+                      ptr->server->port,
+                      STRSRVSTATUS(ptr->server));
         }
-
-        /** Wait base interval */
-        thread_millisleep(MON_BASE_INTERVAL_MS);
-        /**
-         * Calculate how far away the monitor interval is from its full
-         * cycle and if monitor interval time further than the base
-         * interval, then skip monitoring checks. Excluding the first
-         * round.
-         */
-        if (nrounds != 0 &&
-            ((nrounds * MON_BASE_INTERVAL_MS) % mon->interval) >=
-            MON_BASE_INTERVAL_MS)
+        if (SERVER_IS_DOWN(ptr->server))
         {
-            nrounds += 1;
-            continue;
+            /** Increase this server'e error count */
+            ptr->mon_err_count += 1;
+        }
+        else
+        {
+            /** Reset this server's error count */
+            ptr->mon_err_count = 0;
         }
-        nrounds += 1;
 
-        /* start from the first server in the list */
-        ptr = mon->databases;
+        ptr = ptr->next;
+    }
 
-        while (ptr)
-        {
-            /* copy server status into monitor pending_status */
-            ptr->pending_status = ptr->server->status;
+    /* Get Master server pointer */
+    root_master = get_current_master(mon);
 
-            /* monitor current node */
-            monitorDatabase(mon, ptr);
+    /* Update server status from monitor pending status on that server*/
 
-            if (mon_status_changed(ptr) ||
-                mon_print_fail_status(ptr))
-            {
-                MXS_DEBUG("Backend server %s:%d state : %s",
-                          ptr->server->name,
-                          ptr->server->port,
-                          STRSRVSTATUS(ptr->server));
-            }
-            if (SERVER_IS_DOWN(ptr->server))
+    ptr = mon->databases;
+    while (ptr)
+    {
+        if (!SERVER_IN_MAINT(ptr->server))
+        {
+            /* If "detect_stale_master" option is On, let's use the previus master */
+            if (detect_stale_master && root_master &&
+                (!strcmp(ptr->server->name, root_master->server->name) &&
+                 ptr->server->port == root_master->server->port) && (ptr->server->status & SERVER_MASTER) &&
+                !(ptr->pending_status & SERVER_MASTER))
             {
-                /** Increase this server'e error count */
-                ptr->mon_err_count += 1;
+                /* in this case server->status will not be updated from pending_status */
+                MXS_NOTICE("[mysql_mon]: root server [%s:%i] is no longer Master, let's "
+                           "use it again even if it could be a stale master, you have "
+                           "been warned!", ptr->server->name, ptr->server->port);
+                /* Set the STALE bit for this server in server struct */
+                server_set_status(ptr->server, SERVER_STALE_STATUS);
             }
             else
             {
-                /** Reset this server's error count */
-                ptr->mon_err_count = 0;
+                ptr->server->status = ptr->pending_status;
             }
-
-            ptr = ptr->next;
-        }
-
-        /* Get Master server pointer */
-        root_master = get_current_master(mon);
-
-        /* Update server status from monitor pending status on that server*/
-
-        ptr = mon->databases;
-        while (ptr)
-        {
-            if (!SERVER_IN_MAINT(ptr->server))
-            {
-                /* If "detect_stale_master" option is On, let's use the previus master */
-                if (detect_stale_master && root_master &&
-                    (!strcmp(ptr->server->name, root_master->server->name) &&
-                     ptr->server->port == root_master->server->port) && (ptr->server->status & SERVER_MASTER) &&
-                    !(ptr->pending_status & SERVER_MASTER))
-                {
-                    /* in this case server->status will not be updated from pending_status */
-                    MXS_NOTICE("[mysql_mon]: root server [%s:%i] is no longer Master, let's "
-                               "use it again even if it could be a stale master, you have "
-                               "been warned!", ptr->server->name, ptr->server->port);
-                    /* Set the STALE bit for this server in server struct */
-                    server_set_status(ptr->server, SERVER_STALE_STATUS);
-                }
-                else
-                {
-                    ptr->server->status = ptr->pending_status;
-                }
-            }
-            ptr = ptr->next;
         }
+        ptr = ptr->next;
+    }
 
-        ptr = mon->databases;
-        monitor_event_t evtype;
-        while (ptr)
+    ptr = mon->databases;
+    monitor_event_t evtype;
+    while (ptr)
+    {
+        if (mon_status_changed(ptr))
         {
-            if (mon_status_changed(ptr))
+            evtype = mon_get_event_type(ptr);
+            if (isMySQLEvent(evtype))
             {
-                evtype = mon_get_event_type(ptr);
-                if (isMySQLEvent(evtype))
+                mon_log_state_change(ptr);
+                if (handle->script && handle->events[evtype])
                 {
-                    mon_log_state_change(ptr);
-                    if (handle->script && handle->events[evtype])
-                    {
-                        monitor_launch_script(mon, ptr, handle->script);
-                    }
+                    monitor_launch_script(mon, ptr, handle->script);
                 }
             }
-            ptr = ptr->next;
         }
-
-        mon_hangup_failed_servers(mon);
+        ptr = ptr->next;
     }
+
+    server_publish_topology();
+    mon_hangup_failed_servers(mon);
 }
 
 /**
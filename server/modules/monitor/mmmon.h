@@ -39,7 +39,6 @@
 typedef struct
 {
     SPINLOCK lock; /**< The monitor spinlock */
-    THREAD thread; /**< Monitor thread */
     int shutdown; /**< Flag to shutdown the monitor thread */
     int status; /**< Monitor status */
     unsigned long id; /**< Monitor ID */
@@ -46,12 +46,14 @@
  */
 
 #include <mysqlmon.h>
+#include <inttypes.h>
+#include <sys/time.h>
 #include <dcb.h>
 #include <modutil.h>
 
 extern char *strcasestr(const char *haystack, const char *needle);
 
-static void monitorMain(void *);
+static void monitorRound(MONITOR *);
 
 static char *version_str = "V1.4.0";
 
@@ -74,6 +76,7 @@ static void diagnostics(DCB *, void *);
 static MONITOR_SERVERS *getServerByNodeId(MONITOR_SERVERS *, long);
 static MONITOR_SERVERS *getSlaveOfNodeId(MONITOR_SERVERS *, long);
 static MONITOR_SERVERS *get_replication_tree(MONITOR *, int);
+static void log_topology_changes(MONITOR *mon, MONITOR_SERVERS *root_master);
 static void set_master_heartbeat(MYSQL_MONITOR *, MONITOR_SERVERS *);
 static void set_slave_heartbeat(MONITOR *, MONITOR_SERVERS *);
 static int add_slave_to_master(long *, int, long);
@@ -164,6 +167,15 @@ startMonitor(void *arg, void* opt)
         handle->master = NULL;
         handle->script = NULL;
         handle->mysql51_replication = false;
+        handle->by_node_id = NULL;
+        handle->by_master_id = NULL;
+        handle->n_indexed = 0;
+        handle->index_size = 0;
+        handle->topology = NULL;
+        handle->n_topology = 0;
+        handle->root_master = NULL;
+        handle->heartbeat_us = 0;
+        handle->heartbeat_us_column = 0;
         memset(handle->events, false, sizeof(handle->events));
         spinlock_init(&handle->lock);
     }
@@ -233,7 +245,12 @@ startMonitor(void *arg, void* opt)
         memset(handle->events, true, sizeof(handle->events));
     }
 
-    if (thread_start(&handle->thread, monitorMain, monitor) == NULL)
+    handle->last_root_master = NULL;
+    handle->heartbeat_checked = false;
+    handle->log_no_master = true;
+    handle->status = MONITOR_RUNNING;
+
+    if (!mon_schedule_rounds(monitor, monitorRound))
     {
         MXS_ERROR("Failed to start monitor thread for monitor '%s'.", monitor->name);
     }
@@ -253,7 +270,8 @@ stopMonitor(void *arg)
     MYSQL_MONITOR *handle = (MYSQL_MONITOR *) mon->handle;
 
     handle->shutdown = 1;
-    thread_wait(handle->thread);
+    mon_unschedule_rounds(mon);
+    handle->status = MONITOR_STOPPED;
 }
 
 /**
@@ -302,19 +320,17 @@ static void diagnostics(DCB *dcb, void *arg)
     dcb_printf(dcb, "\n");
 }
 
-static inline void monitor_mysql100_db(MONITOR_SERVERS* database)
+static inline void monitor_mysql100_db(MONITOR_SERVERS* database, MYSQL_RES* result)
 {
     int isslave = 0;
-    MYSQL_RES* result;
     MYSQL_ROW row;
 
-    if (mysql_query(database->con, "SHOW ALL SLAVES STATUS") == 0
-        && (result = mysql_store_result(database->con)) != NULL)
+    if (result)
     {
         int i = 0;
         long master_id = -1;
 
-        if (mysql_field_count(database->con) < 42)
+        if (mysql_num_fields(result) < 42)
         {
             mysql_free_result(result);
             MXS_ERROR("\"SHOW ALL SLAVES STATUS\" "
@@ -373,7 +389,7 @@ static inline void monitor_mysql100_db(MONITOR_SERVERS* database)
     monitor_clear_pending_status(database, SERVER_STALE_STATUS);
 
     /* Please note, the MASTER status and SERVER_SLAVE_OF_EXTERNAL_MASTER
-     * will be assigned in the monitorMain() via get_replication_tree() routine
+     * will be assigned in the monitorRound() via get_replication_tree() routine
      */
 
     /* Set the Slave Role */
@@ -391,17 +407,15 @@ static inline void monitor_mysql100_db(MONITOR_SERVERS* database)
     }
 }
 
-static inline void monitor_mysql55_db(MONITOR_SERVERS* database)
+static inline void monitor_mysql55_db(MONITOR_SERVERS* database, MYSQL_RES* result)
 {
     bool isslave = false;
-    MYSQL_RES* result;
     MYSQL_ROW row;
 
-    if (mysql_query(database->con, "SHOW SLAVE STATUS") == 0
-        && (result = mysql_store_result(database->con)) != NULL)
+    if (result)
     {
         long master_id = -1;
-        if (mysql_field_count(database->con) < 40)
+        if (mysql_num_fields(result) < 40)
         {
             mysql_free_result(result);
             MXS_ERROR("\"SHOW SLAVE STATUS\" "
@@ -448,7 +462,7 @@ static inline void monitor_mysql55_db(MONITOR_SERVERS* database)
     monitor_clear_pending_status(database, SERVER_STALE_STATUS);
 
     /* Please note, the MASTER status and SERVER_SLAVE_OF_EXTERNAL_MASTER
-     * will be assigned in the monitorMain() via get_replication_tree() routine
+     * will be assigned in the monitorRound() via get_replication_tree() routine
      */
 
     /* Set the Slave Role */
@@ -466,16 +480,14 @@ static inline void monitor_mysql55_db(MONITOR_SERVERS* database)
     }
 }
 
-static inline void monitor_mysql51_db(MONITOR_SERVERS* database)
+static inline void monitor_mysql51_db(MONITOR_SERVERS* database, MYSQL_RES* result)
 {
     bool isslave = false;
-    MYSQL_RES* result;
     MYSQL_ROW row;
 
-    if (mysql_query(database->con, "SHOW SLAVE STATUS") == 0
-        && (result = mysql_store_result(database->con)) != NULL)
+    if (result)
     {
-        if (mysql_field_count(database->con) < 38)
+        if (mysql_num_fields(result) < 38)
         {
             mysql_free_result(result);
 
@@ -505,7 +517,7 @@ static inline void monitor_mysql51_db(MONITOR_SERVERS* database)
     monitor_clear_pending_status(database, SERVER_STALE_STATUS);
 
     /* Please note, the MASTER status and SERVER_SLAVE_OF_EXTERNAL_MASTER
-     * will be assigned in the monitorMain() via get_replication_tree() routine
+     * will be assigned in the monitorRound() via get_replication_tree() routine
      */
 
     /* Set the Slave Role */
@@ -618,6 +630,136 @@ static MONITOR_SERVERS *build_mysql51_replication_tree(MONITOR *mon)
     return rval;
 }
 
+/**
+ * Get the replication status query for a server
+ *
+ * @param handle         The MySQL Monitor object
+ * @param server_version The version of the server
+ * @return The query or NULL if the replication status can't be resolved
+ */
+static const char *
+slave_status_query(MYSQL_MONITOR *handle, unsigned long server_version)
+{
+    if (server_version >= 100000)
+    {
+        /* MariaDB 10.x.x has multi-master replication */
+        return "SHOW ALL SLAVES STATUS";
+    }
+    else if (server_version >= 5 * 10000 + 5 * 100 || handle->mysql51_replication)
+    {
+        return "SHOW SLAVE STATUS";
+    }
+
+    return NULL;
+}
+
+/**
+ * Query the server ID and the replication status of a server
+ *
+ * Both are fetched with one multi-statement query so that a monitoring round
+ * costs a single round trip on a working connection. The query also serves as
+ * the check of the connection: it fails if the server has gone away.
+ *
+ * @param mon       The monitor
+ * @param database  The database to query
+ * @return True if the server responded to the query
+ */
+static bool
+query_server_status(MONITOR *mon, MONITOR_SERVERS *database)
+{
+    MYSQL_MONITOR* handle = mon->handle;
+    unsigned long server_version = mysql_get_server_version(database->con);
+    const char *slave_query = slave_status_query(handle, server_version);
+    MYSQL_RES *result;
+    MYSQL_RES *slave_result = NULL;
+    MYSQL_ROW row;
+    char query[100];
+
+    snprintf(query, sizeof(query), "SELECT @@server_id%s%s",
+             slave_query ? "; " : "", slave_query ? slave_query : "");
+
+    if (mysql_query(database->con, query) != 0)
+    {
+        return false;
+    }
+
+    bool valid_id = true;
+
+    /* get server_id form current node */
+    if ((result = mysql_store_result(database->con)) != NULL)
+    {
+        long server_id = -1;
+
+        if (mysql_num_fields(result) != 1)
+        {
+            MXS_ERROR("Unexpected result for 'SELECT @@server_id'. Expected 1 column."
+                      " MySQL Version: %s", version_str);
+            valid_id = false;
+        }
+
+        while (valid_id && (row = mysql_fetch_row(result)))
+        {
+            server_id = strtol(row[0], NULL, 10);
+            if ((errno == ERANGE && (server_id == LONG_MAX
+                                     || server_id == LONG_MIN)) || (errno != 0 && server_id == 0))
+            {
+                server_id = -1;
+            }
+            database->server->node_id = server_id;
+        }
+        mysql_free_result(result);
+    }
+
+    if (slave_query && mysql_next_result(database->con) == 0)
+    {
+        slave_result = mysql_store_result(database->con);
+    }
+
+    /** Read any remaining results so that the connection can be used again */
+    while (mysql_next_result(database->con) == 0)
+    {
+        if ((result = mysql_store_result(database->con)))
+        {
+            mysql_free_result(result);
+        }
+    }
+
+    if (!valid_id)
+    {
+        if (slave_result)
+        {
+            mysql_free_result(slave_result);
+        }
+        return true;
+    }
+
+    /* Check first for MariaDB 10.x.x and get status for multi-master replication */
+    if (server_version >= 100000)
+    {
+        monitor_mysql100_db(database, slave_result);
+    }
+    else if (server_version >= 5 * 10000 + 5 * 100)
+    {
+        monitor_mysql55_db(database, slave_result);
+    }
+    else
+    {
+        if (handle->mysql51_replication)
+        {
+            monitor_mysql51_db(database, slave_result);
+        }
+        else if (report_version_err)
+        {
+            report_version_err = false;
+            MXS_ERROR("MySQL version is lower than 5.5 and 'mysql51_replication' option is "
+                      "not enabled, replication tree cannot be resolved. To enable MySQL 5.1 replication "
+                      "detection, add 'mysql51_replication=true' to the monitor section.");
+        }
+    }
+
+    return true;
+}
+
 /**
  * Monitor an individual server
  *
@@ -627,11 +769,7 @@ static MONITOR_SERVERS *build_mysql51_replication_tree(MONITOR *mon)
 static void
 monitorDatabase(MONITOR *mon, MONITOR_SERVERS *database)
 {
-    MYSQL_MONITOR* handle = mon->handle;
-    MYSQL_ROW row;
-    MYSQL_RES *result;
     char *uname = mon->user;
-    unsigned long int server_version = 0;
     char *server_string;
 
     if (database->server->monuser != NULL)
@@ -653,13 +791,18 @@ monitorDatabase(MONITOR *mon, MONITOR_SERVERS *database)
     /** Store previous status */
     database->mon_prev_status = database->server->status;
 
-    if (database->con == NULL || mysql_ping(database->con) != 0)
+    /** On an open connection, the status query also checks the connection */
+    bool status_queried = database->con != NULL && query_server_status(mon, database);
+
+    if (!status_queried)
     {
         connect_result_t rval;
         if ((rval = mon_connect_to_db(mon, database)) == MONITOR_CONN_OK)
         {
             server_clear_status(database->server, SERVER_AUTH_ERROR);
             monitor_clear_pending_status(database, SERVER_AUTH_ERROR);
+            /** The status queries are sent as one multi-statement query */
+            mysql_set_server_option(database->con, MYSQL_OPTION_MULTI_STATEMENTS_ON);
         }
         else
         {
@@ -703,9 +846,6 @@ monitorDatabase(MONITOR *mon, MONITOR_SERVERS *database)
     server_set_status(database->server, SERVER_RUNNING);
     monitor_set_pending_status(database, SERVER_RUNNING);
 
-    /* get server version from current server */
-    server_version = mysql_get_server_version(database->con);
-
     /* get server version string */
     server_string = (char *) mysql_get_server_info(database->con);
     if (server_string)
@@ -713,370 +853,294 @@ monitorDatabase(MONITOR *mon, MONITOR_SERVERS *database)
         server_set_version_string(database->server, server_string);
     }
 
-    /* get server_id form current node */
-    if (mysql_query(database->con, "SELECT @@server_id") == 0
-        && (result = mysql_store_result(database->con)) != NULL)
-    {
-        long server_id = -1;
-
-        if (mysql_field_count(database->con) != 1)
-        {
-            mysql_free_result(result);
-            MXS_ERROR("Unexpected result for 'SELECT @@server_id'. Expected 1 column."
-                      " MySQL Version: %s", version_str);
-            return;
-        }
-
-        while ((row = mysql_fetch_row(result)))
-        {
-            server_id = strtol(row[0], NULL, 10);
-            if ((errno == ERANGE && (server_id == LONG_MAX
-                                     || server_id == LONG_MIN)) || (errno != 0 && server_id == 0))
-            {
-                server_id = -1;
-            }
-            database->server->node_id = server_id;
-        }
-        mysql_free_result(result);
-    }
-
-    /* Check first for MariaDB 10.x.x and get status for multi-master replication */
-    if (server_version >= 100000)
-    {
-        monitor_mysql100_db(database);
-    }
-    else if (server_version >= 5 * 10000 + 5 * 100)
-    {
-        monitor_mysql55_db(database);
-    }
-    else
+    if (!status_queried)
     {
-        if (handle->mysql51_replication)
-        {
-            monitor_mysql51_db(database);
-        }
-        else if (report_version_err)
-        {
-            report_version_err = false;
-            MXS_ERROR("MySQL version is lower than 5.5 and 'mysql51_replication' option is "
-                      "not enabled, replication tree cannot be resolved. To enable MySQL 5.1 replication "
-                      "detection, add 'mysql51_replication=true' to the monitor section.");
-        }
+        query_server_status(mon, database);
     }
-
 }
 
 /**
- * The entry point for the monitoring module thread
+ * Run one monitoring round
  *
- * @param arg   The handle of the monitor
+ * @param mon   The monitor
  */
 static void
-monitorMain(void *arg)
+monitorRound(MONITOR *mon)
 {
-    MONITOR* mon = (MONITOR*) arg;
     MYSQL_MONITOR *handle;
     MONITOR_SERVERS *ptr;
     int replication_heartbeat;
     bool detect_stale_master;
     int num_servers = 0;
-    MONITOR_SERVERS *root_master = NULL;
-    size_t nrounds = 0;
-    int log_no_master = 1;
-    bool heartbeat_checked = false;
+    MONITOR_SERVERS *root_master;
 
     spinlock_acquire(&mon->lock);
     handle = (MYSQL_MONITOR *) mon->handle;
     spinlock_release(&mon->lock);
     replication_heartbeat = handle->replicationHeartbeat;
     detect_stale_master = handle->detectStaleMaster;
+    root_master = handle->last_root_master;
 
-    if (mysql_thread_init())
+    if (handle->replicationHeartbeat && !handle->heartbeat_checked)
     {
-        MXS_ERROR("mysql_thread_init failed in monitor module. Exiting.");
-        return;
+        check_maxscale_schema_replication(mon);
+        handle->heartbeat_checked = true;
     }
-    handle->status = MONITOR_RUNNING;
-
-    while (1)
-    {
-        if (handle->shutdown)
-        {
-            handle->status = MONITOR_STOPPING;
-            mysql_thread_end();
-            handle->status = MONITOR_STOPPED;
-            return;
-        }
-        /** Wait base interval */
-        thread_millisleep(MON_BASE_INTERVAL_MS);
-
-        if (handle->replicationHeartbeat && !heartbeat_checked)
-        {
-            check_maxscale_schema_replication(mon);
-            heartbeat_checked = true;
-        }
 
-        /**
-         * Calculate how far away the monitor interval is from its full
-         * cycle and if monitor interval time further than the base
-         * interval, then skip monitoring checks. Excluding the first
-         * round.
-         */
-        if (nrounds != 0 &&
-            ((nrounds * MON_BASE_INTERVAL_MS) % mon->interval) >=
-            MON_BASE_INTERVAL_MS)
-        {
-            nrounds += 1;
-            continue;
-        }
-        nrounds += 1;
-        /* reset num_servers */
-        num_servers = 0;
+    /* reset num_servers */
+    num_servers = 0;
 
-        /* start from the first server in the list */
-        ptr = mon->databases;
+    for (ptr = mon->databases; ptr; ptr = ptr->next)
+    {
+        ptr->mon_prev_status = ptr->server->status;
 
-        while (ptr)
-        {
-            ptr->mon_prev_status = ptr->server->status;
+        /* copy server status into monitor pending_status */
+        ptr->pending_status = ptr->server->status;
+    }
 
-            /* copy server status into monitor pending_status */
-            ptr->pending_status = ptr->server->status;
+    /* monitor all nodes at the same time */
+    mon_probe_servers(mon, monitorDatabase);
 
-            /* monitor current node */
-            monitorDatabase(mon, ptr);
+    /* start from the first server in the list */
+    ptr = mon->databases;
 
-            /* reset the slave list of current node */
-            memset(&ptr->server->slaves, 0, sizeof(ptr->server->slaves));
+    while (ptr)
+    {
+        /* reset the slave list of current node */
+        memset(&ptr->server->slaves, 0, sizeof(ptr->server->slaves));
 
-            num_servers++;
+        num_servers++;
 
-            if (mon_status_changed(ptr))
+        if (mon_status_changed(ptr))
+        {
+            if (SRV_MASTER_STATUS(ptr->mon_prev_status))
             {
-                if (SRV_MASTER_STATUS(ptr->mon_prev_status))
-                {
-                    /** Master failed, can't recover */
-                    MXS_NOTICE("Server %s:%d lost the master status.",
-                               ptr->server->name,
-                               ptr->server->port);
-                }
+                /** Master failed, can't recover */
+                MXS_NOTICE("Server %s:%d lost the master status.",
+                           ptr->server->name,
+                           ptr->server->port);
             }
+        }
 
-            if (mon_status_changed(ptr))
-            {
+        if (mon_status_changed(ptr))
+        {
 #if defined(SS_DEBUG)
-                MXS_INFO("Backend server %s:%d state : %s",
-                         ptr->server->name,
-                         ptr->server->port,
-                         STRSRVSTATUS(ptr->server));
+            MXS_INFO("Backend server %s:%d state : %s",
+                     ptr->server->name,
+                     ptr->server->port,
+                     STRSRVSTATUS(ptr->server));
 #else
-                MXS_DEBUG("Backend server %s:%d state : %s",
-                          ptr->server->name,
-                          ptr->server->port,
-                          STRSRVSTATUS(ptr->server));
+            MXS_DEBUG("Backend server %s:%d state : %s",
+                      ptr->server->name,
+                      ptr->server->port,
+                      STRSRVSTATUS(ptr->server));
 #endif
-            }
-
-            if (SERVER_IS_DOWN(ptr->server))
-            {
-                /** Increase this server'e error count */
-                ptr->mon_err_count += 1;
-            }
-            else
-            {
-                /** Reset this server's error count */
-                ptr->mon_err_count = 0;
-            }
+        }
 
-            ptr = ptr->next;
+        if (SERVER_IS_DOWN(ptr->server))
+        {
+            /** Increase this server'e error count */
+            ptr->mon_err_count += 1;
+        }
+        else
+        {
+            /** Reset this server's error count */
+            ptr->mon_err_count = 0;
         }
 
-        ptr = mon->databases;
-        /* if only one server is configured, that's is Master */
-        if (num_servers == 1)
+        ptr = ptr->next;
+    }
+
+    ptr = mon->databases;
+    /* if only one server is configured, that's is Master */
+    if (num_servers == 1)
+    {
+        if (SERVER_IS_RUNNING(ptr->server))
         {
-            if (SERVER_IS_RUNNING(ptr->server))
-            {
-                ptr->server->depth = 0;
-                /* status cleanup */
-                monitor_clear_pending_status(ptr, SERVER_SLAVE);
+            ptr->server->depth = 0;
+            /* status cleanup */
+            monitor_clear_pending_status(ptr, SERVER_SLAVE);
 
-                /* master status set */
-                monitor_set_pending_status(ptr, SERVER_MASTER);
+            /* master status set */
+            monitor_set_pending_status(ptr, SERVER_MASTER);
 
-                ptr->server->depth = 0;
-                handle->master = ptr;
-                root_master = ptr;
-            }
+            ptr->server->depth = 0;
+            handle->master = ptr;
+            root_master = ptr;
+        }
+    }
+    else
+    {
+        /* Compute the replication tree */
+        if (handle->mysql51_replication)
+        {
+            root_master = build_mysql51_replication_tree(mon);
         }
         else
         {
-            /* Compute the replication tree */
-            if (handle->mysql51_replication)
-            {
-                root_master = build_mysql51_replication_tree(mon);
-            }
-            else
-            {
-                root_master = get_replication_tree(mon, num_servers);
-            }
-
+            root_master = get_replication_tree(mon, num_servers);
         }
 
-        /* Update server status from monitor pending status on that server*/
+    }
 
-        ptr = mon->databases;
-        while (ptr)
+    /* Update server status from monitor pending status on that server*/
+
+    ptr = mon->databases;
+    while (ptr)
+    {
+        if (!SERVER_IN_MAINT(ptr->server))
         {
-            if (!SERVER_IN_MAINT(ptr->server))
+            /* If "detect_stale_master" option is On, let's use the previous master */
+            if (detect_stale_master && root_master &&
+                (strcmp(ptr->server->name, root_master->server->name) == 0 &&
+                 ptr->server->port == root_master->server->port) &&
+                (ptr->server->status & SERVER_MASTER) &&
+                !(ptr->pending_status & SERVER_MASTER))
             {
-                /* If "detect_stale_master" option is On, let's use the previous master */
-                if (detect_stale_master && root_master &&
-                    (strcmp(ptr->server->name, root_master->server->name) == 0 &&
-                     ptr->server->port == root_master->server->port) &&
-                    (ptr->server->status & SERVER_MASTER) &&
-                    !(ptr->pending_status & SERVER_MASTER))
+                /**
+                 * In this case server->status will not be updated from pending_status
+                 * Set the STALE bit for this server in server struct
+                 */
+                server_set_status(ptr->server, SERVER_STALE_STATUS | SERVER_MASTER);
+                ptr->pending_status |= SERVER_STALE_STATUS | SERVER_MASTER;
+
+                /** Log the message only if the master server didn't have
+                 * the stale master bit set */
+                if ((ptr->mon_prev_status & SERVER_STALE_STATUS) == 0)
                 {
-                    /**
-                     * In this case server->status will not be updated from pending_status
-                     * Set the STALE bit for this server in server struct
-                     */
-                    server_set_status(ptr->server, SERVER_STALE_STATUS | SERVER_MASTER);
-                    ptr->pending_status |= SERVER_STALE_STATUS | SERVER_MASTER;
-
-                    /** Log the message only if the master server didn't have
-                     * the stale master bit set */
-                    if ((ptr->mon_prev_status & SERVER_STALE_STATUS) == 0)
-                    {
-                        MXS_WARNING("All slave servers under the current master "
-                                    "server have been lost. Assigning Stale Master"
-                                    " status to the old master server '%s' (%s:%i).",
-                                    ptr->server->unique_name, ptr->server->name,
-                                    ptr->server->port);
-                    }
+                    MXS_WARNING("All slave servers under the current master "
+                                "server have been lost. Assigning Stale Master"
+                                " status to the old master server '%s' (%s:%i).",
+                                ptr->server->unique_name, ptr->server->name,
+                                ptr->server->port);
                 }
+            }
 
-                if (handle->detectStaleSlave)
-                {
-                    int bits = SERVER_SLAVE | SERVER_RUNNING;
+            if (handle->detectStaleSlave)
+            {
+                int bits = SERVER_SLAVE | SERVER_RUNNING;
 
-                    if ((ptr->mon_prev_status & bits) == bits &&
-                        root_master && SERVER_IS_MASTER(root_master->server))
-                    {
-                        /** Slave with a running master, assign stale slave candidacy */
-                        if ((ptr->pending_status & bits) == bits)
-                        {
-                            ptr->pending_status |= SERVER_STALE_SLAVE;
-                        }
-                        /** Server lost slave when a master is available, remove
-                         * stale slave candidacy */
-                        else if ((ptr->pending_status & bits) == SERVER_RUNNING)
-                        {
-                            ptr->pending_status &= ~SERVER_STALE_SLAVE;
-                        }
-                    }
-                    /** If this server was a stale slave candidate, assign
-                     * slave status to it */
-                    else if (ptr->mon_prev_status & SERVER_STALE_SLAVE &&
-                             ptr->pending_status & SERVER_RUNNING &&
-                             // Master is down
-                             (!root_master || !SERVER_IS_MASTER(root_master->server) ||
-                              // Master just came up
-                              (SERVER_IS_MASTER(root_master->server) &&
-                               (root_master->mon_prev_status & SERVER_MASTER) == 0)))
+                if ((ptr->mon_prev_status & bits) == bits &&
+                    root_master && SERVER_IS_MASTER(root_master->server))
+                {
+                    /** Slave with a running master, assign stale slave candidacy */
+                    if ((ptr->pending_status & bits) == bits)
                     {
-                        ptr->pending_status |= SERVER_SLAVE;
+                        ptr->pending_status |= SERVER_STALE_SLAVE;
                     }
-                    else if (root_master == NULL && ptr->server->slave_configured)
+                    /** Server lost slave when a master is available, remove
+                     * stale slave candidacy */
+                    else if ((ptr->pending_status & bits) == SERVER_RUNNING)
                     {
-                        /** TODO: Change this in 2.1 to use the server_info mechanism */
-                        ptr->pending_status |= SERVER_SLAVE;
+                        ptr->pending_status &= ~SERVER_STALE_SLAVE;
                     }
                 }
-
-                ptr->server->status = ptr->pending_status;
+                /** If this server was a stale slave candidate, assign
+                 * slave status to it */
+                else if (ptr->mon_prev_status & SERVER_STALE_SLAVE &&
+                         ptr->pending_status & SERVER_RUNNING &&
+                         // Master is down
+                         (!root_master || !SERVER_IS_MASTER(root_master->server) ||
+                          // Master just came up
+                          (SERVER_IS_MASTER(root_master->server) &&
+                           (root_master->mon_prev_status & SERVER_MASTER) == 0)))
+                {
+                    ptr->pending_status |= SERVER_SLAVE;
+                }
+                else if (root_master == NULL && ptr->server->slave_configured)
+                {
+                    /** TODO: Change this in 2.1 to use the server_info mechanism */
+                    ptr->pending_status |= SERVER_SLAVE;
+                }
             }
-            ptr = ptr->next;
+
+            ptr->server->status = ptr->pending_status;
         }
+        ptr = ptr->next;
+    }
 
-        ptr = mon->databases;
-        monitor_event_t evtype;
-        while (ptr)
+    ptr = mon->databases;
+    monitor_event_t evtype;
+    while (ptr)
+    {
+        /** Execute monitor script if a server state has changed */
+        if (mon_status_changed(ptr))
         {
-            /** Execute monitor script if a server state has changed */
-            if (mon_status_changed(ptr))
+            evtype = mon_get_event_type(ptr);
+            if (isMySQLEvent(evtype))
             {
-                evtype = mon_get_event_type(ptr);
-                if (isMySQLEvent(evtype))
+                mon_log_state_change(ptr);
+                if (handle->script && handle->events[evtype])
                 {
-                    mon_log_state_change(ptr);
-                    if (handle->script && handle->events[evtype])
-                    {
-                        monitor_launch_script(mon, ptr, handle->script);
-                    }
+                    monitor_launch_script(mon, ptr, handle->script);
                 }
             }
-            ptr = ptr->next;
         }
+        ptr = ptr->next;
+    }
+
+    log_topology_changes(mon, root_master);
 
-        /* log master detection failure of first master becomes available after failure */
-        if (root_master &&
-            mon_status_changed(root_master) &&
-            !(root_master->server->status & SERVER_STALE_STATUS))
+    /* log master detection failure of first master becomes available after failure */
+    if (root_master &&
+        mon_status_changed(root_master) &&
+        !(root_master->server->status & SERVER_STALE_STATUS))
+    {
+        if (root_master->pending_status & (SERVER_MASTER) && SERVER_IS_RUNNING(root_master->server))
         {
-            if (root_master->pending_status & (SERVER_MASTER) && SERVER_IS_RUNNING(root_master->server))
-            {
-                if (!(root_master->mon_prev_status & SERVER_STALE_STATUS) &&
-                    !(root_master->server->status & SERVER_MAINT))
-                {
-                    MXS_NOTICE("A Master Server is now available: %s:%i",
-                               root_master->server->name,
-                               root_master->server->port);
-                }
-            }
-            else
+            if (!(root_master->mon_prev_status & SERVER_STALE_STATUS) &&
+                !(root_master->server->status & SERVER_MAINT))
             {
-                MXS_ERROR("No Master can be determined. Last known was %s:%i",
-                          root_master->server->name,
-                          root_master->server->port);
+                MXS_NOTICE("A Master Server is now available: %s:%i",
+                           root_master->server->name,
+                           root_master->server->port);
             }
-            log_no_master = 1;
         }
         else
         {
-            if (!root_master && log_no_master)
-            {
-                MXS_ERROR("No Master can be determined");
-                log_no_master = 0;
-            }
+            MXS_ERROR("No Master can be determined. Last known was %s:%i",
+                      root_master->server->name,
+                      root_master->server->port);
         }
-
-        /* Do now the heartbeat replication set/get for MySQL Replication Consistency */
-        if (replication_heartbeat &&
-            root_master &&
-            (SERVER_IS_MASTER(root_master->server) ||
-             SERVER_IS_RELAY_SERVER(root_master->server)))
+        handle->log_no_master = true;
+    }
+    else
+    {
+        if (!root_master && handle->log_no_master)
         {
-            set_master_heartbeat(handle, root_master);
-            ptr = mon->databases;
+            MXS_ERROR("No Master can be determined");
+            handle->log_no_master = false;
+        }
+    }
 
-            while (ptr)
+    /* Do now the heartbeat replication set/get for MySQL Replication Consistency */
+    if (replication_heartbeat &&
+        root_master &&
+        (SERVER_IS_MASTER(root_master->server) ||
+         SERVER_IS_RELAY_SERVER(root_master->server)))
+    {
+        set_master_heartbeat(handle, root_master);
+        ptr = mon->databases;
+
+        while (ptr)
+        {
+            if ((!SERVER_IN_MAINT(ptr->server)) && SERVER_IS_RUNNING(ptr->server))
             {
-                if ((!SERVER_IN_MAINT(ptr->server)) && SERVER_IS_RUNNING(ptr->server))
+                if (ptr->server->node_id != root_master->server->node_id &&
+                    (SERVER_IS_SLAVE(ptr->server) ||
+                     SERVER_IS_RELAY_SERVER(ptr->server)))
                 {
-                    if (ptr->server->node_id != root_master->server->node_id &&
-                        (SERVER_IS_SLAVE(ptr->server) ||
-                         SERVER_IS_RELAY_SERVER(ptr->server)))
-                    {
-                        set_slave_heartbeat(mon, ptr);
-                    }
+                    set_slave_heartbeat(mon, ptr);
                 }
-                ptr = ptr->next;
             }
+            ptr = ptr->next;
         }
+    }
+
+    server_publish_topology();
+    mon_hangup_failed_servers(mon);
 
-        mon_hangup_failed_servers(mon);
-    } /*< while (1) */
+    handle->last_root_master = root_master;
 }
 
 /**
@@ -1125,6 +1189,90 @@ getSlaveOfNodeId(MONITOR_SERVERS *ptr, long node_id)
     return NULL;
 }
 
+/**
+ * Return the current time in microseconds
+ */
+static uint64_t heartbeat_now_us()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/**
+ * Add the microsecond timestamp column to a heartbeat table created by an
+ * older version. This is done once, the change replicates to the slaves
+ * with the rest of the table.
+ *
+ * @param handle    The monitor handle
+ * @param database  The master server
+ */
+static void check_heartbeat_us_column(MYSQL_MONITOR *handle, MONITOR_SERVERS *database)
+{
+    if (handle->heartbeat_us_column == 0)
+    {
+        if (mysql_query(database->con, "ALTER TABLE maxscale_schema.replication_heartbeat "
+                        "ADD COLUMN master_timestamp_us BIGINT UNSIGNED NOT NULL DEFAULT 0") == 0 ||
+            mysql_errno(database->con) == ER_DUP_FIELDNAME)
+        {
+            handle->heartbeat_us_column = 1;
+        }
+        else
+        {
+            MXS_WARNING("[mysql_mon]: Could not add the master_timestamp_us column to "
+                        "maxscale_schema.replication_heartbeat in %s:%i, replication lag "
+                        "is measured in seconds: %s", database->server->name,
+                        database->server->port, mysql_error(database->con));
+            handle->heartbeat_us_column = -1;
+        }
+    }
+}
+
+/**
+ * Update the replication lag of a server with a new sample
+ *
+ * The lag is smoothed with an exponentially weighted moving average and its
+ * mean deviation is tracked the same way, like TCP does for round trip times.
+ * A growing lag is followed quickly. A shrinking one is followed once two
+ * consecutive samples agree within the deviation, so that a slave that has
+ * caught up is used again after one more round while a single low sample of a
+ * slave that is still behind only halves the distance.
+ *
+ * @param server    The slave server
+ * @param sample_ms The measured lag in milliseconds
+ */
+static void update_replication_lag(SERVER *server, int sample_ms)
+{
+    if (server->rlag_ms < 0 || server->rlag_sample_ms < 0)
+    {
+        server->rlag_ms = sample_ms;
+        server->rlag_jitter_ms = sample_ms / 2;
+    }
+    else
+    {
+        int diff = sample_ms - server->rlag_ms;
+
+        server->rlag_jitter_ms += (abs(diff) - server->rlag_jitter_ms) / 4;
+
+        if (diff > 0)
+        {
+            server->rlag_ms += (diff + 1) / 2;
+        }
+        else if (abs(sample_ms - server->rlag_sample_ms) <= server->rlag_jitter_ms)
+        {
+            int agreed = MAX(sample_ms, server->rlag_sample_ms);
+            server->rlag_ms = MIN(agreed, server->rlag_ms);
+        }
+        else
+        {
+            server->rlag_ms += diff / 2;
+        }
+    }
+
+    server->rlag_sample_ms = sample_ms;
+    server->rlag = server->rlag_ms / 1000;
+}
+
 /*******
  * This function sets the replication heartbeat
  * into the maxscale_schema.replication_heartbeat table in the current master.
@@ -1137,6 +1285,7 @@ static void set_master_heartbeat(MYSQL_MONITOR *handle, MONITOR_SERVERS *databas
 {
     unsigned long id = handle->id;
     time_t heartbeat;
+    uint64_t heartbeat_us;
     time_t purge_time;
     char heartbeat_insert_query[512] = "";
     char heartbeat_purge_query[512] = "";
@@ -1162,6 +1311,7 @@ static void set_master_heartbeat(MYSQL_MONITOR *handle, MONITOR_SERVERS *databas
                     "(maxscale_id INT NOT NULL, "
                     "master_server_id INT NOT NULL, "
                     "master_timestamp INT UNSIGNED NOT NULL, "
+                    "master_timestamp_us BIGINT UNSIGNED NOT NULL DEFAULT 0, "
                     "PRIMARY KEY ( master_server_id, maxscale_id ) ) "
                     "ENGINE=MYISAM DEFAULT CHARSET=latin1"))
     {
@@ -1170,6 +1320,10 @@ static void set_master_heartbeat(MYSQL_MONITOR *handle, MONITOR_SERVERS *databas
 
         database->server->rlag = -1;
     }
+    else
+    {
+        check_heartbeat_us_column(handle, database);
+    }
 
     /* auto purge old values after 48 hours*/
     purge_time = time(0) - (3600 * 48);
@@ -1185,14 +1339,25 @@ static void set_master_heartbeat(MYSQL_MONITOR *handle, MONITOR_SERVERS *databas
                   mysql_error(database->con));
     }
 
-    heartbeat = time(0);
+    heartbeat_us = heartbeat_now_us();
+    heartbeat = heartbeat_us / 1000000;
 
     /* set node_ts for master as time(0) */
     database->server->node_ts = heartbeat;
 
-    sprintf(heartbeat_insert_query,
-            "UPDATE maxscale_schema.replication_heartbeat SET master_timestamp = %lu WHERE master_server_id = %li AND maxscale_id = %lu",
-            heartbeat, handle->master->server->node_id, id);
+    if (handle->heartbeat_us_column > 0)
+    {
+        sprintf(heartbeat_insert_query,
+                "UPDATE maxscale_schema.replication_heartbeat SET master_timestamp = %lu, "
+                "master_timestamp_us = %" PRIu64 " WHERE master_server_id = %li AND maxscale_id = %lu",
+                heartbeat, heartbeat_us, handle->master->server->node_id, id);
+    }
+    else
+    {
+        sprintf(heartbeat_insert_query,
+                "UPDATE maxscale_schema.replication_heartbeat SET master_timestamp = %lu WHERE master_server_id = %li AND maxscale_id = %lu",
+                heartbeat, handle->master->server->node_id, id);
+    }
 
     /* Try to insert MaxScale timestamp into master */
     if (mysql_query(database->con, heartbeat_insert_query))
@@ -1208,10 +1373,19 @@ static void set_master_heartbeat(MYSQL_MONITOR *handle, MONITOR_SERVERS *databas
     {
         if (mysql_affected_rows(database->con) == 0)
         {
-            heartbeat = time(0);
-            sprintf(heartbeat_insert_query,
-                    "REPLACE INTO maxscale_schema.replication_heartbeat (master_server_id, maxscale_id, master_timestamp ) VALUES ( %li, %lu, %lu)",
-                    handle->master->server->node_id, id, heartbeat);
+            if (handle->heartbeat_us_column > 0)
+            {
+                sprintf(heartbeat_insert_query,
+                        "REPLACE INTO maxscale_schema.replication_heartbeat (master_server_id, maxscale_id, "
+                        "master_timestamp, master_timestamp_us ) VALUES ( %li, %lu, %lu, %" PRIu64 ")",
+                        handle->master->server->node_id, id, heartbeat, heartbeat_us);
+            }
+            else
+            {
+                sprintf(heartbeat_insert_query,
+                        "REPLACE INTO maxscale_schema.replication_heartbeat (master_server_id, maxscale_id, master_timestamp ) VALUES ( %li, %lu, %lu)",
+                        handle->master->server->node_id, id, heartbeat);
+            }
 
             if (mysql_query(database->con, heartbeat_insert_query))
             {
@@ -1227,6 +1401,9 @@ static void set_master_heartbeat(MYSQL_MONITOR *handle, MONITOR_SERVERS *databas
             {
                 /* Set replication lag to 0 for the master */
                 database->server->rlag = 0;
+                database->server->rlag_ms = 0;
+                database->server->rlag_jitter_ms = 0;
+                handle->heartbeat_us = heartbeat_us;
 
                 MXS_DEBUG("[mysql_mon]: heartbeat table inserted data for %s:%i",
                           database->server->name, database->server->port);
@@ -1236,6 +1413,9 @@ static void set_master_heartbeat(MYSQL_MONITOR *handle, MONITOR_SERVERS *databas
         {
             /* Set replication lag as 0 for the master */
             database->server->rlag = 0;
+            database->server->rlag_ms = 0;
+            database->server->rlag_jitter_ms = 0;
+            handle->heartbeat_us = heartbeat_us;
 
             MXS_DEBUG("[mysql_mon]: heartbeat table updated for Master %s:%i",
                       database->server->name, database->server->port);
@@ -1248,6 +1428,12 @@ static void set_master_heartbeat(MYSQL_MONITOR *handle, MONITOR_SERVERS *databas
  * from the maxscale_schema.replication_heartbeat table in the current slave
  * and stores the timestamp and replication lag in the slave server struct
  *
+ * The heartbeat read from the slave is the last one it has replicated. The
+ * lag is at most the age of that heartbeat and, if a newer one was already
+ * written to the master, at least the age of the newer one. The middle of
+ * these bounds is used as the sample so that the lag isn't rounded up to
+ * the monitor interval.
+ *
  * @param handle    The monitor handle
  * @param database      The number database server
  */
@@ -1255,7 +1441,7 @@ static void set_slave_heartbeat(MONITOR* mon, MONITOR_SERVERS *database)
 {
     MYSQL_MONITOR *handle = (MYSQL_MONITOR*) mon->handle;
     unsigned long id = handle->id;
-    time_t heartbeat;
+    uint64_t heartbeat_us;
     char select_heartbeat_query[256] = "";
     MYSQL_ROW row;
     MYSQL_RES *result;
@@ -1268,9 +1454,10 @@ static void set_slave_heartbeat(MONITOR* mon, MONITOR_SERVERS *database)
 
     /* Get the master_timestamp value from maxscale_schema.replication_heartbeat table */
 
-    sprintf(select_heartbeat_query, "SELECT master_timestamp "
+    sprintf(select_heartbeat_query, "SELECT master_timestamp%s "
             "FROM maxscale_schema.replication_heartbeat "
             "WHERE maxscale_id = %lu AND master_server_id = %li",
+            handle->heartbeat_us_column > 0 ? ", master_timestamp_us" : "",
             id, handle->master->server->node_id);
 
     /* if there is a master then send the query to the slave with master_id */
@@ -1281,12 +1468,14 @@ static void set_slave_heartbeat(MONITOR* mon, MONITOR_SERVERS *database)
 
         while ((row = mysql_fetch_row(result)))
         {
-            int rlag = -1;
             time_t slave_read;
+            uint64_t read_us = 0;
+            uint64_t latest_us = handle->heartbeat_us;
 
             rows_found = 1;
 
-            heartbeat = time(0);
+            heartbeat_us = heartbeat_now_us();
+            errno = 0;
             slave_read = strtoul(row[0], NULL, 10);
 
             if ((errno == ERANGE && (slave_read == LONG_MAX || slave_read == LONG_MIN)) || (errno != 0 &&
@@ -1295,33 +1484,49 @@ static void set_slave_heartbeat(MONITOR* mon, MONITOR_SERVERS *database)
                 slave_read = 0;
             }
 
-            if (slave_read)
+            if (mysql_num_fields(result) > 1 && row[1])
             {
-                /* set the replication lag */
-                rlag = heartbeat - slave_read;
+                read_us = strtoull(row[1], NULL, 10);
+            }
+
+            if (read_us == 0)
+            {
+                /** Only the timestamp in seconds is available, compare in seconds */
+                read_us = (uint64_t)slave_read * 1000000;
+                latest_us -= latest_us % 1000000;
             }
 
             /* set this node_ts as master_timestamp read from replication_heartbeat table */
             database->server->node_ts = slave_read;
 
-            if (rlag >= 0)
+            if (slave_read)
             {
-                /* store rlag only if greater than monitor sampling interval */
-                database->server->rlag = ((unsigned int)rlag > (mon->interval / 1000)) ? rlag : 0;
+                uint64_t upper = heartbeat_us > read_us ? heartbeat_us - read_us : 0;
+                uint64_t lower = 0;
+
+                if (read_us < latest_us && heartbeat_us > latest_us)
+                {
+                    lower = heartbeat_us - latest_us;
+                }
+
+                update_replication_lag(database->server, (lower + upper) / 2000);
             }
             else
             {
                 database->server->rlag = -1;
+                database->server->rlag_ms = -1;
             }
 
-            MXS_DEBUG("Slave %s:%i has %i seconds lag",
+            MXS_DEBUG("Slave %s:%i has %i ms lag, jitter %i ms",
                       database->server->name,
                       database->server->port,
-                      database->server->rlag);
+                      database->server->rlag_ms,
+                      database->server->rlag_jitter_ms);
         }
         if (!rows_found)
         {
             database->server->rlag = -1;
+            database->server->rlag_ms = -1;
             database->server->node_ts = 0;
         }
 
@@ -1330,6 +1535,7 @@ static void set_slave_heartbeat(MONITOR* mon, MONITOR_SERVERS *database)
     else
     {
         database->server->rlag = -1;
+        database->server->rlag_ms = -1;
         database->server->node_ts = 0;
 
         if (handle->master->server->node_id < 0)
@@ -1351,6 +1557,224 @@ static void set_slave_heartbeat(MONITOR* mon, MONITOR_SERVERS *database)
     }
 }
 
+/**
+ * Compare two server index entries by ID and then by position
+ */
+static int node_index_cmp(const void *a, const void *b)
+{
+    const NODE_INDEX_ENTRY *e1 = (const NODE_INDEX_ENTRY *) a;
+    const NODE_INDEX_ENTRY *e2 = (const NODE_INDEX_ENTRY *) b;
+
+    if (e1->id != e2->id)
+    {
+        return e1->id < e2->id ? -1 : 1;
+    }
+
+    return e1->position - e2->position;
+}
+
+/**
+ * Index the monitored servers by their node IDs and by the node IDs of their
+ * masters. The indexes are rebuilt every round because the IDs are read from
+ * the servers when they are probed. If the indexes can't be allocated, the
+ * lookups fall back to scanning the server list.
+ *
+ * @param mon The monitor
+ */
+static void build_node_index(MONITOR *mon)
+{
+    MYSQL_MONITOR *handle = (MYSQL_MONITOR *) mon->handle;
+    MONITOR_SERVERS *ptr;
+    int n = 0;
+
+    for (ptr = mon->databases; ptr; ptr = ptr->next)
+    {
+        n++;
+    }
+
+    handle->n_indexed = 0;
+
+    if (n > handle->index_size)
+    {
+        NODE_INDEX_ENTRY *by_node_id = realloc(handle->by_node_id, n * sizeof(NODE_INDEX_ENTRY));
+
+        if (by_node_id)
+        {
+            handle->by_node_id = by_node_id;
+        }
+
+        NODE_INDEX_ENTRY *by_master_id = realloc(handle->by_master_id, n * sizeof(NODE_INDEX_ENTRY));
+
+        if (by_master_id)
+        {
+            handle->by_master_id = by_master_id;
+        }
+
+        if (by_node_id == NULL || by_master_id == NULL)
+        {
+            return;
+        }
+        handle->index_size = n;
+    }
+
+    n = 0;
+
+    for (ptr = mon->databases; ptr; ptr = ptr->next)
+    {
+        handle->by_node_id[n].id = ptr->server->node_id;
+        handle->by_node_id[n].position = n;
+        handle->by_node_id[n].database = ptr;
+        handle->by_master_id[n].id = ptr->server->master_id;
+        handle->by_master_id[n].position = n;
+        handle->by_master_id[n].database = ptr;
+        n++;
+    }
+
+    qsort(handle->by_node_id, n, sizeof(NODE_INDEX_ENTRY), node_index_cmp);
+    qsort(handle->by_master_id, n, sizeof(NODE_INDEX_ENTRY), node_index_cmp);
+    handle->n_indexed = n;
+}
+
+/**
+ * Find the first server, in the order of the server list, with an ID
+ *
+ * @param entries The index
+ * @param n       Number of entries in the index
+ * @param id      The ID to find
+ * @return The server or NULL if no server has the ID
+ */
+static MONITOR_SERVERS *node_index_find(const NODE_INDEX_ENTRY *entries, int n, long id)
+{
+    int lo = 0;
+    int hi = n;
+
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+
+        if (entries[mid].id < id)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    return lo < n && entries[lo].id == id ? entries[lo].database : NULL;
+}
+
+/**
+ * Fetch a monitored server by its node ID
+ *
+ * @param mon     The monitor
+ * @param node_id The node ID
+ * @return The server with the node ID or NULL if none has it
+ */
+static MONITOR_SERVERS *find_server_by_node_id(MONITOR *mon, long node_id)
+{
+    MYSQL_MONITOR *handle = (MYSQL_MONITOR *) mon->handle;
+
+    return handle->n_indexed ?
+           node_index_find(handle->by_node_id, handle->n_indexed, node_id) :
+           getServerByNodeId(mon->databases, node_id);
+}
+
+/**
+ * Fetch a slave of a node
+ *
+ * @param mon     The monitor
+ * @param node_id The node ID of the master
+ * @return A server replicating from the node or NULL if none do
+ */
+static MONITOR_SERVERS *find_slave_of_node_id(MONITOR *mon, long node_id)
+{
+    MYSQL_MONITOR *handle = (MYSQL_MONITOR *) mon->handle;
+
+    return handle->n_indexed ?
+           node_index_find(handle->by_master_id, handle->n_indexed, node_id) :
+           getSlaveOfNodeId(mon->databases, node_id);
+}
+
+/**
+ * Log the changes in the replication topology since the previous round
+ *
+ * The state changes of the servers are logged elsewhere. This logs the
+ * changes that don't show in the states: a server that starts replicating
+ * from another master or moves in the replication tree, and a change of the
+ * root master.
+ *
+ * @param mon         The monitor
+ * @param root_master The root master of this round
+ */
+static void log_topology_changes(MONITOR *mon, MONITOR_SERVERS *root_master)
+{
+    MYSQL_MONITOR *handle = (MYSQL_MONITOR *) mon->handle;
+    SERVER *root = root_master ? root_master->server : NULL;
+    MONITOR_SERVERS *ptr;
+    bool first_round = handle->n_topology == 0;
+    int n = 0;
+
+    for (ptr = mon->databases; ptr; ptr = ptr->next)
+    {
+        n++;
+    }
+
+    if (n > handle->n_topology)
+    {
+        NODE_TOPOLOGY *topology = realloc(handle->topology, n * sizeof(NODE_TOPOLOGY));
+
+        if (topology == NULL)
+        {
+            return;
+        }
+
+        for (int i = handle->n_topology; i < n; i++)
+        {
+            topology[i].master_id = -2;
+            topology[i].depth = -1;
+        }
+        handle->topology = topology;
+        handle->n_topology = n;
+    }
+
+    n = 0;
+
+    for (ptr = mon->databases; ptr; ptr = ptr->next, n++)
+    {
+        NODE_TOPOLOGY *prev = &handle->topology[n];
+        SERVER *server = ptr->server;
+
+        if (SERVER_IS_DOWN(server))
+        {
+            prev->master_id = -2;
+            continue;
+        }
+
+        if (!first_round && prev->master_id != -2 &&
+            (prev->master_id != server->master_id || prev->depth != server->depth))
+        {
+            MXS_NOTICE("Replication topology changed: server %s[%s:%u] now replicates "
+                       "from server_id %ld at depth %d, previously from server_id %ld "
+                       "at depth %d.", server->unique_name, server->name, server->port,
+                       server->master_id, server->depth, prev->master_id, prev->depth);
+        }
+
+        prev->master_id = server->master_id;
+        prev->depth = server->depth;
+    }
+
+    if (!first_round && root != handle->root_master)
+    {
+        MXS_NOTICE("Replication topology changed: the root master is now %s, previously %s.",
+                   root ? root->unique_name : "none",
+                   handle->root_master ? handle->root_master->unique_name : "none");
+    }
+
+    handle->root_master = root;
+}
+
 /*******
  * This function computes the replication tree
  * from a set of MySQL Master/Slave monitored servers
@@ -1372,6 +1796,8 @@ static MONITOR_SERVERS *get_replication_tree(MONITOR *mon, int num_servers)
     long node_id;
     int root_level;
 
+    build_node_index(mon);
+
     ptr = mon->databases;
     root_level = num_servers;
 
@@ -1393,7 +1819,7 @@ static MONITOR_SERVERS *get_replication_tree(MONITOR *mon, int num_servers)
         if (node_id < 1)
         {
             MONITOR_SERVERS *find_slave;
-            find_slave = getSlaveOfNodeId(mon->databases, current->node_id);
+            find_slave = find_slave_of_node_id(mon, current->node_id);
 
             if (find_slave == NULL)
             {
@@ -1420,7 +1846,7 @@ static MONITOR_SERVERS *get_replication_tree(MONITOR *mon, int num_servers)
                 root_level = current->depth;
                 handle->master = ptr;
             }
-            backend = getServerByNodeId(mon->databases, node_id);
+            backend = find_server_by_node_id(mon, node_id);
 
             if (backend)
             {
@@ -1442,7 +1868,7 @@ static MONITOR_SERVERS *get_replication_tree(MONITOR *mon, int num_servers)
                 MONITOR_SERVERS *master;
                 current->depth = depth;
 
-                master = getServerByNodeId(mon->databases, current->master_id);
+                master = find_server_by_node_id(mon, current->master_id);
                 if (master && master->server && master->server->node_id > 0)
                 {
                     add_slave_to_master(master->server->slaves, sizeof(master->server->slaves),
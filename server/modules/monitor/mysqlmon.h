@@ -49,13 +49,31 @@
  * @endverbatim
  */
 
+/**
+ * An entry in an index of the monitored servers
+ */
+typedef struct
+{
+    long id;                   /**< The node ID or the master ID of the server */
+    int position;              /**< Position of the server in the server list of the monitor */
+    MONITOR_SERVERS *database; /**< The server */
+} NODE_INDEX_ENTRY;
+
+/**
+ * The place of a server in the replication topology in the previous round
+ */
+typedef struct
+{
+    long master_id;            /**< Node ID of the master, -2 if the server was down */
+    int depth;                 /**< Replication depth */
+} NODE_TOPOLOGY;
+
 /**
  * The handle for an instance of a MySQL Monitor module
  */
 typedef struct
 {
     SPINLOCK lock; /**< The monitor spinlock */
-    THREAD thread; /**< Monitor thread */
     int shutdown; /**< Flag to shutdown the monitor thread */
     int status; /**< Monitor status */
     unsigned long id; /**< Monitor ID */
@@ -69,6 +87,19 @@ typedef struct
     MONITOR_SERVERS *master; /**< Master server for MySQL Master/Slave replication */
     char* script; /*< Script to call when state changes occur on servers */
     bool events[MAX_MONITOR_EVENT]; /*< enabled events */
+    NODE_INDEX_ENTRY *by_node_id;   /**< The servers sorted by node ID */
+    NODE_INDEX_ENTRY *by_master_id; /**< The servers sorted by the node ID of their master */
+    int n_indexed;                  /**< Number of servers in the indexes, 0 if not built */
+    int index_size;                 /**< Allocated size of the indexes */
+    NODE_TOPOLOGY *topology;        /**< The topology of the previous round, by server position */
+    int n_topology;                 /**< Number of servers in topology, 0 before the first round */
+    SERVER *root_master;            /**< Root master of the previous round */
+    MONITOR_SERVERS *last_root_master; /**< Root master found in the previous round */
+    bool heartbeat_checked;         /**< Whether the heartbeat table replication was checked */
+    bool log_no_master;             /**< Whether a missing master should be logged */
+    uint64_t heartbeat_us;          /**< Time of the last heartbeat written to the master, in microseconds */
+    int heartbeat_us_column;        /**< 1 if the heartbeat table has master_timestamp_us, -1 if it
+                                     * can't be added and 0 if it hasn't been checked */
 } MYSQL_MONITOR;
 
 #endif
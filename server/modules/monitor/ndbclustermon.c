@@ -28,7 +28,7 @@
 
 #include <mysqlmon.h>
 
-static void monitorMain(void *);
+static void monitorRound(MONITOR *);
 
 static char *version_str = "V2.1.0";
 
@@ -180,7 +180,9 @@ startMonitor(void *arg, void* opt)
         memset(handle->events, true, sizeof(handle->events));
     }
 
-    if (thread_start(&handle->thread, monitorMain, mon) == NULL)
+    handle->status = MONITOR_RUNNING;
+
+    if (!mon_schedule_rounds(mon, monitorRound))
     {
         MXS_ERROR("Failed to start monitor thread for monitor '%s'.", mon->name);
     }
@@ -200,7 +202,8 @@ stopMonitor(void *arg)
     MYSQL_MONITOR *handle = (MYSQL_MONITOR *) mon->handle;
 
     handle->shutdown = 1;
-    thread_wait(handle->thread);
+    mon_unschedule_rounds(mon);
+    handle->status = MONITOR_STOPPED;
 }
 
 /**
@@ -359,97 +362,62 @@ monitorDatabase(MONITOR_SERVERS *database, char *defaultUser, char *defaultPassw
 }
 
 /**
- * The entry point for the monitoring module thread
+ * Run one monitoring round
  *
- * @param arg   The handle of the monitor
+ * @param mon   The monitor
  */
 static void
-monitorMain(void *arg)
+monitorRound(MONITOR *mon)
 {
-    MONITOR* mon = arg;
     MYSQL_MONITOR *handle;
     MONITOR_SERVERS *ptr;
-    size_t nrounds = 0;
 
     spinlock_acquire(&mon->lock);
     handle = (MYSQL_MONITOR *) mon->handle;
     spinlock_release(&mon->lock);
 
-    if (mysql_thread_init())
-    {
-        MXS_ERROR("Fatal : mysql_thread_init failed in monitor module. Exiting.");
-        return;
-    }
-    handle->status = MONITOR_RUNNING;
+    ptr = mon->databases;
 
-    while (1)
+    while (ptr)
     {
-        if (handle->shutdown)
-        {
-            handle->status = MONITOR_STOPPING;
-            mysql_thread_end();
-            handle->status = MONITOR_STOPPED;
-            return;
-        }
+        ptr->mon_prev_status = ptr->server->status;
+        monitorDatabase(ptr, mon->user, mon->password, mon);
 
-        /** Wait base interval */
-        thread_millisleep(MON_BASE_INTERVAL_MS);
-        /**
-         * Calculate how far away the monitor interval is from its full
-         * cycle and if monitor interval time further than the base
-         * interval, then skip monitoring checks. Excluding the first
-         * round.
-         */
-        if (nrounds != 0 &&
-            ((nrounds * MON_BASE_INTERVAL_MS) % mon->interval) >=
-            MON_BASE_INTERVAL_MS)
+        if (ptr->server->status != ptr->mon_prev_status ||
+            SERVER_IS_DOWN(ptr->server))
         {
-            nrounds += 1;
-            continue;
+            MXS_DEBUG("Backend server %s:%d state : %s",
+                      ptr->server->name,
+                      ptr->server->port,
+                      STRSRVSTATUS(ptr->server));
         }
-        nrounds += 1;
-        ptr = mon->databases;
 
-        while (ptr)
-        {
-            ptr->mon_prev_status = ptr->server->status;
-            monitorDatabase(ptr, mon->user, mon->password, mon);
-
-            if (ptr->server->status != ptr->mon_prev_status ||
-                SERVER_IS_DOWN(ptr->server))
-            {
-                MXS_DEBUG("Backend server %s:%d state : %s",
-                          ptr->server->name,
-                          ptr->server->port,
-                          STRSRVSTATUS(ptr->server));
-            }
-
-            ptr = ptr->next;
-        }
+        ptr = ptr->next;
+    }
 
-        ptr = mon->databases;
-        monitor_event_t evtype;
+    ptr = mon->databases;
+    monitor_event_t evtype;
 
-        while (ptr)
+    while (ptr)
+    {
+        /** Execute monitor script if a server state has changed */
+        if (mon_status_changed(ptr))
         {
-            /** Execute monitor script if a server state has changed */
-            if (mon_status_changed(ptr))
+            evtype = mon_get_event_type(ptr);
+            if (isNdbEvent(evtype))
             {
-                evtype = mon_get_event_type(ptr);
-                if (isNdbEvent(evtype))
+                mon_log_state_change(ptr);
+                if (handle->script && handle->events[evtype])
                 {
-                    mon_log_state_change(ptr);
-                    if (handle->script && handle->events[evtype])
-                    {
-                        monitor_launch_script(mon, ptr, handle->script);
-                    }
+                    monitor_launch_script(mon, ptr, handle->script);
                 }
             }
-            ptr = ptr->next;
         }
-
-        mon_hangup_failed_servers(mon);
+        ptr = ptr->next;
     }
+
+    server_publish_topology();
+    mon_hangup_failed_servers(mon);
 }
 
 
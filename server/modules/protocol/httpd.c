@@ -64,8 +64,8 @@ static int httpd_hangup(DCB *dcb);
 static int httpd_accept(DCB *dcb);
 static int httpd_close(DCB *dcb);
 static int httpd_listen(DCB *dcb, char *config);
-static int httpd_get_line(int sock, char *buf, int size);
-static void httpd_send_headers(DCB *dcb, int final);
+static void httpd_send_headers(DCB *dcb, int final, const char *content_type, bool keep_alive);
+static void httpd_send_error(DCB *dcb, const char *status);
 static char *httpd_default_auth();
 
 /**
@@ -135,117 +135,238 @@ static char *httpd_default_auth()
 }
 
 /**
- * Read event for EPOLLIN on the httpd protocol module.
+ * Find the end of the request headers
  *
- * @param dcb   The descriptor control block
- * @return
+ * @param data  The buffered request data
+ * @param len   Length of the data
+ * @return      The length of the headers including the empty line that ends
+ *              them or 0 if the headers are not complete
  */
-static int httpd_read_event(DCB* dcb)
+static size_t httpd_header_length(const char *data, size_t len)
 {
-    SESSION *session = dcb->session;
-
-    int numchars = 1;
-    char buf[HTTPD_REQUESTLINE_MAXLEN - 1] = "";
-    char *query_string = NULL;
-    char method[HTTPD_METHOD_MAXLEN - 1] = "";
-    char url[HTTPD_SMALL_BUFFER] = "";
-    size_t i, j;
-    int headers_read = 0;
-    HTTPD_session *client_data = NULL;
-    GWBUF *uri;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (data[i] == '\n')
+        {
+            if (i + 1 < len && data[i + 1] == '\n')
+            {
+                return i + 2;
+            }
+            if (i + 2 < len && data[i + 1] == '\r' && data[i + 2] == '\n')
+            {
+                return i + 3;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Parse the request line and the headers of a request
+ *
+ * @param client_data   The HTTPD session data
+ * @param headers       The NUL terminated request headers
+ * @param request       The parsed request
+ * @return              True if the request line is valid
+ */
+static bool httpd_parse_request(HTTPD_session *client_data, char *headers, HTTPD_request *request)
+{
+    char *line = headers;
+    char *next;
+    char *ptr;
+    size_t i;
 
-    client_data = dcb->data;
+    request->keep_alive = false;
+    request->content_length = 0;
+    request->url[0] = '\0';
 
     /**
-     * get the request line
+     * The request line
      * METHOD URL HTTP_VER\r\n
      */
-
-    numchars = httpd_get_line(dcb->fd, buf, sizeof(buf));
-
-    i = 0;
-    j = 0;
-    while (!ISspace(buf[j]) && (i < sizeof(method) - 1))
+    if ((next = strchr(line, '\n')) != NULL)
     {
-        method[i] = buf[j];
-        i++;
-        j++;
+        *next++ = '\0';
     }
-    method[i] = '\0';
 
-    strcpy(client_data->method, method);
+    ptr = line;
+    for (i = 0; *ptr && !ISspace(*ptr) && i < sizeof(client_data->method) - 1; i++)
+    {
+        client_data->method[i] = *ptr++;
+    }
+    client_data->method[i] = '\0';
 
-    /* check allowed http methods */
-    if (strcasecmp(method, "GET") && strcasecmp(method, "POST"))
+    while (*ptr && ISspace(*ptr))
     {
-        //httpd_unimplemented(dcb->fd);
-        return 0;
+        ptr++;
     }
 
-    i = 0;
+    for (i = 0; *ptr && !ISspace(*ptr) && i < sizeof(request->url) - 1; i++)
+    {
+        request->url[i] = *ptr++;
+    }
+    request->url[i] = '\0';
 
-    while ( (j < sizeof(buf)) && ISspace(buf[j]))
+    while (*ptr && ISspace(*ptr))
     {
-        j++;
+        ptr++;
     }
 
-    while ((j < sizeof(buf) - 1) && !ISspace(buf[j]) && (i < sizeof(url) - 1))
+    if (*client_data->method == '\0' || *request->url == '\0')
     {
-        url[i] = buf[j];
-        i++;
-        j++;
+        return false;
     }
 
-    url[i] = '\0';
+    /** HTTP/1.1 connections are persistent by default, older ones are not */
+    request->http11 = strncasecmp(ptr, "HTTP/1.1", 8) == 0;
+    request->keep_alive = request->http11;
 
     /**
      * Get the query string if availble
      */
-
-    if (strcasecmp(method, "GET") == 0)
+    if (strcasecmp(client_data->method, "GET") == 0 &&
+        (ptr = strchr(request->url, '?')) != NULL)
     {
-        query_string = url;
-        while ((*query_string != '?') && (*query_string != '\0'))
-        {
-            query_string++;
-        }
-        if (*query_string == '?')
-        {
-            *query_string = '\0';
-        }
+        *ptr = '\0';
     }
 
     /**
      * Get the request headers
      */
-
-    while ((numchars > 0) && strcmp("\n", buf))
+    while ((line = next) != NULL)
     {
-        char *value = NULL;
-        char *end = NULL;
-        numchars = httpd_get_line(dcb->fd, buf, sizeof(buf));
-        if ((value = strchr(buf, ':')))
+        char *value;
+        char *end;
+
+        if ((next = strchr(line, '\n')) != NULL)
+        {
+            *next++ = '\0';
+        }
+
+        if ((value = strchr(line, ':')) == NULL)
+        {
+            continue;
+        }
+
+        *value++ = '\0';
+        while (*value && ISspace(*value))
         {
-            *value = '\0';
             value++;
-            end = &value[strlen(value) - 1];
-            *end = '\0';
+        }
+        end = value + strlen(value);
+        while (end > value && ISspace(end[-1]))
+        {
+            *--end = '\0';
+        }
 
-            if (strncasecmp(buf, "Hostname", 6) == 0)
+        if (strcasecmp(line, "Host") == 0)
+        {
+            strncpy(client_data->hostname, value, sizeof(client_data->hostname) - 1);
+        }
+        else if (strcasecmp(line, "User-Agent") == 0)
+        {
+            strncpy(client_data->useragent, value, sizeof(client_data->useragent) - 1);
+        }
+        else if (strcasecmp(line, "Content-Length") == 0)
+        {
+            request->content_length = strtol(value, NULL, 10);
+        }
+        else if (strcasecmp(line, "Connection") == 0)
+        {
+            if (strcasestr(value, "close"))
             {
-                strcpy(client_data->hostname, value);
+                request->keep_alive = false;
             }
-            if (strncasecmp(buf, "useragent", 9) == 0)
+            else if (strcasestr(value, "keep-alive"))
             {
-                strcpy(client_data->useragent, value);
+                request->keep_alive = request->http11;
             }
         }
     }
 
-    if (numchars)
+    return true;
+}
+
+/**
+ * Handle one complete request from the buffered input
+ *
+ * The response to a request that keeps the connection open is sent with
+ * the chunked transfer encoding. The router writes its response while the
+ * request is routed, each write becomes one chunk and the response ends
+ * when the routing returns.
+ *
+ * @param dcb   The client DCB
+ * @return      1 if a request was handled, 0 if no complete request is
+ *              buffered and -1 if the connection was closed
+ */
+static int httpd_process_request(DCB *dcb)
+{
+    HTTPD_session *client_data = dcb->data;
+    char headers[HTTPD_HEADER_MAXLEN + 1];
+    HTTPD_request request;
+    size_t avail, header_len;
+    GWBUF *uri;
+
+    if (client_data->request == NULL)
+    {
+        return 0;
+    }
+
+    client_data->request = gwbuf_make_contiguous(client_data->request);
+    avail = GWBUF_LENGTH(client_data->request);
+    header_len = httpd_header_length((char *)GWBUF_DATA(client_data->request), avail);
+
+    if (header_len == 0)
     {
-        headers_read = 1;
-        memcpy(&client_data->headers_received, &headers_read, sizeof(int));
+        if (avail > HTTPD_HEADER_MAXLEN)
+        {
+            httpd_send_error(dcb, "431 Request Header Fields Too Large");
+            dcb_close(dcb);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (header_len > HTTPD_HEADER_MAXLEN)
+    {
+        httpd_send_error(dcb, "431 Request Header Fields Too Large");
+        dcb_close(dcb);
+        return -1;
+    }
+
+    memcpy(headers, GWBUF_DATA(client_data->request), header_len);
+    headers[header_len] = '\0';
+
+    if (!httpd_parse_request(client_data, headers, &request))
+    {
+        httpd_send_error(dcb, "400 Bad Request");
+        dcb_close(dcb);
+        return -1;
+    }
+
+    if (request.content_length < 0 || request.content_length > HTTPD_BODY_MAXLEN)
+    {
+        httpd_send_error(dcb, "413 Payload Too Large");
+        dcb_close(dcb);
+        return -1;
+    }
+
+    /** The body is not used but it must be received before the next request */
+    if (header_len + request.content_length > avail)
+    {
+        return 0;
+    }
+    client_data->request = gwbuf_consume(client_data->request, header_len + request.content_length);
+    client_data->headers_received = 1;
+    client_data->n_requests++;
+
+    /* check allowed http methods */
+    if (strcasecmp(client_data->method, "GET") && strcasecmp(client_data->method, "POST"))
+    {
+        httpd_send_error(dcb, "501 Not Implemented");
+        dcb_close(dcb);
+        return -1;
     }
 
     /**
@@ -253,46 +374,60 @@ static int httpd_read_event(DCB* dcb)
      */
 
     /* send all the basic headers and close with \r\n */
-    httpd_send_headers(dcb, 1);
+    httpd_send_headers(dcb, 1, strcmp(request.url, "/metrics") == 0 ?
+                       HTTPD_OPENMETRICS_CONTENT_TYPE : "application/json",
+                       request.keep_alive);
 
-#if 0
-    /**
-     * ToDO: launch proper content handling based on the requested URI, later REST interface
-     *
-     */
-    if (strcmp(url, "/show") == 0)
+    if ((uri = gwbuf_alloc(strlen(request.url) + 1)) != NULL)
     {
-        if (query_string && strlen(query_string))
-        {
-            if (strcmp(query_string, "dcb") == 0)
-            {
-                dprintAllDCBs(dcb);
-            }
-            if (strcmp(query_string, "session") == 0)
-            {
-                dprintAllSessions(dcb);
-            }
-        }
+        strcpy((char *)GWBUF_DATA(uri), request.url);
+        gwbuf_set_type(uri, GWBUF_TYPE_HTTP);
+        client_data->chunked = request.keep_alive;
+        SESSION_ROUTE_QUERY(dcb->session, uri);
+        client_data->chunked = false;
     }
-    if (strcmp(url, "/services") == 0)
+
+    if (!request.keep_alive)
     {
-        RESULTSET *set, *seviceGetList();
-        if ((set = serviceGetList()) != NULL)
-        {
-            resultset_stream_json(set, dcb);
-            resultset_free(set);
-        }
+        /* force the client connecton close */
+        dcb_close(dcb);
+        return -1;
     }
-#endif
-    if ((uri = gwbuf_alloc(strlen(url) + 1)) != NULL)
+
+    /** The last chunk ends the response */
+    dcb_printf(dcb, "0\r\n\r\n");
+
+    return 1;
+}
+
+/**
+ * Read event for EPOLLIN on the httpd protocol module.
+ *
+ * The requests are buffered until they are complete. All buffered requests
+ * are handled in the order they were sent, which allows the clients to
+ * pipeline requests on a persistent connection.
+ *
+ * @param dcb   The descriptor control block
+ * @return
+ */
+static int httpd_read_event(DCB* dcb)
+{
+    HTTPD_session *client_data = dcb->data;
+    GWBUF *head = NULL;
+
+    if (dcb_read(dcb, &head, 0) < 0)
     {
-        strcpy((char *)GWBUF_DATA(uri), url);
-        gwbuf_set_type(uri, GWBUF_TYPE_HTTP);
-        SESSION_ROUTE_QUERY(session, uri);
+        gwbuf_free(head);
+        dcb_close(dcb);
+        return 0;
     }
 
-    /* force the client connecton close */
-    dcb_close(dcb);
+    client_data->request = gwbuf_append(client_data->request, head);
+
+    while (httpd_process_request(dcb) > 0)
+    {
+        ;
+    }
 
     return 0;
 }
@@ -319,7 +454,33 @@ static int httpd_write_event(DCB *dcb)
  */
 static int httpd_write(DCB *dcb, GWBUF *queue)
 {
+    HTTPD_session *client_data = dcb->data;
     int rc;
+
+    if (client_data && client_data->chunked)
+    {
+        size_t len = gwbuf_length(queue);
+        GWBUF *head, *tail;
+
+        /** An empty chunk would end the response */
+        if (len == 0)
+        {
+            gwbuf_free(queue);
+            return 1;
+        }
+
+        if ((head = gwbuf_alloc(HTTPD_CHUNK_HEADER_LEN)) == NULL ||
+            (tail = gwbuf_alloc_and_load(2, "\r\n")) == NULL)
+        {
+            gwbuf_free(head);
+            gwbuf_free(queue);
+            return 0;
+        }
+        GWBUF_RTRIM(head, HTTPD_CHUNK_HEADER_LEN -
+                    snprintf((char *)GWBUF_DATA(head), HTTPD_CHUNK_HEADER_LEN, "%zx\r\n", len));
+        queue = gwbuf_append(gwbuf_append(head, queue), tail);
+    }
+
     rc = dcb_write(dcb, queue);
     return rc;
 }
@@ -390,6 +551,13 @@ static int httpd_accept(DCB *listener)
 
 static int httpd_close(DCB *dcb)
 {
+    HTTPD_session *client_data = dcb->data;
+
+    if (client_data && client_data->request)
+    {
+        gwbuf_free(client_data->request);
+        client_data->request = NULL;
+    }
     return 0;
 }
 
@@ -404,55 +572,13 @@ static int httpd_listen(DCB *listener, char *config)
     return (dcb_listen(listener, config, "HTTPD") < 0) ? 0 : 1;
 }
 
-/**
- * HTTPD get line from client
- */
-static int httpd_get_line(int sock, char *buf, int size)
-{
-    int i = 0;
-    char c = '\0';
-    int n;
-
-    while ((i < size - 1) && (c != '\n'))
-    {
-        n = recv(sock, &c, 1, 0);
-        /* DEBUG printf("%02X\n", c); */
-        if (n > 0)
-        {
-            if (c == '\r')
-            {
-                n = recv(sock, &c, 1, MSG_PEEK);
-                /* DEBUG printf("%02X\n", c); */
-                if ((n > 0) && (c == '\n'))
-                {
-                    if (recv(sock, &c, 1, 0) < 0)
-                    {
-                        c = '\n';
-                    }
-                }
-                else
-                {
-                    c = '\n';
-                }
-            }
-            buf[i] = c;
-            i++;
-        }
-        else
-        {
-            c = '\n';
-        }
-    }
-
-    buf[i] = '\0';
-
-    return i;
-}
-
 /**
  * HTTPD send basic headers with 200 OK
+ *
+ * A response on a persistent connection uses the chunked transfer encoding
+ * as the length of the content is not known when the headers are sent.
  */
-static void httpd_send_headers(DCB *dcb, int final)
+static void httpd_send_headers(DCB *dcb, int final, const char *content_type, bool keep_alive)
 {
     char date[64] = "";
     const char *fmt = "%a, %d %b %Y %H:%M:%S GMT";
@@ -464,8 +590,9 @@ static void httpd_send_headers(DCB *dcb, int final)
 
     dcb_printf(dcb,
                "HTTP/1.1 200 OK\r\nDate: %s\r\nServer: %s\r\nConnection: "
-               "close\r\nContent-Type: application/json\r\n",
-               date, HTTP_SERVER_STRING);
+               "%s\r\nContent-Type: %s\r\n%s",
+               date, HTTP_SERVER_STRING, keep_alive ? "keep-alive" : "close", content_type,
+               keep_alive ? "Transfer-Encoding: chunked\r\n" : "");
 
     /* close the headers */
     if (final)
@@ -473,3 +600,16 @@ static void httpd_send_headers(DCB *dcb, int final)
         dcb_printf(dcb, "\r\n");
     }
 }
+
+/**
+ * HTTPD send an error response and a request to close the connection
+ *
+ * @param dcb           The client DCB
+ * @param status        The status code and the reason phrase
+ */
+static void httpd_send_error(DCB *dcb, const char *status)
+{
+    dcb_printf(dcb,
+               "HTTP/1.1 %s\r\nServer: %s\r\nConnection: close\r\nContent-Length: 0\r\n\r\n",
+               status, HTTP_SERVER_STRING);
+}
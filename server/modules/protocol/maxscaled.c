@@ -287,8 +287,8 @@ static int maxscaled_read_event(DCB* dcb)
 
                 case MAXSCALED_STATE_DATA:
                     {
+                        /** The router marks the end of the output with OK */
                         SESSION_ROUTE_QUERY(dcb->session, head);
-                        dcb_printf(dcb, "OK");
                     }
                     break;
                 }
@@ -16,9 +16,11 @@
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <modutil.h>
+#include <mysql_utils.h>
 #include <utils.h>
 #include <netinet/tcp.h>
 #include <gw.h>
+#include <maxscale/poll.h>
 
 /* The following can be compared using memcmp to detect a null password */
 uint8_t null_client_sha1[MYSQL_SCRAMBLE_LEN]="";
@@ -82,6 +84,7 @@ static char *gw_backend_default_auth();
 static GWBUF* process_response_data(DCB* dcb, GWBUF** readbuf, int nbytes_to_process);
 extern char* create_auth_failed_msg(GWBUF* readbuf, char* hostaddr, uint8_t* sha1);
 static bool sescmd_response_complete(DCB* dcb);
+static void gw_read_session_state(DCB *dcb, GWBUF *reply);
 static int gw_read_reply_or_error(DCB *dcb, MYSQL_session local_session);
 static int gw_read_and_write(DCB *dcb, MYSQL_session local_session);
 static int gw_read_backend_handshake(MySQLProtocol *conn);
@@ -92,9 +95,10 @@ static mysql_auth_state_t gw_send_authentication_to_backend(char *dbname,
                                       uint8_t *passwd,
                                       MySQLProtocol *conn);
 static uint32_t create_capabilities(MySQLProtocol *conn, bool db_specified, bool compress);
+static bool backend_wants_compression(MySQLProtocol *conn);
 static int response_length(MySQLProtocol *conn, char *user, uint8_t *passwd, char *dbname);
 static uint8_t *load_hashed_password(MySQLProtocol *conn, uint8_t *payload, uint8_t *passwd);
-static int gw_do_connect_to_backend(char *host, int port, int *fd);
+static int gw_do_connect_to_backend(SERVER *server, int *fd);
 static void inline close_socket(int socket);
 static GWBUF *gw_create_change_user_packet(MYSQL_session*  mses,
                                     MySQLProtocol*  protocol);
@@ -107,6 +111,8 @@ static int gw_send_change_user_to_backend(char          *dbname,
 static int gw_session(DCB *backend_dcb, void *data);
 #endif
 static bool gw_get_shared_session_auth_info(DCB* dcb, MYSQL_session* session);
+static int gw_reset_persistent(DCB *dcb, void *data);
+static bool gw_skip_reset_replies(DCB *dcb, GWBUF **read_buffer);
 
 static GWPROTOCOL MyObject = {
                               gw_read_backend_event, /* Read - EPOLLIN handler        */
@@ -119,7 +125,7 @@ static GWPROTOCOL MyObject = {
                               gw_backend_close, /* Close                         */
                               NULL, /* Listen                        */
                               gw_change_user, /* Authentication                */
-                              NULL, /* Session                       */
+                              gw_reset_persistent, /* Session                       */
                               gw_backend_default_auth, /* Default authenticator */
                               NULL  /**< Connection limit reached      */
 };
@@ -237,7 +243,7 @@ static int gw_create_backend_connection(DCB *backend_dcb,
 
     /*< if succeed, fd > 0, -1 otherwise */
     /* TODO: Better if function returned a protocol auth state */
-    rv = gw_do_connect_to_backend(server->name, server->port, &fd);
+    rv = gw_do_connect_to_backend(server, &fd);
     /*< Assign protocol with backend_dcb */
     backend_dcb->protocol = protocol;
 
@@ -297,9 +303,10 @@ return_fd:
  *
  * This routine creates socket and connects to a backend server.
  * Connect it non-blocking operation. If connect fails, socket is closed.
+ * The address of the server is resolved by server_get_address, which only
+ * does a name lookup when the cached address has expired.
  *
- * @param host The host to connect to
- * @param port The host TCP/IP port
+ * @param server The server to connect to
  * @param *fd where connected fd is copied
  * @return 0/1 on success and -1 on failure
  * If successful, fd has file descriptor to socket which is connected to
@@ -307,8 +314,10 @@ return_fd:
  *
  */
 static int
-gw_do_connect_to_backend(char *host, int port, int *fd)
+gw_do_connect_to_backend(SERVER *server, int *fd)
 {
+    char *host = server->name;
+    int port = server->port;
     struct sockaddr_in serv_addr;
     int rv;
     int so = 0;
@@ -332,7 +341,16 @@ gw_do_connect_to_backend(char *host, int port, int *fd)
         goto return_rv;
     }
     /* prepare for connect */
-    setipaddress(&serv_addr.sin_addr, host);
+    if (!server_get_address(server, &serv_addr.sin_addr))
+    {
+        MXS_ERROR("Establishing connection to backend server "
+                  "%s:%d failed, the address could not be resolved.",
+                  host,
+                  port);
+        rv = -1;
+        close_socket(so);
+        goto return_rv;
+    }
     serv_addr.sin_port = htons(port);
     bufsize = GW_BACKEND_SO_SNDBUF;
 
@@ -386,6 +404,8 @@ gw_do_connect_to_backend(char *host, int port, int *fd)
         goto return_rv;
     }
 
+    poll_set_socket_busy_poll(so);
+
     /* set socket to as non-blocking here */
     setnonblocking(so);
     rv = connect(so, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
@@ -650,6 +670,7 @@ gw_read_backend_handshake(MySQLProtocol *conn)
                               dcb->server->port);
 
                     server_set_status(dcb->server, SERVER_MAINT);
+                    server_publish_topology();
                 }
 
                 free(bufstr);
@@ -747,8 +768,9 @@ gw_send_authentication_to_backend(char *dbname,
         return MYSQL_AUTH_FAILED;
     }
 
-    capabilities = create_capabilities(conn, (dbname && strlen(dbname)), false);
+    capabilities = create_capabilities(conn, (dbname && strlen(dbname)), backend_wants_compression(conn));
     gw_mysql_set_byte4(client_capabilities, capabilities);
+    conn->session_track = capabilities & (uint32_t)GW_MYSQL_CAPABILITIES_SESSION_TRACK;
 
     bytes = response_length(conn, user, passwd, dbname);
 
@@ -901,6 +923,8 @@ gw_read_reply_or_error(DCB *dcb, MYSQL_session local_session)
                     break;
                 case 1:
                     backend_protocol->protocol_auth_state = MYSQL_IDLE;
+                    /** Everything after the OK packet is compressed */
+                    backend_protocol->compress = backend_wants_compression(backend_protocol);
                     MXS_DEBUG("%lu [gw_read_backend_event] "
                           "gw_receive_backend_auth succeed. "
                           "dcb %p fd %d, user %s.",
@@ -934,10 +958,16 @@ gw_read_reply_or_error(DCB *dcb, MYSQL_session local_session)
              * First free delay queue - which is only ever processed while
              * authlock is held.
              */
+            dcb_account_memory(dcb, -(int)gwbuf_length(dcb->delayq));
             gwbuf_free(dcb->delayq);
             dcb->delayq = NULL;
             spinlock_release(&dcb->authlock);
 
+            if (dcb_pool_fill_done(dcb, false))
+            {
+                return 1;
+            }
+
             /* Only reload the users table if authentication failed and the
              * client session is not stopping. It is possible that authentication
              * fails because the client has closed the connection before all
@@ -945,7 +975,7 @@ gw_read_reply_or_error(DCB *dcb, MYSQL_session local_session)
             if (backend_protocol->protocol_auth_state == MYSQL_AUTH_FAILED &&
                 dcb->session->state != SESSION_STATE_STOPPING)
             {
-                service_refresh_users(dcb->session->service);
+                service_refresh_users_async(dcb->session->service);
             }
 #if defined(SS_DEBUG)
             MXS_DEBUG("%lu [gw_read_backend_event] "
@@ -996,6 +1026,14 @@ gw_read_reply_or_error(DCB *dcb, MYSQL_session local_session)
                   dcb->fd,
                   local_session.user);
 
+            if (dcb->flags & DCBF_POOL_FILL)
+            {
+                /** Nothing is sent through a connection opened for the pool */
+                spinlock_release(&dcb->authlock);
+                dcb_pool_fill_done(dcb, true);
+                return 0;
+            }
+
             /* check the delay queue and flush the data */
             if (dcb->delayq)
             {
@@ -1008,6 +1046,84 @@ gw_read_reply_or_error(DCB *dcb, MYSQL_session local_session)
     return 2;
 } /* MYSQL_AUTH_RECV || MYSQL_AUTH_FAILED */
 
+/**
+ * Check whether the replies read from a backend can be given to the router
+ * as they are read. This is the case when the router accepts partial packets
+ * and no reply has to be handled as a whole by the protocol.
+ *
+ * @param dcb The backend DCB
+ * @return True if the data can be routed without waiting for complete packets
+ */
+static bool gw_backend_streams_replies(DCB *dcb)
+{
+    MySQLProtocol *proto = (MySQLProtocol *)dcb->protocol;
+
+    return (dcb->session->service->router->getCapabilities() & (int)RCAP_TYPE_PACKET_INPUT) &&
+        proto->ignore_replies == 0 &&
+        protocol_get_srv_command(proto, false) == MYSQL_COM_UNDEFINED;
+}
+
+/**
+ * Give data read from a backend to the router. The reply tracker of the
+ * protocol follows the data first so that the router can see where the
+ * replies end.
+ *
+ * @param dcb   The backend DCB
+ * @param reply The data, freed if it can't be routed
+ * @return 1 if the data was routed, 0 otherwise
+ */
+static int gw_route_reply(DCB *dcb, GWBUF *reply)
+{
+    SESSION *session = dcb->session;
+    int rc = 0;
+
+    protocol_track_reply(&((MySQLProtocol *)dcb->protocol)->reply_tracker, reply);
+
+    /**
+     * Check that session is operable, and that client DCB is
+     * still listening the socket for replies.
+     */
+    if (session->state == SESSION_STATE_ROUTER_READY &&
+        session->client_dcb != NULL &&
+        session->client_dcb->state == DCB_STATE_POLLING &&
+        (session->router_session ||
+         session->service->router->getCapabilities() & (int)RCAP_TYPE_NO_RSESSION))
+    {
+        MySQLProtocol *client_protocol = (MySQLProtocol *)session->client_dcb->protocol;
+
+        if (client_protocol != NULL)
+        {
+            CHK_PROTOCOL(client_protocol);
+
+            if (client_protocol->protocol_auth_state == MYSQL_IDLE)
+            {
+                gwbuf_set_type(reply, GWBUF_TYPE_MYSQL);
+
+                session->service->router->clientReply(session->service->router_instance,
+                                                      session->router_session,
+                                                      reply, dcb);
+                rc = 1;
+            }
+        }
+        else if (session->client_dcb->dcb_role == DCB_ROLE_INTERNAL)
+        {
+            gwbuf_set_type(reply, GWBUF_TYPE_MYSQL);
+            session->service->router->clientReply(session->service->router_instance,
+                                                  session->router_session,
+                                                  reply, dcb);
+            rc = 1;
+        }
+    }
+
+    if (rc == 0)
+    {
+        /*< session is closing; replying to client isn't possible */
+        gwbuf_free(reply);
+    }
+
+    return rc;
+}
+
 /**
  * @brief With authentication completed, read new data and write to backend
  *
@@ -1026,7 +1142,7 @@ gw_read_and_write(DCB *dcb, MYSQL_session local_session)
         CHK_SESSION(session);
 
         /* read available backend data */
-        return_code = dcb_read(dcb, &read_buffer, 0);
+        return_code = mysql_dcb_read(dcb, &read_buffer, 0);
 
         if (return_code < 0)
         {
@@ -1066,6 +1182,8 @@ gw_read_and_write(DCB *dcb, MYSQL_session local_session)
             ss_dassert(read_buffer != NULL);
         }
 
+        QUERY_TRACE_POINT(session, QTRACE_FIRST_BYTE);
+
         if (nbytes_read < 3)
         {
             dcb->dcb_readqueue = read_buffer;
@@ -1073,8 +1191,44 @@ gw_read_and_write(DCB *dcb, MYSQL_session local_session)
             goto return_rc;
         }
 
+        return_code = 0;
+
+        if (gw_backend_streams_replies(dcb))
+        {
+            /**
+             * The router takes the data as it was read, partial packets
+             * included, so there is no need to wait for complete packets.
+             */
+            return_code = gw_route_reply(dcb, read_buffer);
+            modutil_framer_init(&((MySQLProtocol *)dcb->protocol)->framer);
+            goto return_rc;
+        }
+        else
+        {
+            reply_tracker_t *tracker = &((MySQLProtocol *)dcb->protocol)->reply_tracker;
+            uint32_t left;
+
+            /**
+             * Finish the packet that was being streamed. If its header was
+             * incomplete, the rest of the header is routed first and then the
+             * payload it announces, so that the framer starts at a boundary.
+             */
+            while (read_buffer && (left = protocol_reply_tracker_left(tracker)) > 0)
+            {
+                return_code = gw_route_reply(dcb, gwbuf_split(&read_buffer, left));
+                /** The data the framer parsed no longer begins the chain */
+                modutil_framer_init(&((MySQLProtocol *)dcb->protocol)->framer);
+            }
+
+            if (read_buffer == NULL)
+            {
+                goto return_rc;
+            }
+        }
+
         {
-            GWBUF *tmp = modutil_get_complete_packets(&read_buffer);
+            GWBUF *tmp = modutil_framer_get_complete(&((MySQLProtocol *)dcb->protocol)->framer,
+                                                     &read_buffer);
             /* Put any residue into the read queue */
             spinlock_acquire(&dcb->authlock);
             dcb->dcb_readqueue = read_buffer;
@@ -1082,7 +1236,6 @@ gw_read_and_write(DCB *dcb, MYSQL_session local_session)
             if (tmp == NULL)
             {
                 /** No complete packets */
-                return_code = 0;
                 goto return_rc;
             }
             else
@@ -1091,6 +1244,41 @@ gw_read_and_write(DCB *dcb, MYSQL_session local_session)
             }
         }
 
+        if (((MySQLProtocol *)dcb->protocol)->ignore_replies > 0 &&
+            !gw_skip_reset_replies(dcb, &read_buffer))
+        {
+            GWBUF* errbuf;
+            bool succp;
+            errbuf = mysql_create_custom_error(1,
+                                               0,
+                                               "Resetting a persistent backend connection failed");
+
+            session->service->router->handleError(
+                session->service->router_instance,
+                                session->router_session,
+                                errbuf,
+                                dcb,
+                                ERRACT_NEW_CONNECTION,
+                                &succp);
+            gwbuf_free(errbuf);
+
+            if (!succp)
+            {
+                spinlock_acquire(&session->ses_lock);
+                session->state = SESSION_STATE_STOPPING;
+                spinlock_release(&session->ses_lock);
+            }
+            return_code = 0;
+            goto return_rc;
+        }
+
+        if (read_buffer == NULL)
+        {
+            /** Only responses to the reset were read */
+            return_code = 0;
+            goto return_rc;
+        }
+
     do
     {
         GWBUF *stmt = NULL;
@@ -1110,6 +1298,7 @@ gw_read_and_write(DCB *dcb, MYSQL_session local_session)
                 stmt = gwbuf_append(stmt, read_buffer);
                 spinlock_acquire(&dcb->authlock);
                 dcb->dcb_readqueue = gwbuf_append(stmt, dcb->dcb_readqueue);
+                modutil_framer_init(&((MySQLProtocol *)dcb->protocol)->framer);
                 spinlock_release(&dcb->authlock);
                 return_code = 0;
                 goto return_rc;
@@ -1125,6 +1314,8 @@ gw_read_and_write(DCB *dcb, MYSQL_session local_session)
                 return_code = 0;
                 goto return_rc;
             }
+
+            gw_read_session_state(dcb, stmt);
         }
         else
         {
@@ -1132,43 +1323,9 @@ gw_read_and_write(DCB *dcb, MYSQL_session local_session)
             read_buffer = NULL;
         }
 
-        /**
-         * Check that session is operable, and that client DCB is
-         * still listening the socket for replies.
-         */
-        if (dcb->session->state == SESSION_STATE_ROUTER_READY &&
-            dcb->session->client_dcb != NULL &&
-            dcb->session->client_dcb->state == DCB_STATE_POLLING &&
-            (session->router_session ||
-             session->service->router->getCapabilities() & (int)RCAP_TYPE_NO_RSESSION))
-        {
-            MySQLProtocol *client_protocol = (MySQLProtocol *)dcb->session->client_dcb->protocol;
-            if (client_protocol != NULL)
-            {
-                CHK_PROTOCOL(client_protocol);
-
-                if (client_protocol->protocol_auth_state == MYSQL_IDLE)
-                {
-                    gwbuf_set_type(stmt, GWBUF_TYPE_MYSQL);
-
-                    session->service->router->clientReply(session->service->router_instance,
-                                                          session->router_session,
-                                                          stmt, dcb);
-                    return_code = 1;
-                }
-            }
-            else if (dcb->session->client_dcb->dcb_role == DCB_ROLE_INTERNAL)
-            {
-                gwbuf_set_type(stmt, GWBUF_TYPE_MYSQL);
-                session->service->router->clientReply(session->service->router_instance,
-                                                      session->router_session,
-                                                      stmt, dcb);
-                return_code = 1;
-            }
-        }
-        else /*< session is closing; replying to client isn't possible */
+        if (gw_route_reply(dcb, stmt))
         {
-            gwbuf_free(stmt);
+            return_code = 1;
         }
     }
     while (read_buffer);
@@ -1317,7 +1474,7 @@ static int gw_MySQLWrite_backend(DCB *dcb, GWBUF *queue)
                 protocol_add_srv_command(backend_protocol, cmd);
             }
             /** Write to backend */
-            rc = dcb_write(dcb, queue);
+            rc = mysql_dcb_write(dcb, queue);
         }
         break;
 
@@ -1373,6 +1530,10 @@ static int gw_error_backend_event(DCB *dcb)
     session_state_t ses_state;
 
     CHK_DCB(dcb);
+    if (dcb_pool_fill_done(dcb, false))
+    {
+        return 1;
+    }
     session = dcb->session;
     CHK_SESSION(session);
     if (SESSION_STATE_DUMMY == session->state)
@@ -1505,6 +1666,11 @@ static int gw_backend_hangup(DCB *dcb)
         dcb->dcb_errhandle_called = true;
         goto retblock;
     }
+
+    if (dcb_pool_fill_done(dcb, false))
+    {
+        goto retblock;
+    }
     session = dcb->session;
 
     if (session == NULL)
@@ -1656,6 +1822,7 @@ static int gw_backend_close(DCB *dcb)
 static void backend_set_delayqueue(DCB *dcb, GWBUF *queue)
 {
     /* Append data */
+    dcb_account_memory(dcb, gwbuf_length(queue));
     dcb->delayq = gwbuf_append(dcb->delayq, queue);
 }
 
@@ -1680,6 +1847,7 @@ static int backend_write_delayqueue(DCB *dcb)
     {
         localq = dcb->delayq;
         dcb->delayq = NULL;
+        dcb_account_memory(dcb, -(int)gwbuf_length(localq));
 
         if (MYSQL_IS_CHANGE_USER(((uint8_t *)GWBUF_DATA(localq))))
         {
@@ -1695,7 +1863,7 @@ static int backend_write_delayqueue(DCB *dcb)
             localq = gwbuf_consume(localq, GWBUF_LENGTH(localq));
             localq = gwbuf_append(localq, new_packet);
         }
-        rc = dcb_write(dcb, localq);
+        rc = mysql_dcb_write(dcb, localq);
     }
 
     if (rc == 0)
@@ -1840,21 +2008,11 @@ static int gw_change_user(DCB *backend,
 
     if (auth_ret != 0)
     {
-        if (service_refresh_users(backend->session->client_dcb->service) == 0)
-        {
-            /* Try authentication again with new repository data */
-            /* Note: if no auth client authentication will fail */
-            spinlock_acquire(&in_session->ses_lock);
-            strncpy(current_session->db, "", MYSQL_DATABASE_MAXLEN);
-            auth_ret = gw_check_mysql_scramble_data(
-                                                    backend->session->client_dcb,
-                                                    auth_token, auth_token_len,
-                                                    client_protocol->scramble,
-                                                    sizeof(client_protocol->scramble),
-                                                    username, client_sha1);
-            strncpy(current_session->db, current_database, MYSQL_DATABASE_MAXLEN);
-            spinlock_release(&in_session->ses_lock);
-        }
+        /**
+         * Reload the users in the background so that a retry with new
+         * repository data succeeds, without blocking this thread.
+         */
+        service_refresh_users_async(backend->session->client_dcb->service);
     }
 
     /* let's free the auth_token now */
@@ -2080,6 +2238,7 @@ static GWBUF* process_response_data(DCB* dcb,
                      * and restore the response status to the initial number of packets */
                     spinlock_acquire(&dcb->authlock);
                     dcb->dcb_readqueue = gwbuf_append(outbuf, dcb->dcb_readqueue);
+                    modutil_framer_init(&p->framer);
                     spinlock_release(&dcb->authlock);
                     protocol_set_response_status(p, initial_packets, initial_bytes);
                     return NULL;
@@ -2121,6 +2280,125 @@ static bool sescmd_response_complete(DCB* dcb)
     return succp;
 }
 
+/** Bytes of the reply to a session command that are searched for the state changes */
+#define SESSION_STATE_MAX_OK 1024
+
+/**
+ * Read a length-encoded integer that must end before the end of the data
+ *
+ * @param ptr   Pointer to the integer, moved past it
+ * @param end   End of the data
+ * @param value The value of the integer
+ * @return True if the integer was read
+ */
+static bool read_session_state_int(uint8_t **ptr, uint8_t *end, uint64_t *value)
+{
+    if (*ptr >= end || **ptr == 0xfb || **ptr == 0xff ||
+        leint_bytes(*ptr) > (size_t)(end - *ptr))
+    {
+        return false;
+    }
+
+    *value = leint_consume(ptr);
+    return *value <= (uint64_t)(end - *ptr);
+}
+
+/**
+ * Read the session state changes from the reply to a session command. With
+ * CLIENT_SESSION_TRACK the server lists the changes in the OK packet. When
+ * session_track_state_change is enabled on the server, every statement that
+ * changes the state is marked, so once a mark has been seen, an OK packet
+ * without one means that the command changed nothing. A new default database
+ * is stored in the session so that the connections created later use it.
+ *
+ * @param dcb   Backend DCB
+ * @param reply Complete reply to a session command
+ */
+static void gw_read_session_state(DCB *dcb, GWBUF *reply)
+{
+    MySQLProtocol *proto = (MySQLProtocol *)dcb->protocol;
+    uint8_t packet[SESSION_STATE_MAX_OK];
+    size_t len;
+
+    proto->state_changed = true;
+
+    if (!proto->session_track ||
+        (len = gwbuf_copy_data(reply, 0, sizeof(packet), packet)) <= MYSQL_HEADER_LEN ||
+        MYSQL_GET_PACKET_LEN(packet) + MYSQL_HEADER_LEN > len || !PTR_IS_OK(packet))
+    {
+        return;
+    }
+
+    uint8_t *ptr = packet + MYSQL_HEADER_LEN + 1;
+    uint8_t *end = packet + MYSQL_GET_PACKET_LEN(packet) + MYSQL_HEADER_LEN;
+    uint64_t size;
+
+    /** The affected rows, the insert ID, the status and the warnings */
+    if (!read_session_state_int(&ptr, end, &size) ||
+        !read_session_state_int(&ptr, end, &size) || end - ptr < 4)
+    {
+        return;
+    }
+
+    uint16_t status = gw_mysql_get_byte2(ptr);
+    ptr += 4;
+
+    if (status & MYSQL_SERVER_MORE_RESULTS_EXIST)
+    {
+        /** Only the first of several results is read */
+        return;
+    }
+    else if (!(status & MYSQL_SERVER_SESSION_STATE_CHANGED))
+    {
+        proto->state_changed = !proto->state_tracked;
+        return;
+    }
+
+    /** The info string is followed by the state changes */
+    if (!read_session_state_int(&ptr, end, &size))
+    {
+        return;
+    }
+    ptr += size;
+
+    if (!read_session_state_int(&ptr, end, &size))
+    {
+        return;
+    }
+    end = ptr + size;
+
+    while (ptr < end)
+    {
+        uint8_t type = *ptr++;
+        uint8_t *data;
+
+        if (!read_session_state_int(&ptr, end, &size))
+        {
+            break;
+        }
+
+        data = ptr;
+        ptr += size;
+
+        if (type == MYSQL_SESSION_TRACK_STATE_CHANGE)
+        {
+            proto->state_tracked = true;
+        }
+        else if (type == MYSQL_SESSION_TRACK_SCHEMA &&
+                 read_session_state_int(&data, ptr, &size) && size <= MYSQL_DATABASE_MAXLEN &&
+                 dcb->session && dcb->session->client_dcb && dcb->session->client_dcb->data)
+        {
+            MYSQL_session *ses = (MYSQL_session *)dcb->session->client_dcb->data;
+
+            if (strncmp(ses->db, (char *)data, size) != 0 || ses->db[size] != '\0')
+            {
+                memcpy(ses->db, data, size);
+                ses->db[size] = '\0';
+            }
+        }
+    }
+}
+
 /**
  * gw_decode_mysql_server_handshake
  *
@@ -2183,6 +2461,7 @@ gw_decode_mysql_server_handshake(MySQLProtocol *conn, uint8_t *payload)
 
     // get capabilities part 2 (2 bytes)
     memcpy(&capab_ptr[2], &mysql_server_capabilities_two, 2);
+    conn->server_capabilities = gw_mysql_get_byte4(capab_ptr);
 
     // 2 bytes shift
     payload += 2;
@@ -2337,19 +2616,33 @@ gw_receive_backend_auth(MySQLProtocol *protocol)
     return rc;
 }
 
+/**
+ * Check whether the compressed protocol is used with a backend. It is used
+ * when it is enabled for the server and the server supports it.
+ *
+ * @param conn The MySQLProtocol structure of the backend connection
+ * @return True if the connection should be compressed
+ */
+static bool
+backend_wants_compression(MySQLProtocol *conn)
+{
+    return conn->owner_dcb->server->compression &&
+        (conn->server_capabilities & (uint32_t)GW_MYSQL_CAPABILITIES_COMPRESS);
+}
+
 /**
  * @brief Computes the capabilities bit mask for connecting to backend DB
  *
  * We start by taking the default bitmask and removing any bits not set in
  * the bitmask contained in the connection structure. Then add SSL flag if
  * the connection requires SSL (set from the MaxScale configuration). The
- * compression flag may be set, although compression is NOT SUPPORTED. If a
+ * compression flag may be set. If a
  * database name has been specified in the function call, the relevant flag
  * is set.
  *
  * @param conn  The MySQLProtocol structure for the connection
  * @param db_specified Whether the connection request specified a database
- * @param compress Whether compression is requested - NOT SUPPORTED
+ * @param compress Whether compression is requested
  * @return Bit mask (32 bits)
  * @note Capability bits are defined in mysql_client_server_protocol.h
  */
@@ -2369,7 +2662,6 @@ create_capabilities(MySQLProtocol *conn, bool db_specified, bool compress)
         /* final_capabilities |= (uint32_t)GW_MYSQL_CAPABILITIES_SSL_VERIFY_SERVER_CERT; */
     }
 
-    /* Compression is not currently supported */
     if (compress)
     {
         final_capabilities |= (uint32_t)GW_MYSQL_CAPABILITIES_COMPRESS;
@@ -2391,6 +2683,24 @@ create_capabilities(MySQLProtocol *conn, bool db_specified, bool compress)
 
     final_capabilities |= (int)GW_MYSQL_CAPABILITIES_PLUGIN_AUTH;
 
+    /**
+     * The OK packets are passed to the client as they are, so the state is
+     * tracked only if the client tracks it too.
+     */
+    if (conn->client_capabilities & (uint32_t)GW_MYSQL_CAPABILITIES_SESSION_TRACK)
+    {
+        if (conn->server_capabilities & (uint32_t)GW_MYSQL_CAPABILITIES_SESSION_TRACK)
+        {
+            final_capabilities |= (uint32_t)GW_MYSQL_CAPABILITIES_SESSION_TRACK;
+        }
+        else
+        {
+            MXS_WARNING("Server '%s' does not support session state tracking but the "
+                        "client uses it, the replies of the server will not be read "
+                        "correctly by the client.", conn->owner_dcb->server->unique_name);
+        }
+    }
+
     return final_capabilities;
 }
 
@@ -2703,3 +3013,159 @@ gw_send_change_user_to_backend(char          *dbname,
     }
     return rc;
 }
+
+/**
+ * Check whether a server supports COM_RESET_CONNECTION. It was added in
+ * MySQL 5.7.3 and MariaDB 10.2.4.
+ *
+ * @param server The server
+ * @return True if the server version is known to support it
+ */
+static bool server_supports_reset(SERVER *server)
+{
+    int major = 0, minor = 0, patch = 0;
+    bool rval = false;
+
+    spinlock_acquire(&server->lock);
+    const char *version = server->server_string;
+
+    if (version)
+    {
+        /** MariaDB 10 prefixes its version for the sake of replication */
+        if (strncmp(version, "5.5.5-", 6) == 0)
+        {
+            version += 6;
+        }
+
+        if (sscanf(version, "%d.%d.%d", &major, &minor, &patch) == 3)
+        {
+            int number = major * 10000 + minor * 100 + patch;
+            rval = strstr(version, "MariaDB") ? number >= 100204 : number >= 50703;
+        }
+    }
+    spinlock_release(&server->lock);
+
+    return rval;
+}
+
+/**
+ * Create a packet with a command and an optional string argument
+ *
+ * @param cmd The command byte
+ * @param arg The argument or NULL
+ * @return The packet or NULL if memory allocation failed
+ */
+static GWBUF *create_command_packet(uint8_t cmd, const char *arg)
+{
+    size_t len = arg ? strlen(arg) : 0;
+    GWBUF *buffer = gwbuf_alloc(MYSQL_HEADER_LEN + 1 + len);
+
+    if (buffer)
+    {
+        uint8_t *data = GWBUF_DATA(buffer);
+        gw_mysql_set_byte3(data, 1 + len);
+        data[3] = 0x00;
+        data[4] = cmd;
+        memcpy(data + 5, arg, len);
+        buffer->gwbuf_type = GWBUF_TYPE_MYSQL;
+    }
+
+    return buffer;
+}
+
+/**
+ * Reset a persistent connection that is taken into use by a new session
+ *
+ * The state left behind by the previous session is cleared with
+ * COM_RESET_CONNECTION and the default database of the new session is set
+ * with COM_INIT_DB. The reset keeps the previous default database, so
+ * without a new one, or on servers that lack COM_RESET_CONNECTION,
+ * COM_CHANGE_USER is used instead. The commands are only queued and the
+ * queries of the session are pipelined behind them, the responses are
+ * discarded when they arrive.
+ *
+ * @param dcb  The backend DCB
+ * @param data The session the DCB is now linked to
+ * @return 1 if the reset was queued, 0 on failure
+ */
+static int gw_reset_persistent(DCB *dcb, void *data)
+{
+    SESSION *session = (SESSION *)data;
+    MySQLProtocol *protocol = (MySQLProtocol *)dcb->protocol;
+    MYSQL_session *mses = session->client_dcb ? (MYSQL_session *)session->client_dcb->data : NULL;
+    GWBUF *buffer;
+    int n_replies;
+
+    if (mses == NULL || protocol->protocol_auth_state != MYSQL_IDLE)
+    {
+        return 0;
+    }
+
+    /** The framer starts over with whatever the pooled DCB has queued */
+    modutil_framer_init(&protocol->framer);
+
+    if (mses->db[0] && server_supports_reset(dcb->server))
+    {
+        GWBUF *init_db = create_command_packet(MYSQL_COM_INIT_DB, mses->db);
+
+        if ((buffer = create_command_packet(MYSQL_COM_RESET, NULL)) == NULL || init_db == NULL)
+        {
+            gwbuf_free(buffer);
+            gwbuf_free(init_db);
+            return 0;
+        }
+        buffer = gwbuf_append(buffer, init_db);
+        n_replies = 2;
+    }
+    else
+    {
+        /** Written as an ordinary packet, the response is not for the router */
+        buffer = gw_create_change_user_packet(mses, protocol);
+        buffer->gwbuf_type = GWBUF_TYPE_MYSQL;
+        n_replies = 1;
+    }
+
+    if (buffer == NULL)
+    {
+        return 0;
+    }
+
+    protocol->ignore_replies += n_replies;
+    return mysql_dcb_write(dcb, buffer);
+}
+
+/**
+ * Remove the responses to the reset of a persistent connection from the
+ * packets that were read
+ *
+ * @param dcb         The backend DCB
+ * @param read_buffer Complete packets, set to NULL if all were discarded
+ * @return False if the server failed to reset the connection
+ */
+static bool gw_skip_reset_replies(DCB *dcb, GWBUF **read_buffer)
+{
+    MySQLProtocol *protocol = (MySQLProtocol *)dcb->protocol;
+
+    while (protocol->ignore_replies > 0 && *read_buffer)
+    {
+        uint8_t header[MYSQL_HEADER_LEN + 1];
+
+        gwbuf_copy_data(*read_buffer, 0, sizeof(header), header);
+        GWBUF *reply = gwbuf_split(read_buffer, MYSQL_GET_PACKET_LEN(header) + MYSQL_HEADER_LEN);
+        gwbuf_free(reply);
+        protocol->ignore_replies--;
+
+        if (header[MYSQL_HEADER_LEN] != 0x00)
+        {
+            MXS_ERROR("Server '%s' did not accept the reset of a persistent "
+                      "connection, response type 0x%02x.",
+                      dcb->server->unique_name, header[MYSQL_HEADER_LEN]);
+            gwbuf_free(*read_buffer);
+            *read_buffer = NULL;
+            protocol->ignore_replies = 0;
+            return false;
+        }
+    }
+
+    return true;
+}
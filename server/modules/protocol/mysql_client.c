@@ -57,6 +57,9 @@
 #include <sys/stat.h>
 #include <modutil.h>
 #include <netinet/tcp.h>
+#include <maxconfig.h>
+#include <qc_offload.h>
+#include <listener.h>
 
 #include "gw_authenticator.h"
 
@@ -90,8 +93,11 @@ static int MySQLSendHandshake(DCB* dcb);
 static int route_by_statement(SESSION *, GWBUF **);
 static void mysql_client_auth_error_handling(DCB *dcb, int auth_val);
 static int gw_read_do_authentication(DCB *dcb, GWBUF *read_buffer, int nbytes_read);
+static int gw_read_users_reloaded(DCB *dcb);
+static void gw_read_auth_result(DCB *dcb, int auth_val);
 static int gw_read_normal_data(DCB *dcb, GWBUF *read_buffer, int nbytes_read);
 static int gw_read_finish_processing(DCB *dcb, GWBUF *read_buffer, uint8_t capabilities);
+static int gw_read_offloaded(DCB *dcb);
 extern char* create_auth_fail_str(char *username, char *hostaddr, char *sha1, char *db,int);
 static bool ensure_complete_packet(DCB *dcb, GWBUF **read_buffer, int nbytes_read);
 
@@ -247,34 +253,166 @@ int mysql_send_ok(DCB *dcb, int packet_number, int in_affected_rows, const char*
     return sizeof(mysql_packet_header) + mysql_payload_size;
 }
 
+/** Offsets of the fields that differ between the connections, relative to the thread id */
+#define HANDSHAKE_SCRAMBLE_ONE_OFFSET 4
+#define HANDSHAKE_CAPABILITIES_OFFSET 13
+#define HANDSHAKE_LANGUAGE_OFFSET     15
+#define HANDSHAKE_CAPABILITIES_TWO_OFFSET 18
+#define HANDSHAKE_SCRAMBLE_TWO_OFFSET 31
+
+/**
+ * The initial handshake packet of a listener. The thread id, the scramble,
+ * the capabilities and the server language are patched into a copy of it
+ * for each connection.
+ */
+typedef struct mysql_handshake
+{
+    char    *version;          /**< The version string of the packet */
+    size_t  length;            /**< Length of the packet with the header */
+    size_t  thread_id_offset;  /**< Offset of the thread id in the packet */
+    uint8_t packet[];          /**< The packet */
+} MYSQL_HANDSHAKE;
+
+/**
+ * Build the handshake template for a version string
+ *
+ * @param version_string The server version sent to the clients
+ * @return The template or NULL if memory allocation failed
+ */
+static MYSQL_HANDSHAKE *mysql_handshake_build(const char *version_string)
+{
+    size_t len_version_string = strlen(version_string);
+    uint32_t mysql_payload_size =
+        sizeof(uint8_t) /* protocol version */ + (len_version_string + 1) + 4 /* thread id */ + 8 +
+        sizeof(/* mysql_filler */ uint8_t) + 2 /* capabilities one */ + sizeof(uint8_t) /* language */ +
+        2 /* status */ + 2 /* capabilities two */ + sizeof(uint8_t) /* scramble len */ +
+        10 /* filler */ + 12 + sizeof(/* mysql_last_byte */ uint8_t) + strlen("mysql_native_password") +
+        sizeof(/* mysql_last_byte */ uint8_t);
+    size_t length = MYSQL_HEADER_LEN + mysql_payload_size;
+    MYSQL_HANDSHAKE *handshake = malloc(sizeof(MYSQL_HANDSHAKE) + length);
+    char *version = strdup(version_string);
+
+    if (handshake == NULL || version == NULL)
+    {
+        free(handshake);
+        free(version);
+        return NULL;
+    }
+
+    handshake->version = version;
+    handshake->length = length;
+
+    uint8_t *payload = handshake->packet;
+    memset(payload, 0, length);
+
+    // write packet header with mysql_payload_size, packet number is 0
+    gw_mysql_set_byte3(payload, mysql_payload_size);
+    payload += MYSQL_HEADER_LEN;
+
+    // write protocol version
+    *payload++ = GW_MYSQL_PROTOCOL_VERSION;
+
+    // write server version plus 0 filler
+    memcpy(payload, version_string, len_version_string);
+    payload += len_version_string + 1;
+
+    // the thread id, the scramble, the filler, the capabilities and the language are patched in
+    handshake->thread_id_offset = payload - handshake->packet;
+    payload += HANDSHAKE_LANGUAGE_OFFSET + 1;
+
+    //write server status
+    *payload++ = 2;
+    *payload++ = 0;
+
+    //write server capabilities part two
+    *payload++ = 15;
+    *payload++ = 128;
+
+    // write scramble_len
+    *payload++ = 21;
+
+    // 10 filler, the plugin data is patched in and the last byte is 0
+    payload += 10 + 12 + 1;
+
+    memcpy(payload, "mysql_native_password", strlen("mysql_native_password"));
+
+    return handshake;
+}
+
+static void mysql_handshake_free(MYSQL_HANDSHAKE *handshake)
+{
+    if (handshake)
+    {
+        free(handshake->version);
+        free(handshake);
+    }
+}
+
+/**
+ * Copy the handshake template of the listener of a client into a new buffer
+ *
+ * The template is built when the first client connects and again when the
+ * version string of the service changes.
+ *
+ * @param dcb            The client DCB
+ * @param version_string The server version sent to the client
+ * @param thread_id_offset Set to the offset of the thread id in the packet
+ * @return The buffer or NULL if memory allocation failed
+ */
+static GWBUF *mysql_handshake_copy(DCB *dcb, const char *version_string, size_t *thread_id_offset)
+{
+    SERV_LISTENER *port = dcb->listener;
+    MYSQL_HANDSHAKE *handshake;
+    GWBUF *buf = NULL;
+
+    if (port == NULL)
+    {
+        if ((handshake = mysql_handshake_build(version_string)) &&
+            (buf = gwbuf_alloc_and_load(handshake->length, handshake->packet)))
+        {
+            *thread_id_offset = handshake->thread_id_offset;
+        }
+        mysql_handshake_free(handshake);
+        return buf;
+    }
+
+    spinlock_acquire(&port->handshake_lock);
+    handshake = port->handshake;
+
+    if (handshake == NULL || strcmp(handshake->version, version_string) != 0)
+    {
+        if ((handshake = mysql_handshake_build(version_string)))
+        {
+            mysql_handshake_free(port->handshake);
+            port->handshake = handshake;
+        }
+    }
+
+    if (handshake && (buf = gwbuf_alloc_and_load(handshake->length, handshake->packet)))
+    {
+        *thread_id_offset = handshake->thread_id_offset;
+    }
+    spinlock_release(&port->handshake_lock);
+
+    return buf;
+}
+
 /**
  * MySQLSendHandshake
  *
+ * The packet is copied from the handshake template of the listener and only
+ * the fields that differ between the connections are written.
+ *
  * @param dcb The descriptor control block to use for sending the handshake request
  * @return      The packet length sent
  */
 int MySQLSendHandshake(DCB* dcb)
 {
-    uint8_t *outbuf = NULL;
-    uint32_t mysql_payload_size = 0;
-    uint8_t mysql_packet_header[4];
-    uint8_t mysql_packet_id = 0;
-    /* uint8_t mysql_filler = GW_MYSQL_HANDSHAKE_FILLER; not needed*/
-    uint8_t mysql_protocol_version = GW_MYSQL_PROTOCOL_VERSION;
-    uint8_t *mysql_handshake_payload = NULL;
-    uint8_t mysql_thread_id_num[4];
-    uint8_t mysql_scramble_buf[9] = "";
-    uint8_t mysql_plugin_data[13] = "";
-    uint8_t mysql_server_capabilities_one[2];
-    uint8_t mysql_server_capabilities_two[2];
     uint8_t mysql_server_language = 8;
-    uint8_t mysql_server_status[2];
-    uint8_t mysql_scramble_len = 21;
-    uint8_t mysql_filler_ten[10];
-    /* uint8_t mysql_last_byte = 0x00; not needed */
+    uint8_t mysql_server_capabilities_one[2];
     char server_scramble[GW_MYSQL_SCRAMBLE_SIZE + 1]="";
-    char *version_string;
-    int len_version_string = 0;
+    const char *version_string;
+    size_t thread_id_offset = 0;
     int id_num;
 
     if (dcb->service->dbref)
@@ -289,137 +427,65 @@ int MySQLSendHandshake(DCB* dcb)
     if (dcb->service->version_string != NULL)
     {
         version_string = dcb->service->version_string;
-        len_version_string = strlen(version_string);
     }
     else
     {
         version_string = GW_MYSQL_VERSION;
-        len_version_string = strlen(GW_MYSQL_VERSION);
     }
 
-    gw_generate_random_str(server_scramble, GW_MYSQL_SCRAMBLE_SIZE);
-
-    // copy back to the caller
-    memcpy(protocol->scramble, server_scramble, GW_MYSQL_SCRAMBLE_SIZE);
-
-    // fill the handshake packet
-
-    memset(mysql_filler_ten, 0x00, sizeof(mysql_filler_ten));
-
-    // thread id, now put thePID
-    id_num = getpid() + dcb->fd;
-    gw_mysql_set_byte4(mysql_thread_id_num, id_num);
-
-    memcpy(mysql_scramble_buf, server_scramble, 8);
-
-    memcpy(mysql_plugin_data, server_scramble + 8, 12);
-
-    mysql_payload_size =
-        sizeof(mysql_protocol_version) + (len_version_string + 1) + sizeof(mysql_thread_id_num) + 8 +
-        sizeof(/* mysql_filler */ uint8_t) + sizeof(mysql_server_capabilities_one) + sizeof(mysql_server_language) +
-        sizeof(mysql_server_status) + sizeof(mysql_server_capabilities_two) + sizeof(mysql_scramble_len) +
-        sizeof(mysql_filler_ten) + 12 + sizeof(/* mysql_last_byte */ uint8_t) + strlen("mysql_native_password") +
-        sizeof(/* mysql_last_byte */ uint8_t);
-
-    // allocate memory for packet header + payload
-    if ((buf = gwbuf_alloc(sizeof(mysql_packet_header) + mysql_payload_size)) == NULL)
+    if ((buf = mysql_handshake_copy(dcb, version_string, &thread_id_offset)) == NULL)
     {
         ss_dassert(buf != NULL);
         return 0;
     }
-    outbuf = GWBUF_DATA(buf);
-
-    // write packet header with mysql_payload_size
-    gw_mysql_set_byte3(mysql_packet_header, mysql_payload_size);
-
-    // write packet number, now is 0
-    mysql_packet_header[3]= mysql_packet_id;
-    memcpy(outbuf, mysql_packet_header, sizeof(mysql_packet_header));
-
-    // current buffer pointer
-    mysql_handshake_payload = outbuf + sizeof(mysql_packet_header);
-
-    // write protocol version
-    memcpy(mysql_handshake_payload, &mysql_protocol_version, sizeof(mysql_protocol_version));
-    mysql_handshake_payload = mysql_handshake_payload + sizeof(mysql_protocol_version);
 
-    // write server version plus 0 filler
-    strcpy((char *)mysql_handshake_payload, version_string);
-    mysql_handshake_payload = mysql_handshake_payload + len_version_string;
+    uint8_t *mysql_handshake_payload = GWBUF_DATA(buf) + thread_id_offset;
 
-    *mysql_handshake_payload = 0x00;
+    gw_generate_random_str(server_scramble, GW_MYSQL_SCRAMBLE_SIZE);
 
-    mysql_handshake_payload++;
+    // copy back to the caller
+    memcpy(protocol->scramble, server_scramble, GW_MYSQL_SCRAMBLE_SIZE);
 
-    // write thread id
-    memcpy(mysql_handshake_payload, mysql_thread_id_num, sizeof(mysql_thread_id_num));
-    mysql_handshake_payload = mysql_handshake_payload + sizeof(mysql_thread_id_num);
+    // thread id, now put thePID
+    id_num = getpid() + dcb->fd;
+    gw_mysql_set_byte4(mysql_handshake_payload, id_num);
 
-    // write scramble buf
-    memcpy(mysql_handshake_payload, mysql_scramble_buf, 8);
-    mysql_handshake_payload = mysql_handshake_payload + 8;
-    *mysql_handshake_payload = GW_MYSQL_HANDSHAKE_FILLER;
-    mysql_handshake_payload++;
+    // write scramble buf and plugin data
+    memcpy(mysql_handshake_payload + HANDSHAKE_SCRAMBLE_ONE_OFFSET, server_scramble, 8);
+    memcpy(mysql_handshake_payload + HANDSHAKE_SCRAMBLE_TWO_OFFSET, server_scramble + 8, 12);
 
     // write server capabilities part one
     mysql_server_capabilities_one[0] = GW_MYSQL_SERVER_CAPABILITIES_BYTE1;
     mysql_server_capabilities_one[1] = GW_MYSQL_SERVER_CAPABILITIES_BYTE2;
 
-
-    mysql_server_capabilities_one[0] &= ~(int)GW_MYSQL_CAPABILITIES_COMPRESS;
+    if (!config_client_compression())
+    {
+        mysql_server_capabilities_one[0] &= ~(int)GW_MYSQL_CAPABILITIES_COMPRESS;
+    }
 
     if (ssl_required_by_dcb(dcb))
     {
         mysql_server_capabilities_one[1] |= (int)GW_MYSQL_CAPABILITIES_SSL >> 8;
     }
 
-    memcpy(mysql_handshake_payload, mysql_server_capabilities_one, sizeof(mysql_server_capabilities_one));
-    mysql_handshake_payload = mysql_handshake_payload + sizeof(mysql_server_capabilities_one);
+    memcpy(mysql_handshake_payload + HANDSHAKE_CAPABILITIES_OFFSET, mysql_server_capabilities_one,
+           sizeof(mysql_server_capabilities_one));
 
-    // write server language
-    memcpy(mysql_handshake_payload, &mysql_server_language, sizeof(mysql_server_language));
-    mysql_handshake_payload = mysql_handshake_payload + sizeof(mysql_server_language);
-
-    //write server status
-    mysql_server_status[0] = 2;
-    mysql_server_status[1] = 0;
-    memcpy(mysql_handshake_payload, mysql_server_status, sizeof(mysql_server_status));
-    mysql_handshake_payload = mysql_handshake_payload + sizeof(mysql_server_status);
-
-    //write server capabilities part two
-    mysql_server_capabilities_two[0] = 15;
-    mysql_server_capabilities_two[1] = 128;
-
-    memcpy(mysql_handshake_payload, mysql_server_capabilities_two, sizeof(mysql_server_capabilities_two));
-    mysql_handshake_payload = mysql_handshake_payload + sizeof(mysql_server_capabilities_two);
-
-    // write scramble_len
-    memcpy(mysql_handshake_payload, &mysql_scramble_len, sizeof(mysql_scramble_len));
-    mysql_handshake_payload = mysql_handshake_payload + sizeof(mysql_scramble_len);
-
-    //write 10 filler
-    memcpy(mysql_handshake_payload, mysql_filler_ten, sizeof(mysql_filler_ten));
-    mysql_handshake_payload = mysql_handshake_payload + sizeof(mysql_filler_ten);
-
-    // write plugin data
-    memcpy(mysql_handshake_payload, mysql_plugin_data, 12);
-    mysql_handshake_payload = mysql_handshake_payload + 12;
-
-    //write last byte, 0
-    *mysql_handshake_payload = 0x00;
-    mysql_handshake_payload++;
+    if (config_session_track())
+    {
+        mysql_handshake_payload[HANDSHAKE_CAPABILITIES_TWO_OFFSET] |=
+            (int)GW_MYSQL_CAPABILITIES_SESSION_TRACK >> 16;
+    }
 
-    // to be understanded ????
-    memcpy(mysql_handshake_payload, "mysql_native_password", strlen("mysql_native_password"));
-    mysql_handshake_payload = mysql_handshake_payload + strlen("mysql_native_password");
+    // write server language
+    mysql_handshake_payload[HANDSHAKE_LANGUAGE_OFFSET] = mysql_server_language;
 
-    //write last byte, 0
-    *mysql_handshake_payload = 0x00;
+    int len = GWBUF_LENGTH(buf);
 
     // writing data in the Client buffer queue
     dcb->func.write(dcb, buf);
 
-    return sizeof(mysql_packet_header) + mysql_payload_size;
+    return len;
 }
 
 /**
@@ -430,7 +496,7 @@ int MySQLSendHandshake(DCB* dcb)
  */
 int gw_MySQLWrite_client(DCB *dcb, GWBUF *queue)
 {
-    return dcb_write(dcb, queue);
+    return mysql_dcb_write(dcb, queue);
 }
 
 /**
@@ -457,6 +523,17 @@ int gw_read_client_event(DCB* dcb)
     protocol = (MySQLProtocol *)dcb->protocol;
     CHK_PROTOCOL(protocol);
 
+    if (protocol->qc_job)
+    {
+        return gw_read_offloaded(dcb);
+    }
+
+    if (protocol->protocol_auth_state == MYSQL_AUTH_SENT && dcb->data &&
+        ((MYSQL_session *)dcb->data)->users_wait)
+    {
+        return gw_read_users_reloaded(dcb);
+    }
+
 #ifdef SS_DEBUG
     MXS_DEBUG("[gw_read_client_event] Protocol state: %s",
               gw_mysql_protocol_state2string(protocol->protocol_auth_state));
@@ -485,7 +562,7 @@ int gw_read_client_event(DCB* dcb)
     {
         max_bytes = 36;
     }
-    return_code = dcb_read(dcb, &read_buffer, max_bytes);
+    return_code = mysql_dcb_read(dcb, &read_buffer, max_bytes);
     if (return_code < 0)
     {
         dcb_close(dcb);
@@ -561,12 +638,8 @@ int gw_read_client_event(DCB* dcb)
 static int
 gw_read_do_authentication(DCB *dcb, GWBUF *read_buffer, int nbytes_read)
 {
-    MySQLProtocol *protocol;
     int auth_val;
 
-    protocol = (MySQLProtocol *)dcb->protocol;
-    /* int compress = -1; */
-
     /**
      * The first step in the authentication process is to extract the
      * relevant information from the buffer supplied and place it
@@ -579,15 +652,50 @@ gw_read_do_authentication(DCB *dcb, GWBUF *read_buffer, int nbytes_read)
     if (MYSQL_AUTH_SUCCEEDED == (
         auth_val = dcb->authfunc.extract(dcb, read_buffer)))
     {
-        /*
-         * Maybe this comment will be useful some day:
-          compress =
-          GW_MYSQL_CAPABILITIES_COMPRESS & gw_mysql_get_byte4(
-          &protocol->client_capabilities);
-        */
         auth_val = dcb->authfunc.authenticate(dcb);
     }
 
+    gw_read_auth_result(dcb, auth_val);
+
+    /* One way or another, the buffer is now fully processed */
+    gwbuf_free(read_buffer);
+    return 0;
+}
+
+/**
+ * @brief Client read event while the login waits for the users to be reloaded
+ *
+ * The reads are suspended while the login waits. Once the users have been
+ * reloaded, a read event is added to the DCB and the login is checked again.
+ *
+ * @param dcb           Descriptor control block
+ * @return 0
+ */
+static int
+gw_read_users_reloaded(DCB *dcb)
+{
+    int auth_val = dcb->authfunc.authenticate(dcb);
+
+    if (MYSQL_AUTH_USERS_WAIT != auth_val)
+    {
+        dcb_resume_reads(dcb);
+        gw_read_auth_result(dcb, auth_val);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Act on the result of the authentication of a client
+ *
+ * @param dcb      Descriptor control block
+ * @param auth_val The authentication status
+ */
+static void
+gw_read_auth_result(DCB *dcb, int auth_val)
+{
+    MySQLProtocol *protocol = (MySQLProtocol *)dcb->protocol;
+
     /**
      * At this point, if the auth_val return code indicates success
      * the user authentication has been successfully completed.
@@ -624,17 +732,29 @@ gw_read_do_authentication(DCB *dcb, GWBUF *read_buffer, int nbytes_read)
              * packet sequence is # packet_number
              */
             mysql_send_ok(dcb, packet_number, 0, NULL);
+
+            if (config_client_compression() &&
+                (protocol->client_capabilities & (int)GW_MYSQL_CAPABILITIES_COMPRESS))
+            {
+                /** Everything after the OK packet is compressed */
+                protocol->compress = true;
+            }
         }
         else
         {
             auth_val = MYSQL_AUTH_NO_SESSION;
         }
     }
+    if (MYSQL_AUTH_USERS_WAIT == auth_val)
+    {
+        /** Nothing is read until the login has been checked again */
+        dcb_suspend_reads(dcb);
+    }
     /**
      * If we did not get success throughout, then the protocol state is updated,
      * the client is notified of the failure and the DCB is closed.
      */
-    if (MYSQL_AUTH_SUCCEEDED != auth_val && MYSQL_AUTH_SSL_INCOMPLETE != auth_val)
+    else if (MYSQL_AUTH_SUCCEEDED != auth_val && MYSQL_AUTH_SSL_INCOMPLETE != auth_val)
     {
         protocol->protocol_auth_state = MYSQL_AUTH_FAILED;
         mysql_client_auth_error_handling(dcb, auth_val);
@@ -643,9 +763,6 @@ gw_read_do_authentication(DCB *dcb, GWBUF *read_buffer, int nbytes_read)
          */
         dcb_close(dcb);
     }
-    /* One way or another, the buffer is now fully processed */
-    gwbuf_free(read_buffer);
-    return 0;
 }
 
 /**
@@ -842,11 +959,9 @@ gw_read_normal_data(DCB *dcb, GWBUF *read_buffer, int nbytes_read)
      * we need to make sure that a complete SQL packet is read before continuing */
     if (capabilities & (int)RCAP_TYPE_STMT_INPUT)
     {
-        uint8_t* data;
-        int packet_size;
+        MySQLProtocol *proto = (MySQLProtocol *)dcb->protocol;
 
-        if (nbytes_read < 3 || nbytes_read <
-            (MYSQL_GET_PACKET_LEN((uint8_t *) GWBUF_DATA(read_buffer)) + 4))
+        if (modutil_framer_feed(&proto->framer, read_buffer) == 0)
         {
             spinlock_acquire(&dcb->authlock);
             dcb->dcb_readqueue = read_buffer;
@@ -858,6 +973,47 @@ gw_read_normal_data(DCB *dcb, GWBUF *read_buffer, int nbytes_read)
     return gw_read_finish_processing(dcb, read_buffer, capabilities);
 }
 
+/**
+ * @brief Client read event while a statement is classified by a classifier thread
+ *
+ * The reads are suspended until the statement has been classified. Once it
+ * has, the classifier thread adds a read event and the statement is routed
+ * with the data that was read after it.
+ *
+ * @param dcb           Descriptor control block
+ * @return 0 if succeed, 1 otherwise
+ */
+static int
+gw_read_offloaded(DCB *dcb)
+{
+    MySQLProtocol *proto = (MySQLProtocol*)dcb->protocol;
+    SESSION *session = dcb->session;
+
+    if (!qc_offload_done(proto->qc_job))
+    {
+        return 0;
+    }
+
+    GWBUF *read_buffer = gwbuf_append(qc_offload_finish(proto->qc_job), proto->qc_rest);
+    proto->qc_job = NULL;
+    proto->qc_rest = NULL;
+    /** The classified statement is put before the data the framer parsed */
+    modutil_framer_init(&proto->framer);
+    dcb_resume_reads(dcb);
+
+    if (session->state != SESSION_STATE_ROUTER_READY)
+    {
+        gwbuf_free(read_buffer);
+        return 0;
+    }
+
+    uint8_t capabilities = session->service->router->getCapabilities(
+        session->service->router_instance, session->router_session);
+
+    gwbuf_set_type(read_buffer, GWBUF_TYPE_MYSQL);
+    return gw_read_finish_processing(dcb, read_buffer, capabilities);
+}
+
 /**
  * @brief Client read event, common processing after single statement handling
  *
@@ -905,13 +1061,30 @@ gw_read_finish_processing(DCB *dcb, GWBUF *read_buffer, uint8_t capabilities)
              * to router. The routing functions return 1 for
              * success or 0 for failure.
              */
+            bool batch = config_pipeline_batching();
+
+            if (batch)
+            {
+                dcb_write_batch_begin();
+            }
+
             return_code = route_by_statement(session, &read_buffer) ? 0 : 1;
 
+            if (batch)
+            {
+                dcb_write_batch_end();
+            }
+
             if (read_buffer != NULL)
             {
                 /* Must have been data left over */
                 /* Add incomplete mysql packet to read queue */
                 spinlock_acquire(&dcb->authlock);
+                if (dcb->dcb_readqueue)
+                {
+                    /** The leftover is no longer the head of the chain */
+                    modutil_framer_init(&proto->framer);
+                }
                 dcb->dcb_readqueue = gwbuf_append(dcb->dcb_readqueue, read_buffer);
                 spinlock_release(&dcb->authlock);
             }
@@ -1272,6 +1445,25 @@ gw_client_close(DCB *dcb)
     }
 #endif
     MXS_DEBUG("%lu [gw_client_close]", pthread_self());
+
+    MySQLProtocol *proto = (MySQLProtocol *)dcb->protocol;
+
+    if (proto && proto->qc_job)
+    {
+        qc_offload_cancel(proto->qc_job);
+        gwbuf_free(proto->qc_rest);
+        proto->qc_job = NULL;
+        proto->qc_rest = NULL;
+    }
+
+    MYSQL_session *client_data = (MYSQL_session *)dcb->data;
+
+    if (client_data && client_data->users_wait)
+    {
+        service_refresh_users_cancel(client_data->users_wait);
+        client_data->users_wait = NULL;
+    }
+
     mysql_protocol_done(dcb);
     session = dcb->session;
     /**
@@ -1357,6 +1549,7 @@ static int route_by_statement(SESSION* session, GWBUF** p_readbuf)
 {
     int rc;
     GWBUF* packetbuf;
+    MySQLProtocol *proto = (MySQLProtocol *)session->client_dcb->protocol;
 #if defined(SS_DEBUG)
     GWBUF* tmpbuf;
 
@@ -1372,13 +1565,28 @@ static int route_by_statement(SESSION* session, GWBUF** p_readbuf)
         ss_dassert(GWBUF_IS_TYPE_MYSQL((*p_readbuf)));
 
         /**
-         * Collect incoming bytes to a buffer until complete packet has
-         * arrived and then return the buffer.
+         * Split the next complete packet from the buffer. The framer
+         * remembers what it has parsed, so the partial packet that is
+         * left is not parsed again when more data arrives. The packets
+         * that continue a large statement are forwarded as they are and
+         * they are not copied into contiguous memory.
          */
-        packetbuf = gw_MySQL_get_next_packet(p_readbuf);
+        if (proto->large_packet)
+        {
+            packetbuf = modutil_framer_split_next(&proto->framer, p_readbuf);
+        }
+        else
+        {
+            packetbuf = modutil_framer_get_next(&proto->framer, p_readbuf);
+        }
 
         if (packetbuf != NULL)
         {
+            bool continued = proto->large_packet;
+            uint8_t header[MYSQL_HEADER_LEN];
+            gwbuf_copy_data(packetbuf, 0, MYSQL_HEADER_LEN, header);
+            proto->large_packet = gw_mysql_get_byte3(header) == GW_MYSQL_MAX_PACKET_LEN;
+
             CHK_GWBUF(packetbuf);
             ss_dassert(GWBUF_IS_TYPE_MYSQL(packetbuf));
             /**
@@ -1394,6 +1602,27 @@ static int route_by_statement(SESSION* session, GWBUF** p_readbuf)
              * sure it is set to each (MySQL) packet.
              */
             gwbuf_set_type(packetbuf, GWBUF_TYPE_SINGLE_STMT);
+
+            if (!continued)
+            {
+                QUERY_TRACE_START(session);
+            }
+
+            /**
+             * A large statement is parsed by a classifier thread so that
+             * the other sessions of this thread don't wait for it. The rest
+             * of the data is routed after it, see gw_read_offloaded.
+             */
+            if (!continued && !proto->large_packet && qc_offload_wanted(packetbuf) &&
+                (proto->qc_job = qc_offload_start(packetbuf, session->client_dcb)))
+            {
+                proto->qc_rest = *p_readbuf;
+                *p_readbuf = NULL;
+                dcb_suspend_reads(session->client_dcb);
+                rc = 1;
+                goto return_rc;
+            }
+
             /** Route query */
             rc = SESSION_ROUTE_QUERY(session, packetbuf);
         }
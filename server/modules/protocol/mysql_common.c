@@ -46,9 +46,13 @@
 #include <utils.h>
 #include "mysql_client_server_protocol.h"
 #include <skygw_types.h>
+#include <modutil.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <netinet/tcp.h>
+#include <maxconfig.h>
+#include <zlib.h>
+#include <time.h>
 
 static server_command_t* server_command_init(server_command_t* srvcmd, mysql_server_cmd_t cmd);
 
@@ -90,6 +94,8 @@ MySQLProtocol* mysql_protocol_init(DCB* dcb, int fd)
     p->protocol_command.scom_cmd = MYSQL_COM_UNDEFINED;
     p->protocol_command.scom_nresponse_packets = 0;
     p->protocol_command.scom_nbytes_to_read = 0;
+    protocol_reply_tracker_init(&p->reply_tracker);
+    modutil_framer_init(&p->framer);
 #if defined(SS_DEBUG)
     p->protocol_chk_top = CHK_NUM_PROTOCOL;
     p->protocol_chk_tail = CHK_NUM_PROTOCOL;
@@ -133,6 +139,8 @@ void mysql_protocol_done(DCB* dcb)
         free(scmd);
         scmd = scmd2;
     }
+    gwbuf_free(p->compress_readq);
+    p->compress_readq = NULL;
     p->protocol_state = MYSQL_PROTOCOL_DONE;
 
 retblock:
@@ -711,6 +719,543 @@ retblock:
     CHK_PROTOCOL(p);
 }
 
+/**
+ * Initialise a reply tracker, the next packet it sees starts a reply
+ *
+ * @param t The tracker
+ */
+void protocol_reply_tracker_init(reply_tracker_t* t)
+{
+    memset(t, 0, sizeof(*t));
+    t->rt_first = true;
+    t->rt_status = -1;
+}
+
+/**
+ * Skip a length-encoded integer
+ *
+ * @param ptr Pointer to the integer
+ * @return Pointer to the byte after the integer
+ */
+static uint8_t* skip_lenenc(uint8_t* ptr)
+{
+    switch (*ptr)
+    {
+    case 0xfc:
+        return ptr + 3;
+    case 0xfd:
+        return ptr + 4;
+    case 0xfe:
+        return ptr + 9;
+    default:
+        return ptr + 1;
+    }
+}
+
+/**
+ * Classify a packet whose start is in the tracker and update the reply state
+ *
+ * @param t The tracker
+ */
+static void reply_tracker_packet_done(reply_tracker_t* t)
+{
+    uint8_t* hdr = t->rt_hdr;
+    uint32_t payload_len = t->rt_len - MYSQL_HEADER_LEN;
+    bool continued = t->rt_continued;
+    bool end = false;
+    int status = -1;
+
+    t->rt_continued = payload_len == GW_MYSQL_MAX_PACKET_LEN;
+
+    if (continued || payload_len == 0)
+    {
+        /** Empty packets and the rest of a 16MB packet carry no command byte */
+        return;
+    }
+
+    if (t->rt_first)
+    {
+        t->rt_first = false;
+
+        if (PTR_IS_ERR(hdr))
+        {
+            end = true;
+        }
+        else if (PTR_IS_LOCAL_INFILE(hdr))
+        {
+            /** The client sends the file next and the server then replies with OK */
+            t->rt_local_infile = true;
+            end = true;
+        }
+        else if (PTR_IS_OK(hdr))
+        {
+            uint8_t* ptr = skip_lenenc(skip_lenenc(hdr + MYSQL_HEADER_LEN + 1));
+
+            end = true;
+
+            if (ptr + 2 <= hdr + t->rt_len)
+            {
+                status = gw_mysql_get_byte2(ptr);
+            }
+        }
+    }
+    else if (PTR_IS_ERR(hdr))
+    {
+        end = true;
+    }
+    else if (PTR_IS_EOF(hdr) && ++t->rt_eofs == 2)
+    {
+        end = true;
+        status = gw_mysql_get_byte2(hdr + MYSQL_HEADER_LEN + 3);
+    }
+
+    if (end)
+    {
+        t->rt_first = true;
+        t->rt_eofs = 0;
+
+        if (status < 0 || !(status & MYSQL_SERVER_MORE_RESULTS_EXIST))
+        {
+            t->rt_n_complete++;
+        }
+
+        if (status >= 0)
+        {
+            t->rt_status = status;
+        }
+    }
+}
+
+/**
+ * Follow the packet boundaries and the end of the replies in data read from
+ * a backend. The data does not need to consist of complete packets, the
+ * tracker remembers where the current packet ends. Only the headers are
+ * inspected, the rest of the data is skipped without copying. Afterwards
+ * the tracker tells how many replies the data completed.
+ *
+ * @param t   The tracker
+ * @param buf The data in the order it was read
+ */
+void protocol_track_reply(reply_tracker_t* t, GWBUF* buf)
+{
+    t->rt_n_complete = 0;
+    t->rt_status = -1;
+    t->rt_local_infile = false;
+
+    for (; buf; buf = buf->next)
+    {
+        uint8_t* ptr = GWBUF_DATA(buf);
+        uint8_t* end = ptr + GWBUF_LENGTH(buf);
+
+        while (ptr < end)
+        {
+            uint32_t avail = end - ptr;
+            uint32_t n;
+
+            if (t->rt_len == 0)
+            {
+                /** Collect the header to learn the length of the packet */
+                n = MYSQL_HEADER_LEN - t->rt_pos;
+                n = n < avail ? n : avail;
+                memcpy(t->rt_hdr + t->rt_pos, ptr, n);
+                t->rt_pos += n;
+
+                if (t->rt_pos == MYSQL_HEADER_LEN)
+                {
+                    t->rt_len = gw_mysql_get_byte3(t->rt_hdr) + MYSQL_HEADER_LEN;
+                }
+            }
+            else if (t->rt_pos < REPLY_TRACKER_HDR_LEN)
+            {
+                /** Keep the start of the payload for classifying the packet */
+                uint32_t want = t->rt_len < REPLY_TRACKER_HDR_LEN ?
+                    t->rt_len : REPLY_TRACKER_HDR_LEN;
+                n = want - t->rt_pos;
+                n = n < avail ? n : avail;
+                memcpy(t->rt_hdr + t->rt_pos, ptr, n);
+                t->rt_pos += n;
+            }
+            else
+            {
+                n = t->rt_len - t->rt_pos;
+                n = n < avail ? n : avail;
+                t->rt_pos += n;
+            }
+
+            ptr += n;
+
+            if (t->rt_len > 0 && t->rt_pos == t->rt_len)
+            {
+                reply_tracker_packet_done(t);
+                t->rt_pos = 0;
+                t->rt_len = 0;
+            }
+        }
+    }
+}
+
+/**
+ * Return how many bytes are left of the packet the tracker is in
+ *
+ * @param t The tracker
+ * @return Bytes until the next packet boundary, 0 if at a boundary. While
+ * the header of the packet is incomplete, the bytes left of the header.
+ */
+uint32_t protocol_reply_tracker_left(reply_tracker_t* t)
+{
+    return t->rt_len > 0 ? t->rt_len - t->rt_pos :
+        (t->rt_pos > 0 ? MYSQL_HEADER_LEN - t->rt_pos : 0);
+}
+
+/** Zlib streams of this thread, reused for every compressed packet */
+static thread_local z_stream *thread_deflate = NULL;
+static thread_local z_stream *thread_inflate = NULL;
+
+/**
+ * Return the CPU time used by this thread
+ *
+ * @return The CPU time in microseconds
+ */
+static uint64_t thread_cpu_usecs()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Get the deflate stream of this thread, ready for a new packet
+ *
+ * @return The stream or NULL if it could not be created
+ */
+static z_stream* get_deflate_stream()
+{
+    if (thread_deflate == NULL)
+    {
+        z_stream *strm = calloc(1, sizeof(z_stream));
+
+        if (strm == NULL || deflateInit(strm, Z_DEFAULT_COMPRESSION) != Z_OK)
+        {
+            MXS_ERROR("Failed to initialise the compression of the MySQL protocol.");
+            free(strm);
+            return NULL;
+        }
+        thread_deflate = strm;
+    }
+    else
+    {
+        deflateReset(thread_deflate);
+    }
+
+    return thread_deflate;
+}
+
+/**
+ * Get the inflate stream of this thread, ready for a new packet
+ *
+ * @return The stream or NULL if it could not be created
+ */
+static z_stream* get_inflate_stream()
+{
+    if (thread_inflate == NULL)
+    {
+        z_stream *strm = calloc(1, sizeof(z_stream));
+
+        if (strm == NULL || inflateInit(strm) != Z_OK)
+        {
+            MXS_ERROR("Failed to initialise the decompression of the MySQL protocol.");
+            free(strm);
+            return NULL;
+        }
+        thread_inflate = strm;
+    }
+    else
+    {
+        inflateReset(thread_inflate);
+    }
+
+    return thread_inflate;
+}
+
+/**
+ * Create the header of a compressed packet
+ *
+ * @param compressed_len   Length of the payload of the compressed packet
+ * @param seq              Sequence number of the compressed packet
+ * @param uncompressed_len Length of the payload once decompressed, 0 if the
+ *                         payload is not compressed
+ * @return Buffer with the header or NULL on memory allocation failure
+ */
+static GWBUF* create_compressed_header(uint32_t compressed_len, uint8_t seq, uint32_t uncompressed_len)
+{
+    GWBUF *hdr = gwbuf_alloc(MYSQL_COMPRESSED_HEADER_LEN);
+
+    if (hdr)
+    {
+        uint8_t *ptr = GWBUF_DATA(hdr);
+        gw_mysql_set_byte3(ptr, compressed_len);
+        ptr[3] = seq;
+        gw_mysql_set_byte3(ptr + 4, uncompressed_len);
+    }
+
+    return hdr;
+}
+
+/**
+ * Wrap data into one compressed packet. Data shorter than the compression
+ * threshold, and data that does not get smaller, is sent uncompressed.
+ *
+ * @param dcb   The DCB the packet is written to
+ * @param proto The protocol of the DCB
+ * @param data  At most GW_MYSQL_MAX_PACKET_LEN bytes of MySQL packets, freed
+ * @return The compressed packet or NULL on error
+ */
+static GWBUF* compress_packet(DCB *dcb, MySQLProtocol *proto, GWBUF *data)
+{
+    uint32_t len = gwbuf_length(data);
+    GWBUF *rval = NULL;
+
+    if (len >= config_compression_threshold())
+    {
+        uint64_t start = thread_cpu_usecs();
+        z_stream *strm = get_deflate_stream();
+        GWBUF *out = strm ? gwbuf_alloc(deflateBound(strm, len)) : NULL;
+
+        if (out)
+        {
+            int rc = Z_OK;
+
+            strm->next_out = GWBUF_DATA(out);
+            strm->avail_out = GWBUF_LENGTH(out);
+
+            for (GWBUF *b = data; b && rc == Z_OK; b = b->next)
+            {
+                strm->next_in = GWBUF_DATA(b);
+                strm->avail_in = GWBUF_LENGTH(b);
+                rc = deflate(strm, b->next ? Z_NO_FLUSH : Z_FINISH);
+            }
+
+            if (rc == Z_STREAM_END && strm->total_out < len)
+            {
+                out = gwbuf_rtrim(out, GWBUF_LENGTH(out) - strm->total_out);
+                rval = create_compressed_header(strm->total_out, proto->compress_seq, len);
+
+                if (rval)
+                {
+                    rval = gwbuf_append(rval, out);
+                    gwbuf_free(data);
+                    data = NULL;
+                }
+                else
+                {
+                    gwbuf_free(out);
+                }
+            }
+            else
+            {
+                /** Not worth compressing, the payload is sent as it is */
+                gwbuf_free(out);
+            }
+        }
+
+        dcb->stats.n_compress_usecs += thread_cpu_usecs() - start;
+    }
+
+    if (data)
+    {
+        if ((rval = create_compressed_header(len, proto->compress_seq, 0)))
+        {
+            rval = gwbuf_append(rval, data);
+        }
+        else
+        {
+            gwbuf_free(data);
+        }
+    }
+
+    if (rval)
+    {
+        proto->compress_seq++;
+        dcb->stats.n_compress_in += len;
+        dcb->stats.n_compress_out += gwbuf_length(rval);
+    }
+
+    return rval;
+}
+
+/**
+ * Decompress the complete compressed packets of a queue
+ *
+ * @param dcb   The DCB the data was read from
+ * @param proto The protocol of the DCB
+ * @param queue Compressed data, the incomplete packet at its end is left in it
+ * @param out   The decompressed data is appended here
+ * @return True on success, false if the data was not valid compressed data
+ */
+static bool decompress_packets(DCB *dcb, MySQLProtocol *proto, GWBUF **queue, GWBUF **out)
+{
+    uint8_t hdr[MYSQL_COMPRESSED_HEADER_LEN];
+
+    while (gwbuf_copy_data(*queue, 0, sizeof(hdr), hdr) == sizeof(hdr))
+    {
+        uint32_t compressed_len = gw_mysql_get_byte3(hdr);
+        uint32_t uncompressed_len = gw_mysql_get_byte3(hdr + 4);
+
+        if (gwbuf_length(*queue) < MYSQL_COMPRESSED_HEADER_LEN + compressed_len)
+        {
+            break;
+        }
+
+        *queue = gwbuf_consume(*queue, MYSQL_COMPRESSED_HEADER_LEN);
+        GWBUF *payload = gwbuf_split(queue, compressed_len);
+
+        proto->compress_seq = hdr[3] + 1;
+        dcb->stats.n_decompress_in += MYSQL_COMPRESSED_HEADER_LEN + compressed_len;
+
+        if (uncompressed_len == 0)
+        {
+            /** The packet was too small to be compressed */
+            dcb->stats.n_decompress_out += compressed_len;
+            *out = gwbuf_append(*out, payload);
+            continue;
+        }
+
+        uint64_t start = thread_cpu_usecs();
+        z_stream *strm = get_inflate_stream();
+        GWBUF *plain = strm ? gwbuf_alloc(uncompressed_len) : NULL;
+        int rc = Z_OK;
+
+        if (plain)
+        {
+            strm->next_out = GWBUF_DATA(plain);
+            strm->avail_out = uncompressed_len;
+
+            for (GWBUF *b = payload; b && rc == Z_OK; b = b->next)
+            {
+                strm->next_in = GWBUF_DATA(b);
+                strm->avail_in = GWBUF_LENGTH(b);
+                rc = inflate(strm, b->next ? Z_NO_FLUSH : Z_FINISH);
+            }
+        }
+
+        gwbuf_free(payload);
+        dcb->stats.n_compress_usecs += thread_cpu_usecs() - start;
+
+        if (plain == NULL || rc != Z_STREAM_END || strm->total_out != uncompressed_len)
+        {
+            MXS_ERROR("Invalid compressed packet from %s.",
+                      dcb->server ? dcb->server->unique_name : dcb->remote);
+            gwbuf_free(plain);
+            return false;
+        }
+
+        dcb->stats.n_decompress_out += uncompressed_len;
+        *out = gwbuf_append(*out, plain);
+    }
+
+    return true;
+}
+
+/**
+ * Read from a MySQL connection. When the compressed protocol is in use, the
+ * compressed packets are decompressed and only the uncompressed data is
+ * returned. An incomplete compressed packet is kept until it has been read
+ * completely. The read queue of the DCB holds uncompressed data.
+ *
+ * @param dcb      The DCB to read from
+ * @param head     Pointer to the buffer where the data is stored
+ * @param maxbytes Maximum number of bytes to read from the socket, 0 for no limit
+ * @return -1 on error, otherwise the number of bytes of data in head
+ */
+int mysql_dcb_read(DCB *dcb, GWBUF **head, int maxbytes)
+{
+    MySQLProtocol *proto = (MySQLProtocol *)dcb->protocol;
+
+    if (!proto->compress)
+    {
+        return dcb_read(dcb, head, maxbytes);
+    }
+
+    GWBUF *raw = NULL;
+    GWBUF *plain = NULL;
+
+    /** The read queue must not be mixed with the compressed data */
+    spinlock_acquire(&dcb->authlock);
+    plain = dcb->dcb_readqueue;
+    dcb->dcb_readqueue = NULL;
+    spinlock_release(&dcb->authlock);
+
+    int rc = dcb_read(dcb, &raw, maxbytes);
+
+    if (raw)
+    {
+        proto->compress_readq = gwbuf_append(proto->compress_readq, raw);
+
+        if (!decompress_packets(dcb, proto, &proto->compress_readq, &plain))
+        {
+            rc = -1;
+        }
+    }
+
+    *head = gwbuf_append(*head, plain);
+
+    return rc < 0 ? rc : (int)gwbuf_length(*head);
+}
+
+/**
+ * Write to a MySQL connection. When the compressed protocol is in use, the
+ * data is wrapped into compressed packets.
+ *
+ * @param dcb   The DCB to write to
+ * @param queue Complete MySQL packets
+ * @return The return value of dcb_write
+ */
+int mysql_dcb_write(DCB *dcb, GWBUF *queue)
+{
+    MySQLProtocol *proto = (MySQLProtocol *)dcb->protocol;
+
+    if (!proto->compress || queue == NULL)
+    {
+        return dcb_write(dcb, queue);
+    }
+
+    GWBUF *out = NULL;
+    int rc;
+
+    spinlock_acquire(&proto->compress_lock);
+
+    uint8_t *ptr = GWBUF_DATA(queue);
+
+    if (dcb->dcb_role == DCB_ROLE_BACKEND_HANDLER &&
+        GWBUF_LENGTH(queue) >= MYSQL_HEADER_LEN && MYSQL_GET_PACKET_NO(ptr) == 0)
+    {
+        /** A new command starts a new sequence of compressed packets */
+        proto->compress_seq = 0;
+    }
+
+    while (queue)
+    {
+        uint32_t len = gwbuf_length(queue);
+        GWBUF *data = gwbuf_split(&queue, len < GW_MYSQL_MAX_PACKET_LEN ? len : GW_MYSQL_MAX_PACKET_LEN);
+        GWBUF *packet = compress_packet(dcb, proto, data);
+
+        if (packet == NULL)
+        {
+            gwbuf_free(queue);
+            gwbuf_free(out);
+            spinlock_release(&proto->compress_lock);
+            return 0;
+        }
+        out = gwbuf_append(out, packet);
+    }
+
+    rc = dcb_write(dcb, out);
+    spinlock_release(&proto->compress_lock);
+
+    return rc;
+}
+
 
 /**
  * If router expects to get separate, complete statements, add MySQL command
@@ -46,6 +46,10 @@
 #include <mysql_client_server_protocol.h>
 #include <ini.h>
 #include <sys/stat.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#include <thread.h>
 
 #include <avrorouter.h>
 #include <random_jkiss.h>
@@ -58,6 +62,10 @@
 
 #define AVRO_TASK_DELAY_MAX 15
 
+/** How long the continuous conversion waits for a change before it checks
+ * the binlog files anyway, in milliseconds */
+#define AVRO_NOTIFY_TIMEOUT 1000
+
 static char *version_str = "V1.0.0";
 static const char* avro_task_name = "binlog_to_avro";
 static const char* index_task_name = "avro_indexing";
@@ -84,6 +92,8 @@ static int getCapabilities();
 extern int MaxScaleUptime();
 extern void avro_get_used_tables(AVRO_INSTANCE *router, DCB *dcb);
 void converter_func(void* data);
+static void converter_thread(void* data);
+void notify_all_clients(AVRO_INSTANCE *router);
 bool binlog_next_file_exists(const char* binlogdir, const char* binlog);
 int blr_file_get_next_binlogname(const char *router);
 bool avro_load_conversion_state(AVRO_INSTANCE *router);
@@ -94,6 +104,7 @@ bool avro_save_conversion_state(AVRO_INSTANCE *router);
 static void stats_func(void *);
 void avro_index_file(AVRO_INSTANCE *router, const char* path);
 void avro_update_index(AVRO_INSTANCE* router);
+bool avro_index_init(AVRO_INSTANCE *router);
 
 /** The module object definition */
 static ROUTER_OBJECT MyObject =
@@ -248,6 +259,48 @@ static void add_conversion_task(AVRO_INSTANCE *inst)
     }
 }
 
+/**
+ * @brief Start the continuous conversion
+ *
+ * The binlog directory is watched with inotify so that the converter thread
+ * wakes up as soon as the binlog router, in this process or another one,
+ * writes to the binlog files.
+ *
+ * @param inst Avro router instance
+ * @return True if the conversion thread was started
+ */
+static bool start_converter_thread(AVRO_INSTANCE *inst)
+{
+    char err[STRERROR_BUFLEN];
+
+    if ((inst->notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1 ||
+        inotify_add_watch(inst->notify_fd, inst->binlogdir,
+                          IN_MODIFY | IN_CREATE | IN_MOVED_TO) == -1)
+    {
+        MXS_ERROR("[%s] Failed to watch binlog directory '%s', the binlog "
+                  "files are checked periodically instead: %d, %s",
+                  inst->service->name, inst->binlogdir, errno,
+                  strerror_r(errno, err, sizeof(err)));
+    }
+    else if (thread_start(&inst->converter, converter_thread, inst) == NULL)
+    {
+        MXS_ERROR("[%s] Failed to start the binlog to Avro conversion thread.",
+                  inst->service->name);
+    }
+    else
+    {
+        return true;
+    }
+
+    if (inst->notify_fd != -1)
+    {
+        close(inst->notify_fd);
+        inst->notify_fd = -1;
+    }
+
+    return false;
+}
+
 /**
  * @brief Read router options from an external binlogrouter service
  *
@@ -317,6 +370,7 @@ createInstance(SERVICE *service, char **options)
     memset(&inst->stats, 0, sizeof(AVRO_ROUTER_STATS));
     spinlock_init(&inst->lock);
     spinlock_init(&inst->fileslock);
+    spinlock_init(&inst->block_cache_lock);
     inst->service = service;
     inst->binlog_fd = -1;
     inst->binlogdir = NULL;
@@ -333,6 +387,14 @@ createInstance(SERVICE *service, char **options)
     inst->row_target = AVRO_DEFAULT_BLOCK_ROW_COUNT;
     inst->trx_target = AVRO_DEFAULT_BLOCK_TRX_COUNT;
     inst->block_size = 0;
+    inst->codec = "null";
+    inst->continuous = false;
+    inst->notify_fd = -1;
+    inst->n_shards = 0;
+    inst->shards = NULL;
+    inst->client_high_water = AVRO_CLIENT_HIGH_WATER;
+    inst->client_low_water = AVRO_CLIENT_LOW_WATER;
+    int conversion_threads = 0;
     int first_file = 1;
     bool err = false;
 
@@ -407,6 +469,40 @@ createInstance(SERVICE *service, char **options)
                 {
                     inst->block_size = atoi(value);
                 }
+                else if (strcmp(options[i], "codec") == 0)
+                {
+                    /** The data blocks must be readable by maxavro */
+                    if (strcmp(value, "null") == 0)
+                    {
+                        inst->codec = "null";
+                    }
+                    else if (strcmp(value, "deflate") == 0)
+                    {
+                        inst->codec = "deflate";
+                    }
+                    else
+                    {
+                        MXS_ERROR("[avrorouter] Unsupported codec '%s', use 'null' or 'deflate'.",
+                                  value);
+                        err = true;
+                    }
+                }
+                else if (strcmp(options[i], "continuous") == 0)
+                {
+                    inst->continuous = config_truth_value(value);
+                }
+                else if (strcmp(options[i], "conversion_threads") == 0)
+                {
+                    conversion_threads = MAX(0, atoi(value));
+                }
+                else if (strcmp(options[i], "client_high_water") == 0)
+                {
+                    inst->client_high_water = atoi(value);
+                }
+                else if (strcmp(options[i], "client_low_water") == 0)
+                {
+                    inst->client_low_water = atoi(value);
+                }
                 else
                 {
                     MXS_WARNING("[avrorouter] Unknown router option: '%s'", options[i]);
@@ -421,6 +517,14 @@ createInstance(SERVICE *service, char **options)
         }
     }
 
+    if (inst->client_high_water <= 0 || inst->client_low_water <= 0 ||
+        inst->client_low_water >= inst->client_high_water)
+    {
+        MXS_ERROR("[%s] The value of 'client_low_water' must be positive and less than "
+                  "the value of 'client_high_water'.", service->name);
+        err = true;
+    }
+
     if (inst->binlogdir == NULL)
     {
         MXS_ERROR("No 'binlogdir' option found in source service or in router_options.");
@@ -512,7 +616,7 @@ createInstance(SERVICE *service, char **options)
                   sqlite3_errmsg(inst->sqlite_handle));
         err = true;
     }
-    else if (!create_tables(inst->sqlite_handle))
+    else if (!create_tables(inst->sqlite_handle) || !avro_index_init(inst))
     {
         err = true;
     }
@@ -543,6 +647,12 @@ createInstance(SERVICE *service, char **options)
     avro_load_conversion_state(inst);
     avro_load_metadata_from_schemas(inst);
 
+    if (conversion_threads > 0 && avro_shards_start(inst, conversion_threads))
+    {
+        MXS_NOTICE("[%s] Converting the row events of the tables with %d threads.",
+                   service->name, inst->n_shards);
+    }
+
     /*
      * Add tasks for statistic computation
      */
@@ -552,7 +662,15 @@ createInstance(SERVICE *service, char **options)
      */
 
     /* Start the scan, read, convert AVRO task */
-    add_conversion_task(inst);
+    if (inst->continuous && start_converter_thread(inst))
+    {
+        MXS_NOTICE("[%s] Converting the binlog events as they are written to %s.",
+                   service->name, inst->binlogdir);
+    }
+    else
+    {
+        add_conversion_task(inst);
+    }
 
     MXS_INFO("AVRO: current MySQL binlog file is %s, pos is %lu\n",
              inst->binlog_name, inst->current_pos);
@@ -656,6 +774,10 @@ static void freeSession(ROUTER* router_instance, void* router_client_ses)
     (void) prev_val;
 
     free(client->uuid);
+    free(client->columns);
+    free(client->where_column);
+    free(client->where_value);
+    maxavro_filter_free(client->filter);
     maxavro_file_close(client->file_handle);
     sqlite3_close_v2(client->sqlite_handle);
 
@@ -825,8 +947,27 @@ diagnostics(ROUTER *router, DCB *dcb)
     avro_get_used_tables(router_inst, dcb);
     dcb_printf(dcb, "\n");
 
+    if (router_inst->n_shards)
+    {
+        dcb_printf(dcb, "\tConversion threads:                  %d\n",
+                   router_inst->n_shards);
+
+        for (int i = 0; i < router_inst->n_shards; i++)
+        {
+            AVRO_SHARD *shard = &router_inst->shards[i];
+            pthread_mutex_lock(&shard->lock);
+            dcb_printf(dcb, "\t\tThread %-3d row events converted: %lu, queued: %d\n",
+                       i + 1, shard->n_events, shard->njobs);
+            pthread_mutex_unlock(&shard->lock);
+        }
+    }
+
     dcb_printf(dcb, "\tNumber of AVRO clients:              %u\n",
                router_inst->stats.n_clients);
+    dcb_printf(dcb, "\tShared JSON blocks sent:             %lu\n",
+               router_inst->block_cache_hits);
+    dcb_printf(dcb, "\tJSON blocks decoded:                 %lu\n",
+               router_inst->block_cache_misses);
 
     if (router_inst->clients)
     {
@@ -870,6 +1011,11 @@ diagnostics(ROUTER *router, DCB *dcb)
             dcb_printf(dcb, "\t\tCurrent GTID:                %lu-%lu-%lu\n",
                        session->gtid.domain, session->gtid.server_id,
                        session->gtid.seq);
+            dcb_printf(dcb, "\t\tBacklog bytes:               %d\n",
+                       DCB_WRITEQLEN(session->dcb));
+            dcb_printf(dcb, "\t\tStreaming paused:            %d times%s\n",
+                       session->stats.n_paused,
+                       session->cstate & AVRO_CS_PAUSED ? ", paused now" : "");
 
             // TODO: Add real value for this
             //dcb_printf(dcb, "\t\tAvro Transaction ID:         %u\n", 0);
@@ -995,11 +1141,15 @@ stats_func(void *inst)
 */
 
 /**
- * Conversion task: MySQL binlogs to AVRO files
+ * Convert the binlog events from the current position to the end of the last
+ * binlog file
+ *
+ * @param router Avro router instance
+ * @param processed Set to true if any events were processed
+ * @return How the last binlog file that was read ended
  */
-void converter_func(void* data)
+static avro_binlog_end_t convert_binlogs(AVRO_INSTANCE *router, bool *processed)
 {
-    AVRO_INSTANCE* router = (AVRO_INSTANCE*) data;
     bool ok = true;
     avro_binlog_end_t binlog_end = AVRO_OK;
     while (ok && binlog_end == AVRO_OK)
@@ -1014,10 +1164,10 @@ void converter_func(void* data)
 
             if (router->current_pos != start_pos || strcmp(binlog_name, router->binlog_name) != 0)
             {
-                /** We processed some data, reset the conversion task delay */
-                router->task_delay = 1;
+                *processed = true;
 
-                /** Update the GTID index */
+                /** Update the GTID index once the queued rows are in the files */
+                avro_shards_wait(router);
                 avro_update_index(router);
             }
 
@@ -1029,6 +1179,24 @@ void converter_func(void* data)
         }
     }
 
+    return binlog_end;
+}
+
+/**
+ * Conversion task: MySQL binlogs to AVRO files
+ */
+void converter_func(void* data)
+{
+    AVRO_INSTANCE* router = (AVRO_INSTANCE*) data;
+    bool processed = false;
+    avro_binlog_end_t binlog_end = convert_binlogs(router, &processed);
+
+    if (processed)
+    {
+        /** We processed some data, reset the conversion task delay */
+        router->task_delay = 1;
+    }
+
     /** We reached end of file, flush unwritten records to disk */
     if (router->task_delay == 1)
     {
@@ -1046,6 +1214,53 @@ void converter_func(void* data)
     }
 }
 
+/**
+ * Continuous conversion: MySQL binlogs to AVRO files
+ *
+ * The new events are converted whenever the binlog directory changes. The
+ * records are flushed and the clients notified after every round so that the
+ * clients see the changes without waiting for the group_trx or group_rows
+ * limits.
+ */
+static void converter_thread(void* data)
+{
+    AVRO_INSTANCE* router = (AVRO_INSTANCE*) data;
+    char events[sizeof(struct inotify_event) + NAME_MAX + 1]
+    __attribute__((aligned(__alignof__(struct inotify_event))));
+    avro_binlog_end_t binlog_end;
+
+    do
+    {
+        bool processed = false;
+        binlog_end = convert_binlogs(router, &processed);
+
+        if (processed)
+        {
+            avro_flush_all_tables(router);
+            avro_save_conversion_state(router);
+            notify_all_clients(router);
+        }
+
+        if (binlog_end == AVRO_LAST_FILE || binlog_end == AVRO_OPEN_TRANSACTION)
+        {
+            struct pollfd pfd = {.fd = router->notify_fd, .events = POLLIN};
+
+            if (poll(&pfd, 1, AVRO_NOTIFY_TIMEOUT) > 0)
+            {
+                /** Only the wake-up matters, not which files changed */
+                while (read(router->notify_fd, events, sizeof(events)) > 0)
+                {
+                    ;
+                }
+            }
+        }
+    }
+    while (binlog_end != AVRO_BINLOG_ERROR);
+
+    MXS_ERROR("[%s] Stopped converting binlog file %s at position %lu.",
+              router->service->name, router->binlog_name, router->current_pos);
+}
+
 /**
  * @brief Ensure directory exists and is writable
  *
@@ -28,6 +28,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
 #include <service.h>
 #include <server.h>
 #include <router.h>
@@ -417,6 +418,79 @@ void send_gtid_info(AVRO_INSTANCE *router, gtid_pos_t *gtid_pos, DCB *dcb)
     }
 }
 
+/**
+ * @brief Extract the options of a data request
+ *
+ * The options that follow the table are the GTID to start from and the
+ * optional column projection and row filter:
+ *
+ *   [GTID] [COLUMNS column,column...] [WHERE column=value]
+ *
+ * @param client The client
+ * @param start Start of the options
+ * @param len Length of the options
+ * @return True if the options were valid
+ */
+static bool extract_data_request(AVRO_CLIENT *client, const char *start, int len)
+{
+    char options[len + 1];
+    char gtid[len + 1];
+    char *saveptr;
+    bool rval = true;
+
+    memcpy(options, start, len);
+    options[len] = '\0';
+    gtid[0] = '\0';
+
+    for (char *tok = strtok_r(options, " \t\r\n", &saveptr); tok && rval;
+         tok = strtok_r(NULL, " \t\r\n", &saveptr))
+    {
+        if (strcasecmp(tok, "COLUMNS") == 0)
+        {
+            char *value = strtok_r(NULL, " \t\r\n", &saveptr);
+
+            if (value && client->columns == NULL)
+            {
+                client->columns = strdup(value);
+            }
+            else
+            {
+                rval = false;
+            }
+        }
+        else if (strcasecmp(tok, "WHERE") == 0)
+        {
+            char *value = strtok_r(NULL, " \t\r\n", &saveptr);
+            char *eq = value ? strchr(value, '=') : NULL;
+
+            if (eq && eq != value && client->where_column == NULL)
+            {
+                *eq++ = '\0';
+                client->where_column = strdup(value);
+                client->where_value = strdup(eq);
+            }
+            else
+            {
+                rval = false;
+            }
+        }
+        else
+        {
+            strcat(gtid, tok);
+            strcat(gtid, " ");
+        }
+    }
+
+    if (*gtid)
+    {
+        client->requested_gtid = true;
+        extract_gtid_request(&client->gtid, gtid, strlen(gtid));
+        memcpy(&client->gtid_start, &client->gtid, sizeof(client->gtid_start));
+    }
+
+    return rval;
+}
+
 /**
  * @brief Check if a file exists in a directory
  *
@@ -463,18 +537,24 @@ avro_client_process_command(AVRO_INSTANCE *router, AVRO_CLIENT *client, GWBUF *q
         {
             const char *gtid_ptr = get_avrofile_name(file_ptr, data_len, client->avro_binfile);
 
-            if (gtid_ptr)
+            if (gtid_ptr && !extract_data_request(client, gtid_ptr, data_len - (gtid_ptr - file_ptr)))
             {
-                client->requested_gtid = true;
-                extract_gtid_request(&client->gtid, gtid_ptr, data_len - (gtid_ptr - file_ptr));
-                memcpy(&client->gtid_start, &client->gtid, sizeof(client->gtid_start));
+                dcb_printf(client->dcb, "ERR REQUEST-DATA Invalid COLUMNS or WHERE");
             }
-
-            if (file_in_dir(router->avrodir, client->avro_binfile))
+            else if ((client->columns || client->where_column) && client->format != AVRO_FORMAT_JSON)
+            {
+                dcb_printf(client->dcb, "ERR REQUEST-DATA COLUMNS and WHERE require the JSON format");
+            }
+            else if (file_in_dir(router->avrodir, client->avro_binfile))
             {
                 /* set callback routine for data sending */
                 dcb_add_callback(client->dcb, DCB_REASON_DRAINED, avro_client_callback, client);
 
+                /** The streaming pauses when the client falls behind and resumes
+                 * when its write queue drops below the low water mark */
+                DCB_SET_LOW_WATER(client->dcb, router->client_low_water);
+                dcb_add_callback(client->dcb, DCB_REASON_LOW_WATER, avro_client_callback, client);
+
                 /* Add fake event that will call the avro_client_callback() routine */
                 poll_fake_write_event(client->dcb);
             }
@@ -555,47 +635,209 @@ const char* get_avrofile_name(const char *file_ptr, int data_len, char *dest)
     return rval;
 }
 
-static int send_row(DCB *dcb, json_t* row)
+/**
+ * @brief Check whether a client has more unsent data than it should
+ *
+ * @param client The client
+ * @return True if the write queue of the client is above the high water mark
+ */
+static bool avro_client_backlogged(AVRO_CLIENT *client)
+{
+    return DCB_WRITEQLEN(client->dcb) > client->router->client_high_water;
+}
+
+/**
+ * @brief Add a JSON row to a batch of rows
+ *
+ * The rows are copied one after another into buffers of AVRO_ROW_BATCH_SIZE
+ * bytes so that many rows are sent with one write. A row that does not fit
+ * into such a buffer gets a buffer of its own.
+ *
+ * @param batch The complete buffers of the batch
+ * @param buffer The buffer being filled, NULL if none
+ * @param used Bytes used in @p buffer
+ * @param row The row to add
+ * @return True if the row was added
+ */
+static bool add_row(GWBUF **batch, GWBUF **buffer, size_t *used, json_t* row)
 {
     char *json = json_dumps(row, JSON_PRESERVE_ORDER);
-    size_t len = strlen(json);
-    GWBUF *buf = gwbuf_alloc(len + 1);
-    int rc = 0;
 
-    if (json && buf)
+    if (json == NULL)
     {
-        uint8_t *data = GWBUF_DATA(buf);
-        memcpy(data, json, len);
-        data[len] = '\n';
-        rc = dcb->func.write(dcb, buf);
+        MXS_ERROR("Failed to dump JSON value.");
+        return false;
     }
-    else
+
+    size_t len = strlen(json) + 1;
+
+    if (*buffer && *used + len > AVRO_ROW_BATCH_SIZE)
     {
-        MXS_ERROR("Failed to dump JSON value.");
-        rc = 0;
+        GWBUF_RTRIM(*buffer, AVRO_ROW_BATCH_SIZE - *used);
+        *batch = gwbuf_append(*batch, *buffer);
+        *buffer = NULL;
+    }
+
+    if (*buffer == NULL)
+    {
+        if ((*buffer = gwbuf_alloc(MAX(len, AVRO_ROW_BATCH_SIZE))) == NULL)
+        {
+            free(json);
+            return false;
+        }
+        *used = 0;
     }
+
+    uint8_t *data = (uint8_t *)GWBUF_DATA(*buffer) + *used;
+    memcpy(data, json, len - 1);
+    data[len - 1] = '\n';
+    *used += len;
+
+    if (*used > AVRO_ROW_BATCH_SIZE)
+    {
+        /** A row of its own, the buffer is exactly full */
+        *batch = gwbuf_append(*batch, *buffer);
+        *buffer = NULL;
+    }
+
     free(json);
-    return rc;
+    return true;
 }
 
-static void set_current_gtid(AVRO_CLIENT *client, json_t *row)
+/**
+ * @brief Complete a batch of rows
+ *
+ * @param batch The complete buffers of the batch
+ * @param buffer The buffer being filled, NULL if none
+ * @param used Bytes used in @p buffer
+ * @return All the rows of the batch, NULL if there are none
+ */
+static GWBUF* end_batch(GWBUF *batch, GWBUF *buffer, size_t used)
 {
-    json_t *obj = json_object_get(row, avro_sequence);
-    ss_dassert(json_is_integer(obj));
-    client->gtid.seq = json_integer_value(obj);
+    if (buffer)
+    {
+        if (used < AVRO_ROW_BATCH_SIZE)
+        {
+            GWBUF_RTRIM(buffer, AVRO_ROW_BATCH_SIZE - used);
+        }
+        batch = gwbuf_append(batch, buffer);
+    }
+    return batch;
+}
 
-    obj = json_object_get(row, avro_server_id);
-    ss_dassert(json_is_integer(obj));
-    client->gtid.server_id = json_integer_value(obj);
+/**
+ * @brief Update the current GTID from the last record of a data block
+ *
+ * @param client The client
+ * @param file File read with maxavro_record_read_json_block
+ */
+static void set_current_gtid(AVRO_CLIENT *client, MAXAVRO_FILE *file)
+{
+    maxavro_record_get_integer(file, avro_sequence, &client->gtid.seq);
+    maxavro_record_get_integer(file, avro_server_id, &client->gtid.server_id);
+    maxavro_record_get_integer(file, avro_domain, &client->gtid.domain);
+}
 
-    obj = json_object_get(row, avro_domain);
-    ss_dassert(json_is_integer(obj));
-    client->gtid.domain = json_integer_value(obj);
+/**
+ * @brief Find the cache slot of a data block
+ *
+ * @param router Router instance
+ * @param filename The Avro file
+ * @param offset Offset of the data of the block
+ * @return The slot of the block
+ */
+static AVRO_CACHED_BLOCK* block_cache_slot(AVRO_INSTANCE *router, const char *filename, long offset)
+{
+    unsigned int hash = simple_str_hash((char*)filename) ^ (unsigned int)(offset * 2654435761u);
+    return &router->block_cache[hash % AVRO_BLOCK_CACHE_SIZE];
+}
+
+/**
+ * @brief Get a data block that another client has already decoded
+ *
+ * @param client The client
+ * @param file File the client is streaming, positioned at the start of a block
+ * @return The records of the block or NULL if the block is not in the cache
+ */
+static GWBUF* get_cached_block(AVRO_CLIENT *client, MAXAVRO_FILE *file)
+{
+    AVRO_INSTANCE *router = client->router;
+    AVRO_CACHED_BLOCK *block = block_cache_slot(router, client->avro_binfile, file->data_start_pos);
+    GWBUF *json = NULL;
+
+    spinlock_acquire(&router->block_cache_lock);
+
+    if (block->json && block->offset == file->data_start_pos &&
+        block->block_size == file->block_size &&
+        strcmp(block->filename, client->avro_binfile) == 0 &&
+        (json = gwbuf_clone_all(block->json)))
+    {
+        client->gtid.domain = block->domain;
+        client->gtid.server_id = block->server_id;
+        client->gtid.seq = block->seq;
+        router->block_cache_hits++;
+    }
+
+    spinlock_release(&router->block_cache_lock);
+
+    return json;
+}
+
+/**
+ * @brief Share a decoded data block with the other clients
+ *
+ * The block replaces whatever was in its slot, so the cache holds the most
+ * recently decoded blocks, which are the ones the clients at the head of the
+ * files read.
+ *
+ * @param client The client
+ * @param file File the block was read from
+ * @param json All records of the block
+ */
+static void add_cached_block(AVRO_CLIENT *client, MAXAVRO_FILE *file, GWBUF *json)
+{
+    AVRO_INSTANCE *router = client->router;
+    AVRO_CACHED_BLOCK *block = block_cache_slot(router, client->avro_binfile, file->data_start_pos);
+    GWBUF *clone = gwbuf_clone_all(json);
+    GWBUF *old;
+
+    if (clone == NULL)
+    {
+        return;
+    }
+
+    spinlock_acquire(&router->block_cache_lock);
+    old = block->json;
+    strcpy(block->filename, client->avro_binfile);
+    block->offset = file->data_start_pos;
+    block->block_size = file->block_size;
+    block->json = clone;
+    block->domain = client->gtid.domain;
+    block->server_id = client->gtid.server_id;
+    block->seq = client->gtid.seq;
+    router->block_cache_misses++;
+    spinlock_release(&router->block_cache_lock);
+
+    if (old)
+    {
+        gwbuf_free(old);
+    }
 }
 
 /**
  * @brief Stream Avro data in JSON format
  *
+ * The records of each data block are decoded and sent as one buffer. If the
+ * client requested columns or a row filter, only the matching parts of the
+ * records are decoded and sent.
+ *
+ * Complete blocks sent without a filter are shared through the block cache of
+ * the router. When many clients follow the same table, the newest blocks are
+ * decoded by the first client and the others send the same buffer.
+ *
+ * The blocks of one burst are written to the client at once. The burst ends
+ * early if the write queue of the client is above the high water mark.
+ *
  * @param file File to stream from
  * @param dcb DCB to stream to
  * @return True if more data is readable, false if all data was sent
@@ -605,27 +847,100 @@ static bool stream_json(AVRO_CLIENT *client)
     int bytes = 0;
     MAXAVRO_FILE *file = client->file_handle;
     DCB *dcb = client->dcb;
+    GWBUF *output = NULL;
+    GWBUF *cached;
+    bool more;
+
+    if (client->filter == NULL && (client->columns || client->where_column) &&
+        (client->filter = maxavro_filter_alloc(file, client->columns, client->where_column,
+                                               client->where_value)) == NULL)
+    {
+        MXS_ERROR("Failed to allocate memory for the row filter.");
+        return false;
+    }
 
     do
     {
-        json_t *row;
-        int rc = 1;
-        while (rc > 0 && (row = maxavro_record_read_json(file)))
+        bool whole_block = client->filter == NULL && file->metadata_read &&
+                           file->records_read_from_block == 0;
+
+        if (whole_block && (cached = get_cached_block(client, file)))
         {
-            rc = send_row(dcb, row);
-            set_current_gtid(client, row);
-            json_decref(row);
+            output = gwbuf_append(output, cached);
+            bytes += file->block_size;
+            continue;
+        }
+
+        GWBUF *rows = maxavro_record_read_json_block(file, client->filter);
+
+        if (rows)
+        {
+            set_current_gtid(client, file);
+
+            if (whole_block && file->records_read_from_block == file->records_in_block &&
+                !GWBUF_EMPTY(rows))
+            {
+                add_cached_block(client, file, rows);
+            }
+
+            if (GWBUF_EMPTY(rows))
+            {
+                gwbuf_free(rows);
+            }
+            else
+            {
+                output = gwbuf_append(output, rows);
+            }
         }
         bytes += file->block_size;
     }
-    while (maxavro_next_block(file) && bytes < AVRO_DATA_BURST_SIZE);
+    while ((more = maxavro_next_block(file)) && bytes < AVRO_DATA_BURST_SIZE &&
+           !avro_client_backlogged(client));
 
-    return bytes >= AVRO_DATA_BURST_SIZE;
+    if (output)
+    {
+        dcb->func.write(dcb, output);
+    }
+
+    return more;
+}
+
+/**
+ * @brief Send the current data block straight from the file
+ *
+ * The verified block is sent with sendfile() without reading it into memory.
+ * Only its first record is decoded to update the GTID of the client.
+ *
+ * @param client The client
+ * @param file File to stream from
+ * @return 1 if the block was sent, 0 if it must be read into a buffer and
+ * -1 if the write failed
+ */
+static int send_raw_block(AVRO_CLIENT *client, MAXAVRO_FILE *file)
+{
+    long offset;
+    size_t len;
+    bool blocked;
+    int rc = 0;
+
+    if (maxavro_record_locate_block(file, &offset, &len) &&
+        (rc = dcb_sendfile(client->dcb, NULL, 0, fileno(file->file), offset, len, &blocked)) > 0)
+    {
+        set_current_gtid(client, file);
+        client->stats.n_bytes += len;
+        maxavro_next_block(file);
+    }
+
+    return rc;
 }
 
 /**
  * @brief Stream Avro data in native Avro format
  *
+ * Complete data blocks are sent as they are in the file. The blocks are read
+ * into buffers only when they can't be sent with sendfile(), for example
+ * when the connection is encrypted.
+ *
  * @param file File to stream from
  * @param dcb DCB to stream to
  * @return True if streaming was successful, false if an error occurred
@@ -638,37 +953,24 @@ static bool stream_binary(AVRO_CLIENT *client)
     MAXAVRO_FILE *file = client->file_handle;
     DCB *dcb = client->dcb;
 
-    while (rc > 0 && bytes < AVRO_DATA_BURST_SIZE)
+    while (rc > 0 && bytes < AVRO_DATA_BURST_SIZE && !avro_client_backlogged(client))
     {
         bytes += file->block_size;
-        if ((buffer = maxavro_record_read_binary(file)))
+        if ((rc = send_raw_block(client, file)) != 0)
         {
-            rc = dcb->func.write(dcb, buffer);
+            continue;
         }
-        else
+        else if ((buffer = maxavro_record_read_binary(file)))
         {
-            rc = 0;
+            rc = dcb->func.write(dcb, buffer);
         }
     }
 
     return bytes >= AVRO_DATA_BURST_SIZE;
 }
 
-static int sqlite_cb(void* data, int rows, char** values, char** names)
-{
-    for (int i = 0; i < rows; i++)
-    {
-        if (values[i])
-        {
-            *((long*)data) = strtol(values[i], NULL, 10);
-            return 0;
-        }
-    }
-    return 0;
-}
-
-static const char select_template[] = "SELECT max(position) FROM gtid WHERE domain=%lu "
-                                      "AND server_id=%lu AND sequence <= %lu AND avrofile=\"%s\";";
+static const char select_sql[] = "SELECT max(position) FROM gtid WHERE domain=? "
+                                 "AND server_id=? AND sequence <= ? AND avrofile=?;";
 
 static bool seek_to_index_pos(AVRO_CLIENT *client, MAXAVRO_FILE* file)
 {
@@ -676,15 +978,26 @@ static bool seek_to_index_pos(AVRO_CLIENT *client, MAXAVRO_FILE* file)
     ss_dassert(name);
     name++;
 
-    char sql[sizeof(select_template) + NAME_MAX + 80];
-    snprintf(sql, sizeof(sql), select_template, client->gtid.domain,
-             client->gtid.server_id, client->gtid.seq, name);
-
+    sqlite3_stmt *stmt;
     long offset = -1;
-    char *errmsg = NULL;
     bool rval = false;
+    int rc;
+
+    if ((rc = sqlite3_prepare_v2(client->sqlite_handle, select_sql, -1, &stmt, NULL)) == SQLITE_OK)
+    {
+        sqlite3_bind_int64(stmt, 1, client->gtid.domain);
+        sqlite3_bind_int64(stmt, 2, client->gtid.server_id);
+        sqlite3_bind_int64(stmt, 3, client->gtid.seq);
+        sqlite3_bind_text(stmt, 4, name, -1, SQLITE_STATIC);
 
-    if (sqlite3_exec(client->sqlite_handle, sql, sqlite_cb, &offset, &errmsg) == SQLITE_OK)
+        if ((rc = sqlite3_step(stmt)) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL)
+        {
+            offset = sqlite3_column_int64(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+    }
+
+    if (rc == SQLITE_ROW || rc == SQLITE_DONE)
     {
         rval = true;
         if (offset > 0 && !maxavro_record_set_pos(file, offset))
@@ -695,9 +1008,9 @@ static bool seek_to_index_pos(AVRO_CLIENT *client, MAXAVRO_FILE* file)
     else
     {
         MXS_ERROR("Failed to query index position for GTID %lu-%lu-%lu: %s",
-                  client->gtid.domain, client->gtid.server_id, client->gtid.seq, errmsg);
+                  client->gtid.domain, client->gtid.server_id, client->gtid.seq,
+                  sqlite3_errmsg(client->sqlite_handle));
     }
-    sqlite3_free(errmsg);
     return rval;
 }
 
@@ -709,6 +1022,9 @@ static bool seek_to_index_pos(AVRO_CLIENT *client, MAXAVRO_FILE* file)
 static bool seek_to_gtid(AVRO_CLIENT *client, MAXAVRO_FILE* file)
 {
     bool seeking = true;
+    GWBUF *batch = NULL;
+    GWBUF *buffer = NULL;
+    size_t used = 0;
 
     do
     {
@@ -746,7 +1062,7 @@ static bool seek_to_gtid(AVRO_CLIENT *client, MAXAVRO_FILE* file)
              * read the row into memory */
             if (!seeking)
             {
-                send_row(client->dcb, row);
+                add_row(&batch, &buffer, &used, row);
             }
 
             json_decref(row);
@@ -754,6 +1070,11 @@ static bool seek_to_gtid(AVRO_CLIENT *client, MAXAVRO_FILE* file)
     }
     while (seeking && maxavro_next_block(file));
 
+    if ((batch = end_batch(batch, buffer, used)))
+    {
+        client->dcb->func.write(client->dcb, batch);
+    }
+
     return !seeking;
 }
 
@@ -911,6 +1232,10 @@ static void rotate_avro_file(AVRO_CLIENT *client, char *fullname)
     spinlock_acquire(&client->file_lock);
     maxavro_file_close(client->file_handle);
 
+    /** The filter refers to the fields of the schema of the file */
+    maxavro_filter_free(client->filter);
+    client->filter = NULL;
+
     if ((client->file_handle = maxavro_file_open(fullname)) == NULL)
     {
         MXS_ERROR("Failed to open file: %s", filename);
@@ -952,9 +1277,32 @@ static void print_next_filename(const char *file, const char *dir, char *dest, s
     }
 }
 
+/**
+ * @brief Pause the streaming until the write queue of the client drains
+ *
+ * The client catch_lock must be held when calling this function.
+ *
+ * @param client The client
+ */
+static void avro_client_pause(AVRO_CLIENT *client)
+{
+    if ((client->cstate & AVRO_CS_PAUSED) == 0)
+    {
+        client->cstate |= AVRO_CS_PAUSED;
+        client->stats.n_paused++;
+        MXS_DEBUG("Write queue of %s@%s is %d bytes, pausing the streaming.",
+                  client->dcb->user, client->dcb->remote, DCB_WRITEQLEN(client->dcb));
+    }
+}
+
 /**
  * @brief The client callback for sending data
  *
+ * The data is streamed when the write queue of the client has drained. If
+ * the write queue is above the high water mark of the router, the streaming
+ * pauses. It resumes with a fake write event when the write queue drops
+ * below the low water mark or when it has drained.
+ *
  * @param dcb Client DCB
  * @param reason Why the callback was called
  * @param userdata Data provided when the callback was added
@@ -962,7 +1310,19 @@ static void print_next_filename(const char *file, const char *dir, char *dest, s
  */
 int avro_client_callback(DCB *dcb, DCB_REASON reason, void *userdata)
 {
-    if (reason == DCB_REASON_DRAINED)
+    if (reason == DCB_REASON_LOW_WATER)
+    {
+        AVRO_CLIENT *client = (AVRO_CLIENT*)userdata;
+
+        spinlock_acquire(&client->catch_lock);
+        if (client->cstate & AVRO_CS_PAUSED)
+        {
+            client->cstate &= ~AVRO_CS_PAUSED;
+            avro_notify_client(client);
+        }
+        spinlock_release(&client->catch_lock);
+    }
+    else if (reason == DCB_REASON_DRAINED)
     {
         AVRO_CLIENT *client = (AVRO_CLIENT*)userdata;
 
@@ -973,6 +1333,14 @@ int avro_client_callback(DCB *dcb, DCB_REASON reason, void *userdata)
             return 0;
         }
 
+        if (avro_client_backlogged(client))
+        {
+            avro_client_pause(client);
+            spinlock_release(&client->catch_lock);
+            return 0;
+        }
+
+        client->cstate &= ~AVRO_CS_PAUSED;
         client->cstate |= AVRO_CS_BUSY;
         spinlock_release(&client->catch_lock);
 
@@ -1017,17 +1385,27 @@ int avro_client_callback(DCB *dcb, DCB_REASON reason, void *userdata)
 
         spinlock_acquire(&client->catch_lock);
         client->cstate &= ~AVRO_CS_BUSY;
-        client->cstate |= AVRO_WAIT_DATA;
 
-        if (next_file || read_more)
+        if (avro_client_backlogged(client))
         {
-#ifdef SS_DEBUG
-            if (read_more)
+            /** Neither new data nor the rest of the file is sent until the
+             * client has read what is already queued */
+            avro_client_pause(client);
+        }
+        else
+        {
+            client->cstate |= AVRO_WAIT_DATA;
+
+            if (next_file || read_more)
             {
-                MXS_DEBUG("Burst limit hit, need to read more data.");
-            }
+#ifdef SS_DEBUG
+                if (read_more)
+                {
+                    MXS_DEBUG("Burst limit hit, need to read more data.");
+                }
 #endif
-            avro_notify_client(client);
+                avro_notify_client(client);
+            }
         }
         spinlock_release(&client->catch_lock);
     }
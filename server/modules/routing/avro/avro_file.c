@@ -33,6 +33,7 @@
 #include <binlog_common.h>
 #include <blr_constants.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <avrorouter.h>
 #include <log_manager.h>
 #include <maxscale_pcre2.h>
@@ -42,6 +43,27 @@
 
 static const char *statefile_section = "avro-conversion";
 static const char *ddl_list_name = "table-ddl.list";
+
+/** Size of the window of a rotated binlog that is mapped at a time */
+#define BINLOG_MAP_WINDOW (16 * 1024 * 1024)
+
+/**
+ * The reader of the binlog file that is being converted. The binlog router
+ * does not change a file once it has rotated to the next one, so the events
+ * of the rotated files are used directly from a mapped window of the file.
+ * The last file may still be appended to or truncated and it is read into a
+ * buffer that is reused for all events.
+ */
+typedef struct binlog_reader
+{
+    int      fd;         /*< The binlog file */
+    bool     mapped;     /*< The file is read through the mapped window */
+    uint8_t  *map;       /*< The mapped window, NULL if nothing is mapped */
+    uint64_t map_offset; /*< File offset of the window */
+    size_t   map_size;   /*< Size of the window */
+    uint8_t  *buf;       /*< Buffer for the events of the last file */
+    size_t   buf_size;   /*< Size of the buffer */
+} BINLOG_READER;
 void handle_query_event(AVRO_INSTANCE *router, REP_HEADER *hdr,
                         int *pending_transaction, uint8_t *ptr);
 bool is_create_table_statement(AVRO_INSTANCE *router, char* ptr, size_t len);
@@ -104,8 +126,11 @@ void avro_close_binlog(int fd)
  * Create an Aro table and prepare it for writing.
  * @param filepath Path to the created file
  * @param json_schema The schema of the table in JSON format
+ * @param codec Compression codec of a new file, an existing file keeps its own
+ * @param block_size The Avro data block size
  */
-AVRO_TABLE* avro_table_alloc(const char* filepath, const char* json_schema, size_t block_size)
+AVRO_TABLE* avro_table_alloc(const char* filepath, const char* json_schema,
+                             const char *codec, size_t block_size)
 {
     AVRO_TABLE *table = calloc(1, sizeof(AVRO_TABLE));
     if (table)
@@ -126,7 +151,8 @@ AVRO_TABLE* avro_table_alloc(const char* filepath, const char* json_schema, size
         }
         else
         {
-            rc = avro_file_writer_create_with_codec(filepath, table->avro_schema, &table->avro_file, "null", block_size);
+            rc = avro_file_writer_create_with_codec(filepath, table->avro_schema, &table->avro_file,
+                                                    codec, block_size);
         }
 
         if (rc)
@@ -137,8 +163,14 @@ AVRO_TABLE* avro_table_alloc(const char* filepath, const char* json_schema, size
             return NULL;
         }
 
-        if ((table->avro_writer_iface = avro_generic_class_from_schema(table->avro_schema)) == NULL)
+        if ((table->avro_writer_iface = avro_generic_class_from_schema(table->avro_schema)) == NULL ||
+            avro_generic_value_new(table->avro_writer_iface, &table->avro_record))
         {
+            if (table->avro_writer_iface)
+            {
+                avro_value_iface_decref(table->avro_writer_iface);
+            }
+
             MXS_ERROR("Avro error: %s", avro_strerror());
             avro_schema_decref(table->avro_schema);
             avro_file_writer_close(table->avro_file);
@@ -310,6 +342,7 @@ void* avro_table_free(AVRO_TABLE *table)
     {
         avro_file_writer_flush(table->avro_file);
         avro_file_writer_close(table->avro_file);
+        avro_value_decref(&table->avro_record);
         avro_value_iface_decref(table->avro_writer_iface);
         avro_schema_decref(table->avro_schema);
         free(table->json_schema);
@@ -386,54 +419,183 @@ static void rotate_to_file(AVRO_INSTANCE* router, uint64_t pos, const char *next
 }
 
 /**
- * @brief Read the replication event payload
+ * @brief Prepare the reader of the current binlog file
  *
  * @param router Avro router instance
- * @param hdr Replication header
- * @param pos Starting position of the event header
- * @return The event data or NULL if an error occurred
+ * @param reader The reader to initialize
+ */
+static void binlog_reader_init(AVRO_INSTANCE *router, BINLOG_READER *reader)
+{
+    reader->fd = router->binlog_fd;
+    reader->mapped = binlog_next_file_exists(router->binlogdir, router->binlog_name);
+    reader->map = NULL;
+    reader->map_offset = 0;
+    reader->map_size = 0;
+    reader->buf = NULL;
+    reader->buf_size = 0;
+}
+
+/**
+ * @brief Release the mapped window and the buffer of a reader
+ *
+ * @param reader The reader
+ */
+static void binlog_reader_free(BINLOG_READER *reader)
+{
+    if (reader->map)
+    {
+        munmap(reader->map, reader->map_size);
+        reader->map = NULL;
+    }
+
+    free(reader->buf);
+    reader->buf = NULL;
+}
+
+/**
+ * @brief Move the mapped window so that it contains the requested bytes
+ *
+ * The previous window is unmapped so that the pages behind the reader do
+ * not stay in the memory of the process. The page cache is left alone as
+ * the binlog router may still send the same file to the slaves.
+ *
+ * @param reader The reader
+ * @param pos Offset of the first byte
+ * @param len Number of bytes
+ * @return Number of bytes available, less than @c len at the end of the file
+ * or -1 on error
  */
-static GWBUF* read_event_data(AVRO_INSTANCE *router, REP_HEADER* hdr, uint64_t pos)
+static int binlog_map_window(BINLOG_READER *reader, uint64_t pos, size_t len)
 {
-    GWBUF* result;
-    /* Allocate a GWBUF for the event */
-    if ((result = gwbuf_alloc(hdr->event_size - BINLOG_EVENT_HDR_LEN + 1)))
+    struct stat st;
+
+    if (fstat(reader->fd, &st) == -1)
+    {
+        return -1;
+    }
+
+    uint64_t file_size = st.st_size;
+
+    if (pos + len > file_size)
     {
-        uint8_t *data = GWBUF_DATA(result);
-        int n = pread(router->binlog_fd, data, hdr->event_size - BINLOG_EVENT_HDR_LEN,
-                      pos + BINLOG_EVENT_HDR_LEN);
-        /** NULL-terminate for QUERY_EVENT processing */
-        data[hdr->event_size - BINLOG_EVENT_HDR_LEN] = '\0';
+        return pos < file_size ? file_size - pos : 0;
+    }
+
+    if (reader->map)
+    {
+        munmap(reader->map, reader->map_size);
+        reader->map = NULL;
+    }
+
+    uint64_t start = pos & ~((uint64_t)sysconf(_SC_PAGESIZE) - 1);
+    size_t size = MAX(BINLOG_MAP_WINDOW, pos + len - start);
+
+    if (start + size > file_size)
+    {
+        size = file_size - start;
+    }
 
-        if (n != hdr->event_size - BINLOG_EVENT_HDR_LEN)
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, reader->fd, start);
+
+    if (map == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    madvise(map, size, MADV_SEQUENTIAL);
+    reader->map = map;
+    reader->map_offset = start;
+    reader->map_size = size;
+    return len;
+}
+
+/**
+ * @brief Read bytes from the binlog file
+ *
+ * The bytes of a rotated file are not copied, the returned pointer points to
+ * the mapped window. The mapping is private so the event handlers may modify
+ * the data without changing the file.
+ *
+ * @param reader The reader
+ * @param pos Offset of the first byte
+ * @param len Number of bytes
+ * @param dest Where the pointer to the bytes is stored, it is valid until the
+ * next read
+ * @return Number of bytes read, less than @c len at the end of the file or -1
+ * on error
+ */
+static int binlog_read(BINLOG_READER *reader, uint64_t pos, size_t len, uint8_t **dest)
+{
+    if (reader->mapped)
+    {
+        if (reader->map == NULL || pos < reader->map_offset ||
+            pos + len > reader->map_offset + reader->map_size)
         {
-            if (n == -1)
-            {
-                char err_msg[STRERROR_BUFLEN];
-                MXS_ERROR("Error reading the event at %lu in %s. "
-                          "%s, expected %d bytes.",
-                          pos, router->binlog_name,
-                          strerror_r(errno, err_msg, sizeof(err_msg)),
-                          hdr->event_size - BINLOG_EVENT_HDR_LEN);
-            }
-            else
+            int n = binlog_map_window(reader, pos, len);
+
+            if (n != (int)len)
             {
-                MXS_ERROR("Short read when reading the event at %lu in %s. "
-                          "Expected %d bytes got %d bytes.",
-                          pos, router->binlog_name,
-                          hdr->event_size - BINLOG_EVENT_HDR_LEN, n);
+                return n;
             }
-            gwbuf_free(result);
-            result = NULL;
         }
+
+        *dest = reader->map + (pos - reader->map_offset);
+        return len;
+    }
+
+    if (len > reader->buf_size)
+    {
+        uint8_t *buf = realloc(reader->buf, len);
+
+        if (buf == NULL)
+        {
+            return -1;
+        }
+
+        reader->buf = buf;
+        reader->buf_size = len;
     }
-    else
+
+    *dest = reader->buf;
+    return pread(reader->fd, reader->buf, len, pos);
+}
+
+/**
+ * @brief Read the replication event payload
+ *
+ * @param router Avro router instance
+ * @param reader Reader of the binlog file
+ * @param hdr Replication header
+ * @param pos Starting position of the event header
+ * @return The event data, valid until the next read, or NULL if an error occurred
+ */
+static uint8_t* read_event_data(AVRO_INSTANCE *router, BINLOG_READER *reader,
+                                REP_HEADER* hdr, uint64_t pos)
+{
+    uint8_t *data;
+    int len = hdr->event_size - BINLOG_EVENT_HDR_LEN;
+    int n = binlog_read(reader, pos + BINLOG_EVENT_HDR_LEN, len, &data);
+
+    if (n != len)
     {
-        MXS_ERROR("Failed to allocate memory for binlog entry, "
-                  "size %d at %lu.",
-                  hdr->event_size, pos);
+        if (n == -1)
+        {
+            char err_msg[STRERROR_BUFLEN];
+            MXS_ERROR("Error reading the event at %lu in %s. "
+                      "%s, expected %d bytes.",
+                      pos, router->binlog_name,
+                      strerror_r(errno, err_msg, sizeof(err_msg)), len);
+        }
+        else
+        {
+            MXS_ERROR("Short read when reading the event at %lu in %s. "
+                      "Expected %d bytes got %d bytes.",
+                      pos, router->binlog_name, len, n);
+        }
+        data = NULL;
     }
-    return result;
+
+    return data;
 }
 
 void notify_all_clients(AVRO_INSTANCE *router)
@@ -461,19 +623,15 @@ void notify_all_clients(AVRO_INSTANCE *router)
 }
 
 /**
- * @brief Read all replication events from a binlog file.
- *
- * Routine detects errors and pending transactions
+ * @brief Convert the events of the current binlog file
  *
- * @param router        The router instance
- * @param fix           Whether to fix or not errors
- * @param debug         Whether to enable or not the debug for events
- * @return              How the binlog was closed
- * @see enum avro_binlog_end
+ * @param router Avro router instance
+ * @param reader Reader of the binlog file
+ * @return How the binlog was closed
  */
-avro_binlog_end_t avro_read_all_events(AVRO_INSTANCE *router)
+static avro_binlog_end_t read_all_events(AVRO_INSTANCE *router, BINLOG_READER *reader)
 {
-    uint8_t hdbuf[BINLOG_EVENT_HDR_LEN];
+    uint8_t *hdbuf;
     unsigned long long pos = router->current_pos;
     unsigned long long last_known_commit = 4;
     char next_binlog[BINLOG_FNAMELEN + 1];
@@ -485,17 +643,11 @@ avro_binlog_end_t avro_read_all_events(AVRO_INSTANCE *router)
     bool rotate_seen = false;
     bool stop_seen = false;
 
-    if (router->binlog_fd == -1)
-    {
-        MXS_ERROR("Current binlog file %s is not open", router->binlog_name);
-        return AVRO_BINLOG_ERROR;
-    }
-
     while (1)
     {
         int n;
         /* Read the header information from the file */
-        if ((n = pread(router->binlog_fd, hdbuf, BINLOG_EVENT_HDR_LEN, pos)) != BINLOG_EVENT_HDR_LEN)
+        if ((n = binlog_read(reader, pos, BINLOG_EVENT_HDR_LEN, &hdbuf)) != BINLOG_EVENT_HDR_LEN)
         {
             switch (n)
             {
@@ -576,7 +728,7 @@ avro_binlog_end_t avro_read_all_events(AVRO_INSTANCE *router)
             return AVRO_BINLOG_ERROR;
         }
 
-        if (hdr.event_size <= 0)
+        if (hdr.event_size < BINLOG_EVENT_HDR_LEN)
         {
             MXS_ERROR("Event size error: "
                       "size %d at %llu.",
@@ -587,9 +739,10 @@ avro_binlog_end_t avro_read_all_events(AVRO_INSTANCE *router)
             return AVRO_BINLOG_ERROR;
         }
 
-        GWBUF *result = read_event_data(router, &hdr, pos);
+        /* get event content */
+        ptr = read_event_data(router, reader, &hdr, pos);
 
-        if (result == NULL)
+        if (ptr == NULL)
         {
             router->binlog_position = last_known_commit;
             router->current_pos = pos;
@@ -605,9 +758,6 @@ avro_binlog_end_t avro_read_all_events(AVRO_INSTANCE *router)
             last_known_commit = pos;
         }
 
-        /* get event content */
-        ptr = GWBUF_DATA(result);
-
         MXS_DEBUG("%s(%x) - %llu", binlog_event_name(hdr.event_type), hdr.event_type, pos);
 
         /* check for FORMAT DESCRIPTION EVENT */
@@ -717,8 +867,25 @@ avro_binlog_end_t avro_read_all_events(AVRO_INSTANCE *router)
          */
         else if (hdr.event_type == QUERY_EVENT)
         {
+            /** The statement is NULL-terminated for the processing */
+            size_t len = hdr.event_size - BINLOG_EVENT_HDR_LEN;
+            uint8_t *query = malloc(len + 1);
+
+            if (query == NULL)
+            {
+                MXS_ERROR("Failed to allocate memory for binlog entry, "
+                          "size %d at %llu.", hdr.event_size, pos);
+                router->binlog_position = last_known_commit;
+                router->current_pos = pos;
+                return AVRO_BINLOG_ERROR;
+            }
+
+            memcpy(query, ptr, len);
+            query[len] = '\0';
+
             int trx_before = pending_transaction;
-            handle_query_event(router, &hdr, &pending_transaction, ptr);
+            handle_query_event(router, &hdr, &pending_transaction, query);
+            free(query);
 
             if (trx_before != pending_transaction)
             {
@@ -744,8 +911,6 @@ avro_binlog_end_t avro_read_all_events(AVRO_INSTANCE *router)
             }
         }
 
-        gwbuf_free(result);
-
         /* pos and next_pos sanity checks */
         if (hdr.next_pos > 0 && hdr.next_pos < pos)
         {
@@ -778,6 +943,32 @@ avro_binlog_end_t avro_read_all_events(AVRO_INSTANCE *router)
     return AVRO_BINLOG_ERROR;
 }
 
+/**
+ * @brief Read all replication events from a binlog file.
+ *
+ * Routine detects errors and pending transactions
+ *
+ * @param router        The router instance
+ * @return              How the binlog was closed
+ * @see enum avro_binlog_end
+ */
+avro_binlog_end_t avro_read_all_events(AVRO_INSTANCE *router)
+{
+    BINLOG_READER reader;
+
+    if (router->binlog_fd == -1)
+    {
+        MXS_ERROR("Current binlog file %s is not open", router->binlog_name);
+        return AVRO_BINLOG_ERROR;
+    }
+
+    binlog_reader_init(router, &reader);
+    avro_binlog_end_t rval = read_all_events(router, &reader);
+    binlog_reader_free(&reader);
+
+    return rval;
+}
+
 /**
  * Read the field names from the stored Avro schemas
  *
@@ -851,6 +1042,9 @@ void avro_load_metadata_from_schemas(AVRO_INSTANCE *router)
  */
 void avro_flush_all_tables(AVRO_INSTANCE *router)
 {
+    /** The conversion threads must be done with the tables */
+    avro_shards_wait(router);
+
     HASHITERATOR *iter = hashtable_iterator(router->open_tables);
 
     if (iter)
@@ -997,6 +1191,8 @@ void handle_query_event(AVRO_INSTANCE *router, REP_HEADER *hdr, int *pending_tra
 
     if (is_create_table_statement(router, sql, len))
     {
+        /** The queued row events still use the old table definition */
+        avro_shards_wait(router);
         TABLE_CREATE *created = table_create_alloc(sql, db);
 
         if (created && !save_and_replace_table_create(router, created))
@@ -1021,6 +1217,7 @@ void handle_query_event(AVRO_INSTANCE *router, REP_HEADER *hdr, int *pending_tra
 
         TABLE_CREATE *created = hashtable_fetch(router->created_tables, full_ident);
         ss_dassert(created);
+        avro_shards_wait(router);
 
         if (created)
         {
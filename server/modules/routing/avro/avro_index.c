@@ -38,8 +38,111 @@
 
 void* safe_key_free(void *data);
 
-static const char insert_template[] = "INSERT INTO gtid(domain, server_id, "
-                                      "sequence, avrofile, position) values (%lu, %lu, %lu, \"%s\", %ld);";
+static const char insert_gtid_sql[] = "INSERT OR IGNORE INTO "GTID_TABLE_NAME"(domain, server_id, "
+                                      "sequence, avrofile, position) VALUES (?, ?, ?, ?, ?);";
+static const char select_progress_sql[] = "SELECT position FROM "INDEX_TABLE_NAME
+                                          " WHERE filename=?;";
+static const char update_progress_sql[] = "INSERT OR REPLACE INTO "INDEX_TABLE_NAME
+                                          " VALUES (?, ?);";
+static const char insert_used_sql[] = "INSERT OR IGNORE INTO "MEMORY_TABLE_NAME
+                                      "(domain, server_id, sequence, binlog_timestamp, table_name)"
+                                      " VALUES (?, ?, ?, ?, ?);";
+static const char flush_used_sql[] = "INSERT INTO "USED_TABLES_TABLE_NAME
+                                     " SELECT * FROM "MEMORY_TABLE_NAME";";
+static const char clear_used_sql[] = "DELETE FROM "MEMORY_TABLE_NAME";";
+
+/**
+ * @brief Prepare a statement of the index
+ *
+ * @param router Avro router instance
+ * @param sql The SQL of the statement
+ * @param stmt Where the statement is stored
+ * @return True if the statement was prepared
+ */
+static bool prepare_stmt(AVRO_INSTANCE *router, const char *sql, sqlite3_stmt **stmt)
+{
+    if (sqlite3_prepare_v2(router->sqlite_handle, sql, -1, stmt, NULL) != SQLITE_OK)
+    {
+        MXS_ERROR("Failed to prepare statement '%s': %s", sql,
+                  sqlite3_errmsg(router->sqlite_handle));
+        *stmt = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Execute a prepared statement that returns no rows
+ *
+ * The statement is reset and its parameters cleared so that it can be
+ * executed again.
+ *
+ * @param router Avro router instance
+ * @param stmt The statement
+ * @return True if the statement was executed
+ */
+static bool execute_stmt(AVRO_INSTANCE *router, sqlite3_stmt *stmt)
+{
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return rc == SQLITE_DONE;
+}
+
+/**
+ * @brief Execute an SQL statement and log the error
+ *
+ * @param router Avro router instance
+ * @param sql The statement
+ * @param what What the statement does, used in the error message
+ */
+static void execute_sql(AVRO_INSTANCE *router, const char *sql, const char *what)
+{
+    char *errmsg = NULL;
+
+    if (sqlite3_exec(router->sqlite_handle, sql, NULL, NULL, &errmsg) != SQLITE_OK)
+    {
+        MXS_ERROR("Failed to %s: %s", what, errmsg);
+    }
+    sqlite3_free(errmsg);
+}
+
+/**
+ * @brief Prepare the index database for use
+ *
+ * The database is put in WAL mode so that the clients can read the index while
+ * it is being written. The index can always be rebuilt from the Avro files, so
+ * it is only synced to disk at checkpoints. The statements used by the
+ * converter are prepared once here.
+ *
+ * @param router Avro router instance
+ * @return True if the statements were prepared
+ */
+bool avro_index_init(AVRO_INSTANCE *router)
+{
+    execute_sql(router, "PRAGMA journal_mode=WAL;", "enable WAL mode for the GTID index");
+    execute_sql(router, "PRAGMA synchronous=NORMAL;", "relax synchronization of the GTID index");
+
+    if (prepare_stmt(router, insert_gtid_sql, &router->insert_gtid_stmt) &&
+        prepare_stmt(router, select_progress_sql, &router->select_progress_stmt) &&
+        prepare_stmt(router, update_progress_sql, &router->update_progress_stmt) &&
+        prepare_stmt(router, insert_used_sql, &router->insert_used_stmt) &&
+        prepare_stmt(router, flush_used_sql, &router->flush_used_stmt) &&
+        prepare_stmt(router, clear_used_sql, &router->clear_used_stmt))
+    {
+        return true;
+    }
+
+    sqlite3_finalize(router->insert_gtid_stmt);
+    sqlite3_finalize(router->select_progress_stmt);
+    sqlite3_finalize(router->update_progress_stmt);
+    sqlite3_finalize(router->insert_used_stmt);
+    sqlite3_finalize(router->flush_used_stmt);
+    router->insert_gtid_stmt = router->select_progress_stmt = router->update_progress_stmt = NULL;
+    router->insert_used_stmt = router->flush_used_stmt = NULL;
+    return false;
+}
 
 static void set_gtid(gtid_pos_t *gtid, json_t *row)
 {
@@ -56,19 +159,53 @@ static void set_gtid(gtid_pos_t *gtid, json_t *row)
     gtid->domain = json_integer_value(obj);
 }
 
-int index_query_cb(void *data, int rows, char** values, char** names)
+/**
+ * @brief Get the GTID of the first record of the current data block
+ *
+ * Only the first record is decoded, the rest of the block is not read.
+ *
+ * @param file File to read from
+ * @param gtid Where the GTID is stored
+ * @return True if the block is complete and its GTID was read
+ */
+static bool read_block_gtid(MAXAVRO_FILE *file, gtid_pos_t *gtid)
 {
-    for (int i = 0; i < rows; i++)
+    long offset;
+    size_t len;
+
+    if (!maxavro_record_locate_block(file, &offset, &len))
     {
-        if (values[i])
-        {
-            *((long*)data) = strtol(values[i], NULL, 10);
-            return 0;
-        }
+        return false;
+    }
+
+    if (maxavro_record_get_integer(file, avro_sequence, &gtid->seq) &&
+        maxavro_record_get_integer(file, avro_server_id, &gtid->server_id) &&
+        maxavro_record_get_integer(file, avro_domain, &gtid->domain))
+    {
+        return true;
+    }
+
+    /** The first record is too large to be decoded from the start of the block */
+    json_t *row = maxavro_record_read_json(file);
+
+    if (row)
+    {
+        set_gtid(gtid, row);
+        json_decref(row);
     }
-    return 0;
+
+    return row != NULL;
 }
 
+/**
+ * @brief Index the new data blocks of an Avro file
+ *
+ * The GTID of the first record of each data block is added to the index with
+ * the offset of the block. The caller is responsible for the transaction.
+ *
+ * @param router Avro router instance
+ * @param filename The Avro file
+ */
 void avro_index_file(AVRO_INSTANCE *router, const char* filename)
 {
     MAXAVRO_FILE *file = maxavro_file_open(filename);
@@ -80,19 +217,24 @@ void avro_index_file(AVRO_INSTANCE *router, const char* filename)
 
         if (name)
         {
-            char sql[AVRO_SQL_BUFFER_SIZE];
-            char *errmsg;
+            sqlite3_stmt *stmt = router->select_progress_stmt;
             long pos = -1;
+            int rc;
             name++;
 
-            snprintf(sql, sizeof(sql), "SELECT position FROM "INDEX_TABLE_NAME
-                     " WHERE filename=\"%s\";", name);
+            sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
 
-            if (sqlite3_exec(router->sqlite_handle, sql, index_query_cb, &pos, &errmsg) != SQLITE_OK)
+            if ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+            {
+                pos = sqlite3_column_int64(stmt, 0);
+            }
+            sqlite3_reset(stmt);
+            sqlite3_clear_bindings(stmt);
+
+            if (rc != SQLITE_ROW && rc != SQLITE_DONE)
             {
                 MXS_ERROR("Failed to read last indexed position of file '%s': %s",
-                          name, errmsg);
-                sqlite3_free(errmsg);
+                          name, sqlite3_errmsg(router->sqlite_handle));
                 maxavro_file_close(file);
                 return;
             }
@@ -105,63 +247,48 @@ void avro_index_file(AVRO_INSTANCE *router, const char* filename)
             }
 
             gtid_pos_t prev_gtid = {0, 0, 0, 0, 0};
-
-            if (sqlite3_exec(router->sqlite_handle, "BEGIN", NULL, NULL, &errmsg) != SQLITE_OK)
-            {
-                MXS_ERROR("Failed to start transaction: %s", errmsg);
-            }
-            sqlite3_free(errmsg);
+            stmt = router->insert_gtid_stmt;
 
             do
             {
-                json_t *row = maxavro_record_read_json(file);
+                gtid_pos_t gtid;
+
+                if (!read_block_gtid(file, &gtid))
+                {
+                    break;
+                }
 
-                if (row)
+                if (prev_gtid.domain != gtid.domain ||
+                    prev_gtid.server_id != gtid.server_id ||
+                    prev_gtid.seq != gtid.seq)
                 {
-                    gtid_pos_t gtid;
-                    set_gtid(&gtid, row);
+                    sqlite3_bind_int64(stmt, 1, gtid.domain);
+                    sqlite3_bind_int64(stmt, 2, gtid.server_id);
+                    sqlite3_bind_int64(stmt, 3, gtid.seq);
+                    sqlite3_bind_text(stmt, 4, name, -1, SQLITE_STATIC);
+                    sqlite3_bind_int64(stmt, 5, file->block_start_pos);
 
-                    if (prev_gtid.domain != gtid.domain ||
-                        prev_gtid.server_id != gtid.server_id ||
-                        prev_gtid.seq != gtid.seq)
+                    if (!execute_stmt(router, stmt))
                     {
-                        snprintf(sql, sizeof(sql), insert_template, gtid.domain,
-                                 gtid.server_id, gtid.seq, name, file->block_start_pos);
-                        if (sqlite3_exec(router->sqlite_handle, sql, NULL, NULL,
-                                         &errmsg) != SQLITE_OK)
-                        {
-                            MXS_ERROR("Failed to insert GTID %lu-%lu-%lu for %s "
-                                      "into index database: %s", gtid.domain,
-                                      gtid.server_id, gtid.seq, name, errmsg);
-
-                        }
-                        sqlite3_free(errmsg);
-                        errmsg = NULL;
-                        prev_gtid = gtid;
+                        MXS_ERROR("Failed to insert GTID %lu-%lu-%lu for %s "
+                                  "into index database: %s", gtid.domain,
+                                  gtid.server_id, gtid.seq, name,
+                                  sqlite3_errmsg(router->sqlite_handle));
                     }
-                }
-                else
-                {
-                    break;
+                    prev_gtid = gtid;
                 }
             }
             while (maxavro_next_block(file));
 
-            if (sqlite3_exec(router->sqlite_handle, "COMMIT", NULL, NULL, &errmsg) != SQLITE_OK)
-            {
-                MXS_ERROR("Failed to commit transaction: %s", errmsg);
-            }
-            sqlite3_free(errmsg);
+            stmt = router->update_progress_stmt;
+            sqlite3_bind_int64(stmt, 1, file->block_start_pos);
+            sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC);
 
-            snprintf(sql, sizeof(sql), "INSERT OR REPLACE INTO "INDEX_TABLE_NAME
-                     " values (%lu, \"%s\");", file->block_start_pos, name);
-            if (sqlite3_exec(router->sqlite_handle, sql, NULL, NULL,
-                             &errmsg) != SQLITE_OK)
+            if (!execute_stmt(router, stmt))
             {
-                MXS_ERROR("Failed to update indexing progress: %s", errmsg);
+                MXS_ERROR("Failed to update indexing progress: %s",
+                          sqlite3_errmsg(router->sqlite_handle));
             }
-            sqlite3_free(errmsg);
-            errmsg = NULL;
         }
         else
         {
@@ -181,7 +308,7 @@ void avro_index_file(AVRO_INSTANCE *router, const char* filename)
  *
  * Builds an index of filenames, GTIDs and positions in the Avro file.
  * This allows all tables that contain a GTID to be fetched in an effiecent
- * manner.
+ * manner. All files are indexed in one transaction.
  * @param data The router instance
  */
 void avro_update_index(AVRO_INSTANCE* router)
@@ -192,20 +319,19 @@ void avro_update_index(AVRO_INSTANCE* router)
 
     if (glob(path, 0, NULL, &files) != GLOB_NOMATCH)
     {
+        execute_sql(router, "BEGIN", "start transaction");
+
         for (int i = 0; i < files.gl_pathc; i++)
         {
             avro_index_file(router, files.gl_pathv[i]);
         }
+
+        execute_sql(router, "COMMIT", "commit transaction");
     }
 
     globfree(&files);
 }
 
-/** The SQL for the in-memory used_tables table */
-static const char *insert_sql = "INSERT OR IGNORE INTO "MEMORY_TABLE_NAME
-                                "(domain, server_id, sequence, binlog_timestamp, table_name)"
-                                " VALUES (%lu, %lu, %lu, %lu, \"%s\")";
-
 /**
  * @brief Add a used table to the current transaction
  *
@@ -215,19 +341,21 @@ static const char *insert_sql = "INSERT OR IGNORE INTO "MEMORY_TABLE_NAME
  * @param router Avro router instance
  * @param table Table to add
  */
-void add_used_table(AVRO_INSTANCE* router, char* table)
+void add_used_table(AVRO_INSTANCE* router, const char* table)
 {
-    char sql[AVRO_SQL_BUFFER_SIZE], *errmsg;
-    snprintf(sql, sizeof(sql), insert_sql, router->gtid.domain, router->gtid.server_id,
-             router->gtid.seq, router->gtid.timestamp, table);
-
-    if (sqlite3_exec(router->sqlite_handle, sql, NULL, NULL, &errmsg) != SQLITE_OK)
+    sqlite3_stmt *stmt = router->insert_used_stmt;
+    sqlite3_bind_int64(stmt, 1, router->gtid.domain);
+    sqlite3_bind_int64(stmt, 2, router->gtid.server_id);
+    sqlite3_bind_int64(stmt, 3, router->gtid.seq);
+    sqlite3_bind_int64(stmt, 4, router->gtid.timestamp);
+    sqlite3_bind_text(stmt, 5, table, -1, SQLITE_STATIC);
+
+    if (!execute_stmt(router, stmt))
     {
         MXS_ERROR("Failed to add used table %s for GTID %lu-%lu-%lu: %s",
                   table, router->gtid.domain, router->gtid.server_id,
-                  router->gtid.seq, errmsg);
+                  router->gtid.seq, sqlite3_errmsg(router->sqlite_handle));
     }
-    sqlite3_free(errmsg);
 }
 
 /**
@@ -240,19 +368,10 @@ void add_used_table(AVRO_INSTANCE* router, char* table)
  */
 void update_used_tables(AVRO_INSTANCE* router)
 {
-    char *errmsg;
-
-    if (sqlite3_exec(router->sqlite_handle, "INSERT INTO "USED_TABLES_TABLE_NAME
-                     " SELECT * FROM "MEMORY_TABLE_NAME, NULL, NULL, &errmsg) != SQLITE_OK)
+    if (!execute_stmt(router, router->flush_used_stmt) ||
+        !execute_stmt(router, router->clear_used_stmt))
     {
-        MXS_ERROR("Failed to transfer used table data from memory to disk: %s", errmsg);
+        MXS_ERROR("Failed to transfer used table data from memory to disk: %s",
+                  sqlite3_errmsg(router->sqlite_handle));
     }
-    sqlite3_free(errmsg);
-
-    if (sqlite3_exec(router->sqlite_handle, "DELETE FROM "MEMORY_TABLE_NAME,
-                     NULL, NULL, &errmsg) != SQLITE_OK)
-    {
-        MXS_ERROR("Failed to transfer used table data from memory to disk: %s", errmsg);
-    }
-    sqlite3_free(errmsg);
 }
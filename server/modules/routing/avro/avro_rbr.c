@@ -90,6 +90,8 @@ bool handle_table_map_event(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr
 
         if (old == NULL || old->version != create->version)
         {
+            /** The queued events use the old map and Avro file */
+            avro_shards_wait(router);
             TABLE_MAP *map = table_map_alloc(ptr, ev_len, create);
 
             if (map)
@@ -104,7 +106,8 @@ bool handle_table_map_event(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr
 
                     /** Close the file and open a new one */
                     hashtable_delete(router->open_tables, table_ident);
-                    AVRO_TABLE *avro_table = avro_table_alloc(filepath, json_schema, router->block_size);
+                    AVRO_TABLE *avro_table = avro_table_alloc(filepath, json_schema, router->codec,
+                                                              router->block_size);
 
                     if (avro_table)
                     {
@@ -170,35 +173,168 @@ bool handle_table_map_event(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr
  * This sets the domain, server ID, sequence and event position fields of
  * the GTID. It also sets the event timestamp and event type fields.
  *
- * @param router Avro router instance
+ * @param gtid GTID of the event
  * @param hdr Replication header
  * @param event_type Event type
  * @param record Record to prepare
  */
-static void prepare_record(AVRO_INSTANCE *router, REP_HEADER *hdr,
+static void prepare_record(gtid_pos_t *gtid, REP_HEADER *hdr,
                            int event_type, avro_value_t *record)
 {
     avro_value_t field;
-    avro_value_get_by_name(record, avro_domain, &field, NULL);
-    avro_value_set_int(&field, router->gtid.domain);
+    avro_value_get_by_index(record, AVRO_FIELD_DOMAIN, &field, NULL);
+    avro_value_set_int(&field, gtid->domain);
 
-    avro_value_get_by_name(record, avro_server_id, &field, NULL);
-    avro_value_set_int(&field, router->gtid.server_id);
+    avro_value_get_by_index(record, AVRO_FIELD_SERVER_ID, &field, NULL);
+    avro_value_set_int(&field, gtid->server_id);
 
-    avro_value_get_by_name(record, avro_sequence, &field, NULL);
-    avro_value_set_int(&field, router->gtid.seq);
+    avro_value_get_by_index(record, AVRO_FIELD_SEQUENCE, &field, NULL);
+    avro_value_set_int(&field, gtid->seq);
 
-    router->gtid.event_num++;
-    avro_value_get_by_name(record, avro_event_number, &field, NULL);
-    avro_value_set_int(&field, router->gtid.event_num);
+    gtid->event_num++;
+    avro_value_get_by_index(record, AVRO_FIELD_EVENT_NUMBER, &field, NULL);
+    avro_value_set_int(&field, gtid->event_num);
 
-    avro_value_get_by_name(record, avro_timestamp, &field, NULL);
+    avro_value_get_by_index(record, AVRO_FIELD_TIMESTAMP, &field, NULL);
     avro_value_set_int(&field, hdr->timestamp);
 
-    avro_value_get_by_name(record, avro_event_type, &field, NULL);
+    avro_value_get_by_index(record, AVRO_FIELD_EVENT_TYPE, &field, NULL);
     avro_value_set_enum(&field, event_type);
 }
 
+/**
+ * @brief Convert the rows of a row event into Avro records
+ *
+ * Each event has one or more rows in it. The number of rows is not known
+ * beforehand so we must continue processing them until we reach the end
+ * of the event. Without a table the rows are only counted.
+ *
+ * @param gtid GTID of the event, the event number is advanced for each record
+ * @param hdr Replication header
+ * @param map Table map of the event
+ * @param table Avro file of the table or NULL to only count the records
+ * @param start Pointer to the start of the event
+ * @param ptr Pointer to the first row of the event
+ * @param col_present The bitfield of the columns that are present in the event
+ * @param pos Binlog position of the event
+ * @return Number of records in the event
+ */
+static int convert_rows(gtid_pos_t *gtid, REP_HEADER *hdr, TABLE_MAP *map,
+                        AVRO_TABLE *table, uint8_t *start, uint8_t *ptr,
+                        uint8_t *col_present, uint64_t pos)
+{
+    TABLE_CREATE *create = map->table_create;
+    int event_type = get_event_type(hdr->event_type);
+    avro_value_t *record = table ? &table->avro_record : NULL;
+    int records = 0;
+
+    while (ptr - start < hdr->event_size - BINLOG_EVENT_HDR_LEN)
+    {
+        /** Add the current GTID and timestamp */
+        uint8_t *end = ptr + hdr->event_size - BINLOG_EVENT_HDR_LEN;
+
+        if (record)
+        {
+            /** Resetting keeps the memory of the string and bytes values */
+            avro_value_reset(record);
+            prepare_record(gtid, hdr, event_type, record);
+        }
+        ptr = process_row_event_data(map, create, record, ptr, col_present, end);
+        if (record && avro_file_writer_append_value(table->avro_file, record))
+        {
+            MXS_ERROR("Failed to write value at position %ld: %s",
+                      pos, avro_strerror());
+        }
+        records++;
+
+        /** Update rows events have the before and after images of the
+         * affected rows so we'll process them as another record with
+         * a different type */
+        if (event_type == UPDATE_EVENT)
+        {
+            if (record)
+            {
+                avro_value_reset(record);
+                prepare_record(gtid, hdr, UPDATE_EVENT_AFTER, record);
+            }
+            ptr = process_row_event_data(map, create, record, ptr, col_present, end);
+            if (record && avro_file_writer_append_value(table->avro_file, record))
+            {
+                MXS_ERROR("Failed to write value at position %ld: %s",
+                          pos, avro_strerror());
+            }
+            records++;
+        }
+    }
+
+    return records;
+}
+
+/**
+ * @brief Queue a row event for the conversion thread of its table
+ *
+ * The records of the event are counted here so that the event numbers of
+ * the GTID are assigned in the order of the binlog even though the tables
+ * are converted in parallel.
+ *
+ * @param router Avro router instance
+ * @param hdr Replication header
+ * @param table_ident The table identifier, database.table
+ * @param map Table map of the event
+ * @param table Avro file of the table
+ * @param start Pointer to the start of the event
+ * @param ptr Pointer to the first row of the event
+ * @param present_offset Offset of the present columns bitmap in the event
+ * @return True if the event was queued
+ */
+static bool queue_row_event(AVRO_INSTANCE *router, REP_HEADER *hdr, const char *table_ident,
+                            TABLE_MAP *map, AVRO_TABLE *table, uint8_t *start,
+                            uint8_t *ptr, size_t present_offset)
+{
+    size_t len = hdr->event_size - BINLOG_EVENT_HDR_LEN;
+    AVRO_ROW_JOB *job = malloc(sizeof(AVRO_ROW_JOB));
+    uint8_t *data = malloc(len);
+
+    if (job == NULL || data == NULL)
+    {
+        MXS_ERROR("Failed to allocate memory for a row event of table %s.", table_ident);
+        free(job);
+        free(data);
+        return false;
+    }
+
+    memcpy(data, start, len);
+    job->hdr = *hdr;
+    job->data = data;
+    job->rows_offset = ptr - start;
+    job->present_offset = present_offset;
+    job->map = map;
+    job->table = table;
+    job->gtid = router->gtid;
+    job->pos = router->current_pos;
+    job->next = NULL;
+
+    router->gtid.event_num += convert_rows(&router->gtid, hdr, map, NULL, start, ptr,
+                                           start + present_offset, router->current_pos);
+    avro_shards_add(router, table_ident, job);
+    return true;
+}
+
+/**
+ * @brief Convert a queued row event
+ *
+ * Called by the conversion thread of the table. The job is freed.
+ *
+ * @param job The queued row event
+ */
+void avro_row_job_convert(AVRO_ROW_JOB *job)
+{
+    convert_rows(&job->gtid, &job->hdr, job->map, job->table, job->data,
+                 job->data + job->rows_offset, job->data + job->present_offset, job->pos);
+    free(job->data);
+    free(job);
+}
+
 /**
  * @brief Handle a single RBR row event
  *
@@ -253,6 +389,7 @@ bool handle_row_event(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr)
      * the future partial row images could be used if the bitfield containing
      * the columns that are present in this event is used. */
     const int coldata_size = (ncolumns + 7) / 8;
+    size_t present_offset = ptr - start;
     uint8_t col_present[coldata_size];
     memcpy(&col_present, ptr, coldata_size);
     ptr += coldata_size;
@@ -281,47 +418,19 @@ bool handle_row_event(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr)
 
         if (table && create && ncolumns == map->columns)
         {
-            avro_value_t record;
-            avro_generic_value_new(table->avro_writer_iface, &record);
-
-            /** Each event has one or more rows in it. The number of rows is not known
-             * beforehand so we must continue processing them until we reach the end
-             * of the event. */
-            int rows = 0;
-
-            while (ptr - start < hdr->event_size - BINLOG_EVENT_HDR_LEN)
+            if (router->n_shards)
             {
-                /** Add the current GTID and timestamp */
-                uint8_t *end = ptr + hdr->event_size - BINLOG_EVENT_HDR_LEN;
-                int event_type = get_event_type(hdr->event_type);
-                prepare_record(router, hdr, event_type, &record);
-                ptr = process_row_event_data(map, create, &record, ptr, col_present, end);
-                if (avro_file_writer_append_value(table->avro_file, &record))
-                {
-                    MXS_ERROR("Failed to write value at position %ld: %s",
-                              router->current_pos, avro_strerror());
-                }
-
-                /** Update rows events have the before and after images of the
-                 * affected rows so we'll process them as another record with
-                 * a different type */
-                if (event_type == UPDATE_EVENT)
-                {
-                    prepare_record(router, hdr, UPDATE_EVENT_AFTER, &record);
-                    ptr = process_row_event_data(map, create, &record, ptr, col_present, end);
-                    if (avro_file_writer_append_value(table->avro_file, &record))
-                    {
-                        MXS_ERROR("Failed to write value at position %ld: %s",
-                                  router->current_pos, avro_strerror());
-                    }
-                }
-
-                rows++;
+                rval = queue_row_event(router, hdr, table_ident, map, table, start,
+                                       ptr, present_offset);
+            }
+            else
+            {
+                convert_rows(&router->gtid, hdr, map, table, start, ptr,
+                             col_present, router->current_pos);
+                rval = true;
             }
 
             add_used_table(router, table_ident);
-            avro_value_decref(&record);
-            rval = true;
         }
         else if (table == NULL)
         {
@@ -482,7 +591,7 @@ int get_metadata_len(uint8_t type)
  *
  * @param map Table map event associated with this row
  * @param create Table creation associated with this row
- * @param record Avro record used for storing this row
+ * @param record Avro record used for storing this row, NULL to only skip the row
  * @param ptr Pointer to the start of the row data, should be after the row event header
  * @param columns_present The bitfield holding the columns that are present for
  * this row event. Currently this should be a bitfield which has all bits set.
@@ -509,8 +618,16 @@ uint8_t* process_row_event_data(TABLE_MAP *map, TABLE_CREATE *create, avro_value
     for (long i = 0; i < map->columns && npresent < ncolumns; i++)
     {
         ss_dassert(create->columns == map->columns);
-        ss_debug(int rc = )avro_value_get_by_name(record, create->column_names[i], &field, NULL);
-        ss_dassert(rc == 0);
+        if (record)
+        {
+            /** The fields are looked up by position, the schema was built
+             * from the same table map */
+            const char *name = NULL;
+            ss_debug(int rc = )avro_value_get_by_index(record, AVRO_METADATA_FIELDS + i,
+                                                       &field, &name);
+            ss_dassert(rc == 0 && strcmp(name, create->column_names[i]) == 0);
+            (void)name;
+        }
 
         if (bit_is_set(columns_present, ncolumns, i))
         {
@@ -520,11 +637,17 @@ uint8_t* process_row_event_data(TABLE_MAP *map, TABLE_CREATE *create, avro_value
                 if (column_is_blob(map->column_types[i]))
                 {
                     uint8_t nullvalue = 0;
-                    avro_value_set_bytes(&field, &nullvalue, 1);
+                    if (record)
+                    {
+                        avro_value_set_bytes(&field, &nullvalue, 1);
+                    }
                 }
                 else
                 {
-                    avro_value_set_null(&field);
+                    if (record)
+                    {
+                        avro_value_set_null(&field);
+                    }
                 }
             }
             else if (column_is_fixed_string(map->column_types[i]))
@@ -545,7 +668,10 @@ uint8_t* process_row_event_data(TABLE_MAP *map, TABLE_CREATE *create, avro_value
                         warn_large_enumset = true;
                         MXS_WARNING("ENUM/SET values larger than 255 values aren't supported.");
                     }
-                    avro_value_set_string(&field, strval);
+                    if (record)
+                    {
+                        avro_value_set_string(&field, strval);
+                    }
                     ptr += bytes;
                     ss_dassert(ptr < end);
                 }
@@ -555,7 +681,10 @@ uint8_t* process_row_event_data(TABLE_MAP *map, TABLE_CREATE *create, avro_value
                     char str[bytes + 1];
                     memcpy(str, ptr + 1, bytes);
                     str[bytes] = '\0';
-                    avro_value_set_string(&field, str);
+                    if (record)
+                    {
+                        avro_value_set_string(&field, str);
+                    }
                     ptr += bytes + 1;
                     ss_dassert(ptr < end);
                 }
@@ -575,7 +704,10 @@ uint8_t* process_row_event_data(TABLE_MAP *map, TABLE_CREATE *create, avro_value
                     warn_bit = true;
                     MXS_WARNING("BIT is not currently supported, values are stored as 0.");
                 }
-                avro_value_set_int(&field, value);
+                if (record)
+                {
+                    avro_value_set_int(&field, value);
+                }
                 ptr += bytes;
                 ss_dassert(ptr < end);
             }
@@ -583,7 +715,10 @@ uint8_t* process_row_event_data(TABLE_MAP *map, TABLE_CREATE *create, avro_value
             {
                 double f_value = 0.0;
                 ptr += unpack_decimal_field(ptr, metadata + metadata_offset, &f_value);
-                avro_value_set_double(&field, f_value);
+                if (record)
+                {
+                    avro_value_set_double(&field, f_value);
+                }
                 ss_dassert(ptr < end);
             }
             else if (column_is_variable_string(map->column_types[i]))
@@ -605,7 +740,10 @@ uint8_t* process_row_event_data(TABLE_MAP *map, TABLE_CREATE *create, avro_value
                 memcpy(buf, ptr, sz);
                 buf[sz] = '\0';
                 ptr += sz;
-                avro_value_set_string(&field, buf);
+                if (record)
+                {
+                    avro_value_set_string(&field, buf);
+                }
                 ss_dassert(ptr < end);
             }
             else if (column_is_blob(map->column_types[i]))
@@ -616,13 +754,19 @@ uint8_t* process_row_event_data(TABLE_MAP *map, TABLE_CREATE *create, avro_value
                 ptr += bytes;
                 if (len)
                 {
-                    avro_value_set_bytes(&field, ptr, len);
+                    if (record)
+                    {
+                        avro_value_set_bytes(&field, ptr, len);
+                    }
                     ptr += len;
                 }
                 else
                 {
                     uint8_t nullvalue = 0;
-                    avro_value_set_bytes(&field, &nullvalue, 1);
+                    if (record)
+                    {
+                        avro_value_set_bytes(&field, &nullvalue, 1);
+                    }
                 }
                 ss_dassert(ptr < end);
             }
@@ -632,7 +776,10 @@ uint8_t* process_row_event_data(TABLE_MAP *map, TABLE_CREATE *create, avro_value
                 struct tm tm;
                 ptr += unpack_temporal_value(map->column_types[i], ptr, &metadata[metadata_offset], &tm);
                 format_temporal_value(buf, sizeof(buf), map->column_types[i], &tm);
-                avro_value_set_string(&field, buf);
+                if (record)
+                {
+                    avro_value_set_string(&field, buf);
+                }
                 ss_dassert(ptr < end);
             }
             /** All numeric types (INT, LONG, FLOAT etc.) */
@@ -642,7 +789,10 @@ uint8_t* process_row_event_data(TABLE_MAP *map, TABLE_CREATE *create, avro_value
                 memset(lval, 0, sizeof(lval));
                 ptr += unpack_numeric_field(ptr, map->column_types[i],
                                             &metadata[metadata_offset], lval);
-                set_numeric_field_value(&field, map->column_types[i], &metadata[metadata_offset], lval);
+                if (record)
+                {
+                    set_numeric_field_value(&field, map->column_types[i], &metadata[metadata_offset], lval);
+                }
                 ss_dassert(ptr < end);
             }
             ss_dassert(metadata_offset <= map->column_metadata_size);
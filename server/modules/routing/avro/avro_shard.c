@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file avro_shard.c - Parallel conversion of the row events
+ *
+ * The tables are divided between a pool of conversion threads by a hash of
+ * the table name. The thread of a table owns its Avro file writer and
+ * converts the row events of the table in the order they were read. The
+ * converter reads the binlog, handles the DDL and the table maps and queues
+ * the row events to the threads.
+ *
+ * Before the tables are flushed, the conversion state is saved or a table is
+ * replaced, the converter waits until all threads have converted the events
+ * queued to them. The saved GTID is thus only advanced once every thread has
+ * passed it.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <thread.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+#include <avrorouter.h>
+
+/**
+ * The conversion thread of a shard
+ *
+ * @param data The shard
+ */
+static void shard_thread(void *data)
+{
+    AVRO_SHARD *shard = (AVRO_SHARD*)data;
+
+    pthread_mutex_lock(&shard->lock);
+
+    while (true)
+    {
+        while (shard->head == NULL)
+        {
+            pthread_cond_wait(&shard->cond, &shard->lock);
+        }
+
+        AVRO_ROW_JOB *job = shard->head;
+        shard->head = job->next;
+
+        if (shard->head == NULL)
+        {
+            shard->tail = NULL;
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+        avro_row_job_convert(job);
+        pthread_mutex_lock(&shard->lock);
+
+        /** The job is only counted out once it has been converted so that
+         * avro_shards_wait also waits for the one in progress */
+        shard->njobs--;
+        shard->n_events++;
+        pthread_cond_broadcast(&shard->cond);
+    }
+}
+
+/**
+ * @brief Start the conversion threads
+ *
+ * If not all threads could be started, the ones that were started are used.
+ *
+ * @param router Avro router instance
+ * @param nthreads Number of threads to start
+ * @return True if at least one thread was started
+ */
+bool avro_shards_start(AVRO_INSTANCE *router, int nthreads)
+{
+    AVRO_SHARD *shards = calloc(nthreads, sizeof(AVRO_SHARD));
+    int started = 0;
+
+    if (shards == NULL)
+    {
+        MXS_ERROR("[%s] Failed to allocate memory for the conversion threads.",
+                  router->service->name);
+        return false;
+    }
+
+    for (int i = 0; i < nthreads; i++)
+    {
+        AVRO_SHARD *shard = &shards[started];
+        pthread_mutex_init(&shard->lock, NULL);
+        pthread_cond_init(&shard->cond, NULL);
+
+        if (thread_start(&shard->thread, shard_thread, shard) == NULL)
+        {
+            MXS_ERROR("[%s] Failed to start conversion thread %d, using %d threads.",
+                      router->service->name, i + 1, started);
+            pthread_cond_destroy(&shard->cond);
+            pthread_mutex_destroy(&shard->lock);
+            break;
+        }
+
+        started++;
+    }
+
+    if (started == 0)
+    {
+        free(shards);
+        return false;
+    }
+
+    router->shards = shards;
+    router->n_shards = started;
+    return true;
+}
+
+/**
+ * @brief Queue a row event to the conversion thread of its table
+ *
+ * Waits if the queue of the thread is full.
+ *
+ * @param router Avro router instance
+ * @param table_ident The table identifier, database.table
+ * @param job The row event
+ */
+void avro_shards_add(AVRO_INSTANCE *router, const char *table_ident, AVRO_ROW_JOB *job)
+{
+    unsigned int hash = simple_str_hash((char*)table_ident);
+    AVRO_SHARD *shard = &router->shards[hash % router->n_shards];
+
+    pthread_mutex_lock(&shard->lock);
+
+    while (shard->njobs >= AVRO_SHARD_QUEUE_MAX)
+    {
+        pthread_cond_wait(&shard->cond, &shard->lock);
+    }
+
+    if (shard->tail)
+    {
+        shard->tail->next = job;
+    }
+    else
+    {
+        shard->head = job;
+    }
+
+    shard->tail = job;
+    shard->njobs++;
+    pthread_cond_broadcast(&shard->cond);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * @brief Wait until all queued row events have been converted
+ *
+ * @param router Avro router instance
+ */
+void avro_shards_wait(AVRO_INSTANCE *router)
+{
+    for (int i = 0; i < router->n_shards; i++)
+    {
+        AVRO_SHARD *shard = &router->shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+
+        while (shard->njobs > 0)
+        {
+            pthread_cond_wait(&shard->cond, &shard->lock);
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
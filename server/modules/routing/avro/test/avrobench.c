@@ -0,0 +1,448 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file avrobench.c Throughput benchmark of the binlog to Avro conversion
+ *
+ * The binlog files are converted with avro_read_all_events in the same way
+ * the conversion task does it. Each run uses a new router instance and Avro
+ * directory and the whole conversion, including the flushing of the Avro
+ * files and the GTID index, is timed. The results are written as JSON:
+ *
+ * @verbatim
+ * {
+ *   "codec": "null",
+ *   "results": [
+ *     {"conversion_threads": 0, "seconds": 1.912, "events_per_sec": 261507,
+ *      "mb_per_sec": 12.22, "syscalls": 2011, "avro_bytes": 8100532},
+ *     ...
+ *   ],
+ *   "events": 500003, "bytes": 24501234
+ * }
+ * @endverbatim
+ *
+ * The events and bytes are those of the binlog files that were converted and
+ * the syscalls are the reads and writes the process did during the run. The
+ * temporary directory is kept if a run fails so that the log can be read.
+ *
+ * Without -d a binlog file of row based transactions is generated.
+ *
+ * Usage: avrobench [-d binlogdir] [-n transactions] [-r rows] [-v value_len]
+ *                  [-t threads] [-c codec] [-O options] [-D dir] [-o file]
+ */
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <avrorouter.h>
+#include <gwdirs.h>
+#include <log_manager.h>
+#include <router.h>
+#include <service.h>
+#include <binloggen.h>
+
+/** Largest number of binlog files converted in one run */
+#define BENCH_MAX_FILES 1024
+
+extern void ModuleInit();
+extern ROUTER_OBJECT *GetModuleObject();
+extern bool avro_save_conversion_state(AVRO_INSTANCE *router);
+extern void avro_update_index(AVRO_INSTANCE *router);
+
+/** Total size of the Avro files of the current run */
+static uint64_t avro_bytes;
+
+static double
+bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/**
+ * Read the number of read and write system calls of the process
+ */
+static uint64_t
+bench_syscalls()
+{
+    FILE *file = fopen("/proc/self/io", "r");
+    uint64_t total = 0;
+
+    if (file)
+    {
+        char line[128];
+        unsigned long long value;
+
+        while (fgets(line, sizeof(line), file))
+        {
+            if (sscanf(line, "syscr: %llu", &value) == 1 ||
+                sscanf(line, "syscw: %llu", &value) == 1)
+            {
+                total += value;
+            }
+        }
+        fclose(file);
+    }
+
+    return total;
+}
+
+static int
+remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+static int
+add_avro_size(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    size_t len = strlen(path);
+
+    if (flag == FTW_F && len > 5 && strcmp(path + len - 5, ".avro") == 0)
+    {
+        avro_bytes += st->st_size;
+    }
+
+    return 0;
+}
+
+/**
+ * Count the events of a binlog file
+ *
+ * @param dir       Binlog directory
+ * @param name      Binlog file name
+ * @param n_events  The number of events is added to this
+ * @param n_bytes   The size of the events is added to this
+ */
+static void
+count_events(const char *dir, const char *name, uint64_t *n_events, uint64_t *n_bytes)
+{
+    char path[PATH_MAX + 1];
+    uint8_t hdr[BINLOG_EVENT_HDR_LEN];
+    off_t pos = BINLOG_MAGIC_SIZE;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1)
+    {
+        return;
+    }
+
+    while (pread(fd, hdr, sizeof(hdr), pos) == sizeof(hdr))
+    {
+        uint32_t size = hdr[9] | hdr[10] << 8 | hdr[11] << 16 | (uint32_t)hdr[12] << 24;
+
+        if (size < BINLOG_EVENT_HDR_LEN)
+        {
+            break;
+        }
+
+        (*n_events)++;
+        *n_bytes += size;
+        pos += size;
+    }
+
+    close(fd);
+}
+
+/**
+ * Create an Avro router instance
+ *
+ * @param binlogdir  Binlog directory
+ * @param avrodir    Avro directory
+ * @param threads    Number of conversion threads
+ * @param codec      The Avro codec
+ * @param extra      Extra router options separated by commas or NULL
+ * @return The router instance or NULL on error
+ */
+static AVRO_INSTANCE *
+bench_router_create(const char *binlogdir, const char *avrodir, int threads,
+                    const char *codec, const char *extra)
+{
+    static int n_services = 0;
+    char name[64];
+    char optstr[2 * PATH_MAX + 1024];
+    char *options[64];
+    int n = 0;
+
+    snprintf(name, sizeof(name), "avrobench%d", ++n_services);
+    SERVICE *service = service_alloc(name, "avrorouter");
+
+    if (service == NULL)
+    {
+        return NULL;
+    }
+
+    snprintf(optstr, sizeof(optstr), "binlogdir=%s,avrodir=%s,conversion_threads=%d,codec=%s%s%s",
+             binlogdir, avrodir, threads, codec, extra ? "," : "", extra ? extra : "");
+
+    char *lasts;
+    for (char *tok = strtok_r(optstr, ",", &lasts); tok && n < 63;
+         tok = strtok_r(NULL, ",", &lasts))
+    {
+        options[n++] = strdup(tok);
+    }
+    options[n] = NULL;
+
+    AVRO_INSTANCE *inst = (AVRO_INSTANCE *)GetModuleObject()->createInstance(service, options);
+
+    for (int i = 0; i < n; i++)
+    {
+        free(options[i]);
+    }
+
+    return inst;
+}
+
+/**
+ * Run the conversion once
+ *
+ * @return True on success
+ */
+static bool
+bench_run(FILE *out, bool first, const char *binlogdir, const char *avrodir,
+          int threads, const char *codec, const char *extra,
+          uint64_t *n_events, uint64_t *n_bytes)
+{
+    AVRO_INSTANCE *inst;
+
+    if (mkdir(avrodir, 0700) != 0 ||
+        (inst = bench_router_create(binlogdir, avrodir, threads, codec, extra)) == NULL)
+    {
+        fprintf(stderr, "Failed to set up the router in %s\n", avrodir);
+        return false;
+    }
+
+    static char files[BENCH_MAX_FILES][BINLOG_FNAMELEN + 1];
+    int n_files = 0;
+    avro_binlog_end_t binlog_end = AVRO_OK;
+    uint64_t syscalls = bench_syscalls();
+    double start = bench_now();
+
+    while (binlog_end == AVRO_OK && n_files < BENCH_MAX_FILES)
+    {
+        strcpy(files[n_files], inst->binlog_name);
+
+        if (!avro_open_binlog(inst->binlogdir, inst->binlog_name, &inst->binlog_fd))
+        {
+            binlog_end = AVRO_BINLOG_ERROR;
+            break;
+        }
+
+        n_files++;
+        binlog_end = avro_read_all_events(inst);
+        avro_shards_wait(inst);
+        avro_update_index(inst);
+        avro_close_binlog(inst->binlog_fd);
+    }
+
+    avro_flush_all_tables(inst);
+    avro_save_conversion_state(inst);
+
+    double seconds = bench_now() - start;
+    syscalls = bench_syscalls() - syscalls;
+
+    if (binlog_end == AVRO_BINLOG_ERROR)
+    {
+        fprintf(stderr, "Failed to convert binlog %s\n", inst->binlog_name);
+        return false;
+    }
+
+    *n_events = 0;
+    *n_bytes = 0;
+
+    for (int i = 0; i < n_files; i++)
+    {
+        count_events(binlogdir, files[i], n_events, n_bytes);
+    }
+
+    avro_bytes = 0;
+    nftw(avrodir, add_avro_size, 16, FTW_PHYS);
+
+    fprintf(out, "%s\n    {\"conversion_threads\": %d, \"seconds\": %.6f, \"events_per_sec\": %.0f, "
+            "\"mb_per_sec\": %.2f, \"syscalls\": %lu, \"avro_bytes\": %lu}",
+            first ? "" : ",", inst->n_shards, seconds, *n_events / seconds,
+            *n_bytes / seconds / (1024 * 1024), syscalls, avro_bytes);
+    fflush(out);
+
+    /** The instance stays allocated, it is not used again */
+    return true;
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-d binlogdir] [-n transactions] [-r rows] [-v value_len]\n"
+            "          [-t threads] [-c codec] [-O options] [-D dir] [-o file]\n"
+            "\n"
+            "  -d  Directory of the binlog files, by default one file is generated\n"
+            "  -n  Number of transactions in the generated binlog, default 100000\n"
+            "  -r  Number of rows in each transaction, default 5\n"
+            "  -v  Length of the value of each row, default 32\n"
+            "  -t  Comma separated list of conversion thread counts, default 0,2,4\n"
+            "  -c  Avro codec, null or deflate, default null\n"
+            "  -O  Extra router options, for example filestem=binlog\n"
+            "  -D  Directory for the Avro files, by default a temporary one\n"
+            "  -o  Write the results to this file instead of the standard output\n",
+            name);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *binlogdir = NULL;
+    const char *thread_list = "0,2,4";
+    const char *codec = "null";
+    const char *extra = NULL;
+    const char *basedir = NULL;
+    int n_trx = 100000;
+    int rows = 5;
+    int value_len = 32;
+    FILE *out = stdout;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:n:r:v:t:c:O:D:o:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            binlogdir = optarg;
+            break;
+        case 'n':
+            n_trx = atoi(optarg);
+            break;
+        case 'r':
+            rows = atoi(optarg);
+            break;
+        case 'v':
+            value_len = atoi(optarg);
+            break;
+        case 't':
+            thread_list = optarg;
+            break;
+        case 'c':
+            codec = optarg;
+            break;
+        case 'O':
+            extra = optarg;
+            break;
+        case 'D':
+            basedir = optarg;
+            break;
+        case 'o':
+            if ((out = fopen(optarg, "w")) == NULL)
+            {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (n_trx < 1 || rows < 1 || value_len < 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    char tmpdir[PATH_MAX + 1];
+    snprintf(tmpdir, sizeof(tmpdir), "%s/avrobench.XXXXXX", basedir ? basedir : "/tmp");
+
+    if (mkdtemp(tmpdir) == NULL)
+    {
+        perror(tmpdir);
+        return 1;
+    }
+
+    mxs_log_init(NULL, tmpdir, MXS_LOG_TARGET_FS);
+    mxs_log_set_priority_enabled(LOG_DEBUG, false);
+    mxs_log_set_priority_enabled(LOG_INFO, false);
+    mxs_log_set_priority_enabled(LOG_NOTICE, false);
+    mxs_log_set_syslog_enabled(false);
+
+    set_libdir(strdup(".."));
+    ModuleInit();
+
+    char gendir[PATH_MAX + 1];
+
+    if (binlogdir == NULL)
+    {
+        char path[PATH_MAX + 1];
+        snprintf(gendir, sizeof(gendir), "%s/binlog", tmpdir);
+        snprintf(path, sizeof(path), "%s/" BINLOG_NAMEFMT, gendir, BINLOG_NAME_ROOT, 1);
+
+        if (mkdir(gendir, 0700) != 0 || !binlog_generate(path, n_trx, rows, value_len, true))
+        {
+            fprintf(stderr, "Failed to generate the binlog %s\n", path);
+            return 1;
+        }
+        binlogdir = gendir;
+    }
+
+    fprintf(out, "{\n  \"codec\": \"%s\",\n  \"results\": [", codec);
+
+    int rval = 0;
+    int run = 0;
+    uint64_t n_events = 0;
+    uint64_t n_bytes = 0;
+    char *list = strdup(thread_list);
+    char *lasts;
+
+    for (char *tok = strtok_r(list, ",", &lasts); tok; tok = strtok_r(NULL, ",", &lasts))
+    {
+        char avrodir[PATH_MAX + 1];
+        snprintf(avrodir, sizeof(avrodir), "%s/avro%d", tmpdir, run);
+
+        if (!bench_run(out, run == 0, binlogdir, avrodir, atoi(tok), codec, extra,
+                       &n_events, &n_bytes))
+        {
+            rval = 1;
+            break;
+        }
+        run++;
+    }
+
+    fprintf(out, "\n  ],\n  \"events\": %lu, \"bytes\": %lu\n}\n", n_events, n_bytes);
+
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+
+    free(list);
+    mxs_log_finish();
+
+    if (rval == 0)
+    {
+        nftw(tmpdir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+    else
+    {
+        fprintf(stderr, "The log is in %s\n", tmpdir);
+    }
+
+    return rval;
+}
@@ -81,6 +81,7 @@ static char *version_str = "V2.0.0";
 /* The router entry points */
 static  ROUTER  *createInstance(SERVICE *service, char **options);
 static void free_instance(ROUTER_INSTANCE *instance);
+static unsigned long blr_parse_size(char *value);
 static  void    *newSession(ROUTER *instance, SESSION *session);
 static  void    closeSession(ROUTER *instance, void *router_session);
 static  void    freeSession(ROUTER *instance, void *router_session);
@@ -103,7 +104,7 @@ static int blr_handle_config_item(const char *name, const char *value, ROUTER_IN
 static int blr_set_service_mysql_user(SERVICE *service);
 static int blr_load_dbusers(const ROUTER_INSTANCE *router);
 static int blr_check_binlog(ROUTER_INSTANCE *router);
-int blr_read_events_all_events(ROUTER_INSTANCE *router, int fix, int debug);
+int blr_read_events_all_events(ROUTER_INSTANCE *router, uint64_t start_pos, int fix, int debug);
 void blr_master_close(ROUTER_INSTANCE *);
 
 /** The module object definition */
@@ -240,8 +241,11 @@ createInstance(SERVICE *service, char **options)
     inst->files = NULL;
     spinlock_init(&inst->fileslock);
     spinlock_init(&inst->binlog_lock);
+    spinlock_init(&inst->catchup_lock);
 
     inst->binlog_fd = -1;
+    inst->index_fd = -1;
+    inst->index_pending.start = 0;
     inst->master_chksum = true;
     inst->master_uuid = NULL;
 
@@ -255,6 +259,14 @@ createInstance(SERVICE *service, char **options)
     inst->short_burst = DEF_SHORT_BURST;
     inst->long_burst = DEF_LONG_BURST;
     inst->burst_size = DEF_BURST_SIZE;
+    inst->lagging_burst_size = DEF_LAGGING_BURST_SIZE;
+    inst->catchup_near = DEF_CATCHUP_NEAR;
+    inst->catchup_bandwidth = 0;
+    inst->cache_size = DEF_CACHE_SIZE;
+    inst->write_buf_size = DEF_WRITE_BUFFER_SIZE;
+    inst->sync_policy = BLR_SYNC_BATCH;
+    inst->sync_period = DEF_SYNC_PERIOD;
+    inst->sync_bytes = DEF_SYNC_BYTES;
     inst->retry_backoff = 1;
     inst->binlogdir = NULL;
     inst->heartbeat = BLR_HEARTBEAT_DEFAULT_INTERVAL;
@@ -276,6 +288,18 @@ createInstance(SERVICE *service, char **options)
     inst->set_master_uuid = NULL;
     inst->set_master_server_id = NULL;
     inst->send_slave_heartbeat = 0;
+    inst->bulk_catchup = 1;
+    inst->binlog_index = 1;
+    inst->verify_threads = 0;
+    inst->semisync = 0;
+    inst->shared_cache = 0;
+    inst->async_distribution = 0;
+    inst->dist_queue = NULL;
+    inst->async_checksum = 0;
+    inst->compress_binlogs = 0;
+    inst->badcrc_state = BLR_BADCRC_NONE;
+    inst->semisync_active = false;
+    inst->semisync_need_ack = false;
 
     inst->serverid = 0;
 
@@ -427,29 +451,70 @@ createInstance(SERVICE *service, char **options)
                 }
                 else if (strcmp(options[i], "burstsize") == 0)
                 {
-                    unsigned long size = atoi(value);
-                    char    *ptr = value;
-                    while (*ptr && isdigit(*ptr))
+                    inst->burst_size = blr_parse_size(value);
+                }
+                else if (strcmp(options[i], "lagging_burstsize") == 0)
+                {
+                    inst->lagging_burst_size = blr_parse_size(value);
+                }
+                else if (strcmp(options[i], "catchup_near") == 0)
+                {
+                    inst->catchup_near = blr_parse_size(value);
+                }
+                else if (strcmp(options[i], "catchup_bandwidth") == 0)
+                {
+                    inst->catchup_bandwidth = blr_parse_size(value);
+                }
+                else if (strcmp(options[i], "cache_size") == 0)
+                {
+                    inst->cache_size = blr_parse_size(value);
+                }
+                else if (strcmp(options[i], "write_buffer_size") == 0)
+                {
+                    inst->write_buf_size = blr_parse_size(value);
+                }
+                else if (strcmp(options[i], "sync_policy") == 0)
+                {
+                    if (strcasecmp(value, "batch") == 0)
                     {
-                        ptr++;
+                        inst->sync_policy = BLR_SYNC_BATCH;
                     }
-                    switch (*ptr)
+                    else if (strcasecmp(value, "transaction") == 0)
                     {
-                    case 'G':
-                    case 'g':
-                        size = size * 1024 * 1000 * 1000;
-                        break;
-                    case 'M':
-                    case 'm':
-                        size = size * 1024 * 1000;
-                        break;
-                    case 'K':
-                    case 'k':
-                        size = size * 1024;
-                        break;
+                        inst->sync_policy = BLR_SYNC_TRANSACTION;
                     }
-                    inst->burst_size = size;
+                    else if (strcasecmp(value, "period") == 0)
+                    {
+                        inst->sync_policy = BLR_SYNC_PERIOD;
+                    }
+                    else if (strcasecmp(value, "bytes") == 0)
+                    {
+                        inst->sync_policy = BLR_SYNC_BYTES;
+                    }
+                    else
+                    {
+                        MXS_WARNING("Invalid sync_policy %s, expected batch, "
+                                    "transaction, period or bytes. Using batch.", value);
+                    }
+                }
+                else if (strcmp(options[i], "sync_period") == 0)
+                {
+                    int p_val = (int)strtol(value, NULL, 10);
 
+                    if (p_val <= 0 || (errno == ERANGE))
+                    {
+                        MXS_WARNING("Invalid sync_period %s."
+                                    " Setting it to default value %lu.",
+                                    value, inst->sync_period);
+                    }
+                    else
+                    {
+                        inst->sync_period = p_val;
+                    }
+                }
+                else if (strcmp(options[i], "sync_bytes") == 0)
+                {
+                    inst->sync_bytes = blr_parse_size(value);
                 }
                 else if (strcmp(options[i], "heartbeat") == 0)
                 {
@@ -470,6 +535,38 @@ createInstance(SERVICE *service, char **options)
                 {
                     inst->send_slave_heartbeat = config_truth_value(value);
                 }
+                else if (strcmp(options[i], "bulk_catchup") == 0)
+                {
+                    inst->bulk_catchup = config_truth_value(value);
+                }
+                else if (strcmp(options[i], "binlog_index") == 0)
+                {
+                    inst->binlog_index = config_truth_value(value);
+                }
+                else if (strcmp(options[i], "async_distribution") == 0)
+                {
+                    inst->async_distribution = config_truth_value(value);
+                }
+                else if (strcmp(options[i], "async_checksum") == 0)
+                {
+                    inst->async_checksum = config_truth_value(value);
+                }
+                else if (strcmp(options[i], "compress_binlogs") == 0)
+                {
+                    inst->compress_binlogs = config_truth_value(value);
+                }
+                else if (strcmp(options[i], "shared_cache") == 0)
+                {
+                    inst->shared_cache = config_truth_value(value);
+                }
+                else if (strcmp(options[i], "semisync") == 0)
+                {
+                    inst->semisync = config_truth_value(value);
+                }
+                else if (strcmp(options[i], "verify_threads") == 0)
+                {
+                    inst->verify_threads = atoi(value);
+                }
                 else if (strcmp(options[i], "binlogdir") == 0)
                 {
                     inst->binlogdir = strdup(value);
@@ -518,6 +615,22 @@ createInstance(SERVICE *service, char **options)
         return NULL;
     }
 
+    /* Two services writing the same binlog files would corrupt them */
+    spinlock_acquire(&instlock);
+    for (ROUTER_INSTANCE *other = instances; other; other = other->next)
+    {
+        if (strcmp(other->binlogdir, inst->binlogdir) == 0)
+        {
+            MXS_ERROR("Service %s, binlog directory '%s' is already used by service %s. "
+                      "Each master must have its own binlog directory.",
+                      service->name, inst->binlogdir, other->service->name);
+            spinlock_release(&instlock);
+            free_instance(inst);
+            return NULL;
+        }
+    }
+    spinlock_release(&instlock);
+
     if (inst->serverid <= 0)
     {
         MXS_ERROR("Service %s, server-id is not configured. "
@@ -686,12 +799,49 @@ createInstance(SERVICE *service, char **options)
      */
     blr_init_cache(inst);
 
+    /*
+     * The events of open transactions are collected in the write buffer
+     */
+    if (inst->write_buf_size && (inst->write_buf = malloc(inst->write_buf_size)) == NULL)
+    {
+        MXS_ERROR("%s: Failed to allocate the binlog write buffer, "
+                  "the events are written one at a time.", service->name);
+        inst->write_buf_size = 0;
+    }
+
     /*
      * Add tasks for statistic computation
      */
     snprintf(task_name, BLRM_TASK_NAME_LEN, "%s stats", service->name);
     hktask_add(task_name, stats_func, inst, BLR_STATS_FREQ);
 
+    /*
+     * Add the task that resumes the catch-up of the slaves that were
+     * deferred by the catch-up bandwidth limit
+     */
+    if (inst->catchup_bandwidth)
+    {
+        inst->catchup_tokens = inst->catchup_bandwidth;
+        snprintf(task_name, BLRM_TASK_NAME_LEN, "%s catchup", service->name);
+        hktask_add_ms(task_name, blr_slave_catchup_wakeup, inst, BLR_CATCHUP_PERIOD);
+    }
+
+    /* Start the thread that sends the events to the slaves */
+    if (inst->async_distribution && !blr_distribute_start(inst))
+    {
+        MXS_ERROR("%s: Failed to start the event distribution thread, "
+                  "the events are distributed by the master connection.",
+                  service->name);
+    }
+
+    if (inst->async_checksum && inst->dist_queue == NULL)
+    {
+        MXS_WARNING("%s: The option async_checksum requires async_distribution, "
+                    "the checksums are verified by the master connection.",
+                    service->name);
+        inst->async_checksum = 0;
+    }
+
     /* Log whether the transaction safety option value is on*/
     if (inst->trx_safe)
     {
@@ -725,6 +875,9 @@ createInstance(SERVICE *service, char **options)
                      inst->binlog_name, inst->binlog_position, inst->current_pos);
         }
 
+        /* Check the older binlog files while the replication runs */
+        blr_file_verify_old(inst);
+
         /* Start replication from master server */
         blr_start_master(inst);
     }
@@ -732,6 +885,39 @@ createInstance(SERVICE *service, char **options)
     return (ROUTER *)inst;
 }
 
+/**
+ * Parse a size router option. The value may have a K, M or G suffix.
+ *
+ * @param value The option value
+ * @return The size in bytes
+ */
+static unsigned long
+blr_parse_size(char *value)
+{
+    unsigned long size = atoi(value);
+    char    *ptr = value;
+    while (*ptr && isdigit(*ptr))
+    {
+        ptr++;
+    }
+    switch (*ptr)
+    {
+    case 'G':
+    case 'g':
+        size = size * 1024 * 1000 * 1000;
+        break;
+    case 'M':
+    case 'm':
+        size = size * 1024 * 1000;
+        break;
+    case 'K':
+    case 'k':
+        size = size * 1024;
+        break;
+    }
+    return size;
+}
+
 static void
 free_instance(ROUTER_INSTANCE *instance)
 {
@@ -744,6 +930,8 @@ free_instance(ROUTER_INSTANCE *instance)
     free(instance->set_master_hostname);
     free(instance->fileroot);
     free(instance->binlogdir);
+    blr_free_cache(instance);
+    free(instance->write_buf);
     free(instance);
 }
 
@@ -788,6 +976,7 @@ newSession(ROUTER *instance, SESSION *session)
     slave->pthread = 0;
     slave->overrun = 0;
     slave->uuid = NULL;
+    slave->connect_state = NULL;
     slave->hostname = NULL;
     spinlock_init(&slave->catch_lock);
     slave->dcb = session->client_dcb;
@@ -881,6 +1070,7 @@ static void freeSession(ROUTER* router_instance,
     {
         free(slave->passwd);
     }
+    free(slave->connect_state);
     free(slave);
 }
 
@@ -1128,6 +1318,8 @@ diagnostics(ROUTER *router, DCB *dcb)
                router_inst->stats.n_binlogs);
     dcb_printf(dcb, "\tNo. of bad CRC received from master:         %u\n",
                router_inst->stats.n_badcrc);
+    dcb_printf(dcb, "\tCRC verification:                            %s%s\n",
+               mxs_crc32_impl(), router_inst->async_checksum ? ", in the distribution thread" : "");
     minno = router_inst->stats.minno - 1;
     if (minno == -1)
     {
@@ -1154,6 +1346,82 @@ diagnostics(ROUTER *router, DCB *dcb)
     dcb_printf(dcb, "\tAverage events per packet:                   %.1f\n",
                router_inst->stats.n_reads != 0 ?
                ((double)router_inst->stats.n_binlogs / router_inst->stats.n_reads) : 0);
+    dcb_printf(dcb, "\tNumber of binlog file writes:                %lu\n",
+               router_inst->stats.n_binlog_writes);
+    dcb_printf(dcb, "\tNumber of binlog file syncs:                 %lu\n",
+               router_inst->stats.n_fsyncs);
+    if (router_inst->stats.n_fsyncs)
+    {
+        dcb_printf(dcb, "\tAverage/maximum sync time (us):              %lu/%lu\n",
+                   router_inst->stats.fsync_total_us / router_inst->stats.n_fsyncs,
+                   router_inst->stats.fsync_max_us);
+        dcb_printf(dcb, "\tBinlog file sync times\n");
+
+        for (i = 0; i <= BLR_FSYNC_TIMES; i++)
+        {
+            if (router_inst->stats.fsync_times[i])
+            {
+                char name[40];
+
+                if (i == 0)
+                {
+                    snprintf(name, sizeof(name), "< 2us");
+                }
+                else if (i == BLR_FSYNC_TIMES)
+                {
+                    snprintf(name, sizeof(name), "> %luus", 1UL << BLR_FSYNC_TIMES);
+                }
+                else
+                {
+                    snprintf(name, sizeof(name), "%lu - %luus", 1UL << i, 1UL << (i + 1));
+                }
+                dcb_printf(dcb, "\t\t%-20s %lu\n", name, router_inst->stats.fsync_times[i]);
+            }
+        }
+    }
+    if (router_inst->cache)
+    {
+        uint64_t lookups = router_inst->stats.n_cachehits + router_inst->stats.n_cachemisses;
+
+        spinlock_acquire(&router_inst->cache->lock);
+        dcb_printf(dcb, "\tBinlog event cache size:                     %lu/%lu bytes, %d events%s\n",
+                   router_inst->cache->size, router_inst->cache->max_size,
+                   router_inst->cache->cnt,
+                   router_inst->cache->shared ? " (shared)" : "");
+        spinlock_release(&router_inst->cache->lock);
+        dcb_printf(dcb, "\tBinlog event cache hits/misses:              %lu/%lu\n",
+                   router_inst->stats.n_cachehits, router_inst->stats.n_cachemisses);
+        dcb_printf(dcb, "\tBinlog event cache hit ratio:                %.1f%%\n",
+                   lookups ? 100.0 * router_inst->stats.n_cachehits / lookups : 0.0);
+    }
+
+    if (router_inst->catchup_bandwidth)
+    {
+        dcb_printf(dcb, "\tSlave catch-up bandwidth limit:              %lu bytes/s\n",
+                   router_inst->catchup_bandwidth);
+        dcb_printf(dcb, "\tNumber of deferred catch-up rounds:          %lu\n",
+                   router_inst->stats.n_throttled);
+    }
+
+    if (router_inst->dist_queue)
+    {
+        BLR_DIST_QUEUE *queue = router_inst->dist_queue;
+
+        dcb_printf(dcb, "\tEvents waiting for distribution:             %u/%d\n",
+                   __atomic_load_n(&queue->head, __ATOMIC_RELAXED) -
+                   __atomic_load_n(&queue->tail, __ATOMIC_RELAXED),
+                   BLR_DIST_QUEUE_SIZE);
+        dcb_printf(dcb, "\tEvents queued/dropped for distribution:      %lu/%lu\n",
+                   router_inst->stats.n_distqueued, router_inst->stats.n_distdropped);
+    }
+
+    if (router_inst->semisync)
+    {
+        dcb_printf(dcb, "\tSemi-synchronous replication:                %s\n",
+                   router_inst->semisync_active ? "active" : "not available");
+        dcb_printf(dcb, "\tNumber of semi-sync acknowledgements:        %lu\n",
+                   router_inst->stats.n_semisync_acks);
+    }
 
     spinlock_acquire(&router_inst->lock);
     if (router_inst->stats.lastReply)
@@ -1296,6 +1564,11 @@ diagnostics(ROUTER *router, DCB *dcb)
             {
                 dcb_printf(dcb, "\t\tSlave UUID:                              %s\n", session->uuid);
             }
+            if (session->connect_state)
+            {
+                dcb_printf(dcb, "\t\tSlave GTID connect state:                %s\n",
+                           session->connect_state);
+            }
             dcb_printf(dcb,
                        "\t\tSlave_host_port:                         %s:%d\n",
                        session->dcb->remote, ntohs((session->dcb->ipv4).sin_port));
@@ -1362,6 +1635,27 @@ diagnostics(ROUTER *router, DCB *dcb)
                        session->stats.n_dcb);
             dcb_printf(dcb, "\t\tNo. of failed reads                      %u\n",
                        session->stats.n_failed_read);
+            dcb_printf(dcb, "\t\tNo. of events sent from the file         %u\n",
+                       session->stats.n_sendfile);
+            dcb_printf(dcb, "\t\tNo. of deferred catch-up rounds          %u\n",
+                       session->stats.n_throttled);
+            dcb_printf(dcb, "\t\tBytes sent per second                    %lu\n",
+                       session->stats.bytes_per_sec);
+            if (session->state == BLRS_DUMPING)
+            {
+                uint64_t behind = blr_slave_bytes_behind(router_inst, session);
+
+                if (behind == UINT64_MAX)
+                {
+                    dcb_printf(dcb, "\t\tBytes behind master                      "
+                               "in an older binlog file\n");
+                }
+                else
+                {
+                    dcb_printf(dcb, "\t\tBytes behind master                      %lu\n",
+                               (unsigned long)behind);
+                }
+            }
 
 #ifdef DETAILED_DIAG
             dcb_printf(dcb, "\t\tNo. of nested distribute events          %u\n",
@@ -1652,6 +1946,8 @@ stats_func(void *inst)
     {
         slave->stats.minavgs[slave->stats.minno++] = slave->stats.n_events - slave->stats.lastsample;
         slave->stats.lastsample = slave->stats.n_events;
+        slave->stats.bytes_per_sec = (slave->stats.n_bytes - slave->stats.lastbytes) / BLR_STATS_FREQ;
+        slave->stats.lastbytes = slave->stats.n_bytes;
         if (slave->stats.minno == BLR_NSTATS_MINUTES)
         {
             slave->stats.minno = 0;
@@ -2137,10 +2433,13 @@ static int blr_check_binlog(ROUTER_INSTANCE *router)
      * router->current_pos is the last event found.
      */
 
-    n = blr_read_events_all_events(router, 0, 0);
+    n = blr_read_events_all_events(router, blr_index_checkpoint(router), 0, 0);
 
     MXS_DEBUG("blr_read_events_all_events() ret = %i\n", n);
 
+    /** The index must not refer to anything after the last safe position */
+    blr_index_truncate(router, router->binlog_position);
+
     if (n != 0)
     {
         char msg_err[BINLOG_ERROR_MSG_LEN + 1] = "";
@@ -42,20 +42,475 @@
 #include <blr.h>
 #include <dcb.h>
 #include <spinlock.h>
+#include <hugepage.h>
 
 #include <skygw_types.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
 
 
+/** The cache that is shared by the router instances that have shared_cache */
+static BLCACHE *shared_cache = NULL;
+static SPINLOCK shared_cache_lock = SPINLOCK_INIT;
+
+/**
+ * Hash a router, binlog file and position into the index of the cache
+ *
+ * @param cache     The cache
+ * @param router    The router instance that wrote the event
+ * @param binlog    The binlog file name
+ * @param pos       The position in the file
+ * @return The index slot
+ */
+static int
+blr_cache_hash(BLCACHE *cache, ROUTER_INSTANCE *router, const char *binlog, unsigned long pos)
+{
+    uint32_t hash = 2166136261u;
+
+    while (*binlog)
+    {
+        hash = (hash ^ (uint8_t)*binlog++) * 16777619u;
+    }
+
+    hash ^= pos * 2654435761u;
+    hash ^= (uint32_t)((uintptr_t)router >> 4) * 2246822519u;
+    hash ^= hash >> 15;
+
+    return hash & cache->index_mask;
+}
+
+/**
+ * Remove a record from the cache. The caller must hold the cache lock.
+ *
+ * @param cache     The cache
+ * @param slot      The record to remove
+ */
+static void
+blr_cache_remove(BLCACHE *cache, int slot)
+{
+    BLCACHE_RECORD *record = &cache->records[slot];
+
+    if (record->pkt)
+    {
+        int h = blr_cache_hash(cache, record->router, record->binlogname, record->position);
+
+        if (cache->index[h] == slot)
+        {
+            cache->index[h] = -1;
+        }
+
+        cache->size -= GWBUF_LENGTH(record->pkt);
+        gwbuf_free(record->pkt);
+        record->pkt = NULL;
+    }
+}
+
+/**
+ * Remove the records of a router instance from the cache. The caller must
+ * hold the cache lock.
+ *
+ * @param cache     The cache
+ * @param router    The router instance
+ * @param binlog    The binlog file of the records, NULL for all files
+ * @param pos       The position from which the records of the file are removed
+ */
+static void
+blr_cache_discard(BLCACHE *cache, ROUTER_INSTANCE *router, char *binlog, unsigned long pos)
+{
+    for (int i = 0; i < cache->nrecords; i++)
+    {
+        BLCACHE_RECORD *record = &cache->records[i];
+
+        if (record->pkt && record->router == router &&
+            (binlog == NULL || (record->position >= pos && strcmp(record->binlogname, binlog) == 0)))
+        {
+            blr_cache_remove(cache, i);
+        }
+    }
+
+    /** Drop the emptied records from the tail of the ring */
+    while (cache->cnt > 0 &&
+           cache->records[(cache->current + cache->nrecords - cache->cnt) % cache->nrecords].pkt == NULL)
+    {
+        cache->cnt--;
+    }
+}
+
+/**
+ * Calculate the number of records and index slots for a cache size
+ *
+ * @param size      The size of the cache in bytes
+ * @param nindex    The number of index slots
+ * @return The number of records
+ */
+static int
+blr_cache_nrecords(unsigned long size, int *nindex)
+{
+    int nrecords = size / BLR_CACHE_AVG_EVENT;
+
+    if (nrecords < BLR_CACHE_MIN_RECORDS)
+    {
+        nrecords = BLR_CACHE_MIN_RECORDS;
+    }
+
+    /** Keep the index at most half full */
+    *nindex = 1;
+    while (*nindex < nrecords * 2)
+    {
+        *nindex <<= 1;
+    }
+
+    return nrecords;
+}
+
+/**
+ * Free the record ring and the index of a cache. They are allocated with
+ * hugepage_map so that a large cache is in huge pages when the huge_pages
+ * parameter is enabled.
+ *
+ * @param cache     The cache
+ */
+static void
+blr_cache_unmap(BLCACHE *cache)
+{
+    hugepage_unmap(cache->records, cache->nrecords * sizeof(BLCACHE_RECORD));
+    hugepage_unmap(cache->index, (cache->index_mask + 1) * sizeof(int));
+}
+
+/**
+ * Allocate the record ring and the index of a cache. Existing records are
+ * moved to the new ring from the oldest to the newest. The caller must hold
+ * the cache lock if the cache is in use.
+ *
+ * @param cache     The cache
+ * @param size      The new size of the cache in bytes
+ * @return True if the cache was resized
+ */
+
+static bool
+blr_cache_resize(BLCACHE *cache, unsigned long size)
+{
+    BLCACHE_RECORD *records;
+    int *index;
+    int nindex;
+    int nrecords = blr_cache_nrecords(size, &nindex);
+
+    if (nrecords <= cache->nrecords)
+    {
+        cache->max_size = size;
+        return true;
+    }
+
+    if ((records = hugepage_map(nrecords * sizeof(BLCACHE_RECORD))) == NULL ||
+        (index = hugepage_map(nindex * sizeof(int))) == NULL)
+    {
+        hugepage_unmap(records, nrecords * sizeof(BLCACHE_RECORD));
+        return false;
+    }
+
+    for (int i = 0; i < cache->cnt; i++)
+    {
+        records[i] = cache->records[(cache->current + cache->nrecords - cache->cnt + i) % cache->nrecords];
+    }
+
+    blr_cache_unmap(cache);
+    cache->records = records;
+    cache->index = index;
+    cache->nrecords = nrecords;
+    cache->index_mask = nindex - 1;
+    cache->current = cache->cnt % nrecords;
+    cache->max_size = size;
+
+    for (int i = 0; i < nindex; i++)
+    {
+        index[i] = -1;
+    }
+
+    for (int i = 0; i < cache->cnt; i++)
+    {
+        if (records[i].pkt)
+        {
+            index[blr_cache_hash(cache, records[i].router, records[i].binlogname, records[i].position)] = i;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Free a cache and the events in it
+ *
+ * @param cache     The cache
+ */
+static void
+blr_cache_free(BLCACHE *cache)
+{
+    for (int i = 0; i < cache->nrecords; i++)
+    {
+        blr_cache_remove(cache, i);
+    }
+
+    blr_cache_unmap(cache);
+    free(cache);
+}
+
 /**
- * Initialise the cache for this instanceof the binlog router. As a side
- * effect also determine the binlog file to read and the position to read
- * from.
+ * Initialise the cache for this instance of the binlog router. The cache
+ * holds the latest events written to the binlog files so that the slaves
+ * that catch up close to the master do not have to read them from disk.
+ * A cache_size of zero disables the cache.
+ *
+ * The router instances that have shared_cache use one cache that is the size
+ * of their cache_size values together. The busiest masters can then use the
+ * memory that the quiet ones do not need.
  *
  * @param   router      The router instance
  */
 void
 blr_init_cache(ROUTER_INSTANCE *router)
 {
+    BLCACHE *cache = NULL;
+
+    router->cache = NULL;
+
+    if (router->cache_size == 0)
+    {
+        return;
+    }
+
+    if (router->shared_cache)
+    {
+        spinlock_acquire(&shared_cache_lock);
+
+        if (shared_cache)
+        {
+            spinlock_acquire(&shared_cache->lock);
+            if (blr_cache_resize(shared_cache, shared_cache->max_size + router->cache_size))
+            {
+                cache = shared_cache;
+                cache->refcnt++;
+            }
+            spinlock_release(&shared_cache->lock);
+        }
+        else if ((cache = calloc(1, sizeof(BLCACHE))) != NULL)
+        {
+            spinlock_init(&cache->lock);
+            cache->shared = true;
+            cache->refcnt = 1;
+
+            if (blr_cache_resize(cache, router->cache_size))
+            {
+                shared_cache = cache;
+            }
+            else
+            {
+                free(cache);
+                cache = NULL;
+            }
+        }
+
+        spinlock_release(&shared_cache_lock);
+    }
+    else if ((cache = calloc(1, sizeof(BLCACHE))) != NULL)
+    {
+        spinlock_init(&cache->lock);
+        cache->refcnt = 1;
+
+        if (!blr_cache_resize(cache, router->cache_size))
+        {
+            free(cache);
+            cache = NULL;
+        }
+    }
+
+    if (cache == NULL)
+    {
+        MXS_ERROR("%s: Failed to allocate the binlog event cache, "
+                  "the events are read from the binlog files.",
+                  router->service->name);
+    }
+
+    router->cache = cache;
+}
+
+/**
+ * Free the binlog event cache of the router. The events of the router are
+ * removed from a shared cache, which is freed with its last router.
+ *
+ * @param   router      The router instance
+ */
+void
+blr_free_cache(ROUTER_INSTANCE *router)
+{
+    BLCACHE *cache = router->cache;
+
+    if (cache == NULL)
+    {
+        return;
+    }
+
+    router->cache = NULL;
+
+    if (cache->shared)
+    {
+        bool last;
+
+        spinlock_acquire(&shared_cache_lock);
+        spinlock_acquire(&cache->lock);
+        blr_cache_discard(cache, router, NULL, 0);
+        cache->max_size -= router->cache_size;
+        last = --cache->refcnt == 0;
+        spinlock_release(&cache->lock);
+
+        if (last)
+        {
+            shared_cache = NULL;
+        }
+        spinlock_release(&shared_cache_lock);
+
+        if (!last)
+        {
+            return;
+        }
+    }
+
+    blr_cache_free(cache);
+}
+
+/**
+ * Add an event that was written to the current binlog file to the cache.
+ * The oldest events are discarded to make room for it. Events that are
+ * larger than the whole cache or that were written in parts are not cached.
+ *
+ * @param router    The router instance
+ * @param hdr       The event header
+ * @param pos       The position the event was written at
+ * @param size      The number of bytes written
+ * @param buf       The event data
+ */
+void
+blr_cache_add(ROUTER_INSTANCE *router, REP_HEADER *hdr, unsigned long pos,
+              uint32_t size, uint8_t *buf)
+{
+    BLCACHE *cache = router->cache;
+    BLCACHE_RECORD *record;
+    GWBUF *pkt;
+
+    if (cache == NULL || size != hdr->event_size || size > router->cache_size)
+    {
+        return;
+    }
+
+    if ((pkt = gwbuf_alloc_and_load(size, buf)) == NULL)
+    {
+        return;
+    }
+
+    spinlock_acquire(&cache->lock);
+
+    while (cache->cnt == cache->nrecords ||
+           (cache->cnt > 0 && cache->size + size > cache->max_size))
+    {
+        int oldest = (cache->current + cache->nrecords - cache->cnt) % cache->nrecords;
+
+        blr_cache_remove(cache, oldest);
+        cache->cnt--;
+    }
+
+    record = &cache->records[cache->current];
+    strcpy(record->binlogname, router->binlog_name);
+    record->router = router;
+    record->position = pos;
+    record->hdr = *hdr;
+    record->pkt = pkt;
+    cache->index[blr_cache_hash(cache, router, record->binlogname, pos)] = cache->current;
+    cache->size += size;
+    cache->cnt++;
+    cache->current = (cache->current + 1) % cache->nrecords;
+
+    spinlock_release(&cache->lock);
+}
+
+/**
+ * Look up an event in the cache. Only events that are safe to send to
+ * the slaves are returned, those of a pending transaction are read from the
+ * file so that the normal checks are made.
+ *
+ * @param router    The router instance
+ * @param binlog    The binlog file
+ * @param pos       The position of the event
+ * @param hdr       The header to populate
+ * @return A reference to the cached event or NULL if it was not found
+ */
+GWBUF *
+blr_cache_get(ROUTER_INSTANCE *router, char *binlog, unsigned long pos, REP_HEADER *hdr)
+{
+    BLCACHE *cache = router->cache;
+    GWBUF *result = NULL;
+    int slot;
+
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+
+    spinlock_acquire(&router->binlog_lock);
+    bool unsafe = strcmp(router->binlog_name, binlog) == 0 && pos >= router->binlog_position;
+    spinlock_release(&router->binlog_lock);
+
+    if (unsafe)
+    {
+        return NULL;
+    }
+
+    spinlock_acquire(&cache->lock);
+
+    if ((slot = cache->index[blr_cache_hash(cache, router, binlog, pos)]) != -1)
+    {
+        BLCACHE_RECORD *record = &cache->records[slot];
+
+        if (record->pkt && record->router == router && record->position == pos &&
+            strcmp(record->binlogname, binlog) == 0 &&
+            (result = gwbuf_clone(record->pkt)) != NULL)
+        {
+            *hdr = record->hdr;
+            hdr->ok = SLAVE_POS_READ_OK;
+        }
+    }
+
+    if (result)
+    {
+        router->stats.n_cachehits++;
+    }
+    else
+    {
+        router->stats.n_cachemisses++;
+    }
+
+    spinlock_release(&cache->lock);
+
+    return result;
+}
+
+/**
+ * Discard the cached events of a binlog file from a position onwards. This
+ * must be called whenever the file is truncated or created again.
+ *
+ * @param router    The router instance
+ * @param binlog    The binlog file
+ * @param pos       The position from which the events are discarded
+ */
+void
+blr_cache_truncate(ROUTER_INSTANCE *router, char *binlog, unsigned long pos)
+{
+    BLCACHE *cache = router->cache;
+
+    if (cache == NULL)
+    {
+        return;
+    }
+
+    spinlock_acquire(&cache->lock);
+    blr_cache_discard(cache, router, binlog, pos);
+    spinlock_release(&cache->lock);
 }
@@ -46,6 +46,7 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
 #include <service.h>
 #include <server.h>
 #include <router.h>
@@ -53,6 +54,7 @@
 #include <spinlock.h>
 #include <blr.h>
 #include <dcb.h>
+#include <thread.h>
 #include <spinlock.h>
 #include <gwdirs.h>
 #include <skygw_types.h>
@@ -187,10 +189,42 @@ blr_file_init(ROUTER_INSTANCE *router)
     return 1;
 }
 
+/**
+ * Rotate to a new binlog file. With compress_binlogs the file that was closed
+ * by the previous rotation is compressed in the background, the file that is
+ * closed now is kept as it is in case a partial transaction is truncated from
+ * it.
+ *
+ * @param router    The router instance
+ * @param file      The new binlog file name
+ * @param pos       The position in the new file
+ * @return          Non-zero if the file creation succeeded
+ */
 int
 blr_file_rotate(ROUTER_INSTANCE *router, char *file, uint64_t pos)
 {
-    return blr_file_create(router, file);
+    char older[BINLOG_FNAMELEN + 1] = "";
+    char *sptr = strrchr(router->binlog_name, '.');
+
+    if (router->compress_binlogs && sptr && atoi(sptr + 1) > 1)
+    {
+        snprintf(older, sizeof(older), BINLOG_NAMEFMT, router->fileroot, atoi(sptr + 1) - 1);
+    }
+
+    int rval = blr_file_create(router, file);
+
+    if (rval && *older)
+    {
+        char path[PATH_MAX + 1];
+        snprintf(path, sizeof(path), "%s/%s", router->binlogdir, older);
+
+        if (access(path, R_OK) == 0)
+        {
+            blr_zfile_compress_async(router, older);
+        }
+    }
+
+    return rval;
 }
 
 
@@ -212,6 +246,27 @@ blr_file_add_magic(int fd)
 }
 
 
+/**
+ * Write out and sync the binlog file that the router is writing and close it
+ *
+ * @param router        The router instance
+ */
+static void
+blr_file_close_current(ROUTER_INSTANCE *router)
+{
+    if (router->binlog_fd != -1)
+    {
+        if (blr_file_flush_buffer(router) && router->unsynced_bytes)
+        {
+            blr_file_sync(router);
+        }
+        close(router->binlog_fd);
+    }
+    blr_index_close(router);
+    router->write_buf_len = 0;
+    router->unsynced_bytes = 0;
+}
+
 /**
  * Create a new binlog file for the router to use.
  *
@@ -237,7 +292,7 @@ blr_file_create(ROUTER_INSTANCE *router, char *file)
     {
         if (blr_file_add_magic(fd))
         {
-            close(router->binlog_fd);
+            blr_file_close_current(router);
             spinlock_acquire(&router->binlog_lock);
             strncpy(router->binlog_name, file, BINLOG_FNAMELEN);
             router->binlog_fd = fd;
@@ -247,6 +302,12 @@ blr_file_create(ROUTER_INSTANCE *router, char *file)
             router->last_written = BINLOG_MAGIC_SIZE;
             spinlock_release(&router->binlog_lock);
 
+            /** Events of an earlier file with the same name are no longer valid */
+            blr_cache_truncate(router, file, 0);
+            strcat(path, BLR_ZFILE_SUFFIX);
+            unlink(path);
+            blr_index_open(router, true);
+
             created = 1;
         }
         else
@@ -294,7 +355,7 @@ blr_file_append(ROUTER_INSTANCE *router, char *file)
         return;
     }
     fsync(fd);
-    close(router->binlog_fd);
+    blr_file_close_current(router);
     spinlock_acquire(&router->binlog_lock);
     memmove(router->binlog_name, file, BINLOG_FNAMELEN);
     router->current_pos = lseek(fd, 0L, SEEK_END);
@@ -327,6 +388,192 @@ blr_file_append(ROUTER_INSTANCE *router, char *file)
     }
     router->binlog_fd = fd;
     spinlock_release(&router->binlog_lock);
+
+    blr_index_open(router, false);
+}
+
+/**
+ * Handle a failed write to the binlog file. Any partial event that was written
+ * is removed by truncating the file to the last safe position and the data
+ * that was not yet written is discarded.
+ *
+ * @param router    The router instance
+ * @param pos       The position the write was made at
+ */
+static void
+blr_file_write_failed(ROUTER_INSTANCE *router, uint64_t pos)
+{
+    char err_msg[STRERROR_BUFLEN];
+    MXS_ERROR("%s: Failed to write binlog record at %lu of %s, %s. "
+              "Truncating to previous record.",
+              router->service->name, pos,
+              router->binlog_name,
+              strerror_r(errno, err_msg, sizeof(err_msg)));
+    /* Remove any partial event that was written */
+    if (ftruncate(router->binlog_fd, router->binlog_position))
+    {
+        MXS_ERROR("%s: Failed to truncate binlog record at %lu of %s, %s. ",
+                  router->service->name, router->binlog_position,
+                  router->binlog_name,
+                  strerror_r(errno, err_msg, sizeof(err_msg)));
+    }
+    blr_cache_truncate(router, router->binlog_name, router->binlog_position);
+    router->write_buf_len = 0;
+}
+
+/**
+ * Write data to the binlog file
+ *
+ * @param router    The router instance
+ * @param buf       The data
+ * @param len       Length of the data
+ * @param pos       The position to write at
+ * @return True on success
+ */
+static bool
+blr_file_pwrite(ROUTER_INSTANCE *router, uint8_t *buf, unsigned long len, uint64_t pos)
+{
+    if (pwrite(router->binlog_fd, buf, len, pos) != len)
+    {
+        blr_file_write_failed(router, pos);
+        return false;
+    }
+
+    router->stats.n_binlog_writes++;
+    router->unsynced_bytes += len;
+    return true;
+}
+
+/**
+ * Write out the data in the write buffer of the router
+ *
+ * @param router    The router instance
+ * @param aligned   Only write the data that ends at the last BLR_WRITE_ALIGN
+ *                  boundary of the file, the rest is kept in the buffer
+ * @return True on success
+ */
+static bool
+blr_file_write_buffered(ROUTER_INSTANCE *router, bool aligned)
+{
+    unsigned long len = router->write_buf_len;
+
+    if (aligned)
+    {
+        uint64_t end = (router->write_buf_pos + len) & ~((uint64_t)BLR_WRITE_ALIGN - 1);
+        len = end > router->write_buf_pos ? end - router->write_buf_pos : 0;
+    }
+
+    if (len == 0)
+    {
+        return true;
+    }
+
+    if (!blr_file_pwrite(router, router->write_buf, len, router->write_buf_pos))
+    {
+        return false;
+    }
+
+    router->write_buf_len -= len;
+    router->write_buf_pos += len;
+    memmove(router->write_buf, router->write_buf + len, router->write_buf_len);
+    return true;
+}
+
+/**
+ * Write out all the buffered data of the binlog file. This must be done before
+ * the binlog file is read or closed by the router.
+ *
+ * @param router    The router instance
+ * @return True on success
+ */
+bool
+blr_file_flush_buffer(ROUTER_INSTANCE *router)
+{
+    return blr_file_write_buffered(router, false);
+}
+
+/**
+ * Remove the end of the current binlog file and move the router back to the
+ * position where the file now ends. The events after it are requested from
+ * the master again when the router reconnects.
+ *
+ * @param router    The router instance
+ * @param pos       The new end of the file, the start of an event
+ * @return True on success
+ */
+bool
+blr_file_truncate(ROUTER_INSTANCE *router, uint64_t pos)
+{
+    char err_msg[STRERROR_BUFLEN];
+
+    blr_file_flush_buffer(router);
+    router->write_buf_len = 0;
+
+    if (ftruncate(router->binlog_fd, pos))
+    {
+        MXS_ERROR("%s: Failed to truncate binlog file %s at %lu, %s.",
+                  router->service->name, router->binlog_name, pos,
+                  strerror_r(errno, err_msg, sizeof(err_msg)));
+        return false;
+    }
+
+    blr_cache_truncate(router, router->binlog_name, pos);
+    blr_index_truncate(router, pos);
+
+    spinlock_acquire(&router->binlog_lock);
+    router->last_written = pos;
+    router->current_pos = pos;
+    router->binlog_position = pos;
+    router->current_safe_event = pos;
+    router->last_event_pos = pos;
+    router->last_safe_pos = pos;
+    router->pending_transaction = 0;
+    spinlock_release(&router->binlog_lock);
+
+    return true;
+}
+
+/**
+ * Append data to the binlog file at router->last_written. The caller updates
+ * last_written.
+ *
+ * The events of an open transaction are collected in the write buffer when
+ * transaction safety is on, slaves are only sent the events once the
+ * transaction is complete. The buffer is written out with as few writes as
+ * possible that, except for the last one, end at a BLR_WRITE_ALIGN boundary.
+ * All other data is written through.
+ *
+ * @param router    The router instance
+ * @param buf       The data
+ * @param size      Length of the data
+ * @return True on success, false if the write failed and the file was
+ *         truncated to the last safe position
+ */
+bool
+blr_file_write(ROUTER_INSTANCE *router, uint8_t *buf, uint32_t size)
+{
+    if (router->write_buf && router->trx_safe && router->pending_transaction &&
+        size <= router->write_buf_size)
+    {
+        if (router->write_buf_len + size > router->write_buf_size &&
+            (!blr_file_write_buffered(router, true) ||
+             (router->write_buf_len + size > router->write_buf_size &&
+              !blr_file_write_buffered(router, false))))
+        {
+            return false;
+        }
+
+        if (router->write_buf_len == 0)
+        {
+            router->write_buf_pos = router->last_written;
+        }
+        memcpy(router->write_buf + router->write_buf_len, buf, size);
+        router->write_buf_len += size;
+        return true;
+    }
+
+    return blr_file_write_buffered(router, false) &&
+           blr_file_pwrite(router, buf, size, router->last_written);
 }
 
 /**
@@ -340,44 +587,95 @@ blr_file_append(ROUTER_INSTANCE *router, char *file)
 int
 blr_write_binlog_record(ROUTER_INSTANCE *router, REP_HEADER *hdr, uint32_t size, uint8_t *buf)
 {
-    int n;
-
-    if ((n = pwrite(router->binlog_fd, buf, size,
-                    router->last_written)) != size)
+    if (!blr_file_write(router, buf, size))
     {
-        char err_msg[STRERROR_BUFLEN];
-        MXS_ERROR("%s: Failed to write binlog record at %lu of %s, %s. "
-                  "Truncating to previous record.",
-                  router->service->name, router->last_written,
-                  router->binlog_name,
-                  strerror_r(errno, err_msg, sizeof(err_msg)));
-        /* Remove any partial event that was written */
-        if (ftruncate(router->binlog_fd, router->binlog_position))
-        {
-            MXS_ERROR("%s: Failed to truncate binlog record at %lu of %s, %s. ",
-                      router->service->name, router->binlog_position,
-                      router->binlog_name,
-                      strerror_r(errno, err_msg, sizeof(err_msg)));
-        }
         return 0;
     }
+    blr_cache_add(router, hdr, router->last_written, size, buf);
     spinlock_acquire(&router->binlog_lock);
     router->current_pos = hdr->next_pos;
     router->last_written += size;
     router->last_event_pos = hdr->next_pos - hdr->event_size;
     spinlock_release(&router->binlog_lock);
-    return n;
+    return size;
 }
 
 /**
- * Flush the content of the binlog file to disk.
+ * Sync the binlog file to disk and record how long it took
  *
  * @param   router  The binlog router
  */
 void
-blr_file_flush(ROUTER_INSTANCE *router)
+blr_file_sync(ROUTER_INSTANCE *router)
 {
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
     fsync(router->binlog_fd);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    uint64_t usecs = (end.tv_sec - start.tv_sec) * 1000000 +
+                     (end.tv_nsec - start.tv_nsec) / 1000;
+    int bucket = usecs < 2 ? 0 : 63 - __builtin_clzll(usecs);
+
+    router->stats.fsync_times[bucket > BLR_FSYNC_TIMES ? BLR_FSYNC_TIMES : bucket]++;
+    router->stats.n_fsyncs++;
+    router->stats.fsync_total_us += usecs;
+
+    if (usecs > router->stats.fsync_max_us)
+    {
+        router->stats.fsync_max_us = usecs;
+    }
+
+    router->unsynced_bytes = 0;
+    router->last_sync = end.tv_sec * 1000 + end.tv_nsec / 1000000;
+}
+
+/**
+ * Flush the content of the binlog file to disk. This is called after each
+ * batch of events read from the master and syncs the file according to
+ * the sync_policy of the router.
+ *
+ * @param   router  The binlog router
+ */
+void
+blr_file_flush(ROUTER_INSTANCE *router)
+{
+    bool sync = false;
+
+    if (router->unsynced_bytes == 0 || router->binlog_fd == -1)
+    {
+        return;
+    }
+
+    switch (router->sync_policy)
+    {
+    case BLR_SYNC_BATCH:
+        sync = true;
+        break;
+
+    case BLR_SYNC_TRANSACTION:
+        sync = !router->trx_safe || !router->pending_transaction;
+        break;
+
+    case BLR_SYNC_PERIOD:
+        {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            sync = now.tv_sec * 1000 + now.tv_nsec / 1000000 >=
+                   router->last_sync + router->sync_period;
+        }
+        break;
+
+    case BLR_SYNC_BYTES:
+        sync = router->unsynced_bytes >= router->sync_bytes;
+        break;
+    }
+
+    if (sync)
+    {
+        blr_file_sync(router);
+    }
 }
 
 /**
@@ -414,14 +712,27 @@ blr_open_binlog(ROUTER_INSTANCE *router, char *binlog)
     }
     strncpy(file->binlogname, binlog, BINLOG_FNAMELEN);
     file->refcnt = 1;
-    file->cache = 0;
     spinlock_init(&file->lock);
 
     strncpy(path, router->binlogdir, PATH_MAX);
     strncat(path, "/", PATH_MAX - strlen(path));
     strncat(path, binlog, PATH_MAX - strlen(path));
 
-    if ((file->fd = open(path, O_RDONLY, 0666)) == -1)
+    if ((file->fd = open(path, O_RDONLY, 0666)) == -1 && errno == ENOENT)
+    {
+        /** The file may have been compressed */
+        strncat(path, BLR_ZFILE_SUFFIX, PATH_MAX - strlen(path));
+
+        if ((file->fd = open(path, O_RDONLY, 0666)) != -1 &&
+            (file->zfile = blr_zfile_open(file->fd)) == NULL)
+        {
+            MXS_ERROR("Compressed binlog file %s is not valid", path);
+            close(file->fd);
+            file->fd = -1;
+        }
+    }
+
+    if (file->fd == -1)
     {
         MXS_ERROR("Failed to open binlog file %s", path);
         free(file);
@@ -436,6 +747,21 @@ blr_open_binlog(ROUTER_INSTANCE *router, char *binlog)
     return file;
 }
 
+/**
+ * Read from a binlog file that may be compressed
+ *
+ * @param file  The binlog file
+ * @param buf   Where the data is stored
+ * @param n     Number of bytes to read
+ * @param pos   Position in the binlog file
+ * @return Number of bytes read or -1 on error
+ */
+static ssize_t
+blr_file_pread(BLFILE *file, void *buf, size_t n, uint64_t pos)
+{
+    return file->zfile ? blr_zfile_pread(file->zfile, buf, n, pos) : pread(file->fd, buf, n, pos);
+}
+
 /**
  * Read a replication event into a GWBUF structure.
  *
@@ -468,8 +794,18 @@ blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HE
         return NULL;
     }
 
+    /* Recent events are served from the cache without reading the file */
+    if ((result = blr_cache_get(router, file->binlogname, pos, hdr)) != NULL)
+    {
+        return result;
+    }
+
     spinlock_acquire(&file->lock);
-    if (fstat(file->fd, &statb) == 0)
+    if (file->zfile)
+    {
+        filelen = blr_zfile_size(file->zfile);
+    }
+    else if (fstat(file->fd, &statb) == 0)
     {
         filelen = statb.st_size;
     }
@@ -543,7 +879,7 @@ blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HE
     spinlock_release(&router->binlog_lock);
 
     /* Read the header information from the file */
-    if ((n = pread(file->fd, hdbuf, BINLOG_EVENT_HDR_LEN, pos)) != BINLOG_EVENT_HDR_LEN)
+    if ((n = blr_file_pread(file, hdbuf, BINLOG_EVENT_HDR_LEN, pos)) != BINLOG_EVENT_HDR_LEN)
     {
         switch (n)
         {
@@ -627,7 +963,7 @@ blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HE
                   pos, file->binlogname, filelen, router->binlog_position,
                   router->binlog_name);
 
-        if ((n = pread(file->fd, hdbuf, BINLOG_EVENT_HDR_LEN, pos)) != BINLOG_EVENT_HDR_LEN)
+        if ((n = blr_file_pread(file, hdbuf, BINLOG_EVENT_HDR_LEN, pos)) != BINLOG_EVENT_HDR_LEN)
         {
             switch (n)
             {
@@ -694,7 +1030,7 @@ blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HE
 
     memcpy(data, hdbuf, BINLOG_EVENT_HDR_LEN);  // Copy the header in
 
-    if ((n = pread(file->fd, &data[BINLOG_EVENT_HDR_LEN], hdr->event_size - BINLOG_EVENT_HDR_LEN,
+    if ((n = blr_file_pread(file, &data[BINLOG_EVENT_HDR_LEN], hdr->event_size - BINLOG_EVENT_HDR_LEN,
                    pos + BINLOG_EVENT_HDR_LEN))
         != hdr->event_size - BINLOG_EVENT_HDR_LEN)  // Read the balance
     {
@@ -776,7 +1112,14 @@ blr_close_binlog(ROUTER_INSTANCE *router, BLFILE *file)
 
     if (file)
     {
-        close(file->fd);
+        if (file->zfile)
+        {
+            blr_zfile_close(file->zfile);
+        }
+        else
+        {
+            close(file->fd);
+        }
         file->fd = -1;
         free(file);
     }
@@ -815,6 +1158,11 @@ blr_file_size(BLFILE *file)
 {
     struct stat statb;
 
+    if (file->zfile)
+    {
+        return blr_zfile_size(file->zfile);
+    }
+
     if (fstat(file->fd, &statb) == 0)
     {
         return statb.st_size;
@@ -925,23 +1273,112 @@ blr_file_next_exists(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave)
     sprintf(bigbuf, "%s/%s", router->binlogdir, buf);
     if (access(bigbuf, R_OK) == -1)
     {
-        return 0;
+        strcat(bigbuf, BLR_ZFILE_SUFFIX);
+        return access(bigbuf, R_OK) == 0;
     }
     return 1;
 }
 
+/**
+ * A buffer for the sequential reading of a binlog file. The file is read in
+ * large blocks so that scanning it takes one read per block instead of two
+ * reads per event.
+ */
+typedef struct
+{
+    int         fd;         /*< The file being read */
+    uint8_t     *buf;       /*< The data read from the file, NULL if reads are not buffered */
+    uint64_t    start;      /*< The file position of the data in buf */
+    size_t      len;        /*< Bytes of data in buf */
+} BLR_READAHEAD;
+
+/**
+ * Prepare to read a binlog file sequentially from a position
+ *
+ * @param ra    The read buffer
+ * @param fd    The file to read
+ * @param pos   The position the reads start from
+ */
+static void
+blr_readahead_init(BLR_READAHEAD *ra, int fd, uint64_t pos)
+{
+    ra->fd = fd;
+    ra->buf = malloc(BLR_READAHEAD_SIZE);
+    ra->start = 0;
+    ra->len = 0;
+
+    posix_fadvise(fd, pos, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+/**
+ * Free the read buffer of a binlog file
+ *
+ * @param ra    The read buffer
+ */
+static void
+blr_readahead_free(BLR_READAHEAD *ra)
+{
+    free(ra->buf);
+    ra->buf = NULL;
+}
+
+/**
+ * Read from a binlog file through the read buffer. This behaves like pread().
+ *
+ * @param ra    The read buffer
+ * @param dest  Where the data is copied to
+ * @param n     The number of bytes to read
+ * @param pos   The position to read from
+ * @return The number of bytes read, 0 at the end of the file and -1 on error
+ */
+static ssize_t
+blr_readahead_pread(BLR_READAHEAD *ra, void *dest, size_t n, uint64_t pos)
+{
+    if (ra->buf == NULL || n > BLR_READAHEAD_SIZE)
+    {
+        return pread(ra->fd, dest, n, pos);
+    }
+
+    if (pos < ra->start || pos + n > ra->start + ra->len)
+    {
+        ssize_t nread = pread(ra->fd, ra->buf, BLR_READAHEAD_SIZE, pos);
+
+        if (nread == -1)
+        {
+            ra->len = 0;
+            return -1;
+        }
+        ra->start = pos;
+        ra->len = nread;
+    }
+
+    size_t avail = ra->start + ra->len - pos;
+
+    if (n > avail)
+    {
+        n = avail;
+    }
+
+    memcpy(dest, ra->buf + (pos - ra->start), n);
+
+    return n;
+}
+
 /**
  * Read all replication events from a binlog file.
  *
  * Routine detects errors and pending transactions
  *
- * @param router  The router instance
+ * @param router    The router instance
+ * @param ra        The read buffer of the binlog file
+ * @param start_pos The position up to which the file is known to be valid,
+ *                  the events before it are not read except for the FDE
  * @param fix     Whether to fix or not errors
  * @param debug   Whether to enable or not the debug for events
  * @return        0 on success, >0 on failure
  */
-int
-blr_read_events_all_events(ROUTER_INSTANCE *router, int fix, int debug)
+static int
+blr_read_events(ROUTER_INSTANCE *router, BLR_READAHEAD *ra, uint64_t start_pos, int fix, int debug)
 {
     unsigned long filelen = 0;
     struct stat statb;
@@ -998,7 +1435,7 @@ blr_read_events_all_events(ROUTER_INSTANCE *router, int fix, int debug)
     {
 
         /* Read the header information from the file */
-        if ((n = pread(router->binlog_fd, hdbuf, BINLOG_EVENT_HDR_LEN, pos)) != BINLOG_EVENT_HDR_LEN)
+        if ((n = blr_readahead_pread(ra, hdbuf, BINLOG_EVENT_HDR_LEN, pos)) != BINLOG_EVENT_HDR_LEN)
         {
             switch (n)
             {
@@ -1263,9 +1700,9 @@ blr_read_events_all_events(ROUTER_INSTANCE *router, int fix, int debug)
         memcpy(data, hdbuf, BINLOG_EVENT_HDR_LEN);// Copy the header in
 
         /* Read event data */
-        if ((n = pread(router->binlog_fd, &data[BINLOG_EVENT_HDR_LEN],
-                       hdr.event_size - BINLOG_EVENT_HDR_LEN,
-                       pos + BINLOG_EVENT_HDR_LEN)) != hdr.event_size - BINLOG_EVENT_HDR_LEN)
+        if ((n = blr_readahead_pread(ra, &data[BINLOG_EVENT_HDR_LEN],
+                                     hdr.event_size - BINLOG_EVENT_HDR_LEN,
+                                     pos + BINLOG_EVENT_HDR_LEN)) != hdr.event_size - BINLOG_EVENT_HDR_LEN)
         {
             if (n == -1)
             {
@@ -1694,6 +2131,14 @@ blr_read_events_all_events(ROUTER_INSTANCE *router, int fix, int debug)
             }
 
             pos = hdr.next_pos;
+
+            /** Continue from the known valid position once the FDE has been read */
+            if (hdr.event_type == FORMAT_DESCRIPTION_EVENT && pos < start_pos)
+            {
+                MXS_INFO("Binlog %s is valid up to %lu, skipping to it.",
+                         router->binlog_name, (unsigned long)start_pos);
+                pos = start_pos;
+            }
         }
         else
         {
@@ -1732,6 +2177,229 @@ blr_read_events_all_events(ROUTER_INSTANCE *router, int fix, int debug)
     }
 }
 
+/**
+ * Read all replication events from a binlog file. The file is read
+ * sequentially in large blocks.
+ *
+ * Routine detects errors and pending transactions
+ *
+ * @param router    The router instance
+ * @param start_pos The position up to which the file is known to be valid,
+ *                  the events before it are not read except for the FDE
+ * @param fix       Whether to fix or not errors
+ * @param debug     Whether to enable or not the debug for events
+ * @return          0 on success, >0 on failure
+ */
+int
+blr_read_events_all_events(ROUTER_INSTANCE *router, uint64_t start_pos, int fix, int debug)
+{
+    BLR_READAHEAD ra;
+    int rval;
+
+    blr_readahead_init(&ra, router->binlog_fd, start_pos);
+    rval = blr_read_events(router, &ra, start_pos, fix, debug);
+    blr_readahead_free(&ra);
+
+    return rval;
+}
+
+/**
+ * Verify an older binlog file. The chain of event headers is followed from
+ * the start of the file to its end, the event bodies are not decoded.
+ *
+ * @param router    The router instance
+ * @param path      The path of the binlog file
+ * @return True if the file is valid
+ */
+static bool
+blr_file_verify(ROUTER_INSTANCE *router, const char *path)
+{
+    uint8_t magic[] = BINLOG_MAGIC;
+    uint8_t hdbuf[BINLOG_EVENT_HDR_LEN];
+    int event_limit = router->mariadb10_compat ? MAX_EVENT_TYPE_MARIADB10 : MAX_EVENT_TYPE;
+    uint8_t last_type = 0;
+    uint64_t pos = BINLOG_MAGIC_SIZE;
+    uint64_t filelen;
+    struct stat statb;
+    BLR_READAHEAD ra;
+    bool valid = false;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &statb) == -1)
+    {
+        char err_msg[STRERROR_BUFLEN];
+        MXS_ERROR("%s: Failed to open binlog file %s for verification, %s.",
+                  router->service->name, path, strerror_r(errno, err_msg, sizeof(err_msg)));
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return false;
+    }
+
+    filelen = statb.st_size;
+    blr_readahead_init(&ra, fd, 0);
+
+    if (blr_readahead_pread(&ra, hdbuf, BINLOG_MAGIC_SIZE, 0) != BINLOG_MAGIC_SIZE ||
+        memcmp(hdbuf, magic, BINLOG_MAGIC_SIZE) != 0)
+    {
+        MXS_WARNING("%s: Binlog file %s does not start with the binlog magic number.",
+                    router->service->name, path);
+    }
+    else
+    {
+        while (pos < filelen)
+        {
+            uint32_t event_size;
+            uint32_t next_pos;
+
+            if (blr_readahead_pread(&ra, hdbuf, BINLOG_EVENT_HDR_LEN, pos) != BINLOG_EVENT_HDR_LEN)
+            {
+                MXS_WARNING("%s: Binlog file %s has a truncated event header at %lu.",
+                            router->service->name, path, (unsigned long)pos);
+                break;
+            }
+
+            event_size = extract_field(&hdbuf[9], 32);
+            next_pos = EXTRACT32(&hdbuf[13]);
+
+            if (hdbuf[4] > event_limit || event_size < BINLOG_EVENT_HDR_LEN ||
+                pos + event_size > filelen || (next_pos && next_pos != pos + event_size))
+            {
+                MXS_WARNING("%s: Binlog file %s has an invalid event at %lu: "
+                            "type 0x%x, size %u, next pos %u, file size %lu.",
+                            router->service->name, path, (unsigned long)pos,
+                            hdbuf[4], event_size, next_pos, (unsigned long)filelen);
+                break;
+            }
+
+            last_type = hdbuf[4];
+            pos += event_size;
+        }
+
+        if (pos == filelen)
+        {
+            valid = true;
+
+            if (last_type != ROTATE_EVENT)
+            {
+                MXS_NOTICE("%s: Binlog file %s does not end with a rotate event, "
+                           "it may have been closed by a restart.",
+                           router->service->name, path);
+            }
+        }
+    }
+
+    /** The older files are seldom read, leave the page cache to the current one */
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    blr_readahead_free(&ra);
+    close(fd);
+
+    return valid;
+}
+
+/**
+ * Log the result of the verification of the older binlog files
+ *
+ * @param router    The router instance
+ */
+static void
+blr_file_verify_done(ROUTER_INSTANCE *router)
+{
+    MXS_NOTICE("%s: Verified %d older binlog files in %ld seconds, %d of them have errors.",
+               router->service->name, router->verify_files,
+               (long)(time(0) - router->verify_started), router->verify_errors);
+}
+
+/**
+ * The body of a thread that verifies older binlog files. The threads take
+ * the files from the newest to the oldest until a file does not exist.
+ *
+ * @param data  The router instance
+ */
+static void
+blr_file_verify_thread(void *data)
+{
+    ROUTER_INSTANCE *router = (ROUTER_INSTANCE *)data;
+    char path[PATH_MAX + 1];
+    int filenum;
+
+    while ((filenum = atomic_add(&router->verify_next, -1)) > 0)
+    {
+        snprintf(path, sizeof(path), "%s/" BINLOG_NAMEFMT,
+                 router->binlogdir, router->fileroot, filenum);
+
+        if (access(path, R_OK) == -1)
+        {
+            /** A compressed file was complete when it was compressed */
+            strncat(path, BLR_ZFILE_SUFFIX, PATH_MAX - strlen(path));
+
+            if (access(path, R_OK) == -1)
+            {
+                break;
+            }
+            continue;
+        }
+
+        atomic_add(&router->verify_files, 1);
+
+        if (!blr_file_verify(router, path))
+        {
+            atomic_add(&router->verify_errors, 1);
+        }
+    }
+
+    if (atomic_add(&router->verify_running, -1) == 1)
+    {
+        blr_file_verify_done(router);
+    }
+}
+
+/**
+ * Verify the binlog files older than the current one in the background.
+ * The current binlog file is verified at startup by blr_read_events_all_events,
+ * the older ones are only checked so that damaged files are reported before
+ * a slave needs them. Errors in them are logged but not repaired.
+ *
+ * @param router    The router instance
+ */
+void
+blr_file_verify_old(ROUTER_INSTANCE *router)
+{
+    char *sptr;
+
+    if (router->verify_threads <= 0 || (sptr = strrchr(router->binlog_name, '.')) == NULL)
+    {
+        return;
+    }
+
+    router->verify_next = atoi(sptr + 1) - 1;
+    router->verify_files = 0;
+    router->verify_errors = 0;
+    router->verify_started = time(0);
+    router->verify_running = router->verify_threads;
+
+    for (int i = 0; i < router->verify_threads; i++)
+    {
+        THREAD thr;
+
+        if (thread_start(&thr, blr_file_verify_thread, router) == NULL)
+        {
+            MXS_ERROR("%s: Failed to start a thread to verify the older binlog files.",
+                      router->service->name);
+
+            /** The threads that were started verify all the files */
+            int not_started = router->verify_threads - i;
+
+            if (atomic_add(&router->verify_running, -not_started) == not_started && i > 0)
+            {
+                blr_file_verify_done(router);
+            }
+            break;
+        }
+    }
+}
+
 /**
  * Format a number to G, M, k, or B size
  *
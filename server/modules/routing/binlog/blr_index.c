@@ -0,0 +1,435 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file blr_index.c - binlog router GTID index of the binlog files
+ *
+ * Each binlog file written by the router has an index file next to it that
+ * records the MariaDB 10 GTID event groups of the file. An entry is appended
+ * when a group has been completely written, so the end of every entry is a
+ * safe position of the binlog file. The index is used to find the position
+ * of a slave that registers with its GTID and to skip the verification of
+ * the committed part of the current binlog file at startup.
+ *
+ * The entries are in the order of the positions and, within a replication
+ * domain, in the order of the GTID sequence numbers, which allows them to be
+ * searched with a binary search.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <service.h>
+#include <blr.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+
+/**
+ * Build the path of the index file of a binlog file
+ *
+ * @param router    The router instance
+ * @param binlog    The binlog file name
+ * @param path      Buffer of PATH_MAX + 1 bytes for the path
+ */
+static void
+blr_index_path(ROUTER_INSTANCE *router, const char *binlog, char *path)
+{
+    snprintf(path, PATH_MAX + 1, "%s/%s" BLR_INDEX_SUFFIX, router->binlogdir, binlog);
+}
+
+/**
+ * Get the number of complete entries in an index file
+ *
+ * @param fd    The index file
+ * @return The number of entries
+ */
+static long
+blr_index_entries(int fd)
+{
+    struct stat statb;
+
+    if (fstat(fd, &statb) == -1)
+    {
+        return 0;
+    }
+
+    return statb.st_size / sizeof(BLR_INDEX_ENTRY);
+}
+
+/**
+ * Read an entry of an index file
+ *
+ * @param fd        The index file
+ * @param n         The entry to read
+ * @param entry     The entry to populate
+ * @return True if the entry was read
+ */
+static bool
+blr_index_read(int fd, long n, BLR_INDEX_ENTRY *entry)
+{
+    return pread(fd, entry, sizeof(*entry), n * sizeof(*entry)) == sizeof(*entry);
+}
+
+/**
+ * Find the first entry of a replication domain in a range of an index file
+ *
+ * @param fd        The index file
+ * @param from      The first entry of the range
+ * @param to        The last entry of the range
+ * @param domain    The replication domain
+ * @param entry     The entry to populate
+ * @return The number of the entry or -1 if the range has no entry of the domain
+ */
+static long
+blr_index_next_in_domain(int fd, long from, long to, uint32_t domain, BLR_INDEX_ENTRY *entry)
+{
+    for (long n = from; n <= to; n++)
+    {
+        if (!blr_index_read(fd, n, entry))
+        {
+            break;
+        }
+
+        if (entry->domain == domain)
+        {
+            return n;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Open the index of the current binlog file. The index is only kept when
+ * the MariaDB 10 GTIDs of the events are tracked, that is with both
+ * mariadb10-compatibility and transaction_safety.
+ *
+ * @param router    The router instance
+ * @param create    Whether the binlog file was created, any old index is removed
+ */
+void
+blr_index_open(ROUTER_INSTANCE *router, bool create)
+{
+    char path[PATH_MAX + 1];
+    int flags = O_RDWR | O_CREAT | O_APPEND;
+
+    blr_index_close(router);
+
+    if (!router->binlog_index || !router->mariadb10_compat || !router->trx_safe)
+    {
+        return;
+    }
+
+    if (create)
+    {
+        flags |= O_TRUNC;
+    }
+
+    blr_index_path(router, router->binlog_name, path);
+
+    if ((router->index_fd = open(path, flags, 0666)) == -1)
+    {
+        char err_msg[STRERROR_BUFLEN];
+        MXS_ERROR("%s: Failed to open binlog index file %s, %s. "
+                  "Slaves can not register with the GTIDs of %s.",
+                  router->service->name, path,
+                  strerror_r(errno, err_msg, sizeof(err_msg)),
+                  router->binlog_name);
+    }
+}
+
+/**
+ * Close the index of the current binlog file. An event group that was not
+ * completely written is not added to the index.
+ *
+ * @param router    The router instance
+ */
+void
+blr_index_close(ROUTER_INSTANCE *router)
+{
+    if (router->index_fd != -1)
+    {
+        close(router->index_fd);
+        router->index_fd = -1;
+    }
+    router->index_pending.start = 0;
+}
+
+/**
+ * Record the start of an event group. Called for the GTID event before it
+ * is written at the current position of the binlog file.
+ *
+ * @param router        The router instance
+ * @param domain        The GTID domain id
+ * @param server_id     The GTID server id
+ * @param sequence      The GTID sequence number
+ * @param event_size    The size of the GTID event
+ */
+void
+blr_index_gtid(ROUTER_INSTANCE *router, uint32_t domain, uint32_t server_id,
+               uint64_t sequence, uint32_t event_size)
+{
+    if (router->index_fd != -1)
+    {
+        router->index_pending.domain = domain;
+        router->index_pending.server_id = server_id;
+        router->index_pending.sequence = sequence;
+        router->index_pending.start = router->current_pos;
+        router->index_pending.end = 0;
+        router->index_first_event = router->current_pos + event_size;
+    }
+}
+
+/**
+ * Add the pending event group to the index once it has been completely
+ * written. A group is complete when the safe position of the binlog file
+ * has moved past its first event after the GTID event: for a transaction
+ * this happens at the commit and for a standalone event group once the
+ * event that follows the GTID event has been written.
+ *
+ * @param router    The router instance
+ */
+void
+blr_index_update(ROUTER_INSTANCE *router)
+{
+    BLR_INDEX_ENTRY *entry = &router->index_pending;
+
+    if (router->index_fd == -1 || entry->start == 0)
+    {
+        return;
+    }
+
+    spinlock_acquire(&router->binlog_lock);
+    if (router->pending_transaction == 0 && router->binlog_position > router->index_first_event)
+    {
+        entry->end = router->binlog_position;
+    }
+    spinlock_release(&router->binlog_lock);
+
+    if (entry->end)
+    {
+        if (write(router->index_fd, entry, sizeof(*entry)) != sizeof(*entry))
+        {
+            char err_msg[STRERROR_BUFLEN];
+            MXS_ERROR("%s: Failed to add GTID %u-%u-%lu to the index of binlog file %s, %s.",
+                      router->service->name, entry->domain, entry->server_id,
+                      (unsigned long)entry->sequence, router->binlog_name,
+                      strerror_r(errno, err_msg, sizeof(err_msg)));
+
+            /** Remove a partially written entry */
+            if (ftruncate(router->index_fd, blr_index_entries(router->index_fd) * sizeof(*entry)) == -1)
+            {
+                blr_index_close(router);
+            }
+        }
+        entry->start = 0;
+    }
+}
+
+/**
+ * Remove the entries of the current binlog file that end after a position.
+ * Called when the binlog file has been verified, the index may have been
+ * written ahead of the binlog file when the router was stopped.
+ *
+ * @param router    The router instance
+ * @param pos       The last safe position of the binlog file
+ */
+void
+blr_index_truncate(ROUTER_INSTANCE *router, uint64_t pos)
+{
+    BLR_INDEX_ENTRY entry;
+    long n;
+
+    if (router->index_fd == -1)
+    {
+        return;
+    }
+
+    n = blr_index_entries(router->index_fd);
+
+    while (n > 0 && (!blr_index_read(router->index_fd, n - 1, &entry) || entry.end > pos))
+    {
+        n--;
+    }
+
+    if (ftruncate(router->index_fd, n * sizeof(entry)) == -1)
+    {
+        char err_msg[STRERROR_BUFLEN];
+        MXS_ERROR("%s: Failed to truncate the index of binlog file %s, %s.",
+                  router->service->name, router->binlog_name,
+                  strerror_r(errno, err_msg, sizeof(err_msg)));
+        blr_index_close(router);
+    }
+}
+
+/**
+ * Find the position up to which the current binlog file is known to be valid
+ * from its index. The last entry that fits in the file is checked against
+ * the GTID event it points at before it is trusted.
+ *
+ * @param router    The router instance
+ * @return The position after the last indexed event group, 4 if there is none
+ */
+uint64_t
+blr_index_checkpoint(ROUTER_INSTANCE *router)
+{
+    BLR_INDEX_ENTRY entry;
+    struct stat statb;
+    uint8_t hdbuf[BINLOG_EVENT_HDR_LEN];
+    long n;
+
+    if (router->index_fd == -1 || fstat(router->binlog_fd, &statb) == -1)
+    {
+        return 4;
+    }
+
+    n = blr_index_entries(router->index_fd);
+
+    while (n > 0 && (!blr_index_read(router->index_fd, n - 1, &entry) ||
+                     entry.end > (uint64_t)statb.st_size))
+    {
+        n--;
+    }
+
+    if (n == 0)
+    {
+        return 4;
+    }
+
+    if (pread(router->binlog_fd, hdbuf, BINLOG_EVENT_HDR_LEN, entry.start) != BINLOG_EVENT_HDR_LEN ||
+        hdbuf[4] != MARIADB10_GTID_EVENT ||
+        EXTRACT32(&hdbuf[13]) != entry.start + extract_field(&hdbuf[9], 32))
+    {
+        MXS_WARNING("%s: The index of binlog file %s does not match the file, "
+                    "the whole file is verified.",
+                    router->service->name, router->binlog_name);
+        return 4;
+    }
+
+    return entry.end;
+}
+
+/**
+ * Search the index of one binlog file for a GTID
+ *
+ * @param fd            The index file
+ * @param domain        The GTID domain id
+ * @param server_id     The GTID server id
+ * @param sequence      The GTID sequence number
+ * @param entry         The entry to populate
+ * @return 1 if the GTID was found, 0 if it is not in the file and -1 if the
+ *         GTID would be in this file but is missing from it
+ */
+static int
+blr_index_search(int fd, uint32_t domain, uint32_t server_id,
+                 uint64_t sequence, BLR_INDEX_ENTRY *entry)
+{
+    long lo = 0;
+    long hi = blr_index_entries(fd) - 1;
+    long n;
+
+    /** The file only has the GTID if its first GTID of the domain is not later */
+    if ((n = blr_index_next_in_domain(fd, lo, hi, domain, entry)) == -1 ||
+        entry->sequence > sequence)
+    {
+        return 0;
+    }
+
+    lo = n;
+
+    while (lo <= hi)
+    {
+        long mid = lo + (hi - lo) / 2;
+
+        if ((n = blr_index_next_in_domain(fd, mid, hi, domain, entry)) == -1)
+        {
+            hi = mid - 1;
+        }
+        else if (entry->sequence < sequence)
+        {
+            lo = n + 1;
+        }
+        else if (entry->sequence > sequence)
+        {
+            hi = mid - 1;
+        }
+        else
+        {
+            return entry->server_id == server_id ? 1 : -1;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Find the position that follows an event group in the binlog files. The
+ * indexes are searched from the current binlog file backwards until the file
+ * that holds the GTID is found or a file has no index.
+ *
+ * @param router        The router instance
+ * @param domain        The GTID domain id
+ * @param server_id     The GTID server id
+ * @param sequence      The GTID sequence number
+ * @param binlog        Buffer of BINLOG_FNAMELEN + 1 bytes for the binlog file
+ * @param pos           The position after the event group
+ * @return True if the GTID was found
+ */
+bool
+blr_index_find_gtid(ROUTER_INSTANCE *router, uint32_t domain, uint32_t server_id,
+                    uint64_t sequence, char *binlog, uint64_t *pos)
+{
+    char file[BINLOG_FNAMELEN + 1];
+    char path[PATH_MAX + 1];
+    BLR_INDEX_ENTRY entry;
+    int rval = 0;
+    char *sptr;
+    int filenum;
+
+    spinlock_acquire(&router->binlog_lock);
+    strcpy(file, router->binlog_name);
+    spinlock_release(&router->binlog_lock);
+
+    if ((sptr = strrchr(file, '.')) == NULL)
+    {
+        return false;
+    }
+
+    for (filenum = atoi(sptr + 1); rval == 0 && filenum > 0; filenum--)
+    {
+        int fd;
+
+        snprintf(file, sizeof(file), BINLOG_NAMEFMT, router->fileroot, filenum);
+        blr_index_path(router, file, path);
+
+        if ((fd = open(path, O_RDONLY)) == -1)
+        {
+            break;
+        }
+
+        rval = blr_index_search(fd, domain, server_id, sequence, &entry);
+        close(fd);
+    }
+
+    if (rval == 1)
+    {
+        strcpy(binlog, file);
+        *pos = entry.end;
+    }
+
+    return rval == 1;
+}
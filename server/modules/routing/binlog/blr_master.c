@@ -72,7 +72,9 @@
 #include <log_manager.h>
 
 #include <rdtsc.h>
+#include <probes.h>
 #include <thread.h>
+#include <errno.h>
 
 /* Temporary requirement for auth data */
 #include <mysql_client_server_protocol.h>
@@ -81,11 +83,16 @@
 static GWBUF *blr_make_query(char *statement);
 static GWBUF *blr_make_registration(ROUTER_INSTANCE *router);
 static GWBUF *blr_make_binlog_dump(ROUTER_INSTANCE *router);
+static void blr_semisync_ack(ROUTER_INSTANCE *router);
 void encode_value(unsigned char *data, unsigned int value, int len);
 void blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt);
 static int  blr_rotate_event(ROUTER_INSTANCE *router, uint8_t *pkt, REP_HEADER *hdr);
 void blr_distribute_binlog_record(ROUTER_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr,
                                   blr_thread_role_t role);
+static void blr_distribute_event(ROUTER_INSTANCE *router, BLR_DIST_EVENT *ev, uint8_t *ptr);
+static bool blr_checksum_deferred(ROUTER_INSTANCE *router, REP_HEADER *hdr);
+static bool blr_checksum_verify(ROUTER_INSTANCE *router, BLR_DIST_EVENT *ev, uint8_t *ptr);
+static void blr_checksum_recover(ROUTER_INSTANCE *router);
 static void *CreateMySQLAuthData(char *username, char *password, char *database);
 void blr_extract_header(uint8_t *pkt, REP_HEADER *hdr);
 static void blr_log_packet(int priority, char *msg, uint8_t *ptr, int len);
@@ -681,6 +688,55 @@ blr_master_response(ROUTER_INSTANCE *router, GWBUF *buf)
         }
         router->saved_master.map = buf;
         blr_cache_response(router, "map", buf);
+        router->semisync_active = false;
+        router->semisync_need_ack = false;
+        if (router->semisync)
+        {
+            // Check whether the master has the semi-sync plugin
+            buf = blr_make_query("SHOW VARIABLES LIKE 'rpl_semi_sync_master_enabled'");
+            router->master_state = BLRM_CHECK_SEMISYNC;
+        }
+        else
+        {
+            buf = blr_make_registration(router);
+            router->master_state = BLRM_REGISTER;
+        }
+        router->master->func.write(router->master, buf);
+        break;
+    case BLRM_CHECK_SEMISYNC:
+        {
+            char *val = blr_extract_column(buf, 2);
+
+            gwbuf_consume(buf, gwbuf_length(buf));
+
+            if (val)
+            {
+                /* The master sends the semi-sync headers even if it is disabled */
+                if (strcasecmp(val, "ON") != 0)
+                {
+                    MXS_NOTICE("%s: Semi-synchronous replication is not enabled "
+                               "on the master, the events are not acknowledged "
+                               "until it is.", router->service->name);
+                }
+                buf = blr_make_query("SET @rpl_semi_sync_slave = 1");
+                router->master_state = BLRM_REQUEST_SEMISYNC;
+                free(val);
+            }
+            else
+            {
+                MXS_WARNING("%s: The master does not have the semi-synchronous "
+                            "replication plugin, replicating asynchronously.",
+                            router->service->name);
+                buf = blr_make_registration(router);
+                router->master_state = BLRM_REGISTER;
+            }
+            router->master->func.write(router->master, buf);
+        }
+        break;
+    case BLRM_REQUEST_SEMISYNC:
+        // Response to SET @rpl_semi_sync_slave, no need to save this.
+        gwbuf_consume(buf, gwbuf_length(buf));
+        router->semisync_active = true;
         buf = blr_make_registration(router);
         router->master_state = BLRM_REGISTER;
         router->master->func.write(router->master, buf);
@@ -865,6 +921,22 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
     int prev_length = -1;
     int n_bufs = -1, pn_bufs = -1;
 
+    /**
+     * The distribution thread found an event with a bad checksum, the events
+     * from it onwards are requested again from the master
+     */
+    if (__atomic_load_n(&router->badcrc_state, __ATOMIC_ACQUIRE) == BLR_BADCRC_FOUND)
+    {
+        while ((pkt = gwbuf_consume(pkt, GWBUF_LENGTH(pkt))) != NULL)
+        {
+            ;
+        }
+        blr_checksum_recover(router);
+        blr_master_close(router);
+        blr_master_delayed_connect(router);
+        return;
+    }
+
     /*
      * Prepend any residual buffer to the buffer chain we have
      * been called with.
@@ -911,6 +983,52 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
         }
         /* len is now the payload length for the packet we are working on */
 
+        /* Whether this is the last packet of the event */
+        bool last_packet = len - MYSQL_HEADER_LEN < MYSQL_PACKET_LENGTH_MAX;
+
+        /*
+         * Remove the semi-sync header from the first packet of an event so
+         * that the rest of the packet is handled like that of an asynchronous
+         * master. This is only done once the whole packet has been received.
+         */
+        if (router->semisync_active && router->master_event_state == BLR_EVENT_DONE &&
+            pkt_length >= len && len >= MYSQL_HEADER_LEN + 1 + BLR_SEMISYNC_HDR_LEN)
+        {
+            if (reslen < MYSQL_HEADER_LEN + 1 + BLR_SEMISYNC_HDR_LEN)
+            {
+                GWBUF *contiguous = gwbuf_make_contiguous(pkt);
+
+                if (contiguous == NULL)
+                {
+                    MXS_ERROR("%s: Insufficient memory to buffer event "
+                              "of %d bytes. Binlog %s @ %lu.",
+                              router->service->name, len,
+                              router->binlog_name, router->current_pos);
+                    break;
+                }
+                pkt = contiguous;
+                reslen = GWBUF_LENGTH(pkt);
+                pdata = GWBUF_DATA(pkt);
+            }
+
+            if (pdata[MYSQL_HEADER_LEN] == 0 && pdata[MYSQL_HEADER_LEN + 1] == BLR_SEMISYNC_INDICATOR)
+            {
+                if (pdata[MYSQL_HEADER_LEN + 2] & BLR_SEMISYNC_ACK_REQ)
+                {
+                    router->semisync_need_ack = true;
+                }
+
+                /** Move the packet header and the OK byte over the semi-sync header */
+                memmove(pdata + BLR_SEMISYNC_HDR_LEN, pdata, MYSQL_HEADER_LEN + 1);
+                pkt = gwbuf_consume(pkt, BLR_SEMISYNC_HDR_LEN);
+                pkt_length -= BLR_SEMISYNC_HDR_LEN;
+                len -= BLR_SEMISYNC_HDR_LEN;
+                reslen = GWBUF_LENGTH(pkt);
+                pdata = GWBUF_DATA(pkt);
+                encode_value(pdata, len - MYSQL_HEADER_LEN, 24);
+            }
+        }
+
         if (reslen < len && pkt_length >= len)
         {
             /*
@@ -1020,7 +1138,7 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
                 /* Sanity check */
                 if (hdr.ok == 0)
                 {
-                    if (hdr.event_size != len - 5 && (hdr.event_size + 1) < MYSQL_PACKET_LENGTH_MAX)
+                    if (last_packet && hdr.event_size != len - 5)
                     {
                         MXS_ERROR("Packet length is %d, but event size is %d, "
                                   "binlog file %s position %lu "
@@ -1048,7 +1166,7 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
 
                         break;
                     }
-                    else if ((hdr.event_size + 1) >= MYSQL_PACKET_LENGTH_MAX)
+                    else if (!last_packet)
                     {
                         router->master_event_state = BLR_EVENT_STARTED;
 
@@ -1057,7 +1175,7 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
                     }
 
                     /** Prepare the checksum variables for this event */
-                    router->stored_checksum = crc32(0L, NULL, 0);
+                    router->stored_checksum = mxs_crc32(0, NULL, 0);
                     router->checksum_size = hdr.event_size - MYSQL_CHECKSUM_LEN;
                     router->partial_checksum_bytes = 0;
                 }
@@ -1103,7 +1221,7 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
             /* pending large event */
             if (router->master_event_state != BLR_EVENT_DONE)
             {
-                if (len - MYSQL_HEADER_LEN < MYSQL_PACKET_LENGTH_MAX)
+                if (last_packet)
                 {
                     /** This is the last packet, we can now proceed to distribute
                      * the event afer it has been written to disk */
@@ -1129,7 +1247,7 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
                     {
                         uint32_t size = (len - extra_bytes) < router->checksum_size ?
                             len - extra_bytes : router->checksum_size;
-                        router->stored_checksum = crc32(router->stored_checksum,
+                        router->stored_checksum = mxs_crc32(router->stored_checksum,
                                                         ptr + offset,
                                                         size);
                         router->checksum_size -= size;
@@ -1162,7 +1280,7 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
              * First check that the checksum we calculate matches the
              * checksum in the packet we received.
              */
-            if (router->master_chksum)
+            if (router->master_chksum && !blr_checksum_deferred(router, &hdr))
             {
                 uint32_t pktsum, offset = MYSQL_HEADER_LEN;
                 uint32_t size = len - MYSQL_HEADER_LEN - MYSQL_CHECKSUM_LEN;
@@ -1179,7 +1297,7 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
 
                 if (router->checksum_size > 0)
                 {
-                    router->stored_checksum = crc32(router->stored_checksum,
+                    router->stored_checksum = mxs_crc32(router->stored_checksum,
                                                     ptr + offset,
                                                     size);
                     router->checksum_size -= size;
@@ -1260,6 +1378,8 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
                             domainid = extract_field(ptr + 4 + 20 + 8, 32);
                             flags = *(ptr + 4 + 20 + 8 + 4);
 
+                            blr_index_gtid(router, domainid, hdr.serverid, n_sequence, hdr.event_size);
+
                             if ((flags & (MARIADB_FL_DDL | MARIADB_FL_STANDALONE)) == 0)
                             {
                                 spinlock_acquire(&router->binlog_lock);
@@ -1634,6 +1754,9 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
                                 spinlock_release(&router->binlog_lock);
                             }
                         }
+
+                        /** Index the event group if it is now complete */
+                        blr_index_update(router);
                     }
                     else
                     {
@@ -1717,6 +1840,57 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
         ss_dassert(pkt_length == 0);
     }
     blr_file_flush(router);
+    blr_semisync_ack(router);
+}
+
+/**
+ * Acknowledge the received events to a semi-synchronous master if it waits
+ * for it. The events are made durable first: if the sync policy did not
+ * already sync them to disk, they are synced now.
+ *
+ * @param router    The router instance
+ */
+static void
+blr_semisync_ack(ROUTER_INSTANCE *router)
+{
+    GWBUF *buf;
+    uint8_t *data;
+    int namelen, len;
+
+    if (!router->semisync_need_ack || router->master == NULL)
+    {
+        return;
+    }
+
+    router->semisync_need_ack = false;
+
+    if (!blr_file_flush_buffer(router))
+    {
+        return;
+    }
+
+    if (router->unsynced_bytes)
+    {
+        blr_file_sync(router);
+    }
+
+    namelen = strlen(router->binlog_name);
+    len = 1 + 8 + namelen;
+
+    if ((buf = gwbuf_alloc(len + MYSQL_HEADER_LEN)) == NULL)
+    {
+        return;
+    }
+
+    data = GWBUF_DATA(buf);
+    encode_value(&data[0], len, 24);    // Payload length
+    data[3] = 0;                        // Sequence id
+    data[4] = BLR_SEMISYNC_INDICATOR;
+    encode_value(&data[5], router->current_pos, 64);
+    memcpy(&data[13], router->binlog_name, namelen);
+
+    router->master->func.write(router->master, buf);
+    router->stats.n_semisync_acks++;
 }
 
 /**
@@ -1836,19 +2010,347 @@ typedef enum
 } slave_event_action_t;
 
 /**
- * Distribute the binlog record we have just received to all the registered slaves.
+ * Get the sequence number of a binlog file from its name
+ *
+ * @param binlog    The binlog file name
+ * @return The number in the file name suffix
+ */
+static int
+blr_binlog_seqno(const char *binlog)
+{
+    const char *sptr = strrchr(binlog, '.');
+
+    return sptr ? atoi(sptr + 1) : 0;
+}
+
+/**
+ * Force the slaves that are up to date, but not at the end of the binlog
+ * file, into catchup mode. Called by the distribution thread once it has
+ * drained the queue after events were dropped from it.
+ *
+ * @param   router      The router instance
+ */
+static void
+blr_distribute_resync(ROUTER_INSTANCE *router)
+{
+    ROUTER_SLAVE *slave;
+
+    spinlock_acquire(&router->lock);
+    for (slave = router->slaves; slave; slave = slave->next)
+    {
+        bool behind;
+
+        if (slave->state != BLRS_DUMPING)
+        {
+            continue;
+        }
+
+        spinlock_acquire(&router->binlog_lock);
+        behind = slave->binlog_pos != router->binlog_position ||
+                 strcmp(slave->binlogfile, router->binlog_name) != 0;
+        spinlock_release(&router->binlog_lock);
+
+        spinlock_acquire(&slave->catch_lock);
+        if (behind && (slave->cstate & (CS_UPTODATE | CS_BUSY)) == CS_UPTODATE)
+        {
+            slave->cstate &= ~CS_UPTODATE;
+            slave->cstate |= CS_EXPECTCB;
+            spinlock_release(&slave->catch_lock);
+            poll_fake_write_event(slave->dcb);
+        }
+        else
+        {
+            spinlock_release(&slave->catch_lock);
+        }
+    }
+    spinlock_release(&router->lock);
+}
+
+/**
+ * The distribution thread of a router instance. It sends the events that the
+ * master thread has queued to the slaves that are up to date, so that slow
+ * slave connections do not hold up the reading and writing of the events
+ * from the master.
+ *
+ * @param   data        The router instance
+ */
+static void
+blr_distribute_thread(void *data)
+{
+    ROUTER_INSTANCE *router = (ROUTER_INSTANCE *)data;
+    BLR_DIST_QUEUE *queue = router->dist_queue;
+
+    while (true)
+    {
+        if (sem_wait(&queue->ready) == -1)
+        {
+            continue;
+        }
+
+        uint32_t tail = queue->tail;
+
+        if (tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE))
+        {
+            BLR_DIST_EVENT *ev = &queue->events[tail & (BLR_DIST_QUEUE_SIZE - 1)];
+            uint8_t *ptr = GWBUF_DATA(ev->event);
+
+            if (__atomic_load_n(&router->badcrc_state, __ATOMIC_ACQUIRE) != BLR_BADCRC_NONE ||
+                (ev->verify && !blr_checksum_verify(router, ev, ptr)))
+            {
+                /** The event is requested again from the master */
+                gwbuf_free(ev->event);
+            }
+            else
+            {
+                blr_distribute_event(router, ev, ptr);
+            }
+            __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+        }
+
+        /** The events queued before the binlog file was truncated are gone */
+        if (__atomic_load_n(&queue->tail, __ATOMIC_RELAXED) ==
+            __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE))
+        {
+            int handled = BLR_BADCRC_HANDLED;
+            __atomic_compare_exchange_n(&router->badcrc_state, &handled, BLR_BADCRC_NONE,
+                                        false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+        }
+
+        /**
+         * The slaves that were not sent the dropped events are forced into
+         * catchup mode once the events before them have been sent
+         */
+        if (__atomic_load_n(&queue->tail, __ATOMIC_RELAXED) ==
+            __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) &&
+            __atomic_exchange_n(&queue->dropped, 0, __ATOMIC_ACQ_REL))
+        {
+            blr_distribute_resync(router);
+        }
+    }
+}
+
+/**
+ * Start the distribution thread of a router instance. Until it is started the
+ * events are distributed by the thread that handles the master connection.
+ *
+ * @param   router      The router instance
+ * @return True if the thread was started
+ */
+bool
+blr_distribute_start(ROUTER_INSTANCE *router)
+{
+    BLR_DIST_QUEUE *queue;
+
+    if ((queue = calloc(1, sizeof(BLR_DIST_QUEUE))) == NULL)
+    {
+        return false;
+    }
+
+    if (sem_init(&queue->ready, 0, 0) == -1)
+    {
+        free(queue);
+        return false;
+    }
+
+    router->dist_queue = queue;
+
+    if (thread_start(&queue->thread, blr_distribute_thread, router) == NULL)
+    {
+        router->dist_queue = NULL;
+        sem_destroy(&queue->ready);
+        free(queue);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Add an event to the distribution queue. The event is copied so that the
+ * master thread can carry on with the next one. If the queue is full the
+ * event is dropped and the slaves that miss it read it from the binlog file.
+ * Only the thread that handles the master connection adds events.
+ *
+ * @param   router      The router instance
+ * @param   ev          The event and the router state it is distributed with
+ * @param   ptr         The raw replication event data
+ */
+static void
+blr_distribute_queue(ROUTER_INSTANCE *router, BLR_DIST_EVENT *ev, uint8_t *ptr)
+{
+    BLR_DIST_QUEUE *queue = router->dist_queue;
+    uint32_t head = queue->head;
+
+    if (head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) == BLR_DIST_QUEUE_SIZE ||
+        (ev->event = gwbuf_alloc_and_load(ev->hdr.event_size, ptr)) == NULL)
+    {
+        router->stats.n_distdropped++;
+        __atomic_store_n(&queue->dropped, 1, __ATOMIC_RELEASE);
+
+        /** A dropped event is not seen by the distribution thread */
+        if (ev->verify)
+        {
+            blr_checksum_verify(router, ev, ptr);
+        }
+    }
+    else
+    {
+        ev->queued = true;
+        queue->events[head & (BLR_DIST_QUEUE_SIZE - 1)] = *ev;
+        __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+        router->stats.n_distqueued++;
+    }
+
+    sem_post(&queue->ready);
+}
+
+/**
+ * Check whether the checksum of an event is verified by the distribution
+ * thread instead of the thread that reads it from the master. Only the events
+ * that arrive in one packet and are written to the binlog file are, the other
+ * events do not pass through the distribution queue.
+ *
+ * @param   router      The router instance
+ * @param   hdr         The event header
+ * @return True if the checksum is verified by the distribution thread
+ */
+static bool
+blr_checksum_deferred(ROUTER_INSTANCE *router, REP_HEADER *hdr)
+{
+    return router->async_checksum && router->dist_queue &&
+           router->master_event_state == BLR_EVENT_DONE && hdr->ok == 0 &&
+           hdr->event_type != HEARTBEAT_EVENT && hdr->flags != LOG_EVENT_ARTIFICIAL_F &&
+           !(hdr->event_type == FORMAT_DESCRIPTION_EVENT && hdr->next_pos == 0);
+}
+
+/**
+ * Verify the checksum of an event that is distributed. If it does not match,
+ * the position of the event is recorded so that the master thread truncates
+ * the binlog file there and requests the event again.
+ *
+ * @param   router      The router instance
+ * @param   ev          The event
+ * @param   ptr         The raw replication event data
+ * @return True if the checksum matches
+ */
+static bool
+blr_checksum_verify(ROUTER_INSTANCE *router, BLR_DIST_EVENT *ev, uint8_t *ptr)
+{
+    uint32_t size = ev->hdr.event_size - MYSQL_CHECKSUM_LEN;
+
+    if (mxs_crc32(0, ptr, size) == EXTRACT32(ptr + size))
+    {
+        return true;
+    }
+
+    atomic_add(&router->stats.n_badcrc, 1);
+
+    spinlock_acquire(&router->binlog_lock);
+    if (router->badcrc_state == BLR_BADCRC_NONE)
+    {
+        router->badcrc_pos = ev->hdr.next_pos - ev->hdr.event_size;
+        strcpy(router->badcrc_binlog, ev->binlog);
+        __atomic_store_n(&router->badcrc_state, BLR_BADCRC_FOUND, __ATOMIC_RELEASE);
+    }
+    spinlock_release(&router->binlog_lock);
+
+    return false;
+}
+
+/**
+ * Handle a checksum error found by the distribution thread. The binlog file
+ * is truncated at the event with the bad checksum, or at the start of the
+ * open transaction before it, so that the events are requested again when the
+ * router reconnects to the master. The caller closes the master connection.
+ *
+ * @param   router      The router instance
+ */
+static void
+blr_checksum_recover(ROUTER_INSTANCE *router)
+{
+    spinlock_acquire(&router->binlog_lock);
+    uint64_t pos = MIN(router->badcrc_pos, router->binlog_position);
+    bool same_file = strcmp(router->badcrc_binlog, router->binlog_name) == 0;
+    spinlock_release(&router->binlog_lock);
+
+    MXS_ERROR("%s: Checksum error in event from master, "
+              "binlog %s @ %lu. Closing master connection.",
+              router->service->name, router->badcrc_binlog,
+              router->badcrc_pos);
+
+    if (!same_file)
+    {
+        MXS_ERROR("%s: The binlog file %s has been rotated since the event with "
+                  "the bad checksum was written, it is not truncated.",
+                  router->service->name, router->badcrc_binlog);
+    }
+    else
+    {
+        blr_file_truncate(router, pos);
+    }
+
+    __atomic_store_n(&router->badcrc_state, BLR_BADCRC_HANDLED, __ATOMIC_RELEASE);
+    sem_post(&router->dist_queue->ready);
+}
+
+/**
+ * Distribute the binlog record we have just received to all the registered
+ * slaves. With async_distribution the record is queued for the distribution
+ * thread, otherwise it is sent by the calling thread.
  *
  * @param   router      The router instance
  * @param   hdr     The replication event header
  * @param   ptr     The raw replication event data
+ * @param   role    The role of the calling thread
  */
 void
 blr_distribute_binlog_record(ROUTER_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr,
                              blr_thread_role_t role)
+{
+    BLR_DIST_EVENT ev;
+
+    MXS_PROBE4(blr_distribute_binlog_record, router, hdr->event_type, hdr->event_size, hdr->next_pos);
+
+    ev.hdr = *hdr;
+    ev.event = NULL;
+    ev.role = role;
+    ev.queued = false;
+    ev.verify = router->async_checksum && router->master_chksum;
+
+    spinlock_acquire(&router->binlog_lock);
+    ev.safe_pos = router->trx_safe ? router->current_safe_event : router->last_event_pos;
+    strcpy(ev.binlog, router->binlog_name);
+    strcpy(ev.prevbinlog, router->prevbinlog);
+    spinlock_release(&router->binlog_lock);
+
+    if (router->dist_queue)
+    {
+        blr_distribute_queue(router, &ev, ptr);
+    }
+    else
+    {
+        blr_distribute_event(router, &ev, ptr);
+    }
+}
+
+/**
+ * Send an event to the slaves that are up to date and wake up the slaves that
+ * are in catchup mode. The router state the event was distributed with is in
+ * the event, a queued event is sent after the router has moved on.
+ *
+ * @param   router      The router instance
+ * @param   ev          The event, the event buffer is freed
+ * @param   ptr         The raw replication event data
+ */
+static void
+blr_distribute_event(ROUTER_INSTANCE *router, BLR_DIST_EVENT *ev, uint8_t *ptr)
 {
     ROUTER_SLAVE *slave;
     int action;
     unsigned int cstate;
+    REP_HEADER *hdr = &ev->hdr;
+    blr_thread_role_t role = ev->role;
+    GWBUF *event = ev->event;
 
     spinlock_acquire(&router->lock);
     slave = router->slaves;
@@ -1898,29 +2400,34 @@ blr_distribute_binlog_record(ROUTER_INSTANCE *router, REP_HEADER *hdr, uint8_t *
             spinlock_acquire(&router->binlog_lock);
 
             slave_event_action_t slave_action = SLAVE_FORCE_CATCHUP;
-            const bool same_file = strcmp(slave->binlogfile, router->binlog_name) == 0;
+            const bool same_file = strcmp(slave->binlogfile, ev->binlog) == 0;
             const bool rotate = hdr->event_type == ROTATE_EVENT &&
-                strcmp(slave->binlogfile, router->prevbinlog) == 0;
+                strcmp(slave->binlogfile, ev->prevbinlog) == 0;
 
-            if (router->trx_safe && (same_file || rotate) &&
-                slave->binlog_pos == router->current_safe_event)
+            if ((same_file || rotate) && slave->binlog_pos == ev->safe_pos)
             {
-                /** Slave needs the current event being distributed */
+                /**
+                 * Slave needs the current event being distributed, with
+                 * transaction safety off the last event is always safe
+                 */
                 slave_action = SLAVE_SEND_EVENT;
             }
-            else if (!router->trx_safe && (same_file || rotate) &&
-                     slave->binlog_pos == router->last_event_pos)
+            else if (ev->queued && !same_file && !rotate &&
+                     blr_binlog_seqno(slave->binlogfile) > blr_binlog_seqno(ev->binlog))
             {
-                /** Transaction safety is off */
-                slave_action = SLAVE_SEND_EVENT;
+                /** The slave caught up past a queued event of an older file */
+                slave_action = SLAVE_EVENT_ALREADY_SENT;
             }
             else if (same_file)
             {
-                if (slave->binlog_pos == hdr->next_pos)
+                if (slave->binlog_pos == hdr->next_pos ||
+                    (ev->queued && slave->binlog_pos > hdr->next_pos))
                 {
                     /*
                      * Slave has already read record from file, no
-                     * need to distrbute this event
+                     * need to distrbute this event. A queued event
+                     * may be behind a slave that caught up from the
+                     * file after the event was queued.
                      */
                     slave_action = SLAVE_EVENT_ALREADY_SENT;
                 }
@@ -1999,7 +2506,16 @@ blr_distribute_binlog_record(ROUTER_INSTANCE *router, REP_HEADER *hdr, uint8_t *
                     blr_slave_rotate(router, slave, ptr);
                 }
 
-                if (blr_send_event(role, binlog_name, binlog_pos, slave, hdr, ptr))
+                /**
+                 * The event is copied once into a buffer that all the
+                 * slaves that are up to date share.
+                 */
+                if (event == NULL && hdr->event_size + 1 < MYSQL_PACKET_LENGTH_MAX)
+                {
+                    event = gwbuf_alloc_and_load(hdr->event_size, ptr);
+                }
+
+                if (blr_send_event(role, binlog_name, binlog_pos, slave, hdr, ptr, event))
                 {
                     spinlock_acquire(&slave->catch_lock);
                     if (hdr->event_type != ROTATE_EVENT)
@@ -2083,6 +2599,9 @@ blr_distribute_binlog_record(ROUTER_INSTANCE *router, REP_HEADER *hdr, uint8_t *
         slave = slave->next;
     }
     spinlock_release(&router->lock);
+
+    /** The slaves hold their own references to the event */
+    gwbuf_free(event);
 }
 
 /**
@@ -2247,6 +2766,12 @@ GWBUF
         return NULL;
     }
 
+    /* The events of the transaction may still be in the write buffer */
+    if (!blr_file_flush_buffer(router))
+    {
+        return NULL;
+    }
+
     /* Read the event header information from the file */
     if ((n = pread(router->binlog_fd, hdbuf, 19, pos)) != 19)
     {
@@ -2594,30 +3119,47 @@ blr_distribute_error_message(ROUTER_INSTANCE *router, char *message, char *state
 int
 blr_write_data_into_binlog(ROUTER_INSTANCE *router, uint32_t data_len, uint8_t *buf)
 {
-    int n;
-
-    if ((n = pwrite(router->binlog_fd, buf, data_len,
-                    router->last_written)) != data_len)
+    if (!blr_file_write(router, buf, data_len))
     {
-        char err_msg[STRERROR_BUFLEN];
-        MXS_ERROR("%s: Failed to write binlog record at %lu of %s, %s. "
-                  "Truncating to previous record.",
-                  router->service->name, router->last_written,
-                  router->binlog_name,
-                  strerror_r(errno, err_msg, sizeof(err_msg)));
-
-        /* Remove any partial event that was written */
-        if (ftruncate(router->binlog_fd, router->binlog_position))
-        {
-            MXS_ERROR("%s: Failed to truncate binlog record at %lu of %s, %s. ",
-                      router->service->name, router->binlog_position,
-                      router->binlog_name,
-                      strerror_r(errno, err_msg, sizeof(err_msg)));
-        }
         return 0;
     }
     router->last_written += data_len;
-    return n;
+    return data_len;
+}
+
+/**
+ * Send a replication event that fits into a single packet to a slave without
+ * copying it. Only the packet header with the sequence number of the slave
+ * is allocated, the event is a reference to a buffer that is shared by all
+ * the slaves that the event is sent to. The two are written with one writev.
+ *
+ * @param slave Slave where the packet is sent to
+ * @param event Buffer that contains only the replication event
+ * @return True on success, false when memory allocation fails
+ */
+static bool blr_send_shared_packet(ROUTER_SLAVE *slave, GWBUF *event)
+{
+    unsigned int datalen = GWBUF_LENGTH(event) + 1;
+    GWBUF *buffer = gwbuf_alloc(MYSQL_HEADER_LEN + 1);
+    GWBUF *clone = NULL;
+
+    if (buffer == NULL || (clone = gwbuf_clone(event)) == NULL)
+    {
+        MXS_ERROR("failed to allocate memory when writing an event.");
+        gwbuf_free(buffer);
+        return false;
+    }
+
+    uint8_t *data = GWBUF_DATA(buffer);
+    encode_value(data, datalen, 24);
+    data[3] = slave->seqno++;
+    data[4] = 0; // OK byte
+
+    buffer = gwbuf_append(buffer, clone);
+    slave->stats.n_bytes += datalen + MYSQL_HEADER_LEN;
+    slave->dcb->func.write(slave->dcb, buffer);
+
+    return true;
 }
 
 /**
@@ -2681,6 +3223,8 @@ bool blr_send_packet(ROUTER_SLAVE *slave, uint8_t *buf, uint32_t len, bool first
  * @param slave Slave where the event is sent to
  * @param hdr   Replication header
  * @param buf   Pointer to the replication event as it was read from the disk
+ * @param event Buffer that contains only the event at @c buf and that can be
+ *              shared with the slave, NULL if the event must be copied
  * @return True on success, false if memory allocation failed
  */
 bool blr_send_event(blr_thread_role_t role,
@@ -2688,7 +3232,8 @@ bool blr_send_event(blr_thread_role_t role,
                     uint32_t binlog_pos,
                     ROUTER_SLAVE *slave,
                     REP_HEADER *hdr,
-                    uint8_t *buf)
+                    uint8_t *buf,
+                    GWBUF *event)
 {
     bool rval = true;
 
@@ -2716,7 +3261,14 @@ bool blr_send_event(blr_thread_role_t role,
     /** Check if the event and the OK byte fit into a single packet  */
     if (hdr->event_size + 1 < MYSQL_PACKET_LENGTH_MAX)
     {
-        rval = blr_send_packet(slave, buf, hdr->event_size, true);
+        if (event && event->next == NULL && GWBUF_LENGTH(event) == hdr->event_size)
+        {
+            rval = blr_send_shared_packet(slave, event);
+        }
+        else
+        {
+            rval = blr_send_packet(slave, buf, hdr->event_size, true);
+        }
     }
     else
     {
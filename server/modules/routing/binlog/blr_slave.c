@@ -99,6 +99,7 @@ static void blr_slave_send_error(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, c
 static int blr_slave_send_timestamp(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave);
 static int blr_slave_register(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, GWBUF *queue);
 static int blr_slave_binlog_dump(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, GWBUF *queue);
+static bool blr_slave_gtid_start(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave);
 int blr_slave_catchup(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, bool large);
 uint8_t *blr_build_header(GWBUF *pkt, REP_HEADER *hdr);
 int blr_slave_callback(DCB *dcb, DCB_REASON reason, void *data);
@@ -110,6 +111,7 @@ static int blr_slave_send_maxscale_variables(ROUTER_INSTANCE *router, ROUTER_SLA
 static int blr_slave_send_master_status(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave);
 static int blr_slave_send_slave_status(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave);
 static int blr_slave_send_slave_hosts(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave);
+static int blr_slave_send_slave_catchup(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave);
 static int blr_slave_send_fieldcount(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, int count);
 static int blr_slave_send_columndef(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, char *name, int type,
                                     int len, uint8_t seqno);
@@ -157,6 +159,8 @@ static int blr_slave_send_columndef_with_status_schema(ROUTER_INSTANCE *router,
                                                        char *name, int type, int len, uint8_t seqno);
 static void blr_send_slave_heartbeat(void *inst);
 static int blr_slave_send_heartbeat(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave);
+static int blr_slave_send_file_events(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, BLFILE *file,
+                                      int *burst, long *burst_size, bool *more);
 
 void poll_fake_write_event(DCB *dcb);
 
@@ -299,13 +303,14 @@ blr_slave_request(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, GWBUF *queue)
  *  SELECT @@[GLOBAL.]server_uuid
  *  SELECT USER()
  *
- * Eight show commands are supported:
+ * Nine show commands are supported:
  *  SHOW [GLOBAL] VARIABLES LIKE 'SERVER_ID'
  *  SHOW [GLOBAL] VARIABLES LIKE 'SERVER_UUID'
  *  SHOW [GLOBAL] VARIABLES LIKE 'MAXSCALE%'
  *  SHOW SLAVE STATUS
  *  SHOW MASTER STATUS
  *  SHOW SLAVE HOSTS
+ *  SHOW SLAVE CATCHUP
  *  SHOW WARNINGS
  *  SHOW [GLOBAL] STATUS LIKE 'Uptime'
  *
@@ -676,6 +681,11 @@ blr_slave_query(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, GWBUF *queue)
                     return blr_slave_send_ok(router, slave);
                 }
             }
+            else if (strcasecmp(word, "CATCHUP") == 0)
+            {
+                free(query_text);
+                return blr_slave_send_slave_catchup(router, slave);
+            }
         }
         else if (strcasecmp(word, "STATUS") == 0)
         {
@@ -792,6 +802,45 @@ blr_slave_query(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, GWBUF *queue)
             free(query_text);
             return blr_slave_replay(router, slave, router->saved_master.setslaveuuid);
         }
+        else if (strcasecmp(word, "@slave_connect_state") == 0)
+        {
+            /* The GTID position of a MariaDB 10 slave, a list of GTIDs separated by commas */
+            char state[BINLOG_ERROR_MSG_LEN + 1] = "";
+            char *state_ptr = state;
+            int len;
+
+            while ((word = strtok_r(NULL, sep, &brkb)) != NULL)
+            {
+                if (*state)
+                {
+                    strncat(state, ",", BINLOG_ERROR_MSG_LEN - strlen(state));
+                }
+                strncat(state, word, BINLOG_ERROR_MSG_LEN - strlen(state));
+            }
+
+            len = strlen(state);
+            if (len && state[len - 1] == '\'')
+            {
+                state[len - 1] = '\0';
+            }
+            if (state[0] == '\'')
+            {
+                state_ptr++;
+            }
+
+            free(slave->connect_state);
+            slave->connect_state = *state_ptr ? strdup(state_ptr) : NULL;
+
+            free(query_text);
+            return blr_slave_send_ok(router, slave);
+        }
+        else if ((strcasecmp(word, "@slave_gtid_strict_mode") == 0) ||
+                 (strcasecmp(word, "@slave_gtid_ignore_duplicates") == 0))
+        {
+            /* return OK */
+            free(query_text);
+            return blr_slave_send_ok(router, slave);
+        }
         else if (strcasecmp(word, "NAMES") == 0)
         {
             if ((word = strtok_r(NULL, sep, &brkb)) == NULL)
@@ -1849,6 +1898,103 @@ blr_slave_send_slave_hosts(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave)
     return blr_slave_send_eof(router, slave, seqno);
 }
 
+/**
+ * Send the catch-up status of the slaves of the router. A row is sent for
+ * each slave that is dumping binlog events with the position of the slave,
+ * how far behind the binlog router it is and the rate it is sent events at.
+ *
+ * @param router    The binlog router instance
+ * @param slave     The connected slave server
+ * @return Non-zero if data was sent
+ */
+static int
+blr_slave_send_slave_catchup(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave)
+{
+    static char *columns[] =
+    {
+        "Server_id", "Host", "Port", "Binlog_file", "Binlog_pos", "Bytes_behind",
+        "Seconds_behind", "Bytes_per_sec", "Deferred_rounds", "Slave_mode"
+    };
+    const int ncolumns = sizeof(columns) / sizeof(columns[0]);
+    char values[sizeof(columns) / sizeof(columns[0])][BINLOG_FNAMELEN + 1];
+    GWBUF *pkt;
+    uint8_t *ptr;
+    int len, seqno, i;
+    ROUTER_SLAVE *sptr;
+
+    blr_slave_send_fieldcount(router, slave, ncolumns);
+    for (i = 0; i < ncolumns; i++)
+    {
+        blr_slave_send_columndef(router, slave, columns[i], BLR_TYPE_STRING, 40, i + 2);
+    }
+    blr_slave_send_eof(router, slave, ncolumns + 2);
+
+    seqno = ncolumns + 3;
+    spinlock_acquire(&router->lock);
+    sptr = router->slaves;
+    while (sptr)
+    {
+        if (sptr->state == BLRS_DUMPING)
+        {
+            uint64_t behind = blr_slave_bytes_behind(router, sptr);
+            unsigned long seconds_behind = 0;
+
+            if (sptr->lastEventTimestamp &&
+                router->lastEventTimestamp > sptr->lastEventTimestamp)
+            {
+                seconds_behind = router->lastEventTimestamp - sptr->lastEventTimestamp;
+            }
+
+            snprintf(values[0], sizeof(values[0]), "%d", sptr->serverid);
+            snprintf(values[1], sizeof(values[1]), "%s", sptr->hostname ? sptr->hostname : "");
+            snprintf(values[2], sizeof(values[2]), "%d", sptr->port);
+            snprintf(values[3], sizeof(values[3]), "%s", sptr->binlogfile);
+            snprintf(values[4], sizeof(values[4]), "%u", sptr->binlog_pos);
+            if (behind == UINT64_MAX)
+            {
+                /** The slave reads an older binlog file */
+                values[5][0] = '\0';
+            }
+            else
+            {
+                snprintf(values[5], sizeof(values[5]), "%lu", (unsigned long)behind);
+            }
+            snprintf(values[6], sizeof(values[6]), "%lu", seconds_behind);
+            snprintf(values[7], sizeof(values[7]), "%lu", sptr->stats.bytes_per_sec);
+            snprintf(values[8], sizeof(values[8]), "%d", sptr->stats.n_throttled);
+            snprintf(values[9], sizeof(values[9]), "%s",
+                     (sptr->cstate & CS_UPTODATE) ? "follow" :
+                     (sptr->cstate & CS_THROTTLED) ? "catchup, deferred" : "catchup");
+
+            len = 4;
+            for (i = 0; i < ncolumns; i++)
+            {
+                len += strlen(values[i]) + 1;
+            }
+
+            if ((pkt = gwbuf_alloc(len)) == NULL)
+            {
+                spinlock_release(&router->lock);
+                return 0;
+            }
+            ptr = GWBUF_DATA(pkt);
+            encode_value(ptr, len - 4, 24);         // Add length of data packet
+            ptr += 3;
+            *ptr++ = seqno++;                       // Sequence number in response
+            for (i = 0; i < ncolumns; i++)
+            {
+                *ptr++ = strlen(values[i]);         // Length of result string
+                memcpy(ptr, values[i], strlen(values[i]));  // Result string
+                ptr += strlen(values[i]);
+            }
+            slave->dcb->func.write(slave->dcb, pkt);
+        }
+        sptr = sptr->next;
+    }
+    spinlock_release(&router->lock);
+    return blr_slave_send_eof(router, slave, seqno);
+}
+
 /**
  * Process a slave replication registration message.
  *
@@ -1916,6 +2062,57 @@ blr_slave_register(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, GWBUF *queue)
     return blr_slave_send_ok(router, slave);
 }
 
+/**
+ * Find the binlog file and position of a slave that registers with the GTID
+ * of the last event group it has, from the index of the binlog files. The
+ * slave starts from the event group that follows it.
+ *
+ * @param   router      The router instance
+ * @param   slave       The slave server
+ * @return  True if the position was set, false if the slave was sent an error
+ */
+static bool
+blr_slave_gtid_start(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave)
+{
+    char err_msg[BINLOG_ERROR_MSG_LEN + 1];
+    unsigned int domain, server_id;
+    unsigned long sequence;
+    uint64_t pos;
+    int n = 0;
+
+    if (sscanf(slave->connect_state, "%u-%u-%lu%n", &domain, &server_id, &sequence, &n) != 3 ||
+        slave->connect_state[n] != '\0')
+    {
+        snprintf(err_msg, BINLOG_ERROR_MSG_LEN, "Connecting with the GTID position '%s' "
+                 "is not supported, only a single GTID is", slave->connect_state);
+    }
+    else if (!blr_index_find_gtid(router, domain, server_id, sequence, slave->binlogfile, &pos))
+    {
+        snprintf(err_msg, BINLOG_ERROR_MSG_LEN, "GTID %s was not found in the binlog index",
+                 slave->connect_state);
+    }
+    else
+    {
+        slave->binlog_pos = pos;
+
+        MXS_NOTICE("%s: Slave %s:%i, server-id %d, registered with GTID %s, "
+                   "starting from binlog '%s' at %lu.",
+                   router->service->name, slave->dcb->remote,
+                   ntohs((slave->dcb->ipv4).sin_port), slave->serverid,
+                   slave->connect_state, slave->binlogfile,
+                   (unsigned long)slave->binlog_pos);
+        return true;
+    }
+
+    MXS_ERROR("%s: Slave %s:%i, server-id %d: %s.",
+              router->service->name, slave->dcb->remote,
+              ntohs((slave->dcb->ipv4).sin_port), slave->serverid, err_msg);
+
+    blr_send_custom_error(slave->dcb, 1, 0, err_msg, "HY000", 1236);
+
+    return false;
+}
+
 /**
  * Process a COM_BINLOG_DUMP message from the slave. This is the
  * final step in the process of registration. The new master, MaxScale
@@ -1964,6 +2161,17 @@ blr_slave_binlog_dump(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, GWBUF *queue
     strncpy(slave->binlogfile, (char *)ptr, binlognamelen);
     slave->binlogfile[binlognamelen] = 0;
 
+    /* A MariaDB 10 slave that uses its GTID sends no binlog file */
+    if (slave->binlogfile[0] == '\0' && slave->connect_state)
+    {
+        if (!blr_slave_gtid_start(router, slave))
+        {
+            dcb_close(slave->dcb);
+            return 1;
+        }
+        binlognamelen = strlen(slave->binlogfile);
+    }
+
     if (router->trx_safe)
     {
         /**
@@ -2049,8 +2257,8 @@ blr_slave_binlog_dump(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, GWBUF *queue
          * include the length, sequence number and ok byte that makes up the first
          * 5 bytes of the message. We also do not include the 4 byte checksum itself.
          */
-        chksum = crc32(0L, NULL, 0);
-        chksum = crc32(chksum, GWBUF_DATA(resp) + 5, hdr.event_size - 4);
+        chksum = mxs_crc32(0, NULL, 0);
+        chksum = mxs_crc32(chksum, GWBUF_DATA(resp) + 5, hdr.event_size - 4);
         encode_value(ptr, chksum, 32);
     }
 
@@ -2152,6 +2360,127 @@ blr_build_header(GWBUF  *pkt, REP_HEADER *hdr)
     return ptr;
 }
 
+/**
+ * Get the number of bytes a slave is behind the binlog router
+ *
+ * @param router    The binlog router
+ * @param slave     The slave
+ * @return The number of bytes from the slave position to the safe position of
+ *         the current binlog file, UINT64_MAX if the slave reads an older file
+ */
+uint64_t
+blr_slave_bytes_behind(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave)
+{
+    uint64_t behind = UINT64_MAX;
+
+    spinlock_acquire(&router->binlog_lock);
+    if (strcmp(router->binlog_name, slave->binlogfile) == 0)
+    {
+        behind = router->binlog_position > slave->binlog_pos ?
+                 router->binlog_position - slave->binlog_pos : 0;
+    }
+    spinlock_release(&router->binlog_lock);
+
+    return behind;
+}
+
+/**
+ * Take bytes for a catch-up round from the catch-up bandwidth of the router.
+ * The bandwidth is refilled at catchup_bandwidth bytes per second and at most
+ * one second, or one burst if that is larger, is saved up while it is not used.
+ *
+ * @param router    The binlog router
+ * @param wanted    The number of bytes the round would send
+ * @return The number of bytes the round may send, 0 if it must wait
+ */
+static long
+blr_slave_catchup_budget(ROUTER_INSTANCE *router, long wanted)
+{
+    struct timespec ts;
+    uint64_t now;
+    long max_tokens;
+    long granted = 0;
+
+    if (router->catchup_bandwidth == 0)
+    {
+        return wanted;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    max_tokens = MAX(router->catchup_bandwidth, router->burst_size);
+
+    spinlock_acquire(&router->catchup_lock);
+    if (now > router->catchup_refill)
+    {
+        router->catchup_tokens += MIN((now - router->catchup_refill) * router->catchup_bandwidth / 1000,
+                                      (uint64_t)max_tokens);
+        router->catchup_tokens = MIN(router->catchup_tokens, max_tokens);
+        router->catchup_refill = now;
+    }
+
+    if (router->catchup_tokens > 0)
+    {
+        granted = MIN(wanted, router->catchup_tokens);
+        router->catchup_tokens -= granted;
+    }
+    spinlock_release(&router->catchup_lock);
+
+    return granted;
+}
+
+/**
+ * Settle the catch-up bandwidth after a round. Bytes that were taken but not
+ * sent are given back and bytes sent beyond the budget are charged.
+ *
+ * @param router    The binlog router
+ * @param delta     The bytes to give back, negative to charge bytes
+ */
+static void
+blr_slave_catchup_settle(ROUTER_INSTANCE *router, long delta)
+{
+    if (router->catchup_bandwidth && delta)
+    {
+        spinlock_acquire(&router->catchup_lock);
+        router->catchup_tokens += delta;
+        spinlock_release(&router->catchup_lock);
+    }
+}
+
+/**
+ * Resume the catch-up of the slaves that were deferred because the catch-up
+ * bandwidth of the router was used up. Called periodically by the housekeeper.
+ *
+ * @param inst      The binlog router
+ */
+void
+blr_slave_catchup_wakeup(void *inst)
+{
+    ROUTER_INSTANCE *router = (ROUTER_INSTANCE *)inst;
+    ROUTER_SLAVE *slave;
+
+    spinlock_acquire(&router->lock);
+    for (slave = router->slaves; slave; slave = slave->next)
+    {
+        bool throttled;
+
+        spinlock_acquire(&slave->catch_lock);
+        throttled = (slave->cstate & CS_THROTTLED) != 0;
+        if (throttled)
+        {
+            slave->cstate &= ~CS_THROTTLED;
+            slave->cstate |= CS_EXPECTCB;
+        }
+        spinlock_release(&slave->catch_lock);
+
+        if (throttled && slave->state == BLRS_DUMPING)
+        {
+            poll_fake_write_event(slave->dcb);
+        }
+    }
+    spinlock_release(&router->lock);
+}
+
 /**
  * We have a registered slave that is behind the current leading edge of the
  * binlog. We must replay the log entries to bring this node up to speed.
@@ -2173,6 +2502,13 @@ blr_build_header(GWBUF  *pkt, REP_HEADER *hdr)
  * queue. This ensures that the slave callback for processing DCB write drain
  * will be called and future catchup requests will be handled on another thread.
  *
+ * A slave that is more than catchup_near bytes behind is lagging. Its bursts
+ * are limited to lagging_burstsize bytes so that it can not hold a thread and
+ * the disk for long, and the bytes are taken from the catch-up bandwidth of
+ * the router. When the bandwidth is used up the slave is deferred until the
+ * housekeeper refills it. The slaves close to the head are never deferred,
+ * but what they send is charged to the bandwidth.
+ *
  * @param   router      The binlog router
  * @param   slave       The slave that is behind
  * @param   large       Send a long or short burst of events
@@ -2201,6 +2537,26 @@ blr_slave_catchup(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, bool large)
 
     burst_size = router->burst_size;
 
+    bool lagging = blr_slave_bytes_behind(router, slave) > router->catchup_near;
+    long granted;
+
+    if (lagging)
+    {
+        burst_size = MIN(burst_size, (long)router->lagging_burst_size);
+        if ((burst_size = blr_slave_catchup_budget(router, burst_size)) == 0)
+        {
+            spinlock_acquire(&slave->catch_lock);
+            slave->cstate &= ~CS_BUSY;
+            slave->cstate |= CS_THROTTLED;
+            spinlock_release(&slave->catch_lock);
+            slave->stats.n_throttled++;
+            router->stats.n_throttled++;
+            return 0;
+        }
+    }
+
+    granted = burst_size;
+
     int do_return;
 
     spinlock_acquire(&router->binlog_lock);
@@ -2218,6 +2574,10 @@ blr_slave_catchup(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, bool large)
 
     if (do_return)
     {
+        if (lagging)
+        {
+            blr_slave_catchup_settle(router, granted);
+        }
         spinlock_acquire(&slave->catch_lock);
         slave->cstate &= ~CS_BUSY;
         slave->cstate |= CS_EXPECTCB;
@@ -2276,8 +2636,28 @@ blr_slave_catchup(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, bool large)
     slave->file = file;
 #endif
     int events_before = slave->stats.n_events;
+    bool more = false;
 
-    while (burst-- && burst_size > 0 &&
+    if (blr_slave_send_file_events(router, slave, file, &burst, &burst_size, &more) < 0)
+    {
+        MXS_WARNING("Slave %s:%i, server-id %d, binlog '%s, position %u: "
+                    "Slave-thread could not send events to slave, closing connection.",
+                    slave->dcb->remote,
+                    ntohs((slave->dcb->ipv4).sin_port),
+                    slave->serverid,
+                    slave->binlogfile,
+                    slave->binlog_pos);
+#ifndef BLFILE_IN_SLAVE
+        blr_close_binlog(router, file);
+#endif
+        slave->state = BLRS_ERRORED;
+        dcb_close(slave->dcb);
+        return 0;
+    }
+
+    record = NULL;
+
+    while (!more && burst-- > 0 && burst_size > 0 &&
            (record = blr_read_binlog(router, file, slave->binlog_pos, &hdr, read_errmsg)) != NULL)
     {
         char binlog_name[BINLOG_FNAMELEN + 1];
@@ -2341,7 +2721,7 @@ blr_slave_catchup(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, bool large)
         }
 
         if (blr_send_event(BLR_THREAD_ROLE_SLAVE, binlog_name, binlog_pos,
-                           slave, &hdr, (uint8_t*) record->start))
+                           slave, &hdr, (uint8_t*) record->start, record))
         {
             if (hdr.event_type != ROTATE_EVENT)
             {
@@ -2376,7 +2756,11 @@ blr_slave_catchup(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, bool large)
             slave->lastReply = time(0);
         }
     }
-    if (record == NULL)
+
+    /** Give back what a lagging slave did not use, charge what the others sent */
+    blr_slave_catchup_settle(router, lagging ? burst_size : burst_size - granted);
+
+    if (record == NULL && !more)
     {
         slave->stats.n_failed_read++;
 
@@ -2460,7 +2844,7 @@ blr_slave_catchup(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, bool large)
     slave->cstate &= ~CS_BUSY;
     spinlock_release(&slave->catch_lock);
 
-    if (record)
+    if (record || more)
     {
         slave->stats.n_flows++;
         spinlock_acquire(&slave->catch_lock);
@@ -2690,6 +3074,136 @@ blr_slave_callback(DCB *dcb, DCB_REASON reason, void *data)
     return 0;
 }
 
+/**
+ * Send a run of events to a slave that is far behind the master straight from
+ * the binlog file. Only the packet headers are built in memory, the events are
+ * sent with sendfile() without copying them through user space.
+ *
+ * Only whole events that are safe to send and fit into one packet are sent in
+ * this way. The run ends at the first event that is not, such as a rotate
+ * event, when the slave gets close to the end of the current binlog file or
+ * when the socket blocks. The normal catchup then continues from the position
+ * the slave was left at. Slaves that use the compressed protocol are always
+ * sent the events normally.
+ *
+ * @param router        The router instance
+ * @param slave         The slave
+ * @param file          The binlog file the slave is reading
+ * @param burst         Number of events that may still be sent in this burst
+ * @param burst_size    Number of bytes that may still be sent in this burst
+ * @param more          Set to true if the run ended with more data to send
+ * @return Number of events sent, -1 if sending failed
+ */
+static int
+blr_slave_send_file_events(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, BLFILE *file,
+                           int *burst, long *burst_size, bool *more)
+{
+    uint8_t hdbuf[BINLOG_EVENT_HDR_LEN];
+    uint8_t head[MYSQL_HEADER_LEN + 1];
+    uint64_t end_pos;
+    struct stat statb;
+    int n_events = 0;
+
+    *more = false;
+
+    /** The compressed protocol must see the packets and they are sent with func.write */
+    if (!router->bulk_catchup || (slave->dcb->ssl && !slave->dcb->ssl_ktls_send) ||
+        ((MySQLProtocol *)slave->dcb->protocol)->compress ||
+        file->zfile || fstat(file->fd, &statb) != 0)
+    {
+        return 0;
+    }
+
+    /**
+     * Only the committed part of the current binlog file can be sent and the
+     * last burst before it is streamed normally so that the slave can become
+     * up to date.
+     */
+    spinlock_acquire(&router->binlog_lock);
+    if (strcmp(router->binlog_name, file->binlogname) == 0)
+    {
+        end_pos = router->binlog_position > router->burst_size ?
+                  router->binlog_position - router->burst_size : 0;
+    }
+    else
+    {
+        end_pos = statb.st_size;
+    }
+    spinlock_release(&router->binlog_lock);
+
+    if (end_pos > statb.st_size)
+    {
+        end_pos = statb.st_size;
+    }
+
+    while (*burst > 0 && *burst_size > 0)
+    {
+        uint32_t pos = slave->binlog_pos;
+        uint32_t event_size;
+        uint32_t next_pos;
+        uint8_t event_type;
+        bool blocked;
+
+        if (pread(file->fd, hdbuf, BINLOG_EVENT_HDR_LEN, pos) != BINLOG_EVENT_HDR_LEN)
+        {
+            break;
+        }
+
+        event_type = hdbuf[4];
+        event_size = extract_field(&hdbuf[9], 32);
+        next_pos = EXTRACT32(&hdbuf[13]);
+
+        if (event_type == ROTATE_EVENT ||
+            event_type > (router->mariadb10_compat ? MAX_EVENT_TYPE_MARIADB10 : MAX_EVENT_TYPE) ||
+            event_size < BINLOG_EVENT_HDR_LEN || next_pos != pos + event_size ||
+            next_pos > end_pos || event_size + 1 >= MYSQL_PACKET_LENGTH_MAX)
+        {
+            /** Left to the normal catchup which handles and reports these */
+            break;
+        }
+
+        encode_value(head, event_size + 1, 24);
+        head[3] = slave->seqno;
+        head[4] = 0; // OK byte
+
+        int rc = dcb_sendfile(slave->dcb, head, sizeof(head), file->fd, pos, event_size, &blocked);
+
+        if (rc == 0)
+        {
+            break;
+        }
+        else if (rc < 0)
+        {
+            return -1;
+        }
+
+        slave->seqno++;
+        slave->binlog_pos = next_pos;
+        slave->lastEventTimestamp = EXTRACT32(hdbuf);
+        slave->lastEventReceived = event_type;
+        strcpy(slave->lsi_binlog_name, file->binlogname);
+        slave->lsi_binlog_pos = pos;
+        slave->lsi_sender_role = BLR_THREAD_ROLE_SLAVE;
+        slave->lsi_sender_tid = thread_self();
+        slave->stats.n_events++;
+        slave->stats.n_bytes += sizeof(head) + event_size;
+        slave->stats.n_sendfile++;
+        n_events++;
+        (*burst)--;
+        *burst_size -= event_size;
+
+        if (blocked)
+        {
+            break;
+        }
+    }
+
+    /** The socket blocked or the burst ended, the rest is sent on the next callback */
+    *more = n_events > 0 && (*burst <= 0 || *burst_size <= 0 || slave->dcb->writeq);
+
+    return n_events;
+}
+
 /**
  * Rotate the slave to the new binlog file
  *
@@ -2785,8 +3299,8 @@ blr_slave_fake_rotate(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, BLFILE** fil
          * include the length, sequence number and ok byte that makes up the first
          * 5 bytes of the message. We also do not include the 4 byte checksum itself.
          */
-        chksum = crc32(0L, NULL, 0);
-        chksum = crc32(chksum, GWBUF_DATA(resp) + 5, hdr.event_size - 4);
+        chksum = mxs_crc32(0, NULL, 0);
+        chksum = mxs_crc32(chksum, GWBUF_DATA(resp) + 5, hdr.event_size - 4);
         encode_value(ptr, chksum, 32);
     }
 
@@ -2853,8 +3367,8 @@ blr_slave_send_fde(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave)
      * and write it into the header
      */
     ptr = GWBUF_DATA(record) + hdr.event_size - 4;
-    chksum = crc32(0L, NULL, 0);
-    chksum = crc32(chksum, GWBUF_DATA(record), hdr.event_size - 4);
+    chksum = mxs_crc32(0, NULL, 0);
+    chksum = mxs_crc32(chksum, GWBUF_DATA(record), hdr.event_size - 4);
     encode_value(ptr, chksum, 32);
 
     slave->dcb->func.write(slave->dcb, head);
@@ -3785,6 +4299,9 @@ int blr_handle_change_master(ROUTER_INSTANCE* router, char *command, char *error
         }
         else
         {
+            /* write out what is buffered for the current binlog file */
+            blr_file_flush_buffer(router);
+
             /* set new filename at pos 4 */
             memset(router->binlog_name, '\0', sizeof(router->binlog_name));
             strncpy(router->binlog_name, master_logfile, BINLOG_FNAMELEN);
@@ -5430,8 +5947,8 @@ blr_slave_send_heartbeat(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave)
     /* Add the CRC32 */
     if (!slave->nocrc)
     {
-        chksum = crc32(0L, NULL, 0);
-        chksum = crc32(chksum, GWBUF_DATA(resp) + 5, hdr.event_size - 4);
+        chksum = mxs_crc32(0, NULL, 0);
+        chksum = mxs_crc32(chksum, GWBUF_DATA(resp) + 5, hdr.event_size - 4);
         encode_value(ptr, chksum, 32);
     }
 
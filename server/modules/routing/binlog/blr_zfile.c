@@ -0,0 +1,429 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file blr_zfile.c - Compressed binlog files
+ *
+ * A binlog file that is no longer written is compressed into a file with the
+ * same name and the BLR_ZFILE_SUFFIX suffix and the original file is removed.
+ * The file is split into chunks of BLR_ZCHUNK_SIZE bytes that are compressed
+ * separately with zlib, so that an event is read by decompressing only the
+ * chunks it is in. The compressed chunks are followed by an index that gives
+ * the offset and the length of each chunk and by a trailer:
+ *
+ * @verbatim
+ * chunk 0 .. chunk n-1
+ * index:   n x { offset (8 bytes), length (4 bytes) }
+ * trailer: file size (8 bytes), chunk size (4 bytes), number of chunks (4 bytes),
+ *          version (4 bytes), magic (4 bytes)
+ * @endverbatim
+ *
+ * All numbers are little-endian. The positions in the file are those of the
+ * original binlog file, so slaves and the GTID index are not affected.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <blr.h>
+#include <thread.h>
+#include <log_manager.h>
+
+#define BLR_ZFILE_MAGIC       0x425a584d /*< "MXZB" */
+#define BLR_ZFILE_VERSION     1
+#define BLR_ZFILE_TRAILER_LEN 24
+#define BLR_ZFILE_ENTRY_LEN   12
+
+struct blr_zfile
+{
+    int         fd;         /*< The compressed file */
+    uint64_t    size;       /*< Size of the original file */
+    uint32_t    chunk_size; /*< Bytes of the original file in a chunk */
+    uint32_t    n_chunks;   /*< Number of chunks */
+    uint64_t    *offsets;   /*< Offsets of the chunks, n_chunks + 1 entries */
+    SPINLOCK    lock;       /*< Protects the decompressed chunk */
+    uint8_t     *chunk;     /*< The last decompressed chunk */
+    uint32_t    chunk_no;   /*< Number of the chunk in chunk */
+    uint32_t    chunk_len;  /*< Length of the chunk in chunk, 0 if none */
+    uint8_t     *zbuf;      /*< Buffer for a compressed chunk */
+};
+
+/** A binlog file waiting for the compression thread */
+typedef struct
+{
+    ROUTER_INSTANCE *router;
+    char            binlog[BINLOG_FNAMELEN + 1];
+} BLR_ZFILE_TASK;
+
+static void blr_zfile_put32(uint8_t *ptr, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        ptr[i] = value >> (8 * i);
+    }
+}
+
+static void blr_zfile_put64(uint8_t *ptr, uint64_t value)
+{
+    blr_zfile_put32(ptr, value);
+    blr_zfile_put32(ptr + 4, value >> 32);
+}
+
+static uint32_t blr_zfile_get32(const uint8_t *ptr)
+{
+    return ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((uint32_t)ptr[3] << 24);
+}
+
+static uint64_t blr_zfile_get64(const uint8_t *ptr)
+{
+    return blr_zfile_get32(ptr) | ((uint64_t)blr_zfile_get32(ptr + 4) << 32);
+}
+
+static bool blr_zfile_write(int fd, const uint8_t *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        else if (n <= 0)
+        {
+            return false;
+        }
+
+        buf += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+/**
+ * Compress a binlog file. The compressed file is written under a temporary
+ * name and renamed when it is complete, only then is the original removed.
+ * Readers that have the original open can read it until they close it.
+ *
+ * @param router    The router instance
+ * @param binlog    The name of the binlog file
+ * @return True if the file was compressed
+ */
+bool
+blr_zfile_compress(ROUTER_INSTANCE *router, const char *binlog)
+{
+    char path[PATH_MAX + 1];
+    char zpath[PATH_MAX + 1];
+    char tmppath[PATH_MAX + 1];
+    char err_msg[STRERROR_BUFLEN];
+    uLong zsize = compressBound(BLR_ZCHUNK_SIZE);
+    uint8_t *chunk = malloc(BLR_ZCHUNK_SIZE);
+    uint8_t *zbuf = malloc(zsize);
+    uint8_t *index = NULL;
+    struct stat statb;
+    bool ok = false;
+    int fd = -1, zfd = -1;
+
+    snprintf(path, sizeof(path), "%s/%s", router->binlogdir, binlog);
+    snprintf(zpath, sizeof(zpath), "%s%s", path, BLR_ZFILE_SUFFIX);
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", zpath);
+
+    if (chunk == NULL || zbuf == NULL ||
+        (fd = open(path, O_RDONLY)) == -1 || fstat(fd, &statb) == -1 ||
+        (zfd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1)
+    {
+        MXS_ERROR("%s: Failed to open binlog file %s for compression, %s.",
+                  router->service->name, binlog, strerror_r(errno, err_msg, sizeof(err_msg)));
+        goto done;
+    }
+
+    uint32_t n_chunks = (statb.st_size + BLR_ZCHUNK_SIZE - 1) / BLR_ZCHUNK_SIZE;
+    uint64_t offset = 0;
+
+    if ((index = malloc((size_t)n_chunks * BLR_ZFILE_ENTRY_LEN + BLR_ZFILE_TRAILER_LEN)) == NULL)
+    {
+        goto done;
+    }
+
+    for (uint32_t i = 0; i < n_chunks; i++)
+    {
+        ssize_t len = pread(fd, chunk, BLR_ZCHUNK_SIZE, (off_t)i * BLR_ZCHUNK_SIZE);
+        uLong zlen = zsize;
+
+        if (len <= 0 || (i < n_chunks - 1 && len != BLR_ZCHUNK_SIZE))
+        {
+            MXS_ERROR("%s: Failed to read binlog file %s for compression at %lu.",
+                      router->service->name, binlog, (unsigned long)i * BLR_ZCHUNK_SIZE);
+            goto done;
+        }
+
+        if (compress2(zbuf, &zlen, chunk, len, Z_DEFAULT_COMPRESSION) != Z_OK ||
+            !blr_zfile_write(zfd, zbuf, zlen))
+        {
+            MXS_ERROR("%s: Failed to write the compressed binlog file %s, %s.",
+                      router->service->name, tmppath, strerror_r(errno, err_msg, sizeof(err_msg)));
+            goto done;
+        }
+
+        blr_zfile_put64(index + i * BLR_ZFILE_ENTRY_LEN, offset);
+        blr_zfile_put32(index + i * BLR_ZFILE_ENTRY_LEN + 8, zlen);
+        offset += zlen;
+    }
+
+    uint8_t *trailer = index + (size_t)n_chunks * BLR_ZFILE_ENTRY_LEN;
+    blr_zfile_put64(trailer, statb.st_size);
+    blr_zfile_put32(trailer + 8, BLR_ZCHUNK_SIZE);
+    blr_zfile_put32(trailer + 12, n_chunks);
+    blr_zfile_put32(trailer + 16, BLR_ZFILE_VERSION);
+    blr_zfile_put32(trailer + 20, BLR_ZFILE_MAGIC);
+
+    if (!blr_zfile_write(zfd, index, (size_t)n_chunks * BLR_ZFILE_ENTRY_LEN + BLR_ZFILE_TRAILER_LEN) ||
+        fsync(zfd) == -1 || rename(tmppath, zpath) == -1)
+    {
+        MXS_ERROR("%s: Failed to write the compressed binlog file %s, %s.",
+                  router->service->name, tmppath, strerror_r(errno, err_msg, sizeof(err_msg)));
+        goto done;
+    }
+
+    if (unlink(path) == -1)
+    {
+        MXS_ERROR("%s: Failed to remove binlog file %s after it was compressed, %s.",
+                  router->service->name, path, strerror_r(errno, err_msg, sizeof(err_msg)));
+    }
+
+    MXS_NOTICE("%s: Compressed binlog file %s from %lu to %lu bytes.",
+               router->service->name, binlog, (unsigned long)statb.st_size,
+               (unsigned long)(offset + n_chunks * BLR_ZFILE_ENTRY_LEN + BLR_ZFILE_TRAILER_LEN));
+    ok = true;
+
+done:
+    if (zfd != -1)
+    {
+        close(zfd);
+        if (!ok)
+        {
+            unlink(tmppath);
+        }
+    }
+    if (fd != -1)
+    {
+        /** The compressed file is seldom read, leave the page cache to the current one */
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+    free(index);
+    free(zbuf);
+    free(chunk);
+
+    return ok;
+}
+
+static void
+blr_zfile_compress_thread(void *data)
+{
+    BLR_ZFILE_TASK *task = (BLR_ZFILE_TASK *)data;
+    blr_zfile_compress(task->router, task->binlog);
+    free(task);
+}
+
+/**
+ * Compress a binlog file in a separate thread
+ *
+ * @param router    The router instance
+ * @param binlog    The name of the binlog file
+ */
+void
+blr_zfile_compress_async(ROUTER_INSTANCE *router, const char *binlog)
+{
+    BLR_ZFILE_TASK *task = malloc(sizeof(BLR_ZFILE_TASK));
+    THREAD thr;
+
+    if (task == NULL)
+    {
+        return;
+    }
+
+    task->router = router;
+    strncpy(task->binlog, binlog, BINLOG_FNAMELEN);
+    task->binlog[BINLOG_FNAMELEN] = '\0';
+
+    if (thread_start(&thr, blr_zfile_compress_thread, task) == NULL)
+    {
+        MXS_ERROR("%s: Failed to start a thread to compress binlog file %s.",
+                  router->service->name, binlog);
+        free(task);
+    }
+}
+
+/**
+ * Open a compressed binlog file for reading. The index of the chunks is read
+ * into memory.
+ *
+ * @param fd    The compressed file, owned by the returned object
+ * @return The compressed file or NULL if the file is not valid
+ */
+BLR_ZFILE *
+blr_zfile_open(int fd)
+{
+    uint8_t trailer[BLR_ZFILE_TRAILER_LEN];
+    BLR_ZFILE *zf;
+    uint8_t *index;
+    struct stat statb;
+
+    if (fstat(fd, &statb) == -1 || statb.st_size < BLR_ZFILE_TRAILER_LEN ||
+        pread(fd, trailer, sizeof(trailer), statb.st_size - sizeof(trailer)) != sizeof(trailer) ||
+        blr_zfile_get32(trailer + 20) != BLR_ZFILE_MAGIC ||
+        blr_zfile_get32(trailer + 16) != BLR_ZFILE_VERSION ||
+        (zf = calloc(1, sizeof(BLR_ZFILE))) == NULL)
+    {
+        return NULL;
+    }
+
+    zf->fd = fd;
+    zf->size = blr_zfile_get64(trailer);
+    zf->chunk_size = blr_zfile_get32(trailer + 8);
+    zf->n_chunks = blr_zfile_get32(trailer + 12);
+    spinlock_init(&zf->lock);
+
+    size_t index_len = (size_t)zf->n_chunks * BLR_ZFILE_ENTRY_LEN;
+    uint64_t index_pos = statb.st_size - BLR_ZFILE_TRAILER_LEN - index_len;
+
+    if (zf->chunk_size == 0 || index_len + BLR_ZFILE_TRAILER_LEN > statb.st_size ||
+        (uint64_t)zf->n_chunks * zf->chunk_size < zf->size ||
+        (index = malloc(index_len ? index_len : 1)) == NULL ||
+        (zf->offsets = malloc((zf->n_chunks + 1) * sizeof(uint64_t))) == NULL ||
+        (zf->chunk = malloc(zf->chunk_size)) == NULL ||
+        (zf->zbuf = malloc(compressBound(zf->chunk_size))) == NULL ||
+        pread(fd, index, index_len, index_pos) != index_len)
+    {
+        free(index);
+        free(zf->offsets);
+        free(zf->chunk);
+        free(zf->zbuf);
+        free(zf);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < zf->n_chunks; i++)
+    {
+        zf->offsets[i] = blr_zfile_get64(index + i * BLR_ZFILE_ENTRY_LEN);
+    }
+    zf->offsets[zf->n_chunks] = index_pos;
+    free(index);
+
+    return zf;
+}
+
+/**
+ * Close a compressed binlog file
+ *
+ * @param zf    The compressed file
+ */
+void
+blr_zfile_close(BLR_ZFILE *zf)
+{
+    close(zf->fd);
+    free(zf->offsets);
+    free(zf->chunk);
+    free(zf->zbuf);
+    free(zf);
+}
+
+/**
+ * Get the size of the original binlog file
+ *
+ * @param zf    The compressed file
+ * @return The size of the file before it was compressed
+ */
+uint64_t
+blr_zfile_size(BLR_ZFILE *zf)
+{
+    return zf->size;
+}
+
+/**
+ * Decompress a chunk, the caller holds the lock
+ */
+static bool
+blr_zfile_load(BLR_ZFILE *zf, uint32_t chunk_no)
+{
+    uint64_t start = zf->offsets[chunk_no];
+    size_t zlen = zf->offsets[chunk_no + 1] - start;
+    uLong len = zf->chunk_size;
+
+    zf->chunk_len = 0;
+
+    if (zlen > compressBound(zf->chunk_size) ||
+        pread(zf->fd, zf->zbuf, zlen, start) != zlen ||
+        uncompress(zf->chunk, &len, zf->zbuf, zlen) != Z_OK)
+    {
+        return false;
+    }
+
+    zf->chunk_no = chunk_no;
+    zf->chunk_len = len;
+    return true;
+}
+
+/**
+ * Read data of the original binlog file from a compressed file
+ *
+ * @param zf    The compressed file
+ * @param dest  Where the data is stored
+ * @param n     Number of bytes to read
+ * @param pos   Position in the original file
+ * @return Number of bytes read, less than @c n at the end of the file, or -1
+ *         with errno set to EIO if the compressed data is not valid
+ */
+ssize_t
+blr_zfile_pread(BLR_ZFILE *zf, void *dest, size_t n, uint64_t pos)
+{
+    uint8_t *ptr = dest;
+    size_t done = 0;
+
+    spinlock_acquire(&zf->lock);
+
+    while (done < n && pos < zf->size)
+    {
+        uint32_t chunk_no = pos / zf->chunk_size;
+
+        if ((zf->chunk_len == 0 || zf->chunk_no != chunk_no) && !blr_zfile_load(zf, chunk_no))
+        {
+            spinlock_release(&zf->lock);
+            errno = EIO;
+            return -1;
+        }
+
+        size_t offset = pos - (uint64_t)chunk_no * zf->chunk_size;
+
+        if (offset >= zf->chunk_len)
+        {
+            break;
+        }
+
+        size_t len = MIN(zf->chunk_len - offset, n - done);
+        memcpy(ptr + done, zf->chunk + offset, len);
+        done += len;
+        pos += len;
+    }
+
+    spinlock_release(&zf->lock);
+
+    return done;
+}
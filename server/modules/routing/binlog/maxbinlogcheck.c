@@ -60,7 +60,7 @@
 #include <version.h>
 #include <gwdirs.h>
 
-extern int blr_read_events_all_events(ROUTER_INSTANCE *router, int fix, int debug);
+extern int blr_read_events_all_events(ROUTER_INSTANCE *router, uint64_t start_pos, int fix, int debug);
 extern uint32_t extract_field(uint8_t *src, int bits);
 static void printVersion(const char *progname);
 static void printUsage(const char *progname);
@@ -195,7 +195,7 @@ int main(int argc, char **argv)
     MXS_NOTICE("Checking %s (%s), size %lu bytes", path, inst->binlog_name, filelen);
 
     /* read binary log */
-    ret = blr_read_events_all_events(inst, fix_file, debug_out);
+    ret = blr_read_events_all_events(inst, 4, fix_file, debug_out);
 
     close(inst->binlog_fd);
 
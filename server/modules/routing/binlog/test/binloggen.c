@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file binloggen.c Generation of MariaDB 10 binlog files for the benchmarks
+ */
+
+#include "binloggen.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+#include <blr_constants.h>
+
+#define GEN_SERVER_ID     1
+#define GEN_TABLE_ID      1
+#define GEN_DATABASE      "test"
+#define GEN_TABLE         "t1"
+#define GEN_VARCHAR_LEN   64
+#define GEN_N_EVENT_TYPES 163
+
+/** Row event flag that marks the last row event of a statement */
+#define GEN_STMT_END_F    1
+
+typedef struct
+{
+    FILE     *file;
+    uint32_t pos;        /*< Position of the next event */
+    uint32_t timestamp;
+    bool     checksum;
+    uint8_t  *buf;       /*< Buffer for the events */
+    size_t   size;       /*< Size of the buffer */
+} BINLOG_GEN;
+
+static uint8_t *put16(uint8_t *ptr, uint16_t value)
+{
+    ptr[0] = value;
+    ptr[1] = value >> 8;
+    return ptr + 2;
+}
+
+static uint8_t *put32(uint8_t *ptr, uint32_t value)
+{
+    ptr = put16(ptr, value);
+    return put16(ptr, value >> 16);
+}
+
+static uint8_t *put48(uint8_t *ptr, uint64_t value)
+{
+    ptr = put32(ptr, value);
+    return put16(ptr, value >> 32);
+}
+
+static uint8_t *put64(uint8_t *ptr, uint64_t value)
+{
+    ptr = put32(ptr, value);
+    return put32(ptr, value >> 32);
+}
+
+/**
+ * Reserve space for an event in the buffer of the generator
+ *
+ * @param gen     The generator
+ * @param bodylen Length of the event without the header and the checksum
+ * @return Pointer to the start of the event body or NULL on memory allocation failure
+ */
+static uint8_t *gen_reserve(BINLOG_GEN *gen, size_t bodylen)
+{
+    size_t needed = BINLOG_EVENT_HDR_LEN + bodylen + 4;
+
+    if (needed > gen->size)
+    {
+        uint8_t *buf = realloc(gen->buf, needed);
+
+        if (buf == NULL)
+        {
+            return NULL;
+        }
+        gen->buf = buf;
+        gen->size = needed;
+    }
+
+    return gen->buf + BINLOG_EVENT_HDR_LEN;
+}
+
+/**
+ * Write an event whose body is in the buffer of the generator
+ *
+ * The format description event always has the checksum field, the
+ * other events have it only if checksums are enabled.
+ *
+ * @param gen     The generator
+ * @param type    Event type
+ * @param bodylen Length of the event body
+ * @return True on success
+ */
+static bool gen_write(BINLOG_GEN *gen, uint8_t type, size_t bodylen)
+{
+    bool crc = gen->checksum || type == FORMAT_DESCRIPTION_EVENT;
+    uint32_t size = BINLOG_EVENT_HDR_LEN + bodylen + (crc ? 4 : 0);
+    uint8_t *ptr = gen->buf;
+
+    ptr = put32(ptr, gen->timestamp);
+    *ptr++ = type;
+    ptr = put32(ptr, GEN_SERVER_ID);
+    ptr = put32(ptr, size);
+    ptr = put32(ptr, gen->pos + size);
+    ptr = put16(ptr, 0);
+
+    if (crc)
+    {
+        put32(gen->buf + size - 4, crc32(crc32(0L, NULL, 0), gen->buf, size - 4));
+    }
+
+    gen->pos += size;
+    return fwrite(gen->buf, 1, size, gen->file) == size;
+}
+
+static bool gen_format_description(BINLOG_GEN *gen)
+{
+    uint8_t *body = gen_reserve(gen, 2 + 50 + 4 + 1 + GEN_N_EVENT_TYPES + 1);
+
+    if (body == NULL)
+    {
+        return false;
+    }
+
+    uint8_t *ptr = put16(body, 4);
+    memset(ptr, 0, 50);
+    strcpy((char*)ptr, "10.0.99-MariaDB-bench");
+    ptr += 50;
+    ptr = put32(ptr, gen->timestamp);
+    *ptr++ = BINLOG_EVENT_HDR_LEN;
+
+    /** The post-header lengths of the event types starting from type 1 */
+    uint8_t *lens = ptr;
+    memset(lens, 0, GEN_N_EVENT_TYPES);
+    lens[START_EVENT_V3 - 1] = 56;
+    lens[QUERY_EVENT - 1] = 13;
+    lens[ROTATE_EVENT - 1] = 8;
+    lens[LOAD_EVENT - 1] = 18;
+    lens[CREATE_FILE_EVENT - 1] = 4;
+    lens[APPEND_BLOCK_EVENT - 1] = 4;
+    lens[EXEC_LOAD_EVENT - 1] = 4;
+    lens[DELETE_FILE_EVENT - 1] = 4;
+    lens[NEW_LOAD_EVENT - 1] = 18;
+    lens[FORMAT_DESCRIPTION_EVENT - 1] = 84;
+    lens[BEGIN_LOAD_QUERY_EVENT - 1] = 4;
+    lens[EXECUTE_LOAD_QUERY_EVENT - 1] = 26;
+    lens[TABLE_MAP_EVENT - 1] = 8;
+    lens[WRITE_ROWS_EVENTv1 - 1] = 8;
+    lens[UPDATE_ROWS_EVENTv1 - 1] = 8;
+    lens[DELETE_ROWS_EVENTv1 - 1] = 8;
+    lens[INCIDENT_EVENT - 1] = 2;
+    lens[MARIADB10_BINLOG_CHECKPOINT_EVENT - 1] = 4;
+    lens[MARIADB10_GTID_EVENT - 1] = 19;
+    lens[MARIADB10_GTID_GTID_LIST_EVENT - 1] = 4;
+    ptr += GEN_N_EVENT_TYPES;
+
+    /** The checksum algorithm, 1 is CRC32 */
+    *ptr++ = gen->checksum ? 1 : 0;
+
+    return gen_write(gen, FORMAT_DESCRIPTION_EVENT, ptr - body);
+}
+
+static bool gen_gtid(BINLOG_GEN *gen, uint64_t seq, uint8_t flags)
+{
+    uint8_t *body = gen_reserve(gen, 19);
+
+    if (body == NULL)
+    {
+        return false;
+    }
+
+    uint8_t *ptr = put64(body, seq);
+    ptr = put32(ptr, 0);
+    *ptr++ = flags;
+    memset(ptr, 0, 6);
+    ptr += 6;
+
+    return gen_write(gen, MARIADB10_GTID_EVENT, ptr - body);
+}
+
+static bool gen_query(BINLOG_GEN *gen, const char *sql)
+{
+    size_t dblen = strlen(GEN_DATABASE);
+    size_t sqllen = strlen(sql);
+    uint8_t *body = gen_reserve(gen, 13 + dblen + 1 + sqllen);
+
+    if (body == NULL)
+    {
+        return false;
+    }
+
+    uint8_t *ptr = put32(body, 1);  // Thread id
+    ptr = put32(ptr, 0);            // Execution time
+    *ptr++ = dblen;
+    ptr = put16(ptr, 0);            // Error code
+    ptr = put16(ptr, 0);            // Status variable length
+    memcpy(ptr, GEN_DATABASE, dblen + 1);
+    ptr += dblen + 1;
+    memcpy(ptr, sql, sqllen);
+    ptr += sqllen;
+
+    return gen_write(gen, QUERY_EVENT, ptr - body);
+}
+
+static bool gen_table_map(BINLOG_GEN *gen)
+{
+    uint8_t *body = gen_reserve(gen, 64);
+
+    if (body == NULL)
+    {
+        return false;
+    }
+
+    uint8_t *ptr = put48(body, GEN_TABLE_ID);
+    ptr = put16(ptr, 0);
+    *ptr++ = strlen(GEN_DATABASE);
+    strcpy((char*)ptr, GEN_DATABASE);
+    ptr += strlen(GEN_DATABASE) + 1;
+    *ptr++ = strlen(GEN_TABLE);
+    strcpy((char*)ptr, GEN_TABLE);
+    ptr += strlen(GEN_TABLE) + 1;
+    *ptr++ = 2;                     // Column count
+    *ptr++ = BLR_TYPE_INT;
+    *ptr++ = BLR_TYPE_STRING;
+    *ptr++ = 2;                     // Metadata length
+    ptr = put16(ptr, GEN_VARCHAR_LEN);
+    *ptr++ = 0x03;                  // Both columns are nullable
+
+    return gen_write(gen, TABLE_MAP_EVENT, ptr - body);
+}
+
+static bool gen_write_rows(BINLOG_GEN *gen, uint32_t *id, int rows, int value_len)
+{
+    uint8_t *body = gen_reserve(gen, 6 + 2 + 1 + 1 + (size_t)rows * (1 + 4 + 1 + value_len));
+
+    if (body == NULL)
+    {
+        return false;
+    }
+
+    uint8_t *ptr = put48(body, GEN_TABLE_ID);
+    ptr = put16(ptr, GEN_STMT_END_F);
+    *ptr++ = 2;                     // Column count
+    *ptr++ = 0x03;                  // Both columns are present
+
+    for (int i = 0; i < rows; i++)
+    {
+        uint32_t value = (*id)++;
+        *ptr++ = 0;                 // No NULL values
+        ptr = put32(ptr, value);
+        *ptr++ = value_len;
+
+        for (int j = 0; j < value_len; j++)
+        {
+            *ptr++ = 'a' + (value + j) % 26;
+        }
+    }
+
+    return gen_write(gen, WRITE_ROWS_EVENTv1, ptr - body);
+}
+
+static bool gen_xid(BINLOG_GEN *gen, uint64_t xid)
+{
+    uint8_t *body = gen_reserve(gen, 8);
+
+    if (body == NULL)
+    {
+        return false;
+    }
+
+    return gen_write(gen, XID_EVENT, put64(body, xid) - body);
+}
+
+bool binlog_generate(const char *path, int n_trx, int rows_per_trx, int value_len, bool checksum)
+{
+    static const uint8_t magic[] = BINLOG_MAGIC;
+    BINLOG_GEN gen = {.pos = BINLOG_MAGIC_SIZE, .timestamp = time(NULL), .checksum = checksum};
+    uint32_t id = 1;
+    uint64_t seq = 1;
+
+    if (value_len > GEN_VARCHAR_LEN)
+    {
+        value_len = GEN_VARCHAR_LEN;
+    }
+
+    if ((gen.file = fopen(path, "wb")) == NULL)
+    {
+        return false;
+    }
+
+    bool ok = fwrite(magic, 1, sizeof(magic), gen.file) == sizeof(magic) &&
+              gen_format_description(&gen) &&
+              gen_gtid(&gen, seq++, MARIADB_FL_STANDALONE | MARIADB_FL_DDL) &&
+              gen_query(&gen, "CREATE TABLE " GEN_TABLE " (id INT, name VARCHAR(64))");
+
+    for (int i = 0; ok && i < n_trx; i++)
+    {
+        ok = gen_gtid(&gen, seq, 0) &&
+             gen_query(&gen, "BEGIN") &&
+             gen_table_map(&gen) &&
+             gen_write_rows(&gen, &id, rows_per_trx, value_len) &&
+             gen_xid(&gen, seq);
+        seq++;
+    }
+
+    free(gen.buf);
+
+    if (fclose(gen.file) != 0)
+    {
+        ok = false;
+    }
+
+    return ok;
+}
@@ -0,0 +1,39 @@
+#ifndef _BINLOGGEN_H
+#define _BINLOGGEN_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file binloggen.h Generation of MariaDB 10 binlog files for the benchmarks
+ *
+ * The generated file has a format description event, a CREATE TABLE of
+ * test.t1 (id INT, name VARCHAR(64)) and the requested number of row based
+ * transactions that insert rows into it. Each transaction is a GTID event,
+ * a BEGIN, a table map, one write rows event and an XID event.
+ */
+
+#include <stdbool.h>
+
+/**
+ * Write a binlog file
+ *
+ * @param path         Path of the file
+ * @param n_trx        Number of transactions
+ * @param rows_per_trx Number of rows inserted by each transaction
+ * @param value_len    Length of the VARCHAR value of each row, at most 64
+ * @param checksum     Whether the events have a CRC32 checksum
+ * @return True if the file was written
+ */
+bool binlog_generate(const char *path, int n_trx, int rows_per_trx, int value_len, bool checksum);
+
+#endif
@@ -0,0 +1,711 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file blrbench.c Throughput benchmark of the binlog router
+ *
+ * The events of a binlog file are sent through blr_handle_binlog_record as if
+ * a master had sent them and the router writes them to its own binlog file
+ * and distributes them to a number of fake slaves. The slaves are DCBs whose
+ * write function only counts what it is given. Each run uses a new router
+ * instance and binlog directory and the results are written as JSON:
+ *
+ * @verbatim
+ * {
+ *   "events": 100003, "bytes": 20501234, "checksum": true,
+ *   "results": [
+ *     {"slaves": 1, "seconds": 0.412, "events_per_sec": 242725, "mb_per_sec": 47.45,
+ *      "syscalls": 2011, "latency_p50_us": 3, "latency_p99_us": 11,
+ *      "latency_max_us": 912, "slaves_behind": 0},
+ *     ...
+ *   ]
+ * }
+ * @endverbatim
+ *
+ * The latency is the time from the moment the chunk that contains the event
+ * was given to the router to the moment the event was written to a slave. A
+ * slave that is behind was put into catch-up mode, the benchmark does not
+ * run the catch-up and the time measures only the events sent by the master
+ * connection or the distribution thread. The syscalls are the reads and
+ * writes the process did during the run. The temporary directory is kept if
+ * a run fails so that the log can be read.
+ *
+ * Without -f a binlog file of row based transactions is generated.
+ *
+ * Usage: blrbench [-f binlog] [-n transactions] [-r rows] [-v value_len]
+ *                 [-m slaves] [-c chunk_size] [-O options] [-d dir] [-o file]
+ */
+
+#include <ftw.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <blr.h>
+#include <buffer.h>
+#include <dcb.h>
+#include <gwdirs.h>
+#include <listener.h>
+#include <log_manager.h>
+#include <maxconfig.h>
+#include <maxscale/poll.h>
+#include <router.h>
+#include <service.h>
+#include <session.h>
+#include <statistics.h>
+#include "binloggen.h"
+
+/** The router options that are always used */
+#define BENCH_OPTIONS "server-id=1,mariadb10-compatibility=1,transaction_safety=1"
+
+/** Latencies below this are counted with a resolution of one microsecond */
+#define LAT_LINEAR      64
+/** The larger latencies have this many buckets for each power of two */
+#define LAT_SUB_BUCKETS 32
+#define LAT_BUCKETS     (LAT_LINEAR + 40 * LAT_SUB_BUCKETS)
+
+/** How long the asynchronous distribution of the events is waited for */
+#define BENCH_WAIT_SECONDS 60
+
+extern void ModuleInit();
+extern ROUTER_OBJECT *GetModuleObject();
+extern void blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt);
+extern void encode_value(unsigned char *data, unsigned int value, int len);
+
+/** A fake slave */
+typedef struct
+{
+    DCB          *dcb;
+    SESSION      *session;
+    ROUTER_SLAVE *slave;
+    uint64_t     packets;
+    uint64_t     bytes;
+    uint64_t     latency[LAT_BUCKETS];
+} BENCH_SLAVE;
+
+/** When the chunk being processed was given to the router */
+static uint64_t feed_usecs;
+
+static uint64_t
+bench_usecs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int
+latency_bucket(uint64_t usecs)
+{
+    if (usecs < LAT_LINEAR)
+    {
+        return usecs;
+    }
+
+    int msb = 63 - __builtin_clzll(usecs);
+    int bucket = LAT_LINEAR + (msb - 6) * LAT_SUB_BUCKETS +
+                 ((usecs >> (msb - 5)) & (LAT_SUB_BUCKETS - 1));
+
+    return bucket < LAT_BUCKETS ? bucket : LAT_BUCKETS - 1;
+}
+
+/** The smallest latency that is counted in a bucket */
+static uint64_t
+latency_value(int bucket)
+{
+    if (bucket < LAT_LINEAR)
+    {
+        return bucket;
+    }
+
+    int msb = (bucket - LAT_LINEAR) / LAT_SUB_BUCKETS + 6;
+    uint64_t sub = (bucket - LAT_LINEAR) % LAT_SUB_BUCKETS;
+
+    return (1ULL << msb) | (sub << (msb - 5));
+}
+
+static uint64_t
+latency_percentile(const uint64_t *hist, double pct)
+{
+    uint64_t total = 0;
+
+    for (int i = 0; i < LAT_BUCKETS; i++)
+    {
+        total += hist[i];
+    }
+
+    uint64_t target = total * pct / 100.0;
+    uint64_t count = 0;
+
+    for (int i = 0; i < LAT_BUCKETS; i++)
+    {
+        count += hist[i];
+
+        if (hist[i] && count > target)
+        {
+            return latency_value(i);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * The write function of the fake slaves
+ *
+ * The router writes to one slave from one thread at a time so the counters
+ * of the slave need no locking.
+ */
+static int
+bench_slave_write(DCB *dcb, GWBUF *buf)
+{
+    BENCH_SLAVE *bs = dcb->data;
+    uint64_t now = bench_usecs();
+    uint64_t fed = __atomic_load_n(&feed_usecs, __ATOMIC_ACQUIRE);
+
+    bs->packets++;
+    bs->bytes += gwbuf_length(buf);
+    bs->latency[latency_bucket(now > fed ? now - fed : 0)]++;
+    gwbuf_free(buf);
+
+    return 1;
+}
+
+/**
+ * Read the number of read and write system calls of the process
+ */
+static uint64_t
+bench_syscalls()
+{
+    FILE *file = fopen("/proc/self/io", "r");
+    uint64_t total = 0;
+
+    if (file)
+    {
+        char line[128];
+        unsigned long long value;
+
+        while (fgets(line, sizeof(line), file))
+        {
+            if (sscanf(line, "syscr: %llu", &value) == 1 ||
+                sscanf(line, "syscw: %llu", &value) == 1)
+            {
+                total += value;
+            }
+        }
+        fclose(file);
+    }
+
+    return total;
+}
+
+static int
+remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+/**
+ * Convert a binlog file into the packets a master sends
+ *
+ * Each event is sent as one or more packets whose payload is an OK byte and
+ * the event. The magic bytes of the file are not sent.
+ *
+ * @param data      The binlog file
+ * @param size      Size of the file
+ * @param stream    The packets are stored here
+ * @param n_events  The number of events is stored here
+ * @param checksum  Set to true if the events have checksums
+ * @return Length of the packet stream or 0 on error
+ */
+static size_t
+binlog_to_packets(const uint8_t *data, size_t size, uint8_t **stream, uint64_t *n_events,
+                  bool *checksum)
+{
+    size_t pos = BINLOG_MAGIC_SIZE;
+    size_t n = 0;
+    uint8_t *out = malloc(size * 2 + 1024);
+
+    *n_events = 0;
+    *checksum = false;
+
+    if (out == NULL)
+    {
+        return 0;
+    }
+
+    while (pos + BINLOG_EVENT_HDR_LEN <= size)
+    {
+        const uint8_t *ev = data + pos;
+        uint32_t ev_size = EXTRACT32(ev + 9);
+
+        if (ev_size < BINLOG_EVENT_HDR_LEN || pos + ev_size > size)
+        {
+            fprintf(stderr, "Invalid event at position %lu\n", pos);
+            free(out);
+            return 0;
+        }
+
+        if (ev[4] == FORMAT_DESCRIPTION_EVENT && ev_size > BINLOG_EVENT_HDR_LEN + 5)
+        {
+            /** The checksum algorithm byte is followed by the checksum */
+            uint32_t crc = crc32(crc32(0L, NULL, 0), ev, ev_size - MYSQL_CHECKSUM_LEN);
+            *checksum = ev[ev_size - MYSQL_CHECKSUM_LEN - 1] == 1 &&
+                        EXTRACT32(ev + ev_size - MYSQL_CHECKSUM_LEN) == crc;
+        }
+
+        /** The OK byte is a part of the payload of the first packet */
+        size_t payload = ev_size + 1;
+        const uint8_t *src = ev;
+        bool first = true;
+        bool last;
+
+        do
+        {
+            size_t len = payload < MYSQL_PACKET_LENGTH_MAX ? payload : MYSQL_PACKET_LENGTH_MAX;
+            size_t copy = first ? len - 1 : len;
+            uint8_t *hdr = out + n;
+
+            if ((size_t)(hdr - out) + len + 8 > size * 2 + 1024)
+            {
+                fprintf(stderr, "Too many large events\n");
+                free(out);
+                return 0;
+            }
+
+            encode_value(hdr, len, 24);
+            hdr[3] = 0;
+            n += MYSQL_HEADER_LEN;
+
+            if (first)
+            {
+                out[n++] = 0;
+                first = false;
+            }
+
+            memcpy(out + n, src, copy);
+            n += copy;
+            src += copy;
+            payload -= len;
+            last = len < MYSQL_PACKET_LENGTH_MAX;
+        }
+        while (!last);
+
+        pos += ev_size;
+        (*n_events)++;
+    }
+
+    *stream = out;
+    return n;
+}
+
+/**
+ * Create a binlog router instance that writes to a directory
+ *
+ * @param dir     Binlog directory
+ * @param extra   Extra router options separated by commas or NULL
+ * @param chksum  Whether the master sends checksums
+ * @return The router instance or NULL on error
+ */
+static ROUTER_INSTANCE *
+bench_router_create(const char *dir, const char *extra, bool chksum)
+{
+    static int n_services = 0;
+    char name[64];
+    char optstr[PATH_MAX + 1024];
+    char *options[64];
+    int n = 0;
+
+    snprintf(name, sizeof(name), "blrbench%d", ++n_services);
+    SERVICE *service = service_alloc(name, "binlogrouter");
+
+    if (service == NULL)
+    {
+        return NULL;
+    }
+
+    service->credentials.name = strdup("maxuser");
+    service->credentials.authdata = strdup("maxpwd");
+
+    snprintf(optstr, sizeof(optstr), "binlogdir=%s," BENCH_OPTIONS "%s%s",
+             dir, extra ? "," : "", extra ? extra : "");
+
+    char *lasts;
+    for (char *tok = strtok_r(optstr, ",", &lasts); tok && n < 63;
+         tok = strtok_r(NULL, ",", &lasts))
+    {
+        options[n++] = strdup(tok);
+    }
+    options[n] = NULL;
+
+    ROUTER_INSTANCE *inst = (ROUTER_INSTANCE *)GetModuleObject()->createInstance(service, options);
+
+    for (int i = 0; i < n; i++)
+    {
+        free(options[i]);
+    }
+
+    if (inst == NULL || blr_file_init(inst) == 0)
+    {
+        return NULL;
+    }
+
+    inst->master_chksum = chksum;
+    inst->master_state = BLRM_BINLOGDUMP;
+
+    return inst;
+}
+
+/**
+ * Register fake slaves that are up to date with the router
+ */
+static bool
+bench_slaves_create(ROUTER_INSTANCE *inst, BENCH_SLAVE *slaves, int n_slaves)
+{
+    static SERV_LISTENER listener;
+
+    for (int i = 0; i < n_slaves; i++)
+    {
+        BENCH_SLAVE *bs = &slaves[i];
+
+        if ((bs->dcb = dcb_alloc(DCB_ROLE_CLIENT_HANDLER, &listener)) == NULL ||
+            (bs->session = calloc(1, sizeof(SESSION))) == NULL)
+        {
+            return false;
+        }
+
+        bs->dcb->func.write = bench_slave_write;
+        bs->dcb->data = bs;
+        bs->dcb->session = bs->session;
+        bs->session->client_dcb = bs->dcb;
+
+        if ((bs->slave = GetModuleObject()->newSession((ROUTER *)inst, bs->session)) == NULL)
+        {
+            return false;
+        }
+
+        ROUTER_SLAVE *slave = bs->slave;
+        slave->serverid = i + 100;
+        slave->mariadb10_compat = inst->mariadb10_compat;
+        slave->seqno = 1;
+        strcpy(slave->binlogfile, inst->binlog_name);
+        slave->binlog_pos = inst->current_pos;
+        slave->cstate = CS_UPTODATE;
+        slave->state = BLRS_DUMPING;
+    }
+
+    return true;
+}
+
+/**
+ * Check whether the events have been sent to all slaves
+ */
+static bool
+bench_slaves_done(ROUTER_INSTANCE *inst, BENCH_SLAVE *slaves, int n_slaves)
+{
+    char binlog[BINLOG_FNAMELEN + 1];
+    uint64_t pos;
+    bool done = true;
+
+    spinlock_acquire(&inst->binlog_lock);
+    strcpy(binlog, inst->binlog_name);
+    pos = inst->current_pos;
+    spinlock_release(&inst->binlog_lock);
+
+    for (int i = 0; i < n_slaves && done; i++)
+    {
+        ROUTER_SLAVE *slave = slaves[i].slave;
+
+        spinlock_acquire(&slave->catch_lock);
+        done = (slave->cstate & CS_UPTODATE) == 0 ||
+               (slave->binlog_pos == pos && strcmp(slave->binlogfile, binlog) == 0);
+        spinlock_release(&slave->catch_lock);
+    }
+
+    return done;
+}
+
+/**
+ * Run the benchmark once
+ *
+ * @return True on success
+ */
+static bool
+bench_run(FILE *out, bool first, const char *dir, const char *extra, bool chksum,
+          const uint8_t *stream, size_t len, size_t chunk, uint64_t n_events,
+          uint64_t ev_bytes, int n_slaves)
+{
+    BENCH_SLAVE *slaves = calloc(n_slaves ? n_slaves : 1, sizeof(BENCH_SLAVE));
+    ROUTER_INSTANCE *inst;
+
+    if (slaves == NULL || mkdir(dir, 0700) != 0 ||
+        (inst = bench_router_create(dir, extra, chksum)) == NULL ||
+        !bench_slaves_create(inst, slaves, n_slaves))
+    {
+        fprintf(stderr, "Failed to set up the router in %s\n", dir);
+        free(slaves);
+        return false;
+    }
+
+    uint64_t syscalls = bench_syscalls();
+    uint64_t start = bench_usecs();
+
+    for (size_t pos = 0; pos < len; pos += chunk)
+    {
+        size_t n = len - pos < chunk ? len - pos : chunk;
+        GWBUF *buf = gwbuf_alloc_and_load(n, (void*)(stream + pos));
+
+        if (buf == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed\n");
+            return false;
+        }
+
+        __atomic_store_n(&feed_usecs, bench_usecs(), __ATOMIC_RELEASE);
+        blr_handle_binlog_record(inst, buf);
+    }
+
+    uint64_t deadline = bench_usecs() + BENCH_WAIT_SECONDS * 1000000ULL;
+
+    while (!bench_slaves_done(inst, slaves, n_slaves) && bench_usecs() < deadline)
+    {
+        usleep(100);
+    }
+
+    double seconds = (bench_usecs() - start) / 1000000.0;
+    syscalls = bench_syscalls() - syscalls;
+
+    uint64_t hist[LAT_BUCKETS] = {0};
+    int behind = 0;
+    uint64_t max = 0;
+
+    for (int i = 0; i < n_slaves; i++)
+    {
+        for (int j = 0; j < LAT_BUCKETS; j++)
+        {
+            hist[j] += slaves[i].latency[j];
+
+            if (slaves[i].latency[j] && latency_value(j) > max)
+            {
+                max = latency_value(j);
+            }
+        }
+
+        if ((slaves[i].slave->cstate & CS_UPTODATE) == 0)
+        {
+            behind++;
+        }
+    }
+
+    fprintf(out, "%s\n    {\"slaves\": %d, \"seconds\": %.6f, \"events_per_sec\": %.0f, "
+            "\"mb_per_sec\": %.2f, \"syscalls\": %lu, \"latency_p50_us\": %lu, "
+            "\"latency_p99_us\": %lu, \"latency_max_us\": %lu, \"slaves_behind\": %d}",
+            first ? "" : ",", n_slaves, seconds, n_events / seconds,
+            ev_bytes / seconds / (1024 * 1024), syscalls,
+            latency_percentile(hist, 50), latency_percentile(hist, 99), max, behind);
+    fflush(out);
+
+    /** The instance and the slaves stay allocated, they are not used again */
+    return true;
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-f binlog] [-n transactions] [-r rows] [-v value_len]\n"
+            "          [-m slaves] [-c chunk_size] [-O options] [-d dir] [-o file]\n"
+            "\n"
+            "  -f  Binlog file to send, by default one is generated\n"
+            "  -n  Number of transactions in the generated binlog, default 100000\n"
+            "  -r  Number of rows in each transaction, default 1\n"
+            "  -v  Length of the value of each row, default 32\n"
+            "  -m  Comma separated list of slave counts, default 1,8,64\n"
+            "  -c  Size of the chunks given to the router, default 65536\n"
+            "  -O  Extra router options, for example async_distribution=1\n"
+            "  -d  Directory for the binlog files, by default a temporary one\n"
+            "  -o  Write the results to this file instead of the standard output\n",
+            name);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *input = NULL;
+    const char *slave_list = "1,8,64";
+    const char *extra = NULL;
+    const char *basedir = NULL;
+    int n_trx = 100000;
+    int rows = 1;
+    int value_len = 32;
+    size_t chunk = 65536;
+    FILE *out = stdout;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:n:r:v:m:c:O:d:o:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'f':
+            input = optarg;
+            break;
+        case 'n':
+            n_trx = atoi(optarg);
+            break;
+        case 'r':
+            rows = atoi(optarg);
+            break;
+        case 'v':
+            value_len = atoi(optarg);
+            break;
+        case 'm':
+            slave_list = optarg;
+            break;
+        case 'c':
+            chunk = atol(optarg);
+            break;
+        case 'O':
+            extra = optarg;
+            break;
+        case 'd':
+            basedir = optarg;
+            break;
+        case 'o':
+            if ((out = fopen(optarg, "w")) == NULL)
+            {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (n_trx < 1 || rows < 1 || value_len < 0 || chunk < 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    char tmpdir[PATH_MAX + 1];
+    snprintf(tmpdir, sizeof(tmpdir), "%s/blrbench.XXXXXX", basedir ? basedir : "/tmp");
+
+    if (mkdtemp(tmpdir) == NULL)
+    {
+        perror(tmpdir);
+        return 1;
+    }
+
+    mxs_log_init(NULL, tmpdir, MXS_LOG_TARGET_FS);
+    mxs_log_set_priority_enabled(LOG_DEBUG, false);
+    mxs_log_set_priority_enabled(LOG_INFO, false);
+    mxs_log_set_priority_enabled(LOG_NOTICE, false);
+    mxs_log_set_syslog_enabled(false);
+
+    /** The slaves that fall behind are woken up with fake poll events */
+    config_get_global_options()->n_threads = 1;
+    ts_stats_init();
+    poll_init();
+
+    set_libdir(strdup(".."));
+    ModuleInit();
+
+    char path[PATH_MAX + 1];
+
+    if (input == NULL)
+    {
+        snprintf(path, sizeof(path), "%s/generated.000001", tmpdir);
+
+        if (!binlog_generate(path, n_trx, rows, value_len, true))
+        {
+            fprintf(stderr, "Failed to generate the binlog %s\n", path);
+            return 1;
+        }
+        input = path;
+    }
+
+    FILE *file = fopen(input, "rb");
+    struct stat st;
+    uint8_t *data = NULL;
+
+    if (file == NULL || fstat(fileno(file), &st) != 0 ||
+        (data = malloc(st.st_size)) == NULL ||
+        fread(data, 1, st.st_size, file) != (size_t)st.st_size)
+    {
+        perror(input);
+        return 1;
+    }
+    fclose(file);
+
+    uint8_t *stream;
+    uint64_t n_events;
+    bool chksum;
+    size_t len = binlog_to_packets(data, st.st_size, &stream, &n_events, &chksum);
+    uint64_t ev_bytes = st.st_size - BINLOG_MAGIC_SIZE;
+    free(data);
+
+    if (len == 0)
+    {
+        return 1;
+    }
+
+    fprintf(out, "{\n  \"events\": %lu, \"bytes\": %lu, \"checksum\": %s,\n  \"results\": [",
+            n_events, ev_bytes, chksum ? "true" : "false");
+
+    int rval = 0;
+    int run = 0;
+    char *list = strdup(slave_list);
+    char *lasts;
+
+    for (char *tok = strtok_r(list, ",", &lasts); tok; tok = strtok_r(NULL, ",", &lasts))
+    {
+        char dir[PATH_MAX + 1];
+        snprintf(dir, sizeof(dir), "%s/run%d", tmpdir, run);
+
+        if (!bench_run(out, run == 0, dir, extra, chksum, stream, len, chunk, n_events,
+                       ev_bytes, atoi(tok)))
+        {
+            rval = 1;
+            break;
+        }
+        run++;
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+
+    free(list);
+    free(stream);
+    mxs_log_finish();
+
+    if (rval == 0)
+    {
+        nftw(tmpdir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+    else
+    {
+        fprintf(stderr, "The log is in %s\n", tmpdir);
+    }
+
+    return rval;
+}
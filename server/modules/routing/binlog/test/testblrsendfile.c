@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * Tests of sending the events of a binlog file to a slave with sendfile()
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+
+/** The bulk catchup is static */
+#include "../blr_slave.c"
+
+#include <skygw_debug.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/** Length of the test event */
+#define TEST_EVENT_LEN (BINLOG_EVENT_HDR_LEN + 10)
+
+/** Number of packets written with func.write */
+static int n_writes = 0;
+
+static int test_write(DCB *dcb, GWBUF *buffer)
+{
+    n_writes++;
+    gwbuf_free(buffer);
+    return 1;
+}
+
+/**
+ * Create a binlog file with one query event after the magic bytes
+ *
+ * @param file  The file to fill
+ * @param event Buffer where the event is stored
+ */
+static void create_binlog(BLFILE *file, uint8_t *event)
+{
+    static const uint8_t magic[] = {0xfe, 0x62, 0x69, 0x6e};
+    char name[] = "/tmp/testblrsendfile.XXXXXX";
+
+    memset(event, 'x', TEST_EVENT_LEN);
+    encode_value(event, 1, 32);        // Timestamp
+    event[4] = QUERY_EVENT;
+    encode_value(event + 5, 1, 32);    // Server id
+    encode_value(event + 9, TEST_EVENT_LEN, 32);
+    encode_value(event + 13, sizeof(magic) + TEST_EVENT_LEN, 32);
+    encode_value(event + 17, 0, 16);   // Flags
+
+    file->fd = mkstemp(name);
+    ss_info_dassert(file->fd >= 0, "The binlog file must be created");
+    unlink(name);
+    ss_info_dassert(write(file->fd, magic, sizeof(magic)) == sizeof(magic) &&
+                    write(file->fd, event, TEST_EVENT_LEN) == TEST_EVENT_LEN,
+                    "The binlog file must be written");
+    strcpy(file->binlogname, "mysql-bin.000001");
+}
+
+/**
+ * Send the event with the bulk catchup and, if it was not sent, with func.write
+ *
+ * @param compress Whether the slave uses the compressed protocol
+ */
+static void check_catchup(bool compress)
+{
+    ROUTER_INSTANCE router;
+    ROUTER_SLAVE slave;
+    DCB dcb;
+    MySQLProtocol protocol;
+    BLFILE file;
+    uint8_t event[TEST_EVENT_LEN];
+    uint8_t received[MYSQL_HEADER_LEN + 1 + TEST_EVENT_LEN];
+    int fds[2];
+
+    memset(&router, 0, sizeof(router));
+    memset(&slave, 0, sizeof(slave));
+    memset(&dcb, 0, sizeof(dcb));
+    memset(&protocol, 0, sizeof(protocol));
+    memset(&file, 0, sizeof(file));
+
+    create_binlog(&file, event);
+    ss_info_dassert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0, "The socket pair must be created");
+
+    spinlock_init(&router.binlog_lock);
+    router.bulk_catchup = true;
+    strcpy(router.binlog_name, "mysql-bin.000002");
+
+    protocol.compress = compress;
+    spinlock_init(&dcb.writeqlock);
+    dcb.fd = fds[0];
+    dcb.state = DCB_STATE_POLLING;
+    dcb.protocol = &protocol;
+    dcb.func.write = test_write;
+
+    slave.dcb = &dcb;
+    slave.router = &router;
+    slave.seqno = 1;
+    slave.binlog_pos = 4;
+    strcpy(slave.binlogfile, file.binlogname);
+
+    n_writes = 0;
+    int burst = 10;
+    long burst_size = 1024;
+    bool more;
+    int n = blr_slave_send_file_events(&router, &slave, &file, &burst, &burst_size, &more);
+
+    if (n == 0)
+    {
+        REP_HEADER hdr;
+        GWBUF *record = gwbuf_alloc_and_load(TEST_EVENT_LEN, event);
+        hdr.event_size = TEST_EVENT_LEN;
+        hdr.event_type = QUERY_EVENT;
+        hdr.next_pos = 4 + TEST_EVENT_LEN;
+        ss_info_dassert(blr_send_event(BLR_THREAD_ROLE_SLAVE, slave.binlogfile, slave.binlog_pos,
+                                       &slave, &hdr, GWBUF_DATA(record), record),
+                        "The event must be sent normally");
+        gwbuf_free(record);
+    }
+
+    if (compress)
+    {
+        ss_info_dassert(n == 0, "The bulk catchup must not send to a compressed slave");
+        ss_info_dassert(slave.stats.n_sendfile == 0, "sendfile must not be used");
+        ss_info_dassert(n_writes == 1, "The event must be written with func.write");
+        ss_info_dassert(recv(fds[1], received, sizeof(received), MSG_DONTWAIT) < 0,
+                        "Nothing must be written to the socket past the protocol");
+    }
+    else
+    {
+        ss_info_dassert(n == 1, "The bulk catchup must send the event");
+        ss_info_dassert(slave.stats.n_sendfile == 1, "The event must be sent with sendfile");
+        ss_info_dassert(n_writes == 0, "func.write must not be used");
+        ss_info_dassert(slave.binlog_pos == 4 + TEST_EVENT_LEN, "The slave must have moved");
+        ss_info_dassert(recv(fds[1], received, sizeof(received), MSG_WAITALL) == sizeof(received) &&
+                        received[3] == 1 && received[4] == 0 &&
+                        memcmp(received + MYSQL_HEADER_LEN + 1, event, TEST_EVENT_LEN) == 0,
+                        "The slave must receive the packet");
+    }
+
+    close(fds[0]);
+    close(fds[1]);
+    close(file.fd);
+}
+
+static void test_plain()
+{
+    ss_dfprintf(stderr, "testblrsendfile : bulk catchup of a plain slave.");
+    check_catchup(false);
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+static void test_compressed()
+{
+    ss_dfprintf(stderr, "testblrsendfile : bulk catchup of a compressed slave.");
+    check_catchup(true);
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+int main(int argc, char **argv)
+{
+    test_plain();
+    test_compressed();
+    return 0;
+}
@@ -21,6 +21,7 @@
  * Date		Who		Description
  * 18/06/13	Mark Riddoch	Initial implementation
  * 13/06/14	Mark Riddoch	Creted from the debugcli
+ * 14/10/16	                Commands are run in the admin thread
  *
  * @endverbatim
  */
@@ -39,6 +40,7 @@
 #include <debugcli.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
+#include <admin_thread.h>
 
 
 MODULE_INFO 	info = {
@@ -236,6 +238,30 @@ static void freeSession(
         return;
 }
 
+/** A command waiting for the admin thread */
+typedef struct
+{
+    CLI_SESSION *cli;
+    char         cmd[cmdbuflen];
+} CLI_TASK;
+
+/**
+ * Run a command and mark the end of its output
+ *
+ * @param session The session of the command
+ * @param data    The CLI_TASK of the command
+ */
+static void
+execute_task(SESSION *session, void *data)
+{
+    CLI_TASK *task = (CLI_TASK *)data;
+
+    strcpy(task->cli->cmdbuf, task->cmd);
+    execute_cmd(task->cli);
+    dcb_printf(session->client_dcb, "OK");
+    free(task);
+}
+
 /**
  * We have data from the client, we must route it to the backend.
  * This is simply a case of sending it to the connection that was
@@ -250,15 +276,34 @@ static	int
 execute(ROUTER *instance, void *router_session, GWBUF *queue)
 {
 CLI_SESSION	*session = (CLI_SESSION *)router_session;
+CLI_TASK	*task = calloc(1, sizeof(CLI_TASK));
+
+	if (task == NULL)
+	{
+		gwbuf_free(queue);
+		dcb_printf(session->session->client_dcb, "OK");
+		return 0;
+	}
+
+	task->cli = session;
 
 	/* Extract the characters */
 	while (queue)
 	{
-		strncat(session->cmdbuf, GWBUF_DATA(queue), MIN(GWBUF_LENGTH(queue),cmdbuflen-1));
+		strncat(task->cmd, GWBUF_DATA(queue),
+			MIN(GWBUF_LENGTH(queue), cmdbuflen - 1 - strlen(task->cmd)));
 		queue = gwbuf_consume(queue, GWBUF_LENGTH(queue));
 	}
 
-	execute_cmd(session);
+	/**
+	 * The output of the diagnostic commands can be large, run them in the
+	 * admin thread so that the worker threads are not stalled
+	 */
+	if (!admin_task_add(session->session, execute_task, task))
+	{
+		execute_task(session->session, task);
+	}
+
 	return 1;
 }
 
@@ -68,6 +68,7 @@
 #include <monitor.h>
 #include <debugcli.h>
 #include <housekeeper.h>
+#include <hugepage.h>
 
 #include <skygw_utils.h>
 #include <log_manager.h>
@@ -101,6 +102,7 @@ struct subcommand {
 };
 
 static  void    telnetdShowUsers(DCB *);
+static  void    show_locks(DCB *);
 /**
  * The subcommands of the show command
  */
@@ -111,6 +113,10 @@ struct subcommand showoptions[] = {
       "Show all buffers with backtrace",
       {0, 0, 0} },
 #endif
+    { "bufferpools", 0, dprintBufferPools,
+      "Show the hit rates of the buffer pools",
+      "Show the hit rates of the buffer pools",
+      {0, 0, 0} },
     { "dcbs", 0, dprintAllDCBs,
       "Show all descriptor control blocks (network connections)",
       "Show all descriptor control blocks (network connections)",
@@ -149,6 +155,19 @@ struct subcommand showoptions[] = {
       "Show all filters",
       "Show all filters",
       {0, 0, 0} },
+    { "hugepages", 0, dprintHugePages,
+      "Show the huge page arenas of the buffers, DCBs and sessions",
+      "Show the huge page arenas of the buffers, DCBs and sessions",
+      {0, 0, 0} },
+    { "iostats", 0, dShowIOStats,
+      "Show the socket I/O statistics of all DCBs",
+      "Show the socket I/O statistics of all DCBs",
+      {0, 0, 0} },
+    { "locks", 0, show_locks,
+      "Show the most contended locks of the lock contention profile",
+      "Show the most contended locks of the lock contention profile, "
+      "enable the profile with 'enable lockprofile'",
+      {0, 0, 0} },
     { "modules", 0, dprintAllModules,
       "Show all currently loaded modules",
       "Show all currently loaded modules",
@@ -203,6 +222,14 @@ struct subcommand showoptions[] = {
       "Show the status of the polling threads in MaxScale",
       "Show the status of the polling threads in MaxScale",
       {0, 0, 0} },
+    { "topmemory", 1, dListTopMemorySessions,
+      "Show the sessions that hold the most buffered memory, e.g. show topmemory 10",
+      "Show the sessions that hold the most buffered memory, e.g. show topmemory 10",
+      {ARG_TYPE_NUMERIC, 0, 0} },
+    { "topsessions", 1, dListTopSessions,
+      "Show the sessions that have used the most CPU time, e.g. show topsessions 10",
+      "Show the sessions that have used the most CPU time, e.g. show topsessions 10",
+      {ARG_TYPE_NUMERIC, 0, 0} },
     { "users", 0, telnetdShowUsers,
       "Show all maxadmin enabled Linux accounts and created maxadmin users",
       "Show all maxadmin enabled Linux accounts and created maxadmin users",
@@ -428,6 +455,8 @@ static void enable_maxlog();
 static void disable_maxlog();
 static void enable_account(DCB *, char *user);
 static void disable_account(DCB *, char *user);
+static void enable_lockprofile(DCB *dcb);
+static void disable_lockprofile(DCB *dcb);
 
 /**
  *  * The subcommands of the enable command
@@ -515,6 +544,15 @@ struct subcommand enableoptions[] = {
         "Enable maxlog logging",
         {0, 0, 0}
     },
+    {
+        "lockprofile",
+        0,
+        enable_lockprofile,
+        "Enable the lock contention profile, the results are shown with 'show locks'",
+        "Enable the lock contention profile, the results are shown with 'show locks'. "
+        "Enabling the profile discards the results of the previous profile.",
+        {0, 0, 0}
+    },
     {
         "account",
         1,
@@ -623,6 +661,14 @@ struct subcommand disableoptions[] = {
         "Disable maxlog logging",
         {0, 0, 0}
     },
+    {
+        "lockprofile",
+        0,
+        disable_lockprofile,
+        "Disable the lock contention profile",
+        "Disable the lock contention profile, the collected results can still be shown",
+        {0, 0, 0}
+    },
     {
         "account",
         1,
@@ -1245,6 +1291,7 @@ set_server(DCB *dcb, SERVER *server, char *bit)
     if ((bitvalue = server_map_status(bit)) != 0)
     {
         server_set_status(server, bitvalue);
+        server_publish_topology();
     }
     else
     {
@@ -1268,6 +1315,7 @@ clear_server(DCB *dcb, SERVER *server, char *bit)
     if ((bitvalue = server_map_status(bit)) != 0)
     {
         server_clear_status(server, bitvalue);
+        server_publish_topology();
     }
     else
     {
@@ -1506,11 +1554,7 @@ static void enable_sess_log_action(DCB *dcb, char *arg1, char *arg2)
 
         while (session)
         {
-            if (false == session->ses_is_in_use)
-            {
-                continue;
-            }
-            if (session->ses_id == id)
+            if (session->ses_is_in_use && session->ses_id == id)
             {
                 session_enable_log_priority(session, entry.priority);
                 break;
@@ -1548,11 +1592,7 @@ static void disable_sess_log_action(DCB *dcb, char *arg1, char *arg2)
 
         while (session)
         {
-            if (false == session->ses_is_in_use)
-            {
-                continue;
-            }
-            if (session->ses_id == id)
+            if (session->ses_is_in_use && session->ses_id == id)
             {
                 session_disable_log_priority(session, entry.priority);
                 break;
@@ -1627,11 +1667,7 @@ static void enable_sess_log_priority(DCB *dcb, char *arg1, char *arg2)
 
         while (session)
         {
-            if (false == session->ses_is_in_use)
-            {
-                continue;
-            }
-            if (session->ses_id == id)
+            if (session->ses_is_in_use && session->ses_id == id)
             {
                 session_enable_log_priority(session, priority);
                 break;
@@ -1669,11 +1705,7 @@ static void disable_sess_log_priority(DCB *dcb, char *arg1, char *arg2)
 
         while (session)
         {
-            if (false == session->ses_is_in_use)
-            {
-                continue;
-            }
-            if (session->ses_id == id)
+            if (session->ses_is_in_use && session->ses_id == id)
             {
                 session_disable_log_priority(session, priority);
                 break;
@@ -1817,6 +1849,72 @@ disable_feedback_action(void)
     return;
 }
 
+/**
+ * Enable the lock contention profile
+ *
+ * @param dcb The DCB to print any output to
+ */
+static void
+enable_lockprofile(DCB *dcb)
+{
+    spinlock_profile_enable(true);
+    dcb_printf(dcb, "Lock contention profile enabled, one in 16 acquisitions is sampled.\n");
+}
+
+/**
+ * Disable the lock contention profile
+ *
+ * @param dcb The DCB to print any output to
+ */
+static void
+disable_lockprofile(DCB *dcb)
+{
+    spinlock_profile_enable(false);
+    dcb_printf(dcb, "Lock contention profile disabled.\n");
+}
+
+/**
+ * Show the most contended locks of the lock contention profile
+ *
+ * @param dcb The DCB to print the profile to
+ */
+static void
+show_locks(DCB *dcb)
+{
+    SPINLOCK_PROFILE_ENTRY entries[SPINLOCK_PROFILE_TOP];
+    int n = spinlock_profile_top(entries, SPINLOCK_PROFILE_TOP);
+
+    dcb_printf(dcb, "Lock contention profile is %s. Times are in CPU cycles.\n\n",
+               spinlock_profile_enabled() ? "enabled" : "disabled");
+    dcb_printf(dcb, "%-24s | %10s | %10s | %10s | %12s | %10s | %12s | Call site\n",
+               "Lock", "Samples", "Contended", "Avg wait", "Max wait", "Avg hold", "Max hold");
+    dcb_printf(dcb, "-------------------------+------------+------------+------------+"
+               "--------------+------------+--------------+----------\n");
+
+    for (int i = 0; i < n; i++)
+    {
+        SPINLOCK_PROFILE_ENTRY *e = &entries[i];
+        char name[25];
+        char site[200];
+        uint64_t samples = e->acquired ? e->acquired : 1;
+
+        if (e->name)
+        {
+            snprintf(name, sizeof(name), "%s", e->name);
+        }
+        else
+        {
+            snprintf(name, sizeof(name), "%p", e->lock);
+        }
+        spinlock_profile_site_name(e->site, site, sizeof(site));
+
+        dcb_printf(dcb, "%-24s | %10lu | %10lu | %10lu | %12lu | %10lu | %12lu | %s\n", name,
+                   (unsigned long)e->acquired, (unsigned long)e->contended,
+                   (unsigned long)(e->wait / samples), (unsigned long)e->max_wait,
+                   (unsigned long)(e->hold / samples), (unsigned long)e->max_hold, site);
+    }
+}
+
 /**
  * Enable syslog logging.
  */
@@ -22,6 +22,7 @@
  * 16/02/15	Mark Riddoch		Initial implementation
  * 27/02/15	Massimiliano Pinto	Added maxinfo_add_mysql_user
  * 09/09/2015   Martin Brampton         Modify error handler
+ * 14/10/2016                           Requests are run in the admin thread
  *
  * @endverbatim
  */
@@ -51,6 +52,8 @@
 #include <secrets.h>
 #include <users.h>
 #include <dbusers.h>
+#include <admin_thread.h>
+#include <metrics.h>
 
 
 MODULE_INFO 	info = {
@@ -323,6 +326,66 @@ static void handleError(
 	*succp = false;
 }
 
+/** A complete request waiting for the admin thread */
+typedef struct
+{
+    INFO_INSTANCE *instance;
+    INFO_SESSION  *session;
+    GWBUF         *queue;
+} INFO_TASK;
+
+/**
+ * Execute a complete request
+ *
+ * @param instance	The router instance
+ * @param session	The router session
+ * @param queue		The request in a single buffer, freed by this function
+ * @return The number of bytes sent
+ */
+static int
+execute_request(INFO_INSTANCE *instance, INFO_SESSION *session, GWBUF *queue)
+{
+    int len, residual;
+    char *sql;
+    int rc = 1;
+
+    if (modutil_MySQL_Query(queue, &sql, &len, &residual))
+    {
+        sql = strndup(sql, len);
+        rc = maxinfo_execute_query(instance, session, sql);
+        free(sql);
+    }
+    else
+    {
+        switch (MYSQL_COMMAND(queue))
+        {
+            case COM_PING:
+                rc = maxinfo_ping(instance, session, queue);
+                break;
+            case COM_STATISTICS:
+                rc = maxinfo_statistics(instance, session, queue);
+                break;
+            case COM_QUIT:
+                break;
+            default:
+                MXS_ERROR("maxinfo: Unexpected MySQL command 0x%x",
+                          MYSQL_COMMAND(queue));
+                break;
+        }
+    }
+    // MaxInfo doesn't route the data forward so it should be freed.
+    gwbuf_free(queue);
+    return rc;
+}
+
+static void
+execute_task(SESSION *session, void *data)
+{
+    INFO_TASK *task = (INFO_TASK *)data;
+    execute_request(task->instance, task->session, task->queue);
+    free(task);
+}
+
 /**
  * We have data from the client, this is a SQL command, or other MySQL
  * packet type.
@@ -338,8 +401,7 @@ execute(ROUTER *rinstance, void *router_session, GWBUF *queue)
     INFO_INSTANCE *instance = (INFO_INSTANCE *)rinstance;
     INFO_SESSION *session = (INFO_SESSION *)router_session;
     uint8_t *data;
-    int length, len, residual;
-    char *sql;
+    int length;
 
     if (GWBUF_TYPE(queue) == GWBUF_TYPE_HTTP)
     {
@@ -360,35 +422,31 @@ execute(ROUTER *rinstance, void *router_session, GWBUF *queue)
         return 1;
     }
 
-    int rc = 1;
     // We have a complete request in a single buffer
-    if (modutil_MySQL_Query(queue, &sql, &len, &residual))
-    {
-        sql = strndup(sql, len);
-        rc = maxinfo_execute_query(instance, session, sql);
-        free(sql);
-    }
-    else
+    if (MYSQL_COMMAND(queue) != COM_QUIT)
     {
-        switch (MYSQL_COMMAND(queue))
+        /**
+         * Building the result sets walks the lists of sessions and DCBs,
+         * let the admin thread do that
+         */
+        INFO_TASK *task = malloc(sizeof(INFO_TASK));
+
+        if (task)
         {
-            case COM_PING:
-                rc = maxinfo_ping(instance, session, queue);
-                break;
-            case COM_STATISTICS:
-                rc = maxinfo_statistics(instance, session, queue);
-                break;
-            case COM_QUIT:
-                break;
-            default:
-                MXS_ERROR("maxinfo: Unexpected MySQL command 0x%x",
-                          MYSQL_COMMAND(queue));
-                break;
+            task->instance = instance;
+            task->session = session;
+            task->queue = queue;
+
+            if (admin_task_add(session->session, execute_task, task))
+            {
+                return 1;
+            }
+
+            free(task);
         }
     }
-    // MaxInfo doesn't route the data forward so it should be freed.
-    gwbuf_free(queue);
-    return rc;
+
+    return execute_request(instance, session, queue);
 }
 
 /**
@@ -697,6 +755,8 @@ static struct uri_table {
 	{ "/variables", maxinfo_variables },
 	{ "/status", maxinfo_status },
 	{ "/event/times", eventTimesGetList },
+	{ "/locks", maxinfo_locks },
+	{ "/latency", serviceGetLatencyList },
 	{ NULL, NULL }
 };
 
@@ -716,6 +776,10 @@ int		i;
 RESULTSET	*set;
 
 	uri = (char *)GWBUF_DATA(queue);
+	if (strcmp(uri, "/metrics") == 0)
+	{
+		metrics_print(session->dcb);
+	}
 	for (i = 0; supported_uri[i].uri; i++)
 	{
 		if (strcmp(uri, supported_uri[i].uri) == 0)
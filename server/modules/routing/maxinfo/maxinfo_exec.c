@@ -261,6 +261,46 @@ exec_show_eventTimes(DCB *dcb, MAXINFO_TREE *tree)
     resultset_free(set);
 }
 
+/**
+ * Fetch the most contended locks of the lock contention profile
+ *
+ * @param dcb   DCB to which to stream result set
+ * @param tree  Potential like clause (currently unused)
+ */
+static void
+exec_show_locks(DCB *dcb, MAXINFO_TREE *tree)
+{
+    RESULTSET   *set;
+
+    if ((set = maxinfo_locks()) == NULL)
+    {
+        return;
+    }
+
+    resultset_stream_mysql(set, dcb);
+    resultset_free(set);
+}
+
+/**
+ * Fetch the query latencies of the servers of all services
+ *
+ * @param dcb   DCB to which to stream result set
+ * @param tree  Potential like clause (currently unused)
+ */
+static void
+exec_show_latency(DCB *dcb, MAXINFO_TREE *tree)
+{
+    RESULTSET   *set;
+
+    if ((set = serviceGetLatencyList()) == NULL)
+    {
+        return;
+    }
+
+    resultset_stream_mysql(set, dcb);
+    resultset_free(set);
+}
+
 /**
  * The table of show commands that are supported
  */
@@ -280,6 +320,8 @@ static struct
     { "modules", exec_show_modules },
     { "monitors", exec_show_monitors },
     { "eventTimes", exec_show_eventTimes },
+    { "locks", exec_show_locks },
+    { "latency", exec_show_latency },
     { NULL, NULL }
 };
 
@@ -381,6 +423,7 @@ void exec_set_server(DCB *dcb, MAXINFO_TREE *tree)
         if (status != 0)
         {
             server_set_status(server, status);
+            server_publish_topology();
             maxinfo_send_ok(dcb);
         }
         else
@@ -462,6 +505,7 @@ void exec_clear_server(DCB *dcb, MAXINFO_TREE *tree)
         if (status != 0)
         {
             server_clear_status(server, status);
+            server_publish_topology();
             maxinfo_send_ok(dcb);
         }
         else
@@ -1095,7 +1139,7 @@ static struct
     { "Uptime", VT_INT, (STATSFUNC)maxscale_uptime },
     { "Uptime_since_flush_status", VT_INT, (STATSFUNC)maxscale_uptime },
     { "Threads_created", VT_INT, (STATSFUNC)config_threadcount },
-    { "Threads_running", VT_INT, (STATSFUNC)config_threadcount },
+    { "Threads_running", VT_INT, (STATSFUNC)poll_running_threads },
     { "Threadpool_threads", VT_INT, (STATSFUNC)config_threadcount },
     { "Threads_connected", VT_INT, (STATSFUNC)serviceSessionCountAll },
     { "Connections", VT_INT, (STATSFUNC)maxinfo_all_dcbs },
@@ -1230,6 +1274,101 @@ maxinfo_status()
     return result;
 }
 
+/**
+ * The context of the lock profile result set
+ */
+typedef struct
+{
+    int index;                                          /*< The next entry */
+    int count;                                          /*< Number of entries */
+    SPINLOCK_PROFILE_ENTRY entries[SPINLOCK_PROFILE_TOP]; /*< The profile entries */
+} LOCKCONTEXT;
+
+/**
+ * Callback function to populate rows of the lock profile
+ *
+ * @param data  The context point
+ * @return  The next row or NULL if end of rows
+ */
+static RESULT_ROW *
+lock_row(RESULTSET *result, void *data)
+{
+    LOCKCONTEXT *context = (LOCKCONTEXT *) data;
+    SPINLOCK_PROFILE_ENTRY *e;
+    RESULT_ROW *row;
+    uint64_t samples;
+    char buf[200];
+
+    if (context->index >= context->count)
+    {
+        free(data);
+        return NULL;
+    }
+
+    e = &context->entries[context->index++];
+    samples = e->acquired ? e->acquired : 1;
+    row = resultset_make_row(result);
+
+    if (e->name)
+    {
+        resultset_row_set(row, 0, (char *)e->name);
+    }
+    else
+    {
+        snprintf(buf, sizeof(buf), "%p", e->lock);
+        resultset_row_set(row, 0, buf);
+    }
+    spinlock_profile_site_name(e->site, buf, sizeof(buf));
+    resultset_row_set(row, 1, buf);
+    snprintf(buf, sizeof(buf), "%lu", (unsigned long)e->acquired);
+    resultset_row_set(row, 2, buf);
+    snprintf(buf, sizeof(buf), "%lu", (unsigned long)e->contended);
+    resultset_row_set(row, 3, buf);
+    snprintf(buf, sizeof(buf), "%lu", (unsigned long)(e->wait / samples));
+    resultset_row_set(row, 4, buf);
+    snprintf(buf, sizeof(buf), "%lu", (unsigned long)e->max_wait);
+    resultset_row_set(row, 5, buf);
+    snprintf(buf, sizeof(buf), "%lu", (unsigned long)(e->hold / samples));
+    resultset_row_set(row, 6, buf);
+    snprintf(buf, sizeof(buf), "%lu", (unsigned long)e->max_hold);
+    resultset_row_set(row, 7, buf);
+    return row;
+}
+
+/**
+ * Return the most contended locks of the lock contention profile as a
+ * result set. The times are in CPU cycles.
+ *
+ * @return The lock profile as a result set
+ */
+RESULTSET *
+maxinfo_locks()
+{
+    RESULTSET *result;
+    LOCKCONTEXT *context;
+
+    if ((context = malloc(sizeof(LOCKCONTEXT))) == NULL)
+    {
+        return NULL;
+    }
+    context->index = 0;
+    context->count = spinlock_profile_top(context->entries, SPINLOCK_PROFILE_TOP);
+
+    if ((result = resultset_create(lock_row, context)) == NULL)
+    {
+        free(context);
+        return NULL;
+    }
+    resultset_add_column(result, "Lock", 24, COL_TYPE_VARCHAR);
+    resultset_add_column(result, "Call_site", 80, COL_TYPE_VARCHAR);
+    resultset_add_column(result, "Samples", 12, COL_TYPE_VARCHAR);
+    resultset_add_column(result, "Contended", 12, COL_TYPE_VARCHAR);
+    resultset_add_column(result, "Avg_wait_cycles", 12, COL_TYPE_VARCHAR);
+    resultset_add_column(result, "Max_wait_cycles", 12, COL_TYPE_VARCHAR);
+    resultset_add_column(result, "Avg_hold_cycles", 12, COL_TYPE_VARCHAR);
+    resultset_add_column(result, "Max_hold_cycles", 12, COL_TYPE_VARCHAR);
+    return result;
+}
 
 /**
  * Execute a select command parse tree and return the result set
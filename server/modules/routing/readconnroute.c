@@ -66,6 +66,8 @@
  * 09/09/2015   Martin Brampton         Modify error handler
  * 25/09/2015   Martin Brampton         Block callback processing when no router session in the DCB
  * 09/11/2015   Martin Brampton         Modified routeQuery - must free "queue" regardless of outcome
+ * 14/10/2016                           Two random choices with many servers, least_queries option
+ * 14/10/2016                           Consistent hashing with the hash option
  *
  * @endverbatim
  */
@@ -81,16 +83,28 @@
 #include <readconnection.h>
 #include <dcb.h>
 #include <spinlock.h>
+#include <maxscale/poll.h>
 #include <modinfo.h>
 
 #include <skygw_types.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
+#include <random_jkiss.h>
+#include <math.h>
 
 #include <mysql_client_server_protocol.h>
+#include <query_classifier.h>
 
 #include "modutil.h"
 
+/** Query types that leave state in the backend connection */
+#define PINNING_QUERY_TYPES (QUERY_TYPE_SESSION_WRITE | QUERY_TYPE_USERVAR_WRITE | \
+                             QUERY_TYPE_GSYSVAR_WRITE | QUERY_TYPE_ENABLE_AUTOCOMMIT | \
+                             QUERY_TYPE_DISABLE_AUTOCOMMIT | QUERY_TYPE_PREPARE_NAMED_STMT | \
+                             QUERY_TYPE_PREPARE_STMT | QUERY_TYPE_EXEC_STMT | \
+                             QUERY_TYPE_CREATE_TMP_TABLE | QUERY_TYPE_READ_TMP_TABLE | \
+                             QUERY_TYPE_MASTER_READ)
+
 MODULE_INFO info =
 {
     MODULE_API_ROUTER,
@@ -135,6 +149,9 @@ static void rses_end_locked_router_action(ROUTER_CLIENT_SES* rses);
 
 static BACKEND *get_root_master(BACKEND **servers);
 static int handle_state_switch(DCB* dcb, DCB_REASON reason, void * routersession);
+static DCB *multiplex_route(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+                            mysql_server_cmd_t cmd, GWBUF *queue);
+static DCB *multiplex_reply(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses, DCB *backend_dcb);
 static SPINLOCK instlock;
 static ROUTER_INSTANCE *instances;
 
@@ -183,14 +200,243 @@ static inline void free_readconn_instance(ROUTER_INSTANCE *router)
         {
             for (int i = 0; router->servers[i]; i++)
             {
+                ts_stats_free(router->servers[i]->n_outstanding);
                 free(router->servers[i]);
             }
         }
         free(router->servers);
+        ts_stats_free(router->stats.n_sessions);
+        ts_stats_free(router->stats.n_queries);
+        ts_stats_free(router->stats.n_released);
+        ts_stats_free(router->stats.n_acquired);
         free(router);
     }
 }
 
+/**
+ * Return the weight of a backend scaled by the load the monitor reports
+ *
+ * @param backend The backend
+ * @return The weight to compare connection counts with
+ */
+static inline int backend_load_weight(BACKEND *backend)
+{
+    return server_scale_weight(backend->server, backend->weight);
+}
+
+/**
+ * Return the load of a backend relative to its weight
+ *
+ * @param inst    The router instance
+ * @param backend The backend
+ * @return The load, the backend with the smallest load should be used
+ */
+static inline int64_t backend_load(ROUTER_INSTANCE *inst, BACKEND *backend)
+{
+    int64_t n = inst->least_queries ? ts_stats_sum(backend->n_outstanding) :
+                backend->current_connection_count;
+
+    return ((n + 1) * 1000) / backend_load_weight(backend);
+}
+
+/**
+ * Check if a new session can use a backend. The root master is handled by
+ * the caller when the master router option is used.
+ *
+ * @param inst        The router instance
+ * @param backend     The backend
+ * @param master_host The root master or NULL
+ * @return True if the backend can be used
+ */
+static bool backend_is_eligible(ROUTER_INSTANCE *inst, BACKEND *backend, BACKEND *master_host)
+{
+    return !SERVER_IN_MAINT(backend->server) && backend->weight != 0 &&
+           SERVER_IS_RUNNING(backend->server) &&
+           (backend->server->status & inst->bitmask & inst->bitvalue) &&
+           !(backend == master_host && (inst->bitvalue & SERVER_SLAVE));
+}
+
+/**
+ * Compare the loads of two backends
+ *
+ * @param inst The router instance
+ * @param a    The first backend
+ * @param b    The second backend
+ * @return True if a is less loaded than b. Of two equally loaded backends the
+ *         one with fewer connections over time is less loaded.
+ */
+static bool backend_less_loaded(ROUTER_INSTANCE *inst, BACKEND *a, BACKEND *b)
+{
+    int64_t load_a = backend_load(inst, a);
+    int64_t load_b = backend_load(inst, b);
+
+    return load_a < load_b ||
+           (load_a == load_b && ts_stats_sum(a->server->stats.n_connections) <
+            ts_stats_sum(b->server->stats.n_connections));
+}
+
+/**
+ * Select the less loaded of two randomly chosen eligible backends. This
+ * spreads the load nearly as evenly as comparing all backends but the cost
+ * doesn't grow with the number of backends.
+ *
+ * @param inst        The router instance
+ * @param master_host The root master or NULL
+ * @return The selected backend or NULL if no eligible backends were found,
+ *         in which case all backends should be compared
+ */
+static BACKEND *backend_two_choices(ROUTER_INSTANCE *inst, BACKEND *master_host)
+{
+    BACKEND *choice = NULL;
+
+    for (int i = 0, found = 0; i < RCR_TWO_CHOICES_TRIES && found < 2; i++)
+    {
+        BACKEND *backend = inst->servers[random_jkiss() % inst->n_servers];
+
+        if (backend != choice && backend_is_eligible(inst, backend, master_host))
+        {
+            if (choice == NULL || backend_less_loaded(inst, backend, choice))
+            {
+                choice = backend;
+            }
+            found++;
+        }
+    }
+
+    return choice;
+}
+
+/**
+ * Hash a string with 64-bit FNV-1a
+ *
+ * @param str  The string
+ * @param hash The initial value
+ * @return The hash
+ */
+static uint64_t hash_string(const char *str, uint64_t hash)
+{
+    while (*str)
+    {
+        hash ^= (unsigned char)*str++;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+/**
+ * Mix the bits of a hash so that similar inputs give unrelated outputs
+ *
+ * @param x The value to mix
+ * @return The mixed value
+ */
+static uint64_t hash_mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+/** A server and its score for a session */
+typedef struct
+{
+    BACKEND *backend;
+    double   score;
+} hash_choice_t;
+
+static int compare_choices(const void *a, const void *b)
+{
+    double sa = ((const hash_choice_t *)a)->score;
+    double sb = ((const hash_choice_t *)b)->score;
+
+    return sa > sb ? -1 : sa < sb ? 1 : 0;
+}
+
+/**
+ * Select a server with weighted rendezvous hashing. Every eligible server
+ * gets a score from the hash of the session key and the server name, and the
+ * server with the highest score is used. When a server leaves or joins, only
+ * the sessions whose highest scoring server it was are mapped differently.
+ *
+ * To bound the load, a server with more than RCR_HASH_LOAD_FACTOR times its
+ * share of the connections is skipped in favour of the next highest score.
+ *
+ * @param inst        The router instance
+ * @param session     The session being created
+ * @param master_host The root master or NULL
+ * @return The selected backend or NULL if there are no eligible backends
+ */
+static BACKEND *backend_hashed(ROUTER_INSTANCE *inst, SESSION *session, BACKEND *master_host)
+{
+    DCB *client = session->client_dcb;
+    const char *key = NULL;
+
+    switch (inst->hash)
+    {
+    case RCR_HASH_USER:
+        key = client->user;
+        break;
+
+    case RCR_HASH_DATABASE:
+        key = client->data ? ((MYSQL_session *)client->data)->db : NULL;
+        break;
+
+    case RCR_HASH_CLIENT:
+        key = client->remote;
+        break;
+
+    default:
+        break;
+    }
+
+    hash_choice_t choices[inst->n_servers];
+    uint64_t key_hash = hash_string(key ? key : "", 0xcbf29ce484222325ULL);
+    int64_t connections = 0;
+    int64_t total_weight = 0;
+    int n = 0;
+
+    for (int i = 0; inst->servers[i]; i++)
+    {
+        BACKEND *backend = inst->servers[i];
+
+        if (backend_is_eligible(inst, backend, master_host))
+        {
+            /** A uniform value in (0, 1) for this key and server */
+            uint64_t h = hash_mix(hash_string(backend->server->unique_name, key_hash));
+            double u = ((h >> 11) + 0.5) / 9007199254740992.0;
+
+            choices[n].backend = backend;
+            choices[n].score = -backend_load_weight(backend) / log(u);
+            connections += backend->current_connection_count;
+            total_weight += backend_load_weight(backend);
+            n++;
+        }
+    }
+
+    if (n == 0)
+    {
+        return NULL;
+    }
+
+    qsort(choices, n, sizeof(hash_choice_t), compare_choices);
+
+    for (int i = 0; i < n; i++)
+    {
+        BACKEND *backend = choices[i].backend;
+        double share = (double)(connections + 1) * backend_load_weight(backend) / total_weight;
+
+        if (backend->current_connection_count < ceil(share * RCR_HASH_LOAD_FACTOR))
+        {
+            return backend;
+        }
+    }
+
+    return choices[0].backend;
+}
+
 /**
  * Create an instance of the router for a particular service
  * within the gateway.
@@ -218,6 +464,15 @@ createInstance(SERVICE *service, char **options)
     inst->service = service;
     spinlock_init(&inst->lock);
 
+    if ((inst->stats.n_sessions = ts_stats_alloc()) == NULL ||
+        (inst->stats.n_queries = ts_stats_alloc()) == NULL ||
+        (inst->stats.n_released = ts_stats_alloc()) == NULL ||
+        (inst->stats.n_acquired = ts_stats_alloc()) == NULL)
+    {
+        free_readconn_instance(inst);
+        return NULL;
+    }
+
     /*
      * We need an array of the backend servers in the instance structure so
      * that we can maintain a count of the number of connections to each
@@ -245,9 +500,17 @@ createInstance(SERVICE *service, char **options)
         inst->servers[n]->server = sref->server;
         inst->servers[n]->current_connection_count = 0;
         inst->servers[n]->weight = 1000;
+        if ((inst->servers[n]->n_outstanding = ts_stats_alloc()) == NULL)
+        {
+            free(inst->servers[n]);
+            inst->servers[n] = NULL;
+            free_readconn_instance(inst);
+            return NULL;
+        }
         n++;
     }
     inst->servers[n] = NULL;
+    inst->n_servers = n;
 
     if ((weightby = serviceGetWeightingParameter(service)) != NULL)
     {
@@ -350,12 +613,33 @@ createInstance(SERVICE *service, char **options)
                 inst->bitmask |= (SERVER_NDB);
                 inst->bitvalue |= SERVER_NDB;
             }
+            else if (!strcasecmp(options[i], "multiplex"))
+            {
+                inst->multiplex = true;
+            }
+            else if (!strcasecmp(options[i], "least_queries"))
+            {
+                inst->least_queries = true;
+            }
+            else if (!strcasecmp(options[i], "hash=user"))
+            {
+                inst->hash = RCR_HASH_USER;
+            }
+            else if (!strcasecmp(options[i], "hash=database"))
+            {
+                inst->hash = RCR_HASH_DATABASE;
+            }
+            else if (!strcasecmp(options[i], "hash=client"))
+            {
+                inst->hash = RCR_HASH_CLIENT;
+            }
             else
             {
                 MXS_WARNING("Unsupported router "
                             "option \'%s\' for readconnroute. "
                             "Expected router options are "
-                            "[slave|master|synced|ndb|running]",
+                            "[slave|master|synced|ndb|running|multiplex|least_queries|"
+                            "hash=user|hash=database|hash=client]",
                             options[i]);
                 error = true;
             }
@@ -374,6 +658,20 @@ createInstance(SERVICE *service, char **options)
         inst->bitmask |= (SERVER_RUNNING);
         inst->bitvalue |= SERVER_RUNNING;
     }
+
+    if (inst->multiplex)
+    {
+        for (i = 0; inst->servers[i]; i++)
+        {
+            if (inst->servers[i]->server->persistpoolmax == 0)
+            {
+                MXS_WARNING("Service '%s' multiplexes its backend connections but "
+                            "server '%s' has no 'persistpoolmax'. The connections "
+                            "to it are closed instead of being shared.",
+                            service->name, inst->servers[i]->server->unique_name);
+            }
+        }
+    }
     /*
      * We have completed the creation of the instance data, so now
      * insert this router instance into the linked list of routers
@@ -422,6 +720,7 @@ newSession(ROUTER *instance, SESSION *session)
     client_rses->rses_chk_tail = CHK_NUM_ROUTER_SES;
 #endif
     client_rses->client_dcb = session->client_dcb;
+    client_rses->rses_confined = poll_session_confined(session);
 
     /**
      * Find the Master host from available servers
@@ -434,6 +733,24 @@ newSession(ROUTER *instance, SESSION *session)
      * connection router.
      */
 
+    /*
+     * With consistent hashing the session key decides the server. Otherwise
+     * with many servers, pick the less loaded one of two random servers. The
+     * master router option always uses the root master so it needs the scan.
+     */
+    if (inst->bitvalue & SERVER_MASTER)
+    {
+        /** The master is always used */
+    }
+    else if (inst->hash != RCR_HASH_NONE)
+    {
+        candidate = backend_hashed(inst, session, master_host);
+    }
+    else if (inst->n_servers >= RCR_TWO_CHOICES_MIN)
+    {
+        candidate = backend_two_choices(inst, master_host);
+    }
+
     /*
      * Loop over all the servers and find any that have fewer connections
      * than the candidate server.
@@ -446,7 +763,9 @@ newSession(ROUTER *instance, SESSION *session)
      * become the new candidate. This has the effect of spreading the
      * connections over different servers during periods of very low load.
      */
-    for (i = 0; inst->servers[i]; i++)
+    bool scan = candidate == NULL;
+
+    for (i = 0; scan && inst->servers[i]; i++)
     {
         if (inst->servers[i])
         {
@@ -517,26 +836,11 @@ newSession(ROUTER *instance, SESSION *session)
             {
                 candidate = inst->servers[i];
             }
-            else if (((inst->servers[i]->current_connection_count + 1)
-                      * 1000) / inst->servers[i]->weight <
-                     ((candidate->current_connection_count + 1) *
-                      1000) / candidate->weight)
+            else if (backend_less_loaded(inst, inst->servers[i], candidate))
             {
-                /* This running server has fewer
-                connections, set it as a new candidate */
-                candidate = inst->servers[i];
-            }
-            else if (((inst->servers[i]->current_connection_count + 1)
-                      * 1000) / inst->servers[i]->weight ==
-                     ((candidate->current_connection_count + 1) *
-                      1000) / candidate->weight &&
-                     inst->servers[i]->server->stats.n_connections <
-                     candidate->server->stats.n_connections)
-            {
-                /* This running server has the same number
-                of connections currently as the candidate
-                but has had fewer connections over time
-                than candidate, set this server to candidate*/
+                /* This running server has fewer connections, or the same
+                number of connections but fewer connections over time,
+                set it as a new candidate */
                 candidate = inst->servers[i];
             }
         }
@@ -594,7 +898,7 @@ newSession(ROUTER *instance, SESSION *session)
                      DCB_REASON_NOT_RESPONDING,
                      &handle_state_switch,
                      client_rses);
-    inst->stats.n_sessions++;
+    ts_stats_add(inst->stats.n_sessions, 1);
 
     /**
      * Add this session to the list of active sessions.
@@ -701,6 +1005,12 @@ closeSession(ROUTER *instance, void *router_session)
         /** Unlock */
         rses_end_locked_router_action(router_cli_ses);
 
+        if (__atomic_exchange_n(&router_cli_ses->query_start, 0, __ATOMIC_RELAXED))
+        {
+            /** The response will not be waited for */
+            ts_stats_add(router_cli_ses->backend->n_outstanding, -1);
+        }
+
         /**
          * Close the backend server connection
          */
@@ -733,7 +1043,7 @@ routeQuery(ROUTER *instance, void *router_session, GWBUF *queue)
     mysql_server_cmd_t mysql_command = proto->current_command;
     bool rses_is_closed;
 
-    inst->stats.n_queries++;
+    ts_stats_add(inst->stats.n_queries, 1);
 
     /** Dirty read for quick check if router is closed. */
     if (router_cli_ses->rses_closed)
@@ -755,6 +1065,12 @@ routeQuery(ROUTER *instance, void *router_session, GWBUF *queue)
         rses_end_locked_router_action(router_cli_ses);
     }
 
+    if (!rses_is_closed && inst->multiplex &&
+        !SERVER_IS_DOWN(router_cli_ses->backend->server))
+    {
+        backend_dcb = multiplex_route(inst, router_cli_ses, mysql_command, queue);
+    }
+
     if (rses_is_closed || backend_dcb == NULL ||
         SERVER_IS_DOWN(router_cli_ses->backend->server))
     {
@@ -771,6 +1087,16 @@ routeQuery(ROUTER *instance, void *router_session, GWBUF *queue)
     }
 
     char* trc = NULL;
+    bool timed = false;
+
+    /** Set before the write as the response may be processed by another thread */
+    if (router_cli_ses->query_start == 0 &&
+        mysql_command != MYSQL_COM_QUIT && mysql_command != MYSQL_COM_STMT_CLOSE)
+    {
+        router_cli_ses->query_start = service_latency_now();
+        ts_stats_add(router_cli_ses->backend->n_outstanding, 1);
+        timed = true;
+    }
 
     switch (mysql_command)
     {
@@ -788,6 +1114,12 @@ routeQuery(ROUTER *instance, void *router_session, GWBUF *queue)
             break;
     }
 
+    if (rc != 1 && timed &&
+        __atomic_exchange_n(&router_cli_ses->query_start, 0, __ATOMIC_RELAXED))
+    {
+        ts_stats_add(router_cli_ses->backend->n_outstanding, -1);
+    }
+
     MXS_INFO("Routed [%s] to '%s'%s%s",
              STRPACKETTYPE(mysql_command),
              backend_dcb->server->unique_name,
@@ -824,11 +1156,29 @@ diagnostics(ROUTER *router, DCB *dcb)
     }
     spinlock_release(&router_inst->lock);
 
-    dcb_printf(dcb, "\tNumber of router sessions:   	%d\n",
-               router_inst->stats.n_sessions);
+    dcb_printf(dcb, "\tNumber of router sessions:   	%" PRId64 "\n",
+               ts_stats_sum(router_inst->stats.n_sessions));
     dcb_printf(dcb, "\tCurrent no. of router sessions:	%d\n", i);
-    dcb_printf(dcb, "\tNumber of queries forwarded:   	%d\n",
-               router_inst->stats.n_queries);
+    dcb_printf(dcb, "\tNumber of queries forwarded:   	%" PRId64 "\n",
+               ts_stats_sum(router_inst->stats.n_queries));
+    if (router_inst->multiplex)
+    {
+        dcb_printf(dcb, "\tBackend connections acquired:	%" PRId64 "\n",
+                   ts_stats_sum(router_inst->stats.n_acquired));
+        dcb_printf(dcb, "\tBackend connections released:	%" PRId64 "\n",
+                   ts_stats_sum(router_inst->stats.n_released));
+    }
+    if (router_inst->least_queries)
+    {
+        dcb_printf(dcb, "\tConnection selection based on outstanding queries.\n");
+        dcb_printf(dcb, "\t\tServer               Outstanding\n");
+        for (i = 0; router_inst->servers[i]; i++)
+        {
+            backend = router_inst->servers[i];
+            dcb_printf(dcb, "\t\t%-20s %" PRId64 "\n", backend->server->unique_name,
+                       ts_stats_sum(backend->n_outstanding));
+        }
+    }
     if ((weightby = serviceGetWeightingParameter(router_inst->service))
         != NULL)
     {
@@ -862,8 +1212,41 @@ diagnostics(ROUTER *router, DCB *dcb)
 static void
 clientReply(ROUTER *instance, void *router_session, GWBUF *queue, DCB *backend_dcb)
 {
+    ROUTER_INSTANCE *inst = (ROUTER_INSTANCE *) instance;
+    DCB *idle_dcb = NULL;
+
     ss_dassert(backend_dcb->session->client_dcb != NULL);
-    SESSION_ROUTE_REPLY(backend_dcb->session, queue);
+
+    uint64_t start;
+
+    if (router_session &&
+        (start = __atomic_exchange_n(&((ROUTER_CLIENT_SES *) router_session)->query_start,
+                                     0, __ATOMIC_RELAXED)) != 0)
+    {
+        /** The router doesn't track the replies so this is the time to the first response */
+        ROUTER_CLIENT_SES *rses = (ROUTER_CLIENT_SES *) router_session;
+        service_record_latency(inst->service, backend_dcb->server, SERVICE_LATENCY_OTHER,
+                               service_latency_now() - start);
+        ts_stats_add(rses->backend->n_outstanding, -1);
+    }
+
+    if (inst->multiplex && router_session)
+    {
+        idle_dcb = multiplex_reply(inst, (ROUTER_CLIENT_SES *) router_session, backend_dcb);
+    }
+
+    SESSION *session = backend_dcb->session;
+
+    SESSION_ROUTE_REPLY(session, queue);
+
+    /** The router doesn't track the replies so the first one ends the trace */
+    QUERY_TRACE_END(session);
+
+    if (idle_dcb)
+    {
+        /** Closing a healthy backend connection puts it into the persistent pool */
+        dcb_close(idle_dcb);
+    }
 }
 
 /**
@@ -942,7 +1325,8 @@ static void handleError(ROUTER *instance, void *router_session, GWBUF *errbuf,
  * router was closed before lock was acquired.
  *
  *
- * @details (write detailed description here)
+ * @details A session that is confined to the thread that owns it is not
+ * locked as no other thread uses it.
  *
  */
 static bool rses_begin_locked_router_action(ROUTER_CLIENT_SES* rses)
@@ -955,6 +1339,14 @@ static bool rses_begin_locked_router_action(ROUTER_CLIENT_SES* rses)
     {
         goto return_succp;
     }
+
+    if (rses->rses_confined)
+    {
+        ss_dassert(poll_session_owner(rses->client_dcb->session) == poll_current_thread());
+        succp = true;
+        goto return_succp;
+    }
+
     spinlock_acquire(&rses->rses_lock);
     if (rses->rses_closed)
     {
@@ -985,7 +1377,11 @@ return_succp:
 static void rses_end_locked_router_action(ROUTER_CLIENT_SES* rses)
 {
     CHK_CLIENT_RSES(rses);
-    spinlock_release(&rses->rses_lock);
+
+    if (!rses->rses_confined)
+    {
+        spinlock_release(&rses->rses_lock);
+    }
 }
 
 static int getCapabilities()
@@ -1071,7 +1467,15 @@ static int handle_state_switch(DCB* dcb, DCB_REASON reason, void * routersession
             dcb->func.hangup(dcb);
             break;
         case DCB_REASON_NOT_RESPONDING:
-            dcb->func.hangup(dcb);
+            /** The monitor calls this, the owner of a confined session handles the hangup */
+            if (rses->rses_confined)
+            {
+                poll_fake_hangup_event(dcb);
+            }
+            else
+            {
+                dcb->func.hangup(dcb);
+            }
             break;
         default:
             break;
@@ -1079,3 +1483,157 @@ static int handle_state_switch(DCB* dcb, DCB_REASON reason, void * routersession
 
     return 0;
 }
+
+/**
+ * Take a backend connection for a session that has released its connection.
+ * Connections that are found in the persistent pool of the server are reused,
+ * otherwise a new connection is created.
+ *
+ * @param inst The router instance
+ * @param rses The router session
+ * @return The backend DCB or NULL if no connection could be made
+ */
+static DCB *multiplex_acquire(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses)
+{
+    SERVER *server = rses->backend->server;
+    DCB *dcb = dcb_connect(server, rses->client_dcb->session, server->protocol);
+
+    if (dcb)
+    {
+        dcb_add_callback(dcb, DCB_REASON_NOT_RESPONDING, &handle_state_switch, rses);
+        ts_stats_add(inst->stats.n_acquired, 1);
+    }
+    else
+    {
+        MXS_ERROR("Failed to acquire a connection to server '%s' for a "
+                  "multiplexed session.", server->unique_name);
+    }
+
+    return dcb;
+}
+
+/**
+ * Prepare the routing of a query in a multiplexed session. The session is
+ * pinned to its backend connection if the query leaves state behind in the
+ * connection and a connection is acquired if the session has none.
+ *
+ * @param inst  The router instance
+ * @param rses  The router session
+ * @param cmd   The command being routed
+ * @param queue The query
+ * @return The backend DCB to write the query to or NULL on failure
+ */
+static DCB *multiplex_route(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+                            mysql_server_cmd_t cmd, GWBUF *queue)
+{
+    bool pin = cmd != MYSQL_COM_QUERY && cmd != MYSQL_COM_PING;
+    DCB *dcb;
+
+    if (cmd == MYSQL_COM_QUERY && !rses->pinned)
+    {
+        /** Only a buffer with exactly one packet can be classified */
+        if (GWBUF_LENGTH(queue) != gwbuf_length(queue) ||
+            GWBUF_LENGTH(queue) != MYSQL_GET_PACKET_LEN((uint8_t *)GWBUF_DATA(queue)) + MYSQL_HEADER_LEN ||
+            (qc_get_type(queue) & PINNING_QUERY_TYPES) ||
+            qc_get_operation(queue) == QUERY_OP_LOAD)
+        {
+            pin = true;
+        }
+    }
+
+    if (!rses_begin_locked_router_action(rses))
+    {
+        return NULL;
+    }
+
+    if (pin && !rses->pinned)
+    {
+        MXS_INFO("Multiplexed session is pinned to its backend connection "
+                 "by a %s command.", STRPACKETTYPE(cmd));
+        rses->pinned = true;
+    }
+
+    if ((dcb = rses->backend_dcb) == NULL)
+    {
+        /**
+         * Only a response to a query can release the connection and there
+         * are no queries left without a response, so nothing can change the
+         * connection other than closing the session.
+         */
+        rses_end_locked_router_action(rses);
+
+        if ((dcb = multiplex_acquire(inst, rses)) == NULL)
+        {
+            return NULL;
+        }
+
+        if (!rses_begin_locked_router_action(rses))
+        {
+            dcb_close(dcb);
+            return NULL;
+        }
+        rses->backend_dcb = dcb;
+    }
+
+    if (!pin)
+    {
+        rses->n_pending++;
+    }
+    rses_end_locked_router_action(rses);
+
+    return dcb;
+}
+
+/**
+ * Inspect a reply in a multiplexed session. When the responses to all routed
+ * queries are complete and the backend is not in a transaction, the session
+ * releases its backend connection.
+ *
+ * @param inst  The router instance
+ * @param rses  The router session
+ * @param backend_dcb The backend DCB whose protocol has tracked the reply
+ * @return The released backend DCB that should be closed or NULL
+ */
+static DCB *multiplex_reply(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses, DCB *backend_dcb)
+{
+    reply_tracker_t *tracker = &((MySQLProtocol *)backend_dcb->protocol)->reply_tracker;
+    int n_complete = tracker->rt_n_complete;
+    int status = tracker->rt_status;
+    DCB *dcb = NULL;
+
+    if (rses->pinned)
+    {
+        return NULL;
+    }
+
+    if (tracker->rt_local_infile)
+    {
+        /** LOAD DATA LOCAL INFILE request */
+        rses->pinned = true;
+        return NULL;
+    }
+
+    if (n_complete && rses_begin_locked_router_action(rses))
+    {
+        rses->n_pending -= n_complete;
+
+        if (status >= 0)
+        {
+            rses->trx_active = (status & MYSQL_SERVER_STATUS_IN_TRANS) ||
+                !(status & MYSQL_SERVER_STATUS_AUTOCOMMIT);
+        }
+
+        if (rses->n_pending <= 0 && !rses->pinned && !rses->trx_active &&
+            tracker->rt_first && protocol_reply_tracker_left(tracker) == 0 &&
+            rses->backend_dcb == backend_dcb && backend_dcb->dcb_readqueue == NULL)
+        {
+            rses->n_pending = 0;
+            dcb = rses->backend_dcb;
+            rses->backend_dcb = NULL;
+            ts_stats_add(inst->stats.n_released, 1);
+        }
+        rses_end_locked_router_action(rses);
+    }
+
+    return dcb;
+}
@@ -15,6 +15,8 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <limits.h>
+#include <time.h>
 
 #include <router.h>
 #include <readwritesplit.h>
@@ -22,13 +24,17 @@
 #include <mysql.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
+#include <trace.h>
+#include <probes.h>
 #include <query_classifier.h>
 #include <dcb.h>
 #include <spinlock.h>
+#include <maxscale/poll.h>
 #include <modinfo.h>
 #include <modutil.h>
 #include <mysql_client_server_protocol.h>
 #include <mysqld_error.h>
+#include <platform.h>
 
 MODULE_INFO info =
 {
@@ -135,6 +141,8 @@ int bref_cmp_behind_master(const void *bref1, const void *bref2);
 
 int bref_cmp_current_load(const void *bref1, const void *bref2);
 
+int bref_cmp_response_time(const void *bref1, const void *bref2);
+
 /**
  * The order of functions _must_ match with the order the select criteria are
  * listed in select_criteria_t definition in readwritesplit.h
@@ -145,7 +153,8 @@ int (*criteria_cmpfun[LAST_CRITERIA])(const void *, const void *) =
     bref_cmp_global_conn,
     bref_cmp_router_conn,
     bref_cmp_behind_master,
-    bref_cmp_current_load
+    bref_cmp_current_load,
+    bref_cmp_response_time
 };
 
 static bool select_connect_backend_servers(backend_ref_t **p_master_ref,
@@ -157,6 +166,9 @@ static bool select_connect_backend_servers(backend_ref_t **p_master_ref,
                                            ROUTER_INSTANCE *router,
                                            bool new_session);
 
+static bool route_streamed_packet(ROUTER_CLIENT_SES *rses, GWBUF *querybuf);
+static void connect_slave_on_demand(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+                                    int max_rlag);
 static bool get_dcb(DCB **dcb, ROUTER_CLIENT_SES *rses, backend_type_t btype,
                     char *name, int max_rlag);
 
@@ -224,12 +236,16 @@ static GWBUF *sescmd_cursor_process_replies(GWBUF *replybuf,
 static void tracelog_routed_query(ROUTER_CLIENT_SES *rses, char *funcname,
                                   backend_ref_t *bref, GWBUF *buf);
 
+static char *sescmd_history_key(GWBUF *buf, unsigned char packet_type);
+static void compact_sescmd_history(ROUTER_CLIENT_SES *rses, const char *key);
 static bool route_session_write(ROUTER_CLIENT_SES *router_client_ses,
                                 GWBUF *querybuf, ROUTER_INSTANCE *inst,
                                 unsigned char packet_type,
                                 qc_query_type_t qtype);
 
 static void refreshInstance(ROUTER_INSTANCE *router, CONFIG_PARAMETER *param);
+static void rwsplit_update_config(ROUTER_INSTANCE *router);
+static void rses_update_config(ROUTER_INSTANCE *router, ROUTER_CLIENT_SES *rses);
 
 static void bref_clear_state(backend_ref_t *bref, bref_state_t state);
 static void bref_set_state(backend_ref_t *bref, bref_state_t state);
@@ -256,7 +272,48 @@ static int hashkeyfun(void *key);
 static int hashcmpfun(void *, void *);
 static bool check_for_multi_stmt(ROUTER_CLIENT_SES *rses, GWBUF *buf,
                                  mysql_server_cmd_t packet_type);
+static bool is_pinned_to_master(ROUTER_CLIENT_SES *rses, GWBUF *buf);
+static bool is_read_only_trx(GWBUF *buf);
+static bool is_last_ok_packet(GWBUF *buf);
+static backend_ref_t *get_slave_by_response_time(ROUTER_CLIENT_SES *rses, int max_rlag);
+static backend_ref_t *get_caught_up_backend(ROUTER_CLIENT_SES *rses, int max_rlag);
+static int sescmd_cursor_pending(sescmd_cursor_t *scur);
+static bool sescmd_cursor_behind(sescmd_cursor_t *scur);
+static void bref_start_query(ROUTER_CLIENT_SES *rses, backend_ref_t *bref,
+                             service_latency_t type);
+static void bref_end_query(ROUTER_CLIENT_SES *rses, backend_ref_t *bref);
+static bool send_internal_query(backend_ref_t *bref, const char *sql, bref_internal_t type);
+static bool start_causal_read(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+                              backend_ref_t *bref, GWBUF *querybuf);
+static GWBUF *process_internal_reply(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+                                     backend_ref_t *bref, GWBUF *buf);
+static GWBUF *ps_process_prepare_reply(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+                                       backend_ref_t *bref, GWBUF *buf);
+static rwsplit_ps_t *ps_create(ROUTER_CLIENT_SES *rses, GWBUF *buf, qc_query_type_t qtype);
+static void ps_free(ROUTER_CLIENT_SES *rses, rwsplit_ps_t *ps);
+static rwsplit_ps_t *ps_lookup(ROUTER_CLIENT_SES *rses, GWBUF *buf);
+static int64_t ps_backend_id(ROUTER_CLIENT_SES *rses, rwsplit_ps_t *ps, backend_ref_t *bref);
+static void ps_set_id(GWBUF *buf, uint32_t id);
+static void ps_read_prepare_reply(ROUTER_CLIENT_SES *rses, backend_ref_t *bref, GWBUF *buf);
+static void ps_route_close(ROUTER_CLIENT_SES *rses, rwsplit_ps_t *ps, GWBUF *buf);
+static bool ps_route_fetch(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+                           rwsplit_ps_t *ps, GWBUF *buf);
+static GWBUF *ps_bind_params(ROUTER_CLIENT_SES *rses, rwsplit_ps_t *ps,
+                             backend_ref_t *bref, GWBUF *buf);
+static void ps_forget_backend(ROUTER_CLIENT_SES *rses, backend_ref_t *bref);
+static bool ps_prepare_lazily(ROUTER_CLIENT_SES *rses, backend_ref_t *bref,
+                              rwsplit_ps_t *ps, GWBUF *querybuf);
 static bool send_readonly_error(DCB *dcb);
+static bool mstmt_route(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses, GWBUF *querybuf);
+static void mstmt_process_reply(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+                                backend_ref_t *bref, GWBUF *buf);
+static void mstmt_fail_backend(ROUTER_CLIENT_SES *rses, backend_ref_t *bref);
+static void mstmt_free(rwsplit_mstmt_t *ms);
+static void hedge_start(ROUTER_CLIENT_SES *rses, backend_ref_t *bref, GWBUF *querybuf);
+static void hedge_timeout(void *data);
+static void hedge_choose(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses, backend_ref_t *bref);
+static GWBUF *hedge_drain_reply(ROUTER_CLIENT_SES *rses, backend_ref_t *bref, GWBUF *buf);
+static bool hedge_fail_backend(ROUTER_CLIENT_SES *rses, backend_ref_t *bref);
 
 static int hashkeyfun(void *key)
 {
@@ -471,10 +528,99 @@ static void refreshInstance(ROUTER_INSTANCE *router,
 #endif /*< NOT_USED */
 }
 
+/**
+ * Publish the configuration of the router to the sessions
+ *
+ * The caller must hold the router lock.
+ *
+ * @param router Router instance
+ */
+static void rwsplit_publish_config(ROUTER_INSTANCE *router)
+{
+    rwsplit_config_version_t *cfg = malloc(sizeof(rwsplit_config_version_t));
+
+    if (cfg)
+    {
+        cfg->config = router->rwsplit_config;
+        cfg->version = router->rwsplit_version;
+
+        rwsplit_config_version_t *old = __atomic_exchange_n(&router->rwsplit_published, cfg,
+                                                            __ATOMIC_ACQ_REL);
+        if (old)
+        {
+            dcb_retire(old, free);
+        }
+    }
+}
+
+/**
+ * Re-read the configuration of the router if the service has been reconfigured
+ *
+ * The caller must hold the router lock. The parameters of the service are
+ * read under the service lock as a reload may replace them.
+ *
+ * @param router Router instance
+ */
+static void rwsplit_update_config(ROUTER_INSTANCE *router)
+{
+    if (router->service->svc_config_version > router->rwsplit_version)
+    {
+        spinlock_acquire(&router->service->spin);
+        /** re-read all parameters to rwsplit config structure */
+        refreshInstance(router, NULL);
+        /** increment rwsplit router's config version number */
+        router->rwsplit_version = router->service->svc_config_version;
+        spinlock_release(&router->service->spin);
+        /** Read options */
+        rwsplit_process_router_options(router, router->service->routerOptions);
+        rwsplit_publish_config(router);
+    }
+}
+
+/**
+ * Pick up the changed configuration in a session
+ *
+ * The session copies the parameters that can change while it is connected:
+ * the ones that decide the slave for each query. The number of slave
+ * connections and the handling of the session commands stay as they were when
+ * the session was created. The published configuration is read without
+ * locking. The first session that notices a reconfiguration publishes it
+ * unless another thread holds the router lock, in which case it is picked up
+ * on a later query.
+ *
+ * @param router Router instance
+ * @param rses   Router session
+ */
+static void rses_update_config(ROUTER_INSTANCE *router, ROUTER_CLIENT_SES *rses)
+{
+    if (router->service->svc_config_version > router->rwsplit_version &&
+        spinlock_acquire_nowait(&router->lock))
+    {
+        rwsplit_update_config(router);
+        spinlock_release(&router->lock);
+    }
+
+    rwsplit_config_version_t *cfg = __atomic_load_n(&router->rwsplit_published, __ATOMIC_ACQUIRE);
+
+    if (cfg && cfg->version != rses->rses_config_version)
+    {
+        rses->rses_config.rw_max_slave_replication_lag = cfg->config.rw_max_slave_replication_lag;
+        rses->rses_config.rw_slave_select_criteria = cfg->config.rw_slave_select_criteria;
+        rses->rses_config.rw_master_reads = cfg->config.rw_master_reads;
+        rses->rses_config.rw_master_failure_mode = cfg->config.rw_master_failure_mode;
+        rses->rses_config.rw_causal_reads_timeout = cfg->config.rw_causal_reads_timeout;
+        rses->rses_config.rw_hedged_reads = cfg->config.rw_hedged_reads;
+        rses->rses_config.rw_hedge_delay = cfg->config.rw_hedge_delay;
+        rses->rses_config.rw_hedge_budget = cfg->config.rw_hedge_budget;
+        rses->rses_config_version = cfg->version;
+    }
+}
+
 static inline void free_rwsplit_instance(ROUTER_INSTANCE *router)
 {
     if (router)
     {
+        free(router->rwsplit_published);
         if (router->servers)
         {
             for (int i = 0; router->servers[i]; i++)
@@ -483,6 +629,16 @@ static inline void free_rwsplit_instance(ROUTER_INSTANCE *router)
             }
         }
         free(router->servers);
+        ts_stats_free(router->stats.n_sessions);
+        ts_stats_free(router->stats.n_queries);
+        ts_stats_free(router->stats.n_master);
+        ts_stats_free(router->stats.n_slave);
+        ts_stats_free(router->stats.n_all);
+        ts_stats_free(router->stats.n_causal_waits);
+        ts_stats_free(router->stats.n_causal_timeouts);
+        ts_stats_free(router->stats.n_hedges);
+        ts_stats_free(router->stats.n_hedge_wins);
+        ts_stats_free(router->stats.n_sescmd_noop);
         free(router);
     }
 }
@@ -511,6 +667,21 @@ static ROUTER *createInstance(SERVICE *service, char **options)
     router->service = service;
     spinlock_init(&router->lock);
 
+    if ((router->stats.n_sessions = ts_stats_alloc()) == NULL ||
+        (router->stats.n_queries = ts_stats_alloc()) == NULL ||
+        (router->stats.n_master = ts_stats_alloc()) == NULL ||
+        (router->stats.n_slave = ts_stats_alloc()) == NULL ||
+        (router->stats.n_all = ts_stats_alloc()) == NULL ||
+        (router->stats.n_causal_waits = ts_stats_alloc()) == NULL ||
+        (router->stats.n_causal_timeouts = ts_stats_alloc()) == NULL ||
+        (router->stats.n_hedges = ts_stats_alloc()) == NULL ||
+        (router->stats.n_hedge_wins = ts_stats_alloc()) == NULL ||
+        (router->stats.n_sescmd_noop = ts_stats_alloc()) == NULL)
+    {
+        free_rwsplit_instance(router);
+        return NULL;
+    }
+
     /** Calculate number of servers */
     sref = service->dbref;
     nservers = 0;
@@ -643,6 +814,9 @@ static ROUTER *createInstance(SERVICE *service, char **options)
      * failure is detected */
     router->rwsplit_config.rw_master_failure_mode = RW_FAIL_INSTANTLY;
 
+    router->rwsplit_config.rw_causal_reads_timeout = RW_CAUSAL_READS_DEFAULT_TIMEOUT;
+    router->rwsplit_config.rw_hedge_budget = RW_HEDGE_DEFAULT_BUDGET;
+
     /** Call this before refreshInstance */
     if (options && !rwsplit_process_router_options(router, options))
     {
@@ -698,6 +872,8 @@ static ROUTER *createInstance(SERVICE *service, char **options)
     {
         refreshInstance(router, param);
     }
+    rwsplit_publish_config(router);
+
     /**
      * We have completed the creation of the router data, so now
      * insert this router into the linked list of routers
@@ -749,23 +925,17 @@ static void *newSession(ROUTER *router_inst, SESSION *session)
 
     client_rses->router = router;
     client_rses->client_dcb = session->client_dcb;
+    poll_timer_init(&client_rses->rses_hedge.h_timer, hedge_timeout, client_rses);
     /**
      * If service config has been changed, reload config from service to
      * router instance first.
      */
     spinlock_acquire(&router->lock);
 
-    if (router->service->svc_config_version > router->rwsplit_version)
-    {
-        /** re-read all parameters to rwsplit config structure */
-        refreshInstance(router, NULL); /*< scan through all parameters */
-        /** increment rwsplit router's config version number */
-        router->rwsplit_version = router->service->svc_config_version;
-        /** Read options */
-        rwsplit_process_router_options(router, router->service->routerOptions);
-    }
+    rwsplit_update_config(router);
     /** Copy config struct from router instance */
     memcpy(&client_rses->rses_config, &router->rwsplit_config, sizeof(rwsplit_config_t));
+    client_rses->rses_config_version = router->rwsplit_version;
 
     spinlock_release(&router->lock);
     /**
@@ -820,6 +990,7 @@ static void *newSession(ROUTER *router_inst, SESSION *session)
     max_slave_rlag = rses_get_max_replication_lag(client_rses);
 
     spinlock_init(&client_rses->rses_lock);
+    spinlock_set_name(&client_rses->rses_lock, "readwritesplit rses_lock");
     client_rses->rses_backend_ref = backend_ref;
 
     /**
@@ -836,11 +1007,27 @@ static void *newSession(ROUTER *router_inst, SESSION *session)
         client_rses = NULL;
         goto return_rses;
     }
+    /**
+     * With lazy connections the slaves are connected when the reads need
+     * them and the session command history brings them up to date. One slave
+     * is connected at the start if there is no master.
+     */
+    bool lazy = client_rses->rses_config.rw_lazy_connect &&
+        !client_rses->rses_config.rw_disable_sescmd_hist;
+
     succp = select_connect_backend_servers(&master_ref, backend_ref, router_nservers,
-                                           max_nslaves, max_slave_rlag,
+                                           lazy ? 0 : max_nslaves, max_slave_rlag,
                                            client_rses->rses_config.rw_slave_select_criteria,
                                            session, router, false);
 
+    if (succp && lazy && (master_ref == NULL || !BREF_IS_IN_USE(master_ref)))
+    {
+        succp = select_connect_backend_servers(&master_ref, backend_ref, router_nservers,
+                                               MIN(1, max_nslaves), max_slave_rlag,
+                                               client_rses->rses_config.rw_slave_select_criteria,
+                                               session, router, true);
+    }
+
     rses_end_locked_router_action(client_rses);
 
     /**
@@ -860,6 +1047,7 @@ static void *newSession(ROUTER *router_inst, SESSION *session)
     client_rses->rses_master_ref = master_ref;
     client_rses->rses_backend_ref = backend_ref;
     client_rses->rses_nbackends = router_nservers; /*< # of backend servers */
+    client_rses->rses_confined = poll_session_confined(session);
 
     if (client_rses->rses_config.rw_max_slave_conn_percent)
     {
@@ -869,7 +1057,7 @@ static void *newSession(ROUTER *router_inst, SESSION *session)
         client_rses->rses_config.rw_max_slave_conn_count = n_conn;
     }
 
-    router->stats.n_sessions += 1;
+    ts_stats_add(router->stats.n_sessions, 1);
 
     /**
      * Version is bigger than zero once initialized.
@@ -1053,6 +1241,26 @@ static void freeSession(ROUTER *router_instance, void *router_client_session)
      * all the memory and other resources associated
      * to the client session.
      */
+    /** Waits for the timer if it is expiring in another thread */
+    poll_timer_stop(&router_cli_ses->rses_hedge.h_timer);
+    gwbuf_free(router_cli_ses->rses_hedge.h_query);
+
+    for (i = 0; i < router_cli_ses->rses_nbackends; i++)
+    {
+        gwbuf_free(router_cli_ses->rses_backend_ref[i].bref_causal_query);
+        gwbuf_free(router_cli_ses->rses_backend_ref[i].bref_ps_exec);
+    }
+
+    while (router_cli_ses->rses_ps)
+    {
+        ps_free(router_cli_ses, router_cli_ses->rses_ps);
+    }
+    flatmap_free(router_cli_ses->rses_ps_map);
+
+    if (router_cli_ses->rses_mstmt)
+    {
+        mstmt_free(router_cli_ses->rses_mstmt);
+    }
     free(router_cli_ses->rses_backend_ref);
     free(router_cli_ses);
     return;
@@ -1090,6 +1298,62 @@ static void close_failed_bref(backend_ref_t *bref, bool fatal)
         gwbuf_free(bref->bref_pending_cmd);
         bref->bref_pending_cmd = NULL;
     }
+
+    if (bref->bref_causal_query)
+    {
+        gwbuf_free(bref->bref_causal_query);
+        bref->bref_causal_query = NULL;
+    }
+
+    if (bref->bref_ps_exec)
+    {
+        gwbuf_free(bref->bref_ps_exec);
+        bref->bref_ps_exec = NULL;
+    }
+
+    bref->bref_gtid_after_reply = false;
+    bref->bref_internal = BREF_INTERNAL_NONE;
+    bref->bref_gtid[0] = '\0';
+
+    /** A new connection to the server does not know the statements */
+    ps_forget_backend(bref->bref_sescmd_cur.scmd_cur_rses, bref);
+
+    if (bref->bref_mstmt_active)
+    {
+        mstmt_fail_backend(bref->bref_sescmd_cur.scmd_cur_rses, bref);
+    }
+
+    hedge_fail_backend(bref->bref_sescmd_cur.scmd_cur_rses, bref);
+}
+
+/**
+ * Check whether the replication lag of a server is within the limit
+ *
+ * The lag in milliseconds is used when the monitor measures it so that a
+ * slave that is 1.5 seconds behind isn't used with a limit of one second.
+ *
+ * @param server   The server
+ * @param max_rlag Maximum replication lag in seconds or MAX_RLAG_UNDEFINED
+ * @return True if the server can be used with the limit
+ */
+static inline bool rlag_within_limit(const SERVER *server, int max_rlag)
+{
+    if (max_rlag == MAX_RLAG_UNDEFINED)
+    {
+        return true;
+    }
+
+    if (server->rlag == MAX_RLAG_NOT_AVAILABLE)
+    {
+        return false;
+    }
+
+    if (server->rlag_ms >= 0)
+    {
+        return (int64_t)server->rlag_ms <= (int64_t)max_rlag * 1000;
+    }
+
+    return server->rlag <= max_rlag;
 }
 
 /**
@@ -1164,6 +1428,19 @@ static bool get_dcb(DCB **p_dcb, ROUTER_CLIENT_SES *rses, backend_type_t btype,
         }
     }
 
+    if (btype == BE_SLAVE &&
+        rses->rses_config.rw_slave_select_criteria == LEAST_RESPONSE_TIME)
+    {
+        backend_ref_t *bref = get_slave_by_response_time(rses, max_rlag);
+
+        if (bref)
+        {
+            *p_dcb = bref->bref_dcb;
+            succp = true;
+            goto return_succp;
+        }
+    }
+
     if (btype == BE_SLAVE)
     {
         backend_ref_t *candidate_bref = NULL;
@@ -1205,9 +1482,7 @@ static bool get_dcb(DCB **p_dcb, ROUTER_CLIENT_SES *rses, backend_type_t btype,
                  * or that candidate's lag doesn't exceed the
                  * maximum allowed replication lag.
                  */
-                else if (max_rlag == MAX_RLAG_UNDEFINED ||
-                         (b->backend_server->rlag != MAX_RLAG_NOT_AVAILABLE &&
-                          b->backend_server->rlag <= max_rlag))
+                else if (rlag_within_limit(b->backend_server, max_rlag))
                 {
                     /** found slave */
                     candidate_bref = &backend_ref[i];
@@ -1220,9 +1495,7 @@ static bool get_dcb(DCB **p_dcb, ROUTER_CLIENT_SES *rses, backend_type_t btype,
              * replication lag limits replaces it.
              */
             else if (SERVER_IS_MASTER(&candidate) && SERVER_IS_SLAVE(&server) &&
-                     (max_rlag == MAX_RLAG_UNDEFINED ||
-                      (b->backend_server->rlag != MAX_RLAG_NOT_AVAILABLE &&
-                       b->backend_server->rlag <= max_rlag)) &&
+                     rlag_within_limit(b->backend_server, max_rlag) &&
                      !rses->rses_config.rw_master_reads)
             {
                 /** found slave */
@@ -1238,9 +1511,7 @@ static bool get_dcb(DCB **p_dcb, ROUTER_CLIENT_SES *rses, backend_type_t btype,
             else if (SERVER_IS_SLAVE(&server) ||
                      (rses->rses_config.rw_master_reads && SERVER_IS_MASTER(&server)))
             {
-                if (max_rlag == MAX_RLAG_UNDEFINED ||
-                    (b->backend_server->rlag != MAX_RLAG_NOT_AVAILABLE &&
-                     b->backend_server->rlag <= max_rlag))
+                if (rlag_within_limit(b->backend_server, max_rlag))
                 {
                     candidate_bref =
                         check_candidate_bref(candidate_bref, &backend_ref[i],
@@ -1251,9 +1522,10 @@ static bool get_dcb(DCB **p_dcb, ROUTER_CLIENT_SES *rses, backend_type_t btype,
                 else
                 {
                     MXS_INFO("Server %s:%d is too much behind the "
-                             "master, %d s. and can't be chosen.",
+                             "master, %d ms. and can't be chosen.",
                              b->backend_server->name, b->backend_server->port,
-                             b->backend_server->rlag);
+                             b->backend_server->rlag_ms >= 0 ? b->backend_server->rlag_ms :
+                             b->backend_server->rlag * 1000);
                 }
             }
         } /*<  for */
@@ -1532,7 +1804,9 @@ static route_target_t get_route_target(ROUTER_CLIENT_SES *rses,
 
 /**
  * Check if the query is a DROP TABLE... query and
- * if it targets a temporary table, remove it from the hashtable.
+ * if it targets a temporary table, remove it from the set of temporary tables.
+ * When the last one is dropped, the queries of the session are no longer
+ * checked for temporary tables.
  * @param router_cli_ses Router client session
  * @param querybuf GWBUF containing the query
  * @param type The type of the query resolved so far
@@ -1541,9 +1815,10 @@ void check_drop_tmp_table(ROUTER_CLIENT_SES *router_cli_ses, GWBUF *querybuf,
                           qc_query_type_t type)
 {
 
-    int tsize = 0, klen = 0, i;
+    int tsize = 0, i;
     char **tbl = NULL;
-    char *hkey, *dbname;
+    char *dbname;
+    char hkey[MYSQL_DATABASE_MAXLEN + MYSQL_TABLE_MAXLEN + 2];
     MYSQL_session *data;
     rses_property_t *rses_prop_tmp;
 
@@ -1579,25 +1854,25 @@ void check_drop_tmp_table(ROUTER_CLIENT_SES *router_cli_ses, GWBUF *querybuf,
         {
             for (i = 0; i < tsize; i++)
             {
-                klen = strlen(dbname) + strlen(tbl[i]) + 2;
-                hkey = calloc(klen, sizeof(char));
-                strcpy(hkey, dbname);
-                strcat(hkey, ".");
-                strcat(hkey, tbl[i]);
+                snprintf(hkey, sizeof(hkey), "%s.%s", dbname, tbl[i]);
 
                 if (rses_prop_tmp && rses_prop_tmp->rses_prop_data.temp_tables)
                 {
-                    if (hashtable_delete(rses_prop_tmp->rses_prop_data.temp_tables,
-                                         (void *)hkey))
+                    if (flatmap_delete(rses_prop_tmp->rses_prop_data.temp_tables,
+                                       (void *)hkey))
                     {
                         MXS_INFO("Temporary table dropped: %s", hkey);
                     }
                 }
                 free(tbl[i]);
-                free(hkey);
             }
 
             free(tbl);
+
+            if (rses_prop_tmp && flatmap_size(rses_prop_tmp->rses_prop_data.temp_tables) == 0)
+            {
+                router_cli_ses->have_tmp_tables = false;
+            }
         }
     }
 }
@@ -1660,10 +1935,10 @@ static bool is_read_tmp_table(ROUTER_CLIENT_SES *router_cli_ses,
             /** Query targets at least one table */
             for (i = 0; i < tsize && !target_tmp_table && tbl[i]; i++)
             {
-                sprintf(hkey, "%s.%s", dbname, tbl[i]);
+                snprintf(hkey, sizeof(hkey), "%s.%s", dbname, tbl[i]);
                 if (rses_prop_tmp && rses_prop_tmp->rses_prop_data.temp_tables)
                 {
-                    if (hashtable_fetch(rses_prop_tmp->rses_prop_data.temp_tables, hkey))
+                    if (flatmap_fetch(rses_prop_tmp->rses_prop_data.temp_tables, hkey))
                     {
                         /**Query target is a temporary table*/
                         rval = true;
@@ -1704,11 +1979,11 @@ static void check_create_tmp_table(ROUTER_CLIENT_SES *router_cli_ses,
         return;
     }
 
-    int klen = 0;
     char *hkey, *dbname;
+    char keybuf[MYSQL_DATABASE_MAXLEN + MYSQL_TABLE_MAXLEN + 2];
     MYSQL_session *data;
     rses_property_t *rses_prop_tmp;
-    HASHTABLE *h;
+    FLATMAP *h;
 
     if (router_cli_ses == NULL || querybuf == NULL)
     {
@@ -1743,11 +2018,8 @@ static void check_create_tmp_table(ROUTER_CLIENT_SES *router_cli_ses,
 
     if (tblname && strlen(tblname) > 0)
     {
-        klen = strlen(dbname) + strlen(tblname) + 2;
-        hkey = calloc(klen, sizeof(char));
-        strcpy(hkey, dbname);
-        strcat(hkey, ".");
-        strcat(hkey, tblname);
+        snprintf(keybuf, sizeof(keybuf), "%s.%s", dbname, tblname);
+        hkey = keybuf;
     }
     else
     {
@@ -1777,27 +2049,29 @@ static void check_create_tmp_table(ROUTER_CLIENT_SES *router_cli_ses,
     {
         if (rses_prop_tmp->rses_prop_data.temp_tables == NULL)
         {
-            h = hashtable_alloc(7, hashkeyfun, hashcmpfun);
-            hashtable_memory_fns(h, hstrdup, NULL, hfree, NULL);
+            /** A session rarely has more than a few temporary tables */
+            h = flatmap_alloc(8, hashkeyfun, hashcmpfun);
             if (h != NULL)
             {
+                flatmap_memory_fns(h, hstrdup, NULL, hfree, NULL);
                 rses_prop_tmp->rses_prop_data.temp_tables = h;
             }
             else
             {
-                MXS_ERROR("Failed to allocate a new hashtable.");
+                MXS_ERROR("Failed to allocate the set of temporary tables.");
             }
         }
 
         if (hkey && rses_prop_tmp->rses_prop_data.temp_tables &&
-            hashtable_add(rses_prop_tmp->rses_prop_data.temp_tables, (void *)hkey,
-                          (void *)is_temp) == 0) /*< Conflict in hash table */
+            flatmap_add(rses_prop_tmp->rses_prop_data.temp_tables, (void *)hkey,
+                        (void *)is_temp) == 0) /*< Already in the set */
         {
-            MXS_INFO("Temporary table conflict in hashtable: %s", hkey);
+            MXS_INFO("Temporary table conflict in the set of temporary tables: %s", hkey);
         }
 #if defined(SS_DEBUG)
+        if (hkey)
         {
-            bool retkey = hashtable_fetch(rses_prop_tmp->rses_prop_data.temp_tables, hkey);
+            bool retkey = flatmap_fetch(rses_prop_tmp->rses_prop_data.temp_tables, hkey);
             if (retkey)
             {
                 MXS_INFO("Temporary table added: %s", hkey);
@@ -1806,7 +2080,6 @@ static void check_create_tmp_table(ROUTER_CLIENT_SES *router_cli_ses,
 #endif
     }
 
-    free(hkey);
     free(tblname);
 }
 
@@ -1856,6 +2129,11 @@ static int routeQuery(ROUTER *instance, void *router_session, GWBUF *querybuf)
 
     CHK_CLIENT_RSES(rses);
 
+    if (rses->rses_config_version != inst->service->svc_config_version)
+    {
+        rses_update_config(inst, rses);
+    }
+
     if (rses->rses_closed)
     {
         uint8_t* data = GWBUF_DATA(querybuf);
@@ -1868,6 +2146,13 @@ static int routeQuery(ROUTER *instance, void *router_session, GWBUF *querybuf)
             free(query_str);
         }
     }
+    else if (rses->rses_stream_target &&
+             (rses->rses_large_query ||
+              (rses->rses_load_active && gwbuf_length(querybuf) > MYSQL_HEADER_LEN)))
+    {
+        rval = route_streamed_packet(rses, querybuf) ? 1 : 0;
+        querybuf = NULL;
+    }
     else
     {
         if (GWBUF_IS_TYPE_UNDEFINED(querybuf))
@@ -1900,6 +2185,54 @@ static int routeQuery(ROUTER *instance, void *router_session, GWBUF *querybuf)
     return rval;
 }
 
+/**
+ * Forward a packet that continues a large statement or carries the file of a
+ * LOAD DATA LOCAL INFILE
+ *
+ * The packet goes to the backend that got the start of the statement as it
+ * is. It is not classified and it is not made contiguous, so the data streams
+ * through without being parsed or copied. The flow control of the backend
+ * connection bounds how much of it is buffered.
+ *
+ * @param rses     Router client session
+ * @param querybuf The packet, freed by this function
+ * @return True if the packet was written
+ */
+static bool route_streamed_packet(ROUTER_CLIENT_SES *rses, GWBUF *querybuf)
+{
+    uint8_t header[MYSQL_HEADER_LEN];
+    bool succp = false;
+
+    gwbuf_copy_data(querybuf, 0, MYSQL_HEADER_LEN, header);
+
+    if (rses_begin_locked_router_action(rses))
+    {
+        backend_ref_t *bref = rses->rses_stream_target;
+
+        if (BREF_IS_IN_USE(bref))
+        {
+            if (rses->rses_load_active)
+            {
+                rses->rses_load_data_sent += gwbuf_length(querybuf);
+            }
+            succp = bref->bref_dcb->func.write(bref->bref_dcb, querybuf) == 1;
+            querybuf = NULL;
+        }
+        else
+        {
+            MXS_ERROR("The server %s:%d that received the start of the statement is "
+                      "no longer available.", bref->bref_backend->backend_server->name,
+                      bref->bref_backend->backend_server->port);
+        }
+
+        rses->rses_large_query = gw_mysql_get_byte3(header) == GW_MYSQL_MAX_PACKET_LEN;
+        rses_end_locked_router_action(rses);
+    }
+
+    gwbuf_free(querybuf);
+    return succp;
+}
+
 /**
  * @brief Log master write failure
  *
@@ -1981,10 +2314,16 @@ static bool route_single_stmt(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
     bool succp = false;
     int rlag_max = MAX_RLAG_UNDEFINED;
     backend_type_t btype; /*< target backend type */
+    bool pinned = false; /*< Routed to the master without classification */
+    bool ro_trx_end = false; /*< The statement ends a read-only transaction */
+    rwsplit_ps_t *ps = NULL; /*< The prepared statement the packet refers to */
+    GWBUF *ps_execbuf = NULL; /*< The execution with the parameter types added */
 
     ss_dassert(querybuf->next == NULL); // The buffer must be contiguous.
     ss_dassert(!GWBUF_IS_TYPE_UNDEFINED(querybuf));
 
+    QUERY_TRACE_POINT(rses->client_dcb->session, QTRACE_ROUTE);
+
     packet = GWBUF_DATA(querybuf);
     packet_len = gw_mysql_get_byte3(packet);
 
@@ -2022,7 +2361,20 @@ static bool route_single_stmt(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
                 break;
 
             case MYSQL_COM_QUERY:
-                qtype = qc_get_type(querybuf);
+                if (is_pinned_to_master(rses, querybuf))
+                {
+                    /** The statement goes to the master whatever its type */
+                    pinned = true;
+                }
+                else if (rses->have_tmp_tables)
+                {
+                    /** The temporary table checks need the table names */
+                    qc_parse(querybuf, QC_COLLECT_TABLES);
+                }
+                if (!pinned)
+                {
+                    qtype = qc_get_type(querybuf);
+                }
                 break;
 
             case MYSQL_COM_STMT_PREPARE:
@@ -2063,6 +2415,15 @@ static bool route_single_stmt(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
          * effective since we don't have a node to force queries to. In this
          * situation, assigning QUERY_TYPE_WRITE for the query will trigger
          * the error processing. */
+        if (rses->rses_config.rw_split_multi_stmt && packet_type == MYSQL_COM_QUERY &&
+            packet_len < GW_MYSQL_MAX_PACKET_LEN && !pinned && mstmt_route(inst, rses, querybuf))
+        {
+            /** The statements of a read-only batch were sent to the slaves */
+            rses_end_locked_router_action(rses);
+            succp = true;
+            goto retblock;
+        }
+
         if (check_for_multi_stmt(rses, querybuf, packet_type) &&
             rses->rses_master_ref == NULL)
         {
@@ -2072,7 +2433,7 @@ static bool route_single_stmt(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
         /**
          * Check if the query has anything to do with temporary tables.
          */
-        if (rses->have_tmp_tables &&
+        if (rses->have_tmp_tables && !pinned &&
             (packet_type == MYSQL_COM_QUERY || packet_type == MYSQL_COM_DROP_DB))
         {
             check_drop_tmp_table(rses, querybuf, qtype);
@@ -2083,6 +2444,23 @@ static bool route_single_stmt(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
         }
         check_create_tmp_table(rses, querybuf, qtype);
 
+        if (rses->rses_config.rw_route_prepared_reads &&
+            (packet_type == MYSQL_COM_STMT_EXECUTE ||
+             packet_type == MYSQL_COM_STMT_SEND_LONG_DATA) &&
+            (ps = ps_lookup(rses, querybuf)))
+        {
+            if (packet_type == MYSQL_COM_STMT_SEND_LONG_DATA)
+            {
+                /** The data is only sent to the master, execute there */
+                ps->ps_read_only = false;
+            }
+            else if (ps->ps_read_only)
+            {
+                /** The statement was classified when it was prepared */
+                qtype = QUERY_TYPE_READ;
+            }
+        }
+
         /**
          * Check if this is a LOAD DATA LOCAL INFILE query. If so, send all queries
          * to the master until the last, empty packet arrives.
@@ -2091,7 +2469,7 @@ static bool route_single_stmt(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
         {
             rses->rses_load_data_sent += gwbuf_length(querybuf);
         }
-        else if (packet_type == MYSQL_COM_QUERY)
+        else if (packet_type == MYSQL_COM_QUERY && !pinned)
         {
             qc_query_op_t queryop = qc_get_operation(querybuf);
             if (queryop == QUERY_OP_LOAD)
@@ -2121,6 +2499,14 @@ static bool route_single_stmt(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
                  QUERY_IS_TYPE(qtype, QUERY_TYPE_BEGIN_TRX))
         {
             rses->rses_transaction_active = true;
+
+            if (rses->rses_config.rw_route_read_only_trx &&
+                packet_type == MYSQL_COM_QUERY && is_read_only_trx(querybuf))
+            {
+                /** The whole transaction is routed to one slave */
+                rses->rses_trx_read_only = true;
+                rses->rses_trx_target = NULL;
+            }
         }
         /**
          * Explicit COMMIT and ROLLBACK, implicit COMMIT.
@@ -2130,6 +2516,7 @@ static bool route_single_stmt(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
              QUERY_IS_TYPE(qtype, QUERY_TYPE_ROLLBACK)))
         {
             rses->rses_transaction_active = false;
+            ro_trx_end = rses->rses_trx_read_only;
         }
         else if (!rses->rses_autocommit_enabled &&
                  QUERY_IS_TYPE(qtype, QUERY_TYPE_ENABLE_AUTOCOMMIT))
@@ -2182,6 +2569,10 @@ static bool route_single_stmt(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
          *   eventually to master
          */
         route_target = get_route_target(rses, qtype, querybuf->hint);
+        TRACE_EVENT(TRACE_ROUTE_QUERY, dcb_get_session_id(rses->client_dcb), packet_type, route_target);
+        MXS_PROBE4(rwsplit_route_target, dcb_get_session_id(rses->client_dcb), packet_type,
+                   qtype, route_target);
+        QUERY_TRACE_POINT(rses->client_dcb->session, QTRACE_CLASSIFIED);
 
         if (TARGET_IS_ALL(route_target))
         {
@@ -2247,7 +2638,7 @@ static bool route_single_stmt(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
 
             if (succp)
             {
-                atomic_add(&inst->stats.n_all, 1);
+                ts_stats_add(inst->stats.n_all, 1);
             }
             goto retblock;
         }
@@ -2271,12 +2662,70 @@ static bool route_single_stmt(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
 
     DCB *master_dcb = rses->rses_master_ref ? rses->rses_master_ref->bref_dcb : NULL;
 
+    ps = NULL;
+
+    if (rses->rses_config.rw_route_prepared_reads &&
+        (packet_type == MYSQL_COM_STMT_EXECUTE || packet_type == MYSQL_COM_STMT_CLOSE ||
+         packet_type == MYSQL_COM_STMT_RESET || packet_type == MYSQL_COM_STMT_SEND_LONG_DATA ||
+         packet_type == MYSQL_COM_STMT_FETCH) &&
+        (ps = ps_lookup(rses, querybuf)) &&
+        (packet_type == MYSQL_COM_STMT_CLOSE || packet_type == MYSQL_COM_STMT_FETCH))
+    {
+        if (packet_type == MYSQL_COM_STMT_CLOSE)
+        {
+            /** Each backend knows the statement by its own ID */
+            ps_route_close(rses, ps, querybuf);
+            succp = true;
+        }
+        else
+        {
+            /** The cursor is on the backend that executed the statement */
+            succp = ps_route_fetch(inst, rses, ps, querybuf);
+        }
+        rses_end_locked_router_action(rses);
+        goto retblock;
+    }
+
+    if (rses->rses_trx_read_only)
+    {
+        route_target = TARGET_SLAVE;
+    }
+
+    if (rses->rses_config.rw_causal_reads && rses->rses_gtid_pending &&
+        route_target == TARGET_SLAVE)
+    {
+        /** The position of the last write is not yet known */
+        route_target = TARGET_MASTER;
+    }
+
+    if (rses->rses_trx_read_only && rses->rses_trx_target)
+    {
+        /** The rest of a read-only transaction goes where it was started */
+        if (BREF_IS_IN_USE(rses->rses_trx_target))
+        {
+            target_dcb = rses->rses_trx_target->bref_dcb;
+            succp = true;
+        }
+        else
+        {
+            GWBUF *err = modutil_create_mysql_err_msg(1, 0, 1927, "08S01",
+                                                      "Lost connection to the server "
+                                                      "running the read-only transaction");
+            MXS_ERROR("The server running a read-only transaction was lost.");
+            rses->rses_trx_read_only = false;
+            rses->rses_trx_target = NULL;
+            rses->rses_transaction_active = false;
+            succp = err && SESSION_ROUTE_REPLY(rses->client_dcb->session, err) == 1;
+            rses_end_locked_router_action(rses);
+            goto retblock;
+        }
+    }
     /**
      * There is a hint which either names the target backend or
      * hint which sets maximum allowed replication lag for the
      * backend.
      */
-    if (TARGET_IS_NAMED_SERVER(route_target) ||
+    else if (TARGET_IS_NAMED_SERVER(route_target) ||
         TARGET_IS_RLAG_MAX(route_target))
     {
         HINT *hint;
@@ -2351,6 +2800,11 @@ static bool route_single_stmt(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
         {
             rlag_max = rses_get_max_replication_lag(rses);
         }
+
+        if (rses->rses_config.rw_lazy_connect)
+        {
+            connect_slave_on_demand(inst, rses, rlag_max);
+        }
         /**
          * Search suitable backend server, get DCB in target_dcb
          */
@@ -2361,7 +2815,7 @@ static bool route_single_stmt(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
 #if defined(SS_EXTRA_DEBUG)
             MXS_INFO("Found DCB for slave.");
 #endif
-            atomic_add(&inst->stats.n_slave, 1);
+            ts_stats_add(inst->stats.n_slave, 1);
         }
         else
         {
@@ -2376,7 +2830,7 @@ static bool route_single_stmt(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
 
         if (succp && master_dcb == curr_master_dcb)
         {
-            atomic_add(&inst->stats.n_master, 1);
+            ts_stats_add(inst->stats.n_master, 1);
             target_dcb = master_dcb;
         }
         else
@@ -2405,12 +2859,110 @@ static bool route_single_stmt(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
         }
     }
 
+    if (succp && rses->rses_trx_read_only && rses->rses_trx_target == NULL)
+    {
+        rses->rses_trx_target = get_bref_from_dcb(rses, target_dcb);
+    }
+
     if (succp) /*< Have DCB of the target backend */
     {
         backend_ref_t *bref;
         sescmd_cursor_t *scur;
 
         bref = get_bref_from_dcb(rses, target_dcb);
+
+        if (rses->rses_config.rw_pipeline_sescmd && route_target == TARGET_SLAVE &&
+            !rses->rses_trx_read_only && bref != rses->rses_master_ref && sescmd_cursor_behind(&bref->bref_sescmd_cur))
+        {
+            /** Don't wait for the slave, read from a backend that is up to date */
+            backend_ref_t *other = get_caught_up_backend(rses, rlag_max);
+
+            if (other)
+            {
+                if (other == rses->rses_master_ref)
+                {
+                    ts_stats_add(inst->stats.n_slave, -1);
+                    ts_stats_add(inst->stats.n_master, 1);
+                }
+                bref = other;
+                target_dcb = other->bref_dcb;
+            }
+        }
+
+        if (bref != rses->rses_master_ref && !sescmd_cursor_is_active(&bref->bref_sescmd_cur) &&
+            sescmd_cursor_behind(&bref->bref_sescmd_cur))
+        {
+            /** The session commands were executed only on the master, replay them first */
+            if (rses->rses_sescmd_noop)
+            {
+                compact_sescmd_history(rses, NULL);
+            }
+
+            if (sescmd_cursor_behind(&bref->bref_sescmd_cur))
+            {
+                bref_set_state(bref, BREF_WAITING_RESULT);
+
+                if (!execute_sescmd_in_backend(bref))
+                {
+                    MXS_ERROR("Failed to execute session command in %s:%d",
+                              bref->bref_backend->backend_server->name,
+                              bref->bref_backend->backend_server->port);
+                }
+            }
+        }
+
+        if (ps)
+        {
+            backend_ref_t *master = rses->rses_master_ref;
+
+            if (ps_backend_id(rses, ps, bref) < 0 && bref != master &&
+                master && BREF_IS_IN_USE(master) && ps_backend_id(rses, ps, master) >= 0 &&
+                (packet_type != MYSQL_COM_STMT_EXECUTE ||
+                 sescmd_cursor_is_active(&bref->bref_sescmd_cur) ||
+                 bref->bref_internal != BREF_INTERNAL_NONE))
+            {
+                /** The statement can't be prepared on the slave right now */
+                if (route_target == TARGET_SLAVE)
+                {
+                    ts_stats_add(inst->stats.n_slave, -1);
+                    ts_stats_add(inst->stats.n_master, 1);
+                }
+                bref = master;
+                target_dcb = master->bref_dcb;
+            }
+
+            if (ps_backend_id(rses, ps, bref) >= 0)
+            {
+                ps_set_id(querybuf, ps_backend_id(rses, ps, bref));
+
+                if (packet_type == MYSQL_COM_STMT_EXECUTE &&
+                    (ps_execbuf = ps_bind_params(rses, ps, bref, querybuf)))
+                {
+                    querybuf = ps_execbuf;
+                }
+            }
+            else if (packet_type == MYSQL_COM_STMT_EXECUTE &&
+                     !sescmd_cursor_is_active(&bref->bref_sescmd_cur) &&
+                     bref->bref_internal == BREF_INTERNAL_NONE)
+            {
+                succp = ps_prepare_lazily(rses, bref, ps, querybuf);
+                rses_end_locked_router_action(rses);
+                goto retblock;
+            }
+            else if (packet_type == MYSQL_COM_STMT_EXECUTE)
+            {
+                GWBUF *err = modutil_create_mysql_err_msg(1, 0, 1243, "HY000",
+                                                          "The prepared statement could not "
+                                                          "be prepared on the target server");
+                MXS_ERROR("Prepared statement %u is not prepared on %s:%d.", ps->ps_client_id,
+                          bref->bref_backend->backend_server->name,
+                          bref->bref_backend->backend_server->port);
+                succp = err && SESSION_ROUTE_REPLY(rses->client_dcb->session, err) == 1;
+                rses_end_locked_router_action(rses);
+                goto retblock;
+            }
+        }
+
         scur = &bref->bref_sescmd_cur;
 
         ss_dassert(target_dcb != NULL);
@@ -2430,27 +2982,69 @@ static bool route_single_stmt(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
             goto retblock;
         }
 
-        if ((ret = target_dcb->func.write(target_dcb, gwbuf_clone(querybuf))) == 1)
+        if (bref != rses->rses_master_ref && rses->rses_config.rw_causal_reads &&
+            *rses->rses_gtid && strcmp(bref->bref_gtid, rses->rses_gtid) != 0)
+        {
+            /** The slave must first catch up with the last write */
+            succp = start_causal_read(inst, rses, bref, querybuf);
+        }
+        else if ((ret = target_dcb->func.write(target_dcb, gwbuf_clone(querybuf))) == 1)
         {
-            backend_ref_t *bref;
+            /** The backend was not busy before this query */
+            bool idle = !BREF_IS_WAITING_RESULT(bref);
 
-            atomic_add(&inst->stats.n_queries, 1);
+            ts_stats_add(inst->stats.n_queries, 1);
             /**
              * Add one query response waiter to backend reference
              */
-            bref = get_bref_from_dcb(rses, target_dcb);
+            ss_dassert(bref == get_bref_from_dcb(rses, target_dcb));
             bref_set_state(bref, BREF_QUERY_ACTIVE);
             bref_set_state(bref, BREF_WAITING_RESULT);
-        }
-        else
-        {
-            MXS_ERROR("Routing query failed.");
+            bref_start_query(rses, bref, QUERY_IS_TYPE(qtype, QUERY_TYPE_READ) ?
+                             SERVICE_LATENCY_READ : SERVICE_LATENCY_WRITE);
+
+            /** The rest of a large statement or the file of LOAD DATA follows */
+            rses->rses_large_query = packet_len == GW_MYSQL_MAX_PACKET_LEN;
+            rses->rses_stream_target = rses->rses_large_query || rses->rses_load_active ?
+                bref : NULL;
+
+            if (idle && route_target == TARGET_SLAVE && packet_type == MYSQL_COM_QUERY &&
+                qtype == QUERY_TYPE_READ && !rses->rses_large_query)
+            {
+                hedge_start(rses, bref, querybuf);
+            }
+
+            if (packet_type == MYSQL_COM_STMT_PREPARE &&
+                rses->rses_config.rw_route_prepared_reads && bref->bref_ps_prepare == NULL)
+            {
+                /** The ID is read from the reply the client gets */
+                bref->bref_ps_prepare = ps_create(rses, querybuf, qtype);
+            }
+
+            if (bref == rses->rses_master_ref && rses->rses_config.rw_causal_reads &&
+                ((QUERY_IS_TYPE(qtype, QUERY_TYPE_WRITE) && !rses->rses_transaction_active) ||
+                 QUERY_IS_TYPE(qtype, QUERY_TYPE_COMMIT)))
+            {
+                /** Read the GTID position when the write has completed */
+                bref->bref_gtid_after_reply = true;
+                rses->rses_gtid_pending = true;
+            }
+        }
+        else
+        {
+            MXS_ERROR("Routing query failed.");
             succp = false;
         }
     }
     rses_end_locked_router_action(rses);
 
 retblock :
+    if (ro_trx_end)
+    {
+        rses->rses_trx_read_only = false;
+        rses->rses_trx_target = NULL;
+    }
+
 #if defined(SS_DEBUG2)
     {
         char *canonical_query_str;
@@ -2464,6 +3058,7 @@ retblock :
         }
     }
 #endif
+    gwbuf_free(ps_execbuf);
     return succp;
 }
 
@@ -2479,7 +3074,8 @@ retblock :
  * router was closed before lock was acquired.
  *
  *
- * @details (write detailed description here)
+ * @details A session that is confined to the thread that owns it is not
+ * locked as no other thread uses it.
  *
  */
 static bool rses_begin_locked_router_action(ROUTER_CLIENT_SES *rses)
@@ -2498,6 +3094,14 @@ static bool rses_begin_locked_router_action(ROUTER_CLIENT_SES *rses)
 
         goto return_succp;
     }
+
+    if (rses->rses_confined)
+    {
+        ss_dassert(poll_session_owner(rses->client_dcb->session) == poll_current_thread());
+        succp = true;
+        goto return_succp;
+    }
+
     spinlock_acquire(&rses->rses_lock);
     if (rses->rses_closed)
     {
@@ -2528,7 +3132,11 @@ return_succp:
 static void rses_end_locked_router_action(ROUTER_CLIENT_SES *rses)
 {
     CHK_CLIENT_RSES(rses);
-    spinlock_release(&rses->rses_lock);
+
+    if (!rses->rses_confined)
+    {
+        spinlock_release(&rses->rses_lock);
+    }
 }
 
 /**
@@ -2557,25 +3165,102 @@ static void diagnostic(ROUTER *instance, DCB *dcb)
     spinlock_release(&router->lock);
 
     double master_pct = 0.0, slave_pct = 0.0, all_pct = 0.0;
+    int64_t n_queries = ts_stats_sum(router->stats.n_queries);
+    int64_t n_master = ts_stats_sum(router->stats.n_master);
+    int64_t n_slave = ts_stats_sum(router->stats.n_slave);
+    int64_t n_all = ts_stats_sum(router->stats.n_all);
 
-    if (router->stats.n_queries > 0)
+    if (n_queries > 0)
     {
-        master_pct = ((double)router->stats.n_master / (double)router->stats.n_queries) * 100.0;
-        slave_pct = ((double)router->stats.n_slave / (double)router->stats.n_queries) * 100.0;
-        all_pct = ((double)router->stats.n_all / (double)router->stats.n_queries) * 100.0;
+        master_pct = ((double)n_master / (double)n_queries) * 100.0;
+        slave_pct = ((double)n_slave / (double)n_queries) * 100.0;
+        all_pct = ((double)n_all / (double)n_queries) * 100.0;
     }
 
-    dcb_printf(dcb, "\tNumber of router sessions:           	%d\n",
-               router->stats.n_sessions);
+    dcb_printf(dcb, "\tNumber of router sessions:           	%" PRId64 "\n",
+               ts_stats_sum(router->stats.n_sessions));
     dcb_printf(dcb, "\tCurrent no. of router sessions:      	%d\n", i);
-    dcb_printf(dcb, "\tNumber of queries forwarded:          	%d\n",
-               router->stats.n_queries);
-    dcb_printf(dcb, "\tNumber of queries forwarded to master:	%d (%.2f%%)\n",
-               router->stats.n_master, master_pct);
-    dcb_printf(dcb, "\tNumber of queries forwarded to slave: 	%d (%.2f%%)\n",
-               router->stats.n_slave, slave_pct);
-    dcb_printf(dcb, "\tNumber of queries forwarded to all:   	%d (%.2f%%)\n",
-               router->stats.n_all, all_pct);
+    dcb_printf(dcb, "\tNumber of queries forwarded:          	%" PRId64 "\n",
+               n_queries);
+    dcb_printf(dcb, "\tNumber of queries forwarded to master:	%" PRId64 " (%.2f%%)\n",
+               n_master, master_pct);
+    dcb_printf(dcb, "\tNumber of queries forwarded to slave: 	%" PRId64 " (%.2f%%)\n",
+               n_slave, slave_pct);
+    dcb_printf(dcb, "\tNumber of queries forwarded to all:   	%" PRId64 " (%.2f%%)\n",
+               n_all, all_pct);
+    dcb_printf(dcb, "\tSession commands that changed nothing:	%" PRId64 "\n",
+               ts_stats_sum(router->stats.n_sescmd_noop));
+
+    if (router->rwsplit_config.rw_pipeline_sescmd)
+    {
+        dcb_printf(dcb, "\t\tServer               Sessions behind  Pending session commands\n");
+
+        for (i = 0; router->servers[i]; i++)
+        {
+            int n_behind = 0;
+            int n_pending = 0;
+
+            backend = router->servers[i];
+            spinlock_acquire(&router->lock);
+
+            for (router_cli_ses = router->connections; router_cli_ses;
+                 router_cli_ses = router_cli_ses->next)
+            {
+                spinlock_acquire(&router_cli_ses->rses_lock);
+
+                for (int j = 0; !router_cli_ses->rses_closed && j < router_cli_ses->rses_nbackends; j++)
+                {
+                    backend_ref_t *bref = &router_cli_ses->rses_backend_ref[j];
+
+                    if (bref->bref_backend == backend && BREF_IS_IN_USE(bref) &&
+                        bref->bref_sescmd_cur.scmd_cur_active)
+                    {
+                        n_behind++;
+
+                        /** The owner of a confined session changes the list without the lock */
+                        if (!router_cli_ses->rses_confined)
+                        {
+                            n_pending += sescmd_cursor_pending(&bref->bref_sescmd_cur);
+                        }
+                    }
+                }
+
+                spinlock_release(&router_cli_ses->rses_lock);
+            }
+
+            spinlock_release(&router->lock);
+            dcb_printf(dcb, "\t\t%-20s %-16d %d\n", backend->backend_server->unique_name,
+                       n_behind, n_pending);
+        }
+    }
+
+    if (router->rwsplit_config.rw_slave_select_criteria == LEAST_RESPONSE_TIME)
+    {
+        dcb_printf(dcb, "\t\tServer               Average response time\n");
+
+        for (i = 0; router->servers[i]; i++)
+        {
+            backend = router->servers[i];
+            dcb_printf(dcb, "\t\t%-20s %.3f ms\n", backend->backend_server->unique_name,
+                       backend->response_time * 1000.0);
+        }
+    }
+
+    if (router->rwsplit_config.rw_hedged_reads)
+    {
+        dcb_printf(dcb, "\tNumber of hedged reads:               	%" PRId64 "\n",
+                   ts_stats_sum(router->stats.n_hedges));
+        dcb_printf(dcb, "\tNumber of hedges answered first:      	%" PRId64 "\n",
+                   ts_stats_sum(router->stats.n_hedge_wins));
+    }
+
+    if (router->rwsplit_config.rw_causal_reads)
+    {
+        dcb_printf(dcb, "\tNumber of causal read waits:          	%" PRId64 "\n",
+                   ts_stats_sum(router->stats.n_causal_waits));
+        dcb_printf(dcb, "\tNumber of causal read timeouts:       	%" PRId64 "\n",
+                   ts_stats_sum(router->stats.n_causal_timeouts));
+    }
 
     if ((weightby = serviceGetWeightingParameter(router->service)) != NULL)
     {
@@ -2588,10 +3273,10 @@ static void diagnostic(ROUTER *instance, DCB *dcb)
         for (i = 0; router->servers[i]; i++)
         {
             backend = router->servers[i];
-            dcb_printf(dcb, "\t\t%-20s %3.1f%%     %-6d  %-6d  %d\n",
+            dcb_printf(dcb, "\t\t%-20s %3.1f%%     %-6d  %-6d  %" PRId64 "\n",
                        backend->backend_server->unique_name, (float)backend->weight / 10,
                        backend->backend_server->stats.n_current, backend->backend_conn_count,
-                       backend->backend_server->stats.n_current_ops);
+                       ts_stats_sum(backend->backend_server->stats.n_current_ops));
         }
     }
 }
@@ -2618,6 +3303,7 @@ static void clientReply(ROUTER *instance, void *router_session, GWBUF *writebuf,
     router_cli_ses = (ROUTER_CLIENT_SES *)router_session;
     router_inst = (ROUTER_INSTANCE *)instance;
     CHK_CLIENT_RSES(router_cli_ses);
+    TRACE_EVENT(TRACE_CLIENT_REPLY, dcb_get_session_id(backend_dcb), 0, gwbuf_length(writebuf));
 
     /**
      * Lock router client session for secure read of router session members.
@@ -2669,6 +3355,46 @@ static void clientReply(ROUTER *instance, void *router_session, GWBUF *writebuf,
 
     CHK_BACKEND_REF(bref);
     scur = &bref->bref_sescmd_cur;
+
+    if (bref->bref_hedge_drain &&
+        (writebuf = hedge_drain_reply(router_cli_ses, bref, writebuf)) == NULL)
+    {
+        /** The whole buffer was a reply that the other slave already returned */
+        rses_end_locked_router_action(router_cli_ses);
+        goto lock_failed;
+    }
+
+    if (router_cli_ses->rses_hedge.h_query &&
+        (bref == router_cli_ses->rses_hedge.h_primary ||
+         bref == router_cli_ses->rses_hedge.h_secondary))
+    {
+        hedge_choose(router_inst, router_cli_ses, bref);
+    }
+
+    if (bref->bref_internal != BREF_INTERNAL_NONE &&
+        (writebuf = process_internal_reply(router_inst, router_cli_ses, bref, writebuf)) == NULL)
+    {
+        /** The whole buffer was a reply to an internal query */
+        rses_end_locked_router_action(router_cli_ses);
+        goto lock_failed;
+    }
+
+    if (bref->bref_mstmt_active)
+    {
+        /** The results of a batch are returned to the client in order */
+        mstmt_process_reply(router_inst, router_cli_ses, bref, writebuf);
+        rses_end_locked_router_action(router_cli_ses);
+        goto lock_failed;
+    }
+
+    bool fetch_gtid = false;
+
+    if (bref->bref_gtid_after_reply && !sescmd_cursor_is_active(scur))
+    {
+        bref->bref_gtid_after_reply = false;
+        fetch_gtid = is_last_ok_packet(writebuf);
+    }
+
     /**
      * Active cursor means that reply is from session command
      * execution.
@@ -2732,6 +3458,11 @@ static void clientReply(ROUTER *instance, void *router_session, GWBUF *writebuf,
      */
     else if (BREF_IS_QUERY_ACTIVE(bref))
     {
+        if (bref->bref_ps_prepare)
+        {
+            ps_read_prepare_reply(router_cli_ses, bref, writebuf);
+        }
+        bref_end_query(router_cli_ses, bref);
         bref_clear_state(bref, BREF_QUERY_ACTIVE);
         /** Set response status as replied */
         bref_clear_state(bref, BREF_WAITING_RESULT);
@@ -2741,6 +3472,19 @@ static void clientReply(ROUTER *instance, void *router_session, GWBUF *writebuf,
     {
         /** Write reply to client DCB */
         SESSION_ROUTE_REPLY(backend_dcb->session, writebuf);
+
+        if (!BREF_IS_WAITING_RESULT(bref))
+        {
+            QUERY_TRACE_END(backend_dcb->session);
+        }
+    }
+
+    if (fetch_gtid && !send_internal_query(bref, "SELECT @@gtid_binlog_pos",
+                                           BREF_INTERNAL_GTID_POS))
+    {
+        MXS_ERROR("Failed to read the GTID position from %s:%d.",
+                  bref->bref_backend->backend_server->name,
+                  bref->bref_backend->backend_server->port);
     }
     /** Unlock router session */
     rses_end_locked_router_action(router_cli_ses);
@@ -2779,12 +3523,13 @@ static void clientReply(ROUTER *instance, void *router_session, GWBUF *writebuf,
                        gwbuf_clone(bref->bref_pending_cmd))) == 1)
         {
             ROUTER_INSTANCE* inst = (ROUTER_INSTANCE *)instance;
-            atomic_add(&inst->stats.n_queries, 1);
+            ts_stats_add(inst->stats.n_queries, 1);
             /**
              * Add one query response waiter to backend reference
              */
             bref_set_state(bref, BREF_QUERY_ACTIVE);
             bref_set_state(bref, BREF_WAITING_RESULT);
+            bref_start_query(router_cli_ses, bref, SERVICE_LATENCY_OTHER);
         }
         else
         {
@@ -2810,6 +3555,17 @@ lock_failed:
     return;
 }
 
+/**
+ * Return the weight of a backend scaled by the load the monitor reports
+ *
+ * @param backend The backend
+ * @return The weight to compare the load of the backend with
+ */
+static inline int backend_load_weight(BACKEND *backend)
+{
+    return server_scale_weight(backend->backend_server, backend->weight);
+}
+
 /** Compare nunmber of connections from this router in backend servers */
 int bref_cmp_router_conn(const void *bref1, const void *bref2)
 {
@@ -2830,8 +3586,8 @@ int bref_cmp_router_conn(const void *bref1, const void *bref2)
         return -1;
     }
 
-    return ((1000 + 1000 * b1->backend_conn_count) / b1->weight) -
-           ((1000 + 1000 * b2->backend_conn_count) / b2->weight);
+    return ((1000 + 1000 * b1->backend_conn_count) / backend_load_weight(b1)) -
+           ((1000 + 1000 * b2->backend_conn_count) / backend_load_weight(b2));
 }
 
 /** Compare nunmber of global connections in backend servers */
@@ -2854,8 +3610,8 @@ int bref_cmp_global_conn(const void *bref1, const void *bref2)
         return -1;
     }
 
-    return ((1000 + 1000 * b1->backend_server->stats.n_current) / b1->weight) -
-           ((1000 + 1000 * b2->backend_server->stats.n_current) / b2->weight);
+    return ((1000 + 1000 * b1->backend_server->stats.n_current) / backend_load_weight(b1)) -
+           ((1000 + 1000 * b2->backend_server->stats.n_current) / backend_load_weight(b2));
 }
 
 /** Compare relication lag between backend servers */
@@ -2864,10 +3620,26 @@ int bref_cmp_behind_master(const void *bref1, const void *bref2)
     BACKEND *b1 = ((backend_ref_t *)bref1)->bref_backend;
     BACKEND *b2 = ((backend_ref_t *)bref2)->bref_backend;
 
+    if (b1->backend_server->rlag_ms >= 0 && b2->backend_server->rlag_ms >= 0)
+    {
+        return ((b1->backend_server->rlag_ms < b2->backend_server->rlag_ms) ? -1
+                : ((b1->backend_server->rlag_ms > b2->backend_server->rlag_ms) ? 1 : 0));
+    }
+
     return ((b1->backend_server->rlag < b2->backend_server->rlag) ? -1
             : ((b1->backend_server->rlag > b2->backend_server->rlag) ? 1 : 0));
 }
 
+/** Compare the average response times of backend servers */
+int bref_cmp_response_time(const void *bref1, const void *bref2)
+{
+    BACKEND *b1 = ((backend_ref_t *)bref1)->bref_backend;
+    BACKEND *b2 = ((backend_ref_t *)bref2)->bref_backend;
+
+    return b1->response_time < b2->response_time ? -1 :
+           (b1->response_time > b2->response_time ? 1 : 0);
+}
+
 /** Compare nunmber of current operations in backend servers */
 int bref_cmp_current_load(const void *bref1, const void *bref2)
 {
@@ -2890,8 +3662,8 @@ int bref_cmp_current_load(const void *bref1, const void *bref2)
         return -1;
     }
 
-    return ((1000 * s1->stats.n_current_ops) - b1->weight) -
-           ((1000 * s2->stats.n_current_ops) - b2->weight);
+    return (int)(((1000 * ts_stats_sum(s1->stats.n_current_ops)) - backend_load_weight(b1)) -
+                 ((1000 * ts_stats_sum(s2->stats.n_current_ops)) - backend_load_weight(b2)));
 }
 
 static void bref_clear_state(backend_ref_t *bref, bref_state_t state)
@@ -2905,7 +3677,6 @@ static void bref_clear_state(backend_ref_t *bref, bref_state_t state)
     if ((state & BREF_WAITING_RESULT) && (bref->bref_state & BREF_WAITING_RESULT))
     {
         int prev1;
-        int prev2;
 
         /** Decrease waiter count */
         prev1 = atomic_add(&bref->bref_num_result_wait, -1);
@@ -2916,15 +3687,12 @@ static void bref_clear_state(backend_ref_t *bref, bref_state_t state)
         }
         else
         {
-            /** Decrease global operation count */
-            prev2 = atomic_add(&bref->bref_backend->backend_server->stats.n_current_ops, -1);
-            ss_dassert(prev2 > 0);
-            if (prev2 <= 0)
-            {
-                MXS_ERROR("[%s] Error: negative current operation count in backend %s:%u",
-                          __FUNCTION__, bref->bref_backend->backend_server->name,
-                          bref->bref_backend->backend_server->port);
-            }
+            /**
+             * Decrease global operation count. The operation may have been
+             * started by another thread so the slot of this thread can
+             * become negative, only the sum of all slots is meaningful.
+             */
+            ts_stats_add(bref->bref_backend->backend_server->stats.n_current_ops, -1);
         }
     }
 
@@ -2942,7 +3710,6 @@ static void bref_set_state(backend_ref_t *bref, bref_state_t state)
     if ((state & BREF_WAITING_RESULT) && (bref->bref_state & BREF_WAITING_RESULT) == 0)
     {
         int prev1;
-        int prev2;
 
         /** Increase waiter count */
         prev1 = atomic_add(&bref->bref_num_result_wait, 1);
@@ -2955,15 +3722,12 @@ static void bref_set_state(backend_ref_t *bref, bref_state_t state)
                       bref->bref_backend->backend_server->port);
         }
         /** Increase global operation count */
-        prev2 =
-            atomic_add(&bref->bref_backend->backend_server->stats.n_current_ops, 1);
-        ss_dassert(prev2 >= 0);
-        if (prev2 < 0)
-        {
-            MXS_ERROR("[%s] Error: negative current operation count in backend %s:%u",
-                      __FUNCTION__, bref->bref_backend->backend_server->name,
-                      bref->bref_backend->backend_server->port);
-        }
+        ts_stats_add(bref->bref_backend->backend_server->stats.n_current_ops, 1);
+    }
+    else if ((state & BREF_WAITING_RESULT) && bref->bref_hedge_drain)
+    {
+        /** The reply to this query follows the one that is discarded */
+        bref->bref_hedge_next = true;
     }
 
     bref->bref_state |= state;
@@ -3038,7 +3802,8 @@ void log_server_connections(select_criteria_t select_criteria,
     if (select_criteria == LEAST_GLOBAL_CONNECTIONS ||
         select_criteria == LEAST_ROUTER_CONNECTIONS ||
         select_criteria == LEAST_BEHIND_MASTER ||
-        select_criteria == LEAST_CURRENT_OPERATIONS)
+        select_criteria == LEAST_CURRENT_OPERATIONS ||
+        select_criteria == LEAST_RESPONSE_TIME)
     {
         MXS_INFO("Servers and %s connection counts:",
                  select_criteria == LEAST_GLOBAL_CONNECTIONS ? "all MaxScale"
@@ -3063,8 +3828,8 @@ void log_server_connections(select_criteria_t select_criteria,
                     break;
 
                 case LEAST_CURRENT_OPERATIONS:
-                    MXS_INFO("current operations : %d in \t%s:%d %s",
-                             b->backend_server->stats.n_current_ops,
+                    MXS_INFO("current operations : %" PRId64 " in \t%s:%d %s",
+                             ts_stats_sum(b->backend_server->stats.n_current_ops),
                              b->backend_server->name, b->backend_server->port,
                              STRSRVSTATUS(b->backend_server));
                     break;
@@ -3073,6 +3838,12 @@ void log_server_connections(select_criteria_t select_criteria,
                     MXS_INFO("replication lag : %d in \t%s:%d %s",
                              b->backend_server->rlag, b->backend_server->name,
                              b->backend_server->port, STRSRVSTATUS(b->backend_server));
+                    break;
+
+                case LEAST_RESPONSE_TIME:
+                    MXS_INFO("average response time : %.3f ms in \t%s:%d %s",
+                             b->response_time * 1000.0, b->backend_server->name,
+                             b->backend_server->port, STRSRVSTATUS(b->backend_server));
                 default:
                     break;
             }
@@ -3092,6 +3863,35 @@ static bool bref_valid_for_connect(const backend_ref_t *bref)
         SERVER_IS_RUNNING(bref->bref_backend->backend_server);
 }
 
+/**
+ * Get the state of a server from a topology snapshot
+ *
+ * The states in the snapshot are consistent with each other. The live state
+ * of the server is used if it is not in the snapshot.
+ *
+ * @param topology The topology of the current thread
+ * @param server The server
+ * @param tmp Storage for the live state of the server
+ * @return The state of the server
+ */
+static inline const SERVER_STATE *backend_server_state(const SERVER_TOPOLOGY *topology,
+                                                       SERVER *server, SERVER_STATE *tmp)
+{
+    const SERVER_STATE *state = server_topology_state(topology, server);
+
+    if (state == NULL)
+    {
+        tmp->server = server;
+        tmp->status = server->status;
+        tmp->depth = server->depth;
+        tmp->rlag = server->rlag;
+        tmp->node_ts = server->node_ts;
+        state = tmp;
+    }
+
+    return state;
+}
+
 /**
  * Check whether it's possible to use this server as a slave
  *
@@ -3102,8 +3902,10 @@ static bool bref_valid_for_connect(const backend_ref_t *bref)
 static bool bref_valid_for_slave(const backend_ref_t *bref, const SERVER *master_host)
 {
     SERVER *server = bref->bref_backend->backend_server;
+    SERVER_STATE tmp;
+    const SERVER_STATE *state = backend_server_state(server_get_topology(), server, &tmp);
 
-    return (SERVER_IS_SLAVE(server) || SERVER_IS_RELAY_SERVER(server)) &&
+    return (SERVER_IS_SLAVE(state) || SERVER_IS_RELAY_SERVER(state)) &&
         (master_host == NULL || (server != master_host));
 }
 
@@ -3337,6 +4139,60 @@ static bool select_connect_backend_servers(backend_ref_t **p_master_ref,
     return succp;
 }
 
+/**
+ * Connect to another slave if a read finds no idle slave
+ *
+ * Used with lazy_slave_connections. A slave is connected when none of the
+ * connected slaves can take the read right away, up to the maximum number of
+ * slaves of the session. The session command history is executed on the new
+ * connection before the read is sent to it.
+ *
+ * Router session must be locked.
+ *
+ * @param inst     Router instance
+ * @param rses     Router client session
+ * @param max_rlag Maximum replication lag of the read
+ */
+static void connect_slave_on_demand(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+                                    int max_rlag)
+{
+    if (rses->rses_config.rw_disable_sescmd_hist)
+    {
+        /** A new connection could not be brought up to date */
+        return;
+    }
+
+    BACKEND *master = get_root_master(rses->rses_backend_ref, rses->rses_nbackends);
+    SERVER *master_host = master ? master->backend_server : NULL;
+    int n_slaves = 0;
+
+    for (int i = 0; i < rses->rses_nbackends; i++)
+    {
+        backend_ref_t *bref = &rses->rses_backend_ref[i];
+
+        if (BREF_IS_IN_USE(bref) && bref_valid_for_connect(bref) &&
+            bref_valid_for_slave(bref, master_host))
+        {
+            if (!BREF_IS_QUERY_ACTIVE(bref) && !BREF_IS_WAITING_RESULT(bref) &&
+                !sescmd_cursor_is_active(&bref->bref_sescmd_cur) &&
+                rlag_within_limit(bref->bref_backend->backend_server, max_rlag))
+            {
+                return;
+            }
+            n_slaves++;
+        }
+    }
+
+    if (n_slaves < rses_get_max_slavecount(rses, rses->rses_nbackends))
+    {
+        select_connect_backend_servers(&rses->rses_master_ref, rses->rses_backend_ref,
+                                       rses->rses_nbackends, n_slaves + 1,
+                                       rses_get_max_replication_lag(rses),
+                                       rses->rses_config.rw_slave_select_criteria,
+                                       rses->client_dcb->session, inst, true);
+    }
+}
+
 /**
  * Create a generic router session property strcture.
  */
@@ -3379,7 +4235,7 @@ static void rses_property_done(rses_property_t *prop)
             break;
 
         case RSES_PROP_TYPE_TMPTABLES:
-            hashtable_free(prop->rses_prop_data.temp_tables);
+            flatmap_free(prop->rses_prop_data.temp_tables);
             break;
 
         default:
@@ -3415,7 +4271,7 @@ static int rses_property_add(ROUTER_CLIENT_SES *rses, rses_property_t *prop)
 
     CHK_CLIENT_RSES(rses);
     CHK_RSES_PROP(prop);
-    ss_dassert(SPINLOCK_IS_LOCKED(&rses->rses_lock));
+    ss_dassert(RSES_IS_LOCKED(rses));
 
     prop->rses_prop_rsession = rses;
     p = rses->rses_properties[prop->rses_prop_type];
@@ -3451,7 +4307,7 @@ static mysql_sescmd_t *rses_property_get_sescmd(rses_property_t *prop)
 
     CHK_RSES_PROP(prop);
     ss_dassert(prop->rses_prop_rsession == NULL ||
-               SPINLOCK_IS_LOCKED(&prop->rses_prop_rsession->rses_lock));
+               RSES_IS_LOCKED(prop->rses_prop_rsession));
 
     sescmd = &prop->rses_prop_data.sescmd;
 
@@ -3485,6 +4341,13 @@ static mysql_sescmd_t *mysql_sescmd_init(rses_property_t *rses_prop,
     sescmd->my_sescmd_packet_type = packet_type;
     sescmd->position = atomic_add(&rses->pos_generator, 1);
 
+    /** The history is charged to the memory of the session */
+    if (rses->client_dcb && rses->client_dcb->session)
+    {
+        sescmd->my_sescmd_session = rses->client_dcb->session;
+        session_account_kept_memory(sescmd->my_sescmd_session, gwbuf_length(sescmd_buf));
+    }
+
     return sescmd;
 }
 
@@ -3496,7 +4359,12 @@ static void mysql_sescmd_done(mysql_sescmd_t *sescmd)
         return;
     }
     CHK_RSES_PROP(sescmd->my_sescmd_prop);
+    if (sescmd->my_sescmd_session)
+    {
+        session_account_kept_memory(sescmd->my_sescmd_session, -(int)gwbuf_length(sescmd->my_sescmd_buf));
+    }
     gwbuf_free(sescmd->my_sescmd_buf);
+    free(sescmd->my_sescmd_key);
     memset(sescmd, 0, sizeof(mysql_sescmd_t));
 }
 
@@ -3529,11 +4397,15 @@ static GWBUF *sescmd_cursor_process_replies(GWBUF *replybuf,
     ROUTER_CLIENT_SES *ses;
 
     scur = &bref->bref_sescmd_cur;
-    ss_dassert(SPINLOCK_IS_LOCKED(&(scur->scmd_cur_rses->rses_lock)));
+    ss_dassert(RSES_IS_LOCKED(scur->scmd_cur_rses));
     scmd = sescmd_cursor_get_command(scur);
     ses = (*scur->scmd_cur_ptr_property)->rses_prop_rsession;
     CHK_GWBUF(replybuf);
 
+    /** The protocol has read the state changes of the reply to the first command */
+    MySQLProtocol *proto = bref->bref_dcb ? (MySQLProtocol *)bref->bref_dcb->protocol : NULL;
+    bool noop = proto && proto->session_track && proto->state_tracked && !proto->state_changed;
+
     /**
      * Walk through packets in the message and the list of session
      * commands.
@@ -3596,6 +4468,14 @@ static GWBUF *sescmd_cursor_process_replies(GWBUF *replybuf,
             scmd->my_sescmd_is_replied = true;
             scmd->reply_cmd = *((unsigned char *)replybuf->start + 4);
 
+            if (noop && scmd->reply_cmd == 0x00)
+            {
+                /** The command is not replayed on the backends that have not executed it */
+                scmd->my_sescmd_noop = true;
+                ses->rses_sescmd_noop = true;
+                ts_stats_add(ses->router->stats.n_sescmd_noop, 1);
+            }
+
             MXS_INFO("Server '%s' responded to a session command, sending the response "
                      "to the client.", bref->bref_backend->backend_server->unique_name);
 
@@ -3644,6 +4524,8 @@ static GWBUF *sescmd_cursor_process_replies(GWBUF *replybuf,
             replybuf = NULL;
         }
 
+        noop = false;
+
         if (sescmd_cursor_next(scur))
         {
             scmd = sescmd_cursor_get_command(scur);
@@ -3668,7 +4550,7 @@ static mysql_sescmd_t *sescmd_cursor_get_command(sescmd_cursor_t *scur)
 {
     mysql_sescmd_t *scmd;
 
-    ss_dassert(SPINLOCK_IS_LOCKED(&(scur->scmd_cur_rses->rses_lock)));
+    ss_dassert(RSES_IS_LOCKED(scur->scmd_cur_rses));
     scur->scmd_cur_cmd = rses_property_get_sescmd(*scur->scmd_cur_ptr_property);
 
     CHK_MYSQL_SESCMD(scur->scmd_cur_cmd);
@@ -3688,7 +4570,7 @@ static bool sescmd_cursor_is_active(sescmd_cursor_t *sescmd_cursor)
         MXS_ERROR("[%s] Error: NULL parameter.", __FUNCTION__);
         return false;
     }
-    ss_dassert(SPINLOCK_IS_LOCKED(&sescmd_cursor->scmd_cur_rses->rses_lock));
+    ss_dassert(RSES_IS_LOCKED(sescmd_cursor->scmd_cur_rses));
 
     succp = sescmd_cursor->scmd_cur_active;
     return succp;
@@ -3698,7 +4580,7 @@ static bool sescmd_cursor_is_active(sescmd_cursor_t *sescmd_cursor)
 static void sescmd_cursor_set_active(sescmd_cursor_t *sescmd_cursor,
                                      bool value)
 {
-    ss_dassert(SPINLOCK_IS_LOCKED(&sescmd_cursor->scmd_cur_rses->rses_lock));
+    ss_dassert(RSES_IS_LOCKED(sescmd_cursor->scmd_cur_rses));
     /** avoid calling unnecessarily */
     ss_dassert(sescmd_cursor->scmd_cur_active != value);
     sescmd_cursor->scmd_cur_active = value;
@@ -3915,8 +4797,7 @@ static bool sescmd_cursor_next(sescmd_cursor_t *scur)
 
     ss_dassert(scur != NULL);
     ss_dassert(*(scur->scmd_cur_ptr_property) != NULL);
-    ss_dassert(SPINLOCK_IS_LOCKED(
-                   &(*(scur->scmd_cur_ptr_property))->rses_prop_rsession->rses_lock));
+    ss_dassert(RSES_IS_LOCKED((*(scur->scmd_cur_ptr_property))->rses_prop_rsession));
 
     /** Illegal situation */
     if (scur == NULL || *scur->scmd_cur_ptr_property == NULL ||
@@ -4036,88 +4917,377 @@ static int getCapabilities()
 }
 
 /**
- * Execute in backends used by current router session.
- * Save session variable commands to router session property
- * struct. Thus, they can be replayed in backends which are
- * started and joined later.
- *
- * Suppress redundant OK packets sent by backends.
- *
- * The first OK packet is replied to the client.
- *
- * @param router_cli_ses    Client's router session pointer
- * @param querybuf      GWBUF including the query to be routed
- * @param inst          Router instance
- * @param packet_type       Type of MySQL packet
- * @param qtype         Query type from query_classifier
- *
- * @return True if at least one backend is used and routing succeed to all
- * backends being used, otherwise false.
+ * Find the session state that a session command sets. Only commands that set
+ * one variable from a value that does not depend on the session state have a
+ * key: USE, COM_INIT_DB, SET NAMES and SET [SESSION] var = value where var is
+ * a user variable or a session variable.
  *
+ * @param buf         Contiguous buffer with the session command
+ * @param packet_type The command
+ * @return The key in lower case or NULL if the command has none
  */
-static bool route_session_write(ROUTER_CLIENT_SES *router_cli_ses,
-                                GWBUF *querybuf, ROUTER_INSTANCE *inst,
-                                unsigned char packet_type,
-                                qc_query_type_t qtype)
+static char *sescmd_history_key(GWBUF *buf, unsigned char packet_type)
 {
-    bool succp;
-    rses_property_t *prop;
-    backend_ref_t *backend_ref;
-    int i;
-    int max_nslaves;
-    int nbackends;
-    int nsucc;
+    if (packet_type == MYSQL_COM_INIT_DB)
+    {
+        return strdup("use");
+    }
+    else if (packet_type != MYSQL_COM_QUERY)
+    {
+        return NULL;
+    }
 
-    MXS_INFO("Session write, routing to all servers.");
-    /** Maximum number of slaves in this router client session */
-    max_nslaves =
-        rses_get_max_slavecount(router_cli_ses, router_cli_ses->rses_nbackends);
-    nsucc = 0;
-    nbackends = 0;
-    backend_ref = router_cli_ses->rses_backend_ref;
+    uint8_t *packet = (uint8_t *)GWBUF_DATA(buf);
+    const char *ptr = (const char *)packet + MYSQL_HEADER_LEN + 1;
+    const char *end = ptr + MIN(MYSQL_GET_PACKET_LEN(packet) - 1,
+                                GWBUF_LENGTH(buf) - MYSQL_HEADER_LEN - 1);
+    const char *name;
+    char key[MYSQL_DATABASE_MAXLEN + 2];
+    size_t len;
 
-    /**
-     * These are one-way messages and server doesn't respond to them.
-     * Therefore reply processing is unnecessary and session
-     * command property is not needed. It is just routed to all available
-     * backends.
-     */
-    if (packet_type == MYSQL_COM_STMT_SEND_LONG_DATA ||
-        packet_type == MYSQL_COM_QUIT || packet_type == MYSQL_COM_STMT_CLOSE)
+    while (ptr < end && isspace(*ptr))
     {
-        int rc;
+        ptr++;
+    }
 
-        /** Lock router session */
-        if (!rses_begin_locked_router_action(router_cli_ses))
+    if (end - ptr > 4 && strncasecmp(ptr, "USE", 3) == 0 && isspace(ptr[3]))
+    {
+        /** The database name is checked like a value below */
+        strcpy(key, "use");
+        ptr += 4;
+    }
+    else if (end - ptr > 4 && strncasecmp(ptr, "SET", 3) == 0 && isspace(ptr[3]))
+    {
+        ptr += 4;
+
+        while (ptr < end && isspace(*ptr))
         {
-            goto return_succp;
+            ptr++;
         }
 
-        for (i = 0; i < router_cli_ses->rses_nbackends; i++)
+        if (end - ptr > 8 && strncasecmp(ptr, "SESSION", 7) == 0 && isspace(ptr[7]))
         {
-            DCB *dcb = backend_ref[i].bref_dcb;
+            ptr += 8;
+        }
+        else if (end - ptr > 6 && strncasecmp(ptr, "LOCAL", 5) == 0 && isspace(ptr[5]))
+        {
+            ptr += 6;
+        }
 
-            if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_INFO) &&
-                BREF_IS_IN_USE((&backend_ref[i])))
+        while (ptr < end && isspace(*ptr))
+        {
+            ptr++;
+        }
+
+        name = ptr;
+
+        if (end - ptr > 2 && ptr[0] == '@' && ptr[1] == '@')
+        {
+            ptr += 2;
+            name = ptr;
+
+            if (end - ptr > 8 && strncasecmp(ptr, "session.", 8) == 0)
             {
-                MXS_INFO("Route query to %s \t%s:%d%s",
-                         (SERVER_IS_MASTER(backend_ref[i].bref_backend->backend_server)
-                          ? "master" : "slave"),
-                         backend_ref[i].bref_backend->backend_server->name,
-                         backend_ref[i].bref_backend->backend_server->port,
-                         (i + 1 == router_cli_ses->rses_nbackends ? " <" : " "));
+                name = ptr += 8;
             }
-
-            if (BREF_IS_IN_USE((&backend_ref[i])))
+            else if (end - ptr > 6 && strncasecmp(ptr, "local.", 6) == 0)
             {
-                nbackends += 1;
-                if ((rc = dcb->func.write(dcb, gwbuf_clone(querybuf))) == 1)
-                {
-                    nsucc += 1;
-                }
+                name = ptr += 6;
             }
         }
-        rses_end_locked_router_action(router_cli_ses);
+        else if (ptr < end && *ptr == '@')
+        {
+            ptr++;
+        }
+
+        while (ptr < end && (isalnum(*ptr) || *ptr == '_' || *ptr == '$'))
+        {
+            ptr++;
+        }
+
+        len = ptr - name;
+
+        if (len == 0 || len >= sizeof(key) || (*name == '@' && len == 1))
+        {
+            return NULL;
+        }
+
+        for (size_t i = 0; i < len; i++)
+        {
+            key[i] = tolower(name[i]);
+        }
+        key[len] = '\0';
+
+        while (ptr < end && isspace(*ptr))
+        {
+            ptr++;
+        }
+
+        if (strcmp(key, "names") != 0)
+        {
+            if (end - ptr > 1 && ptr[0] == ':' && ptr[1] == '=')
+            {
+                ptr += 2;
+            }
+            else if (ptr < end && *ptr == '=')
+            {
+                ptr++;
+            }
+            else
+            {
+                return NULL;
+            }
+        }
+    }
+    else
+    {
+        return NULL;
+    }
+
+    /**
+     * The value must not refer to other variables, call functions or be
+     * followed by other assignments or statements.
+     */
+    char quote = 0;
+    bool empty = true;
+
+    for (; ptr < end; ptr++)
+    {
+        if (quote)
+        {
+            if (*ptr == '\\' && ptr + 1 < end)
+            {
+                ptr++;
+            }
+            else if (*ptr == quote)
+            {
+                quote = 0;
+            }
+        }
+        else if (*ptr == '\'' || *ptr == '"' || *ptr == '`')
+        {
+            quote = *ptr;
+            empty = false;
+        }
+        else if (*ptr == '@' || *ptr == '(' || *ptr == ',' || *ptr == ';' ||
+                 *ptr == '#' || *ptr == '/' || *ptr == '-')
+        {
+            /** Comments are not parsed, a minus sign could also start one */
+            return NULL;
+        }
+        else if (!isspace(*ptr))
+        {
+            empty = false;
+        }
+    }
+
+    return quote || empty ? NULL : strdup(key);
+}
+
+/**
+ * Check if a key is a session state that changes how the text of the later
+ * commands is read, like the character set or the SQL mode
+ *
+ * @param key The key of a session command
+ * @return True if the later commands depend on the state
+ */
+static bool sescmd_key_is_parse_state(const char *key)
+{
+    static const char *keys[] =
+    {
+        "names", "sql_mode", "character_set_client", "character_set_connection",
+        "collation_connection", NULL
+    };
+
+    for (int i = 0; keys[i]; i++)
+    {
+        if (strcmp(key, keys[i]) == 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Remove the session commands that are superseded by a new command, and the
+ * commands that the master reported as not changing the session state, from
+ * the history. A command is only removed once its reply has been sent to the
+ * client and no backend is executing it. Backends that have not yet reached
+ * the command will skip it, and a backend that is taken into use later
+ * replays only the commands that are left.
+ *
+ * A command is superseded only if no later command in the history depends on
+ * it. Commands without a key may read any session state, so the commands
+ * before them are kept. The commands that change how the text of the later
+ * commands is read are superseded only by the command right after them.
+ *
+ * Router session must be locked.
+ *
+ * @param rses Router client session
+ * @param key  Key of the new command or NULL, the command itself is not yet
+ *             in the history
+ */
+static void compact_sescmd_history(ROUTER_CLIENT_SES *rses, const char *key)
+{
+    rses_property_t **pprop = &rses->rses_properties[RSES_PROP_TYPE_SESCMD];
+    rses_property_t *barrier = NULL;
+    bool noop_left = false;
+    bool parse_state = key && sescmd_key_is_parse_state(key);
+
+    /** The last command without a key, the commands up to it are not superseded */
+    for (rses_property_t *prop = *pprop; key && prop; prop = prop->rses_prop_next)
+    {
+        if (prop->rses_prop_data.sescmd.my_sescmd_key == NULL)
+        {
+            barrier = prop;
+        }
+    }
+
+    bool past_barrier = barrier == NULL;
+
+    while (*pprop)
+    {
+        rses_property_t *prop = *pprop;
+        mysql_sescmd_t *scmd = &prop->rses_prop_data.sescmd;
+        bool superseded = key && past_barrier && scmd->my_sescmd_key &&
+                          strcmp(scmd->my_sescmd_key, key) == 0 &&
+                          (!parse_state || prop->rses_prop_next == NULL);
+        bool removable = scmd->my_sescmd_is_replied && (scmd->my_sescmd_noop || superseded);
+
+        if (prop == barrier)
+        {
+            past_barrier = true;
+        }
+
+        for (int i = 0; removable && i < rses->rses_nbackends; i++)
+        {
+            sescmd_cursor_t *scur = &rses->rses_backend_ref[i].bref_sescmd_cur;
+
+            if (BREF_IS_IN_USE(&rses->rses_backend_ref[i]) && scur->scmd_cur_active &&
+                scur->scmd_cur_ptr_property == pprop)
+            {
+                /** The backend is executing the command */
+                removable = false;
+            }
+        }
+
+        if (!removable)
+        {
+            noop_left = noop_left || scmd->my_sescmd_noop;
+            pprop = &prop->rses_prop_next;
+            continue;
+        }
+
+        for (int i = 0; i < rses->rses_nbackends; i++)
+        {
+            sescmd_cursor_t *scur = &rses->rses_backend_ref[i].bref_sescmd_cur;
+
+            /** Cursors that are past the command now point to what preceded it */
+            if (scur->scmd_cur_ptr_property == &prop->rses_prop_next)
+            {
+                scur->scmd_cur_ptr_property = pprop;
+            }
+            if (scur->scmd_cur_cmd == scmd)
+            {
+                scur->scmd_cur_cmd = NULL;
+            }
+        }
+
+        MXS_INFO("Removing %s session command %d from the history.",
+                 scmd->my_sescmd_noop ? "ineffective" : "superseded", scmd->position);
+        *pprop = prop->rses_prop_next;
+        rses_property_done(prop);
+        atomic_add(&rses->rses_nsescmd, -1);
+    }
+
+    rses->rses_sescmd_noop = noop_left;
+}
+
+/**
+ * Execute in backends used by current router session.
+ * Save session variable commands to router session property
+ * struct. Thus, they can be replayed in backends which are
+ * started and joined later.
+ *
+ * Suppress redundant OK packets sent by backends.
+ *
+ * The first OK packet is replied to the client.
+ *
+ * @param router_cli_ses    Client's router session pointer
+ * @param querybuf      GWBUF including the query to be routed
+ * @param inst          Router instance
+ * @param packet_type       Type of MySQL packet
+ * @param qtype         Query type from query_classifier
+ *
+ * @return True if at least one backend is used and routing succeed to all
+ * backends being used, otherwise false.
+ *
+ */
+static bool route_session_write(ROUTER_CLIENT_SES *router_cli_ses,
+                                GWBUF *querybuf, ROUTER_INSTANCE *inst,
+                                unsigned char packet_type,
+                                qc_query_type_t qtype)
+{
+    bool succp;
+    rses_property_t *prop;
+    backend_ref_t *backend_ref;
+    int i;
+    int max_nslaves;
+    int nbackends;
+    int nsucc;
+
+    MXS_INFO("Session write, routing to all servers.");
+    /** Maximum number of slaves in this router client session */
+    max_nslaves =
+        rses_get_max_slavecount(router_cli_ses, router_cli_ses->rses_nbackends);
+    nsucc = 0;
+    nbackends = 0;
+    backend_ref = router_cli_ses->rses_backend_ref;
+
+    /**
+     * These are one-way messages and server doesn't respond to them.
+     * Therefore reply processing is unnecessary and session
+     * command property is not needed. It is just routed to all available
+     * backends.
+     */
+    if (packet_type == MYSQL_COM_STMT_SEND_LONG_DATA ||
+        packet_type == MYSQL_COM_QUIT || packet_type == MYSQL_COM_STMT_CLOSE)
+    {
+        int rc;
+
+        /** Lock router session */
+        if (!rses_begin_locked_router_action(router_cli_ses))
+        {
+            goto return_succp;
+        }
+
+        for (i = 0; i < router_cli_ses->rses_nbackends; i++)
+        {
+            DCB *dcb = backend_ref[i].bref_dcb;
+
+            if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_INFO) &&
+                BREF_IS_IN_USE((&backend_ref[i])))
+            {
+                MXS_INFO("Route query to %s \t%s:%d%s",
+                         (SERVER_IS_MASTER(backend_ref[i].bref_backend->backend_server)
+                          ? "master" : "slave"),
+                         backend_ref[i].bref_backend->backend_server->name,
+                         backend_ref[i].bref_backend->backend_server->port,
+                         (i + 1 == router_cli_ses->rses_nbackends ? " <" : " "));
+            }
+
+            if (BREF_IS_IN_USE((&backend_ref[i])))
+            {
+                nbackends += 1;
+                if ((rc = dcb->func.write(dcb, gwbuf_clone(querybuf))) == 1)
+                {
+                    nsucc += 1;
+                }
+            }
+        }
+        rses_end_locked_router_action(router_cli_ses);
         gwbuf_free(querybuf);
         goto return_succp;
     }
@@ -4197,6 +5367,29 @@ static bool route_session_write(ROUTER_CLIENT_SES *router_cli_ses,
 
     mysql_sescmd_init(prop, querybuf, packet_type, router_cli_ses);
 
+    if (router_cli_ses->rses_config.rw_compact_sescmd_hist)
+    {
+        prop->rses_prop_data.sescmd.my_sescmd_key = sescmd_history_key(querybuf, packet_type);
+    }
+
+    if (prop->rses_prop_data.sescmd.my_sescmd_key || router_cli_ses->rses_sescmd_noop)
+    {
+        compact_sescmd_history(router_cli_ses, prop->rses_prop_data.sescmd.my_sescmd_key);
+    }
+
+    /**
+     * With lazy_sescmd only the master executes the command now. The slaves
+     * replay it from the history when the next read is routed to them.
+     */
+    backend_ref_t *lazy_target = NULL;
+
+    if (router_cli_ses->rses_config.rw_lazy_sescmd &&
+        !router_cli_ses->rses_config.rw_disable_sescmd_hist &&
+        router_cli_ses->rses_master_ref && BREF_IS_IN_USE(router_cli_ses->rses_master_ref))
+    {
+        lazy_target = router_cli_ses->rses_master_ref;
+    }
+
     /** Add sescmd property to router client session */
     if (rses_property_add(router_cli_ses, prop) != 0)
     {
@@ -4207,7 +5400,7 @@ static bool route_session_write(ROUTER_CLIENT_SES *router_cli_ses,
 
     for (i = 0; i < router_cli_ses->rses_nbackends; i++)
     {
-        if (BREF_IS_IN_USE((&backend_ref[i])))
+        if (BREF_IS_IN_USE((&backend_ref[i])) && (lazy_target == NULL || &backend_ref[i] == lazy_target))
         {
             sescmd_cursor_t *scur;
 
@@ -4345,14 +5538,15 @@ static bool rwsplit_process_router_options(ROUTER_INSTANCE *router,
                 c = GET_SELECT_CRITERIA(value);
                 ss_dassert(c == LEAST_GLOBAL_CONNECTIONS ||
                            c == LEAST_ROUTER_CONNECTIONS || c == LEAST_BEHIND_MASTER ||
-                           c == LEAST_CURRENT_OPERATIONS || c == UNDEFINED_CRITERIA);
+                           c == LEAST_CURRENT_OPERATIONS || c == LEAST_RESPONSE_TIME ||
+                           c == UNDEFINED_CRITERIA);
 
                 if (c == UNDEFINED_CRITERIA)
                 {
                     MXS_ERROR("Unknown slave selection criteria \"%s\". "
                                 "Allowed values are LEAST_GLOBAL_CONNECTIONS, "
-                                "LEAST_ROUTER_CONNECTIONS, LEAST_BEHIND_MASTER,"
-                                "and LEAST_CURRENT_OPERATIONS.",
+                                "LEAST_ROUTER_CONNECTIONS, LEAST_BEHIND_MASTER, "
+                                "LEAST_CURRENT_OPERATIONS and LEAST_RESPONSE_TIME.",
                                 STRCRITERIA(router->rwsplit_config.rw_slave_select_criteria));
                     success = false;
                 }
@@ -4369,6 +5563,30 @@ static bool rwsplit_process_router_options(ROUTER_INSTANCE *router,
             {
                 router->rwsplit_config.rw_disable_sescmd_hist = config_truth_value(value);
             }
+            else if (strcmp(options[i], "route_prepared_reads") == 0)
+            {
+                router->rwsplit_config.rw_route_prepared_reads = config_truth_value(value);
+            }
+            else if (strcmp(options[i], "split_multi_statements") == 0)
+            {
+                router->rwsplit_config.rw_split_multi_stmt = config_truth_value(value);
+            }
+            else if (strcmp(options[i], "route_read_only_trx") == 0)
+            {
+                router->rwsplit_config.rw_route_read_only_trx = config_truth_value(value);
+            }
+            else if (strcmp(options[i], "pipeline_sescmd") == 0)
+            {
+                router->rwsplit_config.rw_pipeline_sescmd = config_truth_value(value);
+            }
+            else if (strcmp(options[i], "lazy_sescmd") == 0)
+            {
+                router->rwsplit_config.rw_lazy_sescmd = config_truth_value(value);
+            }
+            else if (strcmp(options[i], "compact_sescmd_history") == 0)
+            {
+                router->rwsplit_config.rw_compact_sescmd_hist = config_truth_value(value);
+            }
             else if (strcmp(options[i], "master_accept_reads") == 0)
             {
                 router->rwsplit_config.rw_master_reads = config_truth_value(value);
@@ -4397,6 +5615,62 @@ static bool rwsplit_process_router_options(ROUTER_INSTANCE *router,
                     success = false;
                 }
             }
+            else if (strcmp(options[i], "causal_reads") == 0)
+            {
+                router->rwsplit_config.rw_causal_reads = config_truth_value(value);
+            }
+            else if (strcmp(options[i], "causal_reads_timeout") == 0)
+            {
+                int timeout = atoi(value);
+
+                if (timeout > 0)
+                {
+                    router->rwsplit_config.rw_causal_reads_timeout = timeout;
+                }
+                else
+                {
+                    MXS_ERROR("Invalid value for 'causal_reads_timeout': %s", value);
+                    success = false;
+                }
+            }
+            else if (strcmp(options[i], "lazy_slave_connections") == 0)
+            {
+                router->rwsplit_config.rw_lazy_connect = config_truth_value(value);
+            }
+            else if (strcmp(options[i], "hedged_reads") == 0)
+            {
+                router->rwsplit_config.rw_hedged_reads = config_truth_value(value);
+            }
+            else if (strcmp(options[i], "hedge_delay") == 0)
+            {
+                char *endptr;
+                long delay = strtol(value, &endptr, 10);
+
+                if (*value && *endptr == '\0' && delay >= 0 && delay <= INT_MAX)
+                {
+                    router->rwsplit_config.rw_hedge_delay = delay;
+                }
+                else
+                {
+                    MXS_ERROR("Invalid value for 'hedge_delay': %s", value);
+                    success = false;
+                }
+            }
+            else if (strcmp(options[i], "hedge_budget") == 0)
+            {
+                char *endptr;
+                long budget = strtol(value, &endptr, 10);
+
+                if (*value && *endptr == '\0' && budget >= 0 && budget <= 100)
+                {
+                    router->rwsplit_config.rw_hedge_budget = budget;
+                }
+                else
+                {
+                    MXS_ERROR("Invalid value for 'hedge_budget': %s", value);
+                    success = false;
+                }
+            }
             else
             {
                 MXS_ERROR("Unknown router option \"%s=%s\" for readwritesplit router.",
@@ -4611,7 +5885,7 @@ static void handle_error_reply_client(SESSION *ses, ROUTER_CLIENT_SES *rses,
     if (sesstate == SESSION_STATE_ROUTER_READY)
     {
         CHK_DCB(client_dcb);
-        client_dcb->func.write(client_dcb, gwbuf_clone(errmsg));
+        SESSION_ROUTE_REPLY(ses, gwbuf_clone(errmsg));
     }
 }
 
@@ -4643,7 +5917,7 @@ static bool handle_error_new_connection(ROUTER_INSTANCE *inst,
     bool succp;
 
     myrses = *rses;
-    ss_dassert(SPINLOCK_IS_LOCKED(&myrses->rses_lock));
+    ss_dassert(RSES_IS_LOCKED(myrses));
 
     ses = backend_dcb->session;
     CHK_SESSION(ses);
@@ -4666,10 +5940,9 @@ static bool handle_error_new_connection(ROUTER_INSTANCE *inst,
      * the backend server it is necessary to send an error to the client
      * because it is waiting for reply.
      */
-    if (BREF_IS_WAITING_RESULT(bref))
+    if (BREF_IS_WAITING_RESULT(bref) && !hedge_fail_backend(myrses, bref))
     {
-        DCB *client_dcb = ses->client_dcb;
-        client_dcb->func.write(client_dcb, gwbuf_clone(errmsg));
+        SESSION_ROUTE_REPLY(ses, gwbuf_clone(errmsg));
     }
 
     RW_CHK_DCB(bref, backend_dcb);
@@ -4936,7 +6209,15 @@ static int router_handle_state_switch(DCB *dcb, DCB_REASON reason, void *data)
     switch (reason)
     {
         case DCB_REASON_NOT_RESPONDING:
-            dcb->func.hangup(dcb);
+            /** The monitor calls this, the owner of a confined session handles the hangup */
+            if (((ROUTER_CLIENT_SES *)dcb->session->router_session)->rses_confined)
+            {
+                poll_fake_hangup_event(dcb);
+            }
+            else
+            {
+                dcb->func.hangup(dcb);
+            }
             break;
 
         default:
@@ -5024,12 +6305,16 @@ static bool prep_stmt_drop(prep_stmt_t *pstmt)
  */
 static BACKEND *get_root_master(backend_ref_t *servers, int router_nservers)
 {
+    const SERVER_TOPOLOGY *topology = server_get_topology();
     int i = 0;
     BACKEND *master_host = NULL;
+    int master_depth = 0;
 
     for (i = 0; i < router_nservers; i++)
     {
         BACKEND *b;
+        SERVER_STATE tmp;
+        const SERVER_STATE *state;
 
         if (servers[i].bref_backend == NULL)
         {
@@ -5037,13 +6322,14 @@ static BACKEND *get_root_master(backend_ref_t *servers, int router_nservers)
         }
 
         b = servers[i].bref_backend;
+        state = backend_server_state(topology, b->backend_server, &tmp);
 
-        if (SERVER_IS_MASTER(b->backend_server))
+        if (SERVER_IS_MASTER(state))
         {
-            if (master_host == NULL ||
-                (b->backend_server->depth < master_host->backend_server->depth))
+            if (master_host == NULL || state->depth < master_depth)
             {
                 master_host = b;
+                master_depth = state->depth;
             }
         }
     }
@@ -5064,8 +6350,10 @@ static BACKEND *get_root_master(backend_ref_t *servers, int router_nservers)
  */
 static backend_ref_t *get_root_master_bref(ROUTER_CLIENT_SES *rses)
 {
+    const SERVER_TOPOLOGY *topology = server_get_topology();
     backend_ref_t *bref;
     backend_ref_t *candidate_bref = NULL;
+    int candidate_depth = 0;
     SERVER master = {};
 
     for (int i = 0; i < rses->rses_nbackends; i++)
@@ -5073,20 +6361,23 @@ static backend_ref_t *get_root_master_bref(ROUTER_CLIENT_SES *rses)
         bref = &rses->rses_backend_ref[i];
         if (bref && BREF_IS_IN_USE(bref))
         {
+            SERVER_STATE tmp;
+            const SERVER_STATE *state = backend_server_state(topology,
+                                                             bref->bref_backend->backend_server,
+                                                             &tmp);
             ss_dassert(!BREF_IS_CLOSED(bref) && !BREF_HAS_FAILED(bref));
             if (bref == rses->rses_master_ref)
             {
                 /** Store master state for better error reporting */
-                master.status = bref->bref_backend->backend_server->status;
+                master.status = state->status;
             }
 
-            if (SERVER_IS_MASTER(bref->bref_backend->backend_server))
+            if (SERVER_IS_MASTER(state))
             {
-                if (candidate_bref == NULL ||
-                    (bref->bref_backend->backend_server->depth <
-                     candidate_bref->bref_backend->backend_server->depth))
+                if (candidate_bref == NULL || state->depth < candidate_depth)
                 {
                     candidate_bref = bref;
+                    candidate_depth = state->depth;
                 }
             }
         }
@@ -5153,26 +6444,1994 @@ static bool check_for_multi_stmt(ROUTER_CLIENT_SES *rses, GWBUF *buf,
 }
 
 /**
- * Send an error message to the client telling that the server is in read only mode
- * @param dcb Client DCB
- * @return True if sending the message was successful, false if an error occurred
+ * Check whether a statement can be routed to the master without classifying
+ * it. All statements go to the master while a transaction is open and when
+ * the session uses no slaves. Of those statements only plain DML needs no
+ * classification: it cannot end the transaction, modify the session state or
+ * start a LOAD DATA LOCAL INFILE. Statements with variables, multiple
+ * statements and SELECT ... INTO are classified as they may be routed to all
+ * servers or rejected.
+ *
+ * @param rses Router client session
+ * @param buf  A contiguous buffer with a COM_QUERY packet
+ * @return True if the statement can be routed to the master as such
  */
-static bool send_readonly_error(DCB *dcb)
+static bool is_pinned_to_master(ROUTER_CLIENT_SES *rses, GWBUF *buf)
 {
-    bool succp = false;
-    const char* errmsg = "The MariaDB server is running with the --read-only"
-        " option so it cannot execute this statement";
-    GWBUF* err = modutil_create_mysql_err_msg(1, 0, ER_OPTION_PREVENTS_STATEMENT,
-                                              "HY000", errmsg);
+    static const char *const dml[] = {"SELECT", "INSERT", "UPDATE", "DELETE", "REPLACE", NULL};
 
-    if (err)
+    if (rses->rses_load_active || rses->rses_trx_read_only || buf->hint ||
+        (!rses->rses_transaction_active && rses->rses_config.rw_max_slave_conn_count > 0))
+    {
+        return false;
+    }
+
+    uint8_t *packet = (uint8_t *)GWBUF_DATA(buf);
+    const char *data = (const char *)packet + 5;
+    const char *end = data + MIN(gw_mysql_get_byte3(packet) - 1, GWBUF_LENGTH(buf) - 5);
+    const char *ptr = data;
+
+    while (ptr < end && isspace(*ptr))
+    {
+        ptr++;
+    }
+
+    const char *word = ptr;
+
+    while (ptr < end && isalpha(*ptr))
+    {
+        ptr++;
+    }
+
+    int i = 0;
+
+    while (dml[i] && (ptr - word != strlen(dml[i]) || strncasecmp(word, dml[i], ptr - word) != 0))
+    {
+        i++;
+    }
+
+    if (dml[i] == NULL)
+    {
+        return false;
+    }
+
+    bool is_select = i == 0;
+
+    while (ptr < end)
+    {
+        if (*ptr == '@')
+        {
+            return false;
+        }
+        else if (*ptr == ';')
+        {
+            /** Only a trailing semicolon is accepted */
+            const char *p = ptr + 1;
+
+            while (p < end && isspace(*p))
+            {
+                p++;
+            }
+
+            if (p < end)
+            {
+                return false;
+            }
+        }
+        else if (is_select && (*ptr == 'I' || *ptr == 'i') && end - ptr >= 4 &&
+                 strncasecmp(ptr, "INTO", 4) == 0 && !isalnum(ptr[-1]) && ptr[-1] != '_' &&
+                 (end - ptr == 4 || (!isalnum(ptr[4]) && ptr[4] != '_')))
+        {
+            return false;
+        }
+
+        ptr++;
+    }
+
+    return true;
+}
+
+/**
+ * Choose a slave with the power of two choices: two of the usable slaves are
+ * picked at random and the one with the smaller average response time wins.
+ * This keeps the load away from slow servers without sending all reads to
+ * the one that happens to be the fastest.
+ *
+ * @param rses     Router client session
+ * @param max_rlag Maximum replication lag or MAX_RLAG_UNDEFINED
+ * @return The chosen slave or NULL if no slave can be used
+ */
+static backend_ref_t *get_slave_by_response_time(ROUTER_CLIENT_SES *rses, int max_rlag)
+{
+    static thread_local unsigned int seed = 0;
+    backend_ref_t *choice[2] = {NULL, NULL};
+    int n = 0;
+
+    if (seed == 0)
+    {
+        seed = (unsigned int)time(NULL) ^ (unsigned int)(uintptr_t)&seed;
+    }
+
+    for (int i = 0; i < rses->rses_nbackends; i++)
+    {
+        backend_ref_t *bref = &rses->rses_backend_ref[i];
+        SERVER *server = bref->bref_backend->backend_server;
+        SERVER status;
+        status.status = server->status;
+
+        if (!BREF_IS_IN_USE(bref) ||
+            (!SERVER_IS_SLAVE(&status) &&
+             !(rses->rses_config.rw_master_reads && SERVER_IS_MASTER(&status))) ||
+            !rlag_within_limit(server, max_rlag))
+        {
+            continue;
+        }
+
+        /** Pick two servers at random in one pass */
+        int slot = n < 2 ? n : rand_r(&seed) % (n + 1);
+
+        if (slot < 2)
+        {
+            choice[slot] = bref;
+        }
+        n++;
+    }
+
+    if (choice[1] && choice[1]->bref_backend->response_time <
+        choice[0]->bref_backend->response_time)
+    {
+        return choice[1];
+    }
+
+    return choice[0];
+}
+
+/**
+ * Find a backend that has executed all session commands. Slaves are compared
+ * with the slave selection criteria and the master is used if no slave is
+ * up to date.
+ *
+ * Router session must be locked.
+ *
+ * @param rses     Router client session
+ * @param max_rlag Maximum replication lag or MAX_RLAG_UNDEFINED
+ * @return The backend or NULL if there is none
+ */
+static backend_ref_t *get_caught_up_backend(ROUTER_CLIENT_SES *rses, int max_rlag)
+{
+    backend_ref_t *candidate = NULL;
+
+    for (int i = 0; i < rses->rses_nbackends; i++)
+    {
+        backend_ref_t *bref = &rses->rses_backend_ref[i];
+        SERVER *server = bref->bref_backend->backend_server;
+        SERVER status;
+        status.status = server->status;
+
+        if (BREF_IS_IN_USE(bref) && SERVER_IS_SLAVE(&status) &&
+            !sescmd_cursor_behind(&bref->bref_sescmd_cur) &&
+            rlag_within_limit(server, max_rlag))
+        {
+            candidate = check_candidate_bref(candidate, bref,
+                                             rses->rses_config.rw_slave_select_criteria);
+        }
+    }
+
+    if (candidate == NULL && rses->rses_master_ref && BREF_IS_IN_USE(rses->rses_master_ref))
+    {
+        SERVER status;
+        status.status = rses->rses_master_ref->bref_backend->backend_server->status;
+
+        if (SERVER_IS_MASTER(&status))
+        {
+            candidate = rses->rses_master_ref;
+        }
+    }
+
+    return candidate;
+}
+
+/**
+ * Count the session commands a cursor has not yet received replies to
+ *
+ * Router session must be locked.
+ *
+ * @param scur Session command cursor
+ * @return Number of session commands starting from the current one
+ */
+static int sescmd_cursor_pending(sescmd_cursor_t *scur)
+{
+    int n = 0;
+
+    for (rses_property_t *prop = *scur->scmd_cur_ptr_property; prop; prop = prop->rses_prop_next)
+    {
+        n++;
+    }
+
+    return n;
+}
+
+/**
+ * Check whether a backend has session commands it has not yet replied to,
+ * either because it is executing them or because they were only executed
+ * on the master
+ *
+ * Router session must be locked.
+ *
+ * @param scur Session command cursor
+ * @return True if the backend is not up to date with the session commands
+ */
+static bool sescmd_cursor_behind(sescmd_cursor_t *scur)
+{
+    return scur->scmd_cur_active || *scur->scmd_cur_ptr_property != NULL;
+}
+
+/**
+ * Mark the time when a query was sent to a backend
+ *
+ * @param rses Router client session
+ * @param bref Backend reference
+ * @param type Query type of the latency histogram
+ */
+static void bref_start_query(ROUTER_CLIENT_SES *rses, backend_ref_t *bref,
+                             service_latency_t type)
+{
+    bref->bref_query_start = service_latency_now();
+    bref->bref_query_type = type;
+}
+
+/**
+ * Record the time it took for the reply to arrive in the latency histogram
+ * of the server. With the least response time criteria, the time is also
+ * added to the average response time of the server. The average is an
+ * exponentially weighted moving average so that a server that slows down is
+ * noticed after a few queries.
+ *
+ * @param rses Router client session
+ * @param bref Backend reference
+ */
+static void bref_end_query(ROUTER_CLIENT_SES *rses, backend_ref_t *bref)
+{
+    if (bref->bref_query_start)
+    {
+        BACKEND *b = bref->bref_backend;
+        uint64_t usec = service_latency_now() - bref->bref_query_start;
+
+        service_record_latency(rses->router->service, b->backend_server,
+                               bref->bref_query_type, usec);
+
+        if (rses->rses_config.rw_slave_select_criteria == LEAST_RESPONSE_TIME)
+        {
+            double sample = (double)usec / 1000000.0;
+            b->response_time = b->response_time == 0 ? sample :
+                               b->response_time + RW_RESPONSE_TIME_ALPHA * (sample - b->response_time);
+        }
+        bref->bref_query_start = 0;
+    }
+}
+
+/**
+ * Check whether a reply is a single OK packet that ends the reply
+ *
+ * @param buf Reply from a backend server
+ * @return True if the reply is an OK packet with no more results after it
+ */
+static bool is_last_ok_packet(GWBUF *buf)
+{
+    uint8_t data[MYSQL_HEADER_LEN + 1 + 9 + 9 + 2];
+    size_t len = gwbuf_copy_data(buf, 0, sizeof(data), data);
+
+    if (len < MYSQL_HEADER_LEN + 1 || data[MYSQL_HEADER_LEN] != 0x00 ||
+        gwbuf_length(buf) != MYSQL_GET_PACKET_LEN(data) + MYSQL_HEADER_LEN)
+    {
+        return false;
+    }
+
+    /** Skip the affected rows and the last insert ID to get to the status */
+    size_t offset = MYSQL_HEADER_LEN + 1;
+
+    for (int i = 0; i < 2 && offset < len; i++)
+    {
+        uint8_t c = data[offset];
+        offset += c < 0xfb ? 1 : c == 0xfc ? 3 : c == 0xfd ? 4 : 9;
+    }
+
+    return offset + 2 <= len && (data[offset] & SERVER_MORE_RESULTS_EXIST) == 0;
+}
+
+/**
+ * Send a query whose reply is consumed by the router
+ *
+ * @param bref Backend reference
+ * @param sql  The SQL to send
+ * @param type What the query is for
+ * @return True if the query was sent
+ */
+static bool send_internal_query(backend_ref_t *bref, const char *sql, bref_internal_t type)
+{
+    GWBUF *buf = modutil_create_query((char *)sql);
+
+    if (buf == NULL || bref->bref_dcb->func.write(bref->bref_dcb, buf) != 1)
+    {
+        return false;
+    }
+
+    bref->bref_internal = type;
+    bref->bref_internal_eofs = 0;
+    bref->bref_internal_value[0] = '\0';
+    return true;
+}
+
+/**
+ * Start a read from a slave that has not yet been seen to reach the position
+ * of the last write. The slave is first asked to wait for the position and
+ * the query is sent once the wait has finished.
+ *
+ * @param inst     Router instance
+ * @param rses     Router client session
+ * @param bref     The slave
+ * @param querybuf The query
+ * @return True if the wait was started
+ */
+static bool start_causal_read(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+                              backend_ref_t *bref, GWBUF *querybuf)
+{
+    char sql[RW_GTID_MAX_LEN + 64];
+
+    snprintf(sql, sizeof(sql), "SELECT MASTER_GTID_WAIT('%s', %d)",
+             rses->rses_gtid, rses->rses_config.rw_causal_reads_timeout);
+
+    if (!send_internal_query(bref, sql, BREF_INTERNAL_GTID_WAIT))
+    {
+        MXS_ERROR("Routing query failed.");
+        return false;
+    }
+
+    strcpy(bref->bref_wait_gtid, rses->rses_gtid);
+    bref->bref_causal_query = gwbuf_clone(querybuf);
+    bref_set_state(bref, BREF_QUERY_ACTIVE);
+    bref_set_state(bref, BREF_WAITING_RESULT);
+    ts_stats_add(inst->stats.n_causal_waits, 1);
+    return true;
+}
+
+/**
+ * Finish a causal read once the slave has replied to the wait. If the slave
+ * did not reach the position in time, the query is routed to the master.
+ *
+ * @param inst Router instance
+ * @param rses Router client session
+ * @param bref The slave
+ * @param ok   Whether the wait returned a result
+ */
+static void finish_causal_read(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+                               backend_ref_t *bref, bool ok)
+{
+    GWBUF *query = bref->bref_causal_query;
+    backend_ref_t *target = bref;
+
+    bref->bref_causal_query = NULL;
+
+    if (ok && strcmp(bref->bref_internal_value, "0") == 0)
     {
-        succp = dcb->func.write(dcb, err);
+        strcpy(bref->bref_gtid, bref->bref_wait_gtid);
     }
     else
     {
-        MXS_ERROR("Memory allocation failed when creating client error message.");
+        MXS_INFO("Slave %s:%d did not reach GTID position %s, routing the query to the master.",
+                 bref->bref_backend->backend_server->name,
+                 bref->bref_backend->backend_server->port, bref->bref_wait_gtid);
+        ts_stats_add(inst->stats.n_causal_timeouts, 1);
+        bref_clear_state(bref, BREF_QUERY_ACTIVE);
+        bref_clear_state(bref, BREF_WAITING_RESULT);
+        target = rses->rses_master_ref;
+
+        if (target == NULL || !BREF_IS_IN_USE(target))
+        {
+            modutil_reply_parse_error(bref->bref_dcb,
+                                      strdup("Slave did not catch up with the master "
+                                             "and no master is available."), 0);
+            gwbuf_free(query);
+            return;
+        }
+        bref_set_state(target, BREF_QUERY_ACTIVE);
+        bref_set_state(target, BREF_WAITING_RESULT);
     }
 
-    return succp;
+    if (target->bref_dcb->func.write(target->bref_dcb, query) == 1)
+    {
+        bref_start_query(rses, target, SERVICE_LATENCY_READ);
+        ts_stats_add(inst->stats.n_queries, 1);
+        ts_stats_add(target == bref ? inst->stats.n_slave : inst->stats.n_master, 1);
+    }
+    else
+    {
+        MXS_ERROR("Routing query failed.");
+    }
+}
+
+/**
+ * Read the value of the first column of the first row of a reply
+ *
+ * @param packet The row packet
+ * @param dest   Where the value is stored
+ */
+static void read_internal_value(uint8_t *packet, char *dest)
+{
+    size_t len = MYSQL_GET_PACKET_LEN(packet);
+    uint8_t *ptr = packet + MYSQL_HEADER_LEN;
+    size_t vlen = *ptr++;
+
+    if (vlen < 0xfb && vlen < len && vlen < RW_GTID_MAX_LEN)
+    {
+        memcpy(dest, ptr, vlen);
+        dest[vlen] = '\0';
+
+        /** Only accept values that are safe to put into a query */
+        if (strspn(dest, "0123456789-, ") != vlen)
+        {
+            dest[0] = '\0';
+        }
+    }
+}
+
+/**
+ * Consume the reply to an internal query from the beginning of a buffer
+ *
+ * The reply is a result set with one row and one column or an error. Once
+ * the entire reply has been read, its value is acted upon.
+ *
+ * @param inst Router instance
+ * @param rses Router client session
+ * @param bref Backend reference
+ * @param buf  Buffer with complete packets
+ * @return What is left of the buffer after the internal reply, or NULL
+ */
+static GWBUF *process_internal_reply(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+                                     backend_ref_t *bref, GWBUF *buf)
+{
+    bool done = false;
+    bool ok = false;
+    size_t offset = 0;
+
+    if (bref->bref_internal == BREF_INTERNAL_PS_PREPARE)
+    {
+        return ps_process_prepare_reply(inst, rses, bref, buf);
+    }
+
+    buf = gwbuf_make_contiguous(buf);
+
+    uint8_t *data = (uint8_t *)GWBUF_DATA(buf);
+    size_t len = GWBUF_LENGTH(buf);
+
+    while (!done && offset + MYSQL_HEADER_LEN < len)
+    {
+        uint8_t *packet = data + offset;
+        size_t plen = MYSQL_GET_PACKET_LEN(packet);
+        uint8_t cmd = packet[MYSQL_HEADER_LEN];
+
+        if (bref->bref_internal_eofs == 0 && cmd == 0xff)
+        {
+            done = true;
+        }
+        else if (cmd == 0xfe && plen < 9)
+        {
+            done = ok = ++bref->bref_internal_eofs == 2;
+        }
+        else if (bref->bref_internal_eofs == 1 && bref->bref_internal_value[0] == '\0')
+        {
+            read_internal_value(packet, bref->bref_internal_value);
+        }
+
+        offset += plen + MYSQL_HEADER_LEN;
+    }
+
+    buf = gwbuf_consume(buf, offset);
+
+    if (done)
+    {
+        bref_internal_t type = bref->bref_internal;
+        bref->bref_internal = BREF_INTERNAL_NONE;
+
+        if (type == BREF_INTERNAL_GTID_POS)
+        {
+            if (ok && *bref->bref_internal_value)
+            {
+                strcpy(rses->rses_gtid, bref->bref_internal_value);
+
+                /** Another write may have been sent while the position was read */
+                rses->rses_gtid_pending = bref->bref_gtid_after_reply;
+            }
+            else
+            {
+                MXS_WARNING("Failed to read the GTID position from %s:%d, reads are routed "
+                            "to the master until the position is known.",
+                            bref->bref_backend->backend_server->name,
+                            bref->bref_backend->backend_server->port);
+            }
+        }
+        else
+        {
+            finish_causal_read(inst, rses, bref, ok);
+        }
+    }
+
+    return buf;
+}
+
+/**
+ * Hash a prepared statement ID
+ */
+static int ps_id_hash(void *key)
+{
+    return (int)*(uint32_t *)key;
+}
+
+/**
+ * Compare two prepared statement IDs
+ */
+static int ps_id_cmp(void *v1, void *v2)
+{
+    uint32_t i1 = *(uint32_t *)v1;
+    uint32_t i2 = *(uint32_t *)v2;
+
+    return (i1 < i2 ? -1 : (i1 > i2 ? 1 : 0));
+}
+
+/**
+ * Create a prepared statement for a COM_STMT_PREPARE that was sent to a backend
+ *
+ * @param rses  Router client session
+ * @param buf   The COM_STMT_PREPARE packet
+ * @param qtype Type of the prepared statement
+ * @return The new statement or NULL if memory allocation failed
+ */
+static rwsplit_ps_t *ps_create(ROUTER_CLIENT_SES *rses, GWBUF *buf, qc_query_type_t qtype)
+{
+    rwsplit_ps_t *ps = (rwsplit_ps_t *)calloc(1, sizeof(rwsplit_ps_t));
+    int64_t *ids = (int64_t *)malloc(sizeof(int64_t) * rses->rses_nbackends);
+    bool *sent = (bool *)calloc(rses->rses_nbackends, sizeof(bool));
+
+    if (ps == NULL || ids == NULL || sent == NULL)
+    {
+        MXS_ERROR("Memory allocation failed.");
+        free(ps);
+        free(ids);
+        free(sent);
+        return NULL;
+    }
+
+    for (int i = 0; i < rses->rses_nbackends; i++)
+    {
+        ids[i] = -1;
+    }
+
+    /**
+     * A statement that would be routed to a slave as a plain query is read on
+     * a slave. Temporary tables exist only on the master.
+     */
+    qtype &= ~QUERY_TYPE_PREPARE_STMT;
+    ps->ps_read_only = !rses->have_tmp_tables &&
+                       QUERY_IS_TYPE(qtype, QUERY_TYPE_READ) &&
+                       !QUERY_IS_TYPE(qtype, QUERY_TYPE_WRITE) &&
+                       !QUERY_IS_TYPE(qtype, QUERY_TYPE_MASTER_READ) &&
+                       !QUERY_IS_TYPE(qtype, QUERY_TYPE_SESSION_WRITE) &&
+                       !QUERY_IS_TYPE(qtype, QUERY_TYPE_USERVAR_WRITE) &&
+                       !QUERY_IS_TYPE(qtype, QUERY_TYPE_GSYSVAR_WRITE) &&
+                       !QUERY_IS_TYPE(qtype, QUERY_TYPE_USERVAR_READ) &&
+                       !QUERY_IS_TYPE(qtype, QUERY_TYPE_SYSVAR_READ) &&
+                       !QUERY_IS_TYPE(qtype, QUERY_TYPE_GSYSVAR_READ);
+    ps->ps_prepare = gwbuf_clone(buf);
+    ps->ps_backend_ids = ids;
+    ps->ps_types_sent = sent;
+    ps->ps_exec_backend = -1;
+    ps->ps_next = rses->rses_ps;
+    rses->rses_ps = ps;
+
+    return ps;
+}
+
+/**
+ * Free a prepared statement and remove all references to it
+ *
+ * @param rses Router client session
+ * @param ps   The statement to free
+ */
+static void ps_free(ROUTER_CLIENT_SES *rses, rwsplit_ps_t *ps)
+{
+    rwsplit_ps_t **prev = &rses->rses_ps;
+
+    while (*prev && *prev != ps)
+    {
+        prev = &(*prev)->ps_next;
+    }
+
+    if (*prev)
+    {
+        *prev = ps->ps_next;
+    }
+
+    if (rses->rses_ps_map && flatmap_fetch(rses->rses_ps_map, &ps->ps_client_id) == ps)
+    {
+        flatmap_delete(rses->rses_ps_map, &ps->ps_client_id);
+    }
+
+    for (int i = 0; i < rses->rses_nbackends; i++)
+    {
+        backend_ref_t *bref = &rses->rses_backend_ref[i];
+
+        if (bref->bref_ps_prepare == ps)
+        {
+            bref->bref_ps_prepare = NULL;
+        }
+        if (bref->bref_internal_ps == ps)
+        {
+            bref->bref_internal_ps = NULL;
+        }
+    }
+
+    gwbuf_free(ps->ps_prepare);
+    free(ps->ps_backend_ids);
+    free(ps->ps_param_types);
+    free(ps->ps_types_sent);
+    free(ps);
+}
+
+/**
+ * Find the prepared statement a COM_STMT_EXECUTE, COM_STMT_CLOSE,
+ * COM_STMT_RESET, COM_STMT_SEND_LONG_DATA or COM_STMT_FETCH packet refers to
+ *
+ * @param rses Router client session
+ * @param buf  The packet
+ * @return The statement or NULL if it is not known
+ */
+static rwsplit_ps_t *ps_lookup(ROUTER_CLIENT_SES *rses, GWBUF *buf)
+{
+    uint8_t data[MYSQL_HEADER_LEN + 5];
+
+    if (rses->rses_ps_map == NULL ||
+        gwbuf_copy_data(buf, 0, sizeof(data), data) != sizeof(data))
+    {
+        return NULL;
+    }
+
+    uint32_t id = gw_mysql_get_byte4(data + MYSQL_HEADER_LEN + 1);
+
+    return (rwsplit_ps_t *)flatmap_fetch(rses->rses_ps_map, &id);
+}
+
+/**
+ * Get the ID a backend knows a prepared statement by
+ *
+ * @param rses Router client session
+ * @param ps   The statement
+ * @param bref Backend reference
+ * @return The ID or -1 if the statement is not prepared on the backend
+ */
+static int64_t ps_backend_id(ROUTER_CLIENT_SES *rses, rwsplit_ps_t *ps, backend_ref_t *bref)
+{
+    return ps->ps_backend_ids[bref - rses->rses_backend_ref];
+}
+
+/**
+ * Replace the statement ID of a contiguous COM_STMT_* packet
+ *
+ * @param buf The packet
+ * @param id  The new ID
+ */
+static void ps_set_id(GWBUF *buf, uint32_t id)
+{
+    uint8_t *data = (uint8_t *)GWBUF_DATA(buf);
+
+    ss_dassert(GWBUF_LENGTH(buf) >= MYSQL_HEADER_LEN + 5);
+    gw_mysql_set_byte4(data + MYSQL_HEADER_LEN + 1, id);
+}
+
+/**
+ * Read the statement ID from the reply to a COM_STMT_PREPARE that is sent to
+ * the client. The client uses the ID for the statement from now on.
+ *
+ * @param rses Router client session
+ * @param bref Backend reference
+ * @param buf  The start of the reply
+ */
+static void ps_read_prepare_reply(ROUTER_CLIENT_SES *rses, backend_ref_t *bref, GWBUF *buf)
+{
+    rwsplit_ps_t *ps = bref->bref_ps_prepare;
+    uint8_t data[MYSQL_HEADER_LEN + 9];
+
+    bref->bref_ps_prepare = NULL;
+
+    if (gwbuf_copy_data(buf, 0, sizeof(data), data) != sizeof(data) ||
+        data[MYSQL_HEADER_LEN] != 0x00)
+    {
+        /** The statement could not be prepared */
+        ps_free(rses, ps);
+        return;
+    }
+
+    ps->ps_client_id = gw_mysql_get_byte4(data + MYSQL_HEADER_LEN + 1);
+    ps->ps_n_params = gw_mysql_get_byte2(data + MYSQL_HEADER_LEN + 7);
+    ps->ps_backend_ids[bref - rses->rses_backend_ref] = ps->ps_client_id;
+
+    if (rses->rses_ps_map == NULL &&
+        (rses->rses_ps_map = flatmap_alloc(16, ps_id_hash, ps_id_cmp)) == NULL)
+    {
+        ps_free(rses, ps);
+        return;
+    }
+
+    rwsplit_ps_t *old = (rwsplit_ps_t *)flatmap_fetch(rses->rses_ps_map, &ps->ps_client_id);
+
+    if (old)
+    {
+        /** The ID was given by another backend, the old statement can't be used */
+        ps_free(rses, old);
+    }
+
+    if (flatmap_add(rses->rses_ps_map, &ps->ps_client_id, ps) != 1)
+    {
+        ps_free(rses, ps);
+    }
+}
+
+/**
+ * Close a prepared statement on every backend it is prepared on. The server
+ * does not reply to COM_STMT_CLOSE.
+ *
+ * @param rses Router client session
+ * @param ps   The statement
+ * @param buf  The COM_STMT_CLOSE packet
+ */
+static void ps_route_close(ROUTER_CLIENT_SES *rses, rwsplit_ps_t *ps, GWBUF *buf)
+{
+    for (int i = 0; i < rses->rses_nbackends; i++)
+    {
+        backend_ref_t *bref = &rses->rses_backend_ref[i];
+
+        if (BREF_IS_IN_USE(bref) && ps->ps_backend_ids[i] >= 0)
+        {
+            GWBUF *close = gwbuf_alloc_and_load(GWBUF_LENGTH(buf), GWBUF_DATA(buf));
+
+            if (close)
+            {
+                ps_set_id(close, ps->ps_backend_ids[i]);
+
+                if (sescmd_cursor_is_active(&bref->bref_sescmd_cur) && bref != rses->rses_master_ref)
+                {
+                    bref->bref_pending_cmd = gwbuf_append(bref->bref_pending_cmd, close);
+                }
+                else
+                {
+                    bref->bref_dcb->func.write(bref->bref_dcb, close);
+                }
+            }
+        }
+    }
+
+    ps_free(rses, ps);
+}
+
+/**
+ * Route a COM_STMT_FETCH to the backend that last executed the statement, the
+ * cursor of the execution only exists there
+ *
+ * @param inst Router instance
+ * @param rses Router client session
+ * @param ps   The statement
+ * @param buf  The COM_STMT_FETCH packet
+ * @return True if the fetch was routed or an error was sent to the client
+ */
+static bool ps_route_fetch(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+                           rwsplit_ps_t *ps, GWBUF *buf)
+{
+    backend_ref_t *bref = ps->ps_exec_backend >= 0 ?
+        &rses->rses_backend_ref[ps->ps_exec_backend] : NULL;
+
+    if (bref == NULL || !BREF_IS_IN_USE(bref) || ps_backend_id(rses, ps, bref) < 0)
+    {
+        GWBUF *err = modutil_create_mysql_err_msg(1, 0, 1243, "HY000",
+                                                  "The server that executed the prepared "
+                                                  "statement is no longer available");
+        MXS_ERROR("Prepared statement %u has no open cursor to fetch from.", ps->ps_client_id);
+        return err && SESSION_ROUTE_REPLY(rses->client_dcb->session, err) == 1;
+    }
+
+    GWBUF *fetch = gwbuf_alloc_and_load(GWBUF_LENGTH(buf), GWBUF_DATA(buf));
+
+    if (fetch == NULL)
+    {
+        MXS_ERROR("Memory allocation failed.");
+        return false;
+    }
+
+    ps_set_id(fetch, ps_backend_id(rses, ps, bref));
+
+    if (sescmd_cursor_is_active(&bref->bref_sescmd_cur) && bref != rses->rses_master_ref)
+    {
+        bref->bref_pending_cmd = gwbuf_append(bref->bref_pending_cmd, fetch);
+    }
+    else if (bref->bref_dcb->func.write(bref->bref_dcb, fetch) == 1)
+    {
+        ts_stats_add(inst->stats.n_queries, 1);
+        bref_set_state(bref, BREF_QUERY_ACTIVE);
+        bref_set_state(bref, BREF_WAITING_RESULT);
+        bref_start_query(rses, bref, SERVICE_LATENCY_READ);
+    }
+    else
+    {
+        MXS_ERROR("Routing query failed.");
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Make sure that a backend knows the parameter types of an execution
+ *
+ * The client sends the types of the parameters only with the first execution
+ * of a statement and whenever they change, the new_params_bound_flag of the
+ * other executions is 0. The types the client last sent are saved and a
+ * backend that has not seen them, because the statement was just prepared
+ * on it, gets them in the execution with the flag set. The backend is also
+ * remembered as the one that has the cursor of the statement.
+ *
+ * @param rses Router client session
+ * @param ps   The statement
+ * @param bref The backend the execution is sent to
+ * @param buf  A contiguous COM_STMT_EXECUTE packet with the ID of the backend
+ * @return A new packet with the types to send instead of buf, NULL to send buf
+ */
+static GWBUF *ps_bind_params(ROUTER_CLIENT_SES *rses, rwsplit_ps_t *ps,
+                             backend_ref_t *bref, GWBUF *buf)
+{
+    int idx = bref - rses->rses_backend_ref;
+    /** Command, ID, flags and iteration count, then the NULL bitmap */
+    size_t flag_offset = MYSQL_HEADER_LEN + 10 + (ps->ps_n_params + 7) / 8;
+    size_t types_len = 2 * ps->ps_n_params;
+    size_t len = GWBUF_LENGTH(buf);
+    uint8_t *data = (uint8_t *)GWBUF_DATA(buf);
+    GWBUF *rval = NULL;
+
+    ps->ps_exec_backend = idx;
+
+    if (ps->ps_n_params == 0 || len <= flag_offset)
+    {
+        return NULL;
+    }
+
+    if (data[flag_offset])
+    {
+        if (len >= flag_offset + 1 + types_len &&
+            (ps->ps_param_types || (ps->ps_param_types = (uint8_t *)malloc(types_len))))
+        {
+            memcpy(ps->ps_param_types, data + flag_offset + 1, types_len);
+            ps->ps_types_sent[idx] = true;
+        }
+    }
+    else if (!ps->ps_types_sent[idx] && ps->ps_param_types &&
+             len + types_len - MYSQL_HEADER_LEN < GW_MYSQL_MAX_PACKET_LEN &&
+             (rval = gwbuf_alloc(len + types_len)))
+    {
+        uint8_t *ptr = (uint8_t *)GWBUF_DATA(rval);
+
+        memcpy(ptr, data, flag_offset);
+        ptr[flag_offset] = 1;
+        memcpy(ptr + flag_offset + 1, ps->ps_param_types, types_len);
+        memcpy(ptr + flag_offset + 1 + types_len, data + flag_offset + 1, len - flag_offset - 1);
+        gw_mysql_set_byte3(ptr, len + types_len - MYSQL_HEADER_LEN);
+        rval->gwbuf_type = buf->gwbuf_type;
+        ps->ps_types_sent[idx] = true;
+    }
+
+    return rval;
+}
+
+/**
+ * Forget the statement IDs of a backend whose connection was closed
+ *
+ * @param rses Router client session
+ * @param bref Backend reference
+ */
+static void ps_forget_backend(ROUTER_CLIENT_SES *rses, backend_ref_t *bref)
+{
+    if (rses)
+    {
+        int idx = bref - rses->rses_backend_ref;
+
+        for (rwsplit_ps_t *ps = rses->rses_ps; ps; ps = ps->ps_next)
+        {
+            ps->ps_backend_ids[idx] = -1;
+            ps->ps_types_sent[idx] = false;
+
+            if (ps->ps_exec_backend == idx)
+            {
+                ps->ps_exec_backend = -1;
+            }
+        }
+
+        if (bref->bref_ps_prepare)
+        {
+            /** The client never gets the ID of the statement */
+            ps_free(rses, bref->bref_ps_prepare);
+        }
+    }
+
+    bref->bref_ps_prepare = NULL;
+    bref->bref_internal_ps = NULL;
+}
+
+/**
+ * Prepare a statement on a backend before its first execution there. The
+ * reply to the prepare is consumed and the execution is sent once the
+ * backend's ID for the statement is known.
+ *
+ * @param rses     Router client session
+ * @param bref     Backend reference
+ * @param ps       The statement
+ * @param querybuf The COM_STMT_EXECUTE packet
+ * @return True if the prepare was sent
+ */
+static bool ps_prepare_lazily(ROUTER_CLIENT_SES *rses, backend_ref_t *bref,
+                              rwsplit_ps_t *ps, GWBUF *querybuf)
+{
+    GWBUF *prepare = gwbuf_clone(ps->ps_prepare);
+
+    if (prepare == NULL || bref->bref_dcb->func.write(bref->bref_dcb, prepare) != 1)
+    {
+        MXS_ERROR("Routing query failed.");
+        return false;
+    }
+
+    MXS_INFO("Preparing statement %u on %s:%d before executing it.", ps->ps_client_id,
+             bref->bref_backend->backend_server->name,
+             bref->bref_backend->backend_server->port);
+
+    bref->bref_internal = BREF_INTERNAL_PS_PREPARE;
+    bref->bref_internal_eofs = 0;
+    bref->bref_internal_eofs_expected = -1;
+    bref->bref_internal_ps = ps;
+    bref->bref_ps_exec = gwbuf_clone(querybuf);
+    bref_set_state(bref, BREF_QUERY_ACTIVE);
+    bref_set_state(bref, BREF_WAITING_RESULT);
+    return true;
+}
+
+/**
+ * Send the execution of a statement once the backend has replied to the
+ * prepare. If the prepare failed, the statement is executed on the master.
+ *
+ * @param inst Router instance
+ * @param rses Router client session
+ * @param bref Backend reference
+ * @param ok   Whether the statement was prepared
+ */
+static void ps_finish_prepare(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+                              backend_ref_t *bref, bool ok)
+{
+    GWBUF *query = bref->bref_ps_exec;
+    rwsplit_ps_t *ps = bref->bref_internal_ps;
+    backend_ref_t *target = bref;
+
+    bref->bref_ps_exec = NULL;
+    bref->bref_internal_ps = NULL;
+
+    if (!ok || ps == NULL)
+    {
+        target = rses->rses_master_ref;
+        bref_clear_state(bref, BREF_QUERY_ACTIVE);
+        bref_clear_state(bref, BREF_WAITING_RESULT);
+
+        if (ps == NULL || target == NULL || target == bref || !BREF_IS_IN_USE(target) ||
+            ps_backend_id(rses, ps, target) < 0)
+        {
+            modutil_reply_parse_error(bref->bref_dcb,
+                                      strdup("The prepared statement could not be "
+                                             "prepared on the target server."), 0);
+            gwbuf_free(query);
+            return;
+        }
+
+        MXS_INFO("Failed to prepare statement %u on %s:%d, executing it on the master.",
+                 ps->ps_client_id, bref->bref_backend->backend_server->name,
+                 bref->bref_backend->backend_server->port);
+        bref_set_state(target, BREF_QUERY_ACTIVE);
+        bref_set_state(target, BREF_WAITING_RESULT);
+    }
+
+    ps_set_id(query, ps_backend_id(rses, ps, target));
+
+    GWBUF *bound = ps_bind_params(rses, ps, target, query);
+
+    if (bound)
+    {
+        gwbuf_free(query);
+        query = bound;
+    }
+
+    if (target != rses->rses_master_ref && rses->rses_config.rw_causal_reads &&
+        *rses->rses_gtid && strcmp(target->bref_gtid, rses->rses_gtid) != 0)
+    {
+        /** The slave must still catch up with the last write */
+        if (!start_causal_read(inst, rses, target, query))
+        {
+            modutil_reply_parse_error(target->bref_dcb, strdup("Routing query failed."), 0);
+        }
+        gwbuf_free(query);
+    }
+    else if (target->bref_dcb->func.write(target->bref_dcb, query) == 1)
+    {
+        bref_start_query(rses, target, SERVICE_LATENCY_READ);
+        ts_stats_add(inst->stats.n_queries, 1);
+    }
+    else
+    {
+        MXS_ERROR("Routing query failed.");
+    }
+}
+
+/**
+ * Consume the reply to a COM_STMT_PREPARE sent before the first execution of
+ * a statement on a backend
+ *
+ * The reply starts with a COM_STMT_PREPARE_OK packet or an error. The OK
+ * packet is followed by the parameter and the column definitions, each of
+ * which ends in an EOF packet if there are any.
+ *
+ * @param inst Router instance
+ * @param rses Router client session
+ * @param bref Backend reference
+ * @param buf  Buffer with complete packets
+ * @return What is left of the buffer after the reply, or NULL
+ */
+static GWBUF *ps_process_prepare_reply(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+                                       backend_ref_t *bref, GWBUF *buf)
+{
+    bool done = false;
+    bool ok = false;
+    size_t offset = 0;
+
+    buf = gwbuf_make_contiguous(buf);
+
+    uint8_t *data = (uint8_t *)GWBUF_DATA(buf);
+    size_t len = GWBUF_LENGTH(buf);
+
+    while (!done && offset + MYSQL_HEADER_LEN < len)
+    {
+        uint8_t *packet = data + offset;
+        size_t plen = MYSQL_GET_PACKET_LEN(packet);
+        uint8_t cmd = packet[MYSQL_HEADER_LEN];
+
+        if (bref->bref_internal_eofs_expected < 0)
+        {
+            if (cmd == 0x00 && plen >= 9)
+            {
+                uint8_t *ptr = packet + MYSQL_HEADER_LEN + 1;
+
+                if (bref->bref_internal_ps)
+                {
+                    bref->bref_internal_ps->ps_backend_ids[bref - rses->rses_backend_ref] =
+                        gw_mysql_get_byte4(ptr);
+                }
+
+                /** Number of columns and number of parameters */
+                bref->bref_internal_eofs_expected = (gw_mysql_get_byte2(ptr + 4) > 0) +
+                                                    (gw_mysql_get_byte2(ptr + 6) > 0);
+                done = ok = bref->bref_internal_eofs_expected == 0;
+            }
+            else
+            {
+                done = true;
+            }
+        }
+        else if (cmd == 0xfe && plen < 9)
+        {
+            done = ok = ++bref->bref_internal_eofs == bref->bref_internal_eofs_expected;
+        }
+
+        offset += plen + MYSQL_HEADER_LEN;
+    }
+
+    buf = gwbuf_consume(buf, offset);
+
+    if (done)
+    {
+        bref->bref_internal = BREF_INTERNAL_NONE;
+        ps_finish_prepare(inst, rses, bref, ok);
+    }
+
+    return buf;
+}
+
+/**
+ * Check whether a statement starts a transaction that is declared read-only
+ *
+ * @param buf A COM_QUERY packet
+ * @return True if the statement is START TRANSACTION with the READ ONLY
+ * characteristic
+ */
+static bool is_read_only_trx(GWBUF *buf)
+{
+    bool rval = false;
+    char *sql = modutil_get_SQL(buf);
+
+    if (sql)
+    {
+        const char *delim = " \t\r\n,;";
+        char *saveptr;
+        char *tok = strtok_r(sql, delim, &saveptr);
+
+        if (tok && strcasecmp(tok, "START") == 0 &&
+            (tok = strtok_r(NULL, delim, &saveptr)) && strcasecmp(tok, "TRANSACTION") == 0)
+        {
+            bool read = false;
+
+            while ((tok = strtok_r(NULL, delim, &saveptr)))
+            {
+                if (read && strcasecmp(tok, "ONLY") == 0)
+                {
+                    rval = true;
+                }
+                else if (read && strcasecmp(tok, "WRITE") == 0)
+                {
+                    rval = false;
+                    break;
+                }
+                read = strcasecmp(tok, "READ") == 0;
+            }
+        }
+        free(sql);
+    }
+
+    return rval;
+}
+
+/**
+ * Send an error message to the client telling that the server is in read only mode
+ * @param dcb Client DCB
+ * @return True if sending the message was successful, false if an error occurred
+ */
+static bool send_readonly_error(DCB *dcb)
+{
+    bool succp = false;
+    const char* errmsg = "The MariaDB server is running with the --read-only"
+        " option so it cannot execute this statement";
+    GWBUF* err = modutil_create_mysql_err_msg(1, 0, ER_OPTION_PREVENTS_STATEMENT,
+                                              "HY000", errmsg);
+
+    if (err)
+    {
+        succp = SESSION_ROUTE_REPLY(dcb->session, err);
+    }
+    else
+    {
+        MXS_ERROR("Memory allocation failed when creating client error message.");
+    }
+
+    return succp;
+}
+
+/**
+ * Split a multi-statement COM_QUERY into COM_QUERY packets of its statements
+ *
+ * Batches whose statements can't be reliably separated, such as those with
+ * stored procedure bodies, comments between the statements or empty
+ * statements, are not split.
+ *
+ * @param buf     A contiguous COM_QUERY packet
+ * @param n_stmts Number of statements is stored here
+ * @return The statements or NULL if the batch was not split
+ */
+static GWBUF **mstmt_split(GWBUF *buf, int *n_stmts)
+{
+    char *data = (char *)GWBUF_DATA(buf) + MYSQL_HEADER_LEN + 1;
+    char *end = data + gw_mysql_get_byte3((uint8_t *)GWBUF_DATA(buf)) - 1;
+    char *start = data;
+    GWBUF **stmts = NULL;
+    int n = 0;
+    bool ok = true;
+
+    while (ok)
+    {
+        while (start < end && isspace(*start))
+        {
+            start++;
+        }
+
+        if (start == end)
+        {
+            break;
+        }
+
+        char *ptr = strnchr_esc_mysql(start, ';', end - start);
+        char *stmt_end = ptr ? ptr : end;
+        GWBUF **tmp;
+        char *sql;
+
+        if (stmt_end == start || (ptr && is_mysql_sp_end(ptr, end - ptr)) ||
+            (ptr == NULL && is_mysql_statement_end(start, end - start)) ||
+            (sql = strndup(start, stmt_end - start)) == NULL)
+        {
+            ok = false;
+        }
+        else
+        {
+            if ((tmp = realloc(stmts, sizeof(GWBUF *) * (n + 1))) &&
+                (tmp[n] = modutil_create_query(sql)))
+            {
+                gwbuf_set_type(tmp[n], GWBUF_TYPE_SINGLE_STMT);
+                stmts = tmp;
+                n++;
+            }
+            else
+            {
+                stmts = tmp ? tmp : stmts;
+                ok = false;
+            }
+            free(sql);
+        }
+
+        start = ptr ? ptr + 1 : end;
+
+        if (ok && start < end && is_mysql_statement_end(start, end - start))
+        {
+            /** Only whitespace may follow the last statement */
+            while (start < end && (isspace(*start) || *start == ';'))
+            {
+                start++;
+            }
+            ok = start == end;
+        }
+    }
+
+    if (!ok)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            gwbuf_free(stmts[i]);
+        }
+        free(stmts);
+        stmts = NULL;
+        n = 0;
+    }
+
+    *n_stmts = n;
+    return stmts;
+}
+
+/**
+ * Free a multi-statement batch
+ *
+ * @param ms The batch
+ */
+static void mstmt_free(rwsplit_mstmt_t *ms)
+{
+    for (int i = 0; i < ms->ms_n_stmts; i++)
+    {
+        gwbuf_free(ms->ms_stmts[i]);
+        gwbuf_free(ms->ms_results[i]);
+    }
+    free(ms->ms_stmts);
+    free(ms->ms_results);
+    free(ms->ms_done);
+    free(ms->ms_brefs);
+    free(ms);
+}
+
+/**
+ * Mark a statement of the batch as completed with an error
+ *
+ * @param ms   The batch
+ * @param stmt The statement
+ */
+static void mstmt_set_error(rwsplit_mstmt_t *ms, int stmt)
+{
+    gwbuf_free(ms->ms_stmts[stmt]);
+    gwbuf_free(ms->ms_results[stmt]);
+    ms->ms_stmts[stmt] = NULL;
+    ms->ms_results[stmt] = modutil_create_mysql_err_msg(1, 0, 2013, "HY000",
+                                                        "Lost connection to backend server.");
+    ms->ms_done[stmt] = true;
+    ms->ms_n_pending--;
+}
+
+/**
+ * Set the flag telling that more results follow in the packet that ends a result
+ *
+ * @param packet An OK or an EOF packet
+ */
+static void mstmt_set_more_results(uint8_t *packet)
+{
+    size_t end = MYSQL_GET_PACKET_LEN(packet) + MYSQL_HEADER_LEN;
+    size_t offset = MYSQL_HEADER_LEN + 1;
+
+    if (packet[MYSQL_HEADER_LEN] == 0x00)
+    {
+        /** Skip the affected rows and the last insert ID to get to the status */
+        for (int i = 0; i < 2 && offset < end; i++)
+        {
+            uint8_t c = packet[offset];
+            offset += c < 0xfb ? 1 : c == 0xfc ? 3 : c == 0xfd ? 4 : 9;
+        }
+    }
+    else if (packet[MYSQL_HEADER_LEN] == 0xfe)
+    {
+        /** Skip the warning count */
+        offset += 2;
+    }
+    else
+    {
+        return;
+    }
+
+    if (offset + 2 <= end)
+    {
+        packet[offset] |= SERVER_MORE_RESULTS_EXIST;
+    }
+}
+
+/**
+ * Collect the results of the batch that can be returned to the client. The
+ * packets are renumbered to continue the sequence of the previous result and
+ * each result but the last one is marked to be followed by more results. The
+ * server stops executing a batch at the first error, so the results after an
+ * error are discarded.
+ *
+ * @param rses Router client session
+ * @return The results to return to the client or NULL if there are none
+ */
+static GWBUF *mstmt_flush(ROUTER_CLIENT_SES *rses)
+{
+    rwsplit_mstmt_t *ms = rses->rses_mstmt;
+    GWBUF *rval = NULL;
+
+    while (ms->ms_next < ms->ms_n_stmts && ms->ms_done[ms->ms_next])
+    {
+        GWBUF *result = ms->ms_results[ms->ms_next];
+        bool last = ms->ms_next == ms->ms_n_stmts - 1;
+
+        ms->ms_results[ms->ms_next++] = NULL;
+
+        if (ms->ms_discard || result == NULL ||
+            (result = gwbuf_make_contiguous(result)) == NULL)
+        {
+            gwbuf_free(result);
+            continue;
+        }
+
+        uint8_t *data = GWBUF_DATA(result);
+        size_t len = GWBUF_LENGTH(result);
+        size_t offset = 0;
+        uint8_t *packet = NULL;
+
+        while (offset + MYSQL_HEADER_LEN < len)
+        {
+            packet = data + offset;
+            packet[MYSQL_HEADER_LEN - 1] = ms->ms_seq++;
+            offset += MYSQL_GET_PACKET_LEN(packet) + MYSQL_HEADER_LEN;
+        }
+
+        if (packet && packet[MYSQL_HEADER_LEN] == 0xff)
+        {
+            ms->ms_discard = true;
+        }
+        else if (packet && !last)
+        {
+            mstmt_set_more_results(packet);
+        }
+
+        rval = gwbuf_append(rval, result);
+    }
+
+    return rval;
+}
+
+/**
+ * Return the completed results of the batch to the client and free the batch
+ * once all replies have been read
+ *
+ * @param rses Router client session
+ */
+static void mstmt_reply_client(ROUTER_CLIENT_SES *rses)
+{
+    GWBUF *buf = mstmt_flush(rses);
+
+    if (buf)
+    {
+        SESSION_ROUTE_REPLY(rses->client_dcb->session, buf);
+    }
+
+    if (rses->rses_mstmt->ms_n_pending == 0)
+    {
+        mstmt_free(rses->rses_mstmt);
+        rses->rses_mstmt = NULL;
+    }
+}
+
+/**
+ * Send the next statement of the batch that a backend executes
+ *
+ * @param inst Router instance
+ * @param rses Router client session
+ * @param bref The backend
+ */
+static void mstmt_send_next(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses, backend_ref_t *bref)
+{
+    rwsplit_mstmt_t *ms = rses->rses_mstmt;
+
+    bref->bref_mstmt_active = false;
+
+    for (int i = 0; i < ms->ms_n_stmts && !bref->bref_mstmt_active; i++)
+    {
+        if (ms->ms_brefs[i] != bref || ms->ms_stmts[i] == NULL)
+        {
+            continue;
+        }
+
+        GWBUF *stmt = ms->ms_stmts[i];
+        ms->ms_stmts[i] = NULL;
+
+        if (ms->ms_discard)
+        {
+            /** The client won't see the result */
+            gwbuf_free(stmt);
+            ms->ms_done[i] = true;
+            ms->ms_n_pending--;
+        }
+        else if (bref->bref_dcb->func.write(bref->bref_dcb, stmt) == 1)
+        {
+            ts_stats_add(inst->stats.n_queries, 1);
+            ts_stats_add(inst->stats.n_slave, 1);
+            bref_set_state(bref, BREF_QUERY_ACTIVE);
+            bref_set_state(bref, BREF_WAITING_RESULT);
+            bref_start_query(rses, bref, SERVICE_LATENCY_READ);
+            bref->bref_mstmt_active = true;
+            bref->bref_mstmt_stmt = i;
+            bref->bref_mstmt_packets = 0;
+            bref->bref_mstmt_eofs = 0;
+        }
+        else
+        {
+            MXS_ERROR("Failed to route a statement of a multi-statement batch to %s:%d.",
+                      bref->bref_backend->backend_server->name,
+                      bref->bref_backend->backend_server->port);
+            mstmt_set_error(ms, i);
+        }
+    }
+}
+
+/**
+ * Route a read-only multi-statement batch to the slaves. Each statement is
+ * sent to a slave of its own, or the statements are shared by the slaves in
+ * turns if there are more statements than slaves.
+ *
+ * Router session must be locked.
+ *
+ * @param inst     Router instance
+ * @param rses     Router client session
+ * @param querybuf A contiguous COM_QUERY packet
+ * @return True if the batch was routed, false if it should be routed normally
+ */
+static bool mstmt_route(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses, GWBUF *querybuf)
+{
+    MySQLProtocol *proto = (MySQLProtocol *)rses->client_dcb->protocol;
+
+    if (!(proto->client_capabilities & GW_MYSQL_CAPABILITIES_MULTI_STATEMENTS) ||
+        rses->rses_mstmt || rses->rses_transaction_active || rses->rses_load_active ||
+        rses->have_tmp_tables || querybuf->hint || rses->forced_node ||
+        (rses->rses_config.rw_causal_reads && (*rses->rses_gtid || rses->rses_gtid_pending)))
+    {
+        return false;
+    }
+
+    int n_stmts;
+    GWBUF **stmts = mstmt_split(querybuf, &n_stmts);
+    bool ok = n_stmts > 1;
+
+    for (int i = 0; ok && i < n_stmts; i++)
+    {
+        ok = get_route_target(rses, qc_get_type(stmts[i]), NULL) == TARGET_SLAVE &&
+            qc_get_operation(stmts[i]) == QUERY_OP_SELECT;
+    }
+
+    backend_ref_t **slaves = ok ? malloc(sizeof(backend_ref_t *) * rses->rses_nbackends) : NULL;
+    int max_rlag = rses_get_max_replication_lag(rses);
+    int n_slaves = 0;
+
+    for (int i = 0; slaves && i < rses->rses_nbackends; i++)
+    {
+        backend_ref_t *bref = &rses->rses_backend_ref[i];
+        SERVER *server = bref->bref_backend->backend_server;
+        SERVER status;
+        status.status = server->status;
+
+        if (BREF_IS_IN_USE(bref) && bref != rses->rses_master_ref && SERVER_IS_SLAVE(&status) &&
+            !BREF_IS_QUERY_ACTIVE(bref) && !BREF_IS_WAITING_RESULT(bref) &&
+            bref->bref_internal == BREF_INTERNAL_NONE && bref->bref_pending_cmd == NULL &&
+            !sescmd_cursor_behind(&bref->bref_sescmd_cur) &&
+            rlag_within_limit(server, max_rlag))
+        {
+            slaves[n_slaves++] = bref;
+        }
+    }
+
+    rwsplit_mstmt_t *ms = n_slaves > 0 ? calloc(1, sizeof(rwsplit_mstmt_t)) : NULL;
+
+    if (ms)
+    {
+        ms->ms_results = calloc(n_stmts, sizeof(GWBUF *));
+        ms->ms_done = calloc(n_stmts, sizeof(bool));
+        ms->ms_brefs = calloc(n_stmts, sizeof(backend_ref_t *));
+
+        if (ms->ms_results == NULL || ms->ms_done == NULL || ms->ms_brefs == NULL)
+        {
+            mstmt_free(ms);
+            ms = NULL;
+        }
+    }
+
+    if (ms == NULL)
+    {
+        for (int i = 0; i < n_stmts; i++)
+        {
+            gwbuf_free(stmts[i]);
+        }
+        free(stmts);
+        free(slaves);
+        return false;
+    }
+
+    ms->ms_n_stmts = n_stmts;
+    ms->ms_stmts = stmts;
+    ms->ms_n_pending = n_stmts;
+    ms->ms_seq = 1;
+
+    for (int i = 0; i < n_stmts; i++)
+    {
+        ms->ms_brefs[i] = slaves[i % n_slaves];
+    }
+
+    MXS_INFO("Routing a multi-statement batch of %d statements to %d slaves.",
+             n_stmts, n_slaves < n_stmts ? n_slaves : n_stmts);
+
+    rses->rses_mstmt = ms;
+
+    for (int i = 0; i < n_slaves && i < n_stmts; i++)
+    {
+        mstmt_send_next(inst, rses, slaves[i]);
+    }
+    free(slaves);
+
+    /** Statements that could not be sent already have their results */
+    mstmt_reply_client(rses);
+    return true;
+}
+
+/**
+ * Consume the reply to a statement of a multi-statement batch
+ *
+ * Once the whole reply has been read, the next statement is sent to the
+ * backend and the results that are complete are returned to the client.
+ *
+ * Router session must be locked.
+ *
+ * @param inst Router instance
+ * @param rses Router client session
+ * @param bref Backend reference
+ * @param buf  Buffer with complete packets
+ */
+static void mstmt_process_reply(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+                                backend_ref_t *bref, GWBUF *buf)
+{
+    rwsplit_mstmt_t *ms = rses->rses_mstmt;
+    bool done = false;
+    size_t offset = 0;
+
+    buf = gwbuf_make_contiguous(buf);
+
+    uint8_t *data = (uint8_t *)GWBUF_DATA(buf);
+    size_t len = GWBUF_LENGTH(buf);
+
+    while (!done && offset + MYSQL_HEADER_LEN < len)
+    {
+        uint8_t *packet = data + offset;
+        size_t plen = MYSQL_GET_PACKET_LEN(packet);
+        uint8_t cmd = packet[MYSQL_HEADER_LEN];
+
+        /**
+         * An error ends the result also when it comes in place of a row, a
+         * row never starts with 0xff.
+         */
+        if ((bref->bref_mstmt_packets == 0 && cmd == 0x00) || cmd == 0xff ||
+            (cmd == 0xfe && plen < 9 && ++bref->bref_mstmt_eofs == 2))
+        {
+            done = true;
+        }
+
+        bref->bref_mstmt_packets++;
+        offset += plen + MYSQL_HEADER_LEN;
+    }
+
+    int stmt = bref->bref_mstmt_stmt;
+
+    if (offset < len)
+    {
+        /** Nothing but the reply is expected from the backend */
+        buf = gwbuf_rtrim(buf, len - offset);
+    }
+    ms->ms_results[stmt] = gwbuf_append(ms->ms_results[stmt], buf);
+
+    if (done)
+    {
+        bref_end_query(rses, bref);
+        bref_clear_state(bref, BREF_QUERY_ACTIVE);
+        bref_clear_state(bref, BREF_WAITING_RESULT);
+        ms->ms_done[stmt] = true;
+        ms->ms_n_pending--;
+        mstmt_send_next(inst, rses, bref);
+        mstmt_reply_client(rses);
+    }
+}
+
+/**
+ * Give the statements of the batch that a failed backend was executing an
+ * error as their result
+ *
+ * @param rses Router client session
+ * @param bref The failed backend
+ */
+static void mstmt_fail_backend(ROUTER_CLIENT_SES *rses, backend_ref_t *bref)
+{
+    if (rses == NULL || rses->rses_mstmt == NULL)
+    {
+        return;
+    }
+
+    rwsplit_mstmt_t *ms = rses->rses_mstmt;
+    bool failed = false;
+
+    for (int i = 0; i < ms->ms_n_stmts; i++)
+    {
+        if (ms->ms_brefs[i] == bref && !ms->ms_done[i])
+        {
+            mstmt_set_error(ms, i);
+            failed = true;
+        }
+    }
+
+    bref->bref_mstmt_active = false;
+
+    if (failed && !rses->rses_closed && rses->client_dcb)
+    {
+        mstmt_reply_client(rses);
+    }
+}
+
+/**
+ * Get the delay after which a read that a slave has not started to answer is
+ * sent to another slave
+ *
+ * Without a configured delay, the 95th percentile of the read latency of the
+ * slave is used. It is calculated at most once a second for each slave.
+ *
+ * @param rses Router client session
+ * @param bref The slave
+ * @return The delay in milliseconds or -1 if the latency is not known
+ */
+static int64_t hedge_get_delay(ROUTER_CLIENT_SES *rses, backend_ref_t *bref)
+{
+    if (rses->rses_config.rw_hedge_delay > 0)
+    {
+        return rses->rses_config.rw_hedge_delay;
+    }
+
+    BACKEND *backend = bref->bref_backend;
+    uint64_t now = service_latency_now();
+
+    if (backend->hedge_delay_updated == 0 ||
+        now - backend->hedge_delay_updated > RW_HEDGE_DELAY_REFRESH)
+    {
+        int64_t count;
+        int64_t usec = service_latency_quantile(rses->router->service, backend->backend_server,
+                                                SERVICE_LATENCY_READ, 0.95, &count);
+
+        if (usec < 0 || usec == INT64_MAX || count < RW_HEDGE_MIN_SAMPLES)
+        {
+            backend->hedge_delay = -1;
+        }
+        else
+        {
+            backend->hedge_delay = usec < 1000 ? 1 : (usec + 999) / 1000;
+        }
+        backend->hedge_delay_updated = now;
+    }
+
+    return backend->hedge_delay;
+}
+
+/**
+ * Start timing a read that was sent to a slave
+ *
+ * Only reads that have no side effects are hedged, outside transactions and
+ * when nothing else decides where the read goes. One read is hedged at a time.
+ *
+ * Router session must be locked.
+ *
+ * @param rses     Router client session
+ * @param bref     The slave the read was sent to
+ * @param querybuf The read
+ */
+static void hedge_start(ROUTER_CLIENT_SES *rses, backend_ref_t *bref, GWBUF *querybuf)
+{
+    rwsplit_hedge_t *hedge = &rses->rses_hedge;
+
+    if (!rses->rses_config.rw_hedged_reads || hedge->h_query ||
+        bref == rses->rses_master_ref || bref->bref_internal != BREF_INTERNAL_NONE ||
+        !rses->rses_autocommit_enabled || rses->rses_transaction_active ||
+        rses->rses_trx_read_only || rses->rses_load_active || rses->rses_mstmt ||
+        rses->have_tmp_tables || querybuf->hint || rses->forced_node ||
+        (rses->rses_config.rw_causal_reads && (*rses->rses_gtid || rses->rses_gtid_pending)) ||
+        qc_get_operation(querybuf) != QUERY_OP_SELECT)
+    {
+        return;
+    }
+
+    int64_t delay = hedge_get_delay(rses, bref);
+
+    if (delay > 0 && (hedge->h_query = gwbuf_clone(querybuf)))
+    {
+        hedge->h_primary = bref;
+        hedge->h_secondary = NULL;
+        poll_timer_start(&hedge->h_timer, delay);
+    }
+}
+
+/**
+ * Stop hedging the read
+ *
+ * @param hedge The hedged read
+ */
+static void hedge_clear(rwsplit_hedge_t *hedge)
+{
+    gwbuf_free(hedge->h_query);
+    hedge->h_query = NULL;
+    hedge->h_primary = NULL;
+    hedge->h_secondary = NULL;
+}
+
+/**
+ * Check whether the reads hedged so far leave room for one more
+ *
+ * @param inst Router instance
+ * @param rses Router client session
+ * @return True if another read can be hedged
+ */
+static bool hedge_within_budget(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses)
+{
+    int64_t n_hedges = ts_stats_sum(inst->stats.n_hedges);
+    int64_t n_slave = ts_stats_sum(inst->stats.n_slave);
+
+    return n_hedges * 100 < (int64_t)rses->rses_config.rw_hedge_budget * n_slave;
+}
+
+/**
+ * Find an idle slave for a hedged read
+ *
+ * @param rses Router client session
+ * @return The slave with the shortest response time or NULL if no slave is idle
+ */
+static backend_ref_t *hedge_get_slave(ROUTER_CLIENT_SES *rses)
+{
+    int max_rlag = rses_get_max_replication_lag(rses);
+    backend_ref_t *best = NULL;
+
+    for (int i = 0; i < rses->rses_nbackends; i++)
+    {
+        backend_ref_t *bref = &rses->rses_backend_ref[i];
+        SERVER *server = bref->bref_backend->backend_server;
+        SERVER status;
+        status.status = server->status;
+
+        if (BREF_IS_IN_USE(bref) && bref != rses->rses_master_ref &&
+            bref != rses->rses_hedge.h_primary && SERVER_IS_SLAVE(&status) &&
+            !BREF_IS_QUERY_ACTIVE(bref) && !BREF_IS_WAITING_RESULT(bref) &&
+            bref->bref_internal == BREF_INTERNAL_NONE && bref->bref_pending_cmd == NULL &&
+            !bref->bref_hedge_drain && !sescmd_cursor_behind(&bref->bref_sescmd_cur) &&
+            rlag_within_limit(server, max_rlag) &&
+            (best == NULL || bref->bref_backend->response_time < best->bref_backend->response_time))
+        {
+            best = bref;
+        }
+    }
+
+    return best;
+}
+
+/**
+ * Send a read that the slave has not started to answer to a second slave
+ *
+ * Called by the timer of the hedged read in a polling thread.
+ *
+ * @param data Router client session
+ */
+static void hedge_timeout(void *data)
+{
+    ROUTER_CLIENT_SES *rses = (ROUTER_CLIENT_SES *)data;
+
+    /** The session was given to another thread while the read was pending */
+    if (rses->rses_confined &&
+        poll_session_owner(rses->client_dcb->session) != poll_current_thread())
+    {
+        return;
+    }
+
+    if (!rses_begin_locked_router_action(rses))
+    {
+        return;
+    }
+
+    ROUTER_INSTANCE *inst = rses->router;
+    rwsplit_hedge_t *hedge = &rses->rses_hedge;
+
+    if (hedge->h_query && hedge->h_secondary == NULL)
+    {
+        backend_ref_t *bref = NULL;
+
+        if (BREF_IS_IN_USE(hedge->h_primary) && BREF_IS_WAITING_RESULT(hedge->h_primary) &&
+            hedge_within_budget(inst, rses))
+        {
+            bref = hedge_get_slave(rses);
+        }
+
+        if (bref && bref->bref_dcb->func.write(bref->bref_dcb, gwbuf_clone(hedge->h_query)) == 1)
+        {
+            MXS_INFO("Read not answered by %s:%d, sending it to %s:%d.",
+                     hedge->h_primary->bref_backend->backend_server->name,
+                     hedge->h_primary->bref_backend->backend_server->port,
+                     bref->bref_backend->backend_server->name,
+                     bref->bref_backend->backend_server->port);
+            ts_stats_add(inst->stats.n_queries, 1);
+            ts_stats_add(inst->stats.n_hedges, 1);
+            bref_set_state(bref, BREF_QUERY_ACTIVE);
+            bref_set_state(bref, BREF_WAITING_RESULT);
+            bref_start_query(rses, bref, SERVICE_LATENCY_READ);
+            hedge->h_secondary = bref;
+        }
+        else
+        {
+            hedge_clear(hedge);
+        }
+    }
+
+    rses_end_locked_router_action(rses);
+}
+
+/**
+ * Decide the hedged read when one of its slaves starts to reply
+ *
+ * The slave that replies first answers the client. The read itself can't be
+ * cancelled on the other slave without another connection, so its reply is
+ * discarded when it arrives.
+ *
+ * Router session must be locked.
+ *
+ * @param inst Router instance
+ * @param rses Router client session
+ * @param bref The slave that replied
+ */
+static void hedge_choose(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses, backend_ref_t *bref)
+{
+    rwsplit_hedge_t *hedge = &rses->rses_hedge;
+    backend_ref_t *other = bref == hedge->h_primary ? hedge->h_secondary : hedge->h_primary;
+
+    if (hedge->h_secondary)
+    {
+        other->bref_hedge_drain = true;
+        other->bref_hedge_next = false;
+        other->bref_hedge_packets = 0;
+        other->bref_hedge_eofs = 0;
+
+        if (bref == hedge->h_secondary)
+        {
+            ts_stats_add(inst->stats.n_hedge_wins, 1);
+        }
+    }
+
+    hedge_clear(hedge);
+}
+
+/**
+ * Discard the reply to a hedged read that the other slave answered first
+ *
+ * Router session must be locked.
+ *
+ * @param rses Router client session
+ * @param bref Backend reference
+ * @param buf  Buffer with complete packets
+ * @return The packets that follow the discarded reply or NULL if there are none
+ */
+static GWBUF *hedge_drain_reply(ROUTER_CLIENT_SES *rses, backend_ref_t *bref, GWBUF *buf)
+{
+    bool done = false;
+    size_t offset = 0;
+
+    buf = gwbuf_make_contiguous(buf);
+
+    uint8_t *data = (uint8_t *)GWBUF_DATA(buf);
+    size_t len = GWBUF_LENGTH(buf);
+
+    while (!done && offset + MYSQL_HEADER_LEN < len)
+    {
+        uint8_t *packet = data + offset;
+        size_t plen = MYSQL_GET_PACKET_LEN(packet);
+        uint8_t cmd = packet[MYSQL_HEADER_LEN];
+
+        /**
+         * An error can end the result at any point, also in the middle of
+         * the rows. A row never starts with 0xff, it is not a valid length.
+         */
+        if ((bref->bref_hedge_packets == 0 && cmd == 0x00) || cmd == 0xff ||
+            (cmd == 0xfe && plen < 9 && ++bref->bref_hedge_eofs == 2))
+        {
+            done = true;
+        }
+
+        bref->bref_hedge_packets++;
+        offset += plen + MYSQL_HEADER_LEN;
+    }
+
+    if (done)
+    {
+        bref->bref_hedge_drain = false;
+
+        /** The latency of the slower slave is recorded as well */
+        if (!bref->bref_hedge_next)
+        {
+            bref_end_query(rses, bref);
+            bref_clear_state(bref, BREF_QUERY_ACTIVE);
+            bref_clear_state(bref, BREF_WAITING_RESULT);
+        }
+    }
+
+    if (offset < len)
+    {
+        return gwbuf_consume(buf, offset);
+    }
+
+    gwbuf_free(buf);
+    return NULL;
+}
+
+/**
+ * Stop hedging a read on a failed backend
+ *
+ * @param rses Router client session
+ * @param bref The failed backend
+ * @return True if the client does not wait for a reply from the backend, the
+ *         other slave of the hedged read answers it
+ */
+static bool hedge_fail_backend(ROUTER_CLIENT_SES *rses, backend_ref_t *bref)
+{
+    if (rses == NULL)
+    {
+        return false;
+    }
+
+    rwsplit_hedge_t *hedge = &rses->rses_hedge;
+    bool answered = false;
+
+    if (bref->bref_hedge_drain)
+    {
+        answered = !bref->bref_hedge_next;
+        bref->bref_hedge_drain = false;
+    }
+    else if (hedge->h_query && (bref == hedge->h_primary || bref == hedge->h_secondary))
+    {
+        /** The other slave, if the read was sent to it, answers the client */
+        answered = hedge->h_secondary != NULL;
+        hedge_clear(hedge);
+    }
+
+    return answered;
 }
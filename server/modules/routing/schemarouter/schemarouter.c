@@ -29,6 +29,7 @@
 #include <modutil.h>
 #include <mysql_client_server_protocol.h>
 #include <maxscale/poll.h>
+#include <mysql_utils.h>
 #include <pcre.h>
 
 #define DEFAULT_REFRESH_INTERVAL 30.0
@@ -39,6 +40,9 @@
 /** Hashtable size for the per user shard maps */
 #define SCHEMAROUTER_USERHASH_SIZE 10
 
+/** How often the refresh thread of the shared shard map checks for requests, in milliseconds */
+#define SHARED_MAP_POLL_INTERVAL 100
+
 MODULE_INFO info =
 {
     MODULE_API_ROUTER,
@@ -97,6 +101,7 @@ static bool connect_backend_servers(backend_ref_t*   backend_ref,
                                     int              router_nservers,
                                     SESSION*         session,
                                     ROUTER_INSTANCE* router);
+static bool connect_backend(backend_ref_t* bref, SESSION* session);
 
 static bool get_shard_dcb(DCB**              dcb,
                           ROUTER_CLIENT_SES* rses,
@@ -174,6 +179,7 @@ int inspect_backend_mapping_states(ROUTER_CLIENT_SES *router_cli_ses,
                                    backend_ref_t *bref,
                                    GWBUF** wbuf);
 bool handle_default_db(ROUTER_CLIENT_SES *router_cli_ses);
+bool have_servers(ROUTER_CLIENT_SES* rses);
 void route_queued_query(ROUTER_CLIENT_SES *router_cli_ses);
 void synchronize_shard_map(ROUTER_CLIENT_SES *client);
 
@@ -225,6 +231,8 @@ shard_map_t* shard_map_alloc()
             spinlock_init(&rval->lock);
             rval->last_updated = 0;
             rval->state = SHMAP_UNINIT;
+            rval->refcount = 1;
+            rval->version = 0;
         }
         else
         {
@@ -235,6 +243,246 @@ shard_map_t* shard_map_alloc()
     return rval;
 }
 
+/**
+ * Check if a database may be found on more than one server
+ * @param router Router instance
+ * @param db Database name
+ * @return True if the database is in ignore_databases or matches ignore_databases_regex
+ */
+static bool is_ignored_database(ROUTER_INSTANCE* router, const char* db)
+{
+    return hashtable_fetch(router->ignored_dbs, (void*)db) ||
+           (router->ignore_regex &&
+            pcre2_match(router->ignore_regex, (PCRE2_SPTR)db, PCRE2_ZERO_TERMINATED, 0, 0,
+                        mxs_pcre2_thread_match_data(1), NULL) >= 0);
+}
+
+/**
+ * Take a reference to the latest version of the shared shard map.
+ * @param router Router instance
+ * @return The shared shard map or NULL if it has not been created yet
+ */
+static shard_map_t* shared_map_get(ROUTER_INSTANCE* router)
+{
+    spinlock_acquire(&router->lock);
+    shard_map_t* map = router->shared_map;
+
+    if (map)
+    {
+        atomic_add(&map->refcount, 1);
+    }
+
+    spinlock_release(&router->lock);
+    return map;
+}
+
+/**
+ * Release a reference to a shared shard map. The map is freed once the last
+ * reference to it is released.
+ * @param map Shared shard map
+ */
+static void shared_map_release(shard_map_t* map)
+{
+    if (atomic_add(&map->refcount, -1) == 1)
+    {
+        hashtable_free(map->hash);
+        free(map);
+    }
+}
+
+/**
+ * Request a refresh of the shared shard map. The refresh is done by the refresh
+ * thread of the router.
+ * @param router Router instance
+ */
+static void shared_map_request_refresh(ROUTER_INSTANCE* router)
+{
+    __atomic_store_n(&router->shared_map_refresh, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Switch a session to the latest version of the shared shard map.
+ * @param rses Router client session using the shared shard map
+ * @return True if the session was using an older version of the map
+ */
+static bool shared_map_update_session(ROUTER_CLIENT_SES* rses)
+{
+    ss_dassert(rses->shardmap_shared);
+    shard_map_t* map = shared_map_get(rses->router);
+
+    if (map == NULL || map == rses->shardmap)
+    {
+        if (map)
+        {
+            shared_map_release(map);
+        }
+        return false;
+    }
+
+    shared_map_release(rses->shardmap);
+    rses->shardmap = map;
+    return true;
+}
+
+/**
+ * Add the databases of a server to a shard map. The databases are read with
+ * the credentials of the service.
+ * @param router Router instance
+ * @param server Server to query
+ * @param map Shard map to populate
+ * @return True if the databases were read and none of them was found on another server
+ */
+static bool shared_map_add_server(ROUTER_INSTANCE* router, SERVER* server, shard_map_t* map)
+{
+    char *user, *passwd, *dpasswd;
+    bool rval = false;
+
+    if (serviceGetUser(router->service, &user, &passwd) == 0)
+    {
+        return false;
+    }
+
+    MYSQL* con = mysql_init(NULL);
+
+    if (con == NULL || (dpasswd = decryptPassword(passwd)) == NULL)
+    {
+        if (con)
+        {
+            mysql_close(con);
+        }
+        return false;
+    }
+
+    GATEWAY_CONF* cnf = config_get_global_options();
+    mysql_options(con, MYSQL_OPT_READ_TIMEOUT, &cnf->auth_read_timeout);
+    mysql_options(con, MYSQL_OPT_CONNECT_TIMEOUT, &cnf->auth_conn_timeout);
+    mysql_options(con, MYSQL_OPT_WRITE_TIMEOUT, &cnf->auth_write_timeout);
+
+    MYSQL_RES* result;
+
+    if (mxs_mysql_real_connect(con, server, user, dpasswd) == NULL ||
+        mysql_query(con, "SHOW DATABASES") != 0 ||
+        (result = mysql_store_result(con)) == NULL)
+    {
+        MXS_ERROR("[%s] Failed to read the databases of server '%s' for the shared shard map: %s",
+                  router->service->name, server->unique_name, mysql_error(con));
+    }
+    else
+    {
+        MYSQL_ROW row;
+        rval = true;
+
+        while ((row = mysql_fetch_row(result)))
+        {
+            if (!hashtable_add(map->hash, row[0], server->unique_name) &&
+                !is_ignored_database(router, row[0]))
+            {
+                MXS_ERROR("[%s] Database '%s' found on servers '%s' and '%s', "
+                          "the shared shard map is not updated.",
+                          router->service->name, row[0], server->unique_name,
+                          (char*)hashtable_fetch(map->hash, row[0]));
+                rval = false;
+            }
+        }
+
+        mysql_free_result(result);
+    }
+
+    free(dpasswd);
+    mysql_close(con);
+    return rval;
+}
+
+/**
+ * Build a new version of the shared shard map and replace the current one
+ * with it. If a running server can not be queried, the current map is kept.
+ * @param router Router instance
+ */
+static void shared_map_refresh(ROUTER_INSTANCE* router)
+{
+    shard_map_t* map = shard_map_alloc();
+    bool ok = map != NULL;
+
+    for (int i = 0; ok && router->servers[i]; i++)
+    {
+        SERVER* server = router->servers[i]->backend_server;
+
+        if (SERVER_IS_RUNNING(server))
+        {
+            ok = shared_map_add_server(router, server, map);
+        }
+    }
+
+    if (ok)
+    {
+        map->state = SHMAP_READY;
+        map->last_updated = time(NULL);
+
+        spinlock_acquire(&router->lock);
+        shard_map_t* old = router->shared_map;
+        map->version = ++router->shared_map_version;
+        router->shared_map = map;
+        spinlock_release(&router->lock);
+
+        if (old)
+        {
+            shared_map_release(old);
+        }
+
+        atomic_add(&router->stats.shmap_refresh, 1);
+        MXS_INFO("[%s] Shared shard map updated to version %lu with %d databases.",
+                 router->service->name, map->version, hashtable_size(map->hash));
+    }
+    else
+    {
+        if (map)
+        {
+            shared_map_release(map);
+        }
+        atomic_add(&router->stats.shmap_refresh_failed, 1);
+    }
+}
+
+/**
+ * The refresh thread of the shared shard map. The map is refreshed every
+ * refresh_interval seconds and whenever a refresh is requested. The sessions
+ * request a refresh after they have changed the databases or when the map has
+ * no database they are looking for.
+ * @param data Router instance
+ */
+static void shared_map_thread(void* data)
+{
+    ROUTER_INSTANCE* router = (ROUTER_INSTANCE*)data;
+    time_t last_refresh = 0;
+
+    while (true)
+    {
+        int requested = __atomic_exchange_n(&router->shared_map_refresh, 0, __ATOMIC_ACQ_REL);
+
+        if (requested || router->shared_map == NULL ||
+            difftime(time(NULL), last_refresh) >= router->schemarouter_config.refresh_min_interval)
+        {
+            shared_map_refresh(router);
+            last_refresh = time(NULL);
+        }
+
+        thread_millisleep(SHARED_MAP_POLL_INTERVAL);
+    }
+}
+
+/**
+ * Check if a statement creates or drops a database
+ * @param buffer Statement that creates or drops an object
+ * @return True if the object is a database
+ */
+static bool is_database_ddl(GWBUF* buffer)
+{
+    char* sql = modutil_get_SQL(buffer);
+    bool rval = sql && (strcasestr(sql, "DATABASE") || strcasestr(sql, "SCHEMA"));
+    free(sql);
+    return rval;
+}
+
 /**
  * Convert a length encoded string into a C string.
  * @param data Pointer to the first byte of the string
@@ -370,11 +618,7 @@ showdb_response_t parse_showdb_response(ROUTER_CLIENT_SES* rses, backend_ref_t*
             }
             else
             {
-                if (!(hashtable_fetch(rses->router->ignored_dbs, data) ||
-                      (rses->router->ignore_regex &&
-                       pcre2_match(rses->router->ignore_regex, (PCRE2_SPTR)data,
-                                   PCRE2_ZERO_TERMINATED, 0, 0,
-                                   rses->router->ignore_match_data, NULL) >= 0)))
+                if (!is_ignored_database(rses->router, data))
                 {
                     duplicate_found = true;
                     MXS_ERROR("Database '%s' found on servers '%s' and '%s' for user %s@%s.",
@@ -717,7 +961,7 @@ static ROUTER* createInstance(SERVICE *service, char **options)
                          (HASHMEMORYFN)free,
                          NULL);
 
-    if ((router->shard_maps = hashtable_alloc(SCHEMAROUTER_USERHASH_SIZE, hashkeyfun, hashcmpfun)) == NULL)
+    if ((router->shard_maps = hashtable_alloc_concurrent(SCHEMAROUTER_USERHASH_SIZE, hashkeyfun, hashcmpfun)) == NULL)
     {
         MXS_ERROR("Memory allocation failed when allocating schemarouter database ignore list.");
         hashtable_free(router->ignored_dbs);
@@ -837,6 +1081,26 @@ static ROUTER* createInstance(SERVICE *service, char **options)
         {
             router->schemarouter_config.debug = config_truth_value(value);
         }
+        else if (strcmp(options[i], "shared_map") == 0)
+        {
+            router->schemarouter_config.shared_map = config_truth_value(value);
+        }
+        else if (strcmp(options[i], "lazy_connect") == 0)
+        {
+            router->schemarouter_config.lazy_connect = config_truth_value(value);
+        }
+        else if (strcmp(options[i], "idle_timeout") == 0)
+        {
+            router->schemarouter_config.idle_timeout = atof(value);
+        }
+        else if (strcmp(options[i], "shard_table") == 0)
+        {
+            if (!shard_table_add_rule(&router->table_rules, value, service->name))
+            {
+                failure = true;
+                break;
+            }
+        }
         else
         {
             MXS_ERROR("Unknown router options for Schemarouter: %s", options[i]);
@@ -851,8 +1115,20 @@ static ROUTER* createInstance(SERVICE *service, char **options)
         router->schemarouter_config.max_sescmd_hist = 0;
     }
 
+    /** The connections opened later need the whole session command history */
+    if (router->schemarouter_config.lazy_connect &&
+        (router->schemarouter_config.disable_sescmd_hist ||
+         router->schemarouter_config.max_sescmd_hist > 0))
+    {
+        MXS_WARNING("[%s] 'lazy_connect' can not be used with a limited or disabled "
+                    "session command history, connecting to all servers on session start.",
+                    service->name);
+        router->schemarouter_config.lazy_connect = false;
+    }
+
     if (failure)
     {
+        shard_table_free(router->table_rules);
         free(router);
         return NULL;
     }
@@ -907,6 +1183,11 @@ static ROUTER* createInstance(SERVICE *service, char **options)
     }
     router->servers[nservers] = NULL;
 
+    if (!shard_table_init(router->table_rules, router->servers, router->ignored_dbs, service->name))
+    {
+        goto clean_up;
+    }
+
     /**
      * Process the options
      */
@@ -919,6 +1200,14 @@ static ROUTER* createInstance(SERVICE *service, char **options)
      */
     router->schemarouter_version = service->svc_config_version;
 
+    if (router->schemarouter_config.shared_map &&
+        thread_start(&router->shared_map_thread, shared_map_thread, router) == NULL)
+    {
+        MXS_ERROR("[%s] Failed to start the refresh thread of the shared shard map, "
+                  "the shard maps are created by the sessions.", service->name);
+        router->schemarouter_config.shared_map = false;
+    }
+
     /**
      * We have completed the creation of the router data, so now
      * insert this router into the linked list of routers
@@ -938,6 +1227,7 @@ clean_up:
         free(router->servers[i]);
     }
     free(router->servers);
+    shard_table_free(router->table_rules);
     free(router);
     router = NULL;
     /** Fallthrough */
@@ -1028,17 +1318,27 @@ static void* newSession(ROUTER* router_inst, SESSION* session)
     client_rses->rses_mysql_session = (MYSQL_session*)session->client_dcb->data;
     client_rses->rses_client_dcb = (DCB*)session->client_dcb;
 
-    spinlock_acquire(&router->lock);
-
-    shard_map_t *map = hashtable_fetch(router->shard_maps, session->client_dcb->user);
+    shard_map_t *map = NULL;
     enum shard_map_state state;
 
-    if (map)
+    if (router->schemarouter_config.shared_map && (map = shared_map_get(router)))
     {
-        state = shard_map_update_state(map, router);
+        client_rses->shardmap_shared = true;
+        state = SHMAP_READY;
     }
+    else
+    {
+        spinlock_acquire(&router->lock);
 
-    spinlock_release(&router->lock);
+        map = hashtable_fetch(router->shard_maps, session->client_dcb->user);
+
+        if (map)
+        {
+            state = shard_map_update_state(map, router);
+        }
+
+        spinlock_release(&router->lock);
+    }
 
     if (map == NULL || state != SHMAP_READY)
     {
@@ -1116,6 +1416,7 @@ static void* newSession(ROUTER* router_inst, SESSION* session)
         backend_ref[i].n_mapping_eof = 0;
         backend_ref[i].map_queue = NULL;
         backend_ref[i].bref_backend = router->servers[i];
+        backend_ref[i].bref_gather_shard = -1;
         /** store pointers to sescmd list to both cursors */
         backend_ref[i].bref_sescmd_cur.scmd_cur_rses = client_rses;
         backend_ref[i].bref_sescmd_cur.scmd_cur_active = false;
@@ -1125,6 +1426,7 @@ static void* newSession(ROUTER* router_inst, SESSION* session)
     }
 
     spinlock_init(&client_rses->rses_lock);
+    spinlock_set_name(&client_rses->rses_lock, "schemarouter rses_lock");
     client_rses->rses_backend_ref = backend_ref;
 
     /**
@@ -1139,12 +1441,21 @@ static void* newSession(ROUTER* router_inst, SESSION* session)
         goto return_rses;
     }
     /**
-     * Connect to all backend servers
+     * Connect to all backend servers. With lazy_connect the servers are
+     * connected to when they are first used if the databases do not need
+     * to be mapped.
      */
-    succp = connect_backend_servers(backend_ref,
-                                    router_nservers,
-                                    session,
-                                    router);
+    if (client_rses->rses_config.lazy_connect && (client_rses->init & INIT_UNINT) == 0)
+    {
+        succp = true;
+    }
+    else
+    {
+        succp = connect_backend_servers(backend_ref,
+                                        router_nservers,
+                                        session,
+                                        router);
+    }
 
     rses_end_locked_router_action(client_rses);
 
@@ -1177,6 +1488,7 @@ static void* newSession(ROUTER* router_inst, SESSION* session)
     }
 
     rses_end_locked_router_action(client_rses);
+    client_rses->rses_confined = poll_session_confined(session);
 
     atomic_add(&router->stats.sessions, 1);
 
@@ -1338,6 +1650,12 @@ static void freeSession(ROUTER* router_instance, void* router_client_session)
             ;
         }
     }
+
+    if (router_cli_ses->shardmap_shared)
+    {
+        shared_map_release(router_cli_ses->shardmap);
+    }
+    gather_free(router_cli_ses->gather);
     spinlock_acquire(&router->lock);
 
     if (router->connections == router_cli_ses)
@@ -1426,6 +1744,20 @@ static bool get_shard_dcb(DCB**              p_dcb,
          * backend must be in use, name must match, and
          * the backend state must be RUNNING
          */
+        if (rses->rses_config.lazy_connect &&
+            !BREF_IS_IN_USE((&backend_ref[i])) &&
+            (strncasecmp(name, b->backend_server->unique_name, PATH_MAX) == 0) &&
+            SERVER_IS_RUNNING(b->backend_server))
+        {
+            if (!connect_backend(&backend_ref[i], rses->rses_client_dcb->session))
+            {
+                MXS_ERROR("Unable to establish connection with %s:%d",
+                          b->backend_server->name, b->backend_server->port);
+                goto return_succp;
+            }
+            atomic_add(&rses->router->stats.n_lazy_connect, 1);
+        }
+
         if (BREF_IS_IN_USE((&backend_ref[i])) &&
             (strncasecmp(name, b->backend_server->unique_name, PATH_MAX) == 0) &&
             SERVER_IS_RUNNING(b->backend_server))
@@ -1441,6 +1773,50 @@ return_succp:
     return succp;
 }
 
+/**
+ * Close the lazily opened backend connections that have not been used for
+ * idle_timeout seconds. Connections that are waiting for a result or executing
+ * session commands are kept, as are all connections while a transaction is
+ * open. The connections are opened again when they are next used. Must be
+ * called with the router session lock.
+ *
+ * @param rses  Router client session
+ * @param keep  Backend that is about to be used
+ */
+static void close_idle_backends(ROUTER_CLIENT_SES* rses, backend_ref_t* keep)
+{
+    if (!rses->rses_config.lazy_connect || rses->rses_config.idle_timeout <= 0 ||
+        rses->rses_transaction_active)
+    {
+        return;
+    }
+
+    time_t now = time(NULL);
+
+    for (int i = 0; i < rses->rses_nbackends; i++)
+    {
+        backend_ref_t* bref = &rses->rses_backend_ref[i];
+
+        if (bref != keep && BREF_IS_IN_USE(bref) && !BREF_IS_WAITING_RESULT(bref) &&
+            !sescmd_cursor_is_active(&bref->bref_sescmd_cur) && bref->bref_pending_cmd == NULL &&
+            difftime(now, bref->bref_last_used) >= rses->rses_config.idle_timeout)
+        {
+            MXS_INFO("schemarouter: Closing idle connection to %s for session %p",
+                     bref->bref_backend->backend_server->unique_name,
+                     rses->rses_client_dcb->session);
+            dcb_remove_callback(bref->bref_dcb,
+                                DCB_REASON_NOT_RESPONDING,
+                                &router_handle_state_switch,
+                                (void *)bref);
+            bref_clear_state(bref, BREF_IN_USE);
+            bref_set_state(bref, BREF_CLOSED);
+            dcb_close(bref->bref_dcb);
+            atomic_add(&bref->bref_backend->backend_conn_count, -1);
+            atomic_add(&rses->router->stats.n_idle_closed, 1);
+        }
+    }
+}
+
 
 /**
  * Examine the query type, transaction state and routing hints. Find out the
@@ -1825,6 +2201,137 @@ bool send_database_list(ROUTER_INSTANCE* router, ROUTER_CLIENT_SES* client)
  * an error message is sent to the client.
  *
  */
+/**
+ * Check if the query has a hint that routes it to all servers
+ *
+ * @param hint The hints of the query
+ * @return True if one of the hints is a HINT_ROUTE_TO_ALL
+ */
+static bool has_route_to_all_hint(HINT* hint)
+{
+    for (; hint; hint = hint->next)
+    {
+        if (hint->type == HINT_ROUTE_TO_ALL)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Send the merged result of a query from all shards to the client
+ *
+ * @param rses   Router client session
+ * @param result The packets to send, may be NULL
+ */
+static void send_gathered_result(ROUTER_CLIENT_SES* rses, GWBUF* result)
+{
+    if (result)
+    {
+        SESSION_ROUTE_REPLY(rses->rses_client_dcb->session, result);
+    }
+
+    if (rses->gather && gather_done(rses->gather))
+    {
+        gather_free(rses->gather);
+        rses->gather = NULL;
+    }
+}
+
+/**
+ * Route a SELECT to all running shards. The result sets of the shards are
+ * merged in clientReply. Must be called with the router session lock.
+ *
+ * @param inst     Router instance
+ * @param rses     Router client session
+ * @param querybuf The query
+ * @param rule     The sharded table of the query or NULL to use all servers
+ * @return 1 if the query was routed or an error was sent to the client, 0 on fatal error
+ */
+static int route_scatter_query(ROUTER_INSTANCE* inst, ROUTER_CLIENT_SES* rses, GWBUF* querybuf,
+                               SHARD_TABLE_RULE* rule)
+{
+    backend_ref_t* targets[rses->rses_nbackends];
+    GWBUF* shard_query = NULL;
+    const char* err = NULL;
+    int nshards = 0;
+
+    if (rses->gather)
+    {
+        write_error_to_client(rses->rses_client_dcb, SCHEMA_ERR_SCATTER, SCHEMA_ERRSTR_SCATTER,
+                              "A query to all shards is already in progress");
+        return 1;
+    }
+
+    for (int i = 0; i < rses->rses_nbackends; i++)
+    {
+        backend_ref_t* bref = &rses->rses_backend_ref[i];
+        DCB* dcb = NULL;
+
+        if (SERVER_IS_RUNNING(bref->bref_backend->backend_server) &&
+            (rule == NULL || shard_table_has_server(rule, bref->bref_backend->backend_server->unique_name)) &&
+            get_shard_dcb(&dcb, rses, bref->bref_backend->backend_server->unique_name))
+        {
+            targets[nshards++] = bref;
+        }
+    }
+
+    if (nshards == 0)
+    {
+        MXS_ERROR("Schemarouter: Failed to route query, "
+                  "no backends are available.");
+        return 0;
+    }
+
+    if ((rses->gather = gather_create(querybuf, nshards, &shard_query, &err)) == NULL)
+    {
+        MXS_INFO("schemarouter: Query can not be sent to all shards: %s", err);
+        write_error_to_client(rses->rses_client_dcb, SCHEMA_ERR_SCATTER, SCHEMA_ERRSTR_SCATTER, err);
+        atomic_add(&inst->stats.n_scatter_rejected, 1);
+        return 1;
+    }
+
+    atomic_add(&inst->stats.n_scatter, 1);
+
+    for (int i = 0; i < nshards; i++)
+    {
+        backend_ref_t* bref = targets[i];
+        GWBUF* query = gwbuf_clone(shard_query ? shard_query : querybuf);
+
+        bref->bref_gather_shard = i;
+        bref->bref_last_used = time(NULL);
+
+        if (sescmd_cursor_is_active(&bref->bref_sescmd_cur))
+        {
+            /** Sent once the session commands have been executed */
+            bref->bref_pending_cmd = query;
+        }
+        else if (query && bref->bref_dcb->func.write(bref->bref_dcb, query) == 1)
+        {
+            atomic_add(&inst->stats.n_queries, 1);
+            atomic_add(&bref->bref_backend->stats.queries, 1);
+            bref_set_state(bref, BREF_QUERY_ACTIVE);
+            bref_set_state(bref, BREF_WAITING_RESULT);
+        }
+        else
+        {
+            GWBUF* error = modutil_create_mysql_err_msg(1, 0, SCHEMA_ERR_SCATTER, SCHEMA_ERRSTR_SCATTER,
+                                                        "Routing query to a shard failed");
+            MXS_ERROR("Routing query to %s failed.", bref->bref_backend->backend_server->unique_name);
+            bref->bref_gather_shard = -1;
+
+            if (error)
+            {
+                send_gathered_result(rses, gather_shard_failed(rses->gather, i, error));
+            }
+        }
+    }
+
+    gwbuf_free(shard_query);
+    return 1;
+}
+
 static int routeQuery(ROUTER* instance,
                       void* router_session,
                       GWBUF* qbuf)
@@ -2001,6 +2508,13 @@ static int routeQuery(ROUTER* instance,
         break;
     } /**< switch by packet type */
 
+    if (router_cli_ses->shardmap_shared &&
+        (packet_type == MYSQL_COM_CREATE_DB || packet_type == MYSQL_COM_DROP_DB ||
+         ((op == QUERY_OP_CREATE || op == QUERY_OP_DROP) && is_database_ddl(querybuf))))
+    {
+        /** The new map is requested once the servers have executed the statement */
+        router_cli_ses->refresh_on_reply = true;
+    }
 
     if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_INFO))
     {
@@ -2035,6 +2549,24 @@ static int routeQuery(ROUTER* instance,
                                               router_cli_ses->shardmap->hash,
                                               querybuf);
         spinlock_release(&router_cli_ses->shardmap->lock);
+        if (!change_successful && router_cli_ses->shardmap_shared)
+        {
+            /** A newer version of the shared map may have the database. If
+             * it does not, the map is refreshed in the background and the
+             * session maps the databases itself. */
+            if (shared_map_update_session(router_cli_ses))
+            {
+                change_successful = change_current_db(router_cli_ses->current_db,
+                                                      router_cli_ses->shardmap->hash,
+                                                      querybuf);
+            }
+
+            if (!change_successful)
+            {
+                shared_map_request_refresh(inst);
+            }
+        }
+
         if (!change_successful)
         {
             time_t now = time(NULL);
@@ -2052,6 +2584,21 @@ static int routeQuery(ROUTER* instance,
                 router_cli_ses->queue = querybuf;
                 int rc_refresh = 1;
 
+                if (router_cli_ses->shardmap_shared)
+                {
+                    shared_map_release(router_cli_ses->shardmap);
+                    router_cli_ses->shardmap_shared = false;
+                }
+
+                if (router_cli_ses->rses_config.lazy_connect)
+                {
+                    /** All servers are needed for the mapping */
+                    connect_backend_servers(router_cli_ses->rses_backend_ref,
+                                            router_cli_ses->rses_nbackends,
+                                            router_cli_ses->rses_client_dcb->session,
+                                            inst);
+                }
+
                 if ((router_cli_ses->shardmap = shard_map_alloc()))
                 {
                     gen_databaselist(inst, router_cli_ses);
@@ -2093,11 +2640,91 @@ static int routeQuery(ROUTER* instance,
         goto retblock;
     }
 
+    SHARD_TABLE_RULE* table_rule = NULL;
+    const char* table_server = NULL;
+    shard_table_route_t table_route = SHARD_TABLE_NONE;
+    bool is_read = QUERY_IS_TYPE(qtype, QUERY_TYPE_READ) && !QUERY_IS_TYPE(qtype, QUERY_TYPE_WRITE) &&
+        !QUERY_IS_TYPE(qtype, QUERY_TYPE_SESSION_WRITE);
+
+    /**
+     * The parameters of a prepared statement are not known until it is
+     * executed and the statement is prepared on only one server.
+     */
+    if (inst->table_rules && packet_type == MYSQL_COM_STMT_PREPARE &&
+        shard_table_find(inst->table_rules, querybuf, router_cli_ses->current_db))
+    {
+        write_error_to_client(router_cli_ses->rses_client_dcb, SCHEMA_ERR_SCATTER,
+                              SCHEMA_ERRSTR_SCATTER,
+                              "Prepared statements can not be used with sharded tables");
+        ret = 1;
+        goto retblock;
+    }
+
+    if (inst->table_rules && packet_type == MYSQL_COM_QUERY &&
+        !QUERY_IS_TYPE(qtype, QUERY_TYPE_SESSION_WRITE))
+    {
+        const char* err = NULL;
+        table_route = shard_table_route(inst->table_rules, querybuf, router_cli_ses->current_db,
+                                        &table_rule, &table_server, &err);
+
+        if (table_route == SHARD_TABLE_ALL && !is_read)
+        {
+            table_route = SHARD_TABLE_ERROR;
+            err = "Writes to a sharded table must compare the sharding key to a constant "
+                "or insert constant values of it";
+        }
+
+        if (table_route == SHARD_TABLE_ERROR)
+        {
+            write_error_to_client(router_cli_ses->rses_client_dcb, SCHEMA_ERR_SCATTER,
+                                  SCHEMA_ERRSTR_SCATTER, err);
+            ret = 1;
+            goto retblock;
+        }
+
+        if (table_route == SHARD_TABLE_SERVER)
+        {
+            atomic_add(&inst->stats.n_shard_key, 1);
+        }
+    }
+
+    if (packet_type == MYSQL_COM_QUERY && is_read &&
+        (table_route == SHARD_TABLE_ALL || has_route_to_all_hint(querybuf->hint)))
+    {
+        if (!rses_begin_locked_router_action(router_cli_ses))
+        {
+            MXS_INFO("Route query aborted! Routing session is closed <");
+            ret = 0;
+            goto retblock;
+        }
+
+        ret = route_scatter_query(inst, router_cli_ses, querybuf, table_rule);
+        rses_end_locked_router_action(router_cli_ses);
+        goto retblock;
+    }
+
     route_target = get_shard_route_target(qtype,
                                           router_cli_ses->rses_transaction_active,
                                           querybuf->hint);
 
-    if (packet_type == MYSQL_COM_INIT_DB || op == QUERY_OP_CHANGE_DB)
+    if (table_route == SHARD_TABLE_SERVER)
+    {
+        if (check_shard_status(inst, (char*)table_server))
+        {
+            route_target = TARGET_NAMED_SERVER;
+            targetserver = strdup(table_server);
+        }
+        else
+        {
+            snprintf(errbuf, sizeof(errbuf), "Shard %.*s is not available",
+                     (int)sizeof(errbuf) - 20, table_server);
+            write_error_to_client(router_cli_ses->rses_client_dcb, SCHEMA_ERR_SCATTER,
+                                  SCHEMA_ERRSTR_SCATTER, errbuf);
+            ret = 1;
+            goto retblock;
+        }
+    }
+    else if (packet_type == MYSQL_COM_INIT_DB || op == QUERY_OP_CHANGE_DB)
     {
         route_target = TARGET_UNDEFINED;
 
@@ -2230,7 +2857,20 @@ static int routeQuery(ROUTER* instance,
     {
         int z;
 
-        for (z = 0; inst->servers[z]; z++)
+        /** Prefer a server that is already connected */
+        for (z = 0; router_cli_ses->rses_config.lazy_connect && z < router_cli_ses->rses_nbackends; z++)
+        {
+            backend_ref_t* bref = &router_cli_ses->rses_backend_ref[z];
+
+            if (BREF_IS_IN_USE(bref) && SERVER_IS_RUNNING(bref->bref_backend->backend_server))
+            {
+                route_target = TARGET_NAMED_SERVER;
+                targetserver = strdup(bref->bref_backend->backend_server->unique_name);
+                break;
+            }
+        }
+
+        for (z = 0; TARGET_IS_ANY(route_target) && inst->servers[z]; z++)
         {
             if (SERVER_IS_RUNNING(inst->servers[z]->backend_server))
             {
@@ -2314,6 +2954,8 @@ static int routeQuery(ROUTER* instance,
             bref_set_state(bref, BREF_QUERY_ACTIVE);
             bref_set_state(bref, BREF_WAITING_RESULT);
             atomic_add(&bref->bref_backend->stats.queries, 1);
+            bref->bref_last_used = time(NULL);
+            close_idle_backends(router_cli_ses, bref);
         }
         else
         {
@@ -2340,7 +2982,8 @@ retblock:
  * router was closed before lock was acquired.
  *
  *
- * @details (write detailed description here)
+ * @details A session that is confined to the thread that owns it is not
+ * locked as no other thread uses it.
  *
  */
 static bool rses_begin_locked_router_action(
@@ -2354,6 +2997,14 @@ static bool rses_begin_locked_router_action(
     {
         goto return_succp;
     }
+
+    if (rses->rses_confined)
+    {
+        ss_dassert(poll_session_owner(rses->rses_client_dcb->session) == poll_current_thread());
+        succp = true;
+        goto return_succp;
+    }
+
     spinlock_acquire(&rses->rses_lock);
     if (rses->rses_closed) {
         spinlock_release(&rses->rses_lock);
@@ -2382,7 +3033,11 @@ return_succp:
 static void rses_end_locked_router_action(ROUTER_CLIENT_SES* rses)
 {
     CHK_CLIENT_RSES(rses);
-    spinlock_release(&rses->rses_lock);
+
+    if (!rses->rses_confined)
+    {
+        spinlock_release(&rses->rses_lock);
+    }
 }
 
 /**
@@ -2452,6 +3107,30 @@ static void diagnostic(ROUTER *instance, DCB *dcb)
     }
     dcb_printf(dcb, "Shard map cache hits: %d\n", router->stats.shmap_cache_hit);
     dcb_printf(dcb, "Shard map cache misses: %d\n", router->stats.shmap_cache_miss);
+
+    if (router->schemarouter_config.shared_map)
+    {
+        spinlock_acquire(&router->lock);
+        unsigned long version = router->shared_map ? router->shared_map->version : 0;
+        spinlock_release(&router->lock);
+        dcb_printf(dcb, "Shared shard map version: %lu\n", version);
+        dcb_printf(dcb, "Shared shard map refreshes: %d\n", router->stats.shmap_refresh);
+        dcb_printf(dcb, "Failed shared shard map refreshes: %d\n", router->stats.shmap_refresh_failed);
+    }
+
+    if (router->schemarouter_config.lazy_connect)
+    {
+        dcb_printf(dcb, "Connections opened on first use: %d\n", router->stats.n_lazy_connect);
+        dcb_printf(dcb, "Idle connections closed: %d\n", router->stats.n_idle_closed);
+    }
+    dcb_printf(dcb, "Queries sent to all shards: %d\n", router->stats.n_scatter);
+    dcb_printf(dcb, "Queries to all shards that could not be merged: %d\n",
+               router->stats.n_scatter_rejected);
+
+    if (router->table_rules)
+    {
+        dcb_printf(dcb, "Queries routed by a sharding key: %d\n", router->stats.n_shard_key);
+    }
     dcb_printf(dcb, "\n");
 }
 
@@ -2619,6 +3298,12 @@ static void clientReply(ROUTER* instance,
         return;
     }
 
+    if (router_cli_ses->refresh_on_reply)
+    {
+        router_cli_ses->refresh_on_reply = false;
+        shared_map_request_refresh(router_cli_ses->router);
+    }
+
     CHK_BACKEND_REF(bref);
     scur = &bref->bref_sescmd_cur;
     /**
@@ -2673,6 +3358,28 @@ static void clientReply(ROUTER* instance,
             bref_clear_state(bref, BREF_WAITING_RESULT);
         }
     }
+    /**
+     * The reply is a part of the result of a query sent to all shards. The
+     * merged result is sent to the client and the flags are cleared once the
+     * whole result of the shard has been read.
+     */
+    else if (router_cli_ses->gather && bref->bref_gather_shard >= 0)
+    {
+        writebuf = gather_reply(router_cli_ses->gather, bref->bref_gather_shard, writebuf);
+
+        if (gather_shard_done(router_cli_ses->gather, bref->bref_gather_shard))
+        {
+            bref->bref_gather_shard = -1;
+            bref_clear_state(bref, BREF_QUERY_ACTIVE);
+            bref_clear_state(bref, BREF_WAITING_RESULT);
+        }
+
+        if (gather_done(router_cli_ses->gather))
+        {
+            gather_free(router_cli_ses->gather);
+            router_cli_ses->gather = NULL;
+        }
+    }
     /**
      * Clear BREF_QUERY_ACTIVE flag and decrease waiter counter.
      * This applies for queries  other than session commands.
@@ -2795,8 +3502,8 @@ int bref_cmp_current_load(const void* bref1, const void* bref2)
     BACKEND* b1 = ((backend_ref_t *)bref1)->bref_backend;
     BACKEND* b2 = ((backend_ref_t *)bref2)->bref_backend;
 
-    return ((1000 * s1->stats.n_current_ops) - b1->weight)
-        - ((1000 * s2->stats.n_current_ops) - b2->weight);
+    return (int)(((1000 * ts_stats_sum(s1->stats.n_current_ops)) - b1->weight)
+                 - ((1000 * ts_stats_sum(s2->stats.n_current_ops)) - b2->weight));
 }
 
 static void bref_clear_state(backend_ref_t* bref, bref_state_t state)
@@ -2813,7 +3520,6 @@ static void bref_clear_state(backend_ref_t* bref, bref_state_t state)
     else
     {
         int prev1;
-        int prev2;
 
         /** Decrease waiter count */
         prev1 = atomic_add(&bref->bref_num_result_wait, -1);
@@ -2824,16 +3530,8 @@ static void bref_clear_state(backend_ref_t* bref, bref_state_t state)
         }
         else
         {
-            /** Decrease global operation count */
-            prev2 = atomic_add(&bref->bref_backend->backend_server->stats.n_current_ops, -1);
-            ss_dassert(prev2 > 0);
-            if (prev2 <= 0)
-            {
-                MXS_ERROR("[%s] Error: negative current operation count in backend %s:%u",
-                          __FUNCTION__,
-                          bref->bref_backend->backend_server->name,
-                          bref->bref_backend->backend_server->port);
-            }
+            /** Decrease global operation count, only the sum of the slots is meaningful */
+            ts_stats_add(bref->bref_backend->backend_server->stats.n_current_ops, -1);
         }
     }
 }
@@ -2852,7 +3550,6 @@ static void bref_set_state(backend_ref_t* bref, bref_state_t state)
     else
     {
         int prev1;
-        int prev2;
 
         /** Increase waiter count */
         prev1 = atomic_add(&bref->bref_num_result_wait, 1);
@@ -2866,15 +3563,7 @@ static void bref_set_state(backend_ref_t* bref, bref_state_t state)
                       bref->bref_backend->backend_server->port);
         }
         /** Increase global operation count */
-        prev2 = atomic_add(&bref->bref_backend->backend_server->stats.n_current_ops, 1);
-        ss_dassert(prev2 >= 0);
-        if (prev2 < 0)
-        {
-            MXS_ERROR("[%s] Error: negative current operation count in backend %s:%u",
-                      __FUNCTION__,
-                      bref->bref_backend->backend_server->name,
-                      bref->bref_backend->backend_server->port);
-        }
+        ts_stats_add(bref->bref_backend->backend_server->stats.n_current_ops, 1);
     }
 }
 
@@ -2973,41 +3662,9 @@ static bool connect_backend_servers(backend_ref_t*   backend_ref,
             /** New server connection */
             else
             {
-                backend_ref[i].bref_dcb = dcb_connect(b->backend_server,
-                                                      session,
-                                                      b->backend_server->protocol);
-
-                if (backend_ref[i].bref_dcb != NULL)
+                if (connect_backend(&backend_ref[i], session))
                 {
                     servers_connected += 1;
-                    /**
-                     * Start executing session command
-                     * history.
-                     */
-                    execute_sescmd_history(&backend_ref[i]);
-                    /**
-                     * When server fails, this callback
-                     * is called.
-                     * !!! Todo, routine which removes
-                     * corresponding entries from the hash
-                     * table.
-                     */
-
-                    backend_ref[i].bref_state = 0;
-                    bref_set_state(&backend_ref[i], BREF_IN_USE);
-                    /**
-                     * Increase backend connection counter.
-                     * Server's stats are _increased_ in
-                     * dcb.c:dcb_alloc !
-                     * But decreased in the calling function
-                     * of dcb_close.
-                     */
-                    atomic_add(&b->backend_conn_count, 1);
-
-                    dcb_add_callback(backend_ref[i].bref_dcb,
-                                     DCB_REASON_NOT_RESPONDING,
-                                     &router_handle_state_switch,
-                                     (void *)&backend_ref[i]);
                 }
                 else
                 {
@@ -3065,6 +3722,60 @@ static bool connect_backend_servers(backend_ref_t*   backend_ref,
     return succp;
 }
 
+/**
+ * Connect to the server of a backend reference and start executing the
+ * session command history in it.
+ *
+ * @param bref      Backend reference that is not in use
+ * @param session   Client session
+ *
+ * @return True if the connection was created
+ */
+static bool connect_backend(backend_ref_t* bref, SESSION* session)
+{
+    BACKEND* b = bref->bref_backend;
+
+    bref->bref_dcb = dcb_connect(b->backend_server, session, b->backend_server->protocol);
+
+    if (bref->bref_dcb == NULL)
+    {
+        return false;
+    }
+
+    /**
+     * The reference may have been closed earlier, the state must be reset
+     * before the session command history can be executed.
+     */
+    bref->bref_state = 0;
+    bref_set_state(bref, BREF_IN_USE);
+    bref->bref_last_used = time(NULL);
+
+    /**
+     * Start executing session command
+     * history.
+     */
+    execute_sescmd_history(bref);
+
+    /**
+     * Increase backend connection counter.
+     * Server's stats are _increased_ in
+     * dcb.c:dcb_alloc !
+     * But decreased in the calling function
+     * of dcb_close.
+     */
+    atomic_add(&b->backend_conn_count, 1);
+
+    /**
+     * When server fails, this callback
+     * is called.
+     */
+    dcb_add_callback(bref->bref_dcb,
+                     DCB_REASON_NOT_RESPONDING,
+                     &router_handle_state_switch,
+                     (void *)bref);
+    return true;
+}
+
 /**
  * Create a generic router session property strcture.
  */
@@ -3131,7 +3842,7 @@ static void rses_property_add(ROUTER_CLIENT_SES* rses,
 
     CHK_CLIENT_RSES(rses);
     CHK_RSES_PROP(prop);
-    ss_dassert(SPINLOCK_IS_LOCKED(&rses->rses_lock));
+    ss_dassert(RSES_IS_LOCKED(rses));
 
     prop->rses_prop_rsession = rses;
     p = rses->rses_properties[prop->rses_prop_type];
@@ -3160,7 +3871,7 @@ static mysql_sescmd_t* rses_property_get_sescmd(rses_property_t* prop)
 
     CHK_RSES_PROP(prop);
     ss_dassert(prop->rses_prop_rsession == NULL ||
-               SPINLOCK_IS_LOCKED(&prop->rses_prop_rsession->rses_lock));
+               RSES_IS_LOCKED(prop->rses_prop_rsession));
 
     sescmd = &prop->rses_prop_data.sescmd;
 
@@ -3230,7 +3941,7 @@ static GWBUF* sescmd_cursor_process_replies(GWBUF*         replybuf,
     sescmd_cursor_t* scur;
 
     scur = &bref->bref_sescmd_cur;
-    ss_dassert(SPINLOCK_IS_LOCKED(&(scur->scmd_cur_rses->rses_lock)));
+    ss_dassert(RSES_IS_LOCKED(scur->scmd_cur_rses));
     scmd = sescmd_cursor_get_command(scur);
 
     CHK_GWBUF(replybuf);
@@ -3294,7 +4005,7 @@ static mysql_sescmd_t* sescmd_cursor_get_command(sescmd_cursor_t* scur)
 {
     mysql_sescmd_t* scmd;
 
-    ss_dassert(SPINLOCK_IS_LOCKED(&(scur->scmd_cur_rses->rses_lock)));
+    ss_dassert(RSES_IS_LOCKED(scur->scmd_cur_rses));
     scur->scmd_cur_cmd = rses_property_get_sescmd(*scur->scmd_cur_ptr_property);
 
     CHK_MYSQL_SESCMD(scur->scmd_cur_cmd);
@@ -3308,7 +4019,7 @@ static mysql_sescmd_t* sescmd_cursor_get_command(sescmd_cursor_t* scur)
 static bool sescmd_cursor_is_active(sescmd_cursor_t* sescmd_cursor)
 {
     bool succp;
-    ss_dassert(SPINLOCK_IS_LOCKED(&sescmd_cursor->scmd_cur_rses->rses_lock));
+    ss_dassert(RSES_IS_LOCKED(sescmd_cursor->scmd_cur_rses));
 
     succp = sescmd_cursor->scmd_cur_active;
     return succp;
@@ -3318,7 +4029,7 @@ static bool sescmd_cursor_is_active(sescmd_cursor_t* sescmd_cursor)
 static void sescmd_cursor_set_active(sescmd_cursor_t* sescmd_cursor,
                                      bool             value)
 {
-    ss_dassert(SPINLOCK_IS_LOCKED(&sescmd_cursor->scmd_cur_rses->rses_lock));
+    ss_dassert(RSES_IS_LOCKED(sescmd_cursor->scmd_cur_rses));
     /** avoid calling unnecessarily */
     ss_dassert(sescmd_cursor->scmd_cur_active != value);
     sescmd_cursor->scmd_cur_active = value;
@@ -3511,7 +4222,7 @@ static bool sescmd_cursor_next(sescmd_cursor_t* scur)
 
     ss_dassert(scur != NULL);
     ss_dassert(*(scur->scmd_cur_ptr_property) != NULL);
-    ss_dassert(SPINLOCK_IS_LOCKED(&(*(scur->scmd_cur_ptr_property))->rses_prop_rsession->rses_lock));
+    ss_dassert(RSES_IS_LOCKED((*(scur->scmd_cur_ptr_property))->rses_prop_rsession));
 
     /** Illegal situation */
     if (scur == NULL ||
@@ -3736,6 +4447,26 @@ static bool route_session_write(ROUTER_CLIENT_SES* router_cli_ses,
         goto return_succp;
     }
 
+    /**
+     * With lazy_connect, one server must be connected so that the client gets
+     * a reply. The others execute the command from the history when they are
+     * connected to.
+     */
+    if (router_cli_ses->rses_config.lazy_connect && !have_servers(router_cli_ses))
+    {
+        for (i = 0; i < router_cli_ses->rses_nbackends; i++)
+        {
+            backend_ref_t* bref = &backend_ref[i];
+
+            if (SERVER_IS_RUNNING(bref->bref_backend->backend_server) &&
+                connect_backend(bref, router_cli_ses->rses_client_dcb->session))
+            {
+                atomic_add(&inst->stats.n_lazy_connect, 1);
+                break;
+            }
+        }
+    }
+
     if (router_cli_ses->rses_config.max_sescmd_hist > 0 &&
         router_cli_ses->n_sescmd >= router_cli_ses->rses_config.max_sescmd_hist)
     {
@@ -3855,7 +4586,7 @@ static bool route_session_write(ROUTER_CLIENT_SES* router_cli_ses,
                 }
             }
         }
-        else
+        else if (!router_cli_ses->rses_config.lazy_connect)
         {
             succp = false;
         }
@@ -3988,7 +4719,7 @@ static void handle_error_reply_client(SESSION*           ses,
     if (sesstate == SESSION_STATE_ROUTER_READY)
     {
         CHK_DCB(client_dcb);
-        client_dcb->func.write(client_dcb, gwbuf_clone(errmsg));
+        SESSION_ROUTE_REPLY(client_dcb->session, gwbuf_clone(errmsg));
     }
 }
 
@@ -4039,7 +4770,7 @@ static bool handle_error_new_connection(ROUTER_INSTANCE*   inst,
     backend_ref_t* bref;
     bool succp;
 
-    ss_dassert(SPINLOCK_IS_LOCKED(&rses->rses_lock));
+    ss_dassert(RSES_IS_LOCKED(rses));
 
     ses = backend_dcb->session;
     CHK_SESSION(ses);
@@ -4060,11 +4791,23 @@ static bool handle_error_new_connection(ROUTER_INSTANCE*   inst,
      * the backend server it is necessary to send an error to the client
      * because it is waiting for reply.
      */
-    if (BREF_IS_WAITING_RESULT(bref))
+    if (rses->gather && bref->bref_gather_shard >= 0)
+    {
+        /** The error ends the result of the shard in the merged result */
+        int shard = bref->bref_gather_shard;
+        bref->bref_gather_shard = -1;
+        gwbuf_free(bref->bref_pending_cmd);
+        bref->bref_pending_cmd = NULL;
+
+        while (BREF_IS_WAITING_RESULT(bref))
+        {
+            bref_clear_state(bref, BREF_WAITING_RESULT);
+        }
+        send_gathered_result(rses, gather_shard_failed(rses->gather, shard, gwbuf_clone(errmsg)));
+    }
+    else if (BREF_IS_WAITING_RESULT(bref))
     {
-        DCB* client_dcb;
-        client_dcb = ses->client_dcb;
-        client_dcb->func.write(client_dcb, gwbuf_clone(errmsg));
+        SESSION_ROUTE_REPLY(ses, gwbuf_clone(errmsg));
         bref_clear_state(bref, BREF_WAITING_RESULT);
     }
     bref_clear_state(bref, BREF_IN_USE);
@@ -4090,6 +4833,13 @@ static bool handle_error_new_connection(ROUTER_INSTANCE*   inst,
                         &router_handle_state_switch,
                         (void *)bref);
 
+    /** With lazy_connect the server is connected to again when it is next used */
+    if (rses->rses_config.lazy_connect)
+    {
+        succp = true;
+        goto return_succp;
+    }
+
     router_nservers = router_get_servercount(inst);
     /**
      * Try to get replacement slave or at least the minimum
@@ -4205,7 +4955,16 @@ static int router_handle_state_switch(DCB* dcb,
     case DCB_REASON_NOT_RESPONDING:
         atomic_add(&bref->bref_backend->backend_conn_count, -1);
         MXS_INFO("schemarouter: server %s not responding", srv->unique_name);
-        dcb->func.hangup(dcb);
+
+        /** The monitor calls this, the owner of a confined session handles the hangup */
+        if (((ROUTER_CLIENT_SES *)dcb->session->router_session)->rses_confined)
+        {
+            poll_fake_hangup_event(dcb);
+        }
+        else
+        {
+            dcb->func.hangup(dcb);
+        }
         break;
 
     default:
@@ -4341,6 +5100,8 @@ int process_show_shards(ROUTER_CLIENT_SES* rses)
 }
 
 /**
+ * Send an error to the client. The error is routed through the filters of the
+ * session like the replies of the servers.
  *
  * @param dcb
  * @param errnum
@@ -4352,7 +5113,7 @@ void write_error_to_client(DCB* dcb, int errnum, const char* mysqlstate, const c
     GWBUF* errbuff = modutil_create_mysql_err_msg(1, 0, errnum, mysqlstate, errmsg);
     if (errbuff)
     {
-        if (dcb->func.write(dcb, errbuff) != 1)
+        if (SESSION_ROUTE_REPLY(dcb->session, errbuff) != 1)
         {
             MXS_ERROR("Failed to write error packet to client.");
         }
@@ -4525,7 +5286,7 @@ int inspect_backend_mapping_states(ROUTER_CLIENT_SES *router_cli_ses,
 
                         if (error)
                         {
-                            client_dcb->func.write(client_dcb, error);
+                            SESSION_ROUTE_REPLY(client_dcb->session, error);
                         }
                         else
                         {
@@ -0,0 +1,1868 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file shard_gather.c - Merging of the result sets of a query sent to several shards
+ *
+ * A SELECT that is sent to several shards is inspected before it is routed
+ * and the result sets of the shards are merged in one of three ways:
+ *
+ * - The rows of all shards are streamed to the client as they arrive, which
+ *   gives the result of a UNION ALL of the shards
+ * - With ORDER BY, the rows of the shards are merged in order. A row is sent
+ *   as soon as every shard that has not finished has a row to compare it to.
+ * - If every column of the select list is COUNT, SUM, MIN or MAX and the query
+ *   has no GROUP BY, the single rows of the shards are combined into one
+ *
+ * A LIMIT is applied to the merged rows. An offset is removed from the query that
+ * is sent to the shards, each of them returns the offset and the limit rows.
+ * Queries that can not be merged this way, for example those with GROUP BY,
+ * DISTINCT or expressions of aggregates, are rejected before they are routed.
+ *
+ * The column definitions of the first shard are sent to the client once all
+ * shards have sent theirs. The sequence numbers of the packets are rewritten
+ * and the result ends with the first error returned by a shard, if there was
+ * one, or with an EOF packet.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <schemarouter.h>
+#include <modutil.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+
+/** Maximum number of ORDER BY columns and aggregate functions */
+#define GATHER_MAX_KEYS 16
+
+/** The column types compared as numbers */
+#define GATHER_IS_NUMERIC_TYPE(t) ((t) <= 0x05 || (t) == 0x08 || (t) == 0x09 || \
+                                   (t) == 0x0d || (t) == 0xf6)
+
+typedef enum
+{
+    GATHER_UNION,
+    GATHER_SORT,
+    GATHER_AGGREGATE
+} gather_mode_t;
+
+typedef enum
+{
+    GATHER_COUNT,
+    GATHER_SUM,
+    GATHER_MIN,
+    GATHER_MAX
+} gather_func_t;
+
+typedef enum
+{
+    GS_HEADER,  /*< Waiting for the column count, an OK or an error */
+    GS_COLUMNS, /*< Reading the column definitions */
+    GS_ROWS,    /*< Reading the rows */
+    GS_DONE     /*< The result has been read */
+} gather_state_t;
+
+/**
+ * The result of one shard
+ */
+typedef struct
+{
+    gather_state_t state;
+    GWBUF*   partial;      /*< Incomplete packets */
+    GWBUF*   header;       /*< Column count, definitions and the EOF after them */
+    GWBUF*   rows;         /*< Rows that have not been merged, one packet per buffer */
+    GWBUF*   rows_tail;
+    uint64_t ncolumns;
+    uint64_t columns_left;
+} GATHER_SHARD;
+
+/**
+ * The merged value of an aggregate function
+ */
+typedef struct
+{
+    gather_func_t func;
+    bool     is_null;      /*< No value has been merged */
+    bool     is_double;    /*< The sum is not an integer or a decimal number */
+    int64_t  isum;
+    double   dsum;
+    char*    decimal;      /*< Exact sum of the values that are not 64-bit integers */
+    char*    value;        /*< MIN and MAX value */
+    uint64_t value_len;
+} GATHER_AGG;
+
+/**
+ * An ORDER BY column
+ */
+typedef struct
+{
+    char* name;            /*< Column name or NULL for a column number */
+    int   column;          /*< Index of the column in the result */
+    bool  desc;
+    bool  numeric;
+} GATHER_KEY;
+
+struct shard_gather
+{
+    gather_mode_t mode;
+    int           nshards;
+    int           nfinished;
+    GATHER_SHARD* shards;
+    bool          header_sent;
+    bool          discard;    /*< The response has been sent, discard the rest */
+    uint8_t       seq;        /*< Sequence number of the next packet to the client */
+    GWBUF*        error;      /*< The first error returned by a shard */
+    GWBUF*        eof;        /*< The first EOF that ended the rows of a shard */
+    GWBUF*        ok;         /*< The first OK returned by a shard */
+    GWBUF*        out;        /*< Packets to send to the client */
+    long          offset;     /*< Merged rows to skip */
+    long          limit;      /*< Merged rows to send, -1 for all */
+    long          nrows;      /*< Merged rows so far */
+    int           nkeys;
+    GATHER_KEY    keys[GATHER_MAX_KEYS];
+    int           naggs;
+    GATHER_AGG    aggs[GATHER_MAX_KEYS];
+};
+
+/**
+ * Positions of the top level clauses of a SELECT
+ */
+typedef struct
+{
+    const char* select_list;  /*< The select list */
+    const char* from;         /*< FROM, end of the select list */
+    const char* order;        /*< ORDER BY */
+    const char* limit;        /*< LIMIT */
+    const char* limit_end;    /*< End of the LIMIT clause */
+    bool        unsupported;  /*< GROUP BY, HAVING, DISTINCT, INTO or more than one SELECT */
+    bool        is_union;
+    int         ncommas;
+    const char* commas[GATHER_MAX_KEYS + 1]; /*< Top level commas of the select list */
+} SQL_CLAUSES;
+
+/**
+ * Check if a keyword starts at a position
+ *
+ * @param ptr  Position
+ * @param end  End of the statement
+ * @param word The keyword in upper case
+ * @return True if the keyword is at the position and is followed by a non-identifier character
+ */
+bool sql_is_keyword(const char* ptr, const char* end, const char* word)
+{
+    size_t len = strlen(word);
+    return (size_t)(end - ptr) >= len && strncasecmp(ptr, word, len) == 0 &&
+           (ptr + len == end || !(isalnum(ptr[len]) || ptr[len] == '_' || ptr[len] == '$'));
+}
+
+/**
+ * Skip a quoted string or identifier
+ *
+ * @param ptr Opening quote
+ * @param end End of the statement
+ * @return Position after the closing quote
+ */
+const char* sql_skip_quoted(const char* ptr, const char* end)
+{
+    char quote = *ptr++;
+
+    while (ptr < end && *ptr != quote)
+    {
+        if (*ptr == '\\' && quote != '`' && ptr + 1 < end)
+        {
+            ptr++;
+        }
+        ptr++;
+    }
+
+    return ptr < end ? ptr + 1 : end;
+}
+
+/**
+ * Skip whitespace and comments
+ *
+ * @param ptr Position
+ * @param end End of the statement
+ * @return The first position that is not whitespace or a comment
+ */
+const char* sql_skip_space(const char* ptr, const char* end)
+{
+    while (ptr < end)
+    {
+        if (isspace(*ptr))
+        {
+            ptr++;
+        }
+        else if (*ptr == '#' || (*ptr == '-' && end - ptr > 2 && ptr[1] == '-' && isspace(ptr[2])))
+        {
+            while (ptr < end && *ptr != '\n')
+            {
+                ptr++;
+            }
+        }
+        else if (*ptr == '/' && end - ptr > 1 && ptr[1] == '*')
+        {
+            const char* close = strstr(ptr + 2, "*/");
+            ptr = close && close < end ? close + 2 : end;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    return ptr;
+}
+
+/**
+ * Find the top level clauses of a SELECT. Everything inside parentheses,
+ * strings and comments is skipped.
+ *
+ * @param sql     The statement
+ * @param end     End of the statement
+ * @param clauses The clauses to populate
+ * @return True if the statement is a SELECT
+ */
+static bool find_clauses(const char* sql, const char* end, SQL_CLAUSES* clauses)
+{
+    const char* ptr = sql_skip_space(sql, end);
+    int depth = 0;
+    int nselect = 0;
+
+    memset(clauses, 0, sizeof(*clauses));
+
+    if (!sql_is_keyword(ptr, end, "SELECT"))
+    {
+        return false;
+    }
+
+    while ((ptr = sql_skip_space(ptr, end)) < end)
+    {
+        if (*ptr == '\'' || *ptr == '"' || *ptr == '`')
+        {
+            ptr = sql_skip_quoted(ptr, end);
+            continue;
+        }
+
+        if (*ptr == '(')
+        {
+            depth++;
+        }
+        else if (*ptr == ')')
+        {
+            depth--;
+        }
+        else if (*ptr == ';')
+        {
+            /** Multiple statements can not be merged */
+            clauses->unsupported = true;
+            return true;
+        }
+        else if (depth == 0 && *ptr == ',' && clauses->select_list && !clauses->from)
+        {
+            if (clauses->ncommas < GATHER_MAX_KEYS)
+            {
+                clauses->commas[clauses->ncommas] = ptr;
+            }
+            clauses->ncommas++;
+        }
+        else if (depth == 0 && (isalpha(*ptr) || *ptr == '_'))
+        {
+            const char* word = ptr;
+
+            while (ptr < end && (isalnum(*ptr) || *ptr == '_' || *ptr == '$'))
+            {
+                ptr++;
+            }
+
+            if (sql_is_keyword(word, end, "SELECT"))
+            {
+                if (nselect++ == 0)
+                {
+                    clauses->select_list = ptr;
+                }
+            }
+            else if (sql_is_keyword(word, end, "UNION"))
+            {
+                clauses->is_union = true;
+                clauses->order = NULL;
+                clauses->limit = NULL;
+            }
+            else if (sql_is_keyword(word, end, "FROM") && nselect == 1 && !clauses->from)
+            {
+                clauses->from = word;
+            }
+            else if (sql_is_keyword(word, end, "GROUP") || sql_is_keyword(word, end, "HAVING") ||
+                     sql_is_keyword(word, end, "INTO") ||
+                     (sql_is_keyword(word, end, "DISTINCT") && !clauses->from))
+            {
+                clauses->unsupported = true;
+            }
+            else if (sql_is_keyword(word, end, "ORDER"))
+            {
+                clauses->order = word;
+            }
+            else if (sql_is_keyword(word, end, "LIMIT"))
+            {
+                clauses->limit = word;
+                clauses->limit_end = end;
+            }
+            else if (clauses->limit && (sql_is_keyword(word, end, "FOR") ||
+                                        sql_is_keyword(word, end, "LOCK") ||
+                                        sql_is_keyword(word, end, "PROCEDURE")))
+            {
+                if (clauses->limit_end == end)
+                {
+                    clauses->limit_end = word;
+                }
+            }
+            continue;
+        }
+
+        ptr++;
+    }
+
+    if (nselect > 1 && !clauses->is_union)
+    {
+        /** A subquery outside of parentheses, not something that can be merged */
+        clauses->unsupported = true;
+    }
+
+    return true;
+}
+
+/**
+ * Trim whitespace and comments from both ends of a part of the statement
+ *
+ * @param start Start of the part, updated
+ * @param end   End of the part, updated
+ */
+static void trim_part(const char** start, const char** end)
+{
+    *start = sql_skip_space(*start, *end);
+
+    while (*end > *start && isspace((*end)[-1]))
+    {
+        (*end)--;
+    }
+}
+
+/**
+ * Check if a select list item is a call of an aggregate function
+ *
+ * @param start Start of the item
+ * @param end   End of the item
+ * @param func  The aggregate function
+ * @return 1 if the item is a mergeable aggregate, 0 if the item has no aggregate
+ * and -1 if the item has an aggregate that can not be merged
+ */
+static int parse_aggregate(const char* start, const char* end, gather_func_t* func)
+{
+    static const char* unmergeable[] =
+    {
+        "AVG", "GROUP_CONCAT", "STD", "STDDEV", "STDDEV_POP", "STDDEV_SAMP",
+        "VARIANCE", "VAR_POP", "VAR_SAMP", "BIT_AND", "BIT_OR", "BIT_XOR", NULL
+    };
+    static const char* mergeable[] = {"COUNT", "SUM", "MIN", "MAX", NULL};
+    const char* ptr = start;
+    int rval = 0;
+    bool first = true;
+
+    while (ptr < end)
+    {
+        if (*ptr == '\'' || *ptr == '"' || *ptr == '`')
+        {
+            ptr = sql_skip_quoted(ptr, end);
+            first = false;
+            continue;
+        }
+
+        if (!(isalpha(*ptr) || *ptr == '_'))
+        {
+            ptr++;
+            first = false;
+            continue;
+        }
+
+        const char* word = ptr;
+
+        while (ptr < end && (isalnum(*ptr) || *ptr == '_' || *ptr == '$'))
+        {
+            ptr++;
+        }
+
+        const char* paren = sql_skip_space(ptr, end);
+
+        if (paren >= end || *paren != '(')
+        {
+            first = false;
+            continue;
+        }
+
+        for (int i = 0; unmergeable[i]; i++)
+        {
+            if (ptr - word == (long)strlen(unmergeable[i]) &&
+                strncasecmp(word, unmergeable[i], ptr - word) == 0)
+            {
+                return -1;
+            }
+        }
+
+        for (int i = 0; mergeable[i]; i++)
+        {
+            if (ptr - word == (long)strlen(mergeable[i]) &&
+                strncasecmp(word, mergeable[i], ptr - word) == 0)
+            {
+                if (!first || sql_is_keyword(sql_skip_space(paren + 1, end), end, "DISTINCT"))
+                {
+                    return -1;
+                }
+
+                /** The call must be the whole item, apart from an alias */
+                int depth = 0;
+                const char* p = paren;
+
+                do
+                {
+                    if (*p == '\'' || *p == '"' || *p == '`')
+                    {
+                        p = sql_skip_quoted(p, end);
+                        continue;
+                    }
+                    depth += *p == '(' ? 1 : *p == ')' ? -1 : 0;
+                    p++;
+                }
+                while (p < end && depth > 0);
+
+                p = sql_skip_space(p, end);
+
+                if (sql_is_keyword(p, end, "AS"))
+                {
+                    p = sql_skip_space(p + 2, end);
+                }
+
+                if (p < end && (*p == '`' || *p == '\'' || *p == '"'))
+                {
+                    p = sql_skip_quoted(p, end);
+                }
+                else
+                {
+                    while (p < end && (isalnum(*p) || *p == '_' || *p == '$'))
+                    {
+                        p++;
+                    }
+                }
+
+                if (sql_skip_space(p, end) != end)
+                {
+                    return -1;
+                }
+
+                *func = (gather_func_t)i;
+                rval = 1;
+                break;
+            }
+        }
+
+        first = false;
+    }
+
+    return rval;
+}
+
+/**
+ * Parse the ORDER BY clause
+ *
+ * @param gather The gather state
+ * @param start  Start of the clause, after ORDER
+ * @param end    End of the clause
+ * @return True if all columns are column names or numbers
+ */
+static bool parse_order_by(SHARD_GATHER* gather, const char* start, const char* end)
+{
+    const char* ptr = sql_skip_space(start, end);
+
+    if (!sql_is_keyword(ptr, end, "BY"))
+    {
+        return false;
+    }
+
+    ptr += 2;
+
+    while ((ptr = sql_skip_space(ptr, end)) < end)
+    {
+        const char* item = ptr;
+        const char* name = NULL;
+        size_t name_len = 0;
+
+        if (gather->nkeys == GATHER_MAX_KEYS)
+        {
+            return false;
+        }
+
+        /** A possibly qualified column name, the last part is used */
+        while (ptr < end && *ptr != ',' && !isspace(*ptr))
+        {
+            if (*ptr == '`')
+            {
+                const char* close = sql_skip_quoted(ptr, end);
+                name = ptr + 1;
+                name_len = close - ptr - 2;
+                ptr = close;
+            }
+            else if (isalnum(*ptr) || *ptr == '_' || *ptr == '$')
+            {
+                name = ptr;
+                while (ptr < end && (isalnum(*ptr) || *ptr == '_' || *ptr == '$'))
+                {
+                    ptr++;
+                }
+                name_len = ptr - name;
+            }
+            else if (*ptr == '.')
+            {
+                ptr++;
+            }
+            else
+            {
+                return false;
+            }
+        }
+
+        if (name == NULL || name_len == 0)
+        {
+            return false;
+        }
+
+        GATHER_KEY* key = &gather->keys[gather->nkeys++];
+        key->desc = false;
+        key->column = -1;
+        key->name = NULL;
+
+        bool number = true;
+        for (size_t i = 0; i < name_len; i++)
+        {
+            number = number && isdigit(name[i]);
+        }
+
+        if (number && name == item)
+        {
+            key->column = atoi(name) - 1;
+        }
+        else if ((key->name = strndup(name, name_len)) == NULL)
+        {
+            return false;
+        }
+
+        ptr = sql_skip_space(ptr, end);
+
+        if (sql_is_keyword(ptr, end, "DESC"))
+        {
+            key->desc = true;
+            ptr += 4;
+        }
+        else if (sql_is_keyword(ptr, end, "ASC"))
+        {
+            ptr += 3;
+        }
+
+        ptr = sql_skip_space(ptr, end);
+
+        if (ptr < end)
+        {
+            if (*ptr != ',')
+            {
+                return false;
+            }
+            ptr++;
+        }
+    }
+
+    return gather->nkeys > 0;
+}
+
+/**
+ * Parse a number of the LIMIT clause
+ *
+ * @param ptr   Position before the number, moved past it
+ * @param end   End of the clause
+ * @param value The number
+ * @return True if whitespace and comments were followed by a number
+ */
+static bool parse_limit_number(const char** ptr, const char* end, long* value)
+{
+    const char* p = sql_skip_space(*ptr, end);
+    const char* digits = p;
+    long n = 0;
+
+    while (p < end && isdigit(*p))
+    {
+        if (n > (LONG_MAX - (*p - '0')) / 10)
+        {
+            return false;
+        }
+        n = n * 10 + (*p - '0');
+        p++;
+    }
+
+    if (p == digits || (p < end && (isalpha(*p) || *p == '_' || *p == '$')))
+    {
+        return false;
+    }
+
+    *value = n;
+    *ptr = p;
+    return true;
+}
+
+/**
+ * Parse the LIMIT clause
+ *
+ * Whitespace and comments can be anywhere in the clause.
+ *
+ * @param gather    The gather state
+ * @param start     Start of the clause, after LIMIT
+ * @param end       End of the clause
+ * @param limit_end Set to the position after the last number
+ * @return True if the clause has one or two numbers
+ */
+static bool parse_limit(SHARD_GATHER* gather, const char* start, const char* end,
+                        const char** limit_end)
+{
+    const char* ptr = start;
+    long first;
+    long second;
+
+    if (!parse_limit_number(&ptr, end, &first))
+    {
+        return false;
+    }
+
+    *limit_end = ptr;
+    ptr = sql_skip_space(ptr, end);
+
+    if (ptr == end)
+    {
+        gather->limit = first;
+        return true;
+    }
+
+    bool offset_keyword = sql_is_keyword(ptr, end, "OFFSET");
+
+    if (*ptr != ',' && !offset_keyword)
+    {
+        return false;
+    }
+
+    ptr += offset_keyword ? 6 : 1;
+
+    if (!parse_limit_number(&ptr, end, &second))
+    {
+        return false;
+    }
+
+    *limit_end = ptr;
+
+    if (sql_skip_space(ptr, end) != end)
+    {
+        return false;
+    }
+
+    gather->offset = offset_keyword ? second : first;
+    gather->limit = offset_keyword ? first : second;
+    return true;
+}
+
+/**
+ * Free the gather state
+ *
+ * @param gather Gather state
+ */
+void gather_free(SHARD_GATHER* gather)
+{
+    if (gather == NULL)
+    {
+        return;
+    }
+
+    for (int i = 0; i < gather->nshards; i++)
+    {
+        gwbuf_free(gather->shards[i].partial);
+        gwbuf_free(gather->shards[i].header);
+        gwbuf_free(gather->shards[i].rows);
+    }
+
+    for (int i = 0; i < gather->nkeys; i++)
+    {
+        free(gather->keys[i].name);
+    }
+
+    for (int i = 0; i < gather->naggs; i++)
+    {
+        free(gather->aggs[i].value);
+        free(gather->aggs[i].decimal);
+    }
+
+    gwbuf_free(gather->error);
+    gwbuf_free(gather->eof);
+    gwbuf_free(gather->ok);
+    gwbuf_free(gather->out);
+    free(gather->shards);
+    free(gather);
+}
+
+/**
+ * @brief Create the state of a query that is sent to several shards
+ *
+ * The query is inspected to find out how the results are merged. If the query
+ * has a LIMIT with an offset, the query to send to the shards returns the rows
+ * of the offset as well.
+ *
+ * @param query       The query
+ * @param nshards     Number of shards the query is sent to
+ * @param shard_query Set to the query to send to the shards if it differs from the query
+ * @param err         Set to the reason why the query can not be merged
+ * @return The gather state or NULL if the query can not be merged
+ */
+SHARD_GATHER* gather_create(GWBUF* query, int nshards, GWBUF** shard_query, const char** err)
+{
+    SHARD_GATHER* gather = calloc(1, sizeof(SHARD_GATHER));
+    char* sql = modutil_get_SQL(query);
+    SQL_CLAUSES clauses;
+
+    *shard_query = NULL;
+    *err = "Out of memory";
+
+    if (gather == NULL || sql == NULL ||
+        (gather->shards = calloc(nshards, sizeof(GATHER_SHARD))) == NULL)
+    {
+        free(sql);
+        gather_free(gather);
+        return NULL;
+    }
+
+    gather->nshards = nshards;
+    gather->limit = -1;
+    gather->seq = 1;
+
+    const char* end = sql + strlen(sql);
+
+    if (!find_clauses(sql, end, &clauses))
+    {
+        *err = "Only SELECT statements can be sent to all shards";
+        goto error;
+    }
+
+    if (clauses.unsupported)
+    {
+        *err = "GROUP BY, HAVING, DISTINCT, INTO and multiple statements "
+            "are not supported in queries sent to all shards";
+        goto error;
+    }
+
+    /** Check the select list for aggregate functions */
+    const char* list_end = clauses.from ? clauses.from : (clauses.order ? clauses.order :
+                                                         (clauses.limit ? clauses.limit : end));
+    int nitems = clauses.ncommas + 1;
+    int naggs = 0;
+    bool unmergeable = false;
+
+    for (int i = 0; i < nitems && i <= GATHER_MAX_KEYS; i++)
+    {
+        const char* item = i == 0 ? clauses.select_list : clauses.commas[i - 1] + 1;
+        const char* item_end = i < clauses.ncommas && i < GATHER_MAX_KEYS ? clauses.commas[i] : list_end;
+        gather_func_t func;
+
+        trim_part(&item, &item_end);
+
+        switch (parse_aggregate(item, item_end, &func))
+        {
+        case 1:
+            if (naggs < GATHER_MAX_KEYS)
+            {
+                gather->aggs[naggs].func = func;
+                gather->aggs[naggs].is_null = true;
+            }
+            naggs++;
+            break;
+
+        case -1:
+            unmergeable = true;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    if (naggs > 0 && (naggs != nitems || naggs > GATHER_MAX_KEYS || clauses.is_union))
+    {
+        unmergeable = true;
+    }
+
+    if (unmergeable)
+    {
+        *err = "Only COUNT, SUM, MIN and MAX of the whole result can be merged "
+            "from all shards";
+        goto error;
+    }
+
+    if (naggs > 0)
+    {
+        gather->mode = GATHER_AGGREGATE;
+        gather->naggs = naggs;
+    }
+    else if (clauses.order)
+    {
+        gather->mode = GATHER_SORT;
+
+        if (!parse_order_by(gather, clauses.order + 5, clauses.limit ? clauses.limit : end))
+        {
+            *err = "Only column names and numbers can be used in the ORDER BY "
+                "of a query sent to all shards";
+            goto error;
+        }
+    }
+
+    if (clauses.limit && gather->mode != GATHER_AGGREGATE)
+    {
+        const char* limit_end;
+
+        if (!parse_limit(gather, clauses.limit + 5, clauses.limit_end, &limit_end))
+        {
+            *err = "Invalid LIMIT in a query sent to all shards";
+            goto error;
+        }
+
+        if (gather->offset > 0)
+        {
+            /** Each shard must return the rows of the offset */
+            size_t len = strlen(sql) + 32;
+            char* newsql = malloc(len);
+
+            if (newsql == NULL)
+            {
+                goto error;
+            }
+
+            /** The comments and clauses after the numbers are kept as they are */
+            snprintf(newsql, len, "%.*sLIMIT %ld", (int)(clauses.limit - sql), sql,
+                     gather->offset + gather->limit);
+            strncat(newsql, limit_end, len - strlen(newsql) - 1);
+            *shard_query = modutil_create_query(newsql);
+            free(newsql);
+
+            if (*shard_query == NULL)
+            {
+                goto error;
+            }
+        }
+    }
+
+    free(sql);
+    return gather;
+
+error:
+    free(sql);
+    gather_free(gather);
+    return NULL;
+}
+
+/**
+ * Read a length encoded integer
+ *
+ * @param ptr   Start of the integer, moved past it
+ * @param end   End of the data
+ * @param value The value
+ * @return False if the value is NULL or the data ends
+ */
+static bool read_lenenc(uint8_t** ptr, uint8_t* end, uint64_t* value)
+{
+    uint8_t* p = *ptr;
+    int bytes;
+
+    if (p >= end || *p == 0xfb)
+    {
+        *ptr = p + 1;
+        return false;
+    }
+
+    switch (*p)
+    {
+    case 0xfc:
+        bytes = 2;
+        break;
+
+    case 0xfd:
+        bytes = 3;
+        break;
+
+    case 0xfe:
+        bytes = 8;
+        break;
+
+    default:
+        *value = *p;
+        *ptr = p + 1;
+        return true;
+    }
+
+    if (end - p <= bytes)
+    {
+        *ptr = end;
+        return false;
+    }
+
+    *value = 0;
+
+    for (int i = bytes; i > 0; i--)
+    {
+        *value = (*value << 8) | p[i];
+    }
+
+    *ptr = p + bytes + 1;
+    return true;
+}
+
+/**
+ * Get a column value of a row in the text protocol
+ *
+ * @param row    The row packet
+ * @param column The column index
+ * @param data   The value
+ * @param len    The length of the value
+ * @return False if the value is NULL
+ */
+static bool row_value(GWBUF* row, int column, uint8_t** data, uint64_t* len)
+{
+    uint8_t* ptr = ((uint8_t*)GWBUF_DATA(row)) + 4;
+    uint8_t* end = ((uint8_t*)GWBUF_DATA(row)) + GWBUF_LENGTH(row);
+
+    for (int i = 0; ptr < end; i++)
+    {
+        uint64_t value_len = 0;
+        bool not_null = read_lenenc(&ptr, end, &value_len);
+
+        if (i == column)
+        {
+            *data = ptr;
+            *len = value_len;
+            return not_null && ptr + value_len <= end;
+        }
+
+        ptr += value_len;
+    }
+
+    return false;
+}
+
+/**
+ * Find the name and type of a column from the column definitions
+ *
+ * @param header The column count and definition packets
+ * @param name   The column name
+ * @param type   Set to the type of the column
+ * @return The column index or -1 if the column was not found
+ */
+static int find_column(GWBUF* header, int column, const char* name, uint8_t* type)
+{
+    GWBUF* def = header->next;
+
+    for (int i = 0; def && def->next; i++, def = def->next)
+    {
+        uint8_t* ptr = ((uint8_t*)GWBUF_DATA(def)) + 4;
+        uint8_t* end = ((uint8_t*)GWBUF_DATA(def)) + GWBUF_LENGTH(def);
+        bool found = name == NULL && i == column;
+
+        /** catalog, schema, table, org_table, name, org_name */
+        for (int field = 0; field < 6 && ptr < end; field++)
+        {
+            uint64_t len = 0;
+            read_lenenc(&ptr, end, &len);
+
+            if (name && (field == 4 || field == 5) && len == strlen(name) && ptr + len <= end &&
+                strncasecmp((char*)ptr, name, len) == 0)
+            {
+                found = true;
+            }
+
+            ptr += len;
+        }
+
+        if (found)
+        {
+            /** Length of the fixed fields, character set and column length */
+            ptr += 1 + 2 + 4;
+            *type = ptr < end ? *ptr : 0xfd;
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Compare the ORDER BY columns of two rows
+ *
+ * @return Negative if the first row comes first, positive if the second does and zero if
+ * they are equal
+ */
+static int compare_rows(SHARD_GATHER* gather, GWBUF* a, GWBUF* b)
+{
+    for (int i = 0; i < gather->nkeys; i++)
+    {
+        GATHER_KEY* key = &gather->keys[i];
+        uint8_t *da, *db;
+        uint64_t la, lb;
+        bool a_null = !row_value(a, key->column, &da, &la);
+        bool b_null = !row_value(b, key->column, &db, &lb);
+        int rc;
+
+        if (a_null || b_null)
+        {
+            /** NULLs come first in ascending order */
+            rc = a_null && b_null ? 0 : a_null ? -1 : 1;
+        }
+        else if (key->numeric)
+        {
+            char sa[64], sb[64];
+            snprintf(sa, sizeof(sa), "%.*s", (int)la, da);
+            snprintf(sb, sizeof(sb), "%.*s", (int)lb, db);
+            double va = strtod(sa, NULL);
+            double vb = strtod(sb, NULL);
+            rc = va < vb ? -1 : va > vb ? 1 : 0;
+        }
+        else
+        {
+            rc = memcmp(da, db, la < lb ? la : lb);
+
+            if (rc == 0)
+            {
+                rc = la < lb ? -1 : la > lb ? 1 : 0;
+            }
+        }
+
+        if (rc != 0)
+        {
+            return key->desc ? -rc : rc;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Add a packet to the packets sent to the client
+ *
+ * @param gather Gather state
+ * @param packet The packet, its sequence number is rewritten
+ */
+static void gather_output(SHARD_GATHER* gather, GWBUF* packet)
+{
+    ((uint8_t*)GWBUF_DATA(packet))[3] = gather->seq++;
+    gather->out = gwbuf_append(gather->out, packet);
+}
+
+/**
+ * Send a merged row to the client if it is within the LIMIT
+ *
+ * @param gather Gather state
+ * @param row    The row
+ */
+static void gather_output_row(SHARD_GATHER* gather, GWBUF* row)
+{
+    long n = gather->nrows++;
+
+    if (n >= gather->offset && (gather->limit < 0 || n < gather->offset + gather->limit))
+    {
+        gather_output(gather, row);
+    }
+    else
+    {
+        gwbuf_free(row);
+    }
+}
+
+/**
+ * Split a decimal number into its sign and digits
+ *
+ * @param text     The number
+ * @param negative Set to true if the number is negative
+ * @param digits   Set to the first digit or the decimal point
+ * @param nint     Set to the number of digits before the decimal point
+ * @param nfrac    Set to the number of digits after the decimal point
+ * @return False if the text is not a decimal number without an exponent
+ */
+static bool decimal_parse(const char* text, bool* negative, const char** digits,
+                          int* nint, int* nfrac)
+{
+    const char* p = text;
+
+    *negative = *p == '-';
+
+    if (*p == '-' || *p == '+')
+    {
+        p++;
+    }
+
+    *digits = p;
+    *nint = 0;
+    *nfrac = 0;
+
+    while (isdigit(*p))
+    {
+        (*nint)++;
+        p++;
+    }
+
+    if (*p == '.')
+    {
+        p++;
+
+        while (isdigit(*p))
+        {
+            (*nfrac)++;
+            p++;
+        }
+    }
+
+    return (*nint > 0 || *nfrac > 0) && *p == '\0';
+}
+
+/**
+ * Add two decimal numbers without rounding
+ *
+ * The sum has as many digits after the decimal point as the operand that has
+ * more of them, which is how the server returns a SUM of DECIMAL values.
+ *
+ * @param a A decimal number
+ * @param b A decimal number
+ * @return The sum, which must be freed by the caller, or NULL if an operand is
+ * not a decimal number or memory allocation failed
+ */
+static char* decimal_add(const char* a, const char* b)
+{
+    const char* text[2] = {a, b};
+    bool negative[2];
+    const char* digits[2];
+    int nint[2];
+    int nfrac[2];
+
+    for (int k = 0; k < 2; k++)
+    {
+        if (!decimal_parse(text[k], &negative[k], &digits[k], &nint[k], &nfrac[k]))
+        {
+            return NULL;
+        }
+    }
+
+    int scale = MAX(nfrac[0], nfrac[1]);
+    int width = MAX(nint[0], nint[1]) + 1 + scale;
+    char* num = calloc(3, width + 3);
+
+    if (num == NULL)
+    {
+        return NULL;
+    }
+
+    /** The digit values of both operands aligned at the decimal point */
+    char* value[2] = {num, num + width};
+    char* sum = num + 2 * width;
+
+    for (int k = 0; k < 2; k++)
+    {
+        int point = width - scale;
+
+        for (int i = 0; i < nint[k]; i++)
+        {
+            value[k][point - nint[k] + i] = digits[k][i] - '0';
+        }
+
+        for (int i = 0; i < nfrac[k]; i++)
+        {
+            value[k][point + i] = digits[k][nint[k] + 1 + i] - '0';
+        }
+    }
+
+    /** Subtract the smaller magnitude from the larger if the signs differ */
+    int larger = memcmp(value[0], value[1], width) >= 0 ? 0 : 1;
+    int smaller = 1 - larger;
+    bool subtract = negative[0] != negative[1];
+    bool is_negative = negative[larger];
+    int carry = 0;
+
+    for (int i = width - 1; i >= 0; i--)
+    {
+        int d = subtract ? value[larger][i] - value[smaller][i] - carry :
+            value[larger][i] + value[smaller][i] + carry;
+        carry = subtract ? d < 0 : d > 9;
+        sum[i] = subtract ? (d + 10) % 10 : d % 10;
+    }
+
+    /** Format the digits in place, skipping the leading zeros */
+    int first = 0;
+
+    while (first < width - scale - 1 && sum[first] == 0)
+    {
+        first++;
+    }
+
+    bool is_zero = true;
+
+    for (int i = first; i < width; i++)
+    {
+        is_zero = is_zero && sum[i] == 0;
+        sum[i] += '0';
+    }
+
+    char* result = malloc(width + 3);
+
+    if (result)
+    {
+        snprintf(result, width + 3, "%s%.*s%s%.*s", is_negative && !is_zero ? "-" : "",
+                 width - scale - first, sum + first, scale ? "." : "", scale, sum + width - scale);
+    }
+
+    free(num);
+    return result;
+}
+
+/**
+ * Merge a row into the aggregate values
+ *
+ * @param gather Gather state
+ * @param row    The row
+ */
+static void gather_aggregate(SHARD_GATHER* gather, GWBUF* row)
+{
+    for (int i = 0; i < gather->naggs; i++)
+    {
+        GATHER_AGG* agg = &gather->aggs[i];
+        uint8_t* data;
+        uint64_t len;
+        char buf[128];
+
+        if (!row_value(row, i, &data, &len))
+        {
+            continue;
+        }
+
+        if (agg->func == GATHER_COUNT || agg->func == GATHER_SUM)
+        {
+            if (len >= sizeof(buf))
+            {
+                len = sizeof(buf) - 1;
+                agg->is_double = true;
+            }
+
+            memcpy(buf, data, len);
+            buf[len] = '\0';
+
+            char* end;
+            errno = 0;
+            long long ival = strtoll(buf, &end, 10);
+            double dval = strtod(buf, NULL);
+            int64_t isum;
+
+            if (*end != '\0' || errno == ERANGE ||
+                __builtin_add_overflow(agg->isum, (int64_t)ival, &isum))
+            {
+                /** DECIMAL values and large integers are added as text */
+                char* decimal = decimal_add(agg->decimal ? agg->decimal : "0", buf);
+
+                if (decimal)
+                {
+                    free(agg->decimal);
+                    agg->decimal = decimal;
+                }
+                else
+                {
+                    agg->is_double = true;
+                }
+            }
+            else
+            {
+                agg->isum = isum;
+            }
+
+            agg->dsum += dval;
+        }
+        else
+        {
+            bool replace = agg->is_null;
+
+            if (!replace)
+            {
+                char sa[64], sb[64];
+                snprintf(sa, sizeof(sa), "%.*s", (int)len, data);
+                snprintf(sb, sizeof(sb), "%.*s", (int)agg->value_len, agg->value);
+                char *ea, *eb;
+                double va = strtod(sa, &ea);
+                double vb = strtod(sb, &eb);
+                int rc;
+
+                if (*ea == '\0' && *eb == '\0' && ea != sa && eb != sb)
+                {
+                    rc = va < vb ? -1 : va > vb ? 1 : 0;
+                }
+                else
+                {
+                    rc = memcmp(data, agg->value, len < agg->value_len ? len : agg->value_len);
+                    rc = rc ? rc : len < agg->value_len ? -1 : len > agg->value_len ? 1 : 0;
+                }
+
+                replace = agg->func == GATHER_MIN ? rc < 0 : rc > 0;
+            }
+
+            if (replace)
+            {
+                char* value = malloc(len ? len : 1);
+
+                if (value)
+                {
+                    memcpy(value, data, len);
+                    free(agg->value);
+                    agg->value = value;
+                    agg->value_len = len;
+                }
+            }
+        }
+
+        agg->is_null = false;
+    }
+
+    gwbuf_free(row);
+}
+
+/**
+ * Create the row of the merged aggregate values
+ *
+ * @param gather Gather state
+ * @return The row packet or NULL if memory allocation failed
+ */
+static GWBUF* aggregate_row(SHARD_GATHER* gather)
+{
+    char values[GATHER_MAX_KEYS][128];
+    size_t len = 0;
+
+    for (int i = 0; i < gather->naggs; i++)
+    {
+        GATHER_AGG* agg = &gather->aggs[i];
+
+        if (agg->func == GATHER_COUNT || agg->func == GATHER_SUM)
+        {
+            char* decimal = NULL;
+
+            snprintf(values[i], sizeof(values[i]), "%lld", (long long)agg->isum);
+
+            if (!agg->is_double && agg->decimal &&
+                (decimal = decimal_add(agg->decimal, values[i])) == NULL)
+            {
+                agg->is_double = true;
+            }
+
+            if (agg->is_double)
+            {
+                snprintf(values[i], sizeof(values[i]), "%.15g", agg->dsum);
+            }
+            else if (decimal)
+            {
+                snprintf(values[i], sizeof(values[i]), "%s", decimal);
+            }
+
+            free(decimal);
+        }
+
+        /** The payload of each value is at most 9 bytes of length and the value */
+        len += 9 + (agg->func == GATHER_MIN || agg->func == GATHER_MAX ?
+                    agg->value_len : strlen(values[i]));
+    }
+
+    GWBUF* row = gwbuf_alloc(len + 4);
+
+    if (row == NULL)
+    {
+        return NULL;
+    }
+
+    uint8_t* ptr = ((uint8_t*)GWBUF_DATA(row)) + 4;
+
+    for (int i = 0; i < gather->naggs; i++)
+    {
+        GATHER_AGG* agg = &gather->aggs[i];
+        const char* value = values[i];
+        uint64_t value_len = strlen(values[i]);
+
+        if (agg->func == GATHER_MIN || agg->func == GATHER_MAX)
+        {
+            value = agg->value;
+            value_len = agg->value_len;
+        }
+
+        if ((agg->func == GATHER_SUM || agg->func == GATHER_MIN || agg->func == GATHER_MAX) &&
+            agg->is_null)
+        {
+            *ptr++ = 0xfb;
+            continue;
+        }
+
+        if (value_len < 251)
+        {
+            *ptr++ = value_len;
+        }
+        else if (value_len < 0x10000)
+        {
+            *ptr++ = 0xfc;
+            gw_mysql_set_byte2(ptr, value_len);
+            ptr += 2;
+        }
+        else if (value_len < 0x1000000)
+        {
+            *ptr++ = 0xfd;
+            gw_mysql_set_byte3(ptr, value_len);
+            ptr += 3;
+        }
+        else
+        {
+            *ptr++ = 0xfe;
+            for (int j = 0; j < 8; j++)
+            {
+                *ptr++ = (value_len >> (j * 8)) & 0xff;
+            }
+        }
+
+        memcpy(ptr, value, value_len);
+        ptr += value_len;
+    }
+
+    len = ptr - ((uint8_t*)GWBUF_DATA(row)) - 4;
+    gw_mysql_set_byte3(((uint8_t*)GWBUF_DATA(row)), len);
+    GWBUF_RTRIM(row, GWBUF_LENGTH(row) - len - 4);
+    return row;
+}
+
+/**
+ * Send an error as the whole response and discard the rest of the results
+ *
+ * @param gather Gather state
+ * @param msg    Error message
+ */
+static void gather_abort(SHARD_GATHER* gather, const char* msg)
+{
+    GWBUF* err = modutil_create_mysql_err_msg(1, 0, SCHEMA_ERR_SCATTER, SCHEMA_ERRSTR_SCATTER, msg);
+
+    MXS_ERROR("schemarouter: %s", msg);
+
+    if (err)
+    {
+        gather_output(gather, err);
+    }
+
+    gather->discard = true;
+}
+
+/**
+ * Send the column definitions of the first shard to the client once all shards
+ * have sent theirs, or the first error or OK if no shard returned a result set
+ *
+ * @param gather Gather state
+ */
+static void gather_send_header(SHARD_GATHER* gather)
+{
+    GATHER_SHARD* first = NULL;
+
+    for (int i = 0; i < gather->nshards; i++)
+    {
+        GATHER_SHARD* shard = &gather->shards[i];
+
+        if (shard->state == GS_HEADER || shard->state == GS_COLUMNS)
+        {
+            return;
+        }
+
+        if (shard->header)
+        {
+            if (first == NULL)
+            {
+                first = shard;
+            }
+            else if (shard->ncolumns != first->ncolumns)
+            {
+                gather_abort(gather, "The shards returned a different number of columns");
+                return;
+            }
+        }
+    }
+
+    if (first == NULL)
+    {
+        /** None of the shards returned a result set */
+        GWBUF* reply = gather->error ? gather->error : gather->ok;
+
+        if (reply)
+        {
+            gather_output(gather, reply);
+
+            if (reply == gather->error)
+            {
+                gather->error = NULL;
+            }
+            else
+            {
+                gather->ok = NULL;
+            }
+        }
+        gather->discard = true;
+        return;
+    }
+
+    if (gather->mode == GATHER_AGGREGATE && first->ncolumns != (uint64_t)gather->naggs)
+    {
+        gather_abort(gather, "The select list could not be merged");
+        return;
+    }
+
+    for (int i = 0; i < gather->nkeys; i++)
+    {
+        GATHER_KEY* key = &gather->keys[i];
+        uint8_t type = 0xfd;
+
+        if ((key->column = find_column(first->header, key->column, key->name, &type)) == -1)
+        {
+            gather_abort(gather, "The ORDER BY columns of a query sent to all shards must "
+                         "be in the select list");
+            return;
+        }
+
+        key->numeric = GATHER_IS_NUMERIC_TYPE(type);
+    }
+
+    GWBUF* header = first->header;
+    first->header = NULL;
+
+    while (header)
+    {
+        GWBUF* packet = header;
+        header = header->next;
+        packet->next = NULL;
+        packet->tail = packet;
+        gather_output(gather, packet);
+    }
+
+    gather->header_sent = true;
+}
+
+/**
+ * Merge the queued rows of the shards
+ *
+ * @param gather Gather state
+ */
+static void gather_merge(SHARD_GATHER* gather)
+{
+    while (true)
+    {
+        GATHER_SHARD* next = NULL;
+
+        for (int i = 0; i < gather->nshards; i++)
+        {
+            GATHER_SHARD* shard = &gather->shards[i];
+
+            if (shard->rows == NULL)
+            {
+                if (gather->mode == GATHER_SORT && shard->state != GS_DONE)
+                {
+                    /** A row of this shard may come before the others */
+                    return;
+                }
+            }
+            else if (next == NULL || gather->mode != GATHER_SORT ||
+                     compare_rows(gather, shard->rows, next->rows) < 0)
+            {
+                next = shard;
+            }
+        }
+
+        if (next == NULL)
+        {
+            return;
+        }
+
+        GWBUF* row = next->rows;
+        next->rows = row->next;
+        row->next = NULL;
+        row->tail = row;
+
+        if (next->rows == NULL)
+        {
+            next->rows_tail = NULL;
+        }
+
+        if (gather->mode == GATHER_AGGREGATE)
+        {
+            gather_aggregate(gather, row);
+        }
+        else
+        {
+            gather_output_row(gather, row);
+        }
+    }
+}
+
+/**
+ * Mark the result of a shard as read
+ *
+ * @param gather Gather state
+ * @param shard  The shard
+ * @param packet The EOF, OK or ERR packet that ended the result
+ */
+static void gather_finish_shard(SHARD_GATHER* gather, GATHER_SHARD* shard, GWBUF* packet)
+{
+    GWBUF** keep = NULL;
+
+    switch (((uint8_t*)GWBUF_DATA(packet))[4])
+    {
+    case 0xff:
+        keep = &gather->error;
+        break;
+
+    case 0xfe:
+        keep = &gather->eof;
+        break;
+
+    default:
+        keep = &gather->ok;
+        break;
+    }
+
+    if (*keep == NULL)
+    {
+        *keep = packet;
+    }
+    else
+    {
+        gwbuf_free(packet);
+    }
+
+    gwbuf_free(shard->partial);
+    shard->partial = NULL;
+    shard->state = GS_DONE;
+    gather->nfinished++;
+}
+
+/**
+ * Process one packet of the result of a shard
+ *
+ * @param gather Gather state
+ * @param shard  The shard
+ * @param packet A complete packet in a contiguous buffer
+ */
+static void gather_packet(SHARD_GATHER* gather, GATHER_SHARD* shard, GWBUF* packet)
+{
+    uint8_t* data = ((uint8_t*)GWBUF_DATA(packet));
+    size_t len = gw_mysql_get_byte3(data);
+    bool is_eof = data[4] == 0xfe && len < 9;
+    bool is_err = data[4] == 0xff;
+
+    switch (shard->state)
+    {
+    case GS_HEADER:
+        if (is_err || data[4] == 0x00)
+        {
+            gather_finish_shard(gather, shard, packet);
+        }
+        else
+        {
+            uint8_t* ptr = data + 4;
+            read_lenenc(&ptr, data + 4 + len, &shard->ncolumns);
+            shard->columns_left = shard->ncolumns;
+            shard->header = packet;
+            shard->state = GS_COLUMNS;
+        }
+        break;
+
+    case GS_COLUMNS:
+        if (is_err)
+        {
+            gather_finish_shard(gather, shard, packet);
+        }
+        else
+        {
+            shard->header = gwbuf_append(shard->header, packet);
+
+            if (shard->columns_left-- == 0)
+            {
+                shard->state = GS_ROWS;
+            }
+        }
+        break;
+
+    case GS_ROWS:
+        if (is_eof || is_err)
+        {
+            gather_finish_shard(gather, shard, packet);
+        }
+        else if (shard->rows_tail)
+        {
+            shard->rows_tail->next = packet;
+            shard->rows_tail = packet;
+        }
+        else
+        {
+            shard->rows = shard->rows_tail = packet;
+        }
+        break;
+
+    default:
+        gwbuf_free(packet);
+        break;
+    }
+}
+
+/**
+ * Process the data that was read from a shard. All packets in the data are
+ * processed and a partial packet is kept until the rest of it is read.
+ *
+ * @param gather Gather state
+ * @param shard  Index of the shard
+ * @param reply  The data, freed by this function
+ * @return The packets to send to the client or NULL if there is nothing to send
+ */
+static GWBUF* gather_process(SHARD_GATHER* gather, int shard, GWBUF* reply)
+{
+    GATHER_SHARD* sh = &gather->shards[shard];
+    GWBUF* packet;
+
+    if (sh->state == GS_DONE)
+    {
+        gwbuf_free(reply);
+    }
+    else
+    {
+        sh->partial = gwbuf_append(sh->partial, reply);
+
+        while (sh->state != GS_DONE && (packet = modutil_get_next_MySQL_packet(&sh->partial)))
+        {
+            gather_packet(gather, sh, gwbuf_make_contiguous(packet));
+        }
+    }
+
+    if (gather->discard)
+    {
+        /** Drop everything that the shards send after the response */
+        for (int i = 0; i < gather->nshards; i++)
+        {
+            gwbuf_free(gather->shards[i].rows);
+            gather->shards[i].rows = gather->shards[i].rows_tail = NULL;
+        }
+    }
+    else
+    {
+        if (!gather->header_sent)
+        {
+            gather_send_header(gather);
+        }
+
+        if (gather->header_sent)
+        {
+            gather_merge(gather);
+
+            if (gather->nfinished == gather->nshards)
+            {
+                if (gather->mode == GATHER_AGGREGATE)
+                {
+                    GWBUF* row = aggregate_row(gather);
+
+                    if (row)
+                    {
+                        gather_output(gather, row);
+                    }
+                }
+
+                GWBUF** last = gather->error ? &gather->error : &gather->eof;
+
+                if (*last)
+                {
+                    gather_output(gather, *last);
+                    *last = NULL;
+                }
+
+                gather->discard = true;
+            }
+        }
+    }
+
+    GWBUF* rval = gather->out;
+    gather->out = NULL;
+    return rval;
+}
+
+/**
+ * Process a reply from a shard
+ *
+ * @param gather Gather state
+ * @param shard  Index of the shard
+ * @param reply  The data read from the shard
+ * @return The packets to send to the client or NULL if there is nothing to send
+ */
+GWBUF* gather_reply(SHARD_GATHER* gather, int shard, GWBUF* reply)
+{
+    return gather_process(gather, shard, reply);
+}
+
+/**
+ * Handle the failure of a shard. The error ends the result of the shard.
+ *
+ * @param gather Gather state
+ * @param shard  Index of the shard
+ * @param error  The error packet
+ * @return The packets to send to the client or NULL if there is nothing to send
+ */
+GWBUF* gather_shard_failed(SHARD_GATHER* gather, int shard, GWBUF* error)
+{
+    GATHER_SHARD* sh = &gather->shards[shard];
+
+    if (sh->state != GS_DONE)
+    {
+        gather_finish_shard(gather, sh, gwbuf_make_contiguous(error));
+        error = NULL;
+    }
+
+    return gather_process(gather, shard, error);
+}
+
+/**
+ * Check if the result of a shard has been read
+ *
+ * @param gather Gather state
+ * @param shard  Index of the shard
+ * @return True if the shard has sent its whole result
+ */
+bool gather_shard_done(SHARD_GATHER* gather, int shard)
+{
+    return gather->shards[shard].state == GS_DONE;
+}
+
+/**
+ * Check if all shards have sent their results
+ *
+ * @param gather Gather state
+ * @return True if the query is complete
+ */
+bool gather_done(SHARD_GATHER* gather)
+{
+    return gather->nfinished == gather->nshards;
+}
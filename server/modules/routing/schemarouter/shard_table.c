@@ -0,0 +1,979 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file shard_table.c - Sharding of tables by the value of a column
+ *
+ * A table that is defined with the shard_table router option has its rows
+ * split between the servers by the value of a key column. The rule of the
+ * table either hashes the value onto a consistent hash ring of the servers or
+ * compares it to the upper bounds of the ranges of the servers.
+ *
+ * The tables of a query are read with the query classifier. If one of them is
+ * sharded, the key is taken from a comparison of the key column to a constant
+ * in the WHERE clause or from the values of an INSERT. The shard is thus
+ * chosen from the query alone, with no lookups. A SELECT with no key is sent
+ * to all servers of the table and the results are merged.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <math.h>
+#include <schemarouter.h>
+#include <modutil.h>
+#include <query_classifier.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+
+/** Points of each server on the hash ring */
+#define SHARD_TABLE_VNODES 64
+
+typedef struct
+{
+    uint32_t hash;
+    int      server;
+} RING_NODE;
+
+struct shard_table_rule
+{
+    char*      db;
+    char*      table;
+    char*      column;
+    bool       is_range;
+    int        nservers;
+    char**     servers;  /*< Unique names of the servers of the table */
+    double*    bounds;   /*< Exclusive upper bounds of the ranges, INFINITY for none */
+    RING_NODE* ring;
+    int        nnodes;
+    struct shard_table_rule* next;
+};
+
+/**
+ * Hash a string. Uses FNV-1a with a final mix to spread the points of the ring.
+ *
+ * @param data The string
+ * @param len  Length of the string
+ * @return The hash
+ */
+static uint32_t key_hash(const char* data, size_t len)
+{
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ (uint8_t)data[i]) * 16777619u;
+    }
+
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+static int ring_node_cmp(const void* a, const void* b)
+{
+    const RING_NODE* na = (const RING_NODE*)a;
+    const RING_NODE* nb = (const RING_NODE*)b;
+    return na->hash < nb->hash ? -1 : na->hash > nb->hash ? 1 : 0;
+}
+
+/**
+ * Free the table sharding rules
+ *
+ * @param rules List of rules
+ */
+void shard_table_free(SHARD_TABLE_RULE* rules)
+{
+    while (rules)
+    {
+        SHARD_TABLE_RULE* next = rules->next;
+
+        for (int i = 0; i < rules->nservers; i++)
+        {
+            free(rules->servers[i]);
+        }
+
+        free(rules->servers);
+        free(rules->bounds);
+        free(rules->ring);
+        free(rules->db);
+        free(rules->table);
+        free(rules->column);
+        free(rules);
+        rules = next;
+    }
+}
+
+/**
+ * @brief Add a table sharding rule
+ *
+ * The value of the shard_table router option is one of:
+ *
+ *     <db>.<table>:<column>:hash[:<server>...]
+ *     <db>.<table>:<column>:range:<server><<bound>:...:<server>
+ *
+ * A hash rule without servers uses all servers of the service. The ranges
+ * are listed in ascending order of their exclusive upper bounds. The last
+ * range may be left without a bound.
+ *
+ * @param rules   The list of rules to add to
+ * @param value   The value of the option
+ * @param service Name of the service
+ * @return True if the rule was added
+ */
+bool shard_table_add_rule(SHARD_TABLE_RULE** rules, const char* value, const char* service)
+{
+    SHARD_TABLE_RULE* rule = calloc(1, sizeof(SHARD_TABLE_RULE));
+    char* copy = strdup(value);
+    char* saveptr;
+    bool rval = false;
+
+    if (rule == NULL || copy == NULL)
+    {
+        MXS_ERROR("[%s] Memory allocation failed.", service);
+        goto retblock;
+    }
+
+    char* table = strtok_r(copy, ":", &saveptr);
+    char* column = strtok_r(NULL, ":", &saveptr);
+    char* type = strtok_r(NULL, ":", &saveptr);
+    char* dot = table ? strchr(table, '.') : NULL;
+
+    if (dot == NULL || type == NULL || dot == table || dot[1] == '\0')
+    {
+        MXS_ERROR("[%s] Invalid value for 'shard_table': %s. The value must be "
+                  "<database>.<table>:<column>:hash|range[:<server>...].", service, value);
+        goto retblock;
+    }
+
+    *dot = '\0';
+
+    if (strcasecmp(type, "range") == 0)
+    {
+        rule->is_range = true;
+    }
+    else if (strcasecmp(type, "hash") != 0)
+    {
+        MXS_ERROR("[%s] Unknown sharding type '%s' for table %s.%s, "
+                  "expected 'hash' or 'range'.", service, type, table, dot + 1);
+        goto retblock;
+    }
+
+    rule->db = strdup(table);
+    rule->table = strdup(dot + 1);
+    rule->column = strdup(column);
+
+    if (rule->db == NULL || rule->table == NULL || rule->column == NULL)
+    {
+        MXS_ERROR("[%s] Memory allocation failed.", service);
+        goto retblock;
+    }
+
+    for (char* tok = strtok_r(NULL, ":", &saveptr); tok; tok = strtok_r(NULL, ":", &saveptr))
+    {
+        char** servers = realloc(rule->servers, (rule->nservers + 1) * sizeof(char*));
+        double* bounds = realloc(rule->bounds, (rule->nservers + 1) * sizeof(double));
+
+        if (servers)
+        {
+            rule->servers = servers;
+        }
+
+        if (bounds)
+        {
+            rule->bounds = bounds;
+        }
+
+        if (servers == NULL || bounds == NULL)
+        {
+            MXS_ERROR("[%s] Memory allocation failed.", service);
+            goto retblock;
+        }
+
+        char* lt = strchr(tok, '<');
+        rule->bounds[rule->nservers] = INFINITY;
+
+        if (lt)
+        {
+            char* end;
+            *lt = '\0';
+            rule->bounds[rule->nservers] = strtod(lt + 1, &end);
+
+            if (!rule->is_range || end == lt + 1 || *end != '\0')
+            {
+                MXS_ERROR("[%s] Invalid range '%s<%s' for table %s.%s.", service, tok, lt + 1,
+                          rule->db, rule->table);
+                goto retblock;
+            }
+
+            if (rule->nservers > 0 && rule->bounds[rule->nservers] <= rule->bounds[rule->nservers - 1])
+            {
+                MXS_ERROR("[%s] The ranges of table %s.%s must be in ascending order.", service,
+                          rule->db, rule->table);
+                goto retblock;
+            }
+        }
+        else if (rule->is_range && rule->nservers > 0 && isinf(rule->bounds[rule->nservers - 1]))
+        {
+            MXS_ERROR("[%s] Only the last range of table %s.%s can be left without a bound.",
+                      service, rule->db, rule->table);
+            goto retblock;
+        }
+
+        if ((rule->servers[rule->nservers++] = strdup(tok)) == NULL)
+        {
+            MXS_ERROR("[%s] Memory allocation failed.", service);
+            goto retblock;
+        }
+    }
+
+    if (rule->is_range && rule->nservers == 0)
+    {
+        MXS_ERROR("[%s] No ranges were given for table %s.%s.", service, rule->db, rule->table);
+        goto retblock;
+    }
+
+    rule->next = *rules;
+    *rules = rule;
+    rule = NULL;
+    rval = true;
+
+retblock:
+    free(copy);
+    shard_table_free(rule);
+    return rval;
+}
+
+/**
+ * @brief Check the servers of the table sharding rules and build the hash rings
+ *
+ * The databases of the sharded tables exist on all of their servers, they are
+ * added to the ignored databases so that they are not reported as duplicates
+ * when the databases of the servers are mapped.
+ *
+ * @param rules       The rules
+ * @param servers     The servers of the service
+ * @param ignored_dbs The databases that may be found on more than one server
+ * @param service     Name of the service
+ * @return True if all servers of the rules are servers of the service
+ */
+bool shard_table_init(SHARD_TABLE_RULE* rules, BACKEND** servers, HASHTABLE* ignored_dbs,
+                      const char* service)
+{
+    for (SHARD_TABLE_RULE* rule = rules; rule; rule = rule->next)
+    {
+        if (hashtable_fetch(ignored_dbs, rule->db) == NULL)
+        {
+            hashtable_add(ignored_dbs, rule->db, "");
+        }
+
+        if (rule->nservers == 0)
+        {
+            /** All servers of the service */
+            int n = 0;
+
+            while (servers[n])
+            {
+                n++;
+            }
+
+            if (n == 0 || (rule->servers = calloc(n, sizeof(char*))) == NULL)
+            {
+                MXS_ERROR("[%s] No servers for table %s.%s.", service, rule->db, rule->table);
+                return false;
+            }
+
+            for (int i = 0; i < n; i++)
+            {
+                if ((rule->servers[i] = strdup(servers[i]->backend_server->unique_name)) == NULL)
+                {
+                    return false;
+                }
+                rule->nservers++;
+            }
+        }
+
+        for (int i = 0; i < rule->nservers; i++)
+        {
+            bool found = false;
+
+            for (int j = 0; servers[j]; j++)
+            {
+                if (strcmp(servers[j]->backend_server->unique_name, rule->servers[i]) == 0)
+                {
+                    found = true;
+                }
+            }
+
+            if (!found)
+            {
+                MXS_ERROR("[%s] Server '%s' of table %s.%s is not a server of the service.",
+                          service, rule->servers[i], rule->db, rule->table);
+                return false;
+            }
+        }
+
+        if (!rule->is_range)
+        {
+            rule->nnodes = rule->nservers * SHARD_TABLE_VNODES;
+
+            if ((rule->ring = malloc(rule->nnodes * sizeof(RING_NODE))) == NULL)
+            {
+                MXS_ERROR("[%s] Memory allocation failed.", service);
+                return false;
+            }
+
+            for (int i = 0; i < rule->nservers; i++)
+            {
+                for (int j = 0; j < SHARD_TABLE_VNODES; j++)
+                {
+                    char point[strlen(rule->servers[i]) + 16];
+                    snprintf(point, sizeof(point), "%s-%d", rule->servers[i], j);
+                    rule->ring[i * SHARD_TABLE_VNODES + j].hash = key_hash(point, strlen(point));
+                    rule->ring[i * SHARD_TABLE_VNODES + j].server = i;
+                }
+            }
+
+            qsort(rule->ring, rule->nnodes, sizeof(RING_NODE), ring_node_cmp);
+        }
+
+        MXS_NOTICE("[%s] Table %s.%s is sharded by the %s of column '%s' over %d servers.",
+                   service, rule->db, rule->table, rule->is_range ? "range" : "hash",
+                   rule->column, rule->nservers);
+    }
+
+    return true;
+}
+
+/**
+ * Check if a server is one of the servers of a table
+ *
+ * @param rule The rule of the table
+ * @param name Unique name of the server
+ * @return True if rows of the table are stored on the server
+ */
+bool shard_table_has_server(SHARD_TABLE_RULE* rule, const char* name)
+{
+    for (int i = 0; i < rule->nservers; i++)
+    {
+        if (strcmp(rule->servers[i], name) == 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Find the server of a key value
+ *
+ * @param rule   The rule of the table
+ * @param value  The value, without quotes
+ * @param len    Length of the value
+ * @return Index of the server or -1 if no range contains the value
+ */
+static int find_shard(SHARD_TABLE_RULE* rule, const char* value, size_t len)
+{
+    char buf[64];
+    char* end = buf;
+    long long ival = 0;
+
+    if (len < sizeof(buf))
+    {
+        memcpy(buf, value, len);
+        buf[len] = '\0';
+        ival = strtoll(buf, &end, 10);
+    }
+
+    if (rule->is_range)
+    {
+        double dval = len < sizeof(buf) ? strtod(buf, &end) : 0;
+
+        if (len >= sizeof(buf) || end == buf || *end != '\0')
+        {
+            return -1;
+        }
+
+        for (int i = 0; i < rule->nservers; i++)
+        {
+            if (dval < rule->bounds[i])
+            {
+                return i;
+            }
+        }
+
+        return -1;
+    }
+
+    /** The same integer is hashed the same way however it is written */
+    if (end != buf && *end == '\0')
+    {
+        len = snprintf(buf, sizeof(buf), "%lld", ival);
+        value = buf;
+    }
+
+    uint32_t hash = key_hash(value, len);
+    int lo = 0;
+    int hi = rule->nnodes;
+
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+
+        if (rule->ring[mid].hash < hash)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    return rule->ring[lo == rule->nnodes ? 0 : lo].server;
+}
+
+/**
+ * Read a constant of the statement
+ *
+ * @param ptr   Start of the constant
+ * @param end   End of the statement
+ * @param value Set to the start of the value
+ * @param len   Set to the length of the value
+ * @return Position after the constant or NULL if there is no constant at the position
+ */
+static const char* read_constant(const char* ptr, const char* end, const char** value, size_t* len)
+{
+    if (ptr < end && (*ptr == '\'' || *ptr == '"'))
+    {
+        const char* close = sql_skip_quoted(ptr, end);
+        *value = ptr + 1;
+        *len = close - ptr - 2;
+        return close;
+    }
+
+    const char* start = ptr;
+
+    if (ptr < end && (*ptr == '-' || *ptr == '+'))
+    {
+        ptr++;
+    }
+
+    while (ptr < end && (isdigit(*ptr) || *ptr == '.'))
+    {
+        ptr++;
+    }
+
+    if (ptr == start || (ptr < end && (isalpha(*ptr) || *ptr == '_')))
+    {
+        return NULL;
+    }
+
+    *value = start;
+    *len = ptr - start;
+    return ptr;
+}
+
+/**
+ * Read an identifier and return its last part
+ *
+ * @param ptr  Start of the identifier
+ * @param end  End of the statement
+ * @param name Set to the last part of the identifier
+ * @param len  Set to the length of the last part
+ * @return Position after the identifier or NULL if there is no identifier at the position
+ */
+static const char* read_identifier(const char* ptr, const char* end, const char** name, size_t* len)
+{
+    const char* start = ptr;
+
+    while (ptr < end)
+    {
+        if (*ptr == '`')
+        {
+            const char* close = sql_skip_quoted(ptr, end);
+            *name = ptr + 1;
+            *len = close - ptr - 2;
+            ptr = close;
+        }
+        else if (isalpha(*ptr) || *ptr == '_' || *ptr == '$')
+        {
+            *name = ptr;
+            while (ptr < end && (isalnum(*ptr) || *ptr == '_' || *ptr == '$'))
+            {
+                ptr++;
+            }
+            *len = ptr - *name;
+        }
+        else
+        {
+            return NULL;
+        }
+
+        if (ptr < end && *ptr == '.')
+        {
+            ptr++;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    return ptr == start ? NULL : ptr;
+}
+
+static bool is_column(SHARD_TABLE_RULE* rule, const char* name, size_t len)
+{
+    return len == strlen(rule->column) && strncasecmp(name, rule->column, len) == 0;
+}
+
+/**
+ * Check if a keyword can follow the constant of the key comparison. The
+ * constant can be followed by another condition or by the next clause.
+ *
+ * @param ptr Position after the constant
+ * @param end End of the statement
+ * @return True if the comparison ends at the position
+ */
+static bool is_comparison_end(const char* ptr, const char* end)
+{
+    static const char* keywords[] =
+    {
+        "AND", "GROUP", "ORDER", "LIMIT", "HAVING", "FOR", "LOCK", "WINDOW",
+        "PROCEDURE", "INTO", "UNION", NULL
+    };
+
+    if (ptr == end || *ptr == ';' || (*ptr == '&' && ptr + 1 < end && ptr[1] == '&'))
+    {
+        return true;
+    }
+
+    for (int i = 0; keywords[i]; i++)
+    {
+        if (sql_is_keyword(ptr, end, keywords[i]))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Find the key of a SELECT, UPDATE or DELETE. The key is the constant that
+ * the key column is compared to with = in the top level of the WHERE clause.
+ * A WHERE clause with a top level OR has no key and neither has a comparison
+ * that is negated with NOT.
+ *
+ * @param rule  The rule of the table
+ * @param sql   The statement
+ * @param end   End of the statement
+ * @param value Set to the key
+ * @param len   Set to the length of the key
+ * @return True if the key was found
+ */
+static bool find_where_key(SHARD_TABLE_RULE* rule, const char* sql, const char* end,
+                           const char** value, size_t* len)
+{
+    const char* ptr = sql;
+    int depth = 0;
+    bool in_where = false;
+    bool negated = false;       /*< The condition being read is negated */
+    bool found = false;
+
+    while ((ptr = sql_skip_space(ptr, end)) < end)
+    {
+        if (*ptr == '\'' || *ptr == '"')
+        {
+            ptr = sql_skip_quoted(ptr, end);
+        }
+        else if (*ptr == '(' || *ptr == ')')
+        {
+            depth += *ptr == '(' ? 1 : -1;
+            ptr++;
+        }
+        else if (depth > 0)
+        {
+            ptr = *ptr == '`' ? sql_skip_quoted(ptr, end) : ptr + 1;
+        }
+        else if (*ptr == '|' && ptr + 1 < end && ptr[1] == '|')
+        {
+            return false;
+        }
+        else if (*ptr == '&' && ptr + 1 < end && ptr[1] == '&')
+        {
+            negated = false;
+            ptr += 2;
+        }
+        else if (*ptr == '!' && (ptr + 1 == end || ptr[1] != '='))
+        {
+            negated = true;
+            ptr++;
+        }
+        else if (*ptr == '`' || isalpha(*ptr) || *ptr == '_')
+        {
+            const char* name = NULL;
+            size_t name_len = 0;
+            const char* word = ptr;
+
+            if ((ptr = read_identifier(ptr, end, &name, &name_len)) == NULL)
+            {
+                ptr = word + 1;
+                continue;
+            }
+
+            if (sql_is_keyword(word, end, "UNION"))
+            {
+                return false;
+            }
+            else if (sql_is_keyword(word, end, "WHERE"))
+            {
+                in_where = true;
+            }
+            else if (in_where && (sql_is_keyword(word, end, "OR") || sql_is_keyword(word, end, "XOR")))
+            {
+                return false;
+            }
+            else if (in_where && sql_is_keyword(word, end, "NOT"))
+            {
+                /** NOT binds looser than =, it negates the comparison that follows it */
+                negated = true;
+            }
+            else if (in_where && sql_is_keyword(word, end, "AND"))
+            {
+                negated = false;
+            }
+            else if (in_where && (sql_is_keyword(word, end, "GROUP") || sql_is_keyword(word, end, "ORDER") ||
+                                  sql_is_keyword(word, end, "LIMIT") || sql_is_keyword(word, end, "HAVING") ||
+                                  sql_is_keyword(word, end, "FOR") || sql_is_keyword(word, end, "LOCK")))
+            {
+                in_where = false;
+            }
+            else if (in_where && !found && !negated && is_column(rule, name, name_len))
+            {
+                const char* op = sql_skip_space(ptr, end);
+
+                if (op < end && *op == '=' && (op + 1 == end || op[1] != '>'))
+                {
+                    const char* next = read_constant(sql_skip_space(op + 1, end), end, value, len);
+
+                    /** The constant must not be a part of an expression */
+                    if (next && is_comparison_end((next = sql_skip_space(next, end)), end))
+                    {
+                        found = true;
+                        ptr = next;
+                    }
+                }
+            }
+        }
+        else
+        {
+            ptr++;
+        }
+    }
+
+    return found;
+}
+
+/**
+ * Find the shard of the rows of an INSERT or REPLACE. The columns must be
+ * listed and all rows must belong to the same shard.
+ *
+ * @param rule  The rule of the table
+ * @param sql   The statement
+ * @param end   End of the statement
+ * @param shard Set to the index of the server
+ * @param err   Set to the error message if the rows belong to more than one shard
+ * @return True if the values of the key column were found
+ */
+static bool find_insert_shard(SHARD_TABLE_RULE* rule, const char* sql, const char* end,
+                              int* shard, const char** err)
+{
+    const char* ptr = sql;
+    int column = -1;
+
+    /** The column list is the first parenthesis before VALUES */
+    while ((ptr = sql_skip_space(ptr, end)) < end && *ptr != '(')
+    {
+        if (*ptr == '`' || *ptr == '\'' || *ptr == '"')
+        {
+            ptr = sql_skip_quoted(ptr, end);
+        }
+        else if (isalpha(*ptr) || *ptr == '_')
+        {
+            const char* word = ptr;
+
+            while (ptr < end && (isalnum(*ptr) || *ptr == '_' || *ptr == '$'))
+            {
+                ptr++;
+            }
+
+            if (sql_is_keyword(word, end, "VALUES") || sql_is_keyword(word, end, "VALUE") ||
+                sql_is_keyword(word, end, "SELECT") || sql_is_keyword(word, end, "SET"))
+            {
+                return false;
+            }
+        }
+        else
+        {
+            ptr++;
+        }
+    }
+
+    for (int i = 0; ptr < end && *ptr != ')'; i++)
+    {
+        const char* name = NULL;
+        size_t len = 0;
+
+        ptr = read_identifier(sql_skip_space(ptr + 1, end), end, &name, &len);
+
+        if (ptr == NULL)
+        {
+            return false;
+        }
+
+        if (is_column(rule, name, len))
+        {
+            column = i;
+        }
+
+        ptr = sql_skip_space(ptr, end);
+    }
+
+    ptr = sql_skip_space(ptr + 1, end);
+
+    if (column == -1 || !(sql_is_keyword(ptr, end, "VALUES") || sql_is_keyword(ptr, end, "VALUE")))
+    {
+        return false;
+    }
+
+    ptr += sql_is_keyword(ptr, end, "VALUES") ? 6 : 5;
+    *shard = -1;
+
+    /** Each row of values */
+    while ((ptr = sql_skip_space(ptr, end)) < end && *ptr == '(')
+    {
+        const char* value = NULL;
+        size_t len = 0;
+        int depth = 0;
+
+        for (int i = 0; ptr < end; )
+        {
+            if (*ptr == '\'' || *ptr == '"')
+            {
+                ptr = sql_skip_quoted(ptr, end);
+                continue;
+            }
+
+            if (*ptr == '(')
+            {
+                if (++depth == 1)
+                {
+                    ptr = sql_skip_space(ptr + 1, end);
+
+                    if (i == column)
+                    {
+                        const char* next = read_constant(ptr, end, &value, &len);
+                        value = next && (*sql_skip_space(next, end) == ',' ||
+                                         *sql_skip_space(next, end) == ')') ? value : NULL;
+                    }
+                    continue;
+                }
+            }
+            else if (*ptr == ')')
+            {
+                if (--depth == 0)
+                {
+                    ptr++;
+                    break;
+                }
+            }
+            else if (*ptr == ',' && depth == 1)
+            {
+                ptr = sql_skip_space(ptr + 1, end);
+
+                if (++i == column)
+                {
+                    const char* next = read_constant(ptr, end, &value, &len);
+                    value = next && (*sql_skip_space(next, end) == ',' ||
+                                     *sql_skip_space(next, end) == ')') ? value : NULL;
+                }
+                continue;
+            }
+
+            ptr++;
+        }
+
+        if (value == NULL)
+        {
+            /** The key of the row is not a constant */
+            return false;
+        }
+
+        int row_shard = find_shard(rule, value, len);
+
+        if (row_shard == -1 || (*shard != -1 && row_shard != *shard))
+        {
+            *err = row_shard == -1 ? "No shard contains the value of the sharding key" :
+                "The rows of an INSERT into a sharded table must belong to the same shard";
+            return false;
+        }
+
+        *shard = row_shard;
+        ptr = sql_skip_space(ptr, end);
+
+        if (ptr < end && *ptr == ',')
+        {
+            ptr++;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    return *shard != -1;
+}
+
+/**
+ * Find the rule of a table
+ *
+ * @param rules      The rules
+ * @param name       Table name, possibly qualified with the database
+ * @param current_db The current database of the session
+ * @return The rule or NULL if the table is not sharded
+ */
+static SHARD_TABLE_RULE* find_rule(SHARD_TABLE_RULE* rules, const char* name, const char* current_db)
+{
+    const char* dot = strchr(name, '.');
+    const char* table = dot ? dot + 1 : name;
+    size_t db_len = dot ? (size_t)(dot - name) : strlen(current_db);
+    const char* db = dot ? name : current_db;
+
+    for (SHARD_TABLE_RULE* rule = rules; rule; rule = rule->next)
+    {
+        if (strcasecmp(rule->table, table) == 0 && strlen(rule->db) == db_len &&
+            strncasecmp(rule->db, db, db_len) == 0)
+        {
+            return rule;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Find the first sharded table of a query
+ *
+ * @param rules      The table sharding rules
+ * @param query      The query or the statement to prepare
+ * @param current_db The current database of the session
+ * @return The rule of the table or NULL if the query has no sharded tables
+ */
+SHARD_TABLE_RULE* shard_table_find(SHARD_TABLE_RULE* rules, GWBUF* query, const char* current_db)
+{
+    SHARD_TABLE_RULE* rule = NULL;
+    int ntables = 0;
+    char** tables = qc_get_table_names(query, &ntables, true);
+
+    for (int i = 0; i < ntables && rule == NULL; i++)
+    {
+        rule = find_rule(rules, tables[i], current_db);
+    }
+
+    for (int i = 0; i < ntables; i++)
+    {
+        free(tables[i]);
+    }
+    free(tables);
+
+    return rule;
+}
+
+/**
+ * @brief Route a query by the sharding key of its table
+ *
+ * The first sharded table of the query decides the shard. The other tables
+ * of the query must exist on that shard.
+ *
+ * @param rules      The table sharding rules
+ * @param query      The query
+ * @param current_db The current database of the session
+ * @param rule       Set to the rule of the sharded table
+ * @param server     Set to the unique name of the shard with SHARD_TABLE_SERVER
+ * @param err        Set to the error message with SHARD_TABLE_ERROR
+ * @return How the query is routed
+ */
+shard_table_route_t shard_table_route(SHARD_TABLE_RULE* rules, GWBUF* query, const char* current_db,
+                                      SHARD_TABLE_RULE** rule, const char** server, const char** err)
+{
+    shard_table_route_t rval = SHARD_TABLE_NONE;
+
+    if ((*rule = shard_table_find(rules, query, current_db)) == NULL)
+    {
+        return SHARD_TABLE_NONE;
+    }
+
+    char* sql = modutil_get_SQL(query);
+
+    if (sql == NULL)
+    {
+        *err = "Out of memory";
+        return SHARD_TABLE_ERROR;
+    }
+
+    const char* end = sql + strlen(sql);
+    const char* start = sql_skip_space(sql, end);
+    int shard = -1;
+
+    *err = NULL;
+
+    if (sql_is_keyword(start, end, "INSERT") || sql_is_keyword(start, end, "REPLACE"))
+    {
+        find_insert_shard(*rule, start, end, &shard, err);
+    }
+    else
+    {
+        const char* value = NULL;
+        size_t len = 0;
+
+        if (find_where_key(*rule, start, end, &value, &len) &&
+            (shard = find_shard(*rule, value, len)) == -1)
+        {
+            *err = "No shard contains the value of the sharding key";
+        }
+    }
+
+    if (*err)
+    {
+        rval = SHARD_TABLE_ERROR;
+    }
+    else if (shard == -1)
+    {
+        rval = SHARD_TABLE_ALL;
+    }
+    else
+    {
+        *server = (*rule)->servers[shard];
+        rval = SHARD_TABLE_SERVER;
+    }
+
+    free(sql);
+    return rval;
+}
@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * Tests of the LIMIT parser and the aggregates of the result set merging
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+
+/** The parsers are static */
+#include "../shard_gather.c"
+
+#include <skygw_debug.h>
+
+/**
+ * Create the state of a query and check its LIMIT
+ *
+ * @param sql      The query
+ * @param offset   The expected offset
+ * @param limit    The expected limit, -2 if the query must be rejected
+ * @param expected The expected query to the shards or NULL if it is not rewritten
+ */
+static void check_limit(const char* sql, long offset, long limit, const char* expected)
+{
+    GWBUF* query = modutil_create_query((char*)sql);
+    GWBUF* shard_query = NULL;
+    const char* err = NULL;
+    SHARD_GATHER* gather = gather_create(query, 2, &shard_query, &err);
+
+    if (limit == -2)
+    {
+        ss_info_dassert(gather == NULL, "The query must be rejected");
+        gwbuf_free(query);
+        return;
+    }
+
+    ss_info_dassert(gather, "The query must be accepted");
+    ss_info_dassert(gather->offset == offset, "The offset must match");
+    ss_info_dassert(gather->limit == limit, "The limit must match");
+
+    if (expected == NULL)
+    {
+        ss_info_dassert(shard_query == NULL, "The query must not be rewritten");
+    }
+    else
+    {
+        char* rewritten = modutil_get_SQL(shard_query);
+        ss_info_dassert(rewritten && strcmp(rewritten, expected) == 0, "The rewritten query must match");
+        free(rewritten);
+    }
+
+    gwbuf_free(shard_query);
+    gwbuf_free(query);
+    gather_free(gather);
+}
+
+static void test_limit()
+{
+    ss_dfprintf(stderr, "testshardgather : parsing the LIMIT clause.");
+
+    check_limit("SELECT a FROM t LIMIT 10", 0, 10, NULL);
+    check_limit("SELECT a FROM t LIMIT 10 -- maxscale route to all", 0, 10, NULL);
+    check_limit("SELECT a FROM t LIMIT 10 # comment\n", 0, 10, NULL);
+    check_limit("SELECT a FROM t LIMIT /* first */ 10 /* last */", 0, 10, NULL);
+    check_limit("SELECT a FROM t LIMIT 5 /* x */ , 10 -- maxscale route to all",
+                5, 10, "SELECT a FROM t LIMIT 15 -- maxscale route to all");
+    check_limit("SELECT a FROM t LIMIT 10 OFFSET 5 FOR UPDATE", 5, 10, "SELECT a FROM t LIMIT 15 FOR UPDATE");
+    check_limit("SELECT a FROM t LIMIT x", 0, -2, NULL);
+    check_limit("SELECT a FROM t LIMIT 10, x", 0, -2, NULL);
+    check_limit("SELECT a FROM t LIMIT 10abc", 0, -2, NULL);
+
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+/**
+ * Add two decimal numbers and check the sum
+ *
+ * @param a        A decimal number
+ * @param b        A decimal number
+ * @param expected The sum or NULL if the numbers must be rejected
+ */
+static void check_decimal(const char* a, const char* b, const char* expected)
+{
+    char* sum = decimal_add(a, b);
+
+    if (expected == NULL)
+    {
+        ss_info_dassert(sum == NULL, "The numbers must be rejected");
+        return;
+    }
+
+    ss_info_dassert(sum && strcmp(sum, expected) == 0, "The sum must match");
+    free(sum);
+}
+
+static void test_decimal()
+{
+    ss_dfprintf(stderr, "testshardgather : adding decimal numbers.");
+
+    check_decimal("0", "0.10", "0.10");
+    check_decimal("0.10", "0.20", "0.30");
+    check_decimal("12345678901234567890.12", "0.991", "12345678901234567891.111");
+    check_decimal("99.99", "0.01", "100.00");
+    check_decimal("-1.50", "1.25", "-0.25");
+    check_decimal("1.25", "-1.25", "0.00");
+    check_decimal("-2.5", "-2.5", "-5.0");
+    check_decimal(".5", "+1", "1.5");
+    check_decimal("1e3", "1", NULL);
+    check_decimal("abc", "1", NULL);
+
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+/**
+ * Create a row packet of one value
+ *
+ * @param value The value
+ * @return The row
+ */
+static GWBUF* create_row(const char* value)
+{
+    size_t len = strlen(value);
+    GWBUF* row = gwbuf_alloc(len + 5);
+    uint8_t* data = GWBUF_DATA(row);
+
+    gw_mysql_set_byte3(data, len + 1);
+    data[3] = 1;
+    data[4] = len;
+    memcpy(data + 5, value, len);
+    return row;
+}
+
+/**
+ * Merge the sum of values and check it
+ *
+ * @param values   The values of the shards, terminated by NULL
+ * @param expected The merged sum
+ */
+static void check_sum(const char** values, const char* expected)
+{
+    SHARD_GATHER gather;
+    memset(&gather, 0, sizeof(gather));
+    gather.naggs = 1;
+    gather.aggs[0].func = GATHER_SUM;
+    gather.aggs[0].is_null = true;
+
+    for (int i = 0; values[i]; i++)
+    {
+        gather_aggregate(&gather, create_row(values[i]));
+    }
+
+    GWBUF* row = aggregate_row(&gather);
+    uint8_t* data = GWBUF_DATA(row);
+    ss_info_dassert(data[4] == strlen(expected) && memcmp(data + 5, expected, data[4]) == 0,
+                    "The sum must match");
+    gwbuf_free(row);
+    free(gather.aggs[0].decimal);
+}
+
+static void test_sum()
+{
+    ss_dfprintf(stderr, "testshardgather : merging sums.");
+
+    const char* integers[] = {"1", "2", "-5", NULL};
+    check_sum(integers, "-2");
+
+    const char* decimals[] = {"0.10", "0.20", "7", NULL};
+    check_sum(decimals, "7.30");
+
+    const char* precise[] = {"12345678901234567.89", "0.01", NULL};
+    check_sum(precise, "12345678901234567.90");
+
+    const char* large[] = {"9223372036854775807", "1", NULL};
+    check_sum(large, "9223372036854775808");
+
+    const char* doubles[] = {"1.5e1", "2", NULL};
+    check_sum(doubles, "17");
+
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+int main(int argc, char** argv)
+{
+    test_limit();
+    test_decimal();
+    test_sum();
+    return 0;
+}
@@ -0,0 +1,288 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * Tests of the rules and the key parser of the table sharding
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+
+/** The parser is static */
+#include "../shard_table.c"
+
+#include <skygw_debug.h>
+
+static SERVER test_servers[3] =
+{
+    {.unique_name = "server1"},
+    {.unique_name = "server2"},
+    {.unique_name = "server3"}
+};
+
+static BACKEND test_backends[3] =
+{
+    {.backend_server = &test_servers[0]},
+    {.backend_server = &test_servers[1]},
+    {.backend_server = &test_servers[2]}
+};
+
+static BACKEND* test_backend_list[] = {&test_backends[0], &test_backends[1], &test_backends[2], NULL};
+
+static int test_hash(void* key)
+{
+    return key_hash(key, strlen(key));
+}
+
+static int test_cmp(void* a, void* b)
+{
+    return strcmp(a, b);
+}
+
+/**
+ * Create one rule and initialise it with the test servers
+ *
+ * @param value The value of the shard_table option
+ * @return The rule or NULL if the option is invalid
+ */
+static SHARD_TABLE_RULE* create_rule(const char* value, HASHTABLE* ignored)
+{
+    SHARD_TABLE_RULE* rules = NULL;
+
+    if (!shard_table_add_rule(&rules, value, "test"))
+    {
+        return NULL;
+    }
+
+    if (!shard_table_init(rules, test_backend_list, ignored, "test"))
+    {
+        shard_table_free(rules);
+        return NULL;
+    }
+
+    return rules;
+}
+
+/**
+ * Find the key of a statement and check it
+ *
+ * @param rule     The rule of the table
+ * @param sql      The statement
+ * @param expected The key or NULL if the statement must not have one
+ */
+static void check_key(SHARD_TABLE_RULE* rule, const char* sql, const char* expected)
+{
+    const char* value = NULL;
+    size_t len = 0;
+    bool found = find_where_key(rule, sql, sql + strlen(sql), &value, &len);
+
+    if (expected == NULL)
+    {
+        ss_info_dassert(!found, "The statement must not have a key");
+        return;
+    }
+
+    ss_info_dassert(found, "The key must be found");
+    ss_info_dassert(len == strlen(expected) && memcmp(value, expected, len) == 0, "The key must match");
+}
+
+/**
+ * Find the shard of an INSERT and check it
+ *
+ * @param rule     The rule of the table
+ * @param sql      The statement
+ * @param expected The index of the server or -1 if the statement has no shard
+ * @param error    The statement has rows of several shards
+ */
+static void check_insert(SHARD_TABLE_RULE* rule, const char* sql, int expected, bool error)
+{
+    int shard = -1;
+    const char* err = NULL;
+    bool found = find_insert_shard(rule, sql, sql + strlen(sql), &shard, &err);
+
+    ss_info_dassert(found == (expected != -1), "The shard must be found only if it's expected");
+    ss_info_dassert(!found || shard == expected, "The shard must match");
+    ss_info_dassert((err != NULL) == error, "The error must match");
+}
+
+static void test_rules(HASHTABLE* ignored)
+{
+    ss_dfprintf(stderr, "testshardtable : parsing the rules.");
+
+    const char* invalid[] =
+    {
+        "orders:id:hash",
+        "shop.:id:hash",
+        "shop.orders:id",
+        "shop.orders:id:list",
+        "shop.orders:id:range",
+        "shop.orders:id:hash:server1<10",
+        "shop.orders:id:range:server1<10:server2<5",
+        "shop.orders:id:range:server1<x",
+        "shop.orders:id:range:server1:server2<10",
+        "shop.orders:id:hash:server4",
+        NULL
+    };
+
+    for (int i = 0; invalid[i]; i++)
+    {
+        ss_info_dassert(create_rule(invalid[i], ignored) == NULL, "An invalid rule must be rejected");
+    }
+
+    SHARD_TABLE_RULE* rule = create_rule("shop.orders:id:hash", ignored);
+    ss_info_dassert(rule && rule->nservers == 3, "A hash rule without servers must use all servers");
+    ss_info_dassert(rule->nnodes == 3 * SHARD_TABLE_VNODES, "The ring must have the points of all servers");
+    ss_info_dassert(hashtable_fetch(ignored, "shop"), "The database must not be mapped to one server");
+    ss_info_dassert(shard_table_has_server(rule, "server2"), "The rule must have the server");
+    shard_table_free(rule);
+
+    rule = create_rule("shop.items:id:hash:server2:server3", ignored);
+    ss_info_dassert(rule && rule->nservers == 2, "A hash rule must use the listed servers");
+    ss_info_dassert(!shard_table_has_server(rule, "server1"), "The rule must not have the server");
+    shard_table_free(rule);
+
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+static void test_find_shard(HASHTABLE* ignored)
+{
+    ss_dfprintf(stderr, "testshardtable : finding the shards of values.");
+
+    SHARD_TABLE_RULE* rule = create_rule("shop.orders:id:range:server1<10:server2<20.5:server3", ignored);
+    ss_info_dassert(rule, "The range rule must be valid");
+    ss_info_dassert(find_shard(rule, "-5", 2) == 0, "A value below the first bound is on the first server");
+    ss_info_dassert(find_shard(rule, "10", 2) == 1, "The bounds are exclusive");
+    ss_info_dassert(find_shard(rule, "20.4", 4) == 1, "A decimal value is compared to the bounds");
+    ss_info_dassert(find_shard(rule, "1e9", 3) == 2, "The last range has no bound");
+    ss_info_dassert(find_shard(rule, "abc", 3) == -1, "A string is in no range");
+    shard_table_free(rule);
+
+    rule = create_rule("shop.orders:id:range:server1<10:server2<20", ignored);
+    ss_info_dassert(find_shard(rule, "20", 2) == -1, "A value above the last bound is in no range");
+    shard_table_free(rule);
+
+    rule = create_rule("shop.orders:id:hash", ignored);
+    int counts[3] = {0};
+
+    for (int i = 0; i < 3000; i++)
+    {
+        char value[16];
+        int shard = find_shard(rule, value, snprintf(value, sizeof(value), "%d", i));
+        ss_info_dassert(shard >= 0 && shard < 3, "A value must hash to a server");
+        counts[shard]++;
+    }
+
+    for (int i = 0; i < 3; i++)
+    {
+        ss_info_dassert(counts[i] > 500, "The values must be spread over the servers");
+    }
+
+    ss_info_dassert(find_shard(rule, "007", 3) == find_shard(rule, "7", 1),
+                    "The same integer must hash the same way");
+    ss_info_dassert(find_shard(rule, "abc", 3) == find_shard(rule, "abc", 3), "A string must hash the same way");
+    shard_table_free(rule);
+
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+static void test_where_key(HASHTABLE* ignored)
+{
+    ss_dfprintf(stderr, "testshardtable : finding the keys of WHERE clauses.");
+
+    SHARD_TABLE_RULE* rule = create_rule("shop.orders:customer_id:hash", ignored);
+
+    check_key(rule, "SELECT * FROM orders WHERE customer_id = 5", "5");
+    check_key(rule, "SELECT * FROM orders WHERE customer_id=-5;", "-5");
+    check_key(rule, "SELECT * FROM orders WHERE orders.`customer_id` = '5'", "5");
+    check_key(rule, "SELECT * FROM orders WHERE a = 1 AND customer_id = 5 AND b = 2", "5");
+    check_key(rule, "SELECT * FROM orders WHERE a = 1 && customer_id = 5", "5");
+    check_key(rule, "SELECT * FROM orders WHERE customer_id = 5 ORDER BY a LIMIT 10", "5");
+    check_key(rule, "SELECT * FROM orders WHERE customer_id = 5 FOR UPDATE", "5");
+    check_key(rule, "UPDATE orders SET a = 1 WHERE customer_id = 5", "5");
+    check_key(rule, "DELETE FROM orders WHERE customer_id = 5", "5");
+    check_key(rule, "SELECT * FROM orders WHERE (a = 1 OR b = 2) AND customer_id = 5", "5");
+    check_key(rule, "SELECT * FROM orders WHERE a IS NOT NULL AND customer_id = 5", "5");
+    check_key(rule, "SELECT * FROM orders WHERE NOT a AND customer_id = 5", "5");
+    check_key(rule, "SELECT * FROM orders WHERE customer_id = 5 AND NOT a", "5");
+    check_key(rule, "SELECT * FROM orders WHERE a != 1 AND customer_id = 5", "5");
+    check_key(rule, "SELECT * FROM orders WHERE customer_id = 5 # comment", "5");
+
+    /** No key or a key that doesn't decide the rows */
+    check_key(rule, "SELECT * FROM orders", NULL);
+    check_key(rule, "SELECT * FROM orders WHERE customer_id > 5", NULL);
+    check_key(rule, "SELECT * FROM orders WHERE customer_id <=> 5", NULL);
+    check_key(rule, "SELECT * FROM orders WHERE customer_id = 5 OR a = 1", NULL);
+    check_key(rule, "SELECT * FROM orders WHERE a = 1 XOR customer_id = 5", NULL);
+    check_key(rule, "SELECT * FROM orders WHERE customer_id = 5 || a = 1", NULL);
+    check_key(rule, "SELECT * FROM orders WHERE NOT customer_id = 5", NULL);
+    check_key(rule, "SELECT * FROM orders WHERE a = 1 AND NOT customer_id = 5", NULL);
+    check_key(rule, "SELECT * FROM orders WHERE ! customer_id = 5", NULL);
+    check_key(rule, "SELECT * FROM orders WHERE NOT (customer_id = 5)", NULL);
+    check_key(rule, "SELECT * FROM orders WHERE customer_id = 5 + 1", NULL);
+    check_key(rule, "SELECT * FROM orders WHERE customer_id = 5 IS TRUE", NULL);
+    check_key(rule, "SELECT * FROM orders WHERE customer_id = a", NULL);
+    check_key(rule, "SELECT * FROM orders WHERE a IN (SELECT b FROM c WHERE customer_id = 5)", NULL);
+    check_key(rule, "SELECT * FROM orders WHERE a = 'customer_id = 5'", NULL);
+    check_key(rule, "SELECT * FROM orders WHERE customer_id = 5 UNION SELECT * FROM orders", NULL);
+    check_key(rule, "SELECT customer_id = 5 FROM orders", NULL);
+    check_key(rule, "SELECT * FROM orders ORDER BY customer_id = 5", NULL);
+
+    shard_table_free(rule);
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+static void test_insert_shard(HASHTABLE* ignored)
+{
+    ss_dfprintf(stderr, "testshardtable : finding the shards of inserted rows.");
+
+    SHARD_TABLE_RULE* rule = create_rule("shop.orders:customer_id:range:server1<10:server2<20", ignored);
+
+    check_insert(rule, "INSERT INTO orders (a, customer_id) VALUES (1, 5)", 0, false);
+    check_insert(rule, "INSERT INTO orders(`customer_id`,a) VALUE ('15', 'x')", 1, false);
+    check_insert(rule, "REPLACE INTO shop.orders (customer_id) VALUES (1), (2), (9)", 0, false);
+    check_insert(rule, "INSERT INTO orders (a, customer_id) VALUES (f(1, 2), 12), ('a,)', 13)", 1, false);
+
+    /** The rows are on several shards or on none */
+    check_insert(rule, "INSERT INTO orders (customer_id) VALUES (1), (15)", -1, true);
+    check_insert(rule, "INSERT INTO orders (customer_id) VALUES (25)", -1, true);
+
+    /** The key is not a constant or the columns are not listed */
+    check_insert(rule, "INSERT INTO orders (customer_id) VALUES (1 + 1)", -1, false);
+    check_insert(rule, "INSERT INTO orders (a) VALUES (1)", -1, false);
+    check_insert(rule, "INSERT INTO orders VALUES (1)", -1, false);
+    check_insert(rule, "INSERT INTO orders SET customer_id = 1", -1, false);
+    check_insert(rule, "INSERT INTO orders (customer_id) SELECT 1", -1, false);
+
+    shard_table_free(rule);
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+int main(int argc, char** argv)
+{
+    HASHTABLE* ignored = hashtable_alloc(16, test_hash, test_cmp);
+    ss_info_dassert(ignored, "The hashtable must be allocated");
+    hashtable_memory_fns(ignored, (HASHMEMORYFN)strdup, NULL, (HASHMEMORYFN)free, NULL);
+
+    test_rules(ignored);
+    test_find_shard(ignored);
+    test_where_key(ignored);
+    test_insert_shard(ignored);
+
+    hashtable_free(ignored);
+    return 0;
+}
@@ -454,9 +454,9 @@ DCB	*dcb = session->session->client_dcb;
 static void
 service_row(SERVICE *service, DCB *dcb)
 {
-	dcb_printf(dcb, "<TR><TD>%s</TD><TD>%s</TD><TD>%d</TD><TD>%d</TD></TR>\n",
+	dcb_printf(dcb, "<TR><TD>%s</TD><TD>%s</TD><TD>%d</TD><TD>%" PRId64 "</TD></TR>\n",
 		service->name, service->routerModule,
-		service->stats.n_current, service->stats.n_sessions);
+		service->stats.n_current, ts_stats_sum(service->stats.n_sessions));
 }
 
 /**
@@ -0,0 +1,1165 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file proxybench.c End-to-end benchmark of MaxScale with a synthetic backend
+ *
+ * The program has two parts that can be run separately or together:
+ *
+ * - A fake MySQL backend that listens on one or more ports. It accepts any
+ *   credentials, answers the queries MaxScale uses to load the users with a
+ *   single user 'bench' that has an empty password and answers every other
+ *   query with an OK packet or a resultset of a configurable size, optionally
+ *   after a delay.
+ *
+ * - A load generator that opens a number of client connections to MaxScale as
+ *   the user 'bench', keeps a number of queries in flight on each connection
+ *   and reports the number of queries per second, the latency percentiles and,
+ *   if the process id of MaxScale is given, the CPU time MaxScale used per
+ *   query.
+ *
+ * Each connection on both sides is handled by its own thread with blocking
+ * I/O so that the program itself adds as little latency as possible. See
+ * proxybench.sh for how MaxScale is started between the two parts.
+ *
+ * @verbatim
+ * Run the backends:     proxybench -b 4500,4501 [-r rows] [-c columns] [-w width] [-D delay]
+ * Run the load:         proxybench -P port [-H host] [-n connections] [-d depth] [-t seconds]
+ *                                  [-W warmup] [-q query] [-p pid] [-l label]
+ * @endverbatim
+ */
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MYSQL_HEADER_LEN    4
+#define MAX_BACKENDS        16
+#define BENCH_USER          "bench"
+
+#define COM_QUIT            0x01
+#define COM_QUERY           0x03
+
+/** Client capabilities sent by the load generator */
+#define BENCH_CLIENT_CAPS   (0x00000001 | /* CLIENT_LONG_PASSWORD */ \
+                             0x00000004 | /* CLIENT_LONG_FLAG */ \
+                             0x00000200 | /* CLIENT_PROTOCOL_41 */ \
+                             0x00002000 | /* CLIENT_TRANSACTIONS */ \
+                             0x00008000 | /* CLIENT_SECURE_CONNECTION */ \
+                             0x00020000)  /* CLIENT_MULTI_RESULTS */
+
+/** Server capabilities sent by the fake backend */
+#define BENCH_SERVER_CAPS   (BENCH_CLIENT_CAPS | 0x00000008 /* CLIENT_CONNECT_WITH_DB */ | \
+                             0x00080000 /* CLIENT_PLUGIN_AUTH */)
+
+/**
+ * Latencies are stored in a histogram with 64 buckets for each power of two
+ * above 128 microseconds, which gives a precision of about 1.5%.
+ */
+#define HIST_SUB_BITS       6
+#define HIST_SUB_COUNT      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS        ((32 - HIST_SUB_BITS) * HIST_SUB_COUNT + 2 * HIST_SUB_COUNT)
+
+/** A growable buffer */
+typedef struct
+{
+    uint8_t *data;
+    size_t   len;
+    size_t   size;
+} BUFFER;
+
+/** A buffered reader of MySQL packets */
+typedef struct
+{
+    int      fd;
+    uint8_t  buf[65536];
+    size_t   start;
+    size_t   end;
+    BUFFER   packet;    /*< The payload of the last packet read */
+    uint8_t  seq;       /*< The sequence number of the last packet read */
+} READER;
+
+/** The configuration of the fake backend */
+static struct
+{
+    int      ports[MAX_BACKENDS];
+    int      n_ports;
+    int      rows;      /*< Rows in a resultset, 0 for an OK packet */
+    int      columns;   /*< Columns in a resultset */
+    int      width;     /*< Bytes in each value */
+    int      delay;     /*< Microseconds before each response */
+    BUFFER   response;  /*< The prebuilt response to a benchmark query */
+} backend = {{0}, 0, 1, 1, 16, 0, {NULL, 0, 0}};
+
+/** The configuration and the results of the load generator */
+static struct
+{
+    const char *host;
+    int         port;
+    int         connections;
+    int         depth;      /*< Queries in flight on each connection */
+    int         duration;   /*< Seconds the load is measured */
+    int         warmup;     /*< Seconds of load before the measurement */
+    const char *query;
+    pid_t       pid;        /*< MaxScale process for the CPU time, 0 if not known */
+    const char *label;
+    BUFFER      packet;     /*< The COM_QUERY packet */
+} load = {"127.0.0.1", 0, 16, 1, 10, 2, "SELECT 1", 0, NULL, {NULL, 0, 0}};
+
+static volatile int measuring = 0;  /*< Latencies are recorded */
+static volatile int stopping = 0;   /*< The clients send no more queries */
+
+/** The state of one client connection of the load generator */
+typedef struct
+{
+    pthread_t     thread;
+    int           id;
+    uint64_t      queries;      /*< Queries completed while measuring */
+    uint64_t      errors;       /*< Error responses while measuring */
+    bool          failed;       /*< The connection failed */
+    uint32_t      hist[HIST_BUCKETS];
+} CLIENT;
+
+static uint64_t
+now_usecs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+buffer_reserve(BUFFER *buf, size_t len)
+{
+    if (buf->len + len > buf->size)
+    {
+        size_t size = buf->size ? buf->size : 256;
+
+        while (size < buf->len + len)
+        {
+            size *= 2;
+        }
+
+        if ((buf->data = realloc(buf->data, size)) == NULL)
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        buf->size = size;
+    }
+}
+
+static void
+buffer_add(BUFFER *buf, const void *data, size_t len)
+{
+    buffer_reserve(buf, len);
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+static void
+buffer_add_byte(BUFFER *buf, uint8_t byte)
+{
+    buffer_add(buf, &byte, 1);
+}
+
+static void
+buffer_add_int(BUFFER *buf, uint32_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+    {
+        buffer_add_byte(buf, (value >> (8 * i)) & 0xff);
+    }
+}
+
+/** Add a length-encoded string, NULL is encoded as the NULL value */
+static void
+buffer_add_lenenc(BUFFER *buf, const char *str, size_t len)
+{
+    if (str == NULL)
+    {
+        buffer_add_byte(buf, 0xfb);
+        return;
+    }
+
+    if (len < 251)
+    {
+        buffer_add_byte(buf, len);
+    }
+    else if (len < 0x10000)
+    {
+        buffer_add_byte(buf, 0xfc);
+        buffer_add_int(buf, len, 2);
+    }
+    else
+    {
+        buffer_add_byte(buf, 0xfd);
+        buffer_add_int(buf, len, 3);
+    }
+    buffer_add(buf, str, len);
+}
+
+/**
+ * Start a packet, the length is filled in by packet_end
+ *
+ * @return The offset of the packet in the buffer
+ */
+static size_t
+packet_start(BUFFER *buf, uint8_t seq)
+{
+    size_t offset = buf->len;
+    uint8_t header[MYSQL_HEADER_LEN] = {0, 0, 0, seq};
+    buffer_add(buf, header, sizeof(header));
+    return offset;
+}
+
+static void
+packet_end(BUFFER *buf, size_t offset)
+{
+    size_t len = buf->len - offset - MYSQL_HEADER_LEN;
+    buf->data[offset] = len & 0xff;
+    buf->data[offset + 1] = (len >> 8) & 0xff;
+    buf->data[offset + 2] = (len >> 16) & 0xff;
+}
+
+static bool
+write_all(int fd, const uint8_t *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, data, len);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+
+        data += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+static bool
+reader_fill(READER *rd)
+{
+    if (rd->start == rd->end)
+    {
+        rd->start = rd->end = 0;
+    }
+    else if (rd->start > 0)
+    {
+        memmove(rd->buf, rd->buf + rd->start, rd->end - rd->start);
+        rd->end -= rd->start;
+        rd->start = 0;
+    }
+
+    ssize_t n;
+
+    do
+    {
+        n = read(rd->fd, rd->buf + rd->end, sizeof(rd->buf) - rd->end);
+    }
+    while (n < 0 && errno == EINTR);
+
+    if (n <= 0)
+    {
+        return false;
+    }
+
+    rd->end += n;
+    return true;
+}
+
+/**
+ * Read one packet into rd->packet
+ *
+ * @return True if a packet was read, false if the connection was closed
+ */
+static bool
+read_packet(READER *rd)
+{
+    while (rd->end - rd->start < MYSQL_HEADER_LEN)
+    {
+        if (!reader_fill(rd))
+        {
+            return false;
+        }
+    }
+
+    uint8_t *hdr = rd->buf + rd->start;
+    size_t len = hdr[0] | (hdr[1] << 8) | (hdr[2] << 16);
+    rd->seq = hdr[3];
+    rd->start += MYSQL_HEADER_LEN;
+    rd->packet.len = 0;
+    buffer_reserve(&rd->packet, len + 1);
+
+    while (rd->packet.len < len)
+    {
+        if (rd->start == rd->end && !reader_fill(rd))
+        {
+            return false;
+        }
+
+        size_t n = rd->end - rd->start;
+
+        if (n > len - rd->packet.len)
+        {
+            n = len - rd->packet.len;
+        }
+
+        memcpy(rd->packet.data + rd->packet.len, rd->buf + rd->start, n);
+        rd->packet.len += n;
+        rd->start += n;
+    }
+
+    /** Null terminated so that a query can be searched as a string */
+    rd->packet.data[len] = '\0';
+    return true;
+}
+
+/*
+ * The fake backend
+ */
+
+static void
+add_ok(BUFFER *buf, uint8_t seq)
+{
+    size_t pkt = packet_start(buf, seq);
+    /** OK, no affected rows, no insert id, autocommit, no warnings */
+    const uint8_t ok[] = {0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00};
+    buffer_add(buf, ok, sizeof(ok));
+    packet_end(buf, pkt);
+}
+
+static void
+add_eof(BUFFER *buf, uint8_t seq)
+{
+    size_t pkt = packet_start(buf, seq);
+    const uint8_t eof[] = {0xfe, 0x00, 0x00, 0x02, 0x00};
+    buffer_add(buf, eof, sizeof(eof));
+    packet_end(buf, pkt);
+}
+
+static void
+add_error(BUFFER *buf, uint8_t seq, const char *message)
+{
+    size_t pkt = packet_start(buf, seq);
+    buffer_add_byte(buf, 0xff);
+    buffer_add_int(buf, 1064, 2);
+    buffer_add(buf, "#42000", 6);
+    buffer_add(buf, message, strlen(message));
+    packet_end(buf, pkt);
+}
+
+/**
+ * Add a text protocol resultset
+ *
+ * @param buf       Where the resultset is added
+ * @param names     The column names
+ * @param n_cols    Number of columns
+ * @param values    The values, n_rows * n_cols of them, NULL for a NULL value
+ * @param widths    If not NULL, the lengths of the values
+ * @param n_rows    Number of rows
+ */
+static void
+add_resultset(BUFFER *buf, const char **names, int n_cols, const char **values,
+              const size_t *widths, int n_rows)
+{
+    uint8_t seq = 1;
+    size_t pkt = packet_start(buf, seq++);
+    buffer_add_byte(buf, n_cols);
+    packet_end(buf, pkt);
+
+    for (int i = 0; i < n_cols; i++)
+    {
+        pkt = packet_start(buf, seq++);
+        buffer_add_lenenc(buf, "def", 3);
+        buffer_add_lenenc(buf, "", 0);
+        buffer_add_lenenc(buf, "", 0);
+        buffer_add_lenenc(buf, "", 0);
+        buffer_add_lenenc(buf, names[i], strlen(names[i]));
+        buffer_add_lenenc(buf, names[i], strlen(names[i]));
+        buffer_add_byte(buf, 0x0c);
+        buffer_add_int(buf, 33, 2);         /*< utf8_general_ci */
+        buffer_add_int(buf, 1024, 4);       /*< Column length */
+        buffer_add_byte(buf, 0xfd);         /*< MYSQL_TYPE_VAR_STRING */
+        buffer_add_int(buf, 0, 2);          /*< Flags */
+        buffer_add_byte(buf, 0);            /*< Decimals */
+        buffer_add_int(buf, 0, 2);
+        packet_end(buf, pkt);
+    }
+
+    add_eof(buf, seq++);
+
+    for (int r = 0; r < n_rows; r++)
+    {
+        pkt = packet_start(buf, seq++);
+        for (int c = 0; c < n_cols; c++)
+        {
+            const char *value = values[r * n_cols + c];
+            buffer_add_lenenc(buf, value, widths ? widths[c] : (value ? strlen(value) : 0));
+        }
+        packet_end(buf, pkt);
+    }
+
+    add_eof(buf, seq);
+}
+
+/** Build the response to the benchmark queries */
+static void
+backend_build_response()
+{
+    if (backend.rows == 0)
+    {
+        add_ok(&backend.response, 1);
+        return;
+    }
+
+    const char **names = calloc(backend.columns, sizeof(char*));
+    size_t *widths = calloc(backend.columns, sizeof(size_t));
+    const char **values = calloc((size_t)backend.columns * backend.rows, sizeof(char*));
+    char *value = malloc(backend.width + 1);
+
+    if (names == NULL || widths == NULL || values == NULL || value == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    memset(value, 'x', backend.width);
+    value[backend.width] = '\0';
+
+    for (int c = 0; c < backend.columns; c++)
+    {
+        names[c] = "c";
+        widths[c] = backend.width;
+    }
+
+    for (int i = 0; i < backend.columns * backend.rows; i++)
+    {
+        values[i] = value;
+    }
+
+    add_resultset(&backend.response, names, backend.columns, values, widths, backend.rows);
+
+    free(names);
+    free(widths);
+    free(values);
+    free(value);
+}
+
+/**
+ * Answer the queries MaxScale uses to load the users of a service so that
+ * the user 'bench' with an empty password can log in
+ *
+ * @param out   Where the response is added
+ * @param sql   The query
+ * @return True if this was one of the queries
+ */
+static bool
+backend_answer_internal(BUFFER *out, const char *sql)
+{
+    if (strstr(sql, "INFORMATION_SCHEMA"))
+    {
+        const char *names[] = {"ndbs"};
+        const char *values[] = {"0"};
+        add_resultset(out, names, 1, values, NULL, 1);
+    }
+    else if (strstr(sql, "COUNT(1)"))
+    {
+        const char *names[] = {"nusers"};
+        const char *values[] = {"1"};
+        add_resultset(out, names, 1, values, NULL, 1);
+    }
+    else if (strstr(sql, "mysql.user"))
+    {
+        const char *names[] = {"user", "host", "password", "userdata", "anydb", "db"};
+        const char *values[] = {BENCH_USER, "%", "", BENCH_USER "%Y", "Y", NULL};
+        add_resultset(out, names, 6, values, NULL, 1);
+    }
+    else if (strncasecmp(sql, "SHOW ", 5) == 0)
+    {
+        add_error(out, 1, "Not supported by the benchmark backend");
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+static void
+backend_handshake(BUFFER *out, uint32_t conn_id)
+{
+    const char *version = "5.5.5-10.0.0-proxybench";
+    const char scramble[] = "abcdefghijklmnopqrst";
+    size_t pkt = packet_start(out, 0);
+
+    buffer_add_byte(out, 10);
+    buffer_add(out, version, strlen(version) + 1);
+    buffer_add_int(out, conn_id, 4);
+    buffer_add(out, scramble, 8);
+    buffer_add_byte(out, 0);
+    buffer_add_int(out, BENCH_SERVER_CAPS & 0xffff, 2);
+    buffer_add_byte(out, 8);                /*< latin1_swedish_ci */
+    buffer_add_int(out, 0x0002, 2);         /*< SERVER_STATUS_AUTOCOMMIT */
+    buffer_add_int(out, BENCH_SERVER_CAPS >> 16, 2);
+    buffer_add_byte(out, 21);
+    for (int i = 0; i < 10; i++)
+    {
+        buffer_add_byte(out, 0);
+    }
+    buffer_add(out, scramble + 8, 13);
+    buffer_add(out, "mysql_native_password", 22);
+    packet_end(out, pkt);
+}
+
+/** Handle one connection to the fake backend */
+static void *
+backend_session(void *arg)
+{
+    static uint32_t next_id = 1;
+    int fd = (int)(intptr_t)arg;
+    READER *rd = calloc(1, sizeof(READER));
+    BUFFER out = {NULL, 0, 0};
+
+    if (rd == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    rd->fd = fd;
+    backend_handshake(&out, __sync_fetch_and_add(&next_id, 1));
+
+    /** The credentials in the handshake response are not checked */
+    if (!write_all(fd, out.data, out.len) || !read_packet(rd))
+    {
+        goto done;
+    }
+
+    out.len = 0;
+    add_ok(&out, rd->seq + 1);
+
+    if (!write_all(fd, out.data, out.len))
+    {
+        goto done;
+    }
+
+    while (read_packet(rd) && rd->packet.len > 0)
+    {
+        uint8_t cmd = rd->packet.data[0];
+        const char *sql = (const char*)rd->packet.data + 1;
+        const uint8_t *data;
+        size_t len;
+
+        out.len = 0;
+
+        if (cmd == COM_QUIT)
+        {
+            break;
+        }
+        else if (cmd != COM_QUERY)
+        {
+            add_ok(&out, 1);
+        }
+        else if (!backend_answer_internal(&out, sql))
+        {
+            if (backend.delay > 0)
+            {
+                usleep(backend.delay);
+            }
+
+            data = backend.response.data;
+            len = backend.response.len;
+
+            if (!write_all(fd, data, len))
+            {
+                break;
+            }
+            continue;
+        }
+
+        if (!write_all(fd, out.data, out.len))
+        {
+            break;
+        }
+    }
+
+done:
+    close(fd);
+    free(rd->packet.data);
+    free(rd);
+    free(out.data);
+    return NULL;
+}
+
+static int
+listen_on(int port)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    if (fd < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+        bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(fd, 1024) != 0)
+    {
+        fprintf(stderr, "Failed to listen on port %d: %s\n", port, strerror(errno));
+        exit(1);
+    }
+
+    return fd;
+}
+
+/** Accept the connections of one backend port */
+static void *
+backend_listener(void *arg)
+{
+    int listener = (int)(intptr_t)arg;
+
+    while (true)
+    {
+        int fd = accept(listener, NULL, NULL);
+
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            fprintf(stderr, "Failed to accept a connection: %s\n", strerror(errno));
+            break;
+        }
+
+        int one = 1;
+        pthread_t thr;
+        pthread_attr_t attr;
+
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+        if (pthread_create(&thr, &attr, backend_session, (void*)(intptr_t)fd) != 0)
+        {
+            close(fd);
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    return NULL;
+}
+
+static void
+backend_start()
+{
+    backend_build_response();
+
+    for (int i = 0; i < backend.n_ports; i++)
+    {
+        pthread_t thr;
+        int fd = listen_on(backend.ports[i]);
+
+        if (pthread_create(&thr, NULL, backend_listener, (void*)(intptr_t)fd) != 0)
+        {
+            fprintf(stderr, "Failed to start a backend thread\n");
+            exit(1);
+        }
+        pthread_detach(thr);
+    }
+
+    fprintf(stderr, "Backends listening on %d port(s), %d rows of %d columns of %d bytes, "
+            "%d us delay\n", backend.n_ports, backend.rows, backend.columns,
+            backend.width, backend.delay);
+}
+
+/*
+ * The load generator
+ */
+
+static int
+hist_bucket(uint64_t usecs)
+{
+    if (usecs < 2 * HIST_SUB_COUNT)
+    {
+        return usecs;
+    }
+
+    if (usecs > UINT32_MAX)
+    {
+        usecs = UINT32_MAX;
+    }
+
+    int shift = 63 - __builtin_clzll(usecs) - HIST_SUB_BITS;
+    return shift * HIST_SUB_COUNT + (usecs >> shift);
+}
+
+/** The middle of the values in a bucket */
+static double
+hist_value(int bucket)
+{
+    if (bucket < 2 * HIST_SUB_COUNT)
+    {
+        return bucket;
+    }
+
+    int shift = bucket / HIST_SUB_COUNT - 1;
+    uint64_t low = (uint64_t)(bucket - shift * HIST_SUB_COUNT) << shift;
+    return low + ((1ULL << shift) - 1) / 2.0;
+}
+
+static double
+hist_percentile(const uint64_t *hist, uint64_t total, double pct)
+{
+    uint64_t rank = total * pct / 100.0;
+    uint64_t seen = 0;
+
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += hist[i];
+
+        if (seen > rank)
+        {
+            return hist_value(i);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Read the response to one query
+ *
+ * @return 0 for a successful response, 1 for an error and -1 if the
+ *         connection was closed
+ */
+static int
+read_response(READER *rd)
+{
+    if (!read_packet(rd))
+    {
+        return -1;
+    }
+
+    uint8_t first = rd->packet.data[0];
+
+    if (first == 0x00 || (first == 0xfe && rd->packet.len < 9))
+    {
+        return 0;
+    }
+    else if (first == 0xff)
+    {
+        return 1;
+    }
+
+    /** A resultset: the column definitions and the rows each end with an EOF */
+    for (int eofs = 0; eofs < 2;)
+    {
+        if (!read_packet(rd))
+        {
+            return -1;
+        }
+
+        if (rd->packet.data[0] == 0xfe && rd->packet.len < 9)
+        {
+            eofs++;
+        }
+    }
+
+    return 0;
+}
+
+static int
+client_connect(READER *rd)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(load.port);
+
+    if (fd < 0 || inet_pton(AF_INET, load.host, &addr.sin_addr) != 1 ||
+        connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+        fprintf(stderr, "Failed to connect to %s:%d: %s\n", load.host, load.port, strerror(errno));
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    rd->fd = fd;
+
+    if (!read_packet(rd) || rd->packet.data[0] != 10)
+    {
+        fprintf(stderr, "Failed to read the handshake from %s:%d\n", load.host, load.port);
+        close(fd);
+        return -1;
+    }
+
+    BUFFER out = {NULL, 0, 0};
+    size_t pkt = packet_start(&out, rd->seq + 1);
+    buffer_add_int(&out, BENCH_CLIENT_CAPS, 4);
+    buffer_add_int(&out, 16 * 1024 * 1024, 4);
+    buffer_add_byte(&out, 8);
+    for (int i = 0; i < 23; i++)
+    {
+        buffer_add_byte(&out, 0);
+    }
+    buffer_add(&out, BENCH_USER, strlen(BENCH_USER) + 1);
+    buffer_add_byte(&out, 0);       /*< Empty password */
+    packet_end(&out, pkt);
+
+    bool ok = write_all(fd, out.data, out.len) && read_packet(rd) && rd->packet.data[0] == 0x00;
+    free(out.data);
+
+    if (!ok)
+    {
+        fprintf(stderr, "Failed to log in to %s:%d as '%s'\n", load.host, load.port, BENCH_USER);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/** Drive one client connection */
+static void *
+client_main(void *arg)
+{
+    CLIENT *client = arg;
+    READER *rd = calloc(1, sizeof(READER));
+    uint64_t *sent = calloc(load.depth, sizeof(uint64_t));
+    int head = 0;
+    int in_flight = 0;
+    int fd;
+
+    if (rd == NULL || sent == NULL || (fd = client_connect(rd)) < 0)
+    {
+        client->failed = true;
+        free(sent);
+        free(rd);
+        return NULL;
+    }
+
+    while (true)
+    {
+        while (!stopping && in_flight < load.depth)
+        {
+            sent[(head + in_flight) % load.depth] = now_usecs();
+
+            if (!write_all(fd, load.packet.data, load.packet.len))
+            {
+                client->failed = true;
+                goto done;
+            }
+            in_flight++;
+        }
+
+        if (in_flight == 0)
+        {
+            break;
+        }
+
+        int rc = read_response(rd);
+
+        if (rc < 0)
+        {
+            client->failed = true;
+            break;
+        }
+
+        uint64_t latency = now_usecs() - sent[head];
+        head = (head + 1) % load.depth;
+        in_flight--;
+
+        if (measuring)
+        {
+            client->queries++;
+            client->errors += rc;
+            client->hist[hist_bucket(latency)]++;
+        }
+    }
+
+    {
+        const uint8_t quit[] = {1, 0, 0, 0, COM_QUIT};
+        write_all(fd, quit, sizeof(quit));
+    }
+
+done:
+    close(fd);
+    free(sent);
+    free(rd->packet.data);
+    free(rd);
+    return NULL;
+}
+
+/**
+ * Read the CPU time a process has used
+ *
+ * @param pid   The process
+ * @return The CPU time in seconds, negative if it could not be read
+ */
+static double
+process_cpu(pid_t pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *file = fopen(path, "r");
+    unsigned long utime, stime;
+    int n = 0;
+
+    if (file)
+    {
+        /** The fields after the command name, which can contain spaces */
+        char line[1024];
+
+        if (fgets(line, sizeof(line), file))
+        {
+            char *ptr = strrchr(line, ')');
+
+            n = ptr ? sscanf(ptr + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                             &utime, &stime) : 0;
+        }
+        fclose(file);
+    }
+
+    return n == 2 ? (double)(utime + stime) / sysconf(_SC_CLK_TCK) : -1;
+}
+
+static int
+load_run()
+{
+    CLIENT *clients = calloc(load.connections, sizeof(CLIENT));
+    uint64_t *hist = calloc(HIST_BUCKETS, sizeof(uint64_t));
+    size_t pkt = packet_start(&load.packet, 0);
+
+    buffer_add_byte(&load.packet, COM_QUERY);
+    buffer_add(&load.packet, load.query, strlen(load.query));
+    packet_end(&load.packet, pkt);
+
+    if (clients == NULL || hist == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    for (int i = 0; i < load.connections; i++)
+    {
+        clients[i].id = i;
+        if (pthread_create(&clients[i].thread, NULL, client_main, &clients[i]) != 0)
+        {
+            fprintf(stderr, "Failed to start client thread %d\n", i);
+            return 1;
+        }
+    }
+
+    sleep(load.warmup);
+
+    double cpu_start = load.pid ? process_cpu(load.pid) : -1;
+    uint64_t start = now_usecs();
+    measuring = 1;
+
+    sleep(load.duration);
+
+    measuring = 0;
+    uint64_t end = now_usecs();
+    double cpu_end = load.pid ? process_cpu(load.pid) : -1;
+    stopping = 1;
+
+    uint64_t queries = 0, errors = 0;
+    int failed = 0;
+
+    for (int i = 0; i < load.connections; i++)
+    {
+        pthread_join(clients[i].thread, NULL);
+        queries += clients[i].queries;
+        errors += clients[i].errors;
+        failed += clients[i].failed;
+
+        for (int b = 0; b < HIST_BUCKETS; b++)
+        {
+            hist[b] += clients[i].hist[b];
+        }
+    }
+
+    double seconds = (end - start) / 1000000.0;
+
+    printf("%s%s%d connections, depth %d: %.0f QPS, p50 %.0f us, p99 %.0f us, p99.9 %.0f us",
+           load.label ? load.label : "", load.label ? ": " : "",
+           load.connections, load.depth, queries / seconds,
+           hist_percentile(hist, queries, 50), hist_percentile(hist, queries, 99),
+           hist_percentile(hist, queries, 99.9));
+
+    if (cpu_start >= 0 && cpu_end >= 0 && queries > 0)
+    {
+        printf(", %.1f us CPU/query", (cpu_end - cpu_start) * 1000000.0 / queries);
+    }
+
+    printf(", %lu errors", (unsigned long)errors);
+
+    if (failed)
+    {
+        printf(", %d failed connections", failed);
+    }
+    printf("\n");
+
+    free(clients);
+    free(hist);
+    free(load.packet.data);
+
+    return failed || queries == 0 ? 1 : 0;
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [backend options] [load options]\n"
+            "\n"
+            "Backend options:\n"
+            "  -b PORT[,PORT...]  Run fake backends on the ports of the loopback interface\n"
+            "  -r ROWS            Rows in the resultset of a query, 0 for an OK packet (default 1)\n"
+            "  -c COLUMNS         Columns in the resultset (default 1)\n"
+            "  -w WIDTH           Bytes in each value of the resultset (default 16)\n"
+            "  -D USECS           Delay before each response (default 0)\n"
+            "\n"
+            "Load options:\n"
+            "  -P PORT            Port of the MaxScale listener\n"
+            "  -H HOST            Address of MaxScale (default 127.0.0.1)\n"
+            "  -n CONNECTIONS     Client connections (default 16)\n"
+            "  -d DEPTH           Queries in flight on each connection (default 1)\n"
+            "  -t SECONDS         Duration of the measurement (default 10)\n"
+            "  -W SECONDS         Load before the measurement starts (default 2)\n"
+            "  -q QUERY           The query to send (default 'SELECT 1')\n"
+            "  -p PID             Process id of MaxScale, for the CPU time per query\n"
+            "  -l LABEL           Label of the results\n"
+            "\n"
+            "Without load options the backends run until the process is killed.\n",
+            name);
+}
+
+int
+main(int argc, char **argv)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:r:c:w:D:P:H:n:d:t:W:q:p:l:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            for (char *tok = strtok(optarg, ","); tok && backend.n_ports < MAX_BACKENDS;
+                 tok = strtok(NULL, ","))
+            {
+                backend.ports[backend.n_ports++] = atoi(tok);
+            }
+            break;
+        case 'r':
+            backend.rows = atoi(optarg);
+            break;
+        case 'c':
+            backend.columns = atoi(optarg);
+            break;
+        case 'w':
+            backend.width = atoi(optarg);
+            break;
+        case 'D':
+            backend.delay = atoi(optarg);
+            break;
+        case 'P':
+            load.port = atoi(optarg);
+            break;
+        case 'H':
+            load.host = optarg;
+            break;
+        case 'n':
+            load.connections = atoi(optarg);
+            break;
+        case 'd':
+            load.depth = atoi(optarg);
+            break;
+        case 't':
+            load.duration = atoi(optarg);
+            break;
+        case 'W':
+            load.warmup = atoi(optarg);
+            break;
+        case 'q':
+            load.query = optarg;
+            break;
+        case 'p':
+            load.pid = atoi(optarg);
+            break;
+        case 'l':
+            load.label = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if ((backend.n_ports == 0 && load.port == 0) || backend.columns < 1 || backend.columns > 250 ||
+        backend.rows < 0 || backend.width < 0 || load.connections < 1 || load.depth < 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (backend.n_ports > 0)
+    {
+        backend_start();
+    }
+
+    if (load.port == 0)
+    {
+        while (true)
+        {
+            pause();
+        }
+    }
+
+    return load_run();
+}
@@ -0,0 +1,82 @@
+#!/bin/bash
+#
+# Run the end-to-end proxy benchmark against an installed MaxScale
+#
+# Usage: proxybench.sh <build directory>
+#
+# The fake backends of proxybench are started first so that MaxScale can load
+# the users from them. As there is no monitor, the server states are set with
+# maxadmin. The load is then run against the readconnroute and readwritesplit
+# listeners of proxybench.cnf with each combination of the client connection
+# counts and pipelining depths.
+#
+# The runs can be changed with the following environment variables:
+#
+#   CONNECTIONS   Client connection counts, default "1 16 64"
+#   DEPTHS        Queries in flight on each connection, default "1 8"
+#   DURATION      Seconds each run is measured, default 10
+#   ROWS          Rows in the response of a query, 0 for an OK packet, default 1
+#   COLUMNS       Columns in the response, default 1
+#   WIDTH         Bytes in each value of the response, default 16
+#   DELAY         Microseconds the backends wait before responding, default 0
+
+builddir=$1
+
+if [ -z "$builddir" ]
+then
+    echo "Usage: $0 <build directory>"
+    exit 1
+fi
+
+bench=$builddir/server/test/proxybench
+maxadmin="$builddir/bin/maxadmin -h 127.0.0.1 -P 4019 -u admin -p mariadb"
+
+CONNECTIONS=${CONNECTIONS:-"1 16 64"}
+DEPTHS=${DEPTHS:-"1 8"}
+DURATION=${DURATION:-10}
+
+cleanup()
+{
+    [ -n "$maxscale_pid" ] && kill $maxscale_pid 2> /dev/null
+    [ -n "$backend_pid" ] && kill $backend_pid 2> /dev/null
+    wait 2> /dev/null
+}
+
+trap cleanup EXIT
+
+mkdir -p $builddir/proxybench
+
+$bench -b 4500,4501 -r ${ROWS:-1} -c ${COLUMNS:-1} -w ${WIDTH:-16} -D ${DELAY:-0} &
+backend_pid=$!
+sleep 1
+
+$builddir/bin/maxscale -d -f $builddir/proxybench.cnf &> $builddir/proxybench/maxscale.out &
+maxscale_pid=$!
+
+for i in $(seq 30)
+do
+    $maxadmin list servers &> /dev/null && break
+    sleep 1
+done
+
+if ! $maxadmin set server bench1 master || ! $maxadmin set server bench2 slave
+then
+    echo "MaxScale did not start, see $builddir/proxybench/"
+    exit 1
+fi
+
+rval=0
+
+for service in readconnroute:4016 readwritesplit:4017
+do
+    for conns in $CONNECTIONS
+    do
+        for depth in $DEPTHS
+        do
+            $bench -P ${service#*:} -n $conns -d $depth -t $DURATION -p $maxscale_pid \
+                   -l ${service%:*} || rval=1
+        done
+    done
+done
+
+exit $rval
@@ -0,0 +1,1365 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file qlareplay.c Replay of the traffic captured by the qlafilter
+ *
+ * The program reads a file written by the qlafilter with log_type=capture and
+ * sends the captured sessions to a MaxScale listener again. Each session is
+ * connected at the time it was started in the capture and each COM packet is
+ * sent at the time it was captured, relative to the start of the replay and
+ * divided by the speed. A session only sends a packet once the response to the
+ * previous one has been read, so a session that is slower than the original
+ * falls behind its schedule. The time it fell behind is reported as the lag.
+ *
+ * The latencies of the responses are collected in a histogram that can be
+ * saved to a file. When the histogram of an earlier run is given, for example
+ * from another build of MaxScale, the latencies of the two runs are compared.
+ *
+ * All sessions log in with the user and the password given to the program as
+ * the passwords of the clients are not captured. Changes of the user are not
+ * replayed. Prepared statements are executed with the statement ids of the
+ * capture, which match as long as the backends number the statements of a
+ * connection the same way each time.
+ *
+ * Each session is handled by its own thread with blocking I/O so that the
+ * program itself adds as little latency as possible.
+ *
+ * @verbatim
+ * Usage: qlareplay -P port -u user [-p password] [-D database] [-H host] [-s speed]
+ *                  [-o histogram] [-c baseline] [-l label] capture-file
+ * @endverbatim
+ */
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <openssl/sha.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <qlacapture.h>
+
+#define MYSQL_HEADER_LEN     4
+#define MYSQL_MAX_PACKET_LEN 0xffffff
+#define SCRAMBLE_LEN         20
+
+#define COM_QUIT             0x01
+#define COM_FIELD_LIST       0x04
+#define COM_STATISTICS       0x09
+#define COM_CHANGE_USER      0x11
+#define COM_STMT_PREPARE     0x16
+#define COM_STMT_SEND_LONG_DATA 0x18
+#define COM_STMT_CLOSE       0x19
+
+#define SERVER_MORE_RESULTS_EXIST 0x0008
+
+/** Client capabilities sent by the replay */
+#define REPLAY_CLIENT_CAPS   (0x00000001 | /* CLIENT_LONG_PASSWORD */ \
+                              0x00000004 | /* CLIENT_LONG_FLAG */ \
+                              0x00000200 | /* CLIENT_PROTOCOL_41 */ \
+                              0x00002000 | /* CLIENT_TRANSACTIONS */ \
+                              0x00008000 | /* CLIENT_SECURE_CONNECTION */ \
+                              0x00010000 | /* CLIENT_MULTI_STATEMENTS */ \
+                              0x00020000 | /* CLIENT_MULTI_RESULTS */ \
+                              0x00040000)  /* CLIENT_PS_MULTI_RESULTS */
+
+#define CLIENT_CONNECT_WITH_DB 0x00000008
+
+/** The stack of a session thread, the buffers are allocated separately */
+#define SESSION_STACK_SIZE   (256 * 1024)
+
+/**
+ * Latencies are stored in a histogram with 64 buckets for each power of two
+ * above 128 microseconds, which gives a precision of about 1.5%.
+ */
+#define HIST_SUB_BITS        6
+#define HIST_SUB_COUNT       (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS         ((32 - HIST_SUB_BITS) * HIST_SUB_COUNT + 2 * HIST_SUB_COUNT)
+
+/** A growable buffer */
+typedef struct
+{
+    uint8_t *data;
+    size_t   len;
+    size_t   size;
+} BUFFER;
+
+/** A buffered reader of MySQL packets */
+typedef struct
+{
+    int      fd;
+    uint8_t  buf[65536];
+    size_t   start;
+    size_t   end;
+    BUFFER   packet;    /*< The payload of the last packet read */
+    uint8_t  seq;       /*< The sequence number of the last packet read */
+} READER;
+
+/** A captured record of packets */
+typedef struct
+{
+    uint64_t       time;    /*< Capture time in microseconds */
+    uint32_t       order;   /*< Position in the capture file */
+    const uint8_t *data;
+    uint32_t       len;
+} RECORD;
+
+/** A COM packet and its continuation packets */
+typedef struct
+{
+    uint64_t time;      /*< Capture time of the first byte */
+    size_t   start;     /*< Offset in the packets of the session */
+    size_t   len;
+} COMMAND;
+
+/** A captured session */
+typedef struct
+{
+    uint64_t  id;
+    uint64_t  start;        /*< When the session was started */
+    bool      started;      /*< Whether the start of the session was captured */
+    RECORD   *records;      /*< The records while the capture is read */
+    size_t    n_records;
+    size_t    size_records;
+    BUFFER    packets;      /*< All the packets of the session */
+    COMMAND  *commands;
+    size_t    n_commands;
+} REPLAY_SESSION;
+
+/** The configuration of the replay */
+static struct
+{
+    const char *host;
+    int         port;
+    const char *user;
+    const char *password;
+    const char *database;
+    double      speed;      /*< 0 for no waits */
+    const char *output;     /*< File for the histogram */
+    const char *baseline;   /*< Histogram of an earlier run */
+    const char *label;
+} replay = {"127.0.0.1", 0, NULL, "", NULL, 1.0, NULL, NULL, NULL};
+
+/** The captured sessions */
+static REPLAY_SESSION *sessions = NULL;
+static size_t n_sessions = 0;
+static uint64_t capture_start = 0;  /*< The first time in the capture */
+static uint64_t replay_start = 0;   /*< When the replay started */
+
+/** The results, updated by each session thread when it ends */
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t  done;
+    int             running;        /*< Session threads that have not ended */
+    uint64_t        commands;       /*< Commands that got a response */
+    uint64_t        errors;         /*< Error responses */
+    uint64_t        skipped;        /*< Commands that were not replayed */
+    uint64_t        failed;         /*< Sessions that failed */
+    uint64_t        lag_total;      /*< Total time the commands were sent late */
+    uint64_t        lag_max;
+    uint64_t        hist[HIST_BUCKETS];
+} results = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static uint64_t
+now_usecs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+buffer_reserve(BUFFER *buf, size_t len)
+{
+    if (buf->len + len > buf->size)
+    {
+        size_t size = buf->size ? buf->size : 256;
+
+        while (size < buf->len + len)
+        {
+            size *= 2;
+        }
+
+        if ((buf->data = realloc(buf->data, size)) == NULL)
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        buf->size = size;
+    }
+}
+
+static void
+buffer_add(BUFFER *buf, const void *data, size_t len)
+{
+    buffer_reserve(buf, len);
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+static void
+buffer_add_byte(BUFFER *buf, uint8_t byte)
+{
+    buffer_add(buf, &byte, 1);
+}
+
+static void
+buffer_add_int(BUFFER *buf, uint32_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+    {
+        buffer_add_byte(buf, (value >> (8 * i)) & 0xff);
+    }
+}
+
+static uint64_t
+get_int(const uint8_t *ptr, int bytes)
+{
+    uint64_t value = 0;
+
+    for (int i = 0; i < bytes; i++)
+    {
+        value |= (uint64_t)ptr[i] << (8 * i);
+    }
+
+    return value;
+}
+
+/**
+ * Start a packet, the length is filled in by packet_end
+ *
+ * @return The offset of the packet in the buffer
+ */
+static size_t
+packet_start(BUFFER *buf, uint8_t seq)
+{
+    size_t offset = buf->len;
+    uint8_t header[MYSQL_HEADER_LEN] = {0, 0, 0, seq};
+    buffer_add(buf, header, sizeof(header));
+    return offset;
+}
+
+static void
+packet_end(BUFFER *buf, size_t offset)
+{
+    size_t len = buf->len - offset - MYSQL_HEADER_LEN;
+    buf->data[offset] = len & 0xff;
+    buf->data[offset + 1] = (len >> 8) & 0xff;
+    buf->data[offset + 2] = (len >> 16) & 0xff;
+}
+
+static bool
+write_all(int fd, const uint8_t *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, data, len);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+
+        data += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+static bool
+reader_fill(READER *rd)
+{
+    if (rd->start == rd->end)
+    {
+        rd->start = rd->end = 0;
+    }
+    else if (rd->start > 0)
+    {
+        memmove(rd->buf, rd->buf + rd->start, rd->end - rd->start);
+        rd->end -= rd->start;
+        rd->start = 0;
+    }
+
+    ssize_t n;
+
+    do
+    {
+        n = read(rd->fd, rd->buf + rd->end, sizeof(rd->buf) - rd->end);
+    }
+    while (n < 0 && errno == EINTR);
+
+    if (n <= 0)
+    {
+        return false;
+    }
+
+    rd->end += n;
+    return true;
+}
+
+/**
+ * Read one packet into rd->packet
+ *
+ * @return True if a packet was read, false if the connection was closed
+ */
+static bool
+read_packet(READER *rd)
+{
+    while (rd->end - rd->start < MYSQL_HEADER_LEN)
+    {
+        if (!reader_fill(rd))
+        {
+            return false;
+        }
+    }
+
+    uint8_t *hdr = rd->buf + rd->start;
+    size_t len = hdr[0] | (hdr[1] << 8) | (hdr[2] << 16);
+    rd->seq = hdr[3];
+    rd->start += MYSQL_HEADER_LEN;
+    rd->packet.len = 0;
+    buffer_reserve(&rd->packet, len + 1);
+
+    while (rd->packet.len < len)
+    {
+        if (rd->start == rd->end && !reader_fill(rd))
+        {
+            return false;
+        }
+
+        size_t n = rd->end - rd->start;
+
+        if (n > len - rd->packet.len)
+        {
+            n = len - rd->packet.len;
+        }
+
+        memcpy(rd->packet.data + rd->packet.len, rd->buf + rd->start, n);
+        rd->packet.len += n;
+        rd->start += n;
+    }
+
+    rd->packet.data[len] = '\0';
+    return rd->packet.len > 0;
+}
+
+/*
+ * Reading the capture
+ */
+
+static int
+record_compare(const void *a, const void *b)
+{
+    const RECORD *ra = a;
+    const RECORD *rb = b;
+
+    if (ra->time != rb->time)
+    {
+        return ra->time < rb->time ? -1 : 1;
+    }
+
+    return ra->order < rb->order ? -1 : ra->order > rb->order;
+}
+
+static int
+session_compare(const void *a, const void *b)
+{
+    const REPLAY_SESSION *sa = a;
+    const REPLAY_SESSION *sb = b;
+
+    return sa->start < sb->start ? -1 : sa->start > sb->start;
+}
+
+/**
+ * Find a session by its id, adding it if it is new
+ *
+ * @param index     Open addressing table of session indexes plus one
+ * @param size      Size of the table, a power of two larger than the sessions
+ * @param id        The session id
+ */
+static REPLAY_SESSION *
+session_find(size_t *index, size_t size, uint64_t id)
+{
+    size_t slot = (id * 0x9e3779b97f4a7c15ULL) & (size - 1);
+
+    while (index[slot] && sessions[index[slot] - 1].id != id)
+    {
+        slot = (slot + 1) & (size - 1);
+    }
+
+    if (index[slot] == 0)
+    {
+        /** The table is sized so that it never fills up */
+        index[slot] = ++n_sessions;
+        sessions[n_sessions - 1].id = id;
+    }
+
+    return &sessions[index[slot] - 1];
+}
+
+/**
+ * Split the packets of a session into commands. The records are ordered by
+ * their time first as those queued by different worker threads can be out
+ * of order in the file.
+ */
+static void
+session_build(REPLAY_SESSION *session)
+{
+    size_t pos = 0;
+    size_t cmd_start = 0;
+    uint64_t cmd_time = 0;
+    size_t size_commands = 0;
+
+    qsort(session->records, session->n_records, sizeof(RECORD), record_compare);
+
+    for (size_t i = 0; i < session->n_records; i++)
+    {
+        RECORD *rec = &session->records[i];
+
+        if (cmd_start == session->packets.len)
+        {
+            cmd_time = rec->time;
+        }
+
+        buffer_add(&session->packets, rec->data, rec->len);
+
+        while (session->packets.len - pos >= MYSQL_HEADER_LEN)
+        {
+            size_t len = get_int(session->packets.data + pos, 3);
+
+            if (session->packets.len - pos - MYSQL_HEADER_LEN < len)
+            {
+                break;
+            }
+
+            pos += MYSQL_HEADER_LEN + len;
+
+            if (len < MYSQL_MAX_PACKET_LEN)
+            {
+                if (session->n_commands == size_commands)
+                {
+                    size_commands = size_commands ? size_commands * 2 : 16;
+                    session->commands = realloc(session->commands, size_commands * sizeof(COMMAND));
+
+                    if (session->commands == NULL)
+                    {
+                        fprintf(stderr, "Out of memory\n");
+                        exit(1);
+                    }
+                }
+
+                COMMAND *cmd = &session->commands[session->n_commands++];
+                cmd->time = cmd_time;
+                cmd->start = cmd_start;
+                cmd->len = pos - cmd_start;
+                cmd_start = pos;
+                cmd_time = rec->time;
+            }
+        }
+    }
+
+    if (!session->started)
+    {
+        session->start = session->n_records ? session->records[0].time : capture_start;
+    }
+
+    free(session->records);
+    session->records = NULL;
+}
+
+/**
+ * Read a capture file into the sessions
+ *
+ * @param filename  The capture file
+ * @param capture   The contents of the file, the packets of the sessions are
+ *                  copied from it
+ * @return True if the file was read
+ */
+static bool
+capture_read(const char *filename, BUFFER *capture)
+{
+    FILE *file = fopen(filename, "rb");
+    struct stat st;
+
+    if (file == NULL || fstat(fileno(file), &st) != 0)
+    {
+        fprintf(stderr, "Failed to open '%s': %s\n", filename, strerror(errno));
+        if (file)
+        {
+            fclose(file);
+        }
+        return false;
+    }
+
+    buffer_reserve(capture, st.st_size);
+    capture->len = fread(capture->data, 1, st.st_size, file);
+    fclose(file);
+
+    if (capture->len < QLA_CAPTURE_MAGIC_LEN ||
+        memcmp(capture->data, QLA_CAPTURE_MAGIC, QLA_CAPTURE_MAGIC_LEN) != 0)
+    {
+        fprintf(stderr, "'%s' is not a capture file of the qlafilter\n", filename);
+        return false;
+    }
+
+    /** Every session has at least one record, which bounds their number */
+    size_t max_sessions = capture->len / QLA_CAPTURE_HEADER_LEN + 1;
+    size_t size = 16;
+
+    while (size < 2 * max_sessions)
+    {
+        size *= 2;
+    }
+
+    size_t *index = calloc(size, sizeof(size_t));
+    sessions = calloc(max_sessions, sizeof(REPLAY_SESSION));
+
+    if (index == NULL || sessions == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    size_t pos = QLA_CAPTURE_MAGIC_LEN;
+    uint32_t order = 0;
+    capture_start = UINT64_MAX;
+
+    while (capture->len - pos >= QLA_CAPTURE_HEADER_LEN)
+    {
+        const uint8_t *hdr = capture->data + pos;
+        uint64_t time = get_int(hdr, 8);
+        uint8_t type = hdr[16];
+        uint32_t len = get_int(hdr + 17, 4);
+
+        if (capture->len - pos - QLA_CAPTURE_HEADER_LEN < len)
+        {
+            /** The capture was still being written */
+            break;
+        }
+
+        REPLAY_SESSION *session = session_find(index, size, get_int(hdr + 8, 8));
+
+        if (time < capture_start)
+        {
+            capture_start = time;
+        }
+
+        if (type == QLA_CAPTURE_START)
+        {
+            session->start = time;
+            session->started = true;
+        }
+        else if (type == QLA_CAPTURE_PACKETS)
+        {
+            if (session->n_records == session->size_records)
+            {
+                session->size_records = session->size_records ? session->size_records * 2 : 16;
+                session->records = realloc(session->records, session->size_records * sizeof(RECORD));
+
+                if (session->records == NULL)
+                {
+                    fprintf(stderr, "Out of memory\n");
+                    exit(1);
+                }
+            }
+
+            RECORD *rec = &session->records[session->n_records++];
+            rec->time = time;
+            rec->order = order;
+            rec->data = hdr + QLA_CAPTURE_HEADER_LEN;
+            rec->len = len;
+        }
+
+        pos += QLA_CAPTURE_HEADER_LEN + len;
+        order++;
+    }
+
+    free(index);
+
+    for (size_t i = 0; i < n_sessions; i++)
+    {
+        session_build(&sessions[i]);
+    }
+
+    qsort(sessions, n_sessions, sizeof(REPLAY_SESSION), session_compare);
+
+    return true;
+}
+
+/*
+ * The replay
+ */
+
+static int
+hist_bucket(uint64_t usecs)
+{
+    if (usecs < 2 * HIST_SUB_COUNT)
+    {
+        return usecs;
+    }
+
+    if (usecs > UINT32_MAX)
+    {
+        usecs = UINT32_MAX;
+    }
+
+    int shift = 63 - __builtin_clzll(usecs) - HIST_SUB_BITS;
+    return shift * HIST_SUB_COUNT + (usecs >> shift);
+}
+
+/** The middle of the values in a bucket */
+static double
+hist_value(int bucket)
+{
+    if (bucket < 2 * HIST_SUB_COUNT)
+    {
+        return bucket;
+    }
+
+    int shift = bucket / HIST_SUB_COUNT - 1;
+    uint64_t low = (uint64_t)(bucket - shift * HIST_SUB_COUNT) << shift;
+    return low + ((1ULL << shift) - 1) / 2.0;
+}
+
+static uint64_t
+hist_total(const uint64_t *hist)
+{
+    uint64_t total = 0;
+
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        total += hist[i];
+    }
+
+    return total;
+}
+
+static double
+hist_percentile(const uint64_t *hist, double pct)
+{
+    uint64_t rank = hist_total(hist) * pct / 100.0;
+    uint64_t seen = 0;
+    int last = 0;
+
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += hist[i];
+
+        if (hist[i])
+        {
+            last = i;
+        }
+
+        if (seen > rank)
+        {
+            return hist_value(i);
+        }
+    }
+
+    return hist_value(last);
+}
+
+static double
+hist_mean(const uint64_t *hist)
+{
+    uint64_t total = hist_total(hist);
+    double sum = 0;
+
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        sum += hist[i] * hist_value(i);
+    }
+
+    return total ? sum / total : 0;
+}
+
+/** Write a histogram as lines of a latency in the bucket and a count */
+static bool
+hist_save(const uint64_t *hist, const char *filename)
+{
+    FILE *file = fopen(filename, "w");
+
+    if (file == NULL)
+    {
+        fprintf(stderr, "Failed to open '%s': %s\n", filename, strerror(errno));
+        return false;
+    }
+
+    fprintf(file, "# qlareplay latencies in microseconds%s%s\n",
+            replay.label ? ": " : "", replay.label ? replay.label : "");
+
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        if (hist[i])
+        {
+            fprintf(file, "%lu %lu\n", (unsigned long)hist_value(i), (unsigned long)hist[i]);
+        }
+    }
+
+    return fclose(file) == 0;
+}
+
+static bool
+hist_load(uint64_t *hist, const char *filename)
+{
+    FILE *file = fopen(filename, "r");
+    char line[256];
+
+    if (file == NULL)
+    {
+        fprintf(stderr, "Failed to open '%s': %s\n", filename, strerror(errno));
+        return false;
+    }
+
+    while (fgets(line, sizeof(line), file))
+    {
+        unsigned long usecs, count;
+
+        if (line[0] != '#' && sscanf(line, "%lu %lu", &usecs, &count) == 2)
+        {
+            hist[hist_bucket(usecs)] += count;
+        }
+    }
+
+    fclose(file);
+    return true;
+}
+
+/** When a time of the capture is replayed */
+static uint64_t
+replay_time(uint64_t captured)
+{
+    return replay.speed > 0 ? replay_start + (captured - capture_start) / replay.speed : 0;
+}
+
+static void
+wait_until(uint64_t usecs)
+{
+    struct timespec ts = {usecs / 1000000, (usecs % 1000000) * 1000};
+
+    if (usecs > 0)
+    {
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        {
+        }
+    }
+}
+
+/** Skip a length-encoded integer */
+static const uint8_t *
+skip_lenenc(const uint8_t *ptr)
+{
+    switch (*ptr)
+    {
+    case 0xfc:
+        return ptr + 3;
+    case 0xfd:
+        return ptr + 4;
+    case 0xfe:
+        return ptr + 9;
+    default:
+        return ptr + 1;
+    }
+}
+
+static inline bool
+is_eof(READER *rd)
+{
+    return rd->packet.data[0] == 0xfe && rd->packet.len < 9;
+}
+
+/**
+ * Read packets up to and including an EOF packet
+ *
+ * @return 0 if the EOF was read, 1 for an error and -1 if the connection
+ *         was closed
+ */
+static int
+read_until_eof(READER *rd)
+{
+    do
+    {
+        if (!read_packet(rd))
+        {
+            return -1;
+        }
+
+        if (rd->packet.data[0] == 0xff)
+        {
+            return 1;
+        }
+    }
+    while (!is_eof(rd));
+
+    return 0;
+}
+
+/**
+ * Read the response to a command
+ *
+ * @param rd    The reader of the connection
+ * @param cmd   The command that was sent
+ * @return 0 for a successful response, 1 for an error and -1 if the
+ *         connection was closed
+ */
+static int
+read_response(READER *rd, uint8_t cmd)
+{
+    if (cmd == COM_STATISTICS)
+    {
+        return read_packet(rd) ? 0 : -1;
+    }
+    else if (cmd == COM_FIELD_LIST)
+    {
+        return read_until_eof(rd);
+    }
+    else if (cmd == COM_STMT_PREPARE)
+    {
+        if (!read_packet(rd))
+        {
+            return -1;
+        }
+        else if (rd->packet.data[0] == 0xff || rd->packet.len < 9)
+        {
+            return 1;
+        }
+
+        int columns = get_int(rd->packet.data + 5, 2);
+        int params = get_int(rd->packet.data + 7, 2);
+        int rc = 0;
+
+        if (params > 0)
+        {
+            rc = read_until_eof(rd);
+        }
+
+        if (rc == 0 && columns > 0)
+        {
+            rc = read_until_eof(rd);
+        }
+
+        return rc;
+    }
+
+    /** A query or the execution of a statement, possibly with many results */
+    while (true)
+    {
+        uint16_t status;
+
+        if (!read_packet(rd))
+        {
+            return -1;
+        }
+
+        uint8_t first = rd->packet.data[0];
+
+        if (first == 0xff)
+        {
+            return 1;
+        }
+        else if (first == 0x00)
+        {
+            const uint8_t *ptr = skip_lenenc(skip_lenenc(rd->packet.data + 1));
+            status = ptr + 2 <= rd->packet.data + rd->packet.len ? get_int(ptr, 2) : 0;
+        }
+        else if (first == 0xfb)
+        {
+            /** LOAD DATA LOCAL INFILE, the file is not sent */
+            const uint8_t empty[] = {0, 0, 0, rd->seq + 1};
+
+            if (!write_all(rd->fd, empty, sizeof(empty)))
+            {
+                return -1;
+            }
+            continue;
+        }
+        else
+        {
+            /** A resultset: the column definitions and the rows each end with an EOF */
+            int rc = read_until_eof(rd);
+
+            if (rc == 0)
+            {
+                rc = read_until_eof(rd);
+            }
+
+            if (rc != 0)
+            {
+                return rc;
+            }
+
+            status = rd->packet.len >= 5 ? get_int(rd->packet.data + 3, 2) : 0;
+        }
+
+        if ((status & SERVER_MORE_RESULTS_EXIST) == 0)
+        {
+            return 0;
+        }
+    }
+}
+
+/** The authentication token of mysql_native_password */
+static void
+scramble_password(const uint8_t *scramble, const char *password, uint8_t *token)
+{
+    uint8_t hash1[SHA_DIGEST_LENGTH];
+    uint8_t hash2[SHA_DIGEST_LENGTH];
+    uint8_t hash3[SHA_DIGEST_LENGTH];
+    uint8_t input[SCRAMBLE_LEN + SHA_DIGEST_LENGTH];
+
+    SHA1((const uint8_t*)password, strlen(password), hash1);
+    SHA1(hash1, sizeof(hash1), hash2);
+
+    memcpy(input, scramble, SCRAMBLE_LEN);
+    memcpy(input + SCRAMBLE_LEN, hash2, sizeof(hash2));
+    SHA1(input, sizeof(input), hash3);
+
+    for (int i = 0; i < SHA_DIGEST_LENGTH; i++)
+    {
+        token[i] = hash1[i] ^ hash3[i];
+    }
+}
+
+static int
+client_connect(READER *rd)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(replay.port);
+
+    if (fd < 0 || inet_pton(AF_INET, replay.host, &addr.sin_addr) != 1 ||
+        connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+        fprintf(stderr, "Failed to connect to %s:%d: %s\n", replay.host, replay.port, strerror(errno));
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    rd->fd = fd;
+
+    if (!read_packet(rd) || rd->packet.data[0] != 10)
+    {
+        fprintf(stderr, "Failed to read the handshake from %s:%d\n", replay.host, replay.port);
+        close(fd);
+        return -1;
+    }
+
+    /** The scramble is in two parts around the capabilities and the status */
+    uint8_t scramble[SCRAMBLE_LEN];
+    const uint8_t *ptr = rd->packet.data + 1;
+    const uint8_t *end = rd->packet.data + rd->packet.len;
+
+    ptr += strlen((const char*)ptr) + 1 + 4;
+
+    if (end - ptr < 8 + 1 + 18 + SCRAMBLE_LEN - 8)
+    {
+        fprintf(stderr, "Malformed handshake from %s:%d\n", replay.host, replay.port);
+        close(fd);
+        return -1;
+    }
+
+    memcpy(scramble, ptr, 8);
+    memcpy(scramble + 8, ptr + 8 + 1 + 18, SCRAMBLE_LEN - 8);
+
+    uint32_t caps = REPLAY_CLIENT_CAPS | (replay.database ? CLIENT_CONNECT_WITH_DB : 0);
+    BUFFER out = {NULL, 0, 0};
+    size_t pkt = packet_start(&out, rd->seq + 1);
+    buffer_add_int(&out, caps, 4);
+    buffer_add_int(&out, 16 * 1024 * 1024, 4);
+    buffer_add_byte(&out, 8);
+    for (int i = 0; i < 23; i++)
+    {
+        buffer_add_byte(&out, 0);
+    }
+    buffer_add(&out, replay.user, strlen(replay.user) + 1);
+
+    if (*replay.password)
+    {
+        uint8_t token[SHA_DIGEST_LENGTH];
+        scramble_password(scramble, replay.password, token);
+        buffer_add_byte(&out, sizeof(token));
+        buffer_add(&out, token, sizeof(token));
+    }
+    else
+    {
+        buffer_add_byte(&out, 0);
+    }
+
+    if (replay.database)
+    {
+        buffer_add(&out, replay.database, strlen(replay.database) + 1);
+    }
+    packet_end(&out, pkt);
+
+    bool ok = write_all(fd, out.data, out.len) && read_packet(rd) && rd->packet.data[0] == 0x00;
+    free(out.data);
+
+    if (!ok)
+    {
+        fprintf(stderr, "Failed to log in to %s:%d as '%s'%s%s\n", replay.host, replay.port,
+                replay.user, rd->packet.len > 9 && rd->packet.data[0] == 0xff ? ": " : "",
+                rd->packet.len > 9 && rd->packet.data[0] == 0xff ?
+                (const char*)rd->packet.data + 9 : "");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/** Replay one session */
+static void *
+session_main(void *arg)
+{
+    REPLAY_SESSION *session = arg;
+    READER *rd = calloc(1, sizeof(READER));
+    uint64_t *hist = calloc(HIST_BUCKETS, sizeof(uint64_t));
+    uint64_t commands = 0, errors = 0, skipped = 0, lag_total = 0, lag_max = 0;
+    bool failed = false;
+    bool quit = false;
+    int fd = -1;
+
+    if (rd == NULL || hist == NULL)
+    {
+        failed = true;
+    }
+    else if ((fd = client_connect(rd)) < 0)
+    {
+        failed = true;
+    }
+
+    for (size_t i = 0; !failed && !quit && i < session->n_commands; i++)
+    {
+        COMMAND *cmd = &session->commands[i];
+        const uint8_t *data = session->packets.data + cmd->start;
+        uint8_t com = cmd->len > MYSQL_HEADER_LEN ? data[MYSQL_HEADER_LEN] : 0;
+
+        if (cmd->len <= MYSQL_HEADER_LEN || com == COM_CHANGE_USER)
+        {
+            skipped++;
+            continue;
+        }
+
+        uint64_t scheduled = replay_time(cmd->time);
+        wait_until(scheduled);
+
+        uint64_t sent = now_usecs();
+        uint64_t lag = scheduled && sent > scheduled ? sent - scheduled : 0;
+        lag_total += lag;
+        lag_max = lag > lag_max ? lag : lag_max;
+
+        if (!write_all(fd, data, cmd->len))
+        {
+            failed = true;
+        }
+        else if (com == COM_QUIT)
+        {
+            quit = true;
+        }
+        else if (com != COM_STMT_CLOSE && com != COM_STMT_SEND_LONG_DATA)
+        {
+            int rc = read_response(rd, com);
+
+            if (rc < 0)
+            {
+                failed = true;
+            }
+            else
+            {
+                commands++;
+                errors += rc;
+                hist[hist_bucket(now_usecs() - sent)]++;
+            }
+        }
+    }
+
+    if (fd >= 0)
+    {
+        if (!quit)
+        {
+            const uint8_t packet[] = {1, 0, 0, 0, COM_QUIT};
+            write_all(fd, packet, sizeof(packet));
+        }
+        close(fd);
+    }
+
+    pthread_mutex_lock(&results.lock);
+    results.commands += commands;
+    results.errors += errors;
+    results.skipped += skipped;
+    results.failed += failed;
+    results.lag_total += lag_total;
+    results.lag_max = lag_max > results.lag_max ? lag_max : results.lag_max;
+
+    for (int i = 0; hist && i < HIST_BUCKETS; i++)
+    {
+        results.hist[i] += hist[i];
+    }
+
+    results.running--;
+    pthread_cond_signal(&results.done);
+    pthread_mutex_unlock(&results.lock);
+
+    free(session->packets.data);
+    session->packets.data = NULL;
+    free(session->commands);
+    session->commands = NULL;
+
+    if (rd)
+    {
+        free(rd->packet.data);
+        free(rd);
+    }
+    free(hist);
+    return NULL;
+}
+
+static void
+print_comparison(const uint64_t *baseline)
+{
+    static const struct
+    {
+        const char *name;
+        double      pct;
+    } rows[] =
+    {
+        {"p50", 50}, {"p90", 90}, {"p99", 99}, {"p99.9", 99.9}, {"max", 100}, {"mean", -1}
+    };
+
+    printf("\n%-8s %12s %12s %9s\n", "", "baseline", "this run", "change");
+
+    for (size_t i = 0; i < sizeof(rows) / sizeof(rows[0]); i++)
+    {
+        double a = rows[i].pct < 0 ? hist_mean(baseline) : hist_percentile(baseline, rows[i].pct);
+        double b = rows[i].pct < 0 ? hist_mean(results.hist) :
+                   hist_percentile(results.hist, rows[i].pct);
+
+        printf("%-8s %9.0f us %9.0f us %+8.1f%%\n", rows[i].name, a, b,
+               a > 0 ? (b - a) * 100 / a : 0.0);
+    }
+}
+
+static int
+replay_run()
+{
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, SESSION_STACK_SIZE);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    replay_start = now_usecs();
+
+    for (size_t i = 0; i < n_sessions; i++)
+    {
+        pthread_t thr;
+
+        wait_until(replay_time(sessions[i].start));
+
+        pthread_mutex_lock(&results.lock);
+        results.running++;
+        pthread_mutex_unlock(&results.lock);
+
+        if (pthread_create(&thr, &attr, session_main, &sessions[i]) != 0)
+        {
+            fprintf(stderr, "Failed to start the thread of session %lu\n",
+                    (unsigned long)sessions[i].id);
+            pthread_mutex_lock(&results.lock);
+            results.running--;
+            results.failed++;
+            pthread_mutex_unlock(&results.lock);
+        }
+    }
+
+    pthread_mutex_lock(&results.lock);
+    while (results.running > 0)
+    {
+        pthread_cond_wait(&results.done, &results.lock);
+    }
+    pthread_mutex_unlock(&results.lock);
+
+    pthread_attr_destroy(&attr);
+
+    double seconds = (now_usecs() - replay_start) / 1000000.0;
+    uint64_t sent = results.commands;
+
+    printf("%s%s%lu sessions, %lu commands in %.1f s (%.0f per second): p50 %.0f us, "
+           "p90 %.0f us, p99 %.0f us, p99.9 %.0f us, max %.0f us, mean lag %.0f us, "
+           "max lag %lu us, %lu errors",
+           replay.label ? replay.label : "", replay.label ? ": " : "",
+           (unsigned long)n_sessions, (unsigned long)sent, seconds, sent / seconds,
+           hist_percentile(results.hist, 50), hist_percentile(results.hist, 90),
+           hist_percentile(results.hist, 99), hist_percentile(results.hist, 99.9),
+           hist_percentile(results.hist, 100),
+           sent ? (double)results.lag_total / sent : 0.0,
+           (unsigned long)results.lag_max, (unsigned long)results.errors);
+
+    if (results.skipped)
+    {
+        printf(", %lu skipped", (unsigned long)results.skipped);
+    }
+
+    if (results.failed)
+    {
+        printf(", %lu failed sessions", (unsigned long)results.failed);
+    }
+    printf("\n");
+
+    if (replay.output && !hist_save(results.hist, replay.output))
+    {
+        return 1;
+    }
+
+    if (replay.baseline)
+    {
+        uint64_t *baseline = calloc(HIST_BUCKETS, sizeof(uint64_t));
+
+        if (baseline == NULL || !hist_load(baseline, replay.baseline))
+        {
+            free(baseline);
+            return 1;
+        }
+
+        print_comparison(baseline);
+        free(baseline);
+    }
+
+    return results.failed ? 1 : 0;
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options] CAPTURE\n"
+            "\n"
+            "Replay a capture of the qlafilter with log_type=capture.\n"
+            "\n"
+            "Options:\n"
+            "  -P PORT       Port of the MaxScale listener\n"
+            "  -H HOST       Address of MaxScale (default 127.0.0.1)\n"
+            "  -u USER       User the sessions log in as\n"
+            "  -p PASSWORD   Password of the user (default empty)\n"
+            "  -D DATABASE   Default database of the sessions\n"
+            "  -s SPEED      Speed relative to the capture, 0 sends without waiting (default 1)\n"
+            "  -o FILE       Save the latency histogram to the file\n"
+            "  -c FILE       Compare the latencies with a histogram saved by an earlier run\n"
+            "  -l LABEL      Label of the results\n",
+            name);
+}
+
+int
+main(int argc, char **argv)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "P:H:u:p:D:s:o:c:l:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'P':
+            replay.port = atoi(optarg);
+            break;
+        case 'H':
+            replay.host = optarg;
+            break;
+        case 'u':
+            replay.user = optarg;
+            break;
+        case 'p':
+            replay.password = optarg;
+            break;
+        case 'D':
+            replay.database = optarg;
+            break;
+        case 's':
+            replay.speed = atof(optarg);
+            break;
+        case 'o':
+            replay.output = optarg;
+            break;
+        case 'c':
+            replay.baseline = optarg;
+            break;
+        case 'l':
+            replay.label = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind != argc - 1 || replay.port == 0 || replay.user == NULL || replay.speed < 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    BUFFER capture = {NULL, 0, 0};
+
+    if (!capture_read(argv[optind], &capture))
+    {
+        return 1;
+    }
+
+    size_t commands = 0;
+
+    for (size_t i = 0; i < n_sessions; i++)
+    {
+        commands += sessions[i].n_commands;
+    }
+
+    free(capture.data);
+
+    if (replay.speed > 0)
+    {
+        fprintf(stderr, "Replaying %lu sessions with %lu commands at %gx speed\n",
+                (unsigned long)n_sessions, (unsigned long)commands, replay.speed);
+    }
+    else
+    {
+        fprintf(stderr, "Replaying %lu sessions with %lu commands without waits\n",
+                (unsigned long)n_sessions, (unsigned long)commands);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    int rc = replay_run();
+    free(sessions);
+    return rc;
+}
@@ -802,6 +802,71 @@ void skygw_message_wait(skygw_message_t* mes)
     ss_dassert(err == 0);
 }
 
+/**
+ * Wait for a message for at most the given time
+ *
+ * @param mes  Message to wait for
+ * @param msec Maximum time to wait in milliseconds
+ *
+ * @return true if the message was received, false if the wait timed out
+ */
+bool skygw_message_wait_timeout(skygw_message_t* mes, int msec)
+{
+    int err;
+    struct timespec ts;
+
+    CHK_MESSAGE(mes);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += msec / 1000;
+    ts.tv_nsec += (msec % 1000) * 1000000L;
+
+    if (ts.tv_nsec >= 1000000000L)
+    {
+        ts.tv_sec += 1;
+        ts.tv_nsec -= 1000000000L;
+    }
+
+    err = pthread_mutex_lock(&(mes->mes_mutex));
+
+    if (err != 0)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        fprintf(stderr, "* Locking pthread mutex failed, due error %d, %s\n",
+                err, strerror_r(errno, errbuf, sizeof (errbuf)));
+    }
+    ss_dassert(err == 0);
+
+    while (!mes->mes_sent)
+    {
+        err = pthread_cond_timedwait(&(mes->mes_cond), &(mes->mes_mutex), &ts);
+
+        if (err == ETIMEDOUT)
+        {
+            break;
+        }
+        else if (err != 0)
+        {
+            char errbuf[STRERROR_BUFLEN];
+            fprintf(stderr, "* Locking pthread cond wait failed, due error %d, %s\n",
+                    err, strerror_r(errno, errbuf, sizeof (errbuf)));
+        }
+    }
+
+    bool received = mes->mes_sent;
+    mes->mes_sent = false;
+    err = pthread_mutex_unlock(&(mes->mes_mutex));
+
+    if (err != 0)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        fprintf(stderr, "* Unlocking pthread mutex failed, due error %d, %s\n",
+                err, strerror_r(errno, errbuf, sizeof (errbuf)));
+    }
+    ss_dassert(err == 0);
+
+    return received;
+}
+
 void skygw_message_reset(skygw_message_t* mes)
 {
     int err;
@@ -166,6 +166,7 @@ skygw_message_t* skygw_message_init(void);
 void skygw_message_done(skygw_message_t* mes);
 skygw_mes_rc_t skygw_message_send(skygw_message_t* mes);
 void skygw_message_wait(skygw_message_t* mes);
+bool skygw_message_wait_timeout(skygw_message_t* mes, int msec);
 skygw_mes_rc_t skygw_message_request(skygw_message_t* mes);
 void skygw_message_reset(skygw_message_t* mes);
 